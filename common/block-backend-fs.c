@@ -104,6 +104,14 @@ block_backend_fs_read_block (BlockBackend *bend,
     return (readn (handle->fd, buf, len));
 }
 
+static int
+block_backend_fs_copy_to_fd (BlockBackend *bend,
+                             BHandle *handle,
+                             int fd, int len)
+{
+    return block_backend_copy_fd_range (handle->fd, fd, len);
+}
+
 static int
 block_backend_fs_write_block (BlockBackend *bend,
                                 BHandle *handle,
@@ -356,6 +364,56 @@ block_backend_fs_copy (BlockBackend *bend,
 #endif
 }
 
+static int
+hard_link (const char *src_path, const char *dst_path)
+{
+#ifdef WIN32
+    if (!CreateHardLinkA (dst_path, src_path, NULL)) {
+        seaf_debug ("Failed to link %s to %s: %lu.\n",
+                    src_path, dst_path, GetLastError());
+        return -1;
+    }
+#else
+    if (link (src_path, dst_path) < 0) {
+        seaf_debug ("Failed to link %s to %s: %s.\n",
+                    src_path, dst_path, strerror(errno));
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+static int
+block_backend_fs_link_block_in (BlockBackend *bend,
+                                const char *store_id,
+                                int version,
+                                const char *block_id,
+                                const char *path)
+{
+    char block_path[SEAF_PATH_MAX];
+
+    get_block_path (bend, block_id, block_path, store_id, version);
+
+    if (create_parent_path (block_path) < 0)
+        return -1;
+
+    return hard_link (path, block_path);
+}
+
+static int
+block_backend_fs_link_block_out (BlockBackend *bend,
+                                 const char *store_id,
+                                 int version,
+                                 const char *block_id,
+                                 const char *path)
+{
+    char block_path[SEAF_PATH_MAX];
+
+    get_block_path (bend, block_id, block_path, store_id, version);
+
+    return hard_link (block_path, path);
+}
+
 static int
 block_backend_fs_remove_store (BlockBackend *bend, const char *store_id)
 {
@@ -486,6 +544,7 @@ block_backend_fs_new (const char *seaf_dir, const char *tmp_dir)
 
     bend->open_block = block_backend_fs_open_block;
     bend->read_block = block_backend_fs_read_block;
+    bend->copy_to_fd = block_backend_fs_copy_to_fd;
     bend->write_block = block_backend_fs_write_block;
     bend->commit_block = block_backend_fs_commit_block;
     bend->close_block = block_backend_fs_close_block;
@@ -497,6 +556,8 @@ block_backend_fs_new (const char *seaf_dir, const char *tmp_dir)
     bend->foreach_block = block_backend_fs_foreach_block;
     bend->remove_store = block_backend_fs_remove_store;
     bend->copy = block_backend_fs_copy;
+    bend->link_block_in = block_backend_fs_link_block_in;
+    bend->link_block_out = block_backend_fs_link_block_out;
 
     return bend;
 
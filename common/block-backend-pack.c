@@ -0,0 +1,1347 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Packed block backend.
+ *
+ * Instead of storing every block in its own file, the blocks of a store are
+ * appended to a few large pack files under
+ *
+ *     <seaf_dir>/storage/blocks/<store_id>/packs/
+ *
+ * An append-only index log in the same directory maps each block id to
+ * (pack, offset, size). The log is replayed into a hash table the first time
+ * a store is accessed, and rewritten when it holds too many obsolete records.
+ *
+ * Removed blocks leave dead space in their packs. A pack is deleted as soon as
+ * it has no live block left, and rewritten into the current pack once most of
+ * it is dead. Packs still open in read handles are deleted when the last of
+ * them is closed.
+ *
+ * Blocks in the one-file-per-block layout of the fs backend are migrated into
+ * packs the first time a store is opened.
+ */
+
+#include "common.h"
+
+#include "utils.h"
+
+#include "log.h"
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "block-backend.h"
+
+#define PACK_DIR_NAME "packs"
+#define PACK_INDEX_NAME "index"
+#define PACK_INDEX_TMP_NAME "index.tmp"
+#define PACK_INDEX_MAGIC "SPI1"
+#define PACK_INDEX_MAGIC_LEN 4
+
+/* Start a new pack file once the current one exceeds this size. */
+#define MAX_PACK_SIZE ((gint64)1 << 28) /* 256MB */
+
+/* Rewrite a pack when more than half of it is dead. */
+#define COMPACT_DEAD_RATIO 0.5
+
+/* Rewrite the index when it has this many records per live block. */
+#define INDEX_REWRITE_RATIO 2
+
+#define COPY_BUF_SIZE (1 << 16)
+
+enum {
+    INDEX_OP_ADD = 1,
+    INDEX_OP_REMOVE,
+};
+
+/* On-disk index record. Integers are stored in big endian. */
+#ifdef WIN32
+__pragma(pack(push, 1))
+typedef struct {
+    guint8 op;
+    guint8 block_id[20];
+    guint32 pack;
+    guint64 offset;
+    guint32 size;
+} IndexRecord;
+__pragma(pack(pop))
+#else
+typedef struct {
+    guint8 op;
+    guint8 block_id[20];
+    guint32 pack;
+    guint64 offset;
+    guint32 size;
+} __attribute__((__packed__)) IndexRecord;
+#endif
+
+typedef struct PackEntry {
+    guint32 pack;
+    guint32 size;
+    gint64 offset;
+} PackEntry;
+
+typedef struct PackInfo {
+    gint64 total_bytes;
+    gint64 dead_bytes;
+    int n_live;
+    /* Read handles that have the pack open. */
+    int n_readers;
+    /* Deleted once the readers are done. */
+    gboolean removed;
+} PackInfo;
+
+typedef struct PackStore {
+    char store_id[37];
+    char *store_dir;
+    char *pack_dir;
+
+    GHashTable *blocks;         /* block_id -> PackEntry */
+    GHashTable *packs;          /* pack number -> PackInfo */
+
+    guint32 cur_pack;
+    int cur_fd;                 /* current pack open for append, or -1 */
+    gint64 cur_size;
+
+    int index_fd;
+
+    pthread_mutex_t lock;
+
+    /* Protected by stores_lock. */
+    int ref_count;
+} PackStore;
+
+typedef struct {
+    char *block_dir;
+    GHashTable *stores;         /* store_id -> PackStore */
+    /* Stores released while still in use, store_id -> PackStore. */
+    GHashTable *released;
+    /* Ids of stores being opened, outside of stores_lock. */
+    GHashTable *opening;
+    pthread_cond_t opened_cond;
+    pthread_mutex_t stores_lock;
+} PackPriv;
+
+struct _BHandle {
+    char    *store_id;
+    int     version;
+    char    block_id[41];
+    int     rw_type;
+
+    /* Read handle. Holds a reference to the store and to the pack until
+     * it's closed.
+     */
+    int     fd;
+    guint32 size;
+    guint32 pos;
+    struct PackStore *store;
+    guint32 pack;
+
+    /* Write handle. Blocks are small enough to be buffered in memory. */
+    GByteArray *buf;
+};
+
+/* Pack store. */
+
+static char *
+pack_file_path (PackStore *store, guint32 pack)
+{
+    return g_strdup_printf ("%s/pack-%08u", store->pack_dir, pack);
+}
+
+static void
+pack_store_free (PackStore *store)
+{
+    if (!store)
+        return;
+
+    if (store->cur_fd >= 0)
+        close (store->cur_fd);
+    if (store->index_fd >= 0)
+        close (store->index_fd);
+    g_hash_table_destroy (store->blocks);
+    g_hash_table_destroy (store->packs);
+    g_free (store->store_dir);
+    g_free (store->pack_dir);
+    pthread_mutex_destroy (&store->lock);
+    g_free (store);
+}
+
+static PackInfo *
+get_pack_info (PackStore *store, guint32 pack)
+{
+    PackInfo *info;
+
+    info = g_hash_table_lookup (store->packs, GUINT_TO_POINTER(pack));
+    if (!info) {
+        info = g_new0 (PackInfo, 1);
+        g_hash_table_insert (store->packs, GUINT_TO_POINTER(pack), info);
+    }
+    return info;
+}
+
+static void
+record_dead_entry (PackStore *store, PackEntry *entry)
+{
+    PackInfo *info = get_pack_info (store, entry->pack);
+
+    info->dead_bytes += entry->size;
+    --(info->n_live);
+}
+
+/* Must be called with the store lock held. */
+static void
+delete_pack (PackStore *store, guint32 pack)
+{
+    PackInfo *info = get_pack_info (store, pack);
+    char *path;
+
+    if (info->n_readers > 0) {
+        info->removed = TRUE;
+        return;
+    }
+
+    path = pack_file_path (store, pack);
+    g_unlink (path);
+    g_free (path);
+    g_hash_table_remove (store->packs, GUINT_TO_POINTER(pack));
+}
+
+/* Must be called with the store lock held. */
+static void
+unref_pack (PackStore *store, guint32 pack)
+{
+    PackInfo *info = get_pack_info (store, pack);
+
+    if (--(info->n_readers) == 0 && info->removed)
+        delete_pack (store, pack);
+}
+
+static int
+write_index_record (int fd, int op, const char *block_id, PackEntry *entry)
+{
+    IndexRecord rec;
+
+    memset (&rec, 0, sizeof(rec));
+    rec.op = (guint8)op;
+    hex_to_rawdata (block_id, rec.block_id, 20);
+    if (entry) {
+        rec.pack = GUINT32_TO_BE (entry->pack);
+        rec.offset = GUINT64_TO_BE ((guint64)entry->offset);
+        rec.size = GUINT32_TO_BE (entry->size);
+    }
+
+    if (writen (fd, &rec, sizeof(rec)) != sizeof(rec)) {
+        seaf_warning ("[pack bend] Failed to write index record: %s.\n",
+                      strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+replay_index (PackStore *store, const char *index_path, int *n_records)
+{
+    char *contents = NULL;
+    gsize len, off;
+    IndexRecord *rec;
+    PackEntry *entry, *old;
+    char block_id[41];
+
+    *n_records = 0;
+
+    if (!g_file_get_contents (index_path, &contents, &len, NULL))
+        return;
+
+    if (len < PACK_INDEX_MAGIC_LEN ||
+        memcmp (contents, PACK_INDEX_MAGIC, PACK_INDEX_MAGIC_LEN) != 0) {
+        seaf_warning ("[pack bend] Bad index file %s, ignored.\n", index_path);
+        g_free (contents);
+        return;
+    }
+
+    /* A partial record at the end is left by an interrupted write. */
+    for (off = PACK_INDEX_MAGIC_LEN;
+         off + sizeof(IndexRecord) <= len;
+         off += sizeof(IndexRecord)) {
+        rec = (IndexRecord *)(contents + off);
+        rawdata_to_hex (rec->block_id, block_id, 20);
+        ++(*n_records);
+
+        old = g_hash_table_lookup (store->blocks, block_id);
+        if (old)
+            record_dead_entry (store, old);
+
+        if (rec->op == INDEX_OP_ADD) {
+            entry = g_new0 (PackEntry, 1);
+            entry->pack = GUINT32_FROM_BE (rec->pack);
+            entry->offset = (gint64)GUINT64_FROM_BE (rec->offset);
+            entry->size = GUINT32_FROM_BE (rec->size);
+            g_hash_table_replace (store->blocks, g_strdup(block_id), entry);
+            ++(get_pack_info (store, entry->pack)->n_live);
+        } else if (rec->op == INDEX_OP_REMOVE) {
+            g_hash_table_remove (store->blocks, block_id);
+        }
+    }
+
+    g_free (contents);
+}
+
+/* Drop entries pointing beyond the end of their pack files, which can happen
+ * if the index was written but the pack data didn't make it to disk.
+ */
+static void
+validate_entries (PackStore *store)
+{
+    GHashTable *sizes = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                               NULL, g_free);
+    GHashTableIter iter;
+    gpointer key, value;
+    PackEntry *entry;
+    gint64 *psize;
+    SeafStat st;
+    char *path;
+
+    g_hash_table_iter_init (&iter, store->blocks);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        entry = value;
+
+        psize = g_hash_table_lookup (sizes, GUINT_TO_POINTER(entry->pack));
+        if (!psize) {
+            psize = g_new0 (gint64, 1);
+            path = pack_file_path (store, entry->pack);
+            if (seaf_stat (path, &st) == 0)
+                *psize = (gint64)st.st_size;
+            g_free (path);
+            g_hash_table_insert (sizes, GUINT_TO_POINTER(entry->pack), psize);
+        }
+
+        if (entry->offset + entry->size > *psize) {
+            seaf_warning ("[pack bend] Block %s:%s is truncated in pack %u, dropped.\n",
+                          store->store_id, (char *)key, entry->pack);
+            --(get_pack_info (store, entry->pack)->n_live);
+            g_hash_table_iter_remove (&iter);
+        }
+    }
+
+    g_hash_table_iter_init (&iter, sizes);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        get_pack_info (store, GPOINTER_TO_UINT(key))->total_bytes = *(gint64 *)value;
+    }
+
+    g_hash_table_destroy (sizes);
+}
+
+/* Remove pack files that don't hold any live block, and find out the
+ * number of the last pack.
+ */
+static void
+scan_pack_files (PackStore *store)
+{
+    GDir *dir;
+    const char *dname;
+    guint32 pack;
+    PackInfo *info;
+    char *path;
+    SeafStat st;
+
+    dir = g_dir_open (store->pack_dir, 0, NULL);
+    if (!dir)
+        return;
+
+    while ((dname = g_dir_read_name (dir)) != NULL) {
+        if (!g_str_has_prefix (dname, "pack-"))
+            continue;
+        pack = (guint32)strtoul (dname + strlen("pack-"), NULL, 10);
+        if (pack == 0)
+            continue;
+
+        path = g_build_filename (store->pack_dir, dname, NULL);
+
+        info = g_hash_table_lookup (store->packs, GUINT_TO_POINTER(pack));
+        if (!info || info->n_live <= 0) {
+            g_unlink (path);
+            g_hash_table_remove (store->packs, GUINT_TO_POINTER(pack));
+            g_free (path);
+            continue;
+        }
+
+        if (info->total_bytes == 0 && seaf_stat (path, &st) == 0)
+            info->total_bytes = (gint64)st.st_size;
+
+        if (pack > store->cur_pack)
+            store->cur_pack = pack;
+        g_free (path);
+    }
+
+    g_dir_close (dir);
+}
+
+static int
+open_index_for_append (PackStore *store, const char *index_path)
+{
+    int fd;
+    gint64 size;
+
+    fd = g_open (index_path, O_RDWR | O_CREAT | O_BINARY, 0666);
+    if (fd < 0) {
+        seaf_warning ("[pack bend] Failed to open index %s: %s.\n",
+                      index_path, strerror(errno));
+        return -1;
+    }
+
+    size = seaf_util_lseek (fd, 0, SEEK_END);
+    if (size < PACK_INDEX_MAGIC_LEN) {
+        seaf_util_lseek (fd, 0, SEEK_SET);
+        if (writen (fd, PACK_INDEX_MAGIC, PACK_INDEX_MAGIC_LEN) != PACK_INDEX_MAGIC_LEN) {
+            seaf_warning ("[pack bend] Failed to write index %s: %s.\n",
+                          index_path, strerror(errno));
+            close (fd);
+            return -1;
+        }
+        if (seaf_util_fsync (fd) < 0 || seaf_util_fsync_dir (store->pack_dir) < 0) {
+            close (fd);
+            return -1;
+        }
+    } else {
+        /* Append after the last complete record. */
+        size -= (size - PACK_INDEX_MAGIC_LEN) % sizeof(IndexRecord);
+        seaf_util_lseek (fd, size, SEEK_SET);
+    }
+
+    store->index_fd = fd;
+    return 0;
+}
+
+/* Write a new index containing only the live entries. */
+static int
+rewrite_index (PackStore *store, const char *index_path)
+{
+    char *tmp_path;
+    int fd;
+    GHashTableIter iter;
+    gpointer key, value;
+    int ret = 0;
+
+    tmp_path = g_build_filename (store->pack_dir, PACK_INDEX_TMP_NAME, NULL);
+
+    fd = g_open (tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+    if (fd < 0) {
+        seaf_warning ("[pack bend] Failed to create %s: %s.\n",
+                      tmp_path, strerror(errno));
+        g_free (tmp_path);
+        return -1;
+    }
+
+    if (writen (fd, PACK_INDEX_MAGIC, PACK_INDEX_MAGIC_LEN) != PACK_INDEX_MAGIC_LEN) {
+        ret = -1;
+        goto out;
+    }
+
+    g_hash_table_iter_init (&iter, store->blocks);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        if (write_index_record (fd, INDEX_OP_ADD, key, value) < 0) {
+            ret = -1;
+            goto out;
+        }
+    }
+
+    /* The new index must be on disk before it replaces the old one. */
+    if (seaf_util_fsync (fd) < 0)
+        ret = -1;
+
+out:
+    close (fd);
+    if (ret == 0 && seaf_util_rename (tmp_path, index_path) < 0) {
+        seaf_warning ("[pack bend] Failed to rename %s: %s.\n",
+                      tmp_path, strerror(errno));
+        ret = -1;
+    }
+    if (ret == 0 && seaf_util_fsync_dir (store->pack_dir) < 0)
+        ret = -1;
+    if (ret < 0)
+        g_unlink (tmp_path);
+    g_free (tmp_path);
+    return ret;
+}
+
+/* Flush the current pack and the index to disk. */
+static int
+pack_store_sync (PackStore *store)
+{
+    if (store->cur_fd >= 0 && seaf_util_fsync (store->cur_fd) < 0)
+        return -1;
+    return seaf_util_fsync (store->index_fd);
+}
+
+/* Append @len bytes of block data to the current pack and record it in the
+ * index. If @sync is TRUE, the data is flushed before the index record is
+ * written and the record is flushed before returning. Otherwise the caller
+ * must call pack_store_sync() before relying on the block being on disk.
+ * Must be called with the store lock held.
+ */
+static int
+pack_store_append (PackStore *store, const char *block_id,
+                   const void *data, guint32 len, gboolean sync)
+{
+    PackEntry *entry, *old;
+    char *path;
+
+    if (store->cur_fd >= 0 && store->cur_size > 0 &&
+        store->cur_size + len > MAX_PACK_SIZE) {
+        /* Unsynced appends may still be in the full pack. */
+        if (seaf_util_fsync (store->cur_fd) < 0)
+            return -1;
+        close (store->cur_fd);
+        store->cur_fd = -1;
+        ++(store->cur_pack);
+    }
+
+    if (store->cur_fd < 0) {
+        if (store->cur_pack == 0)
+            store->cur_pack = 1;
+        path = pack_file_path (store, store->cur_pack);
+        store->cur_fd = g_open (path, O_WRONLY | O_CREAT | O_BINARY, 0666);
+        if (store->cur_fd < 0) {
+            seaf_warning ("[pack bend] Failed to open pack %s: %s.\n",
+                          path, strerror(errno));
+            g_free (path);
+            return -1;
+        }
+        g_free (path);
+        store->cur_size = seaf_util_lseek (store->cur_fd, 0, SEEK_END);
+        if (store->cur_size < 0 || seaf_util_fsync_dir (store->pack_dir) < 0) {
+            close (store->cur_fd);
+            store->cur_fd = -1;
+            return -1;
+        }
+    }
+
+    if (seaf_util_lseek (store->cur_fd, store->cur_size, SEEK_SET) < 0 ||
+        writen (store->cur_fd, data, len) != len) {
+        seaf_warning ("[pack bend] Failed to write block %s:%s: %s.\n",
+                      store->store_id, block_id, strerror(errno));
+        return -1;
+    }
+
+    /* Never publish an index record before the data it points to. */
+    if (sync && seaf_util_fsync (store->cur_fd) < 0)
+        return -1;
+
+    entry = g_new0 (PackEntry, 1);
+    entry->pack = store->cur_pack;
+    entry->offset = store->cur_size;
+    entry->size = len;
+
+    /* The record may reach the disk even if writing it fails, so the data
+     * it points to must not be overwritten.
+     */
+    store->cur_size += len;
+
+    if (write_index_record (store->index_fd, INDEX_OP_ADD, block_id, entry) < 0 ||
+        (sync && seaf_util_fsync (store->index_fd) < 0)) {
+        g_free (entry);
+        return -1;
+    }
+
+    old = g_hash_table_lookup (store->blocks, block_id);
+    if (old)
+        record_dead_entry (store, old);
+
+    PackInfo *info = get_pack_info (store, entry->pack);
+    info->total_bytes = store->cur_size;
+    ++(info->n_live);
+
+    g_hash_table_replace (store->blocks, g_strdup(block_id), entry);
+
+    return 0;
+}
+
+/* Import blocks stored in the one-file-per-block layout. */
+static void
+migrate_fs_blocks (PackStore *store)
+{
+    GDir *dir1, *dir2;
+    const char *dname1, *dname2;
+    char *path1, *path2;
+    char block_id[41];
+    char *contents;
+    gsize len;
+    GList *migrated, *ptr;
+    int n = 0;
+
+    dir1 = g_dir_open (store->store_dir, 0, NULL);
+    if (!dir1)
+        return;
+
+    while ((dname1 = g_dir_read_name(dir1)) != NULL) {
+        if (strlen(dname1) != 2)
+            continue;
+
+        path1 = g_build_filename (store->store_dir, dname1, NULL);
+        dir2 = g_dir_open (path1, 0, NULL);
+        if (!dir2) {
+            g_free (path1);
+            continue;
+        }
+
+        migrated = NULL;
+        while ((dname2 = g_dir_read_name(dir2)) != NULL) {
+            snprintf (block_id, sizeof(block_id), "%s%s", dname1, dname2);
+            if (!is_object_id_valid (block_id))
+                continue;
+
+            path2 = g_build_filename (path1, dname2, NULL);
+            if (!g_hash_table_lookup (store->blocks, block_id)) {
+                if (!g_file_get_contents (path2, &contents, &len, NULL)) {
+                    seaf_warning ("[pack bend] Failed to read block %s.\n", path2);
+                    g_free (path2);
+                    continue;
+                }
+                if (pack_store_append (store, block_id, contents,
+                                       (guint32)len, FALSE) < 0) {
+                    g_free (contents);
+                    g_free (path2);
+                    continue;
+                }
+                g_free (contents);
+                ++n;
+            }
+            migrated = g_list_prepend (migrated, path2);
+        }
+        g_dir_close (dir2);
+
+        /* Only remove the block files once their copies are on disk. */
+        if (pack_store_sync (store) == 0) {
+            for (ptr = migrated; ptr; ptr = ptr->next)
+                g_unlink (ptr->data);
+            g_rmdir (path1);
+        }
+        string_list_free (migrated);
+        g_free (path1);
+    }
+    g_dir_close (dir1);
+
+    if (n > 0)
+        seaf_message ("[pack bend] Migrated %d blocks of store %.8s into packs.\n",
+                      n, store->store_id);
+}
+
+static PackStore *
+pack_store_open (PackPriv *priv, const char *store_id)
+{
+    PackStore *store;
+    char *index_path;
+    int n_records;
+
+    store = g_new0 (PackStore, 1);
+    memcpy (store->store_id, store_id, 36);
+    store->store_dir = g_build_filename (priv->block_dir, store_id, NULL);
+    store->pack_dir = g_build_filename (store->store_dir, PACK_DIR_NAME, NULL);
+    store->blocks = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                           g_free, g_free);
+    store->packs = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                          NULL, g_free);
+    store->cur_fd = -1;
+    store->index_fd = -1;
+    pthread_mutex_init (&store->lock, NULL);
+
+    if (g_mkdir_with_parents (store->pack_dir, 0777) < 0) {
+        seaf_warning ("[pack bend] Failed to create pack dir %s.\n", store->pack_dir);
+        pack_store_free (store);
+        return NULL;
+    }
+
+    index_path = g_build_filename (store->pack_dir, PACK_INDEX_NAME, NULL);
+
+    replay_index (store, index_path, &n_records);
+    validate_entries (store);
+    scan_pack_files (store);
+
+    if (n_records > INDEX_REWRITE_RATIO * g_hash_table_size (store->blocks))
+        rewrite_index (store, index_path);
+
+    if (open_index_for_append (store, index_path) < 0) {
+        g_free (index_path);
+        pack_store_free (store);
+        return NULL;
+    }
+    g_free (index_path);
+
+    /* Never append to a pack left by a previous run. */
+    ++(store->cur_pack);
+
+    migrate_fs_blocks (store);
+
+    return store;
+}
+
+/* Called with stores_lock held. */
+static PackStore *
+lookup_pack_store (PackPriv *priv, const char *store_id)
+{
+    PackStore *store;
+
+    store = g_hash_table_lookup (priv->stores, store_id);
+    if (store)
+        return store;
+
+    /* Take back a store released while in use, so that two stores never
+     * append to the same packs.
+     */
+    store = g_hash_table_lookup (priv->released, store_id);
+    if (store) {
+        g_hash_table_remove (priv->released, store_id);
+        ++(store->ref_count);
+        g_hash_table_insert (priv->stores, g_strdup(store_id), store);
+    }
+
+    return store;
+}
+
+/* Returns a reference to the store, to be dropped with put_pack_store().
+ * The stores table holds a reference of its own.
+ *
+ * Opening a store may migrate its blocks, so it's done without
+ * stores_lock. Other threads that want the same store wait for it.
+ */
+static PackStore *
+get_pack_store (BlockBackend *bend, const char *store_id)
+{
+    PackPriv *priv = bend->be_priv;
+    PackStore *store;
+
+    pthread_mutex_lock (&priv->stores_lock);
+    while (!(store = lookup_pack_store (priv, store_id)) &&
+           g_hash_table_contains (priv->opening, store_id))
+        pthread_cond_wait (&priv->opened_cond, &priv->stores_lock);
+    if (store) {
+        ++(store->ref_count);
+        pthread_mutex_unlock (&priv->stores_lock);
+        return store;
+    }
+    g_hash_table_add (priv->opening, g_strdup(store_id));
+    pthread_mutex_unlock (&priv->stores_lock);
+
+    store = pack_store_open (priv, store_id);
+
+    pthread_mutex_lock (&priv->stores_lock);
+    g_hash_table_remove (priv->opening, store_id);
+    if (store) {
+        store->ref_count = 2;
+        g_hash_table_insert (priv->stores, g_strdup(store_id), store);
+    }
+    pthread_cond_broadcast (&priv->opened_cond);
+    pthread_mutex_unlock (&priv->stores_lock);
+
+    return store;
+}
+
+static void
+put_pack_store (BlockBackend *bend, PackStore *store)
+{
+    PackPriv *priv = bend->be_priv;
+    gboolean last;
+
+    pthread_mutex_lock (&priv->stores_lock);
+    last = (--(store->ref_count) == 0);
+    /* The table's reference is gone, so the store was released. */
+    if (last)
+        g_hash_table_remove (priv->released, store->store_id);
+    pthread_mutex_unlock (&priv->stores_lock);
+
+    if (last)
+        pack_store_free (store);
+}
+
+/* Move all live blocks out of @pack and delete it.
+ * Must be called with the store lock held.
+ */
+static void
+compact_pack (PackStore *store, guint32 pack)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    PackEntry *entry;
+    GList *ids = NULL, *ptr;
+    char *path;
+    char *buf = NULL;
+    guint32 buf_size = 0;
+    int fd;
+
+    path = pack_file_path (store, pack);
+    fd = g_open (path, O_RDONLY | O_BINARY, 0);
+    if (fd < 0) {
+        seaf_warning ("[pack bend] Failed to open pack %s for compaction: %s.\n",
+                      path, strerror(errno));
+        g_free (path);
+        return;
+    }
+
+    g_hash_table_iter_init (&iter, store->blocks);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        entry = value;
+        if (entry->pack == pack)
+            ids = g_list_prepend (ids, g_strdup(key));
+    }
+
+    for (ptr = ids; ptr; ptr = ptr->next) {
+        entry = g_hash_table_lookup (store->blocks, ptr->data);
+
+        if (entry->size > buf_size) {
+            buf_size = entry->size;
+            buf = g_realloc (buf, buf_size);
+        }
+
+        if (seaf_util_lseek (fd, entry->offset, SEEK_SET) < 0 ||
+            readn (fd, buf, entry->size) != entry->size) {
+            seaf_warning ("[pack bend] Failed to read block %s from pack %s.\n",
+                          (char *)ptr->data, path);
+            goto out;
+        }
+
+        if (pack_store_append (store, ptr->data, buf, entry->size, FALSE) < 0)
+            goto out;
+    }
+
+    close (fd);
+    fd = -1;
+
+    /* The moved blocks and their index records must be on disk before
+     * the old copies go away.
+     */
+    if (pack_store_sync (store) < 0) {
+        seaf_warning ("[pack bend] Failed to sync store %s, keeping pack %s.\n",
+                      store->store_id, path);
+        goto out;
+    }
+
+    delete_pack (store, pack);
+
+out:
+    if (fd >= 0)
+        close (fd);
+    g_free (path);
+    g_free (buf);
+    string_list_free (ids);
+}
+
+/* Backend interface. */
+
+static BHandle *
+block_backend_pack_open_block (BlockBackend *bend,
+                               const char *store_id,
+                               int version,
+                               const char *block_id,
+                               int rw_type)
+{
+    PackStore *store;
+    PackEntry entry;
+    PackEntry *pentry;
+    BHandle *handle;
+    char *path;
+    int fd = -1;
+
+    g_return_val_if_fail (block_id != NULL, NULL);
+    g_return_val_if_fail (strlen(block_id) == 40, NULL);
+    g_return_val_if_fail (rw_type == BLOCK_READ || rw_type == BLOCK_WRITE, NULL);
+
+    store = get_pack_store (bend, store_id);
+    if (!store)
+        return NULL;
+
+    handle = g_new0 (BHandle, 1);
+    handle->fd = -1;
+
+    if (rw_type == BLOCK_READ) {
+        /* The pack isn't deleted while it's referenced. */
+        pthread_mutex_lock (&store->lock);
+        pentry = g_hash_table_lookup (store->blocks, block_id);
+        if (pentry) {
+            entry = *pentry;
+            ++(get_pack_info (store, entry.pack)->n_readers);
+        }
+        pthread_mutex_unlock (&store->lock);
+
+        if (!pentry) {
+            seaf_warning ("[pack bend] Block %s:%s not found.\n", store_id, block_id);
+            put_pack_store (bend, store);
+            g_free (handle);
+            return NULL;
+        }
+
+        path = pack_file_path (store, entry.pack);
+        fd = g_open (path, O_RDONLY | O_BINARY, 0);
+        if (fd < 0 || seaf_util_lseek (fd, entry.offset, SEEK_SET) < 0) {
+            seaf_warning ("[pack bend] Failed to open block %s in %s: %s.\n",
+                          block_id, path, strerror(errno));
+            if (fd >= 0)
+                close (fd);
+            g_free (path);
+            pthread_mutex_lock (&store->lock);
+            unref_pack (store, entry.pack);
+            pthread_mutex_unlock (&store->lock);
+            put_pack_store (bend, store);
+            g_free (handle);
+            return NULL;
+        }
+        g_free (path);
+
+        handle->fd = fd;
+        handle->size = entry.size;
+        handle->store = store;
+        handle->pack = entry.pack;
+    } else {
+        handle->buf = g_byte_array_new ();
+        put_pack_store (bend, store);
+    }
+
+    memcpy (handle->block_id, block_id, 41);
+    handle->rw_type = rw_type;
+    handle->store_id = g_strdup(store_id);
+    handle->version = version;
+
+    return handle;
+}
+
+static int
+block_backend_pack_read_block (BlockBackend *bend,
+                               BHandle *handle,
+                               void *buf, int len)
+{
+    guint32 left = handle->size - handle->pos;
+    int n;
+
+    if ((guint32)len > left)
+        len = (int)left;
+    if (len == 0)
+        return 0;
+
+    n = readn (handle->fd, buf, len);
+    if (n > 0)
+        handle->pos += n;
+
+    return n;
+}
+
+static int
+block_backend_pack_copy_to_fd (BlockBackend *bend,
+                               BHandle *handle,
+                               int fd, int len)
+{
+    guint32 left = handle->size - handle->pos;
+    int n;
+
+    if ((guint32)len > left)
+        len = (int)left;
+    if (len == 0)
+        return 0;
+
+    n = block_backend_copy_fd_range (handle->fd, fd, len);
+    handle->pos += n;
+
+    return n;
+}
+
+static int
+block_backend_pack_write_block (BlockBackend *bend,
+                                BHandle *handle,
+                                const void *buf, int len)
+{
+    g_byte_array_append (handle->buf, buf, len);
+    return len;
+}
+
+/* Drops the references of a read handle after its fd is closed. */
+static void
+put_handle_pack (BlockBackend *bend, BHandle *handle)
+{
+    PackStore *store = handle->store;
+
+    if (!store)
+        return;
+
+    pthread_mutex_lock (&store->lock);
+    unref_pack (store, handle->pack);
+    pthread_mutex_unlock (&store->lock);
+
+    put_pack_store (bend, store);
+    handle->store = NULL;
+}
+
+static int
+block_backend_pack_close_block (BlockBackend *bend,
+                                BHandle *handle)
+{
+    int ret = 0;
+
+    if (handle->fd >= 0) {
+        ret = close (handle->fd);
+        handle->fd = -1;
+    }
+    put_handle_pack (bend, handle);
+
+    return ret;
+}
+
+static void
+block_backend_pack_block_handle_free (BlockBackend *bend,
+                                      BHandle *handle)
+{
+    if (handle->fd >= 0)
+        close (handle->fd);
+    put_handle_pack (bend, handle);
+    if (handle->buf)
+        g_byte_array_free (handle->buf, TRUE);
+    g_free (handle->store_id);
+    g_free (handle);
+}
+
+static int
+block_backend_pack_commit_block (BlockBackend *bend,
+                                 BHandle *handle)
+{
+    PackStore *store;
+    int ret;
+
+    g_return_val_if_fail (handle->rw_type == BLOCK_WRITE, -1);
+
+    store = get_pack_store (bend, handle->store_id);
+    if (!store)
+        return -1;
+
+    pthread_mutex_lock (&store->lock);
+    ret = pack_store_append (store, handle->block_id,
+                             handle->buf->data, handle->buf->len, TRUE);
+    pthread_mutex_unlock (&store->lock);
+
+    put_pack_store (bend, store);
+
+    if (ret < 0)
+        seaf_warning ("[pack bend] failed to commit block %s:%s.\n",
+                      handle->store_id, handle->block_id);
+
+    return ret;
+}
+
+static gboolean
+block_backend_pack_block_exists (BlockBackend *bend,
+                                 const char *store_id,
+                                 int version,
+                                 const char *block_sha1)
+{
+    PackStore *store;
+    gboolean ret;
+
+    store = get_pack_store (bend, store_id);
+    if (!store)
+        return FALSE;
+
+    pthread_mutex_lock (&store->lock);
+    ret = (g_hash_table_lookup (store->blocks, block_sha1) != NULL);
+    pthread_mutex_unlock (&store->lock);
+
+    put_pack_store (bend, store);
+
+    return ret;
+}
+
+static int
+block_backend_pack_remove_block (BlockBackend *bend,
+                                 const char *store_id,
+                                 int version,
+                                 const char *block_id)
+{
+    PackStore *store;
+    PackEntry *entry;
+    PackInfo *info;
+    guint32 pack;
+    int ret = 0;
+
+    store = get_pack_store (bend, store_id);
+    if (!store)
+        return -1;
+
+    pthread_mutex_lock (&store->lock);
+
+    entry = g_hash_table_lookup (store->blocks, block_id);
+    if (!entry) {
+        ret = -1;
+        goto out;
+    }
+
+    if (write_index_record (store->index_fd, INDEX_OP_REMOVE, block_id, NULL) < 0) {
+        ret = -1;
+        goto out;
+    }
+
+    pack = entry->pack;
+    record_dead_entry (store, entry);
+    g_hash_table_remove (store->blocks, block_id);
+
+    /* Never touch the pack we're appending to. */
+    if (pack == store->cur_pack)
+        goto out;
+
+    info = get_pack_info (store, pack);
+    if (info->n_live <= 0) {
+        delete_pack (store, pack);
+    } else if (info->dead_bytes > info->total_bytes * COMPACT_DEAD_RATIO) {
+        compact_pack (store, pack);
+    }
+
+out:
+    pthread_mutex_unlock (&store->lock);
+    put_pack_store (bend, store);
+    return ret;
+}
+
+static BMetadata *
+block_backend_pack_stat_block (BlockBackend *bend,
+                               const char *store_id,
+                               int version,
+                               const char *block_id)
+{
+    PackStore *store;
+    PackEntry *entry;
+    BMetadata *block_md = NULL;
+
+    store = get_pack_store (bend, store_id);
+    if (!store)
+        return NULL;
+
+    pthread_mutex_lock (&store->lock);
+    entry = g_hash_table_lookup (store->blocks, block_id);
+    if (entry) {
+        block_md = g_new0 (BMetadata, 1);
+        memcpy (block_md->id, block_id, 40);
+        block_md->size = entry->size;
+    }
+    pthread_mutex_unlock (&store->lock);
+
+    put_pack_store (bend, store);
+
+    if (!block_md)
+        seaf_warning ("[pack bend] Failed to stat block %s:%s.\n",
+                      store_id, block_id);
+
+    return block_md;
+}
+
+static BMetadata *
+block_backend_pack_stat_block_by_handle (BlockBackend *bend,
+                                         BHandle *handle)
+{
+    BMetadata *block_md;
+
+    block_md = g_new0 (BMetadata, 1);
+    memcpy (block_md->id, handle->block_id, 40);
+    if (handle->rw_type == BLOCK_WRITE)
+        block_md->size = handle->buf->len;
+    else
+        block_md->size = handle->size;
+
+    return block_md;
+}
+
+static int
+block_backend_pack_foreach_block (BlockBackend *bend,
+                                  const char *store_id,
+                                  int version,
+                                  SeafBlockFunc process,
+                                  void *user_data)
+{
+    PackStore *store;
+    GHashTableIter iter;
+    gpointer key, value;
+    GList *ids = NULL, *ptr;
+
+    store = get_pack_store (bend, store_id);
+    if (!store)
+        return 0;
+
+    pthread_mutex_lock (&store->lock);
+    g_hash_table_iter_init (&iter, store->blocks);
+    while (g_hash_table_iter_next (&iter, &key, &value))
+        ids = g_list_prepend (ids, g_strdup(key));
+    pthread_mutex_unlock (&store->lock);
+
+    put_pack_store (bend, store);
+
+    for (ptr = ids; ptr; ptr = ptr->next) {
+        if (!process (store_id, version, ptr->data, user_data))
+            break;
+    }
+
+    string_list_free (ids);
+    return 0;
+}
+
+static int
+block_backend_pack_copy (BlockBackend *bend,
+                         const char *src_store_id,
+                         int src_version,
+                         const char *dst_store_id,
+                         int dst_version,
+                         const char *block_id)
+{
+    BHandle *src;
+    PackStore *dst;
+    char *buf;
+    int ret = 0;
+
+    if (block_backend_pack_block_exists (bend, dst_store_id, dst_version, block_id))
+        return 0;
+
+    dst = get_pack_store (bend, dst_store_id);
+    if (!dst)
+        return -1;
+
+    src = block_backend_pack_open_block (bend, src_store_id, src_version,
+                                         block_id, BLOCK_READ);
+    if (!src) {
+        put_pack_store (bend, dst);
+        return -1;
+    }
+
+    buf = g_malloc (src->size ? src->size : 1);
+    if (block_backend_pack_read_block (bend, src, buf, src->size) != (int)src->size) {
+        seaf_warning ("[pack bend] Failed to read block %s:%s.\n",
+                      src_store_id, block_id);
+        ret = -1;
+        goto out;
+    }
+
+    pthread_mutex_lock (&dst->lock);
+    ret = pack_store_append (dst, block_id, buf, src->size, TRUE);
+    pthread_mutex_unlock (&dst->lock);
+
+out:
+    g_free (buf);
+    block_backend_pack_block_handle_free (bend, src);
+    put_pack_store (bend, dst);
+    return ret;
+}
+
+static void
+remove_dir_contents (const char *path)
+{
+    GDir *dir;
+    const char *dname;
+    char *sub_path;
+
+    dir = g_dir_open (path, 0, NULL);
+    if (!dir)
+        return;
+
+    while ((dname = g_dir_read_name(dir)) != NULL) {
+        sub_path = g_build_filename (path, dname, NULL);
+        if (g_file_test (sub_path, G_FILE_TEST_IS_DIR)) {
+            remove_dir_contents (sub_path);
+            g_rmdir (sub_path);
+        } else {
+            g_unlink (sub_path);
+        }
+        g_free (sub_path);
+    }
+
+    g_dir_close (dir);
+}
+
+static void
+block_backend_pack_release_store (BlockBackend *bend, const char *store_id)
+{
+    PackPriv *priv = bend->be_priv;
+    PackStore *store;
+    gboolean last = FALSE;
+
+    pthread_mutex_lock (&priv->stores_lock);
+    /* A store being opened is released once it's in the table. */
+    while (g_hash_table_contains (priv->opening, store_id))
+        pthread_cond_wait (&priv->opened_cond, &priv->stores_lock);
+    store = g_hash_table_lookup (priv->stores, store_id);
+    if (store) {
+        g_hash_table_remove (priv->stores, store_id);
+        /* Drop the table's reference. Stores still in use are freed by
+         * their last user.
+         */
+        last = (--(store->ref_count) == 0);
+        if (!last)
+            g_hash_table_insert (priv->released, g_strdup(store_id), store);
+    }
+    pthread_mutex_unlock (&priv->stores_lock);
+
+    if (last)
+        pack_store_free (store);
+}
+
+static int
+block_backend_pack_remove_store (BlockBackend *bend, const char *store_id)
+{
+    PackPriv *priv = bend->be_priv;
+    char *store_dir;
+
+    block_backend_pack_release_store (bend, store_id);
+
+    store_dir = g_build_filename (priv->block_dir, store_id, NULL);
+    remove_dir_contents (store_dir);
+    g_rmdir (store_dir);
+    g_free (store_dir);
+
+    return 0;
+}
+
+BlockBackend *
+block_backend_pack_new (const char *seaf_dir, const char *tmp_dir)
+{
+    BlockBackend *bend;
+    PackPriv *priv;
+
+    bend = g_new0(BlockBackend, 1);
+    priv = g_new0(PackPriv, 1);
+    bend->be_priv = priv;
+
+    priv->block_dir = g_build_filename (seaf_dir, "storage", "blocks", NULL);
+
+    if (g_mkdir_with_parents (priv->block_dir, 0777) < 0) {
+        seaf_warning ("Block dir %s does not exist and"
+                   " is unable to create\n", priv->block_dir);
+        goto onerror;
+    }
+
+    priv->stores = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                          g_free, NULL);
+    priv->released = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                            g_free, NULL);
+    priv->opening = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                           g_free, NULL);
+    pthread_cond_init (&priv->opened_cond, NULL);
+    pthread_mutex_init (&priv->stores_lock, NULL);
+
+    bend->open_block = block_backend_pack_open_block;
+    bend->read_block = block_backend_pack_read_block;
+    bend->copy_to_fd = block_backend_pack_copy_to_fd;
+    bend->write_block = block_backend_pack_write_block;
+    bend->commit_block = block_backend_pack_commit_block;
+    bend->close_block = block_backend_pack_close_block;
+    bend->exists = block_backend_pack_block_exists;
+    bend->remove_block = block_backend_pack_remove_block;
+    bend->stat_block = block_backend_pack_stat_block;
+    bend->stat_block_by_handle = block_backend_pack_stat_block_by_handle;
+    bend->block_handle_free = block_backend_pack_block_handle_free;
+    bend->foreach_block = block_backend_pack_foreach_block;
+    bend->remove_store = block_backend_pack_remove_store;
+    bend->release_store = block_backend_pack_release_store;
+    bend->copy = block_backend_pack_copy;
+
+    return bend;
+
+onerror:
+    g_free (priv->block_dir);
+    g_free (priv);
+    g_free (bend);
+
+    return NULL;
+}
@@ -1,10 +1,40 @@
 
+#if defined __linux__ && !defined _GNU_SOURCE
+/* For copy_file_range(). */
+#define _GNU_SOURCE
+#endif
+
 #include "common.h"
 
 #include "log.h"
 
 #include "block-backend.h"
 
+int
+block_backend_copy_fd_range (int in_fd, int out_fd, int len)
+{
+#ifdef HAVE_COPY_FILE_RANGE
+    ssize_t n;
+    int done = 0;
+
+    while (done < len) {
+        n = copy_file_range (in_fd, NULL, out_fd, NULL, len - done, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        /* Not supported between these files, or a short source. The caller
+         * copies the rest through memory and sees any real error then.
+         */
+        if (n <= 0)
+            break;
+        done += n;
+    }
+
+    return done;
+#else
+    return 0;
+#endif
+}
+
 extern BlockBackend *
 block_backend_fs_new (const char *block_dir, const char *tmp_dir);
 
@@ -54,6 +54,30 @@ struct BlockBackend {
     int      (*remove_store) (BlockBackend *bend,
                               const char *store_id);
 
+    /* Optional. Drop any cached state of the store, e.g. before its
+     * directory is moved away. */
+    void     (*release_store) (BlockBackend *bend,
+                               const char *store_id);
+
+    /* Optional. Copy up to @len bytes from the current position of a read
+     * handle to the current position of @fd without going through user
+     * space. Returns the number of bytes copied.
+     */
+    int      (*copy_to_fd) (BlockBackend *bend, BHandle *handle,
+                            int fd, int len);
+
+    /* Optional. Hard link the file at @path in as the block, or the block
+     * out to @path, which must not exist. Returns -1 if the files can't
+     * share storage, the caller copies them then.
+     */
+    int      (*link_block_in) (BlockBackend *bend,
+                               const char *store_id, int version,
+                               const char *block_id, const char *path);
+
+    int      (*link_block_out) (BlockBackend *bend,
+                                const char *store_id, int version,
+                                const char *block_id, const char *path);
+
     void*    be_priv;           /* backend private field */
 
 };
@@ -61,4 +85,11 @@ struct BlockBackend {
 
 BlockBackend* load_block_backend (GKeyFile *config);
 
+/* Kernel-side copy from the current offset of @in_fd to that of @out_fd, e.g.
+ * with copy_file_range(), which can share extents on btrfs and XFS. Returns
+ * the number of bytes copied, 0 if not supported.
+ */
+int
+block_backend_copy_fd_range (int in_fd, int out_fd, int len);
+
 #endif
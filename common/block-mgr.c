@@ -3,8 +3,11 @@
 #include "common.h"
 
 #include "seafile-session.h"
+#include "seafile-config.h"
 #include "utils.h"
+#include "sha1-util.h"
 #include "block-mgr.h"
+#include "metrics.h"
 #include "log.h"
 
 #include <stdio.h>
@@ -26,22 +29,44 @@
 extern BlockBackend *
 block_backend_fs_new (const char *block_dir, const char *tmp_dir);
 
+extern BlockBackend *
+block_backend_pack_new (const char *seaf_dir, const char *tmp_dir);
+
 
 SeafBlockManager *
 seaf_block_manager_new (struct _SeafileSession *seaf,
                         const char *seaf_dir)
 {
     SeafBlockManager *mgr;
+    char *backend;
 
     mgr = g_new0 (SeafBlockManager, 1);
     mgr->seaf = seaf;
 
-    mgr->backend = block_backend_fs_new (seaf_dir, seaf->tmp_file_dir);
+    backend = seafile_session_config_get_string (seaf, KEY_BLOCK_BACKEND);
+    if (g_strcmp0 (backend, BLOCK_BACKEND_PACK) == 0) {
+        seaf_message ("Using packed block backend.\n");
+        mgr->backend = block_backend_pack_new (seaf_dir, seaf->tmp_file_dir);
+    } else {
+        mgr->backend = block_backend_fs_new (seaf_dir, seaf->tmp_file_dir);
+    }
+    g_free (backend);
     if (!mgr->backend) {
         seaf_warning ("[Block mgr] Failed to load backend.\n");
         goto onerror;
     }
 
+    mgr->read_usec = seaf_metric_get (SEAF_METRIC_HISTOGRAM,
+                                      "seaf_block_read_usec", NULL);
+    mgr->write_usec = seaf_metric_get (SEAF_METRIC_HISTOGRAM,
+                                       "seaf_block_write_usec", NULL);
+    mgr->commit_usec = seaf_metric_get (SEAF_METRIC_HISTOGRAM,
+                                        "seaf_block_commit_usec", NULL);
+    mgr->read_bytes = seaf_metric_get (SEAF_METRIC_COUNTER,
+                                       "seaf_block_read_bytes_total", NULL);
+    mgr->write_bytes = seaf_metric_get (SEAF_METRIC_COUNTER,
+                                        "seaf_block_write_bytes_total", NULL);
+
     return mgr;
 
 onerror:
@@ -78,7 +103,26 @@ seaf_block_manager_read_block (SeafBlockManager *mgr,
                                BlockHandle *handle,
                                void *buf, int len)
 {
-    return mgr->backend->read_block (mgr->backend, handle, buf, len);
+    gint64 start = seaf_metrics_now ();
+    int n;
+
+    n = mgr->backend->read_block (mgr->backend, handle, buf, len);
+    seaf_metric_observe_since (mgr->read_usec, start);
+    if (n > 0)
+        seaf_metric_inc (mgr->read_bytes, n);
+
+    return n;
+}
+
+int
+seaf_block_manager_copy_block_to_fd (SeafBlockManager *mgr,
+                                     BlockHandle *handle,
+                                     int fd, int len)
+{
+    if (!mgr->backend->copy_to_fd)
+        return 0;
+
+    return mgr->backend->copy_to_fd (mgr->backend, handle, fd, len);
 }
 
 int
@@ -86,7 +130,15 @@ seaf_block_manager_write_block (SeafBlockManager *mgr,
                                 BlockHandle *handle,
                                 const void *buf, int len)
 {
-    return mgr->backend->write_block (mgr->backend, handle, buf, len);
+    gint64 start = seaf_metrics_now ();
+    int n;
+
+    n = mgr->backend->write_block (mgr->backend, handle, buf, len);
+    seaf_metric_observe_since (mgr->write_usec, start);
+    if (n > 0)
+        seaf_metric_inc (mgr->write_bytes, n);
+
+    return n;
 }
 
 int
@@ -107,7 +159,13 @@ int
 seaf_block_manager_commit_block (SeafBlockManager *mgr,
                                  BlockHandle *handle)
 {
-    return mgr->backend->commit_block (mgr->backend, handle);
+    gint64 start = seaf_metrics_now ();
+    int ret;
+
+    ret = mgr->backend->commit_block (mgr->backend, handle);
+    seaf_metric_observe_since (mgr->commit_usec, start);
+
+    return ret;
 }
     
 gboolean seaf_block_manager_block_exists (SeafBlockManager *mgr,
@@ -186,6 +244,144 @@ seaf_block_manager_copy_block (SeafBlockManager *mgr,
                                block_id);
 }
 
+#define BLOCK_COPY_BUF_SIZE (64 * 1024)
+
+int
+seaf_block_manager_import_block (SeafBlockManager *mgr,
+                                 const char *store_id,
+                                 int version,
+                                 const char *block_id,
+                                 const char *path)
+{
+    BlockHandle *handle = NULL;
+    char *buf = NULL;
+    int fd = -1;
+    int n;
+    int ret = -1;
+
+    if (!store_id || !is_uuid_valid(store_id) ||
+        !block_id || !is_object_id_valid(block_id))
+        return -1;
+
+    if (mgr->backend->link_block_in &&
+        mgr->backend->link_block_in (mgr->backend, store_id, version,
+                                     block_id, path) == 0)
+        return 0;
+
+    fd = g_open (path, O_RDONLY | O_BINARY, 0);
+    if (fd < 0) {
+        seaf_warning ("Failed to open %s: %s.\n", path, strerror(errno));
+        return -1;
+    }
+
+    handle = seaf_block_manager_open_block (mgr, store_id, version,
+                                            block_id, BLOCK_WRITE);
+    if (!handle) {
+        seaf_warning ("Failed to open block %s:%s.\n", store_id, block_id);
+        goto out;
+    }
+
+    buf = g_malloc (BLOCK_COPY_BUF_SIZE);
+    while ((n = readn (fd, buf, BLOCK_COPY_BUF_SIZE)) > 0) {
+        if (seaf_block_manager_write_block (mgr, handle, buf, n) != n) {
+            seaf_warning ("Failed to write block %s:%s.\n", store_id, block_id);
+            seaf_block_manager_close_block (mgr, handle);
+            goto out;
+        }
+    }
+    if (n < 0) {
+        seaf_warning ("Failed to read %s: %s.\n", path, strerror(errno));
+        seaf_block_manager_close_block (mgr, handle);
+        goto out;
+    }
+
+    if (seaf_block_manager_close_block (mgr, handle) < 0 ||
+        seaf_block_manager_commit_block (mgr, handle) < 0) {
+        seaf_warning ("Failed to commit block %s:%s.\n", store_id, block_id);
+        goto out;
+    }
+
+    ret = 0;
+
+out:
+    if (handle)
+        seaf_block_manager_block_handle_free (mgr, handle);
+    g_free (buf);
+    close (fd);
+    return ret;
+}
+
+int
+seaf_block_manager_export_block (SeafBlockManager *mgr,
+                                 const char *store_id,
+                                 int version,
+                                 const char *block_id,
+                                 const char *path)
+{
+    BlockHandle *handle = NULL;
+    BlockMetadata *bmd = NULL;
+    char *buf = NULL;
+    int fd = -1;
+    int n, done;
+    int ret = -1;
+
+    if (!store_id || !is_uuid_valid(store_id) ||
+        !block_id || !is_object_id_valid(block_id))
+        return -1;
+
+    if (mgr->backend->link_block_out &&
+        mgr->backend->link_block_out (mgr->backend, store_id, version,
+                                      block_id, path) == 0)
+        return 0;
+
+    handle = seaf_block_manager_open_block (mgr, store_id, version,
+                                            block_id, BLOCK_READ);
+    if (!handle) {
+        seaf_warning ("Failed to open block %s:%s.\n", store_id, block_id);
+        return -1;
+    }
+
+    bmd = seaf_block_manager_stat_block_by_handle (mgr, handle);
+    if (!bmd)
+        goto out;
+
+    fd = g_open (path, O_WRONLY | O_CREAT | O_EXCL | O_BINARY, 0666);
+    if (fd < 0) {
+        seaf_warning ("Failed to create %s: %s.\n", path, strerror(errno));
+        goto out;
+    }
+
+    done = seaf_block_manager_copy_block_to_fd (mgr, handle, fd, bmd->size);
+    if (done < bmd->size) {
+        buf = g_malloc (BLOCK_COPY_BUF_SIZE);
+        while ((n = seaf_block_manager_read_block (mgr, handle, buf,
+                                                   BLOCK_COPY_BUF_SIZE)) > 0) {
+            if (writen (fd, buf, n) != n) {
+                seaf_warning ("Failed to write %s: %s.\n", path, strerror(errno));
+                goto out;
+            }
+        }
+        if (n < 0) {
+            seaf_warning ("Failed to read block %s:%s.\n", store_id, block_id);
+            goto out;
+        }
+    }
+
+    ret = 0;
+
+out:
+    if (fd >= 0) {
+        close (fd);
+        if (ret < 0)
+            g_unlink (path);
+    }
+    seaf_block_manager_close_block (mgr, handle);
+    seaf_block_manager_block_handle_free (mgr, handle);
+    g_free (bmd);
+    g_free (buf);
+    return ret;
+}
+
 static gboolean
 get_block_number (const char *store_id,
                   int version,
@@ -222,8 +418,9 @@ seaf_block_manager_verify_block (SeafBlockManager *mgr,
     BlockHandle *h;
     char buf[10240];
     int n;
-    GChecksum *cs;
-    const char *check_id;
+    SeafSHA1Ctx cs;
+    unsigned char sha1[20];
+    char check_id[41];
     gboolean ret;
 
     h = seaf_block_manager_open_block (mgr,
@@ -235,32 +432,34 @@ seaf_block_manager_verify_block (SeafBlockManager *mgr,
         return FALSE;
     }
 
-    cs = g_checksum_new (G_CHECKSUM_SHA1);
+    seaf_sha1_init (&cs);
     while (1) {
         n = seaf_block_manager_read_block (mgr, h, buf, sizeof(buf));
         if (n < 0) {
             seaf_warning ("Failed to read block %s:%.8s.\n", store_id, block_id);
             *io_error = TRUE;
-            g_checksum_free (cs);
+            seaf_sha1_cleanup (&cs);
+            seaf_block_manager_close_block (mgr, h);
+            seaf_block_manager_block_handle_free (mgr, h);
             return FALSE;
         }
         if (n == 0)
             break;
 
-        g_checksum_update (cs, (guchar *)buf, n);
+        seaf_sha1_update (&cs, buf, n);
     }
 
     seaf_block_manager_close_block (mgr, h);
     seaf_block_manager_block_handle_free (mgr, h);
 
-    check_id = g_checksum_get_string (cs);
+    seaf_sha1_final (&cs, sha1);
+    rawdata_to_hex (sha1, check_id, 20);
 
     if (strcmp (check_id, block_id) == 0)
         ret = TRUE;
     else
         ret = FALSE;
 
-    g_checksum_free (cs);
     return ret;
 }
 
@@ -270,3 +469,11 @@ seaf_block_manager_remove_store (SeafBlockManager *mgr,
 {
     return mgr->backend->remove_store (mgr->backend, store_id);
 }
+
+void
+seaf_block_manager_release_store (SeafBlockManager *mgr,
+                                  const char *store_id)
+{
+    if (mgr->backend->release_store)
+        mgr->backend->release_store (mgr->backend, store_id);
+}
@@ -10,6 +10,7 @@
 #include "block.h"
 
 struct _SeafileSession;
+struct SeafMetric;
 
 typedef struct _SeafBlockManager SeafBlockManager;
 
@@ -17,6 +18,12 @@ struct _SeafBlockManager {
     struct _SeafileSession *seaf;
 
     struct BlockBackend *backend;
+
+    struct SeafMetric *read_usec;
+    struct SeafMetric *write_usec;
+    struct SeafMetric *commit_usec;
+    struct SeafMetric *read_bytes;
+    struct SeafMetric *write_bytes;
 };
 
 
@@ -55,6 +62,18 @@ seaf_block_manager_read_block (SeafBlockManager *mgr,
                                BlockHandle *handle,
                                void *buf, int len);
 
+/*
+ * Copy up to @len bytes of a block opened for read to the current position
+ * of @fd, in the kernel if the backend and file systems support it.
+ *
+ * Returns: the bytes copied. The caller should read and write the rest
+ * itself.
+ */
+int
+seaf_block_manager_copy_block_to_fd (SeafBlockManager *mgr,
+                                     BlockHandle *handle,
+                                     int fd, int len);
+
 /*
  * Write data to a block.
  * The semantics is similar to writen.
@@ -134,11 +153,39 @@ seaf_block_manager_copy_block (SeafBlockManager *mgr,
                                int dst_version,
                                const char *block_id);
 
+/*
+ * Store the file at @path as a block, hard linked if the backend and file
+ * system allow it, copied otherwise. The block must not exist yet.
+ */
+int
+seaf_block_manager_import_block (SeafBlockManager *mgr,
+                                 const char *store_id,
+                                 int version,
+                                 const char *block_id,
+                                 const char *path);
+
+/*
+ * Save a block to the new file @path, hard linked or copied the same way.
+ * Copies may still share extents, see seaf_block_manager_copy_block_to_fd().
+ */
+int
+seaf_block_manager_export_block (SeafBlockManager *mgr,
+                                 const char *store_id,
+                                 int version,
+                                 const char *block_id,
+                                 const char *path);
+
 /* Remove all blocks for a repo. Only valid for version 1 repo. */
 int
 seaf_block_manager_remove_store (SeafBlockManager *mgr,
                                  const char *store_id);
 
+/* Drop the backend's cached state of a store whose directory is about to be
+ * moved or removed outside of the block manager. */
+void
+seaf_block_manager_release_store (SeafBlockManager *mgr,
+                                  const char *store_id);
+
 guint64
 seaf_block_manager_get_block_number (SeafBlockManager *mgr,
                                      const char *store_id,
@@ -0,0 +1,197 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Compare the byte-at-a-time rolling checksum with rabin_find_break().
+ *
+ * Usage: cdc-bench [size-in-MB | file]
+ *
+ * Both scanners cut the same in-memory data with the parameters used by
+ * file_chunk_cdc(). The cut points must be identical; the throughput of
+ * each is reported in MB/s on a single core.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "rabin-checksum.h"
+
+#define BLOCK_SZ        (1024*1024*1)
+#define BLOCK_MIN_SZ    (1024*256)
+#define BLOCK_MAX_SZ    (1024*1024*4)
+#define BLOCK_WIN_SZ    48
+#define BREAK_VALUE     0x0013
+
+#define DEFAULT_SIZE_MB 256
+#define ROUNDS 3
+
+typedef int (*NextBreakFunc) (const char *buf, int len);
+
+static double
+now ()
+{
+    struct timeval tv;
+
+    gettimeofday (&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* Same loop as file_chunk_cdc() before rabin_find_break() was added. */
+static int
+next_break_rolling (const char *buf, int len)
+{
+    unsigned int fp = 0;
+    int cur;
+
+    if (len < BLOCK_MIN_SZ)
+        return len;
+
+    for (cur = BLOCK_MIN_SZ - 1; cur < len; cur++) {
+        fp = (cur == BLOCK_MIN_SZ - 1) ?
+            rabin_checksum ((char *)buf + cur - BLOCK_WIN_SZ + 1, BLOCK_WIN_SZ) :
+            rabin_rolling_checksum (fp, BLOCK_WIN_SZ,
+                                    buf[cur - BLOCK_WIN_SZ], buf[cur]);
+        if ((fp & (BLOCK_SZ - 1)) == (BREAK_VALUE & (BLOCK_SZ - 1)) ||
+            cur + 1 >= BLOCK_MAX_SZ)
+            return cur + 1;
+    }
+
+    return len;
+}
+
+static int
+next_break_fast (const char *buf, int len)
+{
+    int limit, brk;
+
+    if (len < BLOCK_MIN_SZ)
+        return len;
+
+    limit = (len < BLOCK_MAX_SZ) ? len : BLOCK_MAX_SZ;
+    brk = rabin_find_break (buf, BLOCK_MIN_SZ - 1, BLOCK_MIN_SZ - 1, limit,
+                            BLOCK_SZ - 1, BREAK_VALUE);
+    return (brk >= 0) ? brk + 1 : limit;
+}
+
+static int
+cut_all (NextBreakFunc next, const char *data, size_t size, size_t *cuts)
+{
+    size_t off = 0;
+    int n = 0;
+
+    while (off < size) {
+        size_t left = size - off;
+        int len = (left > BLOCK_MAX_SZ) ? BLOCK_MAX_SZ : (int)left;
+
+        off += next (data + off, len);
+        if (cuts)
+            cuts[n] = off;
+        n++;
+    }
+
+    return n;
+}
+
+static double
+bench (const char *name, NextBreakFunc next,
+       const char *data, size_t size, size_t *cuts, int *n_cuts)
+{
+    double best = 0, start, mbps;
+    int i;
+
+    for (i = 0; i < ROUNDS; i++) {
+        start = now ();
+        *n_cuts = cut_all (next, data, size, cuts);
+        mbps = size / (1024.0 * 1024.0) / (now () - start);
+        if (mbps > best)
+            best = mbps;
+    }
+
+    printf ("%-10s %10.1f MB/s  %d blocks\n", name, best, *n_cuts);
+    return best;
+}
+
+static char *
+load_data (const char *arg, size_t *size)
+{
+    char *data;
+    char *end;
+    long mb;
+
+    mb = strtol (arg, &end, 10);
+    if (*end == '\0' && mb > 0) {
+        unsigned int seed = 1;
+        size_t i;
+
+        *size = (size_t)mb * 1024 * 1024;
+        data = malloc (*size);
+        if (!data)
+            return NULL;
+        for (i = 0; i < *size; i++) {
+            seed = seed * 1103515245 + 12345;
+            data[i] = (char)(seed >> 16);
+        }
+        return data;
+    }
+
+    FILE *fp = fopen (arg, "rb");
+    if (!fp) {
+        fprintf (stderr, "Failed to open %s.\n", arg);
+        return NULL;
+    }
+    fseek (fp, 0, SEEK_END);
+    *size = ftell (fp);
+    fseek (fp, 0, SEEK_SET);
+    data = malloc (*size + 1);
+    if (data && fread (data, 1, *size, fp) != *size) {
+        fprintf (stderr, "Failed to read %s.\n", arg);
+        free (data);
+        data = NULL;
+    }
+    fclose (fp);
+    return data;
+}
+
+int
+main (int argc, char **argv)
+{
+    char *data;
+    size_t size, max_cuts;
+    size_t *cuts_ref, *cuts_fast;
+    int n_ref, n_fast;
+    double ref, fast;
+    char arg[32];
+
+    if (argc > 1) {
+        data = load_data (argv[1], &size);
+    } else {
+        snprintf (arg, sizeof(arg), "%d", DEFAULT_SIZE_MB);
+        data = load_data (arg, &size);
+    }
+    if (!data)
+        return 1;
+
+    rabin_init (BLOCK_WIN_SZ);
+
+    max_cuts = size / BLOCK_MIN_SZ + 2;
+    cuts_ref = calloc (max_cuts, sizeof(size_t));
+    cuts_fast = calloc (max_cuts, sizeof(size_t));
+
+    printf ("Chunking %.1f MB\n", size / (1024.0 * 1024.0));
+    ref = bench ("rolling", next_break_rolling, data, size, cuts_ref, &n_ref);
+    fast = bench ("fast", next_break_fast, data, size, cuts_fast, &n_fast);
+    printf ("speedup    %10.2fx\n", fast / ref);
+
+    if (n_ref != n_fast ||
+        memcmp (cuts_ref, cuts_fast, n_ref * sizeof(size_t)) != 0) {
+        fprintf (stderr, "Cut points differ!\n");
+        return 1;
+    }
+    printf ("Cut points identical.\n");
+
+    free (cuts_ref);
+    free (cuts_fast);
+    free (data);
+    return 0;
+}
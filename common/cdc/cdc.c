@@ -16,13 +16,12 @@
 #include <glib/gstdio.h>
 
 #include "utils.h"
+#include "sha1-util.h"
 
 #include "cdc.h"
 #include "../seafile-crypt.h"
 
 #include "rabin-checksum.h"
-#define finger rabin_checksum
-#define rolling_finger rabin_rolling_checksum
 
 #define BLOCK_SZ        (1024*1024*1)
 #define BLOCK_MIN_SZ    (1024*256)
@@ -78,6 +77,9 @@ static int init_cdc_file_descriptor (int fd,
     max_block_nr = ((file_size + block_min_sz - 1) / block_min_sz);
     file_descr->blk_sha1s = (uint8_t *)calloc (sizeof(uint8_t),
                                                max_block_nr * CHECKSUM_LENGTH);
+    if (file_descr->keep_blk_lens)
+        file_descr->blk_lens = (uint32_t *)calloc (sizeof(uint32_t),
+                                                   max_block_nr);
     file_descr->max_block_nr = max_block_nr;
 
     return 0;
@@ -101,7 +103,10 @@ do {                                                         \
     memcpy (file_descr->blk_sha1s +                          \
             file_descr->block_nr * CHECKSUM_LENGTH,          \
             chunk_descr.checksum, CHECKSUM_LENGTH);          \
-    g_checksum_update (file_ctx, chunk_descr.checksum, 20);       \
+    if (file_descr->blk_lens)                                \
+        file_descr->blk_lens[file_descr->block_nr] =         \
+            _block_sz;                                       \
+    seaf_sha1_update (&file_ctx, chunk_descr.checksum, 20);  \
     file_descr->block_nr++;                                  \
     offset += _block_sz;                                     \
                                                              \
@@ -118,10 +123,12 @@ int file_chunk_cdc(int fd_src,
 {
     char *buf = NULL;
     uint32_t buf_sz;
-    GChecksum *file_ctx = g_checksum_new (G_CHECKSUM_SHA1);
+    SeafSHA1Ctx file_ctx;
     CDCDescriptor chunk_descr;
     int ret = 0;
 
+    seaf_sha1_init (&file_ctx);
+
     SeafStat sb;
     if (seaf_fstat (fd_src, &sb) < 0) {
         seaf_warning ("CDC: failed to stat: %s.\n", strerror(errno));
@@ -134,9 +141,8 @@ int file_chunk_cdc(int fd_src,
     uint32_t block_min_sz = file_descr->block_min_sz;
     uint32_t block_mask = file_descr->block_sz - 1;
 
-    int fingerprint = 0;
     int offset = 0;
-    int tail, cur, rsize;
+    int tail, cur, rsize, brk;
 
     buf_sz = file_descr->block_max_sz;
     buf = chunk_descr.block_buf = malloc (buf_sz);
@@ -195,36 +201,32 @@ int file_chunk_cdc(int fd_src,
         if (cur < block_min_sz - 1)
             cur = block_min_sz - 1;
 
-        while (cur < tail) {
-            fingerprint = (cur == block_min_sz - 1) ?
-                finger(buf + cur - BLOCK_WIN_SZ + 1, BLOCK_WIN_SZ) :
-                rolling_finger (fingerprint, BLOCK_WIN_SZ, 
-                                *(buf+cur-BLOCK_WIN_SZ), *(buf + cur));
-
-            /* get a chunk, write block info to chunk file */
-            if (((fingerprint & block_mask) ==  ((BREAK_VALUE & block_mask)))
-                || cur + 1 >= file_descr->block_max_sz)
-            {
-                if (file_descr->block_nr == file_descr->max_block_nr) {
-                    seaf_warning ("Block id array is not large enough, bail out.\n");
-                    ret = -1;
-                    goto out;
-                }
-
-                WRITE_CDC_BLOCK (cur + 1, write_data);
-                break;
-            } else {
-                cur ++;
+        /* The window is seeded at block_min_sz - 1 and rolled forward
+         * from there. Cut at the first break value, or at block_max_sz. */
+        brk = rabin_find_break (buf, block_min_sz - 1, cur, tail,
+                                block_mask, BREAK_VALUE);
+        if (brk < 0 && tail >= file_descr->block_max_sz)
+            brk = file_descr->block_max_sz - 1;
+
+        /* get a chunk, write block info to chunk file */
+        if (brk >= 0) {
+            if (file_descr->block_nr == file_descr->max_block_nr) {
+                seaf_warning ("Block id array is not large enough, bail out.\n");
+                ret = -1;
+                goto out;
             }
+
+            WRITE_CDC_BLOCK (brk + 1, write_data);
+        } else {
+            cur = tail;
         }
     }
 
-    gsize chk_sum_len = CHECKSUM_LENGTH;
-    g_checksum_get_digest (file_ctx, file_descr->file_sum, &chk_sum_len);
+    seaf_sha1_final (&file_ctx, file_descr->file_sum);
 
 out:
+    seaf_sha1_cleanup (&file_ctx);
     free (buf);
-    g_checksum_free (file_ctx);
 
     return ret;
 }
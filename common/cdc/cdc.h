@@ -32,6 +32,9 @@ typedef struct _CDCFileDescriptor {
 
     uint32_t block_nr;
     uint8_t *blk_sha1s;
+    /* Lengths of the blocks, only kept if keep_blk_lens is set. */
+    gboolean keep_blk_lens;
+    uint32_t *blk_lens;
     int max_block_nr;
     uint8_t  file_sum[CHECKSUM_LENGTH];
 
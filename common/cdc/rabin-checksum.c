@@ -39,6 +39,12 @@ static u_int64_t poly = 0xbfe6b8a5bf378d83LL;
 static u_int64_t T[256];
 static u_int64_t U[256];
 static int shift;
+static int win_size;
+
+/* Per outgoing byte term of rabin_rolling_checksum(), truncated to 32 bits. */
+static unsigned int R[256];
+/* Low 8 bits of R[]. */
+static u_char R8[256];
 
 /* Highest bit set in a byte */
 static const char bytemsb[0x100] = {
@@ -154,10 +160,21 @@ static void calcU(int size)
         U[i] = polymmult (i, sizeshift, poly);
 }
 
+static void calcR()
+{
+    int i;
+    for (i = 0; i < 256; i++) {
+        R[i] = (unsigned int) ((U[i] << 8) ^ T[U[i] >> shift]);
+        R8[i] = (u_char) R[i];
+    }
+}
+
 void rabin_init(int len)
 {
     calcT(poly);
     calcU(len);
+    calcR();
+    win_size = len;
 }
 
 /*
@@ -178,3 +195,61 @@ unsigned int rabin_rolling_checksum(unsigned int csum, int len,
 {
     return append8(csum ^ U[(unsigned char)c1], c2);
 }
+
+/*
+ * The rolling checksum is kept in 32 bits and shifted left by 8 on every
+ * step, so its value at offset i only depends on the last four steps:
+ *
+ *   sum(i) = G(i) ^ G(i-1) << 8 ^ G(i-2) << 16 ^ G(i-3) << 24
+ *
+ * where G(i) = R[buf[i - win_size]] ^ buf[i], or just buf[i] for offsets
+ * covered by the initial rabin_checksum() at @origin. This lets us compute
+ * the checksum at any offset directly instead of chaining through every byte.
+ */
+static inline unsigned int
+step_input (const u_char *buf, int origin, int i)
+{
+    if (i <= origin)
+        return buf[i];
+    return R[buf[i - win_size]] ^ buf[i];
+}
+
+static inline unsigned int
+checksum_at (const u_char *buf, int origin, int i)
+{
+    return step_input (buf, origin, i) ^
+        (step_input (buf, origin, i - 1) << 8) ^
+        (step_input (buf, origin, i - 2) << 16) ^
+        (step_input (buf, origin, i - 3) << 24);
+}
+
+int rabin_find_break(const char *buf, int origin, int start, int end,
+                     unsigned int mask, unsigned int value)
+{
+    const u_char *p = (const u_char *)buf;
+    u_char mask8 = (u_char) mask;
+    u_char value8;
+    int i;
+
+    value &= mask;
+    value8 = (u_char) value;
+
+    if (start < origin)
+        start = origin;
+    if (start == origin && start < end) {
+        if ((checksum_at (p, origin, start) & mask) == value)
+            return start;
+        start++;
+    }
+
+    /* Only the newest step reaches the low byte of the checksum, so test
+     * that first and only compute the full value for candidates. */
+    for (i = start; i < end; i++) {
+        if (((R8[p[i - win_size]] ^ p[i]) & mask8) != value8)
+            continue;
+        if ((checksum_at (p, origin, i) & mask) == value)
+            return i;
+    }
+
+    return -1;
+}
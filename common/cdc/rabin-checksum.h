@@ -7,4 +7,15 @@ unsigned int rabin_rolling_checksum(unsigned int csum, int len, char c1, char c2
 
 void rabin_init (int len);
 
+/*
+ * Return the first offset in [start, end) at which
+ * (rolling checksum & mask) == (value & mask), or -1 if there is none.
+ * The window is assumed to be seeded with rabin_checksum() ending at
+ * @origin and rolled forward byte by byte from there, as file_chunk_cdc()
+ * does. Gives the same result as calling rabin_rolling_checksum() on every
+ * byte, only faster.
+ */
+int rabin_find_break (const char *buf, int origin, int start, int end,
+                      unsigned int mask, unsigned int value);
+
 #endif
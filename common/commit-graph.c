@@ -0,0 +1,951 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * The graph file of a repo starts with a magic, followed by one fixed-size
+ * record per commit. Records are only appended, and a commit is always
+ * written after its parents, so the file can be loaded in one pass. A record
+ * cut short by a crash is dropped on load.
+ *
+ * A deleted commit is recorded with n_parents set to GRAPH_DELETED. When it
+ * is loaded, the commit and its descendants are dropped again.
+ */
+
+#include "common.h"
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "utils.h"
+#include "seafile-session.h"
+#include "commit-mgr.h"
+#include "commit-graph.h"
+
+#define DEBUG_FLAG SEAFILE_DEBUG_OTHER
+#include "log.h"
+
+#define GRAPH_DIR_NAME "commit-graph"
+
+#define GRAPH_MAGIC "SCG1"
+#define GRAPH_MAGIC_LEN 4
+
+#define GRAPH_DELETED 0xFF
+
+/* Integers in graph files are stored in big endian. */
+#ifdef WIN32
+__pragma(pack(push, 1))
+typedef struct {
+    guint8 id[20];
+    guint8 parents[2][20];
+    guint8 n_parents;
+    guint32 generation;
+    guint64 ctime;
+} GraphRecord;
+__pragma(pack(pop))
+#else
+typedef struct {
+    guint8 id[20];
+    guint8 parents[2][20];
+    guint8 n_parents;
+    guint32 generation;
+    guint64 ctime;
+} __attribute__((__packed__)) GraphRecord;
+#endif
+
+typedef struct GraphNode {
+    char id[41];
+    struct GraphNode *parents[2];
+    int n_parents;
+    guint32 generation;
+    gint64 ctime;
+} GraphNode;
+
+typedef struct RepoGraph {
+    char *path;
+    gboolean file_exists;
+    /* Opened for appending when the first records are written. */
+    int fd;
+    GHashTable *nodes;          /* commit id -> GraphNode */
+    /* Commits whose history is not complete in the store. They are looked
+     * up again after a restart.
+     */
+    GHashTable *incomplete;
+} RepoGraph;
+
+struct CommitGraph {
+    char *graph_dir;
+    GHashTable *repos;          /* repo id -> RepoGraph */
+    pthread_mutex_t lock;
+};
+
+/* A commit loaded from the store whose parents may not be in the graph yet. */
+typedef struct PendingCommit {
+    char id[41];
+    char parents[2][41];
+    int n_parents;
+    gint64 ctime;
+    /* A parent was deleted from the graph while it was loaded. */
+    gboolean dropped;
+} PendingCommit;
+
+static void
+repo_graph_free (RepoGraph *repo)
+{
+    if (repo->fd >= 0)
+        close (repo->fd);
+    g_free (repo->path);
+    g_hash_table_destroy (repo->nodes);
+    g_hash_table_destroy (repo->incomplete);
+    g_free (repo);
+}
+
+CommitGraph *
+commit_graph_new (const char *seaf_dir)
+{
+    CommitGraph *graph = g_new0 (CommitGraph, 1);
+
+    graph->graph_dir = g_build_filename (seaf_dir, GRAPH_DIR_NAME, NULL);
+    graph->repos = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                          g_free,
+                                          (GDestroyNotify)repo_graph_free);
+    pthread_mutex_init (&graph->lock, NULL);
+
+    return graph;
+}
+
+static gboolean
+lookup_parents (RepoGraph *repo, char parent_ids[][41], int n_parents,
+                GraphNode **parents)
+{
+    int i;
+
+    for (i = 0; i < n_parents; ++i) {
+        parents[i] = g_hash_table_lookup (repo->nodes, parent_ids[i]);
+        if (!parents[i])
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+static guint32
+compute_generation (GraphNode **parents, int n_parents)
+{
+    guint32 generation = 0;
+    int i;
+
+    for (i = 0; i < n_parents; ++i)
+        generation = MAX (generation, parents[i]->generation);
+
+    return generation + 1;
+}
+
+static GraphNode *
+add_node (RepoGraph *repo, const char *id,
+          GraphNode **parents, int n_parents, gint64 ctime)
+{
+    GraphNode *node = g_new0 (GraphNode, 1);
+    int i;
+
+    memcpy (node->id, id, 40);
+    for (i = 0; i < n_parents; ++i)
+        node->parents[i] = parents[i];
+    node->n_parents = n_parents;
+    node->generation = compute_generation (parents, n_parents);
+    node->ctime = ctime;
+
+    g_hash_table_insert (repo->nodes, node->id, node);
+
+    return node;
+}
+
+static gint
+compare_node_by_generation (gconstpointer a, gconstpointer b)
+{
+    const GraphNode *node_a = *(GraphNode **)a;
+    const GraphNode *node_b = *(GraphNode **)b;
+
+    if (node_a->generation == node_b->generation)
+        return 0;
+    return node_a->generation < node_b->generation ? -1 : 1;
+}
+
+/* Drops @node and the nodes that have it in their history. Only nodes of
+ * a higher generation can, and they are checked parents first.
+ */
+static void
+remove_node (RepoGraph *repo, GraphNode *node)
+{
+    GHashTable *removed;
+    GPtrArray *candidates;
+    GHashTableIter iter;
+    gpointer value;
+    GraphNode *cand;
+    guint i;
+    int j;
+
+    removed = g_hash_table_new (g_direct_hash, g_direct_equal);
+    candidates = g_ptr_array_new ();
+
+    g_hash_table_add (removed, node);
+    g_hash_table_iter_init (&iter, repo->nodes);
+    while (g_hash_table_iter_next (&iter, NULL, &value)) {
+        cand = value;
+        if (cand->generation > node->generation)
+            g_ptr_array_add (candidates, cand);
+    }
+    g_ptr_array_sort (candidates, compare_node_by_generation);
+
+    for (i = 0; i < candidates->len; ++i) {
+        cand = g_ptr_array_index (candidates, i);
+        for (j = 0; j < cand->n_parents; ++j) {
+            if (g_hash_table_contains (removed, cand->parents[j])) {
+                g_hash_table_add (removed, cand);
+                break;
+            }
+        }
+    }
+
+    g_hash_table_iter_init (&iter, removed);
+    while (g_hash_table_iter_next (&iter, &value, NULL))
+        g_hash_table_remove (repo->nodes, ((GraphNode *)value)->id);
+
+    g_ptr_array_free (candidates, TRUE);
+    g_hash_table_destroy (removed);
+}
+
+static void
+load_record (RepoGraph *repo, const GraphRecord *rec)
+{
+    char id[41];
+    char parent_ids[2][41];
+    GraphNode *parents[2];
+    GraphNode *node;
+    int i;
+
+    rawdata_to_hex (rec->id, id, 20);
+    node = g_hash_table_lookup (repo->nodes, id);
+
+    if (rec->n_parents == GRAPH_DELETED) {
+        if (node)
+            remove_node (repo, node);
+        return;
+    }
+
+    if (node || rec->n_parents > 2)
+        return;
+
+    for (i = 0; i < rec->n_parents; ++i)
+        rawdata_to_hex (rec->parents[i], parent_ids[i], 20);
+    if (!lookup_parents (repo, parent_ids, rec->n_parents, parents))
+        return;
+
+    if (compute_generation (parents, rec->n_parents) !=
+        GUINT32_FROM_BE (rec->generation))
+        return;
+
+    add_node (repo, id, parents, rec->n_parents,
+              (gint64)GUINT64_FROM_BE (rec->ctime));
+}
+
+static int
+open_for_append (CommitGraph *graph, RepoGraph *repo)
+{
+    if (repo->fd >= 0)
+        return 0;
+
+    if (g_mkdir_with_parents (graph->graph_dir, 0777) < 0) {
+        seaf_warning ("Failed to create %s.\n", graph->graph_dir);
+        return -1;
+    }
+
+    repo->fd = g_open (repo->path, O_WRONLY | O_CREAT | O_APPEND | O_BINARY,
+                       0666);
+    if (repo->fd < 0) {
+        seaf_warning ("Failed to open %s: %s.\n", repo->path, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Cuts off a record left incomplete by a crash. */
+static void
+truncate_graph_file (RepoGraph *repo, gsize len)
+{
+    int fd;
+    int rc;
+
+    fd = g_open (repo->path, O_WRONLY | O_BINARY, 0);
+    if (fd < 0) {
+        seaf_warning ("Failed to open %s: %s.\n", repo->path, strerror(errno));
+        return;
+    }
+
+#ifdef WIN32
+    rc = _chsize_s (fd, (gint64)len) == 0 ? 0 : -1;
+#else
+    rc = ftruncate (fd, (off_t)len);
+#endif
+    if (rc < 0)
+        seaf_warning ("Failed to truncate %s: %s.\n", repo->path, strerror(errno));
+
+    close (fd);
+}
+
+static RepoGraph *
+load_repo_graph (CommitGraph *graph, const char *repo_id)
+{
+    RepoGraph *repo;
+    char *contents = NULL;
+    gsize len, off;
+
+    repo = g_new0 (RepoGraph, 1);
+    repo->fd = -1;
+    repo->path = g_build_filename (graph->graph_dir, repo_id, NULL);
+    repo->nodes = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, g_free);
+    repo->incomplete = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+    if (g_file_get_contents (repo->path, &contents, &len, NULL)) {
+        if (len < GRAPH_MAGIC_LEN ||
+            memcmp (contents, GRAPH_MAGIC, GRAPH_MAGIC_LEN) != 0) {
+            seaf_warning ("Invalid commit graph file %s, removing it.\n",
+                          repo->path);
+            g_unlink (repo->path);
+        } else {
+            repo->file_exists = TRUE;
+
+            for (off = GRAPH_MAGIC_LEN;
+                 off + sizeof(GraphRecord) <= len;
+                 off += sizeof(GraphRecord))
+                load_record (repo, (GraphRecord *)(contents + off));
+
+            /* Keep new records aligned. */
+            if (off != len)
+                truncate_graph_file (repo, off);
+        }
+        g_free (contents);
+    }
+
+    g_hash_table_insert (graph->repos, g_strdup(repo_id), repo);
+
+    return repo;
+}
+
+static RepoGraph *
+get_repo_graph (CommitGraph *graph, const char *repo_id)
+{
+    RepoGraph *repo;
+
+    repo = g_hash_table_lookup (graph->repos, repo_id);
+    if (repo)
+        return repo;
+
+    return load_repo_graph (graph, repo_id);
+}
+
+static int
+write_records (RepoGraph *repo, const GraphRecord *recs, guint n)
+{
+    ssize_t size;
+
+    if (!repo->file_exists) {
+        if (writen (repo->fd, GRAPH_MAGIC, GRAPH_MAGIC_LEN) != GRAPH_MAGIC_LEN) {
+            seaf_warning ("Failed to write %s: %s.\n", repo->path, strerror(errno));
+            return -1;
+        }
+        repo->file_exists = TRUE;
+    }
+
+    size = (ssize_t)(n * sizeof(GraphRecord));
+    if (writen (repo->fd, recs, size) != size) {
+        seaf_warning ("Failed to write %s: %s.\n", repo->path, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+append_nodes (CommitGraph *graph, RepoGraph *repo, GPtrArray *nodes)
+{
+    GraphRecord *recs;
+    GraphNode *node;
+    guint i;
+    int j;
+    int ret;
+
+    if (nodes->len == 0)
+        return 0;
+
+    if (open_for_append (graph, repo) < 0)
+        return -1;
+
+    recs = g_new0 (GraphRecord, nodes->len);
+    for (i = 0; i < nodes->len; ++i) {
+        node = g_ptr_array_index (nodes, i);
+        hex_to_rawdata (node->id, recs[i].id, 20);
+        for (j = 0; j < node->n_parents; ++j)
+            hex_to_rawdata (node->parents[j]->id, recs[i].parents[j], 20);
+        recs[i].n_parents = (guint8)node->n_parents;
+        recs[i].generation = GUINT32_TO_BE (node->generation);
+        recs[i].ctime = GUINT64_TO_BE ((guint64)node->ctime);
+    }
+
+    ret = write_records (repo, recs, nodes->len);
+
+    g_free (recs);
+    return ret;
+}
+
+static void
+mark_incomplete (RepoGraph *repo, const char *id)
+{
+    g_hash_table_replace (repo->incomplete, g_strdup(id), GINT_TO_POINTER(1));
+}
+
+/*
+ * Called with graph->lock held. Loads @id and those of its ancestors that
+ * are not in the graph yet. The lock is released while commits are read
+ * from the store, so the graph may change meanwhile. Returns FALSE if some
+ * commit is missing from the store.
+ */
+static gboolean
+load_pending_commits (CommitGraph *graph, const char *repo_id, int version,
+                      const char *id, GHashTable *pending, GPtrArray *order)
+{
+    GQueue *to_load = g_queue_new ();
+    RepoGraph *repo;
+    SeafCommit *commit;
+    PendingCommit *pc;
+    char *cid;
+    gboolean ret = TRUE;
+
+    g_queue_push_tail (to_load, g_strdup(id));
+
+    while ((cid = g_queue_pop_head (to_load)) != NULL) {
+        repo = get_repo_graph (graph, repo_id);
+        if (g_hash_table_lookup (repo->nodes, cid) ||
+            g_hash_table_lookup (pending, cid)) {
+            g_free (cid);
+            continue;
+        }
+
+        if (g_hash_table_lookup (repo->incomplete, cid)) {
+            g_free (cid);
+            ret = FALSE;
+            break;
+        }
+
+        pthread_mutex_unlock (&graph->lock);
+        commit = seaf_commit_manager_get_commit (seaf->commit_mgr,
+                                                 repo_id, version, cid);
+        pthread_mutex_lock (&graph->lock);
+
+        if (!commit) {
+            seaf_debug ("Commit %s of repo %s is missing, "
+                        "history of %s is incomplete.\n",
+                        cid, repo_id, id);
+            mark_incomplete (get_repo_graph (graph, repo_id), cid);
+            g_free (cid);
+            ret = FALSE;
+            break;
+        }
+
+        pc = g_new0 (PendingCommit, 1);
+        memcpy (pc->id, commit->commit_id, 40);
+        if (commit->parent_id)
+            memcpy (pc->parents[pc->n_parents++], commit->parent_id, 40);
+        if (commit->second_parent_id)
+            memcpy (pc->parents[pc->n_parents++], commit->second_parent_id, 40);
+        pc->ctime = (gint64)commit->ctime;
+        seaf_commit_unref (commit);
+
+        g_hash_table_insert (pending, pc->id, pc);
+        g_ptr_array_add (order, pc);
+
+        if (pc->n_parents > 0)
+            g_queue_push_tail (to_load, g_strdup(pc->parents[0]));
+        if (pc->n_parents > 1)
+            g_queue_push_tail (to_load, g_strdup(pc->parents[1]));
+
+        g_free (cid);
+    }
+
+    while ((cid = g_queue_pop_head (to_load)) != NULL)
+        g_free (cid);
+    g_queue_free (to_load);
+
+    return ret;
+}
+
+/* Add pending commits to the graph, parents first. Commits whose parents
+ * were deleted meanwhile are left out.
+ */
+static void
+insert_pending_commits (RepoGraph *repo, GHashTable *pending, GPtrArray *order,
+                        GPtrArray *new_nodes)
+{
+    GPtrArray *stack = g_ptr_array_new ();
+    PendingCommit *pc, *top, *next;
+    GraphNode *parents[2];
+    gboolean dropped;
+    guint i;
+    int j;
+
+    for (i = 0; i < order->len; ++i) {
+        pc = g_ptr_array_index (order, i);
+        if (pc->dropped || g_hash_table_lookup (repo->nodes, pc->id))
+            continue;
+
+        g_ptr_array_add (stack, pc);
+        while (stack->len > 0) {
+            top = g_ptr_array_index (stack, stack->len - 1);
+
+            next = NULL;
+            dropped = FALSE;
+            for (j = 0; j < top->n_parents; ++j) {
+                if (!g_hash_table_lookup (repo->nodes, top->parents[j])) {
+                    next = g_hash_table_lookup (pending, top->parents[j]);
+                    if (!next || next->dropped) {
+                        next = NULL;
+                        dropped = TRUE;
+                    }
+                    break;
+                }
+            }
+            if (next) {
+                g_ptr_array_add (stack, next);
+                continue;
+            }
+
+            g_ptr_array_remove_index (stack, stack->len - 1);
+            if (dropped) {
+                top->dropped = TRUE;
+                continue;
+            }
+
+            lookup_parents (repo, top->parents, top->n_parents, parents);
+            g_ptr_array_add (new_nodes,
+                             add_node (repo, top->id, parents,
+                                       top->n_parents, top->ctime));
+        }
+    }
+
+    g_ptr_array_free (stack, TRUE);
+}
+
+/*
+ * Called with graph->lock held, which is released while commits are
+ * loaded. Adds @id and its history to the graph if needed. Returns FALSE
+ * if its history is incomplete. Nodes found before the call may have been
+ * dropped by then, so they have to be looked up again.
+ */
+static gboolean
+load_node (CommitGraph *graph, const char *repo_id, int version,
+           const char *id)
+{
+    RepoGraph *repo;
+    GHashTable *pending;
+    GPtrArray *order, *new_nodes;
+    gboolean ret = FALSE;
+    guint i;
+
+    repo = get_repo_graph (graph, repo_id);
+    if (g_hash_table_lookup (repo->nodes, id))
+        return TRUE;
+
+    if (g_hash_table_lookup (repo->incomplete, id))
+        return FALSE;
+
+    pending = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, g_free);
+    order = g_ptr_array_new ();
+
+    if (!load_pending_commits (graph, repo_id, version, id, pending, order)) {
+        /* Not all of them depend on the missing commit, but it's only a
+         * shortcut for failing later queries.
+         */
+        repo = get_repo_graph (graph, repo_id);
+        mark_incomplete (repo, id);
+        for (i = 0; i < order->len; ++i)
+            mark_incomplete (repo, ((PendingCommit *)g_ptr_array_index (order, i))->id);
+        goto out;
+    }
+
+    /* The repo graph may have been removed and loaded again. */
+    repo = get_repo_graph (graph, repo_id);
+
+    new_nodes = g_ptr_array_new ();
+    insert_pending_commits (repo, pending, order, new_nodes);
+    append_nodes (graph, repo, new_nodes);
+    g_ptr_array_free (new_nodes, TRUE);
+
+    ret = (g_hash_table_lookup (repo->nodes, id) != NULL);
+
+out:
+    g_ptr_array_free (order, TRUE);
+    g_hash_table_destroy (pending);
+    return ret;
+}
+
+void
+commit_graph_add_commit (CommitGraph *graph, SeafCommit *commit)
+{
+    RepoGraph *repo;
+    char parent_ids[2][41];
+    GraphNode *parents[2];
+    int n_parents = 0;
+    GPtrArray *nodes;
+
+    if (commit->parent_id)
+        memcpy (parent_ids[n_parents++], commit->parent_id, 41);
+    if (commit->second_parent_id)
+        memcpy (parent_ids[n_parents++], commit->second_parent_id, 41);
+
+    pthread_mutex_lock (&graph->lock);
+
+    repo = get_repo_graph (graph, commit->repo_id);
+    if (g_hash_table_lookup (repo->nodes, commit->commit_id) ||
+        !lookup_parents (repo, parent_ids, n_parents, parents))
+        goto out;
+
+    nodes = g_ptr_array_new ();
+    g_ptr_array_add (nodes, add_node (repo, commit->commit_id,
+                                      parents, n_parents,
+                                      (gint64)commit->ctime));
+    append_nodes (graph, repo, nodes);
+    g_ptr_array_free (nodes, TRUE);
+
+out:
+    pthread_mutex_unlock (&graph->lock);
+}
+
+void
+commit_graph_del_commit (CommitGraph *graph, const char *repo_id,
+                         const char *commit_id)
+{
+    RepoGraph *repo;
+    GraphNode *node;
+    GraphRecord rec;
+
+    pthread_mutex_lock (&graph->lock);
+
+    repo = get_repo_graph (graph, repo_id);
+    node = g_hash_table_lookup (repo->nodes, commit_id);
+    if (!node)
+        goto out;
+
+    remove_node (repo, node);
+
+    memset (&rec, 0, sizeof(rec));
+    hex_to_rawdata (commit_id, rec.id, 20);
+    rec.n_parents = GRAPH_DELETED;
+    if (open_for_append (graph, repo) == 0)
+        write_records (repo, &rec, 1);
+
+out:
+    pthread_mutex_unlock (&graph->lock);
+}
+
+void
+commit_graph_remove_store (CommitGraph *graph, const char *repo_id)
+{
+    char *path;
+
+    pthread_mutex_lock (&graph->lock);
+
+    g_hash_table_remove (graph->repos, repo_id);
+
+    path = g_build_filename (graph->graph_dir, repo_id, NULL);
+    if (g_file_test (path, G_FILE_TEST_EXISTS))
+        g_unlink (path);
+    g_free (path);
+
+    pthread_mutex_unlock (&graph->lock);
+}
+
+/* Queue of nodes to visit, highest generation first. */
+
+static void
+heap_push (GPtrArray *heap, GraphNode *node)
+{
+    guint i, parent;
+    gpointer tmp;
+
+    g_ptr_array_add (heap, node);
+
+    for (i = heap->len - 1; i > 0; i = parent) {
+        parent = (i - 1) / 2;
+        if (((GraphNode *)heap->pdata[parent])->generation >=
+            ((GraphNode *)heap->pdata[i])->generation)
+            break;
+        tmp = heap->pdata[parent];
+        heap->pdata[parent] = heap->pdata[i];
+        heap->pdata[i] = tmp;
+    }
+}
+
+static GraphNode *
+heap_pop (GPtrArray *heap)
+{
+    GraphNode *top = heap->pdata[0];
+    guint i, child;
+    gpointer tmp;
+
+    heap->pdata[0] = heap->pdata[heap->len - 1];
+    g_ptr_array_remove_index (heap, heap->len - 1);
+
+    for (i = 0; (child = 2 * i + 1) < heap->len; i = child) {
+        if (child + 1 < heap->len &&
+            ((GraphNode *)heap->pdata[child + 1])->generation >
+            ((GraphNode *)heap->pdata[child])->generation)
+            ++child;
+        if (((GraphNode *)heap->pdata[i])->generation >=
+            ((GraphNode *)heap->pdata[child])->generation)
+            break;
+        tmp = heap->pdata[child];
+        heap->pdata[child] = heap->pdata[i];
+        heap->pdata[i] = tmp;
+    }
+
+    return top;
+}
+
+enum {
+    REACHED_FROM_ONE = 1 << 0,
+    REACHED_FROM_TWOS = 1 << 1,
+    /* Ancestor of a merge base found already. */
+    STALE = 1 << 2,
+};
+
+typedef struct WalkState {
+    guint flags;
+    gboolean queued;
+} WalkState;
+
+typedef struct MergeWalk {
+    GHashTable *states;         /* GraphNode -> WalkState */
+    GPtrArray *heap;
+    /* Queued nodes that are not stale. The walk ends when there are none. */
+    int n_active;
+} MergeWalk;
+
+static void
+walk_mark (MergeWalk *walk, GraphNode *node, guint flags)
+{
+    WalkState *state;
+    gboolean was_stale;
+
+    state = g_hash_table_lookup (walk->states, node);
+    if (!state) {
+        state = g_new0 (WalkState, 1);
+        g_hash_table_insert (walk->states, node, state);
+    }
+
+    if ((state->flags & flags) == flags)
+        return;
+
+    was_stale = (state->flags & STALE) != 0;
+    state->flags |= flags;
+
+    if (!state->queued) {
+        state->queued = TRUE;
+        heap_push (walk->heap, node);
+        if (!(state->flags & STALE))
+            ++(walk->n_active);
+    } else if (!was_stale && (state->flags & STALE)) {
+        --(walk->n_active);
+    }
+}
+
+static gint
+compare_node_by_time (gconstpointer a, gconstpointer b)
+{
+    const GraphNode *node_a = a;
+    const GraphNode *node_b = b;
+
+    /* Latest commit comes first in the list. */
+    if (node_a->ctime != node_b->ctime)
+        return node_a->ctime > node_b->ctime ? -1 : 1;
+    return strcmp (node_a->id, node_b->id);
+}
+
+/*
+ * Nodes are visited in decreasing generation order, so every descendant
+ * of a node is visited before it. A node reached from both sides is a merge
+ * base, and its ancestors are marked stale before they are visited, so the
+ * merge bases found are independent of each other.
+ */
+static GList *
+find_merge_bases (GraphNode *one, int n, GraphNode **twos)
+{
+    MergeWalk walk;
+    WalkState *state;
+    GraphNode *node;
+    GList *result = NULL;
+    guint flags;
+    int i;
+
+    for (i = 0; i < n; ++i) {
+        if (twos[i] == one)
+            return g_list_prepend (NULL, one);
+    }
+
+    walk.states = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                         NULL, g_free);
+    walk.heap = g_ptr_array_new ();
+    walk.n_active = 0;
+
+    walk_mark (&walk, one, REACHED_FROM_ONE);
+    for (i = 0; i < n; ++i)
+        walk_mark (&walk, twos[i], REACHED_FROM_TWOS);
+
+    while (walk.n_active > 0) {
+        node = heap_pop (walk.heap);
+        state = g_hash_table_lookup (walk.states, node);
+        state->queued = FALSE;
+
+        flags = state->flags;
+        if (!(flags & STALE))
+            --(walk.n_active);
+
+        if (flags == (REACHED_FROM_ONE | REACHED_FROM_TWOS)) {
+            result = g_list_prepend (result, node);
+            flags |= STALE;
+        }
+
+        for (i = 0; i < node->n_parents; ++i)
+            walk_mark (&walk, node->parents[i], flags);
+    }
+
+    g_ptr_array_free (walk.heap, TRUE);
+    g_hash_table_destroy (walk.states);
+
+    return g_list_sort (result, compare_node_by_time);
+}
+
+int
+commit_graph_merge_bases (CommitGraph *graph,
+                          const char *repo_id,
+                          int version,
+                          const char *one,
+                          int n,
+                          char **twos,
+                          GList **bases)
+{
+    RepoGraph *repo;
+    GraphNode *one_node, **two_nodes;
+    GList *result, *ptr;
+    int i;
+    int ret = 0;
+
+    *bases = NULL;
+    two_nodes = g_new0 (GraphNode *, n);
+
+    pthread_mutex_lock (&graph->lock);
+
+    if (!load_node (graph, repo_id, version, one)) {
+        ret = -1;
+        goto out;
+    }
+    for (i = 0; i < n; ++i) {
+        if (!load_node (graph, repo_id, version, twos[i])) {
+            ret = -1;
+            goto out;
+        }
+    }
+
+    repo = get_repo_graph (graph, repo_id);
+    one_node = g_hash_table_lookup (repo->nodes, one);
+    if (!one_node) {
+        ret = -1;
+        goto out;
+    }
+    for (i = 0; i < n; ++i) {
+        two_nodes[i] = g_hash_table_lookup (repo->nodes, twos[i]);
+        if (!two_nodes[i]) {
+            ret = -1;
+            goto out;
+        }
+    }
+
+    result = find_merge_bases (one_node, n, two_nodes);
+    for (ptr = result; ptr; ptr = ptr->next)
+        *bases = g_list_prepend (*bases, g_strdup(((GraphNode *)ptr->data)->id));
+    *bases = g_list_reverse (*bases);
+    g_list_free (result);
+
+out:
+    pthread_mutex_unlock (&graph->lock);
+    g_free (two_nodes);
+    return ret;
+}
+
+int
+commit_graph_is_ancestor (CommitGraph *graph,
+                          const char *repo_id,
+                          int version,
+                          const char *ancestor,
+                          const char *commit_id,
+                          gboolean *is_ancestor)
+{
+    RepoGraph *repo;
+    GraphNode *target, *node, *parent;
+    GPtrArray *stack;
+    GHashTable *visited;
+    int i;
+    int ret = 0;
+
+    *is_ancestor = FALSE;
+
+    pthread_mutex_lock (&graph->lock);
+
+    if (!load_node (graph, repo_id, version, ancestor) ||
+        !load_node (graph, repo_id, version, commit_id)) {
+        ret = -1;
+        goto out;
+    }
+
+    repo = get_repo_graph (graph, repo_id);
+    target = g_hash_table_lookup (repo->nodes, ancestor);
+    node = g_hash_table_lookup (repo->nodes, commit_id);
+    if (!target || !node) {
+        ret = -1;
+        goto out;
+    }
+
+    if (node == target) {
+        *is_ancestor = TRUE;
+        goto out;
+    }
+
+    stack = g_ptr_array_new ();
+    visited = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+    g_ptr_array_add (stack, node);
+    while (stack->len > 0 && !*is_ancestor) {
+        node = g_ptr_array_index (stack, stack->len - 1);
+        g_ptr_array_remove_index (stack, stack->len - 1);
+
+        for (i = 0; i < node->n_parents; ++i) {
+            parent = node->parents[i];
+            if (parent == target) {
+                *is_ancestor = TRUE;
+                break;
+            }
+            /* Only nodes of higher generation can lead to the target. */
+            if (parent->generation <= target->generation ||
+                g_hash_table_lookup (visited, parent))
+                continue;
+            g_hash_table_insert (visited, parent, parent);
+            g_ptr_array_add (stack, parent);
+        }
+    }
+
+    g_hash_table_destroy (visited);
+    g_ptr_array_free (stack, TRUE);
+
+out:
+    pthread_mutex_unlock (&graph->lock);
+    return ret;
+}
@@ -0,0 +1,68 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SEAF_COMMIT_GRAPH_H
+#define SEAF_COMMIT_GRAPH_H
+
+#include <glib.h>
+
+/*
+ * Parents, generation number and ctime of the commits of each repo, kept in
+ * memory and in <seaf_dir>/commit-graph/<repo_id>, so that ancestry queries
+ * don't have to load commit objects.
+ *
+ * The generation number of a commit is one more than the largest one of its
+ * parents. An ancestor always has a smaller generation number than its
+ * descendants, which lets the queries below stop walking early.
+ *
+ * Commits that are not in the graph yet are added when first queried, along
+ * with their history. If part of the history is missing from the commit
+ * store, the queries return -1 and the caller has to fall back to walking
+ * commit objects.
+ */
+
+struct _SeafCommit;
+
+typedef struct CommitGraph CommitGraph;
+
+CommitGraph *
+commit_graph_new (const char *seaf_dir);
+
+/* Record a new commit whose parents are already in the graph. */
+void
+commit_graph_add_commit (CommitGraph *graph, struct _SeafCommit *commit);
+
+/* Forget a deleted commit. Its descendants are dropped as well and added
+ * again when queried, so they fail if the history is really needed.
+ */
+void
+commit_graph_del_commit (CommitGraph *graph, const char *repo_id,
+                         const char *commit_id);
+
+/* Forget the graph of a store, e.g. when its commits are removed. */
+void
+commit_graph_remove_store (CommitGraph *graph, const char *repo_id);
+
+/*
+ * Common ancestors of @one and some commit in @twos, none of which is an
+ * ancestor of another. Sets @bases to a list of commit ids, latest commit
+ * first. The caller should free the list with g_list_free_full (.., g_free).
+ */
+int
+commit_graph_merge_bases (CommitGraph *graph,
+                          const char *repo_id,
+                          int version,
+                          const char *one,
+                          int n,
+                          char **twos,
+                          GList **bases);
+
+/* Sets @is_ancestor to whether @ancestor is reachable from @commit_id. */
+int
+commit_graph_is_ancestor (CommitGraph *graph,
+                          const char *repo_id,
+                          int version,
+                          const char *ancestor,
+                          const char *commit_id,
+                          gboolean *is_ancestor);
+
+#endif
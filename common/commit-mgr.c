@@ -5,18 +5,35 @@
 #include "log.h"
 
 #include <jansson.h>
+#include <pthread.h>
 
 #include "utils.h"
+#include "sha1-util.h"
 #include "db.h"
 #include "searpc-utils.h"
 
 #include "seafile-session.h"
 #include "commit-mgr.h"
+#include "commit-graph.h"
 
 #define MAX_TIME_SKEW 259200    /* 3 days */
 
+/* Max number of parsed commits kept in memory. */
+#define MAX_CACHED_COMMITS 2000
+
+typedef struct CommitCacheEntry {
+    char *key;
+    SeafCommit *commit;
+    GList *link;                /* node in the lru queue */
+} CommitCacheEntry;
+
 struct _SeafCommitManagerPriv {
-    int dummy;
+    /* LRU cache of loaded commits, keyed by repo id and commit id.
+     * The cache holds a reference to each commit.
+     */
+    GHashTable *commit_cache;
+    GQueue *commit_lru;         /* most recently used first */
+    pthread_mutex_t cache_lock;
 };
 
 static SeafCommit *
@@ -38,25 +55,24 @@ commit_from_json_object (const char *id, json_t *object);
 
 static void compute_commit_id (SeafCommit* commit)
 {
-    GChecksum *ctx = g_checksum_new(G_CHECKSUM_SHA1);
+    SeafSHA1Ctx ctx;
     uint8_t sha1[20];    
     gint64 ctime_n;
 
-    g_checksum_update (ctx, (guchar *)commit->root_id, 41);
-    g_checksum_update (ctx, (guchar *)commit->creator_id, 41);
+    seaf_sha1_init (&ctx);
+    seaf_sha1_update (&ctx, commit->root_id, 41);
+    seaf_sha1_update (&ctx, commit->creator_id, 41);
     if (commit->creator_name)
-        g_checksum_update (ctx, (guchar *)commit->creator_name, strlen(commit->creator_name)+1);
-    g_checksum_update (ctx, (guchar *)commit->desc, strlen(commit->desc)+1);
+        seaf_sha1_update (&ctx, commit->creator_name, strlen(commit->creator_name)+1);
+    seaf_sha1_update (&ctx, commit->desc, strlen(commit->desc)+1);
 
     /* convert to network byte order */
     ctime_n = hton64 (commit->ctime);
-    g_checksum_update (ctx, (guchar *)&ctime_n, sizeof(ctime_n));
+    seaf_sha1_update (&ctx, &ctime_n, sizeof(ctime_n));
 
-    gsize len = 20;
-    g_checksum_get_digest (ctx, sha1, &len);
+    seaf_sha1_final (&ctx, sha1);
     
     rawdata_to_hex (sha1, commit->commit_id, 20);
-    g_checksum_free (ctx);
 }
 
 SeafCommit*
@@ -168,10 +184,13 @@ seaf_commit_free (SeafCommit *commit)
     g_free (commit);
 }
 
+/* Commits in the cache are shared between threads, so the ref count
+ * must be updated atomically.
+ */
 void
 seaf_commit_ref (SeafCommit *commit)
 {
-    commit->ref++;
+    g_atomic_int_inc (&commit->ref);
 }
 
 void
@@ -180,7 +199,7 @@ seaf_commit_unref (SeafCommit *commit)
     if (!commit)
         return;
 
-    if (--commit->ref <= 0)
+    if (g_atomic_int_dec_and_test (&commit->ref))
         seaf_commit_free (commit);
 }
 
@@ -190,8 +209,12 @@ seaf_commit_manager_new (SeafileSession *seaf)
     SeafCommitManager *mgr = g_new0 (SeafCommitManager, 1);
 
     mgr->priv = g_new0 (SeafCommitManagerPriv, 1);
+    mgr->priv->commit_cache = g_hash_table_new (g_str_hash, g_str_equal);
+    mgr->priv->commit_lru = g_queue_new ();
+    pthread_mutex_init (&mgr->priv->cache_lock, NULL);
     mgr->seaf = seaf;
     mgr->obj_store = seaf_obj_store_new (mgr->seaf, "commits");
+    mgr->graph = commit_graph_new (seaf->seaf_dir);
 
     return mgr;
 }
@@ -223,23 +246,124 @@ seaf_commit_manager_init (SeafCommitManager *mgr)
     return 0;
 }
 
-#if 0
-inline static void
+/* The same commit id may appear in several repos, with different repo
+ * fields, so the repo id is part of the key.
+ */
+static char *
+commit_cache_key (const char *repo_id, const char *commit_id)
+{
+    return g_strconcat (repo_id, commit_id, NULL);
+}
+
+static void
+commit_cache_entry_free (CommitCacheEntry *entry)
+{
+    seaf_commit_unref (entry->commit);
+    g_free (entry->key);
+    g_free (entry);
+}
+
+/* Returns a new reference to the cached commit, or NULL. */
+static SeafCommit *
+lookup_commit_in_cache (SeafCommitManager *mgr,
+                        const char *repo_id,
+                        const char *commit_id)
+{
+    SeafCommitManagerPriv *priv = mgr->priv;
+    CommitCacheEntry *entry;
+    SeafCommit *commit = NULL;
+    char *key = commit_cache_key (repo_id, commit_id);
+
+    pthread_mutex_lock (&priv->cache_lock);
+    entry = g_hash_table_lookup (priv->commit_cache, key);
+    if (entry) {
+        g_queue_unlink (priv->commit_lru, entry->link);
+        g_queue_push_head_link (priv->commit_lru, entry->link);
+        commit = entry->commit;
+        seaf_commit_ref (commit);
+    }
+    pthread_mutex_unlock (&priv->cache_lock);
+
+    g_free (key);
+    return commit;
+}
+
+static void
 add_commit_to_cache (SeafCommitManager *mgr, SeafCommit *commit)
 {
-    g_hash_table_insert (mgr->priv->commit_cache,
-                         g_strdup(commit->commit_id),
-                         commit);
+    SeafCommitManagerPriv *priv = mgr->priv;
+    CommitCacheEntry *entry, *old;
+    char *key = commit_cache_key (commit->repo_id, commit->commit_id);
+
+    pthread_mutex_lock (&priv->cache_lock);
+
+    if (g_hash_table_lookup (priv->commit_cache, key)) {
+        pthread_mutex_unlock (&priv->cache_lock);
+        g_free (key);
+        return;
+    }
+
+    entry = g_new0 (CommitCacheEntry, 1);
+    entry->key = key;
+    entry->commit = commit;
     seaf_commit_ref (commit);
+
+    g_queue_push_head (priv->commit_lru, entry);
+    entry->link = priv->commit_lru->head;
+    g_hash_table_insert (priv->commit_cache, entry->key, entry);
+
+    while (g_hash_table_size (priv->commit_cache) > MAX_CACHED_COMMITS) {
+        old = g_queue_pop_tail (priv->commit_lru);
+        g_hash_table_remove (priv->commit_cache, old->key);
+        commit_cache_entry_free (old);
+    }
+
+    pthread_mutex_unlock (&priv->cache_lock);
 }
 
-inline static void
-remove_commit_from_cache (SeafCommitManager *mgr, SeafCommit *commit)
+static void
+remove_store_from_cache (SeafCommitManager *mgr, const char *repo_id)
 {
-    g_hash_table_remove (mgr->priv->commit_cache, commit->commit_id);
-    seaf_commit_unref (commit);
+    SeafCommitManagerPriv *priv = mgr->priv;
+    CommitCacheEntry *entry;
+    GList *ptr, *next, *removed = NULL;
+
+    pthread_mutex_lock (&priv->cache_lock);
+    for (ptr = priv->commit_lru->head; ptr; ptr = next) {
+        next = ptr->next;
+        entry = ptr->data;
+        if (strncmp (entry->key, repo_id, 36) != 0)
+            continue;
+        g_hash_table_remove (priv->commit_cache, entry->key);
+        g_queue_delete_link (priv->commit_lru, ptr);
+        removed = g_list_prepend (removed, entry);
+    }
+    pthread_mutex_unlock (&priv->cache_lock);
+
+    g_list_free_full (removed, (GDestroyNotify)commit_cache_entry_free);
+}
+
+static void
+remove_commit_from_cache (SeafCommitManager *mgr,
+                          const char *repo_id,
+                          const char *commit_id)
+{
+    SeafCommitManagerPriv *priv = mgr->priv;
+    CommitCacheEntry *entry;
+    char *key = commit_cache_key (repo_id, commit_id);
+
+    pthread_mutex_lock (&priv->cache_lock);
+    entry = g_hash_table_lookup (priv->commit_cache, key);
+    if (entry) {
+        g_hash_table_remove (priv->commit_cache, key);
+        g_queue_delete_link (priv->commit_lru, entry->link);
+    }
+    pthread_mutex_unlock (&priv->cache_lock);
+
+    if (entry)
+        commit_cache_entry_free (entry);
+    g_free (key);
 }
-#endif
 
 int
 seaf_commit_manager_add_commit (SeafCommitManager *mgr,
@@ -247,9 +371,13 @@ seaf_commit_manager_add_commit (SeafCommitManager *mgr,
 {
     int ret;
 
-    /* add_commit_to_cache (mgr, commit); */
+    /* New commits are not cached, since the caller may still modify them.
+     * They are cached when loaded back.
+     */
     if ((ret = save_commit (mgr, commit->repo_id, commit->version, commit)) < 0)
         return -1;
+
+    commit_graph_add_commit (mgr->graph, commit);
     
     return 0;
 }
@@ -262,20 +390,8 @@ seaf_commit_manager_del_commit (SeafCommitManager *mgr,
 {
     g_return_if_fail (id != NULL);
 
-#if 0
-    commit = g_hash_table_lookup(mgr->priv->commit_cache, id);
-    if (!commit)
-        goto delete;
-
-    /*
-     * Catch ref count bug here. We have bug in commit ref, the
-     * following assert can't pass. TODO: fix the commit ref bug
-     */
-    /* g_assert (commit->ref <= 1); */
-    remove_commit_from_cache (mgr, commit);
-
-delete:
-#endif
+    remove_commit_from_cache (mgr, repo_id, id);
+    commit_graph_del_commit (mgr->graph, repo_id, id);
 
     delete_commit (mgr, repo_id, version, id);
 }
@@ -288,19 +404,15 @@ seaf_commit_manager_get_commit (SeafCommitManager *mgr,
 {
     SeafCommit *commit;
 
-#if 0
-    commit = g_hash_table_lookup (mgr->priv->commit_cache, id);
-    if (commit != NULL) {
-        seaf_commit_ref (commit);
+    commit = lookup_commit_in_cache (mgr, repo_id, id);
+    if (commit != NULL)
         return commit;
-    }
-#endif
 
     commit = load_commit (mgr, repo_id, version, id);
     if (!commit)
         return NULL;
 
-    /* add_commit_to_cache (mgr, commit); */
+    add_commit_to_cache (mgr, commit);
 
     return commit;
 }
@@ -577,18 +689,141 @@ seaf_commit_manager_traverse_commit_tree_truncated (SeafCommitManager *mgr,
                                         func, data, skip_errors, TRUE);
 }
 
+struct _SeafCommitIter {
+    SeafCommitManager *mgr;
+    char *repo_id;
+    int version;
+    /* Commits not returned yet whose children have all been, the latest
+     * first. */
+    GList *pending;
+    /* Ids of the pending commits. */
+    GHashTable *pending_ids;
+};
+
+static gint
+compare_commit_for_iter (gconstpointer a, gconstpointer b, gpointer unused)
+{
+    const SeafCommit *commit_a = a;
+    const SeafCommit *commit_b = b;
+
+    if (commit_a->ctime != commit_b->ctime)
+        return commit_a->ctime > commit_b->ctime ? -1 : 1;
+    /* Keep the order stable across pages. */
+    return strcmp (commit_a->commit_id, commit_b->commit_id);
+}
+
+static void
+iter_add_pending (SeafCommitIter *iter, const char *commit_id)
+{
+    SeafCommit *commit;
+
+    if (g_hash_table_lookup (iter->pending_ids, commit_id) != NULL)
+        return;
+
+    /* History on the client may be truncated, stop at missing commits. */
+    commit = seaf_commit_manager_get_commit (iter->mgr, iter->repo_id,
+                                             iter->version, commit_id);
+    if (!commit)
+        return;
+
+    iter->pending = g_list_insert_sorted_with_data (iter->pending, commit,
+                                                    compare_commit_for_iter,
+                                                    NULL);
+    g_hash_table_add (iter->pending_ids, commit->commit_id);
+}
+
+SeafCommitIter *
+seaf_commit_iter_new (SeafCommitManager *mgr,
+                      const char *repo_id,
+                      int version,
+                      const char *cursor)
+{
+    SeafCommitIter *iter;
+    char **ids, **ptr;
+
+    ids = g_strsplit (cursor, " ", -1);
+    for (ptr = ids; *ptr; ++ptr) {
+        if (!is_object_id_valid (*ptr)) {
+            seaf_warning ("Invalid commit cursor %s.\n", cursor);
+            g_strfreev (ids);
+            return NULL;
+        }
+    }
+
+    iter = g_new0 (SeafCommitIter, 1);
+    iter->mgr = mgr;
+    iter->repo_id = g_strdup (repo_id);
+    iter->version = version;
+    /* Keys point into the pending commits. */
+    iter->pending_ids = g_hash_table_new (g_str_hash, g_str_equal);
+
+    for (ptr = ids; *ptr; ++ptr)
+        iter_add_pending (iter, *ptr);
+    g_strfreev (ids);
+
+    return iter;
+}
+
+SeafCommit *
+seaf_commit_iter_next (SeafCommitIter *iter)
+{
+    SeafCommit *commit;
+
+    if (!iter->pending)
+        return NULL;
+
+    commit = iter->pending->data;
+    iter->pending = g_list_delete_link (iter->pending, iter->pending);
+    g_hash_table_remove (iter->pending_ids, commit->commit_id);
+
+    if (commit->parent_id)
+        iter_add_pending (iter, commit->parent_id);
+    if (commit->second_parent_id)
+        iter_add_pending (iter, commit->second_parent_id);
+
+    return commit;
+}
+
+char *
+seaf_commit_iter_get_cursor (SeafCommitIter *iter)
+{
+    GString *buf;
+    GList *ptr;
+    SeafCommit *commit;
+
+    if (!iter->pending)
+        return NULL;
+
+    buf = g_string_new (NULL);
+    for (ptr = iter->pending; ptr; ptr = ptr->next) {
+        commit = ptr->data;
+        if (buf->len > 0)
+            g_string_append_c (buf, ' ');
+        g_string_append (buf, commit->commit_id);
+    }
+
+    return g_string_free (buf, FALSE);
+}
+
+void
+seaf_commit_iter_free (SeafCommitIter *iter)
+{
+    if (!iter)
+        return;
+
+    g_hash_table_destroy (iter->pending_ids);
+    g_list_free_full (iter->pending, (GDestroyNotify)seaf_commit_unref);
+    g_free (iter->repo_id);
+    g_free (iter);
+}
+
 gboolean
 seaf_commit_manager_commit_exists (SeafCommitManager *mgr,
                                    const char *repo_id,
                                    int version,
                                    const char *id)
 {
-#if 0
-    commit = g_hash_table_lookup (mgr->priv->commit_cache, id);
-    if (commit != NULL)
-        return TRUE;
-#endif
-
+    /* Don't consult the cache, the store may have been removed since. */
     return seaf_obj_store_obj_exists (mgr->obj_store, repo_id, version, id);
 }
 
@@ -908,5 +1143,16 @@ int
 seaf_commit_manager_remove_store (SeafCommitManager *mgr,
                                   const char *store_id)
 {
+    remove_store_from_cache (mgr, store_id);
+    commit_graph_remove_store (mgr->graph, store_id);
     return seaf_obj_store_remove_store (mgr->obj_store, store_id);
 }
+
+void
+seaf_commit_manager_release_store (SeafCommitManager *mgr,
+                                   const char *store_id)
+{
+    remove_store_from_cache (mgr, store_id);
+    commit_graph_remove_store (mgr->graph, store_id);
+    seaf_obj_store_release_store (mgr->obj_store, store_id);
+}
@@ -88,6 +88,7 @@ struct _SeafCommitManager {
 
     sqlite3    *db;
     struct SeafObjStore *obj_store;
+    struct CommitGraph *graph;
 
     SeafCommitManagerPriv *priv;
 };
@@ -183,6 +184,39 @@ seaf_commit_manager_traverse_commit_tree_with_limit (SeafCommitManager *mgr,
                                                      void *data,
                                                      gboolean skip_errors);
 
+/*
+ * Walks the commits DAG lazily, in the same order as
+ * seaf_commit_manager_traverse_commit_tree(). Only the commits at the
+ * boundary of the part already returned are kept in memory, so long
+ * histories can be read page by page. Missing parents end the walk down
+ * that way, like the truncated traverse.
+ */
+typedef struct _SeafCommitIter SeafCommitIter;
+
+/*
+ * @cursor is a head commit id or a cursor returned by
+ * seaf_commit_iter_get_cursor(). Returns NULL if it's malformed.
+ */
+SeafCommitIter *
+seaf_commit_iter_new (SeafCommitManager *mgr,
+                      const char *repo_id,
+                      int version,
+                      const char *cursor);
+
+/* Returns the next commit, to be unref'ed by the caller, or NULL at the end. */
+SeafCommit *
+seaf_commit_iter_next (SeafCommitIter *iter);
+
+/*
+ * Returns the position of @iter to resume from with a new iterator later,
+ * or NULL at the end.
+ */
+char *
+seaf_commit_iter_get_cursor (SeafCommitIter *iter);
+
+void
+seaf_commit_iter_free (SeafCommitIter *iter);
+
 gboolean
 seaf_commit_manager_commit_exists (SeafCommitManager *mgr,
                                    const char *repo_id,
@@ -193,4 +227,10 @@ int
 seaf_commit_manager_remove_store (SeafCommitManager *mgr,
                                   const char *store_id);
 
+/* Drop cached commits and backend state of a store whose directory is
+ * about to be moved away. */
+void
+seaf_commit_manager_release_store (SeafCommitManager *mgr,
+                                   const char *store_id);
+
 #endif
@@ -1,7 +1,12 @@
 #include "common.h"
+
+#include <pthread.h>
+
 #include "diff-simple.h"
 #include "utils.h"
 #include "log.h"
+#include "metrics.h"
+#include "trace.h"
 
 DiffEntry *
 diff_entry_new (char type, char status, unsigned char *sha1, const char *name)
@@ -66,6 +71,24 @@ dirent_same (SeafDirent *denta, SeafDirent *dentb)
 	    denta->mtime == dentb->mtime);
 }
 
+static int
+filter_dent_path (DiffOptions *opt, const char *basedir, SeafDirent *dents[],
+                  gboolean is_dir)
+{
+    SeafDirent *dent = NULL;
+    char *path;
+    int i, ret;
+
+    for (i = 0; !dent; ++i)
+        dent = dents[i];
+
+    path = g_strconcat (basedir, dent->name, NULL);
+    ret = opt->path_filter (path, is_dir, opt->filter_data);
+    g_free (path);
+
+    return ret;
+}
+
 static int
 diff_files (int n, SeafDirent *dents[], const char *basedir, DiffOptions *opt)
 {
@@ -83,15 +106,309 @@ diff_files (int n, SeafDirent *dents[], const char *basedir, DiffOptions *opt)
     if (n_files == 0)
         return 0;
 
+    if (opt->path_filter &&
+        filter_dent_path (opt, basedir, files, FALSE) == DIFF_PATH_SKIP)
+        return 0;
+
     return opt->file_cb (n, basedir, files, opt->data);
 }
 
+/*
+ * Sub-directories that differ are loaded ahead of the walk by a pool of
+ * threads, since reading and parsing dir objects is most of the cost of
+ * diffing large trees. The comparison and the callbacks stay on the calling
+ * thread, in the same order as before, so callbacks don't have to be
+ * thread-safe and the results don't change.
+ *
+ * The directories needed next by the depth-first walk are usually the
+ * deepest ones queued, so the pool runs those first. If the walk reaches a
+ * directory that no thread has started on yet, it loads it by itself.
+ */
+#define DIFF_PREFETCH_MAX_THREADS 8
+/* Max number of sub-directories of one directory that are loaded ahead. */
+#define DIFF_PREFETCH_PER_DIR 64
+
+enum {
+    DIR_LOAD_QUEUED = 0,
+    DIR_LOAD_RUNNING,
+    DIR_LOAD_DONE,
+};
+
+typedef struct DirLoad {
+    char store_id[37];
+    int version;
+    char dir_id[41];
+    int depth;
+    guint seq;
+    /* The entry in the parent dir that the walk looks the load up by. */
+    SeafDirent *dent;
+
+    int state;
+    /* Set when the walk doesn't wait for the load any more. */
+    gboolean taken;
+    SeafDir *dir;
+    /* One for the pool and one for the walk. */
+    int ref;
+} DirLoad;
+
+static GThreadPool *prefetch_pool;
+static pthread_once_t prefetch_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetch_cond = PTHREAD_COND_INITIALIZER;
+static guint prefetch_seq;
+
+/* Called with prefetch_lock held. */
+static void
+dir_load_unref (DirLoad *load)
+{
+    if (--(load->ref) == 0) {
+        seaf_dir_free (load->dir);
+        g_free (load);
+    }
+}
+
+static void
+dir_load_worker (gpointer vload, gpointer user_data)
+{
+    DirLoad *load = vload;
+    SeafDir *dir;
+
+    pthread_mutex_lock (&prefetch_lock);
+    if (load->taken) {
+        dir_load_unref (load);
+        pthread_mutex_unlock (&prefetch_lock);
+        return;
+    }
+    load->state = DIR_LOAD_RUNNING;
+    pthread_mutex_unlock (&prefetch_lock);
+
+    dir = seaf_fs_manager_get_seafdir (seaf->fs_mgr,
+                                       load->store_id,
+                                       load->version,
+                                       load->dir_id);
+
+    pthread_mutex_lock (&prefetch_lock);
+    if (load->taken)
+        seaf_dir_free (dir);
+    else
+        load->dir = dir;
+    load->state = DIR_LOAD_DONE;
+    pthread_cond_broadcast (&prefetch_cond);
+    dir_load_unref (load);
+    pthread_mutex_unlock (&prefetch_lock);
+}
+
+/* Deeper first, then in the order they were queued. */
+static gint
+compare_dir_loads (gconstpointer a, gconstpointer b, gpointer user_data)
+{
+    const DirLoad *load_a = a, *load_b = b;
+
+    if (load_a->depth != load_b->depth)
+        return load_b->depth - load_a->depth;
+    if (load_a->seq != load_b->seq)
+        return load_a->seq < load_b->seq ? -1 : 1;
+    return 0;
+}
+
+static void
+prefetch_pool_init ()
+{
+    int n_threads = CLAMP (seaf_util_get_num_cores (),
+                           2, DIFF_PREFETCH_MAX_THREADS);
+
+    prefetch_pool = g_thread_pool_new (dir_load_worker, NULL,
+                                       n_threads, FALSE, NULL);
+    g_thread_pool_set_sort_function (prefetch_pool, compare_dir_loads, NULL);
+}
+
+/* Returns the loaded dir, loading it on this thread if no thread has
+ * started on it yet. Returns NULL if the dir can't be loaded.
+ */
+static SeafDir *
+dir_load_take (DirLoad *load)
+{
+    SeafDir *dir;
+
+    pthread_mutex_lock (&prefetch_lock);
+
+    if (load->state == DIR_LOAD_QUEUED) {
+        /* The pool will skip it. */
+        load->taken = TRUE;
+        pthread_mutex_unlock (&prefetch_lock);
+        dir = seaf_fs_manager_get_seafdir (seaf->fs_mgr,
+                                           load->store_id,
+                                           load->version,
+                                           load->dir_id);
+        pthread_mutex_lock (&prefetch_lock);
+    } else {
+        while (load->state != DIR_LOAD_DONE)
+            pthread_cond_wait (&prefetch_cond, &prefetch_lock);
+        dir = load->dir;
+        load->dir = NULL;
+    }
+
+    dir_load_unref (load);
+
+    pthread_mutex_unlock (&prefetch_lock);
+
+    return dir;
+}
+
+static void
+dir_load_abandon (DirLoad *load)
+{
+    pthread_mutex_lock (&prefetch_lock);
+    load->taken = TRUE;
+    dir_load_unref (load);
+    pthread_mutex_unlock (&prefetch_lock);
+}
+
+static void
+abandon_dir_loads (GQueue *loads)
+{
+    DirLoad *load;
+
+    while ((load = g_queue_pop_head (loads)) != NULL)
+        dir_load_abandon (load);
+}
+
+/* Sets @dents to the next set of entries with the same name, skipping the
+ * ones that are the same in all trees. Returns FALSE at the end.
+ */
+static gboolean
+next_diff_dents (int n, GList *ptrs[], SeafDirent *dents[])
+{
+    SeafDirent *dent;
+    char *first_name;
+    gboolean done;
+    int i;
+
+    while (1) {
+        first_name = NULL;
+        memset (dents, 0, sizeof(dents[0])*n);
+        done = TRUE;
+
+        /* Find the "largest" name, assuming dirents are sorted. */
+        for (i = 0; i < n; ++i) {
+            if (ptrs[i] != NULL) {
+                done = FALSE;
+                dent = ptrs[i]->data;
+                if (!first_name)
+                    first_name = dent->name;
+                else if (strcmp(dent->name, first_name) > 0)
+                    first_name = dent->name;
+            }
+        }
+
+        if (done)
+            return FALSE;
+
+        /*
+         * Setup dir entries for all names that equal to first_name
+         */
+        for (i = 0; i < n; ++i) {
+            if (ptrs[i] != NULL) {
+                dent = ptrs[i]->data;
+                if (strcmp(first_name, dent->name) == 0) {
+                    dents[i] = dent;
+                    ptrs[i] = ptrs[i]->next;
+                }
+            }
+        }
+
+        if (n == 2 && dents[0] && dents[1] && dirent_same(dents[0], dents[1]))
+            continue;
+
+        if (n == 3 && dents[0] && dents[1] && dents[2] &&
+            dirent_same(dents[0], dents[1]) && dirent_same(dents[0], dents[2]))
+            continue;
+
+        return TRUE;
+    }
+}
+
+/* Queue loads of the sub-directories that the walk will visit, in the
+ * order it will visit them, until DIFF_PREFETCH_PER_DIR are queued. @ptrs
+ * is where the last call stopped.
+ */
+static void
+prefetch_sub_dirs (int n, GList *ptrs[], const char *basedir, int depth,
+                   DiffOptions *opt, GQueue *loads)
+{
+    SeafDirent *dents[3];
+    DirLoad *load;
+    int i;
+
+    pthread_once (&prefetch_once, prefetch_pool_init);
+
+    while (g_queue_get_length (loads) < DIFF_PREFETCH_PER_DIR &&
+           next_diff_dents (n, ptrs, dents)) {
+        for (i = 0; i < n; ++i) {
+            if (!dents[i] || !S_ISDIR(dents[i]->mode) ||
+                strcmp (dents[i]->id, EMPTY_SHA1) == 0)
+                continue;
+
+            /* Dents at the same position have the same name. */
+            if (opt->path_filter &&
+                filter_dent_path (opt, basedir, dents, TRUE) == DIFF_PATH_SKIP)
+                break;
+
+            load = g_new0 (DirLoad, 1);
+            memcpy (load->store_id, opt->store_id, 37);
+            load->version = opt->version;
+            memcpy (load->dir_id, dents[i]->id, 41);
+            load->depth = depth;
+            load->dent = dents[i];
+            load->ref = 2;
+
+            pthread_mutex_lock (&prefetch_lock);
+            load->seq = prefetch_seq++;
+            pthread_mutex_unlock (&prefetch_lock);
+
+            g_queue_push_tail (loads, load);
+            g_thread_pool_push (prefetch_pool, load, NULL);
+        }
+    }
+}
+
+static SeafDir *
+get_sub_dir (SeafDirent *dent, GQueue *loads, DiffOptions *opt)
+{
+    DirLoad *load = g_queue_peek_head (loads);
+
+    if (load && load->dent == dent) {
+        g_queue_pop_head (loads);
+        return dir_load_take (load);
+    }
+
+    return seaf_fs_manager_get_seafdir (seaf->fs_mgr,
+                                        opt->store_id,
+                                        opt->version,
+                                        dent->id);
+}
+
+/* Drop the loads of @dents when the walk doesn't go into them. */
+static void
+skip_sub_dirs (int n, SeafDirent *dents[], GQueue *loads)
+{
+    DirLoad *load;
+    int i;
+
+    for (i = 0; i < n; ++i) {
+        load = g_queue_peek_head (loads);
+        if (load && dents[i] && load->dent == dents[i])
+            dir_load_abandon (g_queue_pop_head (loads));
+    }
+}
+
 static int
 diff_trees_recursive (int n, SeafDir *trees[],
-                      const char *basedir, DiffOptions *opt);
+                      const char *basedir, int depth, DiffOptions *opt);
 
 static int
-diff_directories (int n, SeafDirent *dents[], const char *basedir, DiffOptions *opt)
+diff_directories (int n, SeafDirent *dents[], const char *basedir,
+                  int depth, GQueue *loads, DiffOptions *opt)
 {
     SeafDirent *dirs[3];
     int i, n_dirs = 0;
@@ -110,21 +427,31 @@ diff_directories (int n, SeafDirent *dents[], const char *basedir, DiffOptions *
     if (n_dirs == 0)
         return 0;
 
+    int filtered = DIFF_PATH_FULL;
+    if (opt->path_filter) {
+        filtered = filter_dent_path (opt, basedir, dirs, TRUE);
+        if (filtered == DIFF_PATH_SKIP) {
+            skip_sub_dirs (n, dirs, loads);
+            return 0;
+        }
+    }
+
     gboolean recurse = TRUE;
-    ret = opt->dir_cb (n, basedir, dirs, opt->data, &recurse);
-    if (ret < 0)
-        return ret;
+    if (filtered != DIFF_PATH_PARTIAL || dirs[0] != NULL) {
+        ret = opt->dir_cb (n, basedir, dirs, opt->data, &recurse);
+        if (ret < 0)
+            return ret;
+    }
 
-    if (!recurse)
+    if (!recurse) {
+        skip_sub_dirs (n, dirs, loads);
         return 0;
+    }
 
     memset (sub_dirs, 0, sizeof(sub_dirs[0])*n);
     for (i = 0; i < n; ++i) {
         if (dents[i] != NULL && S_ISDIR(dents[i]->mode)) {
-            dir = seaf_fs_manager_get_seafdir (seaf->fs_mgr,
-                                               opt->store_id,
-                                               opt->version,
-                                               dents[i]->id);
+            dir = get_sub_dir (dents[i], loads, opt);
             if (!dir) {
                 seaf_warning ("Failed to find dir %s:%s.\n",
                               opt->store_id, dents[i]->id);
@@ -139,7 +466,13 @@ diff_directories (int n, SeafDirent *dents[], const char *basedir, DiffOptions *
 
     char *new_basedir = g_strconcat (basedir, dirname, "/", NULL);
 
-    ret = diff_trees_recursive (n, sub_dirs, new_basedir, opt);
+    if (opt->path_filter && filtered == DIFF_PATH_FULL) {
+        /* Everything below is included. */
+        DiffOptions sub_opt = *opt;
+        sub_opt.path_filter = NULL;
+        ret = diff_trees_recursive (n, sub_dirs, new_basedir, depth + 1, &sub_opt);
+    } else
+        ret = diff_trees_recursive (n, sub_dirs, new_basedir, depth + 1, opt);
 
     g_free (new_basedir);
 
@@ -151,14 +484,12 @@ free_sub_dirs:
 
 static int
 diff_trees_recursive (int n, SeafDir *trees[],
-                      const char *basedir, DiffOptions *opt)
+                      const char *basedir, int depth, DiffOptions *opt)
 {
-    GList *ptrs[3];
+    GList *ptrs[3], *prefetch_ptrs[3];
     SeafDirent *dents[3];
+    GQueue loads = G_QUEUE_INIT;
     int i;
-    SeafDirent *dent;
-    char *first_name;
-    gboolean done;
     int ret = 0;
 
     for (i = 0; i < n; ++i) {
@@ -166,59 +497,28 @@ diff_trees_recursive (int n, SeafDir *trees[],
             ptrs[i] = trees[i]->entries;
         else
             ptrs[i] = NULL;
+        prefetch_ptrs[i] = ptrs[i];
     }
 
     while (1) {
-        first_name = NULL;
-        memset (dents, 0, sizeof(dents[0])*n);
-        done = TRUE;
+        prefetch_sub_dirs (n, prefetch_ptrs, basedir, depth, opt, &loads);
 
-        /* Find the "largest" name, assuming dirents are sorted. */
-        for (i = 0; i < n; ++i) {
-            if (ptrs[i] != NULL) {
-                done = FALSE;
-                dent = ptrs[i]->data;
-                if (!first_name)
-                    first_name = dent->name;
-                else if (strcmp(dent->name, first_name) > 0)
-                    first_name = dent->name;
-            }
-        }
-
-        if (done)
+        if (!next_diff_dents (n, ptrs, dents))
             break;
 
-        /*
-         * Setup dir entries for all names that equal to first_name
-         */
-        for (i = 0; i < n; ++i) {
-            if (ptrs[i] != NULL) {
-                dent = ptrs[i]->data;
-                if (strcmp(first_name, dent->name) == 0) {
-                    dents[i] = dent;
-                    ptrs[i] = ptrs[i]->next;
-                }
-            }
-        }
-
-        if (n == 2 && dents[0] && dents[1] && dirent_same(dents[0], dents[1]))
-            continue;
-
-        if (n == 3 && dents[0] && dents[1] && dents[2] &&
-            dirent_same(dents[0], dents[1]) && dirent_same(dents[0], dents[2]))
-            continue;
-
         /* Diff files of this level. */
         ret = diff_files (n, dents, basedir, opt);
         if (ret < 0)
-            return ret;
+            break;
 
         /* Recurse into sub level. */
-        ret = diff_directories (n, dents, basedir, opt);
+        ret = diff_directories (n, dents, basedir, depth, &loads, opt);
         if (ret < 0)
-            return ret;
+            break;
     }
 
+    abandon_dir_loads (&loads);
+
     return ret;
 }
 
@@ -226,6 +526,7 @@ int
 diff_trees (int n, const char *roots[], DiffOptions *opt)
 {
     SeafDir **trees, *root;
+    gint64 start = seaf_metrics_now ();
     int i, ret;
 
     g_return_val_if_fail (n == 2 || n == 3, -1);
@@ -244,12 +545,19 @@ diff_trees (int n, const char *roots[], DiffOptions *opt)
         trees[i] = root;
     }
 
-    ret = diff_trees_recursive (n, trees, "", opt);
+    ret = diff_trees_recursive (n, trees, "", 0, opt);
 
     for (i = 0; i < n; ++i)
         seaf_dir_free (trees[i]);
     g_free (trees);
 
+    seaf_metric_observe_since (seaf_metric_get (SEAF_METRIC_HISTOGRAM,
+                                                "seaf_diff_trees_usec",
+                                                n == 2 ? "ways=\"2\"" :
+                                                "ways=\"3\""),
+                               start);
+    seaf_trace_span ("diff_trees", start, opt->store_id);
+
     return ret;
 }
 
@@ -366,6 +674,16 @@ int
 diff_commit_roots (const char *store_id, int version,
                    const char *root1, const char *root2, GList **results,
                    gboolean fold_dir_diff)
+{
+    return diff_commit_roots_filtered (store_id, version, root1, root2,
+                                       results, fold_dir_diff, NULL, NULL);
+}
+
+int
+diff_commit_roots_filtered (const char *store_id, int version,
+                            const char *root1, const char *root2,
+                            GList **results, gboolean fold_dir_diff,
+                            DiffPathFilter filter, void *filter_data)
 {
     DiffOptions opt;
     const char *roots[2];
@@ -381,6 +699,8 @@ diff_commit_roots (const char *store_id, int version,
     opt.file_cb = twoway_diff_files;
     opt.dir_cb = twoway_diff_dirs;
     opt.data = &data;
+    opt.path_filter = filter;
+    opt.filter_data = filter_data;
 
     roots[0] = root1;
     roots[1] = root2;
@@ -550,6 +870,7 @@ void
 diff_resolve_renames (GList **diff_entries)
 {
     GHashTable *deleted;
+    GQueue *dels;
     GList *p;
     GList *added = NULL;
     DiffEntry *de;
@@ -557,16 +878,28 @@ diff_resolve_renames (GList **diff_entries)
 
     memset (empty_sha1, 0, 20);
 
-    /* Hash and equal functions for raw sha1. */
-    deleted = g_hash_table_new (ccnet_sha1_hash, ccnet_sha1_equal);
+    /* Hash and equal functions for raw sha1. Several deleted entries may
+     * have the same content, so each sha1 maps to a queue of them.
+     */
+    deleted = g_hash_table_new_full (ccnet_sha1_hash, ccnet_sha1_equal,
+                                     g_free, (GDestroyNotify)g_queue_free);
 
     /* Collect all "deleted" entries. */
     for (p = *diff_entries; p != NULL; p = p->next) {
         de = p->data;
         if ((de->status == DIFF_STATUS_DELETED ||
              de->status == DIFF_STATUS_DIR_DELETED) &&
-            memcmp (de->sha1, empty_sha1, 20) != 0)
-            g_hash_table_insert (deleted, de->sha1, p);
+            memcmp (de->sha1, empty_sha1, 20) != 0) {
+            dels = g_hash_table_lookup (deleted, de->sha1);
+            if (!dels) {
+                /* The entries are freed as they are paired. */
+                unsigned char *sha1 = g_new (unsigned char, 20);
+                memcpy (sha1, de->sha1, 20);
+                dels = g_queue_new ();
+                g_hash_table_insert (deleted, sha1, dels);
+            }
+            g_queue_push_head (dels, p);
+        }
     }
 
     /* Collect all "added" entries into a separate list. */
@@ -583,14 +916,16 @@ diff_resolve_renames (GList **diff_entries)
      */
     p = added;
     while (p != NULL) {
-        GList *p_add, *p_del;
+        GList *p_add, *p_del = NULL;
         DiffEntry *de_add, *de_del, *de_rename;
         int rename_status;
 
         p_add = p->data;
         de_add = p_add->data;
 
-        p_del = g_hash_table_lookup (deleted, de_add->sha1);
+        dels = g_hash_table_lookup (deleted, de_add->sha1);
+        if (dels)
+            p_del = g_queue_pop_head (dels);
         if (p_del) {
             de_del = p_del->data;
 
@@ -607,7 +942,8 @@ diff_resolve_renames (GList **diff_entries)
             *diff_entries = g_list_delete_link (*diff_entries, p_del);
             *diff_entries = g_list_prepend (*diff_entries, de_rename);
 
-            g_hash_table_remove (deleted, de_add->sha1);
+            if (g_queue_is_empty (dels))
+                g_hash_table_remove (deleted, de_add->sha1);
 
             diff_entry_free (de_add);
             diff_entry_free (de_del);
@@ -619,30 +955,14 @@ diff_resolve_renames (GList **diff_entries)
     g_hash_table_destroy (deleted);
 }
 
-static gboolean
-is_redundant_empty_dir (DiffEntry *de_dir, DiffEntry *de_file)
+/* Add all the parent dirs of @path to @dirs. */
+static void
+add_parent_dirs (GHashTable *dirs, const char *path)
 {
-    int dir_len;
-
-    if (de_dir->status == DIFF_STATUS_DIR_ADDED &&
-        de_file->status == DIFF_STATUS_DELETED)
-    {
-        dir_len = strlen (de_dir->name);
-        if (strlen (de_file->name) > dir_len &&
-            strncmp (de_dir->name, de_file->name, dir_len) == 0)
-            return TRUE;
-    }
+    const char *slash;
 
-    if (de_dir->status == DIFF_STATUS_DIR_DELETED &&
-        de_file->status == DIFF_STATUS_ADDED)
-    {
-        dir_len = strlen (de_dir->name);
-        if (strlen (de_file->name) > dir_len &&
-            strncmp (de_dir->name, de_file->name, dir_len) == 0)
-            return TRUE;
-    }
-
-    return FALSE;
+    for (slash = strchr (path, '/'); slash; slash = strchr (slash + 1, '/'))
+        g_hash_table_replace (dirs, g_strndup (path, slash - path), dirs);
 }
 
 /*
@@ -654,29 +974,38 @@ is_redundant_empty_dir (DiffEntry *de_dir, DiffEntry *de_file)
 void
 diff_resolve_empty_dirs (GList **diff_entries)
 {
-    GList *empty_dirs = NULL;
-    GList *p, *dir, *file;
-    DiffEntry *de, *de_dir, *de_file;
+    GHashTable *deleted_parents, *added_parents;
+    GList *p, *next;
+    DiffEntry *de;
+
+    /* Parent dirs of deleted and added files, so that the files under an
+     * empty dir don't have to be searched for.
+     */
+    deleted_parents = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                             g_free, NULL);
+    added_parents = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                           g_free, NULL);
 
     for (p = *diff_entries; p != NULL; p = p->next) {
         de = p->data;
-        if (de->status == DIFF_STATUS_DIR_ADDED ||
-            de->status == DIFF_STATUS_DIR_DELETED)
-            empty_dirs = g_list_prepend (empty_dirs, p);
+        if (de->status == DIFF_STATUS_DELETED)
+            add_parent_dirs (deleted_parents, de->name);
+        else if (de->status == DIFF_STATUS_ADDED)
+            add_parent_dirs (added_parents, de->name);
     }
 
-    for (dir = empty_dirs; dir != NULL; dir = dir->next) {
-        de_dir = ((GList *)dir->data)->data;
-        for (file = *diff_entries; file != NULL; file = file->next) {
-            de_file = file->data;
-            if (is_redundant_empty_dir (de_dir, de_file)) {
-                *diff_entries = g_list_delete_link (*diff_entries, dir->data);
-                break;
-            }
-        }
+    for (p = *diff_entries; p != NULL; p = next) {
+        next = p->next;
+        de = p->data;
+        if ((de->status == DIFF_STATUS_DIR_ADDED &&
+             g_hash_table_lookup (deleted_parents, de->name)) ||
+            (de->status == DIFF_STATUS_DIR_DELETED &&
+             g_hash_table_lookup (added_parents, de->name)))
+            *diff_entries = g_list_delete_link (*diff_entries, p);
     }
 
-    g_list_free (empty_dirs);
+    g_hash_table_destroy (deleted_parents);
+    g_hash_table_destroy (added_parents);
 }
 
 int diff_unmerged_state(int mask)
@@ -81,6 +81,24 @@ diff_commit_roots (const char *store_id, int version,
                    const char *root1, const char *root2, GList **results,
                    gboolean fold_dir_diff);
 
+/* Filters the paths walked by diff_trees(). */
+enum {
+    DIFF_PATH_SKIP = 0,         /* leave out the path and what's below it */
+    DIFF_PATH_PARTIAL,          /* walk into the dir, filter what's below */
+    DIFF_PATH_FULL,             /* include the path and all below it */
+};
+
+typedef int (*DiffPathFilter) (const char *path, gboolean is_dir, void *data);
+
+/* Like diff_commit_roots(), but only the paths passed by @filter are
+ * diffed. Dirs that are partially passed are never folded.
+ */
+int
+diff_commit_roots_filtered (const char *store_id, int version,
+                            const char *root1, const char *root2,
+                            GList **results, gboolean fold_dir_diff,
+                            DiffPathFilter filter, void *filter_data);
+
 int
 diff_merge (SeafCommit *merge, GList **results, gboolean fold_dir_diff);
 
@@ -122,6 +140,12 @@ typedef struct DiffOptions {
     DiffFileCB file_cb;
     DiffDirCB dir_cb;
     void *data;
+    /* Optional. Skipped dirs are not loaded. For a partial dir that is
+     * only in the later trees, dir_cb is not called and the walk goes on
+     * into the dir.
+     */
+    DiffPathFilter path_filter;
+    void *filter_data;
 } DiffOptions;
 
 int
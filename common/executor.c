@@ -0,0 +1,318 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#include "executor.h"
+#include "log.h"
+
+#define DEFAULT_IO_THREADS 24
+
+struct _SeafTaskGroup {
+    int             lane;
+    int             priority;
+    guint64         seq;
+    int             max_running;
+    int             n_running;
+    /* Queued and running items. */
+    int             n_unfinished;
+    /* Queued items, in push order unless the group has a sort func. */
+    GQueue          items;
+    GSequence      *sorted_items;
+    GCompareDataFunc sort_func;
+    gpointer        sort_data;
+
+    GFunc           func;
+    gpointer        user_data;
+
+    SeafCancelFunc  is_canceled;
+    gpointer        cancel_data;
+    GFunc           drop_func;
+
+    /* Signalled whenever an item of the group is done. */
+    pthread_cond_t  item_done;
+};
+
+typedef struct Lane {
+    /* Groups of the lane, by priority and then by creation order. */
+    GList          *groups;
+    pthread_cond_t  work_ready;
+} Lane;
+
+static Lane lanes[N_SEAF_LANES];
+static pthread_mutex_t lock;
+static guint64 next_seq;
+
+static int lane_threads[N_SEAF_LANES];
+
+static gint
+compare_groups (gconstpointer a, gconstpointer b)
+{
+    const SeafTaskGroup *ga = a, *gb = b;
+
+    if (ga->priority != gb->priority)
+        return ga->priority - gb->priority;
+    return (ga->seq < gb->seq) ? -1 : 1;
+}
+
+/* Queue helpers, called with lock held. */
+static gboolean
+group_has_items (SeafTaskGroup *group)
+{
+    if (group->sorted_items)
+        return !g_sequence_iter_is_end (g_sequence_get_begin_iter (group->sorted_items));
+    return !g_queue_is_empty (&group->items);
+}
+
+static gpointer
+group_pop_item (SeafTaskGroup *group)
+{
+    GSequenceIter *iter;
+    gpointer item;
+
+    if (!group->sorted_items)
+        return g_queue_pop_head (&group->items);
+
+    iter = g_sequence_get_begin_iter (group->sorted_items);
+    item = g_sequence_get (iter);
+    g_sequence_remove (iter);
+    return item;
+}
+
+static int
+group_clear_items (SeafTaskGroup *group)
+{
+    GSequenceIter *begin, *end;
+    int n;
+
+    if (!group->sorted_items) {
+        n = g_queue_get_length (&group->items);
+        g_queue_clear (&group->items);
+        return n;
+    }
+
+    n = g_sequence_get_length (group->sorted_items);
+    begin = g_sequence_get_begin_iter (group->sorted_items);
+    end = g_sequence_get_end_iter (group->sorted_items);
+    g_sequence_remove_range (begin, end);
+    return n;
+}
+
+/* Called with lock held. */
+static SeafTaskGroup *
+find_runnable_group (Lane *lane)
+{
+    GList *ptr;
+    SeafTaskGroup *group;
+
+    for (ptr = lane->groups; ptr; ptr = ptr->next) {
+        group = ptr->data;
+        if (group_has_items (group) &&
+            group->n_running < group->max_running)
+            return group;
+    }
+
+    return NULL;
+}
+
+/* Called with lock held, which is released while the item runs. */
+static void
+run_item (SeafTaskGroup *group, Lane *lane)
+{
+    gpointer item = group_pop_item (group);
+
+    ++(group->n_running);
+    pthread_mutex_unlock (&lock);
+
+    if (group->is_canceled && group->is_canceled (group->cancel_data))
+        group->drop_func (item, group->user_data);
+    else
+        group->func (item, group->user_data);
+
+    pthread_mutex_lock (&lock);
+    --(group->n_running);
+    --(group->n_unfinished);
+    pthread_cond_broadcast (&group->item_done);
+    /* The group may have been held back by its limit. */
+    if (group_has_items (group))
+        pthread_cond_signal (&lane->work_ready);
+}
+
+static void *
+lane_worker (void *vlane)
+{
+    Lane *lane = vlane;
+    SeafTaskGroup *group;
+
+    pthread_mutex_lock (&lock);
+    while (1) {
+        group = find_runnable_group (lane);
+        if (!group) {
+            pthread_cond_wait (&lane->work_ready, &lock);
+            continue;
+        }
+        run_item (group, lane);
+    }
+
+    return NULL;
+}
+
+static gpointer
+start_lanes (gpointer unused)
+{
+    pthread_t tid;
+    int i, j;
+    int rc;
+
+    pthread_mutex_init (&lock, NULL);
+
+    if (lane_threads[SEAF_LANE_CPU] <= 0)
+        lane_threads[SEAF_LANE_CPU] = g_get_num_processors ();
+    if (lane_threads[SEAF_LANE_IO] <= 0)
+        lane_threads[SEAF_LANE_IO] = DEFAULT_IO_THREADS;
+
+    for (i = 0; i < N_SEAF_LANES; ++i) {
+        pthread_cond_init (&lanes[i].work_ready, NULL);
+        for (j = 0; j < lane_threads[i]; ++j) {
+            rc = pthread_create (&tid, NULL, lane_worker, &lanes[i]);
+            if (rc != 0) {
+                seaf_warning ("Failed to create executor thread: %s.\n",
+                              strerror(rc));
+                break;
+            }
+            pthread_detach (tid);
+        }
+        /* Queued items are still run by the threads waiting for them. */
+        lane_threads[i] = j;
+    }
+
+    return NULL;
+}
+
+static void
+ensure_started ()
+{
+    static GOnce once = G_ONCE_INIT;
+
+    g_once (&once, start_lanes, NULL);
+}
+
+void
+seaf_executor_start (int cpu_threads, int io_threads)
+{
+    lane_threads[SEAF_LANE_CPU] = cpu_threads;
+    lane_threads[SEAF_LANE_IO] = io_threads;
+    ensure_started ();
+}
+
+SeafTaskGroup *
+seaf_task_group_new (int lane, int priority, int max_running,
+                     GFunc func, gpointer user_data)
+{
+    SeafTaskGroup *group;
+
+    ensure_started ();
+
+    group = g_new0 (SeafTaskGroup, 1);
+    group->lane = lane;
+    group->priority = priority;
+    group->max_running = MAX (max_running, 1);
+    group->func = func;
+    group->user_data = user_data;
+    g_queue_init (&group->items);
+    pthread_cond_init (&group->item_done, NULL);
+
+    pthread_mutex_lock (&lock);
+    group->seq = next_seq++;
+    lanes[lane].groups = g_list_insert_sorted (lanes[lane].groups, group,
+                                               compare_groups);
+    pthread_mutex_unlock (&lock);
+
+    return group;
+}
+
+void
+seaf_task_group_set_cancel_func (SeafTaskGroup *group,
+                                 SeafCancelFunc is_canceled,
+                                 gpointer cancel_data,
+                                 GFunc drop_func)
+{
+    pthread_mutex_lock (&lock);
+    group->is_canceled = is_canceled;
+    group->cancel_data = cancel_data;
+    group->drop_func = drop_func;
+    pthread_mutex_unlock (&lock);
+}
+
+void
+seaf_task_group_set_sort_func (SeafTaskGroup *group,
+                               GCompareDataFunc sort_func,
+                               gpointer sort_data)
+{
+    gpointer item;
+
+    pthread_mutex_lock (&lock);
+    group->sort_func = sort_func;
+    group->sort_data = sort_data;
+    if (!group->sorted_items) {
+        group->sorted_items = g_sequence_new (NULL);
+        while ((item = g_queue_pop_head (&group->items)) != NULL)
+            g_sequence_insert_sorted (group->sorted_items, item,
+                                      sort_func, sort_data);
+    } else {
+        g_sequence_sort (group->sorted_items, sort_func, sort_data);
+    }
+    pthread_mutex_unlock (&lock);
+}
+
+void
+seaf_task_group_resort (SeafTaskGroup *group)
+{
+    pthread_mutex_lock (&lock);
+    if (group->sorted_items)
+        g_sequence_sort (group->sorted_items,
+                         group->sort_func, group->sort_data);
+    pthread_mutex_unlock (&lock);
+}
+
+void
+seaf_task_group_push (SeafTaskGroup *group, gpointer item)
+{
+    pthread_mutex_lock (&lock);
+    if (group->sorted_items)
+        g_sequence_insert_sorted (group->sorted_items, item,
+                                  group->sort_func, group->sort_data);
+    else
+        g_queue_push_tail (&group->items, item);
+    ++(group->n_unfinished);
+    pthread_cond_signal (&lanes[group->lane].work_ready);
+    pthread_mutex_unlock (&lock);
+}
+
+void
+seaf_task_group_free (SeafTaskGroup *group, gboolean discard)
+{
+    Lane *lane = &lanes[group->lane];
+
+    pthread_mutex_lock (&lock);
+
+    if (discard)
+        group->n_unfinished -= group_clear_items (group);
+
+    while (group->n_unfinished > 0) {
+        if (group_has_items (group) &&
+            group->n_running < group->max_running)
+            run_item (group, lane);
+        else
+            pthread_cond_wait (&group->item_done, &lock);
+    }
+
+    lane->groups = g_list_remove (lane->groups, group);
+    pthread_mutex_unlock (&lock);
+
+    pthread_cond_destroy (&group->item_done);
+    if (group->sorted_items)
+        g_sequence_free (group->sorted_items);
+    g_free (group);
+}
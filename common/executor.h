@@ -0,0 +1,92 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SEAF_EXECUTOR_H
+#define SEAF_EXECUTOR_H
+
+#include <glib.h>
+
+/*
+ * Shared worker threads for short parallel work items.
+ *
+ * Work is pushed to task groups, which replace per-call thread pools. A
+ * group belongs to a lane: CPU-bound work like chunking is run by about
+ * one thread per core, I/O-bound work like transfers by a larger set of
+ * threads. All groups of a lane share its threads, so the number of
+ * threads doesn't grow with the number of repos being synced at once.
+ * Idle threads take items from the group with the best priority that is
+ * below its own limit of running items.
+ *
+ * Work items must not block on items of other groups in the same lane.
+ */
+
+enum {
+    SEAF_LANE_CPU,
+    SEAF_LANE_IO,
+    N_SEAF_LANES,
+};
+
+/* Lower runs first. */
+enum {
+    SEAF_TASK_PRIORITY_HIGH,    /* Commits. */
+    SEAF_TASK_PRIORITY_NORMAL,
+    SEAF_TASK_PRIORITY_LOW,
+};
+
+typedef struct _SeafTaskGroup SeafTaskGroup;
+
+/* Returns TRUE once the work of @cancel_data is cancelled. */
+typedef gboolean (*SeafCancelFunc) (gpointer cancel_data);
+
+/*
+ * Sets the number of threads of each lane. The lanes are started with
+ * defaults if a group is created before this is called.
+ */
+void
+seaf_executor_start (int cpu_threads, int io_threads);
+
+/* @func is called as func (item, user_data) for every pushed item, by at
+ * most @max_running threads at once.
+ */
+SeafTaskGroup *
+seaf_task_group_new (int lane, int priority, int max_running,
+                     GFunc func, gpointer user_data);
+
+/*
+ * Ties the group to a cancellation token, such as the state of a transfer
+ * task. Items still queued when @is_canceled returns TRUE are passed to
+ * @drop_func instead of the group's func.
+ */
+void
+seaf_task_group_set_cancel_func (SeafTaskGroup *group,
+                                 SeafCancelFunc is_canceled,
+                                 gpointer cancel_data,
+                                 GFunc drop_func);
+
+/*
+ * Runs queued items in the order of @sort_func instead of push order.
+ * Items that compare equal may run in any order.
+ */
+void
+seaf_task_group_set_sort_func (SeafTaskGroup *group,
+                               GCompareDataFunc sort_func,
+                               gpointer sort_data);
+
+/*
+ * Sorts the queued items again, after the order of @sort_func changed.
+ * Items must not be pushed while the order is being changed.
+ */
+void
+seaf_task_group_resort (SeafTaskGroup *group);
+
+void
+seaf_task_group_push (SeafTaskGroup *group, gpointer item);
+
+/*
+ * Waits until all items are done and frees the group. The calling thread
+ * runs queued items itself meanwhile. If @discard is set, queued items
+ * that haven't started are dropped without calling any func.
+ */
+void
+seaf_task_group_free (SeafTaskGroup *group, gboolean discard);
+
+#endif
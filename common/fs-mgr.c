@@ -4,6 +4,7 @@
 
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <pthread.h>
 #ifndef WIN32
 #include <dirent.h>
 #endif
@@ -19,20 +20,67 @@
 #include "fs-mgr.h"
 #include "block-mgr.h"
 #include "utils.h"
+#include "sha1-util.h"
 #define DEBUG_FLAG SEAFILE_DEBUG_OTHER
 #include "log.h"
 #include "../common/seafile-crypt.h"
+#include "executor.h"
+#include "mem-budget.h"
+#include "work-mode.h"
+#include "metrics.h"
+#include "trace.h"
 
 #ifndef SEAFILE_SERVER
 #include "../daemon/vc-utils.h"
 #include "vc-common.h"
+#include "seafile-config.h"
 #endif  /* SEAFILE_SERVER */
 
 #include "db.h"
 
+/* Max memory used by parsed dir objects in the dir cache. */
+#define DIR_CACHE_MAX_MEM (64 << 20) /* 64MB */
+
+/* Cache keys are "<store id>/<object id>", so that a repo only gets
+ * objects that are in its own store.
+ */
+#define CACHE_KEY_SIZE 128
+
+typedef struct DirCacheEntry {
+    char *key;
+    SeafDir *dir;
+    gint64 mem;
+    GList *link;                /* node in the lru queue */
+} DirCacheEntry;
+
+/* Dir ids resolved by path are kept for this many recent roots. */
+#define PATH_CACHE_ROOTS 8
+#define PATH_CACHE_MAX_PATHS 100000 /* per root */
+
 struct _SeafFSManagerPriv {
     /* GHashTable      *seafile_cache; */
     GHashTable      *bl_cache;
+
+    /* LRU cache of parsed dir objects, keyed by store id and dir id. Dir
+     * objects are immutable, so entries never need to be invalidated.
+     */
+    GHashTable      *dir_cache;
+    GQueue          *dir_lru;   /* most recently used first */
+    gint64          dir_cache_mem;
+    gint64          dir_cache_hits;
+    gint64          dir_cache_misses;
+    pthread_mutex_t dir_cache_lock;
+
+    /* Dir ids of paths under recently used root ids. A root id fixes the
+     * whole tree below it, so the paths of a root never change. They are
+     * only dropped when the root falls out of the cache.
+     */
+    GHashTable      *path_cache; /* store id/root id -> (dir path -> dir id) */
+    GQueue          *path_roots; /* most recently used first */
+    pthread_mutex_t path_cache_lock;
+
+    /* Codec used for new fs objects. Both codecs can always be read. */
+    int             compress_codec;
 };
 
 #ifdef WIN32
@@ -102,6 +150,27 @@ seaf_fs_manager_new (SeafileSession *seaf,
     }
 
     mgr->priv = g_new0(SeafFSManagerPriv, 1);
+    mgr->priv->dir_cache = g_hash_table_new (g_str_hash, g_str_equal);
+    mgr->priv->dir_lru = g_queue_new ();
+    pthread_mutex_init (&mgr->priv->dir_cache_lock, NULL);
+    mgr->priv->path_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                   g_free,
+                                                   (GDestroyNotify)g_hash_table_destroy);
+    mgr->priv->path_roots = g_queue_new ();
+    pthread_mutex_init (&mgr->priv->path_cache_lock, NULL);
+
+#ifndef SEAFILE_SERVER
+    char *codec = seafile_session_config_get_string (seaf,
+                                                     KEY_FS_OBJECT_COMPRESSION);
+    if (g_strcmp0 (codec, FS_OBJECT_COMPRESSION_ZSTD) == 0) {
+#ifdef HAVE_ZSTD
+        mgr->priv->compress_codec = SEAF_COMPRESS_ZSTD;
+#else
+        seaf_warning ("zstd is not supported in this build, use zlib for fs objects.\n");
+#endif
+    }
+    g_free (codec);
+#endif
 
     return mgr;
 }
@@ -133,7 +202,142 @@ seaf_fs_manager_init (SeafFSManager *mgr)
     return 0;
 }
 
+/* Blocks are read and encrypted in a buffer kept by each thread, unless
+ * they are larger than this.
+ */
+#define THREAD_BUF_MAX_KEEP (16 << 20) /* 16MB */
+
+typedef struct ThreadBuf {
+    char *data;
+    int size;
+} ThreadBuf;
+
+static pthread_key_t thread_buf_key;
+static pthread_once_t thread_buf_once = PTHREAD_ONCE_INIT;
+
+static void
+thread_buf_free (void *vbuf)
+{
+    ThreadBuf *buf = vbuf;
+
+    g_free (buf->data);
+    g_free (buf);
+}
+
+static void
+thread_buf_key_init ()
+{
+    pthread_key_create (&thread_buf_key, thread_buf_free);
+}
+
+/* Returns a buffer of at least @size bytes. It should be freed by the caller
+ * only if *pooled is FALSE.
+ */
+static char *
+get_thread_buf (int size, gboolean *pooled)
+{
+    ThreadBuf *buf;
+
+    if (size > THREAD_BUF_MAX_KEEP) {
+        *pooled = FALSE;
+        return g_malloc (size);
+    }
+
+    pthread_once (&thread_buf_once, thread_buf_key_init);
+
+    buf = pthread_getspecific (thread_buf_key);
+    if (!buf) {
+        buf = g_new0 (ThreadBuf, 1);
+        pthread_setspecific (thread_buf_key, buf);
+    }
+
+    if (buf->size < size) {
+        g_free (buf->data);
+        buf->data = g_malloc (size);
+        buf->size = size;
+    }
+
+    *pooled = TRUE;
+    return buf->data;
+}
+
 #ifndef SEAFILE_SERVER
+/* Encrypted blocks are decrypted in pieces of this size, so that they don't
+ * have to be read into memory as a whole.
+ */
+#define CHECKOUT_DECRYPT_CHUNK (64 << 10) /* 64KB */
+
+static int
+checkout_encrypted_block (BlockHandle *handle,
+                          const char *block_id,
+                          int size,
+                          int wfd,
+                          SeafileCrypt *crypt)
+{
+    SeafBlockManager *block_mgr = seaf->block_mgr;
+    SeafileCipher *cipher;
+    char *buf, *in, *out;
+    gboolean pooled = FALSE;
+    int left = size, n, out_len;
+    int ret = -1;
+
+    /* An encrypted block size must be a multiple of ENCRYPT_BLK_SIZE */
+    if (size % ENCRYPT_BLK_SIZE != 0) {
+        seaf_warning ("Error: An invalid encrypted block, %s \n", block_id);
+        return -1;
+    }
+
+    cipher = seafile_cipher_new (crypt, FALSE);
+    if (!cipher) {
+        seaf_warning ("Decryt block %s failed. \n", block_id);
+        return -1;
+    }
+
+    buf = get_thread_buf (CHECKOUT_DECRYPT_CHUNK +
+                          SEAFILE_CIPHER_MAX_OUT(CHECKOUT_DECRYPT_CHUNK),
+                          &pooled);
+    in = buf;
+    out = buf + CHECKOUT_DECRYPT_CHUNK;
+
+    while (left > 0) {
+        n = MIN (left, CHECKOUT_DECRYPT_CHUNK);
+        if (seaf_block_manager_read_block (block_mgr, handle, in, n) != n) {
+            seaf_warning ("Error when reading from block %s.\n", block_id);
+            goto out;
+        }
+        left -= n;
+
+        if (seafile_cipher_update (cipher, out, &out_len, in, n) < 0) {
+            seaf_warning ("Decryt block %s failed. \n", block_id);
+            goto out;
+        }
+
+        if (writen (wfd, out, out_len) != out_len) {
+            seaf_warning ("Failed to write the decryted block %s.\n",
+                          block_id);
+            goto out;
+        }
+    }
+
+    if (seafile_cipher_final (cipher, out, &out_len) < 0) {
+        seaf_warning ("Decryt block %s failed. \n", block_id);
+        goto out;
+    }
+
+    if (writen (wfd, out, out_len) != out_len) {
+        seaf_warning ("Failed to write the decryted block %s.\n", block_id);
+        goto out;
+    }
+
+    ret = 0;
+
+out:
+    if (!pooled)
+        g_free (buf);
+    seafile_cipher_free (cipher);
+    return ret;
+}
+
 static int
 checkout_block (const char *repo_id,
                 int version,
@@ -144,9 +348,9 @@ checkout_block (const char *repo_id,
     SeafBlockManager *block_mgr = seaf->block_mgr;
     BlockHandle *handle;
     BlockMetadata *bmd;
-    char *dec_out = NULL;
-    int dec_out_len = -1;
     char *blk_content = NULL;
+    gboolean pooled = FALSE;
+    int copied, left = 0;
 
     handle = seaf_block_manager_open_block (block_mgr,
                                             repo_id, version,
@@ -164,66 +368,46 @@ checkout_block (const char *repo_id,
     }
 
     /* empty file, skip it */
-    if (bmd->size == 0) {
-        seaf_block_manager_close_block (block_mgr, handle);
-        seaf_block_manager_block_handle_free (block_mgr, handle);
-        return 0;
+    if (bmd->size == 0)
+        goto out;
+
+    if (crypt != NULL) {
+        if (checkout_encrypted_block (handle, block_id, bmd->size,
+                                      wfd, crypt) < 0)
+            goto checkout_blk_error;
+        goto out;
     }
 
-    blk_content = (char *)malloc (bmd->size * sizeof(char));
+    /* Unencrypted blocks can be copied by the kernel, or even shared with
+     * the block file on file systems that support reflinks.
+     */
+    copied = seaf_block_manager_copy_block_to_fd (block_mgr, handle,
+                                                  wfd, bmd->size);
+    left = bmd->size - copied;
+    if (left == 0)
+        goto out;
+
+    seaf_mem_budget_acquire (SEAF_MEM_CHECKOUT, left);
+    blk_content = get_thread_buf (left, &pooled);
 
-    /* read the block to prepare decryption */
     if (seaf_block_manager_read_block (block_mgr, handle,
-                                       blk_content, bmd->size) != bmd->size) {
+                                       blk_content, left) != left) {
         seaf_warning ("Error when reading from block %s.\n", block_id);
         goto checkout_blk_error;
     }
 
-    if (crypt != NULL) {
-
-        /* An encrypted block size must be a multiple of
-           ENCRYPT_BLK_SIZE
-        */
-        if (bmd->size % ENCRYPT_BLK_SIZE != 0) {
-            seaf_warning ("Error: An invalid encrypted block, %s \n", block_id);
-            goto checkout_blk_error;
-        }
-
-        /* decrypt the block */
-        int ret = seafile_decrypt (&dec_out,
-                                   &dec_out_len,
-                                   blk_content,
-                                   bmd->size,
-                                   crypt);
-
-        if (ret != 0) {
-            seaf_warning ("Decryt block %s failed. \n", block_id);
-            goto checkout_blk_error;
-        }
-
-        /* write the decrypted content */
-        ret = writen (wfd, dec_out, dec_out_len);
-
-
-        if (ret !=  dec_out_len) {
-            seaf_warning ("Failed to write the decryted block %s.\n",
-                       block_id);
-            goto checkout_blk_error;
-        }
-
-        g_free (blk_content);
-        g_free (dec_out);
-
-    } else {
-        /* not an encrypted block */
-        if (writen(wfd, blk_content, bmd->size) != bmd->size) {
-            seaf_warning ("Failed to write the decryted block %s.\n",
-                       block_id);
-            goto checkout_blk_error;
-        }
-        g_free (blk_content);
+    if (writen(wfd, blk_content, left) != left) {
+        seaf_warning ("Failed to write the decryted block %s.\n",
+                      block_id);
+        goto checkout_blk_error;
     }
 
+out:
+    if (blk_content) {
+        if (!pooled)
+            g_free (blk_content);
+        seaf_mem_budget_release (SEAF_MEM_CHECKOUT, left);
+    }
     g_free (bmd);
     seaf_block_manager_close_block (block_mgr, handle);
     seaf_block_manager_block_handle_free (block_mgr, handle);
@@ -231,10 +415,11 @@ checkout_block (const char *repo_id,
 
 checkout_blk_error:
 
-    if (blk_content)
-        free (blk_content);
-    if (dec_out)
-        g_free (dec_out);
+    if (blk_content) {
+        if (!pooled)
+            g_free (blk_content);
+        seaf_mem_budget_release (SEAF_MEM_CHECKOUT, left);
+    }
     if (bmd)
         g_free (bmd);
 
@@ -246,66 +431,22 @@ checkout_blk_error:
 #define SEAF_TMP_EXT "~"
 #define SEAF_BACKUP_EXT ".sbak"
 
-/*
- * File updating procedure:
- * 1. Checkout server versioin to tmp file.
- * 2. If there is a local version, move it to a backup file.
- * 3. Rename the tmp file to the destination path.
- * 4. Remove the backup file if exists.
- */
-int
-seaf_fs_manager_checkout_file (SeafFSManager *mgr,
-                               const char *repo_id,
-                               int version,
-                               const char *file_id,
-                               const char *file_path,
-                               guint32 mode,
-                               guint64 mtime,
-                               SeafileCrypt *crypt,
-                               const char *in_repo_path,
-                               const char *conflict_head_id,
-                               gboolean force_conflict,
-                               gboolean *conflicted,
-                               const char *email)
+/* Move the checked out @tmp_path into place, taking the ownership of it. */
+static int
+install_checkout_tmp_file (const char *repo_id,
+                           int version,
+                           char *tmp_path,
+                           const char *file_path,
+                           guint64 mtime,
+                           const char *in_repo_path,
+                           const char *conflict_head_id,
+                           gboolean force_conflict,
+                           gboolean *conflicted,
+                           const char *email)
 {
-    Seafile *seafile = NULL;
-    char *blk_id;
-    int wfd = -1;
-    int i;
-    char *tmp_path = NULL;
     char *backup_path = NULL;
     char *conflict_path = NULL;
 
-    *conflicted = FALSE;
-
-    /* Check out server version to tmp file. */
-
-    seafile = seaf_fs_manager_get_seafile (mgr, repo_id, version, file_id);
-    if (!seafile) {
-        seaf_warning ("File %s does not exist.\n", file_id);
-        return -1;
-    }
-
-    tmp_path = g_strconcat (file_path, SEAF_TMP_EXT, NULL);
-
-    mode_t rmode = mode & 0100 ? 0777 : 0666;
-    wfd = seaf_util_create (tmp_path, O_WRONLY | O_TRUNC | O_CREAT | O_BINARY,
-                            rmode & ~S_IFMT);
-    if (wfd < 0) {
-        seaf_warning ("Failed to open file %s for checkout: %s.\n",
-                   tmp_path, strerror(errno));
-        goto bad;
-    }
-
-    for (i = 0; i < seafile->n_blocks; ++i) {
-        blk_id = seafile->blk_sha1s[i];
-        if (checkout_block (repo_id, version, blk_id, wfd, crypt) < 0)
-            goto bad;
-    }
-
-    close (wfd);
-    wfd = -1;
-
     /* Move existing file to backup file. */
 
     backup_path = g_strconcat (file_path, SEAF_BACKUP_EXT, NULL);
@@ -418,21 +559,125 @@ out:
     g_free (tmp_path);
     g_free (backup_path);
     g_free (conflict_path);
-    seafile_unref (seafile);
     return 0;
 
 bad:
-    if (wfd >= 0)
-        close (wfd);
     /* Remove the tmp file if it still exists, in case that rename fails. */
     seaf_util_unlink (tmp_path);
     g_free (tmp_path);
     g_free (backup_path);
     g_free (conflict_path);
+    return -1;
+}
+
+int
+seaf_fs_manager_create_checkout_tmp_file (const char *file_path,
+                                          guint32 mode,
+                                          char **tmp_path)
+{
+    int fd;
+
+    *tmp_path = g_strconcat (file_path, SEAF_TMP_EXT, NULL);
+
+    mode_t rmode = mode & 0100 ? 0777 : 0666;
+    fd = seaf_util_create (*tmp_path, O_WRONLY | O_TRUNC | O_CREAT | O_BINARY,
+                           rmode & ~S_IFMT);
+    if (fd < 0) {
+        seaf_warning ("Failed to open file %s for checkout: %s.\n",
+                   *tmp_path, strerror(errno));
+    }
+
+    return fd;
+}
+
+/*
+ * File updating procedure:
+ * 1. Checkout server versioin to tmp file.
+ * 2. If there is a local version, move it to a backup file.
+ * 3. Rename the tmp file to the destination path.
+ * 4. Remove the backup file if exists.
+ */
+int
+seaf_fs_manager_checkout_file (SeafFSManager *mgr,
+                               const char *repo_id,
+                               int version,
+                               const char *file_id,
+                               const char *file_path,
+                               guint32 mode,
+                               guint64 mtime,
+                               SeafileCrypt *crypt,
+                               const char *in_repo_path,
+                               const char *conflict_head_id,
+                               gboolean force_conflict,
+                               gboolean *conflicted,
+                               const char *email)
+{
+    Seafile *seafile = NULL;
+    char *blk_id;
+    int wfd = -1;
+    int i;
+    char *tmp_path = NULL;
+
+    *conflicted = FALSE;
+
+    /* Check out server version to tmp file. */
+
+    seafile = seaf_fs_manager_get_seafile (mgr, repo_id, version, file_id);
+    if (!seafile) {
+        seaf_warning ("File %s does not exist.\n", file_id);
+        return -1;
+    }
+
+    wfd = seaf_fs_manager_create_checkout_tmp_file (file_path, mode, &tmp_path);
+    if (wfd < 0)
+        goto bad;
+
+    for (i = 0; i < seafile->n_blocks; ++i) {
+        blk_id = seafile->blk_sha1s[i];
+        if (checkout_block (repo_id, version, blk_id, wfd, crypt) < 0)
+            goto bad;
+    }
+
+    close (wfd);
+    wfd = -1;
+
+    seafile_unref (seafile);
+
+    return install_checkout_tmp_file (repo_id, version, tmp_path, file_path,
+                                      mtime, in_repo_path, conflict_head_id,
+                                      force_conflict, conflicted, email);
+
+bad:
+    if (wfd >= 0)
+        close (wfd);
+    /* Remove the tmp file if it still exists, in case that rename fails. */
+    seaf_util_unlink (tmp_path);
+    g_free (tmp_path);
     seafile_unref (seafile);
     return -1;
 }
 
+int
+seaf_fs_manager_checkout_staged_file (SeafFSManager *mgr,
+                                      const char *repo_id,
+                                      int version,
+                                      const char *staged_path,
+                                      const char *file_path,
+                                      guint64 mtime,
+                                      const char *in_repo_path,
+                                      const char *conflict_head_id,
+                                      gboolean force_conflict,
+                                      gboolean *conflicted,
+                                      const char *email)
+{
+    *conflicted = FALSE;
+
+    return install_checkout_tmp_file (repo_id, version,
+                                      g_strdup (staged_path), file_path,
+                                      mtime, in_repo_path, conflict_head_id,
+                                      force_conflict, conflicted, email);
+}
+
 #endif /* SEAFILE_SERVER */
 
 static void *
@@ -545,7 +790,9 @@ write_seafile (SeafFSManager *fs_mgr,
         guint8 *compressed;
         int outlen;
 
-        if (seaf_compress (ondisk, ondisk_size, &compressed, &outlen) < 0) {
+        if (seaf_compress_with_codec (fs_mgr->priv->compress_codec,
+                                      ondisk, ondisk_size,
+                                      &compressed, &outlen) < 0) {
             seaf_warning ("Failed to compress seafile obj %s:%s.\n",
                           repo_id, seafile_id);
             ret = -1;
@@ -645,60 +892,88 @@ seafile_write_chunk (const char *repo_id,
                      uint8_t *checksum,
                      gboolean write_data)
 {
-    GChecksum *ctx = g_checksum_new (G_CHECKSUM_SHA1);
-    gsize len = 20;
+    SeafSHA1Ctx ctx;
     int ret = 0;
 
     /* Encrypt before write to disk if needed, and we don't encrypt
      * empty files. */
     if (crypt != NULL && chunk->len) {
-        char *encrypted_buf = NULL;         /* encrypted output */
-        int enc_len = -1;                /* encrypted length */
-
-        ret = seafile_encrypt (&encrypted_buf, /* output */
-                               &enc_len,      /* output len */
-                               chunk->block_buf, /* input */
-                               chunk->len,       /* input len */
-                               crypt);
-        if (ret != 0) {
+        SeafileCipher *cipher;
+        char *encrypted_buf;            /* encrypted output */
+        int enc_len, final_len;         /* encrypted length */
+        gboolean pooled = FALSE;
+
+        cipher = seafile_cipher_new (crypt, TRUE);
+        if (!cipher) {
+            seaf_warning ("Error: failed to encrypt block\n");
+            return -1;
+        }
+
+        /* The block id is the hash of the encrypted content, so it has to be
+         * encrypted as a whole before being written. The output goes to a
+         * buffer reused by the thread.
+         */
+        encrypted_buf = get_thread_buf (SEAFILE_CIPHER_MAX_OUT(chunk->len),
+                                        &pooled);
+        if (seafile_cipher_update (cipher, encrypted_buf, &enc_len,
+                                   chunk->block_buf, chunk->len) < 0 ||
+            seafile_cipher_final (cipher, encrypted_buf + enc_len,
+                                  &final_len) < 0) {
             seaf_warning ("Error: failed to encrypt block\n");
-            g_checksum_free (ctx);
+            seafile_cipher_free (cipher);
+            if (!pooled)
+                g_free (encrypted_buf);
             return -1;
         }
+        enc_len += final_len;
+        seafile_cipher_free (cipher);
 
+        seaf_sha1_init (&ctx);
         if (seaf->disable_block_hash) {
             char *uuid = gen_uuid();
-            g_checksum_update (ctx, (unsigned char *)uuid, strlen(uuid));
+            seaf_sha1_update (&ctx, uuid, strlen(uuid));
             g_free(uuid);
         } else {
-            g_checksum_update (ctx, (unsigned char *)encrypted_buf, enc_len);
+            seaf_sha1_update (&ctx, encrypted_buf, enc_len);
         }
-        g_checksum_get_digest (ctx, checksum, &len);
+        seaf_sha1_final (&ctx, checksum);
 
         if (write_data)
             ret = do_write_chunk (repo_id, version, checksum, encrypted_buf, enc_len);
-        g_free (encrypted_buf);
+        if (!pooled)
+            g_free (encrypted_buf);
     } else {
         /* not a encrypted repo, go ahead */
+        seaf_sha1_init (&ctx);
         if (seaf->disable_block_hash) {
             char *uuid = gen_uuid();
-            g_checksum_update (ctx, (unsigned char *)uuid, strlen(uuid));
+            seaf_sha1_update (&ctx, uuid, strlen(uuid));
             g_free(uuid);
         }
         else {
-            g_checksum_update (ctx, (unsigned char *)chunk->block_buf, chunk->len);
+            seaf_sha1_update (&ctx, chunk->block_buf, chunk->len);
         }
-        g_checksum_get_digest (ctx, checksum, &len);
+        seaf_sha1_final (&ctx, checksum);
 
         if (write_data)
             ret = do_write_chunk (repo_id, version, checksum, chunk->block_buf, chunk->len);
     }
 
-    g_checksum_free (ctx);
-
     return ret;
 }
 
+/* Blocks of files uploaded directly from the worktree are not stored. */
+static int
+hash_chunk (const char *repo_id,
+            int version,
+            CDCDescriptor *chunk,
+            SeafileCrypt *crypt,
+            uint8_t *checksum,
+            gboolean write_data)
+{
+    return seafile_write_chunk (repo_id, version, chunk, crypt, checksum, FALSE);
+}
+
 static void
 create_cdc_for_empty_file (CDCFileDescriptor *cdc)
 {
@@ -713,6 +988,9 @@ typedef struct ChunkingData {
     SeafileCrypt *crypt;
     guint8 *blk_sha1s;
     GAsyncQueue *finished_tasks;
+    gboolean write_data;
+    /* Set when a chunk fails, so that queued chunks are skipped. */
+    gint error;
 } ChunkingData;
 
 static void
@@ -723,10 +1001,12 @@ chunking_worker (gpointer vdata, gpointer user_data)
     int fd = -1;
     ssize_t n;
     int idx;
+    gint64 start = seaf_metrics_now ();
 
-    chunk->block_buf = g_new0 (char, chunk->len);
-    if (!chunk->block_buf) {
-        seaf_warning ("Failed to allow chunk buffer\n");
+    seaf_work_mode_apply_to_thread ();
+
+    if (g_atomic_int_get (&data->error)) {
+        chunk->result = -1;
         goto out;
     }
 
@@ -750,10 +1030,13 @@ chunking_worker (gpointer vdata, gpointer user_data)
         chunk->result = -1;
         goto out;
     }
+    /* Buffers are reused, don't hash stale data if the file shrank. */
+    if (n < chunk->len)
+        memset (chunk->block_buf + n, 0, chunk->len - n);
 
     chunk->result = seafile_write_chunk (data->repo_id, data->version,
                                          chunk, data->crypt,
-                                         chunk->checksum, 1);
+                                         chunk->checksum, data->write_data);
     if (chunk->result < 0)
         goto out;
 
@@ -761,13 +1044,39 @@ chunking_worker (gpointer vdata, gpointer user_data)
     memcpy (data->blk_sha1s + idx * CHECKSUM_LENGTH, chunk->checksum, CHECKSUM_LENGTH);
 
 out:
-    g_free (chunk->block_buf);
-    close (fd);
+    if (chunk->result < 0)
+        g_atomic_int_set (&data->error, 1);
+    if (fd >= 0)
+        close (fd);
+    seaf_trace_span ("chunk_block", start, data->file_path);
+    seaf_work_mode_restore_thread ();
     g_async_queue_push (data->finished_tasks, chunk);
 }
 
 #define DEFAULT_SPLIT_FILE_TO_BLOCK_THREADS 3
+/* Chunks in flight per worker thread. Each one holds a block buffer, so
+ * peak memory is about threads * this * block size. */
+#define SPLIT_FILE_CHUNKS_PER_THREAD 2
+
+/* Only the first block buffer of a file waits for memory budget. More are
+ * allocated while budget is left, otherwise the file is chunked with the
+ * buffers it already has.
+ */
+static gboolean
+reserve_chunk_buf (int n_alloced, guint32 size)
+{
+    if (n_alloced == 0) {
+        seaf_mem_budget_acquire (SEAF_MEM_CHUNKING, size);
+        return TRUE;
+    }
+    return seaf_mem_budget_try_acquire (SEAF_MEM_CHUNKING, size);
+}
 
+/*
+ * Blocks are produced as workers finish earlier ones, instead of queuing the
+ * whole file up front. A fixed set of chunk descriptors and block buffers
+ * is reused for the whole file.
+ */
 static int
 split_file_to_block (const char *repo_id,
                      int version,
@@ -779,11 +1088,13 @@ split_file_to_block (const char *repo_id,
 {
     int n_blocks;
     uint8_t *block_sha1s = NULL;
-    GThreadPool *tpool = NULL;
+    SeafTaskGroup *tasks = NULL;
     GAsyncQueue *finished_tasks = NULL;
-    GList *pending_tasks = NULL;
-    int n_pending = 0;
+    int n_threads, max_pending, n_alloced = 0, n_pending = 0;
+    CDCDescriptor *chunks = NULL;
+    GQueue free_chunks = G_QUEUE_INIT;
     CDCDescriptor *chunk;
+    int i;
     int ret = 0;
 
     n_blocks = (file_size + cdc->block_sz - 1) / cdc->block_sz;
@@ -805,60 +1116,101 @@ split_file_to_block (const char *repo_id,
     data.blk_sha1s = block_sha1s;
     data.finished_tasks = finished_tasks;
     data.blk_size = cdc->block_sz;
-    
-    tpool = g_thread_pool_new (chunking_worker, &data,
-                               DEFAULT_SPLIT_FILE_TO_BLOCK_THREADS, FALSE, NULL);
-    if (!tpool) {
-        seaf_warning ("Failed to allocate thread pool\n");
-        ret = -1;
-        goto out;
-    }
+    data.write_data = write_data;
+
+    n_threads = seaf->split_file_threads;
+    if (n_threads <= 0)
+        n_threads = DEFAULT_SPLIT_FILE_TO_BLOCK_THREADS;
+    if (n_threads > n_blocks)
+        n_threads = n_blocks;
+    max_pending = n_threads * SPLIT_FILE_CHUNKS_PER_THREAD;
+    if (max_pending > n_blocks)
+        max_pending = n_blocks;
+
+    chunks = g_new0 (CDCDescriptor, max_pending);
+
+    /* Chunks are hashed and compressed for commits, ahead of transfers. */
+    tasks = seaf_task_group_new (SEAF_LANE_CPU, SEAF_TASK_PRIORITY_HIGH,
+                                 n_threads, chunking_worker, &data);
 
     guint64 offset = 0;
     guint64 len;
     guint64 left = (guint64)file_size;
-    while (left > 0) {
-        len = ((left >= cdc->block_sz) ? cdc->block_sz : left);
+    while (left > 0 || n_pending > 0) {
+        if (left > 0 && ret == 0 && n_pending < max_pending &&
+            (!g_queue_is_empty (&free_chunks) ||
+             reserve_chunk_buf (n_alloced, cdc->block_sz))) {
+            if (!g_queue_is_empty (&free_chunks)) {
+                chunk = g_queue_pop_head (&free_chunks);
+            } else {
+                chunk = &chunks[n_alloced++];
+                chunk->block_buf = g_try_malloc (cdc->block_sz);
+                if (!chunk->block_buf) {
+                    seaf_warning ("Failed to allocate chunk buffer.\n");
+                    ret = -1;
+                    continue;
+                }
+            }
 
-        chunk = g_new0 (CDCDescriptor, 1);
-        chunk->offset = offset;
-        chunk->len = (guint32)len;
+            len = ((left >= cdc->block_sz) ? cdc->block_sz : left);
+            chunk->offset = offset;
+            chunk->len = (guint32)len;
+            chunk->result = 0;
 
-        g_thread_pool_push (tpool, chunk, NULL);
-        pending_tasks = g_list_prepend (pending_tasks, chunk);
-        n_pending++;
+            seaf_task_group_push (tasks, chunk);
+            n_pending++;
 
-        left -= len;
-        offset += len;
-    }
-
-    while ((chunk = g_async_queue_pop (finished_tasks)) != NULL) {
-        if (chunk->result < 0) {
-            ret = -1;
-            goto out;
+            left -= len;
+            offset += len;
+            continue;
         }
 
-        if ((--n_pending) <= 0) {
+        /* Wait for a worker. After an error we only drain what is in
+         * flight, the remaining chunks are skipped by the workers. */
+        if (n_pending == 0)
             break;
-        }
+        chunk = g_async_queue_pop (finished_tasks);
+        n_pending--;
+        if (chunk->result < 0)
+            ret = -1;
+        g_queue_push_tail (&free_chunks, chunk);
     }
 
+    if (ret < 0)
+        goto out;
+
     cdc->block_nr = n_blocks;
     cdc->blk_sha1s = block_sha1s;
 
 
 out:
-    if (tpool)
-        g_thread_pool_free (tpool, TRUE, TRUE);
+    if (tasks)
+        seaf_task_group_free (tasks, TRUE);
     if (finished_tasks)
         g_async_queue_unref (finished_tasks);
-    g_list_free_full (pending_tasks, g_free);
+    g_queue_clear (&free_chunks);
+    for (i = 0; i < n_alloced; i++)
+        g_free (chunks[i].block_buf);
+    if (n_alloced > 0)
+        seaf_mem_budget_release (SEAF_MEM_CHUNKING,
+                                 (gint64)n_alloced * cdc->block_sz);
+    g_free (chunks);
     if (ret < 0)
         g_free (block_sha1s);
 
     return ret;
 }
 
+void
+file_block_map_free (FileBlockMap *map)
+{
+    if (!map)
+        return;
+
+    free (map->blk_sha1s);
+    free (map->blk_lens);
+    g_free (map);
+}
 
 int
 seaf_fs_manager_index_blocks (SeafFSManager *mgr,
@@ -869,10 +1221,17 @@ seaf_fs_manager_index_blocks (SeafFSManager *mgr,
                               gint64 *size,
                               SeafileCrypt *crypt,
                               gboolean write_data,
-                              gboolean use_cdc)
+                              gboolean write_blocks,
+                              gboolean use_cdc,
+                              guint32 fixed_block_size,
+                              FileBlockMap **block_map)
 {
     SeafStat sb;
     CDCFileDescriptor cdc;
+    gint64 start = seaf_metrics_now ();
+
+    if (block_map)
+        *block_map = NULL;
 
     if (seaf_stat (file_path, &sb) < 0) {
         seaf_warning ("Bad file %s: %s.\n", file_path, strerror(errno));
@@ -899,32 +1258,50 @@ seaf_fs_manager_index_blocks (SeafFSManager *mgr,
         }
         
         if (use_cdc) {
-            cdc.write_block = seafile_write_chunk;
+            cdc.write_block = write_blocks ? seafile_write_chunk : hash_chunk;
             memcpy (cdc.repo_id, repo_id, 36);
             cdc.version = version;
+            cdc.keep_blk_lens = (block_map != NULL);
             if (filename_chunk_cdc (file_path, &cdc, crypt, write_data) < 0) {
                 seaf_warning ("Failed to chunk file with CDC.\n");
+                free (cdc.blk_sha1s);
+                free (cdc.blk_lens);
                 return -1;
             }
         } else {
             memcpy (cdc.repo_id, repo_id, 36);
             cdc.version = version;
             cdc.file_size = sb.st_size;
+            if (fixed_block_size > 0)
+                cdc.block_sz = fixed_block_size;
             if (split_file_to_block (repo_id, version, file_path, sb.st_size,
                                      crypt, &cdc, write_data) < 0) {
                 return -1;
             }            
         }
+        seaf_trace_span ("chunk_file", start, file_path);
 
         if (write_data && write_seafile (mgr, repo_id, version, &cdc, sha1) < 0) {
             g_free (cdc.blk_sha1s);
+            free (cdc.blk_lens);
             seaf_warning ("Failed to write seafile for %s.\n", file_path);
             return -1;
         }
+        if (!write_data && version > 0)
+            seaf_fs_manager_calculate_seafile_id_json (version, &cdc, sha1);
     }
 
     *size = (gint64)sb.st_size;
 
+    if (cdc.blk_lens) {
+        FileBlockMap *map = g_new0 (FileBlockMap, 1);
+        map->n_blocks = cdc.block_nr;
+        map->blk_sha1s = cdc.blk_sha1s;
+        map->blk_lens = cdc.blk_lens;
+        *block_map = map;
+        return 0;
+    }
+
     if (cdc.blk_sha1s)
         free (cdc.blk_sha1s);
 
@@ -1210,7 +1587,8 @@ seafile_to_data (Seafile *file, int *len)
         if (!data)
             return NULL;
 
-        if (seaf_compress (data, orig_len, &compressed, len) < 0) {
+        if (seaf_compress_with_codec (seaf->fs_mgr->priv->compress_codec,
+                                      data, orig_len, &compressed, len) < 0) {
             seaf_warning ("Failed to compress file object %s.\n", file->file_id);
             g_free (data);
             return NULL;
@@ -1305,7 +1683,8 @@ seaf_dir_free (SeafDir *dir)
     if (dir == NULL)
         return;
 
-    GList *ptr = dir->entries;
+    /* Dirents in the arena are freed with it. */
+    GList *ptr = dir->arena ? NULL : dir->entries;
     while (ptr) {
         seaf_dirent_free ((SeafDirent *)ptr->data);
         ptr = ptr->next;
@@ -1313,6 +1692,7 @@ seaf_dir_free (SeafDir *dir)
 
     g_list_free (dir->entries);
     g_free (dir->ondisk);
+    g_free (dir->arena);
     g_free(dir);
 }
 
@@ -1480,60 +1860,416 @@ parse_dirent (const char *dir_id, int version, json_t *object)
         dirent->size = size;
     }
 
-    return dirent;
+    return dirent;
+}
+
+static SeafDir *
+seaf_dir_from_json_object (const char *dir_id, json_t *object)
+{
+    json_t *dirent_array = NULL;
+    int type;
+    int version;
+    SeafDir *dir = NULL;
+
+    /* Sanity checks. */
+    type = json_object_get_int_member (object, "type");
+    if (type != SEAF_METADATA_TYPE_DIR) {
+        seaf_debug ("Object %s is not a dir.\n", dir_id);
+        return NULL;
+    }
+
+    version = (int) json_object_get_int_member (object, "version");
+    if (version < 1) {
+        seaf_debug ("Dir object %s version should be > 0, version is %d.\n",
+                    dir_id, version);
+        return NULL;
+    }
+
+    dirent_array = json_object_get (object, "dirents");
+    if (!dirent_array) {
+        seaf_debug ("No dirents in dir object %s.\n", dir_id);
+        return NULL;
+    }
+
+    dir = g_new0 (SeafDir, 1);
+
+    dir->object.type = SEAF_METADATA_TYPE_DIR;
+
+    memcpy (dir->dir_id, dir_id, 40);
+    dir->version = version;
+
+    size_t n_dirents = json_array_size (dirent_array);
+    int i;
+    json_t *dirent_obj;
+    SeafDirent *dirent;
+    for (i = 0; i < n_dirents; ++i) {
+        dirent_obj = json_array_get (dirent_array, i);
+        dirent = parse_dirent (dir_id, version, dirent_obj);
+        if (!dirent) {
+            seaf_dir_free (dir);
+            return NULL;
+        }
+        dir->entries = g_list_prepend (dir->entries, dirent);
+    }
+    dir->entries = g_list_reverse (dir->entries);
+
+    return dir;
+}
+
+/*
+ * Dir objects written by seafile always have the same few keys, so they
+ * are parsed without building a jansson tree. The dirents and their
+ * strings are put into one arena owned by the dir. Anything the parser
+ * doesn't expect, including invalid objects, is left to jansson.
+ */
+typedef struct DirParser {
+    const char *p;
+    const char *end;
+    /* Next free byte for strings in the arena. */
+    char *strings;
+} DirParser;
+
+static void
+skip_ws (DirParser *ps)
+{
+    while (ps->p < ps->end &&
+           (*ps->p == ' ' || *ps->p == '\t' || *ps->p == '\n' || *ps->p == '\r'))
+        ++ps->p;
+}
+
+static gboolean
+accept_char (DirParser *ps, char c)
+{
+    skip_ws (ps);
+    if (ps->p < ps->end && *ps->p == c) {
+        ++ps->p;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+static gboolean
+parse_int (DirParser *ps, gint64 *value)
+{
+    gboolean negative = FALSE;
+    gint64 v = 0;
+    int n_digits = 0;
+
+    skip_ws (ps);
+    if (ps->p < ps->end && *ps->p == '-') {
+        negative = TRUE;
+        ++ps->p;
+    }
+    while (ps->p < ps->end && g_ascii_isdigit (*ps->p)) {
+        /* Leave anything that may overflow to jansson. */
+        if (++n_digits > 18)
+            return FALSE;
+        v = v * 10 + (*ps->p - '0');
+        ++ps->p;
+    }
+    if (n_digits == 0)
+        return FALSE;
+    /* Fractions and exponents. */
+    if (ps->p < ps->end &&
+        (*ps->p == '.' || *ps->p == 'e' || *ps->p == 'E'))
+        return FALSE;
+
+    *value = negative ? -v : v;
+    return TRUE;
+}
+
+static gboolean
+parse_hex4 (DirParser *ps, guint32 *value)
+{
+    int i;
+    int d;
+
+    if (ps->end - ps->p < 4)
+        return FALSE;
+
+    *value = 0;
+    for (i = 0; i < 4; ++i) {
+        d = g_ascii_xdigit_value (ps->p[i]);
+        if (d < 0)
+            return FALSE;
+        *value = (*value << 4) | d;
+    }
+    ps->p += 4;
+    return TRUE;
+}
+
+/* Unescapes a string into the arena. The result is never longer than the
+ * string in the object.
+ */
+static char *
+parse_string (DirParser *ps)
+{
+    char *start = ps->strings;
+    char *out = ps->strings;
+    unsigned char c;
+    guint32 cp, low;
+
+    if (!accept_char (ps, '"'))
+        return NULL;
+
+    while (1) {
+        if (ps->p >= ps->end)
+            return NULL;
+        c = *ps->p++;
+        if (c == '"')
+            break;
+        if (c < 0x20)
+            return NULL;
+        if (c != '\\') {
+            *out++ = c;
+            continue;
+        }
+
+        if (ps->p >= ps->end)
+            return NULL;
+        c = *ps->p++;
+        switch (c) {
+        case '"':
+        case '\\':
+        case '/':
+            *out++ = c;
+            break;
+        case 'b':
+            *out++ = '\b';
+            break;
+        case 'f':
+            *out++ = '\f';
+            break;
+        case 'n':
+            *out++ = '\n';
+            break;
+        case 'r':
+            *out++ = '\r';
+            break;
+        case 't':
+            *out++ = '\t';
+            break;
+        case 'u':
+            if (!parse_hex4 (ps, &cp) || cp == 0)
+                return NULL;
+            if (cp >= 0xDC00 && cp <= 0xDFFF)
+                return NULL;
+            if (cp >= 0xD800 && cp <= 0xDBFF) {
+                if (ps->end - ps->p < 2 || ps->p[0] != '\\' || ps->p[1] != 'u')
+                    return NULL;
+                ps->p += 2;
+                if (!parse_hex4 (ps, &low) || low < 0xDC00 || low > 0xDFFF)
+                    return NULL;
+                cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+            }
+            out += g_unichar_to_utf8 (cp, out);
+            break;
+        default:
+            return NULL;
+        }
+    }
+
+    *out++ = 0;
+    if (!g_utf8_validate (start, out - start - 1, NULL))
+        return NULL;
+
+    ps->strings = out;
+    return start;
+}
+
+/* Keys are only compared, so their space in the arena is reused. */
+static gboolean
+parse_key (DirParser *ps, char **keys, int n_keys, int *index)
+{
+    char *mark = ps->strings;
+    char *key;
+    int i;
+
+    key = parse_string (ps);
+    if (!key)
+        return FALSE;
+    ps->strings = mark;
+
+    for (i = 0; i < n_keys; ++i) {
+        if (strcmp (key, keys[i]) == 0) {
+            *index = i;
+            return accept_char (ps, ':');
+        }
+    }
+    return FALSE;
+}
+
+enum {
+    DIRENT_KEY_ID,
+    DIRENT_KEY_MODE,
+    DIRENT_KEY_MODIFIER,
+    DIRENT_KEY_MTIME,
+    DIRENT_KEY_NAME,
+    DIRENT_KEY_SIZE,
+};
+
+static char *dirent_keys[] = {
+    "id", "mode", "modifier", "mtime", "name", "size",
+};
+
+static gboolean
+parse_dirent_fast (DirParser *ps, SeafDirent *dent)
+{
+    char *mark;
+    char *id;
+    gint64 value;
+    int key;
+
+    memset (dent, 0, sizeof(SeafDirent));
+
+    if (!accept_char (ps, '{'))
+        return FALSE;
+
+    do {
+        if (!parse_key (ps, dirent_keys, G_N_ELEMENTS(dirent_keys), &key))
+            return FALSE;
+
+        switch (key) {
+        case DIRENT_KEY_ID:
+            mark = ps->strings;
+            id = parse_string (ps);
+            if (!id || !is_object_id_valid (id))
+                return FALSE;
+            memcpy (dent->id, id, 41);
+            ps->strings = mark;
+            break;
+        case DIRENT_KEY_NAME:
+            dent->name = parse_string (ps);
+            if (!dent->name)
+                return FALSE;
+            break;
+        case DIRENT_KEY_MODIFIER:
+            dent->modifier = parse_string (ps);
+            if (!dent->modifier)
+                return FALSE;
+            break;
+        default:
+            if (!parse_int (ps, &value))
+                return FALSE;
+            if (key == DIRENT_KEY_MODE)
+                dent->mode = (guint32)value;
+            else if (key == DIRENT_KEY_MTIME)
+                dent->mtime = value;
+            else
+                dent->size = value;
+            break;
+        }
+    } while (accept_char (ps, ','));
+
+    if (!accept_char (ps, '}'))
+        return FALSE;
+
+    if (dent->id[0] == 0 || !dent->name)
+        return FALSE;
+    dent->name_len = strlen (dent->name);
+    if (S_ISREG(dent->mode)) {
+        if (!dent->modifier)
+            return FALSE;
+    } else {
+        dent->modifier = NULL;
+        dent->size = 0;
+    }
+
+    return TRUE;
 }
 
+enum {
+    DIR_KEY_DIRENTS,
+    DIR_KEY_TYPE,
+    DIR_KEY_VERSION,
+};
+
+static char *dir_keys[] = {
+    "dirents", "type", "version",
+};
+
 static SeafDir *
-seaf_dir_from_json_object (const char *dir_id, json_t *object)
-{
-    json_t *dirent_array = NULL;
-    int type;
-    int version;
-    SeafDir *dir = NULL;
+seaf_dir_from_json_fast (const char *dir_id, const char *data, int len)
+{
+    DirParser ps;
+    SeafDirent *dents;
+    const char *p;
+    int max_dents = 0;
+    int n_dents = 0;
+    gsize dents_size, arena_size;
+    char *arena;
+    gint64 type = -1, version = -1;
+    gboolean has_dirents = FALSE;
+    int key;
+    int i;
+    SeafDir *dir;
 
-    /* Sanity checks. */
-    type = json_object_get_int_member (object, "type");
-    if (type != SEAF_METADATA_TYPE_DIR) {
-        seaf_debug ("Object %s is not a dir.\n", dir_id);
-        return NULL;
-    }
+    /* Every dirent is an object, so this is enough room for all of them. */
+    for (p = data; (p = memchr (p, '{', data + len - p)) != NULL; ++p)
+        ++max_dents;
+
+    dents_size = sizeof(SeafDirent) * max_dents;
+    arena_size = dents_size + len;
+    arena = g_malloc (arena_size);
+    dents = (SeafDirent *)arena;
+
+    ps.p = data;
+    ps.end = data + len;
+    ps.strings = arena + dents_size;
+
+    if (!accept_char (&ps, '{'))
+        goto fallback;
+
+    do {
+        if (!parse_key (&ps, dir_keys, G_N_ELEMENTS(dir_keys), &key))
+            goto fallback;
+
+        if (key == DIR_KEY_DIRENTS) {
+            if (!accept_char (&ps, '['))
+                goto fallback;
+            n_dents = 0;
+            if (!accept_char (&ps, ']')) {
+                do {
+                    if (n_dents == max_dents ||
+                        !parse_dirent_fast (&ps, &dents[n_dents]))
+                        goto fallback;
+                    ++n_dents;
+                } while (accept_char (&ps, ','));
+                if (!accept_char (&ps, ']'))
+                    goto fallback;
+            }
+            has_dirents = TRUE;
+        } else if (!parse_int (&ps, (key == DIR_KEY_TYPE) ? &type : &version)) {
+            goto fallback;
+        }
+    } while (accept_char (&ps, ','));
 
-    version = (int) json_object_get_int_member (object, "version");
-    if (version < 1) {
-        seaf_debug ("Dir object %s version should be > 0, version is %d.\n",
-                    dir_id, version);
-        return NULL;
-    }
+    if (!accept_char (&ps, '}'))
+        goto fallback;
+    skip_ws (&ps);
+    if (ps.p != ps.end)
+        goto fallback;
 
-    dirent_array = json_object_get (object, "dirents");
-    if (!dirent_array) {
-        seaf_debug ("No dirents in dir object %s.\n", dir_id);
-        return NULL;
-    }
+    if (type != SEAF_METADATA_TYPE_DIR || version < 1 || !has_dirents)
+        goto fallback;
 
     dir = g_new0 (SeafDir, 1);
-
     dir->object.type = SEAF_METADATA_TYPE_DIR;
-
     memcpy (dir->dir_id, dir_id, 40);
-    dir->version = version;
+    dir->version = (int)version;
+    dir->arena = arena;
+    dir->arena_size = arena_size;
 
-    size_t n_dirents = json_array_size (dirent_array);
-    int i;
-    json_t *dirent_obj;
-    SeafDirent *dirent;
-    for (i = 0; i < n_dirents; ++i) {
-        dirent_obj = json_array_get (dirent_array, i);
-        dirent = parse_dirent (dir_id, version, dirent_obj);
-        if (!dirent) {
-            seaf_dir_free (dir);
-            return NULL;
-        }
-        dir->entries = g_list_prepend (dir->entries, dirent);
+    for (i = n_dents - 1; i >= 0; --i) {
+        dents[i].version = dir->version;
+        dir->entries = g_list_prepend (dir->entries, &dents[i]);
     }
-    dir->entries = g_list_reverse (dir->entries);
 
     return dir;
+
+fallback:
+    g_free (arena);
+    return NULL;
 }
 
 static SeafDir *
@@ -1550,6 +2286,12 @@ seaf_dir_from_json (const char *dir_id, uint8_t *data, int len)
         return NULL;
     }
 
+    dir = seaf_dir_from_json_fast (dir_id, (const char *)decompressed, outlen);
+    if (dir) {
+        g_free (decompressed);
+        return dir;
+    }
+
     object = json_loadb ((const char *)decompressed, outlen, 0, &error);
     g_free (decompressed);
     if (!object) {
@@ -1633,12 +2375,110 @@ add_to_dirent_array (json_t *array, SeafDirent *dirent)
     json_array_append_new (array, object);
 }
 
+static void
+append_json_string (GString *buf, const char *s)
+{
+    const unsigned char *p;
+
+    g_string_append_c (buf, '"');
+    for (p = (const unsigned char *)s; *p; ++p) {
+        switch (*p) {
+        case '"':
+            g_string_append (buf, "\\\"");
+            break;
+        case '\\':
+            g_string_append (buf, "\\\\");
+            break;
+        case '\b':
+            g_string_append (buf, "\\b");
+            break;
+        case '\f':
+            g_string_append (buf, "\\f");
+            break;
+        case '\n':
+            g_string_append (buf, "\\n");
+            break;
+        case '\r':
+            g_string_append (buf, "\\r");
+            break;
+        case '\t':
+            g_string_append (buf, "\\t");
+            break;
+        default:
+            if (*p < 0x20)
+                g_string_append_printf (buf, "\\u%04X", *p);
+            else
+                g_string_append_c (buf, *p);
+            break;
+        }
+    }
+    g_string_append_c (buf, '"');
+}
+
+/*
+ * Writes the same bytes as json_dumps() with JSON_SORT_KEYS does for the
+ * object built below, so dir ids don't change. jansson leaves out strings
+ * that aren't valid UTF-8, so such dirs are still serialized by it.
+ */
+static char *
+seaf_dir_to_json_fast (SeafDir *dir, int *len)
+{
+    GString *buf;
+    GList *ptr;
+    SeafDirent *dent;
+
+    for (ptr = dir->entries; ptr; ptr = ptr->next) {
+        dent = ptr->data;
+        if (!g_utf8_validate (dent->id, -1, NULL) ||
+            !g_utf8_validate (dent->name, -1, NULL))
+            return NULL;
+        if (S_ISREG(dent->mode) &&
+            (!dent->modifier || !g_utf8_validate (dent->modifier, -1, NULL)))
+            return NULL;
+    }
+
+    buf = g_string_sized_new (64 + 160 * g_list_length (dir->entries));
+
+    g_string_append (buf, "{\"dirents\": [");
+    for (ptr = dir->entries; ptr; ptr = ptr->next) {
+        dent = ptr->data;
+        if (ptr != dir->entries)
+            g_string_append (buf, ", ");
+
+        g_string_append (buf, "{\"id\": ");
+        append_json_string (buf, dent->id);
+        g_string_append_printf (buf, ", \"mode\": %u", dent->mode);
+        if (S_ISREG(dent->mode)) {
+            g_string_append (buf, ", \"modifier\": ");
+            append_json_string (buf, dent->modifier);
+        }
+        g_string_append_printf (buf, ", \"mtime\": %"G_GINT64_FORMAT
+                                ", \"name\": ", dent->mtime);
+        append_json_string (buf, dent->name);
+        if (S_ISREG(dent->mode))
+            g_string_append_printf (buf, ", \"size\": %"G_GINT64_FORMAT,
+                                    dent->size);
+        g_string_append_c (buf, '}');
+    }
+    g_string_append_printf (buf, "], \"type\": %d, \"version\": %d}",
+                            SEAF_METADATA_TYPE_DIR, dir->version);
+
+    *len = (int)buf->len;
+    return g_string_free (buf, FALSE);
+}
+
 static void *
 seaf_dir_to_json (SeafDir *dir, int *len)
 {
     json_t *object, *dirent_array;
     GList *ptr;
     SeafDirent *dirent;
+    char *data;
+    unsigned char sha1[20];
+
+    data = seaf_dir_to_json_fast (dir, len);
+    if (data)
+        goto out;
 
     object = json_object ();
 
@@ -1652,15 +2492,15 @@ seaf_dir_to_json (SeafDir *dir, int *len)
     }
     json_object_set_new (object, "dirents", dirent_array);
 
-    char *data = json_dumps (object, JSON_SORT_KEYS);
+    data = json_dumps (object, JSON_SORT_KEYS);
     *len = strlen(data);
+    json_decref (object);
 
+out:
     /* The dir object id is sha1 hash of the json object. */
-    unsigned char sha1[20];
     calculate_sha1 (sha1, data, *len);
     rawdata_to_hex (sha1, dir->dir_id, 20);
 
-    json_decref (object);
     return data;
 }
 
@@ -1676,7 +2516,8 @@ seaf_dir_to_data (SeafDir *dir, int *len)
         if (!data)
             return NULL;
 
-        if (seaf_compress (data, orig_len, &compressed, len) < 0) {
+        if (seaf_compress_with_codec (seaf->fs_mgr->priv->compress_codec,
+                                      data, orig_len, &compressed, len) < 0) {
             seaf_warning ("Failed to compress dir object %s.\n", dir->dir_id);
             g_free (data);
             return NULL;
@@ -1707,6 +2548,164 @@ seaf_dir_save (SeafFSManager *fs_mgr,
     return ret;
 }
 
+static SeafDir *
+seaf_dir_copy (SeafDir *dir)
+{
+    SeafDir *copy;
+    GList *ptr, *entries = NULL;
+
+    copy = g_new0 (SeafDir, 1);
+    copy->object = dir->object;
+    copy->version = dir->version;
+    memcpy (copy->dir_id, dir->dir_id, 41);
+
+    if (dir->arena) {
+        /* Copy the arena and move the pointers into it over. */
+        char *base = dir->arena;
+        char *copy_base = g_memdup (dir->arena, dir->arena_size);
+        SeafDirent *dent;
+
+        for (ptr = dir->entries; ptr; ptr = ptr->next) {
+            dent = (SeafDirent *)(copy_base + ((char *)ptr->data - base));
+            dent->name = copy_base + (dent->name - base);
+            if (dent->modifier)
+                dent->modifier = copy_base + (dent->modifier - base);
+            entries = g_list_prepend (entries, dent);
+        }
+        copy->arena = copy_base;
+        copy->arena_size = dir->arena_size;
+    } else {
+        for (ptr = dir->entries; ptr; ptr = ptr->next)
+            entries = g_list_prepend (entries, seaf_dirent_dup (ptr->data));
+    }
+    copy->entries = g_list_reverse (entries);
+
+    if (dir->ondisk) {
+        copy->ondisk = g_memdup (dir->ondisk, dir->ondisk_size);
+        copy->ondisk_size = dir->ondisk_size;
+    }
+
+    return copy;
+}
+
+static gint64
+seaf_dir_mem_size (SeafDir *dir)
+{
+    gint64 size = sizeof(SeafDir) + sizeof(DirCacheEntry) + dir->ondisk_size;
+    GList *ptr;
+    SeafDirent *dent;
+
+    if (dir->arena)
+        return size + dir->arena_size +
+            sizeof(GList) * g_list_length (dir->entries);
+
+    for (ptr = dir->entries; ptr; ptr = ptr->next) {
+        dent = ptr->data;
+        size += sizeof(GList) + sizeof(SeafDirent) + dent->name_len + 1;
+        if (dent->modifier)
+            size += strlen(dent->modifier) + 1;
+    }
+
+    return size;
+}
+
+static void
+make_cache_key (char *key, const char *repo_id, const char *obj_id)
+{
+    snprintf (key, CACHE_KEY_SIZE, "%s/%s", repo_id, obj_id);
+}
+
+/* Returns a copy of the cached dir, which the caller owns. */
+static SeafDir *
+dir_cache_lookup (SeafFSManagerPriv *priv, const char *repo_id,
+                  const char *dir_id)
+{
+    char key[CACHE_KEY_SIZE];
+    DirCacheEntry *entry;
+    SeafDir *dir = NULL;
+
+    make_cache_key (key, repo_id, dir_id);
+
+    pthread_mutex_lock (&priv->dir_cache_lock);
+
+    entry = g_hash_table_lookup (priv->dir_cache, key);
+    if (entry) {
+        g_queue_unlink (priv->dir_lru, entry->link);
+        g_queue_push_head_link (priv->dir_lru, entry->link);
+        dir = seaf_dir_copy (entry->dir);
+        ++(priv->dir_cache_hits);
+    } else {
+        ++(priv->dir_cache_misses);
+    }
+
+    pthread_mutex_unlock (&priv->dir_cache_lock);
+
+    return dir;
+}
+
+/* Caches a copy of @dir. */
+static void
+dir_cache_insert (SeafFSManagerPriv *priv, const char *repo_id, SeafDir *dir)
+{
+    char key[CACHE_KEY_SIZE];
+    DirCacheEntry *entry, *old;
+    gint64 mem = seaf_dir_mem_size (dir);
+
+    /* Don't let one huge dir flush the whole cache. */
+    if (mem > DIR_CACHE_MAX_MEM / 8)
+        return;
+
+    make_cache_key (key, repo_id, dir->dir_id);
+
+    entry = g_new0 (DirCacheEntry, 1);
+    entry->dir = seaf_dir_copy (dir);
+    entry->mem = mem;
+
+    pthread_mutex_lock (&priv->dir_cache_lock);
+
+    if (g_hash_table_lookup (priv->dir_cache, key)) {
+        /* Inserted by another thread. */
+        pthread_mutex_unlock (&priv->dir_cache_lock);
+        seaf_dir_free (entry->dir);
+        g_free (entry);
+        return;
+    }
+
+    entry->key = g_strdup (key);
+    g_queue_push_head (priv->dir_lru, entry);
+    entry->link = priv->dir_lru->head;
+    g_hash_table_insert (priv->dir_cache, entry->key, entry);
+    priv->dir_cache_mem += mem;
+
+    while (priv->dir_cache_mem > DIR_CACHE_MAX_MEM) {
+        old = g_queue_pop_tail (priv->dir_lru);
+        g_hash_table_remove (priv->dir_cache, old->key);
+        priv->dir_cache_mem -= old->mem;
+        seaf_dir_free (old->dir);
+        g_free (old->key);
+        g_free (old);
+    }
+
+    pthread_mutex_unlock (&priv->dir_cache_lock);
+}
+
+void
+seaf_fs_manager_get_dir_cache_stats (SeafFSManager *mgr,
+                                     gint64 *hits,
+                                     gint64 *misses,
+                                     int *n_entries,
+                                     gint64 *mem_used)
+{
+    SeafFSManagerPriv *priv = mgr->priv;
+
+    pthread_mutex_lock (&priv->dir_cache_lock);
+    *hits = priv->dir_cache_hits;
+    *misses = priv->dir_cache_misses;
+    *n_entries = (int)g_hash_table_size (priv->dir_cache);
+    *mem_used = priv->dir_cache_mem;
+    pthread_mutex_unlock (&priv->dir_cache_lock);
+}
+
 SeafDir *
 seaf_fs_manager_get_seafdir (SeafFSManager *mgr,
                              const char *repo_id,
@@ -1717,8 +2716,6 @@ seaf_fs_manager_get_seafdir (SeafFSManager *mgr,
     int len;
     SeafDir *dir;
 
-    /* TODO: add hash cache */
-
     if (memcmp (dir_id, EMPTY_SHA1, 40) == 0) {
         dir = g_new0 (SeafDir, 1);
         dir->version = version;
@@ -1726,6 +2723,10 @@ seaf_fs_manager_get_seafdir (SeafFSManager *mgr,
         return dir;
     }
 
+    dir = dir_cache_lookup (mgr->priv, repo_id, dir_id);
+    if (dir)
+        return dir;
+
     if (seaf_obj_store_read_obj (mgr->obj_store, repo_id, version,
                                  dir_id, &data, &len) < 0) {
         seaf_warning ("[fs mgr] Failed to read dir %s.\n", dir_id);
@@ -1735,6 +2736,9 @@ seaf_fs_manager_get_seafdir (SeafFSManager *mgr,
     dir = seaf_dir_from_data (dir_id, data, len, (version > 0));
     g_free (data);
 
+    if (dir)
+        dir_cache_insert (mgr->priv, repo_id, dir);
+
     return dir;
 }
 
@@ -1939,13 +2943,16 @@ seaf_fs_object_free (SeafFSObject *obj)
         seaf_dir_free ((SeafDir *)obj);
 }
 
+/* Must be a power of 2. */
+#define BLOCK_LIST_INIT_SLOTS 1024
+
 BlockList *
 block_list_new ()
 {
     BlockList *bl = g_new0 (BlockList, 1);
 
-    bl->block_hash = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
-    bl->block_ids = g_ptr_array_new_with_free_func (g_free);
+    bl->n_slots = BLOCK_LIST_INIT_SLOTS;
+    bl->slots = g_new0 (uint32_t, bl->n_slots);
 
     return bl;
 }
@@ -1953,42 +2960,110 @@ block_list_new ()
 void
 block_list_free (BlockList *bl)
 {
-    if (bl->block_hash)
-        g_hash_table_destroy (bl->block_hash);
-    g_ptr_array_free (bl->block_ids, TRUE);
+    g_free (bl->ids);
+    g_free (bl->slots);
     g_free (bl);
 }
 
-void
+/* Returns the slot holding @id, or the empty slot where it would go. */
+static uint32_t
+block_list_find_slot (BlockList *bl, const guint8 *id)
+{
+    uint32_t mask = bl->n_slots - 1;
+    uint32_t i, idx;
+
+    /* Block ids are SHA-1 hashes, any 4 bytes are well distributed. */
+    memcpy (&i, id, sizeof(i));
+    i &= mask;
+
+    while ((idx = bl->slots[i]) != 0) {
+        if (memcmp (bl->ids + (gsize)(idx - 1) * 20, id, 20) == 0)
+            break;
+        i = (i + 1) & mask;
+    }
+
+    return i;
+}
+
+static void
+block_list_grow_slots (BlockList *bl)
+{
+    uint32_t i;
+
+    g_free (bl->slots);
+    bl->n_slots *= 2;
+    bl->slots = g_new0 (uint32_t, bl->n_slots);
+
+    for (i = 0; i < bl->n_blocks; ++i)
+        bl->slots[block_list_find_slot (bl, bl->ids + (gsize)i * 20)] = i + 1;
+}
+
+static gboolean
+block_list_insert_raw (BlockList *bl, const guint8 *id)
+{
+    uint32_t slot;
+
+    slot = block_list_find_slot (bl, id);
+    if (bl->slots[slot] != 0)
+        return FALSE;
+
+    if (bl->n_blocks == bl->capacity) {
+        bl->capacity = bl->capacity ? bl->capacity * 2 : BLOCK_LIST_INIT_SLOTS;
+        bl->ids = g_realloc (bl->ids, (gsize)bl->capacity * 20);
+    }
+    memcpy (bl->ids + (gsize)bl->n_blocks * 20, id, 20);
+    bl->slots[slot] = ++bl->n_blocks;
+
+    /* Keep the table at most 3/4 full. */
+    if ((guint64)bl->n_blocks * 4 > (guint64)bl->n_slots * 3)
+        block_list_grow_slots (bl);
+
+    return TRUE;
+}
+
+gboolean
 block_list_insert (BlockList *bl, const char *block_id)
 {
-    if (g_hash_table_lookup (bl->block_hash, block_id))
-        return;
+    guint8 id[20];
+
+    if (hex_to_rawdata (block_id, id, 20) < 0) {
+        seaf_warning ("Invalid block id %s.\n", block_id);
+        return FALSE;
+    }
+
+    return block_list_insert_raw (bl, id);
+}
+
+gboolean
+block_list_contains (BlockList *bl, const char *block_id)
+{
+    guint8 id[20];
+
+    if (hex_to_rawdata (block_id, id, 20) < 0)
+        return FALSE;
 
-    char *key = g_strdup(block_id);
-    g_hash_table_replace (bl->block_hash, key, key);
-    g_ptr_array_add (bl->block_ids, g_strdup(block_id));
-    ++bl->n_blocks;
+    return bl->slots[block_list_find_slot (bl, id)] != 0;
+}
+
+void
+block_list_get_id (BlockList *bl, uint32_t i, char *block_id)
+{
+    rawdata_to_hex (bl->ids + (gsize)i * 20, block_id, 20);
 }
 
 BlockList *
 block_list_difference (BlockList *bl1, BlockList *bl2)
 {
     BlockList *bl;
-    int i;
-    char *block_id;
-    char *key;
+    const guint8 *id;
+    uint32_t i;
 
     bl = block_list_new ();
 
-    for (i = 0; i < bl1->block_ids->len; ++i) {
-        block_id = g_ptr_array_index (bl1->block_ids, i);
-        if (g_hash_table_lookup (bl2->block_hash, block_id) == NULL) {
-            key = g_strdup(block_id);
-            g_hash_table_replace (bl->block_hash, key, key);
-            g_ptr_array_add (bl->block_ids, g_strdup(block_id));
-            ++bl->n_blocks;
-        }
+    for (i = 0; i < bl1->n_blocks; ++i) {
+        id = bl1->ids + (gsize)i * 20;
+        if (bl2->slots[block_list_find_slot (bl2, id)] == 0)
+            block_list_insert_raw (bl, id);
     }
 
     return bl;
@@ -2343,6 +3418,75 @@ seaf_fs_manager_count_fs_files (SeafFSManager *mgr,
      return count_dir_files (mgr, repo_id, version, root_id);
 }
 
+static gboolean
+path_cache_lookup (SeafFSManagerPriv *priv, const char *repo_id,
+                   const char *root_id, const char *path, char *dir_id)
+{
+    char key[CACHE_KEY_SIZE];
+    gpointer root_key;
+    GHashTable *paths;
+    const char *id;
+    gboolean ret = FALSE;
+
+    make_cache_key (key, repo_id, root_id);
+
+    pthread_mutex_lock (&priv->path_cache_lock);
+
+    if (g_hash_table_lookup_extended (priv->path_cache, key,
+                                      &root_key, (gpointer *)&paths)) {
+        if (priv->path_roots->head->data != root_key) {
+            g_queue_remove (priv->path_roots, root_key);
+            g_queue_push_head (priv->path_roots, root_key);
+        }
+
+        id = g_hash_table_lookup (paths, path);
+        if (id) {
+            memcpy (dir_id, id, 41);
+            ret = TRUE;
+        }
+    }
+
+    pthread_mutex_unlock (&priv->path_cache_lock);
+
+    return ret;
+}
+
+static void
+path_cache_insert (SeafFSManagerPriv *priv, const char *repo_id,
+                   const char *root_id, const char *path, const char *dir_id)
+{
+    char key[CACHE_KEY_SIZE];
+    GHashTable *paths;
+    char *root_key;
+
+    make_cache_key (key, repo_id, root_id);
+
+    pthread_mutex_lock (&priv->path_cache_lock);
+
+    paths = g_hash_table_lookup (priv->path_cache, key);
+    if (!paths) {
+        paths = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                       g_free, g_free);
+        root_key = g_strdup (key);
+        g_hash_table_insert (priv->path_cache, root_key, paths);
+        g_queue_push_head (priv->path_roots, root_key);
+
+        if (g_queue_get_length (priv->path_roots) > PATH_CACHE_ROOTS)
+            g_hash_table_remove (priv->path_cache,
+                                 g_queue_pop_tail (priv->path_roots));
+    }
+
+    if (g_hash_table_size (paths) < PATH_CACHE_MAX_PATHS)
+        g_hash_table_replace (paths, g_strdup(path), g_strdup(dir_id));
+
+    pthread_mutex_unlock (&priv->path_cache_lock);
+}
+
+/*
+ * Checkout and conflict handling look up many paths in the same dirs, so
+ * the lookup starts from the deepest dir of @path whose id is cached for
+ * this root.
+ */
 SeafDir *
 seaf_fs_manager_get_seafdir_by_path (SeafFSManager *mgr,
                                      const char *repo_id,
@@ -2351,27 +3495,60 @@ seaf_fs_manager_get_seafdir_by_path (SeafFSManager *mgr,
                                      const char *path,
                                      GError **error)
 {
+    SeafFSManagerPriv *priv = mgr->priv;
     SeafDir *dir;
     SeafDirent *dent;
-    const char *dir_id = root_id;
-    char *name, *saveptr;
-    char *tmp_path = g_strdup(path);
+    char dir_id[41];
+    char **names;
+    char **parts;
+    GString *norm;
+    int *ends;
+    int n_names = 0;
+    int start = 0;
+    int i;
+    char c;
+
+    /* Normalise @path to names joined by single slashes. */
+    names = g_strsplit (path, "/", -1);
+    norm = g_string_new (NULL);
+    parts = g_new0 (char *, g_strv_length (names) + 1);
+    /* Length of the path of the first i names. */
+    ends = g_new0 (int, g_strv_length (names) + 1);
+    for (i = 0; names[i] != NULL; ++i) {
+        if (*names[i] == 0)
+            continue;
+        if (n_names > 0)
+            g_string_append_c (norm, '/');
+        g_string_append (norm, names[i]);
+        parts[n_names++] = names[i];
+        ends[n_names] = norm->len;
+    }
+
+    memcpy (dir_id, root_id, 40);
+    dir_id[40] = 0;
+    for (i = n_names; i > 0; --i) {
+        c = norm->str[ends[i]];
+        norm->str[ends[i]] = 0;
+        if (path_cache_lookup (priv, repo_id, root_id, norm->str, dir_id))
+            start = i;
+        norm->str[ends[i]] = c;
+        if (start > 0)
+            break;
+    }
 
     dir = seaf_fs_manager_get_seafdir (mgr, repo_id, version, dir_id);
     if (!dir) {
         g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_DIR_MISSING, "directory is missing");
-        g_free (tmp_path);
-        return NULL;
+        goto out;
     }
 
-    name = strtok_r (tmp_path, "/", &saveptr);
-    while (name != NULL) {
+    for (i = start; i < n_names; ++i) {
         GList *l;
         for (l = dir->entries; l != NULL; l = l->next) {
             dent = l->data;
 
-            if (strcmp(dent->name, name) == 0 && S_ISDIR(dent->mode)) {
-                dir_id = dent->id;
+            if (strcmp(dent->name, parts[i]) == 0 && S_ISDIR(dent->mode)) {
+                memcpy (dir_id, dent->id, 41);
                 break;
             }
         }
@@ -2394,10 +3571,17 @@ seaf_fs_manager_get_seafdir_by_path (SeafFSManager *mgr,
             break;
         }
 
-        name = strtok_r (NULL, "/", &saveptr);
+        c = norm->str[ends[i + 1]];
+        norm->str[ends[i + 1]] = 0;
+        path_cache_insert (priv, repo_id, root_id, norm->str, dir_id);
+        norm->str[ends[i + 1]] = c;
     }
 
-    g_free (tmp_path);
+out:
+    g_free (ends);
+    g_free (parts);
+    g_string_free (norm, TRUE);
+    g_strfreev (names);
     return dir;
 }
 
@@ -2855,6 +4039,22 @@ seaf_fs_manager_verify_object (SeafFSManager *mgr,
     return ret;
 }
 
+gboolean
+seaf_fs_manager_verify_object_data (SeafFSManager *mgr,
+                                    int version,
+                                    const char *obj_id,
+                                    void *data,
+                                    int len)
+{
+    if (memcmp (obj_id, EMPTY_SHA1, 40) == 0)
+        return TRUE;
+
+    if (version == 0)
+        return verify_fs_object_v0 (obj_id, data, len, TRUE);
+    else
+        return verify_fs_object_json (obj_id, data, len);
+}
+
 int
 dir_version_from_repo_version (int repo_version)
 {
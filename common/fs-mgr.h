@@ -83,6 +83,12 @@ struct _SeafDir {
     /* data in on-disk format. */
     void  *ondisk;
     int    ondisk_size;
+
+    /* Dirents and their strings, for dirs parsed from json objects. These
+     * dirents are freed with the dir, never by seaf_dirent_free().
+     */
+    void  *arena;
+    gsize  arena_size;
 };
 
 SeafDir *
@@ -127,10 +133,17 @@ seaf_fs_object_from_data (const char *obj_id,
 void
 seaf_fs_object_free (SeafFSObject *obj);
 
+/*
+ * A set of block ids that also keeps their insertion order. Ids are kept
+ * as 20-byte binary in one array, indexed by an open addressing table, so
+ * that a list of millions of blocks takes tens of megabytes.
+ */
 typedef struct {
-    /* TODO: GHashTable may be inefficient when we have large number of IDs. */
-    GHashTable  *block_hash;
-    GPtrArray   *block_ids;
+    guint8      *ids;           /* n_blocks raw ids, in insertion order */
+    uint32_t     capacity;
+    /* Index into @ids plus one for each used slot, 0 for empty ones. */
+    uint32_t    *slots;
+    uint32_t     n_slots;
     uint32_t     n_blocks;
     uint32_t     n_valid_blocks;
 } BlockList;
@@ -141,9 +154,17 @@ block_list_new ();
 void
 block_list_free (BlockList *bl);
 
-void
+/* Returns FALSE if @block_id was already in @bl. */
+gboolean
 block_list_insert (BlockList *bl, const char *block_id);
 
+gboolean
+block_list_contains (BlockList *bl, const char *block_id);
+
+/* Copy the @i-th inserted id to @block_id, which must hold 41 bytes. */
+void
+block_list_get_id (BlockList *bl, uint32_t i, char *block_id);
+
 /* Return a blocklist containing block ids which are in @bl1 but
  * not in @bl2.
  */
@@ -169,6 +190,14 @@ seaf_fs_manager_new (struct _SeafileSession *seaf,
 int
 seaf_fs_manager_init (SeafFSManager *mgr);
 
+/* Statistics of the cache of parsed dir objects. */
+void
+seaf_fs_manager_get_dir_cache_stats (SeafFSManager *mgr,
+                                     gint64 *hits,
+                                     gint64 *misses,
+                                     int *n_entries,
+                                     gint64 *mem_used);
+
 #ifndef SEAFILE_SERVER
 
 int 
@@ -186,6 +215,31 @@ seaf_fs_manager_checkout_file (SeafFSManager *mgr,
                                gboolean *conflicted,
                                const char *email);
 
+/* Create the tmp file that a checkout of @file_path is first written to.
+ * Returns the fd, or -1 on error. *tmp_path is always set.
+ */
+int
+seaf_fs_manager_create_checkout_tmp_file (const char *file_path,
+                                          guint32 mode,
+                                          char **tmp_path);
+
+/* Same as seaf_fs_manager_checkout_file(), for content that has already been
+ * written to @staged_path, a file created with
+ * seaf_fs_manager_create_checkout_tmp_file().
+ */
+int
+seaf_fs_manager_checkout_staged_file (SeafFSManager *mgr,
+                                      const char *repo_id,
+                                      int version,
+                                      const char *staged_path,
+                                      const char *file_path,
+                                      guint64 mtime,
+                                      const char *in_repo_path,
+                                      const char *conflict_head_id,
+                                      gboolean force_conflict,
+                                      gboolean *conflicted,
+                                      const char *email);
+
 #endif  /* not SEAFILE_SERVER */
 
 /**
@@ -215,6 +269,26 @@ seaf_fs_manager_index_existed_file_blocks (SeafFSManager *mgr,
                                            GList *blockids,
                                            unsigned char sha1[],
                                            gint64 file_size);
+
+/* Ids and plaintext lengths of the blocks of a file, in file order. */
+typedef struct FileBlockMap {
+    int n_blocks;
+    uint8_t *blk_sha1s;
+    uint32_t *blk_lens;
+} FileBlockMap;
+
+void
+file_block_map_free (FileBlockMap *map);
+
+/*
+ * If @block_map is not NULL, it's set to the blocks of the file when it's
+ * chunked with CDC, and to NULL otherwise.
+ * If @write_data is set but not @write_blocks, the file object is saved
+ * but blocks chunked with CDC are only hashed. If @write_data isn't set,
+ * nothing is written and @sha1 is the id the file would get.
+ * Without @use_cdc, the file is split into blocks of @fixed_block_size
+ * bytes, or of the CDC average block size if it's 0.
+ */
 int
 seaf_fs_manager_index_blocks (SeafFSManager *mgr,
                               const char *repo_id,
@@ -224,7 +298,10 @@ seaf_fs_manager_index_blocks (SeafFSManager *mgr,
                               gint64 *size,
                               SeafileCrypt *crypt,
                               gboolean write_data,
-                              gboolean use_cdc);
+                              gboolean write_blocks,
+                              gboolean use_cdc,
+                              guint32 fixed_block_size,
+                              FileBlockMap **block_map);
 
 Seafile *
 seaf_fs_manager_get_seafile (SeafFSManager *mgr,
@@ -408,6 +485,14 @@ seaf_fs_manager_verify_object (SeafFSManager *mgr,
                                gboolean verify_id,
                                gboolean *io_error);
 
+/* Checks the id and format of an object that isn't in the store yet. */
+gboolean
+seaf_fs_manager_verify_object_data (SeafFSManager *mgr,
+                                    int version,
+                                    const char *obj_id,
+                                    void *data,
+                                    int len);
+
 int
 dir_version_from_repo_version (int repo_version);
 
@@ -12,11 +12,13 @@
 
 #include "common.h"
 #include "utils.h"
+#include "sha1-util.h"
 
 #include "log.h"
 
 #include "index.h"
 #include "../seafile-crypt.h"
+#include "../metrics.h"
 /* #include "../vc-utils.h" */
 /* #include "cache-tree.h" */
 
@@ -72,11 +74,95 @@ static void replace_index_entry(struct index_state *istate, int nr, struct cache
     istate->cache_changed = 1;
 }
 
+/*
+ * Entries read from disk are allocated in large blocks owned by the
+ * index_state and marked with CE_ARENA. cache_entry_free() leaves them
+ * alone; the blocks are freed together by discard_index().
+ */
+
+#define CE_ARENA_BLOCK_SIZE (1 << 20)
+
+struct ce_arena {
+    struct ce_arena *next;
+    size_t used;
+    size_t size;
+    /* entries follow */
+};
+
+#define CE_ARENA_HDR_SIZE ((sizeof(struct ce_arena) + 7) & ~(size_t)7)
+
+static struct cache_entry *arena_alloc_ce(struct index_state *istate, size_t size)
+{
+    struct ce_arena *block = istate->arena;
+    struct cache_entry *ce;
+
+    if (!block || block->size - block->used < size) {
+        size_t block_size = MAX(size, CE_ARENA_BLOCK_SIZE);
+
+        block = malloc(CE_ARENA_HDR_SIZE + block_size);
+        block->used = 0;
+        block->size = block_size;
+        if (istate->arena && size > CE_ARENA_BLOCK_SIZE) {
+            /* Keep filling the current block after a large entry. */
+            block->next = istate->arena->next;
+            istate->arena->next = block;
+        } else {
+            block->next = istate->arena;
+            istate->arena = block;
+        }
+    }
+
+    ce = (struct cache_entry *)((char *)block + CE_ARENA_HDR_SIZE + block->used);
+    block->used += size;
+    memset(ce, 0, size);
+    return ce;
+}
+
+static void arena_free(struct index_state *istate)
+{
+    struct ce_arena *block, *next;
+
+    for (block = istate->arena; block; block = next) {
+        next = block->next;
+        free(block);
+    }
+    istate->arena = NULL;
+}
+
+/* Allocates from the arena of @istate, or from the heap if it's NULL. */
+static struct cache_entry *alloc_disk_ce(struct index_state *istate, size_t size)
+{
+    struct cache_entry *ce;
+
+    if (!istate)
+        return calloc(1, size);
+
+    ce = arena_alloc_ce(istate, size);
+    ce->ce_flags = CE_ARENA;
+    return ce;
+}
+
+static const char *intern_modifier(const char *str, size_t len)
+{
+    char buf[256];
+    char *tmp;
+    const char *ret;
+
+    if (len < sizeof(buf)) {
+        memcpy(buf, str, len);
+        buf[len] = 0;
+        return g_intern_string(buf);
+    }
+
+    tmp = g_strndup(str, len);
+    ret = g_intern_string(tmp);
+    g_free(tmp);
+    return ret;
+}
+
 static int verify_hdr(struct cache_header *hdr, unsigned long size)
 {
-    GChecksum *c;
     unsigned char sha1[20];
-    gsize len = 20;
 
     if (hdr->hdr_signature != htonl(CACHE_SIGNATURE)) {
         g_critical("bad signature\n");
@@ -87,10 +173,7 @@ static int verify_hdr(struct cache_header *hdr, unsigned long size)
         g_critical("bad index version\n");
         return -1;
     }
-    c = g_checksum_new (G_CHECKSUM_SHA1);
-    g_checksum_update(c, (unsigned char *)hdr, size - 20);
-    g_checksum_get_digest (c, sha1, &len);
-    g_checksum_free (c);
+    seaf_sha1 ((unsigned char *)hdr, size - 20, sha1);
     if (hashcmp(sha1, (unsigned char *)hdr + size - 20)) {
         g_critical("bad index file sha1 signature\n");
         return -1;
@@ -98,7 +181,8 @@ static int verify_hdr(struct cache_header *hdr, unsigned long size)
     return 0;
 }
 
-static int convert_from_disk(struct ondisk_cache_entry *ondisk, struct cache_entry **ce)
+static int convert_from_disk(struct index_state *istate,
+                             struct ondisk_cache_entry *ondisk, struct cache_entry **ce)
 {
     size_t len;
     const char *name;
@@ -128,7 +212,7 @@ static int convert_from_disk(struct ondisk_cache_entry *ondisk, struct cache_ent
     if (len == CE_NAMEMASK)
         len = strlen(name);
 
-    ret = calloc(1, cache_entry_size(len));
+    ret = alloc_disk_ce(istate, cache_entry_size(len));
 
     ret->ce_ctime.sec = ntohl(ondisk->ctime.sec);
     ret->ce_mtime.sec = ntohl(ondisk->mtime.sec);
@@ -139,7 +223,7 @@ static int convert_from_disk(struct ondisk_cache_entry *ondisk, struct cache_ent
     ret->ce_gid   = ntohl(ondisk->gid);
     ret->ce_size  = ntoh64(ondisk->size);
     /* On-disk flags are just 16 bits */
-    ret->ce_flags = flags;
+    ret->ce_flags |= flags;
 
     hashcpy(ret->sha1, ondisk->sha1);
 
@@ -154,7 +238,8 @@ static int convert_from_disk(struct ondisk_cache_entry *ondisk, struct cache_ent
     return 0;
 }
 
-static int convert_from_disk2(struct ondisk_cache_entry2 *ondisk, struct cache_entry **ce)
+static int convert_from_disk2(struct index_state *istate,
+                              struct ondisk_cache_entry2 *ondisk, struct cache_entry **ce)
 {
     size_t len;
     const char *name;
@@ -170,7 +255,7 @@ static int convert_from_disk2(struct ondisk_cache_entry2 *ondisk, struct cache_e
     if (len == CE_NAMEMASK)
         len = strlen(name);
 
-    ret = calloc(1, cache_entry_size(len));
+    ret = alloc_disk_ce(istate, cache_entry_size(len));
 
     ret->ce_ctime.sec = ntoh64(ondisk->ctime.sec);
     ret->ce_mtime.sec = ntoh64(ondisk->mtime.sec);
@@ -181,7 +266,7 @@ static int convert_from_disk2(struct ondisk_cache_entry2 *ondisk, struct cache_e
     ret->ce_gid   = ntohl(ondisk->gid);
     ret->ce_size  = ntoh64(ondisk->size);
     /* On-disk flags are just 16 bits */
-    ret->ce_flags = flags;
+    ret->ce_flags |= flags;
 
     hashcpy(ret->sha1, ondisk->sha1);
 
@@ -198,7 +283,7 @@ static int convert_from_disk2(struct ondisk_cache_entry2 *ondisk, struct cache_e
 
 static int read_modifiers (struct index_state *istate, void *data, unsigned int size)
 {
-    char *p = data, *sep = data, *modifier;
+    char *p = data, *sep = data;
     unsigned int i;
     unsigned int idx = 0;
 
@@ -212,8 +297,7 @@ static int read_modifiers (struct index_state *istate, void *data, unsigned int
                 return -1;
             }
 
-            modifier = g_strndup(p, sep - p);
-            istate->cache[idx]->modifier = modifier;
+            istate->cache[idx]->modifier = intern_modifier(p, sep - p);
             idx++;
             p = sep + 1;
         }
@@ -257,12 +341,299 @@ static void alloc_index (struct index_state *istate)
     istate->i_name_hash = g_hash_table_new_full (g_str_hash, g_str_equal,
                                                  g_free, NULL);
 #endif
+    istate->removed_names = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                   g_free, NULL);
     istate->initialized = 1;
     istate->name_hash_initialized = 1;
 }
 
-/* remember to discard_cache() before reading a different cache! */
-int read_index_from(struct index_state *istate, const char *path, int repo_version)
+/*
+ * The delta log "<index>.delta" holds the changes made after the index
+ * was last rewritten. It starts with a header naming the index it applies
+ * to, followed by batches of records, one batch per write_index_delta():
+ *
+ *   'U' <modifier len, 16 bits> <ondisk_cache_entry2> <modifier>
+ *   'D' <name len, 16 bits> <name>
+ *   'E' <number of records, 32 bits> <sha1 of the batch up to here>
+ *
+ * A later record for the same name replaces an earlier one. A batch that
+ * is cut short or doesn't match its checksum is ignored with everything
+ * after it.
+ */
+
+#define INDEX_DELTA_SIGNATURE 0x444c5441 /* "DLTA" */
+#define INDEX_DELTA_VERSION 1
+
+/* Smaller indexes are rewritten as a whole on each update. */
+#define INDEX_DELTA_MIN_ENTRIES 10000
+/* Fold the delta log into the index when it's larger than 1/8 of it. */
+#define INDEX_DELTA_MAX_RATIO 8
+
+#define DELTA_NO_MODIFIER 0xffff
+
+struct index_delta_header {
+    unsigned int signature;
+    unsigned int version;
+    unsigned char base_sha1[20];
+};
+
+static guint64
+fnv_hash (guint64 h, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+
+    while (len--) {
+        h ^= *p++;
+        h *= G_GUINT64_CONSTANT(0x100000001b3);
+    }
+    return h;
+}
+
+/* Hash of everything write_index() stores for @ce. Never returns 0. */
+static guint64
+ce_disk_hash (const struct cache_entry *ce)
+{
+    guint64 h = G_GUINT64_CONSTANT(0xcbf29ce484222325);
+    unsigned short flags = (unsigned short)ce->ce_flags;
+
+    h = fnv_hash (h, &ce->ce_ctime.sec, sizeof(ce->ce_ctime.sec));
+    h = fnv_hash (h, &ce->ce_mtime.sec, sizeof(ce->ce_mtime.sec));
+    h = fnv_hash (h, &ce->ce_dev, sizeof(ce->ce_dev));
+    h = fnv_hash (h, &ce->ce_ino, sizeof(ce->ce_ino));
+    h = fnv_hash (h, &ce->ce_mode, sizeof(ce->ce_mode));
+    h = fnv_hash (h, &ce->ce_uid, sizeof(ce->ce_uid));
+    h = fnv_hash (h, &ce->ce_gid, sizeof(ce->ce_gid));
+    h = fnv_hash (h, &ce->ce_size, sizeof(ce->ce_size));
+    h = fnv_hash (h, ce->sha1, 20);
+    h = fnv_hash (h, &flags, sizeof(flags));
+    h = fnv_hash (h, ce->name, ce_namelen(ce));
+    if (ce->modifier)
+        h = fnv_hash (h, ce->modifier, strlen(ce->modifier) + 1);
+
+    return h ? h : 1;
+}
+
+static void
+delta_value_free (gpointer value)
+{
+    /* NULL for removed entries. */
+    if (value)
+        cache_entry_free (value);
+}
+
+static int
+compare_ce_names (const void *a, const void *b)
+{
+    const struct cache_entry *ce1 = *(struct cache_entry **)a;
+    const struct cache_entry *ce2 = *(struct cache_entry **)b;
+
+    return cache_name_compare (ce1->name, ce1->ce_flags,
+                               ce2->name, ce2->ce_flags);
+}
+
+static char *
+delta_path (const char *index_path)
+{
+    return g_strconcat (index_path, ".delta", NULL);
+}
+
+/* Parse one batch starting at @p. Returns the end of the batch, or NULL
+ * if the batch is incomplete or corrupt.
+ */
+static const char *
+parse_delta_batch (struct index_state *istate,
+                   const char *p, const char *end, GHashTable *updates)
+{
+    const char *start = p;
+    GHashTable *batch;
+    GHashTableIter iter;
+    gpointer key, value;
+    unsigned char sha1[20];
+    guint32 n_records = 0, n;
+    guint16 len;
+    struct cache_entry *ce;
+    struct ondisk_cache_entry2 *ondisk;
+    size_t name_len, size;
+    const char *name;
+
+    batch = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                   delta_value_free);
+
+    while (p < end) {
+        char type = *p++;
+
+        if (type == 'E') {
+            if (end - p < 4 + 20)
+                goto bad;
+            memcpy (&n, p, 4);
+            p += 4;
+            seaf_sha1 ((unsigned char *)start, p - start, sha1);
+            if (ntohl(n) != n_records || hashcmp (sha1, (unsigned char *)p))
+                goto bad;
+            p += 20;
+
+            g_hash_table_iter_init (&iter, batch);
+            while (g_hash_table_iter_next (&iter, &key, &value)) {
+                g_hash_table_iter_steal (&iter);
+                g_hash_table_replace (updates, key, value);
+            }
+            g_hash_table_destroy (batch);
+            return p;
+        }
+
+        if (end - p < 2)
+            goto bad;
+        memcpy (&len, p, 2);
+        len = ntohs(len);
+        p += 2;
+
+        if (type == 'D') {
+            if (len == 0 || end - p < len)
+                goto bad;
+            g_hash_table_replace (batch, g_strndup (p, len), NULL);
+            p += len;
+        } else if (type == 'U') {
+            size = offsetof(struct ondisk_cache_entry2, name);
+            if (end - p < size)
+                goto bad;
+            name = p + size;
+            name_len = memchr (name, 0, end - name) ?
+                strlen (name) : (size_t)(end - name);
+            size = ondisk_cache_entry_size2(name_len);
+            if (name_len == 0 || end - p < size)
+                goto bad;
+
+            /* The record is not aligned in the buffer. */
+            ondisk = g_malloc (size);
+            memcpy (ondisk, p, size);
+            if ((ntohs(ondisk->flags) & CE_NAMEMASK) != MIN(name_len, CE_NAMEMASK)) {
+                g_free (ondisk);
+                goto bad;
+            }
+            convert_from_disk2 (istate, ondisk, &ce);
+            g_free (ondisk);
+            p += size;
+
+            if (len != DELTA_NO_MODIFIER) {
+                if (end - p < len) {
+                    cache_entry_free (ce);
+                    goto bad;
+                }
+                ce->modifier = intern_modifier (p, len);
+                p += len;
+            }
+            g_hash_table_replace (batch, g_strdup (ce->name), ce);
+        } else {
+            goto bad;
+        }
+        ++n_records;
+    }
+
+bad:
+    g_hash_table_destroy (batch);
+    return NULL;
+}
+
+/* Apply "<index_path>.delta" to the entries just read from the index.
+ * The entries are not in the name hash yet.
+ */
+static void
+read_index_delta (struct index_state *istate, const char *index_path)
+{
+    char *path = delta_path (index_path);
+    char *data = NULL;
+    gsize len;
+    const char *p, *end, *next;
+    struct index_delta_header hdr;
+    GHashTable *updates = NULL;
+    GHashTableIter iter;
+    gpointer key, value;
+    struct cache_entry **added = NULL, **merged;
+    struct cache_entry *ce;
+    unsigned int i, j, k, n_added = 0, n_merged;
+    SeafStat st;
+
+    if (!g_file_get_contents (path, &data, &len, NULL))
+        goto out;
+
+    if (len < sizeof(hdr))
+        goto out;
+    memcpy (&hdr, data, sizeof(hdr));
+    if (hdr.signature != htonl(INDEX_DELTA_SIGNATURE) ||
+        hdr.version != htonl(INDEX_DELTA_VERSION) ||
+        hashcmp (hdr.base_sha1, istate->base_sha1) != 0) {
+        /* Left over from an older index, overwritten by the next write. */
+        goto out;
+    }
+
+    updates = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                     delta_value_free);
+    p = data + sizeof(hdr);
+    end = data + len;
+    while (p < end) {
+        next = parse_delta_batch (istate, p, end, updates);
+        if (!next) {
+            seaf_warning ("Index delta log %s is corrupt after %ld bytes.\n",
+                          path, (long)(p - data));
+            istate->delta_broken = 1;
+            break;
+        }
+        p = next;
+    }
+    istate->delta_size = p - data;
+
+    if (g_hash_table_size (updates) == 0)
+        goto out;
+
+    /* Drop the updated and removed entries, then merge in the updated
+     * ones in name order.
+     */
+    for (i = j = 0; i < istate->cache_nr; i++) {
+        ce = istate->cache[i];
+        if (g_hash_table_lookup_extended (updates, ce->name, NULL, NULL))
+            cache_entry_free (ce);
+        else
+            istate->cache[j++] = ce;
+    }
+    istate->cache_nr = j;
+
+    added = g_new (struct cache_entry *, g_hash_table_size (updates));
+    g_hash_table_iter_init (&iter, updates);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        if (value)
+            added[n_added++] = value;
+        g_hash_table_iter_steal (&iter);
+        g_free (key);
+    }
+    qsort (added, n_added, sizeof(struct cache_entry *), compare_ce_names);
+
+    n_merged = istate->cache_nr + n_added;
+    istate->cache_alloc = alloc_nr(n_merged);
+    merged = calloc (istate->cache_alloc, sizeof(struct cache_entry *));
+    for (i = j = k = 0; i < istate->cache_nr || j < n_added; k++) {
+        if (j == n_added ||
+            (i < istate->cache_nr &&
+             compare_ce_names (&istate->cache[i], &added[j]) < 0))
+            merged[k] = istate->cache[i++];
+        else
+            merged[k] = added[j++];
+    }
+    free (istate->cache);
+    istate->cache = merged;
+    istate->cache_nr = n_merged;
+
+    if (seaf_stat (path, &st) == 0)
+        istate->timestamp.sec = st.st_mtime;
+
+out:
+    if (updates)
+        g_hash_table_destroy (updates);
+    g_free (added);
+    g_free (data);
+    g_free (path);
+}
+
+static int do_read_index_from(struct index_state *istate, const char *path, int repo_version)
 {
     int fd, i;
     SeafStat st;
@@ -304,7 +675,7 @@ int read_index_from(struct index_state *istate, const char *path, int repo_versi
         return -1;
     }
 
-    mm = mmap(NULL, mmap_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    mm = mmap(NULL, mmap_size, PROT_READ, MAP_PRIVATE, fd, 0);
     close(fd);
     if (mm == MAP_FAILED) {
         g_critical("unable to map index file\n");
@@ -342,7 +713,7 @@ int read_index_from(struct index_state *istate, const char *path, int repo_versi
             /* allocate each ce separately so that we can free new
              * entries added by add_index_entry() later.
              */
-            if (convert_from_disk(disk_ce, &ce) < 0)
+            if (convert_from_disk(istate, disk_ce, &ce) < 0)
                 return -1;
 
             src_offset += ondisk_ce_size(ce);
@@ -352,12 +723,13 @@ int read_index_from(struct index_state *istate, const char *path, int repo_versi
             /* allocate each ce separately so that we can free new
              * entries added by add_index_entry() later.
              */
-            if (convert_from_disk2(disk_ce2, &ce) < 0)
+            if (convert_from_disk2(istate, disk_ce2, &ce) < 0)
                 return -1;
 
             src_offset += ondisk_ce_size2(ce);
         }
-        set_index_entry(istate, i, ce);
+        /* Hashed after the delta log is applied. */
+        istate->cache[i] = ce;
     }
     istate->timestamp.sec = st.st_mtime;
     istate->timestamp.nsec = 0;
@@ -382,7 +754,20 @@ int read_index_from(struct index_state *istate, const char *path, int repo_versi
         src_offset += size;
     }
 
+    hashcpy(istate->base_sha1, (unsigned char *)mm + mmap_size - 20);
+    istate->base_size = mmap_size;
     munmap(mm, mmap_size);
+
+    if (istate->version >= 4)
+        read_index_delta (istate, path);
+
+    for (i = 0; i < istate->cache_nr; i++) {
+        istate->cache[i]->disk_hash = ce_disk_hash (istate->cache[i]);
+        if (ce_stage(istate->cache[i]))
+            istate->has_unmerged = 1;
+        add_name_hash(istate, istate->cache[i]);
+    }
+
     return istate->cache_nr;
 
 unmap:
@@ -391,6 +776,20 @@ unmap:
     return -1;
 }
 
+/* remember to discard_cache() before reading a different cache! */
+int read_index_from(struct index_state *istate, const char *path, int repo_version)
+{
+    gint64 start = seaf_metrics_now ();
+    int ret;
+
+    ret = do_read_index_from (istate, path, repo_version);
+    seaf_metric_observe_since (seaf_metric_get (SEAF_METRIC_HISTOGRAM,
+                                                "seaf_index_read_usec", NULL),
+                               start);
+
+    return ret;
+}
+
 int is_index_unborn(struct index_state *istate)
 {
     return (!istate->cache_nr && !istate->alloc && !istate->timestamp.sec);
@@ -441,8 +840,6 @@ void fill_stat_cache_info(struct cache_entry *ce, SeafStat *st)
 {
     ce->ce_ctime.sec = st->st_ctime;
     ce->ce_mtime.sec = st->st_mtime;
-    ce->ce_ctime.nsec = 0;
-    ce->ce_mtime.nsec = 0;
     ce->ce_dev = st->st_dev;
     ce->ce_ino = st->st_ino;
     ce->ce_uid = st->st_uid;
@@ -459,6 +856,8 @@ void fill_stat_cache_info(struct cache_entry *ce, SeafStat *st)
 void mark_all_ce_unused(struct index_state *index)
 {
     int i;
+
+    index_flush_batch(index);
     for (i = 0; i < index->cache_nr; i++)
         index->cache[i]->ce_flags &= ~(CE_UNPACKED | CE_ADDED | CE_NEW_SKIP_WORKTREE);
 }
@@ -699,7 +1098,10 @@ int index_name_pos(const struct index_state *istate, const char *name, int namel
 /* Remove entry, return true if there are more entries to go.. */
 int remove_index_entry_at(struct index_state *istate, int pos)
 {
-    struct cache_entry *ce = istate->cache[pos];
+    struct cache_entry *ce;
+
+    index_flush_batch(istate);
+    ce = istate->cache[pos];
 
     /* record_resolve_undo(istate, ce); */
     remove_name_hash(istate, ce);
@@ -721,10 +1123,12 @@ int remove_index_entry_at(struct index_state *istate, int pos)
  */
 void remove_marked_cache_entries(struct index_state *istate)
 {
-    struct cache_entry **ce_array = istate->cache;
+    struct cache_entry **ce_array;
     unsigned int i, j;
     gboolean removed = FALSE;
 
+    index_flush_batch(istate);
+    ce_array = istate->cache;
     for (i = j = 0; i < istate->cache_nr; i++) {
         if (ce_array[i]->ce_flags & CE_REMOVE) {
             remove_name_hash(istate, ce_array[i]);
@@ -740,9 +1144,123 @@ void remove_marked_cache_entries(struct index_state *istate)
     }
 }
 
+/*
+ * Batched updates. Existing entries are found through the name hash;
+ * replaced or removed ones are unhashed and marked with CE_BATCH_REMOVED,
+ * and new ones are queued in istate->pending. This avoids a binary search
+ * and a memmove of the cache array for every change. The fast path is only
+ * used while there are no unmerged entries, since those share a name.
+ */
+static int batch_fast_path(struct index_state *istate)
+{
+    return istate->batching && !istate->has_unmerged;
+}
+
+static void batch_remove_entry(struct index_state *istate, struct cache_entry *ce)
+{
+    remove_name_hash(istate, ce);
+    ce->ce_flags |= CE_BATCH_REMOVED;
+    istate->batch_removed++;
+    istate->cache_changed = 1;
+}
+
+static unsigned int drop_batch_removed(struct cache_entry **array, unsigned int nr)
+{
+    unsigned int i, j;
+
+    for (i = j = 0; i < nr; i++) {
+        if (array[i]->ce_flags & CE_BATCH_REMOVED)
+            cache_entry_free (array[i]);
+        else
+            array[j++] = array[i];
+    }
+    return j;
+}
+
+void index_begin_batch(struct index_state *istate)
+{
+    istate->batching = 1;
+}
+
+void index_flush_batch(struct index_state *istate)
+{
+    struct cache_entry **cache;
+    unsigned int i, j, k;
+
+    if (istate->batch_removed) {
+        istate->cache_nr = drop_batch_removed(istate->cache, istate->cache_nr);
+        istate->pending_nr = drop_batch_removed(istate->pending, istate->pending_nr);
+        istate->batch_removed = 0;
+    }
+
+    if (!istate->pending_nr)
+        return;
+
+    qsort(istate->pending, istate->pending_nr, sizeof(struct cache_entry *),
+          compare_ce_names);
+
+    ALLOC_GROW(istate->cache, istate->cache_nr + istate->pending_nr,
+               istate->cache_alloc);
+
+    /* Merge from the back so that it can be done in place. Names are
+     * unique, as an entry with the same name was marked removed when the
+     * new one was queued.
+     */
+    cache = istate->cache;
+    i = istate->cache_nr;
+    j = istate->pending_nr;
+    k = i + j;
+    while (j > 0) {
+        if (i > 0 && compare_ce_names(&cache[i - 1], &istate->pending[j - 1]) > 0)
+            cache[--k] = cache[--i];
+        else
+            cache[--k] = istate->pending[--j];
+    }
+
+    istate->cache_nr += istate->pending_nr;
+    istate->pending_nr = 0;
+}
+
+void index_end_batch(struct index_state *istate)
+{
+    index_flush_batch(istate);
+    istate->batching = 0;
+}
+
+static int add_index_entry_batched(struct index_state *istate, struct cache_entry *ce, int option)
+{
+    struct cache_entry *old;
+
+    remove_empty_parent_dir_entry (istate, ce->name);
+
+    old = index_name_exists(istate, ce->name, ce_namelen(ce), 0);
+    if (old) {
+        if (option & ADD_CACHE_NEW_ONLY)
+            return 0;
+        batch_remove_entry(istate, old);
+    } else if (!(option & ADD_CACHE_OK_TO_ADD))
+        return -1;
+
+    ALLOC_GROW(istate->pending, istate->pending_nr + 1, istate->pending_alloc);
+    istate->pending[istate->pending_nr++] = ce;
+    add_name_hash(istate, ce);
+    istate->cache_changed = 1;
+    return 0;
+}
+
 int remove_file_from_index(struct index_state *istate, const char *path)
 {
-    int pos = index_name_pos(istate, path, strlen(path));
+    int pos;
+
+    if (batch_fast_path(istate)) {
+        struct cache_entry *ce = index_name_exists(istate, path, strlen(path), 0);
+        if (ce)
+            batch_remove_entry(istate, ce);
+        return 0;
+    }
+
+    index_flush_batch(istate);
+    pos = index_name_pos(istate, path, strlen(path));
     if (pos < 0)
         pos = -pos-1;
     /* cache_tree_invalidate_path(istate->cache_tree, path); */
@@ -923,6 +1441,14 @@ int add_index_entry(struct index_state *istate, struct cache_entry *ce, int opti
 {
     int pos;
 
+    if (ce_stage(ce))
+        istate->has_unmerged = 1;
+
+    if (batch_fast_path(istate) && !(option & ADD_CACHE_JUST_APPEND))
+        return add_index_entry_batched(istate, ce, option);
+
+    index_flush_batch(istate);
+
     if (option & ADD_CACHE_JUST_APPEND)
         pos = istate->cache_nr;
     else {
@@ -951,23 +1477,39 @@ int add_index_entry(struct index_state *istate, struct cache_entry *ce, int opti
     return 0;
 }
 
-int add_to_index(const char *repo_id,
-                 int version,
-                 struct index_state *istate,
-                 const char *path,
-                 const char *full_path,
-                 SeafStat *st,
-                 int flags,
-                 SeafileCrypt *crypt,
-                 IndexCB index_cb,
-                 const char *modifier,
-                 gboolean *added)
+#define ADD_MATCH_OPTIONS \
+    (CE_MATCH_IGNORE_VALID|CE_MATCH_IGNORE_SKIP_WORKTREE|CE_MATCH_RACY_IS_DIRTY)
+
+gboolean
+index_entry_uptodate (struct index_state *istate,
+                      const char *path,
+                      SeafStat *st)
+{
+    struct cache_entry *ce;
+
+    ce = index_name_exists (istate, path, strlen(path), 0);
+    return (ce && !ce_stage(ce) && !ie_match_stat(ce, st, ADD_MATCH_OPTIONS));
+}
+
+static int
+add_to_index_internal (const char *repo_id,
+                       int version,
+                       struct index_state *istate,
+                       const char *path,
+                       const char *full_path,
+                       SeafStat *st,
+                       int flags,
+                       SeafileCrypt *crypt,
+                       IndexCB index_cb,
+                       const unsigned char *file_sha1,
+                       const char *modifier,
+                       gboolean *added)
 {
     int size, namelen;
     mode_t st_mode = st->st_mode;
     struct cache_entry *ce, *alias;
     unsigned char sha1[20];
-    unsigned ce_option = CE_MATCH_IGNORE_VALID|CE_MATCH_IGNORE_SKIP_WORKTREE|CE_MATCH_RACY_IS_DIRTY;
+    unsigned ce_option = ADD_MATCH_OPTIONS;
     int add_option = (ADD_CACHE_OK_TO_ADD|ADD_CACHE_OK_TO_REPLACE);
 
     *added = FALSE;
@@ -1038,14 +1580,16 @@ int add_to_index(const char *repo_id,
 #endif
 #endif  /* 0 */
 
-    if (index_cb (repo_id, version, full_path, sha1, crypt, TRUE) < 0) {
+    if (file_sha1) {
+        memcpy (sha1, file_sha1, 20);
+    } else if (index_cb (repo_id, version, full_path, sha1, crypt, TRUE) < 0) {
         free (ce);
         return -1;
     }
 
     memcpy (ce->sha1, sha1, 20);
     ce->ce_flags |= CE_ADDED;
-    ce->modifier = g_strdup(modifier);
+    ce->modifier = g_intern_string(modifier);
 
     if (add_index_entry(istate, ce, add_option)) {
         seaf_warning("unable to add %s to index\n",path);
@@ -1060,6 +1604,35 @@ int add_to_index(const char *repo_id,
     return 0;
 }
 
+int add_to_index(const char *repo_id,
+                 int version,
+                 struct index_state *istate,
+                 const char *path,
+                 const char *full_path,
+                 SeafStat *st,
+                 int flags,
+                 SeafileCrypt *crypt,
+                 IndexCB index_cb,
+                 const char *modifier,
+                 gboolean *added)
+{
+    return add_to_index_internal (repo_id, version, istate, path, full_path,
+                                  st, flags, crypt, index_cb, NULL,
+                                  modifier, added);
+}
+
+int
+add_indexed_file_to_index (struct index_state *istate,
+                           const char *path,
+                           SeafStat *st,
+                           const unsigned char *file_sha1,
+                           const char *modifier,
+                           gboolean *added)
+{
+    return add_to_index_internal (NULL, 0, istate, path, NULL, st, 0,
+                                  NULL, NULL, file_sha1, modifier, added);
+}
+
 /*
  * Check whether the empty dir conflicts with existing files
  */
@@ -1123,6 +1696,8 @@ add_empty_dir_to_index (struct index_state *istate, const char *path, SeafStat *
     struct cache_entry *ce, *alias;
     int add_option = (ADD_CACHE_OK_TO_ADD|ADD_CACHE_OK_TO_REPLACE);
 
+    index_flush_batch (istate);
+
     ce = create_empty_dir_index_entry (path, st);
 
     if (is_garbage_empty_dir (istate, ce)) {
@@ -1163,9 +1738,12 @@ remove_from_index_with_prefix (struct index_state *istate, const char *path_pref
                                gboolean *not_found)
 {
     int pathlen = strlen(path_prefix);
-    int pos = index_name_pos (istate, path_prefix, pathlen);
+    int pos;
     struct cache_entry *ce;
 
+    index_flush_batch (istate);
+    pos = index_name_pos (istate, path_prefix, pathlen);
+
     if (not_found)
         *not_found = FALSE;
 
@@ -1233,6 +1811,49 @@ remove_from_index_with_prefix (struct index_state *istate, const char *path_pref
     return 0;
 }
 
+int
+mark_index_entries_with_prefix (struct index_state *istate,
+                                const char *path_prefix)
+{
+    int pathlen = strlen(path_prefix);
+    int pos, n = 0;
+    struct cache_entry *ce;
+    char *full_path_prefix;
+
+    index_flush_batch (istate);
+    pos = index_name_pos (istate, path_prefix, pathlen);
+
+    /* Exact match, mark that entry. */
+    if (pos >= 0) {
+        istate->cache[pos]->ce_flags |= CE_REMOVE;
+        return 1;
+    }
+
+    /* Otherwise mark all entries under the prefix, which follow the
+     * position the prefix would be inserted at.
+     */
+    pos = -pos-1;
+
+    full_path_prefix = g_strconcat (path_prefix, "/", NULL);
+    ++pathlen;
+
+    while (pos < istate->cache_nr) {
+        ce = istate->cache[pos];
+        if (strncmp (ce->name, full_path_prefix, pathlen) < 0) {
+            ++pos;
+            continue;
+        }
+        if (strncmp (ce->name, full_path_prefix, pathlen) > 0)
+            break;
+        ce->ce_flags |= CE_REMOVE;
+        ++n;
+        ++pos;
+    }
+    g_free (full_path_prefix);
+
+    return n;
+}
+
 static struct cache_entry *
 create_renamed_cache_entry (struct cache_entry *ce,
                             const char *src_path, const char *dst_path)
@@ -1248,9 +1869,6 @@ create_renamed_cache_entry (struct cache_entry *ce,
     new_ce = calloc (size, 1);
     memcpy (new_ce, ce, sizeof(struct cache_entry));
     new_ce->ce_flags = namelen;
-    new_ce->current_mtime = 0;
-    new_ce->modifier = g_strdup(ce->modifier);
-    new_ce->next = NULL;
     memcpy (new_ce->name, new_ce_name, namelen);
     g_free (new_ce_name);
 
@@ -1362,6 +1980,8 @@ rename_index_entries (struct index_state *istate,
     int ret = 0;
     int i;
 
+    index_flush_batch (istate);
+
     if (not_found)
         *not_found = FALSE;
 
@@ -1432,9 +2052,12 @@ add_empty_dir_to_index_with_check (struct index_state *istate,
                                    const char *path, SeafStat *st)
 {
     int pathlen = strlen(path);
-    int pos = index_name_pos (istate, path, pathlen);
+    int pos;
     struct cache_entry *ce;
 
+    index_flush_batch (istate);
+    pos = index_name_pos (istate, path, pathlen);
+
     /* Exact match, empty dir entry already exists. */
     if (pos >= 0) {
         return 0;
@@ -1545,6 +2168,8 @@ list_dirents_from_index (struct index_state *istate, const char *dir)
     gboolean is_dir;
     IndexDirent *dirent;
 
+    index_flush_batch (istate);
+
     if (dir[0] == 0) {
         pos = 0;
         full_dir = g_strdup(dir);
@@ -1708,14 +2333,7 @@ static int type_from_string(const char *str)
 static void hash_sha1_file(const void *buf, unsigned long len,
                            const char *type, unsigned char *sha1)
 {
-    GChecksum *c;
-    gsize cs_len = 20;
-
-    /* Sha1.. */
-    c = g_checksum_new (G_CHECKSUM_SHA1);
-    g_checksum_update(c, buf, len);
-    g_checksum_get_digest (c, sha1, &cs_len);
-    g_checksum_free (c);
+    seaf_sha1 (buf, len, sha1);
 }
 
 static int index_mem(unsigned char *sha1, void *buf, uint64_t size,
@@ -1799,16 +2417,17 @@ static unsigned long write_buffer_len;
 #define WRITE_BUFFER_SIZE 8192
 
 typedef struct {
-    GChecksum *context;
+    SeafSHA1Ctx context;
     unsigned char write_buffer[WRITE_BUFFER_SIZE];
     unsigned long write_buffer_len;
+    unsigned char sha1[20];
 } WriteIndexInfo;
 
 static int ce_write_flush(WriteIndexInfo *info, int fd)
 {
     unsigned int buffered = info->write_buffer_len;
     if (buffered) {
-        g_checksum_update(info->context, info->write_buffer, buffered);
+        seaf_sha1_update(&info->context, info->write_buffer, buffered);
         if (writen(fd, info->write_buffer, buffered) != buffered)
             return -1;
         info->write_buffer_len = 0;
@@ -1850,11 +2469,10 @@ static int write_index_ext_header(WriteIndexInfo *info, int fd,
 static int ce_flush(WriteIndexInfo *info, int fd)
 {
     unsigned int left = info->write_buffer_len;
-    gsize len = 20;
 
     if (left) {
         info->write_buffer_len = 0;
-        g_checksum_update(info->context, info->write_buffer, left);
+        seaf_sha1_update(&info->context, info->write_buffer, left);
     }
 
     /* Flush first if not enough space for SHA1 signature */
@@ -1865,7 +2483,8 @@ static int ce_flush(WriteIndexInfo *info, int fd)
     }
 
     /* Append the SHA1 signature at the end */
-    g_checksum_get_digest (info->context, info->write_buffer + left, &len);
+    seaf_sha1_final (&info->context, info->write_buffer + left);
+    hashcpy (info->sha1, info->write_buffer + left);
     left += 20;
     return (writen(fd, info->write_buffer, left) != left) ? -1 : 0;
 }
@@ -1920,12 +2539,11 @@ static void ce_smudge_racily_clean_entry(struct cache_entry *ce)
 }
 #endif
 
-static int ce_write_entry2(WriteIndexInfo *info, int fd, struct cache_entry *ce)
+static struct ondisk_cache_entry2 *ce_to_ondisk2(struct cache_entry *ce)
 {
     int size = ondisk_ce_size2(ce);
     struct ondisk_cache_entry2 *ondisk = calloc(1, size);
     char *name;
-    int result;
 
     ondisk->ctime.sec = hton64(ce->ce_ctime.sec);
     ondisk->mtime.sec = hton64(ce->ce_mtime.sec);
@@ -1940,7 +2558,15 @@ static int ce_write_entry2(WriteIndexInfo *info, int fd, struct cache_entry *ce)
     name = ondisk->name;
     memcpy(name, ce->name, ce_namelen(ce));
 
-    result = ce_write(info, fd, ondisk, size);
+    return ondisk;
+}
+
+static int ce_write_entry2(WriteIndexInfo *info, int fd, struct cache_entry *ce)
+{
+    struct ondisk_cache_entry2 *ondisk = ce_to_ondisk2(ce);
+    int result;
+
+    result = ce_write(info, fd, ondisk, ondisk_ce_size2(ce));
     free(ondisk);
     return result;
 }
@@ -1971,12 +2597,16 @@ int write_index(struct index_state *istate, int newfd)
     WriteIndexInfo info;
     struct cache_header hdr;
     int i, removed, extended;
-    struct cache_entry **cache = istate->cache;
-    int entries = istate->cache_nr;
+    struct cache_entry **cache;
+    int entries;
     SeafStat st;
     const char *prev_name = NULL;
     int ret = 0;
 
+    index_flush_batch (istate);
+    cache = istate->cache;
+    entries = istate->cache_nr;
+
     memset (&info, 0, sizeof(info));
 
     for (i = removed = extended = 0; i < entries; i++) {
@@ -1996,7 +2626,7 @@ int write_index(struct index_state *istate, int newfd)
     hdr.hdr_version = htonl(4);
     hdr.hdr_entries = htonl(entries - removed);
 
-    info.context = g_checksum_new (G_CHECKSUM_SHA1);
+    seaf_sha1_init (&info.context);
     if (ce_write(&info, newfd, &hdr, sizeof(hdr)) < 0) {
         ret = -1;
         goto out;
@@ -2047,16 +2677,221 @@ int write_index(struct index_state *istate, int newfd)
     istate->timestamp.sec = (unsigned int)st.st_mtime;
     istate->timestamp.nsec = 0;
 
+    /* The new file is the base for later delta logs. */
+    prev_name = NULL;
+    for (i = 0; i < entries; i++) {
+        struct cache_entry *ce = cache[i];
+        if ((ce->ce_flags & CE_REMOVE) ||
+            (prev_name && g_strcmp0 (ce->name, prev_name) == 0)) {
+            ce->disk_hash = 0;
+            continue;
+        }
+        prev_name = ce->name;
+        ce->disk_hash = ce_disk_hash (ce);
+    }
+    if (istate->removed_names)
+        g_hash_table_remove_all (istate->removed_names);
+    hashcpy (istate->base_sha1, info.sha1);
+    istate->base_size = (guint64)st.st_size;
+    istate->delta_size = 0;
+    istate->delta_broken = 0;
+
+out:
+    seaf_sha1_cleanup (&info.context);
+    return ret;
+}
+
+static void
+append_delta_update (GByteArray *buf, struct index_state *istate,
+                     struct cache_entry *ce)
+{
+    struct ondisk_cache_entry2 *ondisk = ce_to_ondisk2 (ce);
+    guint16 len;
+
+    len = htons(ce->modifier ? strlen(ce->modifier) : DELTA_NO_MODIFIER);
+    g_byte_array_append (buf, (guint8 *)"U", 1);
+    g_byte_array_append (buf, (guint8 *)&len, 2);
+    g_byte_array_append (buf, (guint8 *)ondisk, ondisk_ce_size2(ce));
+    if (ce->modifier)
+        g_byte_array_append (buf, (guint8 *)ce->modifier, strlen(ce->modifier));
+    free (ondisk);
+}
+
+static void
+append_delta_removal (GByteArray *buf, const char *name)
+{
+    guint16 len = htons(strlen(name));
+
+    g_byte_array_append (buf, (guint8 *)"D", 1);
+    g_byte_array_append (buf, (guint8 *)&len, 2);
+    g_byte_array_append (buf, (guint8 *)name, strlen(name));
+}
+
+int write_index_delta(struct index_state *istate, const char *index_path)
+{
+    struct cache_entry **cache;
+    struct cache_entry *ce;
+    const char *prev_name = NULL;
+    GByteArray *buf;
+    GHashTableIter iter;
+    gpointer key, value;
+    struct index_delta_header hdr;
+    unsigned char sha1[20];
+    guint32 n_records = 0, n;
+    guint64 new_size;
+    char *path = NULL;
+    int fd = -1;
+    unsigned int i;
+    SeafStat st;
+    int ret = 0;
+
+    index_flush_batch (istate);
+    cache = istate->cache;
+
+    if (istate->delta_broken || istate->base_size == 0 || istate->version < 4 ||
+        istate->cache_nr < INDEX_DELTA_MIN_ENTRIES)
+        return 1;
+
+    buf = g_byte_array_new ();
+
+    g_hash_table_iter_init (&iter, istate->removed_names);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        if (g_hash_table_lookup (istate->name_hash, key))
+            continue;
+        append_delta_removal (buf, key);
+        ++n_records;
+    }
+
+    for (i = 0; i < istate->cache_nr; i++) {
+        ce = cache[i];
+        if (ce->ce_flags & CE_REMOVE) {
+            if (ce->disk_hash != 0 ||
+                g_hash_table_lookup (istate->removed_names, ce->name)) {
+                append_delta_removal (buf, ce->name);
+                ++n_records;
+            }
+            continue;
+        }
+        if (prev_name && g_strcmp0 (ce->name, prev_name) == 0)
+            continue;
+        prev_name = ce->name;
+
+        if (istate->has_modifier && !S_ISDIR(ce->ce_mode) && !ce->modifier) {
+            seaf_warning ("BUG: index entry %s doesn't have modifier info.\n",
+                          ce->name);
+            ret = -1;
+            goto out;
+        }
+        if (ce_disk_hash (ce) != ce->disk_hash) {
+            append_delta_update (buf, istate, ce);
+            ++n_records;
+        }
+    }
+
+    if (n_records == 0)
+        goto out;
+
+    n = htonl(n_records);
+    g_byte_array_append (buf, (guint8 *)"E", 1);
+    g_byte_array_append (buf, (guint8 *)&n, 4);
+    seaf_sha1 (buf->data, buf->len, sha1);
+    g_byte_array_append (buf, sha1, 20);
+
+    new_size = istate->delta_size ? istate->delta_size : sizeof(hdr);
+    new_size += buf->len;
+    if (new_size * INDEX_DELTA_MAX_RATIO > istate->base_size) {
+        ret = 1;
+        goto out;
+    }
+
+    path = delta_path (index_path);
+    if (istate->delta_size == 0) {
+        fd = seaf_util_create (path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY,
+                               0666);
+        if (fd < 0) {
+            seaf_warning ("Failed to create %s: %s.\n", path, strerror(errno));
+            ret = -1;
+            goto out;
+        }
+        hdr.signature = htonl(INDEX_DELTA_SIGNATURE);
+        hdr.version = htonl(INDEX_DELTA_VERSION);
+        hashcpy (hdr.base_sha1, istate->base_sha1);
+        if (writen (fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+            seaf_warning ("Failed to write %s: %s.\n", path, strerror(errno));
+            ret = -1;
+            goto out;
+        }
+    } else {
+        fd = seaf_util_open (path, O_WRONLY | O_APPEND | O_BINARY);
+        if (fd < 0 || seaf_fstat (fd, &st) < 0 ||
+            (guint64)st.st_size != istate->delta_size) {
+            /* Changed behind our back, start over. */
+            ret = 1;
+            goto out;
+        }
+        /* O_APPEND is not honored by seaf_util_open() on Windows. */
+        if (lseek (fd, 0, SEEK_END) < 0) {
+            ret = -1;
+            goto out;
+        }
+    }
+
+    if (writen (fd, buf->data, buf->len) != buf->len ||
+        seaf_fstat (fd, &st) < 0) {
+        seaf_warning ("Failed to write %s: %s.\n", path, strerror(errno));
+        ret = -1;
+        goto out;
+    }
+
+    istate->timestamp.sec = (unsigned int)st.st_mtime;
+    istate->timestamp.nsec = 0;
+    istate->delta_size = new_size;
+
+    prev_name = NULL;
+    for (i = 0; i < istate->cache_nr; i++) {
+        ce = cache[i];
+        if ((ce->ce_flags & CE_REMOVE) ||
+            (prev_name && g_strcmp0 (ce->name, prev_name) == 0)) {
+            ce->disk_hash = 0;
+            continue;
+        }
+        prev_name = ce->name;
+        ce->disk_hash = ce_disk_hash (ce);
+    }
+    g_hash_table_remove_all (istate->removed_names);
+
 out:
-    g_checksum_free (info.context);
+    if (ret != 0)
+        istate->delta_broken = 1;
+    if (fd >= 0)
+        close (fd);
+    g_free (path);
+    g_byte_array_free (buf, TRUE);
     return ret;
 }
 
+void remove_index_delta(const char *index_path)
+{
+    char *path = delta_path (index_path);
+
+    if (seaf_util_unlink (path) < 0 && errno != ENOENT)
+        seaf_warning ("Failed to remove %s: %s.\n", path, strerror(errno));
+    g_free (path);
+}
+
 int discard_index(struct index_state *istate)
 {
     int i;
     for (i = 0; i < istate->cache_nr; ++i)
         cache_entry_free (istate->cache[i]);
+    for (i = 0; i < istate->pending_nr; ++i)
+        cache_entry_free (istate->pending[i]);
+    free (istate->pending);
+    istate->pending = NULL;
+    istate->pending_nr = istate->pending_alloc = 0;
+    istate->batch_removed = 0;
+    istate->batching = 0;
+    istate->has_unmerged = 0;
 
     istate->cache_nr = 0;
     istate->cache_changed = 0;
@@ -2067,8 +2902,13 @@ int discard_index(struct index_state *istate)
 #if defined WIN32 || defined __APPLE__
     g_hash_table_destroy (istate->i_name_hash);
 #endif
+    if (istate->removed_names) {
+        g_hash_table_destroy (istate->removed_names);
+        istate->removed_names = NULL;
+    }
     /* cache_tree_free(&(istate->cache_tree)); */
     /* free(istate->alloc); */
+    arena_free(istate);
     free(istate->cache);
     istate->alloc = NULL;
     istate->initialized = 0;
@@ -2079,17 +2919,24 @@ int discard_index(struct index_state *istate)
 
 void cache_entry_free (struct cache_entry *ce)
 {
-    g_free (ce->modifier);
-    free (ce);
+    /* The modifier is interned. */
+    if (!(ce->ce_flags & CE_ARENA))
+        free (ce);
 }
 
 void remove_name_hash(struct index_state *istate, struct cache_entry *ce)
 {
     g_hash_table_remove (istate->name_hash, ce->name);
 
+    if (ce->disk_hash && istate->removed_names)
+        g_hash_table_replace (istate->removed_names, g_strdup(ce->name),
+                              GINT_TO_POINTER(1));
+
 #if defined WIN32 || defined __APPLE__
-    char *i_name = g_utf8_strdown (ce->name, -1);
-    g_hash_table_remove (istate->i_name_hash, i_name);
+    char *i_name = index_icase_name (ce->name);
+    /* Another entry may have the same name in a different case. */
+    if (g_hash_table_lookup (istate->i_name_hash, i_name) == ce)
+        g_hash_table_remove (istate->i_name_hash, i_name);
     g_free (i_name);
 #endif
 }
@@ -2098,10 +2945,31 @@ void add_name_hash(struct index_state *istate, struct cache_entry *ce)
 {
     g_hash_table_insert (istate->name_hash, g_strdup(ce->name), ce);
 #if defined WIN32 || defined __APPLE__
-    g_hash_table_insert (istate->i_name_hash, g_utf8_strdown(ce->name, -1), ce);
+    g_hash_table_insert (istate->i_name_hash, index_icase_name(ce->name), ce);
 #endif
 }
 
+#if defined WIN32 || defined __APPLE__
+char *index_icase_name(const char *name)
+{
+#ifdef __APPLE__
+    char *normalized, *i_name;
+#endif
+
+    if (!g_utf8_validate (name, -1, NULL))
+        return g_ascii_strdown (name, -1);
+
+#ifdef __APPLE__
+    normalized = g_utf8_normalize (name, -1, G_NORMALIZE_NFC);
+    i_name = g_utf8_strdown (normalized, -1);
+    g_free (normalized);
+    return i_name;
+#else
+    return g_utf8_strdown (name, -1);
+#endif
+}
+#endif
+
 struct cache_entry *index_name_exists(struct index_state *istate,
                                       const char *name, int namelen,
                                       int igncase)
@@ -2111,7 +2979,7 @@ struct cache_entry *index_name_exists(struct index_state *istate,
         return g_hash_table_lookup (istate->name_hash, name);
     else {
         struct cache_entry *ce;
-        char *i_name = g_utf8_strdown (name, -1);
+        char *i_name = index_icase_name (name);
         ce = g_hash_table_lookup (istate->i_name_hash, i_name);
         g_free (i_name);
         return ce;
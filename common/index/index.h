@@ -237,20 +237,25 @@ struct cache_ext_hdr {
 } __attribute__((__packed__));
 #endif
 
+/* Nanoseconds are not kept in memory, they're always 0 on disk. */
+struct ce_time {
+    guint64 sec;
+};
+
 struct cache_entry {
-    struct cache_time64 ce_ctime;
-    struct cache_time64 ce_mtime;
-    guint64 current_mtime;      /* used in merge */
-    unsigned int ce_dev;
-    unsigned int ce_ino;
+    /* Fields compared by ie_match_stat() come first. */
+    struct ce_time ce_mtime;
+    uint64_t     ce_size;
+    unsigned int ce_flags;
     unsigned int ce_mode;
+    unsigned int ce_ino;
     unsigned int ce_uid;
     unsigned int ce_gid;
-    uint64_t     ce_size;
-    unsigned int ce_flags;
+    unsigned int ce_dev;
+    struct ce_time ce_ctime;
     unsigned char sha1[20];
-    char *modifier;
-    struct cache_entry *next;
+    const char *modifier;       /* interned with g_intern_string() */
+    guint64 disk_hash;          /* as last written to disk, 0 if not there */
     char name[0]; /* more */
 };
 
@@ -281,6 +286,8 @@ struct cache_entry {
 
 #define CE_UNPACKED          (1 << 24)
 #define CE_NEW_SKIP_WORKTREE (1 << 25)
+#define CE_ARENA             (1 << 26) /* owned by index_state.arena */
+#define CE_BATCH_REMOVED     (1 << 27) /* dropped at the next batch flush */
 
 /*
  * Extended on-disk flags
@@ -306,13 +313,13 @@ struct cache_entry {
  * Copy the sha1 and stat state of a cache entry from one to
  * another. But we never change the name, or the hash state!
  */
-#define CE_STATE_MASK (CE_HASHED | CE_UNHASHED)
+#define CE_STATE_MASK (CE_HASHED | CE_UNHASHED | CE_ARENA)
 
 static inline void copy_cache_entry(struct cache_entry *dst, struct cache_entry *src)
 {
     unsigned int state = dst->ce_flags & CE_STATE_MASK;
 
-    /* Don't copy modifier, hash chain and name */
+    /* Don't copy modifier, disk hash and name */
     memcpy(dst, src, offsetof(struct cache_entry, modifier));
 
     /* Restore the hash state */
@@ -398,6 +405,23 @@ struct index_state {
     GHashTable *i_name_hash;    /* ignore case */
 #endif
     int has_modifier;
+
+    /* Entries read from disk are carved from here. */
+    struct ce_arena *arena;
+
+    /* What's on disk, for appending changes to the delta log. */
+    unsigned char base_sha1[20];
+    guint64 base_size;
+    guint64 delta_size;         /* valid bytes in the delta log */
+    int delta_broken;           /* rewrite the whole index next time */
+    GHashTable *removed_names;  /* on disk but removed from memory */
+
+    /* See index_begin_batch(). */
+    int batching;
+    int has_unmerged;           /* some entry has stage != 0 */
+    struct cache_entry **pending;   /* added, not yet merged into cache */
+    unsigned int pending_nr, pending_alloc;
+    unsigned int batch_removed;     /* entries marked CE_BATCH_REMOVED */
 };
 
 extern struct index_state the_index;
@@ -453,6 +477,14 @@ extern int read_index_from(struct index_state *, const char *path, int repo_vers
 extern int is_index_unborn(struct index_state *);
 extern int read_index_unmerged(struct index_state *);
 extern int write_index(struct index_state *, int newfd);
+/*
+ * Append the entries changed since the last write to "<index_path>.delta".
+ * Returns 1 if the whole index should be rewritten with write_index()
+ * instead, e.g. when the delta log has grown too large.
+ */
+extern int write_index_delta(struct index_state *, const char *index_path);
+/* Remove the delta log after the index is rewritten or deleted. */
+extern void remove_index_delta(const char *index_path);
 extern int discard_index(struct index_state *);
 extern int unmerged_index(const struct index_state *);
 extern int verify_path(const char *path);
@@ -466,6 +498,17 @@ extern int add_index_entry(struct index_state *, struct cache_entry *ce, int opt
 extern void rename_index_entry_at(struct index_state *, int pos, const char *new_name);
 extern int remove_index_entry_at(struct index_state *, int pos);
 extern void remove_marked_cache_entries(struct index_state *istate);
+/*
+ * Between index_begin_batch() and index_end_batch(), add_index_entry() and
+ * remove_file_from_index() look entries up in the name hash and queue the
+ * changes; they are merged into istate->cache in one pass by
+ * index_flush_batch(). Functions in this file flush by themselves before
+ * using positions in istate->cache. Other code that walks istate->cache
+ * during a batch must call index_flush_batch() first.
+ */
+extern void index_begin_batch(struct index_state *istate);
+extern void index_flush_batch(struct index_state *istate);
+extern void index_end_batch(struct index_state *istate);
 extern int remove_file_from_index(struct index_state *, const char *path);
 
 #define ADD_CACHE_VERBOSE 1
@@ -493,6 +536,25 @@ int add_to_index(const char *repo_id,
                  const char *modifier,
                  gboolean *added);
 
+/* Returns TRUE if add_to_index() would find @path unchanged since it
+ * was last indexed.
+ */
+gboolean
+index_entry_uptodate (struct index_state *istate,
+                      const char *path,
+                      SeafStat *st);
+
+/* Same as add_to_index(), but with the file already indexed into
+ * @file_sha1, e.g. on another thread.
+ */
+int
+add_indexed_file_to_index (struct index_state *istate,
+                           const char *path,
+                           SeafStat *st,
+                           const unsigned char *file_sha1,
+                           const char *modifier,
+                           gboolean *added);
+
 int
 add_empty_dir_to_index (struct index_state *istate,
                         const char *path,
@@ -504,6 +566,15 @@ int
 remove_from_index_with_prefix (struct index_state *istate, const char *path_prefix,
                                gboolean *not_found);
 
+/*
+ * Marks the entry @path_prefix and all entries under it with CE_REMOVE,
+ * so that entries of many paths are removed in one pass by
+ * remove_marked_cache_entries(). Returns the number of marked entries.
+ */
+int
+mark_index_entries_with_prefix (struct index_state *istate,
+                                const char *path_prefix);
+
 int
 rename_index_entries (struct index_state *istate,
                       const char *src_path,
@@ -559,6 +630,15 @@ struct cache_entry *index_name_exists(struct index_state *istate,
                                       const char *name, int namelen,
                                       int igncase);
 
+#if defined WIN32 || defined __APPLE__
+/*
+ * Key of @name in case-insensitive hash tables, to be freed by the caller.
+ * On macOS names are also compared regardless of their Unicode
+ * normalization, like the file system does.
+ */
+char *index_icase_name(const char *name);
+#endif
+
 #define MTIME_CHANGED    0x0001
 #define CTIME_CHANGED    0x0002
 #define OWNER_CHANGED    0x0004
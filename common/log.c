@@ -48,29 +48,274 @@ get_syslog_level (GLogLevelFlags level)
 #endif
 #endif
 
+/*
+ * Messages are appended to a buffer by the calling thread and written to
+ * the log file by a writer thread, which flushes the file once per batch
+ * instead of once per message. Errors and critical messages, and exiting
+ * the process, wait until everything logged so far is written.
+ */
+
+#define LOG_BUFFER_SIZE (256 * 1024)
+
+/* At most WARNING_RATE_BURST warnings from the same source line are logged
+ * in WARNING_RATE_WINDOW seconds.
+ */
+#define WARNING_RATE_WINDOW 60
+#define WARNING_RATE_BURST 20
+#define MAX_WARNING_RATE_ENTRIES 1024
+
+typedef struct WarningRate {
+    time_t window_start;
+    int count;
+    int suppressed;
+} WarningRate;
+
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Signalled when there is something to write. */
+static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
+/* Signalled when the buffer is taken by the writer or has been written. */
+static pthread_cond_t log_written_cond = PTHREAD_COND_INITIALIZER;
+static char *log_buf;
+static size_t log_buf_len;
+static char *spare_buf;
+static gboolean writer_running;
+static gboolean writing;
+
+static time_t timestamp_time = (time_t)-1;
+static char timestamp[64];
+
+static GHashTable *warning_rates;
+
+/* Held while writing to logfp. */
+static pthread_mutex_t logfp_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+write_to_logfp (const char *data, size_t len)
+{
+    pthread_mutex_lock (&logfp_lock);
+    if (logfp != NULL) {
+        fwrite (data, 1, len, logfp);
+        fflush (logfp);
+    } else { // log file not available
+        fwrite (data, 1, len, stdout);
+    }
+    pthread_mutex_unlock (&logfp_lock);
+}
+
+static void *
+log_writer_thread (void *vdata)
+{
+    char *buf;
+    size_t len;
+
+    pthread_mutex_lock (&log_lock);
+    while (1) {
+        while (log_buf_len == 0)
+            pthread_cond_wait (&log_cond, &log_lock);
+
+        buf = log_buf;
+        len = log_buf_len;
+        log_buf = spare_buf;
+        log_buf_len = 0;
+        writing = TRUE;
+        pthread_cond_broadcast (&log_written_cond);
+        pthread_mutex_unlock (&log_lock);
+
+        write_to_logfp (buf, len);
+
+        pthread_mutex_lock (&log_lock);
+        spare_buf = buf;
+        writing = FALSE;
+        pthread_cond_broadcast (&log_written_cond);
+    }
+
+    return NULL;
+}
+
+/* Called with log_lock held. */
+static void
+wait_log_written ()
+{
+    while (log_buf_len > 0 || writing) {
+        pthread_cond_signal (&log_cond);
+        pthread_cond_wait (&log_written_cond, &log_lock);
+    }
+}
+
+static void
+seafile_log_flush ()
+{
+    pthread_mutex_lock (&log_lock);
+    if (writer_running)
+        wait_log_written ();
+    pthread_mutex_unlock (&log_lock);
+}
+
+static void
+start_log_writer ()
+{
+    pthread_t tid;
+    pthread_attr_t attr;
+
+    if (writer_running)
+        return;
+
+    log_buf = g_malloc (LOG_BUFFER_SIZE);
+    spare_buf = g_malloc (LOG_BUFFER_SIZE);
+
+    pthread_attr_init (&attr);
+    pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create (&tid, &attr, log_writer_thread, NULL) != 0) {
+        /* Messages will be written by the logging threads. */
+        g_free (log_buf);
+        g_free (spare_buf);
+        log_buf = spare_buf = NULL;
+    } else {
+        pthread_mutex_lock (&log_lock);
+        writer_running = TRUE;
+        pthread_mutex_unlock (&log_lock);
+        atexit (seafile_log_flush);
+    }
+    pthread_attr_destroy (&attr);
+}
+
+/* Called with log_lock held. */
+static void
+append_log_locked (const char *str)
+{
+    size_t len = strlen (str);
+
+    if (!writer_running || len > LOG_BUFFER_SIZE) {
+        if (writer_running)
+            wait_log_written ();
+        write_to_logfp (str, len);
+        return;
+    }
+
+    while (log_buf_len + len > LOG_BUFFER_SIZE) {
+        pthread_cond_signal (&log_cond);
+        pthread_cond_wait (&log_written_cond, &log_lock);
+    }
+
+    memcpy (log_buf + log_buf_len, str, len);
+    if (log_buf_len == 0)
+        pthread_cond_signal (&log_cond);
+    log_buf_len += len;
+}
+
+/* Called with log_lock held. The formatted time only changes once a
+ * second, so it's cached.
+ */
+static const char *
+get_timestamp (time_t t)
+{
+    struct tm *tm;
+#ifndef WIN32
+    struct tm tm_buf;
+#endif
+
+    if (t != timestamp_time) {
+#ifdef WIN32
+        tm = localtime (&t);
+#else
+        tm = localtime_r (&t, &tm_buf);
+#endif
+        if (!tm || strftime (timestamp, sizeof(timestamp), "[%x %X] ", tm) == 0)
+            timestamp[0] = '\0';
+        timestamp_time = t;
+    }
+
+    return timestamp;
+}
+
+/* Called with log_lock held. Returns FALSE if @message should be dropped. */
+static gboolean
+check_warning_rate (const char *message, time_t now)
+{
+    WarningRate *rate;
+    const char *end;
+    char *source;
+    char *note;
+
+    /* seaf_warning() puts the source file and line before the message. */
+    end = strstr (message, "): ");
+    if (end && end - message < 256)
+        source = g_strndup (message, end - message + 1);
+    else
+        source = g_strdup (message);
+
+    if (!warning_rates)
+        warning_rates = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                               g_free, g_free);
+
+    rate = g_hash_table_lookup (warning_rates, source);
+    if (!rate) {
+        if (g_hash_table_size (warning_rates) >= MAX_WARNING_RATE_ENTRIES)
+            g_hash_table_remove_all (warning_rates);
+        rate = g_new0 (WarningRate, 1);
+        rate->window_start = now;
+        g_hash_table_insert (warning_rates, source, rate);
+        source = NULL;
+    }
+
+    if (now - rate->window_start >= WARNING_RATE_WINDOW) {
+        if (rate->suppressed > 0) {
+            note = g_strdup_printf ("%s%d more warnings like the next one "
+                                    "were not logged.\n",
+                                    get_timestamp (now), rate->suppressed);
+            append_log_locked (note);
+            g_free (note);
+        }
+        rate->window_start = now;
+        rate->count = 0;
+        rate->suppressed = 0;
+    }
+
+    g_free (source);
+
+    if (rate->count >= WARNING_RATE_BURST) {
+        ++(rate->suppressed);
+        return FALSE;
+    }
+    ++(rate->count);
+
+    return TRUE;
+}
+
+static void
+write_log (GLogLevelFlags log_level, const gchar *message)
+{
+    time_t now = time (NULL);
+    char *line;
+
+    pthread_mutex_lock (&log_lock);
+
+    if ((log_level & G_LOG_LEVEL_MASK) == G_LOG_LEVEL_WARNING &&
+        !check_warning_rate (message, now)) {
+        pthread_mutex_unlock (&log_lock);
+        return;
+    }
+
+    line = g_strconcat (get_timestamp (now), message, NULL);
+    append_log_locked (line);
+    g_free (line);
+
+    /* The process may abort right after an error is logged. */
+    if (writer_running &&
+        (log_level & (G_LOG_FLAG_FATAL | G_LOG_LEVEL_ERROR | G_LOG_LEVEL_CRITICAL)))
+        wait_log_written ();
+
+    pthread_mutex_unlock (&log_lock);
+}
+
 static void 
 seafile_log (const gchar *log_domain, GLogLevelFlags log_level,
              const gchar *message,    gpointer user_data)
 {
-    time_t t;
-    struct tm *tm;
-    char buf[1024];
-    int len;
-
     if (log_level > seafile_log_level)
         return;
 
-    t = time(NULL);
-    tm = localtime(&t);
-    len = strftime (buf, 1024, "[%x %X] ", tm);
-    g_return_if_fail (len < 1024);
-    if (logfp != NULL) {    
-        fputs (buf, logfp);
-        fputs (message, logfp);
-        fflush (logfp);
-    } else { // log file not available
-        printf("%s %s", buf, message);
-    }
+    write_log (log_level, message);
 
 #ifndef WIN32
 #ifdef SEAFILE_SERVER
@@ -84,25 +329,10 @@ static void
 ccnet_log (const gchar *log_domain, GLogLevelFlags log_level,
              const gchar *message,    gpointer user_data)
 {
-    time_t t;
-    struct tm *tm;
-    char buf[1024];
-    int len;
-
     if (log_level > ccnet_log_level)
         return;
 
-    t = time(NULL);
-    tm = localtime(&t);
-    len = strftime (buf, 1024, "[%x %X] ", tm);
-    g_return_if_fail (len < 1024);
-    if (logfp != NULL) {
-        fputs (buf, logfp);
-        fputs (message, logfp);
-        fflush (logfp);
-    } else { // log file not available
-        printf("%s %s", buf, message);
-    }
+    write_log (log_level, message);
 
 #ifndef WIN32
 #ifdef SEAFILE_SERVER
@@ -149,6 +379,8 @@ seafile_log_init (const char *_logfile, const char *ccnet_debug_level_str,
         }
     }
 
+    start_log_writer ();
+
     return 0;
 }
 
@@ -167,8 +399,10 @@ seafile_log_reopen ()
 
     //TODO: check file's health
 
+    pthread_mutex_lock (&logfp_lock);
     oldfp = logfp;
     logfp = fp;
+    pthread_mutex_unlock (&logfp_lock);
     if (fclose(oldfp) < 0) {
         seaf_message ("Failed to close file %s\n", logfile);
         return -1;
@@ -0,0 +1,119 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#include "mem-budget.h"
+
+static const char *subsystem_names[N_SEAF_MEM_SUBSYSTEMS] = {
+    "chunking",
+    "checkout",
+    "fs_upload",
+    "block_upload",
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t released = PTHREAD_COND_INITIALIZER;
+
+static gint64 limit;
+static gint64 used;
+static int n_waiting;
+static gint64 subsystem_used[N_SEAF_MEM_SUBSYSTEMS];
+static gint64 subsystem_peak[N_SEAF_MEM_SUBSYSTEMS];
+
+void
+seaf_mem_budget_set_limit (gint64 new_limit)
+{
+    pthread_mutex_lock (&lock);
+    limit = MAX (new_limit, 0);
+    pthread_cond_broadcast (&released);
+    pthread_mutex_unlock (&lock);
+}
+
+/* Called with lock held. */
+static gboolean
+can_grant (gint64 size)
+{
+    return (limit == 0 || used == 0 || used + size <= limit);
+}
+
+/* Called with lock held. */
+static void
+grant (int subsystem, gint64 size)
+{
+    used += size;
+    subsystem_used[subsystem] += size;
+    if (subsystem_used[subsystem] > subsystem_peak[subsystem])
+        subsystem_peak[subsystem] = subsystem_used[subsystem];
+}
+
+void
+seaf_mem_budget_acquire (int subsystem, gint64 size)
+{
+    pthread_mutex_lock (&lock);
+
+    ++n_waiting;
+    while (!can_grant (size))
+        pthread_cond_wait (&released, &lock);
+    --n_waiting;
+
+    grant (subsystem, size);
+
+    pthread_mutex_unlock (&lock);
+}
+
+gboolean
+seaf_mem_budget_try_acquire (int subsystem, gint64 size)
+{
+    gboolean ret = FALSE;
+
+    pthread_mutex_lock (&lock);
+    if (can_grant (size)) {
+        grant (subsystem, size);
+        ret = TRUE;
+    }
+    pthread_mutex_unlock (&lock);
+
+    return ret;
+}
+
+void
+seaf_mem_budget_release (int subsystem, gint64 size)
+{
+    pthread_mutex_lock (&lock);
+    used -= size;
+    subsystem_used[subsystem] -= size;
+    if (n_waiting > 0)
+        pthread_cond_broadcast (&released);
+    pthread_mutex_unlock (&lock);
+}
+
+json_t *
+seaf_mem_budget_to_json ()
+{
+    json_t *object, *subsystems, *item;
+    int i;
+
+    object = json_object ();
+    subsystems = json_object ();
+
+    pthread_mutex_lock (&lock);
+
+    json_object_set_new (object, "limit", json_integer (limit));
+    json_object_set_new (object, "used", json_integer (used));
+    json_object_set_new (object, "waiting", json_integer (n_waiting));
+
+    for (i = 0; i < N_SEAF_MEM_SUBSYSTEMS; ++i) {
+        item = json_object ();
+        json_object_set_new (item, "used", json_integer (subsystem_used[i]));
+        json_object_set_new (item, "peak", json_integer (subsystem_peak[i]));
+        json_object_set_new (subsystems, subsystem_names[i], item);
+    }
+
+    pthread_mutex_unlock (&lock);
+
+    json_object_set_new (object, "subsystems", subsystems);
+
+    return object;
+}
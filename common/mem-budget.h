@@ -0,0 +1,52 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SEAF_MEM_BUDGET_H
+#define SEAF_MEM_BUDGET_H
+
+#include <glib.h>
+#include <jansson.h>
+
+/*
+ * Daemon wide accounting of large transfer buffers.
+ *
+ * Code that allocates block buffers or object packs acquires their size
+ * from the budget first and releases it after freeing them. Once the limit
+ * is reached, acquiring blocks until other buffers are released, which
+ * slows down the producers instead of letting memory grow.
+ *
+ * A request is always granted when nothing is in use, so a buffer larger
+ * than the limit doesn't wait forever. Callers that already hold budget
+ * must use seaf_mem_budget_try_acquire(), otherwise producers could wait
+ * on each other.
+ */
+
+enum {
+    SEAF_MEM_CHUNKING = 0,
+    SEAF_MEM_CHECKOUT,
+    SEAF_MEM_FS_UPLOAD,
+    SEAF_MEM_BLOCK_UPLOAD,
+    N_SEAF_MEM_SUBSYSTEMS,
+};
+
+/* Sets the limit in bytes. 0 disables the limit, usage is still counted. */
+void
+seaf_mem_budget_set_limit (gint64 limit);
+
+void
+seaf_mem_budget_acquire (int subsystem, gint64 size);
+
+/* Returns FALSE instead of waiting if the budget is exhausted. */
+gboolean
+seaf_mem_budget_try_acquire (int subsystem, gint64 size);
+
+void
+seaf_mem_budget_release (int subsystem, gint64 size);
+
+/*
+ * Returns the limit, total usage, number of waiting threads and the
+ * current and peak usage of every subsystem.
+ */
+json_t *
+seaf_mem_budget_to_json ();
+
+#endif
@@ -0,0 +1,489 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#include "metrics.h"
+#include "log.h"
+
+#define N_SHARDS 8
+
+/* Values below 2^SUB_BUCKET_BITS get a bucket each. Larger ones are split
+ * by their highest bit, then by the next SUB_BUCKET_BITS bits.
+ */
+#define SUB_BUCKET_BITS 2
+#define N_SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+/* About 12 days in microseconds. Larger values are counted as this. */
+#define MAX_VALUE_BITS 40
+#define N_BUCKETS (N_SUB_BUCKETS * (MAX_VALUE_BITS - SUB_BUCKET_BITS + 1))
+
+typedef struct MetricShard {
+    pthread_mutex_t lock;
+    /* Value of counters and gauges, sum of histograms. */
+    gint64 value;
+    gint64 count;
+    gint64 max;
+    gint64 *buckets;
+} MetricShard;
+
+struct SeafMetric {
+    int type;
+    char *name;
+    char *labels;
+    /* Gauges only use the first shard. */
+    MetricShard shards[N_SHARDS];
+};
+
+typedef struct MetricSnapshot {
+    SeafMetric *metric;
+    gint64 value;
+    gint64 count;
+    gint64 max;
+    gint64 buckets[N_BUCKETS];
+} MetricSnapshot;
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+/* "name{labels}" -> SeafMetric */
+static GHashTable *registry;
+
+static pthread_once_t shard_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t shard_key;
+static int next_shard;
+
+static void
+create_shard_key ()
+{
+    pthread_key_create (&shard_key, NULL);
+}
+
+/* Threads are assigned shards round robin, on their first update. */
+static int
+get_thread_shard ()
+{
+    void *data;
+    int shard;
+
+    pthread_once (&shard_key_once, create_shard_key);
+
+    data = pthread_getspecific (shard_key);
+    if (data)
+        return GPOINTER_TO_INT (data) - 1;
+
+    pthread_mutex_lock (&registry_lock);
+    shard = next_shard;
+    next_shard = (next_shard + 1) % N_SHARDS;
+    pthread_mutex_unlock (&registry_lock);
+
+    pthread_setspecific (shard_key, GINT_TO_POINTER (shard + 1));
+
+    return shard;
+}
+
+SeafMetric *
+seaf_metric_get (int type, const char *name, const char *labels)
+{
+    SeafMetric *metric;
+    char *key;
+    int i;
+
+    if (!labels)
+        labels = "";
+
+    key = g_strdup_printf ("%s{%s}", name, labels);
+
+    pthread_mutex_lock (&registry_lock);
+
+    if (!registry)
+        registry = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                          g_free, NULL);
+
+    metric = g_hash_table_lookup (registry, key);
+    if (metric) {
+        if (metric->type != type)
+            seaf_warning ("Metric %s is registered with another type.\n", key);
+        g_free (key);
+        goto out;
+    }
+
+    metric = g_new0 (SeafMetric, 1);
+    metric->type = type;
+    metric->name = g_strdup (name);
+    metric->labels = g_strdup (labels);
+    for (i = 0; i < N_SHARDS; ++i) {
+        pthread_mutex_init (&metric->shards[i].lock, NULL);
+        if (type == SEAF_METRIC_HISTOGRAM)
+            metric->shards[i].buckets = g_new0 (gint64, N_BUCKETS);
+    }
+
+    g_hash_table_insert (registry, key, metric);
+
+out:
+    pthread_mutex_unlock (&registry_lock);
+    return metric;
+}
+
+void
+seaf_metric_inc (SeafMetric *metric, gint64 delta)
+{
+    MetricShard *shard;
+
+    if (metric->type == SEAF_METRIC_GAUGE)
+        shard = &metric->shards[0];
+    else
+        shard = &metric->shards[get_thread_shard ()];
+
+    pthread_mutex_lock (&shard->lock);
+    shard->value += delta;
+    pthread_mutex_unlock (&shard->lock);
+}
+
+void
+seaf_metric_set (SeafMetric *metric, gint64 value)
+{
+    MetricShard *shard = &metric->shards[0];
+
+    pthread_mutex_lock (&shard->lock);
+    shard->value = value;
+    pthread_mutex_unlock (&shard->lock);
+}
+
+static int
+bucket_index (gint64 value)
+{
+    int bit = 0;
+
+    if (value < N_SUB_BUCKETS)
+        return (int)value;
+
+    while ((value >> (bit + 1)) != 0)
+        ++bit;
+
+    return (bit - SUB_BUCKET_BITS + 1) * N_SUB_BUCKETS +
+        (int)((value >> (bit - SUB_BUCKET_BITS)) & (N_SUB_BUCKETS - 1));
+}
+
+/* Largest value counted in bucket @index. */
+static gint64
+bucket_upper_bound (int index)
+{
+    int shift;
+
+    if (index < N_SUB_BUCKETS)
+        return index;
+
+    shift = index / N_SUB_BUCKETS - 1;
+    return ((gint64)(N_SUB_BUCKETS + index % N_SUB_BUCKETS + 1) << shift) - 1;
+}
+
+void
+seaf_metric_observe (SeafMetric *metric, gint64 value)
+{
+    MetricShard *shard = &metric->shards[get_thread_shard ()];
+
+    if (value < 0)
+        value = 0;
+    else if (value >= ((gint64)1 << MAX_VALUE_BITS))
+        value = ((gint64)1 << MAX_VALUE_BITS) - 1;
+
+    pthread_mutex_lock (&shard->lock);
+    shard->value += value;
+    ++(shard->count);
+    if (value > shard->max)
+        shard->max = value;
+    ++(shard->buckets[bucket_index (value)]);
+    pthread_mutex_unlock (&shard->lock);
+}
+
+gint64
+seaf_metrics_now ()
+{
+    GTimeVal tv;
+
+    g_get_current_time (&tv);
+    return (gint64)tv.tv_sec * G_USEC_PER_SEC + tv.tv_usec;
+}
+
+void
+seaf_metric_observe_since (SeafMetric *metric, gint64 start)
+{
+    seaf_metric_observe (metric, seaf_metrics_now () - start);
+}
+
+gint64
+seaf_metrics_process_cpu_time ()
+{
+#ifdef WIN32
+    FILETIME created, exited, kernel, user;
+    ULARGE_INTEGER k, u;
+
+    if (!GetProcessTimes (GetCurrentProcess (),
+                          &created, &exited, &kernel, &user))
+        return 0;
+
+    k.LowPart = kernel.dwLowDateTime;
+    k.HighPart = kernel.dwHighDateTime;
+    u.LowPart = user.dwLowDateTime;
+    u.HighPart = user.dwHighDateTime;
+
+    /* In units of 100 nanoseconds. */
+    return (gint64)((k.QuadPart + u.QuadPart) / 10);
+#else
+    struct rusage usage;
+
+    if (getrusage (RUSAGE_SELF, &usage) < 0)
+        return 0;
+
+    return (gint64)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * G_USEC_PER_SEC +
+        usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+#endif
+}
+
+/* Peak resident set size in bytes, 0 where it isn't known. */
+static gint64
+get_process_max_rss ()
+{
+#ifdef WIN32
+    return 0;
+#else
+    struct rusage usage;
+
+    if (getrusage (RUSAGE_SELF, &usage) < 0)
+        return 0;
+
+#ifdef __APPLE__
+    return (gint64)usage.ru_maxrss;
+#else
+    /* In kilobytes. */
+    return (gint64)usage.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+static pthread_once_t process_metrics_once = PTHREAD_ONCE_INIT;
+static SeafMetric *cpu_usec, *max_rss;
+
+static void
+create_process_metrics ()
+{
+    cpu_usec = seaf_metric_get (SEAF_METRIC_GAUGE,
+                                "seaf_process_cpu_usec", NULL);
+    max_rss = seaf_metric_get (SEAF_METRIC_GAUGE,
+                               "seaf_process_max_rss_bytes", NULL);
+}
+
+static void
+update_process_metrics ()
+{
+    pthread_once (&process_metrics_once, create_process_metrics);
+
+    seaf_metric_set (cpu_usec, seaf_metrics_process_cpu_time ());
+    seaf_metric_set (max_rss, get_process_max_rss ());
+}
+
+static int
+compare_metrics (gconstpointer a, gconstpointer b)
+{
+    const SeafMetric *m1 = *(SeafMetric **)a;
+    const SeafMetric *m2 = *(SeafMetric **)b;
+    int rc;
+
+    rc = strcmp (m1->name, m2->name);
+    if (rc != 0)
+        return rc;
+    return strcmp (m1->labels, m2->labels);
+}
+
+static void
+take_snapshot (SeafMetric *metric, MetricSnapshot *snap)
+{
+    MetricShard *shard;
+    int i, j;
+
+    memset (snap, 0, sizeof(MetricSnapshot));
+    snap->metric = metric;
+
+    for (i = 0; i < N_SHARDS; ++i) {
+        shard = &metric->shards[i];
+
+        pthread_mutex_lock (&shard->lock);
+        snap->value += shard->value;
+        snap->count += shard->count;
+        if (shard->max > snap->max)
+            snap->max = shard->max;
+        if (shard->buckets) {
+            for (j = 0; j < N_BUCKETS; ++j)
+                snap->buckets[j] += shard->buckets[j];
+        }
+        pthread_mutex_unlock (&shard->lock);
+    }
+}
+
+/* Returns the snapshots sorted by name and labels. */
+static MetricSnapshot *
+take_snapshots (int *n_snaps)
+{
+    GPtrArray *metrics;
+    MetricSnapshot *snaps;
+    GHashTableIter iter;
+    gpointer value;
+    guint i;
+
+    metrics = g_ptr_array_new ();
+
+    pthread_mutex_lock (&registry_lock);
+    if (registry) {
+        g_hash_table_iter_init (&iter, registry);
+        while (g_hash_table_iter_next (&iter, NULL, &value))
+            g_ptr_array_add (metrics, value);
+    }
+    pthread_mutex_unlock (&registry_lock);
+
+    g_ptr_array_sort (metrics, compare_metrics);
+
+    snaps = g_new0 (MetricSnapshot, MAX (metrics->len, 1));
+    for (i = 0; i < metrics->len; ++i)
+        take_snapshot (g_ptr_array_index (metrics, i), &snaps[i]);
+
+    *n_snaps = metrics->len;
+    g_ptr_array_free (metrics, TRUE);
+
+    return snaps;
+}
+
+static gint64
+snapshot_quantile (MetricSnapshot *snap, double q)
+{
+    gint64 rank, seen = 0;
+    int i;
+
+    if (snap->count == 0)
+        return 0;
+
+    rank = (gint64)(q * snap->count);
+    if (rank >= snap->count)
+        rank = snap->count - 1;
+
+    for (i = 0; i < N_BUCKETS; ++i) {
+        seen += snap->buckets[i];
+        if (seen > rank)
+            return MIN (bucket_upper_bound (i), snap->max);
+    }
+
+    return snap->max;
+}
+
+static const char *
+type_name (int type)
+{
+    switch (type) {
+    case SEAF_METRIC_COUNTER:
+        return "counter";
+    case SEAF_METRIC_GAUGE:
+        return "gauge";
+    default:
+        return "summary";
+    }
+}
+
+static const double quantiles[] = { 0.5, 0.9, 0.99 };
+static const char *quantile_keys[] = { "p50", "p90", "p99" };
+
+json_t *
+seaf_metrics_to_json ()
+{
+    MetricSnapshot *snaps, *snap;
+    json_t *array, *object;
+    int n_snaps, i, j;
+
+    update_process_metrics ();
+    snaps = take_snapshots (&n_snaps);
+
+    array = json_array ();
+    for (i = 0; i < n_snaps; ++i) {
+        snap = &snaps[i];
+
+        object = json_object ();
+        json_object_set_new (object, "name", json_string (snap->metric->name));
+        json_object_set_new (object, "labels",
+                             json_string (snap->metric->labels));
+        json_object_set_new (object, "type",
+                             json_string (type_name (snap->metric->type)));
+
+        if (snap->metric->type == SEAF_METRIC_HISTOGRAM) {
+            json_object_set_new (object, "count", json_integer (snap->count));
+            json_object_set_new (object, "sum", json_integer (snap->value));
+            json_object_set_new (object, "max", json_integer (snap->max));
+            for (j = 0; j < G_N_ELEMENTS (quantiles); ++j)
+                json_object_set_new (object, quantile_keys[j],
+                                     json_integer (snapshot_quantile (snap, quantiles[j])));
+        } else {
+            json_object_set_new (object, "value", json_integer (snap->value));
+        }
+
+        json_array_append_new (array, object);
+    }
+
+    g_free (snaps);
+
+    return array;
+}
+
+char *
+seaf_metrics_to_text ()
+{
+    MetricSnapshot *snaps, *snap;
+    GString *buf;
+    const char *name, *labels;
+    const char *last_name = NULL;
+    char *braced;
+    int n_snaps, i, j;
+
+    update_process_metrics ();
+    snaps = take_snapshots (&n_snaps);
+
+    buf = g_string_new (NULL);
+    for (i = 0; i < n_snaps; ++i) {
+        snap = &snaps[i];
+        name = snap->metric->name;
+        labels = snap->metric->labels;
+
+        if (!last_name || strcmp (last_name, name) != 0) {
+            g_string_append_printf (buf, "# TYPE %s %s\n", name,
+                                    type_name (snap->metric->type));
+            last_name = name;
+        }
+
+        braced = (*labels != '\0') ? g_strdup_printf ("{%s}", labels) :
+            g_strdup ("");
+
+        if (snap->metric->type != SEAF_METRIC_HISTOGRAM) {
+            g_string_append_printf (buf, "%s%s %" G_GINT64_FORMAT "\n",
+                                    name, braced, snap->value);
+            g_free (braced);
+            continue;
+        }
+
+        for (j = 0; j < G_N_ELEMENTS (quantiles); ++j)
+            g_string_append_printf (buf,
+                                    "%s{%s%squantile=\"%g\"} %" G_GINT64_FORMAT "\n",
+                                    name, labels, (*labels != '\0') ? "," : "",
+                                    quantiles[j],
+                                    snapshot_quantile (snap, quantiles[j]));
+        g_string_append_printf (buf, "%s_sum%s %" G_GINT64_FORMAT "\n",
+                                name, braced, snap->value);
+        g_string_append_printf (buf, "%s_count%s %" G_GINT64_FORMAT "\n",
+                                name, braced, snap->count);
+        g_free (braced);
+    }
+
+    g_free (snaps);
+
+    return g_string_free (buf, FALSE);
+}
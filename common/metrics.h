@@ -0,0 +1,68 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SEAF_METRICS_H
+#define SEAF_METRICS_H
+
+#include <glib.h>
+#include <jansson.h>
+
+/*
+ * Process wide counters, gauges and latency histograms.
+ *
+ * A metric is identified by its name and labels, e.g. "seaf_obj_read_usec"
+ * and "type=\"fs\"". Metrics are created on first use and never freed, so
+ * callers on hot paths should look them up once and keep the pointer.
+ *
+ * Counters and histograms are split into shards that are picked per thread,
+ * so that threads updating the same metric don't contend on one lock.
+ * Histograms use logarithmic buckets with 4 sub-buckets per power of 2,
+ * which keeps the reported quantiles within 25% of the real values.
+ */
+
+enum {
+    SEAF_METRIC_COUNTER = 0,
+    SEAF_METRIC_GAUGE,
+    SEAF_METRIC_HISTOGRAM,
+};
+
+typedef struct SeafMetric SeafMetric;
+
+SeafMetric *
+seaf_metric_get (int type, const char *name, const char *labels);
+
+void
+seaf_metric_inc (SeafMetric *metric, gint64 delta);
+
+/* Gauges only. */
+void
+seaf_metric_set (SeafMetric *metric, gint64 value);
+
+/* Histograms only. */
+void
+seaf_metric_observe (SeafMetric *metric, gint64 value);
+
+/* Current time in microseconds, for timing with seaf_metric_observe(). */
+gint64
+seaf_metrics_now ();
+
+/* User and system CPU time of the process in microseconds. */
+gint64
+seaf_metrics_process_cpu_time ();
+
+/* Records the time since @start, as returned by seaf_metrics_now(). */
+void
+seaf_metric_observe_since (SeafMetric *metric, gint64 start);
+
+/*
+ * Snapshot of all metrics as an array of objects. Histograms are reported
+ * with their count, sum, max and 50th/90th/99th percentiles. The process
+ * CPU time and peak RSS are included as gauges.
+ */
+json_t *
+seaf_metrics_to_json ();
+
+/* The same snapshot in the Prometheus text exposition format. */
+char *
+seaf_metrics_to_text ();
+
+#endif
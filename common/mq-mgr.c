@@ -61,3 +61,29 @@ seaf_mq_manager_pop_message (SeafMqManager *mgr)
 
     return g_async_queue_try_pop (async_queue);
 }
+
+json_t *
+seaf_mq_manager_wait_messages (SeafMqManager *mgr, gint64 timeout_usec,
+                               int max_messages)
+{
+    const char *chan = SEAFILE_NOTIFY_CHAN;
+    GAsyncQueue *async_queue = g_hash_table_lookup (mgr->priv->chans, chan);
+    json_t *messages, *msg;
+
+    if (!async_queue) {
+        seaf_warning ("Unkonwn message channel %s.\n", chan);
+        return NULL;
+    }
+
+    messages = json_array ();
+
+    msg = g_async_queue_timeout_pop (async_queue, timeout_usec);
+    while (msg) {
+        json_array_append_new (messages, msg);
+        if (json_array_size (messages) >= max_messages)
+            break;
+        msg = g_async_queue_try_pop (async_queue);
+    }
+
+    return messages;
+}
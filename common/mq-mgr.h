@@ -21,4 +21,13 @@ seaf_mq_manager_publish_notification (SeafMqManager *mgr, const char *type, cons
 json_t *
 seaf_mq_manager_pop_message (SeafMqManager *mgr);
 
+/*
+ * Waits up to @timeout_usec for a message. Returns an array of it and the
+ * messages queued after it, at most @max_messages. The array is empty if
+ * no message arrived in time.
+ */
+json_t *
+seaf_mq_manager_wait_messages (SeafMqManager *mgr, gint64 timeout_usec,
+                               int max_messages);
+
 #endif
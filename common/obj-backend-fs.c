@@ -2,9 +2,17 @@
 #define _WIN32_WINNT 0x500
 #endif
 
+#if defined __linux__ && !defined _GNU_SOURCE
+/* For syncfs(). */
+#define _GNU_SOURCE
+#endif
+
 #include "common.h"
 #include "utils.h"
 #include "obj-backend.h"
+#include "uring-io.h"
+
+#include <pthread.h>
 
 #ifndef WIN32
 #include <sys/types.h>
@@ -25,8 +33,17 @@ typedef struct FsPriv {
     int v0_dir_len;
     char *obj_dir;
     int   dir_len;
+
+    GHashTable *batches;        /* store dir -> FsBatch */
+    pthread_mutex_t batch_lock;
 } FsPriv;
 
+typedef struct FsBatch {
+    int depth;
+    char *store_dir;
+    GPtrArray *paths;           /* objects written in the batch */
+} FsBatch;
+
 static void
 id_to_path (FsPriv *priv, const char *obj_id, char path[],
             const char *repo_id, int version)
@@ -55,6 +72,16 @@ id_to_path (FsPriv *priv, const char *obj_id, char path[],
     memcpy (pos, obj_id + 2, 41 - 2);
 }
 
+static char *
+get_store_dir (FsPriv *priv, const char *repo_id, int version)
+{
+#if defined MIGRATION || defined SEAFILE_CLIENT
+    if (version == 0)
+        return g_strdup (priv->v0_obj_dir);
+#endif
+    return g_build_filename (priv->obj_dir, repo_id, NULL);
+}
+
 static int
 obj_backend_fs_read (ObjBackend *bend,
                      const char *repo_id,
@@ -95,74 +122,14 @@ obj_backend_fs_read (ObjBackend *bend,
     return 0;
 }
 
-/*
- * Flush operating system and disk caches for @fd.
- */
-static int
-fsync_obj_contents (int fd)
-{
 #ifdef __linux__
-    /* Some file systems may not support fsync().
-     * In this case, just skip the error.
-     */
-    if (fsync (fd) < 0) {
-        if (errno == EINVAL)
-            return 0;
-        else {
-            seaf_warning ("Failed to fsync: %s.\n", strerror(errno));
-            return -1;
-        }
-    }
-    return 0;
-#endif
-
-#ifdef __APPLE__
-    /* OS X: fcntl() is required to flush disk cache, fsync() only
-     * flushes operating system cache.
-     */
-    if (fcntl (fd, F_FULLFSYNC, NULL) < 0) {
-        seaf_warning ("Failed to fsync: %s.\n", strerror(errno));
-        return -1;
-    }
-    return 0;
-#endif
-
-#ifdef WIN32
-    HANDLE handle;
-
-    handle = (HANDLE)_get_osfhandle (fd);
-    if (handle == INVALID_HANDLE_VALUE) {
-        seaf_warning ("Failed to get handle from fd.\n");
-        return -1;
-    }
-
-    if (!FlushFileBuffers (handle)) {
-        seaf_warning ("FlushFileBuffer() failed: %lu.\n", GetLastError());
-        return -1;
-    }
-
-    return 0;
-#endif
-}
-
-/*
- * Rename file from @tmp_path to @obj_path.
- * This also makes sure the changes to @obj_path's parent folder
- * is flushed to disk.
- */
+/* Flushes the entry of @obj_path in its parent folder to disk. */
 static int
-rename_and_sync (const char *tmp_path, const char *obj_path)
+sync_parent_dir (const char *obj_path)
 {
-#ifdef __linux__
     char *parent_dir;
     int ret = 0;
 
-    if (rename (tmp_path, obj_path) < 0) {
-        seaf_warning ("Failed to rename from %s to %s: %s.\n",
-                      tmp_path, obj_path, strerror(errno));
-        return -1;
-    }
-
     parent_dir = g_path_get_dirname (obj_path);
     int dir_fd = open (parent_dir, O_RDONLY);
     if (dir_fd < 0) {
@@ -186,6 +153,25 @@ out:
     if (dir_fd >= 0)
         close (dir_fd);
     return ret;
+}
+#endif
+
+/*
+ * Rename file from @tmp_path to @obj_path.
+ * This also makes sure the changes to @obj_path's parent folder
+ * is flushed to disk.
+ */
+static int
+rename_and_sync (const char *tmp_path, const char *obj_path)
+{
+#ifdef __linux__
+    if (rename (tmp_path, obj_path) < 0) {
+        seaf_warning ("Failed to rename from %s to %s: %s.\n",
+                      tmp_path, obj_path, strerror(errno));
+        return -1;
+    }
+
+    return sync_parent_dir (obj_path);
 #endif
 
 #ifdef __APPLE__
@@ -234,13 +220,25 @@ save_obj_contents (const char *path, const void *data, int len, gboolean need_sy
         return -1;
     }
 
+#ifdef HAVE_LIBURING
+    if (seaf_uring_available ()) {
+        if (seaf_uring_write_file (fd, data, len, need_sync, tmp_path, path) < 0) {
+            seaf_warning ("[obj backend] Failed to write obj %s.\n", path);
+            return -1;
+        }
+        if (need_sync)
+            return sync_parent_dir (path);
+        return 0;
+    }
+#endif
+
     if (writen (fd, data, len) < 0) {
         seaf_warning ("[obj backend] Failed to write obj %s: %s.\n",
                       tmp_path, strerror(errno));
         return -1;
     }
 
-    if (need_sync && fsync_obj_contents (fd) < 0)
+    if (need_sync && seaf_util_fsync (fd) < 0)
         return -1;
 
     /* Close may return error, especially in NFS. */
@@ -296,10 +294,19 @@ obj_backend_fs_write (ObjBackend *bend,
                       int len,
                       gboolean need_sync)
 {
+    FsPriv *priv = bend->priv;
     char path[SEAF_PATH_MAX];
+    char *store_dir;
+    gboolean in_batch;
+    FsBatch *batch;
 
     id_to_path (bend->priv, obj_id, path, repo_id, version);
 
+    store_dir = get_store_dir (priv, repo_id, version);
+    pthread_mutex_lock (&priv->batch_lock);
+    in_batch = (g_hash_table_lookup (priv->batches, store_dir) != NULL);
+    pthread_mutex_unlock (&priv->batch_lock);
+
     /* GTimeVal s, e; */
 
     /* g_get_current_time (&s); */
@@ -307,15 +314,29 @@ obj_backend_fs_write (ObjBackend *bend,
     if (create_parent_path (path) < 0) {
         seaf_warning ("[obj backend] Failed to create path for obj %s:%s.\n",
                       repo_id, obj_id);
+        g_free (store_dir);
         return -1;
     }
 
-    if (save_obj_contents (path, data, len, need_sync) < 0) {
+    if (save_obj_contents (path, data, len, need_sync && !in_batch) < 0) {
         seaf_warning ("[obj backend] Failed to write obj %s:%s.\n",
                       repo_id, obj_id);
+        g_free (store_dir);
         return -1;
     }
 
+    if (in_batch) {
+        pthread_mutex_lock (&priv->batch_lock);
+        /* The batch may have been committed meanwhile. Then the object is
+         * left unsynced, as if it had been written right after the commit.
+         */
+        batch = g_hash_table_lookup (priv->batches, store_dir);
+        if (batch)
+            g_ptr_array_add (batch->paths, g_strdup(path));
+        pthread_mutex_unlock (&priv->batch_lock);
+    }
+    g_free (store_dir);
+
     /* g_get_current_time (&e); */
 
     /* seaf_message ("write obj time: %ldus.\n", */
@@ -398,6 +419,8 @@ obj_backend_fs_foreach_obj (ObjBackend *bend,
 
         while ((dname2 = g_dir_read_name(dir2)) != NULL) {
             snprintf (obj_id, sizeof(obj_id), "%s%s", dname1, dname2);
+            if (!is_object_id_valid (obj_id))
+                continue;
             if (!process (repo_id, version, obj_id, user_data)) {
                 g_dir_close (dir2);
                 goto out;
@@ -502,6 +525,192 @@ obj_backend_fs_remove_store (ObjBackend *bend, const char *store_id)
     return 0;
 }
 
+static void
+fs_batch_free (FsBatch *batch)
+{
+    g_free (batch->store_dir);
+    g_ptr_array_free (batch->paths, TRUE);
+    g_free (batch);
+}
+
+static int
+obj_backend_fs_begin_batch (ObjBackend *bend,
+                            const char *repo_id,
+                            int version)
+{
+    FsPriv *priv = bend->priv;
+    char *store_dir;
+    FsBatch *batch;
+
+    store_dir = get_store_dir (priv, repo_id, version);
+
+    pthread_mutex_lock (&priv->batch_lock);
+    batch = g_hash_table_lookup (priv->batches, store_dir);
+    if (!batch) {
+        batch = g_new0 (FsBatch, 1);
+        batch->store_dir = store_dir;
+        batch->paths = g_ptr_array_new_with_free_func (g_free);
+        g_hash_table_insert (priv->batches, batch->store_dir, batch);
+    } else {
+        g_free (store_dir);
+    }
+    ++(batch->depth);
+    pthread_mutex_unlock (&priv->batch_lock);
+
+    return 0;
+}
+
+#ifndef HAVE_SYNCFS
+static int
+sync_path (const char *path, gboolean is_dir)
+{
+    int fd;
+    int ret = 0;
+
+#ifdef WIN32
+    /* FlushFileBuffers() needs write access. Directory entries are
+     * written through by the file system.
+     */
+    if (is_dir)
+        return 0;
+    fd = g_open (path, O_RDWR | O_BINARY, 0);
+#else
+    fd = g_open (path, O_RDONLY, 0);
+#endif
+    if (fd < 0) {
+        seaf_warning ("[obj backend] Failed to open %s for sync: %s.\n",
+                      path, strerror(errno));
+        return -1;
+    }
+
+#ifdef __APPLE__
+    /* OS X: a plain fsync() only pushes the data to the drive. The drive
+     * cache is flushed once for the whole batch by the caller.
+     */
+    if (fsync (fd) < 0 && errno != EINVAL) {
+        seaf_warning ("[obj backend] Failed to fsync %s: %s.\n",
+                      path, strerror(errno));
+        ret = -1;
+    }
+#else
+    if (is_dir) {
+        /* Some file systems don't support fsyncing a directory. */
+        if (fsync (fd) < 0 && errno != EINVAL) {
+            seaf_warning ("[obj backend] Failed to fsync dir %s: %s.\n",
+                          path, strerror(errno));
+            ret = -1;
+        }
+    } else {
+        ret = seaf_util_fsync (fd);
+    }
+#endif
+
+    close (fd);
+    return ret;
+}
+#endif
+
+/* Make the objects written in @batch durable with one pass. */
+static int
+sync_batch (FsBatch *batch)
+{
+#ifdef HAVE_SYNCFS
+    int fd;
+    int ret = 0;
+
+    if (batch->paths->len == 0)
+        return 0;
+
+    /* One syncfs() flushes the data and the directory entries of all the
+     * objects in the batch.
+     */
+    fd = g_open (batch->store_dir, O_RDONLY, 0);
+    if (fd < 0) {
+        seaf_warning ("[obj backend] Failed to open %s: %s.\n",
+                      batch->store_dir, strerror(errno));
+        return -1;
+    }
+    if (syncfs (fd) < 0) {
+        seaf_warning ("[obj backend] Failed to syncfs %s: %s.\n",
+                      batch->store_dir, strerror(errno));
+        ret = -1;
+    }
+    close (fd);
+    return ret;
+#else
+    GHashTable *dirs;
+    GHashTableIter iter;
+    gpointer key;
+    char *path, *dir;
+    guint i;
+    int ret = 0;
+
+    dirs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+    for (i = 0; i < batch->paths->len; ++i) {
+        path = g_ptr_array_index (batch->paths, i);
+        if (sync_path (path, FALSE) < 0)
+            ret = -1;
+        dir = g_path_get_dirname (path);
+        g_hash_table_replace (dirs, dir, dir);
+    }
+
+    g_hash_table_iter_init (&iter, dirs);
+    while (g_hash_table_iter_next (&iter, &key, NULL)) {
+        if (sync_path (key, TRUE) < 0)
+            ret = -1;
+    }
+
+#ifdef __APPLE__
+    if (batch->paths->len > 0) {
+        int fd = g_open (g_ptr_array_index (batch->paths, 0), O_RDONLY, 0);
+        if (fd >= 0) {
+            if (seaf_util_fsync (fd) < 0)
+                ret = -1;
+            close (fd);
+        }
+    }
+#endif
+
+    g_hash_table_destroy (dirs);
+    return ret;
+#endif
+}
+
+static int
+obj_backend_fs_commit_batch (ObjBackend *bend,
+                             const char *repo_id,
+                             int version)
+{
+    FsPriv *priv = bend->priv;
+    char *store_dir;
+    FsBatch *batch;
+    int ret = 0;
+
+    store_dir = get_store_dir (priv, repo_id, version);
+
+    pthread_mutex_lock (&priv->batch_lock);
+    batch = g_hash_table_lookup (priv->batches, store_dir);
+    if (batch && --(batch->depth) == 0)
+        g_hash_table_steal (priv->batches, store_dir);
+    else
+        batch = NULL;
+    pthread_mutex_unlock (&priv->batch_lock);
+
+    g_free (store_dir);
+
+    if (!batch)
+        return 0;
+
+    ret = sync_batch (batch);
+    if (ret < 0)
+        seaf_warning ("[obj backend] Failed to sync objects of store %s.\n",
+                      repo_id);
+
+    fs_batch_free (batch);
+    return ret;
+}
+
 ObjBackend *
 obj_backend_fs_new (const char *seaf_dir, const char *obj_type)
 {
@@ -537,6 +746,11 @@ obj_backend_fs_new (const char *seaf_dir, const char *obj_type)
     bend->foreach_obj = obj_backend_fs_foreach_obj;
     bend->copy = obj_backend_fs_copy;
     bend->remove_store = obj_backend_fs_remove_store;
+    bend->begin_batch = obj_backend_fs_begin_batch;
+    bend->commit_batch = obj_backend_fs_commit_batch;
+
+    priv->batches = g_hash_table_new (g_str_hash, g_str_equal);
+    pthread_mutex_init (&priv->batch_lock, NULL);
 
     return bend;
 
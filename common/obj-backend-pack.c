@@ -0,0 +1,1127 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Packed object backend for fs and commit objects.
+ *
+ * Objects of a version 1 store are appended to pack files under
+ *
+ *     <seaf_dir>/storage/<obj_type>/<store_id>/packs/pack-<n>.pack
+ *
+ * Each object in a pack is preceded by a small header (object id and size),
+ * so a pack can always be re-indexed by scanning it. Once a pack is full it
+ * is sealed: a sorted index pack-<n>.idx is written next to it, and both
+ * files are mmap'd when the store is opened. Looking up an object in a sealed
+ * pack is a binary search plus a memcpy, with no system call.
+ *
+ * Objects in the pack currently being written are indexed in memory. Packs
+ * left unsealed by a previous run are scanned and sealed on open.
+ *
+ * Objects are immutable, so deletion is recorded in a small log of tombstones
+ * rather than by rewriting packs.
+ *
+ * Inside a write batch, objects are appended without syncing; committing the
+ * batch syncs the current pack once. Sealed packs are synced when sealed.
+ *
+ * Version 0 stores and objects stored in the one-file-per-object layout are
+ * handled by the fs backend, so existing stores keep working without a
+ * migration.
+ */
+
+#include "common.h"
+
+#include "utils.h"
+#include "obj-backend.h"
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#define DEBUG_FLAG SEAFILE_DEBUG_OTHER
+#include "log.h"
+
+#define PACK_DIR_NAME "packs"
+#define DELETED_LOG_NAME "deleted"
+
+#define PACK_IDX_MAGIC "SOI1"
+#define PACK_IDX_MAGIC_LEN 4
+
+/* Seal the current pack once it grows beyond this size. */
+#define MAX_OBJ_PACK_SIZE (1 << 24) /* 16MB */
+
+enum {
+    DELETED_OP_DELETE = 1,
+    DELETED_OP_RESTORE,
+};
+
+/* Integers in pack files are stored in big endian. */
+#ifdef WIN32
+__pragma(pack(push, 1))
+typedef struct {
+    guint8 id[20];
+    guint32 size;
+} ObjHeader;
+
+typedef struct {
+    guint8 id[20];
+    guint64 offset;
+    guint32 size;
+} IdxEntry;
+
+typedef struct {
+    guint8 op;
+    guint8 id[20];
+} DeletedRecord;
+__pragma(pack(pop))
+#else
+typedef struct {
+    guint8 id[20];
+    guint32 size;
+} __attribute__((__packed__)) ObjHeader;
+
+typedef struct {
+    guint8 id[20];
+    guint64 offset;
+    guint32 size;
+} __attribute__((__packed__)) IdxEntry;
+
+typedef struct {
+    guint8 op;
+    guint8 id[20];
+} __attribute__((__packed__)) DeletedRecord;
+#endif
+
+typedef struct SealedPack {
+    guint32 num;
+    GMappedFile *data;
+    GMappedFile *idx;
+    const IdxEntry *entries;
+    guint32 n_entries;
+} SealedPack;
+
+typedef struct CurEntry {
+    gint64 offset;              /* offset of the object data */
+    guint32 size;
+} CurEntry;
+
+typedef struct ObjPackStore {
+    char store_id[37];
+    char *pack_dir;
+
+    GPtrArray *sealed;          /* SealedPack, newest last */
+
+    guint32 cur_pack;
+    int cur_fd;                 /* -1 until the first write */
+    gint64 cur_size;
+    GHashTable *cur_objs;       /* raw id -> CurEntry */
+
+    GHashTable *deleted;        /* raw id set */
+    int deleted_fd;
+
+    int batch_depth;
+
+    pthread_mutex_t lock;
+
+    /* Protected by stores_lock. */
+    int ref_count;
+} ObjPackStore;
+
+typedef struct PackPriv {
+    char *obj_dir;
+    ObjBackend *fs;             /* fallback for v0 stores and loose objects */
+    GHashTable *stores;         /* store_id -> ObjPackStore */
+    /* Stores released while still in use, store_id -> ObjPackStore. */
+    GHashTable *released;
+    pthread_mutex_t stores_lock;
+} PackPriv;
+
+static guint
+raw_id_hash (gconstpointer key)
+{
+    /* Object ids are SHA-1 hashes, any 4 bytes are well distributed. */
+    guint h;
+    memcpy (&h, key, sizeof(h));
+    return h;
+}
+
+static gboolean
+raw_id_equal (gconstpointer a, gconstpointer b)
+{
+    return memcmp (a, b, 20) == 0;
+}
+
+static char *
+pack_path (ObjPackStore *store, guint32 num, const char *suffix)
+{
+    return g_strdup_printf ("%s/pack-%08u.%s", store->pack_dir, num, suffix);
+}
+
+static void
+sealed_pack_free (SealedPack *pack)
+{
+    if (pack->data)
+        g_mapped_file_unref (pack->data);
+    if (pack->idx)
+        g_mapped_file_unref (pack->idx);
+    g_free (pack);
+}
+
+static void
+obj_pack_store_free (ObjPackStore *store)
+{
+    if (!store)
+        return;
+
+    if (store->cur_fd >= 0)
+        close (store->cur_fd);
+    if (store->deleted_fd >= 0)
+        close (store->deleted_fd);
+    g_ptr_array_free (store->sealed, TRUE);
+    g_hash_table_destroy (store->cur_objs);
+    g_hash_table_destroy (store->deleted);
+    g_free (store->pack_dir);
+    pthread_mutex_destroy (&store->lock);
+    g_free (store);
+}
+
+/* Sealed packs. */
+
+static SealedPack *
+load_sealed_pack (ObjPackStore *store, guint32 num)
+{
+    SealedPack *pack;
+    char *data_path, *idx_path;
+    GError *error = NULL;
+    const char *contents;
+    gsize len;
+    guint32 n;
+
+    pack = g_new0 (SealedPack, 1);
+    pack->num = num;
+
+    data_path = pack_path (store, num, "pack");
+    idx_path = pack_path (store, num, "idx");
+
+    pack->idx = g_mapped_file_new (idx_path, FALSE, &error);
+    if (!pack->idx) {
+        seaf_warning ("[pack obj bend] Failed to map %s: %s.\n",
+                      idx_path, error->message);
+        g_clear_error (&error);
+        goto error;
+    }
+
+    contents = g_mapped_file_get_contents (pack->idx);
+    len = g_mapped_file_get_length (pack->idx);
+    if (len < PACK_IDX_MAGIC_LEN + sizeof(guint32) ||
+        memcmp (contents, PACK_IDX_MAGIC, PACK_IDX_MAGIC_LEN) != 0) {
+        seaf_warning ("[pack obj bend] Bad index file %s.\n", idx_path);
+        goto error;
+    }
+
+    memcpy (&n, contents + PACK_IDX_MAGIC_LEN, sizeof(n));
+    n = GUINT32_FROM_BE (n);
+    if (len != PACK_IDX_MAGIC_LEN + sizeof(guint32) + (gsize)n * sizeof(IdxEntry)) {
+        seaf_warning ("[pack obj bend] Index file %s is truncated.\n", idx_path);
+        goto error;
+    }
+    pack->entries = (const IdxEntry *)(contents + PACK_IDX_MAGIC_LEN + sizeof(guint32));
+    pack->n_entries = n;
+
+    pack->data = g_mapped_file_new (data_path, FALSE, &error);
+    if (!pack->data) {
+        seaf_warning ("[pack obj bend] Failed to map %s: %s.\n",
+                      data_path, error->message);
+        g_clear_error (&error);
+        goto error;
+    }
+
+    g_free (data_path);
+    g_free (idx_path);
+    return pack;
+
+error:
+    g_free (data_path);
+    g_free (idx_path);
+    sealed_pack_free (pack);
+    return NULL;
+}
+
+static const IdxEntry *
+sealed_pack_lookup (SealedPack *pack, const guint8 *id)
+{
+    guint32 lo = 0, hi = pack->n_entries, mid;
+    int cmp;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        cmp = memcmp (pack->entries[mid].id, id, 20);
+        if (cmp == 0)
+            return &pack->entries[mid];
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return NULL;
+}
+
+static int
+compare_idx_entry (const void *a, const void *b)
+{
+    return memcmp (((const IdxEntry *)a)->id, ((const IdxEntry *)b)->id, 20);
+}
+
+/* Write the sorted index of pack @num from @objs. */
+static int
+write_pack_idx (ObjPackStore *store, guint32 num, GHashTable *objs)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    CurEntry *ce;
+    IdxEntry *entries;
+    guint32 n = 0, n_be;
+    char *idx_path, *tmp_path;
+    int fd = -1;
+    int ret = 0;
+
+    entries = g_new0 (IdxEntry, g_hash_table_size (objs) + 1);
+    g_hash_table_iter_init (&iter, objs);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        ce = value;
+        memcpy (entries[n].id, key, 20);
+        entries[n].offset = GUINT64_TO_BE ((guint64)ce->offset);
+        entries[n].size = GUINT32_TO_BE (ce->size);
+        ++n;
+    }
+    qsort (entries, n, sizeof(IdxEntry), compare_idx_entry);
+
+    idx_path = pack_path (store, num, "idx");
+    tmp_path = g_strconcat (idx_path, ".tmp", NULL);
+
+    fd = g_open (tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+    if (fd < 0) {
+        seaf_warning ("[pack obj bend] Failed to create %s: %s.\n",
+                      tmp_path, strerror(errno));
+        ret = -1;
+        goto out;
+    }
+
+    n_be = GUINT32_TO_BE (n);
+    if (writen (fd, PACK_IDX_MAGIC, PACK_IDX_MAGIC_LEN) != PACK_IDX_MAGIC_LEN ||
+        writen (fd, &n_be, sizeof(n_be)) != sizeof(n_be) ||
+        writen (fd, entries, n * sizeof(IdxEntry)) != (ssize_t)(n * sizeof(IdxEntry))) {
+        seaf_warning ("[pack obj bend] Failed to write %s: %s.\n",
+                      tmp_path, strerror(errno));
+        ret = -1;
+        goto out;
+    }
+
+    if (seaf_util_fsync (fd) < 0) {
+        ret = -1;
+        goto out;
+    }
+
+    close (fd);
+    fd = -1;
+
+    if (seaf_util_rename (tmp_path, idx_path) < 0) {
+        seaf_warning ("[pack obj bend] Failed to rename %s: %s.\n",
+                      tmp_path, strerror(errno));
+        ret = -1;
+        goto out;
+    }
+
+    /* The sealed pack is published with its index. */
+    if (seaf_util_fsync_dir (store->pack_dir) < 0)
+        ret = -1;
+
+out:
+    if (fd >= 0)
+        close (fd);
+    if (ret < 0)
+        g_unlink (tmp_path);
+    g_free (idx_path);
+    g_free (tmp_path);
+    g_free (entries);
+    return ret;
+}
+
+/* Index the objects in an unsealed pack left by a previous run.
+ * A partial object at the end is ignored.
+ */
+static GHashTable *
+scan_pack (const char *path)
+{
+    GMappedFile *file;
+    GError *error = NULL;
+    const char *contents;
+    gsize len, off = 0;
+    ObjHeader hdr;
+    CurEntry *ce;
+    guint32 size;
+    GHashTable *objs;
+
+    file = g_mapped_file_new (path, FALSE, &error);
+    if (!file) {
+        seaf_warning ("[pack obj bend] Failed to map %s: %s.\n",
+                      path, error->message);
+        g_clear_error (&error);
+        return NULL;
+    }
+
+    objs = g_hash_table_new_full (raw_id_hash, raw_id_equal, g_free, g_free);
+
+    contents = g_mapped_file_get_contents (file);
+    len = g_mapped_file_get_length (file);
+    while (off + sizeof(ObjHeader) <= len) {
+        memcpy (&hdr, contents + off, sizeof(hdr));
+        size = GUINT32_FROM_BE (hdr.size);
+        if (off + sizeof(ObjHeader) + size > len)
+            break;
+
+        ce = g_new0 (CurEntry, 1);
+        ce->offset = off + sizeof(ObjHeader);
+        ce->size = size;
+        g_hash_table_replace (objs, g_memdup (hdr.id, 20), ce);
+
+        off += sizeof(ObjHeader) + size;
+    }
+
+    g_mapped_file_unref (file);
+    return objs;
+}
+
+static int
+compare_uint (gconstpointer a, gconstpointer b)
+{
+    guint32 x = GPOINTER_TO_UINT(*(gpointer *)a);
+    guint32 y = GPOINTER_TO_UINT(*(gpointer *)b);
+
+    return (x > y) - (x < y);
+}
+
+static void
+load_packs (ObjPackStore *store)
+{
+    GDir *dir;
+    const char *dname;
+    GPtrArray *nums;
+    GHashTable *idx_set;
+    guint32 num;
+    guint i;
+    char *path;
+    GHashTable *objs;
+    SealedPack *pack;
+
+    dir = g_dir_open (store->pack_dir, 0, NULL);
+    if (!dir)
+        return;
+
+    nums = g_ptr_array_new ();
+    idx_set = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+    while ((dname = g_dir_read_name (dir)) != NULL) {
+        if (!g_str_has_prefix (dname, "pack-"))
+            continue;
+        num = (guint32)strtoul (dname + strlen("pack-"), NULL, 10);
+        if (num == 0)
+            continue;
+
+        if (g_str_has_suffix (dname, ".pack"))
+            g_ptr_array_add (nums, GUINT_TO_POINTER(num));
+        else if (g_str_has_suffix (dname, ".idx"))
+            g_hash_table_insert (idx_set, GUINT_TO_POINTER(num), GINT_TO_POINTER(1));
+
+        if (num > store->cur_pack)
+            store->cur_pack = num;
+    }
+    g_dir_close (dir);
+
+    g_ptr_array_sort (nums, compare_uint);
+
+    for (i = 0; i < nums->len; ++i) {
+        num = GPOINTER_TO_UINT(g_ptr_array_index (nums, i));
+
+        if (!g_hash_table_lookup (idx_set, GUINT_TO_POINTER(num))) {
+            path = pack_path (store, num, "pack");
+            objs = scan_pack (path);
+            if (!objs || g_hash_table_size (objs) == 0) {
+                g_unlink (path);
+                g_free (path);
+                if (objs)
+                    g_hash_table_destroy (objs);
+                continue;
+            }
+            g_free (path);
+
+            if (write_pack_idx (store, num, objs) < 0) {
+                g_hash_table_destroy (objs);
+                continue;
+            }
+            g_hash_table_destroy (objs);
+        }
+
+        pack = load_sealed_pack (store, num);
+        if (pack)
+            g_ptr_array_add (store->sealed, pack);
+    }
+
+    g_ptr_array_free (nums, TRUE);
+    g_hash_table_destroy (idx_set);
+}
+
+static void
+load_deleted (ObjPackStore *store)
+{
+    char *path;
+    char *contents = NULL;
+    gsize len, off;
+    DeletedRecord *rec;
+
+    path = g_build_filename (store->pack_dir, DELETED_LOG_NAME, NULL);
+
+    if (g_file_get_contents (path, &contents, &len, NULL)) {
+        for (off = 0; off + sizeof(DeletedRecord) <= len; off += sizeof(DeletedRecord)) {
+            rec = (DeletedRecord *)(contents + off);
+            if (rec->op == DELETED_OP_DELETE)
+                g_hash_table_insert (store->deleted, g_memdup (rec->id, 20), GINT_TO_POINTER(1));
+            else
+                g_hash_table_remove (store->deleted, rec->id);
+        }
+        g_free (contents);
+
+        if (g_hash_table_size (store->deleted) == 0)
+            g_unlink (path);
+    }
+
+    g_free (path);
+}
+
+static int
+append_deleted_record (ObjPackStore *store, int op, const guint8 *id)
+{
+    DeletedRecord rec;
+    char *path;
+
+    if (store->deleted_fd < 0) {
+        path = g_build_filename (store->pack_dir, DELETED_LOG_NAME, NULL);
+        store->deleted_fd = g_open (path, O_WRONLY | O_CREAT | O_APPEND | O_BINARY, 0666);
+        if (store->deleted_fd < 0) {
+            seaf_warning ("[pack obj bend] Failed to open %s: %s.\n",
+                          path, strerror(errno));
+            g_free (path);
+            return -1;
+        }
+        g_free (path);
+    }
+
+    rec.op = (guint8)op;
+    memcpy (rec.id, id, 20);
+    if (writen (store->deleted_fd, &rec, sizeof(rec)) != sizeof(rec)) {
+        seaf_warning ("[pack obj bend] Failed to write deleted log: %s.\n",
+                      strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+static ObjPackStore *
+obj_pack_store_open (PackPriv *priv, const char *store_id)
+{
+    ObjPackStore *store;
+
+    store = g_new0 (ObjPackStore, 1);
+    memcpy (store->store_id, store_id, 36);
+    store->pack_dir = g_build_filename (priv->obj_dir, store_id, PACK_DIR_NAME, NULL);
+    store->sealed = g_ptr_array_new_with_free_func ((GDestroyNotify)sealed_pack_free);
+    store->cur_objs = g_hash_table_new_full (raw_id_hash, raw_id_equal, g_free, g_free);
+    store->deleted = g_hash_table_new_full (raw_id_hash, raw_id_equal, g_free, NULL);
+    store->cur_fd = -1;
+    store->deleted_fd = -1;
+    pthread_mutex_init (&store->lock, NULL);
+
+    if (g_mkdir_with_parents (store->pack_dir, 0777) < 0) {
+        seaf_warning ("[pack obj bend] Failed to create %s.\n", store->pack_dir);
+        obj_pack_store_free (store);
+        return NULL;
+    }
+
+    load_packs (store);
+    load_deleted (store);
+
+    /* New objects always go to a new pack. */
+    ++(store->cur_pack);
+
+    return store;
+}
+
+/* Returns a reference to the store, to be dropped with put_store().
+ * The stores table holds a reference of its own.
+ */
+static ObjPackStore *
+get_store (ObjBackend *bend, const char *store_id)
+{
+    PackPriv *priv = bend->priv;
+    ObjPackStore *store;
+
+    pthread_mutex_lock (&priv->stores_lock);
+    store = g_hash_table_lookup (priv->stores, store_id);
+    if (!store) {
+        /* Take back a store released while in use, so that two stores never
+         * append to the same packs.
+         */
+        store = g_hash_table_lookup (priv->released, store_id);
+        if (store) {
+            g_hash_table_remove (priv->released, store_id);
+            ++(store->ref_count);
+        } else {
+            store = obj_pack_store_open (priv, store_id);
+            if (store)
+                store->ref_count = 1;
+        }
+        if (store)
+            g_hash_table_insert (priv->stores, g_strdup(store_id), store);
+    }
+    if (store)
+        ++(store->ref_count);
+    pthread_mutex_unlock (&priv->stores_lock);
+
+    return store;
+}
+
+static void
+put_store (ObjBackend *bend, ObjPackStore *store)
+{
+    PackPriv *priv = bend->priv;
+    gboolean last;
+
+    pthread_mutex_lock (&priv->stores_lock);
+    last = (--(store->ref_count) == 0);
+    /* The table's reference is gone, so the store was released. */
+    if (last)
+        g_hash_table_remove (priv->released, store->store_id);
+    pthread_mutex_unlock (&priv->stores_lock);
+
+    if (last)
+        obj_pack_store_free (store);
+}
+
+/* Seal the current pack and make it part of the mmap'd set.
+ * Must be called with the store lock held.
+ */
+static void
+seal_current_pack (ObjPackStore *store)
+{
+    SealedPack *pack;
+
+    if (store->cur_fd < 0)
+        return;
+
+    if (seaf_util_fsync (store->cur_fd) < 0 ||
+        write_pack_idx (store, store->cur_pack, store->cur_objs) < 0) {
+        /* Keep writing to the current pack, try again later. */
+        return;
+    }
+
+    pack = load_sealed_pack (store, store->cur_pack);
+    if (!pack)
+        return;
+
+    g_ptr_array_add (store->sealed, pack);
+    close (store->cur_fd);
+    store->cur_fd = -1;
+    store->cur_size = 0;
+    g_hash_table_remove_all (store->cur_objs);
+    ++(store->cur_pack);
+}
+
+/* Look up an object in the packs. On success, *data points to a copy of the
+ * object contents if @data is not NULL.
+ * Must be called with the store lock held.
+ */
+static gboolean
+pack_store_lookup (ObjPackStore *store, const guint8 *id, void **data, int *len)
+{
+    CurEntry *ce;
+    const IdxEntry *ie;
+    SealedPack *pack;
+    guint64 offset;
+    guint32 size;
+    int i;
+
+    if (g_hash_table_lookup (store->deleted, id))
+        return FALSE;
+
+    ce = g_hash_table_lookup (store->cur_objs, id);
+    if (ce) {
+        if (!data)
+            return TRUE;
+        *data = g_malloc (ce->size ? ce->size : 1);
+        if (seaf_util_lseek (store->cur_fd, ce->offset, SEEK_SET) < 0 ||
+            readn (store->cur_fd, *data, ce->size) != ce->size) {
+            seaf_warning ("[pack obj bend] Failed to read object from %s: %s.\n",
+                          store->pack_dir, strerror(errno));
+            g_free (*data);
+            *data = NULL;
+            return FALSE;
+        }
+        *len = (int)ce->size;
+        return TRUE;
+    }
+
+    for (i = (int)store->sealed->len - 1; i >= 0; --i) {
+        pack = g_ptr_array_index (store->sealed, i);
+        ie = sealed_pack_lookup (pack, id);
+        if (!ie)
+            continue;
+        if (!data)
+            return TRUE;
+
+        offset = GUINT64_FROM_BE (ie->offset);
+        size = GUINT32_FROM_BE (ie->size);
+        if (offset + size > g_mapped_file_get_length (pack->data)) {
+            seaf_warning ("[pack obj bend] Object is beyond the end of pack %u in %s.\n",
+                          pack->num, store->pack_dir);
+            return FALSE;
+        }
+        *data = g_memdup (g_mapped_file_get_contents (pack->data) + offset,
+                          size ? size : 1);
+        *len = (int)size;
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+/* Must be called with the store lock held. */
+static int
+pack_store_append (ObjPackStore *store, const guint8 *id,
+                   const void *data, int len, gboolean need_sync)
+{
+    ObjHeader hdr;
+    CurEntry *ce;
+    char *path;
+
+    if (store->cur_fd < 0) {
+        path = pack_path (store, store->cur_pack, "pack");
+        store->cur_fd = g_open (path, O_RDWR | O_CREAT | O_TRUNC | O_BINARY, 0666);
+        if (store->cur_fd < 0) {
+            seaf_warning ("[pack obj bend] Failed to create pack %s: %s.\n",
+                          path, strerror(errno));
+            g_free (path);
+            return -1;
+        }
+        g_free (path);
+        store->cur_size = 0;
+        /* Batches flush the directory when they're committed. */
+        if (need_sync && seaf_util_fsync_dir (store->pack_dir) < 0)
+            return -1;
+    }
+
+    memcpy (hdr.id, id, 20);
+    hdr.size = GUINT32_TO_BE ((guint32)len);
+
+    if (seaf_util_lseek (store->cur_fd, store->cur_size, SEEK_SET) < 0 ||
+        writen (store->cur_fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+        writen (store->cur_fd, data, len) != len) {
+        seaf_warning ("[pack obj bend] Failed to write object to %s: %s.\n",
+                      store->pack_dir, strerror(errno));
+        return -1;
+    }
+
+    /* One fsync of the pack replaces the fsync, rename and directory fsync
+     * done for every object by the fs backend.
+     */
+    if (need_sync && seaf_util_fsync (store->cur_fd) < 0)
+        return -1;
+
+    ce = g_new0 (CurEntry, 1);
+    ce->offset = store->cur_size + sizeof(hdr);
+    ce->size = (guint32)len;
+    g_hash_table_replace (store->cur_objs, g_memdup (id, 20), ce);
+
+    store->cur_size += sizeof(hdr) + len;
+
+    if (store->cur_size >= MAX_OBJ_PACK_SIZE)
+        seal_current_pack (store);
+
+    return 0;
+}
+
+/* Backend interface. */
+
+static int
+obj_backend_pack_read (ObjBackend *bend,
+                       const char *repo_id,
+                       int version,
+                       const char *obj_id,
+                       void **data,
+                       int *len)
+{
+    PackPriv *priv = bend->priv;
+    ObjPackStore *store;
+    guint8 id[20];
+    gboolean found;
+
+    if (version > 0) {
+        store = get_store (bend, repo_id);
+        if (store) {
+            hex_to_rawdata (obj_id, id, 20);
+
+            pthread_mutex_lock (&store->lock);
+            found = pack_store_lookup (store, id, data, len);
+            pthread_mutex_unlock (&store->lock);
+            put_store (bend, store);
+
+            if (found)
+                return 0;
+        }
+    }
+
+    return priv->fs->read (priv->fs, repo_id, version, obj_id, data, len);
+}
+
+static int
+obj_backend_pack_write (ObjBackend *bend,
+                        const char *repo_id,
+                        int version,
+                        const char *obj_id,
+                        void *data,
+                        int len,
+                        gboolean need_sync)
+{
+    PackPriv *priv = bend->priv;
+    ObjPackStore *store;
+    guint8 id[20];
+    int ret = 0;
+
+    if (version == 0)
+        return priv->fs->write (priv->fs, repo_id, version, obj_id,
+                                data, len, need_sync);
+
+    store = get_store (bend, repo_id);
+    if (!store)
+        return -1;
+
+    hex_to_rawdata (obj_id, id, 20);
+
+    pthread_mutex_lock (&store->lock);
+
+    if (g_hash_table_lookup (store->deleted, id)) {
+        if (append_deleted_record (store, DELETED_OP_RESTORE, id) < 0) {
+            ret = -1;
+            goto out;
+        }
+        g_hash_table_remove (store->deleted, id);
+    }
+
+    /* Objects are content addressed, no need to write one twice. */
+    if (pack_store_lookup (store, id, NULL, NULL))
+        goto out;
+
+    ret = pack_store_append (store, id, data, len,
+                             need_sync && store->batch_depth == 0);
+
+out:
+    pthread_mutex_unlock (&store->lock);
+    put_store (bend, store);
+
+    if (ret < 0)
+        seaf_warning ("[pack obj bend] Failed to write obj %s:%s.\n",
+                      repo_id, obj_id);
+    return ret;
+}
+
+static gboolean
+obj_backend_pack_exists (ObjBackend *bend,
+                         const char *repo_id,
+                         int version,
+                         const char *obj_id)
+{
+    PackPriv *priv = bend->priv;
+    ObjPackStore *store;
+    guint8 id[20];
+    gboolean deleted, found;
+
+    if (version > 0) {
+        store = get_store (bend, repo_id);
+        if (store) {
+            hex_to_rawdata (obj_id, id, 20);
+
+            pthread_mutex_lock (&store->lock);
+            deleted = g_hash_table_lookup (store->deleted, id);
+            found = pack_store_lookup (store, id, NULL, NULL);
+            pthread_mutex_unlock (&store->lock);
+            put_store (bend, store);
+
+            if (deleted)
+                return FALSE;
+            if (found)
+                return TRUE;
+        }
+    }
+
+    return priv->fs->exists (priv->fs, repo_id, version, obj_id);
+}
+
+static void
+obj_backend_pack_delete (ObjBackend *bend,
+                         const char *repo_id,
+                         int version,
+                         const char *obj_id)
+{
+    PackPriv *priv = bend->priv;
+    ObjPackStore *store;
+    guint8 id[20];
+
+    priv->fs->delete (priv->fs, repo_id, version, obj_id);
+
+    if (version == 0)
+        return;
+
+    store = get_store (bend, repo_id);
+    if (!store)
+        return;
+
+    hex_to_rawdata (obj_id, id, 20);
+
+    pthread_mutex_lock (&store->lock);
+    if (pack_store_lookup (store, id, NULL, NULL) &&
+        append_deleted_record (store, DELETED_OP_DELETE, id) == 0)
+        g_hash_table_insert (store->deleted, g_memdup (id, 20), GINT_TO_POINTER(1));
+    pthread_mutex_unlock (&store->lock);
+    put_store (bend, store);
+}
+
+static int
+obj_backend_pack_foreach_obj (ObjBackend *bend,
+                              const char *repo_id,
+                              int version,
+                              SeafObjFunc process,
+                              void *user_data)
+{
+    PackPriv *priv = bend->priv;
+    ObjPackStore *store;
+    GHashTableIter iter;
+    gpointer key;
+    SealedPack *pack;
+    GList *ids = NULL, *ptr;
+    char obj_id[41];
+    guint i, j;
+
+    if (version > 0) {
+        store = get_store (bend, repo_id);
+        if (!store)
+            return -1;
+
+        pthread_mutex_lock (&store->lock);
+        for (i = 0; i < store->sealed->len; ++i) {
+            pack = g_ptr_array_index (store->sealed, i);
+            for (j = 0; j < pack->n_entries; ++j) {
+                if (g_hash_table_lookup (store->deleted, pack->entries[j].id))
+                    continue;
+                rawdata_to_hex (pack->entries[j].id, obj_id, 20);
+                ids = g_list_prepend (ids, g_strdup(obj_id));
+            }
+        }
+        g_hash_table_iter_init (&iter, store->cur_objs);
+        while (g_hash_table_iter_next (&iter, &key, NULL)) {
+            if (g_hash_table_lookup (store->deleted, key))
+                continue;
+            rawdata_to_hex (key, obj_id, 20);
+            ids = g_list_prepend (ids, g_strdup(obj_id));
+        }
+        pthread_mutex_unlock (&store->lock);
+        put_store (bend, store);
+
+        for (ptr = ids; ptr; ptr = ptr->next) {
+            if (!process (repo_id, version, ptr->data, user_data)) {
+                string_list_free (ids);
+                return 0;
+            }
+        }
+        string_list_free (ids);
+    }
+
+    return priv->fs->foreach_obj (priv->fs, repo_id, version, process, user_data);
+}
+
+static int
+obj_backend_pack_copy (ObjBackend *bend,
+                       const char *src_repo_id,
+                       int src_version,
+                       const char *dst_repo_id,
+                       int dst_version,
+                       const char *obj_id)
+{
+    void *data = NULL;
+    int len;
+    int ret;
+
+    if (obj_backend_pack_exists (bend, dst_repo_id, dst_version, obj_id))
+        return 0;
+
+    if (obj_backend_pack_read (bend, src_repo_id, src_version,
+                               obj_id, &data, &len) < 0) {
+        seaf_warning ("[pack obj bend] Failed to read obj %s:%s.\n",
+                      src_repo_id, obj_id);
+        return -1;
+    }
+
+    ret = obj_backend_pack_write (bend, dst_repo_id, dst_version,
+                                  obj_id, data, len, FALSE);
+    g_free (data);
+    return ret;
+}
+
+static int
+obj_backend_pack_begin_batch (ObjBackend *bend,
+                              const char *repo_id,
+                              int version)
+{
+    PackPriv *priv = bend->priv;
+    ObjPackStore *store;
+
+    if (version == 0)
+        return priv->fs->begin_batch (priv->fs, repo_id, version);
+
+    store = get_store (bend, repo_id);
+    if (!store)
+        return -1;
+
+    pthread_mutex_lock (&store->lock);
+    ++(store->batch_depth);
+    pthread_mutex_unlock (&store->lock);
+    put_store (bend, store);
+
+    return 0;
+}
+
+static int
+obj_backend_pack_commit_batch (ObjBackend *bend,
+                               const char *repo_id,
+                               int version)
+{
+    PackPriv *priv = bend->priv;
+    ObjPackStore *store;
+    int ret = 0;
+
+    if (version == 0)
+        return priv->fs->commit_batch (priv->fs, repo_id, version);
+
+    store = get_store (bend, repo_id);
+    if (!store)
+        return -1;
+
+    pthread_mutex_lock (&store->lock);
+    if (store->batch_depth > 0 && --(store->batch_depth) == 0) {
+        if (store->cur_fd >= 0)
+            ret = seaf_util_fsync (store->cur_fd);
+        /* Packs may have been created in the batch. */
+        if (seaf_util_fsync_dir (store->pack_dir) < 0)
+            ret = -1;
+    }
+    pthread_mutex_unlock (&store->lock);
+    put_store (bend, store);
+
+    if (ret < 0)
+        seaf_warning ("[pack obj bend] Failed to sync objects of store %s.\n",
+                      repo_id);
+    return ret;
+}
+
+static void
+obj_backend_pack_release_store (ObjBackend *bend, const char *store_id)
+{
+    PackPriv *priv = bend->priv;
+    ObjPackStore *store;
+    gboolean last = FALSE;
+
+    pthread_mutex_lock (&priv->stores_lock);
+    store = g_hash_table_lookup (priv->stores, store_id);
+    if (store) {
+        g_hash_table_remove (priv->stores, store_id);
+        /* Drop the table's reference. Stores still in use are freed by
+         * their last user.
+         */
+        last = (--(store->ref_count) == 0);
+        if (!last)
+            g_hash_table_insert (priv->released, g_strdup(store_id), store);
+    }
+    pthread_mutex_unlock (&priv->stores_lock);
+
+    if (last)
+        obj_pack_store_free (store);
+}
+
+static int
+obj_backend_pack_remove_store (ObjBackend *bend, const char *store_id)
+{
+    PackPriv *priv = bend->priv;
+    char *pack_dir;
+    GDir *dir;
+    const char *dname;
+    char *path;
+
+    obj_backend_pack_release_store (bend, store_id);
+
+    pack_dir = g_build_filename (priv->obj_dir, store_id, PACK_DIR_NAME, NULL);
+    dir = g_dir_open (pack_dir, 0, NULL);
+    if (dir) {
+        while ((dname = g_dir_read_name(dir)) != NULL) {
+            path = g_build_filename (pack_dir, dname, NULL);
+            g_unlink (path);
+            g_free (path);
+        }
+        g_dir_close (dir);
+        g_rmdir (pack_dir);
+    }
+    g_free (pack_dir);
+
+    return priv->fs->remove_store (priv->fs, store_id);
+}
+
+extern ObjBackend *
+obj_backend_fs_new (const char *seaf_dir, const char *obj_type);
+
+ObjBackend *
+obj_backend_pack_new (const char *seaf_dir, const char *obj_type)
+{
+    ObjBackend *bend;
+    PackPriv *priv;
+
+    bend = g_new0(ObjBackend, 1);
+    priv = g_new0(PackPriv, 1);
+    bend->priv = priv;
+
+    priv->fs = obj_backend_fs_new (seaf_dir, obj_type);
+    if (!priv->fs)
+        goto onerror;
+
+    priv->obj_dir = g_build_filename (seaf_dir, "storage", obj_type, NULL);
+    priv->stores = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                          g_free, NULL);
+    priv->released = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                            g_free, NULL);
+    pthread_mutex_init (&priv->stores_lock, NULL);
+
+    bend->read = obj_backend_pack_read;
+    bend->write = obj_backend_pack_write;
+    bend->exists = obj_backend_pack_exists;
+    bend->delete = obj_backend_pack_delete;
+    bend->foreach_obj = obj_backend_pack_foreach_obj;
+    bend->copy = obj_backend_pack_copy;
+    bend->remove_store = obj_backend_pack_remove_store;
+    bend->begin_batch = obj_backend_pack_begin_batch;
+    bend->commit_batch = obj_backend_pack_commit_batch;
+    bend->release_store = obj_backend_pack_release_store;
+
+    return bend;
+
+onerror:
+    g_free (priv);
+    g_free (bend);
+
+    return NULL;
+}
@@ -48,6 +48,21 @@ struct ObjBackend {
     int        (*remove_store) (ObjBackend *bend,
                                 const char *store_id);
 
+    /* Optional. Between begin_batch and commit_batch, writes to the store
+     * are not synced one by one; commit_batch makes them all durable.
+     * Batches nest. */
+    int        (*begin_batch) (ObjBackend *bend,
+                               const char *repo_id,
+                               int version);
+
+    int        (*commit_batch) (ObjBackend *bend,
+                                const char *repo_id,
+                                int version);
+
+    /* Optional. Drop any cached state of the store. */
+    void       (*release_store) (ObjBackend *bend,
+                                 const char *store_id);
+
     void *priv;
 };
 
@@ -3,35 +3,63 @@
 #include "log.h"
 
 #include "seafile-session.h"
+#include "seafile-config.h"
 
 #include "utils.h"
 
 #include "obj-backend.h"
 #include "obj-store.h"
+#include "metrics.h"
 
 struct SeafObjStore {
     ObjBackend   *bend;
+
+    SeafMetric   *read_usec;
+    SeafMetric   *write_usec;
+    SeafMetric   *read_bytes;
+    SeafMetric   *write_bytes;
 };
 typedef struct SeafObjStore SeafObjStore;
 
 extern ObjBackend *
 obj_backend_fs_new (const char *seaf_dir, const char *obj_type);
 
+extern ObjBackend *
+obj_backend_pack_new (const char *seaf_dir, const char *obj_type);
+
 struct SeafObjStore *
 seaf_obj_store_new (SeafileSession *seaf, const char *obj_type)
 {
     SeafObjStore *store = g_new0 (SeafObjStore, 1);
+    char *backend;
+    char *labels;
 
     if (!store)
         return NULL;
 
-    store->bend = obj_backend_fs_new (seaf->seaf_dir, obj_type);
+    backend = seafile_session_config_get_string (seaf, KEY_OBJ_BACKEND);
+    if (g_strcmp0 (backend, OBJ_BACKEND_PACK) == 0)
+        store->bend = obj_backend_pack_new (seaf->seaf_dir, obj_type);
+    else
+        store->bend = obj_backend_fs_new (seaf->seaf_dir, obj_type);
+    g_free (backend);
     if (!store->bend) {
         seaf_warning ("[Object store] Failed to load backend.\n");
         g_free (store);
         return NULL;
     }
 
+    labels = g_strdup_printf ("type=\"%s\"", obj_type);
+    store->read_usec = seaf_metric_get (SEAF_METRIC_HISTOGRAM,
+                                        "seaf_obj_read_usec", labels);
+    store->write_usec = seaf_metric_get (SEAF_METRIC_HISTOGRAM,
+                                         "seaf_obj_write_usec", labels);
+    store->read_bytes = seaf_metric_get (SEAF_METRIC_COUNTER,
+                                         "seaf_obj_read_bytes_total", labels);
+    store->write_bytes = seaf_metric_get (SEAF_METRIC_COUNTER,
+                                          "seaf_obj_write_bytes_total", labels);
+    g_free (labels);
+
     return store;
 }
 
@@ -52,12 +80,20 @@ seaf_obj_store_read_obj (struct SeafObjStore *obj_store,
                          int *len)
 {
     ObjBackend *bend = obj_store->bend;
+    gint64 start;
+    int ret;
 
     if (!repo_id || !is_uuid_valid(repo_id) ||
         !obj_id || !is_object_id_valid(obj_id))
         return -1;
 
-    return bend->read (bend, repo_id, version, obj_id, data, len);
+    start = seaf_metrics_now ();
+    ret = bend->read (bend, repo_id, version, obj_id, data, len);
+    seaf_metric_observe_since (obj_store->read_usec, start);
+    if (ret == 0)
+        seaf_metric_inc (obj_store->read_bytes, *len);
+
+    return ret;
 }
 
 int
@@ -70,12 +106,20 @@ seaf_obj_store_write_obj (struct SeafObjStore *obj_store,
                           gboolean need_sync)
 {
     ObjBackend *bend = obj_store->bend;
+    gint64 start;
+    int ret;
 
     if (!repo_id || !is_uuid_valid(repo_id) ||
         !obj_id || !is_object_id_valid(obj_id))
         return -1;
 
-    return bend->write (bend, repo_id, version, obj_id, data, len, need_sync);
+    start = seaf_metrics_now ();
+    ret = bend->write (bend, repo_id, version, obj_id, data, len, need_sync);
+    seaf_metric_observe_since (obj_store->write_usec, start);
+    if (ret == 0)
+        seaf_metric_inc (obj_store->write_bytes, len);
+
+    return ret;
 }
 
 gboolean
@@ -144,3 +188,39 @@ seaf_obj_store_remove_store (struct SeafObjStore *obj_store,
 
     return bend->remove_store (bend, store_id);
 }
+
+int
+seaf_obj_store_begin_batch (struct SeafObjStore *obj_store,
+                            const char *repo_id,
+                            int version)
+{
+    ObjBackend *bend = obj_store->bend;
+
+    if (!bend->begin_batch)
+        return 0;
+
+    return bend->begin_batch (bend, repo_id, version);
+}
+
+int
+seaf_obj_store_commit_batch (struct SeafObjStore *obj_store,
+                             const char *repo_id,
+                             int version)
+{
+    ObjBackend *bend = obj_store->bend;
+
+    if (!bend->commit_batch)
+        return 0;
+
+    return bend->commit_batch (bend, repo_id, version);
+}
+
+void
+seaf_obj_store_release_store (struct SeafObjStore *obj_store,
+                              const char *store_id)
+{
+    ObjBackend *bend = obj_store->bend;
+
+    if (bend->release_store)
+        bend->release_store (bend, store_id);
+}
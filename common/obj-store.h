@@ -70,4 +70,26 @@ seaf_obj_store_copy_obj (struct SeafObjStore *obj_store,
 int
 seaf_obj_store_remove_store (struct SeafObjStore *obj_store,
                              const char *store_id);
+
+/*
+ * Write batch. Objects written to the store between begin and commit,
+ * from any thread, are written without syncing. Commit makes all of them
+ * durable in one pass, which is much cheaper than syncing every object.
+ * Batches on the same store nest; only the outermost commit syncs.
+ */
+int
+seaf_obj_store_begin_batch (struct SeafObjStore *obj_store,
+                            const char *repo_id,
+                            int version);
+
+int
+seaf_obj_store_commit_batch (struct SeafObjStore *obj_store,
+                             const char *repo_id,
+                             int version);
+
+/* Drop the backend's cached state of a store whose directory is about to be
+ * moved or removed outside of the object store. */
+void
+seaf_obj_store_release_store (struct SeafObjStore *obj_store,
+                              const char *store_id);
 #endif
@@ -19,10 +19,21 @@
 #include "seafile-config.h"
 #include "seafile-object.h"
 #include "seafile-error-impl.h"
+#include "metrics.h"
+#include "trace.h"
+#include "mem-budget.h"
+#include "work-mode.h"
 #define DEBUG_FLAG SEAFILE_DEBUG_OTHER
 #include "log.h"
 
 #include "../daemon/vc-utils.h"
+#include "../daemon/hydration.h"
+#include "../daemon/repo-state.h"
+#include "../daemon/scrubber.h"
+#include "../daemon/wt-event-log.h"
+#include "../daemon/download-priority.h"
+#include "../daemon/transfer-policy.h"
+#include "../daemon/dir-size.h"
 
 
 /* -------- Utilities -------- */
@@ -136,8 +147,6 @@ seafile_set_upload_rate_limit (int limit, GError **error)
     if (limit < 0)
         limit = 0;
 
-    seaf->sync_mgr->upload_limit = limit;
-
     return seafile_session_config_set_int (seaf, KEY_UPLOAD_LIMIT, limit);
 }
 
@@ -147,8 +156,6 @@ seafile_set_download_rate_limit (int limit, GError **error)
     if (limit < 0)
         limit = 0;
 
-    seaf->sync_mgr->download_limit = limit;
-
     return seafile_session_config_set_int (seaf, KEY_DOWNLOAD_LIMIT, limit);
 }
 
@@ -291,6 +298,11 @@ seafile_get_clone_tasks (GError **error)
     return ret;
 }
 
+/* Indexing and checkout run at full speed for this long after the user
+ * asks for a sync.
+ */
+#define SYNC_BOOST_SECONDS 600
+
 int
 seafile_sync (const char *repo_id, const char *peer_id, GError **error)
 {
@@ -299,6 +311,9 @@ seafile_sync (const char *repo_id, const char *peer_id, GError **error)
         return -1;
     }
 
+    /* The user waits for this sync. */
+    seaf_work_mode_boost (SYNC_BOOST_SECONDS);
+
     return seaf_sync_manager_add_sync_task (seaf->sync_mgr, repo_id, error);
 }
 
@@ -404,6 +419,17 @@ seafile_get_repo_sync_task (const char *repo_id, GError **error)
     return (GObject *)s_task;
 }
 
+json_t *
+seafile_get_repo_sync_timings (const char *repo_id, GError **error)
+{
+    if (!repo_id || !is_uuid_valid (repo_id)) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Invalid repo id");
+        return NULL;
+    }
+
+    return seaf_sync_manager_get_sync_timings (seaf->sync_mgr, repo_id);
+}
+
 int
 seafile_set_repo_property (const char *repo_id,
                            const char *key,
@@ -480,7 +506,7 @@ seafile_calc_dir_size (const char *path, GError **error)
         return -1;
     }
 
-    gint64 size_64 = ccnet_calc_directory_size(path, error);
+    gint64 size_64 = seaf_dir_size_calc (path, error);
     if (size_64 < 0) {
         seaf_warning ("failed to calculate dir size for %s\n", path);
         return -1;
@@ -491,6 +517,41 @@ seafile_calc_dir_size (const char *path, GError **error)
     return size;
 }
 
+int
+seafile_start_calc_dir_size (const char *path, GError **error)
+{
+    if (!path) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Argument should not be null");
+        return -1;
+    }
+
+    if (seaf_dir_size_start (path) < 0) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                     "Failed to start calculating dir size");
+        return -1;
+    }
+
+    return 0;
+}
+
+json_t *
+seafile_get_calc_dir_size_progress (const char *path, GError **error)
+{
+    json_t *progress;
+
+    if (!path) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Argument should not be null");
+        return NULL;
+    }
+
+    progress = seaf_dir_size_get_progress (path);
+    if (!progress)
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "Dir size calculation is not started");
+
+    return progress;
+}
+
 int
 seafile_disable_auto_sync (GError **error)
 {
@@ -543,6 +604,73 @@ seafile_get_path_sync_status (const char *repo_id,
     return status;
 }
 
+json_t *
+seafile_get_paths_sync_status (const char *repo_id,
+                               const char *paths_json,
+                               GError **error)
+{
+    json_t *array, *ret = NULL;
+    json_error_t jerror;
+    const char *path;
+    char **paths = NULL, **statuses = NULL;
+    gboolean *is_dirs = NULL;
+    int n, i, len;
+
+    if (!repo_id || !paths_json) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Argument should not be null");
+        return NULL;
+    }
+
+    array = json_loadb (paths_json, strlen(paths_json), 0, &jerror);
+    if (!array || !json_is_array (array)) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Invalid paths");
+        goto out;
+    }
+
+    n = json_array_size (array);
+    paths = g_new0 (char *, n + 1);
+    is_dirs = g_new0 (gboolean, n);
+
+    /* Paths are canonicalized as in seafile_get_path_sync_status(). A
+     * trailing '/' marks a directory.
+     */
+    for (i = 0; i < n; ++i) {
+        path = json_string_value (json_array_get (array, i));
+        if (!path) {
+            g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Invalid paths");
+            goto out;
+        }
+        if (*path == '/')
+            ++path;
+        paths[i] = g_strdup (path);
+        len = strlen (paths[i]);
+        if (len > 0 && paths[i][len-1] == '/') {
+            paths[i][len-1] = 0;
+            is_dirs[i] = TRUE;
+        }
+    }
+
+    statuses = seaf_sync_manager_get_paths_sync_status (seaf->sync_mgr,
+                                                        repo_id,
+                                                        paths,
+                                                        is_dirs,
+                                                        n);
+
+    /* Keyed by the paths as given by the caller. */
+    ret = json_object ();
+    for (i = 0; i < n; ++i)
+        json_object_set_new (ret, json_string_value (json_array_get (array, i)),
+                             json_string (statuses[i]));
+
+out:
+    if (array)
+        json_decref (array);
+    g_strfreev (paths);
+    g_strfreev (statuses);
+    g_free (is_dirs);
+    return ret;
+}
+
 int
 seafile_mark_file_locked (const char *repo_id, const char *path, GError **error)
 {
@@ -607,12 +735,256 @@ seafile_mark_file_unlocked (const char *repo_id, const char *path, GError **erro
     return ret;
 }
 
+static const char *
+check_file_path_arg (const char *repo_id, const char *path, GError **error)
+{
+    if (!repo_id || !path) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Argument should not be null");
+        return NULL;
+    }
+
+    if (!is_uuid_valid (repo_id)) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Invalid repo id");
+        return NULL;
+    }
+
+    while (*path == '/')
+        ++path;
+
+    if (path[0] == 0 || path[strlen(path)-1] == '/') {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Invalid path");
+        return NULL;
+    }
+
+    return path;
+}
+
+int
+seafile_hydrate_file (const char *repo_id, const char *path, GError **error)
+{
+    path = check_file_path_arg (repo_id, path, error);
+    if (!path)
+        return -1;
+
+    return seaf_hydration_hydrate (repo_id, path, error);
+}
+
+int
+seafile_dehydrate_file (const char *repo_id, const char *path, GError **error)
+{
+    path = check_file_path_arg (repo_id, path, error);
+    if (!path)
+        return -1;
+
+    return seaf_hydration_dehydrate (repo_id, path, error);
+}
+
 json_t *
 seafile_get_sync_notification (GError **error)
 {
     return seaf_mq_manager_pop_message (seaf->mq_mgr);
 }
 
+#define MAX_NOTIFICATION_WAIT 60 /* seconds */
+#define MAX_NOTIFICATION_BATCH 100
+
+json_t *
+seafile_wait_sync_notifications (int timeout, GError **error)
+{
+    gint64 timeout_usec;
+
+    if (timeout < 0) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "Invalid timeout");
+        return NULL;
+    }
+
+    timeout_usec = (gint64)MIN (timeout, MAX_NOTIFICATION_WAIT) * G_USEC_PER_SEC;
+    return seaf_mq_manager_wait_messages (seaf->mq_mgr, timeout_usec,
+                                          MAX_NOTIFICATION_BATCH);
+}
+
+json_t *
+seafile_get_fs_cache_stats (GError **error)
+{
+    json_t *object;
+    gint64 hits, misses, mem_used;
+    int n_entries;
+
+    seaf_fs_manager_get_dir_cache_stats (seaf->fs_mgr,
+                                         &hits, &misses, &n_entries, &mem_used);
+
+    object = json_object ();
+    json_object_set_new (object, "dir_cache_hits", json_integer (hits));
+    json_object_set_new (object, "dir_cache_misses", json_integer (misses));
+    json_object_set_new (object, "dir_cache_entries", json_integer (n_entries));
+    json_object_set_new (object, "dir_cache_mem", json_integer (mem_used));
+
+    return object;
+}
+
+json_t *
+seafile_get_metrics (GError **error)
+{
+    return seaf_metrics_to_json ();
+}
+
+int
+seafile_set_trace_enabled (int enabled, GError **error)
+{
+    seaf_trace_set_enabled (enabled != 0);
+    return 0;
+}
+
+int
+seafile_dump_trace (const char *path, GError **error)
+{
+    char *default_path = NULL;
+    int ret;
+
+    if (!path || path[0] == 0) {
+        default_path = g_build_filename (seaf->seaf_dir, "trace.json", NULL);
+        path = default_path;
+    }
+
+    ret = seaf_trace_dump (path);
+    if (ret < 0)
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                     "Failed to write trace to %s", path);
+
+    g_free (default_path);
+    return ret;
+}
+
+int
+seafile_start_wt_event_recording (const char *repo_id, const char *path,
+                                  GError **error)
+{
+    if (!repo_id || !is_uuid_valid (repo_id)) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Invalid repo id");
+        return -1;
+    }
+    if (!path || path[0] == 0) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Invalid path");
+        return -1;
+    }
+
+    if (wt_event_log_start (repo_id, path) < 0) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                     "Failed to open %s", path);
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+seafile_stop_wt_event_recording (const char *repo_id, GError **error)
+{
+    if (!repo_id || wt_event_log_stop (repo_id) < 0) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "Events of repo are not recorded");
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+seafile_prioritize_download (const char *repo_id, const char *path,
+                             GError **error)
+{
+    if (!repo_id || !is_uuid_valid (repo_id)) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Invalid repo id");
+        return -1;
+    }
+    if (!path) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Invalid path");
+        return -1;
+    }
+
+    return seaf_download_priority_add_path (repo_id, path);
+}
+
+int
+seafile_clear_download_priorities (const char *repo_id, GError **error)
+{
+    if (!repo_id || !is_uuid_valid (repo_id)) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Invalid repo id");
+        return -1;
+    }
+
+    seaf_download_priority_clear (repo_id);
+    return 0;
+}
+
+json_t *
+seafile_get_transfer_policy (GError **error)
+{
+    return seaf_transfer_policy_to_json ();
+}
+
+int
+seafile_set_transfer_policy_override (const char *condition, int value,
+                                      GError **error)
+{
+    const char *key;
+
+    if (g_strcmp0 (condition, "metered") == 0)
+        key = KEY_METERED_OVERRIDE;
+    else if (g_strcmp0 (condition, "battery") == 0)
+        key = KEY_BATTERY_OVERRIDE;
+    else {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "Unknown condition");
+        return -1;
+    }
+
+    if (value < -1 || value > 1) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "Invalid override");
+        return -1;
+    }
+
+    if (seafile_session_config_set_int (seaf, key, value) < 0) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_INTERNAL,
+                     "Failed to save override");
+        return -1;
+    }
+
+    return 0;
+}
+
+json_t *
+seafile_get_memory_usage (GError **error)
+{
+    return seaf_mem_budget_to_json ();
+}
+
+json_t *
+seafile_get_work_mode (GError **error)
+{
+    return seaf_work_mode_to_json ();
+}
+
+json_t *
+seafile_get_repo_state_changes (gint64 since, GError **error)
+{
+    return seaf_repo_state_get_changes (since);
+}
+
+json_t *
+seafile_get_task_states (GError **error)
+{
+    return seaf_repo_state_get_tasks ();
+}
+
+json_t *
+seafile_get_scrub_status (GError **error)
+{
+    return seaf_scrubber_get_status ();
+}
+
 char *
 seafile_get_server_property (const char *server_url, const char *key, GError **error)
 {
@@ -650,6 +1022,13 @@ seafile_get_file_sync_errors (int offset, int limit, GError **error)
     return seaf_repo_manager_get_file_sync_errors (seaf->repo_mgr, offset, limit);
 }
 
+GList *
+seafile_get_file_sync_errors_before (int before_id, int limit, GError **error)
+{
+    return seaf_repo_manager_get_file_sync_errors_before (seaf->repo_mgr,
+                                                          before_id, limit);
+}
+
 int
 seafile_del_file_sync_error_by_id (int id, GError **error)
 {
@@ -975,6 +1354,92 @@ seafile_diff (const char *repo_id, const char *arg1, const char *arg2, int fold_
     return g_list_reverse (ret);
 }
 
+#define MAX_HISTORY_PAGE_SIZE 1000
+
+static json_t *
+commit_to_json (SeafCommit *commit)
+{
+    json_t *object = json_object ();
+
+    json_object_set_new (object, "id", json_string (commit->commit_id));
+    json_object_set_new (object, "root_id", json_string (commit->root_id));
+    json_object_set_new (object, "desc", json_string (commit->desc));
+    json_object_set_new (object, "creator", json_string (commit->creator_id));
+    json_object_set_new (object, "creator_name",
+                         json_string (commit->creator_name));
+    json_object_set_new (object, "ctime", json_integer (commit->ctime));
+    json_object_set_new (object, "parent_id",
+                         commit->parent_id ?
+                         json_string (commit->parent_id) : json_null ());
+    json_object_set_new (object, "second_parent_id",
+                         commit->second_parent_id ?
+                         json_string (commit->second_parent_id) : json_null ());
+    json_object_set_new (object, "device_name",
+                         commit->device_name ?
+                         json_string (commit->device_name) : json_null ());
+
+    return object;
+}
+
+json_t *
+seafile_get_commit_history (const char *repo_id, const char *cursor, int limit,
+                            GError **error)
+{
+    SeafRepo *repo;
+    SeafCommitIter *iter;
+    SeafCommit *commit;
+    json_t *ret, *commits;
+    char head_id[41];
+    char *next;
+    int n = 0;
+
+    if (!repo_id) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Argument should not be null");
+        return NULL;
+    }
+
+    if (!is_uuid_valid (repo_id)) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Invalid repo id");
+        return NULL;
+    }
+
+    repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
+    if (!repo || !repo->head) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "No such repository");
+        return NULL;
+    }
+
+    if (!cursor || cursor[0] == 0) {
+        memcpy (head_id, repo->head->commit_id, 41);
+        cursor = head_id;
+    }
+    iter = seaf_commit_iter_new (seaf->commit_mgr, repo->id, repo->version,
+                                 cursor);
+    if (!iter) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Invalid cursor");
+        return NULL;
+    }
+
+    if (limit <= 0 || limit > MAX_HISTORY_PAGE_SIZE)
+        limit = MAX_HISTORY_PAGE_SIZE;
+
+    commits = json_array ();
+    while (n < limit && (commit = seaf_commit_iter_next (iter)) != NULL) {
+        json_array_append_new (commits, commit_to_json (commit));
+        seaf_commit_unref (commit);
+        ++n;
+    }
+
+    ret = json_object ();
+    json_object_set_new (ret, "commits", commits);
+    next = seaf_commit_iter_get_cursor (iter);
+    json_object_set_new (ret, "next", next ? json_string (next) : json_null ());
+    g_free (next);
+
+    seaf_commit_iter_free (iter);
+    return ret;
+}
+
 int
 seafile_shutdown (GError **error)
 {
@@ -10,12 +10,17 @@
 #include <gnutls/gnutls.h>
 #include <gnutls/crypto.h>
 #include <nettle/pbkdf2.h>
+#include <nettle/hmac.h>
 #else
 #include <openssl/aes.h>
+#include <openssl/crypto.h>
 #include <openssl/evp.h>
+#include <openssl/hmac.h>
 #include <openssl/rand.h>
 #endif
 
+#include <pthread.h>
+
 #include "utils.h"
 #include "log.h"
 
@@ -46,10 +51,10 @@ seafile_crypt_new (int version, unsigned char *key, unsigned char *iv)
     return crypt;
 }
 
-int
-seafile_derive_key (const char *data_in, int in_len, int version,
-                    const char *repo_salt,
-                    unsigned char *key, unsigned char *iv)
+static int
+derive_key (const char *data_in, int in_len, int version,
+            const char *repo_salt,
+            unsigned char *key, unsigned char *iv)
 {
 #ifdef USE_GPL_CRYPTO
     if (version != 2) {
@@ -115,6 +120,155 @@ seafile_derive_key (const char *data_in, int in_len, int version,
 #endif
 }
 
+/*
+ * Derived keys are cached in memory, since the same password is derived
+ * several times while a library is cloned, and the key derivation is made
+ * to be slow. Entries are looked up by an HMAC of the inputs under a
+ * random key that is generated when the cache is first used and never
+ * written anywhere, so the cache doesn't keep the passwords and its ids
+ * can't be checked against guesses outside the process. Anyone who can
+ * read the memory of the process gets the cached keys themselves, like
+ * the keys kept for the libraries that are already unlocked.
+ */
+#define DERIVED_KEY_CACHE_SIZE 256
+
+typedef struct DerivedKey {
+    unsigned char key[32];
+    unsigned char iv[16];
+} DerivedKey;
+
+static pthread_mutex_t derived_key_lock = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable *derived_keys;
+/* Per process, only used for the ids of cache entries. */
+static unsigned char cache_id_secret[32];
+
+void
+seafile_wipe (void *ptr, size_t len)
+{
+#ifdef USE_GPL_CRYPTO
+    gnutls_memset (ptr, 0, len);
+#else
+    OPENSSL_cleanse (ptr, len);
+#endif
+}
+
+static void
+derived_key_free (DerivedKey *dkey)
+{
+    seafile_wipe (dkey, sizeof(*dkey));
+    g_free (dkey);
+}
+
+static int
+derived_key_cache_init ()
+{
+#ifdef USE_GPL_CRYPTO
+    if (gnutls_rnd (GNUTLS_RND_RANDOM, cache_id_secret,
+                    sizeof(cache_id_secret)) < 0)
+        return -1;
+#else
+    if (RAND_bytes (cache_id_secret, sizeof(cache_id_secret)) != 1)
+        return -1;
+#endif
+
+    derived_keys = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                          g_free,
+                                          (GDestroyNotify)derived_key_free);
+    return 0;
+}
+
+static void
+derived_key_id (const char *data_in, int in_len, int version,
+                const char *repo_salt, char *id)
+{
+    unsigned char digest[32];
+    char version_str[16];
+    int version_len;
+
+    version_len = snprintf (version_str, sizeof(version_str), "%d:", version);
+    if (!repo_salt)
+        repo_salt = "";
+
+#ifdef USE_GPL_CRYPTO
+    struct hmac_sha256_ctx ctx;
+
+    hmac_sha256_set_key (&ctx, sizeof(cache_id_secret), cache_id_secret);
+    hmac_sha256_update (&ctx, version_len, (const guchar *)version_str);
+    hmac_sha256_update (&ctx, strlen(repo_salt) + 1, (const guchar *)repo_salt);
+    hmac_sha256_update (&ctx, in_len, (const guchar *)data_in);
+    hmac_sha256_digest (&ctx, sizeof(digest), digest);
+    seafile_wipe (&ctx, sizeof(ctx));
+#else
+    GString *buf = g_string_new (NULL);
+    unsigned int len = sizeof(digest);
+
+    g_string_append_len (buf, version_str, version_len);
+    g_string_append_len (buf, repo_salt, strlen(repo_salt) + 1);
+    g_string_append_len (buf, data_in, in_len);
+
+    HMAC (EVP_sha256(), cache_id_secret, sizeof(cache_id_secret),
+          (const unsigned char *)buf->str, buf->len, digest, &len);
+
+    seafile_wipe (buf->str, buf->len);
+    g_string_free (buf, TRUE);
+#endif
+
+    rawdata_to_hex (digest, id, 32);
+    seafile_wipe (digest, sizeof(digest));
+}
+
+int
+seafile_derive_key (const char *data_in, int in_len, int version,
+                    const char *repo_salt,
+                    unsigned char *key, unsigned char *iv)
+{
+    char id[65];
+    DerivedKey *cached;
+    int ret;
+
+    pthread_mutex_lock (&derived_key_lock);
+    if (!derived_keys && derived_key_cache_init () < 0) {
+        pthread_mutex_unlock (&derived_key_lock);
+        seaf_warning ("Failed to init derived key cache.\n");
+        return derive_key (data_in, in_len, version, repo_salt, key, iv);
+    }
+    pthread_mutex_unlock (&derived_key_lock);
+
+    derived_key_id (data_in, in_len, version, repo_salt, id);
+
+    pthread_mutex_lock (&derived_key_lock);
+    cached = g_hash_table_lookup (derived_keys, id);
+    if (cached) {
+        memcpy (key, cached->key, sizeof(cached->key));
+        memcpy (iv, cached->iv, sizeof(cached->iv));
+    }
+    pthread_mutex_unlock (&derived_key_lock);
+
+    if (cached)
+        return 0;
+
+    /* Derived without the lock, so that several keys can be derived at the
+     * same time.
+     */
+    memset (key, 0, 32);
+    memset (iv, 0, 16);
+    ret = derive_key (data_in, in_len, version, repo_salt, key, iv);
+    if (ret < 0)
+        return ret;
+
+    cached = g_new0 (DerivedKey, 1);
+    memcpy (cached->key, key, sizeof(cached->key));
+    memcpy (cached->iv, iv, sizeof(cached->iv));
+
+    pthread_mutex_lock (&derived_key_lock);
+    if (g_hash_table_size (derived_keys) >= DERIVED_KEY_CACHE_SIZE)
+        g_hash_table_remove_all (derived_keys);
+    g_hash_table_replace (derived_keys, g_strdup (id), cached);
+    pthread_mutex_unlock (&derived_key_lock);
+
+    return 0;
+}
+
 int
 seafile_generate_repo_salt (char *repo_salt)
 {
@@ -322,118 +476,302 @@ seafile_update_random_key (const char *old_passwd, const char *old_random_key,
 
 #ifdef USE_GPL_CRYPTO
 
-int
-seafile_encrypt (char **data_out,
-                 int *out_len,
-                 const char *data_in,
-                 const int in_len,
-                 SeafileCrypt *crypt)
-{
-    char *buf = NULL, *enc_buf = NULL;
-    int buf_size, remain;
-    guint8 padding;
+struct SeafileCipher {
     gnutls_cipher_hd_t handle;
-    gnutls_datum_t key, iv;
-    int rc, ret = 0;
+    gboolean encrypt;
+    /* GnuTLS doesn't buffer partial blocks or handle padding. For
+     * decryption the last full block is also held back, since it carries
+     * the padding.
+     */
+    unsigned char pending[BLK_SIZE];
+    int n_pending;
+};
 
-    buf_size = BLK_SIZE * ((in_len / BLK_SIZE) + 1);
-    remain = buf_size - in_len;
-    buf = g_new (char, buf_size);
+SeafileCipher *
+seafile_cipher_new (SeafileCrypt *crypt, gboolean encrypt)
+{
+    SeafileCipher *cipher;
+    gnutls_datum_t key, iv;
+    int rc;
 
-    memcpy (buf, data_in, in_len);
-    padding = (guint8)remain;
-    memset (buf + in_len, padding, remain);
+    cipher = g_new0 (SeafileCipher, 1);
+    cipher->encrypt = encrypt;
 
     key.data = crypt->key;
     key.size = sizeof(crypt->key);
     iv.data = crypt->iv;
     iv.size = sizeof(crypt->iv);
-    rc = gnutls_cipher_init (&handle, GNUTLS_CIPHER_AES_256_CBC, &key, &iv);
+    rc = gnutls_cipher_init (&cipher->handle, GNUTLS_CIPHER_AES_256_CBC,
+                             &key, &iv);
     if (rc < 0) {
         seaf_warning ("Failed to init cipher: %s\n", gnutls_strerror(rc));
-        ret = -1;
-        goto out;
+        g_free (cipher);
+        return NULL;
     }
 
-    enc_buf = g_new (char, buf_size);
-    rc = gnutls_cipher_encrypt2 (handle, buf, buf_size, enc_buf, buf_size);
+    return cipher;
+}
+
+void
+seafile_cipher_free (SeafileCipher *cipher)
+{
+    if (!cipher)
+        return;
+
+    gnutls_cipher_deinit (cipher->handle);
+    g_free (cipher);
+}
+
+static int
+process_blocks (SeafileCipher *cipher, const void *in, int len, char *out)
+{
+    int rc;
+
+    if (cipher->encrypt)
+        rc = gnutls_cipher_encrypt2 (cipher->handle, in, len, out, len);
+    else
+        rc = gnutls_cipher_decrypt2 (cipher->handle, in, len, out, len);
     if (rc < 0) {
-        seaf_warning ("Failed to encrypt: %s\n", gnutls_strerror(rc));
-        ret = -1;
-        gnutls_cipher_deinit (handle);
-        goto out;
+        seaf_warning ("Failed to %s data: %s\n",
+                      cipher->encrypt ? "encrypt" : "decrypt",
+                      gnutls_strerror(rc));
+        return -1;
     }
 
-    gnutls_cipher_deinit (handle);
+    return 0;
+}
 
-out:
-    g_free (buf);
-    if (ret < 0) {
-        g_free (enc_buf);
-        *data_out = NULL;
-        *out_len = -1;
-    } else {
-        *data_out = enc_buf;
-        *out_len = buf_size;
+int
+seafile_cipher_update (SeafileCipher *cipher,
+                       char *out, int *out_len,
+                       const char *in, int in_len)
+{
+    int n, bulk;
+
+    *out_len = 0;
+
+    if (cipher->n_pending > 0) {
+        n = MIN (BLK_SIZE - cipher->n_pending, in_len);
+        memcpy (cipher->pending + cipher->n_pending, in, n);
+        cipher->n_pending += n;
+        in += n;
+        in_len -= n;
+
+        if (cipher->n_pending < BLK_SIZE ||
+            (!cipher->encrypt && in_len == 0))
+            return 0;
+
+        if (process_blocks (cipher, cipher->pending, BLK_SIZE, out) < 0)
+            return -1;
+        out += BLK_SIZE;
+        *out_len += BLK_SIZE;
+        cipher->n_pending = 0;
+    }
+
+    bulk = in_len - in_len % BLK_SIZE;
+    if (!cipher->encrypt && bulk > 0 && bulk == in_len)
+        bulk -= BLK_SIZE;
+
+    if (bulk > 0) {
+        if (process_blocks (cipher, in, bulk, out) < 0)
+            return -1;
+        *out_len += bulk;
     }
-    return ret;
+
+    memcpy (cipher->pending, in + bulk, in_len - bulk);
+    cipher->n_pending = in_len - bulk;
+
+    return 0;
 }
 
 int
-seafile_decrypt (char **data_out,
-                 int *out_len,
-                 const char *data_in,
-                 const int in_len,
-                 SeafileCrypt *crypt)
+seafile_cipher_final (SeafileCipher *cipher, char *out, int *out_len)
 {
-    char *dec_buf = NULL;
-    gnutls_cipher_hd_t handle;
-    gnutls_datum_t key, iv;
-    int rc, ret = 0;
+    unsigned char last[BLK_SIZE];
     guint8 padding;
-    int remain;
 
-    if (in_len <= 0 || in_len % BLK_SIZE != 0) {
+    *out_len = 0;
+
+    if (cipher->encrypt) {
+        padding = (guint8)(BLK_SIZE - cipher->n_pending);
+        memset (cipher->pending + cipher->n_pending, padding, padding);
+        if (process_blocks (cipher, cipher->pending, BLK_SIZE, out) < 0)
+            return -1;
+        *out_len = BLK_SIZE;
+        return 0;
+    }
+
+    if (cipher->n_pending != BLK_SIZE) {
         seaf_warning ("Invalid encrypted buffer size.\n");
         return -1;
     }
 
-    key.data = crypt->key;
-    key.size = sizeof(crypt->key);
-    iv.data = crypt->iv;
-    iv.size = sizeof(crypt->iv);
-    rc = gnutls_cipher_init (&handle, GNUTLS_CIPHER_AES_256_CBC, &key, &iv);
-    if (rc < 0) {
-        seaf_warning ("Failed to init cipher: %s\n", gnutls_strerror(rc));
-        ret = -1;
-        goto out;
+    if (process_blocks (cipher, cipher->pending, BLK_SIZE, (char *)last) < 0)
+        return -1;
+
+    padding = last[BLK_SIZE - 1];
+    if (padding == 0 || padding > BLK_SIZE) {
+        seaf_warning ("Bad padding in decrypted data.\n");
+        return -1;
     }
 
-    dec_buf = g_new (char, in_len);
-    rc = gnutls_cipher_decrypt2 (handle, data_in, in_len, dec_buf, in_len);
-    if (rc < 0) {
-        seaf_warning ("Failed to decrypt data: %s\n", gnutls_strerror(rc));
-        ret = -1;
-        gnutls_cipher_deinit (handle);
-        goto out;
+    *out_len = BLK_SIZE - padding;
+    memcpy (out, last, *out_len);
+
+    return 0;
+}
+
+#else
+
+struct SeafileCipher {
+    EVP_CIPHER_CTX *ctx;
+    gboolean encrypt;
+};
+
+/* One idle cipher for each direction is kept per thread, so that contexts
+ * don't have to be allocated for every block.
+ */
+typedef struct ThreadCiphers {
+    SeafileCipher *idle[2];
+} ThreadCiphers;
+
+static pthread_key_t thread_ciphers_key;
+static pthread_once_t thread_ciphers_once = PTHREAD_ONCE_INIT;
+
+static void
+free_cipher (SeafileCipher *cipher)
+{
+    EVP_CIPHER_CTX_free (cipher->ctx);
+    g_free (cipher);
+}
+
+static void
+thread_ciphers_free (void *vciphers)
+{
+    ThreadCiphers *ciphers = vciphers;
+
+    if (ciphers->idle[0])
+        free_cipher (ciphers->idle[0]);
+    if (ciphers->idle[1])
+        free_cipher (ciphers->idle[1]);
+    g_free (ciphers);
+}
+
+static void
+thread_ciphers_key_init ()
+{
+    pthread_key_create (&thread_ciphers_key, thread_ciphers_free);
+}
+
+static ThreadCiphers *
+get_thread_ciphers ()
+{
+    ThreadCiphers *ciphers;
+
+    pthread_once (&thread_ciphers_once, thread_ciphers_key_init);
+
+    ciphers = pthread_getspecific (thread_ciphers_key);
+    if (!ciphers) {
+        ciphers = g_new0 (ThreadCiphers, 1);
+        pthread_setspecific (thread_ciphers_key, ciphers);
     }
 
-    padding = dec_buf[in_len - 1];
-    remain = padding;
-    *out_len = (in_len - remain);
-    *data_out = dec_buf;
-
-    gnutls_cipher_deinit (handle);
-out:
-    if (ret < 0) {
-        g_free (dec_buf);
-        *data_out = NULL;
-        *out_len = -1;
+    return ciphers;
+}
+
+static const EVP_CIPHER *
+get_evp_cipher (int version)
+{
+    if (version == 1)
+        return EVP_aes_128_cbc ();
+    else if (version == 3)
+        return EVP_aes_128_ecb ();
+    else
+        return EVP_aes_256_cbc ();
+}
+
+SeafileCipher *
+seafile_cipher_new (SeafileCrypt *crypt, gboolean encrypt)
+{
+    ThreadCiphers *ciphers = get_thread_ciphers ();
+    SeafileCipher *cipher;
+    int ret;
+
+    encrypt = encrypt ? 1 : 0;
+
+    cipher = ciphers->idle[encrypt];
+    if (cipher) {
+        ciphers->idle[encrypt] = NULL;
+    } else {
+        cipher = g_new0 (SeafileCipher, 1);
+        cipher->ctx = EVP_CIPHER_CTX_new ();
+        cipher->encrypt = encrypt;
     }
-    return ret;
+
+    ret = EVP_CipherInit_ex (cipher->ctx,
+                             get_evp_cipher (crypt->version),
+                             NULL, /* engine, NULL for default */
+                             crypt->key,  /* derived key */
+                             crypt->iv,   /* initial vector */
+                             encrypt);
+    if (ret == ENC_FAILURE) {
+        seaf_warning ("Failed to init cipher.\n");
+        free_cipher (cipher);
+        return NULL;
+    }
+
+    return cipher;
 }
 
-#else
+void
+seafile_cipher_free (SeafileCipher *cipher)
+{
+    ThreadCiphers *ciphers;
+
+    if (!cipher)
+        return;
+
+    ciphers = get_thread_ciphers ();
+    if (!ciphers->idle[cipher->encrypt])
+        ciphers->idle[cipher->encrypt] = cipher;
+    else
+        free_cipher (cipher);
+}
+
+int
+seafile_cipher_update (SeafileCipher *cipher,
+                       char *out, int *out_len,
+                       const char *in, int in_len)
+{
+    int ret;
+
+    ret = EVP_CipherUpdate (cipher->ctx,
+                            (unsigned char *)out, out_len,
+                            (const unsigned char *)in, in_len);
+    if (ret == ENC_FAILURE) {
+        *out_len = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+seafile_cipher_final (SeafileCipher *cipher, char *out, int *out_len)
+{
+    int ret;
+
+    /* Finish the possible partial block. */
+    ret = EVP_CipherFinal_ex (cipher->ctx, (unsigned char *)out, out_len);
+    if (ret == ENC_FAILURE) {
+        *out_len = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+#endif  /* USE_GPL_CRYPTO */
 
 int
 seafile_encrypt (char **data_out,
@@ -442,6 +780,10 @@ seafile_encrypt (char **data_out,
                  const int in_len,
                  SeafileCrypt *crypt)
 {
+    SeafileCipher *cipher;
+    int blks;
+    int update_len, final_len;
+
     *data_out = NULL;
     *out_len = -1;
 
@@ -451,97 +793,45 @@ seafile_encrypt (char **data_out,
         return -1;
     }
 
-    EVP_CIPHER_CTX *ctx;
-    int ret;
-    int blks;
-
-    /* Prepare CTX for encryption. */
-    ctx = EVP_CIPHER_CTX_new ();
-
-    if (crypt->version == 1)
-        ret = EVP_EncryptInit_ex (ctx,
-                                  EVP_aes_128_cbc(), /* cipher mode */
-                                  NULL, /* engine, NULL for default */
-                                  crypt->key,  /* derived key */
-                                  crypt->iv);  /* initial vector */
-    else if (crypt->version == 3)
-        ret = EVP_EncryptInit_ex (ctx,
-                                  EVP_aes_128_ecb(), /* cipher mode */
-                                  NULL, /* engine, NULL for default */
-                                  crypt->key,  /* derived key */
-                                  crypt->iv);  /* initial vector */
-    else
-        ret = EVP_EncryptInit_ex (ctx,
-                                  EVP_aes_256_cbc(), /* cipher mode */
-                                  NULL, /* engine, NULL for default */
-                                  crypt->key,  /* derived key */
-                                  crypt->iv);  /* initial vector */
-
-    if (ret == ENC_FAILURE) {
-        EVP_CIPHER_CTX_free (ctx);
+    cipher = seafile_cipher_new (crypt, TRUE);
+    if (!cipher)
         return -1;
-    }
 
-    /* Allocating output buffer. */
-    
     /*
-      For EVP symmetric encryption, padding is always used __even if__
+      For symmetric encryption, padding is always used __even if__
       data size is a multiple of block size, in which case the padding
       length is the block size. so we have the following:
     */
-    
     blks = (in_len / BLK_SIZE) + 1;
 
     *data_out = (char *)g_malloc (blks * BLK_SIZE);
 
-    if (*data_out == NULL) {
-        seaf_warning ("failed to allocate the output buffer.\n");
+    if (seafile_cipher_update (cipher, *data_out, &update_len,
+                               data_in, in_len) < 0)
         goto enc_error;
-    }                
-
-    int update_len, final_len;
 
-    /* Do the encryption. */
-    ret = EVP_EncryptUpdate (ctx,
-                             (unsigned char*)*data_out,
-                             &update_len,
-                             (unsigned char*)data_in,
-                             in_len);
-
-    if (ret == ENC_FAILURE)
+    if (seafile_cipher_final (cipher, *data_out + update_len, &final_len) < 0)
         goto enc_error;
 
-
-    /* Finish the possible partial block. */
-    ret = EVP_EncryptFinal_ex (ctx,
-                               (unsigned char*)*data_out + update_len,
-                               &final_len);
-
-    *out_len = update_len + final_len;
-
     /* out_len should be equal to the allocated buffer size. */
-    if (ret == ENC_FAILURE || *out_len != (blks * BLK_SIZE))
+    if (update_len + final_len != (blks * BLK_SIZE))
         goto enc_error;
-    
-    EVP_CIPHER_CTX_free (ctx);
+
+    *out_len = update_len + final_len;
+    seafile_cipher_free (cipher);
 
     return 0;
 
 enc_error:
+    seafile_cipher_free (cipher);
 
-    EVP_CIPHER_CTX_free (ctx);
-
-    *out_len = -1;
-
-    if (*data_out != NULL)
-        g_free (*data_out);
-
+    g_free (*data_out);
     *data_out = NULL;
+    *out_len = -1;
 
     return -1;
-    
 }
-                               
+
 int
 seafile_decrypt (char **data_out,
                  int *out_len,
@@ -549,6 +839,9 @@ seafile_decrypt (char **data_out,
                  const int in_len,
                  SeafileCrypt *crypt)
 {
+    SeafileCipher *cipher;
+    int update_len, final_len;
+
     *data_out = NULL;
     *out_len = -1;
 
@@ -561,85 +854,35 @@ seafile_decrypt (char **data_out,
         return -1;
     }
 
-    EVP_CIPHER_CTX *ctx;
-    int ret;
-
-    /* Prepare CTX for decryption. */
-    ctx = EVP_CIPHER_CTX_new ();
-
-    if (crypt->version == 1)
-        ret = EVP_DecryptInit_ex (ctx,
-                                  EVP_aes_128_cbc(), /* cipher mode */
-                                  NULL, /* engine, NULL for default */
-                                  crypt->key,  /* derived key */
-                                  crypt->iv);  /* initial vector */
-    else if (crypt->version == 3)
-        ret = EVP_DecryptInit_ex (ctx,
-                                  EVP_aes_128_ecb(), /* cipher mode */
-                                  NULL, /* engine, NULL for default */
-                                  crypt->key,  /* derived key */
-                                  crypt->iv);  /* initial vector */
-    else
-        ret = EVP_DecryptInit_ex (ctx,
-                                  EVP_aes_256_cbc(), /* cipher mode */
-                                  NULL, /* engine, NULL for default */
-                                  crypt->key,  /* derived key */
-                                  crypt->iv);  /* initial vector */
-
-    if (ret == DEC_FAILURE) {
-        EVP_CIPHER_CTX_free (ctx);
+    cipher = seafile_cipher_new (crypt, FALSE);
+    if (!cipher)
         return -1;
-    }
 
-    /* Allocating output buffer. */
-    
-    *data_out = (char *)g_malloc (in_len);
+    /* The update may need room for one more block than the input. */
+    *data_out = (char *)g_malloc (in_len + BLK_SIZE);
 
-    if (*data_out == NULL) {
-        seaf_warning ("failed to allocate the output buffer.\n");
+    if (seafile_cipher_update (cipher, *data_out, &update_len,
+                               data_in, in_len) < 0)
         goto dec_error;
-    }                
-
-    int update_len, final_len;
-
-    /* Do the decryption. */
-    ret = EVP_DecryptUpdate (ctx,
-                             (unsigned char*)*data_out,
-                             &update_len,
-                             (unsigned char*)data_in,
-                             in_len);
 
-    if (ret == DEC_FAILURE)
+    if (seafile_cipher_final (cipher, *data_out + update_len, &final_len) < 0)
         goto dec_error;
 
-
-    /* Finish the possible partial block. */
-    ret = EVP_DecryptFinal_ex (ctx,
-                               (unsigned char*)*data_out + update_len,
-                               &final_len);
-
-    *out_len = update_len + final_len;
-
     /* out_len should be smaller than in_len. */
-    if (ret == DEC_FAILURE || *out_len > in_len)
+    if (update_len + final_len > in_len)
         goto dec_error;
 
-    EVP_CIPHER_CTX_free (ctx);
-    
+    *out_len = update_len + final_len;
+    seafile_cipher_free (cipher);
+
     return 0;
 
 dec_error:
+    seafile_cipher_free (cipher);
 
-    EVP_CIPHER_CTX_free (ctx);
-
-    *out_len = -1;
-    if (*data_out != NULL)
-        g_free (*data_out);
-
+    g_free (*data_out);
     *data_out = NULL;
+    *out_len = -1;
 
     return -1;
-    
 }
-
-#endif  /* USE_GPL_CRYPTO */
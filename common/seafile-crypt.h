@@ -45,6 +45,12 @@ seafile_derive_key (const char *data_in, int in_len, int version,
                     const char *repo_salt,
                     unsigned char *key, unsigned char *iv);
 
+/* Zeroes keys and passwords before they are freed. Unlike memset(), this
+ * isn't optimized away.
+ */
+void
+seafile_wipe (void *ptr, size_t len);
+
 /* @salt must be an char array of size 65 bytes. */
 int
 seafile_generate_repo_salt (char *repo_salt);
@@ -98,4 +104,33 @@ seafile_decrypt (char **data_out,
                  const int in_len,
                  SeafileCrypt *crypt);
 
+/*
+ * Incremental encryption/decryption, for data that arrives or is written in
+ * pieces. Output goes to buffers provided by the caller:
+ * seafile_cipher_update() writes at most @in_len + BLK_SIZE bytes and
+ * seafile_cipher_final() at most BLK_SIZE bytes. The padding is the same as
+ * seafile_encrypt() and seafile_decrypt().
+ *
+ * Freed ciphers are kept by the calling thread and reused by the next
+ * seafile_cipher_new() in that thread. A cipher may be freed without being
+ * finalized, e.g. on errors.
+ */
+typedef struct SeafileCipher SeafileCipher;
+
+#define SEAFILE_CIPHER_MAX_OUT(in_len) ((in_len) + BLK_SIZE)
+
+SeafileCipher *
+seafile_cipher_new (SeafileCrypt *crypt, gboolean encrypt);
+
+void
+seafile_cipher_free (SeafileCipher *cipher);
+
+int
+seafile_cipher_update (SeafileCipher *cipher,
+                       char *out, int *out_len,
+                       const char *in, int in_len);
+
+int
+seafile_cipher_final (SeafileCipher *cipher, char *out, int *out_len);
+
 #endif  /* _SEAFILE_CRYPT_H */
@@ -0,0 +1,290 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+#include <glib/gstdio.h>
+
+#include "trace.h"
+#include "metrics.h"
+#include "log.h"
+
+/* About 640KB per thread. */
+#define TRACE_BUFFER_EVENTS 8192
+#define TRACE_ARG_LEN 48
+
+typedef struct TraceEvent {
+    const char *name;
+    gint64 ts;
+    gint64 dur;
+    int tid;
+    char arg[TRACE_ARG_LEN];
+} TraceEvent;
+
+typedef struct TraceBuffer {
+    pthread_mutex_t lock;
+    /* Owner thread, for the events recorded from now on. */
+    int tid;
+    gboolean in_use;
+    int pos;
+    int count;
+    TraceEvent events[TRACE_BUFFER_EVENTS];
+} TraceBuffer;
+
+static gint enabled;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Buffers are kept when their thread exits, so that its spans can still be
+ * dumped, and handed to the next new thread.
+ */
+static GList *buffers;
+static int next_tid;
+
+static pthread_once_t buffer_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t buffer_key;
+
+static void
+release_buffer (void *vbuf)
+{
+    TraceBuffer *buf = vbuf;
+
+    pthread_mutex_lock (&trace_lock);
+    buf->in_use = FALSE;
+    pthread_mutex_unlock (&trace_lock);
+}
+
+static void
+create_buffer_key ()
+{
+    pthread_key_create (&buffer_key, release_buffer);
+}
+
+static TraceBuffer *
+get_thread_buffer ()
+{
+    TraceBuffer *buf;
+    GList *ptr;
+
+    pthread_once (&buffer_key_once, create_buffer_key);
+
+    buf = pthread_getspecific (buffer_key);
+    if (buf)
+        return buf;
+
+    pthread_mutex_lock (&trace_lock);
+    for (ptr = buffers; ptr; ptr = ptr->next) {
+        buf = ptr->data;
+        if (!buf->in_use)
+            break;
+    }
+    if (!ptr) {
+        buf = g_new0 (TraceBuffer, 1);
+        pthread_mutex_init (&buf->lock, NULL);
+        buffers = g_list_prepend (buffers, buf);
+    }
+    buf->in_use = TRUE;
+    buf->tid = ++next_tid;
+    pthread_mutex_unlock (&trace_lock);
+
+    pthread_setspecific (buffer_key, buf);
+
+    return buf;
+}
+
+gboolean
+seaf_trace_enabled ()
+{
+    return g_atomic_int_get (&enabled);
+}
+
+void
+seaf_trace_set_enabled (gboolean on)
+{
+    TraceBuffer *buf;
+    GList *ptr;
+
+    if (on && !g_atomic_int_get (&enabled)) {
+        pthread_mutex_lock (&trace_lock);
+        for (ptr = buffers; ptr; ptr = ptr->next) {
+            buf = ptr->data;
+            pthread_mutex_lock (&buf->lock);
+            buf->pos = 0;
+            buf->count = 0;
+            pthread_mutex_unlock (&buf->lock);
+        }
+        pthread_mutex_unlock (&trace_lock);
+    }
+
+    g_atomic_int_set (&enabled, on ? 1 : 0);
+    seaf_message ("Tracing is %s.\n", on ? "on" : "off");
+}
+
+void
+seaf_trace_span (const char *name, gint64 start, const char *arg)
+{
+    TraceBuffer *buf;
+    TraceEvent *event;
+    gint64 now;
+
+    if (!g_atomic_int_get (&enabled))
+        return;
+
+    now = seaf_metrics_now ();
+    buf = get_thread_buffer ();
+
+    pthread_mutex_lock (&buf->lock);
+    event = &buf->events[buf->pos];
+    event->name = name;
+    event->ts = start;
+    event->dur = MAX (now - start, 0);
+    event->tid = buf->tid;
+    if (arg)
+        g_strlcpy (event->arg, arg, sizeof(event->arg));
+    else
+        event->arg[0] = 0;
+    buf->pos = (buf->pos + 1) % TRACE_BUFFER_EVENTS;
+    if (buf->count < TRACE_BUFFER_EVENTS)
+        ++(buf->count);
+    pthread_mutex_unlock (&buf->lock);
+}
+
+static void
+write_json_string (FILE *fp, const char *str)
+{
+    const unsigned char *p;
+
+    fputc ('"', fp);
+    for (p = (const unsigned char *)str; *p; ++p) {
+        if (*p == '"' || *p == '\\')
+            fprintf (fp, "\\%c", *p);
+        else if (*p < 0x20)
+            fprintf (fp, "\\u%04x", *p);
+        else
+            fputc (*p, fp);
+    }
+    fputc ('"', fp);
+}
+
+int
+seaf_trace_dump (const char *path)
+{
+    FILE *fp;
+    GList *ptr;
+    TraceBuffer *buf;
+    TraceEvent *events, *event;
+    int n, i, start;
+    gboolean first = TRUE;
+    int ret = 0;
+
+    fp = g_fopen (path, "w");
+    if (!fp) {
+        seaf_warning ("Failed to open %s: %s.\n", path, strerror(errno));
+        return -1;
+    }
+
+    fprintf (fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+    events = g_new (TraceEvent, TRACE_BUFFER_EVENTS);
+
+    /* Buffers are never freed, so the list can be walked after unlocking. */
+    pthread_mutex_lock (&trace_lock);
+    ptr = buffers;
+    pthread_mutex_unlock (&trace_lock);
+
+    for (; ptr; ptr = ptr->next) {
+        buf = ptr->data;
+
+        /* Copy out so that the thread isn't blocked by the file writes. */
+        pthread_mutex_lock (&buf->lock);
+        n = buf->count;
+        start = (buf->pos - n + TRACE_BUFFER_EVENTS) % TRACE_BUFFER_EVENTS;
+        for (i = 0; i < n; ++i)
+            events[i] = buf->events[(start + i) % TRACE_BUFFER_EVENTS];
+        pthread_mutex_unlock (&buf->lock);
+
+        for (i = 0; i < n; ++i) {
+            event = &events[i];
+            fprintf (fp, "%s\n{\"name\":\"%s\",\"cat\":\"seafile\",\"ph\":\"X\","
+                     "\"ts\":%"G_GINT64_FORMAT",\"dur\":%"G_GINT64_FORMAT","
+                     "\"pid\":1,\"tid\":%d",
+                     first ? "" : ",", event->name, event->ts, event->dur,
+                     event->tid);
+            if (event->arg[0]) {
+                fprintf (fp, ",\"args\":{\"id\":");
+                write_json_string (fp, event->arg);
+                fputc ('}', fp);
+            }
+            fputc ('}', fp);
+            first = FALSE;
+        }
+    }
+
+    g_free (events);
+
+    fprintf (fp, "\n]}\n");
+
+    if (ferror (fp)) {
+        seaf_warning ("Failed to write %s.\n", path);
+        ret = -1;
+    }
+    if (fclose (fp) != 0)
+        ret = -1;
+
+    return ret;
+}
+
+typedef struct SpanTotal {
+    gint64 count;
+    gint64 usec;
+} SpanTotal;
+
+json_t *
+seaf_trace_get_totals ()
+{
+    GHashTable *table;
+    GHashTableIter iter;
+    gpointer key, value;
+    GList *ptr;
+    TraceBuffer *buf;
+    TraceEvent *event;
+    SpanTotal *total;
+    json_t *totals, *object;
+    int i;
+
+    /* Names are string constants, they outlive the table. */
+    table = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, g_free);
+
+    pthread_mutex_lock (&trace_lock);
+    ptr = buffers;
+    pthread_mutex_unlock (&trace_lock);
+
+    for (; ptr; ptr = ptr->next) {
+        buf = ptr->data;
+
+        pthread_mutex_lock (&buf->lock);
+        for (i = 0; i < buf->count; ++i) {
+            event = &buf->events[i];
+            total = g_hash_table_lookup (table, event->name);
+            if (!total) {
+                total = g_new0 (SpanTotal, 1);
+                g_hash_table_insert (table, (gpointer)event->name, total);
+            }
+            ++(total->count);
+            total->usec += event->dur;
+        }
+        pthread_mutex_unlock (&buf->lock);
+    }
+
+    totals = json_object ();
+    g_hash_table_iter_init (&iter, table);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        total = value;
+        object = json_object ();
+        json_object_set_new (object, "count", json_integer (total->count));
+        json_object_set_new (object, "usec", json_integer (total->usec));
+        json_object_set_new (totals, key, object);
+    }
+    g_hash_table_destroy (table);
+
+    return totals;
+}
@@ -0,0 +1,51 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SEAF_TRACE_H
+#define SEAF_TRACE_H
+
+#include <glib.h>
+#include <jansson.h>
+
+/*
+ * Timeline of spans across threads, to be viewed in chrome://tracing or
+ * Perfetto.
+ *
+ * Tracing is off by default and switched on at runtime. Each thread records
+ * into its own ring buffer, which keeps the latest spans of the thread when
+ * it fills up. While tracing is off, recording a span costs one check.
+ *
+ * A span is timed like a metric:
+ *
+ *     gint64 start = seaf_metrics_now ();
+ *     ...
+ *     seaf_trace_span ("send_block", start, block_id);
+ */
+
+gboolean
+seaf_trace_enabled ();
+
+/* Turning tracing on drops the spans of an earlier run. */
+void
+seaf_trace_set_enabled (gboolean enabled);
+
+/*
+ * Records a span from @start, as returned by seaf_metrics_now(), until now.
+ * @name must be a string constant. @arg, e.g. a repo or block id, is copied
+ * and may be NULL.
+ */
+void
+seaf_trace_span (const char *name, gint64 start, const char *arg);
+
+/* Writes the recorded spans to @path in the Chrome trace JSON format. */
+int
+seaf_trace_dump (const char *path);
+
+/*
+ * Returns an object with the number and total duration of the recorded
+ * spans of each name, as {"name": {"count": n, "usec": total}}. Only the
+ * spans still in the ring buffers are counted.
+ */
+json_t *
+seaf_trace_get_totals ();
+
+#endif
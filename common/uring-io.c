@@ -0,0 +1,182 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#ifdef HAVE_LIBURING
+
+#include <fcntl.h>
+#include <liburing.h>
+
+#include "uring-io.h"
+#include "log.h"
+
+/* At most four operations are in flight per ring. */
+#define RING_ENTRIES 8
+
+enum {
+    OP_WRITE,
+    OP_FSYNC,
+    OP_CLOSE,
+    OP_RENAME,
+    N_OPS,
+};
+
+static gboolean supported;
+
+static void free_ring (gpointer data);
+
+static GPrivate thread_ring = G_PRIVATE_INIT (free_ring);
+/* Set for threads that failed to set up a ring. */
+static GPrivate thread_ring_failed;
+
+static gpointer
+probe_ops (gpointer unused)
+{
+    struct io_uring_probe *probe;
+
+    probe = io_uring_get_probe ();
+    if (!probe)
+        return NULL;
+
+    supported = (io_uring_opcode_supported (probe, IORING_OP_WRITE) &&
+                 io_uring_opcode_supported (probe, IORING_OP_FSYNC) &&
+                 io_uring_opcode_supported (probe, IORING_OP_CLOSE) &&
+                 io_uring_opcode_supported (probe, IORING_OP_RENAMEAT));
+    io_uring_free_probe (probe);
+
+    if (!supported)
+        seaf_message ("io_uring doesn't support renames, using system calls.\n");
+
+    return NULL;
+}
+
+static void
+free_ring (gpointer data)
+{
+    struct io_uring *ring = data;
+
+    io_uring_queue_exit (ring);
+    g_free (ring);
+}
+
+static struct io_uring *
+get_thread_ring ()
+{
+    struct io_uring *ring;
+    int rc;
+
+    ring = g_private_get (&thread_ring);
+    if (ring || g_private_get (&thread_ring_failed))
+        return ring;
+
+    ring = g_new0 (struct io_uring, 1);
+    rc = io_uring_queue_init (RING_ENTRIES, ring, 0);
+    if (rc < 0) {
+        seaf_warning ("Failed to set up io_uring: %s.\n", strerror(-rc));
+        g_free (ring);
+        g_private_set (&thread_ring_failed, GINT_TO_POINTER(1));
+        return NULL;
+    }
+
+    g_private_set (&thread_ring, ring);
+    return ring;
+}
+
+gboolean
+seaf_uring_available ()
+{
+    static GOnce once = G_ONCE_INIT;
+
+    g_once (&once, probe_ops, NULL);
+    return supported && get_thread_ring () != NULL;
+}
+
+int
+seaf_uring_write_file (int fd, const void *data, int len, gboolean need_sync,
+                       const char *tmp_path, const char *path)
+{
+    struct io_uring *ring;
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    int res[N_OPS];
+    int n_ops = 0;
+    int i, rc;
+    int ret = 0;
+
+    ring = get_thread_ring ();
+    if (!ring) {
+        close (fd);
+        return -1;
+    }
+
+    for (i = 0; i < N_OPS; ++i)
+        res[i] = 0;
+
+    /* A failed or short write cancels the rest of the chain. */
+    sqe = io_uring_get_sqe (ring);
+    io_uring_prep_write (sqe, fd, data, len, 0);
+    io_uring_sqe_set_data (sqe, GINT_TO_POINTER(OP_WRITE));
+    sqe->flags |= IOSQE_IO_LINK;
+    ++n_ops;
+
+    if (need_sync) {
+        sqe = io_uring_get_sqe (ring);
+        io_uring_prep_fsync (sqe, fd, 0);
+        io_uring_sqe_set_data (sqe, GINT_TO_POINTER(OP_FSYNC));
+        sqe->flags |= IOSQE_IO_LINK;
+        ++n_ops;
+    }
+
+    sqe = io_uring_get_sqe (ring);
+    io_uring_prep_close (sqe, fd);
+    io_uring_sqe_set_data (sqe, GINT_TO_POINTER(OP_CLOSE));
+    sqe->flags |= IOSQE_IO_LINK;
+    ++n_ops;
+
+    sqe = io_uring_get_sqe (ring);
+    io_uring_prep_renameat (sqe, AT_FDCWD, tmp_path, AT_FDCWD, path, 0);
+    io_uring_sqe_set_data (sqe, GINT_TO_POINTER(OP_RENAME));
+    ++n_ops;
+
+    rc = io_uring_submit_and_wait (ring, n_ops);
+    if (rc < 0) {
+        seaf_warning ("Failed to submit io_uring requests: %s.\n", strerror(-rc));
+        close (fd);
+        return -1;
+    }
+
+    for (i = 0; i < n_ops; ++i) {
+        rc = io_uring_wait_cqe (ring, &cqe);
+        if (rc < 0) {
+            seaf_warning ("Failed to wait for io_uring completion: %s.\n",
+                          strerror(-rc));
+            return -1;
+        }
+        res[GPOINTER_TO_INT(io_uring_cqe_get_data (cqe))] = cqe->res;
+        io_uring_cqe_seen (ring, cqe);
+    }
+
+    if (res[OP_WRITE] != len) {
+        seaf_warning ("Failed to write %s: %s.\n", tmp_path,
+                      res[OP_WRITE] < 0 ? strerror(-res[OP_WRITE]) : "short write");
+        ret = -1;
+    } else if (res[OP_FSYNC] < 0) {
+        seaf_warning ("Failed to fsync %s: %s.\n", tmp_path, strerror(-res[OP_FSYNC]));
+        ret = -1;
+    } else if (res[OP_CLOSE] < 0 && res[OP_CLOSE] != -ECANCELED) {
+        seaf_warning ("Failed to close %s: %s.\n", tmp_path, strerror(-res[OP_CLOSE]));
+        ret = -1;
+    } else if (res[OP_RENAME] < 0) {
+        seaf_warning ("Failed to rename %s to %s: %s.\n",
+                      tmp_path, path, strerror(-res[OP_RENAME]));
+        ret = -1;
+    }
+
+    /* The close was cancelled by an earlier failure. */
+    if (res[OP_CLOSE] == -ECANCELED)
+        close (fd);
+
+    return ret;
+}
+
+#endif  /* HAVE_LIBURING */
@@ -0,0 +1,33 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef URING_IO_H
+#define URING_IO_H
+
+#include <glib.h>
+
+/*
+ * Small file writes through io_uring on Linux.
+ *
+ * Each thread gets its own ring on first use. The write, fsync, close and
+ * rename of a file are submitted as one linked chain, which costs one
+ * system call instead of four. Renames need Linux 5.11. When the kernel
+ * doesn't support the operations, or rings can't be created, callers use
+ * plain system calls instead.
+ */
+
+#ifdef HAVE_LIBURING
+
+gboolean
+seaf_uring_available ();
+
+/*
+ * Writes @len bytes of @data to @fd, fsyncs it if @need_sync is set,
+ * closes it and renames @tmp_path to @path. @fd is closed in any case.
+ */
+int
+seaf_uring_write_file (int fd, const void *data, int len, gboolean need_sync,
+                       const char *tmp_path, const char *path);
+
+#endif
+
+#endif
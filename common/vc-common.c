@@ -2,6 +2,7 @@
 
 #include "seafile-session.h"
 #include "vc-common.h"
+#include "commit-graph.h"
 
 #include "log.h"
 #include "seafile-error.h"
@@ -120,6 +121,53 @@ typedef struct {
     GHashTable *commit_hash;
 } MergeTraverseData;
 
+/*
+ * Same as merge_bases_many(), but only looks at the commit graph. The
+ * bases found in the graph are independent already.
+ * Returns -1 if the graph doesn't have the history of the commits.
+ */
+static int
+merge_bases_from_graph (SeafCommit *one, int n, SeafCommit **twos,
+                        GList **result)
+{
+    GList *bases = NULL, *ptr;
+    char **two_ids;
+    SeafCommit *commit;
+    int i;
+    int ret = 0;
+
+    *result = NULL;
+
+    two_ids = g_new0 (char *, n);
+    for (i = 0; i < n; i++)
+        two_ids[i] = twos[i]->commit_id;
+
+    ret = commit_graph_merge_bases (seaf->commit_mgr->graph,
+                                    one->repo_id, one->version,
+                                    one->commit_id, n, two_ids, &bases);
+    g_free (two_ids);
+    if (ret < 0)
+        return -1;
+
+    /* Latest commit first, like the graph returns them. */
+    for (ptr = bases; ptr; ptr = ptr->next) {
+        commit = seaf_commit_manager_get_commit (seaf->commit_mgr,
+                                                 one->repo_id, one->version,
+                                                 ptr->data);
+        if (!commit) {
+            g_list_free_full (*result, (GDestroyNotify)seaf_commit_unref);
+            *result = NULL;
+            ret = -1;
+            break;
+        }
+        *result = g_list_prepend (*result, commit);
+    }
+    *result = g_list_reverse (*result);
+
+    g_list_free_full (bases, g_free);
+    return ret;
+}
+
 static gboolean
 get_merge_bases (SeafCommit *commit, void *vdata, gboolean *stop)
 {
@@ -161,6 +209,9 @@ merge_bases_many (SeafCommit *one, int n, SeafCommit **twos)
             return g_list_append (result, one);
     }
 
+    if (merge_bases_from_graph (one, n, twos, &result) == 0)
+        return result;
+
     /* First construct a hash table of all commit ids rooted at one. */
     commit_hash = commit_tree_to_hash (one);
     if (!commit_hash) {
@@ -273,11 +324,21 @@ vc_compare_commits (const char *repo_id, int version,
 {
     SeafCommit *commit1, *commit2, *ca;
     VCCompareResult ret;
+    gboolean is_ancestor;
 
     /* Treat the same as up-to-date. */
     if (strcmp (c1, c2) == 0)
         return VC_UP_TO_DATE;
 
+    if (commit_graph_is_ancestor (seaf->commit_mgr->graph, repo_id, version,
+                                  c1, c2, &is_ancestor) == 0) {
+        if (is_ancestor)
+            return VC_UP_TO_DATE;
+        if (commit_graph_is_ancestor (seaf->commit_mgr->graph, repo_id, version,
+                                      c2, c1, &is_ancestor) == 0)
+            return is_ancestor ? VC_FAST_FORWARD : VC_INDEPENDENT;
+    }
+
     commit1 = seaf_commit_manager_get_commit (seaf->commit_mgr, repo_id, version, c1);
     if (!commit1)
         return VC_INDEPENDENT;
@@ -0,0 +1,291 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#ifdef WIN32
+#include <windows.h>
+#elif defined __APPLE__
+#include <pthread/qos.h>
+#include <ApplicationServices/ApplicationServices.h>
+#elif defined __linux__
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+
+#include "work-mode.h"
+#include "log.h"
+
+/* The user counts as away after this many seconds without input. */
+#define USER_IDLE_SECONDS 300
+
+/* The mode is evaluated at most this often. */
+#define MODE_CHECK_USEC (G_USEC_PER_SEC)
+
+#ifdef __linux__
+/* From linux/ioprio.h, which isn't installed everywhere. */
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_PRIO_VALUE(class, data) (((class) << IOPRIO_CLASS_SHIFT) | (data))
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_NONE 0
+#define IOPRIO_CLASS_IDLE 3
+
+/* Nice value of background threads. */
+#define BACKGROUND_NICE 19
+#endif
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static gboolean enabled;
+static gint64 boost_until;
+static int mode = SEAF_WORK_MODE_FULL_SPEED;
+static gint64 mode_checked_at;
+static gboolean warned;
+
+typedef struct ThreadState {
+    gboolean demoted;
+#ifdef __linux__
+    /* Nice value before the thread was demoted, if it was changed. */
+    gboolean reniced;
+    int saved_nice;
+#endif
+} ThreadState;
+
+static GPrivate thread_state = G_PRIVATE_INIT (g_free);
+
+/* Seconds since the last keyboard or mouse input of the user. */
+static gint64
+get_user_idle_seconds ()
+{
+#ifdef WIN32
+    LASTINPUTINFO info;
+
+    info.cbSize = sizeof(info);
+    if (!GetLastInputInfo (&info))
+        return -1;
+    return (GetTickCount () - info.dwTime) / 1000;
+#elif defined __APPLE__
+    return (gint64)CGEventSourceSecondsSinceLastEventType (
+        kCGEventSourceStateCombinedSessionState, kCGAnyInputEventType);
+#else
+    /* Not available to a daemon without a display connection. */
+    return -1;
+#endif
+}
+
+/* Called with lock held. */
+static void
+update_mode ()
+{
+    gint64 now = g_get_monotonic_time ();
+    gint64 idle;
+
+    if (now - mode_checked_at < MODE_CHECK_USEC)
+        return;
+    mode_checked_at = now;
+
+    if (!enabled || now < boost_until) {
+        mode = SEAF_WORK_MODE_FULL_SPEED;
+        return;
+    }
+
+    idle = get_user_idle_seconds ();
+    if (idle >= USER_IDLE_SECONDS)
+        mode = SEAF_WORK_MODE_FULL_SPEED;
+    else
+        mode = SEAF_WORK_MODE_BACKGROUND;
+}
+
+void
+seaf_work_mode_set_enabled (gboolean value)
+{
+    pthread_mutex_lock (&lock);
+    enabled = value;
+    mode_checked_at = 0;
+    pthread_mutex_unlock (&lock);
+}
+
+void
+seaf_work_mode_boost (int seconds)
+{
+    pthread_mutex_lock (&lock);
+    boost_until = MAX (boost_until,
+                       g_get_monotonic_time () + (gint64)seconds * G_USEC_PER_SEC);
+    mode_checked_at = 0;
+    pthread_mutex_unlock (&lock);
+}
+
+int
+seaf_work_mode_get ()
+{
+    int ret;
+
+    pthread_mutex_lock (&lock);
+    update_mode ();
+    ret = mode;
+    pthread_mutex_unlock (&lock);
+
+    return ret;
+}
+
+#ifdef __linux__
+/* An unprivileged thread can only lower its nice value down to the limit
+ * set by RLIMIT_NICE, so it's only raised if it can be restored.
+ */
+static gboolean
+can_restore_nice (int nice)
+{
+    struct rlimit limit;
+
+    if (getrlimit (RLIMIT_NICE, &limit) < 0)
+        return FALSE;
+    if (limit.rlim_cur == RLIM_INFINITY)
+        return TRUE;
+    return nice >= 20 - (int)limit.rlim_cur;
+}
+#endif
+
+static int
+demote_thread (ThreadState *state)
+{
+#ifdef WIN32
+    if (!SetThreadPriority (GetCurrentThread (), THREAD_MODE_BACKGROUND_BEGIN))
+        return -1;
+#elif defined __APPLE__
+    if (pthread_set_qos_class_self_np (QOS_CLASS_UTILITY, 0) != 0)
+        return -1;
+#elif defined __linux__
+    pid_t tid = (pid_t)syscall (SYS_gettid);
+    int nice;
+
+    /* Per thread when called with a thread id. */
+    if (syscall (SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid,
+                 IOPRIO_PRIO_VALUE (IOPRIO_CLASS_IDLE, 0)) < 0)
+        return -1;
+
+    state->reniced = FALSE;
+    errno = 0;
+    nice = getpriority (PRIO_PROCESS, tid);
+    if (errno == 0 && nice < BACKGROUND_NICE && can_restore_nice (nice) &&
+        setpriority (PRIO_PROCESS, tid, BACKGROUND_NICE) == 0) {
+        state->reniced = TRUE;
+        state->saved_nice = nice;
+    }
+#endif
+
+    return 0;
+}
+
+static int
+restore_thread (ThreadState *state)
+{
+#ifdef WIN32
+    if (!SetThreadPriority (GetCurrentThread (), THREAD_MODE_BACKGROUND_END))
+        return -1;
+#elif defined __APPLE__
+    if (pthread_set_qos_class_self_np (QOS_CLASS_DEFAULT, 0) != 0)
+        return -1;
+#elif defined __linux__
+    pid_t tid = (pid_t)syscall (SYS_gettid);
+
+    if (syscall (SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid,
+                 IOPRIO_PRIO_VALUE (IOPRIO_CLASS_NONE, 0)) < 0)
+        return -1;
+    if (state->reniced) {
+        if (setpriority (PRIO_PROCESS, tid, state->saved_nice) < 0)
+            return -1;
+        state->reniced = FALSE;
+    }
+#endif
+
+    return 0;
+}
+
+static ThreadState *
+get_thread_state ()
+{
+    ThreadState *state = g_private_get (&thread_state);
+
+    if (!state) {
+        state = g_new0 (ThreadState, 1);
+        g_private_set (&thread_state, state);
+    }
+    return state;
+}
+
+static void
+warn_once ()
+{
+    gboolean do_warn;
+
+    pthread_mutex_lock (&lock);
+    do_warn = !warned;
+    warned = TRUE;
+    pthread_mutex_unlock (&lock);
+
+    if (do_warn)
+        seaf_warning ("Failed to change the priority of worker threads.\n");
+}
+
+void
+seaf_work_mode_apply_to_thread ()
+{
+    ThreadState *state = get_thread_state ();
+    gboolean background;
+
+    background = (seaf_work_mode_get () == SEAF_WORK_MODE_BACKGROUND);
+    if (background == state->demoted)
+        return;
+
+    /* The state is only changed on success, so it's retried next time. */
+    if (background) {
+        if (demote_thread (state) < 0) {
+            warn_once ();
+            return;
+        }
+        state->demoted = TRUE;
+    } else {
+        seaf_work_mode_restore_thread ();
+    }
+}
+
+void
+seaf_work_mode_restore_thread ()
+{
+    ThreadState *state = g_private_get (&thread_state);
+
+    if (!state || !state->demoted)
+        return;
+
+    if (restore_thread (state) < 0) {
+        warn_once ();
+        return;
+    }
+    state->demoted = FALSE;
+}
+
+json_t *
+seaf_work_mode_to_json ()
+{
+    json_t *object;
+    int cur_mode;
+    gboolean is_enabled;
+
+    cur_mode = seaf_work_mode_get ();
+
+    pthread_mutex_lock (&lock);
+    is_enabled = enabled;
+    pthread_mutex_unlock (&lock);
+
+    object = json_object ();
+    json_object_set_new (object, "mode",
+                         json_string (cur_mode == SEAF_WORK_MODE_BACKGROUND ?
+                                      "background" : "full_speed"));
+    json_object_set_new (object, "background_mode_enabled",
+                         json_boolean (is_enabled));
+    json_object_set_new (object, "user_idle_seconds",
+                         json_integer (get_user_idle_seconds ()));
+
+    return object;
+}
@@ -0,0 +1,58 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SEAF_WORK_MODE_H
+#define SEAF_WORK_MODE_H
+
+#include <glib.h>
+#include <jansson.h>
+
+/*
+ * Scheduling class of the threads that index, chunk and check out files.
+ *
+ * In background mode these threads run with the OS background priority:
+ * the idle I/O class and nice 19 on Linux, THREAD_MODE_BACKGROUND_BEGIN
+ * on Windows and QOS_CLASS_UTILITY on macOS. They run at full speed while
+ * the user is away from the machine (Windows and macOS only) and for a
+ * while after a sync is requested over RPC.
+ *
+ * Workers run on shared threads, so each piece of work restores the
+ * priority of its thread when done. On Linux the nice value is only raised
+ * if RLIMIT_NICE allows lowering it again.
+ */
+
+enum {
+    SEAF_WORK_MODE_FULL_SPEED = 0,
+    SEAF_WORK_MODE_BACKGROUND,
+};
+
+/* Background mode is only used if enabled. */
+void
+seaf_work_mode_set_enabled (gboolean enabled);
+
+/* Runs at full speed for the next @seconds. */
+void
+seaf_work_mode_boost (int seconds);
+
+int
+seaf_work_mode_get ();
+
+/*
+ * Switches the calling thread to the current mode. Called by the workers
+ * before each piece of work, the OS is only asked when the mode changes.
+ */
+void
+seaf_work_mode_apply_to_thread ();
+
+/* Restores the priority the thread had before it was switched to
+ * background mode. Called by the workers after each piece of work.
+ */
+void
+seaf_work_mode_restore_thread ();
+
+/* Returns the mode, whether background mode is enabled and the seconds
+ * since the last user input, -1 if that's not known.
+ */
+json_t *
+seaf_work_mode_to_json ();
+
+#endif
@@ -0,0 +1,242 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#include "bandwidth-scheduler.h"
+
+/* Tokens that may pile up while nobody is transferring, in seconds. */
+#define BURST_TIME 0.05
+/* A flow that hasn't transferred for this long starts over at the current
+ * virtual time of the busy flows.
+ */
+#define IDLE_TIME 1.0
+/* Upper bound of a single wait, so that a lowered limit is noticed. */
+#define MAX_WAIT_TIME 0.1
+
+/* Indexed by TRANSFER_PRIORITY_*. */
+static const int priority_weights[] = { 4, 1, 16 };
+
+struct BandwidthScheduler {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    double tokens;
+    double last_refill;
+
+    GList *flows;
+};
+
+struct BandwidthFlow {
+    BandwidthScheduler *sched;
+    int weight;
+
+    /* Bytes transferred divided by weight. */
+    double vtime;
+    int waiting;
+    double last_active;
+};
+
+static double
+now_sec ()
+{
+    GTimeVal tv;
+
+    g_get_current_time (&tv);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+BandwidthScheduler *
+bandwidth_scheduler_new ()
+{
+    BandwidthScheduler *sched = g_new0 (BandwidthScheduler, 1);
+
+    pthread_mutex_init (&sched->lock, NULL);
+    pthread_cond_init (&sched->cond, NULL);
+    sched->last_refill = now_sec ();
+
+    return sched;
+}
+
+BandwidthFlow *
+bandwidth_scheduler_add_flow (BandwidthScheduler *sched, int priority)
+{
+    BandwidthFlow *flow = g_new0 (BandwidthFlow, 1);
+
+    if (priority < 0 || priority >= (int)G_N_ELEMENTS (priority_weights))
+        priority = TRANSFER_PRIORITY_NORMAL;
+
+    flow->sched = sched;
+    flow->weight = priority_weights[priority];
+
+    pthread_mutex_lock (&sched->lock);
+    sched->flows = g_list_prepend (sched->flows, flow);
+    pthread_mutex_unlock (&sched->lock);
+
+    return flow;
+}
+
+void
+bandwidth_flow_free (BandwidthFlow *flow)
+{
+    BandwidthScheduler *sched;
+
+    if (!flow)
+        return;
+
+    sched = flow->sched;
+
+    pthread_mutex_lock (&sched->lock);
+    sched->flows = g_list_remove (sched->flows, flow);
+    /* Let the other waiters re-check whether it's their turn. */
+    pthread_cond_broadcast (&sched->cond);
+    pthread_mutex_unlock (&sched->lock);
+
+    g_free (flow);
+}
+
+/* Smallest virtual time of the flows that transferred recently. */
+static gboolean
+min_active_vtime (BandwidthScheduler *sched, BandwidthFlow *self,
+                  double now, double *vtime)
+{
+    GList *ptr;
+    BandwidthFlow *flow;
+    gboolean found = FALSE;
+
+    for (ptr = sched->flows; ptr; ptr = ptr->next) {
+        flow = ptr->data;
+        if (flow == self ||
+            (flow->waiting == 0 && now - flow->last_active > IDLE_TIME))
+            continue;
+        if (!found || flow->vtime < *vtime)
+            *vtime = flow->vtime;
+        found = TRUE;
+    }
+
+    return found;
+}
+
+static gboolean
+is_next_waiter (BandwidthScheduler *sched, BandwidthFlow *self)
+{
+    GList *ptr;
+    BandwidthFlow *flow;
+
+    for (ptr = sched->flows; ptr; ptr = ptr->next) {
+        flow = ptr->data;
+        if (flow != self && flow->waiting > 0 && flow->vtime < self->vtime)
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void
+refill (BandwidthScheduler *sched, gint64 limit, int bytes, double now)
+{
+    double burst = MAX (limit * BURST_TIME, bytes);
+
+    if (now > sched->last_refill)
+        sched->tokens += limit * (now - sched->last_refill);
+    sched->last_refill = now;
+
+    if (sched->tokens > burst)
+        sched->tokens = burst;
+}
+
+static void
+wait_for (BandwidthScheduler *sched, double seconds)
+{
+    struct timespec ts;
+    double deadline;
+
+    seconds = CLAMP (seconds, 0.001, MAX_WAIT_TIME);
+    deadline = now_sec () + seconds;
+
+    ts.tv_sec = (time_t)deadline;
+    ts.tv_nsec = (long)((deadline - ts.tv_sec) * 1000000000);
+
+    pthread_cond_timedwait (&sched->cond, &sched->lock, &ts);
+}
+
+/* Called with the scheduler lock held. */
+static void
+catch_up_idle_flow (BandwidthScheduler *sched, BandwidthFlow *flow, double now)
+{
+    double vtime;
+
+    if (flow->waiting == 0 && now - flow->last_active > IDLE_TIME &&
+        min_active_vtime (sched, flow, now, &vtime) && vtime > flow->vtime)
+        flow->vtime = vtime;
+}
+
+void
+bandwidth_flow_consume (BandwidthFlow *flow, gint64 limit, int bytes)
+{
+    BandwidthScheduler *sched = flow->sched;
+    double now;
+
+    if (limit <= 0 || bytes <= 0)
+        return;
+
+    pthread_mutex_lock (&sched->lock);
+
+    now = now_sec ();
+    catch_up_idle_flow (sched, flow, now);
+
+    ++(flow->waiting);
+
+    while (1) {
+        refill (sched, limit, bytes, now);
+
+        if (is_next_waiter (sched, flow)) {
+            if (sched->tokens >= bytes)
+                break;
+            wait_for (sched, (bytes - sched->tokens) / limit);
+        } else {
+            /* Woken up when the next waiter takes its tokens. */
+            wait_for (sched, MAX_WAIT_TIME);
+        }
+
+        now = now_sec ();
+    }
+
+    sched->tokens -= bytes;
+    flow->vtime += (double)bytes / flow->weight;
+    --(flow->waiting);
+    flow->last_active = now;
+
+    pthread_cond_broadcast (&sched->cond);
+
+    pthread_mutex_unlock (&sched->lock);
+}
+
+gint64
+bandwidth_flow_charge (BandwidthFlow *flow, gint64 limit, int bytes)
+{
+    BandwidthScheduler *sched = flow->sched;
+    double now;
+    gint64 delay = 0;
+
+    if (limit <= 0 || bytes <= 0)
+        return 0;
+
+    pthread_mutex_lock (&sched->lock);
+
+    now = now_sec ();
+    catch_up_idle_flow (sched, flow, now);
+    refill (sched, limit, bytes, now);
+
+    sched->tokens -= bytes;
+    flow->vtime += (double)bytes / flow->weight;
+    flow->last_active = now;
+
+    if (sched->tokens < 0)
+        delay = (gint64)(-sched->tokens / limit * G_USEC_PER_SEC);
+
+    pthread_mutex_unlock (&sched->lock);
+
+    return delay;
+}
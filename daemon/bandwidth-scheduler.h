@@ -0,0 +1,52 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef BANDWIDTH_SCHEDULER_H
+#define BANDWIDTH_SCHEDULER_H
+
+#include <glib.h>
+
+/*
+ * Shares a rate limit between the transfer tasks of one direction.
+ *
+ * Tokens accrue continuously at the limit, with a burst of only a few
+ * milliseconds, so transfers are paced smoothly instead of sending a
+ * second's worth of data and then sleeping. When several tasks are waiting,
+ * the tokens go to the one that has used the least bandwidth relative to
+ * its weight, so each busy task gets a share proportional to its weight.
+ * Tasks that become busy after being idle don't get to use up the share
+ * they didn't use.
+ */
+
+typedef struct BandwidthScheduler BandwidthScheduler;
+typedef struct BandwidthFlow BandwidthFlow;
+
+enum {
+    TRANSFER_PRIORITY_NORMAL = 0,
+    TRANSFER_PRIORITY_LOW,
+    TRANSFER_PRIORITY_HIGH,
+};
+
+BandwidthScheduler *
+bandwidth_scheduler_new ();
+
+/* One flow per transfer task. */
+BandwidthFlow *
+bandwidth_scheduler_add_flow (BandwidthScheduler *sched, int priority);
+
+void
+bandwidth_flow_free (BandwidthFlow *flow);
+
+/* Wait until @bytes may be transferred by @flow under @limit bytes per
+ * second. Returns immediately if @limit is 0.
+ */
+void
+bandwidth_flow_consume (BandwidthFlow *flow, gint64 limit, int bytes);
+
+/* Like bandwidth_flow_consume(), but for callers that can't block: takes
+ * the tokens for @bytes, already transferred, right away. Returns how many
+ * microseconds the caller should wait before transferring again.
+ */
+gint64
+bandwidth_flow_charge (BandwidthFlow *flow, gint64 limit, int bytes);
+
+#endif
@@ -0,0 +1,480 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include "seafile-session.h"
+#include "commit-mgr.h"
+#include "branch-mgr.h"
+#include "repo-mgr.h"
+#include "fs-mgr.h"
+#include "index/index.h"
+#include "metrics.h"
+#include "timer.h"
+#include "block-gc.h"
+#include "utils.h"
+#include "log.h"
+
+/* How often to look for a repo to collect. */
+#define GC_CHECK_INTERVAL 60
+
+/* Seconds without sync tasks before the GC starts. */
+#define GC_IDLE_TIME 300
+
+/* The sweep removes blocks for one slice, then pauses for as long. */
+#define SWEEP_SLICE_USEC 100000
+
+typedef struct BlockGC {
+    char repo_id[37];
+    int version;
+
+    /* Set on the main loop to stop the GC early. */
+    gint stop;
+
+    /* Ids of all fs objects in the master head. */
+    BlockList *master_objs;
+    /* Files that are not in the master head. */
+    BlockList *files;
+    BlockList *live_blocks;
+    BlockList *garbage;
+
+    gint64 n_removed;
+    gint64 removed_bytes;
+    int result;
+} BlockGC;
+
+static BlockGC *current;
+static gint64 last_busy;
+
+static SeafMetric *blocks_removed;
+static SeafMetric *bytes_removed;
+
+static gboolean
+gc_stopped (BlockGC *gc)
+{
+    return g_atomic_int_get (&gc->stop) != 0;
+}
+
+static gboolean
+collect_master_obj (SeafFSManager *mgr,
+                    const char *repo_id,
+                    int version,
+                    const char *obj_id,
+                    int type,
+                    void *user_data,
+                    gboolean *stop)
+{
+    BlockGC *gc = user_data;
+
+    if (gc_stopped (gc))
+        return FALSE;
+
+    block_list_insert (gc->master_objs, obj_id);
+    return TRUE;
+}
+
+static gboolean
+collect_local_file (SeafFSManager *mgr,
+                    const char *repo_id,
+                    int version,
+                    const char *obj_id,
+                    int type,
+                    void *user_data,
+                    gboolean *stop)
+{
+    BlockGC *gc = user_data;
+
+    if (gc_stopped (gc))
+        return FALSE;
+
+    /* Subtrees in the master head have nothing to upload. */
+    if (block_list_contains (gc->master_objs, obj_id)) {
+        *stop = TRUE;
+        return TRUE;
+    }
+
+    if (type == SEAF_METADATA_TYPE_FILE)
+        block_list_insert (gc->files, obj_id);
+    return TRUE;
+}
+
+static void
+add_file (BlockGC *gc, const char *file_id)
+{
+    if (strcmp (file_id, EMPTY_SHA1) == 0 ||
+        block_list_contains (gc->master_objs, file_id))
+        return;
+    block_list_insert (gc->files, file_id);
+}
+
+static int
+get_head_root (BlockGC *gc, const char *branch_name, char *root_id)
+{
+    SeafBranch *branch;
+    SeafCommit *head;
+
+    branch = seaf_branch_manager_get_branch (seaf->branch_mgr,
+                                             gc->repo_id, branch_name);
+    if (!branch) {
+        seaf_warning ("Branch %s not found for repo %.8s.\n",
+                      branch_name, gc->repo_id);
+        return -1;
+    }
+
+    head = seaf_commit_manager_get_commit (seaf->commit_mgr,
+                                           gc->repo_id, gc->version,
+                                           branch->commit_id);
+    seaf_branch_unref (branch);
+    if (!head) {
+        seaf_warning ("Head commit of branch %s not found for repo %.8s.\n",
+                      branch_name, gc->repo_id);
+        return -1;
+    }
+
+    memcpy (root_id, head->root_id, 41);
+    seaf_commit_unref (head);
+    return 0;
+}
+
+static int
+add_index_files (BlockGC *gc)
+{
+    struct index_state istate;
+    char index_path[SEAF_PATH_MAX];
+    struct cache_entry *ce;
+    char file_id[41];
+    unsigned int i;
+
+    memset (&istate, 0, sizeof(istate));
+    snprintf (index_path, SEAF_PATH_MAX, "%s/%s",
+              seaf->repo_mgr->index_dir, gc->repo_id);
+    if (read_index_from (&istate, index_path, gc->version) < 0) {
+        seaf_warning ("Failed to load index for repo %.8s.\n", gc->repo_id);
+        return -1;
+    }
+
+    for (i = 0; i < istate.cache_nr; ++i) {
+        ce = istate.cache[i];
+        if (S_ISDIR(ce->ce_mode))
+            continue;
+        rawdata_to_hex (ce->sha1, file_id, 20);
+        add_file (gc, file_id);
+    }
+
+    discard_index (&istate);
+    return 0;
+}
+
+#if defined WIN32 || defined __APPLE__
+static void
+add_locked_files (BlockGC *gc)
+{
+    LockedFileSet *fset;
+    GHashTableIter iter;
+    gpointer key, value;
+    LockedFile *locked;
+
+    fset = seaf_repo_manager_get_locked_file_set (seaf->repo_mgr, gc->repo_id);
+
+    g_hash_table_iter_init (&iter, fset->locked_files);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        locked = value;
+        if (strcmp (locked->operation, LOCKED_OP_UPDATE) == 0)
+            add_file (gc, locked->file_id);
+    }
+
+    locked_file_set_free (fset);
+}
+#endif
+
+static int
+mark (BlockGC *gc)
+{
+    char master_root[41], local_root[41];
+    char file_id[41];
+    Seafile *file;
+    uint32_t i;
+    int j;
+
+    if (get_head_root (gc, "master", master_root) < 0 ||
+        get_head_root (gc, "local", local_root) < 0)
+        return -1;
+
+    if (seaf_fs_manager_traverse_tree (seaf->fs_mgr, gc->repo_id, gc->version,
+                                       master_root, collect_master_obj,
+                                       gc, FALSE) < 0)
+        return -1;
+
+    if (seaf_fs_manager_traverse_tree (seaf->fs_mgr, gc->repo_id, gc->version,
+                                       local_root, collect_local_file,
+                                       gc, FALSE) < 0)
+        return -1;
+
+    if (add_index_files (gc) < 0)
+        return -1;
+
+#if defined WIN32 || defined __APPLE__
+    add_locked_files (gc);
+#endif
+
+    for (i = 0; i < gc->files->n_blocks; ++i) {
+        if (gc_stopped (gc))
+            return -1;
+
+        block_list_get_id (gc->files, i, file_id);
+        file = seaf_fs_manager_get_seafile (seaf->fs_mgr, gc->repo_id,
+                                            gc->version, file_id);
+        if (!file) {
+            /* Without the file object its blocks can't be told apart. */
+            seaf_warning ("Failed to find file %s in repo %.8s.\n",
+                          file_id, gc->repo_id);
+            return -1;
+        }
+        for (j = 0; j < file->n_blocks; ++j)
+            block_list_insert (gc->live_blocks, file->blk_sha1s[j]);
+        seafile_unref (file);
+    }
+
+    return 0;
+}
+
+static gboolean
+collect_garbage (const char *store_id,
+                 int version,
+                 const char *block_id,
+                 void *user_data)
+{
+    BlockGC *gc = user_data;
+
+    if (gc_stopped (gc))
+        return FALSE;
+
+    if (!block_list_contains (gc->live_blocks, block_id))
+        block_list_insert (gc->garbage, block_id);
+    return TRUE;
+}
+
+static void
+sweep (BlockGC *gc)
+{
+    char block_id[41];
+    BlockMetadata *bmd;
+    gint64 slice_start;
+    uint32_t i;
+
+    slice_start = seaf_metrics_now ();
+
+    for (i = 0; i < gc->garbage->n_blocks && !gc_stopped (gc); ++i) {
+        block_list_get_id (gc->garbage, i, block_id);
+
+        bmd = seaf_block_manager_stat_block (seaf->block_mgr, gc->repo_id,
+                                             gc->version, block_id);
+        if (seaf_block_manager_remove_block (seaf->block_mgr, gc->repo_id,
+                                             gc->version, block_id) == 0) {
+            ++gc->n_removed;
+            gc->removed_bytes += bmd ? bmd->size : 0;
+        }
+        g_free (bmd);
+
+        if (seaf_metrics_now () - slice_start >= SWEEP_SLICE_USEC) {
+            g_usleep (SWEEP_SLICE_USEC);
+            slice_start = seaf_metrics_now ();
+        }
+    }
+}
+
+static void *
+block_gc_job (void *vdata)
+{
+    BlockGC *gc = vdata;
+
+    gc->result = -1;
+
+    gc->master_objs = block_list_new ();
+    gc->files = block_list_new ();
+    gc->live_blocks = block_list_new ();
+    if (mark (gc) < 0)
+        goto out;
+
+    /* Ids from master aren't needed any more. */
+    block_list_free (gc->master_objs);
+    gc->master_objs = NULL;
+    block_list_free (gc->files);
+    gc->files = NULL;
+
+    gc->garbage = block_list_new ();
+    if (seaf_block_manager_foreach_block (seaf->block_mgr,
+                                          gc->repo_id, gc->version,
+                                          collect_garbage, gc) < 0 ||
+        gc_stopped (gc))
+        goto out;
+
+    sweep (gc);
+    if (!gc_stopped (gc))
+        gc->result = 0;
+
+out:
+    if (gc->master_objs)
+        block_list_free (gc->master_objs);
+    if (gc->files)
+        block_list_free (gc->files);
+    block_list_free (gc->live_blocks);
+    if (gc->garbage)
+        block_list_free (gc->garbage);
+    return gc;
+}
+
+static void
+block_gc_done (void *vdata)
+{
+    BlockGC *gc = vdata;
+    char *now;
+
+    seaf_metric_inc (blocks_removed, gc->n_removed);
+    seaf_metric_inc (bytes_removed, gc->removed_bytes);
+
+    if (gc->result == 0) {
+        seaf_message ("Block GC of repo %.8s removed %" G_GINT64_FORMAT
+                      " blocks, %" G_GINT64_FORMAT " bytes reclaimed.\n",
+                      gc->repo_id, gc->n_removed, gc->removed_bytes);
+        now = g_strdup_printf ("%" G_GINT64_FORMAT, (gint64)time(NULL));
+        seaf_repo_manager_set_repo_property (seaf->repo_mgr, gc->repo_id,
+                                             REPO_PROP_LAST_BLOCK_GC, now);
+        g_free (now);
+    } else if (gc_stopped (gc)) {
+        seaf_message ("Block GC of repo %.8s stopped after removing %"
+                      G_GINT64_FORMAT " blocks.\n",
+                      gc->repo_id, gc->n_removed);
+    } else {
+        seaf_warning ("Block GC of repo %.8s failed.\n", gc->repo_id);
+        /* Don't retry before the next interval. */
+        now = g_strdup_printf ("%" G_GINT64_FORMAT, (gint64)time(NULL));
+        seaf_repo_manager_set_repo_property (seaf->repo_mgr, gc->repo_id,
+                                             REPO_PROP_LAST_BLOCK_GC, now);
+        g_free (now);
+    }
+
+    current = NULL;
+    last_busy = (gint64)time(NULL);
+    g_free (gc);
+}
+
+static gboolean
+block_store_exists (const char *repo_id)
+{
+    char *store_path;
+    gboolean ret;
+
+    store_path = g_build_filename (seaf->seaf_dir, "storage", "blocks",
+                                   repo_id, NULL);
+    ret = g_file_test (store_path, G_FILE_TEST_IS_DIR);
+    g_free (store_path);
+    return ret;
+}
+
+static gboolean
+need_gc (SeafRepo *repo, gint64 now)
+{
+    SyncInfo *info;
+    char *value;
+    gint64 last_gc = 0;
+    gboolean ret = FALSE;
+
+    if (repo->delete_pending || repo->version == 0)
+        return FALSE;
+
+    info = seaf_sync_manager_get_sync_info (seaf->sync_mgr, repo->id);
+    if ((info && info->in_sync) ||
+        http_tx_manager_find_task (seaf->http_tx_mgr, repo->id) != NULL)
+        return FALSE;
+
+    if (!block_store_exists (repo->id))
+        return FALSE;
+
+    /* Blocks of an interrupted download are kept for resuming it. */
+    value = seaf_repo_manager_get_repo_property (seaf->repo_mgr, repo->id,
+                                                 REPO_PROP_DOWNLOAD_HEAD);
+    if (value && strcmp (value, EMPTY_SHA1) != 0)
+        goto out;
+    g_free (value);
+
+    value = seaf_repo_manager_get_repo_property (seaf->repo_mgr, repo->id,
+                                                 REPO_PROP_LAST_BLOCK_GC);
+    if (value)
+        last_gc = g_ascii_strtoll (value, NULL, 10);
+    ret = (now - last_gc >= (gint64)seaf->block_gc_interval * 3600);
+
+out:
+    g_free (value);
+    return ret;
+}
+
+static void
+start_gc (SeafRepo *repo)
+{
+    BlockGC *gc = g_new0 (BlockGC, 1);
+
+    memcpy (gc->repo_id, repo->id, 37);
+    gc->version = repo->version;
+
+    seaf_message ("Starting block GC of repo %s(%.8s).\n", repo->name, repo->id);
+
+    current = gc;
+    if (seaf_job_manager_schedule_job (seaf->job_mgr, block_gc_job,
+                                       block_gc_done, gc) < 0) {
+        seaf_warning ("Failed to schedule block GC.\n");
+        current = NULL;
+        g_free (gc);
+    }
+}
+
+static int
+block_gc_pulse (void *vdata)
+{
+    gint64 now = (gint64)time(NULL);
+    GList *repos, *ptr;
+
+    if (current)
+        return TRUE;
+
+    if (seaf->sync_mgr->n_running_tasks > 0) {
+        last_busy = now;
+        return TRUE;
+    }
+    if (now - last_busy < GC_IDLE_TIME)
+        return TRUE;
+
+    repos = seaf_repo_manager_get_repo_list (seaf->repo_mgr, -1, -1);
+    for (ptr = repos; ptr; ptr = ptr->next) {
+        if (need_gc (ptr->data, now)) {
+            start_gc (ptr->data);
+            break;
+        }
+    }
+    g_list_free (repos);
+
+    return TRUE;
+}
+
+int
+seaf_block_gc_start ()
+{
+    blocks_removed = seaf_metric_get (SEAF_METRIC_COUNTER,
+                                      "seaf_block_gc_blocks", NULL);
+    bytes_removed = seaf_metric_get (SEAF_METRIC_COUNTER,
+                                     "seaf_block_gc_bytes", NULL);
+
+    last_busy = (gint64)time(NULL);
+    seaf_timer_new (block_gc_pulse, NULL, GC_CHECK_INTERVAL * 1000);
+
+    return 0;
+}
+
+gboolean
+seaf_block_gc_stop (const char *repo_id)
+{
+    if (!current || strcmp (current->repo_id, repo_id) != 0)
+        return FALSE;
+
+    g_atomic_int_set (&current->stop, 1);
+    return TRUE;
+}
@@ -0,0 +1,40 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef BLOCK_GC_H
+#define BLOCK_GC_H
+
+#include <glib.h>
+
+/*
+ * Garbage collection of the local block stores.
+ *
+ * A block store is removed as a whole once its repo is in sync with the
+ * server. Repos that don't get there, e.g. because uploads keep failing,
+ * accumulate the blocks of every version of the files committed meanwhile.
+ * The GC removes the blocks that no upload or commit can use any more. Only
+ * these blocks are reachable:
+ *  - blocks of files in the local head but not in the master head, which
+ *    are the pending upload;
+ *  - blocks of indexed files that are not in the master head;
+ *  - blocks of locked files with a pending update (Windows and macOS).
+ *
+ * Marking skips the subtrees shared with the master head, so only the file
+ * objects that differ from it are loaded. Ids are kept in BlockLists. The
+ * sweep removes the other blocks in time slices with pauses in between.
+ *
+ * One repo is collected at a time, after the daemon has had no sync tasks
+ * for a while, and each repo at most once per block_gc_interval hours.
+ */
+
+int
+seaf_block_gc_start ();
+
+/*
+ * Returns TRUE if the GC is working on @repo_id, and asks it to stop. The
+ * sync manager calls this before creating a sync task, and doesn't start
+ * the sync until the GC is done, since syncs write and upload blocks.
+ */
+gboolean
+seaf_block_gc_stop (const char *repo_id);
+
+#endif
@@ -15,6 +15,10 @@
 struct _ChangeSetDir {
     int version;
     char dir_id[41];
+    /* Set when the entries differ from the dir object @dir_id. Dirs that
+     * are only loaded on the way to a path keep their id when committed.
+     */
+    gboolean changed;
     /* A hash table of dirents for fast lookup and insertion. */
     GHashTable *dents;
 #if defined WIN32 || defined __APPLE__
@@ -93,33 +97,68 @@ changeset_dirent_free (ChangeSetDirent *dent)
 static void
 add_dent_to_dir (ChangeSetDir *dir, ChangeSetDirent *dent)
 {
-    g_hash_table_insert (dir->dents,
-                         g_strdup(dent->name),
-                         dent);
+    dir->changed = TRUE;
+    /* Keyed by the dent's own name. Replace rather than insert so that the
+     * key never points into a dent that gets freed.
+     */
+    g_hash_table_replace (dir->dents, dent->name, dent);
 #if defined WIN32 || defined __APPLE__
-    g_hash_table_insert (dir->dents_i,
-                         g_utf8_strdown(dent->name, -1),
-                         dent);
+    if (dir->dents_i)
+        g_hash_table_insert (dir->dents_i,
+                             index_icase_name(dent->name),
+                             dent);
 #endif
 }
 
 static void
 remove_dent_from_dir (ChangeSetDir *dir, const char *dname)
 {
-    char *key;
+    ChangeSetDirent *dent;
 
-    if (g_hash_table_lookup_extended (dir->dents, dname,
-                                      (gpointer*)&key, NULL)) {
-        g_hash_table_steal (dir->dents, dname);
-        g_free (key);
-    }
+    dent = g_hash_table_lookup (dir->dents, dname);
+    if (!dent)
+        return;
+    g_hash_table_steal (dir->dents, dname);
+    dir->changed = TRUE;
 #if defined WIN32 || defined __APPLE__
-    char *dname_i = g_utf8_strdown (dname, -1);
-    g_hash_table_remove (dir->dents_i, dname_i);
-    g_free (dname_i);
+    if (dir->dents_i) {
+        char *dname_i = index_icase_name (dname);
+        /* Another dent may have the same name in a different case. */
+        if (g_hash_table_lookup (dir->dents_i, dname_i) == dent)
+            g_hash_table_remove (dir->dents_i, dname_i);
+        g_free (dname_i);
+    }
 #endif
 }
 
+#if defined WIN32 || defined __APPLE__
+/* The case-insensitive table is only needed when a name is added, so it's
+ * not built for dirs that are just passed through.
+ */
+static GHashTable *
+get_dents_i (ChangeSetDir *dir)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    ChangeSetDirent *dent;
+
+    if (dir->dents_i)
+        return dir->dents_i;
+
+    dir->dents_i = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                          g_free, NULL);
+    g_hash_table_iter_init (&iter, dir->dents);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        dent = value;
+        g_hash_table_insert (dir->dents_i,
+                             index_icase_name(dent->name),
+                             dent);
+    }
+
+    return dir->dents_i;
+}
+#endif
+
 static ChangeSetDir *
 changeset_dir_new (int version, const char *id, GList *dirents)
 {
@@ -132,16 +171,14 @@ changeset_dir_new (int version, const char *id, GList *dirents)
     if (id)
         memcpy (dir->dir_id, id, 40);
     dir->dents = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                        g_free, (GDestroyNotify)changeset_dirent_free);
-#if defined WIN32 || defined __APPLE__
-    dir->dents_i = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                          g_free, NULL);
-#endif
+                                        NULL, (GDestroyNotify)changeset_dirent_free);
     for (ptr = dirents; ptr; ptr = ptr->next) {
         dent = ptr->data;
         changeset_dent = seaf_dirent_to_changeset_dirent(dent);
         add_dent_to_dir (dir, changeset_dent);
     }
+    /* A new dir has no object yet. */
+    dir->changed = (id == NULL || strcmp (id, EMPTY_SHA1) == 0);
 
     return dir;
 } 
@@ -153,7 +190,8 @@ changeset_dir_free (ChangeSetDir *dir)
         return;
     g_hash_table_destroy (dir->dents);
 #if defined WIN32 || defined __APPLE__
-    g_hash_table_destroy (dir->dents_i);
+    if (dir->dents_i)
+        g_hash_table_destroy (dir->dents_i);
 #endif
     g_free (dir);
 }
@@ -226,10 +264,11 @@ changeset_new (const char *repo_id)
         return NULL;
     }
 
-    seaf_dir = seaf_fs_manager_get_seafdir_sorted (seaf->fs_mgr,
-                                                   repo_id,
-                                                   repo->version,
-                                                   commit->root_id);
+    /* Entries go into a hash table, so there's no need to sort them. */
+    seaf_dir = seaf_fs_manager_get_seafdir (seaf->fs_mgr,
+                                            repo_id,
+                                            repo->version,
+                                            commit->root_id);
     if (!seaf_dir) {
         seaf_warning ("Failed to find root dir %s in repo %s\n",
                       repo->root_id, repo_id);
@@ -376,6 +415,8 @@ add_to_tree (ChangeSet *changeset,
     ChangeSetDir *dir;
     ChangeSetDirent *dent;
     ChangeSetDirent *parent_dent = NULL;
+    /* The dir that contains parent_dent. */
+    ChangeSetDir *parent_dir = NULL;
     SeafDir *seaf_dir;
     gboolean changed;
 
@@ -408,15 +449,19 @@ add_to_tree (ChangeSet *changeset,
                     dent->subdir = seaf_dir_to_changeset_dir (seaf_dir);
                     seaf_dir_free (seaf_dir);
                 }
+                parent_dir = dir;
                 dir = dent->subdir;
                 parent_dent = dent;
             } else if (S_ISREG(dent->mode)) {
                 if (i == (n-1)) {
                     /* File exists, update it. */
                     changed = update_file (dent, sha1, st, modifier);
+                    if (changed)
+                        dir->changed = TRUE;
                     // update parent dir mtime when modify files locally.
                     if (parent_dent && changed) {
                         parent_dent->mtime = st->st_mtime;
+                        parent_dir->changed = TRUE;
                     }
                     break;
                 }
@@ -425,8 +470,8 @@ add_to_tree (ChangeSet *changeset,
 #if defined WIN32 || defined __APPLE__
             /* Only effective for add operation, not applicable to rename. */
             if (!new_dent) {
-                char *search_key = g_utf8_strdown (dname, -1);
-                dent = g_hash_table_lookup (dir->dents_i, search_key);
+                char *search_key = index_icase_name (dname);
+                dent = g_hash_table_lookup (get_dents_i (dir), search_key);
                 g_free (search_key);
                 if (dent) {
                     remove_dent_from_dir (dir, dent->name);
@@ -446,9 +491,11 @@ add_to_tree (ChangeSet *changeset,
                 if (parent_dent && new_dent) {
                     // update parent dir mtime when rename files locally.
                     parent_dent->mtime = time(NULL);
+                    parent_dir->changed = TRUE;
                 } else if (parent_dent && st) {
                     // update parent dir mtime when add files locally.
                     parent_dent->mtime = st->st_mtime;
+                    parent_dir->changed = TRUE;
                 }
                 create_new_dent (dir, dname, sha1, st, modifier, new_dent);
             } else {
@@ -472,6 +519,8 @@ delete_from_tree (ChangeSet *changeset,
     ChangeSetDir *dir;
     ChangeSetDirent *dent, *ret = NULL;
     ChangeSetDirent *parent_dent = NULL;
+    /* The dir that contains parent_dent. */
+    ChangeSetDir *parent_dir = NULL;
     SeafDir *seaf_dir;
 
     *parent_empty = FALSE;
@@ -496,6 +545,7 @@ delete_from_tree (ChangeSet *changeset,
                 // update parent dir mtime when delete dirs locally.
                 if (parent_dent) {
                     parent_dent->mtime = time (NULL);
+                    parent_dir->changed = TRUE;
                 }
                 break;
             }
@@ -513,6 +563,7 @@ delete_from_tree (ChangeSet *changeset,
                 dent->subdir = seaf_dir_to_changeset_dir (seaf_dir);
                 seaf_dir_free (seaf_dir);
             }
+            parent_dir = dir;
             dir = dent->subdir;
             parent_dent = dent;
         } else if (S_ISREG(dent->mode)) {
@@ -525,6 +576,7 @@ delete_from_tree (ChangeSet *changeset,
                 // update parent dir mtime when delete files locally.
                 if (parent_dent) {
                     parent_dent->mtime = time (NULL);
+                    parent_dir->changed = TRUE;
                 }
                 break;
             }
@@ -636,11 +688,18 @@ commit_tree_recursive (const char *repo_id, ChangeSetDir *dir)
             if (!new_id)
                 return NULL;
 
-            memcpy (dent->id, new_id, 40);
+            if (memcmp (dent->id, new_id, 40) != 0) {
+                memcpy (dent->id, new_id, 40);
+                dir->changed = TRUE;
+            }
             g_free (new_id);
         }
     }
 
+    /* Nothing under this dir changed, reuse its object. */
+    if (!dir->changed)
+        return g_strdup (dir->dir_id);
+
     seaf_dir = changeset_dir_to_seaf_dir (dir);
 
     memcpy (dir->dir_id, seaf_dir->dir_id, 40);
@@ -655,6 +714,7 @@ commit_tree_recursive (const char *repo_id, ChangeSetDir *dir)
         }
     }
 
+    dir->changed = FALSE;
     ret = g_strdup(seaf_dir->dir_id);
 
 out:
@@ -671,8 +731,22 @@ out:
 char *
 commit_tree_from_changeset (ChangeSet *changeset)
 {
-    char *root_id = commit_tree_recursive (changeset->repo_id,
-                                           changeset->tree_root);
+    char *root_id;
+
+    /* The dir objects are synced together when the batch is committed. */
+    seaf_obj_store_begin_batch (seaf->fs_mgr->obj_store,
+                                changeset->repo_id,
+                                changeset->tree_root->version);
+
+    root_id = commit_tree_recursive (changeset->repo_id,
+                                     changeset->tree_root);
+
+    if (seaf_obj_store_commit_batch (seaf->fs_mgr->obj_store,
+                                     changeset->repo_id,
+                                     changeset->tree_root->version) < 0) {
+        g_free (root_id);
+        return NULL;
+    }
 
     return root_id;
 }
@@ -0,0 +1,197 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <fcntl.h>
+#include <jansson.h>
+
+#include "seafile-session.h"
+#include "chunk-policy.h"
+#include "fs-mgr.h"
+#include "utils.h"
+#include "log.h"
+
+#define DEFAULT_MIN_SIZE ((gint64)64 << 20)
+#define SAMPLE_SIZE (64 << 10)
+/* A sample that shrinks by less than this is taken as incompressible. */
+#define INCOMPRESSIBLE_RATIO 0.95
+
+struct ChunkPolicy {
+    gint ref_count;
+    gint64 min_size;
+    /* Lower case extensions, without the dot. */
+    GHashTable *extensions;
+    gboolean incompressible;
+};
+
+static const char *default_extensions[] = {
+    "mp4", "m4v", "mov", "mkv", "avi", "wmv", "webm", "mts", "m2ts", "mxf",
+    "mp3", "m4a", "aac", "flac", "ogg", "opus",
+    "jpg", "jpeg", "heic", "heif", "webp", "avif",
+    "cr2", "cr3", "nef", "arw", "dng", "raf", "orf", "rw2",
+    "zip", "7z", "rar", "gz", "xz", "bz2", "zst", "iso", "dmg",
+    NULL,
+};
+
+int
+chunk_policy_parse (const char *str, ChunkPolicy **policy)
+{
+    json_t *object, *value, *item;
+    json_error_t jerror;
+    ChunkPolicy *ret;
+    size_t i;
+    int j;
+
+    *policy = NULL;
+    if (!str || str[0] == 0)
+        return 0;
+
+    object = json_loads (str, 0, &jerror);
+    if (!object || !json_is_object (object)) {
+        seaf_warning ("Invalid chunk policy: %s.\n", str);
+        json_decref (object);
+        return -1;
+    }
+
+    ret = g_new0 (ChunkPolicy, 1);
+    ret->ref_count = 1;
+    ret->min_size = DEFAULT_MIN_SIZE;
+    ret->extensions = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                             g_free, NULL);
+
+    value = json_object_get (object, "min_size");
+    if (value) {
+        if (!json_is_integer (value) || json_integer_value (value) < 0)
+            goto error;
+        ret->min_size = json_integer_value (value);
+    }
+
+    value = json_object_get (object, "extensions");
+    if (value) {
+        if (!json_is_array (value))
+            goto error;
+        json_array_foreach (value, i, item) {
+            if (!json_is_string (item))
+                goto error;
+            g_hash_table_add (ret->extensions,
+                              g_ascii_strdown (json_string_value (item), -1));
+        }
+    } else {
+        for (j = 0; default_extensions[j]; ++j)
+            g_hash_table_add (ret->extensions, g_strdup (default_extensions[j]));
+    }
+
+    value = json_object_get (object, "incompressible");
+    if (value) {
+        if (!json_is_boolean (value))
+            goto error;
+        ret->incompressible = json_is_true (value);
+    }
+
+    json_decref (object);
+    *policy = ret;
+    return 0;
+
+error:
+    seaf_warning ("Invalid chunk policy: %s.\n", str);
+    json_decref (object);
+    chunk_policy_unref (ret);
+    return -1;
+}
+
+ChunkPolicy *
+chunk_policy_ref (ChunkPolicy *policy)
+{
+    g_atomic_int_inc (&policy->ref_count);
+    return policy;
+}
+
+void
+chunk_policy_unref (ChunkPolicy *policy)
+{
+    if (!policy || !g_atomic_int_dec_and_test (&policy->ref_count))
+        return;
+
+    g_hash_table_destroy (policy->extensions);
+    g_free (policy);
+}
+
+static gboolean
+has_listed_extension (ChunkPolicy *policy, const char *path)
+{
+    char *base, *dot, *ext;
+    gboolean ret = FALSE;
+
+    base = g_path_get_basename (path);
+    dot = strrchr (base, '.');
+    if (dot && dot != base && dot[1] != 0) {
+        ext = g_ascii_strdown (dot + 1, -1);
+        ret = g_hash_table_contains (policy->extensions, ext);
+        g_free (ext);
+    }
+    g_free (base);
+
+    return ret;
+}
+
+/* Compresses a sample from the middle of the file, past the headers. */
+static gboolean
+is_incompressible (const char *path, gint64 size)
+{
+    guint8 *buf, *compressed = NULL;
+    int fd, n, compressed_len;
+    gboolean ret = FALSE;
+
+    fd = seaf_util_open (path, O_RDONLY | O_BINARY);
+    if (fd < 0)
+        return FALSE;
+
+    buf = g_malloc (SAMPLE_SIZE);
+    if (seaf_util_lseek (fd, MAX (size / 2 - SAMPLE_SIZE / 2, 0),
+                         SEEK_SET) == (gint64)-1)
+        goto out;
+    n = readn (fd, buf, SAMPLE_SIZE);
+    if (n < SAMPLE_SIZE)
+        goto out;
+
+    if (seaf_compress (buf, n, &compressed, &compressed_len) < 0)
+        goto out;
+    ret = (compressed_len >= n * INCOMPRESSIBLE_RATIO);
+
+out:
+    g_free (compressed);
+    g_free (buf);
+    close (fd);
+    return ret;
+}
+
+guint32
+chunk_policy_get_block_size (const char *repo_id, const char *path,
+                             gint64 size)
+{
+    SeafRepo *repo;
+    ChunkPolicy *policy = NULL;
+    guint32 ret = 0;
+
+    if (!repo_id)
+        return 0;
+    repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
+    if (!repo)
+        return 0;
+
+    pthread_mutex_lock (&repo->lock);
+    if (repo->chunk_policy)
+        policy = chunk_policy_ref (repo->chunk_policy);
+    pthread_mutex_unlock (&repo->lock);
+
+    if (!policy)
+        return 0;
+
+    if (size >= policy->min_size && size > 0 &&
+        (has_listed_extension (policy, path) ||
+         (policy->incompressible && is_incompressible (path, size))))
+        ret = calculate_chunk_size ((uint64_t)size);
+
+    chunk_policy_unref (policy);
+    return ret;
+}
@@ -0,0 +1,49 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef CHUNK_POLICY_H
+#define CHUNK_POLICY_H
+
+#include <glib.h>
+
+/*
+ * Chunking policy of a library: which files are split into fixed-size
+ * blocks instead of being chunked with CDC. It's kept in the
+ * "chunk-policy" repo property as JSON:
+ *
+ *     {"min_size": 67108864, "extensions": ["mp4", "mov"], "incompressible": true}
+ *
+ * Files of at least min_size bytes (64MB by default) are split into blocks
+ * of calculate_chunk_size() bytes if their extension is listed, or if
+ * "incompressible" is true and a sample of their content doesn't compress.
+ * Without "extensions", a built-in list of video, audio, image and archive
+ * types is used. Such files are rarely edited in place, so CDC finds
+ * little to share between their versions but has to scan every byte.
+ *
+ * The block size only depends on the file, so clients with the same policy
+ * produce the same blocks and file ids for the same content.
+ */
+
+typedef struct ChunkPolicy ChunkPolicy;
+
+/*
+ * Parses @str into *@policy. *@policy is set to NULL if @str is NULL or
+ * empty. Returns -1 if @str is invalid.
+ */
+int
+chunk_policy_parse (const char *str, ChunkPolicy **policy);
+
+ChunkPolicy *
+chunk_policy_ref (ChunkPolicy *policy);
+
+void
+chunk_policy_unref (ChunkPolicy *policy);
+
+/*
+ * Returns the block size @path of @size bytes in @repo_id is split into, or
+ * 0 if it's chunked as usual. May read a sample of the file.
+ */
+guint32
+chunk_policy_get_block_size (const char *repo_id, const char *path,
+                             gint64 size);
+
+#endif
@@ -10,6 +10,7 @@
 #include "vc-utils.h"
 #include "utils.h"
 #include "seafile-config.h"
+#include "server-caps.h"
 
 #include "timer.h"
 
@@ -184,35 +185,18 @@ http_check_head_commit (CloneTask *task)
         transition_to_error (task, SYNC_ERROR_ID_NOT_ENOUGH_MEMORY);
 }
 
-static char *
-http_fileserver_url (const char *url)
+static void
+set_server_caps (CloneTask *task, const ServerCaps *caps)
 {
-    const char *host;
-    char *colon;
-    char *url_no_port;
-    char *ret = NULL;
-
-    /* Just return the url itself if it's invalid. */
-    if (strlen(url) <= strlen("http://"))
-        return g_strdup(url);
-
-    /* Skip protocol schem. */
-    host = url + strlen("http://");
-
-    colon = strrchr (host, ':');
-    if (colon) {
-        url_no_port = g_strndup(url, colon - url);
-        ret = g_strconcat(url_no_port, ":8082", NULL);
-        g_free (url_no_port);
-    } else {
-        ret = g_strconcat(url, ":8082", NULL);
-    }
-
-    return ret;
+    task->http_protocol_version = caps->protocol_version;
+    g_free (task->effective_url);
+    task->effective_url = g_strdup (caps->effective_url);
+    task->use_fileserver_port = caps->use_fileserver_port;
 }
 
 static void
-check_http_fileserver_protocol_done (HttpProtocolVersion *result, void *user_data)
+check_http_protocol_done (const ServerCaps *caps, int error_code,
+                          void *user_data)
 {
     CloneTask *task = user_data;
 
@@ -221,54 +205,31 @@ check_http_fileserver_protocol_done (HttpProtocolVersion *result, void *user_dat
         return;
     }
 
-    if (result->check_success && !result->not_supported) {
-        task->http_protocol_version = result->version;
-        task->effective_url = http_fileserver_url (task->server_url);
-        task->use_fileserver_port = TRUE;
+    if (caps) {
+        set_server_caps (task, caps);
         http_check_head_commit (task);
     } else {
         /* Wait for periodic retry. */
-        transition_to_error (task, result->error_code);
+        transition_to_error (task, error_code);
     }
 }
 
 static void
-check_http_protocol_done (HttpProtocolVersion *result, void *user_data)
+check_http_protocol (CloneTask *task)
 {
-    CloneTask *task = user_data;
+    ServerCaps caps;
 
-    if (task->state == CLONE_STATE_CANCEL_PENDING) {
-        transition_state (task, CLONE_STATE_CANCELED);
-        return;
-    }
-
-    if (result->check_success && !result->not_supported) {
-        task->http_protocol_version = result->version;
-        task->effective_url = g_strdup(task->server_url);
+    /* Other clones from the same server don't have to probe it again. */
+    if (seaf_server_caps_get (task->server_url, &caps)) {
+        transition_state (task, CLONE_STATE_CHECK_SERVER);
+        set_server_caps (task, &caps);
+        g_free (caps.effective_url);
         http_check_head_commit (task);
-    } else if (strncmp(task->server_url, "https", 5) != 0) {
-        char *host_fileserver = http_fileserver_url(task->server_url);
-        if (http_tx_manager_check_protocol_version (seaf->http_tx_mgr,
-                                                    host_fileserver,
-                                                    TRUE,
-                                                    check_http_fileserver_protocol_done,
-                                                    task) < 0)
-            transition_to_error (task, SYNC_ERROR_ID_NOT_ENOUGH_MEMORY);
-        g_free (host_fileserver);
-    } else {
-        /* Wait for periodic retry. */
-        transition_to_error (task, result->error_code);
+        return;
     }
-}
 
-static void
-check_http_protocol (CloneTask *task)
-{
-    if (http_tx_manager_check_protocol_version (seaf->http_tx_mgr,
-                                                task->server_url,
-                                                FALSE,
-                                                check_http_protocol_done,
-                                                task) < 0) {
+    if (seaf_server_caps_probe (task->server_url,
+                                check_http_protocol_done, task) < 0) {
         transition_to_error (task, SYNC_ERROR_ID_NOT_ENOUGH_MEMORY);
         return;
     }
@@ -317,6 +278,68 @@ clone_task_free (CloneTask *task)
     g_free (task);
 }
 
+typedef struct PrederiveData {
+    int enc_version;
+    char *passwd;
+    char *random_key;
+    char *repo_salt;
+} PrederiveData;
+
+static void *
+prederive_enc_key_job (void *vdata)
+{
+    PrederiveData *data = vdata;
+    unsigned char key[32], iv[16];
+
+    seafile_decrypt_repo_enc_key (data->enc_version, data->passwd,
+                                  data->random_key, data->repo_salt,
+                                  key, iv);
+    seafile_wipe (key, sizeof(key));
+    seafile_wipe (iv, sizeof(iv));
+
+    return data;
+}
+
+static void
+prederive_enc_key_done (void *vdata)
+{
+    PrederiveData *data = vdata;
+
+    seafile_wipe (data->passwd, strlen(data->passwd));
+    g_free (data->passwd);
+    g_free (data->random_key);
+    g_free (data->repo_salt);
+    g_free (data);
+}
+
+/* Derive the key of an encrypted library on the job threads, so that the
+ * checkout and seaf_repo_manager_set_repo_passwd() find it in the derived
+ * key cache. The pending tasks restarted at startup are derived in
+ * parallel this way.
+ */
+static void
+prederive_enc_key (CloneTask *task)
+{
+    PrederiveData *data;
+
+    if (!task->passwd)
+        return;
+    if (task->enc_version >= 2 && !task->random_key)
+        return;
+
+    data = g_new0 (PrederiveData, 1);
+    data->enc_version = task->enc_version;
+    data->passwd = g_strdup (task->passwd);
+    data->random_key = g_strdup (task->random_key);
+    data->repo_salt = g_strdup (task->repo_salt);
+
+    if (seaf_job_manager_schedule_job (seaf->job_mgr,
+                                       prederive_enc_key_job,
+                                       prederive_enc_key_done,
+                                       data) < 0)
+        prederive_enc_key_done (data);
+}
+
 const char *
 clone_task_state_to_str (int state)
 {
@@ -493,6 +516,8 @@ restart_task (sqlite3_stmt *stmt, void *data)
 
     g_hash_table_insert (mgr->tasks, g_strdup(task->repo_id), task);
 
+    prederive_enc_key (task);
+
     return TRUE;
 }
 
@@ -992,6 +1017,7 @@ add_task_common (SeafCloneManager *mgr,
                  GError **error)
 {
     CloneTask *task;
+    char *sparse_rules = NULL;
 
     task = clone_task_new (repo_id, repo_name,
                            token, worktree,
@@ -1020,9 +1046,34 @@ add_task_common (SeafCloneManager *mgr,
         json_t *repo_salt = json_object_get (object, "repo_salt");
         if (repo_salt)
             task->repo_salt = g_strdup (json_string_value (repo_salt));
+        /* Either the JSON text or the rules object, see sparse-rules.h. */
+        json_t *rules = json_object_get (object, "sparse_rules");
+        if (json_is_string (rules)) {
+            sparse_rules = g_strdup (json_string_value (rules));
+        } else if (json_is_object (rules)) {
+            char *str = json_dumps (rules, JSON_COMPACT);
+            sparse_rules = g_strdup (str);
+            free (str);
+        }
         json_decref (object);
     }
 
+    /* Rules are saved as a repo property before the first checkout. Rules
+     * left by an earlier failed clone are cleared.
+     */
+    if (sparse_rules ||
+        !seaf_repo_manager_repo_exists (seaf->repo_mgr, repo_id)) {
+        if (seaf_repo_manager_set_sparse_rules (seaf->repo_mgr, repo_id,
+                                                sparse_rules) < 0) {
+            g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                         "Invalid sparse rules");
+            g_free (sparse_rules);
+            clone_task_free (task);
+            return NULL;
+        }
+    }
+    g_free (sparse_rules);
+
     if (save_task_to_db (mgr, task) < 0) {
         seaf_warning ("[Clone mgr] failed to save task.\n");
         clone_task_free (task);
@@ -1041,6 +1092,8 @@ add_task_common (SeafCloneManager *mgr,
     /* The old task for this repo will be freed. */
     g_hash_table_insert (mgr->tasks, g_strdup(task->repo_id), task);
 
+    prederive_enc_key (task);
+
     return g_strdup(repo_id);
 }
 
@@ -0,0 +1,431 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+#include <fcntl.h>
+
+#include "seafile-session.h"
+#include "content-index.h"
+#include "metrics.h"
+#include "db.h"
+#include "utils.h"
+#include "log.h"
+
+/* Worktree files tried per missing block. */
+#define MAX_LOCATIONS_PER_BLOCK 4
+
+/* Larger lengths are from a corrupted record. */
+#define MAX_BLOCK_LEN (1 << 26)
+
+static sqlite3 *index_db;
+static SqliteStmtCache *stmts;
+static pthread_mutex_t db_lock;
+
+static SeafMetric *blocks_reused;
+static SeafMetric *bytes_reused;
+
+typedef struct BlockLocation {
+    char *path;
+    gint64 offset;
+    guint32 len;
+    gint64 mtime;
+    gint64 size;
+} BlockLocation;
+
+static void
+block_location_free (BlockLocation *loc)
+{
+    g_free (loc->path);
+    g_free (loc);
+}
+
+int
+seaf_content_index_add_file (const char *repo_id, const char *path,
+                             FileBlockMap *block_map)
+{
+    sqlite3_stmt *stmt;
+    SeafStat st;
+    char block_id[41];
+    gint64 offset = 0;
+    int i;
+
+    if (!index_db)
+        return -1;
+    if (!block_map || block_map->n_blocks == 0)
+        return 0;
+
+    /* Chunked content is checked against the block ids before use, so a
+     * change after chunking only costs a failed lookup later.
+     */
+    if (seaf_stat (path, &st) < 0 || !S_ISREG(st.st_mode))
+        return -1;
+
+    pthread_mutex_lock (&db_lock);
+
+    sqlite_batch_begin (index_db);
+
+    stmt = sqlite_stmt_cache_get (stmts,
+                                  "DELETE FROM BlockLocations "
+                                  "WHERE repo_id = ? AND path = ?");
+    if (!stmt)
+        goto error;
+    sqlite3_bind_text (stmt, 1, repo_id, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text (stmt, 2, path, -1, SQLITE_TRANSIENT);
+    if (sqlite3_step (stmt) != SQLITE_DONE) {
+        sqlite3_reset (stmt);
+        goto error;
+    }
+    sqlite3_reset (stmt);
+    sqlite3_clear_bindings (stmt);
+
+    stmt = sqlite_stmt_cache_get (stmts,
+                                  "REPLACE INTO BlockLocations "
+                                  "(repo_id, block_id, path, offset, len, mtime, size) "
+                                  "VALUES (?, ?, ?, ?, ?, ?, ?)");
+    if (!stmt)
+        goto error;
+
+    for (i = 0; i < block_map->n_blocks; ++i) {
+        rawdata_to_hex (block_map->blk_sha1s + i * 20, block_id, 20);
+
+        sqlite3_bind_text (stmt, 1, repo_id, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text (stmt, 2, block_id, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text (stmt, 3, path, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64 (stmt, 4, offset);
+        sqlite3_bind_int64 (stmt, 5, block_map->blk_lens[i]);
+        sqlite3_bind_int64 (stmt, 6, (gint64)st.st_mtime);
+        sqlite3_bind_int64 (stmt, 7, (gint64)st.st_size);
+
+        if (sqlite3_step (stmt) != SQLITE_DONE) {
+            sqlite3_reset (stmt);
+            goto error;
+        }
+        sqlite3_reset (stmt);
+        sqlite3_clear_bindings (stmt);
+
+        offset += block_map->blk_lens[i];
+    }
+
+    sqlite_batch_end (index_db, TRUE);
+    pthread_mutex_unlock (&db_lock);
+    return 0;
+
+error:
+    seaf_warning ("Failed to record blocks of %s: %s.\n",
+                  path, sqlite3_errmsg (index_db));
+    sqlite_batch_end (index_db, FALSE);
+    pthread_mutex_unlock (&db_lock);
+    return -1;
+}
+
+static GList *
+get_locations (const char *repo_id, const char *block_id)
+{
+    sqlite3_stmt *stmt;
+    BlockLocation *loc;
+    GList *locs = NULL;
+
+    pthread_mutex_lock (&db_lock);
+
+    stmt = sqlite_stmt_cache_get (stmts,
+                                  "SELECT path, offset, len, mtime, size "
+                                  "FROM BlockLocations "
+                                  "WHERE repo_id = ? AND block_id = ? LIMIT ?");
+    if (!stmt) {
+        pthread_mutex_unlock (&db_lock);
+        return NULL;
+    }
+
+    sqlite3_bind_text (stmt, 1, repo_id, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text (stmt, 2, block_id, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int (stmt, 3, MAX_LOCATIONS_PER_BLOCK);
+
+    while (sqlite3_step (stmt) == SQLITE_ROW) {
+        loc = g_new0 (BlockLocation, 1);
+        loc->path = g_strdup ((const char *)sqlite3_column_text (stmt, 0));
+        loc->offset = sqlite3_column_int64 (stmt, 1);
+        loc->len = (guint32)sqlite3_column_int64 (stmt, 2);
+        loc->mtime = sqlite3_column_int64 (stmt, 3);
+        loc->size = sqlite3_column_int64 (stmt, 4);
+        locs = g_list_prepend (locs, loc);
+    }
+
+    sqlite3_reset (stmt);
+    sqlite3_clear_bindings (stmt);
+
+    pthread_mutex_unlock (&db_lock);
+
+    return g_list_reverse (locs);
+}
+
+/* Drops the locations of @block_id in @path, or all locations in @path if
+ * @block_id is NULL.
+ */
+static void
+forget_locations (const char *repo_id, const char *path, const char *block_id)
+{
+    char *sql;
+
+    if (block_id)
+        sql = sqlite3_mprintf ("DELETE FROM BlockLocations WHERE repo_id = %Q "
+                               "AND path = %Q AND block_id = %Q",
+                               repo_id, path, block_id);
+    else
+        sql = sqlite3_mprintf ("DELETE FROM BlockLocations WHERE repo_id = %Q "
+                               "AND path = %Q",
+                               repo_id, path);
+
+    pthread_mutex_lock (&db_lock);
+    sqlite_query_exec (index_db, sql);
+    pthread_mutex_unlock (&db_lock);
+    sqlite3_free (sql);
+}
+
+/* Reads the block at @loc into @chunk if it still hashes to @block_id. */
+static gboolean
+read_block_at (const char *repo_id, int version, SeafileCrypt *crypt,
+               const char *block_id, BlockLocation *loc, CDCDescriptor *chunk)
+{
+    SeafStat st;
+    uint8_t checksum[20];
+    char check_id[41];
+    int fd;
+    gboolean ret = FALSE;
+
+    if (seaf_stat (loc->path, &st) < 0 || !S_ISREG(st.st_mode) ||
+        (gint64)st.st_mtime != loc->mtime || (gint64)st.st_size != loc->size) {
+        forget_locations (repo_id, loc->path, NULL);
+        return FALSE;
+    }
+
+    if (loc->len == 0 || loc->len > MAX_BLOCK_LEN ||
+        loc->offset + loc->len > loc->size) {
+        forget_locations (repo_id, loc->path, block_id);
+        return FALSE;
+    }
+
+    fd = seaf_util_open (loc->path, O_RDONLY | O_BINARY);
+    if (fd < 0)
+        return FALSE;
+
+    chunk->block_buf = g_malloc (loc->len);
+    chunk->offset = loc->offset;
+    chunk->len = loc->len;
+
+    if (seaf_util_lseek (fd, loc->offset, SEEK_SET) == (gint64)-1 ||
+        readn (fd, chunk->block_buf, loc->len) != (ssize_t)loc->len)
+        goto out;
+
+    if (seafile_write_chunk (repo_id, version, chunk, crypt,
+                             checksum, FALSE) < 0)
+        goto out;
+
+    rawdata_to_hex (checksum, check_id, 20);
+    if (strcmp (check_id, block_id) != 0) {
+        forget_locations (repo_id, loc->path, block_id);
+        goto out;
+    }
+
+    ret = TRUE;
+
+out:
+    close (fd);
+    if (!ret) {
+        g_free (chunk->block_buf);
+        chunk->block_buf = NULL;
+    }
+    return ret;
+}
+
+/* Returns the length of the block, or 0 if it's not found. */
+static guint32
+fill_block (const char *repo_id, int version, SeafileCrypt *crypt,
+            const char *block_id)
+{
+    GList *locs, *ptr;
+    CDCDescriptor chunk;
+    uint8_t checksum[20];
+    guint32 ret = 0;
+
+    locs = get_locations (repo_id, block_id);
+
+    for (ptr = locs; ptr; ptr = ptr->next) {
+        memset (&chunk, 0, sizeof(chunk));
+        if (!read_block_at (repo_id, version, crypt, block_id,
+                            ptr->data, &chunk))
+            continue;
+
+        if (seafile_write_chunk (repo_id, version, &chunk, crypt,
+                                 checksum, TRUE) == 0)
+            ret = chunk.len;
+        g_free (chunk.block_buf);
+        break;
+    }
+
+    g_list_free_full (locs, (GDestroyNotify)block_location_free);
+    return ret;
+}
+
+/* Content read without a key only hashes to the block id if the repo is
+ * not encrypted. Locations of encrypted repos would be dropped.
+ */
+static gboolean
+is_plain_repo (const char *repo_id)
+{
+    SeafRepo *repo;
+
+    repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
+    return (repo && !repo->encrypted);
+}
+
+char *
+seaf_content_index_read_block (const char *repo_id, int version,
+                               const char *block_id, guint32 *len)
+{
+    GList *locs, *ptr;
+    CDCDescriptor chunk;
+    char *buf = NULL;
+
+    if (!index_db || !is_plain_repo (repo_id))
+        return NULL;
+
+    locs = get_locations (repo_id, block_id);
+
+    for (ptr = locs; ptr; ptr = ptr->next) {
+        memset (&chunk, 0, sizeof(chunk));
+        if (read_block_at (repo_id, version, NULL, block_id, ptr->data, &chunk)) {
+            buf = chunk.block_buf;
+            *len = chunk.len;
+            break;
+        }
+    }
+
+    g_list_free_full (locs, (GDestroyNotify)block_location_free);
+    return buf;
+}
+
+guint32
+seaf_content_index_get_block_len (const char *repo_id, const char *block_id)
+{
+    GList *locs;
+    guint32 len = 0;
+
+    if (!index_db)
+        return 0;
+
+    locs = get_locations (repo_id, block_id);
+    if (locs)
+        len = ((BlockLocation *)locs->data)->len;
+    g_list_free_full (locs, (GDestroyNotify)block_location_free);
+
+    return len;
+}
+
+int
+seaf_content_index_stage_block (const char *repo_id, int version,
+                                const char *block_id)
+{
+    if (!index_db || !is_plain_repo (repo_id))
+        return -1;
+
+    if (seaf_block_manager_block_exists (seaf->block_mgr, repo_id, version,
+                                         block_id))
+        return 0;
+
+    return (fill_block (repo_id, version, NULL, block_id) > 0) ? 0 : -1;
+}
+
+int
+seaf_content_index_fill_blocks (const char *repo_id, int version,
+                                const char *file_id, SeafileCrypt *crypt)
+{
+    Seafile *file;
+    guint32 len;
+    gint64 bytes = 0;
+    int i, n = 0;
+
+    /* Block ids are not content hashes then. */
+    if (!index_db || seaf->disable_block_hash)
+        return 0;
+
+    file = seaf_fs_manager_get_seafile (seaf->fs_mgr, repo_id, version, file_id);
+    if (!file)
+        return 0;
+
+    for (i = 0; i < file->n_blocks; ++i) {
+        if (seaf_block_manager_block_exists (seaf->block_mgr,
+                                             repo_id, version,
+                                             file->blk_sha1s[i]))
+            continue;
+        len = fill_block (repo_id, version, crypt, file->blk_sha1s[i]);
+        if (len > 0) {
+            ++n;
+            bytes += len;
+        }
+    }
+
+    seafile_unref (file);
+
+    if (n > 0) {
+        seaf_debug ("Reused %d local blocks for file %s in repo %.8s.\n",
+                    n, file_id, repo_id);
+        seaf_metric_inc (blocks_reused, n);
+        seaf_metric_inc (bytes_reused, bytes);
+    }
+
+    return n;
+}
+
+void
+seaf_content_index_remove_repo (const char *repo_id)
+{
+    char *sql;
+
+    if (!index_db)
+        return;
+
+    sql = sqlite3_mprintf ("DELETE FROM BlockLocations WHERE repo_id = %Q",
+                           repo_id);
+    pthread_mutex_lock (&db_lock);
+    sqlite_query_exec (index_db, sql);
+    pthread_mutex_unlock (&db_lock);
+    sqlite3_free (sql);
+}
+
+int
+seaf_content_index_start ()
+{
+    char *db_path;
+    sqlite3 *db;
+    const char *sql;
+
+    pthread_mutex_init (&db_lock, NULL);
+
+    blocks_reused = seaf_metric_get (SEAF_METRIC_COUNTER,
+                                     "seaf_local_blocks_reused", NULL);
+    bytes_reused = seaf_metric_get (SEAF_METRIC_COUNTER,
+                                    "seaf_local_bytes_reused", NULL);
+
+    db_path = g_build_filename (seaf->seaf_dir, "content-index.db", NULL);
+    if (sqlite_open_db (db_path, &db) < 0) {
+        g_free (db_path);
+        return -1;
+    }
+    g_free (db_path);
+
+    sql = "CREATE TABLE IF NOT EXISTS BlockLocations ("
+        "repo_id TEXT, block_id TEXT, path TEXT, offset INTEGER, "
+        "len INTEGER, mtime INTEGER, size INTEGER, "
+        "PRIMARY KEY (repo_id, block_id, path));";
+    sqlite_query_exec (db, sql);
+
+    sql = "CREATE INDEX IF NOT EXISTS block_locations_path_idx "
+        "ON BlockLocations (repo_id, path);";
+    sqlite_query_exec (db, sql);
+
+    stmts = sqlite_stmt_cache_new (db);
+    index_db = db;
+
+    return 0;
+}
@@ -0,0 +1,68 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef CONTENT_INDEX_H
+#define CONTENT_INDEX_H
+
+#include <glib.h>
+
+#include "fs-mgr.h"
+
+/*
+ * Local content index.
+ *
+ * Maps block ids to the worktree files that have the block content, with
+ * the offset and length of the block and the mtime and size of the file
+ * when it was chunked. Files are added when they're chunked for a commit
+ * or to compare them with a downloaded version.
+ *
+ * Before the blocks of a file are downloaded, the ones found in the index
+ * are read from the worktree into the block store, so copies, older
+ * versions and files moved on the server don't have to be downloaded
+ * again. A location is only used if the file still has the recorded mtime
+ * and size, and the content read from it still hashes to the block id.
+ * Locations that fail the check are dropped.
+ *
+ * Block ids depend on the encryption key, so locations are kept per repo.
+ */
+
+int
+seaf_content_index_start ();
+
+/* Records the blocks in @block_map for the worktree file @path. */
+int
+seaf_content_index_add_file (const char *repo_id, const char *path,
+                             FileBlockMap *block_map);
+
+/*
+ * Copies the blocks of @file_id that are missing from the block store but
+ * found in the worktree into the block store. Returns the number of
+ * blocks copied.
+ */
+int
+seaf_content_index_fill_blocks (const char *repo_id, int version,
+                                const char *file_id, SeafileCrypt *crypt);
+
+/*
+ * Blocks of unencrypted repos indexed for direct upload are only in the
+ * worktree. Returns the content of @block_id, read from a file that still
+ * matches the index, or NULL.
+ */
+char *
+seaf_content_index_read_block (const char *repo_id, int version,
+                               const char *block_id, guint32 *len);
+
+/* Returns the recorded length of @block_id, without checking the file. */
+guint32
+seaf_content_index_get_block_len (const char *repo_id, const char *block_id);
+
+/* Copies @block_id of an unencrypted repo from the worktree into the
+ * block store, unless it's there already.
+ */
+int
+seaf_content_index_stage_block (const char *repo_id, int version,
+                                const char *block_id);
+
+void
+seaf_content_index_remove_repo (const char *repo_id);
+
+#endif
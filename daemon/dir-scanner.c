@@ -0,0 +1,348 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#if defined __linux__ && !defined _GNU_SOURCE
+/* For statx(). */
+#define _GNU_SOURCE
+#endif
+
+#include "common.h"
+
+#include <pthread.h>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#endif
+
+#include "dir-scanner.h"
+#include "log.h"
+
+/* Stop prefetching when this many listed entries are not picked up yet. */
+#define MAX_BUFFERED_ENTRIES 100000
+
+enum {
+    SCAN_PENDING = 0,
+    SCAN_RUNNING,
+    SCAN_DONE,
+    SCAN_TAKEN,                 /* listed by the caller, drop in the worker */
+};
+
+typedef struct ScanTask {
+    char *full_path;
+    guint64 seq;
+    int state;
+    ScanDir *result;
+} ScanTask;
+
+struct DirScanner {
+    GThreadPool *pool;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    GHashTable *tasks;          /* full path -> ScanTask */
+    guint64 next_seq;
+    int n_buffered;
+};
+
+#ifdef __linux__
+
+/* What ie_match_stat() and fill_stat_cache_info() look at, and the block
+ * count that seaf_hydration_is_placeholder() looks at.
+ */
+#define SCAN_STATX_MASK (STATX_TYPE | STATX_MODE | STATX_UID | STATX_GID | \
+                         STATX_MTIME | STATX_CTIME | STATX_INO | STATX_SIZE | \
+                         STATX_BLOCKS)
+
+/* Like stat(), but @name is looked up in the open dir @dir_fd. */
+static int
+stat_at (int dir_fd, const char *name, SeafStat *st)
+{
+#ifdef HAVE_STATX
+    struct statx stx;
+
+    if (statx (dir_fd, name, AT_STATX_SYNC_AS_STAT, SCAN_STATX_MASK, &stx) < 0)
+        return -1;
+
+    /* A missing block count would make every file look like a placeholder. */
+    if (!(stx.stx_mask & STATX_BLOCKS))
+        return fstatat (dir_fd, name, st, 0);
+
+    memset (st, 0, sizeof(*st));
+    st->st_mode = stx.stx_mode;
+    st->st_uid = stx.stx_uid;
+    st->st_gid = stx.stx_gid;
+    st->st_ino = stx.stx_ino;
+    st->st_size = stx.stx_size;
+    st->st_blocks = stx.stx_blocks;
+    st->st_dev = makedev (stx.stx_dev_major, stx.stx_dev_minor);
+    st->st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+    st->st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+    st->st_ctim.tv_sec = stx.stx_ctime.tv_sec;
+    st->st_ctim.tv_nsec = stx.stx_ctime.tv_nsec;
+    return 0;
+#else
+    return fstatat (dir_fd, name, st, 0);
+#endif
+}
+
+static ScanDir *
+list_dir (const char *full_path)
+{
+    ScanDir *dir = g_new0 (ScanDir, 1);
+    GArray *entries;
+    DIR *dp;
+    struct dirent *dent;
+    ScanEntry entry;
+    int fd;
+
+    fd = open (full_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        dir->error = errno ? errno : EIO;
+        return dir;
+    }
+    dp = fdopendir (fd);
+    if (!dp) {
+        dir->error = errno ? errno : EIO;
+        close (fd);
+        return dir;
+    }
+
+    entries = g_array_new (FALSE, FALSE, sizeof(ScanEntry));
+    while ((dent = readdir (dp)) != NULL) {
+        if (strcmp (dent->d_name, ".") == 0 || strcmp (dent->d_name, "..") == 0)
+            continue;
+
+        memset (&entry, 0, sizeof(entry));
+        entry.name = g_strdup (dent->d_name);
+        /* Dirs are only looked at by their content. Symlinks and
+         * DT_UNKNOWN are stat'ed to find out what they are.
+         */
+        if (dent->d_type == DT_DIR) {
+            entry.st.st_mode = S_IFDIR;
+            entry.type_only = TRUE;
+        } else if (stat_at (fd, dent->d_name, &entry.st) < 0) {
+            entry.stat_errno = errno ? errno : EIO;
+        }
+        g_array_append_val (entries, entry);
+    }
+    /* Also closes fd. */
+    closedir (dp);
+
+    dir->n_entries = entries->len;
+    dir->entries = (ScanEntry *)g_array_free (entries, FALSE);
+    return dir;
+}
+
+#else
+
+static ScanDir *
+list_dir (const char *full_path)
+{
+    ScanDir *dir = g_new0 (ScanDir, 1);
+    GArray *entries;
+    GDir *gdir;
+    const char *dname;
+    ScanEntry entry;
+    char *full_subpath;
+
+    gdir = g_dir_open (full_path, 0, NULL);
+    if (!gdir) {
+        dir->error = errno ? errno : EIO;
+        return dir;
+    }
+
+    entries = g_array_new (FALSE, FALSE, sizeof(ScanEntry));
+    while ((dname = g_dir_read_name (gdir)) != NULL) {
+        memset (&entry, 0, sizeof(entry));
+        entry.name = g_strdup (dname);
+        full_subpath = g_build_filename (full_path, dname, NULL);
+        if (seaf_stat (full_subpath, &entry.st) < 0)
+            entry.stat_errno = errno ? errno : EIO;
+        g_free (full_subpath);
+        g_array_append_val (entries, entry);
+    }
+    g_dir_close (gdir);
+
+    dir->n_entries = entries->len;
+    dir->entries = (ScanEntry *)g_array_free (entries, FALSE);
+    return dir;
+}
+
+#endif
+
+void
+scan_dir_free (ScanDir *dir)
+{
+    int i;
+
+    if (!dir)
+        return;
+
+    for (i = 0; i < dir->n_entries; i++)
+        g_free (dir->entries[i].name);
+    g_free (dir->entries);
+    g_free (dir);
+}
+
+static void
+scan_task_free (ScanTask *task)
+{
+    scan_dir_free (task->result);
+    g_free (task->full_path);
+    g_free (task);
+}
+
+static void
+scan_worker (gpointer data, gpointer user_data)
+{
+    ScanTask *task = data;
+    DirScanner *scanner = user_data;
+    ScanDir *result;
+
+    pthread_mutex_lock (&scanner->lock);
+    if (task->state == SCAN_TAKEN) {
+        pthread_mutex_unlock (&scanner->lock);
+        scan_task_free (task);
+        return;
+    }
+    task->state = SCAN_RUNNING;
+    pthread_mutex_unlock (&scanner->lock);
+
+    result = list_dir (task->full_path);
+
+    pthread_mutex_lock (&scanner->lock);
+    task->result = result;
+    task->state = SCAN_DONE;
+    scanner->n_buffered += result->n_entries;
+    pthread_cond_broadcast (&scanner->cond);
+    pthread_mutex_unlock (&scanner->lock);
+}
+
+/* Latest requests first. */
+static gint
+compare_task_seq (gconstpointer a, gconstpointer b, gpointer user_data)
+{
+    const ScanTask *ta = a, *tb = b;
+
+    if (ta->seq == tb->seq)
+        return 0;
+    return (ta->seq > tb->seq) ? -1 : 1;
+}
+
+DirScanner *
+dir_scanner_new (int n_threads)
+{
+    DirScanner *scanner = g_new0 (DirScanner, 1);
+    GError *error = NULL;
+
+    scanner->pool = g_thread_pool_new (scan_worker, scanner,
+                                       n_threads, FALSE, &error);
+    if (!scanner->pool) {
+        seaf_warning ("Failed to create dir scanner thread pool: %s.\n",
+                      error->message);
+        g_clear_error (&error);
+        g_free (scanner);
+        return NULL;
+    }
+    g_thread_pool_set_sort_function (scanner->pool, compare_task_seq, NULL);
+
+    pthread_mutex_init (&scanner->lock, NULL);
+    pthread_cond_init (&scanner->cond, NULL);
+    scanner->tasks = g_hash_table_new (g_str_hash, g_str_equal);
+
+    return scanner;
+}
+
+void
+dir_scanner_free (DirScanner *scanner)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    ScanTask *task;
+
+    if (!scanner)
+        return;
+
+    /* Let the workers finish the queued tasks, so that the ones already
+     * taken by the caller are freed.
+     */
+    g_thread_pool_free (scanner->pool, FALSE, TRUE);
+
+    /* Prefetched but never asked for. */
+    g_hash_table_iter_init (&iter, scanner->tasks);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        task = value;
+        scan_task_free (task);
+    }
+    g_hash_table_destroy (scanner->tasks);
+
+    pthread_mutex_destroy (&scanner->lock);
+    pthread_cond_destroy (&scanner->cond);
+    g_free (scanner);
+}
+
+void
+dir_scanner_prefetch (DirScanner *scanner, const char *full_path)
+{
+    ScanTask *task;
+
+    if (!scanner)
+        return;
+
+    pthread_mutex_lock (&scanner->lock);
+
+    if (scanner->n_buffered >= MAX_BUFFERED_ENTRIES ||
+        g_hash_table_lookup (scanner->tasks, full_path)) {
+        pthread_mutex_unlock (&scanner->lock);
+        return;
+    }
+
+    task = g_new0 (ScanTask, 1);
+    task->full_path = g_strdup (full_path);
+    task->seq = scanner->next_seq++;
+    g_hash_table_insert (scanner->tasks, task->full_path, task);
+
+    pthread_mutex_unlock (&scanner->lock);
+
+    g_thread_pool_push (scanner->pool, task, NULL);
+}
+
+ScanDir *
+dir_scanner_get (DirScanner *scanner, const char *full_path)
+{
+    ScanTask *task;
+    ScanDir *result;
+
+    if (!scanner)
+        return list_dir (full_path);
+
+    pthread_mutex_lock (&scanner->lock);
+
+    task = g_hash_table_lookup (scanner->tasks, full_path);
+    if (!task) {
+        pthread_mutex_unlock (&scanner->lock);
+        return list_dir (full_path);
+    }
+
+    g_hash_table_remove (scanner->tasks, full_path);
+
+    if (task->state == SCAN_PENDING) {
+        /* Not started yet, cheaper to list it here than to wait. */
+        task->state = SCAN_TAKEN;
+        pthread_mutex_unlock (&scanner->lock);
+        return list_dir (full_path);
+    }
+
+    while (task->state != SCAN_DONE)
+        pthread_cond_wait (&scanner->cond, &scanner->lock);
+
+    result = task->result;
+    task->result = NULL;
+    scanner->n_buffered -= result->n_entries;
+
+    pthread_mutex_unlock (&scanner->lock);
+
+    scan_task_free (task);
+    return result;
+}
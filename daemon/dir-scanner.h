@@ -0,0 +1,60 @@
+#ifndef DIR_SCANNER_H
+#define DIR_SCANNER_H
+
+#include <glib.h>
+
+#include "utils.h"
+
+/*
+ * DirScanner lists directories and stats their entries on a pool of
+ * threads, ahead of a caller that walks the tree in its own order.
+ *
+ * The caller asks for a listing with dir_scanner_get() and, before
+ * descending, passes the subdirs it will visit next to
+ * dir_scanner_prefetch(). Recently requested dirs are listed first, which
+ * follows a depth-first walk. Listings are returned in readdir order, so
+ * the walk and its results are the same as without the scanner.
+ *
+ * On Linux entries are stat'ed relative to the open dir, and dirs whose
+ * type is returned by readdir are not stat'ed at all.
+ */
+
+typedef struct ScanEntry {
+    char *name;
+    int stat_errno;             /* 0 if stat() succeeded */
+    SeafStat st;
+    /* Only st_mode is set, to S_IFDIR. */
+    gboolean type_only;
+    gboolean ignored;           /* free for the caller to use */
+} ScanEntry;
+
+typedef struct ScanDir {
+    int error;                  /* errno if the dir can't be opened */
+    int n_entries;
+    ScanEntry *entries;
+} ScanDir;
+
+typedef struct DirScanner DirScanner;
+
+DirScanner *
+dir_scanner_new (int n_threads);
+
+void
+dir_scanner_free (DirScanner *scanner);
+
+/* Schedule listing @full_path in the background. No-op for a NULL scanner
+ * or if too many listings are already waiting to be picked up.
+ */
+void
+dir_scanner_prefetch (DirScanner *scanner, const char *full_path);
+
+/* Returns the listing of @full_path, waiting for or doing the listing
+ * if it's not ready. @scanner may be NULL. Free with scan_dir_free().
+ */
+ScanDir *
+dir_scanner_get (DirScanner *scanner, const char *full_path);
+
+void
+scan_dir_free (ScanDir *dir);
+
+#endif
@@ -0,0 +1,387 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#include "seafile-session.h"
+#include "seafile-error.h"
+#include "dir-scanner.h"
+#include "dir-size.h"
+#include "utils.h"
+#include "log.h"
+
+#define DIR_SIZE_SCAN_THREADS 8
+/* Cached folders are listed again after this many seconds. */
+#define CACHED_DIR_TTL 600
+/* The cache is cleared when it grows past this many folders. */
+#define MAX_CACHED_DIRS 200000
+/* Results of background walks are kept this long after they finished. */
+#define RESULT_TTL 600
+
+typedef struct CachedDir {
+    gint64 mtime;
+    gint64 cached_at;
+    /* Size of the files directly in the folder. */
+    gint64 files_size;
+    char **subdirs;
+} CachedDir;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+/* full path -> CachedDir */
+static GHashTable *cache;
+
+typedef struct DirSizeCalc {
+    char *path;
+    DirScanner *scanner;
+
+    /* Updated by the walk, read by seaf_dir_size_get_progress(). */
+    pthread_mutex_t lock;
+    gint64 size;
+    int scanned_dirs;
+    int pending_dirs;
+
+    /* Main thread only. */
+    gboolean finished;
+    gint64 finished_at;
+    /* Set by the walk before it finishes. */
+    char *error;
+} DirSizeCalc;
+
+/* path -> DirSizeCalc, main thread only. */
+static GHashTable *calcs;
+
+static void
+cached_dir_free (CachedDir *dir)
+{
+    g_strfreev (dir->subdirs);
+    g_free (dir);
+}
+
+static gboolean
+lookup_cached_dir (const char *full_path, gint64 mtime,
+                   gint64 *files_size, char ***subdirs)
+{
+    CachedDir *dir;
+    gboolean found = FALSE;
+
+    pthread_mutex_lock (&cache_lock);
+    if (cache) {
+        dir = g_hash_table_lookup (cache, full_path);
+        if (dir && dir->mtime == mtime &&
+            (gint64)time(NULL) - dir->cached_at < CACHED_DIR_TTL) {
+            *files_size = dir->files_size;
+            *subdirs = g_strdupv (dir->subdirs);
+            found = TRUE;
+        }
+    }
+    pthread_mutex_unlock (&cache_lock);
+
+    return found;
+}
+
+static gboolean
+is_dir_cached (const char *full_path, gint64 mtime)
+{
+    CachedDir *dir;
+    gboolean found = FALSE;
+
+    pthread_mutex_lock (&cache_lock);
+    if (cache) {
+        dir = g_hash_table_lookup (cache, full_path);
+        found = (dir && dir->mtime == mtime &&
+                 (gint64)time(NULL) - dir->cached_at < CACHED_DIR_TTL);
+    }
+    pthread_mutex_unlock (&cache_lock);
+
+    return found;
+}
+
+static void
+cache_dir (const char *full_path, gint64 mtime,
+           gint64 files_size, char **subdirs)
+{
+    CachedDir *dir = g_new0 (CachedDir, 1);
+
+    dir->mtime = mtime;
+    dir->cached_at = (gint64)time(NULL);
+    dir->files_size = files_size;
+    dir->subdirs = g_strdupv (subdirs);
+
+    pthread_mutex_lock (&cache_lock);
+    if (!cache)
+        cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                       g_free, (GDestroyNotify)cached_dir_free);
+    if (g_hash_table_size (cache) >= MAX_CACHED_DIRS)
+        g_hash_table_remove_all (cache);
+    g_hash_table_replace (cache, g_strdup (full_path), dir);
+    pthread_mutex_unlock (&cache_lock);
+}
+
+static int
+list_dir (DirSizeCalc *calc, const char *full_path,
+          gint64 *files_size, char ***subdirs, GError **error)
+{
+    ScanDir *dir;
+    ScanEntry *entry;
+    GPtrArray *names;
+    GArray *mtimes;
+    gint64 mtime;
+    char *sub_path;
+    int i;
+
+    dir = dir_scanner_get (calc->scanner, full_path);
+    if (dir->error != 0) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                     "Failed to open dir %s: %s", full_path, strerror(dir->error));
+        scan_dir_free (dir);
+        return -1;
+    }
+
+    *files_size = 0;
+    names = g_ptr_array_new ();
+    mtimes = g_array_new (FALSE, FALSE, sizeof(gint64));
+    for (i = 0; i < dir->n_entries; ++i) {
+        entry = &dir->entries[i];
+        if (entry->stat_errno != 0) {
+            g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                         "Failed to stat %s/%s: %s", full_path, entry->name,
+                         strerror(entry->stat_errno));
+            g_ptr_array_add (names, NULL);
+            g_strfreev ((char **)g_ptr_array_free (names, FALSE));
+            g_array_free (mtimes, TRUE);
+            scan_dir_free (dir);
+            return -1;
+        }
+
+        if (S_ISDIR(entry->st.st_mode)) {
+            g_ptr_array_add (names, g_strdup (entry->name));
+            mtime = (gint64)entry->st.st_mtime;
+            g_array_append_val (mtimes, mtime);
+        } else if (S_ISREG(entry->st.st_mode))
+            *files_size += entry->st.st_size;
+    }
+    g_ptr_array_add (names, NULL);
+    *subdirs = (char **)g_ptr_array_free (names, FALSE);
+
+    /* Queued in reverse so that the first one is listed first. Folders
+     * that are cached won't be listed, so they're not read ahead.
+     */
+    for (i = (int)g_strv_length (*subdirs) - 1; i >= 0; --i) {
+        sub_path = g_build_filename (full_path, (*subdirs)[i], NULL);
+        if (!is_dir_cached (sub_path, g_array_index (mtimes, gint64, i)))
+            dir_scanner_prefetch (calc->scanner, sub_path);
+        g_free (sub_path);
+    }
+
+    g_array_free (mtimes, TRUE);
+    scan_dir_free (dir);
+    return 0;
+}
+
+static int
+walk_dir (DirSizeCalc *calc, const char *full_path, GError **error)
+{
+    SeafStat st;
+    gint64 files_size = 0;
+    char **subdirs = NULL;
+    char *sub_path;
+    int i, n_subdirs;
+
+    if (seaf_stat (full_path, &st) < 0) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                     "Failed to stat %s: %s", full_path, strerror(errno));
+        return -1;
+    }
+
+    if (!lookup_cached_dir (full_path, (gint64)st.st_mtime,
+                            &files_size, &subdirs)) {
+        if (list_dir (calc, full_path, &files_size, &subdirs, error) < 0)
+            return -1;
+        cache_dir (full_path, (gint64)st.st_mtime, files_size, subdirs);
+    }
+
+    n_subdirs = g_strv_length (subdirs);
+
+    pthread_mutex_lock (&calc->lock);
+    calc->size += files_size;
+    ++calc->scanned_dirs;
+    calc->pending_dirs += n_subdirs;
+    pthread_mutex_unlock (&calc->lock);
+
+    for (i = 0; i < n_subdirs; ++i) {
+        pthread_mutex_lock (&calc->lock);
+        --calc->pending_dirs;
+        pthread_mutex_unlock (&calc->lock);
+
+        sub_path = g_build_filename (full_path, subdirs[i], NULL);
+        if (walk_dir (calc, sub_path, error) < 0) {
+            g_free (sub_path);
+            g_strfreev (subdirs);
+            return -1;
+        }
+        g_free (sub_path);
+    }
+
+    g_strfreev (subdirs);
+    return 0;
+}
+
+static DirSizeCalc *
+dir_size_calc_new (const char *path)
+{
+    DirSizeCalc *calc = g_new0 (DirSizeCalc, 1);
+
+    calc->path = g_strdup (path);
+    pthread_mutex_init (&calc->lock, NULL);
+
+    return calc;
+}
+
+static void
+dir_size_calc_free (DirSizeCalc *calc)
+{
+    g_free (calc->path);
+    g_free (calc->error);
+    pthread_mutex_destroy (&calc->lock);
+    g_free (calc);
+}
+
+static gint64
+run_calc (DirSizeCalc *calc, GError **error)
+{
+    int rc;
+
+    calc->scanner = dir_scanner_new (DIR_SIZE_SCAN_THREADS);
+    rc = walk_dir (calc, calc->path, error);
+    dir_scanner_free (calc->scanner);
+    calc->scanner = NULL;
+
+    return (rc < 0) ? -1 : calc->size;
+}
+
+gint64
+seaf_dir_size_calc (const char *path, GError **error)
+{
+    DirSizeCalc *calc = dir_size_calc_new (path);
+    gint64 size;
+
+    size = run_calc (calc, error);
+    dir_size_calc_free (calc);
+
+    return size;
+}
+
+static void *
+calc_thread (void *vdata)
+{
+    DirSizeCalc *calc = vdata;
+    GError *error = NULL;
+
+    if (run_calc (calc, &error) < 0) {
+        seaf_warning ("Failed to calculate size of %s: %s.\n",
+                      calc->path, error->message);
+        calc->error = g_strdup (error->message);
+        g_clear_error (&error);
+    }
+
+    return vdata;
+}
+
+static void
+calc_done (void *result)
+{
+    DirSizeCalc *calc = result;
+
+    calc->finished = TRUE;
+    calc->finished_at = (gint64)time(NULL);
+}
+
+static void
+drop_expired_calcs ()
+{
+    GHashTableIter iter;
+    gpointer value;
+    DirSizeCalc *calc;
+    gint64 now = (gint64)time(NULL);
+
+    g_hash_table_iter_init (&iter, calcs);
+    while (g_hash_table_iter_next (&iter, NULL, &value)) {
+        calc = value;
+        if (calc->finished && now - calc->finished_at >= RESULT_TTL) {
+            g_hash_table_iter_remove (&iter);
+            dir_size_calc_free (calc);
+        }
+    }
+}
+
+int
+seaf_dir_size_start (const char *path)
+{
+    DirSizeCalc *calc;
+
+    if (!calcs)
+        calcs = g_hash_table_new (g_str_hash, g_str_equal);
+
+    drop_expired_calcs ();
+
+    calc = g_hash_table_lookup (calcs, path);
+    if (calc) {
+        if (!calc->finished)
+            return 0;
+        g_hash_table_remove (calcs, path);
+        dir_size_calc_free (calc);
+    }
+
+    calc = dir_size_calc_new (path);
+    if (seaf_job_manager_schedule_job (seaf->job_mgr,
+                                       calc_thread,
+                                       calc_done,
+                                       calc) < 0) {
+        seaf_warning ("Failed to start calculating size of %s.\n", path);
+        dir_size_calc_free (calc);
+        return -1;
+    }
+    g_hash_table_insert (calcs, calc->path, calc);
+
+    return 0;
+}
+
+json_t *
+seaf_dir_size_get_progress (const char *path)
+{
+    DirSizeCalc *calc;
+    json_t *object;
+    gint64 size, estimated;
+    int scanned, pending;
+
+    if (!calcs)
+        return NULL;
+
+    drop_expired_calcs ();
+
+    calc = g_hash_table_lookup (calcs, path);
+    if (!calc)
+        return NULL;
+
+    pthread_mutex_lock (&calc->lock);
+    size = calc->size;
+    scanned = calc->scanned_dirs;
+    pending = calc->pending_dirs;
+    pthread_mutex_unlock (&calc->lock);
+
+    estimated = size;
+    if (!calc->finished && scanned > 0)
+        estimated += size / scanned * pending;
+
+    object = json_object ();
+    json_object_set_new (object, "finished", json_boolean (calc->finished));
+    json_object_set_new (object, "size", json_integer (size));
+    json_object_set_new (object, "estimated_size", json_integer (estimated));
+    json_object_set_new (object, "scanned_dirs", json_integer (scanned));
+    json_object_set_new (object, "pending_dirs", json_integer (pending));
+    if (calc->finished && calc->error)
+        json_object_set_new (object, "error", json_string (calc->error));
+
+    return object;
+}
@@ -0,0 +1,51 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef DIR_SIZE_H
+#define DIR_SIZE_H
+
+#include <glib.h>
+#include <jansson.h>
+
+/*
+ * Total size of the files under a folder, as shown before an existing
+ * folder is synced with a library.
+ *
+ * Folders are listed by a DirScanner ahead of the walk. The size of the
+ * files directly in each folder is cached with the mtime of the folder,
+ * so an unchanged folder isn't listed again, though its subfolders are
+ * still checked. Changing a file doesn't change the mtime of its folder,
+ * so cached sizes are also dropped after 10 minutes.
+ *
+ * seaf_dir_size_start() runs the walk in the background. While it runs,
+ * seaf_dir_size_get_progress() returns the size found so far and an
+ * estimate of the total.
+ */
+
+/* Returns the size in bytes, or -1 with @error set. */
+gint64
+seaf_dir_size_calc (const char *path, GError **error);
+
+/* Starts calculating the size of @path in the background, unless that's
+ * already running. Must be called in the main thread.
+ */
+int
+seaf_dir_size_start (const char *path);
+
+/*
+ * Returns the progress of the calculation started for @path:
+ *
+ *   "finished"       - whether the walk is done;
+ *   "size"           - size of the files found so far;
+ *   "estimated_size" - the final size if known, otherwise "size" plus the
+ *                      average size per folder for each folder found but
+ *                      not walked yet;
+ *   "scanned_dirs", "pending_dirs" - folders walked and still to walk;
+ *   "error"          - set if the walk failed.
+ *
+ * Returns NULL if no calculation of @path was started, or its result
+ * expired. Must be called in the main thread.
+ */
+json_t *
+seaf_dir_size_get_progress (const char *path);
+
+#endif
@@ -0,0 +1,167 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#include "download-priority.h"
+#include "log.h"
+
+static pthread_mutex_t pins_lock = PTHREAD_MUTEX_INITIALIZER;
+/* repo_id -> GQueue of paths, most recent first. */
+static GHashTable *pins;
+static guint pins_version;
+
+static gint download_order = DOWNLOAD_ORDER_DIFF;
+
+void
+seaf_download_priority_set_order (const char *order)
+{
+    int value = DOWNLOAD_ORDER_DIFF;
+
+    if (g_strcmp0 (order, "small_first") == 0)
+        value = DOWNLOAD_ORDER_SMALL_FIRST;
+    else if (g_strcmp0 (order, "recent_first") == 0)
+        value = DOWNLOAD_ORDER_RECENT_FIRST;
+    else if (order && order[0] != 0 && g_strcmp0 (order, "diff") != 0)
+        seaf_warning ("Unknown download order %s, using diff order.\n", order);
+
+    g_atomic_int_set (&download_order, value);
+}
+
+int
+seaf_download_priority_get_order ()
+{
+    return g_atomic_int_get (&download_order);
+}
+
+static void
+free_path_queue (GQueue *queue)
+{
+    g_queue_free_full (queue, g_free);
+}
+
+/* Pinned paths are relative to the worktree, without leading or trailing
+ * slashes. The root pins the whole library.
+ */
+static char *
+normalize_path (const char *path)
+{
+    char *ret = g_strdup (path);
+    char *p;
+
+    for (p = ret; *p; ++p) {
+        if (*p == '\\')
+            *p = '/';
+    }
+    while (ret[0] == '/')
+        memmove (ret, ret + 1, strlen(ret));
+    p = ret + strlen(ret);
+    while (p > ret && p[-1] == '/')
+        *(--p) = 0;
+
+    return ret;
+}
+
+int
+seaf_download_priority_add_path (const char *repo_id, const char *path)
+{
+    GQueue *queue;
+    GList *link;
+    char *norm;
+
+    norm = normalize_path (path);
+
+    pthread_mutex_lock (&pins_lock);
+
+    if (!pins)
+        pins = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                      (GDestroyNotify)free_path_queue);
+    queue = g_hash_table_lookup (pins, repo_id);
+    if (!queue) {
+        queue = g_queue_new ();
+        g_hash_table_insert (pins, g_strdup (repo_id), queue);
+    }
+
+    link = g_queue_find_custom (queue, norm, (GCompareFunc)g_strcmp0);
+    if (link) {
+        g_free (link->data);
+        g_queue_delete_link (queue, link);
+    }
+    g_queue_push_head (queue, norm);
+    while (g_queue_get_length (queue) > DOWNLOAD_PRIORITY_MAX_PINS)
+        g_free (g_queue_pop_tail (queue));
+
+    ++pins_version;
+
+    pthread_mutex_unlock (&pins_lock);
+
+    return 0;
+}
+
+void
+seaf_download_priority_clear (const char *repo_id)
+{
+    pthread_mutex_lock (&pins_lock);
+    if (pins && g_hash_table_remove (pins, repo_id))
+        ++pins_version;
+    pthread_mutex_unlock (&pins_lock);
+}
+
+guint
+seaf_download_priority_get_version ()
+{
+    guint ret;
+
+    pthread_mutex_lock (&pins_lock);
+    ret = pins_version;
+    pthread_mutex_unlock (&pins_lock);
+
+    return ret;
+}
+
+char **
+seaf_download_priority_get_paths (const char *repo_id)
+{
+    GQueue *queue;
+    GList *ptr;
+    char **ret;
+    int i = 0;
+
+    pthread_mutex_lock (&pins_lock);
+
+    queue = pins ? g_hash_table_lookup (pins, repo_id) : NULL;
+    if (!queue) {
+        pthread_mutex_unlock (&pins_lock);
+        return NULL;
+    }
+
+    ret = g_new0 (char *, g_queue_get_length (queue) + 1);
+    for (ptr = queue->head; ptr; ptr = ptr->next)
+        ret[i++] = g_strdup (ptr->data);
+
+    pthread_mutex_unlock (&pins_lock);
+
+    return ret;
+}
+
+int
+seaf_download_priority_get_rank (char **paths, const char *path)
+{
+    int i;
+    size_t len;
+
+    if (!paths)
+        return 0;
+
+    for (i = 0; paths[i]; ++i) {
+        len = strlen (paths[i]);
+        if (len == 0)
+            return i;
+        if (strncmp (path, paths[i], len) == 0 &&
+            (path[len] == 0 || path[len] == '/'))
+            return i;
+    }
+
+    return i;
+}
@@ -0,0 +1,64 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef DOWNLOAD_PRIORITY_H
+#define DOWNLOAD_PRIORITY_H
+
+#include <glib.h>
+
+/*
+ * Order in which the files of a download are fetched.
+ *
+ * Files under the folders pinned with seafile_prioritize_download come
+ * first, the most recently pinned one before the others, so that a folder
+ * the user opens is usable before the rest of the library is downloaded.
+ * Pins can be changed while a download runs; the queued files are sorted
+ * again. Within the same pin, files are fetched in the order set by the
+ * "download_order" config:
+ *
+ *   "diff"         - the order of the diff, i.e. by path (default);
+ *   "small_first"  - smallest files first;
+ *   "recent_first" - most recently modified files first.
+ *
+ * Only the order changes, files are fetched by as many threads as before.
+ * Pins are kept in memory and cleared when the daemon restarts.
+ */
+
+enum {
+    DOWNLOAD_ORDER_DIFF,
+    DOWNLOAD_ORDER_SMALL_FIRST,
+    DOWNLOAD_ORDER_RECENT_FIRST,
+};
+
+/* At most this many folders are pinned per repo; older pins are dropped. */
+#define DOWNLOAD_PRIORITY_MAX_PINS 16
+
+/* Sets the order from the value of the "download_order" config. */
+void
+seaf_download_priority_set_order (const char *order);
+
+int
+seaf_download_priority_get_order ();
+
+/* Moves @path and the files under it ahead of the rest of @repo_id. */
+int
+seaf_download_priority_add_path (const char *repo_id, const char *path);
+
+void
+seaf_download_priority_clear (const char *repo_id);
+
+/* Changes whenever the pins of any repo change. */
+guint
+seaf_download_priority_get_version ();
+
+/* Pinned paths of @repo_id, most recent first. Free with g_strfreev(). */
+char **
+seaf_download_priority_get_paths (const char *repo_id);
+
+/*
+ * Rank of @path among the pinned @paths, 0 for the most recently pinned
+ * folder. Paths that aren't pinned get the number of pins.
+ */
+int
+seaf_download_priority_get_rank (char **paths, const char *path);
+
+#endif
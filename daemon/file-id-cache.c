@@ -0,0 +1,229 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#include "seafile-session.h"
+#include "file-id-cache.h"
+#include "db.h"
+#include "utils.h"
+#include "log.h"
+
+/* Writes within the same second keep the mtime, so files modified less
+ * than this many seconds before they're chunked are not cached.
+ */
+#define RACY_SECONDS 2
+
+static sqlite3 *cache_db;
+static SqliteStmtCache *stmts;
+static pthread_mutex_t db_lock;
+
+/* A reused inode only gets a stale id if the new file also has the same
+ * size and the same mtime to the nanosecond, so files are only cached
+ * where stat has nanoseconds.
+ */
+static gboolean
+is_cacheable (SeafStat *st)
+{
+#if defined __linux__ || defined __APPLE__
+    return (S_ISREG(st->st_mode) && st->st_ino != 0 && st->st_size > 0);
+#else
+    return FALSE;
+#endif
+}
+
+static gint64
+mtime_nsec (SeafStat *st)
+{
+#if defined __linux__
+    return (gint64)st->st_mtim.tv_nsec;
+#elif defined __APPLE__
+    return (gint64)st->st_mtimespec.tv_nsec;
+#else
+    return 0;
+#endif
+}
+
+static gboolean
+same_stat (SeafStat *st1, SeafStat *st2)
+{
+    return (st1->st_dev == st2->st_dev && st1->st_ino == st2->st_ino &&
+            st1->st_size == st2->st_size &&
+            st1->st_mtime == st2->st_mtime &&
+            mtime_nsec (st1) == mtime_nsec (st2));
+}
+
+gboolean
+seaf_file_id_cache_lookup (const char *repo_id, SeafStat *st,
+                           unsigned char *sha1)
+{
+    sqlite3_stmt *stmt;
+    const char *file_id;
+    gboolean ret = FALSE;
+
+    if (!cache_db || !is_cacheable (st))
+        return FALSE;
+
+    pthread_mutex_lock (&db_lock);
+
+    stmt = sqlite_stmt_cache_get (stmts,
+                                  "SELECT file_id FROM InodeFileIds "
+                                  "WHERE repo_id = ? AND dev = ? AND ino = ? "
+                                  "AND size = ? AND mtime = ? "
+                                  "AND mtime_nsec = ?");
+    if (!stmt) {
+        pthread_mutex_unlock (&db_lock);
+        return FALSE;
+    }
+
+    sqlite3_bind_text (stmt, 1, repo_id, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int64 (stmt, 2, (gint64)st->st_dev);
+    sqlite3_bind_int64 (stmt, 3, (gint64)st->st_ino);
+    sqlite3_bind_int64 (stmt, 4, (gint64)st->st_size);
+    sqlite3_bind_int64 (stmt, 5, (gint64)st->st_mtime);
+    sqlite3_bind_int64 (stmt, 6, mtime_nsec (st));
+
+    if (sqlite3_step (stmt) == SQLITE_ROW) {
+        file_id = (const char *)sqlite3_column_text (stmt, 0);
+        if (file_id && strlen (file_id) == 40) {
+            hex_to_rawdata (file_id, sha1, 20);
+            ret = TRUE;
+        }
+    }
+
+    sqlite3_reset (stmt);
+    sqlite3_clear_bindings (stmt);
+
+    pthread_mutex_unlock (&db_lock);
+
+    return ret;
+}
+
+void
+seaf_file_id_cache_add (const char *repo_id, const char *path,
+                        SeafStat *st, const unsigned char *sha1)
+{
+    sqlite3_stmt *stmt;
+    SeafStat st2;
+    char file_id[41];
+
+    if (!cache_db || !is_cacheable (st))
+        return;
+
+    if ((gint64)st->st_mtime > (gint64)time(NULL) - RACY_SECONDS)
+        return;
+
+    if (seaf_stat (path, &st2) < 0 || !same_stat (st, &st2))
+        return;
+
+    rawdata_to_hex (sha1, file_id, 20);
+
+    pthread_mutex_lock (&db_lock);
+
+    stmt = sqlite_stmt_cache_get (stmts,
+                                  "REPLACE INTO InodeFileIds "
+                                  "(repo_id, dev, ino, size, mtime, "
+                                  "mtime_nsec, file_id) "
+                                  "VALUES (?, ?, ?, ?, ?, ?, ?)");
+    if (!stmt) {
+        pthread_mutex_unlock (&db_lock);
+        return;
+    }
+
+    sqlite3_bind_text (stmt, 1, repo_id, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int64 (stmt, 2, (gint64)st->st_dev);
+    sqlite3_bind_int64 (stmt, 3, (gint64)st->st_ino);
+    sqlite3_bind_int64 (stmt, 4, (gint64)st->st_size);
+    sqlite3_bind_int64 (stmt, 5, (gint64)st->st_mtime);
+    sqlite3_bind_int64 (stmt, 6, mtime_nsec (st));
+    sqlite3_bind_text (stmt, 7, file_id, -1, SQLITE_TRANSIENT);
+
+    if (sqlite3_step (stmt) != SQLITE_DONE)
+        seaf_warning ("Failed to cache file id of %s: %s.\n",
+                      path, sqlite3_errmsg (cache_db));
+
+    sqlite3_reset (stmt);
+    sqlite3_clear_bindings (stmt);
+
+    pthread_mutex_unlock (&db_lock);
+}
+
+void
+seaf_file_id_cache_remove (const char *repo_id, SeafStat *st)
+{
+    sqlite3_stmt *stmt;
+
+    if (!cache_db || !is_cacheable (st))
+        return;
+
+    pthread_mutex_lock (&db_lock);
+
+    stmt = sqlite_stmt_cache_get (stmts,
+                                  "DELETE FROM InodeFileIds "
+                                  "WHERE repo_id = ? AND dev = ? AND ino = ?");
+    if (!stmt) {
+        pthread_mutex_unlock (&db_lock);
+        return;
+    }
+
+    sqlite3_bind_text (stmt, 1, repo_id, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int64 (stmt, 2, (gint64)st->st_dev);
+    sqlite3_bind_int64 (stmt, 3, (gint64)st->st_ino);
+
+    if (sqlite3_step (stmt) != SQLITE_DONE)
+        seaf_warning ("Failed to remove cached file id: %s.\n",
+                      sqlite3_errmsg (cache_db));
+
+    sqlite3_reset (stmt);
+    sqlite3_clear_bindings (stmt);
+
+    pthread_mutex_unlock (&db_lock);
+}
+
+void
+seaf_file_id_cache_remove_repo (const char *repo_id)
+{
+    char *sql;
+
+    if (!cache_db)
+        return;
+
+    sql = sqlite3_mprintf ("DELETE FROM InodeFileIds WHERE repo_id = %Q", repo_id);
+    pthread_mutex_lock (&db_lock);
+    sqlite_query_exec (cache_db, sql);
+    pthread_mutex_unlock (&db_lock);
+    sqlite3_free (sql);
+}
+
+int
+seaf_file_id_cache_start ()
+{
+    char *db_path;
+    sqlite3 *db;
+    const char *sql;
+
+    pthread_mutex_init (&db_lock, NULL);
+
+    db_path = g_build_filename (seaf->seaf_dir, "file-id-cache.db", NULL);
+    if (sqlite_open_db (db_path, &db) < 0) {
+        g_free (db_path);
+        return -1;
+    }
+    g_free (db_path);
+
+    /* Replaced by InodeFileIds, which has nanosecond mtimes. */
+    sqlite_query_exec (db, "DROP TABLE IF EXISTS FileIds");
+    sqlite_query_exec (db, "DROP TABLE IF EXISTS CachedFileIds");
+
+    sql = "CREATE TABLE IF NOT EXISTS InodeFileIds ("
+        "repo_id TEXT, dev INTEGER, ino INTEGER, size INTEGER, "
+        "mtime INTEGER, mtime_nsec INTEGER, file_id TEXT, "
+        "PRIMARY KEY (repo_id, dev, ino));";
+    sqlite_query_exec (db, sql);
+
+    stmts = sqlite_stmt_cache_new (db);
+    cache_db = db;
+
+    return 0;
+}
@@ -0,0 +1,51 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef FILE_ID_CACHE_H
+#define FILE_ID_CACHE_H
+
+#include <glib.h>
+
+#include "utils.h"
+
+/*
+ * Persistent cache of file ids by inode.
+ *
+ * Maps (dev, ino) of a worktree file to its size, mtime and file id when it
+ * was last chunked. The mtime is compared with nanoseconds. A file that
+ * still has the same size and mtime doesn't have to be chunked again, even
+ * if it was renamed or moved, its ctime changed or the index was rebuilt.
+ *
+ * Entries are kept when files leave the index, so a rename seen as a
+ * delete and an add still finds the id. A reused inode only matches if the
+ * new file has the same size and nanosecond mtime. Platforms whose stat has
+ * no nanoseconds or no inode numbers, like seaf_stat on Windows, are not
+ * cached.
+ */
+
+int
+seaf_file_id_cache_start ();
+
+/* Sets @sha1 to the cached id of the file with @st. */
+gboolean
+seaf_file_id_cache_lookup (const char *repo_id, SeafStat *st,
+                           unsigned char *sha1);
+
+/*
+ * Records @sha1 as the id of the file at @path, which had @st before it
+ * was chunked. Nothing is recorded if the file has changed since then, or
+ * could still change without a new mtime.
+ */
+void
+seaf_file_id_cache_add (const char *repo_id, const char *path,
+                        SeafStat *st, const unsigned char *sha1);
+
+/* Forgets the id cached for the file with @st, when its content changed
+ * without a new mtime.
+ */
+void
+seaf_file_id_cache_remove (const char *repo_id, SeafStat *st);
+
+void
+seaf_file_id_cache_remove_repo (const char *repo_id);
+
+#endif
@@ -0,0 +1,178 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#include "seafile-session.h"
+#include "file-indexer.h"
+#include "log.h"
+
+/* Max bytes of files being indexed at the same time, over all repos.
+ * A file larger than this is indexed alone.
+ */
+#define INDEX_BYTES_BUDGET (256 * (1 << 20))
+
+/* Small files still cost a few reads and writes. */
+#define MIN_JOB_COST 4096
+
+typedef struct PendingJob {
+    IndexJob job;               /* first, freed by index_job_free() */
+    FileIndexer *indexer;
+    gint64 cost;
+    gboolean done;
+} PendingJob;
+
+struct FileIndexer {
+    char repo_id[37];
+    int version;
+    struct SeafileCrypt *crypt;
+    IndexCB index_cb;
+    GQueue *jobs;               /* PendingJob in submit order */
+};
+
+static pthread_mutex_t indexer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t indexer_cond = PTHREAD_COND_INITIALIZER;
+static GThreadPool *index_pool;
+static gboolean index_pool_inited;
+static gint64 bytes_in_flight;
+
+static void
+run_job (PendingJob *pj)
+{
+    FileIndexer *indexer = pj->indexer;
+
+    pj->job.result = indexer->index_cb (indexer->repo_id, indexer->version,
+                                        pj->job.full_path, pj->job.sha1,
+                                        indexer->crypt, TRUE);
+
+    pthread_mutex_lock (&indexer_lock);
+    pj->done = TRUE;
+    bytes_in_flight -= pj->cost;
+    pthread_cond_broadcast (&indexer_cond);
+    pthread_mutex_unlock (&indexer_lock);
+}
+
+static void
+index_worker (gpointer data, gpointer user_data)
+{
+    run_job ((PendingJob *)data);
+}
+
+/* Called with indexer_lock held. */
+static GThreadPool *
+get_index_pool ()
+{
+    GError *error = NULL;
+
+    if (index_pool_inited)
+        return index_pool;
+    index_pool_inited = TRUE;
+
+    index_pool = g_thread_pool_new (index_worker, NULL,
+                                    seaf->index_file_threads, FALSE, &error);
+    if (!index_pool) {
+        seaf_warning ("Failed to create file index thread pool: %s. "
+                      "Index files one by one.\n", error->message);
+        g_clear_error (&error);
+    }
+    return index_pool;
+}
+
+FileIndexer *
+file_indexer_new (const char *repo_id, int version,
+                  struct SeafileCrypt *crypt, IndexCB index_cb)
+{
+    FileIndexer *indexer = g_new0 (FileIndexer, 1);
+
+    memcpy (indexer->repo_id, repo_id, 36);
+    indexer->version = version;
+    indexer->crypt = crypt;
+    indexer->index_cb = index_cb;
+    indexer->jobs = g_queue_new ();
+
+    return indexer;
+}
+
+void
+file_indexer_free (FileIndexer *indexer)
+{
+    IndexJob *job;
+
+    if (!indexer)
+        return;
+
+    while ((job = file_indexer_next (indexer, TRUE)) != NULL)
+        index_job_free (job);
+    g_queue_free (indexer->jobs);
+    g_free (indexer);
+}
+
+void
+file_indexer_submit (FileIndexer *indexer, const char *path,
+                     const char *full_path, SeafStat *st)
+{
+    PendingJob *pj = g_new0 (PendingJob, 1);
+    GThreadPool *pool;
+
+    pj->job.path = g_strdup (path);
+    pj->job.full_path = g_strdup (full_path);
+    pj->job.st = *st;
+    pj->indexer = indexer;
+    pj->cost = MAX ((gint64)st->st_size, MIN_JOB_COST);
+
+    pthread_mutex_lock (&indexer_lock);
+    while (bytes_in_flight > 0 &&
+           bytes_in_flight + pj->cost > INDEX_BYTES_BUDGET)
+        pthread_cond_wait (&indexer_cond, &indexer_lock);
+    bytes_in_flight += pj->cost;
+    g_queue_push_tail (indexer->jobs, pj);
+    pool = get_index_pool ();
+    pthread_mutex_unlock (&indexer_lock);
+
+    if (pool)
+        g_thread_pool_push (pool, pj, NULL);
+    else
+        run_job (pj);
+}
+
+IndexJob *
+file_indexer_next (FileIndexer *indexer, gboolean wait)
+{
+    PendingJob *pj;
+
+    pthread_mutex_lock (&indexer_lock);
+    pj = g_queue_peek_head (indexer->jobs);
+    while (pj && !pj->done && wait)
+        pthread_cond_wait (&indexer_cond, &indexer_lock);
+    if (pj && pj->done)
+        g_queue_pop_head (indexer->jobs);
+    else
+        pj = NULL;
+    pthread_mutex_unlock (&indexer_lock);
+
+    return (IndexJob *)pj;
+}
+
+guint
+file_indexer_n_pending (FileIndexer *indexer)
+{
+    guint n;
+
+    pthread_mutex_lock (&indexer_lock);
+    n = g_queue_get_length (indexer->jobs);
+    pthread_mutex_unlock (&indexer_lock);
+
+    return n;
+}
+
+void
+index_job_free (IndexJob *job)
+{
+    if (!job)
+        return;
+
+    g_free (job->path);
+    g_free (job->full_path);
+    g_free (job);
+}
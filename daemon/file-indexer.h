@@ -0,0 +1,56 @@
+#ifndef FILE_INDEXER_H
+#define FILE_INDEXER_H
+
+#include <glib.h>
+
+#include "utils.h"
+#include "index/index.h"
+
+/*
+ * FileIndexer chunks, hashes and writes the blocks of many files at once
+ * on a thread pool shared by all repos. The files being indexed at the
+ * same time are limited by a global byte budget.
+ *
+ * Finished files are returned by file_indexer_next() in the order they
+ * were submitted, so the caller can apply them to the index on its own
+ * thread as if they were indexed one by one.
+ */
+
+typedef struct IndexJob {
+    char *path;
+    char *full_path;
+    SeafStat st;
+    int result;                 /* return value of the IndexCB */
+    unsigned char sha1[20];
+} IndexJob;
+
+typedef struct FileIndexer FileIndexer;
+
+FileIndexer *
+file_indexer_new (const char *repo_id, int version,
+                  struct SeafileCrypt *crypt, IndexCB index_cb);
+
+/* Waits for the jobs still running and frees the ones not taken. */
+void
+file_indexer_free (FileIndexer *indexer);
+
+/* Queue @full_path for indexing. Blocks while the byte budget is used up
+ * by other files.
+ */
+void
+file_indexer_submit (FileIndexer *indexer, const char *path,
+                     const char *full_path, SeafStat *st);
+
+/* Returns the oldest submitted job if it's finished, or waits for it if
+ * @wait is TRUE. Returns NULL if there is no such job.
+ */
+IndexJob *
+file_indexer_next (FileIndexer *indexer, gboolean wait);
+
+guint
+file_indexer_n_pending (FileIndexer *indexer);
+
+void
+index_job_free (IndexJob *job);
+
+#endif
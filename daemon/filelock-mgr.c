@@ -12,10 +12,13 @@
 #include "db.h"
 
 struct _FilelockMgrPriv {
+    /* repo_id -> (path -> LockInfo) */
     GHashTable *repo_locked_files;
-    pthread_mutex_t hash_lock;
+    pthread_rwlock_t hash_lock;
     sqlite3 *db;
     pthread_mutex_t db_lock;
+    /* Protected by db_lock. */
+    SqliteStmtCache *stmts;
 };
 typedef struct _FilelockMgrPriv FilelockMgrPriv;
 
@@ -23,6 +26,13 @@ typedef struct _LockInfo {
     int locked_by_me;
 } LockInfo;
 
+/* A row of ServerLockedFiles to be written after an update from server. */
+typedef struct _LockChange {
+    char *path;
+    int locked_by_me;
+    gboolean removed;
+} LockChange;
+
 /* When a file is locked by me, it can have two reasons:
  * - Locked by the user manually
  * - Auto-Locked by Seafile when it detects Office opens the file.
@@ -41,7 +51,7 @@ seaf_filelock_manager_new (struct _SeafileSession *session)
                                                      g_free,
                                                      (GDestroyNotify)g_hash_table_destroy);
 
-    pthread_mutex_init (&priv->hash_lock, NULL);
+    pthread_rwlock_init (&priv->hash_lock, NULL);
     pthread_mutex_init (&priv->db_lock, NULL);
 
     return mgr;
@@ -99,25 +109,42 @@ seaf_filelock_manager_init (SeafFilelockManager *mgr)
         "ON ServerLockedFiles (repo_id);";
     sqlite_query_exec (db, sql);
 
+    /* Rows are updated one by one, so a path can only appear once. Older
+     * versions may have left duplicated rows, keep the latest one.
+     */
+    sql = "SELECT 1 FROM sqlite_master WHERE type = 'index' AND "
+        "name = 'server_locked_files_path_idx'";
+    if (!sqlite_check_for_existence (db, sql)) {
+        sql = "DELETE FROM ServerLockedFiles WHERE rowid NOT IN "
+            "(SELECT MAX(rowid) FROM ServerLockedFiles GROUP BY repo_id, path)";
+        sqlite_query_exec (db, sql);
+
+        sql = "CREATE UNIQUE INDEX IF NOT EXISTS server_locked_files_path_idx "
+            "ON ServerLockedFiles (repo_id, path);";
+        sqlite_query_exec (db, sql);
+    }
+
     sql = "CREATE TABLE IF NOT EXISTS ServerLockedFilesTimestamp ("
         "repo_id TEXT, timestamp INTEGER, PRIMARY KEY (repo_id));";
     sqlite_query_exec (db, sql);
 
+    mgr->priv->stmts = sqlite_stmt_cache_new (db);
+
     sql = "SELECT repo_id, path, locked_by_me FROM ServerLockedFiles";
 
     pthread_mutex_lock (&mgr->priv->db_lock);
-    pthread_mutex_lock (&mgr->priv->hash_lock);
+    pthread_rwlock_wrlock (&mgr->priv->hash_lock);
 
     if (sqlite_foreach_selected_row (mgr->priv->db, sql,
                                      load_locked_files,
                                      mgr->priv->repo_locked_files) < 0) {
         pthread_mutex_unlock (&mgr->priv->db_lock);
-        pthread_mutex_unlock (&mgr->priv->hash_lock);
+        pthread_rwlock_unlock (&mgr->priv->hash_lock);
         g_hash_table_destroy (mgr->priv->repo_locked_files);
         return -1;
     }
 
-    pthread_mutex_unlock (&mgr->priv->hash_lock);
+    pthread_rwlock_unlock (&mgr->priv->hash_lock);
     pthread_mutex_unlock (&mgr->priv->db_lock);
 
     return 0;
@@ -145,7 +172,7 @@ seaf_filelock_manager_start (SeafFilelockManager *mgr)
     char *repo_id;
     GHashTable *locks;
 
-    pthread_mutex_lock (&mgr->priv->hash_lock);
+    pthread_rwlock_rdlock (&mgr->priv->hash_lock);
 
     g_hash_table_iter_init (&iter, mgr->priv->repo_locked_files);
     while (g_hash_table_iter_next (&iter, &key, &value)) {
@@ -154,61 +181,45 @@ seaf_filelock_manager_start (SeafFilelockManager *mgr)
         g_hash_table_foreach (locks, init_locks, repo_id);
     }
 
-    pthread_mutex_unlock (&mgr->priv->hash_lock);
+    pthread_rwlock_unlock (&mgr->priv->hash_lock);
 
     return 0;
 }
 
-gboolean
-seaf_filelock_manager_is_file_locked (SeafFilelockManager *mgr,
-                                      const char *repo_id,
-                                      const char *path)
+/* Returns the locked_by_me value of @path, or -1 if it's not locked. */
+static int
+lookup_lock (SeafFilelockManager *mgr, const char *repo_id, const char *path)
 {
-    gboolean ret;
+    GHashTable *locks;
+    LockInfo *info = NULL;
+    int ret;
 
-    pthread_mutex_lock (&mgr->priv->hash_lock);
+    pthread_rwlock_rdlock (&mgr->priv->hash_lock);
 
-    GHashTable *locks = g_hash_table_lookup (mgr->priv->repo_locked_files, repo_id);
-    if (!locks) {
-        pthread_mutex_unlock (&mgr->priv->hash_lock);
-        return FALSE;
-    }
+    locks = g_hash_table_lookup (mgr->priv->repo_locked_files, repo_id);
+    if (locks)
+        info = g_hash_table_lookup (locks, path);
+    ret = info ? info->locked_by_me : -1;
 
-    LockInfo *info = g_hash_table_lookup (locks, path);
-    if (!info) {
-        pthread_mutex_unlock (&mgr->priv->hash_lock);
-        return FALSE;
-    }
-    ret = !info->locked_by_me;
+    pthread_rwlock_unlock (&mgr->priv->hash_lock);
 
-    pthread_mutex_unlock (&mgr->priv->hash_lock);
     return ret;
 }
 
+gboolean
+seaf_filelock_manager_is_file_locked (SeafFilelockManager *mgr,
+                                      const char *repo_id,
+                                      const char *path)
+{
+    return (lookup_lock (mgr, repo_id, path) == LOCKED_OTHERS);
+}
+
 gboolean
 seaf_filelock_manager_is_file_locked_by_me (SeafFilelockManager *mgr,
                                             const char *repo_id,
                                             const char *path)
 {
-    gboolean ret;
-
-    pthread_mutex_lock (&mgr->priv->hash_lock);
-
-    GHashTable *locks = g_hash_table_lookup (mgr->priv->repo_locked_files, repo_id);
-    if (!locks) {
-        pthread_mutex_unlock (&mgr->priv->hash_lock);
-        return FALSE;
-    }
-
-    LockInfo *info = g_hash_table_lookup (locks, path);
-    if (!info) {
-        pthread_mutex_unlock (&mgr->priv->hash_lock);
-        return FALSE;
-    }
-    ret = (info->locked_by_me > 0);
-
-    pthread_mutex_unlock (&mgr->priv->hash_lock);
-    return ret;
+    return (lookup_lock (mgr, repo_id, path) > 0);
 }
 
 int
@@ -216,31 +227,16 @@ seaf_filelock_manager_get_lock_status (SeafFilelockManager *mgr,
                                        const char *repo_id,
                                        const char *path)
 {
-    int ret;
-
-    pthread_mutex_lock (&mgr->priv->hash_lock);
+    int locked_by_me = lookup_lock (mgr, repo_id, path);
 
-    GHashTable *locks = g_hash_table_lookup (mgr->priv->repo_locked_files, repo_id);
-    if (!locks) {
-        pthread_mutex_unlock (&mgr->priv->hash_lock);
+    if (locked_by_me < 0)
         return FILE_NOT_LOCKED;
-    }
-
-    LockInfo *info = g_hash_table_lookup (locks, path);
-    if (!info) {
-        pthread_mutex_unlock (&mgr->priv->hash_lock);
-        return FILE_NOT_LOCKED;
-    }
-
-    if (info->locked_by_me == LOCKED_MANUAL)
-        ret = FILE_LOCKED_BY_ME_MANUAL;
-    else if (info->locked_by_me == LOCKED_AUTO)
-        ret = FILE_LOCKED_BY_ME_AUTO;
+    else if (locked_by_me == LOCKED_MANUAL)
+        return FILE_LOCKED_BY_ME_MANUAL;
+    else if (locked_by_me == LOCKED_AUTO)
+        return FILE_LOCKED_BY_ME_AUTO;
     else
-        ret = FILE_LOCKED_BY_OTHERS;
-
-    pthread_mutex_unlock (&mgr->priv->hash_lock);
-    return ret;
+        return FILE_LOCKED_BY_OTHERS;
 }
 
 void
@@ -280,40 +276,69 @@ seaf_filelock_manager_unlock_wt_file (SeafFilelockManager *mgr,
 }
 
 static void
-update_in_memory (SeafFilelockManager *mgr, const char *repo_id, GHashTable *new_locks)
+lock_change_free (LockChange *change)
 {
-    GHashTable *repo_hash = mgr->priv->repo_locked_files;
+    g_free (change->path);
+    g_free (change);
+}
 
-    pthread_mutex_lock (&mgr->priv->hash_lock);
+static void
+add_lock_change (GList **changes, const char *path,
+                 int locked_by_me, gboolean removed)
+{
+    LockChange *change = g_new0 (LockChange, 1);
 
-    GHashTable *locks = g_hash_table_lookup (repo_hash, repo_id);
+    change->path = g_strdup (path);
+    change->locked_by_me = locked_by_me;
+    change->removed = removed;
+    *changes = g_list_prepend (*changes, change);
+}
 
-    if (!locks) {
-        if (g_hash_table_size (new_locks) == 0) {
-            pthread_mutex_unlock (&mgr->priv->hash_lock);
-            return;
-        }
-        locks = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                       g_free, (GDestroyNotify)lock_info_free);
-        g_hash_table_insert (repo_hash, g_strdup(repo_id), locks);
-    }
+#ifdef WIN32
+static void
+add_refresh_path (SeafRepo *repo, const char *path)
+{
+    char *fullpath = g_build_path ("/", repo->worktree, path, NULL);
+    seaf_sync_manager_add_refresh_path (seaf->sync_mgr, fullpath);
+    g_free (fullpath);
+}
+#endif
 
+/* Apply the difference between the current locks of the repo and @new_locks.
+ * Returns the changed rows to be written to db.
+ */
+static GList *
+update_in_memory (SeafFilelockManager *mgr, const char *repo_id, GHashTable *new_locks)
+{
+    GHashTable *repo_hash = mgr->priv->repo_locked_files;
     GHashTableIter iter;
     gpointer key, value;
     gpointer new_key, new_val;
     char *path;
-#ifdef WIN32
-    char *fullpath;
-#endif
     LockInfo *info;
     gboolean exists;
     int locked_by_me;
     SeafRepo *repo;
+    GList *changes = NULL;
 
     repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
     if (!repo) {
         seaf_warning ("Failed to find repo %s\n", repo_id);
-        return;
+        return NULL;
+    }
+
+    pthread_rwlock_wrlock (&mgr->priv->hash_lock);
+
+    GHashTable *locks = g_hash_table_lookup (repo_hash, repo_id);
+
+    if (!locks) {
+        if (g_hash_table_size (new_locks) == 0) {
+            pthread_rwlock_unlock (&mgr->priv->hash_lock);
+            return NULL;
+        }
+        locks = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                       g_free, (GDestroyNotify)lock_info_free);
+        g_hash_table_insert (repo_hash, g_strdup(repo_id), locks);
     }
 
     g_hash_table_iter_init (&iter, locks);
@@ -324,30 +349,27 @@ update_in_memory (SeafFilelockManager *mgr, const char *repo_id, GHashTable *new
         exists = g_hash_table_lookup_extended (new_locks, path, &new_key, &new_val);
         if (!exists) {
 #ifdef WIN32
-            fullpath = g_build_path ("/", repo->worktree, path, NULL);
-            seaf_sync_manager_add_refresh_path (seaf->sync_mgr, fullpath);
-            g_free (fullpath);
+            add_refresh_path (repo, path);
 #endif
             seaf_filelock_manager_unlock_wt_file (mgr, repo_id, path);
+            add_lock_change (&changes, path, 0, TRUE);
             g_hash_table_iter_remove (&iter);
         } else {
             locked_by_me = (int)(long)new_val;
             if (!info->locked_by_me && locked_by_me) {
 #ifdef WIN32
-                fullpath = g_build_path ("/", repo->worktree, path, NULL);
-                seaf_sync_manager_add_refresh_path (seaf->sync_mgr, fullpath);
-                g_free (fullpath);
+                add_refresh_path (repo, path);
 #endif
                 seaf_filelock_manager_unlock_wt_file (mgr, repo_id, path);
                 info->locked_by_me = locked_by_me;
+                add_lock_change (&changes, path, locked_by_me, FALSE);
             } else if (info->locked_by_me && !locked_by_me) {
 #ifdef WIN32
-                fullpath = g_build_path ("/", repo->worktree, path, NULL);
-                seaf_sync_manager_add_refresh_path (seaf->sync_mgr, fullpath);
-                g_free (fullpath);
+                add_refresh_path (repo, path);
 #endif
                 seaf_filelock_manager_lock_wt_file (mgr, repo_id, path);
                 info->locked_by_me = locked_by_me;
+                add_lock_change (&changes, path, locked_by_me, FALSE);
             }
         }
     }
@@ -361,89 +383,77 @@ update_in_memory (SeafFilelockManager *mgr, const char *repo_id, GHashTable *new
             info->locked_by_me = locked_by_me;
             g_hash_table_insert (locks, g_strdup(path), info);
 #ifdef WIN32
-            fullpath = g_build_path ("/", repo->worktree, path, NULL);
-            seaf_sync_manager_add_refresh_path (seaf->sync_mgr, fullpath);
-            g_free (fullpath);
+            add_refresh_path (repo, path);
 #endif
             if (!locked_by_me) {
                 seaf_filelock_manager_lock_wt_file (mgr, repo_id, path);
             }
+            add_lock_change (&changes, path, locked_by_me, FALSE);
         }
     }
 
-    pthread_mutex_unlock (&mgr->priv->hash_lock);
-}
+    if (g_hash_table_size (locks) == 0)
+        g_hash_table_remove (repo_hash, repo_id);
 
-static gint
-compare_paths (gconstpointer a, gconstpointer b)
-{
-    const char *patha = a, *pathb = b;
+    pthread_rwlock_unlock (&mgr->priv->hash_lock);
 
-    return strcmp (patha, pathb);
+    return changes;
 }
 
+/* Write the changed rows in one transaction. */
 static int
-update_db (SeafFilelockManager *mgr, const char *repo_id)
+update_db (SeafFilelockManager *mgr, const char *repo_id, GList *changes)
 {
-    char *sql;
-    sqlite3_stmt *stmt;
-    GHashTable *locks;
-    GList *paths, *ptr;
-    char *path;
-    LockInfo *info;
-
-    pthread_mutex_lock (&mgr->priv->db_lock);
-
-    sql = "DELETE FROM ServerLockedFiles WHERE repo_id = ?";
-    stmt = sqlite_query_prepare (mgr->priv->db, sql);
-    sqlite3_bind_text (stmt, 1, repo_id, -1, SQLITE_TRANSIENT);
-    if (sqlite3_step (stmt) != SQLITE_DONE) {
-        seaf_warning ("Failed to remove server locked files for %.8s: %s.\n",
-                      repo_id, sqlite3_errmsg (mgr->priv->db));
-        sqlite3_finalize (stmt);
-        pthread_mutex_unlock (&mgr->priv->db_lock);
-        return -1;
-    }
-    sqlite3_finalize (stmt);
+    sqlite3_stmt *replace_stmt, *delete_stmt, *stmt;
+    GList *ptr;
+    LockChange *change;
 
-    locks = g_hash_table_lookup (mgr->priv->repo_locked_files, repo_id);
-    if (!locks || g_hash_table_size (locks) == 0) {
-        pthread_mutex_unlock (&mgr->priv->db_lock);
+    if (!changes)
         return 0;
-    }
 
-    paths = g_hash_table_get_keys (locks);
-    paths = g_list_sort (paths, compare_paths);
+    pthread_mutex_lock (&mgr->priv->db_lock);
 
-    sql = "INSERT INTO ServerLockedFiles (repo_id, path, locked_by_me) VALUES (?, ?, ?)";
-    stmt = sqlite_query_prepare (mgr->priv->db, sql);
+    sqlite_batch_begin (mgr->priv->db);
 
-    for (ptr = paths; ptr; ptr = ptr->next) {
-        path = ptr->data;
-        info = g_hash_table_lookup (locks, path);
+    replace_stmt = sqlite_stmt_cache_get (mgr->priv->stmts,
+                                          "REPLACE INTO ServerLockedFiles "
+                                          "(repo_id, path, locked_by_me) VALUES (?, ?, ?)");
+    delete_stmt = sqlite_stmt_cache_get (mgr->priv->stmts,
+                                         "DELETE FROM ServerLockedFiles "
+                                         "WHERE repo_id = ? AND path = ?");
+    if (!replace_stmt || !delete_stmt)
+        goto error;
+
+    for (ptr = changes; ptr; ptr = ptr->next) {
+        change = ptr->data;
+        stmt = change->removed ? delete_stmt : replace_stmt;
 
         sqlite3_bind_text (stmt, 1, repo_id, -1, SQLITE_TRANSIENT);
-        sqlite3_bind_text (stmt, 2, path, -1, SQLITE_TRANSIENT);
-        sqlite3_bind_int (stmt, 3, info->locked_by_me);
+        sqlite3_bind_text (stmt, 2, change->path, -1, SQLITE_TRANSIENT);
+        if (!change->removed)
+            sqlite3_bind_int (stmt, 3, change->locked_by_me);
 
         if (sqlite3_step (stmt) != SQLITE_DONE) {
-            seaf_warning ("Failed to insert server file lock for %.8s: %s.\n",
+            seaf_warning ("Failed to update server file lock for %.8s: %s.\n",
                           repo_id, sqlite3_errmsg (mgr->priv->db));
-            sqlite3_finalize (stmt);
-            pthread_mutex_unlock (&mgr->priv->db_lock);
-            return -1;
+            sqlite3_reset (stmt);
+            goto error;
         }
 
         sqlite3_reset (stmt);
         sqlite3_clear_bindings (stmt);
     }
 
-    sqlite3_finalize (stmt);
-    g_list_free (paths);
+    sqlite_batch_end (mgr->priv->db, TRUE);
 
     pthread_mutex_unlock (&mgr->priv->db_lock);
 
     return 0;
+
+error:
+    sqlite_batch_end (mgr->priv->db, FALSE);
+    pthread_mutex_unlock (&mgr->priv->db_lock);
+    return -1;
 }
 
 int
@@ -451,9 +461,14 @@ seaf_filelock_manager_update (SeafFilelockManager *mgr,
                               const char *repo_id,
                               GHashTable *new_locked_files)
 {
-    update_in_memory (mgr, repo_id, new_locked_files);
+    GList *changes;
+    int ret;
 
-    int ret = update_db (mgr, repo_id);
+    changes = update_in_memory (mgr, repo_id, new_locked_files);
+
+    ret = update_db (mgr, repo_id, changes);
+
+    g_list_free_full (changes, (GDestroyNotify)lock_change_free);
 
     return ret;
 }
@@ -534,9 +549,9 @@ seaf_filelock_manager_remove (SeafFilelockManager *mgr,
 
     pthread_mutex_unlock (&mgr->priv->db_lock);
 
-    pthread_mutex_lock (&mgr->priv->hash_lock);
+    pthread_rwlock_wrlock (&mgr->priv->hash_lock);
     g_hash_table_remove (mgr->priv->repo_locked_files, repo_id);
-    pthread_mutex_unlock (&mgr->priv->hash_lock);
+    pthread_rwlock_unlock (&mgr->priv->hash_lock);
 
     return 0;
 }
@@ -569,18 +584,22 @@ mark_file_locked_in_db (SeafFilelockManager *mgr,
     pthread_mutex_lock (&mgr->priv->db_lock);
 
     sql = "REPLACE INTO ServerLockedFiles (repo_id, path, locked_by_me) VALUES (?, ?, ?)";
-    stmt = sqlite_query_prepare (mgr->priv->db, sql);
+    stmt = sqlite_stmt_cache_get (mgr->priv->stmts, sql);
+    if (!stmt) {
+        pthread_mutex_unlock (&mgr->priv->db_lock);
+        return -1;
+    }
     sqlite3_bind_text (stmt, 1, repo_id, -1, SQLITE_TRANSIENT);
     sqlite3_bind_text (stmt, 2, path, -1, SQLITE_TRANSIENT);
     sqlite3_bind_int (stmt, 3, locked_by_me);
     if (sqlite3_step (stmt) != SQLITE_DONE) {
         seaf_warning ("Failed to update server locked files for %.8s: %s.\n",
                       repo_id, sqlite3_errmsg (mgr->priv->db));
-        sqlite3_finalize (stmt);
+        sqlite3_reset (stmt);
         pthread_mutex_unlock (&mgr->priv->db_lock);
         return -1;
     }
-    sqlite3_finalize (stmt);
+    sqlite3_reset (stmt);
 
     pthread_mutex_unlock (&mgr->priv->db_lock);
 
@@ -596,7 +615,7 @@ seaf_filelock_manager_mark_file_locked (SeafFilelockManager *mgr,
     GHashTable *locks;
     LockInfo *info;
 
-    pthread_mutex_lock (&mgr->priv->hash_lock);
+    pthread_rwlock_wrlock (&mgr->priv->hash_lock);
 
     locks = g_hash_table_lookup (mgr->priv->repo_locked_files, repo_id);
     if (!locks) {
@@ -614,13 +633,13 @@ seaf_filelock_manager_mark_file_locked (SeafFilelockManager *mgr,
 
     info->locked_by_me = type;
 
-    pthread_mutex_unlock (&mgr->priv->hash_lock);
+    pthread_rwlock_unlock (&mgr->priv->hash_lock);
 
 #ifdef WIN32
     refresh_locked_path_status (repo_id, path);
 #endif
 
-    return mark_file_locked_in_db (mgr, repo_id, path, info->locked_by_me);
+    return mark_file_locked_in_db (mgr, repo_id, path, type);
 }
 
 static int
@@ -634,17 +653,21 @@ remove_locked_file_from_db (SeafFilelockManager *mgr,
     pthread_mutex_lock (&mgr->priv->db_lock);
 
     sql = "DELETE FROM ServerLockedFiles WHERE repo_id = ? AND path = ?";
-    stmt = sqlite_query_prepare (mgr->priv->db, sql);
+    stmt = sqlite_stmt_cache_get (mgr->priv->stmts, sql);
+    if (!stmt) {
+        pthread_mutex_unlock (&mgr->priv->db_lock);
+        return -1;
+    }
     sqlite3_bind_text (stmt, 1, repo_id, -1, SQLITE_TRANSIENT);
     sqlite3_bind_text (stmt, 2, path, -1, SQLITE_TRANSIENT);
     if (sqlite3_step (stmt) != SQLITE_DONE) {
         seaf_warning ("Failed to remove locked file %s from %.8s: %s.\n",
                       path, repo_id, sqlite3_errmsg (mgr->priv->db));
-        sqlite3_finalize (stmt);
+        sqlite3_reset (stmt);
         pthread_mutex_unlock (&mgr->priv->db_lock);
         return -1;
     }
-    sqlite3_finalize (stmt);
+    sqlite3_reset (stmt);
 
     pthread_mutex_unlock (&mgr->priv->db_lock);
 
@@ -658,17 +681,17 @@ seaf_filelock_manager_mark_file_unlocked (SeafFilelockManager *mgr,
 {
     GHashTable *locks;
 
-    pthread_mutex_lock (&mgr->priv->hash_lock);
+    pthread_rwlock_wrlock (&mgr->priv->hash_lock);
 
     locks = g_hash_table_lookup (mgr->priv->repo_locked_files, repo_id);
     if (!locks) {
-        pthread_mutex_unlock (&mgr->priv->hash_lock);
+        pthread_rwlock_unlock (&mgr->priv->hash_lock);
         return 0;
     }
 
     g_hash_table_remove (locks, path);
 
-    pthread_mutex_unlock (&mgr->priv->hash_lock);
+    pthread_rwlock_unlock (&mgr->priv->hash_lock);
 
 #ifdef WIN32
     refresh_locked_path_status (repo_id, path);
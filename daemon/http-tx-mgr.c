@@ -8,6 +8,7 @@
 #include <curl/curl.h>
 #include <jansson.h>
 #include <event2/buffer.h>
+#include <zlib.h>
 
 #ifdef WIN32
 #include <windows.h>
@@ -26,10 +27,22 @@
 
 #include "seafile-session.h"
 #include "http-tx-mgr.h"
+#include "server-block-cache.h"
+#include "shared-block-cache.h"
+#include "content-index.h"
+#include "transfer-journal.h"
+#include "transfer-concurrency.h"
+#include "bandwidth-scheduler.h"
+#include "transfer-policy.h"
 
 #include "seafile-error-impl.h"
 #include "utils.h"
+#include "sha1-util.h"
 #include "diff-simple.h"
+#include "metrics.h"
+#include "trace.h"
+#include "executor.h"
+#include "mem-budget.h"
 
 #define DEBUG_FLAG SEAFILE_DEBUG_TRANSFER
 #include "log.h"
@@ -37,6 +50,7 @@
 #include "timer.h"
 
 #define HTTP_OK 200
+#define HTTP_PARTIAL_CONTENT 206
 #define HTTP_BAD_REQUEST 400
 #define HTTP_REQUEST_TIME_OUT 408
 #define HTTP_FORBIDDEN 403
@@ -83,6 +97,13 @@ struct _ConnectionPool {
     GQueue *queue;
     pthread_mutex_t lock;
     int err_cnt;
+    /* Shared by all block transfers to this host. */
+    TransferConcurrency *concurrency;
+    /* Set from the protocol version check. */
+    gboolean block_deflate;
+    gboolean block_pack;
+    /* A connection is being opened ahead of a sync. */
+    gboolean warming_up;
 };
 typedef struct _ConnectionPool ConnectionPool;
 
@@ -100,6 +121,22 @@ struct _HttpTxPriv {
     /* Regex to parse error message returned by update-branch. */
     GRegex *locked_error_regex;
     GRegex *folder_perm_error_regex;
+
+    TransferJournal *journal;
+
+    /* repo_id -> PreUpload, see http_tx_manager_pre_upload_start(). */
+    GHashTable *pre_uploads;
+    pthread_mutex_t pre_upload_lock;
+
+    /* Share the rate limits between tasks. */
+    BandwidthScheduler *upload_sched;
+    BandwidthScheduler *download_sched;
+
+    /* DNS cache, TLS sessions and open connections shared by all
+     * connections, so that a new connection rarely needs a full handshake.
+     */
+    CURLSH *curl_share;
+    pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
 };
 typedef struct _HttpTxPriv HttpTxPriv;
 
@@ -133,6 +170,7 @@ http_tx_task_new (HttpTxManager *mgr,
         task->worktree = g_strdup(worktree);
 
     task->error = SYNC_ERROR_ID_NO_ERROR;
+    sync_phase_timer_init (&task->timer);
 
     return task;
 }
@@ -149,6 +187,8 @@ http_tx_task_free (HttpTxTask *task)
     if (task->type == HTTP_TASK_TYPE_DOWNLOAD) {
         g_hash_table_destroy (task->blk_ref_cnts);
     }
+    server_block_cache_free (task->block_cache);
+    bandwidth_flow_free (task->flow);
     g_free (task);
 }
 
@@ -196,6 +236,7 @@ connection_pool_new (const char *host)
     pool->host = g_strdup(host);
     pool->queue = g_queue_new ();
     pthread_mutex_init (&pool->lock, NULL);
+    pool->concurrency = transfer_concurrency_new ();
     return pool;
 }
 
@@ -270,6 +311,73 @@ connection_pool_return_connection (ConnectionPool *pool, Connection *conn)
     pthread_mutex_unlock (&pool->lock);
 }
 
+static void
+share_lock_cb (CURL *handle, curl_lock_data data,
+               curl_lock_access access, void *userptr)
+{
+    HttpTxPriv *priv = userptr;
+
+    pthread_mutex_lock (&priv->share_locks[data]);
+}
+
+static void
+share_unlock_cb (CURL *handle, curl_lock_data data, void *userptr)
+{
+    HttpTxPriv *priv = userptr;
+
+    pthread_mutex_unlock (&priv->share_locks[data]);
+}
+
+static CURLSH *
+create_curl_share (HttpTxPriv *priv)
+{
+    CURLSH *share;
+    int i;
+
+    share = curl_share_init ();
+    if (!share) {
+        seaf_warning ("Failed to create curl share handle.\n");
+        return NULL;
+    }
+
+    for (i = 0; i < CURL_LOCK_DATA_LAST; ++i)
+        pthread_mutex_init (&priv->share_locks[i], NULL);
+
+    curl_share_setopt (share, CURLSHOPT_LOCKFUNC, share_lock_cb);
+    curl_share_setopt (share, CURLSHOPT_UNLOCKFUNC, share_unlock_cb);
+    curl_share_setopt (share, CURLSHOPT_USERDATA, priv);
+
+    curl_share_setopt (share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt (share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900 /* 7.57.0 */
+    curl_share_setopt (share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+
+    return share;
+}
+
+/* Options every request needs. They are set per request since connections
+ * are reset after use.
+ */
+static void
+set_connection_options (CURL *curl)
+{
+    HttpTxPriv *priv = seaf->http_tx_mgr->priv;
+
+    if (priv->curl_share)
+        curl_easy_setopt (curl, CURLOPT_SHARE, priv->curl_share);
+
+#if LIBCURL_VERSION_NUM >= 0x071900 /* 7.25.0 */
+    if (seaf->tcp_keepalive_idle > 0) {
+        curl_easy_setopt (curl, CURLOPT_TCP_KEEPALIVE, 1L);
+        curl_easy_setopt (curl, CURLOPT_TCP_KEEPIDLE,
+                          (long)seaf->tcp_keepalive_idle);
+        curl_easy_setopt (curl, CURLOPT_TCP_KEEPINTVL,
+                          (long)seaf->tcp_keepalive_idle);
+    }
+#endif
+}
+
 #define LOCKED_ERROR_PATTERN "File (.+) is locked"
 #define FOLDER_PERM_ERROR_PATTERN "Update to path (.+) is not allowed by folder permission settings"
 
@@ -281,6 +389,9 @@ http_tx_manager_new (struct _SeafileSession *seaf)
 
     mgr->seaf = seaf;
 
+    priv->upload_sched = bandwidth_scheduler_new ();
+    priv->download_sched = bandwidth_scheduler_new ();
+
     priv->download_tasks = g_hash_table_new_full (g_str_hash, g_str_equal,
                                                   g_free,
                                                   (GDestroyNotify)http_tx_task_free);
@@ -291,6 +402,12 @@ http_tx_manager_new (struct _SeafileSession *seaf)
     priv->connection_pools = g_hash_table_new (g_str_hash, g_str_equal);
     pthread_mutex_init (&priv->pools_lock, NULL);
 
+    priv->pre_uploads = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                               g_free, NULL);
+    pthread_mutex_init (&priv->pre_upload_lock, NULL);
+
+    priv->curl_share = create_curl_share (priv);
+
     priv->ca_bundle_path = g_build_filename (seaf->seaf_dir, "ca-bundle.pem", NULL);
 
     GError *error = NULL;
@@ -347,6 +464,11 @@ http_tx_manager_start (HttpTxManager *mgr)
 
     /* TODO: add a timer to clean up unused Http connections. */
 
+    mgr->priv->journal = transfer_journal_open (seaf->seaf_dir);
+    if (!mgr->priv->journal)
+        seaf_warning ("Failed to open transfer journal, "
+                      "interrupted transfers will start over.\n");
+
     mgr->priv->reset_bytes_timer = seaf_timer_new (reset_bytes,
                                                    mgr,
                                                    RESET_BYTES_INTERVAL_MSEC);
@@ -671,22 +793,56 @@ sockopt_callback (void *clientp, curl_socket_t curlfd, curlsocktype purpose)
 #endif  /* WIN32 */
 
 typedef struct _HttpResponse {
+    CURL *curl;
     char *content;
     size_t size;
+    size_t capacity;
 } HttpResponse;
 
+/* A larger Content-Length is only trusted as the data arrives. */
+#define MAX_PRESIZED_RESPONSE (64 << 20)
+
+/*
+ * The buffer is allocated for the whole body when the server sends its
+ * length, and grown by doubling otherwise, so that large responses are
+ * not copied for every chunk received.
+ */
 static size_t
 recv_response (void *contents, size_t size, size_t nmemb, void *userp)
 {
     size_t realsize = size * nmemb;
     HttpResponse *rsp = userp;
+    size_t capacity;
+    char *content;
+#if LIBCURL_VERSION_NUM >= 0x073700 /* 7.55.0 */
+    curl_off_t length = -1;
+#endif
 
-    rsp->content = g_realloc (rsp->content, rsp->size + realsize);
     if (!rsp->content) {
+        capacity = 0;
+#if LIBCURL_VERSION_NUM >= 0x073700
+        if (curl_easy_getinfo (rsp->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T,
+                               &length) == CURLE_OK &&
+            length > 0 && length <= MAX_PRESIZED_RESPONSE)
+            capacity = (size_t)length;
+#endif
+        capacity = MAX (capacity, realsize);
+        content = g_try_malloc (capacity);
+    } else if (rsp->size + realsize > rsp->capacity) {
+        capacity = MAX (rsp->capacity * 2, rsp->size + realsize);
+        /* The old buffer is still freed with the response on failure. */
+        content = g_try_realloc (rsp->content, capacity);
+    } else {
+        capacity = rsp->capacity;
+        content = rsp->content;
+    }
+    if (!content) {
         seaf_warning ("Not enough memory.\n");
         /* return a value other than realsize to signify an error. */
         return 0;
     }
+    rsp->content = content;
+    rsp->capacity = capacity;
 
     memcpy (rsp->content + rsp->size, contents, realsize);
     rsp->size += realsize;
@@ -696,6 +852,79 @@ recv_response (void *contents, size_t size, size_t nmemb, void *userp)
 
 extern FILE *seafile_get_log_fp ();
 
+static gboolean
+is_id_path_component (const char *comp)
+{
+    const char *p;
+
+    if (is_uuid_valid (comp) || is_object_id_valid (comp))
+        return TRUE;
+
+    for (p = comp; *p != '\0'; ++p) {
+        if (!g_ascii_isalnum (*p) && *p != '-' && *p != '_' && *p != '.')
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+/*
+ * Path of @url with repo, commit and block ids replaced by ":id", so that
+ * requests to the same API share one latency histogram.
+ */
+static char *
+get_url_endpoint (const char *url)
+{
+    const char *path, *end;
+    char *tmp, **comps;
+    GString *endpoint;
+    int i;
+
+    path = strstr (url, "://");
+    path = path ? strchr (path + 3, '/') : NULL;
+    if (!path)
+        return g_strdup ("/");
+
+    end = strchr (path, '?');
+    tmp = end ? g_strndup (path, end - path) : g_strdup (path);
+    comps = g_strsplit (tmp, "/", -1);
+
+    endpoint = g_string_new (NULL);
+    for (i = 0; comps[i]; ++i) {
+        if (comps[i][0] == '\0')
+            continue;
+        g_string_append_c (endpoint, '/');
+        if (is_id_path_component (comps[i]))
+            g_string_append (endpoint, ":id");
+        else
+            g_string_append (endpoint, comps[i]);
+    }
+    if (endpoint->len == 0)
+        g_string_append_c (endpoint, '/');
+
+    g_strfreev (comps);
+    g_free (tmp);
+
+    return g_string_free (endpoint, FALSE);
+}
+
+static void
+observe_http_request (const char *method, const char *url, gint64 start)
+{
+    char *endpoint, *labels;
+
+    endpoint = get_url_endpoint (url);
+    labels = g_strdup_printf ("method=\"%s\",endpoint=\"%s\"",
+                              method, endpoint);
+    seaf_metric_observe_since (seaf_metric_get (SEAF_METRIC_HISTOGRAM,
+                                                "seaf_http_request_usec",
+                                                labels),
+                               start);
+    seaf_trace_span (method, start, endpoint);
+    g_free (labels);
+    g_free (endpoint);
+}
+
 #define HTTP_TIMEOUT_SEC 300
 
 typedef size_t (*HttpRecvCallback) (void *, size_t, size_t, void *);
@@ -735,6 +964,7 @@ http_get (CURL *curl, const char *url, const char *token,
 
     curl_easy_setopt(curl, CURLOPT_URL, url);
     curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    set_connection_options (curl);
 
     if (timeout) {
         /* Set low speed limit to 1 bytes. This effectively means no data. */
@@ -749,6 +979,7 @@ http_get (CURL *curl, const char *url, const char *token,
 
     HttpResponse rsp;
     memset (&rsp, 0, sizeof(rsp));
+    rsp.curl = curl;
     if (rsp_content) {
         curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, recv_response);
         curl_easy_setopt(curl, CURLOPT_WRITEDATA, &rsp);
@@ -779,7 +1010,9 @@ http_get (CURL *curl, const char *url, const char *token,
     curl_easy_setopt (curl, CURLOPT_SOCKOPTFUNCTION, sockopt_callback);
 #endif
 
+    gint64 start = seaf_metrics_now ();
     int rc = curl_easy_perform (curl);
+    observe_http_request ("GET", url, start);
     if (rc != 0) {
         seaf_warning ("libcurl failed to GET %s: %s.\n",
                       url, curl_easy_strerror(rc));
@@ -837,11 +1070,12 @@ send_request (void *ptr, size_t size, size_t nmemb, void *userp)
 typedef size_t (*HttpSendCallback) (void *, size_t, size_t, void *);
 
 static int
-http_put (CURL *curl, const char *url, const char *token,
-          const char *req_content, gint64 req_size,
-          HttpSendCallback callback, void *cb_data,
-          int *rsp_status, char **rsp_content, gint64 *rsp_size,
-          gboolean timeout, int *pcurl_error)
+http_put_internal (CURL *curl, const char *url, const char *token,
+                   const char *req_content, gint64 req_size,
+                   HttpSendCallback callback, void *cb_data,
+                   const char *extra_header,
+                   int *rsp_status, char **rsp_content, gint64 *rsp_size,
+                   gboolean timeout, int *pcurl_error)
 {
     char *token_header;
     struct curl_slist *headers = NULL;
@@ -862,6 +1096,9 @@ http_put (CURL *curl, const char *url, const char *token,
         g_free (token_header);
     }
 
+    if (extra_header)
+        headers = curl_slist_append (headers, extra_header);
+
     curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
 
     curl_easy_setopt(curl, CURLOPT_URL, url);
@@ -895,9 +1132,11 @@ http_put (CURL *curl, const char *url, const char *token,
     }
 
     curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    set_connection_options (curl);
 
     HttpResponse rsp;
     memset (&rsp, 0, sizeof(rsp));
+    rsp.curl = curl;
     if (rsp_content) {
         curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, recv_response);
         curl_easy_setopt(curl, CURLOPT_WRITEDATA, &rsp);
@@ -925,7 +1164,9 @@ http_put (CURL *curl, const char *url, const char *token,
     curl_easy_setopt (curl, CURLOPT_SOCKOPTFUNCTION, sockopt_callback);
 #endif
 
+    gint64 start = seaf_metrics_now ();
     int rc = curl_easy_perform (curl);
+    observe_http_request ("PUT", url, start);
     if (rc != 0) {
         seaf_warning ("libcurl failed to PUT %s: %s.\n",
                       url, curl_easy_strerror(rc));
@@ -958,17 +1199,29 @@ out:
 }
 
 static int
-http_post (CURL *curl, const char *url, const char *token,
-           const char *req_content, gint64 req_size,
-           int *rsp_status, char **rsp_content, gint64 *rsp_size,
-           gboolean timeout, int *pcurl_error)
+http_put (CURL *curl, const char *url, const char *token,
+          const char *req_content, gint64 req_size,
+          HttpSendCallback callback, void *cb_data,
+          int *rsp_status, char **rsp_content, gint64 *rsp_size,
+          gboolean timeout, int *pcurl_error)
+{
+    return http_put_internal (curl, url, token, req_content, req_size,
+                              callback, cb_data, NULL,
+                              rsp_status, rsp_content, rsp_size,
+                              timeout, pcurl_error);
+}
+
+static int
+http_post_internal (CURL *curl, const char *url, const char *token,
+                    HttpSendCallback callback, curl_seek_callback seek_cb,
+                    void *cb_data, gint64 req_size,
+                    int *rsp_status, char **rsp_content, gint64 *rsp_size,
+                    gboolean timeout, int *pcurl_error)
 {
     char *token_header;
     struct curl_slist *headers = NULL;
     int ret = 0;
 
-    g_return_val_if_fail (req_content != NULL, -1);
-
     if (seafile_debug_flag_is_set (SEAFILE_DEBUG_CURL)) {
         curl_easy_setopt (curl, CURLOPT_VERBOSE, 1);
         curl_easy_setopt (curl, CURLOPT_STDERR, seafile_get_log_fp());
@@ -1000,18 +1253,20 @@ http_post (CURL *curl, const char *url, const char *token,
         curl_easy_setopt (curl, CURLOPT_SSL_VERIFYHOST, 0L);
     }
 
-    HttpRequest req;
-    memset (&req, 0, sizeof(req));
-    req.content = req_content;
-    req.size = req_size;
-    curl_easy_setopt(curl, CURLOPT_READFUNCTION, send_request);
-    curl_easy_setopt(curl, CURLOPT_READDATA, &req);
+    curl_easy_setopt(curl, CURLOPT_READFUNCTION, callback);
+    curl_easy_setopt(curl, CURLOPT_READDATA, cb_data);
+    if (seek_cb) {
+        curl_easy_setopt(curl, CURLOPT_SEEKFUNCTION, seek_cb);
+        curl_easy_setopt(curl, CURLOPT_SEEKDATA, cb_data);
+    }
     curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)req_size);
 
     curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    set_connection_options (curl);
 
     HttpResponse rsp;
     memset (&rsp, 0, sizeof(rsp));
+    rsp.curl = curl;
     if (rsp_content) {
         curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, recv_response);
         curl_easy_setopt(curl, CURLOPT_WRITEDATA, &rsp);
@@ -1041,7 +1296,9 @@ http_post (CURL *curl, const char *url, const char *token,
     curl_easy_setopt (curl, CURLOPT_SOCKOPTFUNCTION, sockopt_callback);
 #endif
 
+    gint64 start = seaf_metrics_now ();
     int rc = curl_easy_perform (curl);
+    observe_http_request ("POST", url, start);
     if (rc != 0) {
         seaf_warning ("libcurl failed to POST %s: %s.\n",
                       url, curl_easy_strerror(rc));
@@ -1073,6 +1330,95 @@ out:
     return ret;
 }
 
+static int
+http_post (CURL *curl, const char *url, const char *token,
+           const char *req_content, gint64 req_size,
+           int *rsp_status, char **rsp_content, gint64 *rsp_size,
+           gboolean timeout, int *pcurl_error)
+{
+    HttpRequest req;
+
+    g_return_val_if_fail (req_content != NULL, -1);
+
+    memset (&req, 0, sizeof(req));
+    req.content = req_content;
+    req.size = req_size;
+
+    return http_post_internal (curl, url, token, send_request, NULL, &req,
+                               req_size, rsp_status, rsp_content, rsp_size,
+                               timeout, pcurl_error);
+}
+
+/* Sends the request body straight from the chains of an evbuffer, without
+ * making it contiguous first. Seeking lets curl rewind the body when it has
+ * to resend the request.
+ */
+typedef struct _EvbufferRequest {
+    struct evbuffer *buf;
+    size_t offset;
+} EvbufferRequest;
+
+#define EVBUFFER_REQUEST_IOVECS 16
+
+static size_t
+send_evbuffer_request (void *ptr, size_t size, size_t nmemb, void *userp)
+{
+    EvbufferRequest *req = userp;
+    size_t realsize = size * nmemb;
+    size_t copied = 0, copy_size;
+    struct evbuffer_ptr pos;
+    struct evbuffer_iovec vec[EVBUFFER_REQUEST_IOVECS];
+    int n, i;
+
+    if (req->offset >= evbuffer_get_length (req->buf))
+        return 0;
+
+    if (evbuffer_ptr_set (req->buf, &pos, req->offset, EVBUFFER_PTR_SET) < 0)
+        return CURL_READFUNC_ABORT;
+
+    n = evbuffer_peek (req->buf, realsize, &pos, vec, EVBUFFER_REQUEST_IOVECS);
+    n = MIN (n, EVBUFFER_REQUEST_IOVECS);
+    for (i = 0; i < n && copied < realsize; ++i) {
+        copy_size = MIN (vec[i].iov_len, realsize - copied);
+        memcpy ((char *)ptr + copied, vec[i].iov_base, copy_size);
+        copied += copy_size;
+    }
+    req->offset += copied;
+
+    return copied;
+}
+
+static int
+seek_evbuffer_request (void *userp, curl_off_t offset, int origin)
+{
+    EvbufferRequest *req = userp;
+
+    if (origin != SEEK_SET || offset < 0 ||
+        offset > (curl_off_t)evbuffer_get_length (req->buf))
+        return CURL_SEEKFUNC_CANTSEEK;
+
+    req->offset = (size_t)offset;
+    return CURL_SEEKFUNC_OK;
+}
+
+static int
+http_post_evbuffer (CURL *curl, const char *url, const char *token,
+                    struct evbuffer *buf,
+                    int *rsp_status, char **rsp_content, gint64 *rsp_size,
+                    gboolean timeout, int *pcurl_error)
+{
+    EvbufferRequest req;
+
+    req.buf = buf;
+    req.offset = 0;
+
+    return http_post_internal (curl, url, token,
+                               send_evbuffer_request, seek_evbuffer_request,
+                               &req, (gint64)evbuffer_get_length (buf),
+                               rsp_status, rsp_content, rsp_size,
+                               timeout, pcurl_error);
+}
+
 static int
 http_error_to_http_task_error (int status)
 {
@@ -1187,8 +1533,34 @@ typedef struct {
     gboolean not_supported;
     int version;
     int error_code;
+    gboolean block_deflate;
+    gboolean block_pack;
+    gboolean head_commits_delta;
 } CheckProtocolData;
 
+/* Servers that can decode deflate encoded blocks list "deflate" in the
+ * "block_encodings" member of the protocol version response.
+ */
+static gboolean
+block_deflate_supported (json_t *object)
+{
+    json_t *encodings, *item;
+    size_t i;
+
+    encodings = json_object_get (object, "block_encodings");
+    if (!encodings || !json_is_array (encodings))
+        return FALSE;
+
+    for (i = 0; i < json_array_size (encodings); ++i) {
+        item = json_array_get (encodings, i);
+        if (json_is_string (item) &&
+            g_strcmp0 (json_string_value (item), "deflate") == 0)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
 static int
 parse_protocol_version (const char *rsp_content, int rsp_size, CheckProtocolData *data)
 {
@@ -1205,6 +1577,11 @@ parse_protocol_version (const char *rsp_content, int rsp_size, CheckProtocolData
     if (json_object_has_member (object, "version")) {
         version = json_object_get_int_member (object, "version");
         data->version = version;
+        data->block_deflate = block_deflate_supported (object);
+        /* Servers that accept and return packs of small blocks. */
+        data->block_pack = json_is_true (json_object_get (object, "block_pack"));
+        data->head_commits_delta = json_is_true (json_object_get (object,
+                                                                  "head_commits_delta"));
     } else {
         seaf_warning ("Response doesn't contain protocol version.\n");
         json_decref (object);
@@ -1261,6 +1638,8 @@ check_protocol_version_thread (void *vdata)
             data->not_supported = TRUE;
         else if (parse_protocol_version (rsp_content, rsp_size, data) < 0)
             data->not_supported = TRUE;
+        pool->block_deflate = data->block_deflate;
+        pool->block_pack = data->block_pack;
     } else {
         seaf_warning ("Bad response code for GET %s: %d.\n", url, status);
         data->not_supported = TRUE;
@@ -1286,6 +1665,7 @@ check_protocol_version_done (void *vdata)
     result.not_supported = data->not_supported;
     result.version = data->version;
     result.error_code = data->error_code;
+    result.head_commits_delta = data->head_commits_delta;
 
     data->callback (&result, data->user_data);
 
@@ -1307,10 +1687,11 @@ http_tx_manager_check_protocol_version (HttpTxManager *manager,
     data->callback = callback;
     data->user_data = user_data;
 
-    int ret = seaf_job_manager_schedule_job (seaf->job_mgr,
-                                             check_protocol_version_thread,
-                                             check_protocol_version_done,
-                                             data);
+    int ret = seaf_job_manager_schedule_class_job (seaf->job_mgr,
+                                                   SEAF_JOB_API,
+                                                   check_protocol_version_thread,
+                                                   check_protocol_version_done,
+                                                   data);
     if (ret < 0) {
         g_free (data->host);
         g_free (data);
@@ -1319,6 +1700,97 @@ http_tx_manager_check_protocol_version (HttpTxManager *manager,
     return ret;
 }
 
+typedef struct {
+    char *host;
+    gboolean use_fileserver_port;
+    ConnectionPool *pool;
+} WarmUpData;
+
+static void *
+warm_up_thread (void *vdata)
+{
+    WarmUpData *data = vdata;
+    Connection *conn;
+    char *url;
+    int status;
+    char *rsp_content = NULL;
+    gint64 rsp_size;
+    int curl_error;
+
+    conn = connection_pool_get_connection (data->pool);
+    if (!conn)
+        goto out;
+
+    /* Any cheap request will do, the point is the handshakes. */
+    if (!data->use_fileserver_port)
+        url = g_strdup_printf ("%s/seafhttp/protocol-version", data->host);
+    else
+        url = g_strdup_printf ("%s/protocol-version", data->host);
+
+    if (http_get (conn->curl, url, NULL, &status, &rsp_content, &rsp_size,
+                  NULL, NULL, TRUE, &curl_error) < 0)
+        conn->release = TRUE;
+
+    g_free (url);
+    g_free (rsp_content);
+    connection_pool_return_connection (data->pool, conn);
+
+out:
+    pthread_mutex_lock (&data->pool->lock);
+    data->pool->warming_up = FALSE;
+    pthread_mutex_unlock (&data->pool->lock);
+
+    return vdata;
+}
+
+static void
+warm_up_done (void *vdata)
+{
+    WarmUpData *data = vdata;
+
+    g_free (data->host);
+    g_free (data);
+}
+
+void
+http_tx_manager_warm_up_host (HttpTxManager *manager,
+                              const char *host,
+                              gboolean use_fileserver_port)
+{
+    ConnectionPool *pool;
+    WarmUpData *data;
+    gboolean need_warm_up;
+
+    pool = find_connection_pool (manager->priv, host);
+    if (!pool)
+        return;
+
+    pthread_mutex_lock (&pool->lock);
+    need_warm_up = (!pool->warming_up && g_queue_is_empty (pool->queue));
+    if (need_warm_up)
+        pool->warming_up = TRUE;
+    pthread_mutex_unlock (&pool->lock);
+
+    if (!need_warm_up)
+        return;
+
+    data = g_new0 (WarmUpData, 1);
+    data->host = g_strdup (host);
+    data->use_fileserver_port = use_fileserver_port;
+    data->pool = pool;
+
+    if (seaf_job_manager_schedule_class_job (seaf->job_mgr,
+                                             SEAF_JOB_API,
+                                             warm_up_thread,
+                                             warm_up_done,
+                                             data) < 0) {
+        pthread_mutex_lock (&pool->lock);
+        pool->warming_up = FALSE;
+        pthread_mutex_unlock (&pool->lock);
+        warm_up_done (data);
+    }
+}
+
 typedef struct {
     char *host;
     gboolean use_notif_server_port;
@@ -1406,10 +1878,11 @@ http_tx_manager_check_notif_server (HttpTxManager *manager,
     data->callback = callback;
     data->user_data = user_data;
 
-    int ret = seaf_job_manager_schedule_job (seaf->job_mgr,
-                                             check_notif_server_thread,
-                                             check_notif_server_done,
-                                             data);
+    int ret = seaf_job_manager_schedule_class_job (seaf->job_mgr,
+                                                   SEAF_JOB_API,
+                                                   check_notif_server_thread,
+                                                   check_notif_server_done,
+                                                   data);
     if (ret < 0) {
         g_free (data->host);
         g_free (data);
@@ -1572,10 +2045,11 @@ http_tx_manager_check_head_commit (HttpTxManager *manager,
     data->user_data = user_data;
     data->use_fileserver_port = use_fileserver_port;
 
-    if (seaf_job_manager_schedule_job (seaf->job_mgr,
-                                       check_head_commit_thread,
-                                       check_head_commit_done,
-                                       data) < 0) {
+    if (seaf_job_manager_schedule_class_job (seaf->job_mgr,
+                                             SEAF_JOB_API,
+                                             check_head_commit_thread,
+                                             check_head_commit_done,
+                                             data) < 0) {
         g_free (data->host);
         g_free (data->token);
         g_free (data);
@@ -1926,10 +2400,11 @@ http_tx_manager_get_folder_perms (HttpTxManager *manager,
     data->user_data = user_data;
     data->use_fileserver_port = use_fileserver_port;
 
-    if (seaf_job_manager_schedule_job (seaf->job_mgr,
-                                       get_folder_perms_thread,
-                                       get_folder_perms_done,
-                                       data) < 0) {
+    if (seaf_job_manager_schedule_class_job (seaf->job_mgr,
+                                             SEAF_JOB_API,
+                                             get_folder_perms_thread,
+                                             get_folder_perms_done,
+                                             data) < 0) {
         g_free (data->host);
         g_free (data);
         return -1;
@@ -2202,10 +2677,11 @@ http_tx_manager_get_locked_files (HttpTxManager *manager,
     data->user_data = user_data;
     data->use_fileserver_port = use_fileserver_port;
 
-    if (seaf_job_manager_schedule_job (seaf->job_mgr,
-                                       get_locked_files_thread,
-                                       get_locked_files_done,
-                                       data) < 0) {
+    if (seaf_job_manager_schedule_class_job (seaf->job_mgr,
+                                             SEAF_JOB_API,
+                                             get_locked_files_thread,
+                                             get_locked_files_done,
+                                             data) < 0) {
         g_free (data->host);
         g_free (data);
         return -1;
@@ -2430,10 +2906,11 @@ http_tx_manager_fileserver_api_get  (HttpTxManager *manager,
     data->callback = callback;
     data->user_data = user_data;
 
-    if (seaf_job_manager_schedule_job (seaf->job_mgr,
-                                       fileserver_api_get_request,
-                                       fileserver_api_get_request_done,
-                                       data) < 0) {
+    if (seaf_job_manager_schedule_class_job (seaf->job_mgr,
+                                             SEAF_JOB_API,
+                                             fileserver_api_get_request,
+                                             fileserver_api_get_request_done,
+                                             data) < 0) {
         g_free (data->rsp_content);
         g_free (data->host);
         g_free (data->url);
@@ -2503,49 +2980,40 @@ out:
     return ret;
 }
 
-GHashTable *
-http_tx_manager_get_head_commit_ids (HttpTxManager *manager,
-                                     const char *host,
-                                     gboolean use_fileserver_port,
-                                     GList *repo_id_list,
-                                     int *ret_status)
+static int
+post_head_commits_request (const char *host, gboolean use_fileserver_port,
+                           const char *api, char *req_content,
+                           int *ret_status, char **rsp_content, gint64 *rsp_size)
 {
     HttpTxPriv *priv = seaf->http_tx_mgr->priv;
     ConnectionPool *pool;
     Connection *conn;
     CURL *curl;
     char *url;
-    char *req_content = NULL;
-    gint64 req_size;
     int status;
-    char *rsp_content = NULL;
-    gint64 rsp_size;
-    GHashTable *map = NULL;
+    int ret = -1;
 
     pool = find_connection_pool (priv, host);
     if (!pool) {
         seaf_warning ("Failed to create connection pool for host %s.\n", host);
-        return NULL;
+        return -1;
     }
 
     conn = connection_pool_get_connection (pool);
     if (!conn) {
         seaf_warning ("Failed to get connection to host %s.\n", host);
-        return NULL;
+        return -1;
     }
 
     curl = conn->curl;
 
     if (!use_fileserver_port)
-        url = g_strdup_printf ("%s/seafhttp/repo/head-commits-multi/", host);
+        url = g_strdup_printf ("%s/seafhttp/repo/%s/", host, api);
     else
-        url = g_strdup_printf ("%s/repo/head-commits-multi/", host);
-
-    req_content = repo_id_list_to_json (repo_id_list);
-    req_size = strlen(req_content);
+        url = g_strdup_printf ("%s/repo/%s/", host, api);
 
-    if (http_post (curl, url, NULL, req_content, req_size,
-                   &status, &rsp_content, &rsp_size, TRUE, NULL) < 0) {
+    if (http_post (curl, url, NULL, req_content, strlen(req_content),
+                   &status, rsp_content, rsp_size, TRUE, NULL) < 0) {
         conn->release = TRUE;
         goto out;
     }
@@ -2557,25 +3025,152 @@ http_tx_manager_get_head_commit_ids (HttpTxManager *manager,
         goto out;
     }
 
-    map = repo_head_commit_map_from_json (rsp_content, rsp_size);
+    ret = 0;
 
 out:
     g_free (url);
     connection_pool_return_connection (pool, conn);
-    /* returned by json_dumps(). */
-    free (req_content);
-    g_free (rsp_content);
-    return map;
+    return ret;
 }
 
-static gboolean
-remove_task_help (gpointer key, gpointer value, gpointer user_data)
+GHashTable *
+http_tx_manager_get_head_commit_ids (HttpTxManager *manager,
+                                     const char *host,
+                                     gboolean use_fileserver_port,
+                                     GList *repo_id_list,
+                                     int *ret_status)
 {
-    HttpTxTask *task = value;
-    const char *repo_id = user_data;
+    char *req_content = NULL;
+    char *rsp_content = NULL;
+    gint64 rsp_size;
+    GHashTable *map = NULL;
 
-    if (strcmp(task->repo_id, repo_id) != 0)
-        return FALSE;
+    req_content = repo_id_list_to_json (repo_id_list);
+
+    if (post_head_commits_request (host, use_fileserver_port,
+                                   "head-commits-multi", req_content,
+                                   ret_status, &rsp_content, &rsp_size) < 0)
+        goto out;
+
+    map = repo_head_commit_map_from_json (rsp_content, rsp_size);
+
+out:
+    /* returned by json_dumps(). */
+    free (req_content);
+    g_free (rsp_content);
+    return map;
+}
+
+/*
+ * The request is {"repo_ids": [...], "since": "<token>"}, without "since" on
+ * the first call. The response is {"token": "<token>", "full": <bool>,
+ * "heads": {"<repo_id>": "<head>" or null, ...}}.
+ */
+static GHashTable *
+parse_head_commit_delta (const char *rsp_content, gint64 rsp_size,
+                         char **ret_token, gboolean *ret_full)
+{
+    json_t *object, *heads, *value;
+    json_error_t jerror;
+    const char *token, *key;
+    void *iter;
+    GHashTable *map = NULL;
+
+    object = json_loadb (rsp_content, (size_t)rsp_size, 0, &jerror);
+    if (!object) {
+        seaf_warning ("Failed to load json: %s\n", jerror.text);
+        return NULL;
+    }
+
+    token = json_object_get_string_member (object, "token");
+    heads = json_object_get (object, "heads");
+    if (!token || !heads || !json_is_object (heads)) {
+        seaf_warning ("Bad json object format when parsing head commit delta.\n");
+        goto out;
+    }
+
+    map = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+    iter = json_object_iter (heads);
+    while (iter) {
+        key = json_object_iter_key (iter);
+        value = json_object_iter_value (iter);
+        if (json_is_null (value)) {
+            g_hash_table_replace (map, g_strdup (key), g_strdup (""));
+        } else if (json_is_string (value)) {
+            g_hash_table_replace (map, g_strdup (key),
+                                  g_strdup (json_string_value (value)));
+        } else {
+            seaf_warning ("Bad json object format when parsing head commit delta.\n");
+            g_hash_table_destroy (map);
+            map = NULL;
+            goto out;
+        }
+        iter = json_object_iter_next (heads, iter);
+    }
+
+    *ret_token = g_strdup (token);
+    *ret_full = json_is_true (json_object_get (object, "full"));
+
+out:
+    json_decref (object);
+    return map;
+}
+
+GHashTable *
+http_tx_manager_get_head_commit_delta (HttpTxManager *manager,
+                                       const char *host,
+                                       gboolean use_fileserver_port,
+                                       GList *repo_id_list,
+                                       const char *since,
+                                       char **ret_token,
+                                       gboolean *ret_full,
+                                       int *ret_status)
+{
+    json_t *object, *array;
+    GList *ptr;
+    char *req_content = NULL;
+    char *rsp_content = NULL;
+    gint64 rsp_size;
+    GHashTable *map = NULL;
+
+    object = json_object ();
+    array = json_array ();
+    for (ptr = repo_id_list; ptr; ptr = ptr->next)
+        json_array_append_new (array, json_string ((char *)ptr->data));
+    json_object_set_new (object, "repo_ids", array);
+    if (since)
+        json_object_set_new (object, "since", json_string (since));
+
+    req_content = json_dumps (object, JSON_COMPACT);
+    json_decref (object);
+    if (!req_content) {
+        seaf_warning ("Failed to dump json.\n");
+        return NULL;
+    }
+
+    if (post_head_commits_request (host, use_fileserver_port,
+                                   "head-commits-delta", req_content,
+                                   ret_status, &rsp_content, &rsp_size) < 0)
+        goto out;
+
+    map = parse_head_commit_delta (rsp_content, rsp_size, ret_token, ret_full);
+
+out:
+    /* returned by json_dumps(). */
+    free (req_content);
+    g_free (rsp_content);
+    return map;
+}
+
+static gboolean
+remove_task_help (gpointer key, gpointer value, gpointer user_data)
+{
+    HttpTxTask *task = value;
+    const char *repo_id = user_data;
+
+    if (strcmp(task->repo_id, repo_id) != 0)
+        return FALSE;
 
     return TRUE;
 }
@@ -2740,14 +3335,18 @@ http_tx_manager_add_upload (HttpTxManager *manager,
 
     task->repo_name = g_strdup(repo->name);
 
+    task->flow = bandwidth_scheduler_add_flow (manager->priv->upload_sched,
+                                               repo->transfer_priority);
+
     g_hash_table_insert (manager->priv->upload_tasks,
                          g_strdup(repo_id),
                          task);
 
-    if (seaf_job_manager_schedule_job (seaf->job_mgr,
-                                       http_upload_thread,
-                                       http_upload_done,
-                                       task) < 0) {
+    if (seaf_job_manager_schedule_class_job (seaf->job_mgr,
+                                             SEAF_JOB_TRANSFER,
+                                             http_upload_thread,
+                                             http_upload_done,
+                                             task) < 0) {
         g_hash_table_remove (manager->priv->upload_tasks, repo_id);
         return -1;
     }
@@ -2763,26 +3362,102 @@ dirent_same (SeafDirent *dent1, SeafDirent *dent2)
             dent1->mtime == dent2->mtime);
 }
 
+/*
+ * What an upload needs from the diff between the local and master heads:
+ * the quota delta, the active paths, and the fs objects and blocks that
+ * may have to be sent. They're collected in one traversal, so dir objects
+ * are loaded and parsed once.
+ */
 typedef struct {
     HttpTxTask *task;
     gint64 delta;
     GHashTable *active_paths;
-} CalcQuotaDeltaData;
+    /* Not needed when resuming the block upload of the same head. */
+    gboolean collect_objects;
+    GList *fs_list;
+    GHashTable *checked_objs;
+    BlockList *blocks;
+} UploadDiffData;
+
+static void
+collect_fs_object (UploadDiffData *data, SeafDirent *dent1, SeafDirent *dent2)
+{
+    if (!dent1 || strcmp (dent1->id, EMPTY_SHA1) == 0)
+        return;
+
+    if (g_hash_table_lookup (data->checked_objs, dent1->id))
+        return;
+
+    if (!dent2 || strcmp (dent1->id, dent2->id) != 0) {
+        data->fs_list = g_list_prepend (data->fs_list, g_strdup(dent1->id));
+        g_hash_table_insert (data->checked_objs, g_strdup(dent1->id),
+                             GINT_TO_POINTER(1));
+    }
+}
+
+static int
+collect_blocks (UploadDiffData *data, SeafDirent *file1, SeafDirent *file2)
+{
+    HttpTxTask *task = data->task;
+    Seafile *f1 = NULL, *f2 = NULL;
+    int i;
+
+    if (!file1 || strcmp (file1->id, EMPTY_SHA1) == 0)
+        return 0;
+    if (file2 && strcmp (file1->id, file2->id) == 0)
+        return 0;
+
+    f1 = seaf_fs_manager_get_seafile (seaf->fs_mgr,
+                                      task->repo_id, task->repo_version,
+                                      file1->id);
+    if (!f1) {
+        seaf_warning ("Failed to get seafile object %s:%s.\n",
+                      task->repo_id, file1->id);
+        return -1;
+    }
+
+    if (!file2) {
+        for (i = 0; i < f1->n_blocks; ++i)
+            block_list_insert (data->blocks, f1->blk_sha1s[i]);
+        seafile_unref (f1);
+        return 0;
+    }
+
+    f2 = seaf_fs_manager_get_seafile (seaf->fs_mgr,
+                                      task->repo_id, task->repo_version,
+                                      file2->id);
+    if (!f2) {
+        seafile_unref (f1);
+        seaf_warning ("Failed to get seafile object %s:%s.\n",
+                      task->repo_id, file2->id);
+        return -1;
+    }
+
+    GHashTable *h = g_hash_table_new (g_str_hash, g_str_equal);
+    for (i = 0; i < f2->n_blocks; ++i)
+        g_hash_table_insert (h, f2->blk_sha1s[i], GINT_TO_POINTER(1));
+
+    for (i = 0; i < f1->n_blocks; ++i)
+        if (!g_hash_table_lookup (h, f1->blk_sha1s[i]))
+            block_list_insert (data->blocks, f1->blk_sha1s[i]);
+
+    seafile_unref (f1);
+    seafile_unref (f2);
+    g_hash_table_destroy (h);
+
+    return 0;
+}
 
 static int
-check_quota_and_active_paths_diff_files (int n, const char *basedir,
-                                         SeafDirent *files[], void *vdata)
+upload_diff_files (int n, const char *basedir, SeafDirent *files[], void *vdata)
 {
-    CalcQuotaDeltaData *data = vdata;
+    UploadDiffData *data = vdata;
     SeafDirent *file1 = files[0];
     SeafDirent *file2 = files[1];
-    gint64 size1, size2;
     char *path;
 
     if (file1 && file2) {
-        size1 = file1->size;
-        size2 = file2->size;
-        data->delta += (size1 - size2);
+        data->delta += (file1->size - file2->size);
 
         if (!dirent_same (file1, file2)) {
             path = g_strconcat(basedir, file1->name, NULL);
@@ -2797,15 +3472,19 @@ check_quota_and_active_paths_diff_files (int n, const char *basedir,
         data->delta -= file2->size;
     }
 
-    return 0;
+    if (!data->collect_objects)
+        return 0;
+
+    collect_fs_object (data, file1, file2);
+
+    return collect_blocks (data, file1, file2);
 }
 
 static int
-check_quota_and_active_paths_diff_dirs (int n, const char *basedir,
-                                        SeafDirent *dirs[], void *vdata,
-                                        gboolean *recurse)
+upload_diff_dirs (int n, const char *basedir, SeafDirent *dirs[], void *vdata,
+                  gboolean *recurse)
 {
-    CalcQuotaDeltaData *data = vdata;
+    UploadDiffData *data = vdata;
     SeafDirent *dir1 = dirs[0];
     SeafDirent *dir2 = dirs[1];
     char *path;
@@ -2817,13 +3496,43 @@ check_quota_and_active_paths_diff_dirs (int n, const char *basedir,
         g_hash_table_replace (data->active_paths, path, (void*)(long)S_IFDIR);
     }
 
+    if (data->collect_objects)
+        collect_fs_object (data, dir1, dir2);
+
     return 0;
 }
 
+static void
+upload_diff_data_init (UploadDiffData *data, HttpTxTask *task,
+                       gboolean collect_objects)
+{
+    memset (data, 0, sizeof(UploadDiffData));
+    data->task = task;
+    data->active_paths = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                g_free, NULL);
+    data->collect_objects = collect_objects;
+    if (collect_objects) {
+        data->checked_objs = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                    g_free, NULL);
+        data->blocks = block_list_new ();
+    }
+}
+
+static void
+upload_diff_data_clear (UploadDiffData *data)
+{
+    if (data->active_paths)
+        g_hash_table_destroy (data->active_paths);
+    if (data->checked_objs)
+        g_hash_table_destroy (data->checked_objs);
+    string_list_free (data->fs_list);
+    if (data->blocks)
+        block_list_free (data->blocks);
+    memset (data, 0, sizeof(UploadDiffData));
+}
+
 static int
-calculate_upload_size_delta_and_active_paths (HttpTxTask *task,
-                                              gint64 *delta,
-                                              GHashTable *active_paths)
+calculate_upload_diff (HttpTxTask *task, UploadDiffData *data)
 {
     int ret = 0;
     SeafBranch *local = NULL, *master = NULL;
@@ -2861,18 +3570,13 @@ calculate_upload_size_delta_and_active_paths (HttpTxTask *task,
         goto out;
     }
 
-    CalcQuotaDeltaData data;
-    memset (&data, 0, sizeof(data));
-    data.task = task;
-    data.active_paths = active_paths;
-
     DiffOptions opts;
     memset (&opts, 0, sizeof(opts));
     memcpy (opts.store_id, task->repo_id, 36);
     opts.version = task->repo_version;
-    opts.file_cb = check_quota_and_active_paths_diff_files;
-    opts.dir_cb = check_quota_and_active_paths_diff_dirs;
-    opts.data = &data;
+    opts.file_cb = upload_diff_files;
+    opts.dir_cb = upload_diff_dirs;
+    opts.data = data;
 
     const char *trees[2];
     trees[0] = local_head->root_id;
@@ -2884,7 +3588,11 @@ calculate_upload_size_delta_and_active_paths (HttpTxTask *task,
         goto out;
     }
 
-    *delta = data.delta;
+    /* Diff won't traverse the root object itself. */
+    if (data->collect_objects &&
+        strcmp (local_head->root_id, master_head->root_id) != 0)
+        data->fs_list = g_list_append (data->fs_list,
+                                       g_strdup(local_head->root_id));
 
 out:
     seaf_branch_unref (local);
@@ -2985,172 +3693,126 @@ out:
     return ret;
 }
 
-typedef struct {
-    GList **pret;
-    GHashTable *checked_objs;
-} CalcFsListData;
-
-static int
-collect_file_ids (int n, const char *basedir, SeafDirent *files[], void *vdata)
-{
-    SeafDirent *file1 = files[0];
-    SeafDirent *file2 = files[1];
-    CalcFsListData *data = vdata;
-    GList **pret = data->pret;
-    int dummy;
-
-    if (!file1 || strcmp (file1->id, EMPTY_SHA1) == 0)
-        return 0;
-
-    if (g_hash_table_lookup (data->checked_objs, file1->id))
-        return 0;
+#define ID_LIST_SEGMENT_N 1000
+#define DEFAULT_CHECK_ID_THREADS 3
+#define MAX_PENDING_ID_SEGMENTS (DEFAULT_CHECK_ID_THREADS * 2)
 
-    if (!file2 || strcmp (file1->id, file2->id) != 0) {
-        *pret = g_list_prepend (*pret, g_strdup(file1->id));
-        g_hash_table_insert (data->checked_objs, g_strdup(file1->id), &dummy);
-    }
+typedef struct IdListSegment {
+    GList *ids;
+    char *req_content;
+    GList *needed;
+    int result;
+} IdListSegment;
+
+/* Ids left to check, taken from the head of a list or from a block list. */
+typedef struct IdListSource {
+    GList *ids;
+    BlockList *blocks;
+    uint32_t next;
+    /* Ids found in the cache are skipped. */
+    ServerBlockCache *cache;
+    int n_cached;
+} IdListSource;
+
+typedef struct IdListCheckData {
+    HttpTxTask *http_task;
+    ConnectionPool *cpool;
+    const char *url;
+    GAsyncQueue *finished_segments;
+} IdListCheckData;
 
-    return 0;
+static gboolean
+id_list_source_empty (IdListSource *src)
+{
+    if (src->blocks)
+        return src->next >= src->blocks->n_blocks;
+    return src->ids == NULL;
 }
 
-static int
-collect_dir_ids (int n, const char *basedir, SeafDirent *dirs[], void *vdata,
-                 gboolean *recurse)
+/* Returns a newly allocated id, or NULL if there are none left. */
+static char *
+id_list_source_next (IdListSource *src)
 {
-    SeafDirent *dir1 = dirs[0];
-    SeafDirent *dir2 = dirs[1];
-    CalcFsListData *data = vdata;
-    GList **pret = data->pret;
-    int dummy;
+    char block_id[41];
+    char *id;
 
-    if (!dir1 || strcmp (dir1->id, EMPTY_SHA1) == 0)
-        return 0;
+    while (!id_list_source_empty (src)) {
+        if (src->blocks) {
+            block_list_get_id (src->blocks, src->next++, block_id);
+            id = g_strdup (block_id);
+        } else {
+            id = src->ids->data;
+            src->ids = g_list_delete_link (src->ids, src->ids);
+        }
 
-    if (g_hash_table_lookup (data->checked_objs, dir1->id))
-        return 0;
+        if (src->cache && server_block_cache_lookup (src->cache, id)) {
+            g_free (id);
+            ++(src->n_cached);
+            continue;
+        }
 
-    if (!dir2 || strcmp (dir1->id, dir2->id) != 0) {
-        *pret = g_list_prepend (*pret, g_strdup(dir1->id));
-        g_hash_table_insert (data->checked_objs, g_strdup(dir1->id), &dummy);
+        return id;
     }
 
-    return 0;
+    return NULL;
 }
 
-static GList *
-calculate_send_fs_object_list (HttpTxTask *task)
+/* Returns NULL if there are no ids left. */
+static IdListSegment *
+id_list_segment_new (IdListSource *src)
 {
-    GList *ret = NULL;
-    SeafBranch *local = NULL, *master = NULL;
-    SeafCommit *local_head = NULL, *master_head = NULL;
+    IdListSegment *seg;
+    json_t *array;
     GList *ptr;
+    char *id;
+    int n_sent = 0;
 
-    local = seaf_branch_manager_get_branch (seaf->branch_mgr, task->repo_id, "local");
-    if (!local) {
-        seaf_warning ("Branch local not found for repo %.8s.\n", task->repo_id);
-        goto out;
-    }
-    master = seaf_branch_manager_get_branch (seaf->branch_mgr, task->repo_id, "master");
-    if (!master) {
-        seaf_warning ("Branch master not found for repo %.8s.\n", task->repo_id);
-        goto out;
-    }
+    id = id_list_source_next (src);
+    if (!id)
+        return NULL;
 
-    local_head = seaf_commit_manager_get_commit (seaf->commit_mgr,
-                                                 task->repo_id, task->repo_version,
-                                                 local->commit_id);
-    if (!local_head) {
-        seaf_warning ("Local head commit not found for repo %.8s.\n",
-                      task->repo_id);
-        goto out;
-    }
-    master_head = seaf_commit_manager_get_commit (seaf->commit_mgr,
-                                                  task->repo_id, task->repo_version,
-                                                  master->commit_id);
-    if (!master_head) {
-        seaf_warning ("Master head commit not found for repo %.8s.\n",
-                      task->repo_id);
-        goto out;
+    seg = g_new0 (IdListSegment, 1);
+    while (id) {
+        seg->ids = g_list_prepend (seg->ids, id);
+        if (++n_sent >= ID_LIST_SEGMENT_N)
+            break;
+        id = id_list_source_next (src);
     }
 
-    /* Diff won't traverse the root object itself. */
-    if (strcmp (local_head->root_id, master_head->root_id) != 0)
-        ret = g_list_prepend (ret, g_strdup(local_head->root_id));
-
-    CalcFsListData *data = g_new0(CalcFsListData, 1);
-    data->pret = &ret;
-    data->checked_objs = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                                g_free, NULL);
-
-    DiffOptions opts;
-    memset (&opts, 0, sizeof(opts));
-    memcpy (opts.store_id, task->repo_id, 36);
-    opts.version = task->repo_version;
-    opts.file_cb = collect_file_ids;
-    opts.dir_cb = collect_dir_ids;
-    opts.data = data;
-
-    const char *trees[2];
-    trees[0] = local_head->root_id;
-    trees[1] = master_head->root_id;
-    if (diff_trees (2, trees, &opts) < 0) {
-        seaf_warning ("Failed to diff local and master head for repo %.8s.\n",
-                      task->repo_id);
-        for (ptr = ret; ptr; ptr = ptr->next)
-            g_free (ptr->data);
-        ret = NULL;
-    }
+    /* Convert object id list to JSON format. */
 
-    g_hash_table_destroy (data->checked_objs);
-    g_free (data);
+    array = json_array ();
+    for (ptr = seg->ids; ptr; ptr = ptr->next)
+        json_array_append_new (array, json_string((char *)ptr->data));
+    seg->req_content = json_dumps (array, 0);
+    json_decref (array);
 
-out:
-    seaf_branch_unref (local);
-    seaf_branch_unref (master);
-    seaf_commit_unref (local_head);
-    seaf_commit_unref (master_head);
-    return ret;
+    return seg;
 }
 
-#define ID_LIST_SEGMENT_N 1000
+static void
+id_list_segment_free (IdListSegment *seg)
+{
+    string_list_free (seg->ids);
+    string_list_free (seg->needed);
+    g_free (seg->req_content);
+    g_free (seg);
+}
 
 static int
-upload_check_id_list_segment (HttpTxTask *task, Connection *conn, const char *url,
-                              GList **send_id_list, GList **recv_id_list)
+check_id_list_segment (HttpTxTask *task, Connection *conn, const char *url,
+                       IdListSegment *seg)
 {
     json_t *array;
     json_error_t jerror;
-    char *obj_id;
-    int n_sent = 0;
-    char *data = NULL;
-    int len;
     CURL *curl;
     int status;
     char *rsp_content = NULL;
     gint64 rsp_size;
     int ret = 0;
 
-    /* Convert object id list to JSON format. */
-
-    array = json_array ();
-
-    while (*send_id_list != NULL) {
-        obj_id = (*send_id_list)->data;
-        json_array_append_new (array, json_string(obj_id));
-
-        *send_id_list = g_list_delete_link (*send_id_list, *send_id_list);
-        g_free (obj_id);
-
-        if (++n_sent >= ID_LIST_SEGMENT_N)
-            break;
-    }
-
-    seaf_debug ("Check %d ids for %s:%s.\n",
-                n_sent, task->host, task->repo_id);
-
-    data = json_dumps (array, 0);
-    len = strlen(data);
-    json_decref (array);
+    seaf_debug ("Check %u ids for %s:%s.\n",
+                g_list_length (seg->ids), task->host, task->repo_id);
 
     /* Send fs object id list. */
 
@@ -3158,7 +3820,7 @@ upload_check_id_list_segment (HttpTxTask *task, Connection *conn, const char *ur
 
     int curl_error;
     if (http_post (curl, url, task->token,
-                   data, len,
+                   seg->req_content, strlen(seg->req_content),
                    &status, &rsp_content, &rsp_size, TRUE, &curl_error) < 0) {
         conn->release = TRUE;
         handle_curl_errors (task, curl_error);
@@ -3199,24 +3861,169 @@ upload_check_id_list_segment (HttpTxTask *task, Connection *conn, const char *ur
             goto out;
         }
 
-        *recv_id_list = g_list_prepend (*recv_id_list, g_strdup(json_string_value(str)));
+        seg->needed = g_list_prepend (seg->needed, g_strdup(json_string_value(str)));
     }
 
     json_decref (array);
 
 out:
     curl_easy_reset (curl);
-    g_free (data);
     g_free (rsp_content);
 
     return ret;
 }
 
-#define MAX_OBJECT_PACK_SIZE (1 << 20) /* 1MB */
+static void
+check_id_list_thread_func (gpointer data, gpointer user_data)
+{
+    IdListSegment *seg = data;
+    IdListCheckData *tx_data = user_data;
+    HttpTxTask *task = tx_data->http_task;
+    Connection *conn;
 
-#ifdef WIN32
-__pragma(pack(push, 1))
-typedef struct {
+    if (task->state == HTTP_TASK_STATE_CANCELED)
+        goto out;
+
+    conn = connection_pool_get_connection (tx_data->cpool);
+    if (!conn) {
+        seaf_warning ("Failed to get connection to host %s.\n", task->host);
+        task->error = SYNC_ERROR_ID_NOT_ENOUGH_MEMORY;
+        seg->result = -1;
+        goto out;
+    }
+
+    seg->result = check_id_list_segment (task, conn, tx_data->url, seg);
+
+    connection_pool_return_connection (tx_data->cpool, conn);
+
+out:
+    g_async_queue_push (tx_data->finished_segments, seg);
+}
+
+/* Ids that the server already has are recorded as pending in @cache. */
+static void
+add_present_ids_to_cache (ServerBlockCache *cache, IdListSegment *seg)
+{
+    GHashTable *needed;
+    GList *ptr;
+
+    needed = g_hash_table_new (g_str_hash, g_str_equal);
+    for (ptr = seg->needed; ptr; ptr = ptr->next)
+        g_hash_table_insert (needed, ptr->data, ptr->data);
+
+    for (ptr = seg->ids; ptr; ptr = ptr->next) {
+        if (!g_hash_table_lookup (needed, ptr->data))
+            server_block_cache_add (cache, ptr->data);
+    }
+
+    g_hash_table_destroy (needed);
+}
+
+/*
+ * Ask the server which of the ids in @send_id_list, or in @send_blocks if
+ * not NULL, it doesn't have, and return them in @recv_id_list. Ids taken
+ * from @send_id_list are removed from it. Segments of the list are checked
+ * concurrently on pooled connections. If @cache is given, ids found in it
+ * are not sent, and their number is returned in @n_cached.
+ */
+static int
+upload_check_id_list (HttpTxTask *task, const char *url,
+                      GList **send_id_list, BlockList *send_blocks,
+                      GList **recv_id_list,
+                      ServerBlockCache *cache, int *n_cached)
+{
+    HttpTxPriv *priv = seaf->http_tx_mgr->priv;
+    ConnectionPool *cpool;
+    GThreadPool *tpool;
+    IdListCheckData data;
+    IdListSource src;
+    IdListSegment *seg;
+    int n_running = 0;
+    gboolean stop = FALSE;
+    int ret = 0;
+
+    memset (&src, 0, sizeof(src));
+    if (send_id_list)
+        src.ids = *send_id_list;
+    src.blocks = send_blocks;
+    src.cache = cache;
+
+    if (id_list_source_empty (&src))
+        goto out;
+
+    cpool = find_connection_pool (priv, task->host);
+    if (!cpool) {
+        seaf_warning ("Failed to create connection pool for host %s.\n", task->host);
+        task->error = SYNC_ERROR_ID_NOT_ENOUGH_MEMORY;
+        ret = -1;
+        goto out;
+    }
+
+    data.http_task = task;
+    data.cpool = cpool;
+    data.url = url;
+    data.finished_segments = g_async_queue_new ();
+
+    tpool = g_thread_pool_new (check_id_list_thread_func, &data,
+                               DEFAULT_CHECK_ID_THREADS, FALSE, NULL);
+
+    while (1) {
+        while (!stop && n_running < MAX_PENDING_ID_SEGMENTS &&
+               (seg = id_list_segment_new (&src)) != NULL) {
+            g_thread_pool_push (tpool, seg, NULL);
+            ++n_running;
+        }
+
+        if (n_running == 0)
+            break;
+
+        seg = g_async_queue_pop (data.finished_segments);
+        --n_running;
+
+        if (seg->result < 0) {
+            ret = -1;
+            stop = TRUE;
+        } else if (task->state == HTTP_TASK_STATE_CANCELED) {
+            stop = TRUE;
+        } else {
+            if (cache)
+                add_present_ids_to_cache (cache, seg);
+            *recv_id_list = g_list_concat (seg->needed, *recv_id_list);
+            seg->needed = NULL;
+        }
+
+        id_list_segment_free (seg);
+    }
+
+    g_thread_pool_free (tpool, FALSE, TRUE);
+    g_async_queue_unref (data.finished_segments);
+
+out:
+    if (send_id_list)
+        *send_id_list = src.ids;
+    if (n_cached)
+        *n_cached = src.n_cached;
+    return ret;
+}
+
+/*
+ * Fs objects are sent in packs of several objects per request. Packs are
+ * uploaded in parallel on separate connections. The pack size is adjusted
+ * so that each request takes between OBJECT_PACK_MIN_TIME and
+ * OBJECT_PACK_MAX_TIME seconds: small packs on a fast or high latency
+ * link waste most of their time waiting for the round trip, and large
+ * packs on a slow link hold a lot of memory.
+ */
+#define MIN_OBJECT_PACK_SIZE (1 << 18) /* 256KB */
+#define INIT_OBJECT_PACK_SIZE (1 << 20) /* 1MB */
+#define MAX_OBJECT_PACK_SIZE (1 << 22) /* 4MB */
+#define OBJECT_PACK_MIN_TIME 0.5
+#define OBJECT_PACK_MAX_TIME 2.0
+#define DEFAULT_UPLOAD_FS_THREADS 3
+
+#ifdef WIN32
+__pragma(pack(push, 1))
+typedef struct {
     char obj_id[40];
     guint32 obj_size;
     guint8 object[0];
@@ -3230,24 +4037,92 @@ typedef struct {
 } __attribute__((__packed__)) ObjectHeader;
 #endif
 
+typedef struct FsObjectPack {
+    struct evbuffer *buf;
+    int n_objects;
+    int result;
+    double elapsed;
+    /* Memory budget held by the pack. */
+    gint64 budget;
+} FsObjectPack;
+
+typedef struct FsUploadData {
+    HttpTxTask *http_task;
+    ConnectionPool *cpool;
+    GAsyncQueue *finished_packs;
+} FsUploadData;
+
+static void
+fs_object_pack_free (FsObjectPack *pack)
+{
+    evbuffer_free (pack->buf);
+    seaf_mem_budget_release (SEAF_MEM_FS_UPLOAD, pack->budget);
+    g_free (pack);
+}
+
+/* Reserves the memory budget for a pack to be read. Only the first pack
+ * in flight waits for it, later ones are held back while the budget is
+ * exhausted.
+ */
+static gboolean
+reserve_pack_budget (int subsystem, int n_running, gint64 size)
+{
+    if (n_running == 0) {
+        seaf_mem_budget_acquire (subsystem, size);
+        return TRUE;
+    }
+    return seaf_mem_budget_try_acquire (subsystem, size);
+}
+
+static void
+free_object_data (const void *data, size_t datalen, void *extra)
+{
+    g_free ((void *)data);
+}
+
+/* Objects stored with zstd are sent zlib compressed, which is all the
+ * server understands.
+ */
 static int
-send_fs_objects (HttpTxTask *task, Connection *conn, GList **send_fs_list)
+zstd_object_to_zlib (char **data, int *len)
 {
-    struct evbuffer *buf;
+    guint8 *raw, *compressed;
+    int raw_len, compressed_len;
+
+    if (seaf_decompress ((guint8 *)*data, *len, &raw, &raw_len) < 0)
+        return -1;
+
+    if (seaf_compress (raw, raw_len, &compressed, &compressed_len) < 0) {
+        g_free (raw);
+        return -1;
+    }
+    g_free (raw);
+
+    g_free (*data);
+    *data = (char *)compressed;
+    *len = compressed_len;
+    return 0;
+}
+
+/* Objects are added to the pack by reference, so they are not copied
+ * until curl reads the request body.
+ *
+ * The caller has reserved @max_size bytes of memory budget, which are
+ * released with the pack.
+ */
+static FsObjectPack *
+pack_fs_objects (HttpTxTask *task, GList **send_fs_list, int max_size)
+{
+    FsObjectPack *pack;
     ObjectHeader hdr;
     char *obj_id;
     char *data;
     int len;
-    int total_size;
-    unsigned char *package;
-    CURL *curl;
-    char *url = NULL;
-    int status;
-    int ret = 0;
-    int n_sent = 0;
+    gint64 start = seaf_metrics_now ();
 
-    buf = evbuffer_new ();
-    curl = conn->curl;
+    pack = g_new0 (FsObjectPack, 1);
+    pack->buf = evbuffer_new ();
+    pack->budget = max_size;
 
     while (*send_fs_list != NULL) {
         obj_id = (*send_fs_list)->data;
@@ -3258,31 +4133,69 @@ send_fs_objects (HttpTxTask *task, Connection *conn, GList **send_fs_list)
             seaf_warning ("Failed to read fs object %s in repo %s.\n",
                           obj_id, task->repo_id);
             task->error = SYNC_ERROR_ID_LOCAL_DATA_CORRUPT;
-            ret = -1;
-            goto out;
+            fs_object_pack_free (pack);
+            return NULL;
         }
 
-        ++n_sent;
+        if (seaf_is_zstd_compressed ((guint8 *)data, len) &&
+            zstd_object_to_zlib (&data, &len) < 0) {
+            seaf_warning ("Failed to convert fs object %s in repo %s.\n",
+                          obj_id, task->repo_id);
+            g_free (data);
+            task->error = SYNC_ERROR_ID_LOCAL_DATA_CORRUPT;
+            fs_object_pack_free (pack);
+            return NULL;
+        }
+
+        ++(pack->n_objects);
 
         memcpy (hdr.obj_id, obj_id, 40);
         hdr.obj_size = htonl (len);
 
-        evbuffer_add (buf, &hdr, sizeof(hdr));
-        evbuffer_add (buf, data, len);
+        evbuffer_add (pack->buf, &hdr, sizeof(hdr));
+        if (len == 0 ||
+            evbuffer_add_reference (pack->buf, data, len,
+                                    free_object_data, NULL) < 0) {
+            evbuffer_add (pack->buf, data, len);
+            g_free (data);
+        }
 
-        g_free (data);
         *send_fs_list = g_list_delete_link (*send_fs_list, *send_fs_list);
         g_free (obj_id);
 
-        total_size = evbuffer_get_length (buf);
-        if (total_size >= MAX_OBJECT_PACK_SIZE)
+        if (evbuffer_get_length (pack->buf) >= max_size)
             break;
     }
 
     seaf_debug ("Sending %d fs objects for %s:%s.\n",
-                n_sent, task->host, task->repo_id);
+                pack->n_objects, task->host, task->repo_id);
+    seaf_trace_span ("pack_fs_objects", start, task->repo_id);
+
+    return pack;
+}
+
+static void
+upload_fs_pack_thread_func (gpointer data, gpointer user_data)
+{
+    FsObjectPack *pack = data;
+    FsUploadData *tx_data = user_data;
+    HttpTxTask *task = tx_data->http_task;
+    Connection *conn;
+    char *url = NULL;
+    int status;
+    int curl_error;
+    gint64 start = seaf_metrics_now ();
 
-    package = evbuffer_pullup (buf, -1);
+    if (task->state == HTTP_TASK_STATE_CANCELED)
+        goto out;
+
+    conn = connection_pool_get_connection (tx_data->cpool);
+    if (!conn) {
+        seaf_warning ("Failed to get connection to host %s.\n", task->host);
+        task->error = SYNC_ERROR_ID_NOT_ENOUGH_MEMORY;
+        pack->result = -1;
+        goto out;
+    }
 
     if (!task->use_fileserver_port)
         url = g_strdup_printf ("%s/seafhttp/repo/%s/recv-fs/",
@@ -3291,194 +4204,112 @@ send_fs_objects (HttpTxTask *task, Connection *conn, GList **send_fs_list)
         url = g_strdup_printf ("%s/repo/%s/recv-fs/",
                                task->host, task->repo_id);
 
-    int curl_error;
-    if (http_post (curl, url, task->token,
-                   (char *)package, evbuffer_get_length(buf),
-                   &status, NULL, NULL, TRUE, &curl_error) < 0) {
+    if (http_post_evbuffer (conn->curl, url, task->token, pack->buf,
+                            &status, NULL, NULL, TRUE, &curl_error) < 0) {
         conn->release = TRUE;
         handle_curl_errors (task, curl_error);
-        ret = -1;
-        goto out;
-    }
-
-    if (status != HTTP_OK) {
+        pack->result = -1;
+    } else if (status != HTTP_OK) {
         seaf_warning ("Bad response code for POST %s: %d.\n", url, status);
         handle_http_errors (task, status);
-        ret = -1;
+        pack->result = -1;
+    } else {
+        curl_easy_getinfo (conn->curl, CURLINFO_TOTAL_TIME, &pack->elapsed);
     }
 
+    curl_easy_reset (conn->curl);
+    connection_pool_return_connection (tx_data->cpool, conn);
+
 out:
     g_free (url);
-    evbuffer_free (buf);
-    curl_easy_reset (curl);
-
-    return ret;
+    seaf_trace_span ("upload_fs_pack", start, task->repo_id);
+    g_async_queue_push (tx_data->finished_packs, pack);
 }
 
-typedef struct {
-    GList *block_list;
-    GHashTable *added_blocks;
-    HttpTxTask *task;
-} CalcBlockListData;
-
-static void
-add_to_block_list (GList **block_list, GHashTable *added_blocks, const char *block_id)
+static int
+adjust_pack_size (int pack_size, FsObjectPack *pack)
 {
-    int dummy;
+    /* The last pack of a list is usually not full. */
+    if (evbuffer_get_length (pack->buf) < pack_size)
+        return pack_size;
 
-    if (g_hash_table_lookup (added_blocks, block_id))
-        return;
+    if (pack->elapsed < OBJECT_PACK_MIN_TIME)
+        pack_size = MIN (pack_size * 2, MAX_OBJECT_PACK_SIZE);
+    else if (pack->elapsed > OBJECT_PACK_MAX_TIME)
+        pack_size = MAX (pack_size / 2, MIN_OBJECT_PACK_SIZE);
 
-    *block_list = g_list_prepend (*block_list, g_strdup(block_id));
-    g_hash_table_insert (added_blocks, g_strdup(block_id), &dummy);
+    return pack_size;
 }
 
 static int
-block_list_diff_files (int n, const char *basedir, SeafDirent *files[], void *vdata)
+send_fs_objects (HttpTxTask *task, GList **send_fs_list)
 {
-    SeafDirent *file1 = files[0];
-    SeafDirent *file2 = files[1];
-    CalcBlockListData *data = vdata;
-    HttpTxTask *task = data->task;
-    Seafile *f1 = NULL, *f2 = NULL;
-    int i;
-
-    if (file1 && strcmp (file1->id, EMPTY_SHA1) != 0) {
-        if (!file2) {
-            f1 = seaf_fs_manager_get_seafile (seaf->fs_mgr,
-                                              task->repo_id, task->repo_version,
-                                              file1->id);
-            if (!f1) {
-                seaf_warning ("Failed to get seafile object %s:%s.\n",
-                              task->repo_id, file1->id);
-                return -1;
-            }
-            for (i = 0; i < f1->n_blocks; ++i)
-                add_to_block_list (&data->block_list, data->added_blocks,
-                                   f1->blk_sha1s[i]);
-            seafile_unref (f1);
-        } else if (strcmp (file1->id, file2->id) != 0) {
-            f1 = seaf_fs_manager_get_seafile (seaf->fs_mgr,
-                                              task->repo_id, task->repo_version,
-                                              file1->id);
-            if (!f1) {
-                seaf_warning ("Failed to get seafile object %s:%s.\n",
-                              task->repo_id, file1->id);
-                return -1;
-            }
-            f2 = seaf_fs_manager_get_seafile (seaf->fs_mgr,
-                                              task->repo_id, task->repo_version,
-                                              file2->id);
-            if (!f2) {
-                seafile_unref (f1);
-                seaf_warning ("Failed to get seafile object %s:%s.\n",
-                              task->repo_id, file2->id);
-                return -1;
-            }
-
-            GHashTable *h = g_hash_table_new (g_str_hash, g_str_equal);
-            int dummy;
-            for (i = 0; i < f2->n_blocks; ++i)
-                g_hash_table_insert (h, f2->blk_sha1s[i], &dummy);
+    HttpTxPriv *priv = seaf->http_tx_mgr->priv;
+    ConnectionPool *cpool;
+    GThreadPool *tpool;
+    GAsyncQueue *finished_packs;
+    FsUploadData data;
+    FsObjectPack *pack;
+    int pack_size = INIT_OBJECT_PACK_SIZE;
+    int n_running = 0;
+    gboolean stop = FALSE;
+    int ret = 0;
 
-            for (i = 0; i < f1->n_blocks; ++i)
-                if (!g_hash_table_lookup (h, f1->blk_sha1s[i]))
-                    add_to_block_list (&data->block_list, data->added_blocks,
-                                       f1->blk_sha1s[i]);
+    if (*send_fs_list == NULL)
+        return 0;
 
-            seafile_unref (f1);
-            seafile_unref (f2);
-            g_hash_table_destroy (h);
-        }
+    cpool = find_connection_pool (priv, task->host);
+    if (!cpool) {
+        seaf_warning ("Failed to create connection pool for host %s.\n", task->host);
+        task->error = SYNC_ERROR_ID_NOT_ENOUGH_MEMORY;
+        return -1;
     }
 
-    return 0;
-}
-
-static int
-block_list_diff_dirs (int n, const char *basedir, SeafDirent *dirs[], void *data,
-                      gboolean *recurse)
-{
-    /* Do nothing */
-    return 0;
-}
-
-static int
-calculate_block_list (HttpTxTask *task, GList **plist)
-{
-    int ret = 0;
-    SeafBranch *local = NULL, *master = NULL;
-    SeafCommit *local_head = NULL, *master_head = NULL;
+    finished_packs = g_async_queue_new ();
 
-    local = seaf_branch_manager_get_branch (seaf->branch_mgr, task->repo_id, "local");
-    if (!local) {
-        seaf_warning ("Branch local not found for repo %.8s.\n", task->repo_id);
-        ret = -1;
-        goto out;
-    }
-    master = seaf_branch_manager_get_branch (seaf->branch_mgr, task->repo_id, "master");
-    if (!master) {
-        seaf_warning ("Branch master not found for repo %.8s.\n", task->repo_id);
-        ret = -1;
-        goto out;
-    }
+    data.http_task = task;
+    data.cpool = cpool;
+    data.finished_packs = finished_packs;
 
-    local_head = seaf_commit_manager_get_commit (seaf->commit_mgr,
-                                                 task->repo_id, task->repo_version,
-                                                 local->commit_id);
-    if (!local_head) {
-        seaf_warning ("Local head commit not found for repo %.8s.\n",
-                      task->repo_id);
-        ret = -1;
-        goto out;
-    }
-    master_head = seaf_commit_manager_get_commit (seaf->commit_mgr,
-                                                 task->repo_id, task->repo_version,
-                                                 master->commit_id);
-    if (!master_head) {
-        seaf_warning ("Master head commit not found for repo %.8s.\n",
-                      task->repo_id);
-        ret = -1;
-        goto out;
-    }
+    tpool = g_thread_pool_new (upload_fs_pack_thread_func, &data,
+                               DEFAULT_UPLOAD_FS_THREADS, FALSE, NULL);
 
-    CalcBlockListData data;
-    memset (&data, 0, sizeof(data));
-    data.added_blocks = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
-    data.task = task;
+    while (1) {
+        /* Read the next pack while the others are being sent. */
+        while (!stop && *send_fs_list != NULL &&
+               n_running < DEFAULT_UPLOAD_FS_THREADS &&
+               reserve_pack_budget (SEAF_MEM_FS_UPLOAD, n_running, pack_size)) {
+            pack = pack_fs_objects (task, send_fs_list, pack_size);
+            if (!pack) {
+                ret = -1;
+                stop = TRUE;
+                break;
+            }
+            g_thread_pool_push (tpool, pack, NULL);
+            ++n_running;
+        }
 
-    DiffOptions opts;
-    memset (&opts, 0, sizeof(opts));
-    memcpy (opts.store_id, task->repo_id, 36);
-    opts.version = task->repo_version;
-    opts.file_cb = block_list_diff_files;
-    opts.dir_cb = block_list_diff_dirs;
-    opts.data = &data;
+        if (n_running == 0)
+            break;
 
-    const char *trees[2];
-    trees[0] = local_head->root_id;
-    trees[1] = master_head->root_id;
-    if (diff_trees (2, trees, &opts) < 0) {
-        seaf_warning ("Failed to diff local and master head for repo %.8s.\n",
-                      task->repo_id);
-        g_hash_table_destroy (data.added_blocks);
+        pack = g_async_queue_pop (finished_packs);
+        --n_running;
 
-        GList *ptr;
-        for (ptr = data.block_list; ptr; ptr = ptr->next)
-            g_free (ptr->data);
+        if (pack->result < 0) {
+            ret = -1;
+            stop = TRUE;
+        } else if (task->state == HTTP_TASK_STATE_CANCELED) {
+            stop = TRUE;
+        } else {
+            pack_size = adjust_pack_size (pack_size, pack);
+        }
 
-        ret = -1;
-        goto out;
+        fs_object_pack_free (pack);
     }
 
-    g_hash_table_destroy (data.added_blocks);
-    *plist = data.block_list;
+    g_thread_pool_free (tpool, FALSE, TRUE);
+    g_async_queue_unref (finished_packs);
 
-out:
-    seaf_branch_unref (local);
-    seaf_branch_unref (master);
-    seaf_commit_unref (local_head);
-    seaf_commit_unref (master_head);
     return ret;
 }
 
@@ -3486,6 +4317,17 @@ typedef struct {
     char block_id[41];
     BlockHandle *block;
     HttpTxTask *task;
+    /* If set, the block is sent from here instead of being read. */
+    char *buf;
+    gsize buf_len;
+    gsize buf_off;
+    /* Set for the streams of a curl multi handle, whose callbacks must not
+     * block the other streams. Instead of waiting for the bandwidth limit,
+     * the stream is paused until resume_time.
+     */
+    gboolean no_wait;
+    gboolean paused;
+    gint64 resume_time;
 } SendBlockData;
 
 static size_t
@@ -3499,9 +4341,20 @@ send_block_callback (void *ptr, size_t size, size_t nmemb, void *userp)
     if (task->state == HTTP_TASK_STATE_CANCELED || task->all_stop)
         return CURL_READFUNC_ABORT;
 
-    n = seaf_block_manager_read_block (seaf->block_mgr,
-                                       data->block,
-                                       ptr, realsize);
+    if (data->no_wait && g_get_monotonic_time () < data->resume_time) {
+        data->paused = TRUE;
+        return CURL_READFUNC_PAUSE;
+    }
+
+    if (data->buf) {
+        n = MIN (realsize, data->buf_len - data->buf_off);
+        memcpy (ptr, data->buf + data->buf_off, n);
+        data->buf_off += n;
+    } else {
+        n = seaf_block_manager_read_block (seaf->block_mgr,
+                                           data->block,
+                                           ptr, realsize);
+    }
     if (n < 0) {
         seaf_warning ("Failed to read block %s in repo %.8s.\n",
                       data->block_id, task->repo_id);
@@ -3515,53 +4368,220 @@ send_block_callback (void *ptr, size_t size, size_t nmemb, void *userp)
     /* Update transferred bytes for this task */
     g_atomic_int_add (&task->tx_bytes, n);
 
-    /* If uploaded bytes exceeds the limit, wait until the counter
-     * is reset. We check the counter every 100 milliseconds, so we
-     * can waste up to 100 milliseconds without sending data after
-     * the counter is reset.
-     */
-    while (1) {
-        gint sent = g_atomic_int_get(&(seaf->sync_mgr->sent_bytes));
-        if (seaf->sync_mgr->upload_limit > 0 &&
-            sent > seaf->sync_mgr->upload_limit)
-            /* 100 milliseconds */
-            g_usleep (100000);
-        else
-            break;
+    /* Pace the upload under the upload limit. */
+    if (data->no_wait)
+        data->resume_time = g_get_monotonic_time () +
+            bandwidth_flow_charge (task->flow,
+                                   seaf_transfer_policy_get_upload_limit (), n);
+    else
+        bandwidth_flow_consume (task->flow, seaf_transfer_policy_get_upload_limit (), n);
+
+    return n;
+}
+
+static size_t
+get_block_callback (void *ptr, size_t size, size_t nmemb, void *userp)
+{
+    size_t realsize = size *nmemb;
+    SendBlockData *data = userp;
+    HttpTxTask *task = data->task;
+    size_t n;
+
+    if (task->state == HTTP_TASK_STATE_CANCELED || task->all_stop)
+        return 0;
+
+    /* curl passes the same data again after the stream is resumed. */
+    if (data->no_wait && g_get_monotonic_time () < data->resume_time) {
+        data->paused = TRUE;
+        return CURL_WRITEFUNC_PAUSE;
+    }
+
+    n = seaf_block_manager_write_block (seaf->block_mgr,
+                                        data->block,
+                                        ptr, realsize);
+    if (n < realsize) {
+        seaf_warning ("Failed to write block %s in repo %.8s.\n",
+                      data->block_id, task->repo_id);
+        task->error = SYNC_ERROR_ID_WRITE_LOCAL_DATA;
+        return n;
     }
 
+    /* Update global transferred bytes. */
+    g_atomic_int_add (&(seaf->sync_mgr->recv_bytes), n);
+
+    /* Update transferred bytes for this task */
+    g_atomic_int_add (&task->tx_bytes, n);
+
+    /* Pace the download under the download limit. */
+    if (data->no_wait)
+        data->resume_time = g_get_monotonic_time () +
+            bandwidth_flow_charge (task->flow,
+                                   seaf_transfer_policy_get_download_limit (), n);
+    else
+        bandwidth_flow_consume (task->flow, seaf_transfer_policy_get_download_limit (), n);
+
     return n;
 }
 
+/*
+ * Blocks are deflate encoded on the wire when the server supports it, unless
+ * a sample of the block looks random, as encrypted or already compressed
+ * data does. The sample is three windows at the start, middle and end of
+ * the block. The sum of squared byte frequencies stands in for the entropy:
+ * about 1/256 for random bytes, and above MIN_COMPRESSIBLE_COLLISION (around
+ * 7.5 bits per byte) for data that is worth compressing.
+ */
+#define MIN_DEFLATE_BLOCK_SIZE 4096
+#define ENTROPY_SAMPLE_SIZE 4096
+#define MIN_COMPRESSIBLE_COLLISION 0.0055
+
+static gboolean
+looks_compressible (const unsigned char *data, gsize len)
+{
+    guint32 counts[256];
+    gsize offsets[3];
+    gsize sample, i, j, n = 0;
+    double sum = 0;
+
+    memset (counts, 0, sizeof(counts));
+
+    sample = MIN (len, ENTROPY_SAMPLE_SIZE);
+    offsets[0] = 0;
+    offsets[1] = (len - sample) / 2;
+    offsets[2] = len - sample;
+
+    for (i = 0; i < 3; ++i) {
+        for (j = 0; j < sample; ++j)
+            ++counts[data[offsets[i] + j]];
+        n += sample;
+    }
+
+    for (i = 0; i < 256; ++i)
+        sum += (double)counts[i] * counts[i];
+
+    return sum / ((double)n * n) >= MIN_COMPRESSIBLE_COLLISION;
+}
+
+/*
+ * Blocks chunked for direct upload are not in the block store. They're read
+ * from the worktree file they came from, if it still has the content.
+ */
+static char *
+read_worktree_block (HttpTxTask *task, const char *block_id, guint32 *size)
+{
+    char *buf;
+
+    buf = seaf_content_index_read_block (task->repo_id, task->repo_version,
+                                         block_id, size);
+    if (!buf) {
+        seaf_warning ("Failed to stat block %s in repo %s.\n",
+                      block_id, task->repo_id);
+        task->error = SYNC_ERROR_ID_LOCAL_DATA_CORRUPT;
+    }
+
+    return buf;
+}
+
+static char *
+read_whole_block (HttpTxTask *task, BlockHandle *block,
+                  const char *block_id, guint32 size)
+{
+    char *buf;
+    guint32 n = 0;
+    int rc;
+
+    buf = g_malloc (size);
+    while (n < size) {
+        rc = seaf_block_manager_read_block (seaf->block_mgr, block,
+                                            buf + n, size - n);
+        if (rc <= 0) {
+            seaf_warning ("Failed to read block %s in repo %.8s.\n",
+                          block_id, task->repo_id);
+            task->error = SYNC_ERROR_ID_LOCAL_DATA_CORRUPT;
+            g_free (buf);
+            return NULL;
+        }
+        n += rc;
+    }
+
+    return buf;
+}
+
+/* Read the whole block into @data->buf, deflate encoded if that saves at
+ * least a tenth of its size.
+ */
+static int
+load_block_for_upload (HttpTxTask *task, SendBlockData *data,
+                       guint32 size, gboolean *encoded)
+{
+    char *raw, *out;
+    uLongf out_len;
+
+    if (data->buf)
+        raw = data->buf;
+    else
+        raw = read_whole_block (task, data->block, data->block_id, size);
+    if (!raw)
+        return -1;
+
+    *encoded = FALSE;
+    data->buf = raw;
+    data->buf_len = size;
+
+    if (!looks_compressible ((unsigned char *)raw, size))
+        return 0;
+
+    out_len = compressBound (size);
+    out = g_malloc (out_len);
+    if (compress2 ((Bytef *)out, &out_len, (Bytef *)raw, size,
+                   Z_BEST_SPEED) == Z_OK &&
+        out_len < size - size / 10) {
+        g_free (raw);
+        data->buf = out;
+        data->buf_len = out_len;
+        *encoded = TRUE;
+    } else {
+        g_free (out);
+    }
+
+    return 0;
+}
+
 static int
 send_block (HttpTxTask *task, Connection *conn, const char *block_id, guint32 *psize)
 {
+    HttpTxPriv *priv = seaf->http_tx_mgr->priv;
+    ConnectionPool *pool;
     CURL *curl;
     char *url;
     int status;
     BlockMetadata *bmd;
-    BlockHandle *block;
+    BlockHandle *block = NULL;
+    char *wt_buf = NULL;
+    guint32 size;
+    gboolean encoded = FALSE;
     int ret = 0;
 
     bmd = seaf_block_manager_stat_block (seaf->block_mgr,
                                          task->repo_id, task->repo_version,
                                          block_id);
     if (!bmd) {
-        seaf_warning ("Failed to stat block %s in repo %s.\n",
-                      block_id, task->repo_id);
-        task->error = SYNC_ERROR_ID_LOCAL_DATA_CORRUPT;
-        return -1;
-    }
-
-    block = seaf_block_manager_open_block (seaf->block_mgr,
-                                           task->repo_id, task->repo_version,
-                                           block_id, BLOCK_READ);
-    if (!block) {
-        seaf_warning ("Failed to open block %s in repo %s.\n",
-                      block_id, task->repo_id);
-        task->error = SYNC_ERROR_ID_LOCAL_DATA_CORRUPT;
+        wt_buf = read_worktree_block (task, block_id, &size);
+        if (!wt_buf)
+            return -1;
+    } else {
+        size = bmd->size;
         g_free (bmd);
-        return -1;
+
+        block = seaf_block_manager_open_block (seaf->block_mgr,
+                                               task->repo_id, task->repo_version,
+                                               block_id, BLOCK_READ);
+        if (!block) {
+            seaf_warning ("Failed to open block %s in repo %s.\n",
+                          block_id, task->repo_id);
+            task->error = SYNC_ERROR_ID_LOCAL_DATA_CORRUPT;
+            return -1;
+        }
     }
 
     SendBlockData data;
@@ -3569,6 +4589,8 @@ send_block (HttpTxTask *task, Connection *conn, const char *block_id, guint32 *p
     memcpy (data.block_id, block_id, 40);
     data.block = block;
     data.task = task;
+    data.buf = wt_buf;
+    data.buf_len = size;
 
     curl = conn->curl;
 
@@ -3579,11 +4601,19 @@ send_block (HttpTxTask *task, Connection *conn, const char *block_id, guint32 *p
         url = g_strdup_printf ("%s/repo/%s/block/%s",
                                task->host, task->repo_id, block_id);
 
+    pool = find_connection_pool (priv, task->host);
+    if (pool && pool->block_deflate && size >= MIN_DEFLATE_BLOCK_SIZE &&
+        load_block_for_upload (task, &data, size, &encoded) < 0) {
+        ret = -1;
+        goto out;
+    }
+
     int curl_error;
-    if (http_put (curl, url, task->token,
-                  NULL, bmd->size,
-                  send_block_callback, &data,
-                  &status, NULL, NULL, TRUE, &curl_error) < 0) {
+    if (http_put_internal (curl, url, task->token,
+                           NULL, data.buf ? data.buf_len : size,
+                           send_block_callback, &data,
+                           encoded ? "Content-Encoding: deflate" : NULL,
+                           &status, NULL, NULL, TRUE, &curl_error) < 0) {
         if (task->state == HTTP_TASK_STATE_CANCELED)
             goto out;
 
@@ -3603,965 +4633,3362 @@ send_block (HttpTxTask *task, Connection *conn, const char *block_id, guint32 *p
         goto out;
     }
 
+    server_block_cache_add (task->block_cache, block_id);
+    transfer_journal_block_sent (seaf->http_tx_mgr->priv->journal,
+                                 task->repo_id, block_id);
+
     if (psize)
-        *psize = bmd->size;
+        *psize = size;
 
 out:
     g_free (url);
+    g_free (data.buf);
     curl_easy_reset (curl);
-    g_free (bmd);
-    seaf_block_manager_close_block (seaf->block_mgr, block);
-    seaf_block_manager_block_handle_free (seaf->block_mgr, block);
+    if (block) {
+        seaf_block_manager_close_block (seaf->block_mgr, block);
+        seaf_block_manager_block_handle_free (seaf->block_mgr, block);
+    }
 
     return ret;
 }
 
-typedef struct BlockUploadData {
-    HttpTxTask *http_task;
-    ConnectionPool *cpool;
-    GAsyncQueue *finished_tasks;
-} BlockUploadData;
+/* Called after all data of a downloaded block has been written to @block.
+ * Closes the block, commits it to the block store and takes @refs references
+ * on it for the files that will be checked out.
+ * The caller still has to free the block handle.
+ */
+static int
+commit_downloaded_block (HttpTxTask *task, BlockHandle *block,
+                         const char *block_id, int refs)
+{
+    BlockMetadata *bmd;
+    int *pcnt;
+    int ret = 0;
 
-typedef struct BlockUploadTask {
-    char block_id[41];
-    int result;
-    guint32 block_size;
-} BlockUploadTask;
+    bmd = seaf_block_manager_stat_block_by_handle (seaf->block_mgr, block);
+    if (bmd == NULL) {
+        seaf_warning ("Failed to get block %s meta data in repo %.8s.\n", block_id, task->repo_id);
+        seaf_block_manager_close_block (seaf->block_mgr, block);
+        return -1;
+    }
 
-static void
-block_upload_task_free (BlockUploadTask *task)
-{
-    g_free (task);
-}
+    seaf_block_manager_close_block (seaf->block_mgr, block);
 
-static void
-upload_block_thread_func (gpointer data, gpointer user_data)
-{
-    BlockUploadTask *task = data;
-    BlockUploadData *tx_data = user_data;
-    HttpTxTask *http_task = tx_data->http_task;
-    Connection *conn;
-    int ret = 0;
+    pthread_mutex_lock (&task->ref_cnt_lock);
 
-    conn = connection_pool_get_connection (tx_data->cpool);
-    if (!conn) {
-        seaf_warning ("Failed to get connection to host %s.\n", http_task->host);
-        http_task->error = SYNC_ERROR_ID_NOT_ENOUGH_MEMORY;
+    task->done_download += bmd->size;
+    g_free (bmd);
+
+    /* Don't overwrite the block if other thread already downloaded it.
+     * Since we've locked ref_cnt_lock, we can be sure the block won't be removed.
+     */
+    if (!seaf_block_manager_block_exists (seaf->block_mgr,
+                                          task->repo_id, task->repo_version,
+                                          block_id) &&
+        seaf_block_manager_commit_block (seaf->block_mgr, block) < 0)
+    {
+        seaf_warning ("Failed to commit block %s in repo %.8s.\n",
+                      block_id, task->repo_id);
+        task->error = SYNC_ERROR_ID_WRITE_LOCAL_DATA;
         ret = -1;
-        goto out;
     }
 
-    ret = send_block (http_task, conn, task->block_id, &task->block_size);
+    if (ret == 0) {
+        pcnt = g_hash_table_lookup (task->blk_ref_cnts, block_id);
+        if (!pcnt) {
+            pcnt = g_new0(int, 1);
+            g_hash_table_insert (task->blk_ref_cnts, g_strdup(block_id), pcnt);
+        }
+        *pcnt += refs;
+    }
 
-    connection_pool_return_connection (tx_data->cpool, conn);
+    pthread_mutex_unlock (&task->ref_cnt_lock);
 
-out:
-    task->result = ret;
-    g_async_queue_push (tx_data->finished_tasks, task);
+    /* The reference taken keeps the block in the store. */
+    if (ret == 0 && task->shared_blocks)
+        seaf_shared_block_cache_add (task->repo_id, task->repo_version,
+                                     block_id);
+
+    if (ret == 0)
+        server_block_cache_add (task->block_cache, block_id);
+
+    return ret;
 }
 
-#define DEFAULT_UPLOAD_BLOCK_THREADS 3
+/* Multiplexed block transfer.
+ *
+ * When http2_max_streams is set, blocks are sent or fetched as concurrent
+ * requests driven by one curl multi handle. If the server speaks HTTP/2 all
+ * requests become streams on a single connection, so the per-block round
+ * trip no longer limits throughput on high-latency links. For HTTP/1.1
+ * servers curl falls back to a few parallel connections.
+ */
 
-static int
-multi_threaded_send_blocks (HttpTxTask *http_task, GList *block_list)
+#if LIBCURL_VERSION_NUM >= 0x072f00 /* 7.47.0 */
+#define HTTP_MULTIPLEX_SUPPORTED 1
+#endif
+
+#ifdef HTTP_MULTIPLEX_SUPPORTED
+
+#define MAX_HTTP2_STREAMS 100
+#define MULTI_WAIT_TIMEOUT_MSEC 1000
+
+typedef struct BlockStream {
+    CURL *curl;
+    struct curl_slist *headers;
+    char *url;
+    SendBlockData data;
+    gboolean upload;
+    guint32 block_size;
+    /* Number of references to take on a downloaded block. */
+    int refs;
+    gboolean block_closed;
+    gint64 start;
+} BlockStream;
+
+static void
+block_stream_free (BlockStream *stream)
 {
-    HttpTxPriv *priv = seaf->http_tx_mgr->priv;
-    GThreadPool *tpool;
-    GAsyncQueue *finished_tasks;
-    GHashTable *pending_tasks;
-    ConnectionPool *cpool;
-    GList *ptr;
-    char *block_id;
-    BlockUploadTask *task;
-    SyncInfo *info;
-    int ret = 0;
+    if (!stream)
+        return;
 
-    if (block_list == NULL)
-        return 0;
+    if (stream->data.block) {
+        if (!stream->block_closed)
+            seaf_block_manager_close_block (seaf->block_mgr, stream->data.block);
+        seaf_block_manager_block_handle_free (seaf->block_mgr, stream->data.block);
+    }
+    g_free (stream->data.buf);
+    if (stream->curl)
+        curl_easy_cleanup (stream->curl);
+    curl_slist_free_all (stream->headers);
+    g_free (stream->url);
+    g_free (stream);
+}
 
-    cpool = find_connection_pool (priv, http_task->host);
-    if (!cpool) {
-        seaf_warning ("Failed to create connection pool for host %s.\n", http_task->host);
-        http_task->error = SYNC_ERROR_ID_NOT_ENOUGH_MEMORY;
-        return -1;
+static void
+set_block_stream_options (BlockStream *stream, HttpTxTask *task)
+{
+    CURL *curl = stream->curl;
+    char *token_header;
+
+    if (seafile_debug_flag_is_set (SEAFILE_DEBUG_CURL)) {
+        curl_easy_setopt (curl, CURLOPT_VERBOSE, 1);
+        curl_easy_setopt (curl, CURLOPT_STDERR, seafile_get_log_fp());
     }
 
-    finished_tasks = g_async_queue_new ();
+    stream->headers = curl_slist_append (stream->headers, "User-Agent: Seafile/"SEAFILE_CLIENT_VERSION" ("USER_AGENT_OS")");
+    /* Disable the default "Expect: 100-continue" header */
+    if (stream->upload)
+        stream->headers = curl_slist_append (stream->headers, "Expect:");
 
-    BlockUploadData data;
-    data.http_task = http_task;
-    data.finished_tasks = finished_tasks;
-    data.cpool = cpool;
+    token_header = g_strdup_printf ("Seafile-Repo-Token: %s", task->token);
+    stream->headers = curl_slist_append (stream->headers, token_header);
+    g_free (token_header);
 
-    tpool = g_thread_pool_new (upload_block_thread_func, &data,
-                               DEFAULT_UPLOAD_BLOCK_THREADS, FALSE, NULL);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, stream->headers);
+    curl_easy_setopt(curl, CURLOPT_URL, stream->url);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    set_connection_options (curl);
+    curl_easy_setopt(curl, CURLOPT_PRIVATE, (char *)stream);
 
-    pending_tasks = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                           g_free,
-                                           (GDestroyNotify)block_upload_task_free);
+    /* Use HTTP/2 for https and wait for an existing connection to
+     * find out if it can be multiplexed, rather than opening
+     * a new connection for every stream.
+     */
+    curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+    curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
 
-    info = seaf_sync_manager_get_sync_info (seaf->sync_mgr, http_task->repo_id);
+    /* Set low speed limit to 1 bytes. This effectively means no data. */
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1);
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, HTTP_TIMEOUT_SEC);
 
-    for (ptr = block_list; ptr; ptr = ptr->next) {
-        block_id = ptr->data;
+    if (seaf->disable_verify_certificate) {
+        curl_easy_setopt (curl, CURLOPT_SSL_VERIFYPEER, 0L);
+        curl_easy_setopt (curl, CURLOPT_SSL_VERIFYHOST, 0L);
+    }
 
-        task = g_new0 (BlockUploadTask, 1);
-        memcpy (task->block_id, block_id, 40);
+    if (stream->upload) {
+        curl_easy_setopt(curl, CURLOPT_UPLOAD, 1L);
+        curl_easy_setopt(curl, CURLOPT_READFUNCTION, send_block_callback);
+        curl_easy_setopt(curl, CURLOPT_READDATA, &stream->data);
+        curl_easy_setopt(curl, CURLOPT_INFILESIZE_LARGE, (curl_off_t)stream->block_size);
+    } else {
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, get_block_callback);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &stream->data);
+    }
 
-        if (!g_hash_table_lookup (pending_tasks, block_id)) {
-            g_hash_table_insert (pending_tasks, g_strdup(block_id), task);
-            g_thread_pool_push (tpool, task, NULL);
+    gboolean is_https = (strncasecmp(stream->url, "https", strlen("https")) == 0);
+    set_proxy (curl, is_https);
+
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+
+#ifndef USE_GPL_CRYPTO
+#if defined WIN32 || defined __APPLE__
+    load_ca_bundle (curl);
+#endif
+#endif
+
+#ifndef USE_GPL_CRYPTO
+    if (!seaf->disable_verify_certificate) {
+        curl_easy_setopt (curl, CURLOPT_SSL_CTX_FUNCTION, ssl_callback);
+        curl_easy_setopt (curl, CURLOPT_SSL_CTX_DATA, stream->url);
+    }
+#endif
+
+#ifdef WIN32
+    curl_easy_setopt (curl, CURLOPT_SOCKOPTFUNCTION, sockopt_callback);
+#endif
+}
+
+static BlockStream *
+block_stream_new (HttpTxTask *task, const char *block_id,
+                  gboolean upload, int refs)
+{
+    BlockStream *stream;
+    BlockMetadata *bmd;
+    BlockHandle *block;
+    char *wt_buf = NULL;
+    guint32 wt_size = 0;
+
+    if (upload) {
+        bmd = seaf_block_manager_stat_block (seaf->block_mgr,
+                                             task->repo_id, task->repo_version,
+                                             block_id);
+        if (!bmd) {
+            wt_buf = read_worktree_block (task, block_id, &wt_size);
+            if (!wt_buf)
+                return NULL;
+            block = NULL;
         } else {
-            g_free (task);
+            block = seaf_block_manager_open_block (seaf->block_mgr,
+                                                   task->repo_id,
+                                                   task->repo_version,
+                                                   block_id, BLOCK_READ);
+            if (!block) {
+                seaf_warning ("Failed to open block %s in repo %s.\n",
+                              block_id, task->repo_id);
+                task->error = SYNC_ERROR_ID_LOCAL_DATA_CORRUPT;
+                g_free (bmd);
+                return NULL;
+            }
+        }
+    } else {
+        bmd = NULL;
+        block = seaf_block_manager_open_block (seaf->block_mgr,
+                                               task->repo_id, task->repo_version,
+                                               block_id, BLOCK_WRITE);
+        if (!block) {
+            seaf_warning ("Failed to open block %s in repo %.8s.\n",
+                          block_id, task->repo_id);
+            task->error = SYNC_ERROR_ID_WRITE_LOCAL_DATA;
+            return NULL;
         }
     }
 
-    while ((task = g_async_queue_pop (finished_tasks)) != NULL) {
-        if (task->result < 0 || http_task->state == HTTP_TASK_STATE_CANCELED) {
-            ret = task->result;
-            http_task->all_stop = TRUE;
-            break;
-        }
+    stream = g_new0 (BlockStream, 1);
+    stream->upload = upload;
+    stream->refs = refs;
+    stream->start = seaf_metrics_now ();
+    if (bmd) {
+        stream->block_size = bmd->size;
+        g_free (bmd);
+    } else if (wt_buf) {
+        stream->block_size = wt_size;
+        stream->data.buf = wt_buf;
+        stream->data.buf_len = wt_size;
+    }
+    memcpy (stream->data.block_id, block_id, 40);
+    stream->data.block = block;
+    stream->data.task = task;
+    stream->data.no_wait = TRUE;
 
-        ++(http_task->done_blocks);
+    if (!task->use_fileserver_port)
+        stream->url = g_strdup_printf ("%s/seafhttp/repo/%s/block/%s",
+                                       task->host, task->repo_id, block_id);
+    else
+        stream->url = g_strdup_printf ("%s/repo/%s/block/%s",
+                                       task->host, task->repo_id, block_id);
 
-        if (info && info->multipart_upload) {
-            info->uploaded_bytes += (gint64)task->block_size;
-        }
+    stream->curl = curl_easy_init ();
+    if (!stream->curl) {
+        seaf_warning ("Failed to init curl handle.\n");
+        task->error = SYNC_ERROR_ID_NOT_ENOUGH_MEMORY;
+        block_stream_free (stream);
+        return NULL;
+    }
 
-        g_hash_table_remove (pending_tasks, task->block_id);
-        if (g_hash_table_size(pending_tasks) == 0)
-            break;
+    set_block_stream_options (stream, task);
+
+    return stream;
+}
+
+static int
+finish_block_stream (HttpTxTask *task, BlockStream *stream,
+                     CURLcode result, SyncInfo *info)
+{
+    long status;
+
+    seaf_trace_span (stream->upload ? "send_block" : "get_block",
+                     stream->start, stream->data.block_id);
+
+    if (result != CURLE_OK) {
+        seaf_warning ("libcurl failed to %s %s: %s.\n",
+                      stream->upload ? "PUT" : "GET",
+                      stream->url, curl_easy_strerror(result));
+        if (task->state != HTTP_TASK_STATE_CANCELED &&
+            task->error == SYNC_ERROR_ID_NO_ERROR)
+            handle_curl_errors (task, result);
+        return -1;
     }
 
-    g_thread_pool_free (tpool, TRUE, TRUE);
+    if (curl_easy_getinfo (stream->curl, CURLINFO_RESPONSE_CODE, &status) != CURLE_OK) {
+        seaf_warning ("Failed to get status code for %s.\n", stream->url);
+        return -1;
+    }
 
-    g_hash_table_destroy (pending_tasks);
+    if (status != HTTP_OK) {
+        seaf_warning ("Bad response code for %s %s: %ld.\n",
+                      stream->upload ? "PUT" : "GET", stream->url, status);
+        handle_http_errors (task, (int)status);
+        return -1;
+    }
 
-    g_async_queue_unref (finished_tasks);
+    if (stream->upload) {
+        server_block_cache_add (task->block_cache, stream->data.block_id);
+        transfer_journal_block_sent (seaf->http_tx_mgr->priv->journal,
+                                     task->repo_id, stream->data.block_id);
+        ++(task->done_blocks);
+        task->done_block_bytes += (gint64)stream->block_size;
+        if (info && info->multipart_upload)
+            info->uploaded_bytes += (gint64)stream->block_size;
+        return 0;
+    }
 
-    return ret;
+    stream->block_closed = TRUE;
+    return commit_downloaded_block (task, stream->data.block,
+                                    stream->data.block_id, stream->refs);
 }
 
+/* Resume the streams paused by the bandwidth limit whose wait is over. */
 static void
-notify_permission_error (HttpTxTask *task, const char *error_str)
+resume_block_streams (GList *streams)
 {
-    HttpTxPriv *priv = seaf->http_tx_mgr->priv;
-    GMatchInfo *match_info;
-    char *path;
+    gint64 now = g_get_monotonic_time ();
+    BlockStream *stream;
+    GList *ptr;
 
-    if (g_regex_match (priv->locked_error_regex, error_str, 0, &match_info)) {
-        path = g_match_info_fetch (match_info, 1);
-        seaf_repo_manager_record_sync_error (task->repo_id, task->repo_name, path,
-                                             SYNC_ERROR_ID_FILE_LOCKED);
-        g_free (path);
+    for (ptr = streams; ptr; ptr = ptr->next) {
+        stream = ptr->data;
+        if (stream->data.paused && stream->data.resume_time <= now) {
+            stream->data.paused = FALSE;
+            curl_easy_pause (stream->curl, CURLPAUSE_CONT);
+        }
+    }
+}
 
-        /* Set more accurate error. */
-        task->error = SYNC_ERROR_ID_FILE_LOCKED;
-    } else if (g_regex_match (priv->folder_perm_error_regex, error_str, 0, &match_info)) {
-        path = g_match_info_fetch (match_info, 1);
-        /* The path returned by server begins with '/'. */
-        seaf_repo_manager_record_sync_error (task->repo_id, task->repo_name,
-                                             (path[0] == '/') ? (path + 1) : path,
-                                             SYNC_ERROR_ID_FOLDER_PERM_DENIED);
-        g_free (path);
+/* How long to wait for socket activity before a paused stream is due. */
+static int
+block_streams_wait_msec (GList *streams)
+{
+    gint64 now = g_get_monotonic_time ();
+    int timeout = MULTI_WAIT_TIMEOUT_MSEC;
+    BlockStream *stream;
+    GList *ptr;
 
-        task->error = SYNC_ERROR_ID_FOLDER_PERM_DENIED;
+    for (ptr = streams; ptr; ptr = ptr->next) {
+        stream = ptr->data;
+        if (stream->data.paused)
+            timeout = MIN (timeout,
+                           MAX (stream->data.resume_time - now, 0) / 1000 + 1);
     }
 
-    g_match_info_free (match_info);
+    return timeout;
 }
 
+/*
+ * Transfer all blocks in @block_list through one curl multi handle, with at
+ * most seaf->http2_max_streams requests in flight.
+ * For downloads, @block_refs maps block id to the number of references
+ * to take on the block after it's committed.
+ */
 static int
-update_branch (HttpTxTask *task, Connection *conn)
+multiplexed_transfer_blocks (HttpTxTask *task, GList *block_list,
+                             gboolean upload, GHashTable *block_refs)
 {
-    CURL *curl;
-    char *url;
-    int status;
-    char *rsp_content = NULL;
-    char *rsp_content_str = NULL;
-    gint64 rsp_size;
+    CURLM *multi;
+    CURLMsg *msg;
+    GList *ptr = block_list;
+    GList *streams = NULL;
+    GHashTable *scheduled;
+    BlockStream *stream;
+    ConnectionPool *cpool;
+    SyncInfo *info = NULL;
+    int max_streams, n_streams = 0;
+    int still_running, msgs_left;
     int ret = 0;
 
-    curl = conn->curl;
+    if (block_list == NULL)
+        return 0;
 
-    if (!task->use_fileserver_port)
-        url = g_strdup_printf ("%s/seafhttp/repo/%s/commit/HEAD/?head=%s",
-                               task->host, task->repo_id, task->head);
-    else
-        url = g_strdup_printf ("%s/repo/%s/commit/HEAD/?head=%s",
-                               task->host, task->repo_id, task->head);
+    max_streams = MIN (seaf->http2_max_streams, MAX_HTTP2_STREAMS);
+    if (max_streams <= 0)
+        max_streams = 1;
 
-    int curl_error;
-    if (http_put (curl, url, task->token,
-                  NULL, 0,
-                  NULL, NULL,
-                  &status, &rsp_content, &rsp_size, TRUE, &curl_error) < 0) {
-        conn->release = TRUE;
-        handle_curl_errors (task, curl_error);
-        ret = -1;
-        goto out;
+    if (upload)
+        info = seaf_sync_manager_get_sync_info (seaf->sync_mgr, task->repo_id);
+
+    multi = curl_multi_init ();
+    if (!multi) {
+        seaf_warning ("Failed to init curl multi handle.\n");
+        task->error = SYNC_ERROR_ID_NOT_ENOUGH_MEMORY;
+        return -1;
     }
 
-    if (status != HTTP_OK) {
-        seaf_warning ("Bad response code for PUT %s: %d.\n", url, status);
-        handle_http_errors (task, status);
+    curl_multi_setopt (multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    /* Only matters when the server doesn't support HTTP/2. */
+    cpool = find_connection_pool (seaf->http_tx_mgr->priv, task->host);
+    curl_multi_setopt (multi, CURLMOPT_MAX_HOST_CONNECTIONS,
+                       (long)transfer_concurrency_get_limit (cpool->concurrency));
 
-        if (status == HTTP_FORBIDDEN) {
-            rsp_content_str = g_new0 (gchar, rsp_size + 1);
-            memcpy (rsp_content_str, rsp_content, rsp_size);
-            seaf_warning ("%s\n", rsp_content_str);
-            notify_permission_error (task, rsp_content_str);
-            g_free (rsp_content_str);
+    scheduled = g_hash_table_new (g_str_hash, g_str_equal);
+
+    while (1) {
+        while (ptr && n_streams < max_streams) {
+            const char *block_id = ptr->data;
+            int refs = 1;
+
+            ptr = ptr->next;
+
+            if (g_hash_table_lookup (scheduled, block_id))
+                continue;
+            g_hash_table_insert (scheduled, (gpointer)block_id, (gpointer)block_id);
+
+            if (block_refs)
+                refs = GPOINTER_TO_INT (g_hash_table_lookup (block_refs, block_id));
+
+            stream = block_stream_new (task, block_id, upload, refs);
+            if (!stream) {
+                ret = -1;
+                goto out;
+            }
+            curl_multi_add_handle (multi, stream->curl);
+            streams = g_list_prepend (streams, stream);
+            ++n_streams;
         }
 
-        ret = -1;
+        if (!streams)
+            break;
+
+        resume_block_streams (streams);
+
+        curl_multi_perform (multi, &still_running);
+
+        while ((msg = curl_multi_info_read (multi, &msgs_left)) != NULL) {
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+
+            curl_easy_getinfo (msg->easy_handle, CURLINFO_PRIVATE, (char **)&stream);
+
+            int rc = finish_block_stream (task, stream, msg->data.result, info);
+
+            curl_multi_remove_handle (multi, stream->curl);
+            streams = g_list_remove (streams, stream);
+            --n_streams;
+            block_stream_free (stream);
+
+            if (rc < 0) {
+                ret = -1;
+                goto out;
+            }
+        }
+
+        if (task->state == HTTP_TASK_STATE_CANCELED || task->all_stop)
+            goto out;
+
+        curl_multi_wait (multi, NULL, 0, block_streams_wait_msec (streams), NULL);
     }
 
 out:
-    g_free (url);
-    g_free (rsp_content);
-    curl_easy_reset (curl);
+    for (ptr = streams; ptr; ptr = ptr->next) {
+        stream = ptr->data;
+        curl_multi_remove_handle (multi, stream->curl);
+        block_stream_free (stream);
+    }
+    g_list_free (streams);
+    g_hash_table_destroy (scheduled);
+    curl_multi_cleanup (multi);
 
     return ret;
 }
 
+#endif  /* HTTP_MULTIPLEX_SUPPORTED */
+
+typedef struct BlockUploadData {
+    HttpTxTask *http_task;
+    ConnectionPool *cpool;
+    GAsyncQueue *finished_tasks;
+} BlockUploadData;
+
+typedef struct BlockUploadTask {
+    char block_id[41];
+    int result;
+    guint32 block_size;
+} BlockUploadTask;
+
 static void
-update_master_branch (HttpTxTask *task)
+block_upload_task_free (BlockUploadTask *task)
 {
-    SeafBranch *branch;
-    branch = seaf_branch_manager_get_branch (seaf->branch_mgr,
-                                             task->repo_id,
-                                             "master");
-    if (!branch) {
-        branch = seaf_branch_new ("master", task->repo_id, task->head);
-        seaf_branch_manager_add_branch (seaf->branch_mgr, branch);
-        seaf_branch_unref (branch);
-    } else {
-        seaf_branch_set_commit (branch, task->head);
-        seaf_branch_manager_update_branch (seaf->branch_mgr, branch);
-        seaf_branch_unref (branch);
+    g_free (task);
+}
+
+static void
+upload_block_thread_func (gpointer data, gpointer user_data)
+{
+    BlockUploadTask *task = data;
+    BlockUploadData *tx_data = user_data;
+    HttpTxTask *http_task = tx_data->http_task;
+    Connection *conn;
+    int ret = 0;
+
+    conn = connection_pool_get_connection (tx_data->cpool);
+    if (!conn) {
+        seaf_warning ("Failed to get connection to host %s.\n", http_task->host);
+        http_task->error = SYNC_ERROR_ID_NOT_ENOUGH_MEMORY;
+        ret = -1;
+        goto out;
     }
+
+    gint64 start = seaf_metrics_now ();
+    transfer_concurrency_acquire (tx_data->cpool->concurrency);
+    ret = send_block (http_task, conn, task->block_id, &task->block_size);
+    seaf_trace_span ("send_block", start, task->block_id);
+    transfer_concurrency_release (tx_data->cpool->concurrency,
+                                  task->block_size, ret < 0 && conn->release);
+
+    connection_pool_return_connection (tx_data->cpool, conn);
+
+out:
+    task->result = ret;
+    g_async_queue_push (tx_data->finished_tasks, task);
 }
 
+/* The sender stops at the first block it gets back after a cancel. */
 static void
-set_path_status_syncing (gpointer key, gpointer value, gpointer user_data)
+drop_upload_block_task (gpointer data, gpointer user_data)
 {
-    HttpTxTask *task = user_data;
-    char *path = key;
-    int mode = (int)(long)value;
-    seaf_sync_manager_update_active_path (seaf->sync_mgr,
-                                          task->repo_id,
-                                          path,
-                                          mode,
-                                          SYNC_STATUS_SYNCING,
-                                          TRUE);
+    BlockUploadTask *task = data;
+    BlockUploadData *tx_data = user_data;
+
+    g_async_queue_push (tx_data->finished_tasks, task);
 }
 
+/*
+ * Servers that set "block_pack" in the protocol version response accept
+ * packs of small blocks in one request, with the same framing as fs objects.
+ * Blocks up to HTTP_MAX_PACKED_BLOCK_SIZE are sent that way, instead of
+ * paying a request for every few KB. Larger blocks are still sent one by one.
+ */
+#define BLOCK_PACK_SIZE (1 << 20)
+
+typedef struct BlockPack {
+    struct evbuffer *buf;
+    GList *block_ids;
+    int n_blocks;
+    gint64 data_size;
+    int result;
+    gint64 budget;
+} BlockPack;
+
 static void
-set_path_status_synced (gpointer key, gpointer value, gpointer user_data)
+block_pack_free (BlockPack *pack)
 {
-    HttpTxTask *task = user_data;
-    char *path = key;
-    int mode = (int)(long)value;
-    seaf_sync_manager_update_active_path (seaf->sync_mgr,
-                                          task->repo_id,
-                                          path,
-                                          mode,
-                                          SYNC_STATUS_SYNCED,
-                                          TRUE);
+    if (pack->buf)
+        evbuffer_free (pack->buf);
+    seaf_mem_budget_release (SEAF_MEM_BLOCK_UPLOAD, pack->budget);
+    string_list_free (pack->block_ids);
+    g_free (pack);
 }
 
-static void *
-http_upload_thread (void *vdata)
+static int
+add_block_to_pack (HttpTxTask *task, BlockPack *pack, const char *block_id)
 {
-    HttpTxTask *task = vdata;
-    HttpTxPriv *priv = seaf->http_tx_mgr->priv;
-    ConnectionPool *pool;
-    Connection *conn = NULL;
-    char *url = NULL;
-    GList *send_fs_list = NULL, *needed_fs_list = NULL;
-    GList *block_list = NULL, *needed_block_list = NULL;
-    GHashTable *active_paths = NULL;
+    BlockMetadata *bmd;
+    BlockHandle *block;
+    ObjectHeader hdr;
+    char *data = NULL;
+    guint32 size;
 
-    SeafBranch *local = seaf_branch_manager_get_branch (seaf->branch_mgr,
-                                                        task->repo_id, "local");
-    if (!local) {
-        seaf_warning ("Failed to get branch local of repo %.8s.\n", task->repo_id);
+    bmd = seaf_block_manager_stat_block (seaf->block_mgr,
+                                         task->repo_id, task->repo_version,
+                                         block_id);
+    if (!bmd) {
+        data = read_worktree_block (task, block_id, &size);
+        if (!data)
+            return -1;
+        goto add;
+    }
+    size = bmd->size;
+    g_free (bmd);
+
+    block = seaf_block_manager_open_block (seaf->block_mgr,
+                                           task->repo_id, task->repo_version,
+                                           block_id, BLOCK_READ);
+    if (!block) {
+        seaf_warning ("Failed to open block %s in repo %s.\n",
+                      block_id, task->repo_id);
         task->error = SYNC_ERROR_ID_LOCAL_DATA_CORRUPT;
-        return NULL;
+        return -1;
     }
-    memcpy (task->head, local->commit_id, 40);
-    seaf_branch_unref (local);
 
-    pool = find_connection_pool (priv, task->host);
-    if (!pool) {
-        seaf_warning ("Failed to create connection pool for host %s.\n", task->host);
-        task->error = SYNC_ERROR_ID_NOT_ENOUGH_MEMORY;
-        goto out;
+    if (size > 0)
+        data = read_whole_block (task, block, block_id, size);
+
+    seaf_block_manager_close_block (seaf->block_mgr, block);
+    seaf_block_manager_block_handle_free (seaf->block_mgr, block);
+
+    if (size > 0 && !data)
+        return -1;
+
+add:
+    memcpy (hdr.obj_id, block_id, 40);
+    hdr.obj_size = htonl (size);
+
+    evbuffer_add (pack->buf, &hdr, sizeof(hdr));
+    if (size == 0 ||
+        evbuffer_add_reference (pack->buf, data, size,
+                                free_object_data, NULL) < 0) {
+        evbuffer_add (pack->buf, data, size);
+        g_free (data);
     }
 
-    conn = connection_pool_get_connection (pool);
+    pack->block_ids = g_list_prepend (pack->block_ids, g_strdup(block_id));
+    ++(pack->n_blocks);
+    pack->data_size += size;
+
+    return 0;
+}
+
+/* The caller has reserved BLOCK_PACK_SIZE bytes of memory budget. */
+static BlockPack *
+pack_blocks (HttpTxTask *task, GList **small_blocks)
+{
+    BlockPack *pack;
+
+    pack = g_new0 (BlockPack, 1);
+    pack->buf = evbuffer_new ();
+    pack->budget = BLOCK_PACK_SIZE;
+
+    while (*small_blocks != NULL &&
+           pack->n_blocks < HTTP_MAX_BLOCKS_PER_PACK &&
+           evbuffer_get_length (pack->buf) < BLOCK_PACK_SIZE) {
+        if (add_block_to_pack (task, pack, (*small_blocks)->data) < 0) {
+            block_pack_free (pack);
+            return NULL;
+        }
+        *small_blocks = g_list_delete_link (*small_blocks, *small_blocks);
+    }
+
+    return pack;
+}
+
+static void
+upload_block_pack_thread_func (gpointer data, gpointer user_data)
+{
+    BlockPack *pack = data;
+    BlockUploadData *tx_data = user_data;
+    HttpTxTask *task = tx_data->http_task;
+    TransferJournal *journal = seaf->http_tx_mgr->priv->journal;
+    Connection *conn;
+    GList *ptr;
+    char *url = NULL;
+    int status;
+    int curl_error;
+    gint64 start = seaf_metrics_now ();
+
+    if (task->state == HTTP_TASK_STATE_CANCELED)
+        goto out;
+
+    conn = connection_pool_get_connection (tx_data->cpool);
     if (!conn) {
         seaf_warning ("Failed to get connection to host %s.\n", task->host);
         task->error = SYNC_ERROR_ID_NOT_ENOUGH_MEMORY;
+        pack->result = -1;
         goto out;
     }
 
-    /* seaf_message ("Upload with HTTP sync protocol version %d.\n", */
-    /*               task->protocol_version); */
+    if (!task->use_fileserver_port)
+        url = g_strdup_printf ("%s/seafhttp/repo/%s/recv-blocks/",
+                               task->host, task->repo_id);
+    else
+        url = g_strdup_printf ("%s/repo/%s/recv-blocks/",
+                               task->host, task->repo_id);
 
-    transition_state (task, task->state, HTTP_TASK_RT_STATE_CHECK);
+    bandwidth_flow_consume (task->flow, seaf_transfer_policy_get_upload_limit (),
+                            (int)pack->data_size);
+
+    transfer_concurrency_acquire (tx_data->cpool->concurrency);
+    if (http_post_evbuffer (conn->curl, url, task->token, pack->buf,
+                            &status, NULL, NULL, TRUE, &curl_error) < 0) {
+        conn->release = TRUE;
+        handle_curl_errors (task, curl_error);
+        pack->result = -1;
+    } else if (status != HTTP_OK) {
+        seaf_warning ("Bad response code for POST %s: %d.\n", url, status);
+        handle_http_errors (task, status);
+        pack->result = -1;
+    }
+    transfer_concurrency_release (tx_data->cpool->concurrency, pack->data_size,
+                                  pack->result < 0 && conn->release);
 
-    gint64 delta = 0;
-    active_paths = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    curl_easy_reset (conn->curl);
+    connection_pool_return_connection (tx_data->cpool, conn);
 
-    if (calculate_upload_size_delta_and_active_paths (task, &delta, active_paths) < 0) {
-        seaf_warning ("Failed to calculate upload size delta for repo %s.\n",
-                      task->repo_id);
-        task->error = SYNC_ERROR_ID_LOCAL_DATA_CORRUPT;
+    if (pack->result < 0)
         goto out;
+
+    for (ptr = pack->block_ids; ptr; ptr = ptr->next)
+        server_block_cache_add (task->block_cache, ptr->data);
+    transfer_journal_blocks_sent (journal, task->repo_id, pack->block_ids);
+
+    g_atomic_int_add (&(seaf->sync_mgr->sent_bytes), (int)pack->data_size);
+    g_atomic_int_add (&task->tx_bytes, (int)pack->data_size);
+
+    seaf_debug ("Sent %d blocks in one pack for %s:%s.\n",
+                pack->n_blocks, task->host, task->repo_id);
+
+out:
+    g_free (url);
+    seaf_trace_span ("upload_block_pack", start, task->repo_id);
+    g_async_queue_push (tx_data->finished_tasks, pack);
+}
+
+static int
+send_block_packs (HttpTxTask *http_task, ConnectionPool *cpool,
+                  GList **small_blocks)
+{
+    GThreadPool *tpool;
+    GAsyncQueue *finished_packs;
+    BlockUploadData data;
+    BlockPack *pack;
+    SyncInfo *info;
+    int n_running = 0;
+    gboolean stop = FALSE;
+    int ret = 0;
+
+    finished_packs = g_async_queue_new ();
+
+    data.http_task = http_task;
+    data.cpool = cpool;
+    data.finished_tasks = finished_packs;
+
+    tpool = g_thread_pool_new (upload_block_pack_thread_func, &data,
+                               seaf->max_transfer_threads, FALSE, NULL);
+
+    info = seaf_sync_manager_get_sync_info (seaf->sync_mgr, http_task->repo_id);
+
+    while (1) {
+        /* Only read as many packs as can be sent at once. */
+        while (!stop && *small_blocks != NULL &&
+               n_running < transfer_concurrency_get_limit (cpool->concurrency) &&
+               reserve_pack_budget (SEAF_MEM_BLOCK_UPLOAD, n_running,
+                                    BLOCK_PACK_SIZE)) {
+            pack = pack_blocks (http_task, small_blocks);
+            if (!pack) {
+                ret = -1;
+                stop = TRUE;
+                break;
+            }
+            g_thread_pool_push (tpool, pack, NULL);
+            ++n_running;
+        }
+
+        if (n_running == 0)
+            break;
+
+        pack = g_async_queue_pop (finished_packs);
+        --n_running;
+
+        if (pack->result < 0) {
+            ret = -1;
+            stop = TRUE;
+            http_task->all_stop = TRUE;
+        } else if (http_task->state == HTTP_TASK_STATE_CANCELED) {
+            stop = TRUE;
+        } else {
+            http_task->done_blocks += pack->n_blocks;
+            http_task->done_block_bytes += pack->data_size;
+            if (info && info->multipart_upload)
+                info->uploaded_bytes += pack->data_size;
+        }
+
+        block_pack_free (pack);
     }
 
-    g_hash_table_foreach (active_paths, set_path_status_syncing, task);
+    g_thread_pool_free (tpool, FALSE, TRUE);
+    g_async_queue_unref (finished_packs);
 
-    if (check_permission (task, conn) < 0) {
-        seaf_warning ("Upload permission denied for repo %.8s on server %s.\n",
-                      task->repo_id, task->host);
-        goto out;
+    return ret;
+}
+
+static int
+send_blocks_one_by_one (HttpTxTask *http_task, GList *block_list)
+{
+    HttpTxPriv *priv = seaf->http_tx_mgr->priv;
+    SeafTaskGroup *tasks;
+    GAsyncQueue *finished_tasks;
+    GHashTable *pending_tasks;
+    ConnectionPool *cpool;
+    GList *ptr;
+    char *block_id;
+    BlockUploadTask *task;
+    SyncInfo *info;
+    int ret = 0;
+
+    if (block_list == NULL)
+        return 0;
+
+#ifdef HTTP_MULTIPLEX_SUPPORTED
+    if (seaf->http2_max_streams > 0)
+        return multiplexed_transfer_blocks (http_task, block_list, TRUE, NULL);
+#endif
+
+    cpool = find_connection_pool (priv, http_task->host);
+    if (!cpool) {
+        seaf_warning ("Failed to create connection pool for host %s.\n", http_task->host);
+        http_task->error = SYNC_ERROR_ID_NOT_ENOUGH_MEMORY;
+        return -1;
     }
 
-    if (check_quota (task, conn, delta) < 0) {
-        seaf_warning ("Not enough quota for repo %.8s on server %s.\n",
-                      task->repo_id, task->host);
-        goto out;
+    finished_tasks = g_async_queue_new ();
+
+    BlockUploadData data;
+    data.http_task = http_task;
+    data.finished_tasks = finished_tasks;
+    data.cpool = cpool;
+
+    /* Threads wait for a transfer slot, so only the slots limit how many
+     * blocks are sent at once.
+     */
+    tasks = seaf_task_group_new (SEAF_LANE_IO, SEAF_TASK_PRIORITY_NORMAL,
+                                 seaf->max_transfer_threads,
+                                 upload_block_thread_func, &data);
+    seaf_task_group_set_cancel_func (tasks, http_tx_task_is_canceled,
+                                     http_task, drop_upload_block_task);
+
+    pending_tasks = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                           g_free,
+                                           (GDestroyNotify)block_upload_task_free);
+
+    info = seaf_sync_manager_get_sync_info (seaf->sync_mgr, http_task->repo_id);
+
+    for (ptr = block_list; ptr; ptr = ptr->next) {
+        block_id = ptr->data;
+
+        task = g_new0 (BlockUploadTask, 1);
+        memcpy (task->block_id, block_id, 40);
+
+        if (!g_hash_table_lookup (pending_tasks, block_id)) {
+            g_hash_table_insert (pending_tasks, g_strdup(block_id), task);
+            seaf_task_group_push (tasks, task);
+        } else {
+            g_free (task);
+        }
     }
 
-    if (task->state == HTTP_TASK_STATE_CANCELED)
-        goto out;
+    while ((task = g_async_queue_pop (finished_tasks)) != NULL) {
+        if (task->result < 0 || http_task->state == HTTP_TASK_STATE_CANCELED) {
+            ret = task->result;
+            http_task->all_stop = TRUE;
+            break;
+        }
+
+        ++(http_task->done_blocks);
+        http_task->done_block_bytes += (gint64)task->block_size;
+
+        if (info && info->multipart_upload) {
+            info->uploaded_bytes += (gint64)task->block_size;
+        }
+
+        g_hash_table_remove (pending_tasks, task->block_id);
+        if (g_hash_table_size(pending_tasks) == 0)
+            break;
+    }
+
+    seaf_task_group_free (tasks, TRUE);
+
+    g_hash_table_destroy (pending_tasks);
+
+    g_async_queue_unref (finished_tasks);
+
+    return ret;
+}
+
+static int
+multi_threaded_send_blocks (HttpTxTask *http_task, GList *block_list)
+{
+    HttpTxPriv *priv = seaf->http_tx_mgr->priv;
+    ConnectionPool *cpool;
+    GList *small_blocks = NULL, *large_blocks = NULL;
+    BlockList *added;
+    GList *ptr;
+    BlockMetadata *bmd;
+    guint32 size;
+    int ret = 0;
+
+    cpool = find_connection_pool (priv, http_task->host);
+    if (!cpool || !cpool->block_pack)
+        return send_blocks_one_by_one (http_task, block_list);
+
+    added = block_list_new ();
+
+    for (ptr = block_list; ptr; ptr = ptr->next) {
+        if (!block_list_insert (added, ptr->data))
+            continue;
+
+        bmd = seaf_block_manager_stat_block (seaf->block_mgr,
+                                             http_task->repo_id,
+                                             http_task->repo_version,
+                                             ptr->data);
+        if (bmd)
+            size = bmd->size;
+        else
+            size = seaf_content_index_get_block_len (http_task->repo_id,
+                                                     ptr->data);
+        /* Errors are reported when the block is sent. */
+        if ((bmd || size > 0) && size <= HTTP_MAX_PACKED_BLOCK_SIZE)
+            small_blocks = g_list_prepend (small_blocks, g_strdup(ptr->data));
+        else
+            large_blocks = g_list_prepend (large_blocks, ptr->data);
+        g_free (bmd);
+    }
+
+    block_list_free (added);
+
+    small_blocks = g_list_reverse (small_blocks);
+    large_blocks = g_list_reverse (large_blocks);
+
+    if (small_blocks)
+        ret = send_block_packs (http_task, cpool, &small_blocks);
+
+    if (ret == 0 && http_task->state != HTTP_TASK_STATE_CANCELED)
+        ret = send_blocks_one_by_one (http_task, large_blocks);
+
+    string_list_free (small_blocks);
+    g_list_free (large_blocks);
+
+    return ret;
+}
+
+static void
+notify_permission_error (HttpTxTask *task, const char *error_str)
+{
+    HttpTxPriv *priv = seaf->http_tx_mgr->priv;
+    GMatchInfo *match_info;
+    char *path;
+
+    if (g_regex_match (priv->locked_error_regex, error_str, 0, &match_info)) {
+        path = g_match_info_fetch (match_info, 1);
+        seaf_repo_manager_record_sync_error (task->repo_id, task->repo_name, path,
+                                             SYNC_ERROR_ID_FILE_LOCKED);
+        g_free (path);
+
+        /* Set more accurate error. */
+        task->error = SYNC_ERROR_ID_FILE_LOCKED;
+    } else if (g_regex_match (priv->folder_perm_error_regex, error_str, 0, &match_info)) {
+        path = g_match_info_fetch (match_info, 1);
+        /* The path returned by server begins with '/'. */
+        seaf_repo_manager_record_sync_error (task->repo_id, task->repo_name,
+                                             (path[0] == '/') ? (path + 1) : path,
+                                             SYNC_ERROR_ID_FOLDER_PERM_DENIED);
+        g_free (path);
+
+        task->error = SYNC_ERROR_ID_FOLDER_PERM_DENIED;
+    }
+
+    g_match_info_free (match_info);
+}
+
+static int
+update_branch (HttpTxTask *task, Connection *conn)
+{
+    CURL *curl;
+    char *url;
+    int status;
+    char *rsp_content = NULL;
+    char *rsp_content_str = NULL;
+    gint64 rsp_size;
+    int ret = 0;
+
+    curl = conn->curl;
+
+    if (!task->use_fileserver_port)
+        url = g_strdup_printf ("%s/seafhttp/repo/%s/commit/HEAD/?head=%s",
+                               task->host, task->repo_id, task->head);
+    else
+        url = g_strdup_printf ("%s/repo/%s/commit/HEAD/?head=%s",
+                               task->host, task->repo_id, task->head);
+
+    int curl_error;
+    if (http_put (curl, url, task->token,
+                  NULL, 0,
+                  NULL, NULL,
+                  &status, &rsp_content, &rsp_size, TRUE, &curl_error) < 0) {
+        conn->release = TRUE;
+        handle_curl_errors (task, curl_error);
+        ret = -1;
+        goto out;
+    }
+
+    if (status != HTTP_OK) {
+        seaf_warning ("Bad response code for PUT %s: %d.\n", url, status);
+        handle_http_errors (task, status);
+
+        if (status == HTTP_FORBIDDEN) {
+            rsp_content_str = g_new0 (gchar, rsp_size + 1);
+            memcpy (rsp_content_str, rsp_content, rsp_size);
+            seaf_warning ("%s\n", rsp_content_str);
+            notify_permission_error (task, rsp_content_str);
+            g_free (rsp_content_str);
+        }
+
+        ret = -1;
+    }
+
+out:
+    g_free (url);
+    g_free (rsp_content);
+    curl_easy_reset (curl);
+
+    return ret;
+}
+
+static void
+update_master_branch (HttpTxTask *task)
+{
+    SeafBranch *branch;
+    branch = seaf_branch_manager_get_branch (seaf->branch_mgr,
+                                             task->repo_id,
+                                             "master");
+    if (!branch) {
+        branch = seaf_branch_new ("master", task->repo_id, task->head);
+        seaf_branch_manager_add_branch (seaf->branch_mgr, branch);
+        seaf_branch_unref (branch);
+    } else {
+        seaf_branch_set_commit (branch, task->head);
+        seaf_branch_manager_update_branch (seaf->branch_mgr, branch);
+        seaf_branch_unref (branch);
+    }
+}
+
+static void
+set_path_status_syncing (gpointer key, gpointer value, gpointer user_data)
+{
+    HttpTxTask *task = user_data;
+    char *path = key;
+    int mode = (int)(long)value;
+    seaf_sync_manager_update_active_path (seaf->sync_mgr,
+                                          task->repo_id,
+                                          path,
+                                          mode,
+                                          SYNC_STATUS_SYNCING,
+                                          TRUE);
+}
+
+static void
+set_path_status_synced (gpointer key, gpointer value, gpointer user_data)
+{
+    HttpTxTask *task = user_data;
+    char *path = key;
+    int mode = (int)(long)value;
+    seaf_sync_manager_update_active_path (seaf->sync_mgr,
+                                          task->repo_id,
+                                          path,
+                                          mode,
+                                          SYNC_STATUS_SYNCED,
+                                          TRUE);
+}
+
+static void *
+http_upload_thread (void *vdata)
+{
+    HttpTxTask *task = vdata;
+    HttpTxPriv *priv = seaf->http_tx_mgr->priv;
+    ConnectionPool *pool;
+    Connection *conn = NULL;
+    char *url = NULL;
+    GList *needed_fs_list = NULL;
+    GList *needed_block_list = NULL;
+    UploadDiffData diff;
+    gboolean resume_blocks;
+    int n_cached_blocks = 0;
+    SeafRepo *repo;
+
+    memset (&diff, 0, sizeof(diff));
+
+    task->block_cache = server_block_cache_load (task->repo_id, task->host);
+
+    SeafBranch *local = seaf_branch_manager_get_branch (seaf->branch_mgr,
+                                                        task->repo_id, "local");
+    if (!local) {
+        seaf_warning ("Failed to get branch local of repo %.8s.\n", task->repo_id);
+        task->error = SYNC_ERROR_ID_LOCAL_DATA_CORRUPT;
+        return NULL;
+    }
+    memcpy (task->head, local->commit_id, 40);
+    seaf_branch_unref (local);
+
+    pool = find_connection_pool (priv, task->host);
+    if (!pool) {
+        seaf_warning ("Failed to create connection pool for host %s.\n", task->host);
+        task->error = SYNC_ERROR_ID_NOT_ENOUGH_MEMORY;
+        goto out;
+    }
+
+    conn = connection_pool_get_connection (pool);
+    if (!conn) {
+        seaf_warning ("Failed to get connection to host %s.\n", task->host);
+        task->error = SYNC_ERROR_ID_NOT_ENOUGH_MEMORY;
+        goto out;
+    }
+
+    /* seaf_message ("Upload with HTTP sync protocol version %d.\n", */
+    /*               task->protocol_version); */
+
+    transition_state (task, task->state, HTTP_TASK_RT_STATE_CHECK);
+    sync_phase_timer_switch (&task->timer, SYNC_PHASE_CHECK_HEAD);
+
+    /* If an upload of the same head was interrupted after its fs objects
+     * were sent, only send the blocks that are left.
+     */
+    resume_blocks = transfer_journal_get_upload_blocks (priv->journal,
+                                                        task->repo_id,
+                                                        task->head,
+                                                        &needed_block_list);
+
+    upload_diff_data_init (&diff, task, !resume_blocks);
+    if (calculate_upload_diff (task, &diff) < 0) {
+        seaf_warning ("Failed to calculate upload size delta for repo %s.\n",
+                      task->repo_id);
+        task->error = SYNC_ERROR_ID_LOCAL_DATA_CORRUPT;
+        goto out;
+    }
+
+    g_hash_table_foreach (diff.active_paths, set_path_status_syncing, task);
+
+    if (check_permission (task, conn) < 0) {
+        seaf_warning ("Upload permission denied for repo %.8s on server %s.\n",
+                      task->repo_id, task->host);
+        goto out;
+    }
+
+    if (check_quota (task, conn, diff.delta) < 0) {
+        seaf_warning ("Not enough quota for repo %.8s on server %s.\n",
+                      task->repo_id, task->host);
+        goto out;
+    }
+
+    if (task->state == HTTP_TASK_STATE_CANCELED)
+        goto out;
+
+    transition_state (task, task->state, HTTP_TASK_RT_STATE_COMMIT);
+
+    if (send_commit_object (task, conn) < 0) {
+        seaf_warning ("Failed to send head commit for repo %.8s.\n", task->repo_id);
+        goto out;
+    }
+
+    if (task->state == HTTP_TASK_STATE_CANCELED)
+        goto out;
+
+    if (resume_blocks) {
+        seaf_message ("Resume uploading %u blocks of repo %.8s.\n",
+                      g_list_length (needed_block_list), task->repo_id);
+        transition_state (task, task->state, HTTP_TASK_RT_STATE_BLOCK);
+        goto send_blocks;
+    }
+
+    transition_state (task, task->state, HTTP_TASK_RT_STATE_FS);
+    sync_phase_timer_switch (&task->timer, SYNC_PHASE_FS_LIST);
+
+    if (!task->use_fileserver_port)
+        url = g_strdup_printf ("%s/seafhttp/repo/%s/check-fs/",
+                               task->host, task->repo_id);
+    else
+        url = g_strdup_printf ("%s/repo/%s/check-fs/",
+                               task->host, task->repo_id);
+
+    if (upload_check_id_list (task, url, &diff.fs_list, NULL, &needed_fs_list,
+                              NULL, NULL) < 0) {
+        seaf_warning ("Failed to check fs list for repo %.8s.\n", task->repo_id);
+        goto out;
+    }
+
+    if (task->state == HTTP_TASK_STATE_CANCELED)
+        goto out;
+    g_free (url);
+    url = NULL;
+
+    sync_phase_timer_switch (&task->timer, SYNC_PHASE_FS_OBJECTS);
+
+    if (send_fs_objects (task, &needed_fs_list) < 0) {
+        seaf_warning ("Failed to send fs objects for repo %.8s.\n", task->repo_id);
+        goto out;
+    }
+
+    if (task->state == HTTP_TASK_STATE_CANCELED)
+        goto out;
+
+    transition_state (task, task->state, HTTP_TASK_RT_STATE_BLOCK);
+    sync_phase_timer_switch (&task->timer, SYNC_PHASE_BLOCK_LIST);
+
+    if (!task->use_fileserver_port)
+        url = g_strdup_printf ("%s/seafhttp/repo/%s/check-blocks/",
+                               task->host, task->repo_id);
+    else
+        url = g_strdup_printf ("%s/repo/%s/check-blocks/",
+                               task->host, task->repo_id);
+
+    if (upload_check_id_list (task, url, NULL, diff.blocks, &needed_block_list,
+                              task->block_cache, &n_cached_blocks) < 0) {
+        seaf_warning ("Failed to check block list for repo %.8s.\n",
+                      task->repo_id);
+        goto out;
+    }
+
+    block_list_free (diff.blocks);
+    diff.blocks = NULL;
+
+    if (task->state == HTTP_TASK_STATE_CANCELED)
+        goto out;
+    g_free (url);
+    url = NULL;
+
+    if (n_cached_blocks > 0)
+        seaf_debug ("%d blocks are known to be on %s, not checked.\n",
+                    n_cached_blocks, task->host);
+
+    transfer_journal_start_upload_blocks (priv->journal, task->repo_id,
+                                          task->head, needed_block_list);
+
+send_blocks:
+    sync_phase_timer_switch (&task->timer, SYNC_PHASE_BLOCKS);
+
+    task->n_blocks = g_list_length (needed_block_list);
+
+    seaf_debug ("%d blocks to send for %s:%s.\n",
+                task->n_blocks, task->host, task->repo_id);
+
+    if (multi_threaded_send_blocks(task, needed_block_list) < 0 ||
+        task->state == HTTP_TASK_STATE_CANCELED)
+        goto out;
+
+    transition_state (task, task->state, HTTP_TASK_RT_STATE_UPDATE_BRANCH);
+    /* Counted with the other head commit exchanges with the server. */
+    sync_phase_timer_switch (&task->timer, SYNC_PHASE_CHECK_HEAD);
+
+    repo = seaf_repo_manager_get_repo (seaf->repo_mgr, task->repo_id);
+    if (repo)
+        seaf_repo_record_upload_rate (repo, task->done_block_bytes,
+                                      task->timer.times.wall[SYNC_PHASE_BLOCKS]);
+
+    if (update_branch (task, conn) < 0) {
+        seaf_warning ("Failed to update branch of repo %.8s.\n", task->repo_id);
+        /* The server may have rejected the commit because some block we
+         * believed it had is missing. Check all blocks next time.
+         */
+        if (n_cached_blocks > 0 &&
+            (task->error == SYNC_ERROR_ID_SERVER ||
+             task->error == SYNC_ERROR_ID_GENERAL_ERROR))
+            server_block_cache_clear (task->block_cache);
+        /* Blocks recorded as sent may be the missing ones. */
+        if (task->error == SYNC_ERROR_ID_SERVER ||
+            task->error == SYNC_ERROR_ID_GENERAL_ERROR)
+            transfer_journal_remove (priv->journal, task->repo_id,
+                                     TRANSFER_JOURNAL_UPLOAD);
+        goto out;
+    }
+
+    transfer_journal_remove (priv->journal, task->repo_id,
+                             TRANSFER_JOURNAL_UPLOAD);
+
+    /* The uploaded and checked blocks are now referenced by the new head. */
+    server_block_cache_confirm (task->block_cache);
+
+    /* After successful upload, the cached 'master' branch should be updated to
+     * the head commit of 'local' branch.
+     */
+    update_master_branch (task);
+
+    g_hash_table_foreach (diff.active_paths, set_path_status_synced, task);
+
+out:
+    string_list_free (needed_fs_list);
+    string_list_free (needed_block_list);
+    upload_diff_data_clear (&diff);
+
+    g_free (url);
+
+    server_block_cache_save (task->block_cache);
+
+    connection_pool_return_connection (pool, conn);
+
+    sync_phase_timer_switch (&task->timer, SYNC_PHASE_NONE);
+
+    return vdata;
+}
+
+static void
+http_upload_done (void *vdata)
+{
+    HttpTxTask *task = vdata;
+
+    if (task->error != SYNC_ERROR_ID_NO_ERROR)
+        transition_state (task, HTTP_TASK_STATE_ERROR, HTTP_TASK_RT_STATE_FINISHED);
+    else if (task->state == HTTP_TASK_STATE_CANCELED)
+        transition_state (task, task->state, HTTP_TASK_RT_STATE_FINISHED);
+    else
+        transition_state (task, HTTP_TASK_STATE_FINISHED, HTTP_TASK_RT_STATE_FINISHED);
+}
+
+/*
+ * Pre-upload.
+ *
+ * Blocks checked in by a commit are sent while the rest of the worktree is
+ * still being indexed. The server doesn't reference them until the upload
+ * of the new commit updates the branch, and that upload only sends the
+ * blocks that check-blocks still reports as missing.
+ *
+ * In direct mode the blocks are not in the block store, but read from the
+ * worktree when they're sent. Before the commit is created, the ones the
+ * server didn't confirm are copied into the block store, since the worktree
+ * files may change before the commit is uploaded. Confirmed blocks are only
+ * kept on the server. If it drops them before the commit is uploaded, the
+ * upload reads them from the worktree again and fails if the files changed.
+ */
+
+#define PRE_UPLOAD_BATCH_N 100
+/* Blocks of small files are collected for at most so long. */
+#define PRE_UPLOAD_FLUSH_USEC 2000000
+
+/* Pushed to the queue to stop the worker. */
+#define PRE_UPLOAD_END ((gpointer)1)
+
+typedef struct PreUpload {
+    HttpTxTask *task;
+    GAsyncQueue *queue;
+    gboolean direct;
+    /* Set by http_tx_manager_pre_upload_finish(). */
+    gboolean send_all;
+    /* Direct blocks, block id -> file in @files. Protected by
+     * pre_upload_lock until finish.
+     */
+    GHashTable *direct_blocks;
+    GHashTable *files;
+    /* Blocks the server has, only used by the worker until it's joined. */
+    GHashTable *confirmed;
+    pthread_t tid;
+} PreUpload;
+
+static void
+mark_confirmed (PreUpload *pre, BlockList *batch, GList *needed)
+{
+    GHashTable *missing;
+    GList *ptr;
+    char block_id[41];
+    uint32_t i;
+
+    if (!pre->direct)
+        return;
+
+    missing = g_hash_table_new (g_str_hash, g_str_equal);
+    for (ptr = needed; ptr; ptr = ptr->next)
+        g_hash_table_add (missing, ptr->data);
+
+    for (i = 0; i < batch->n_blocks; ++i) {
+        block_list_get_id (batch, i, block_id);
+        if (!g_hash_table_contains (missing, block_id))
+            g_hash_table_add (pre->confirmed, g_strdup(block_id));
+    }
+
+    g_hash_table_destroy (missing);
+}
+
+static void
+pre_upload_send_batch (PreUpload *pre, const char *url, BlockList *batch)
+{
+    HttpTxTask *task = pre->task;
+    GList *needed = NULL;
+
+    if (task->error != SYNC_ERROR_ID_NO_ERROR ||
+        task->state == HTTP_TASK_STATE_CANCELED)
+        return;
+
+    if (upload_check_id_list (task, url, NULL, batch, &needed,
+                              task->block_cache, NULL) < 0) {
+        seaf_warning ("Failed to check blocks to pre-upload for repo %.8s.\n",
+                      task->repo_id);
+        goto out;
+    }
+
+    if (!needed) {
+        mark_confirmed (pre, batch, NULL);
+        goto out;
+    }
+
+    if (task->state == HTTP_TASK_STATE_CANCELED)
+        goto out;
+
+    if (multi_threaded_send_blocks (task, needed) < 0) {
+        if (task->state != HTTP_TASK_STATE_CANCELED)
+            seaf_warning ("Failed to pre-upload blocks for repo %.8s.\n",
+                          task->repo_id);
+        /* Some of the needed blocks may not have been sent. */
+        mark_confirmed (pre, batch, needed);
+    } else {
+        mark_confirmed (pre, batch, NULL);
+    }
+
+out:
+    string_list_free (needed);
+}
+
+static void *
+pre_upload_thread (void *vdata)
+{
+    PreUpload *pre = vdata;
+    HttpTxTask *task = pre->task;
+    BlockList *batch = block_list_new ();
+    gboolean done = FALSE;
+    gpointer item;
+    char *url;
+
+    if (!task->use_fileserver_port)
+        url = g_strdup_printf ("%s/seafhttp/repo/%s/check-blocks/",
+                               task->host, task->repo_id);
+    else
+        url = g_strdup_printf ("%s/repo/%s/check-blocks/",
+                               task->host, task->repo_id);
+
+    while (!done) {
+        item = g_async_queue_timeout_pop (pre->queue, PRE_UPLOAD_FLUSH_USEC);
+        if (item == PRE_UPLOAD_END) {
+            done = TRUE;
+            /* The commit failed or didn't change anything. */
+            if (!pre->send_all)
+                break;
+        } else if (item) {
+            block_list_insert (batch, item);
+            g_free (item);
+            if (batch->n_blocks < PRE_UPLOAD_BATCH_N)
+                continue;
+        }
+
+        if (batch->n_blocks > 0) {
+            pre_upload_send_batch (pre, url, batch);
+            block_list_free (batch);
+            batch = block_list_new ();
+        }
+    }
+
+    block_list_free (batch);
+    /* Ids pushed after the end marker. */
+    while ((item = g_async_queue_try_pop (pre->queue)) != NULL)
+        if (item != PRE_UPLOAD_END)
+            g_free (item);
+
+    g_free (url);
+    return NULL;
+}
+
+int
+http_tx_manager_pre_upload_start (HttpTxManager *manager,
+                                  const char *repo_id,
+                                  int repo_version,
+                                  const char *host,
+                                  const char *token,
+                                  gboolean use_fileserver_port,
+                                  gboolean direct)
+{
+    HttpTxPriv *priv = manager->priv;
+    SeafRepo *repo;
+    PreUpload *pre;
+    int rc;
+
+    repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
+    if (!repo)
+        return -1;
+
+    pre = g_new0 (PreUpload, 1);
+    pre->task = http_tx_task_new (manager, repo_id, repo_version,
+                                  HTTP_TASK_TYPE_UPLOAD, FALSE,
+                                  host, token, NULL, NULL);
+    pre->task->state = HTTP_TASK_STATE_NORMAL;
+    pre->task->use_fileserver_port = use_fileserver_port;
+    pre->task->repo_name = g_strdup (repo->name);
+    pre->task->flow = bandwidth_scheduler_add_flow (priv->upload_sched,
+                                                    repo->transfer_priority);
+    /* Only read. Blocks sent here are not referenced by a commit yet. */
+    pre->task->block_cache = server_block_cache_load (repo_id, host);
+    pre->queue = g_async_queue_new ();
+    /* Worktree blocks can only be checked without a key. */
+    pre->direct = (direct && !repo->encrypted);
+    pre->direct_blocks = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                g_free, NULL);
+    pre->files = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    pre->confirmed = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                            g_free, NULL);
+
+    rc = pthread_create (&pre->tid, NULL, pre_upload_thread, pre);
+    if (rc != 0) {
+        seaf_warning ("Failed to create pre-upload thread for repo %.8s: %s.\n",
+                      repo_id, strerror(rc));
+        g_async_queue_unref (pre->queue);
+        g_hash_table_destroy (pre->direct_blocks);
+        g_hash_table_destroy (pre->files);
+        g_hash_table_destroy (pre->confirmed);
+        http_tx_task_free (pre->task);
+        g_free (pre);
+        return -1;
+    }
+
+    pthread_mutex_lock (&priv->pre_upload_lock);
+    g_hash_table_insert (priv->pre_uploads, g_strdup(repo_id), pre);
+    pthread_mutex_unlock (&priv->pre_upload_lock);
+
+    return 0;
+}
+
+gboolean
+http_tx_manager_pre_upload_is_direct (HttpTxManager *manager,
+                                      const char *repo_id)
+{
+    HttpTxPriv *priv = manager->priv;
+    PreUpload *pre;
+    gboolean ret = FALSE;
+
+    pthread_mutex_lock (&priv->pre_upload_lock);
+    pre = g_hash_table_lookup (priv->pre_uploads, repo_id);
+    if (pre)
+        ret = pre->direct;
+    pthread_mutex_unlock (&priv->pre_upload_lock);
+
+    return ret;
+}
+
+void
+http_tx_manager_pre_upload_blocks (HttpTxManager *manager,
+                                   const char *repo_id,
+                                   const char *direct_file,
+                                   int n_blocks,
+                                   const unsigned char *blk_sha1s)
+{
+    HttpTxPriv *priv = manager->priv;
+    PreUpload *pre;
+    char block_id[41];
+    char *file = NULL;
+    int i;
+
+    if (n_blocks == 0)
+        return;
+
+    pthread_mutex_lock (&priv->pre_upload_lock);
+    pre = g_hash_table_lookup (priv->pre_uploads, repo_id);
+    if (pre) {
+        if (pre->direct && direct_file) {
+            file = g_hash_table_lookup (pre->files, direct_file);
+            if (!file) {
+                file = g_strdup (direct_file);
+                g_hash_table_add (pre->files, file);
+            }
+        }
+        for (i = 0; i < n_blocks; ++i) {
+            rawdata_to_hex (blk_sha1s + i * 20, block_id, 20);
+            if (file)
+                g_hash_table_replace (pre->direct_blocks,
+                                      g_strdup(block_id), file);
+            g_async_queue_push (pre->queue, g_strdup(block_id));
+        }
+    }
+    pthread_mutex_unlock (&priv->pre_upload_lock);
+}
+
+/* Direct blocks the server didn't confirm must be in the block store until
+ * the new commit is uploaded. Returns the files whose blocks changed in the
+ * worktree.
+ */
+static GList *
+stage_direct_blocks (PreUpload *pre)
+{
+    HttpTxTask *task = pre->task;
+    GHashTable *changed;
+    GHashTableIter iter;
+    gpointer key, value;
+    GList *ret;
+    int n_staged = 0;
+
+    changed = g_hash_table_new (g_str_hash, g_str_equal);
+
+    g_hash_table_iter_init (&iter, pre->direct_blocks);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        if (g_hash_table_contains (pre->confirmed, key) ||
+            g_hash_table_contains (changed, value))
+            continue;
+        if (seaf_content_index_stage_block (task->repo_id, task->repo_version,
+                                            key) < 0) {
+            seaf_message ("File %s in repo %.8s changed before its blocks "
+                          "were staged.\n", (char *)value, task->repo_id);
+            g_hash_table_add (changed, value);
+            continue;
+        }
+        ++n_staged;
+    }
+
+    if (n_staged > 0)
+        seaf_debug ("Staged %d direct blocks of repo %.8s.\n",
+                    n_staged, task->repo_id);
+
+    ret = g_hash_table_get_keys (changed);
+    g_hash_table_destroy (changed);
+    return ret;
+}
+
+int
+http_tx_manager_pre_upload_finish (HttpTxManager *manager,
+                                   const char *repo_id,
+                                   gboolean send_all,
+                                   GList **changed_files)
+{
+    HttpTxPriv *priv = manager->priv;
+    PreUpload *pre;
+    GList *changed, *ptr;
+    int ret = 0;
+
+    pthread_mutex_lock (&priv->pre_upload_lock);
+    pre = g_hash_table_lookup (priv->pre_uploads, repo_id);
+    if (pre)
+        g_hash_table_remove (priv->pre_uploads, repo_id);
+    pthread_mutex_unlock (&priv->pre_upload_lock);
+
+    if (!pre)
+        return 0;
+
+    if (!send_all)
+        pre->task->state = HTTP_TASK_STATE_CANCELED;
+    pre->send_all = send_all;
+    g_async_queue_push (pre->queue, PRE_UPLOAD_END);
+
+    pthread_join (pre->tid, NULL);
+
+    seaf_debug ("Pre-uploaded %d blocks of repo %.8s.\n",
+                pre->task->done_blocks, repo_id);
+
+    if (send_all) {
+        changed = stage_direct_blocks (pre);
+        if (changed)
+            ret = -1;
+        for (ptr = changed; ptr; ptr = ptr->next) {
+            if (changed_files)
+                *changed_files = g_list_prepend (*changed_files,
+                                                 g_strdup (ptr->data));
+        }
+        g_list_free (changed);
+    }
+
+    g_async_queue_unref (pre->queue);
+    g_hash_table_destroy (pre->direct_blocks);
+    g_hash_table_destroy (pre->files);
+    g_hash_table_destroy (pre->confirmed);
+    http_tx_task_free (pre->task);
+    g_free (pre);
+
+    return ret;
+}
+
+/* Download */
+
+static void *http_download_thread (void *vdata);
+static void http_download_done (void *vdata);
+
+int
+http_tx_manager_add_download (HttpTxManager *manager,
+                              const char *repo_id,
+                              int repo_version,
+                              const char *host,
+                              const char *token,
+                              const char *server_head_id,
+                              gboolean is_clone,
+                              const char *passwd,
+                              const char *worktree,
+                              int protocol_version,
+                              const char *email,
+                              gboolean use_fileserver_port,
+                              const char *repo_name,
+                              GError **error)
+{
+    HttpTxTask *task;
+    SeafRepo *repo = NULL;
+
+    if (!repo_id) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Empty argument(repo_id)");
+        return -1;
+    }
+
+    if (!token) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Empty argument(token)");
+        return -1;
+    }
+
+    if (!host) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Empty argument(host)");
+        return -1;
+    }
+
+    if (!server_head_id) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Empty argument(server_head_id)");
+        return -1;
+    }
+
+    if (!email) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Empty argument(email)");
+        return -1;
+    }
+
+    if (!is_clone) {
+        repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
+        if (!repo) {
+            g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Repo not found");
+            return -1;
+        }
+    }
+
+    clean_tasks_for_repo (manager, repo_id);
+
+    task = http_tx_task_new (manager, repo_id, repo_version,
+                             HTTP_TASK_TYPE_DOWNLOAD, is_clone,
+                             host, token, passwd, worktree);
+
+    memcpy (task->head, server_head_id, 40);
+    task->protocol_version = protocol_version;
+    task->email = g_strdup(email);
+
+    task->state = HTTP_TASK_STATE_NORMAL;
+
+    task->use_fileserver_port = use_fileserver_port;
+
+    task->blk_ref_cnts = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                g_free, g_free);
+    pthread_mutex_init (&task->ref_cnt_lock, NULL);
+
+    task->flow = bandwidth_scheduler_add_flow (manager->priv->download_sched,
+                                               repo ? repo->transfer_priority :
+                                               TRANSFER_PRIORITY_NORMAL);
+
+    g_hash_table_insert (manager->priv->download_tasks,
+                         g_strdup(repo_id),
+                         task);
+
+    task->repo_name = g_strdup(repo_name);
+
+    if (seaf_job_manager_schedule_class_job (seaf->job_mgr,
+                                             SEAF_JOB_TRANSFER,
+                                             http_download_thread,
+                                             http_download_done,
+                                             task) < 0) {
+        g_hash_table_remove (manager->priv->download_tasks, repo_id);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+get_commit_object (HttpTxTask *task, Connection *conn)
+{
+    CURL *curl;
+    char *url;
+    int status;
+    char *rsp_content = NULL;
+    gint64 rsp_size;
+    int ret = 0;
+
+    curl = conn->curl;
+
+    if (!task->use_fileserver_port)
+        url = g_strdup_printf ("%s/seafhttp/repo/%s/commit/%s",
+                               task->host, task->repo_id, task->head);
+    else
+        url = g_strdup_printf ("%s/repo/%s/commit/%s",
+                               task->host, task->repo_id, task->head);
+
+    int curl_error;
+    if (http_get (curl, url, task->token, &status,
+                  &rsp_content, &rsp_size,
+                  NULL, NULL, TRUE, &curl_error) < 0) {
+        conn->release = TRUE;
+        handle_curl_errors (task, curl_error);
+        ret = -1;
+        goto out;
+    }
+
+    if (status != HTTP_OK) {
+        seaf_warning ("Bad response code for GET %s: %d.\n", url, status);
+        handle_http_errors (task, status);
+        ret = -1;
+        goto out;
+    }
+
+    int rc = seaf_obj_store_write_obj (seaf->commit_mgr->obj_store,
+                                       task->repo_id, task->repo_version,
+                                       task->head,
+                                       rsp_content,
+                                       rsp_size,
+                                       FALSE);
+    if (rc < 0) {
+        seaf_warning ("Failed to save commit %s in repo %.8s.\n",
+                      task->head, task->repo_id);
+        task->error = SYNC_ERROR_ID_WRITE_LOCAL_DATA;
+        ret = -1;
+    }
+
+out:
+    g_free (url);
+    g_free (rsp_content);
+    curl_easy_reset (curl);
+
+    return ret;
+}
+
+/*
+ * The fs id list of a large repo can be hundreds of MB, so it's parsed as
+ * it's received instead of being loaded as a whole. It's a JSON array of
+ * object ids, which never need escapes. Ids that have to be fetched are
+ * passed to get_fs_objects() through a queue, so that fs objects are
+ * requested while the rest of the list is still being received.
+ */
+#define FS_ID_LIST_END ((gpointer)1)
+
+enum {
+    FS_ID_LIST_BEGIN,           /* before '[' */
+    FS_ID_LIST_FIRST,           /* after '[' */
+    FS_ID_LIST_ITEM,            /* after ',' */
+    FS_ID_LIST_ID,              /* inside an id */
+    FS_ID_LIST_NEXT,            /* after an id */
+    FS_ID_LIST_DONE,            /* after ']' */
+};
+
+typedef struct FsIdListStream {
+    HttpTxTask *task;
+    Connection *conn;
+    /* Ids to fetch, followed by FS_ID_LIST_END. */
+    GAsyncQueue *ids;
+    GHashTable *checked_objs;
+    int state;
+    char id[41];
+    int id_len;
+    gboolean invalid;
+    /* Set by the consumer to abort the download. */
+    gboolean stop;
+    int result;
+    pthread_t tid;
+} FsIdListStream;
+
+static void
+check_listed_fs_id (FsIdListStream *stream, const char *obj_id)
+{
+    HttpTxTask *task = stream->task;
+    gboolean needed = FALSE;
+
+    ++(task->n_fs_objs);
+
+    if (g_hash_table_lookup (stream->checked_objs, obj_id)) {
+        g_atomic_int_inc (&task->done_fs_objs);
+        return;
+    }
+    g_hash_table_insert (stream->checked_objs, g_strdup(obj_id),
+                         GINT_TO_POINTER(1));
+
+    if (!seaf_obj_store_obj_exists (seaf->fs_mgr->obj_store,
+                                    task->repo_id, task->repo_version,
+                                    obj_id)) {
+        needed = TRUE;
+    } else if (task->is_clone) {
+        gboolean io_error = FALSE;
+        gboolean sound;
+        sound = seaf_fs_manager_verify_object (seaf->fs_mgr,
+                                               task->repo_id, task->repo_version,
+                                               obj_id, FALSE, &io_error);
+        if (!sound && !io_error)
+            needed = TRUE;
+    }
+
+    if (needed)
+        g_async_queue_push (stream->ids, g_strdup(obj_id));
+    else
+        g_atomic_int_inc (&task->done_fs_objs);
+}
+
+static size_t
+recv_fs_id_list (void *contents, size_t size, size_t nmemb, void *userp)
+{
+    FsIdListStream *stream = userp;
+    size_t realsize = size * nmemb;
+    const char *p = contents;
+    const char *end = p + realsize;
+    long status = 0;
+    char c;
+
+    if (stream->stop || stream->task->state == HTTP_TASK_STATE_CANCELED)
+        return 0;
+
+    /* Error responses are handled by the caller. */
+    curl_easy_getinfo (stream->conn->curl, CURLINFO_RESPONSE_CODE, &status);
+    if (status != HTTP_OK)
+        return realsize;
+
+    for (; p < end; ++p) {
+        c = *p;
+
+        if (stream->state == FS_ID_LIST_ID) {
+            if (c == '"') {
+                if (stream->id_len != 40)
+                    goto invalid;
+                stream->id[40] = 0;
+                check_listed_fs_id (stream, stream->id);
+                stream->state = FS_ID_LIST_NEXT;
+            } else if (c != '\\' && stream->id_len < 40) {
+                stream->id[stream->id_len++] = c;
+            } else {
+                goto invalid;
+            }
+            continue;
+        }
+
+        if (c == ' ' || c == '\t' || c == '\n' || c == '\r')
+            continue;
+
+        switch (stream->state) {
+        case FS_ID_LIST_BEGIN:
+            if (c != '[')
+                goto invalid;
+            stream->state = FS_ID_LIST_FIRST;
+            break;
+        case FS_ID_LIST_FIRST:
+        case FS_ID_LIST_ITEM:
+            if (c == '"') {
+                stream->id_len = 0;
+                stream->state = FS_ID_LIST_ID;
+            } else if (c == ']' && stream->state == FS_ID_LIST_FIRST) {
+                stream->state = FS_ID_LIST_DONE;
+            } else {
+                goto invalid;
+            }
+            break;
+        case FS_ID_LIST_NEXT:
+            if (c == ',')
+                stream->state = FS_ID_LIST_ITEM;
+            else if (c == ']')
+                stream->state = FS_ID_LIST_DONE;
+            else
+                goto invalid;
+            break;
+        default:
+            goto invalid;
+        }
+    }
+
+    return realsize;
+
+invalid:
+    stream->invalid = TRUE;
+    return 0;
+}
+
+static void *
+fs_id_list_thread (void *vdata)
+{
+    FsIdListStream *stream = vdata;
+    HttpTxTask *task = stream->task;
+    SeafBranch *master;
+    char *url = NULL;
+    int status;
+    int curl_error;
+
+    const char *url_prefix = (task->use_fileserver_port) ? "" : "seafhttp/";
+
+    if (!task->is_clone) {
+        master = seaf_branch_manager_get_branch (seaf->branch_mgr,
+                                                 task->repo_id,
+                                                 "master");
+        if (!master) {
+            seaf_warning ("Failed to get branch master for repo %.8s.\n",
+                          task->repo_id);
+            stream->result = -1;
+            goto out;
+        }
+
+        url = g_strdup_printf ("%s/%srepo/%s/fs-id-list/"
+                               "?server-head=%s&client-head=%s",
+                               task->host, url_prefix, task->repo_id,
+                               task->head, master->commit_id);
+
+        seaf_branch_unref (master);
+    } else {
+        url = g_strdup_printf ("%s/%srepo/%s/fs-id-list/?server-head=%s",
+                               task->host, url_prefix, task->repo_id, task->head);
+    }
+
+    if (http_get (stream->conn->curl, url, task->token, &status,
+                  NULL, NULL, recv_fs_id_list, stream,
+                  (!task->is_clone), &curl_error) < 0) {
+        stream->conn->release = TRUE;
+        if (stream->invalid) {
+            seaf_warning ("Invalid JSON response from the server.\n");
+            task->error = SYNC_ERROR_ID_SERVER;
+        } else if (!stream->stop &&
+                   task->state != HTTP_TASK_STATE_CANCELED) {
+            handle_curl_errors (task, curl_error);
+        }
+        stream->result = -1;
+        goto out;
+    }
+
+    if (status != HTTP_OK) {
+        seaf_warning ("Bad response code for GET %s: %d.\n", url, status);
+        handle_http_errors (task, status);
+        stream->result = -1;
+        goto out;
+    }
+
+    if (stream->state != FS_ID_LIST_DONE) {
+        seaf_warning ("Incomplete fs id list received for repo %.8s.\n",
+                      task->repo_id);
+        task->error = SYNC_ERROR_ID_SERVER;
+        stream->result = -1;
+        goto out;
+    }
+
+    seaf_debug ("Received fs object list size %d from %s:%s.\n",
+                task->n_fs_objs, task->host, task->repo_id);
+
+out:
+    curl_easy_reset (stream->conn->curl);
+    g_free (url);
+    g_async_queue_push (stream->ids, FS_ID_LIST_END);
+    return NULL;
+}
+
+static FsIdListStream *
+fs_id_list_stream_start (HttpTxTask *task, Connection *conn)
+{
+    FsIdListStream *stream;
+    int rc;
+
+    stream = g_new0 (FsIdListStream, 1);
+    stream->task = task;
+    stream->conn = conn;
+    stream->ids = g_async_queue_new ();
+    stream->checked_objs = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                  g_free, NULL);
+
+    task->n_fs_objs = 0;
+
+    rc = pthread_create (&stream->tid, NULL, fs_id_list_thread, stream);
+    if (rc != 0) {
+        seaf_warning ("Failed to create fs id list thread for repo %.8s: %s.\n",
+                      task->repo_id, strerror(rc));
+        task->error = SYNC_ERROR_ID_NOT_ENOUGH_MEMORY;
+        g_async_queue_unref (stream->ids);
+        g_hash_table_destroy (stream->checked_objs);
+        g_free (stream);
+        return NULL;
+    }
+
+    return stream;
+}
+
+/* Returns the result of receiving the list. */
+static int
+fs_id_list_stream_finish (FsIdListStream *stream)
+{
+    gpointer item;
+    int ret;
+
+    stream->stop = TRUE;
+    pthread_join (stream->tid, NULL);
+
+    while ((item = g_async_queue_try_pop (stream->ids)) != NULL)
+        if (item != FS_ID_LIST_END)
+            g_free (item);
+
+    ret = stream->result;
+    g_async_queue_unref (stream->ids);
+    g_hash_table_destroy (stream->checked_objs);
+    g_free (stream);
+
+    return ret;
+}
+
+/*
+ * Fs objects are requested in batches of object ids. Several batches are
+ * kept in flight on pooled connections. Received batches are verified and
+ * written to the object store on the CPU lane, while the connections go
+ * back to receiving. The batch size starts at
+ * GET_FS_OBJECT_N and is doubled as long as that keeps raising the number
+ * of objects received per second.
+ */
+#define GET_FS_OBJECT_N 100
+#define MAX_GET_FS_OBJECT_N 1600
+#define DEFAULT_DOWNLOAD_FS_THREADS 3
+#define MAX_PENDING_FS_BATCHES (DEFAULT_DOWNLOAD_FS_THREADS * 2)
+/* Grow the batch only if the last increase helped by at least 10%. */
+#define FS_BATCH_GROWTH_GAIN 1.1
+/* How often batches in flight are checked while ids are still listed. */
+#define FS_ID_LIST_POLL_USEC 100000
+
+typedef struct FsFetchBatch {
+    GHashTable *requested;
+    int n_requested;
+    char *req_content;
+    char *rsp_content;
+    gint64 rsp_size;
+    int result;
+    double elapsed;
+} FsFetchBatch;
+
+typedef struct FsFetchData {
+    HttpTxTask *http_task;
+    ConnectionPool *cpool;
+    SeafTaskGroup *save_tasks;
+    GAsyncQueue *finished_batches;
+} FsFetchData;
+
+static FsFetchBatch *
+fs_fetch_batch_new (GList **fs_list, int max_ids)
+{
+    FsFetchBatch *batch;
+    json_t *array;
+    char *obj_id;
+
+    batch = g_new0 (FsFetchBatch, 1);
+    batch->requested = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                              g_free, NULL);
+
+    /* Convert object id list to JSON format. */
+    array = json_array ();
+
+    while (*fs_list != NULL) {
+        obj_id = (*fs_list)->data;
+        json_array_append_new (array, json_string(obj_id));
+
+        *fs_list = g_list_delete_link (*fs_list, *fs_list);
+
+        g_hash_table_replace (batch->requested, obj_id, obj_id);
+
+        if (++(batch->n_requested) >= max_ids)
+            break;
+    }
+
+    batch->req_content = json_dumps (array, 0);
+    json_decref (array);
+
+    return batch;
+}
+
+static void
+fs_fetch_batch_free (FsFetchBatch *batch)
+{
+    g_hash_table_destroy (batch->requested);
+    g_free (batch->req_content);
+    g_free (batch->rsp_content);
+    g_free (batch);
+}
+
+static void
+get_fs_objects_thread_func (gpointer data, gpointer user_data)
+{
+    FsFetchBatch *batch = data;
+    FsFetchData *tx_data = user_data;
+    HttpTxTask *task = tx_data->http_task;
+    Connection *conn;
+    char *url = NULL;
+    int status;
+    int curl_error;
+    gint64 start = seaf_metrics_now ();
+
+    if (task->state == HTTP_TASK_STATE_CANCELED)
+        goto done;
+
+    conn = connection_pool_get_connection (tx_data->cpool);
+    if (!conn) {
+        seaf_warning ("Failed to get connection to host %s.\n", task->host);
+        task->error = SYNC_ERROR_ID_NOT_ENOUGH_MEMORY;
+        batch->result = -1;
+        goto done;
+    }
+
+    seaf_debug ("Requesting %d fs objects from %s:%s.\n",
+                batch->n_requested, task->host, task->repo_id);
+
+    if (!task->use_fileserver_port)
+        url = g_strdup_printf ("%s/seafhttp/repo/%s/pack-fs/", task->host, task->repo_id);
+    else
+        url = g_strdup_printf ("%s/repo/%s/pack-fs/", task->host, task->repo_id);
+
+    if (http_post (conn->curl, url, task->token,
+                   batch->req_content, strlen(batch->req_content),
+                   &status, &batch->rsp_content, &batch->rsp_size,
+                   TRUE, &curl_error) < 0) {
+        conn->release = TRUE;
+        handle_curl_errors (task, curl_error);
+        batch->result = -1;
+    } else if (status != HTTP_OK) {
+        seaf_warning ("Bad response code for POST %s: %d.\n", url, status);
+        handle_http_errors (task, status);
+        batch->result = -1;
+    } else {
+        curl_easy_getinfo (conn->curl, CURLINFO_TOTAL_TIME, &batch->elapsed);
+    }
+
+    curl_easy_reset (conn->curl);
+    connection_pool_return_connection (tx_data->cpool, conn);
+    g_free (url);
+    seaf_trace_span ("get_fs_pack", start, task->repo_id);
+
+    if (batch->result == 0) {
+        seaf_task_group_push (tx_data->save_tasks, batch);
+        return;
+    }
+
+done:
+    g_async_queue_push (tx_data->finished_batches, batch);
+}
+
+/* Objects are written unsynced, the whole fetch is made durable with one
+ * commit of the write batch.
+ */
+static void
+save_fs_objects_thread_func (gpointer data, gpointer user_data)
+{
+    FsFetchBatch *batch = data;
+    FsFetchData *tx_data = user_data;
+    HttpTxTask *task = tx_data->http_task;
+    int n_recv = 0;
+    char *p = batch->rsp_content;
+    ObjectHeader *hdr = (ObjectHeader *)p;
+    char recv_obj_id[41];
+    gint64 n = 0;
+    int size;
+    int rc;
+    gint64 start = seaf_metrics_now ();
+
+    while (n < batch->rsp_size) {
+        if (n + sizeof(ObjectHeader) > batch->rsp_size) {
+            seaf_warning ("Incomplete object package received for repo %.8s.\n",
+                          task->repo_id);
+            task->error = SYNC_ERROR_ID_SERVER;
+            batch->result = -1;
+            goto out;
+        }
+
+        memcpy (recv_obj_id, hdr->obj_id, 40);
+        recv_obj_id[40] = 0;
+        size = ntohl (hdr->obj_size);
+        if (n + sizeof(ObjectHeader) + size > batch->rsp_size) {
+            seaf_warning ("Incomplete object package received for repo %.8s.\n",
+                          task->repo_id);
+            task->error = SYNC_ERROR_ID_SERVER;
+            batch->result = -1;
+            goto out;
+        }
+
+        ++n_recv;
+
+        if (task->state == HTTP_TASK_STATE_CANCELED)
+            goto out;
+
+        if (!seaf_fs_manager_verify_object_data (seaf->fs_mgr,
+                                                 task->repo_version,
+                                                 recv_obj_id,
+                                                 hdr->object, size)) {
+            seaf_warning ("Corrupt fs object %s received for repo %.8s.\n",
+                          recv_obj_id, task->repo_id);
+            task->error = SYNC_ERROR_ID_SERVER;
+            batch->result = -1;
+            goto out;
+        }
+
+        rc = seaf_obj_store_write_obj (seaf->fs_mgr->obj_store,
+                                       task->repo_id, task->repo_version,
+                                       recv_obj_id,
+                                       hdr->object,
+                                       size, FALSE);
+        if (rc < 0) {
+            seaf_warning ("Failed to write fs object %s in repo %.8s.\n",
+                          recv_obj_id, task->repo_id);
+            task->error = SYNC_ERROR_ID_WRITE_LOCAL_DATA;
+            batch->result = -1;
+            goto out;
+        }
+
+        g_hash_table_remove (batch->requested, recv_obj_id);
+
+        g_atomic_int_inc (&task->done_fs_objs);
+
+        p += (sizeof(ObjectHeader) + size);
+        n += (sizeof(ObjectHeader) + size);
+        hdr = (ObjectHeader *)p;
+    }
+
+    seaf_debug ("Received %d fs objects from %s:%s.\n",
+                n_recv, task->host, task->repo_id);
+
+out:
+    g_free (batch->rsp_content);
+    batch->rsp_content = NULL;
+    seaf_trace_span ("save_fs_pack", start, task->repo_id);
+    g_async_queue_push (tx_data->finished_batches, batch);
+}
+
+static int
+get_fs_objects (HttpTxTask *task, FsIdListStream *stream)
+{
+    HttpTxPriv *priv = seaf->http_tx_mgr->priv;
+    ConnectionPool *cpool;
+    GThreadPool *tpool;
+    GAsyncQueue *finished_batches;
+    FsFetchData data;
+    FsFetchBatch *batch;
+    GHashTableIter iter;
+    gpointer key, value;
+    GList *fs_list = NULL;
+    int n_listed = 0;
+    gboolean listed = FALSE;
+    gpointer item;
+    int batch_size = GET_FS_OBJECT_N;
+    double last_rate = 0, rate;
+    gboolean growing = TRUE;
+    int n_running = 0;
+    gboolean stop = FALSE;
+    int ret = 0;
+
+    cpool = find_connection_pool (priv, task->host);
+    if (!cpool) {
+        seaf_warning ("Failed to create connection pool for host %s.\n", task->host);
+        task->error = SYNC_ERROR_ID_NOT_ENOUGH_MEMORY;
+        return -1;
+    }
+
+    finished_batches = g_async_queue_new ();
+
+    data.http_task = task;
+    data.cpool = cpool;
+    data.finished_batches = finished_batches;
+    data.save_tasks = seaf_task_group_new (SEAF_LANE_CPU,
+                                           SEAF_TASK_PRIORITY_NORMAL,
+                                           MAX_PENDING_FS_BATCHES,
+                                           save_fs_objects_thread_func, &data);
+
+    seaf_obj_store_begin_batch (seaf->fs_mgr->obj_store,
+                                task->repo_id, task->repo_version);
+
+    tpool = g_thread_pool_new (get_fs_objects_thread_func, &data,
+                               DEFAULT_DOWNLOAD_FS_THREADS, FALSE, NULL);
+
+    while (1) {
+        while (!stop && !listed) {
+            /* Wait for ids only when there is nothing else to do. */
+            if (fs_list == NULL && n_running == 0)
+                item = g_async_queue_pop (stream->ids);
+            else
+                item = g_async_queue_try_pop (stream->ids);
+            if (!item)
+                break;
+
+            if (item == FS_ID_LIST_END) {
+                listed = TRUE;
+                if (stream->result < 0) {
+                    ret = -1;
+                    stop = TRUE;
+                }
+            } else {
+                fs_list = g_list_prepend (fs_list, item);
+                ++n_listed;
+            }
+        }
+
+        /* Only full batches are sent until the whole list is received. */
+        while (!stop && fs_list != NULL &&
+               n_running < MAX_PENDING_FS_BATCHES &&
+               (listed || n_running == 0 || n_listed >= batch_size)) {
+            batch = fs_fetch_batch_new (&fs_list, batch_size);
+            n_listed -= batch->n_requested;
+            g_thread_pool_push (tpool, batch, NULL);
+            ++n_running;
+        }
+
+        if (n_running == 0) {
+            if (stop || (listed && fs_list == NULL))
+                break;
+            continue;
+        }
+
+        if (listed)
+            batch = g_async_queue_pop (finished_batches);
+        else
+            batch = g_async_queue_timeout_pop (finished_batches,
+                                               FS_ID_LIST_POLL_USEC);
+        if (!batch)
+            continue;
+        --n_running;
+
+        if (batch->result < 0) {
+            ret = -1;
+            stop = TRUE;
+        } else if (task->state == HTTP_TASK_STATE_CANCELED) {
+            stop = TRUE;
+        } else {
+            /* The server may not return all the objects we requested.
+             * So we need to add back the remaining object ids into fs_list.
+             */
+            g_hash_table_iter_init (&iter, batch->requested);
+            while (g_hash_table_iter_next (&iter, &key, &value)) {
+                fs_list = g_list_prepend (fs_list, g_strdup((char *)key));
+                ++n_listed;
+            }
+
+            if (growing && batch->n_requested == batch_size &&
+                batch->elapsed > 0) {
+                rate = batch->n_requested / batch->elapsed;
+                if (rate > last_rate * FS_BATCH_GROWTH_GAIN &&
+                    batch_size < MAX_GET_FS_OBJECT_N) {
+                    last_rate = rate;
+                    batch_size *= 2;
+                } else {
+                    growing = FALSE;
+                }
+            }
+        }
+
+        fs_fetch_batch_free (batch);
+    }
+
+    g_thread_pool_free (tpool, FALSE, TRUE);
+    seaf_task_group_free (data.save_tasks, FALSE);
+    g_async_queue_unref (finished_batches);
+    string_list_free (fs_list);
+
+    if (seaf_obj_store_commit_batch (seaf->fs_mgr->obj_store,
+                                     task->repo_id, task->repo_version) < 0) {
+        seaf_warning ("Failed to sync fs objects for repo %.8s.\n",
+                      task->repo_id);
+        task->error = SYNC_ERROR_ID_WRITE_LOCAL_DATA;
+        ret = -1;
+    }
+
+    return ret;
+}
+
+/* Keep what was received of an interrupted block download if it's at
+ * least this large, and ask for the rest with a range request next time.
+ */
+#define MIN_PARTIAL_BLOCK_SIZE (256 * 1024)
+
+typedef struct {
+    SendBlockData data;
+    CURL *curl;
+    /* Data received by an earlier, interrupted download. */
+    char *prefix;
+    gsize prefix_len;
+    gboolean started;
+    /* Everything written to the block so far. */
+    GByteArray *received;
+} GetBlockData;
+
+static size_t
+get_block_resume_callback (void *ptr, size_t size, size_t nmemb, void *userp)
+{
+    GetBlockData *data = userp;
+    HttpTxTask *task = data->data.task;
+    long status = 0;
+    size_t n;
+
+    if (!data->started) {
+        data->started = TRUE;
+
+        /* The server may ignore the range and send the whole block. */
+        curl_easy_getinfo (data->curl, CURLINFO_RESPONSE_CODE, &status);
+        if (data->prefix && status == HTTP_PARTIAL_CONTENT) {
+            if (seaf_block_manager_write_block (seaf->block_mgr,
+                                                data->data.block,
+                                                data->prefix,
+                                                data->prefix_len) < (int)data->prefix_len) {
+                seaf_warning ("Failed to write block %s in repo %.8s.\n",
+                              data->data.block_id, task->repo_id);
+                task->error = SYNC_ERROR_ID_WRITE_LOCAL_DATA;
+                return 0;
+            }
+            g_byte_array_append (data->received,
+                                 (guint8 *)data->prefix, data->prefix_len);
+        }
+    }
+
+    n = get_block_callback (ptr, size, nmemb, &data->data);
+    if (n > 0)
+        g_byte_array_append (data->received, ptr, n);
+
+    return n;
+}
+
+/* Called with ref_cnt_lock held. Returns the size of @block_id if it's in
+ * the store, and takes a reference to it.
+ */
+static gint64
+ref_block_in_store (HttpTxTask *task, const char *block_id)
+{
+    BlockMetadata *bmd;
+    gint64 size;
+    int *pcnt;
+
+    if (!seaf_block_manager_block_exists (seaf->block_mgr,
+                                          task->repo_id, task->repo_version,
+                                          block_id))
+        return -1;
+
+    bmd = seaf_block_manager_stat_block (seaf->block_mgr,
+                                         task->repo_id, task->repo_version,
+                                         block_id);
+    if (!bmd)
+        return -1;
+    size = bmd->size;
+    g_free (bmd);
+
+    pcnt = g_hash_table_lookup (task->blk_ref_cnts, block_id);
+    if (!pcnt) {
+        pcnt = g_new0(int, 1);
+        g_hash_table_insert (task->blk_ref_cnts, g_strdup(block_id), pcnt);
+    }
+    *pcnt += 1;
+
+    return size;
+}
+
+/*
+ * Takes a reference to @block_id if it's in the store, or can be taken from
+ * the shared block cache. Returns the size of the block, or -1 if it has to
+ * be downloaded. The block is imported without ref_cnt_lock, so lookups of
+ * other threads don't wait for the disk.
+ */
+static gint64
+ref_stored_block (HttpTxTask *task, const char *block_id)
+{
+    gint64 size;
+
+    pthread_mutex_lock (&task->ref_cnt_lock);
+    size = ref_block_in_store (task, block_id);
+    pthread_mutex_unlock (&task->ref_cnt_lock);
+
+    if (size >= 0 || !task->shared_blocks ||
+        seaf_shared_block_cache_get (task->repo_id, task->repo_version,
+                                     block_id) < 0)
+        return size;
+
+    /* The block may have been removed again meanwhile. */
+    pthread_mutex_lock (&task->ref_cnt_lock);
+    size = ref_block_in_store (task, block_id);
+    pthread_mutex_unlock (&task->ref_cnt_lock);
 
-    transition_state (task, task->state, HTTP_TASK_RT_STATE_COMMIT);
+    return size;
+}
 
-    if (send_commit_object (task, conn) < 0) {
-        seaf_warning ("Failed to send head commit for repo %.8s.\n", task->repo_id);
-        goto out;
-    }
+int
+get_block (HttpTxTask *task, Connection *conn, const char *block_id)
+{
+    HttpTxPriv *priv = seaf->http_tx_mgr->priv;
+    TransferJournal *journal = priv->journal;
+    ConnectionPool *pool;
+    CURL *curl;
+    char *url;
+    char *range = NULL;
+    gboolean accept_deflate = FALSE;
+    int status;
+    BlockHandle *block;
+    int ret = 0;
 
-    if (task->state == HTTP_TASK_STATE_CANCELED)
-        goto out;
+    block = seaf_block_manager_open_block (seaf->block_mgr,
+                                           task->repo_id, task->repo_version,
+                                           block_id, BLOCK_WRITE);
+    if (!block) {
+        seaf_warning ("Failed to open block %s in repo %.8s.\n",
+                      block_id, task->repo_id);
+        return -1;
+    }
 
-    transition_state (task, task->state, HTTP_TASK_RT_STATE_FS);
+    curl = conn->curl;
 
-    send_fs_list = calculate_send_fs_object_list (task);
-    if (!send_fs_list) {
-        seaf_warning ("Failed to calculate fs object list for repo %.8s.\n",
-                      task->repo_id);
-        task->error = SYNC_ERROR_ID_LOCAL_DATA_CORRUPT;
-        goto out;
+    GetBlockData data;
+    memset (&data, 0, sizeof(data));
+    memcpy (data.data.block_id, block_id, 40);
+    data.data.block = block;
+    data.data.task = task;
+    data.curl = curl;
+    data.received = g_byte_array_new ();
+
+    data.prefix = transfer_journal_load_partial_block (journal,
+                                                       task->repo_id, block_id,
+                                                       &data.prefix_len);
+    if (data.prefix) {
+        seaf_debug ("Resume downloading block %s from byte %"G_GSIZE_FORMAT".\n",
+                    block_id, data.prefix_len);
+        range = g_strdup_printf ("%"G_GSIZE_FORMAT"-", data.prefix_len);
+        curl_easy_setopt (curl, CURLOPT_RANGE, range);
+    } else {
+        /* curl decodes the block, so the data received is the same either
+         * way, and a partial block can still be resumed.
+         */
+        pool = find_connection_pool (priv, task->host);
+        if (pool && pool->block_deflate) {
+            curl_easy_setopt (curl, CURLOPT_ACCEPT_ENCODING, "deflate");
+            accept_deflate = TRUE;
+        }
     }
 
     if (!task->use_fileserver_port)
-        url = g_strdup_printf ("%s/seafhttp/repo/%s/check-fs/",
-                               task->host, task->repo_id);
+        url = g_strdup_printf ("%s/seafhttp/repo/%s/block/%s",
+                               task->host, task->repo_id, block_id);
     else
-        url = g_strdup_printf ("%s/repo/%s/check-fs/",
-                               task->host, task->repo_id);
-
-    while (send_fs_list != NULL) {
-        if (upload_check_id_list_segment (task, conn, url,
-                                          &send_fs_list, &needed_fs_list) < 0) {
-            seaf_warning ("Failed to check fs list for repo %.8s.\n", task->repo_id);
-            goto out;
-        }
+        url = g_strdup_printf ("%s/repo/%s/block/%s",
+                               task->host, task->repo_id, block_id);
 
+    int curl_error;
+    int rc = http_get (curl, url, task->token, &status, NULL, NULL,
+                       get_block_resume_callback, &data, TRUE, &curl_error);
+    /* The connection may be used for other blocks. */
+    if (range)
+        curl_easy_setopt (curl, CURLOPT_RANGE, NULL);
+    if (accept_deflate)
+        curl_easy_setopt (curl, CURLOPT_ACCEPT_ENCODING, NULL);
+    if (rc < 0) {
         if (task->state == HTTP_TASK_STATE_CANCELED)
-            goto out;
-    }
-    g_free (url);
-    url = NULL;
+            goto error;
 
-    while (needed_fs_list != NULL) {
-        if (send_fs_objects (task, conn, &needed_fs_list) < 0) {
-            seaf_warning ("Failed to send fs objects for repo %.8s.\n", task->repo_id);
-            goto out;
+        if (task->error == SYNC_ERROR_ID_NO_ERROR) {
+            /* Only release the connection when it's a network error. */
+            conn->release = TRUE;
+            handle_curl_errors (task, curl_error);
         }
 
-        if (task->state == HTTP_TASK_STATE_CANCELED)
-            goto out;
+        if (data.received->len >= MIN_PARTIAL_BLOCK_SIZE &&
+            task->error != SYNC_ERROR_ID_WRITE_LOCAL_DATA)
+            transfer_journal_save_partial_block (journal,
+                                                 task->repo_id, block_id,
+                                                 (char *)data.received->data,
+                                                 data.received->len);
+        ret = -1;
+        goto error;
     }
 
-    transition_state (task, task->state, HTTP_TASK_RT_STATE_BLOCK);
-
-    if (calculate_block_list (task, &block_list) < 0) {
-        seaf_warning ("Failed to calculate block list for repo %.8s.\n",
-                      task->repo_id);
-        task->error = SYNC_ERROR_ID_LOCAL_DATA_CORRUPT;
-        goto out;
+    if (status != HTTP_OK &&
+        !(data.prefix && status == HTTP_PARTIAL_CONTENT)) {
+        seaf_warning ("Bad response code for GET %s: %d.\n", url, status);
+        handle_http_errors (task, status);
+        if (data.prefix)
+            transfer_journal_remove_partial_block (journal,
+                                                   task->repo_id, block_id);
+        ret = -1;
+        goto error;
     }
 
-    if (!task->use_fileserver_port)
-        url = g_strdup_printf ("%s/seafhttp/repo/%s/check-blocks/",
-                               task->host, task->repo_id);
-    else
-        url = g_strdup_printf ("%s/repo/%s/check-blocks/",
-                               task->host, task->repo_id);
+    ret = commit_downloaded_block (task, block, block_id, 1);
 
-    while (block_list != NULL) {
-        if (upload_check_id_list_segment (task, conn, url,
-                                          &block_list, &needed_block_list) < 0) {
-            seaf_warning ("Failed to check block list for repo %.8s.\n",
-                          task->repo_id);
-            goto out;
-        }
+    if (data.prefix)
+        transfer_journal_remove_partial_block (journal, task->repo_id, block_id);
+
+    seaf_block_manager_block_handle_free (seaf->block_mgr, block);
 
-        if (task->state == HTTP_TASK_STATE_CANCELED)
-            goto out;
-    }
     g_free (url);
-    url = NULL;
+    g_free (range);
+    g_free (data.prefix);
+    g_byte_array_free (data.received, TRUE);
 
-    task->n_blocks = g_list_length (needed_block_list);
+    return ret;
 
-    seaf_debug ("%d blocks to send for %s:%s.\n",
-                task->n_blocks, task->host, task->repo_id);
+error:
+    g_free (url);
+    g_free (range);
+    g_free (data.prefix);
+    g_byte_array_free (data.received, TRUE);
 
-    if (multi_threaded_send_blocks(task, needed_block_list) < 0 ||
-        task->state == HTTP_TASK_STATE_CANCELED)
-        goto out;
+    seaf_block_manager_close_block (seaf->block_mgr, block);
+    seaf_block_manager_block_handle_free (seaf->block_mgr, block);
 
-    transition_state (task, task->state, HTTP_TASK_RT_STATE_UPDATE_BRANCH);
+    return ret;
+}
 
-    if (update_branch (task, conn) < 0) {
-        seaf_warning ("Failed to update branch of repo %.8s.\n", task->repo_id);
-        goto out;
-    }
+#ifdef HTTP_MULTIPLEX_SUPPORTED
 
-    /* After successful upload, the cached 'master' branch should be updated to
-     * the head commit of 'local' branch.
-     */
-    update_master_branch (task);
+static int
+multiplexed_download_file_blocks (HttpTxTask *task, Seafile *file)
+{
+    GList *missing = NULL;
+    GHashTable *block_refs;
+    char *block_id;
+    gint64 size;
+    int i, refs;
+    int ret;
 
-    if (active_paths != NULL)
-        g_hash_table_foreach (active_paths, set_path_status_synced, task);
+    block_refs = g_hash_table_new (g_str_hash, g_str_equal);
 
-out:
-    string_list_free (send_fs_list);
-    string_list_free (needed_fs_list);
-    string_list_free (block_list);
-    string_list_free (needed_block_list);
+    for (i = 0; i < file->n_blocks; ++i) {
+        block_id = file->blk_sha1s[i];
 
-    if (active_paths)
-        g_hash_table_destroy (active_paths);
+        /* A block may appear more than once in a file. Fetch it once
+         * but take one reference for every occurrence.
+         */
+        refs = GPOINTER_TO_INT (g_hash_table_lookup (block_refs, block_id));
+        if (refs > 0) {
+            g_hash_table_replace (block_refs, block_id, GINT_TO_POINTER(refs + 1));
+            continue;
+        }
 
-    g_free (url);
+        size = ref_stored_block (task, block_id);
+        if (size >= 0) {
+            task->done_download += size;
+            continue;
+        }
 
-    connection_pool_return_connection (pool, conn);
+        g_hash_table_replace (block_refs, block_id, GINT_TO_POINTER(1));
+        missing = g_list_prepend (missing, block_id);
+    }
 
-    return vdata;
+    missing = g_list_reverse (missing);
+
+    ret = multiplexed_transfer_blocks (task, missing, FALSE, block_refs);
+
+    g_list_free (missing);
+    g_hash_table_destroy (block_refs);
+
+    return ret;
 }
 
-static void
-http_upload_done (void *vdata)
+#endif  /* HTTP_MULTIPLEX_SUPPORTED */
+
+gboolean
+http_tx_task_can_pack_blocks (HttpTxTask *task)
 {
-    HttpTxTask *task = vdata;
+    ConnectionPool *pool;
 
-    if (task->error != SYNC_ERROR_ID_NO_ERROR)
-        transition_state (task, HTTP_TASK_STATE_ERROR, HTTP_TASK_RT_STATE_FINISHED);
-    else if (task->state == HTTP_TASK_STATE_CANCELED)
-        transition_state (task, task->state, HTTP_TASK_RT_STATE_FINISHED);
-    else
-        transition_state (task, HTTP_TASK_STATE_FINISHED, HTTP_TASK_RT_STATE_FINISHED);
+    pool = find_connection_pool (seaf->http_tx_mgr->priv, task->host);
+    return (pool && pool->block_pack);
 }
 
-/* Download */
+typedef struct BlockFetchPack {
+    char *req_content;
+    int n_requested;
+    int result;
+} BlockFetchPack;
 
-static void *http_download_thread (void *vdata);
-static void http_download_done (void *vdata);
+typedef struct BlockPrefetchData {
+    HttpTxTask *http_task;
+    ConnectionPool *cpool;
+    GAsyncQueue *finished_packs;
+} BlockPrefetchData;
 
-int
-http_tx_manager_add_download (HttpTxManager *manager,
-                              const char *repo_id,
-                              int repo_version,
-                              const char *host,
-                              const char *token,
-                              const char *server_head_id,
-                              gboolean is_clone,
-                              const char *passwd,
-                              const char *worktree,
-                              int protocol_version,
-                              const char *email,
-                              gboolean use_fileserver_port,
-                              const char *repo_name,
-                              GError **error)
+static void
+block_fetch_pack_free (BlockFetchPack *pack)
 {
-    HttpTxTask *task;
-    SeafRepo *repo;
-
-    if (!repo_id) {
-        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Empty argument(repo_id)");
-        return -1;
-    }
+    g_free (pack->req_content);
+    g_free (pack);
+}
 
-    if (!token) {
-        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Empty argument(token)");
-        return -1;
-    }
+/* Store a block received in a pack. No reference is taken, that is left to
+ * the fetch of the file it belongs to.
+ */
+static int
+save_packed_block (HttpTxTask *task, const char *block_id,
+                   const guint8 *data, int size)
+{
+    BlockHandle *block;
+    int ret = 0;
 
-    if (!host) {
-        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Empty argument(host)");
+    block = seaf_block_manager_open_block (seaf->block_mgr,
+                                           task->repo_id, task->repo_version,
+                                           block_id, BLOCK_WRITE);
+    if (!block) {
+        seaf_warning ("Failed to open block %s in repo %.8s.\n",
+                      block_id, task->repo_id);
+        task->error = SYNC_ERROR_ID_WRITE_LOCAL_DATA;
         return -1;
     }
 
-    if (!server_head_id) {
-        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Empty argument(server_head_id)");
+    if (size > 0 &&
+        seaf_block_manager_write_block (seaf->block_mgr, block,
+                                        data, size) != size) {
+        seaf_warning ("Failed to write block %s in repo %.8s.\n",
+                      block_id, task->repo_id);
+        task->error = SYNC_ERROR_ID_WRITE_LOCAL_DATA;
+        seaf_block_manager_close_block (seaf->block_mgr, block);
+        seaf_block_manager_block_handle_free (seaf->block_mgr, block);
         return -1;
     }
 
-    if (!email) {
-        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Empty argument(email)");
-        return -1;
-    }
+    seaf_block_manager_close_block (seaf->block_mgr, block);
 
-    if (!is_clone) {
-        repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
-        if (!repo) {
-            g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Repo not found");
-            return -1;
-        }
+    pthread_mutex_lock (&task->ref_cnt_lock);
+    if (!seaf_block_manager_block_exists (seaf->block_mgr,
+                                          task->repo_id, task->repo_version,
+                                          block_id) &&
+        seaf_block_manager_commit_block (seaf->block_mgr, block) < 0) {
+        seaf_warning ("Failed to commit block %s in repo %.8s.\n",
+                      block_id, task->repo_id);
+        task->error = SYNC_ERROR_ID_WRITE_LOCAL_DATA;
+        ret = -1;
     }
+    pthread_mutex_unlock (&task->ref_cnt_lock);
 
-    clean_tasks_for_repo (manager, repo_id);
-
-    task = http_tx_task_new (manager, repo_id, repo_version,
-                             HTTP_TASK_TYPE_DOWNLOAD, is_clone,
-                             host, token, passwd, worktree);
+    seaf_block_manager_block_handle_free (seaf->block_mgr, block);
 
-    memcpy (task->head, server_head_id, 40);
-    task->protocol_version = protocol_version;
-    task->email = g_strdup(email);
+    if (ret == 0)
+        server_block_cache_add (task->block_cache, block_id);
+    if (ret == 0 && task->shared_blocks)
+        seaf_shared_block_cache_add (task->repo_id, task->repo_version,
+                                     block_id);
 
-    task->state = HTTP_TASK_STATE_NORMAL;
+    return ret;
+}
 
-    task->use_fileserver_port = use_fileserver_port;
+static int
+save_packed_blocks (HttpTxTask *task, const char *rsp_content, gint64 rsp_size)
+{
+    const char *p = rsp_content;
+    ObjectHeader *hdr;
+    char block_id[41];
+    gint64 n = 0;
+    int size;
 
-    task->blk_ref_cnts = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                                g_free, g_free);
-    pthread_mutex_init (&task->ref_cnt_lock, NULL);
+    while (n < rsp_size) {
+        hdr = (ObjectHeader *)p;
+        if (n + sizeof(ObjectHeader) > rsp_size) {
+            seaf_warning ("Incomplete block package received for repo %.8s.\n",
+                          task->repo_id);
+            task->error = SYNC_ERROR_ID_SERVER;
+            return -1;
+        }
 
-    g_hash_table_insert (manager->priv->download_tasks,
-                         g_strdup(repo_id),
-                         task);
+        memcpy (block_id, hdr->obj_id, 40);
+        block_id[40] = 0;
+        size = ntohl (hdr->obj_size);
+        if (n + sizeof(ObjectHeader) + size > rsp_size) {
+            seaf_warning ("Incomplete block package received for repo %.8s.\n",
+                          task->repo_id);
+            task->error = SYNC_ERROR_ID_SERVER;
+            return -1;
+        }
 
-    task->repo_name = g_strdup(repo_name);
+        if (save_packed_block (task, block_id, hdr->object, size) < 0)
+            return -1;
 
-    if (seaf_job_manager_schedule_job (seaf->job_mgr,
-                                       http_download_thread,
-                                       http_download_done,
-                                       task) < 0) {
-        g_hash_table_remove (manager->priv->download_tasks, repo_id);
-        return -1;
+        p += (sizeof(ObjectHeader) + size);
+        n += (sizeof(ObjectHeader) + size);
     }
 
     return 0;
 }
-
-static int
-get_commit_object (HttpTxTask *task, Connection *conn)
+
+static void
+prefetch_block_pack_thread_func (gpointer data, gpointer user_data)
 {
-    CURL *curl;
-    char *url;
-    int status;
+    BlockFetchPack *pack = data;
+    BlockPrefetchData *tx_data = user_data;
+    HttpTxTask *task = tx_data->http_task;
+    Connection *conn;
+    char *url = NULL;
     char *rsp_content = NULL;
-    gint64 rsp_size;
-    int ret = 0;
+    gint64 rsp_size = 0;
+    int status;
+    int curl_error;
 
-    curl = conn->curl;
+    if (task->state == HTTP_TASK_STATE_CANCELED)
+        goto out;
+
+    conn = connection_pool_get_connection (tx_data->cpool);
+    if (!conn) {
+        seaf_warning ("Failed to get connection to host %s.\n", task->host);
+        task->error = SYNC_ERROR_ID_NOT_ENOUGH_MEMORY;
+        pack->result = -1;
+        goto out;
+    }
 
     if (!task->use_fileserver_port)
-        url = g_strdup_printf ("%s/seafhttp/repo/%s/commit/%s",
-                               task->host, task->repo_id, task->head);
+        url = g_strdup_printf ("%s/seafhttp/repo/%s/pack-blocks/",
+                               task->host, task->repo_id);
     else
-        url = g_strdup_printf ("%s/repo/%s/commit/%s",
-                               task->host, task->repo_id, task->head);
+        url = g_strdup_printf ("%s/repo/%s/pack-blocks/",
+                               task->host, task->repo_id);
 
-    int curl_error;
-    if (http_get (curl, url, task->token, &status,
-                  &rsp_content, &rsp_size,
-                  NULL, NULL, TRUE, &curl_error) < 0) {
+    transfer_concurrency_acquire (tx_data->cpool->concurrency);
+    if (http_post (conn->curl, url, task->token,
+                   pack->req_content, strlen(pack->req_content),
+                   &status, &rsp_content, &rsp_size,
+                   TRUE, &curl_error) < 0) {
         conn->release = TRUE;
         handle_curl_errors (task, curl_error);
-        ret = -1;
-        goto out;
+        pack->result = -1;
+    } else if (status != HTTP_OK) {
+        seaf_warning ("Bad response code for POST %s: %d.\n", url, status);
+        handle_http_errors (task, status);
+        pack->result = -1;
     }
+    transfer_concurrency_release (tx_data->cpool->concurrency, rsp_size,
+                                  pack->result < 0 && conn->release);
 
-    if (status != HTTP_OK) {
-        seaf_warning ("Bad response code for GET %s: %d.\n", url, status);
-        handle_http_errors (task, status);
-        ret = -1;
+    curl_easy_reset (conn->curl);
+    connection_pool_return_connection (tx_data->cpool, conn);
+
+    if (pack->result < 0)
         goto out;
-    }
 
-    int rc = seaf_obj_store_write_obj (seaf->commit_mgr->obj_store,
-                                       task->repo_id, task->repo_version,
-                                       task->head,
-                                       rsp_content,
-                                       rsp_size,
-                                       FALSE);
-    if (rc < 0) {
-        seaf_warning ("Failed to save commit %s in repo %.8s.\n",
-                      task->head, task->repo_id);
-        task->error = SYNC_ERROR_ID_WRITE_LOCAL_DATA;
-        ret = -1;
-    }
+    g_atomic_int_add (&(seaf->sync_mgr->recv_bytes), (int)rsp_size);
+    g_atomic_int_add (&task->tx_bytes, (int)rsp_size);
+    bandwidth_flow_consume (task->flow, seaf_transfer_policy_get_download_limit (),
+                            (int)rsp_size);
+
+    if (save_packed_blocks (task, rsp_content, rsp_size) < 0)
+        pack->result = -1;
+    else
+        seaf_debug ("Received %d blocks in one pack from %s:%s.\n",
+                    pack->n_requested, task->host, task->repo_id);
 
 out:
     g_free (url);
     g_free (rsp_content);
-    curl_easy_reset (curl);
-
-    return ret;
+    g_async_queue_push (tx_data->finished_packs, pack);
 }
 
-static int
-get_needed_fs_id_list (HttpTxTask *task, Connection *conn, GList **fs_id_list)
+static GList *
+collect_missing_blocks (HttpTxTask *task, GList *file_ids)
 {
-    SeafBranch *master;
-    CURL *curl;
-    char *url = NULL;
-    int status;
-    char *rsp_content = NULL;
-    gint64 rsp_size;
-    int ret = 0;
-    json_t *array;
-    json_error_t jerror;
-    const char *obj_id;
+    GHashTable *added;
+    GList *missing = NULL;
+    GList *ptr;
+    Seafile *file;
+    char *block_id;
+    int i;
 
-    const char *url_prefix = (task->use_fileserver_port) ? "" : "seafhttp/";
+    added = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
 
-    if (!task->is_clone) {
-        master = seaf_branch_manager_get_branch (seaf->branch_mgr,
+    for (ptr = file_ids; ptr; ptr = ptr->next) {
+        file = seaf_fs_manager_get_seafile (seaf->fs_mgr,
+                                            task->repo_id, task->repo_version,
+                                            ptr->data);
+        /* Reported when the file itself is fetched. */
+        if (!file)
+            continue;
+
+        for (i = 0; i < file->n_blocks; ++i) {
+            block_id = file->blk_sha1s[i];
+            if (g_hash_table_lookup (added, block_id) ||
+                seaf_block_manager_block_exists (seaf->block_mgr,
                                                  task->repo_id,
-                                                 "master");
-        if (!master) {
-            seaf_warning ("Failed to get branch master for repo %.8s.\n",
-                          task->repo_id);
-            return -1;
+                                                 task->repo_version,
+                                                 block_id))
+                continue;
+            g_hash_table_insert (added, g_strdup(block_id), GINT_TO_POINTER(1));
+            missing = g_list_prepend (missing, g_strdup(block_id));
         }
 
-        url = g_strdup_printf ("%s/%srepo/%s/fs-id-list/"
-                               "?server-head=%s&client-head=%s",
-                               task->host, url_prefix, task->repo_id,
-                               task->head, master->commit_id);
-
-        seaf_branch_unref (master);
-    } else {
-        url = g_strdup_printf ("%s/%srepo/%s/fs-id-list/?server-head=%s",
-                               task->host, url_prefix, task->repo_id, task->head);
+        seafile_unref (file);
     }
 
-    curl = conn->curl;
+    g_hash_table_destroy (added);
 
-    int curl_error;
-    if (http_get (curl, url, task->token, &status,
-                  &rsp_content, &rsp_size,
-                  NULL, NULL, (!task->is_clone), &curl_error) < 0) {
-        conn->release = TRUE;
-        handle_curl_errors (task, curl_error);
-        ret = -1;
-        goto out;
-    }
+    return g_list_reverse (missing);
+}
 
-    if (status != HTTP_OK) {
-        seaf_warning ("Bad response code for GET %s: %d.\n", url, status);
-        handle_http_errors (task, status);
-        ret = -1;
-        goto out;
+static BlockFetchPack *
+block_fetch_pack_new (GList **block_ids)
+{
+    BlockFetchPack *pack;
+    json_t *array;
+    char *block_id;
+
+    pack = g_new0 (BlockFetchPack, 1);
+    array = json_array ();
+
+    while (*block_ids != NULL &&
+           pack->n_requested < HTTP_MAX_BLOCKS_PER_PACK) {
+        block_id = (*block_ids)->data;
+        json_array_append_new (array, json_string(block_id));
+        *block_ids = g_list_delete_link (*block_ids, *block_ids);
+        g_free (block_id);
+        ++(pack->n_requested);
     }
 
-    array = json_loadb (rsp_content, rsp_size, 0, &jerror);
-    if (!array) {
-        seaf_warning ("Invalid JSON response from the server: %s.\n", jerror.text);
-        task->error = SYNC_ERROR_ID_SERVER;
-        ret = -1;
-        goto out;
+    pack->req_content = json_dumps (array, 0);
+    json_decref (array);
+
+    return pack;
+}
+
+int
+http_tx_task_prefetch_file_blocks (HttpTxTask *task, GList *file_ids)
+{
+    HttpTxPriv *priv = seaf->http_tx_mgr->priv;
+    ConnectionPool *cpool;
+    GThreadPool *tpool;
+    GAsyncQueue *finished_packs;
+    BlockPrefetchData data;
+    BlockFetchPack *pack;
+    GList *missing;
+    int n_running = 0;
+    gboolean stop = FALSE;
+    int ret = 0;
+
+    cpool = find_connection_pool (priv, task->host);
+    if (!cpool) {
+        seaf_warning ("Failed to create connection pool for host %s.\n", task->host);
+        task->error = SYNC_ERROR_ID_NOT_ENOUGH_MEMORY;
+        return -1;
     }
 
-    int i;
-    size_t n = json_array_size (array);
-    json_t *str;
+    missing = collect_missing_blocks (task, file_ids);
+    if (!missing)
+        return 0;
 
-    seaf_debug ("Received fs object list size %lu from %s:%s.\n",
-                n, task->host, task->repo_id);
+    finished_packs = g_async_queue_new ();
 
-    task->n_fs_objs = (int)n;
+    data.http_task = task;
+    data.cpool = cpool;
+    data.finished_packs = finished_packs;
 
-    GHashTable *checked_objs = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                                      g_free, NULL);
+    tpool = g_thread_pool_new (prefetch_block_pack_thread_func, &data,
+                               seaf->max_transfer_threads, FALSE, NULL);
 
-    for (i = 0; i < n; ++i) {
-        str = json_array_get (array, i);
-        if (!str) {
-            seaf_warning ("Invalid JSON response from the server.\n");
-            json_decref (array);
-            string_list_free (*fs_id_list);
-            ret = -1;
-            goto out;
+    while (1) {
+        while (!stop && missing != NULL &&
+               n_running < transfer_concurrency_get_limit (cpool->concurrency)) {
+            pack = block_fetch_pack_new (&missing);
+            g_thread_pool_push (tpool, pack, NULL);
+            ++n_running;
         }
 
-        obj_id = json_string_value(str);
+        if (n_running == 0)
+            break;
 
-        if (g_hash_table_lookup (checked_objs, obj_id)) {
-            ++(task->done_fs_objs);
-            continue;
-        }
-        char *key = g_strdup(obj_id);
-        g_hash_table_replace (checked_objs, key, key);
-
-        if (!seaf_obj_store_obj_exists (seaf->fs_mgr->obj_store,
-                                        task->repo_id, task->repo_version,
-                                        obj_id)) {
-            *fs_id_list = g_list_prepend (*fs_id_list, g_strdup(obj_id));
-        } else if (task->is_clone) {
-            gboolean io_error = FALSE;
-            gboolean sound;
-            sound = seaf_fs_manager_verify_object (seaf->fs_mgr,
-                                                   task->repo_id, task->repo_version,
-                                                   obj_id, FALSE, &io_error);
-            if (!sound && !io_error) {
-                *fs_id_list = g_list_prepend (*fs_id_list, g_strdup(obj_id));
-            } else {
-                ++(task->done_fs_objs);
-            }
-        } else {
-            ++(task->done_fs_objs);
+        pack = g_async_queue_pop (finished_packs);
+        --n_running;
+
+        if (pack->result < 0) {
+            ret = -1;
+            stop = TRUE;
+        } else if (task->state == HTTP_TASK_STATE_CANCELED) {
+            stop = TRUE;
         }
-    }
 
-    json_decref (array);
-    g_hash_table_destroy (checked_objs);
+        block_fetch_pack_free (pack);
+    }
 
-out:
-    g_free (url);
-    g_free (rsp_content);
-    curl_easy_reset (curl);
+    g_thread_pool_free (tpool, FALSE, TRUE);
+    g_async_queue_unref (finished_packs);
+    string_list_free (missing);
 
     return ret;
 }
 
-#define GET_FS_OBJECT_N 100
-
-static int
-get_fs_objects (HttpTxTask *task, Connection *conn, GList **fs_list)
+int
+http_tx_task_download_file_blocks (HttpTxTask *task, const char *file_id)
 {
-    json_t *array;
-    char *obj_id;
-    int n_sent = 0;
-    char *data = NULL;
-    int len;
-    CURL *curl;
-    char *url = NULL;
-    int status;
-    char *rsp_content = NULL;
-    gint64 rsp_size;
+    Seafile *file;
+    HttpTxPriv *priv = seaf->http_tx_mgr->priv;
+    ConnectionPool *pool;
+    Connection *conn;
     int ret = 0;
-    GHashTable *requested;
-
-    /* Convert object id list to JSON format. */
 
-    requested = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    file = seaf_fs_manager_get_seafile (seaf->fs_mgr,
+                                        task->repo_id,
+                                        task->repo_version,
+                                        file_id);
+    if (!file) {
+        seaf_warning ("Failed to find seafile object %s in repo %.8s.\n",
+                      file_id, task->repo_id);
+        return -1;
+    }
 
-    array = json_array ();
+#ifdef HTTP_MULTIPLEX_SUPPORTED
+    if (seaf->http2_max_streams > 0) {
+        ret = multiplexed_download_file_blocks (task, file);
+        seafile_unref (file);
+        return ret;
+    }
+#endif
 
-    while (*fs_list != NULL) {
-        obj_id = (*fs_list)->data;
-        json_array_append_new (array, json_string(obj_id));
+    pool = find_connection_pool (priv, task->host);
+    if (!pool) {
+        seaf_warning ("Failed to create connection pool for host %s.\n", task->host);
+        task->error = SYNC_ERROR_ID_NOT_ENOUGH_MEMORY;
+        seafile_unref (file);
+        return -1;
+    }
 
-        *fs_list = g_list_delete_link (*fs_list, *fs_list);
+    conn = connection_pool_get_connection (pool);
+    if (!conn) {
+        seaf_warning ("Failed to get connection to host %s.\n", task->host);
+        task->error = SYNC_ERROR_ID_NOT_ENOUGH_MEMORY;
+        seafile_unref (file);
+        return -1;
+    }
 
-        g_hash_table_replace (requested, obj_id, obj_id);
+    int i;
+    char *block_id;
+    gint64 size;
+    double received;
+    for (i = 0; i < file->n_blocks; ++i) {
+        block_id = file->blk_sha1s[i];
+        size = ref_stored_block (task, block_id);
+        if (size >= 0) {
+            task->done_download += size;
+            continue;
+        }
 
-        if (++n_sent >= GET_FS_OBJECT_N)
+        gint64 start = seaf_metrics_now ();
+        transfer_concurrency_acquire (pool->concurrency);
+        ret = get_block (task, conn, block_id);
+        seaf_trace_span ("get_block", start, block_id);
+        received = 0;
+        curl_easy_getinfo (conn->curl, CURLINFO_SIZE_DOWNLOAD, &received);
+        transfer_concurrency_release (pool->concurrency, (gint64)received,
+                                      ret < 0 && conn->release);
+        if (ret < 0 || task->state == HTTP_TASK_STATE_CANCELED)
             break;
     }
 
-    seaf_debug ("Requesting %d fs objects from %s:%s.\n",
-                n_sent, task->host, task->repo_id);
-
-    data = json_dumps (array, 0);
-    len = strlen(data);
-    json_decref (array);
+    connection_pool_return_connection (pool, conn);
 
-    /* Send fs object id list. */
+    seafile_unref (file);
 
-    curl = conn->curl;
+    return ret;
+}
 
-    if (!task->use_fileserver_port)
-        url = g_strdup_printf ("%s/seafhttp/repo/%s/pack-fs/", task->host, task->repo_id);
-    else
-        url = g_strdup_printf ("%s/repo/%s/pack-fs/", task->host, task->repo_id);
+int
+http_tx_manager_download_file_blocks (HttpTxManager *manager,
+                                      const char *repo_id,
+                                      int repo_version,
+                                      const char *host,
+                                      const char *token,
+                                      gboolean use_fileserver_port,
+                                      int transfer_priority,
+                                      const char *file_id)
+{
+    HttpTxTask *task;
+    SeafRepo *repo;
+    int ret;
 
-    int curl_error;
-    if (http_post (curl, url, task->token,
-                   data, len,
-                   &status, &rsp_content, &rsp_size, TRUE, &curl_error) < 0) {
-        conn->release = TRUE;
-        handle_curl_errors (task, curl_error);
-        ret = -1;
-        goto out;
-    }
+    task = http_tx_task_new (manager, repo_id, repo_version,
+                             HTTP_TASK_TYPE_DOWNLOAD, FALSE,
+                             host, token, NULL, NULL);
+    task->state = HTTP_TASK_STATE_NORMAL;
+    task->use_fileserver_port = use_fileserver_port;
+    task->blk_ref_cnts = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                g_free, g_free);
+    pthread_mutex_init (&task->ref_cnt_lock, NULL);
+    task->flow = bandwidth_scheduler_add_flow (manager->priv->download_sched,
+                                               transfer_priority);
+    repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
+    task->shared_blocks = (repo && !repo->encrypted);
 
-    if (status != HTTP_OK) {
-        seaf_warning ("Bad response code for POST %s: %d.\n", url, status);
-        handle_http_errors (task, status);
-        ret = -1;
-        goto out;
-    }
+    ret = http_tx_task_download_file_blocks (task, file_id);
 
-    /* Save received fs objects. */
+    pthread_mutex_destroy (&task->ref_cnt_lock);
+    http_tx_task_free (task);
+    return ret;
+}
 
-    int n_recv = 0;
-    char *p = rsp_content;
-    ObjectHeader *hdr = (ObjectHeader *)p;
-    char recv_obj_id[41];
-    int n = 0;
-    int size;
-    int rc;
-    while (n < rsp_size) {
-        memcpy (recv_obj_id, hdr->obj_id, 40);
-        recv_obj_id[40] = 0;
-        size = ntohl (hdr->obj_size);
-        if (n + sizeof(ObjectHeader) + size > rsp_size) {
-            seaf_warning ("Incomplete object package received for repo %.8s.\n",
-                          task->repo_id);
-            task->error = SYNC_ERROR_ID_SERVER;
-            ret = -1;
-            goto out;
-        }
+int
+http_tx_manager_refetch_objects (HttpTxManager *manager,
+                                 const char *repo_id,
+                                 int repo_version,
+                                 const char *host,
+                                 const char *token,
+                                 gboolean use_fileserver_port,
+                                 int transfer_priority,
+                                 GList *fs_ids,
+                                 GList *block_ids)
+{
+    HttpTxTask *task;
+    FsIdListStream stream;
+    ConnectionPool *pool;
+    Connection *conn;
+    GList *ptr;
+    int ret = 0;
 
-        ++n_recv;
+    task = http_tx_task_new (manager, repo_id, repo_version,
+                             HTTP_TASK_TYPE_DOWNLOAD, FALSE,
+                             host, token, NULL, NULL);
+    task->state = HTTP_TASK_STATE_NORMAL;
+    task->use_fileserver_port = use_fileserver_port;
+    task->blk_ref_cnts = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                g_free, g_free);
+    pthread_mutex_init (&task->ref_cnt_lock, NULL);
+    task->flow = bandwidth_scheduler_add_flow (manager->priv->download_sched,
+                                               transfer_priority);
+
+    if (fs_ids) {
+        /* The listed ids, as if received in an fs id list. */
+        memset (&stream, 0, sizeof(stream));
+        stream.task = task;
+        stream.ids = g_async_queue_new ();
+        for (ptr = fs_ids; ptr; ptr = ptr->next)
+            g_async_queue_push (stream.ids, g_strdup (ptr->data));
+        g_async_queue_push (stream.ids, FS_ID_LIST_END);
+
+        if (get_fs_objects (task, &stream) < 0)
+            ret = -1;
+        g_async_queue_unref (stream.ids);
+    }
 
-        rc = seaf_obj_store_write_obj (seaf->fs_mgr->obj_store,
-                                       task->repo_id, task->repo_version,
-                                       recv_obj_id,
-                                       hdr->object,
-                                       size, FALSE);
-        if (rc < 0) {
-            seaf_warning ("Failed to write fs object %s in repo %.8s.\n",
-                          recv_obj_id, task->repo_id);
-            task->error = SYNC_ERROR_ID_WRITE_LOCAL_DATA;
+    if (block_ids) {
+        pool = find_connection_pool (manager->priv, host);
+        conn = pool ? connection_pool_get_connection (pool) : NULL;
+        if (!conn) {
+            seaf_warning ("Failed to get connection to host %s.\n", host);
             ret = -1;
             goto out;
         }
 
-        g_hash_table_remove (requested, recv_obj_id);
-
-        ++(task->done_fs_objs);
-
-        p += (sizeof(ObjectHeader) + size);
-        n += (sizeof(ObjectHeader) + size);
-        hdr = (ObjectHeader *)p;
-    }
-
-    seaf_debug ("Received %d fs objects from %s:%s.\n",
-                n_recv, task->host, task->repo_id);
+        for (ptr = block_ids; ptr; ptr = ptr->next) {
+            /* A block in the store isn't fetched again. */
+            seaf_block_manager_remove_block (seaf->block_mgr,
+                                             repo_id, repo_version, ptr->data);
+            if (get_block (task, conn, ptr->data) < 0)
+                ret = -1;
+        }
 
-    /* The server may not return all the objects we requested.
-     * So we need to add back the remaining object ids into fs_list.
-     */
-    GHashTableIter iter;
-    gpointer key, value;
-    g_hash_table_iter_init (&iter, requested);
-    while (g_hash_table_iter_next (&iter, &key, &value)) {
-        obj_id = key;
-        *fs_list = g_list_prepend (*fs_list, g_strdup(obj_id));
+        connection_pool_return_connection (pool, conn);
     }
-    g_hash_table_destroy (requested);
 
 out:
-    g_free (url);
-    g_free (data);
-    g_free (rsp_content);
-    curl_easy_reset (curl);
-
+    pthread_mutex_destroy (&task->ref_cnt_lock);
+    http_tx_task_free (task);
     return ret;
 }
 
+/* Downloaded data is decrypted in pieces of this size. curl doesn't pass
+ * more than CURL_MAX_WRITE_SIZE to a callback by default, so it usually
+ * takes one piece.
+ */
+#define STREAM_DECRYPT_CHUNK (16 << 10)
+
 typedef struct {
-    char block_id[41];
-    BlockHandle *block;
     HttpTxTask *task;
-} GetBlockData;
+    int fd;
+    SeafileCipher *cipher;
+    char *dec_buf;
+    SeafSHA1Ctx sha1_ctx;
+    gint64 size;
+    /* Set if the callback failed, rather than the network. */
+    int error;
+} StreamBlockData;
+
+static int
+stream_block_write (StreamBlockData *data, const char *buf, int len)
+{
+    if (writen (data->fd, buf, len) != len) {
+        seaf_warning ("Failed to write block of repo %.8s: %s.\n",
+                      data->task->repo_id, strerror(errno));
+        data->error = SYNC_ERROR_ID_WRITE_LOCAL_DATA;
+        return -1;
+    }
+    return 0;
+}
+
+static int
+stream_block_decrypt (StreamBlockData *data, const char *buf, int len)
+{
+    int n, out_len;
+
+    while (len > 0) {
+        n = MIN (len, STREAM_DECRYPT_CHUNK);
+        if (seafile_cipher_update (data->cipher, data->dec_buf, &out_len,
+                                   buf, n) < 0) {
+            data->error = SYNC_ERROR_ID_LOCAL_DATA_CORRUPT;
+            return -1;
+        }
+        if (stream_block_write (data, data->dec_buf, out_len) < 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+}
 
 static size_t
-get_block_callback (void *ptr, size_t size, size_t nmemb, void *userp)
+stream_block_callback (void *ptr, size_t size, size_t nmemb, void *userp)
 {
     size_t realsize = size *nmemb;
-    SendBlockData *data = userp;
+    StreamBlockData *data = userp;
     HttpTxTask *task = data->task;
-    size_t n;
+    int ret;
 
     if (task->state == HTTP_TASK_STATE_CANCELED || task->all_stop)
         return 0;
 
-    n = seaf_block_manager_write_block (seaf->block_mgr,
-                                        data->block,
-                                        ptr, realsize);
-    if (n < realsize) {
-        seaf_warning ("Failed to write block %s in repo %.8s.\n",
-                      data->block_id, task->repo_id);
-        task->error = SYNC_ERROR_ID_WRITE_LOCAL_DATA;
-        return n;
-    }
-
-    /* Update global transferred bytes. */
-    g_atomic_int_add (&(seaf->sync_mgr->recv_bytes), n);
+    seaf_sha1_update (&data->sha1_ctx, ptr, realsize);
+    data->size += realsize;
 
-    /* Update transferred bytes for this task */
-    g_atomic_int_add (&task->tx_bytes, n);
+    if (data->cipher)
+        ret = stream_block_decrypt (data, ptr, (int)realsize);
+    else
+        ret = stream_block_write (data, ptr, (int)realsize);
+    if (ret < 0)
+        return 0;
 
-    /* If uploaded bytes exceeds the limit, wait until the counter
-     * is reset. We check the counter every 100 milliseconds, so we
-     * can waste up to 100 milliseconds without sending data after
-     * the counter is reset.
-     */
-    while (1) {
-        gint sent = g_atomic_int_get(&(seaf->sync_mgr->recv_bytes));
-        if (seaf->sync_mgr->download_limit > 0 &&
-            sent > seaf->sync_mgr->download_limit)
-            /* 100 milliseconds */
-            g_usleep (100000);
-        else
-            break;
-    }
+    g_atomic_int_add (&(seaf->sync_mgr->recv_bytes), realsize);
+    g_atomic_int_add (&task->tx_bytes, realsize);
+    bandwidth_flow_consume (task->flow, seaf_transfer_policy_get_download_limit (), realsize);
 
-    return n;
+    return realsize;
 }
 
-int
-get_block (HttpTxTask *task, Connection *conn, const char *block_id)
+/* Download a block and write its decrypted content to @fd as it arrives.
+ * The block is only verified at the end, so on errors @fd contains junk and
+ * should be discarded.
+ */
+static int
+stream_block (HttpTxTask *task, Connection *conn, const char *block_id,
+              int fd, SeafileCrypt *crypt)
 {
-    CURL *curl;
+    ConnectionPool *pool;
+    CURL *curl = conn->curl;
+    StreamBlockData data;
+    gboolean accept_deflate = FALSE;
+    unsigned char sha1[20];
+    char check_id[41];
     char *url;
-    int status;
-    BlockHandle *block;
+    char dec_buf[SEAFILE_CIPHER_MAX_OUT(STREAM_DECRYPT_CHUNK)];
+    int dec_out_len;
+    int status, curl_error;
     int ret = 0;
-    int *pcnt;
 
-    block = seaf_block_manager_open_block (seaf->block_mgr,
-                                           task->repo_id, task->repo_version,
-                                           block_id, BLOCK_WRITE);
-    if (!block) {
-        seaf_warning ("Failed to open block %s in repo %.8s.\n",
-                      block_id, task->repo_id);
-        return -1;
+    memset (&data, 0, sizeof(data));
+    data.task = task;
+    data.fd = fd;
+    data.dec_buf = dec_buf;
+
+    if (crypt) {
+        data.cipher = seafile_cipher_new (crypt, FALSE);
+        if (!data.cipher) {
+            task->error = SYNC_ERROR_ID_LOCAL_DATA_CORRUPT;
+            return -1;
+        }
     }
 
-    GetBlockData data;
-    memcpy (data.block_id, block_id, 40);
-    data.block = block;
-    data.task = task;
+    seaf_sha1_init (&data.sha1_ctx);
 
-    curl = conn->curl;
+    pool = find_connection_pool (seaf->http_tx_mgr->priv, task->host);
+    if (pool && pool->block_deflate) {
+        curl_easy_setopt (curl, CURLOPT_ACCEPT_ENCODING, "deflate");
+        accept_deflate = TRUE;
+    }
 
     if (!task->use_fileserver_port)
         url = g_strdup_printf ("%s/seafhttp/repo/%s/block/%s",
@@ -4570,91 +7997,89 @@ get_block (HttpTxTask *task, Connection *conn, const char *block_id)
         url = g_strdup_printf ("%s/repo/%s/block/%s",
                                task->host, task->repo_id, block_id);
 
-    int curl_error;
-    if (http_get (curl, url, task->token, &status, NULL, NULL,
-                  get_block_callback, &data, TRUE, &curl_error) < 0) {
-        if (task->state == HTTP_TASK_STATE_CANCELED)
-            goto error;
-
-        if (task->error == SYNC_ERROR_ID_NO_ERROR) {
-            /* Only release the connection when it's a network error. */
+    int rc = http_get (curl, url, task->token, &status, NULL, NULL,
+                       stream_block_callback, &data, TRUE, &curl_error);
+    if (accept_deflate)
+        curl_easy_setopt (curl, CURLOPT_ACCEPT_ENCODING, NULL);
+    if (rc < 0) {
+        if (data.error) {
+            task->error = data.error;
+        } else if (task->state != HTTP_TASK_STATE_CANCELED &&
+                   task->error == SYNC_ERROR_ID_NO_ERROR) {
             conn->release = TRUE;
             handle_curl_errors (task, curl_error);
         }
         ret = -1;
-        goto error;
+        goto out;
     }
 
     if (status != HTTP_OK) {
         seaf_warning ("Bad response code for GET %s: %d.\n", url, status);
         handle_http_errors (task, status);
         ret = -1;
-        goto error;
-    }
-
-    BlockMetadata *bmd = seaf_block_manager_stat_block_by_handle(seaf->block_mgr, block);
-    if (bmd == NULL) {
-        seaf_warning ("Failed to get block %s meta data in repo %.8s.\n", block_id, task->repo_id);
-        ret = -1;
-        goto error;
+        goto out;
     }
-    
-    seaf_block_manager_close_block (seaf->block_mgr, block);
-
-    pthread_mutex_lock (&task->ref_cnt_lock);
-
-    task->done_download += bmd->size;
-    g_free (bmd);    
 
-    /* Don't overwrite the block if other thread already downloaded it.
-     * Since we've locked ref_cnt_lock, we can be sure the block won't be removed.
-     */
-    if (!seaf_block_manager_block_exists (seaf->block_mgr,
-                                          task->repo_id, task->repo_version,
-                                          block_id) &&
-        seaf_block_manager_commit_block (seaf->block_mgr, block) < 0)
-    {
-        seaf_warning ("Failed to commit block %s in repo %.8s.\n",
+    seaf_sha1_final (&data.sha1_ctx, sha1);
+    rawdata_to_hex (sha1, check_id, 20);
+    if (strcmp (check_id, block_id) != 0) {
+        seaf_warning ("Block %s in repo %.8s is corrupted on download.\n",
                       block_id, task->repo_id);
-        task->error = SYNC_ERROR_ID_WRITE_LOCAL_DATA;
+        task->error = SYNC_ERROR_ID_SERVER;
         ret = -1;
+        goto out;
     }
 
-    if (ret == 0) {
-        pcnt = g_hash_table_lookup (task->blk_ref_cnts, block_id);
-        if (!pcnt) {
-            pcnt = g_new0(int, 1);
-            g_hash_table_insert (task->blk_ref_cnts, g_strdup(block_id), pcnt);
+    if (data.cipher) {
+        if (seafile_cipher_final (data.cipher, dec_buf, &dec_out_len) < 0) {
+            seaf_warning ("Failed to decrypt block %s in repo %.8s.\n",
+                          block_id, task->repo_id);
+            task->error = SYNC_ERROR_ID_LOCAL_DATA_CORRUPT;
+            ret = -1;
+            goto out;
+        }
+        if (stream_block_write (&data, dec_buf, dec_out_len) < 0) {
+            task->error = data.error;
+            ret = -1;
+            goto out;
         }
-        *pcnt += 1;
     }
 
+    pthread_mutex_lock (&task->ref_cnt_lock);
+    task->done_download += data.size;
     pthread_mutex_unlock (&task->ref_cnt_lock);
 
-    seaf_block_manager_block_handle_free (seaf->block_mgr, block);
-
-    g_free (url);
-
-    return ret;
+    server_block_cache_add (task->block_cache, block_id);
 
-error:
+out:
+    seaf_sha1_cleanup (&data.sha1_ctx);
+    seafile_cipher_free (data.cipher);
     g_free (url);
-
-    seaf_block_manager_close_block (seaf->block_mgr, block);
-    seaf_block_manager_block_handle_free (seaf->block_mgr, block);
-
     return ret;
 }
 
 int
-http_tx_task_download_file_blocks (HttpTxTask *task, const char *file_id)
+http_tx_task_stream_file_blocks (HttpTxTask *task, const char *file_id,
+                                 int fd, SeafileCrypt *crypt)
 {
     Seafile *file;
     HttpTxPriv *priv = seaf->http_tx_mgr->priv;
     ConnectionPool *pool;
     Connection *conn;
+    char *block_id;
+    double received;
+    int i;
     int ret = 0;
 
+#ifdef HTTP_MULTIPLEX_SUPPORTED
+    if (seaf->http2_max_streams > 0)
+        return 1;
+#endif
+
+    /* Streamed blocks aren't stored, so they couldn't be shared. */
+    if (task->shared_blocks && seaf_shared_block_cache_enabled ())
+        return 1;
+
     file = seaf_fs_manager_get_seafile (seaf->fs_mgr,
                                         task->repo_id,
                                         task->repo_version,
@@ -4665,6 +8090,18 @@ http_tx_task_download_file_blocks (HttpTxTask *task, const char *file_id)
         return -1;
     }
 
+    /* Blocks already in the store are referenced by other files or were
+     * prefetched for this one. Leave those files to the normal path.
+     */
+    for (i = 0; i < file->n_blocks; ++i) {
+        if (seaf_block_manager_block_exists (seaf->block_mgr,
+                                             task->repo_id, task->repo_version,
+                                             file->blk_sha1s[i])) {
+            seafile_unref (file);
+            return 1;
+        }
+    }
+
     pool = find_connection_pool (priv, task->host);
     if (!pool) {
         seaf_warning ("Failed to create connection pool for host %s.\n", task->host);
@@ -4681,35 +8118,15 @@ http_tx_task_download_file_blocks (HttpTxTask *task, const char *file_id)
         return -1;
     }
 
-    int i;
-    char *block_id;
-    int *pcnt;
     for (i = 0; i < file->n_blocks; ++i) {
         block_id = file->blk_sha1s[i];
-        pthread_mutex_lock (&task->ref_cnt_lock);
-        if (seaf_block_manager_block_exists (seaf->block_mgr,
-                                             task->repo_id, task->repo_version,
-                                             block_id)) {
-            BlockMetadata *bmd;
-            bmd = seaf_block_manager_stat_block (seaf->block_mgr,
-                                                 task->repo_id, task->repo_version,
-                                                 block_id);
-            if (bmd) {
-                pcnt = g_hash_table_lookup (task->blk_ref_cnts, block_id);
-                if (!pcnt) {
-                    pcnt = g_new0(int, 1);
-                    g_hash_table_insert (task->blk_ref_cnts, g_strdup(block_id), pcnt);
-                }
-                *pcnt += 1;
-                pthread_mutex_unlock (&task->ref_cnt_lock);
-                task->done_download += bmd->size;
-                g_free (bmd);
-                continue;
-            }
-        }
-        pthread_mutex_unlock (&task->ref_cnt_lock);
 
-        ret = get_block (task, conn, block_id);
+        transfer_concurrency_acquire (pool->concurrency);
+        ret = stream_block (task, conn, block_id, fd, crypt);
+        received = 0;
+        curl_easy_getinfo (conn->curl, CURLINFO_SIZE_DOWNLOAD, &received);
+        transfer_concurrency_release (pool->concurrency, (gint64)received,
+                                      ret < 0 && conn->release);
         if (ret < 0 || task->state == HTTP_TASK_STATE_CANCELED)
             break;
     }
@@ -4807,7 +8224,10 @@ http_download_thread (void *vdata)
     HttpTxPriv *priv = seaf->http_tx_mgr->priv;
     ConnectionPool *pool;
     Connection *conn = NULL;
-    GList *fs_id_list = NULL;
+    FsIdListStream *stream;
+    int fs_ret;
+
+    task->block_cache = server_block_cache_load (task->repo_id, task->host);
 
     pool = find_connection_pool (priv, task->host);
     if (!pool) {
@@ -4827,6 +8247,7 @@ http_download_thread (void *vdata)
     /*               task->protocol_version); */
 
     transition_state (task, task->state, HTTP_TASK_RT_STATE_CHECK);
+    sync_phase_timer_switch (&task->timer, SYNC_PHASE_CHECK_HEAD);
 
     if (check_permission (task, conn) < 0) {
         seaf_warning ("Download permission denied for repo %.8s on server %s.\n",
@@ -4849,28 +8270,44 @@ http_download_thread (void *vdata)
         goto out;
 
     transition_state (task, task->state, HTTP_TASK_RT_STATE_FS);
+    sync_phase_timer_switch (&task->timer, SYNC_PHASE_FS_LIST);
+
+    /* All fs objects of this head were fetched by an interrupted download. */
+    if (transfer_journal_fs_fetched (priv->journal, task->repo_id, task->head))
+        goto fetch_blocks;
+
+    stream = fs_id_list_stream_start (task, conn);
+    if (!stream)
+        goto out;
+
+    /* The list is received while the objects are fetched, so the time
+     * spent on both is counted for fs objects.
+     */
+    sync_phase_timer_switch (&task->timer, SYNC_PHASE_FS_OBJECTS);
 
-    if (get_needed_fs_id_list (task, conn, &fs_id_list) < 0) {
+    fs_ret = get_fs_objects (task, stream);
+    if (fs_id_list_stream_finish (stream) < 0) {
         seaf_warning ("Failed to get fs id list for repo %.8s on server %s.\n",
                       task->repo_id, task->host);
         goto out;
     }
+    if (fs_ret < 0) {
+        seaf_warning ("Failed to get fs objects for repo %.8s on server %s.\n",
+                      task->repo_id, task->host);
+        goto out;
+    }
 
     if (task->state == HTTP_TASK_STATE_CANCELED)
         goto out;
 
-    while (fs_id_list != NULL) {
-        if (get_fs_objects (task, conn, &fs_id_list) < 0) {
-            seaf_warning ("Failed to get fs objects for repo %.8s on server %s.\n",
-                          task->repo_id, task->host);
-            goto out;
-        }
-
-        if (task->state == HTTP_TASK_STATE_CANCELED)
-            goto out;
-    }
+    transfer_journal_set_fs_fetched (priv->journal, task->repo_id, task->head);
 
+fetch_blocks:
     transition_state (task, task->state, HTTP_TASK_RT_STATE_BLOCK);
+    /* Checkout and index updates are split out by
+     * seaf_repo_fetch_and_checkout().
+     */
+    sync_phase_timer_switch (&task->timer, SYNC_PHASE_BLOCKS);
 
     /* Record download head commit id, so that we can resume download
      * if this download is interrupted.
@@ -4896,11 +8333,18 @@ http_download_thread (void *vdata)
         goto out;
     }
 
+    /* The downloaded blocks are referenced by the server head commit. */
+    server_block_cache_confirm (task->block_cache);
+
+    transfer_journal_remove (priv->journal, task->repo_id,
+                             TRANSFER_JOURNAL_DOWNLOAD);
+
     update_local_repo (task);
 
 out:
+    server_block_cache_save (task->block_cache);
     connection_pool_return_connection (pool, conn);
-    string_list_free (fs_id_list);
+    sync_phase_timer_switch (&task->timer, SYNC_PHASE_NONE);
     return vdata;
 }
 
@@ -4977,6 +8421,12 @@ http_tx_task_get_rate (HttpTxTask *task)
     return task->last_tx_bytes;
 }
 
+gboolean
+http_tx_task_is_canceled (gpointer task)
+{
+    return (((HttpTxTask *)task)->state == HTTP_TASK_STATE_CANCELED);
+}
+
 const char *
 http_task_state_to_str (int state)
 {
@@ -3,6 +3,8 @@
 
 #include <pthread.h>
 
+#include "sync-timing.h"
+
 enum {
     HTTP_TASK_TYPE_DOWNLOAD = 0,
     HTTP_TASK_TYPE_UPLOAD,
@@ -85,12 +87,26 @@ struct _HttpTxTask {
     /* For upload progress */
     int n_blocks;
     int done_blocks;
+    gint64 done_block_bytes;
     /* For download progress */
     gint64 total_download;
     gint64 done_download;
 
     gint tx_bytes;              /* bytes transferred in this second. */
     gint last_tx_bytes;         /* bytes transferred in the last second. */
+    /* Share of the upload or download limit. */
+    struct BandwidthFlow *flow;
+
+    /* Blocks known to be on the server. */
+    struct ServerBlockCache *block_cache;
+
+    /* Downloaded blocks are shared with other repos through the shared
+     * block cache. Never set for encrypted repos.
+     */
+    gboolean shared_blocks;
+
+    /* Time spent in each phase, only switched by the transfer thread. */
+    SyncPhaseTimer timer;
 };
 typedef struct _HttpTxTask HttpTxTask;
 
@@ -126,11 +142,55 @@ http_tx_manager_add_upload (HttpTxManager *manager,
                             gboolean use_fileserver_port,
                             GError **error);
 
+/*
+ * Send blocks of a commit that is still being created, so that its upload
+ * overlaps with indexing. Blocks added with
+ * http_tx_manager_pre_upload_blocks() are checked against the server and
+ * sent in the background. The upload of the commit skips those the server
+ * already has. If @send_all is TRUE, finish returns after the remaining
+ * blocks are sent, otherwise they're dropped.
+ *
+ * If @direct is set and the repo is not encrypted, blocks are read from
+ * the worktree as recorded in the content index, so they don't have to be
+ * written to the block store while indexing. Blocks added with a
+ * @direct_file are direct. Finish then copies the direct blocks the server
+ * didn't confirm into the block store. It returns -1 if some of them have
+ * changed in the worktree in the meantime, and adds their files to
+ * @changed_files.
+ */
+int
+http_tx_manager_pre_upload_start (HttpTxManager *manager,
+                                  const char *repo_id,
+                                  int repo_version,
+                                  const char *host,
+                                  const char *token,
+                                  gboolean use_fileserver_port,
+                                  gboolean direct);
+
+gboolean
+http_tx_manager_pre_upload_is_direct (HttpTxManager *manager,
+                                      const char *repo_id);
+
+void
+http_tx_manager_pre_upload_blocks (HttpTxManager *manager,
+                                   const char *repo_id,
+                                   const char *direct_file,
+                                   int n_blocks,
+                                   const unsigned char *blk_sha1s);
+
+int
+http_tx_manager_pre_upload_finish (HttpTxManager *manager,
+                                   const char *repo_id,
+                                   gboolean send_all,
+                                   GList **changed_files);
+
 struct _HttpProtocolVersion {
     gboolean check_success;     /* TRUE if we get response from the server. */
     gboolean not_supported;
     int version;
     int error_code;
+    /* The server supports http_tx_manager_get_head_commit_delta(). */
+    gboolean head_commits_delta;
 };
 typedef struct _HttpProtocolVersion HttpProtocolVersion;
 
@@ -147,6 +207,14 @@ http_tx_manager_check_protocol_version (HttpTxManager *manager,
                                         HttpProtocolVersionCallback callback,
                                         void *user_data);
 
+/* Open a connection to @host in the background unless an idle one is
+ * already pooled, so that the next sync doesn't wait for the handshakes.
+ */
+void
+http_tx_manager_warm_up_host (HttpTxManager *manager,
+                              const char *host,
+                              gboolean use_fileserver_port);
+
 
 typedef void (*HttpNotifServerCallback) (gboolean is_alive,
                                          void *user_data);
@@ -298,9 +366,82 @@ http_tx_manager_get_head_commit_ids (HttpTxManager *manager,
                                      GList *repo_id_list,
                                      int *ret_status);
 
+/* Get the head commits of the repos in @repo_id_list that changed since
+ * @since, a token returned by an earlier call, or of all of them if @since
+ * is NULL. Repos removed on the server map to an empty string. *ret_full is
+ * set if the server returned all heads anyway, e.g. because @since expired.
+ */
+GHashTable *
+http_tx_manager_get_head_commit_delta (HttpTxManager *manager,
+                                       const char *host,
+                                       gboolean use_fileserver_port,
+                                       GList *repo_id_list,
+                                       const char *since,
+                                       char **ret_token,
+                                       gboolean *ret_full,
+                                       int *ret_status);
+
 int
 http_tx_task_download_file_blocks (HttpTxTask *task, const char *file_id);
 
+/* Download the blocks of @file_id into the block store outside of a sync
+ * task, e.g. to hydrate an on-demand file. Blocks the calling thread.
+ */
+int
+http_tx_manager_download_file_blocks (HttpTxManager *manager,
+                                      const char *repo_id,
+                                      int repo_version,
+                                      const char *host,
+                                      const char *token,
+                                      gboolean use_fileserver_port,
+                                      int transfer_priority,
+                                      const char *file_id);
+
+/*
+ * Fetch the fs objects @fs_ids and blocks @block_ids of a repo from the
+ * server, replacing the local copies, e.g. ones found corrupt. The local
+ * blocks are removed first, so blocks the server doesn't have end up
+ * missing. Blocks the calling thread. Returns -1 if any of the objects
+ * couldn't be fetched.
+ */
+int
+http_tx_manager_refetch_objects (HttpTxManager *manager,
+                                 const char *repo_id,
+                                 int repo_version,
+                                 const char *host,
+                                 const char *token,
+                                 gboolean use_fileserver_port,
+                                 int transfer_priority,
+                                 GList *fs_ids,
+                                 GList *block_ids);
+
+struct SeafileCrypt;
+
+/* Download the blocks of @file_id and write the file content to @fd, without
+ * storing the blocks. Returns 1 without writing anything if the file should
+ * be downloaded with http_tx_task_download_file_blocks() instead, e.g.
+ * because some of its blocks are already in the store.
+ */
+int
+http_tx_task_stream_file_blocks (HttpTxTask *task, const char *file_id,
+                                 int fd, struct SeafileCrypt *crypt);
+
+/* Blocks up to this size are transferred in packs when the server supports
+ * it.
+ */
+#define HTTP_MAX_PACKED_BLOCK_SIZE (64 * 1024)
+#define HTTP_MAX_BLOCKS_PER_PACK 1000
+
+gboolean
+http_tx_task_can_pack_blocks (HttpTxTask *task);
+
+/* Fetch the missing blocks of @file_ids in packs. The blocks are only
+ * stored, http_tx_task_download_file_blocks() still has to be called for
+ * every file and then finds them in place.
+ */
+int
+http_tx_task_prefetch_file_blocks (HttpTxTask *task, GList *file_ids);
+
 GList*
 http_tx_manager_get_upload_tasks (HttpTxManager *manager);
 
@@ -318,6 +459,10 @@ http_tx_manager_cancel_task (HttpTxManager *manager,
 int
 http_tx_task_get_rate (HttpTxTask *task);
 
+/* Cancellation token of @task for executor task groups. */
+gboolean
+http_tx_task_is_canceled (gpointer task);
+
 const char *
 http_task_state_to_str (int state);
 
@@ -0,0 +1,808 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+#include <fcntl.h>
+
+#ifdef WIN32
+#include <windows.h>
+#include <io.h>
+#endif
+
+#include "seafile-session.h"
+#include "seafile-error.h"
+#include "hydration.h"
+#include "content-index.h"
+#include "vc-utils.h"
+#include "timer.h"
+#include "db.h"
+#include "utils.h"
+#include "log.h"
+
+/* Seconds between checks of the hydrated size against the budget. */
+#define BUDGET_CHECK_INTERVAL 600
+
+/* Files looked at per check while over the budget. */
+#define DEHYDRATE_BATCH 1000
+
+static sqlite3 *hydration_db;
+static pthread_mutex_t db_lock;
+static gboolean budget_check_running;
+static const SeafHydrationProvider *provider;
+
+void
+seaf_hydration_set_provider (const SeafHydrationProvider *new_provider)
+{
+    g_atomic_pointer_set (&provider, new_provider);
+}
+
+static const SeafHydrationProvider *
+get_provider ()
+{
+    return g_atomic_pointer_get (&provider);
+}
+
+gboolean
+seaf_hydration_has_provider ()
+{
+    return (get_provider () != NULL);
+}
+
+gboolean
+seaf_hydration_use_placeholder (const char *repo_id, gint64 size)
+{
+    SeafRepo *repo;
+
+    if (size <= HYDRATION_MIN_SIZE || !seaf_hydration_has_provider ())
+        return FALSE;
+
+    repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
+    return (repo && repo->on_demand);
+}
+
+static int
+set_sparse_size (int fd, gint64 size)
+{
+#ifdef WIN32
+    HANDLE handle = (HANDLE)_get_osfhandle (fd);
+    LARGE_INTEGER offset;
+    DWORD bytes;
+
+    /* Extending a sparse file doesn't allocate clusters. */
+    DeviceIoControl (handle, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &bytes, NULL);
+
+    offset.QuadPart = size;
+    if (!SetFilePointerEx (handle, offset, NULL, FILE_BEGIN) ||
+        !SetEndOfFile (handle))
+        return -1;
+    return 0;
+#else
+    return ftruncate (fd, (off_t)size);
+#endif
+}
+
+static void
+record_placeholder (const char *repo_id, const char *path)
+{
+    char *sql;
+
+    if (!hydration_db)
+        return;
+
+    sql = sqlite3_mprintf ("REPLACE INTO Placeholders VALUES (%Q, %Q)",
+                           repo_id, path);
+    pthread_mutex_lock (&db_lock);
+    sqlite_query_exec (hydration_db, sql);
+    pthread_mutex_unlock (&db_lock);
+    sqlite3_free (sql);
+}
+
+static void
+forget_placeholder (const char *repo_id, const char *path)
+{
+    char *sql;
+
+    if (!hydration_db)
+        return;
+
+    sql = sqlite3_mprintf ("DELETE FROM Placeholders "
+                           "WHERE repo_id = %Q AND path = %Q",
+                           repo_id, path);
+    pthread_mutex_lock (&db_lock);
+    sqlite_query_exec (hydration_db, sql);
+    pthread_mutex_unlock (&db_lock);
+    sqlite3_free (sql);
+}
+
+gboolean
+seaf_hydration_placeholder_created (const char *repo_id, const char *path)
+{
+    char *sql;
+    gboolean ret;
+
+    if (!hydration_db)
+        return FALSE;
+
+    sql = sqlite3_mprintf ("SELECT 1 FROM Placeholders "
+                           "WHERE repo_id = %Q AND path = %Q",
+                           repo_id, path);
+    pthread_mutex_lock (&db_lock);
+    ret = sqlite_check_for_existence (hydration_db, sql);
+    pthread_mutex_unlock (&db_lock);
+    sqlite3_free (sql);
+
+    return ret;
+}
+
+int
+seaf_hydration_create_placeholder (const char *repo_id, const char *path,
+                                   const char *full_path, guint32 mode,
+                                   gint64 size, gint64 mtime)
+{
+    const SeafHydrationProvider *p = get_provider ();
+    char *tmp_path = NULL;
+    int fd;
+    int ret = -1;
+
+    /* Applications would read zeros from a placeholder nothing hydrates. */
+    if (!p) {
+        seaf_warning ("No hydration provider to create placeholder %s.\n",
+                      full_path);
+        return -1;
+    }
+
+    fd = seaf_fs_manager_create_checkout_tmp_file (full_path, mode, &tmp_path);
+    if (fd < 0)
+        goto out;
+
+    if (set_sparse_size (fd, size) < 0) {
+        seaf_warning ("Failed to set size of placeholder %s.\n", tmp_path);
+        close (fd);
+        goto out;
+    }
+    close (fd);
+
+    if (seaf_set_file_time (tmp_path, mtime) < 0) {
+        seaf_warning ("Failed to set mtime of placeholder %s.\n", tmp_path);
+        goto out;
+    }
+
+    if (p->create_placeholder (repo_id, path, tmp_path) < 0) {
+        seaf_warning ("Failed to create placeholder %s.\n", tmp_path);
+        goto out;
+    }
+
+    /* Recorded first, so that the placeholder is never taken for a
+     * changed file.
+     */
+    record_placeholder (repo_id, path);
+
+    if (seaf_util_rename (tmp_path, full_path) < 0) {
+        seaf_warning ("Failed to rename %s to %s: %s.\n",
+                      tmp_path, full_path, strerror(errno));
+        goto out;
+    }
+
+    ret = 0;
+
+out:
+    if (ret < 0 && tmp_path)
+        seaf_util_unlink (tmp_path);
+    g_free (tmp_path);
+    return ret;
+}
+
+/* Placeholders created without a provider by earlier versions are plain
+ * sparse files. They're still recognized, so that they can be hydrated.
+ */
+static gboolean
+is_sparse_placeholder (const char *path, SeafStat *st)
+{
+#ifdef WIN32
+    wchar_t *wpath = win32_long_path (path);
+    DWORD attrs = GetFileAttributesW (wpath);
+    g_free (wpath);
+
+    return (attrs != INVALID_FILE_ATTRIBUTES &&
+            (attrs & FILE_ATTRIBUTE_OFFLINE) != 0);
+#else
+    /* Nothing has been written to it, so no blocks are allocated. */
+    return (st->st_blocks == 0);
+#endif
+}
+
+gboolean
+seaf_hydration_is_placeholder (const char *path, SeafStat *st)
+{
+    const SeafHydrationProvider *p = get_provider ();
+
+    if (!S_ISREG(st->st_mode) || st->st_size == 0)
+        return FALSE;
+
+    if (p && p->is_placeholder (path, st))
+        return TRUE;
+
+    return is_sparse_placeholder (path, st);
+}
+
+/* Like seaf_hydration_is_placeholder(), for an open file. The size and
+ * the allocation are read from the same file, even if the path is
+ * replaced meanwhile.
+ */
+static gboolean
+fd_is_placeholder (int fd, const char *path, gint64 size)
+{
+    const SeafHydrationProvider *p = get_provider ();
+    SeafStat st;
+
+    if (p) {
+        if (seaf_fstat (fd, &st) == 0 && S_ISREG(st.st_mode) &&
+            (gint64)st.st_size == size && p->is_placeholder (path, &st))
+            return TRUE;
+    }
+
+#ifdef WIN32
+    HANDLE handle = (HANDLE)_get_osfhandle (fd);
+    BY_HANDLE_FILE_INFORMATION info;
+
+    if (!GetFileInformationByHandle (handle, &info))
+        return FALSE;
+
+    return (((gint64)info.nFileSizeHigh << 32 | info.nFileSizeLow) == size &&
+            (info.dwFileAttributes & FILE_ATTRIBUTE_OFFLINE) != 0);
+#else
+    if (seaf_fstat (fd, &st) < 0)
+        return FALSE;
+
+    return (S_ISREG(st.st_mode) && st.st_size > 0 &&
+            (gint64)st.st_size == size && st.st_blocks == 0);
+#endif
+}
+
+static void
+placeholder_hydrated (const char *path)
+{
+    const SeafHydrationProvider *p = get_provider ();
+
+    if (p)
+        p->placeholder_hydrated (path);
+
+#ifdef WIN32
+    wchar_t *wpath = win32_long_path (path);
+    DWORD attrs = GetFileAttributesW (wpath);
+    if (attrs != INVALID_FILE_ATTRIBUTES && (attrs & FILE_ATTRIBUTE_OFFLINE))
+        SetFileAttributesW (wpath, attrs & ~FILE_ATTRIBUTE_OFFLINE);
+    g_free (wpath);
+#endif
+}
+
+static void
+record_hydrated (const char *repo_id, const char *path, gint64 size)
+{
+    char *sql;
+
+    if (!hydration_db)
+        return;
+
+    sql = sqlite3_mprintf ("REPLACE INTO HydratedFiles VALUES "
+                           "(%Q, %Q, %lld, %lld)",
+                           repo_id, path, (long long)size,
+                           (long long)time(NULL));
+    pthread_mutex_lock (&db_lock);
+    sqlite_query_exec (hydration_db, sql);
+    pthread_mutex_unlock (&db_lock);
+    sqlite3_free (sql);
+}
+
+static void
+forget_hydrated (const char *repo_id, const char *path)
+{
+    char *sql;
+
+    if (!hydration_db)
+        return;
+
+    sql = sqlite3_mprintf ("DELETE FROM HydratedFiles "
+                           "WHERE repo_id = %Q AND path = %Q",
+                           repo_id, path);
+    pthread_mutex_lock (&db_lock);
+    sqlite_query_exec (hydration_db, sql);
+    pthread_mutex_unlock (&db_lock);
+    sqlite3_free (sql);
+}
+
+/* The dirent of @path in the commit the worktree was last synced to. */
+static SeafDirent *
+get_synced_dirent (SeafRepo *repo, const char *path)
+{
+    SeafBranch *master;
+    SeafCommit *head;
+    SeafDirent *dent;
+
+    master = seaf_branch_manager_get_branch (seaf->branch_mgr,
+                                             repo->id, "master");
+    if (!master)
+        return NULL;
+
+    head = seaf_commit_manager_get_commit (seaf->commit_mgr,
+                                           repo->id, repo->version,
+                                           master->commit_id);
+    seaf_branch_unref (master);
+    if (!head)
+        return NULL;
+
+    dent = seaf_fs_manager_get_dirent_by_path (seaf->fs_mgr,
+                                               repo->id, repo->version,
+                                               head->root_id, path, NULL);
+    seaf_commit_unref (head);
+
+    return dent;
+}
+
+/* Placeholders have no content to change, only their mtime may have been
+ * touched.
+ */
+static gboolean
+dirent_matches_placeholder (SeafDirent *dent, const char *path, SeafStat *st)
+{
+    int fd;
+    gboolean ret;
+
+    if (!S_ISREG(dent->mode) || dent->size != (gint64)st->st_size)
+        return FALSE;
+    if (dent->mtime == (gint64)st->st_mtime)
+        return TRUE;
+
+    /* The file may have been written to since @st was taken. */
+    fd = seaf_util_open (path, O_RDONLY | O_BINARY);
+    if (fd < 0)
+        return FALSE;
+    ret = fd_is_placeholder (fd, path, dent->size);
+    close (fd);
+
+    return ret;
+}
+
+/* Hydrated files are only thrown away if their content is the one in the
+ * synced commit. Size and mtime alone don't show that.
+ */
+static gboolean
+dirent_matches_file (SeafRepo *repo, SeafDirent *dent,
+                     const char *path, SeafStat *st)
+{
+    SeafileCrypt *crypt = NULL;
+    unsigned char sha1[20];
+    gboolean ret;
+
+    if (!S_ISREG(dent->mode) || dent->size != (gint64)st->st_size)
+        return FALSE;
+
+    if (repo->encrypted)
+        crypt = seafile_crypt_new (repo->enc_version,
+                                   repo->enc_key, repo->enc_iv);
+
+    hex_to_rawdata (dent->id, sha1, 20);
+    ret = (compare_file_content (repo->id, path, st, sha1,
+                                 crypt, repo->version) == 0);
+
+    g_free (crypt);
+    return ret;
+}
+
+/* Finds the repo and the worktree file for @path. */
+static SeafRepo *
+lookup_file (const char *repo_id, const char *path,
+             char **full_path, SeafStat *st, GError **error)
+{
+    SeafRepo *repo;
+
+    repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
+    if (!repo || repo->delete_pending || !repo->worktree) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "No such repository");
+        return NULL;
+    }
+
+    *full_path = g_build_filename (repo->worktree, path, NULL);
+    if (seaf_stat (*full_path, st) < 0 || !S_ISREG(st->st_mode)) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "No such file");
+        g_free (*full_path);
+        *full_path = NULL;
+        return NULL;
+    }
+
+    return repo;
+}
+
+/* The dirent of the worktree file if it's the same as the synced file. */
+static SeafDirent *
+lookup_synced_file (SeafRepo *repo, const char *path,
+                    const char *full_path, SeafStat *st,
+                    gboolean is_placeholder, GError **error)
+{
+    SeafDirent *dent;
+    gboolean matches = FALSE;
+
+    dent = get_synced_dirent (repo, path);
+    if (dent) {
+        if (is_placeholder)
+            matches = dirent_matches_placeholder (dent, full_path, st);
+        else
+            matches = dirent_matches_file (repo, dent, full_path, st);
+    }
+    if (!dent || !matches) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                     "File is not synced");
+        seaf_dirent_free (dent);
+        return NULL;
+    }
+
+    return dent;
+}
+
+int
+seaf_hydration_hydrate (const char *repo_id, const char *path, GError **error)
+{
+    SeafRepo *repo;
+    char *full_path = NULL;
+    SeafStat st;
+    SeafDirent *dent = NULL;
+    SeafileCrypt *crypt = NULL;
+    gboolean locked, conflicted;
+    int rc, ret = -1;
+
+    repo = lookup_file (repo_id, path, &full_path, &st, error);
+    if (!repo)
+        return -1;
+
+    /* Only an access to record. */
+    if (!seaf_hydration_is_placeholder (full_path, &st)) {
+        forget_placeholder (repo_id, path);
+        record_hydrated (repo_id, path, st.st_size);
+        ret = 0;
+        goto out;
+    }
+
+    dent = lookup_synced_file (repo, path, full_path, &st, TRUE, error);
+    if (!dent)
+        goto out;
+
+    if (!repo->effective_host || !repo->token) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                     "Not connected to the server");
+        goto out;
+    }
+
+    if (repo->encrypted)
+        crypt = seafile_crypt_new (repo->enc_version,
+                                   repo->enc_key, repo->enc_iv);
+
+    seaf_content_index_fill_blocks (repo->id, repo->version, dent->id, crypt);
+
+    if (http_tx_manager_download_file_blocks (seaf->http_tx_mgr,
+                                              repo->id, repo->version,
+                                              repo->effective_host,
+                                              repo->token,
+                                              repo->use_fileserver_port,
+                                              repo->transfer_priority,
+                                              dent->id) < 0) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                     "Failed to download file");
+        goto out;
+    }
+
+    /* A sync or another hydration may have replaced the placeholder. */
+    if (seaf_stat (full_path, &st) < 0 ||
+        !seaf_hydration_is_placeholder (full_path, &st) ||
+        (gint64)st.st_size != dent->size) {
+        ret = 0;
+        goto out;
+    }
+
+    locked = seaf_filelock_manager_is_file_locked (seaf->filelock_mgr,
+                                                   repo->id, path);
+    if (locked)
+        seaf_filelock_manager_unlock_wt_file (seaf->filelock_mgr,
+                                              repo->id, path);
+
+    rc = seaf_fs_manager_checkout_file (seaf->fs_mgr,
+                                        repo->id, repo->version,
+                                        dent->id, full_path,
+                                        dent->mode, dent->mtime,
+                                        crypt, path,
+                                        NULL, FALSE, &conflicted,
+                                        repo->email);
+
+    if (locked)
+        seaf_filelock_manager_lock_wt_file (seaf->filelock_mgr,
+                                            repo->id, path);
+
+    if (rc < 0) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                     "Failed to write file");
+        goto out;
+    }
+
+    placeholder_hydrated (full_path);
+    forget_placeholder (repo_id, path);
+    record_hydrated (repo_id, path, dent->size);
+    ret = 0;
+
+out:
+    g_free (crypt);
+    seaf_dirent_free (dent);
+    g_free (full_path);
+    return ret;
+}
+
+int
+seaf_hydration_dehydrate (const char *repo_id, const char *path, GError **error)
+{
+    SeafRepo *repo;
+    char *full_path = NULL;
+    SeafStat st;
+    SeafDirent *dent = NULL;
+    gboolean locked;
+    int ret = -1;
+
+    repo = lookup_file (repo_id, path, &full_path, &st, error);
+    if (!repo)
+        return -1;
+
+    if (seaf_hydration_is_placeholder (full_path, &st)) {
+        ret = 0;
+        goto out;
+    }
+
+    if (!seaf_hydration_has_provider ()) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                     "No hydration provider");
+        goto out;
+    }
+
+    dent = lookup_synced_file (repo, path, full_path, &st, FALSE, error);
+    if (!dent)
+        goto out;
+
+    if (dent->size <= HYDRATION_MIN_SIZE) {
+        ret = 0;
+        goto out;
+    }
+
+    locked = seaf_filelock_manager_is_file_locked (seaf->filelock_mgr,
+                                                   repo->id, path);
+    if (locked)
+        seaf_filelock_manager_unlock_wt_file (seaf->filelock_mgr,
+                                              repo->id, path);
+
+    ret = seaf_hydration_create_placeholder (repo_id, path, full_path,
+                                             dent->mode, dent->size,
+                                             dent->mtime);
+
+    if (locked)
+        seaf_filelock_manager_lock_wt_file (seaf->filelock_mgr,
+                                            repo->id, path);
+
+    if (ret < 0)
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                     "Failed to create placeholder");
+
+out:
+    if (ret == 0)
+        forget_hydrated (repo_id, path);
+    seaf_dirent_free (dent);
+    g_free (full_path);
+    return ret;
+}
+
+typedef struct HydratedFile {
+    char repo_id[37];
+    char *path;
+    gint64 size;
+} HydratedFile;
+
+static gboolean
+collect_hydrated_file (sqlite3_stmt *stmt, void *data)
+{
+    GList **files = data;
+    HydratedFile *file = g_new0 (HydratedFile, 1);
+
+    g_strlcpy (file->repo_id,
+               (const char *)sqlite3_column_text (stmt, 0), 37);
+    file->path = g_strdup ((const char *)sqlite3_column_text (stmt, 1));
+    file->size = sqlite3_column_int64 (stmt, 2);
+    *files = g_list_prepend (*files, file);
+
+    return TRUE;
+}
+
+static void
+hydrated_file_free (HydratedFile *file)
+{
+    g_free (file->path);
+    g_free (file);
+}
+
+static void *
+enforce_budget (void *vdata)
+{
+    gint64 budget = (gint64)seaf->hydration_budget << 20;
+    gint64 total;
+    GList *files = NULL, *ptr;
+    HydratedFile *file;
+    char sql[256];
+
+    pthread_mutex_lock (&db_lock);
+    total = sqlite_get_int64 (hydration_db,
+                              "SELECT SUM(size) FROM HydratedFiles");
+    if (total > budget) {
+        snprintf (sql, sizeof(sql),
+                  "SELECT repo_id, path, size FROM HydratedFiles "
+                  "ORDER BY atime LIMIT %d", DEHYDRATE_BATCH);
+        sqlite_foreach_selected_row (hydration_db, sql,
+                                     collect_hydrated_file, &files);
+    }
+    pthread_mutex_unlock (&db_lock);
+
+    files = g_list_reverse (files);
+    for (ptr = files; ptr && total > budget; ptr = ptr->next) {
+        file = ptr->data;
+
+        /* Files that were changed or removed are forgotten too, they're
+         * recorded again when hydrated.
+         */
+        if (seaf_hydration_dehydrate (file->repo_id, file->path, NULL) < 0)
+            forget_hydrated (file->repo_id, file->path);
+        total -= file->size;
+    }
+
+    g_list_free_full (files, (GDestroyNotify)hydrated_file_free);
+    return vdata;
+}
+
+static void
+enforce_budget_done (void *vdata)
+{
+    budget_check_running = FALSE;
+}
+
+typedef struct HydrateRepoData {
+    char repo_id[37];
+    GList *paths;
+} HydrateRepoData;
+
+static gboolean
+collect_placeholder (sqlite3_stmt *stmt, void *data)
+{
+    GList **paths = data;
+
+    *paths = g_list_prepend (*paths,
+                             g_strdup ((const char *)sqlite3_column_text (stmt, 0)));
+    return TRUE;
+}
+
+static void *
+hydrate_repo_thread (void *vdata)
+{
+    HydrateRepoData *data = vdata;
+    GList *ptr;
+    GError *error = NULL;
+
+    for (ptr = data->paths; ptr; ptr = ptr->next) {
+        if (seaf_hydration_hydrate (data->repo_id, ptr->data, &error) == 0)
+            continue;
+
+        /* Removed files and repos are forgotten. Other placeholders are
+         * still recorded, and left alone by the worktree scan.
+         */
+        if (error->code == SEAF_ERR_BAD_ARGS)
+            forget_placeholder (data->repo_id, ptr->data);
+        else
+            seaf_warning ("Failed to hydrate %s in repo %.8s: %s.\n",
+                          (char *)ptr->data, data->repo_id, error->message);
+        g_clear_error (&error);
+    }
+
+    return vdata;
+}
+
+static void
+hydrate_repo_done (void *vdata)
+{
+    HydrateRepoData *data = vdata;
+
+    string_list_free (data->paths);
+    g_free (data);
+}
+
+int
+seaf_hydration_hydrate_repo (const char *repo_id)
+{
+    HydrateRepoData *data;
+    char *sql;
+
+    if (!hydration_db)
+        return 0;
+
+    data = g_new0 (HydrateRepoData, 1);
+    memcpy (data->repo_id, repo_id, 36);
+
+    sql = sqlite3_mprintf ("SELECT path FROM Placeholders WHERE repo_id = %Q",
+                           repo_id);
+    pthread_mutex_lock (&db_lock);
+    sqlite_foreach_selected_row (hydration_db, sql,
+                                 collect_placeholder, &data->paths);
+    pthread_mutex_unlock (&db_lock);
+    sqlite3_free (sql);
+
+    if (!data->paths) {
+        g_free (data);
+        return 0;
+    }
+
+    if (seaf_job_manager_schedule_job (seaf->job_mgr,
+                                       hydrate_repo_thread,
+                                       hydrate_repo_done,
+                                       data) < 0) {
+        seaf_warning ("Failed to start hydrating repo %.8s.\n", repo_id);
+        hydrate_repo_done (data);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+check_budget (void *vdata)
+{
+    if (budget_check_running)
+        return TRUE;
+
+    budget_check_running = TRUE;
+    if (seaf_job_manager_schedule_job (seaf->job_mgr,
+                                       enforce_budget,
+                                       enforce_budget_done,
+                                       NULL) < 0)
+        budget_check_running = FALSE;
+
+    return TRUE;
+}
+
+int
+seaf_hydration_start ()
+{
+    char *db_path;
+    sqlite3 *db;
+    const char *sql;
+
+    pthread_mutex_init (&db_lock, NULL);
+
+    db_path = g_build_filename (seaf->seaf_dir, "hydration.db", NULL);
+    if (sqlite_open_db (db_path, &db) < 0) {
+        g_free (db_path);
+        return -1;
+    }
+    g_free (db_path);
+
+    sql = "CREATE TABLE IF NOT EXISTS HydratedFiles ("
+        "repo_id TEXT, path TEXT, size INTEGER, atime INTEGER, "
+        "PRIMARY KEY (repo_id, path));";
+    sqlite_query_exec (db, sql);
+
+    sql = "CREATE INDEX IF NOT EXISTS hydrated_files_atime_idx "
+        "ON HydratedFiles (atime);";
+    sqlite_query_exec (db, sql);
+
+    sql = "CREATE TABLE IF NOT EXISTS Placeholders ("
+        "repo_id TEXT, path TEXT, PRIMARY KEY (repo_id, path));";
+    sqlite_query_exec (db, sql);
+
+    hydration_db = db;
+
+    if (seaf->hydration_budget > 0)
+        seaf_timer_new (check_budget, NULL, BUDGET_CHECK_INTERVAL * 1000);
+
+    return 0;
+}
@@ -0,0 +1,98 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef HYDRATION_H
+#define HYDRATION_H
+
+#include <glib.h>
+
+#include "utils.h"
+
+/*
+ * On-demand files.
+ *
+ * In repos with the "on-demand" property set to "true", checkouts create
+ * placeholders instead of downloading files. A placeholder is hydrated,
+ * i.e. its content downloaded, with seafile_hydrate_file.
+ *
+ * The daemon doesn't intercept opens itself. Placeholders are only created
+ * while a platform provider (Cloud Files API on Windows, File Provider on
+ * macOS, a FUSE layer on Linux) is registered. The provider turns the
+ * sparse file written by the daemon into a platform placeholder, and
+ * hydrates it before it's opened. Without a provider, "on-demand" can't
+ * be turned on and files are always downloaded.
+ *
+ * Only mtime and size are compared when scanning the worktree, so
+ * placeholders look like the files in the index. Placeholders are also
+ * recorded in hydration.db, and a recorded placeholder that was touched is
+ * never committed, even after "on-demand" is turned off. Turning it off
+ * hydrates the placeholders of the repo in the background.
+ *
+ * Hydrated files are dehydrated back to placeholders, least recently used
+ * first, once their total size exceeds hydration_budget MB. Files are only
+ * dehydrated if their content is the same as in the last synced commit.
+ */
+
+typedef struct SeafHydrationProvider {
+    /* Turns the file at @full_path into a placeholder that is hydrated
+     * before it's opened. @path is the path in @repo_id it will be renamed
+     * to.
+     */
+    int (*create_placeholder) (const char *repo_id, const char *path,
+                               const char *full_path);
+    /* Whether the file at @full_path with @st is a placeholder. */
+    gboolean (*is_placeholder) (const char *full_path, SeafStat *st);
+    /* Called after the content of the placeholder at @full_path was
+     * written.
+     */
+    void (*placeholder_hydrated) (const char *full_path);
+} SeafHydrationProvider;
+
+/* Files up to this size are always downloaded. */
+#define HYDRATION_MIN_SIZE (1 << 20)
+
+int
+seaf_hydration_start ();
+
+/* Registers the platform provider, or removes it if @provider is NULL. */
+void
+seaf_hydration_set_provider (const SeafHydrationProvider *provider);
+
+gboolean
+seaf_hydration_has_provider ();
+
+/* Whether a file of @size in @repo_id is checked out as a placeholder. */
+gboolean
+seaf_hydration_use_placeholder (const char *repo_id, gint64 size);
+
+/* Creates a placeholder for @path in @repo_id at @full_path, replacing the
+ * file that's there.
+ */
+int
+seaf_hydration_create_placeholder (const char *repo_id, const char *path,
+                                   const char *full_path, guint32 mode,
+                                   gint64 size, gint64 mtime);
+
+/* Whether a placeholder was created for @path and not hydrated since. */
+gboolean
+seaf_hydration_placeholder_created (const char *repo_id, const char *path);
+
+/* Whether the worktree file @path with @st is a placeholder. */
+gboolean
+seaf_hydration_is_placeholder (const char *path, SeafStat *st);
+
+/*
+ * Downloads the content of the placeholder at @path in @repo_id. Records an
+ * access if the file is already hydrated. Blocks until the file is written.
+ */
+int
+seaf_hydration_hydrate (const char *repo_id, const char *path, GError **error);
+
+/* Turns the hydrated file at @path back into a placeholder. */
+int
+seaf_hydration_dehydrate (const char *repo_id, const char *path, GError **error);
+
+/* Hydrates all placeholders of @repo_id in the background. */
+int
+seaf_hydration_hydrate_repo (const char *repo_id);
+
+#endif
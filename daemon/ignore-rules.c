@@ -0,0 +1,327 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+#include <glib/gstdio.h>
+
+#include "ignore-rules.h"
+#include "utils.h"
+#include "log.h"
+
+#define IGNORE_FILE "seafile-ignore.txt"
+
+struct IgnoreRules {
+    gint ref;
+
+    /* Identity of the ignore file the rules were read from. */
+    gint64 mtime;
+    gint64 size;
+    guint64 ino;
+
+    /* Rules are matched against the path after "<worktree>/". */
+    char *prefix;
+    int prefix_len;
+
+    gboolean match_all;
+    GHashTable *literals;
+    /* Rules "prefix*" and "*suffix", with the distinct lengths of the
+     * prefixes and suffixes in ascending order.
+     */
+    GHashTable *prefixes;
+    GArray *prefix_lens;
+    GHashTable *suffixes;
+    GArray *suffix_lens;
+    /* All other rules. If the worktree path has glob characters itself,
+     * these are all rules and they're matched against the full path.
+     */
+    GPtrArray *globs;
+    gboolean full_path_globs;
+};
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+/* worktree -> IgnoreRules */
+static GHashTable *cache;
+
+static gboolean
+has_glob_chars (const char *str, int len)
+{
+    int i;
+
+    for (i = 0; i < len; ++i) {
+        if (str[i] == '*' || str[i] == '?')
+            return TRUE;
+    }
+    return FALSE;
+}
+
+static void
+add_len (GArray *lens, int len)
+{
+    int i;
+
+    for (i = 0; i < lens->len; ++i) {
+        if (g_array_index (lens, int, i) == len)
+            return;
+        if (g_array_index (lens, int, i) > len)
+            break;
+    }
+    g_array_insert_val (lens, i, len);
+}
+
+static void
+add_rule (IgnoreRules *rules, const char *rule)
+{
+    int len = strlen (rule);
+    int start = 0, end = len;
+    char *pattern;
+
+    if (rules->full_path_globs) {
+        pattern = g_strconcat (rules->prefix, rule, NULL);
+        g_ptr_array_add (rules->globs, g_pattern_spec_new (pattern));
+        g_free (pattern);
+        return;
+    }
+
+    while (start < len && rule[start] == '*')
+        ++start;
+    if (start == len) {
+        rules->match_all = TRUE;
+        return;
+    }
+    while (end > start && rule[end - 1] == '*')
+        --end;
+
+    if (!has_glob_chars (rule + start, end - start)) {
+        if (start == 0 && end == len) {
+            g_hash_table_add (rules->literals, g_strdup (rule));
+            return;
+        }
+        if (start > 0 && end == len) {
+            g_hash_table_add (rules->suffixes, g_strdup (rule + start));
+            add_len (rules->suffix_lens, len - start);
+            return;
+        }
+        if (start == 0) {
+            g_hash_table_add (rules->prefixes, g_strndup (rule, end));
+            add_len (rules->prefix_lens, end);
+            return;
+        }
+    }
+
+    g_ptr_array_add (rules->globs, g_pattern_spec_new (rule));
+}
+
+static IgnoreRules *
+ignore_rules_new (const char *worktree)
+{
+    IgnoreRules *rules = g_new0 (IgnoreRules, 1);
+
+    rules->ref = 1;
+    rules->prefix = g_strconcat (worktree, "/", NULL);
+    rules->prefix_len = strlen (rules->prefix);
+    rules->literals = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                             g_free, NULL);
+    rules->prefixes = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                             g_free, NULL);
+    rules->prefix_lens = g_array_new (FALSE, FALSE, sizeof(int));
+    rules->suffixes = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                             g_free, NULL);
+    rules->suffix_lens = g_array_new (FALSE, FALSE, sizeof(int));
+    rules->globs = g_ptr_array_new_with_free_func ((GDestroyNotify)g_pattern_spec_free);
+    rules->full_path_globs = has_glob_chars (rules->prefix, rules->prefix_len);
+
+    return rules;
+}
+
+void
+ignore_rules_unref (IgnoreRules *rules)
+{
+    if (!rules || !g_atomic_int_dec_and_test (&rules->ref))
+        return;
+
+    g_free (rules->prefix);
+    g_hash_table_destroy (rules->literals);
+    g_hash_table_destroy (rules->prefixes);
+    g_array_free (rules->prefix_lens, TRUE);
+    g_hash_table_destroy (rules->suffixes);
+    g_array_free (rules->suffix_lens, TRUE);
+    g_ptr_array_free (rules->globs, TRUE);
+    g_free (rules);
+}
+
+static IgnoreRules *
+parse_ignore_file (const char *worktree, const char *path, SeafStat *st)
+{
+    IgnoreRules *rules;
+    FILE *fp;
+    char line[SEAF_PATH_MAX];
+    char *rule;
+
+    fp = g_fopen (path, "r");
+    if (fp == NULL)
+        return NULL;
+
+    rules = ignore_rules_new (worktree);
+    rules->mtime = (gint64)st->st_mtime;
+    rules->size = (gint64)st->st_size;
+    rules->ino = (guint64)st->st_ino;
+
+    while (fgets (line, SEAF_PATH_MAX, fp) != NULL) {
+        /* remove leading and trailing whitespace, including \n \r. */
+        g_strstrip (line);
+
+        /* ignore comment and blank line */
+        if (line[0] == '#' || line[0] == '\0')
+            continue;
+
+        /* Change 'foo/' to 'foo/ *'. */
+        if (line[strlen(line)-1] == '/') {
+            rule = g_strconcat (line, "*", NULL);
+            add_rule (rules, rule);
+            g_free (rule);
+        } else {
+            add_rule (rules, line);
+        }
+    }
+
+    fclose (fp);
+    return rules;
+}
+
+IgnoreRules *
+ignore_rules_load (const char *worktree)
+{
+    IgnoreRules *rules;
+    SeafStat st;
+    char *path;
+
+    path = g_build_path ("/", worktree, IGNORE_FILE, NULL);
+    if (seaf_stat (path, &st) < 0 || !S_ISREG(st.st_mode)) {
+        pthread_mutex_lock (&cache_lock);
+        if (cache)
+            g_hash_table_remove (cache, worktree);
+        pthread_mutex_unlock (&cache_lock);
+        g_free (path);
+        return NULL;
+    }
+
+    pthread_mutex_lock (&cache_lock);
+    if (!cache)
+        cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                       (GDestroyNotify)ignore_rules_unref);
+    rules = g_hash_table_lookup (cache, worktree);
+    if (rules && rules->mtime == (gint64)st.st_mtime &&
+        rules->size == (gint64)st.st_size && rules->ino == (guint64)st.st_ino) {
+        g_atomic_int_inc (&rules->ref);
+        pthread_mutex_unlock (&cache_lock);
+        g_free (path);
+        return rules;
+    }
+    pthread_mutex_unlock (&cache_lock);
+
+    rules = parse_ignore_file (worktree, path, &st);
+    g_free (path);
+    if (!rules)
+        return NULL;
+
+    pthread_mutex_lock (&cache_lock);
+    g_atomic_int_inc (&rules->ref);
+    g_hash_table_replace (cache, g_strdup (worktree), rules);
+    pthread_mutex_unlock (&cache_lock);
+
+    return rules;
+}
+
+static gboolean
+match_prefixes (IgnoreRules *rules, char *rel, int rel_len)
+{
+    gboolean found = FALSE;
+    int i, len;
+    char c;
+
+    for (i = 0; i < rules->prefix_lens->len && !found; ++i) {
+        len = g_array_index (rules->prefix_lens, int, i);
+        if (len > rel_len)
+            break;
+        c = rel[len];
+        rel[len] = '\0';
+        found = g_hash_table_contains (rules->prefixes, rel);
+        rel[len] = c;
+    }
+
+    return found;
+}
+
+static gboolean
+match_suffixes (IgnoreRules *rules, const char *rel, int rel_len)
+{
+    int i, len;
+
+    for (i = 0; i < rules->suffix_lens->len; ++i) {
+        len = g_array_index (rules->suffix_lens, int, i);
+        if (len > rel_len)
+            break;
+        if (g_hash_table_contains (rules->suffixes, rel + rel_len - len))
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+static gboolean
+match_globs (IgnoreRules *rules, const char *str)
+{
+    int i;
+
+    for (i = 0; i < rules->globs->len; ++i) {
+        if (g_pattern_match_string (g_ptr_array_index (rules->globs, i), str))
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+gboolean
+ignore_rules_match (IgnoreRules *rules, const char *fullpath, gboolean is_dir)
+{
+    char stack_buf[SEAF_PATH_MAX];
+    char *buf, *rel;
+    int len, rel_len;
+    gboolean ret = FALSE;
+
+    if (!rules)
+        return FALSE;
+
+    /* Dirs are matched with a trailing slash, so that "foo/" rules match
+     * the dir itself.
+     */
+    len = strlen (fullpath);
+    buf = (len + 2 <= sizeof(stack_buf)) ? stack_buf : g_malloc (len + 2);
+    memcpy (buf, fullpath, len);
+    if (is_dir)
+        buf[len++] = '/';
+    buf[len] = '\0';
+
+    if (rules->full_path_globs) {
+        ret = match_globs (rules, buf);
+        goto out;
+    }
+
+    if (len < rules->prefix_len ||
+        memcmp (buf, rules->prefix, rules->prefix_len) != 0)
+        goto out;
+    rel = buf + rules->prefix_len;
+    rel_len = len - rules->prefix_len;
+
+    ret = (rules->match_all ||
+           g_hash_table_contains (rules->literals, rel) ||
+           match_suffixes (rules, rel, rel_len) ||
+           match_prefixes (rules, rel, rel_len) ||
+           match_globs (rules, rel));
+
+out:
+    if (buf != stack_buf)
+        g_free (buf);
+    return ret;
+}
@@ -0,0 +1,34 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef IGNORE_RULES_H
+#define IGNORE_RULES_H
+
+#include <glib.h>
+
+/*
+ * Rules of the seafile-ignore.txt file in a worktree.
+ *
+ * Each line is a glob pattern relative to the worktree, "foo/" ignores
+ * the dir foo with all its content. Rules are compiled once: plain paths,
+ * "*suffix" and "prefix*" rules are looked up in hash tables, only other
+ * patterns are matched one by one.
+ */
+
+typedef struct IgnoreRules IgnoreRules;
+
+/*
+ * Returns the rules of @worktree, or NULL if it has no ignore file. The
+ * compiled rules are shared until the file changes. Release them with
+ * ignore_rules_unref().
+ */
+IgnoreRules *
+ignore_rules_load (const char *worktree);
+
+void
+ignore_rules_unref (IgnoreRules *rules);
+
+/* @fullpath is a path in the worktree of @rules. NULL rules match nothing. */
+gboolean
+ignore_rules_match (IgnoreRules *rules, const char *fullpath, gboolean is_dir);
+
+#endif
@@ -0,0 +1,346 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#include "seafile-session.h"
+#include "index-cache.h"
+#include "timer.h"
+#include "utils.h"
+#include "log.h"
+
+/* Cached indexes of repos not committed for this long are dropped. */
+#define INDEX_CACHE_IDLE_SECONDS 900
+#define INDEX_CACHE_CHECK_INTERVAL 60 /* seconds */
+
+/* Rough per entry overhead of the name hashes. */
+#define NAME_HASH_ENTRY_SIZE 48
+
+/* What's on disk when the cached copy was made. */
+typedef struct IndexFileId {
+    gint64 mtime;
+    gint64 size;
+    guint64 ino;
+    gint64 delta_size;          /* -1 if there's no delta log */
+} IndexFileId;
+
+typedef struct CachedIndex {
+    /* Held from load to release. */
+    pthread_mutex_t lock;
+
+    /* The rest is protected by cache_lock. */
+    gboolean cached;
+    struct index_state istate;
+    IndexFileId file_id;
+    gint64 size;
+    gint64 last_used;
+} CachedIndex;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+/* repo_id -> CachedIndex. Entries are never freed, a waiting loader may
+ * still refer to them; only the index in them is dropped.
+ */
+static GHashTable *indexes;
+static gint64 limit;
+static gint64 total_size;
+
+static void
+get_index_path (const char *repo_id, char *path)
+{
+    snprintf (path, SEAF_PATH_MAX, "%s/%s", seaf->repo_mgr->index_dir, repo_id);
+}
+
+static int
+get_file_id (const char *index_path, IndexFileId *id)
+{
+    SeafStat st;
+    char *delta;
+
+    if (seaf_stat (index_path, &st) < 0)
+        return -1;
+    id->mtime = (gint64)st.st_mtime;
+    id->size = (gint64)st.st_size;
+    id->ino = (guint64)st.st_ino;
+
+    delta = g_strconcat (index_path, ".delta", NULL);
+    if (seaf_stat (delta, &st) < 0)
+        id->delta_size = -1;
+    else
+        id->delta_size = (gint64)st.st_size;
+    g_free (delta);
+
+    return 0;
+}
+
+static gint64
+estimate_size (struct index_state *istate)
+{
+    gint64 size = (gint64)istate->cache_alloc * sizeof(struct cache_entry *);
+    unsigned int i;
+
+    for (i = 0; i < istate->cache_nr; ++i)
+        size += ce_size (istate->cache[i]) + NAME_HASH_ENTRY_SIZE;
+
+    return size;
+}
+
+/* Called with cache_lock held. */
+static CachedIndex *
+get_entry (const char *repo_id)
+{
+    CachedIndex *entry;
+
+    if (!indexes)
+        indexes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+    entry = g_hash_table_lookup (indexes, repo_id);
+    if (!entry) {
+        entry = g_new0 (CachedIndex, 1);
+        pthread_mutex_init (&entry->lock, NULL);
+        g_hash_table_insert (indexes, g_strdup (repo_id), entry);
+    }
+
+    return entry;
+}
+
+/* Called with cache_lock held. Moves the cached index out of @entry. */
+static void
+take_cached (CachedIndex *entry, struct index_state *istate)
+{
+    memcpy (istate, &entry->istate, sizeof(*istate));
+    memset (&entry->istate, 0, sizeof(entry->istate));
+    entry->cached = FALSE;
+    total_size -= entry->size;
+    entry->size = 0;
+}
+
+/*
+ * Called with cache_lock held. Moves the indexes to drop to @victims:
+ * idle ones and the least recently used ones beyond the limit. Indexes in
+ * use by other threads are skipped.
+ */
+static void
+collect_victims (GList **victims, gboolean idle_only)
+{
+    GHashTableIter iter;
+    gpointer value;
+    CachedIndex *entry, *oldest;
+    struct index_state *istate;
+    gint64 now = (gint64)time(NULL);
+
+    g_hash_table_iter_init (&iter, indexes);
+    while (g_hash_table_iter_next (&iter, NULL, &value)) {
+        entry = value;
+        if (!entry->cached ||
+            (limit > 0 && now - entry->last_used < INDEX_CACHE_IDLE_SECONDS))
+            continue;
+        if (pthread_mutex_trylock (&entry->lock) != 0)
+            continue;
+        istate = g_new0 (struct index_state, 1);
+        take_cached (entry, istate);
+        *victims = g_list_prepend (*victims, istate);
+        pthread_mutex_unlock (&entry->lock);
+    }
+
+    if (idle_only)
+        return;
+
+    while (total_size > limit) {
+        oldest = NULL;
+        g_hash_table_iter_init (&iter, indexes);
+        while (g_hash_table_iter_next (&iter, NULL, &value)) {
+            entry = value;
+            if (entry->cached &&
+                (!oldest || entry->last_used < oldest->last_used))
+                oldest = entry;
+        }
+        if (!oldest || pthread_mutex_trylock (&oldest->lock) != 0)
+            break;
+        istate = g_new0 (struct index_state, 1);
+        take_cached (oldest, istate);
+        *victims = g_list_prepend (*victims, istate);
+        pthread_mutex_unlock (&oldest->lock);
+    }
+}
+
+/* Frees the dropped indexes outside of cache_lock. */
+static void
+free_victims (GList *victims)
+{
+    GList *ptr;
+    struct index_state *istate;
+
+    for (ptr = victims; ptr; ptr = ptr->next) {
+        istate = ptr->data;
+        discard_index (istate);
+        g_free (istate);
+    }
+    g_list_free (victims);
+}
+
+static int
+check_idle_indexes (void *vdata)
+{
+    GList *victims = NULL;
+
+    pthread_mutex_lock (&cache_lock);
+    if (indexes)
+        collect_victims (&victims, TRUE);
+    pthread_mutex_unlock (&cache_lock);
+
+    free_victims (victims);
+
+    return TRUE;
+}
+
+int
+seaf_index_cache_start ()
+{
+    seaf_timer_new (check_idle_indexes, NULL,
+                    INDEX_CACHE_CHECK_INTERVAL * 1000);
+    return 0;
+}
+
+void
+seaf_index_cache_set_limit (gint64 bytes)
+{
+    GList *victims = NULL;
+
+    pthread_mutex_lock (&cache_lock);
+    limit = MAX (bytes, 0);
+    if (indexes)
+        collect_victims (&victims, FALSE);
+    pthread_mutex_unlock (&cache_lock);
+
+    free_victims (victims);
+}
+
+static int
+load_index (const char *repo_id, int repo_version,
+            struct index_state *istate, gboolean wait)
+{
+    char index_path[SEAF_PATH_MAX];
+    CachedIndex *entry;
+    IndexFileId file_id;
+    gboolean cached, hit = FALSE;
+
+    get_index_path (repo_id, index_path);
+
+    pthread_mutex_lock (&cache_lock);
+    entry = get_entry (repo_id);
+    pthread_mutex_unlock (&cache_lock);
+
+    if (wait)
+        pthread_mutex_lock (&entry->lock);
+    else if (pthread_mutex_trylock (&entry->lock) != 0)
+        return 1;
+
+    pthread_mutex_lock (&cache_lock);
+    cached = entry->cached;
+    if (cached) {
+        /* Drop the copy if someone else changed the index on disk. */
+        hit = (get_file_id (index_path, &file_id) == 0 &&
+               memcmp (&file_id, &entry->file_id, sizeof(file_id)) == 0);
+        take_cached (entry, istate);
+    }
+    pthread_mutex_unlock (&cache_lock);
+
+    if (hit)
+        return 0;
+
+    if (cached) {
+        discard_index (istate);
+        memset (istate, 0, sizeof(*istate));
+    }
+    if (read_index_from (istate, index_path, repo_version) < 0) {
+        pthread_mutex_unlock (&entry->lock);
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+seaf_index_cache_load (const char *repo_id, int repo_version,
+                       struct index_state *istate)
+{
+    return load_index (repo_id, repo_version, istate, TRUE);
+}
+
+int
+seaf_index_cache_try_load (const char *repo_id, int repo_version,
+                           struct index_state *istate)
+{
+    return load_index (repo_id, repo_version, istate, FALSE);
+}
+
+void
+seaf_index_cache_release (const char *repo_id, struct index_state *istate)
+{
+    char index_path[SEAF_PATH_MAX];
+    CachedIndex *entry;
+    IndexFileId file_id;
+    gint64 size = 0;
+    gboolean keep;
+    GList *victims = NULL;
+
+    get_index_path (repo_id, index_path);
+
+    /* cache_changed is cleared by update_index(), so an unchanged index
+     * is the same as on disk.
+     */
+    keep = (limit > 0 && !istate->cache_changed && !istate->delta_broken &&
+            !istate->batching && istate->pending_nr == 0 &&
+            get_file_id (index_path, &file_id) == 0);
+    if (keep) {
+        size = estimate_size (istate);
+        keep = (size <= limit);
+    }
+
+    pthread_mutex_lock (&cache_lock);
+    entry = get_entry (repo_id);
+    if (keep) {
+        memcpy (&entry->istate, istate, sizeof(*istate));
+        memset (istate, 0, sizeof(*istate));
+        entry->cached = TRUE;
+        entry->file_id = file_id;
+        entry->size = size;
+        entry->last_used = (gint64)time(NULL);
+        total_size += size;
+    }
+    pthread_mutex_unlock (&entry->lock);
+
+    if (keep)
+        collect_victims (&victims, FALSE);
+    pthread_mutex_unlock (&cache_lock);
+
+    if (!keep)
+        discard_index (istate);
+    free_victims (victims);
+}
+
+void
+seaf_index_cache_remove_repo (const char *repo_id)
+{
+    CachedIndex *entry;
+    struct index_state istate;
+
+    pthread_mutex_lock (&cache_lock);
+    entry = indexes ? g_hash_table_lookup (indexes, repo_id) : NULL;
+    pthread_mutex_unlock (&cache_lock);
+    if (!entry)
+        return;
+
+    memset (&istate, 0, sizeof(istate));
+
+    pthread_mutex_lock (&entry->lock);
+    pthread_mutex_lock (&cache_lock);
+    if (entry->cached)
+        take_cached (entry, &istate);
+    pthread_mutex_unlock (&cache_lock);
+    pthread_mutex_unlock (&entry->lock);
+
+    if (istate.initialized)
+        discard_index (&istate);
+}
@@ -0,0 +1,56 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef INDEX_CACHE_H
+#define INDEX_CACHE_H
+
+#include <glib.h>
+
+#include "index/index.h"
+
+/*
+ * In-memory copies of repo indexes between commits and checkouts.
+ *
+ * An index released after it was written to disk stays in memory, so the
+ * next commit of the repo doesn't parse it again. The copy is only used
+ * while the index file and its delta log are unchanged on disk. Indexes of
+ * repos that weren't committed for a while are dropped, as are the least
+ * recently used ones beyond index_cache_size MB.
+ *
+ * Loading an index also locks it until it's released, so commits,
+ * checkouts and locked file updates of a repo are serialized.
+ */
+
+int
+seaf_index_cache_start ();
+
+/* 0 disables the cache, loaded indexes are always read from disk. */
+void
+seaf_index_cache_set_limit (gint64 bytes);
+
+/*
+ * Loads the index of @repo_id into @istate, which must be zeroed. Blocks
+ * while the index is loaded by another thread. On failure the index is
+ * not locked and @istate needn't be released.
+ */
+int
+seaf_index_cache_load (const char *repo_id, int repo_version,
+                       struct index_state *istate);
+
+/* Like seaf_index_cache_load(), but returns 1 instead of blocking if the
+ * index is loaded by another thread.
+ */
+int
+seaf_index_cache_try_load (const char *repo_id, int repo_version,
+                           struct index_state *istate);
+
+/*
+ * Unlocks the index and clears @istate. The index is kept in memory if it
+ * has no changes since it was loaded or last written with update_index().
+ */
+void
+seaf_index_cache_release (const char *repo_id, struct index_state *istate);
+
+void
+seaf_index_cache_remove_repo (const char *repo_id);
+
+#endif
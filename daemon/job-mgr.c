@@ -10,6 +10,7 @@
 #endif
 
 #include <glib.h>
+#include <pthread.h>
 
 #include <string.h>
 #include <stdlib.h>
@@ -22,17 +23,39 @@
 #include "seafile-session.h"
 #include "job-mgr.h"
 
+typedef struct JobClass {
+    /* Lower runs first. */
+    int             priority;
+    /* Max number of running jobs, 0 for no limit. */
+    int             max_running;
+    int             n_running;
+    GQueue         *waiting;
+} JobClass;
+
+struct _SeafJob;
+
 struct _SeafJobManager {
     SeafileSession  *session;
     GThreadPool     *thread_pool;
     int              next_job_id;
+
+    JobClass         classes[N_SEAF_JOB_CLASSES];
+    pthread_mutex_t  classes_lock;
+
+    /* Finished jobs, pushed by the worker threads without locking and
+     * taken all at once by the main loop. One byte is written to the pipe
+     * whenever the list goes from empty to non-empty.
+     */
+    struct _SeafJob *finished;
+    seaf_pipe_t      pipefd[2];
+    struct event    *done_event;
 };
 
 struct _SeafJob {
     SeafJobManager *manager;
 
     int             id;
-    seaf_pipe_t    pipefd[2];
+    int             job_class;
 
     JobThreadFunc   thread_func;
     JobDoneCallback done_func;  /* called when the thread is done */
@@ -40,6 +63,8 @@ struct _SeafJob {
 
     /* the done callback should only access this field */
     void           *result;
+
+    struct _SeafJob *next;
 };
 typedef struct _SeafJob SeafJob;
 
@@ -58,50 +83,110 @@ seaf_job_free (SeafJob *job)
     g_free (job);
 }
 
+static void
+push_finished_job (SeafJobManager *mgr, SeafJob *job)
+{
+    SeafJob *head;
+
+    do {
+        head = g_atomic_pointer_get (&mgr->finished);
+        job->next = head;
+    } while (!g_atomic_pointer_compare_and_exchange ((gpointer *)&mgr->finished,
+                                                     head, job));
+
+    if (!head && seaf_pipe_writen (mgr->pipefd[1], "a", 1) != 1) {
+        seaf_warning ("[Job Manager] write to pipe error: %s\n", strerror(errno));
+    }
+}
+
+static SeafJob *
+take_finished_jobs (SeafJobManager *mgr)
+{
+    SeafJob *head, *job, *next, *list = NULL;
+
+    do {
+        head = g_atomic_pointer_get (&mgr->finished);
+    } while (!g_atomic_pointer_compare_and_exchange ((gpointer *)&mgr->finished,
+                                                     head, NULL));
+
+    /* Reverse into the order the jobs finished in. */
+    for (job = head; job; job = next) {
+        next = job->next;
+        job->next = list;
+        list = job;
+    }
+
+    return list;
+}
+
+/* Called with classes_lock held. */
+static void
+start_job (SeafJobManager *mgr, SeafJob *job)
+{
+    ++(mgr->classes[job->job_class].n_running);
+    g_thread_pool_push (mgr->thread_pool, job, NULL);
+}
+
 static void
 job_thread_wrapper (void *vdata, void *unused)
 {
     SeafJob *job = vdata;
-   
+    SeafJobManager *mgr = job->manager;
+    JobClass *cls = &mgr->classes[job->job_class];
+    SeafJob *next;
+
     job->result = job->thread_func (job->data);
-    if (seaf_pipe_writen (job->pipefd[1], "a", 1) != 1) {
-        seaf_warning ("[Job Manager] write to pipe error: %s\n", strerror(errno));
-    }
+
+    pthread_mutex_lock (&mgr->classes_lock);
+    --(cls->n_running);
+    next = g_queue_pop_head (cls->waiting);
+    if (next)
+        start_job (mgr, next);
+    pthread_mutex_unlock (&mgr->classes_lock);
+
+    push_finished_job (mgr, job);
 }
 
 static void
 job_done_cb (evutil_socket_t fd, short event, void *vdata)
 {
-    SeafJob *job = vdata;
+    SeafJobManager *mgr = vdata;
+    SeafJob *job, *next;
     char buf[1];
 
-    if (seaf_pipe_readn (job->pipefd[0], buf, 1) != 1) {
+    if (seaf_pipe_readn (mgr->pipefd[0], buf, 1) != 1) {
         seaf_warning ("[Job Manager] read pipe error: %s\n", strerror(errno));
     }
-    seaf_pipe_close (job->pipefd[0]);
-    seaf_pipe_close (job->pipefd[1]);
-    if (job->done_func) {
-        job->done_func (job->result);
-    }
 
-    seaf_job_free (job);
+    for (job = take_finished_jobs (mgr); job; job = next) {
+        next = job->next;
+        if (job->done_func) {
+            job->done_func (job->result);
+        }
+        seaf_job_free (job);
+    }
 }
 
-int
-job_thread_create (SeafJob *job)
+static gint
+compare_jobs (gconstpointer a, gconstpointer b, gpointer vmgr)
 {
-    SeafileSession *session = job->manager->session;
+    const SeafJob *job_a = a, *job_b = b;
+    SeafJobManager *mgr = vmgr;
+    int prio_a = mgr->classes[job_a->job_class].priority;
+    int prio_b = mgr->classes[job_b->job_class].priority;
 
-    if (seaf_pipe (job->pipefd) < 0) {
-        seaf_warning ("[Job Manager] pipe error: %s\n", strerror(errno));
-        return -1;
-    }
-
-    g_thread_pool_push (job->manager->thread_pool, job, NULL);
-
-    event_base_once (session->ev_base, job->pipefd[0], EV_READ, job_done_cb, job, NULL);
+    if (prio_a != prio_b)
+        return prio_a - prio_b;
+    return job_a->id - job_b->id;
+}
 
-    return 0;
+static void
+init_job_class (SeafJobManager *mgr, int job_class,
+                int priority, int max_running)
+{
+    mgr->classes[job_class].priority = priority;
+    mgr->classes[job_class].max_running = max_running;
+    mgr->classes[job_class].waiting = g_queue_new ();
 }
 
 SeafJobManager *
@@ -116,6 +201,24 @@ seaf_job_manager_new (SeafileSession *session, int max_threads)
                                           max_threads,
                                           FALSE,
                                           NULL);
+    g_thread_pool_set_sort_function (mgr->thread_pool, compare_jobs, mgr);
+
+    pthread_mutex_init (&mgr->classes_lock, NULL);
+    init_job_class (mgr, SEAF_JOB_COMMIT, 0, 0);
+    init_job_class (mgr, SEAF_JOB_DEFAULT, 1, 0);
+    init_job_class (mgr, SEAF_JOB_TRANSFER, 2, MAX (max_threads / 2, 1));
+    init_job_class (mgr, SEAF_JOB_API, 3, MAX (max_threads / 4, 1));
+
+    if (seaf_pipe (mgr->pipefd) < 0) {
+        seaf_warning ("[Job Manager] pipe error: %s\n", strerror(errno));
+        g_thread_pool_free (mgr->thread_pool, TRUE, FALSE);
+        g_free (mgr);
+        return NULL;
+    }
+
+    mgr->done_event = event_new (session->ev_base, mgr->pipefd[0],
+                                 EV_READ | EV_PERSIST, job_done_cb, mgr);
+    event_add (mgr->done_event, NULL);
 
     return mgr;
 }
@@ -123,27 +226,56 @@ seaf_job_manager_new (SeafileSession *session, int max_threads)
 void
 seaf_job_manager_free (SeafJobManager *mgr)
 {
+    int i;
+
     g_thread_pool_free (mgr->thread_pool, TRUE, FALSE);
+    event_free (mgr->done_event);
+    seaf_pipe_close (mgr->pipefd[0]);
+    seaf_pipe_close (mgr->pipefd[1]);
+    for (i = 0; i < N_SEAF_JOB_CLASSES; ++i)
+        g_queue_free (mgr->classes[i].waiting);
     g_free (mgr);
 }
 
 int
-seaf_job_manager_schedule_job (SeafJobManager *mgr,
-                               JobThreadFunc func,
-                               JobDoneCallback done_func,
-                               void *data)
+seaf_job_manager_schedule_class_job (SeafJobManager *mgr,
+                                     int job_class,
+                                     JobThreadFunc func,
+                                     JobDoneCallback done_func,
+                                     void *data)
 {
-    SeafJob *job = seaf_job_new ();
-    job->id = mgr->next_job_id++;
+    SeafJob *job;
+    JobClass *cls;
+
+    if (job_class < 0 || job_class >= N_SEAF_JOB_CLASSES)
+        job_class = SEAF_JOB_DEFAULT;
+
+    job = seaf_job_new ();
     job->manager = mgr;
+    job->job_class = job_class;
     job->thread_func = func;
     job->done_func = done_func;
     job->data = data;
-    
-    if (job_thread_create (job) < 0) {
-        seaf_job_free (job);
-        return -1;
-    }
+
+    cls = &mgr->classes[job_class];
+
+    pthread_mutex_lock (&mgr->classes_lock);
+    job->id = mgr->next_job_id++;
+    if (cls->max_running > 0 && cls->n_running >= cls->max_running)
+        g_queue_push_tail (cls->waiting, job);
+    else
+        start_job (mgr, job);
+    pthread_mutex_unlock (&mgr->classes_lock);
 
     return 0;
 }
+
+int
+seaf_job_manager_schedule_job (SeafJobManager *mgr,
+                               JobThreadFunc func,
+                               JobDoneCallback done_func,
+                               void *data)
+{
+    return seaf_job_manager_schedule_class_job (mgr, SEAF_JOB_DEFAULT,
+                                                func, done_func, data);
+}
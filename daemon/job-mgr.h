@@ -21,6 +21,18 @@ struct _SeafileSession;
 typedef void* (*JobThreadFunc)(void *data);
 typedef void (*JobDoneCallback)(void *result);
 
+/* Jobs of a class are run in priority order, and some classes have a cap
+ * on how many of their jobs run at the same time, so that a burst of API
+ * requests can't hold up commits.
+ */
+enum {
+    SEAF_JOB_DEFAULT = 0,
+    SEAF_JOB_COMMIT,            /* Highest priority. */
+    SEAF_JOB_TRANSFER,          /* Uploads, downloads and checkouts. */
+    SEAF_JOB_API,               /* Short requests to the server. */
+    N_SEAF_JOB_CLASSES,
+};
+
 SeafJobManager *
 seaf_job_manager_new (struct _SeafileSession *session, int max_threads);
 
@@ -33,4 +45,11 @@ seaf_job_manager_schedule_job (struct _SeafJobManager *mgr,
                                JobDoneCallback done_func,
                                void *data);
 
+int
+seaf_job_manager_schedule_class_job (struct _SeafJobManager *mgr,
+                                     int job_class,
+                                     JobThreadFunc func,
+                                     JobDoneCallback done_func,
+                                     void *data);
+
 #endif
@@ -12,24 +12,40 @@
 #define DEBUG_FLAG SEAFILE_DEBUG_NOTIFICATION
 #include "log.h"
 
+#include "timer.h"
+
 #define NOTIF_PORT 8083
 
-#define RECONNECT_INTERVAL 60 /* 60s */
+/* Repo updates received within this window are passed to the sync manager
+ * together, one per repo.
+ */
+#define BATCH_WINDOW 500 /* 500ms */
+#define RATE_INTERVAL 60 /* 60s */
+
+/* Reconnect delays double from the min to the max, randomized so that
+ * clients don't all come back at once after a server restart.
+ */
+#define RECONNECT_INTERVAL_MIN 5   /* 5s */
+#define RECONNECT_INTERVAL_MAX 300 /* 5min */
+
+/* One internal fd of the context plus one per server, with some spare. */
+#define NOTIF_FD_LIMIT 64
 
 #define STATUS_DISCONNECTED 0
 #define STATUS_CONNECTED    1
 #define STATUS_ERROR        2
-#define STATUS_CANCELLED    3
+#define STATUS_CONNECTING   3
 
 typedef struct NotifServer {
-    struct lws_context *context;
     struct lws_client_connect_info i;
     struct lws		*wsi;
 
     // status of the notification server.
     int      status;
-    // whether to close the connection to the server.
-    gboolean close;
+
+    /* Only used by the service thread. */
+    lws_sorted_usec_list_t reconnect_sul;
+    int      n_retries;
 
     GHashTable *subscriptions;
     pthread_mutex_t sub_lock;
@@ -41,12 +57,36 @@ typedef struct NotifServer {
     char    *path;
     int     port;
 
+    /* Message counters, only updated by the worker thread. */
+    gint64  n_messages;
+    gint64  n_repo_updates;
+    gint64  n_coalesced;
+    gint64  rate_start;
+    int     rate_messages;
+
     gint    refcnt;
 } NotifServer;
 
 struct _SeafNotifManagerPriv {
     pthread_mutex_t server_lock;
     GHashTable *servers;
+
+    /* All servers share one context served by one thread, both created
+     * with the first server.
+     */
+    struct lws_context *context;
+    pthread_t service_tid;
+
+    /* repo_id -> newest commit id of the repo updates in the current
+     * batch, protected by pending_lock.
+     */
+    pthread_mutex_t pending_lock;
+    GHashTable *pending_updates;
+    gboolean flush_requested;
+    uint32_t flush_event_id;
+
+    /* Only used on the main loop. */
+    SeafTimer *flush_timer;
 };
 
 // The Message structure is used to send messages to the server.
@@ -86,6 +126,9 @@ notif_message_free (Message *msg)
     g_free (msg);
 }
 
+static void
+on_flush_requested (CEvent *event, void *vmgr);
+
 SeafNotifManager *
 seaf_notif_manager_new (SeafileSession *seaf)
 {
@@ -97,6 +140,13 @@ seaf_notif_manager_new (SeafileSession *seaf)
     mgr->priv->servers = g_hash_table_new_full (g_str_hash, g_str_equal,
                                                 g_free, NULL);
 
+    pthread_mutex_init (&mgr->priv->pending_lock, NULL);
+    mgr->priv->pending_updates = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                        g_free, g_free);
+    mgr->priv->flush_event_id = cevent_manager_register (seaf->ev_mgr,
+                                                         on_flush_requested,
+                                                         mgr);
+
     return mgr;
 }
 
@@ -158,13 +208,12 @@ static void
 notif_server_ref (NotifServer *server);
 
 static struct lws_context *
-lws_context_new (int port);
+lws_context_new ();
 
 static NotifServer*
 notif_new_server (const char *server_url, gboolean use_notif_server_port)
 {
     NotifServer *server = NULL;
-    static struct lws_context *context;
     URI *uri = NULL;
     int port = NOTIF_PORT;
     gboolean use_ssl = FALSE;
@@ -184,22 +233,11 @@ notif_new_server (const char *server_url, gboolean use_notif_server_port)
     if (strncmp(server_url, "https", 5) == 0) {
         use_ssl = TRUE;
     }
-    
-
-    context = lws_context_new (use_ssl);
-    if (!context) {
-        g_free (uri->scheme);
-        g_free (uri->host);
-        g_free (uri);
-        seaf_warning ("failed to create libwebsockets context\n");
-        return NULL;
-    }
 
     server = g_new0 (NotifServer, 1);
 
     server->messages = g_async_queue_new ();
 
-    server->context = context;
     server->server_url = g_strdup (server_url);
     server->addr = g_strdup (uri->host);
     server->use_ssl = use_ssl;
@@ -248,8 +286,6 @@ notif_server_free (NotifServer *server)
 {
     if (!server)
         return;
-    if (server->context)
-        lws_context_destroy(server->context);
     g_free (server->server_url);
     g_free (server->addr);
     g_free (server->path);
@@ -281,7 +317,33 @@ static void
 init_client_connect_info (NotifServer *server);
 
 static void *
-notification_worker (void *vdata);
+notification_service (void *vmgr);
+
+/* Called with server_lock held. */
+static int
+start_service (SeafNotifManager *mgr)
+{
+    int rc;
+
+    if (mgr->priv->context)
+        return 0;
+
+    mgr->priv->context = lws_context_new ();
+    if (!mgr->priv->context)
+        return -1;
+
+    rc = pthread_create (&mgr->priv->service_tid, NULL,
+                         notification_service, mgr);
+    if (rc != 0) {
+        seaf_warning ("Failed to create event notification thread: %s.\n",
+                      strerror(rc));
+        lws_context_destroy (mgr->priv->context);
+        mgr->priv->context = NULL;
+        return -1;
+    }
+
+    return 0;
+}
 
 // This function will check whether the notification server has been created,
 // if not, it will create a new one, otherwise it will return directly.
@@ -289,8 +351,6 @@ notification_worker (void *vdata);
 void
 seaf_notif_manager_connect_server (SeafNotifManager *mgr, const char *host, gboolean use_notif_server_port)
 {
-    pthread_t tid;
-    int rc;
     NotifServer *existing_server = NULL;
     NotifServer *server = NULL;
 
@@ -306,36 +366,28 @@ seaf_notif_manager_connect_server (SeafNotifManager *mgr, const char *host, gboo
         return;
     }
 
-    init_client_connect_info (server);
-
-    rc = pthread_create (&tid, NULL, notification_worker, server);
-    if (rc != 0) {
-        seaf_warning ("Failed to create event notification new thread: %s.\n", strerror(rc));
+    pthread_mutex_lock (&mgr->priv->server_lock);
+    if (start_service (mgr) < 0) {
+        pthread_mutex_unlock (&mgr->priv->server_lock);
         notif_server_unref (server);
         return;
     }
-
-    pthread_mutex_lock (&mgr->priv->server_lock);
+    init_client_connect_info (server);
     g_hash_table_insert (mgr->priv->servers, g_strdup (host), server);
     pthread_mutex_unlock (&mgr->priv->server_lock);
 
-    return;
-}
+    /* The service thread connects it. */
+    lws_cancel_service (mgr->priv->context);
 
-static void
-disconnect_server (NotifServer *server)
-{
-    // lws_cancel_service will produce a cancel event to break out of lws_service loop.
-    lws_cancel_service (server->context);
-    server->close = TRUE;
+    return;
 }
 
-// This policy will send a ping packet to the server per second.
-// If we don't receive pong messages within 5 seconds, it is considered that the connection is unavailable.
-// We will exit the event loop, and reconnect to the notification server.
+// This policy will send a ping packet to the server after 30 seconds without
+// traffic. If we don't receive any message within 45 seconds, it is considered
+// that the connection is unavailable and we reconnect to the notification server.
 static const lws_retry_bo_t ping_policy = {
-	.secs_since_valid_ping		= 1,
-	.secs_since_valid_hangup	= 5,
+	.secs_since_valid_ping		= 30,
+	.secs_since_valid_hangup	= 45,
 };
 
 static void
@@ -344,7 +396,7 @@ init_client_connect_info (NotifServer *server)
     struct lws_client_connect_info *i = &server->i;
     memset(i, 0, sizeof(server->i));
 
-    i->context = server->context;
+    i->context = seaf->notif_mgr->priv->context;
     i->port = server->port;
     i->address = server->addr;
     i->path = server->path;
@@ -361,7 +413,13 @@ init_client_connect_info (NotifServer *server)
 }
 
 static void
-handle_messages (const char *msg, size_t len);
+handle_messages (NotifServer *server, const char *msg, size_t len);
+
+static void
+schedule_reconnect (NotifServer *server);
+
+static void
+service_servers ();
 
 // success:0
 static int
@@ -372,6 +430,13 @@ event_callback (struct lws *wsi, enum lws_callback_reasons reason,
     Message *msg = NULL;
     int m;
     int ret = 0;
+
+    /* Woken up for new servers or messages, not bound to a connection. */
+    if (reason == LWS_CALLBACK_EVENT_WAIT_CANCELLED) {
+        service_servers ();
+        return 0;
+    }
+
     if (!server) {
         return ret;
     }
@@ -380,13 +445,13 @@ event_callback (struct lws *wsi, enum lws_callback_reasons reason,
 
     switch (reason) {
     case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
-        server->status = STATUS_ERROR;
         seaf_debug ("websocket connection error: %s\n",
             in ? (char *)in : "(null)");
+        schedule_reconnect (server);
         ret = -1;
         break;
     case LWS_CALLBACK_CLIENT_RECEIVE:
-        handle_messages (in, len);
+        handle_messages (server, in, len);
         break;
     case LWS_CALLBACK_CLIENT_WRITEABLE:
         msg = g_async_queue_try_pop (server->messages);
@@ -400,24 +465,23 @@ event_callback (struct lws *wsi, enum lws_callback_reasons reason,
         if (m < (int)msg->len) {
             notif_message_free (msg);
             seaf_warning ("Failed to write message to websocket\n");
-            server->status = STATUS_ERROR;
+            /* Reconnected when the connection is closed. */
             return -1;
         }
 
         notif_message_free (msg);
+        if (g_async_queue_length (server->messages) > 0)
+            lws_callback_on_writable (wsi);
         break;
     case LWS_CALLBACK_CLIENT_ESTABLISHED:
+        server->n_retries = 0;
         seaf_sync_manager_check_locks_and_folder_perms (seaf->sync_mgr, server->server_url);
         server->status = STATUS_CONNECTED;
         seaf_debug ("Successfully connected to the server: %s\n", server->server_url);
         break;
     case LWS_CALLBACK_CLIENT_CLOSED:
         ret = -1;
-        server->status = STATUS_ERROR;
-        break;
-    case LWS_CALLBACK_EVENT_WAIT_CANCELLED:
-        ret = -1;
-        server->status = STATUS_CANCELLED;
+        schedule_reconnect (server);
         break;
     default:
         break;
@@ -427,7 +491,75 @@ event_callback (struct lws *wsi, enum lws_callback_reasons reason,
 }
 
 static int
-handle_repo_update (json_t *content)
+flush_pending_updates (void *vmgr)
+{
+    SeafNotifManager *mgr = vmgr;
+    GHashTable *updates;
+    GHashTableIter iter;
+    gpointer key, value;
+    SeafRepo *repo;
+
+    /* The timer frees itself since we return 0. */
+    mgr->priv->flush_timer = NULL;
+
+    pthread_mutex_lock (&mgr->priv->pending_lock);
+    updates = mgr->priv->pending_updates;
+    mgr->priv->pending_updates = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                        g_free, g_free);
+    mgr->priv->flush_requested = FALSE;
+    pthread_mutex_unlock (&mgr->priv->pending_lock);
+
+    g_hash_table_iter_init (&iter, updates);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        repo = seaf_repo_manager_get_repo (seaf->repo_mgr, key);
+        if (!repo || !seaf_notif_manager_is_repo_subscribed (mgr, repo))
+            continue;
+        seaf_sync_manager_update_repo (seaf->sync_mgr, repo, value);
+    }
+
+    g_hash_table_destroy (updates);
+
+    return 0;
+}
+
+static void
+on_flush_requested (CEvent *event, void *vmgr)
+{
+    SeafNotifManager *mgr = vmgr;
+
+    if (!mgr->priv->flush_timer)
+        mgr->priv->flush_timer = seaf_timer_new (flush_pending_updates, mgr,
+                                                 BATCH_WINDOW);
+}
+
+/* Returns FALSE if an older update of the same repo was still pending. */
+static gboolean
+queue_repo_update (const char *repo_id, const char *commit_id)
+{
+    SeafNotifManagerPriv *priv = seaf->notif_mgr->priv;
+    gboolean replaced, notify = FALSE;
+
+    pthread_mutex_lock (&priv->pending_lock);
+
+    replaced = (g_hash_table_lookup (priv->pending_updates, repo_id) != NULL);
+    g_hash_table_replace (priv->pending_updates,
+                          g_strdup (repo_id), g_strdup (commit_id));
+
+    if (!priv->flush_requested) {
+        priv->flush_requested = TRUE;
+        notify = TRUE;
+    }
+
+    pthread_mutex_unlock (&priv->pending_lock);
+
+    if (notify)
+        cevent_manager_add_event (seaf->ev_mgr, priv->flush_event_id, NULL);
+
+    return !replaced;
+}
+
+static int
+handle_repo_update (NotifServer *server, json_t *content)
 {
     json_t *member;
     const char *repo_id;
@@ -461,7 +593,9 @@ handle_repo_update (json_t *content)
         return -1;
     }
 
-    seaf_sync_manager_update_repo (seaf->sync_mgr, repo, commit_id);
+    ++(server->n_repo_updates);
+    if (!queue_repo_update (repo->id, commit_id))
+        ++(server->n_coalesced);
 
     return 0;
 }
@@ -670,7 +804,29 @@ out:
 }
 
 static void
-handle_messages (const char *msg, size_t len)
+count_message (NotifServer *server)
+{
+    gint64 now = (gint64)time(NULL);
+
+    ++(server->n_messages);
+    ++(server->rate_messages);
+
+    if (server->rate_start == 0) {
+        server->rate_start = now;
+    } else if (now - server->rate_start >= RATE_INTERVAL) {
+        seaf_debug ("Notification server %s: %d messages in the last %d seconds, "
+                    "%"G_GINT64_FORMAT" repo updates received, "
+                    "%"G_GINT64_FORMAT" coalesced.\n",
+                    server->server_url, server->rate_messages,
+                    (int)(now - server->rate_start),
+                    server->n_repo_updates, server->n_coalesced);
+        server->rate_start = now;
+        server->rate_messages = 0;
+    }
+}
+
+static void
+handle_messages (NotifServer *server, const char *msg, size_t len)
 {
     json_t *object, *content, *member;
     json_error_t jerror;
@@ -678,6 +834,8 @@ handle_messages (const char *msg, size_t len)
 
     seaf_debug ("Receive repo notification: %s\n", msg);
 
+    count_message (server);
+
     object = json_loadb (msg, len, 0, &jerror);
     if (!object) {
         seaf_warning ("Failed to parse notification: %s.\n", jerror.text);
@@ -699,7 +857,7 @@ handle_messages (const char *msg, size_t len)
     }
 
     if (g_strcmp0 (type, "repo-update") == 0) {
-        if (handle_repo_update (content) < 0) {
+        if (handle_repo_update (server, content) < 0) {
             goto out;
         }
     } else if (g_strcmp0 (type, "file-lock-changed") == 0) {
@@ -727,7 +885,7 @@ static const struct lws_protocols protocols[] = {
 };
 
 static struct lws_context *
-lws_context_new (gboolean use_ssl)
+lws_context_new ()
 {
     struct lws_context_creation_info info;
     struct lws_context *context = NULL;
@@ -735,16 +893,14 @@ lws_context_new (gboolean use_ssl)
     memset(&info, 0, sizeof info);
     info.port = CONTEXT_PORT_NO_LISTEN;
     info.protocols = protocols;
-    // Since we know this lws context is only ever going to be used with
-    // one client wsis / fds / sockets at a time, let lws know it doesn't
-    // have to use the default allocations for fd tables up to ulimit -n.
-    // It will just allocate for 1 internal and 1 (+ 1 http2 nwsi) that we will use.
-    info.fd_limit_per_thread = 1 + 1 + 1;
+    // Since we know this lws context is only used by the notification
+    // client connections, let lws know it doesn't have to use the default
+    // allocations for fd tables up to ulimit -n.
+    info.fd_limit_per_thread = NOTIF_FD_LIMIT;
+    // Servers with and without SSL share the context.
     char *ca_path = g_build_filename (seaf->seaf_dir, "ca-bundle.pem", NULL);
-    if (use_ssl) {
-         info.options = LWS_SERVER_OPTION_DO_SSL_GLOBAL_INIT;
-         info.client_ssl_ca_filepath = ca_path;
-    }
+    info.options = LWS_SERVER_OPTION_DO_SSL_GLOBAL_INIT;
+    info.client_ssl_ca_filepath = ca_path;
 
     context = lws_create_context(&info);
     if (!context) {
@@ -793,54 +949,101 @@ delete_unsent_messages (NotifServer *server)
     return;
 }
 
-static void *
-notification_worker (void *vdata)
+/* Returns the reconnect delay in milliseconds, between half of and the full
+ * backoff interval.
+ */
+static gint64
+get_reconnect_delay (int n_retries)
 {
-    NotifServer *server = (NotifServer *)vdata;
+    gint64 interval = RECONNECT_INTERVAL_MAX;
 
-    if (!server) {
-        return 0;
-    }
+    if (n_retries < 10)
+        interval = MIN (RECONNECT_INTERVAL_MIN << n_retries, RECONNECT_INTERVAL_MAX);
+    interval *= 1000;
 
-    struct lws_client_connect_info *i = &server->i;
-    int n = 0;
+    return interval / 2 + g_random_int_range (0, (gint32)(interval / 2) + 1);
+}
+
+static void
+on_reconnect (lws_sorted_usec_list_t *sul)
+{
+    NotifServer *server = lws_container_of (sul, NotifServer, reconnect_sul);
 
-    while (!server->close) {
-        // We don't need to check the return value of this function, the connection will be processed in the event loop.
-        lws_client_connect_via_info(i);
+    server->status = STATUS_DISCONNECTED;
+    service_servers ();
+}
 
-        while (n >= 0 && !server->close &&
-               server->status != STATUS_ERROR &&
-               server->status != STATUS_CANCELLED) {
-            n = lws_service(server->context, 0);
-        }
+static void
+schedule_reconnect (NotifServer *server)
+{
+    gint64 delay;
 
-        delete_subscribed_repos (server);
-        delete_unsent_messages (server);
+    /* Both connection error and closed may be reported for one attempt. */
+    if (server->status == STATUS_ERROR)
+        return;
 
-        if (server->status == STATUS_CANCELLED)
-            break;
+    server->status = STATUS_ERROR;
+    server->wsi = NULL;
+    delete_subscribed_repos (server);
+    delete_unsent_messages (server);
 
-        // Wait a minute to reconnect to the notification server.
-        g_usleep (RECONNECT_INTERVAL * G_USEC_PER_SEC);
-        n = 0;
-        server->status = STATUS_DISCONNECTED;
+    delay = get_reconnect_delay (server->n_retries++);
+    seaf_debug ("Reconnect to notification server %s in %"G_GINT64_FORMAT" ms.\n",
+                server->server_url, delay);
+    lws_sul_schedule (seaf->notif_mgr->priv->context, 0, &server->reconnect_sul,
+                      on_reconnect, delay * LWS_US_PER_MS);
+}
 
-        lws_context_destroy(server->context);
-        server->context = NULL;
-        server->context = lws_context_new (server->use_ssl);
-        if (!server->context)
-            break;
-        i->context = server->context;
+/* Called in the service thread to connect new servers and send queued
+ * messages.
+ */
+static void
+service_servers ()
+{
+    SeafNotifManagerPriv *priv = seaf->notif_mgr->priv;
+    GHashTableIter iter;
+    gpointer value;
+    GList *servers = NULL, *ptr;
+    NotifServer *server;
+
+    pthread_mutex_lock (&priv->server_lock);
+    g_hash_table_iter_init (&iter, priv->servers);
+    while (g_hash_table_iter_next (&iter, NULL, &value)) {
+        server = value;
+        notif_server_ref (server);
+        servers = g_list_prepend (servers, server);
+    }
+    pthread_mutex_unlock (&priv->server_lock);
+
+    /* lws may call back into us before returning, so don't hold the lock. */
+    for (ptr = servers; ptr; ptr = ptr->next) {
+        server = ptr->data;
+        if (server->status == STATUS_DISCONNECTED) {
+            server->status = STATUS_CONNECTING;
+            // Errors are reported by the callback, but not always.
+            if (!lws_client_connect_via_info (&server->i) &&
+                server->status == STATUS_CONNECTING)
+                schedule_reconnect (server);
+        } else if (server->status == STATUS_CONNECTED && server->wsi &&
+                   g_async_queue_length (server->messages) > 0) {
+            lws_callback_on_writable (server->wsi);
+        }
+        notif_server_unref (server);
     }
+    g_list_free (servers);
+}
 
-    seaf_message ("Notification worker for server %s exiting.\n", server->server_url);
-    pthread_mutex_lock (&seaf->notif_mgr->priv->server_lock);
-    g_hash_table_remove (seaf->notif_mgr->priv->servers, server->server_url);
-    pthread_mutex_unlock (&seaf->notif_mgr->priv->server_lock);
-    notif_server_unref (server);
+static void *
+notification_service (void *vmgr)
+{
+    SeafNotifManager *mgr = vmgr;
 
-    return 0;
+    /* lws sleeps until the next socket event or scheduled reconnect. */
+    while (lws_service (mgr->priv->context, 0) >= 0)
+        ;
+
+    seaf_warning ("Notification service exiting.\n");
+    return NULL;
 }
 
 void
@@ -883,6 +1086,7 @@ seaf_notif_manager_subscribe_repo (SeafNotifManager *mgr, SeafRepo *repo)
         goto out;
 
     g_async_queue_push (server->messages, msg);
+    lws_cancel_service (mgr->priv->context);
 
     sub_id = g_strdup (repo_id);
 
@@ -937,6 +1141,7 @@ seaf_notif_manager_unsubscribe_repo (SeafNotifManager *mgr, SeafRepo *repo)
         goto out;
 
     g_async_queue_push (server->messages, msg);
+    lws_cancel_service (mgr->priv->context);
 
     pthread_mutex_lock (&server->sub_lock);
     g_hash_table_remove (server->subscriptions, repo_id);
@@ -952,17 +1157,26 @@ out:
 
 gboolean
 seaf_notif_manager_is_repo_subscribed (SeafNotifManager *mgr, SeafRepo *repo)
+{
+    return seaf_notif_manager_is_repo_id_subscribed (mgr, repo->server_url,
+                                                     repo->id);
+}
+
+gboolean
+seaf_notif_manager_is_repo_id_subscribed (SeafNotifManager *mgr,
+                                          const char *server_url,
+                                          const char *repo_id)
 {
     NotifServer *server = NULL;
     gboolean subscribed = FALSE;
 
-    server = get_notif_server (mgr, repo->server_url);
+    server = get_notif_server (mgr, server_url);
     if (!server || server->status != STATUS_CONNECTED) {
         goto out;
     }
 
     pthread_mutex_lock (&server->sub_lock);
-    if (g_hash_table_lookup (server->subscriptions, repo->id)) {
+    if (g_hash_table_lookup (server->subscriptions, repo_id)) {
         pthread_mutex_unlock (&server->sub_lock);
         subscribed = TRUE;
         goto out;
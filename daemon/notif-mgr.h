@@ -29,4 +29,10 @@ seaf_notif_manager_unsubscribe_repo (SeafNotifManager *mgr, SeafRepo *repo);
 gboolean
 seaf_notif_manager_is_repo_subscribed (SeafNotifManager *mgr, SeafRepo *repo);
 
+/* Same as above, for threads that can't hold on to a SeafRepo. */
+gboolean
+seaf_notif_manager_is_repo_id_subscribed (SeafNotifManager *mgr,
+                                          const char *server_url,
+                                          const char *repo_id);
+
 #endif
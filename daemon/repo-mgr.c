@@ -28,13 +28,30 @@
 #include "index/cache-tree.h"
 #include "diff-simple.h"
 #include "change-set.h"
+#include "wt-journal.h"
+#include "dir-scanner.h"
+#include "file-indexer.h"
+#include "server-block-cache.h"
+#include "bandwidth-scheduler.h"
+#include "store-cleanup.h"
+#include "sparse-rules.h"
+#include "chunk-policy.h"
+#include "ignore-rules.h"
+#include "index-cache.h"
+#include "hydration.h"
+#include "download-priority.h"
+#include "content-index.h"
+#include "file-id-cache.h"
+#include "executor.h"
+#include "work-mode.h"
+#include "metrics.h"
+#include "trace.h"
 
 #include "db.h"
 
 #include "seafile-object.h"
 
 #define INDEX_DIR "index"
-#define IGNORE_FILE "seafile-ignore.txt"
 
 #ifdef HAVE_KEYSTORAGE_GK
 #include "repokey/seafile-gnome-keyring.h"
@@ -48,6 +65,26 @@ struct _SeafRepoManagerPriv {
     GHashTable *repo_hash;
     sqlite3    *db;
     pthread_mutex_t db_lock;
+    /* Protected by db_lock. */
+    SqliteStmtCache *stmts;
+
+    /* Writes queued to the db writer thread. */
+    GAsyncQueue *db_writes;
+    pthread_mutex_t db_writes_lock;
+    pthread_cond_t db_writes_cond;
+    gint64 n_db_writes_queued;
+    gint64 n_db_writes_done;
+    gint n_sync_errors_recorded;
+
+    /* Read-through caches of RepoProperty and ServerProperty, protected by
+     * props_lock. repo_id or server_url -> (key -> value). A NULL value
+     * means the property is not set.
+     */
+    pthread_mutex_t props_lock;
+    GHashTable *repo_props;
+    GHashTable *server_props;
+    guint props_generation;
+
     GHashTable *checkout_tasks_hash;
     pthread_rwlock_t lock;
 
@@ -55,7 +92,20 @@ struct _SeafRepoManagerPriv {
     GHashTable *group_perms;    /* repo_id -> folder group perms */
     pthread_mutex_t perm_lock;
 
+    /* Read-only snapshot of the perms above, indexed as path tries.
+     * repo_id -> FolderPermIndex. It's replaced as a whole under perm_lock
+     * and read without any lock, see perm_index_acquire().
+     */
+    GHashTable *perm_index;
+    volatile gint perm_epoch;
+    volatile gint perm_readers[2];
+
     GAsyncQueue *lock_office_job_queue;
+    /* "<repo_id>/<lock file path>" -> path of the office file it locks,
+     * for the lock files created since the daemon started.
+     */
+    GHashTable *office_lock_files;
+    pthread_mutex_t office_lock_files_lock;
 };
 
 static const char *ignore_table[] = {
@@ -82,9 +132,6 @@ static GPatternSpec* office_temp_ignore_patterns[4];
 static GRegex *conflict_pattern = NULL;
 static GRegex *office_lock_pattern = NULL;
 
-static SeafRepo *
-load_repo (SeafRepoManager *manager, const char *repo_id);
-
 static void load_repos (SeafRepoManager *manager, const char *seaf_dir);
 static void seaf_repo_manager_del_repo_property (SeafRepoManager *manager,
                                                  const char *repo_id);
@@ -93,6 +140,9 @@ static int save_branch_repo_map (SeafRepoManager *manager, SeafBranch *branch);
 static void save_repo_property (SeafRepoManager *manager,
                                 const char *repo_id,
                                 const char *key, const char *value);
+static void save_sparse_rules_applied (SeafRepoManager *mgr,
+                                       const char *repo_id,
+                                       const char *rules);
 
 static void
 locked_file_free (LockedFile *file)
@@ -152,15 +202,161 @@ seaf_repo_manager_get_locked_file_set (SeafRepoManager *mgr, const char *repo_id
     ret->mgr = mgr;
     memcpy (ret->repo_id, repo_id, 36);
     ret->locked_files = locked_files;
+    ret->pending_writes = g_queue_new ();
+
+    return ret;
+}
+
+enum {
+    LOCKED_WRITE_INSERT = 0,
+    LOCKED_WRITE_UPDATE,
+    LOCKED_WRITE_DELETE,
+};
+
+typedef struct LockedFileWrite {
+    int type;
+    char *path;
+    char *operation;
+    gint64 old_mtime;
+    char *file_id;
+} LockedFileWrite;
+
+/* Pending writes are flushed in transactions of this many rows. */
+#define LOCKED_FILE_BATCH_SIZE 100
+
+static void
+locked_file_write_free (LockedFileWrite *write)
+{
+    g_free (write->path);
+    g_free (write->operation);
+    g_free (write->file_id);
+    g_free (write);
+}
+
+static int
+exec_locked_file_write (SeafRepoManager *mgr, const char *repo_id,
+                        LockedFileWrite *write)
+{
+    sqlite3_stmt *stmt;
+    const char *sql;
+    int rc;
+
+    switch (write->type) {
+    case LOCKED_WRITE_INSERT:
+        sql = "INSERT INTO LockedFiles VALUES (?, ?, ?, ?, ?, NULL)";
+        stmt = sqlite_stmt_cache_get (mgr->priv->stmts, sql);
+        if (!stmt)
+            return -1;
+        sqlite3_bind_text (stmt, 1, repo_id, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text (stmt, 2, write->path, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text (stmt, 3, write->operation, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64 (stmt, 4, write->old_mtime);
+        sqlite3_bind_text (stmt, 5, write->file_id, -1, SQLITE_TRANSIENT);
+        break;
+    case LOCKED_WRITE_UPDATE:
+        /* If a UPDATE record exists, don't update the old_mtime.
+         * We need to keep the old mtime when the locked file was first detected.
+         */
+        sql = "UPDATE LockedFiles SET operation = ?, file_id = ? "
+            "WHERE repo_id = ? AND path = ?";
+        stmt = sqlite_stmt_cache_get (mgr->priv->stmts, sql);
+        if (!stmt)
+            return -1;
+        sqlite3_bind_text (stmt, 1, write->operation, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text (stmt, 2, write->file_id, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text (stmt, 3, repo_id, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text (stmt, 4, write->path, -1, SQLITE_TRANSIENT);
+        break;
+    default:
+        sql = "DELETE FROM LockedFiles WHERE repo_id = ? AND path = ?";
+        stmt = sqlite_stmt_cache_get (mgr->priv->stmts, sql);
+        if (!stmt)
+            return -1;
+        sqlite3_bind_text (stmt, 1, repo_id, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text (stmt, 2, write->path, -1, SQLITE_TRANSIENT);
+        break;
+    }
+
+    rc = sqlite3_step (stmt);
+    sqlite3_reset (stmt);
+    if (rc != SQLITE_DONE) {
+        seaf_warning ("Failed to write locked file %s to db: %s.\n",
+                      write->path, sqlite3_errmsg (mgr->priv->db));
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+flush_locked_file_writes (LockedFileSet *fset)
+{
+    SeafRepoManager *mgr = fset->mgr;
+    LockedFileWrite *write;
+    int ret = 0;
+
+    if (g_queue_is_empty (fset->pending_writes))
+        return 0;
+
+    pthread_mutex_lock (&mgr->priv->db_lock);
+
+    sqlite_batch_begin (mgr->priv->db);
+    while ((write = g_queue_pop_head (fset->pending_writes)) != NULL) {
+        if (exec_locked_file_write (mgr, fset->repo_id, write) < 0)
+            ret = -1;
+        locked_file_write_free (write);
+    }
+    sqlite_batch_end (mgr->priv->db, TRUE);
+
+    pthread_mutex_unlock (&mgr->priv->db_lock);
 
     return ret;
 }
 
+static int
+queue_locked_file_write (LockedFileSet *fset, int type, const char *path,
+                         const char *operation, gint64 old_mtime,
+                         const char *file_id)
+{
+    LockedFileWrite *write = g_new0 (LockedFileWrite, 1);
+
+    write->type = type;
+    write->path = g_strdup (path);
+    write->operation = g_strdup (operation);
+    write->old_mtime = old_mtime;
+    write->file_id = g_strdup (file_id);
+    g_queue_push_tail (fset->pending_writes, write);
+
+    if (fset->batching &&
+        g_queue_get_length (fset->pending_writes) < LOCKED_FILE_BATCH_SIZE)
+        return 0;
+
+    return flush_locked_file_writes (fset);
+}
+
+void
+locked_file_set_begin_batch (LockedFileSet *fset)
+{
+    fset->batching = TRUE;
+}
+
+int
+locked_file_set_end_batch (LockedFileSet *fset)
+{
+    if (!fset)
+        return 0;
+
+    fset->batching = FALSE;
+    return flush_locked_file_writes (fset);
+}
+
 void
 locked_file_set_free (LockedFileSet *fset)
 {
     if (!fset)
         return;
+    flush_locked_file_writes (fset);
+    g_queue_free (fset->pending_writes);
     g_hash_table_destroy (fset->locked_files);
     g_free (fset);
 }
@@ -172,37 +368,16 @@ locked_file_set_add_update (LockedFileSet *fset,
                             gint64 old_mtime,
                             const char *file_id)
 {
-    SeafRepoManager *mgr = fset->mgr;
-    char *sql;
-    sqlite3_stmt *stmt;
     LockedFile *file;
     gboolean exists;
 
     exists = (g_hash_table_lookup (fset->locked_files, path) != NULL);
 
-    pthread_mutex_lock (&mgr->priv->db_lock);
-
     if (!exists) {
         seaf_debug ("New locked file record %.8s, %s, %s, %"
                     G_GINT64_FORMAT".\n",
                     fset->repo_id, path, operation, old_mtime);
 
-        sql = "INSERT INTO LockedFiles VALUES (?, ?, ?, ?, ?, NULL)";
-        stmt = sqlite_query_prepare (mgr->priv->db, sql);
-        sqlite3_bind_text (stmt, 1, fset->repo_id, -1, SQLITE_TRANSIENT);
-        sqlite3_bind_text (stmt, 2, path, -1, SQLITE_TRANSIENT);
-        sqlite3_bind_text (stmt, 3, operation, -1, SQLITE_TRANSIENT);
-        sqlite3_bind_int64 (stmt, 4, old_mtime);
-        sqlite3_bind_text (stmt, 5, file_id, -1, SQLITE_TRANSIENT);
-        if (sqlite3_step (stmt) != SQLITE_DONE) {
-            seaf_warning ("Failed to insert locked file %s to db: %s.\n",
-                          path, sqlite3_errmsg (mgr->priv->db));
-            sqlite3_finalize (stmt);
-            pthread_mutex_unlock (&mgr->priv->db_lock);
-            return -1;
-        }
-        sqlite3_finalize (stmt);
-
         file = g_new0 (LockedFile, 1);
         file->operation = g_strdup(operation);
         file->old_mtime = old_mtime;
@@ -210,75 +385,38 @@ locked_file_set_add_update (LockedFileSet *fset,
             memcpy (file->file_id, file_id, 40);
 
         g_hash_table_insert (fset->locked_files, g_strdup(path), file);
+
+        return queue_locked_file_write (fset, LOCKED_WRITE_INSERT, path,
+                                        operation, old_mtime, file_id);
     } else {
         seaf_debug ("Update locked file record %.8s, %s, %s.\n",
                     fset->repo_id, path, operation);
 
-        /* If a UPDATE record exists, don't update the old_mtime.
-         * We need to keep the old mtime when the locked file was first detected.
-         */
-
-        sql = "UPDATE LockedFiles SET operation = ?, file_id = ? "
-            "WHERE repo_id = ? AND path = ?";
-        stmt = sqlite_query_prepare (mgr->priv->db, sql);
-        sqlite3_bind_text (stmt, 1, operation, -1, SQLITE_TRANSIENT);
-        sqlite3_bind_text (stmt, 2, file_id, -1, SQLITE_TRANSIENT);
-        sqlite3_bind_text (stmt, 3, fset->repo_id, -1, SQLITE_TRANSIENT);
-        sqlite3_bind_text (stmt, 4, path, -1, SQLITE_TRANSIENT);
-        if (sqlite3_step (stmt) != SQLITE_DONE) {
-            seaf_warning ("Failed to update locked file %s to db: %s.\n",
-                          path, sqlite3_errmsg (mgr->priv->db));
-            sqlite3_finalize (stmt);
-            pthread_mutex_unlock (&mgr->priv->db_lock);
-            return -1;
-        }
-        sqlite3_finalize (stmt);
-
         file = g_hash_table_lookup (fset->locked_files, path);
         g_free (file->operation);
         file->operation = g_strdup(operation);
         if (file_id)
             memcpy (file->file_id, file_id, 40);
-    }
-
-    pthread_mutex_unlock (&mgr->priv->db_lock);
 
-    return 0;
+        return queue_locked_file_write (fset, LOCKED_WRITE_UPDATE, path,
+                                        operation, 0, file_id);
+    }
 }
 
 int
 locked_file_set_remove (LockedFileSet *fset, const char *path, gboolean db_only)
 {
-    SeafRepoManager *mgr = fset->mgr;
-    char *sql;
-    sqlite3_stmt *stmt;
-
     if (g_hash_table_lookup (fset->locked_files, path) == NULL)
         return 0;
 
     seaf_debug ("Remove locked file record %.8s, %s.\n",
                 fset->repo_id, path);
 
-    pthread_mutex_lock (&mgr->priv->db_lock);
-
-    sql = "DELETE FROM LockedFiles WHERE repo_id = ? AND path = ?";
-    stmt = sqlite_query_prepare (mgr->priv->db, sql);
-    sqlite3_bind_text (stmt, 1, fset->repo_id, -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text (stmt, 2, path, -1, SQLITE_TRANSIENT);
-    if (sqlite3_step (stmt) != SQLITE_DONE) {
-        seaf_warning ("Failed to remove locked file %s from db: %s.\n",
-                      path, sqlite3_errmsg (mgr->priv->db));
-        sqlite3_finalize (stmt);
-        pthread_mutex_unlock (&mgr->priv->db_lock);
-        return -1;
-    }
-    sqlite3_finalize (stmt);
-    pthread_mutex_unlock (&mgr->priv->db_lock);
-
     if (!db_only)
         g_hash_table_remove (fset->locked_files, path);
 
-    return 0;
+    return queue_locked_file_write (fset, LOCKED_WRITE_DELETE, path,
+                                    NULL, 0, NULL);
 }
 
 LockedFile *
@@ -334,6 +472,228 @@ comp_folder_perms (gconstpointer a, gconstpointer b)
     return (strcmp (perm_b->path, perm_a->path));
 }
 
+/*
+ * Folder perm index.
+ *
+ * Each repo's user and group perms are kept in a trie of path components,
+ * so that looking up a path costs one hash lookup per component instead of
+ * a string comparison with every perm.
+ *
+ * Snapshots are never modified once published. A writer builds a new
+ * snapshot, swaps the pointer, then waits for the readers that may still
+ * see the old one before freeing it. Readers register themselves in one of
+ * two counters, chosen by the current epoch; the writer flips the epoch and
+ * waits for the counter of the previous one to drop to zero.
+ */
+
+typedef struct FolderPermNode {
+    /* The permission set on exactly this folder, or NULL. */
+    char *permission;
+    /* Path component -> FolderPermNode. */
+    GHashTable *children;
+} FolderPermNode;
+
+typedef struct FolderPermIndex {
+    /* Shared by consecutive snapshots, only touched under perm_lock. */
+    int ref;
+    FolderPermNode *user_root;
+    FolderPermNode *group_root;
+} FolderPermIndex;
+
+static void
+folder_perm_node_free (FolderPermNode *node)
+{
+    if (!node)
+        return;
+
+    g_free (node->permission);
+    if (node->children)
+        g_hash_table_destroy (node->children);
+    g_free (node);
+}
+
+static FolderPermNode *
+build_folder_perm_trie (GList *perms)
+{
+    FolderPermNode *root, *node, *child;
+    GList *ptr;
+    FolderPerm *perm;
+    char **components, **p;
+
+    if (!perms)
+        return NULL;
+
+    root = g_new0 (FolderPermNode, 1);
+
+    for (ptr = perms; ptr; ptr = ptr->next) {
+        perm = ptr->data;
+        node = root;
+
+        components = g_strsplit (perm->path, "/", -1);
+        for (p = components; *p; ++p) {
+            if (**p == '\0')
+                continue;
+            if (!node->children)
+                node->children = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                        (GDestroyNotify)folder_perm_node_free);
+            child = g_hash_table_lookup (node->children, *p);
+            if (!child) {
+                child = g_new0 (FolderPermNode, 1);
+                g_hash_table_insert (node->children, g_strdup(*p), child);
+            }
+            node = child;
+        }
+        g_strfreev (components);
+
+        /* The lists are sorted, keep the first perm of duplicated paths. */
+        if (!node->permission)
+            node->permission = g_strdup (perm->permission);
+    }
+
+    return root;
+}
+
+/* Permission of the deepest folder in @root that contains @path. @path is
+ * relative to the repo root and is modified during the lookup.
+ */
+static const char *
+lookup_folder_perm (FolderPermNode *root, char *path)
+{
+    FolderPermNode *node = root;
+    const char *permission = root->permission;
+    char *component = path, *slash;
+
+    while (node->children && component) {
+        slash = strchr (component, '/');
+        if (slash)
+            *slash = '\0';
+        if (*component != '\0') {
+            node = g_hash_table_lookup (node->children, component);
+            if (!node)
+                break;
+            if (node->permission)
+                permission = node->permission;
+        }
+        if (slash)
+            *slash = '/';
+        component = slash ? slash + 1 : NULL;
+    }
+
+    return permission;
+}
+
+static void
+folder_perm_index_unref (FolderPermIndex *index)
+{
+    if (!index || --(index->ref) > 0)
+        return;
+
+    folder_perm_node_free (index->user_root);
+    folder_perm_node_free (index->group_root);
+    g_free (index);
+}
+
+static GHashTable *
+perm_index_table_new ()
+{
+    return g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                  (GDestroyNotify)folder_perm_index_unref);
+}
+
+static GHashTable *
+perm_index_acquire (SeafRepoManager *mgr, int *epoch)
+{
+    SeafRepoManagerPriv *priv = mgr->priv;
+    int e;
+
+    while (1) {
+        e = g_atomic_int_get (&priv->perm_epoch) & 1;
+        g_atomic_int_inc (&priv->perm_readers[e]);
+        if ((g_atomic_int_get (&priv->perm_epoch) & 1) == e)
+            break;
+        /* A writer flipped the epoch meanwhile and may not wait for us. */
+        g_atomic_int_add (&priv->perm_readers[e], -1);
+    }
+
+    *epoch = e;
+    return g_atomic_pointer_get (&priv->perm_index);
+}
+
+static void
+perm_index_release (SeafRepoManager *mgr, int epoch)
+{
+    g_atomic_int_add (&mgr->priv->perm_readers[epoch], -1);
+}
+
+/* Must be called with perm_lock held. */
+static void
+perm_index_publish (SeafRepoManager *mgr, GHashTable *index)
+{
+    SeafRepoManagerPriv *priv = mgr->priv;
+    GHashTable *old;
+    int e;
+
+    old = priv->perm_index;
+    g_atomic_pointer_set (&priv->perm_index, index);
+
+    e = g_atomic_int_get (&priv->perm_epoch) & 1;
+    g_atomic_int_inc (&priv->perm_epoch);
+    while (g_atomic_int_get (&priv->perm_readers[e]) > 0)
+        g_usleep (100);
+
+    if (old)
+        g_hash_table_destroy (old);
+}
+
+static FolderPermIndex *
+build_folder_perm_index (SeafRepoManager *mgr, const char *repo_id)
+{
+    FolderPermIndex *index;
+    GList *user_perms, *group_perms;
+
+    user_perms = g_hash_table_lookup (mgr->priv->user_perms, repo_id);
+    group_perms = g_hash_table_lookup (mgr->priv->group_perms, repo_id);
+    if (!user_perms && !group_perms)
+        return NULL;
+
+    index = g_new0 (FolderPermIndex, 1);
+    index->ref = 1;
+    index->user_root = build_folder_perm_trie (user_perms);
+    index->group_root = build_folder_perm_trie (group_perms);
+
+    return index;
+}
+
+/* Publish a new snapshot after the perms of @repo_id have changed. The other
+ * repos' tries are shared with the old snapshot. Must be called with
+ * perm_lock held.
+ */
+static void
+update_folder_perm_index (SeafRepoManager *mgr, const char *repo_id)
+{
+    GHashTable *index = perm_index_table_new ();
+    GHashTableIter iter;
+    gpointer key, value;
+    FolderPermIndex *repo_index;
+
+    if (mgr->priv->perm_index) {
+        g_hash_table_iter_init (&iter, mgr->priv->perm_index);
+        while (g_hash_table_iter_next (&iter, &key, &value)) {
+            if (strcmp ((char *)key, repo_id) == 0)
+                continue;
+            repo_index = value;
+            ++(repo_index->ref);
+            g_hash_table_insert (index, g_strdup((char *)key), repo_index);
+        }
+    }
+
+    repo_index = build_folder_perm_index (mgr, repo_id);
+    if (repo_index)
+        g_hash_table_insert (index, g_strdup(repo_id), repo_index);
+
+    perm_index_publish (mgr, index);
+}
+
 static void
 delete_folder_perm (SeafRepoManager *mgr, const char *repo_id, FolderPermType type, FolderPerm *perm)
 {
@@ -431,6 +791,7 @@ seaf_repo_manager_delete_folder_perm (SeafRepoManager *mgr,
     /* Update in memory */
     pthread_mutex_lock (&mgr->priv->perm_lock);
     delete_folder_perm (mgr, repo_id, type, perm);
+    update_folder_perm_index (mgr, repo_id);
     pthread_mutex_unlock (&mgr->priv->perm_lock);
 
     return 0;
@@ -541,6 +902,7 @@ seaf_repo_manager_update_folder_perm (SeafRepoManager *mgr,
         }
         g_hash_table_insert (mgr->priv->group_perms, g_strdup(repo_id), folder_perms);
     }
+    update_folder_perm_index (mgr, repo_id);
     pthread_mutex_unlock (&mgr->priv->perm_lock);
 
     return 0;
@@ -561,26 +923,30 @@ seaf_repo_manager_update_folder_perms (SeafRepoManager *mgr,
                            type == FOLDER_PERM_TYPE_GROUP),
                           -1);
 
-    /* Update db. */
+    /* Update db. All rows are written in one transaction. */
 
     pthread_mutex_lock (&mgr->priv->db_lock);
 
+    sqlite_batch_begin (mgr->priv->db);
+
     if (type == FOLDER_PERM_TYPE_USER)
         sql = "DELETE FROM FolderUserPerms WHERE repo_id = ?";
     else
         sql = "DELETE FROM FolderGroupPerms WHERE repo_id = ?";
-    stmt = sqlite_query_prepare (mgr->priv->db, sql);
+    stmt = sqlite_stmt_cache_get (mgr->priv->stmts, sql);
+    if (!stmt)
+        goto error;
     sqlite3_bind_text (stmt, 1, repo_id, -1, SQLITE_TRANSIENT);
     if (sqlite3_step (stmt) != SQLITE_DONE) {
         seaf_warning ("Failed to remove folder perms for %.8s: %s.\n",
                       repo_id, sqlite3_errmsg (mgr->priv->db));
-        sqlite3_finalize (stmt);
-        pthread_mutex_unlock (&mgr->priv->db_lock);
-        return -1;
+        sqlite3_reset (stmt);
+        goto error;
     }
-    sqlite3_finalize (stmt);
+    sqlite3_reset (stmt);
 
     if (!folder_perms) {
+        sqlite_batch_end (mgr->priv->db, TRUE);
         pthread_mutex_unlock (&mgr->priv->db_lock);
         return 0;
     }
@@ -589,7 +955,9 @@ seaf_repo_manager_update_folder_perms (SeafRepoManager *mgr,
         sql = "INSERT INTO FolderUserPerms VALUES (?, ?, ?)";
     else
         sql = "INSERT INTO FolderGroupPerms VALUES (?, ?, ?)";
-    stmt = sqlite_query_prepare (mgr->priv->db, sql);
+    stmt = sqlite_stmt_cache_get (mgr->priv->stmts, sql);
+    if (!stmt)
+        goto error;
 
     for (ptr = folder_perms; ptr; ptr = ptr->next) {
         perm = ptr->data;
@@ -601,16 +969,15 @@ seaf_repo_manager_update_folder_perms (SeafRepoManager *mgr,
         if (sqlite3_step (stmt) != SQLITE_DONE) {
             seaf_warning ("Failed to insert folder perms for %.8s: %s.\n",
                           repo_id, sqlite3_errmsg (mgr->priv->db));
-            sqlite3_finalize (stmt);
-            pthread_mutex_unlock (&mgr->priv->db_lock);
-            return -1;
+            sqlite3_reset (stmt);
+            goto error;
         }
 
         sqlite3_reset (stmt);
         sqlite3_clear_bindings (stmt);
     }
 
-    sqlite3_finalize (stmt);
+    sqlite_batch_end (mgr->priv->db, TRUE);
 
     pthread_mutex_unlock (&mgr->priv->db_lock);
 
@@ -631,9 +998,15 @@ seaf_repo_manager_update_folder_perms (SeafRepoManager *mgr,
             g_list_free_full (old, (GDestroyNotify)folder_perm_free);
         g_hash_table_insert (mgr->priv->group_perms, g_strdup(repo_id), new);
     }
+    update_folder_perm_index (mgr, repo_id);
     pthread_mutex_unlock (&mgr->priv->perm_lock);
 
     return 0;
+
+error:
+    sqlite_batch_end (mgr->priv->db, FALSE);
+    pthread_mutex_unlock (&mgr->priv->db_lock);
+    return -1;
 }
 
 static gboolean
@@ -702,6 +1075,8 @@ init_folder_perms (SeafRepoManager *mgr)
     GList *ptr;
     GList *perms;
     char *repo_id;
+    GHashTable *index;
+    FolderPermIndex *repo_index;
 
     priv->user_perms = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
     priv->group_perms = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
@@ -723,6 +1098,18 @@ init_folder_perms (SeafRepoManager *mgr)
         }
     }
 
+    /* Build the index of all repos at once. */
+    pthread_mutex_lock (&priv->perm_lock);
+    index = perm_index_table_new ();
+    for (ptr = repo_ids; ptr; ptr = ptr->next) {
+        repo_id = ptr->data;
+        repo_index = build_folder_perm_index (mgr, repo_id);
+        if (repo_index)
+            g_hash_table_insert (index, g_strdup(repo_id), repo_index);
+    }
+    perm_index_publish (mgr, index);
+    pthread_mutex_unlock (&priv->perm_lock);
+
     g_list_free (repo_ids);
 }
 
@@ -745,6 +1132,8 @@ remove_folder_perms (SeafRepoManager *mgr, const char *repo_id)
         g_hash_table_remove (mgr->priv->group_perms, repo_id);
     }
 
+    update_folder_perm_index (mgr, repo_id);
+
     pthread_mutex_unlock (&mgr->priv->perm_lock);
 }
 
@@ -789,69 +1178,40 @@ seaf_repo_manager_get_folder_perm_timestamp (SeafRepoManager *mgr,
     return ret;
 }
 
-static char *
-lookup_folder_perm (GList *perms, const char *path)
-{
-    GList *ptr;
-    FolderPerm *perm;
-    char *folder;
-    int len;
-    char *permission = NULL;
-
-    for (ptr = perms; ptr; ptr = ptr->next) {
-        perm = ptr->data;
-
-        if (strcmp (perm->path, "/") != 0)
-            folder = g_strconcat (perm->path, "/", NULL);
-        else
-            folder = g_strdup(perm->path);
-
-        len = strlen(folder);
-        if (strcmp (perm->path, path) == 0 || strncmp(folder, path, len) == 0) {
-            permission = perm->permission;
-            g_free (folder);
-            break;
-        }
-        g_free (folder);
-    }
-
-    return permission;
-}
-
 static gboolean
 is_path_writable (const char *repo_id,
                   gboolean is_repo_readonly,
                   const char *path)
 {
     SeafRepoManager *mgr = seaf->repo_mgr;
-    GList *user_perms = NULL, *group_perms = NULL;
-    char *permission = NULL;
-    char *abs_path = NULL;
+    GHashTable *index;
+    FolderPermIndex *repo_index;
+    const char *permission = NULL;
+    char *lookup_path = NULL;
+    gboolean ret;
+    int epoch;
 
-    pthread_mutex_lock (&mgr->priv->perm_lock);
+    index = perm_index_acquire (mgr, &epoch);
 
-    user_perms = g_hash_table_lookup (mgr->priv->user_perms, repo_id);
-    group_perms = g_hash_table_lookup (mgr->priv->group_perms, repo_id);
+    repo_index = index ? g_hash_table_lookup (index, repo_id) : NULL;
+    if (repo_index)
+        lookup_path = g_strdup (path);
 
-    if (user_perms || group_perms)
-        abs_path = g_strconcat ("/", path, NULL);
+    if (repo_index && repo_index->user_root)
+        permission = lookup_folder_perm (repo_index->user_root, lookup_path);
+    if (!permission && repo_index && repo_index->group_root)
+        permission = lookup_folder_perm (repo_index->group_root, lookup_path);
 
-    if (user_perms)
-        permission = lookup_folder_perm (user_perms, abs_path);
-    if (!permission && group_perms)
-        permission = lookup_folder_perm (group_perms, abs_path);
-
-    pthread_mutex_unlock (&mgr->priv->perm_lock);
+    if (!permission)
+        ret = !is_repo_readonly;
+    else
+        ret = (strcmp (permission, "rw") == 0);
 
-    g_free (abs_path);
+    perm_index_release (mgr, epoch);
 
-    if (!permission)
-        return !is_repo_readonly;
+    g_free (lookup_path);
 
-    if (strcmp (permission, "rw") == 0)
-        return TRUE;
-    else
-        return FALSE;
+    return ret;
 }
 
 gboolean
@@ -882,48 +1242,69 @@ is_repo_id_valid (const char *id)
  * But since we have to store the errors in repo database, we have to put the code here.
  */
 
+/* Only the latest errors are kept. */
+#define MAX_FILE_SYNC_ERRORS 10000
+/* The table is trimmed to MAX_FILE_SYNC_ERRORS after this many errors. */
+#define FILE_SYNC_ERROR_TRIM_INTERVAL 500
+
+static void
+queue_db_write (SeafRepoManager *mgr, char *sql);
+
+static void
+wait_for_db_writes (SeafRepoManager *mgr);
+
+/*
+ * Errors are written by the db writer thread, so that the errors of a sync
+ * are stored in a few transactions. A path has at most one error. When it
+ * fails again with the same error, only the timestamp is updated and it
+ * keeps its position in the list.
+ */
 int
 seaf_repo_manager_record_sync_error (const char *repo_id,
                                      const char *repo_name,
                                      const char *path,
                                      int error_id)
 {
+    SeafRepoManagerPriv *priv = seaf->repo_mgr->priv;
+    gint64 now = (gint64)time(NULL);
     char *sql;
-    int ret;
-
-    pthread_mutex_lock (&seaf->repo_mgr->priv->db_lock);
-
-    if (path != NULL)
-        sql = sqlite3_mprintf ("DELETE FROM FileSyncError WHERE repo_id='%q' AND path='%q'",
-                               repo_id, path);
-    else
-        sql = sqlite3_mprintf ("DELETE FROM FileSyncError WHERE repo_id='%q' AND path IS NULL",
-                               repo_id);
-    ret = sqlite_query_exec (seaf->repo_mgr->priv->db, sql);
-    sqlite3_free (sql);
-    if (ret < 0)
-        goto out;
 
-    /* REPLACE INTO will update the primary key id automatically.
-     * So new errors are always on top.
-     */
     if (path != NULL)
-        sql = sqlite3_mprintf ("INSERT INTO FileSyncError "
-                               "(repo_id, repo_name, path, err_id, timestamp) "
-                               "VALUES ('%q', '%q', '%q', %d, %lld)",
-                               repo_id, repo_name, path, error_id, (gint64)time(NULL));
+        sql = sqlite3_mprintf (
+            "DELETE FROM FileSyncError WHERE repo_id = %Q AND path = %Q "
+            "AND err_id <> %d;"
+            "UPDATE FileSyncError SET repo_name = %Q, timestamp = %lld "
+            "WHERE repo_id = %Q AND path = %Q;"
+            "INSERT INTO FileSyncError "
+            "(repo_id, repo_name, path, err_id, timestamp) "
+            "SELECT %Q, %Q, %Q, %d, %lld WHERE changes() = 0;",
+            repo_id, path, error_id,
+            repo_name, (long long)now, repo_id, path,
+            repo_id, repo_name, path, error_id, (long long)now);
     else
-        sql = sqlite3_mprintf ("INSERT INTO FileSyncError "
-                               "(repo_id, repo_name, err_id, timestamp) "
-                               "VALUES ('%q', '%q', %d, %lld)",
-                               repo_id, repo_name, error_id, (gint64)time(NULL));
-        
-    ret = sqlite_query_exec (seaf->repo_mgr->priv->db, sql);
-    sqlite3_free (sql);
+        sql = sqlite3_mprintf (
+            "DELETE FROM FileSyncError WHERE repo_id = %Q AND path IS NULL "
+            "AND err_id <> %d;"
+            "UPDATE FileSyncError SET repo_name = %Q, timestamp = %lld "
+            "WHERE repo_id = %Q AND path IS NULL;"
+            "INSERT INTO FileSyncError "
+            "(repo_id, repo_name, path, err_id, timestamp) "
+            "SELECT %Q, %Q, NULL, %d, %lld WHERE changes() = 0;",
+            repo_id, error_id,
+            repo_name, (long long)now, repo_id,
+            repo_id, repo_name, error_id, (long long)now);
+    queue_db_write (seaf->repo_mgr, sql);
+
+    if (g_atomic_int_add (&priv->n_sync_errors_recorded, 1) %
+        FILE_SYNC_ERROR_TRIM_INTERVAL == 0) {
+        sql = sqlite3_mprintf (
+            "DELETE FROM FileSyncError WHERE id <= "
+            "(SELECT id FROM FileSyncError ORDER BY id DESC LIMIT 1 OFFSET %d)",
+            MAX_FILE_SYNC_ERRORS);
+        queue_db_write (seaf->repo_mgr, sql);
+    }
 
-out:
-    pthread_mutex_unlock (&seaf->repo_mgr->priv->db_lock);
-    return ret;
+    return 0;
 }
 
 static gboolean
@@ -961,6 +1342,8 @@ seaf_repo_manager_del_file_sync_error_by_id (SeafRepoManager *mgr, int id)
     int ret = 0;    
     char *sql = NULL;
 
+    wait_for_db_writes (mgr);
+
     pthread_mutex_lock (&mgr->priv->db_lock);
 
     sql = sqlite3_mprintf ("DELETE FROM FileSyncError WHERE id=%d",
@@ -979,6 +1362,8 @@ seaf_repo_manager_get_file_sync_errors (SeafRepoManager *mgr, int offset, int li
     GList *ret = NULL;
     char *sql;
 
+    wait_for_db_writes (mgr);
+
     pthread_mutex_lock (&mgr->priv->db_lock);
 
     sql = sqlite3_mprintf ("SELECT id, repo_id, repo_name, path, err_id, timestamp FROM "
@@ -995,6 +1380,37 @@ seaf_repo_manager_get_file_sync_errors (SeafRepoManager *mgr, int offset, int li
     return ret;
 }
 
+GList *
+seaf_repo_manager_get_file_sync_errors_before (SeafRepoManager *mgr,
+                                               int before_id, int limit)
+{
+    GList *ret = NULL;
+    char *sql;
+
+    wait_for_db_writes (mgr);
+
+    pthread_mutex_lock (&mgr->priv->db_lock);
+
+    if (before_id > 0)
+        sql = sqlite3_mprintf ("SELECT id, repo_id, repo_name, path, err_id, timestamp "
+                               "FROM FileSyncError WHERE id < %d "
+                               "ORDER BY id DESC LIMIT %d",
+                               before_id, limit);
+    else
+        sql = sqlite3_mprintf ("SELECT id, repo_id, repo_name, path, err_id, timestamp "
+                               "FROM FileSyncError ORDER BY id DESC LIMIT %d",
+                               limit);
+    sqlite_foreach_selected_row (mgr->priv->db, sql,
+                                 collect_file_sync_errors, &ret);
+    sqlite3_free (sql);
+
+    pthread_mutex_unlock (&mgr->priv->db_lock);
+
+    ret = g_list_reverse (ret);
+
+    return ret;
+}
+
 /*
  * Record file-level sync errors and send system notification.
  */
@@ -1056,41 +1472,49 @@ seaf_repo_new (const char *id, const char *name, const char *desc)
     return repo;
 }
 
-int
-seaf_repo_check_worktree (SeafRepo *repo)
+static int
+check_worktree_dir (const char *worktree, const char *repo_name,
+                    const char *repo_id, gboolean warn_access)
 {
     SeafStat st;
 
-    if (repo->worktree == NULL) {
-        seaf_warning ("Worktree for repo '%s'(%.8s) is not set.\n",
-                      repo->name, repo->id);
-        return -1;
-    }
-
     /* check repo worktree */
-    if (g_access(repo->worktree, F_OK) < 0) {
-        if (!repo->worktree_invalid) {
+    if (g_access(worktree, F_OK) < 0) {
+        if (warn_access) {
             seaf_warning ("Failed to access worktree %s for repo '%s'(%.8s)\n",
-                          repo->worktree, repo->name, repo->id);
+                          worktree, repo_name, repo_id);
         }
 
         return -1;
     }
 
-    if (seaf_stat(repo->worktree, &st) < 0) {
+    if (seaf_stat(worktree, &st) < 0) {
         seaf_warning ("Failed to stat worktree %s for repo '%s'(%.8s)\n",
-                      repo->worktree, repo->name, repo->id);
+                      worktree, repo_name, repo_id);
         return -1;
     }
     if (!S_ISDIR(st.st_mode)) {
         seaf_warning ("Worktree %s for repo '%s'(%.8s) is not a directory.\n",
-                      repo->worktree, repo->name, repo->id);
+                      worktree, repo_name, repo_id);
         return -1;
     }
 
     return 0;
 }
 
+int
+seaf_repo_check_worktree (SeafRepo *repo)
+{
+    if (repo->worktree == NULL) {
+        seaf_warning ("Worktree for repo '%s'(%.8s) is not set.\n",
+                      repo->name, repo->id);
+        return -1;
+    }
+
+    return check_worktree_dir (repo->worktree, repo->name, repo->id,
+                               !repo->worktree_invalid);
+}
+
 
 static gboolean
 check_worktree_common (SeafRepo *repo)
@@ -1113,6 +1537,7 @@ seaf_repo_free (SeafRepo *repo)
 {
     if (repo->head) seaf_branch_unref (repo->head);
 
+    chunk_policy_unref (repo->chunk_policy);
     g_free (repo->name);
     g_free (repo->desc);
     g_free (repo->category);
@@ -1292,57 +1717,6 @@ seaf_repo_set_name (SeafRepo *repo, const char *new_name)
         update_repo_worktree_name (repo, new_name, TRUE);
 }
 
-static gboolean
-collect_commit (SeafCommit *commit, void *vlist, gboolean *stop)
-{
-    GList **commits = vlist;
-
-    /* The traverse function will unref the commit, so we need to ref it.
-     */
-    seaf_commit_ref (commit);
-    *commits = g_list_prepend (*commits, commit);
-    return TRUE;
-}
-
-GList *
-seaf_repo_get_commits (SeafRepo *repo)
-{
-    GList *branches;
-    GList *ptr;
-    SeafBranch *branch;
-    GList *commits = NULL;
-
-    branches = seaf_branch_manager_get_branch_list (seaf->branch_mgr, repo->id);
-    if (branches == NULL) {
-        seaf_warning ("Failed to get branch list of repo %s.\n", repo->id);
-        return NULL;
-    }
-
-    for (ptr = branches; ptr != NULL; ptr = ptr->next) {
-        branch = ptr->data;
-        gboolean res = seaf_commit_manager_traverse_commit_tree (seaf->commit_mgr,
-                                                                 repo->id,
-                                                                 repo->version,
-                                                                 branch->commit_id,
-                                                                 collect_commit,
-                                                                 &commits, FALSE);
-        if (!res) {
-            for (ptr = commits; ptr != NULL; ptr = ptr->next)
-                seaf_commit_unref ((SeafCommit *)(ptr->data));
-            g_list_free (commits);
-            goto out;
-        }
-    }
-
-    commits = g_list_reverse (commits);
-
-out:
-    for (ptr = branches; ptr != NULL; ptr = ptr->next) {
-        seaf_branch_unref ((SeafBranch *)ptr->data);
-    }
-    return commits;
-}
-
 void
 seaf_repo_set_readonly (SeafRepo *repo)
 {
@@ -1372,10 +1746,11 @@ seaf_repo_manager_is_ignored_hidden_file (const char *filename)
 }
 
 static gboolean
-should_ignore(const char *basepath, const char *filename, void *data)
+should_ignore(const char *basepath, const char *filename, gboolean is_dir,
+              void *data)
 {
     GPatternSpec **spec = ignore_patterns;
-    GList *ignore_list = (GList *)data;
+    IgnoreRules *ignore_list = (IgnoreRules *)data;
 
     if (!g_utf8_validate (filename, -1, NULL)) {
         seaf_warning ("File name %s contains non-UTF8 characters, skip.\n", filename);
@@ -1406,7 +1781,7 @@ should_ignore(const char *basepath, const char *filename, void *data)
 
     if (basepath) {
         char *fullpath = g_build_path ("/", basepath, filename, NULL);
-        if (seaf_repo_check_ignore_file (ignore_list, fullpath)) {
+        if (ignore_rules_match (ignore_list, fullpath, is_dir)) {
             g_free (fullpath);
             return TRUE;
         }
@@ -1473,6 +1848,38 @@ out:
 }
 #endif
 
+static int
+index_file_blocks (const char *repo_id, int version, const char *path,
+                   unsigned char sha1[], SeafileCrypt *crypt,
+                   gboolean write_data, gboolean write_blocks,
+                   guint32 fixed_block_size, FileBlockMap **block_map)
+{
+    SeafRepo *repo;
+    gint64 size;
+
+    /* Check in blocks and get object ID. */
+    if (seaf_fs_manager_index_blocks (seaf->fs_mgr, repo_id, version,
+                                      path, sha1, &size, crypt,
+                                      write_data, write_blocks,
+                                      !seaf->disable_block_hash &&
+                                      fixed_block_size == 0,
+                                      fixed_block_size,
+                                      block_map) < 0) {
+        seaf_warning ("Failed to index file %s.\n", path);
+        return -1;
+    }
+
+    /* For the indexing throughput, see get_partial_commit_size(). */
+    repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
+    if (repo && write_data) {
+        pthread_mutex_lock (&repo->lock);
+        repo->indexed_bytes += size;
+        pthread_mutex_unlock (&repo->lock);
+    }
+
+    return 0;
+}
+
 static int
 index_cb (const char *repo_id,
           int version,
@@ -1481,26 +1888,246 @@ index_cb (const char *repo_id,
           SeafileCrypt *crypt,
           gboolean write_data)
 {
-    gint64 size;
+    FileBlockMap *block_map = NULL;
+    SeafStat st;
+    gboolean has_stat;
+    gboolean direct;
+    guint32 fixed_block_size = 0;
+    char file_id[41];
 
-    /* Check in blocks and get object ID. */
-    if (seaf_fs_manager_index_blocks (seaf->fs_mgr, repo_id, version,
-                                      path, sha1, &size, crypt, write_data, !seaf->disable_block_hash) < 0) {
-        seaf_warning ("Failed to index file %s.\n", path);
+    /* Renamed files and files with only a new ctime were chunked before.
+     * Their blocks were checked in then, or came from the server.
+     */
+    has_stat = (seaf_stat (path, &st) == 0);
+    if (has_stat && seaf_file_id_cache_lookup (repo_id, &st, sha1)) {
+        rawdata_to_hex (sha1, file_id, 20);
+        if (!write_data ||
+            seaf_fs_manager_object_exists (seaf->fs_mgr, repo_id, version, file_id))
+            return 0;
+    }
+
+    if (has_stat)
+        fixed_block_size = chunk_policy_get_block_size (repo_id, path,
+                                                        (gint64)st.st_size);
+
+    /* Blocks uploaded directly are read from the file when they're sent.
+     * Their locations are only known for files chunked with CDC.
+     */
+    direct = (write_data && !crypt && !seaf->disable_block_hash &&
+              fixed_block_size == 0 &&
+              http_tx_manager_pre_upload_is_direct (seaf->http_tx_mgr, repo_id));
+
+    if (index_file_blocks (repo_id, version, path, sha1, crypt,
+                           write_data, !direct, fixed_block_size,
+                           &block_map) < 0)
         return -1;
+
+    /* Downloads can take these blocks from the file. */
+    if (seaf_content_index_add_file (repo_id, path, block_map) < 0 && direct) {
+        /* Direct blocks can't be found without their locations. */
+        file_block_map_free (block_map);
+        direct = FALSE;
+        if (index_file_blocks (repo_id, version, path, sha1, crypt,
+                               write_data, TRUE, 0, &block_map) < 0)
+            return -1;
     }
+    if (write_data && block_map)
+        http_tx_manager_pre_upload_blocks (seaf->http_tx_mgr, repo_id,
+                                           direct ? path : NULL,
+                                           block_map->n_blocks,
+                                           block_map->blk_sha1s);
+    file_block_map_free (block_map);
+
+    /* Direct blocks may be lost if the commit fails. The file has to be
+     * chunked again then.
+     */
+    if (has_stat && write_data && !direct)
+        seaf_file_id_cache_add (repo_id, path, &st, sha1);
+
     return 0;
 }
 
-#define MAX_COMMIT_SIZE 100 * (1 << 20) /* 100MB */
+/*
+ * Big additions are committed in parts. Parts are sized so that indexing
+ * and uploading one takes about PARTIAL_COMMIT_SECONDS, at the indexing
+ * and upload throughput measured for the repo. The first files of a big
+ * copy then reach the server quickly on slow machines and links, while
+ * fast ones don't create many small commits.
+ */
+#define PARTIAL_COMMIT_SECONDS 60
+#define DEFAULT_COMMIT_SIZE ((gint64)100 << 20) /* 100MB */
+#define MIN_COMMIT_SIZE ((gint64)32 << 20)
+#define MAX_COMMIT_SIZE ((gint64)4 << 30)
+/* Smaller samples mostly measure per-file and per-request overhead. */
+#define MIN_RATE_SAMPLE_SIZE ((gint64)8 << 20)
+
+static void
+update_rate (SeafRepo *repo, double *rate, gint64 bytes, gint64 usec)
+{
+    double sample;
+
+    if (bytes < MIN_RATE_SAMPLE_SIZE || usec <= 0)
+        return;
+
+    sample = (double)bytes * 1000000 / usec;
+
+    pthread_mutex_lock (&repo->lock);
+    if (*rate == 0)
+        *rate = sample;
+    else
+        *rate = (*rate + sample) / 2;
+    pthread_mutex_unlock (&repo->lock);
+}
+
+void
+seaf_repo_record_upload_rate (SeafRepo *repo, gint64 bytes, gint64 usec)
+{
+    update_rate (repo, &repo->upload_rate, bytes, usec);
+}
+
+/* Bytes chunked since the last call. */
+static gint64
+take_indexed_bytes (SeafRepo *repo)
+{
+    gint64 bytes;
+
+    pthread_mutex_lock (&repo->lock);
+    bytes = repo->indexed_bytes;
+    repo->indexed_bytes = 0;
+    pthread_mutex_unlock (&repo->lock);
+
+    return bytes;
+}
+
+static gint64
+get_partial_commit_size (SeafRepo *repo)
+{
+    double index_rate, upload_rate, secs_per_byte = 0;
+    gint64 size;
+
+    pthread_mutex_lock (&repo->lock);
+    index_rate = repo->index_rate;
+    upload_rate = repo->upload_rate;
+    pthread_mutex_unlock (&repo->lock);
+
+    if (index_rate > 0)
+        secs_per_byte += 1 / index_rate;
+    if (upload_rate > 0)
+        secs_per_byte += 1 / upload_rate;
+    if (secs_per_byte == 0)
+        return DEFAULT_COMMIT_SIZE;
+
+    size = (gint64)(PARTIAL_COMMIT_SECONDS / secs_per_byte);
+    return CLAMP (size, MIN_COMMIT_SIZE, MAX_COMMIT_SIZE);
+}
 
 typedef struct _AddOptions {
     LockedFileSet *fset;
     ChangeSet *changeset;
     gboolean is_repo_ro;
     gboolean startup_scan;
+    FileIndexer *indexer;
+    SparseRules *sparse_rules;
+    gint64 partial_commit_size;
 } AddOptions;
 
+/* Paths left out by the sparse rules are handled like ignored ones. Dirs
+ * leading to included paths are not left out.
+ */
+static gboolean
+sparse_path_ignored (SparseRules *rules, const char *path, gboolean is_dir)
+{
+    if (!rules)
+        return FALSE;
+    return (sparse_rules_match (path, is_dir, rules) == DIFF_PATH_SKIP);
+}
+
+/* Limit the finished files waiting behind a slow one. */
+#define MAX_PENDING_INDEX_JOBS 1000
+
+static void
+finish_add_file (const char *repo_id,
+                 const char *modifier,
+                 struct index_state *istate,
+                 const char *path,
+                 SeafStat *st,
+                 int ret,
+                 gboolean added,
+                 AddOptions *options)
+{
+    struct cache_entry *ce;
+
+    if (!added) {
+        /* If the contents of the file doesn't change, move it to
+           synced status.
+        */
+        seaf_sync_manager_update_active_path (seaf->sync_mgr,
+                                              repo_id,
+                                              path,
+                                              S_IFREG,
+                                              SYNC_STATUS_SYNCED,
+                                              FALSE);
+    } else if (options && options->changeset) {
+        /* ce may be updated. */
+        ce = index_name_exists (istate, path, strlen(path), 0);
+        add_to_changeset (options->changeset,
+                          DIFF_STATUS_ADDED,
+                          ce->sha1,
+                          st,
+                          modifier,
+                          path,
+                          NULL);
+    }
+
+    if (ret < 0) {
+        seaf_sync_manager_update_active_path (seaf->sync_mgr,
+                                              repo_id,
+                                              path,
+                                              S_IFREG,
+                                              SYNC_STATUS_ERROR,
+                                              TRUE);
+        send_file_sync_error_notification (repo_id, NULL, path,
+                                           SYNC_ERROR_ID_INDEX_ERROR);
+    }
+}
+
+/* Add the files indexed by options->indexer to the index, in the order
+ * they were submitted. If @wait_all is TRUE, wait for all of them.
+ */
+static void
+apply_indexed_files (const char *repo_id,
+                     const char *modifier,
+                     struct index_state *istate,
+                     gint64 *total_size,
+                     AddOptions *options,
+                     gboolean wait_all)
+{
+    IndexJob *job;
+    gboolean wait, added;
+    int ret;
+
+    while (1) {
+        wait = (wait_all ||
+                file_indexer_n_pending (options->indexer) >= MAX_PENDING_INDEX_JOBS);
+        job = file_indexer_next (options->indexer, wait);
+        if (!job)
+            break;
+
+        added = FALSE;
+        ret = job->result;
+        if (ret == 0)
+            ret = add_indexed_file_to_index (istate, job->path, &job->st,
+                                             job->sha1, modifier, &added);
+        /* The size was counted when the file was submitted. */
+        if (!added && total_size)
+            *total_size -= (gint64)(job->st.st_size);
+
+        finish_add_file (repo_id, modifier, istate, job->path, &job->st,
+                         ret, added, options);
+        index_job_free (job);
+    }
+}
+
 static int
 add_file (const char *repo_id,
           int version,
@@ -1557,6 +2184,19 @@ add_file (const char *repo_id,
     if (!is_writable || is_locked)
         return ret;
 
+    /* A placeholder that was touched but not written to still has no
+     * content, keep the indexed file. This holds after on-demand is
+     * turned off, until the placeholder is hydrated. Unchanged files
+     * aren't checked, it costs a query per file.
+     */
+    if (!index_entry_uptodate (istate, path, st)) {
+        ce = index_name_exists (istate, path, strlen(path), 0);
+        if (ce && ce->ce_size == st->st_size &&
+            seaf_hydration_placeholder_created (repo_id, path) &&
+            seaf_hydration_is_placeholder (full_path, st))
+            return ret;
+    }
+
 #if defined WIN32 || defined __APPLE__
     if (options && options->fset) {
         LockedFile *file = locked_file_set_lookup (options->fset, path);
@@ -1585,76 +2225,39 @@ add_file (const char *repo_id,
     g_free (base_name);
 #endif
 
-    if (!remain_files) {
-        ret = add_to_index (repo_id, version, istate, path, full_path,
-                            st, 0, crypt, index_cb, modifier, &added);
-        if (!added) {
-            /* If the contents of the file doesn't change, move it to
-               synced status.
-            */
-            seaf_sync_manager_update_active_path (seaf->sync_mgr,
-                                                  repo_id,
-                                                  path,
-                                                  S_IFREG,
-                                                  SYNC_STATUS_SYNCED,
-                                                  FALSE);
-        } else {
-            if (total_size)
-                *total_size += (gint64)(st->st_size);
-            if (options && options->changeset) {
-                /* ce may be updated. */
-                ce = index_name_exists (istate, path, strlen(path), 0);
-                add_to_changeset (options->changeset,
-                                  DIFF_STATUS_ADDED,
-                                  ce->sha1,
-                                  st,
-                                  modifier,
-                                  path,
-                                  NULL);
-            }
-        }
-    } else if (*remain_files == NULL) {
-        ret = add_to_index (repo_id, version, istate, path, full_path,
-                            st, 0, crypt, index_cb, modifier, &added);
-        if (added) {
+    if (remain_files && *remain_files != NULL) {
+        *total_size += (gint64)(st->st_size);
+        g_queue_push_tail (*remain_files, g_strdup(path));
+        return ret;
+    }
+
+    if (options && options->indexer &&
+        !index_entry_uptodate (istate, path, st)) {
+        /* Count the size now, so that partial commits are split at the
+         * same file as when indexing one by one.
+         */
+        file_indexer_submit (options->indexer, path, full_path, st);
+        if (total_size) {
             *total_size += (gint64)(st->st_size);
-            if (*total_size >= MAX_COMMIT_SIZE)
+            if (remain_files && *total_size >= options->partial_commit_size)
                 *remain_files = g_queue_new ();
-        } else {
-            seaf_sync_manager_update_active_path (seaf->sync_mgr,
-                                                  repo_id,
-                                                  path,
-                                                  S_IFREG,
-                                                  SYNC_STATUS_SYNCED,
-                                                  FALSE);
-        }
-        if (added && options && options->changeset) {
-            /* ce may be updated. */
-            ce = index_name_exists (istate, path, strlen(path), 0);
-            add_to_changeset (options->changeset,
-                              DIFF_STATUS_ADDED,
-                              ce->sha1,
-                              st,
-                              modifier,
-                              path,
-                              NULL);
         }
-    } else {
-        *total_size += (gint64)(st->st_size);
-        g_queue_push_tail (*remain_files, g_strdup(path));
+        apply_indexed_files (repo_id, modifier, istate, total_size,
+                             options, FALSE);
+        return ret;
     }
 
-    if (ret < 0) {
-        seaf_sync_manager_update_active_path (seaf->sync_mgr,
-                                              repo_id,
-                                              path,
-                                              S_IFREG,
-                                              SYNC_STATUS_ERROR,
-                                              TRUE);
-        send_file_sync_error_notification (repo_id, NULL, path,
-                                           SYNC_ERROR_ID_INDEX_ERROR);
+    ret = add_to_index (repo_id, version, istate, path, full_path,
+                        st, 0, crypt, index_cb, modifier, &added);
+    if (added && total_size) {
+        *total_size += (gint64)(st->st_size);
+        if (remain_files && options &&
+            *total_size >= options->partial_commit_size)
+            *remain_files = g_queue_new ();
     }
 
+    finish_add_file (repo_id, modifier, istate, path, st, ret, added, options);
+
     return ret;
 }
 
@@ -1666,30 +2269,99 @@ typedef struct AddParams {
     const char *worktree;
     SeafileCrypt *crypt;
     gboolean ignore_empty_dir;
-    GList *ignore_list;
+    IgnoreRules *ignore_list;
     gint64 *total_size;
     GQueue **remain_files;
     AddOptions *options;
+    DirScanner *scanner;
+    gint64 n_scanned;
 } AddParams;
 
+/* Index the files found by a directory walk in parallel. Returns TRUE
+ * if an indexer was set up, which must be finished by the caller.
+ */
+static gboolean
+start_file_indexer (const char *repo_id, int version, SeafileCrypt *crypt,
+                    AddOptions *options)
+{
+    if (!options || options->indexer)
+        return FALSE;
+
+    options->indexer = file_indexer_new (repo_id, version, crypt, index_cb);
+    return TRUE;
+}
+
+static void
+finish_file_indexer (const char *repo_id,
+                     const char *modifier,
+                     struct index_state *istate,
+                     gint64 *total_size,
+                     AddOptions *options)
+{
+    apply_indexed_files (repo_id, modifier, istate, total_size, options, TRUE);
+    file_indexer_free (options->indexer);
+    options->indexer = NULL;
+}
+
+/* Listing dirs and stat'ing files is mostly waiting for the disk or the
+ * file server, so use more threads than cores.
+ */
+#define WORKTREE_SCAN_THREADS 8
+
+static void
+log_scan_throughput (const char *repo_id, const char *path,
+                     gint64 n_scanned, double elapsed)
+{
+    double rate = (elapsed > 0) ? n_scanned / elapsed : 0;
+
+    /* Small scans happen on every change, don't flood the log. */
+    if (n_scanned >= 1000)
+        seaf_message ("Scanned %"G_GINT64_FORMAT" files under '%s' of repo %.8s "
+                      "in %.2fs, %.0f files/s.\n",
+                      n_scanned, path, repo_id, elapsed, rate);
+    else
+        seaf_debug ("Scanned %"G_GINT64_FORMAT" files under '%s' of repo %.8s "
+                    "in %.2fs, %.0f files/s.\n",
+                    n_scanned, path, repo_id, elapsed, rate);
+}
+
 #ifndef WIN32
 
+static char *
+build_subpath (const char *path, const char *dname)
+{
+#ifdef __APPLE__
+    char *norm_dname = g_utf8_normalize (dname, -1, G_NORMALIZE_NFC);
+    char *subpath = g_build_path (PATH_SEPERATOR, path, norm_dname, NULL);
+    g_free (norm_dname);
+    return subpath;
+#else
+    return g_build_path (PATH_SEPERATOR, path, dname, NULL);
+#endif
+}
+
+/* @st is NULL if the dir was listed by type only, it's stat'ed when an
+ * empty dir is added.
+ */
 static int
 add_dir_recursive (const char *path, const char *full_path, SeafStat *st,
                    AddParams *params, gboolean ignored)
 {
     AddOptions *options = params->options;
-    GDir *dir;
+    SeafStat dir_st;
+    ScanDir *dir;
+    ScanEntry *entry;
     const char *dname;
     char *subpath, *full_subpath;
-    int n, total;
+    int i, n, total;
     gboolean is_writable = TRUE;
-    struct stat sub_st;
+    struct stat *sub_st;
     char *base_name = NULL;
 
-    dir = g_dir_open (full_path, 0, NULL);
-    if (!dir) {
-        seaf_warning ("Failed to open dir %s: %s.\n", full_path, strerror(errno));
+    dir = dir_scanner_get (params->scanner, full_path);
+    if (dir->error != 0) {
+        seaf_warning ("Failed to open dir %s: %s.\n", full_path, strerror(dir->error));
+        scan_dir_free (dir);
 
         seaf_sync_manager_update_active_path (seaf->sync_mgr,
                                               params->repo_id,
@@ -1710,31 +2382,68 @@ add_dir_recursive (const char *path, const char *full_path, SeafStat *st,
     }
     g_free (base_name);
 
+    /* Let the scanner list the subdirs we're going to visit. They're
+     * queued in reverse so that the first one is listed first.
+     */
+    for (i = dir->n_entries - 1; i >= 0; i--) {
+        entry = &dir->entries[i];
+        if (entry->stat_errno != 0)
+            continue;
+        entry->ignored = (ignored ||
+                          should_ignore(full_path, entry->name,
+                                        S_ISDIR(entry->st.st_mode),
+                                        params->ignore_list));
+        if (!S_ISDIR(entry->st.st_mode) ||
+            (entry->ignored && !(options && options->startup_scan)))
+            continue;
+        subpath = build_subpath (path, entry->name);
+        if (options && sparse_path_ignored (options->sparse_rules, subpath, TRUE)) {
+            g_free (subpath);
+            continue;
+        }
+        full_subpath = g_build_filename (params->worktree, subpath, NULL);
+        dir_scanner_prefetch (params->scanner, full_subpath);
+        g_free (subpath);
+        g_free (full_subpath);
+    }
+
     n = 0;
     total = 0;
-    while ((dname = g_dir_read_name(dir)) != NULL) {
+    for (i = 0; i < dir->n_entries; i++) {
+        entry = &dir->entries[i];
+        dname = entry->name;
+        sub_st = &entry->st;
         ++total;
+        ++(params->n_scanned);
 
-#ifdef __APPLE__
-        char *norm_dname = g_utf8_normalize (dname, -1, G_NORMALIZE_NFC);
-        subpath = g_build_path (PATH_SEPERATOR, path, norm_dname, NULL);
-        g_free (norm_dname);
-#else
-        subpath = g_build_path (PATH_SEPERATOR, path, dname, NULL);
-#endif
+        subpath = build_subpath (path, dname);
         full_subpath = g_build_filename (params->worktree, subpath, NULL);
 
-        if (stat (full_subpath, &sub_st) < 0) {
-            seaf_warning ("Failed to stat %s: %s.\n", full_subpath, strerror(errno));
+        if (entry->stat_errno != 0) {
+            seaf_warning ("Failed to stat %s: %s.\n", full_subpath,
+                          strerror(entry->stat_errno));
+            g_free (subpath);
+            g_free (full_subpath);
+            continue;
+        }
+
+        /* Left out by the sparse rules. They're not committed, but the dir
+         * is not empty.
+         */
+        if (options && sparse_path_ignored (options->sparse_rules, subpath,
+                                            S_ISDIR(sub_st->st_mode))) {
+            ++n;
             g_free (subpath);
             g_free (full_subpath);
             continue;
         }
 
-        if (ignored || should_ignore(full_path, dname, params->ignore_list)) {
+        if (entry->ignored) {
             if (options && options->startup_scan) {
-                if (S_ISDIR(sub_st.st_mode))
-                    add_dir_recursive (subpath, full_subpath, &sub_st, params, TRUE);
+                if (S_ISDIR(sub_st->st_mode))
+                    add_dir_recursive (subpath, full_subpath,
+                                       entry->type_only ? NULL : sub_st,
+                                       params, TRUE);
                 else
                     seaf_sync_manager_update_active_path (seaf->sync_mgr,
                                                           params->repo_id,
@@ -1750,16 +2459,18 @@ add_dir_recursive (const char *path, const char *full_path, SeafStat *st,
 
         ++n;
 
-        if (S_ISDIR(sub_st.st_mode))
-            add_dir_recursive (subpath, full_subpath, &sub_st, params, FALSE);
-        else if (S_ISREG(sub_st.st_mode))
+        if (S_ISDIR(sub_st->st_mode))
+            add_dir_recursive (subpath, full_subpath,
+                               entry->type_only ? NULL : sub_st,
+                               params, FALSE);
+        else if (S_ISREG(sub_st->st_mode))
             add_file (params->repo_id,
                       params->version,
                       params->modifier,
                       params->istate,
                       subpath,
                       full_subpath,
-                      &sub_st,
+                      sub_st,
                       params->crypt,
                       params->total_size,
                       params->remain_files,
@@ -1768,7 +2479,7 @@ add_dir_recursive (const char *path, const char *full_path, SeafStat *st,
         g_free (subpath);
         g_free (full_subpath);
     }
-    g_dir_close (dir);
+    scan_dir_free (dir);
 
     if (ignored) {
         seaf_sync_manager_update_active_path (seaf->sync_mgr,
@@ -1806,6 +2517,14 @@ add_dir_recursive (const char *path, const char *full_path, SeafStat *st,
 
     if (n == 0 && path[0] != 0 && is_writable) {
         if (!params->remain_files || *(params->remain_files) == NULL) {
+            if (!st) {
+                if (seaf_stat (full_path, &dir_st) < 0) {
+                    seaf_warning ("Failed to stat %s: %s.\n", full_path,
+                                  strerror(errno));
+                    return 0;
+                }
+                st = &dir_st;
+            }
             int rc = add_empty_dir_to_index (params->istate, path, st);
             if (rc == 1 && options && options->changeset) {
                 unsigned char allzero[20] = {0};
@@ -1837,7 +2556,7 @@ add_recursive (const char *repo_id,
                const char *path,
                SeafileCrypt *crypt,
                gboolean ignore_empty_dir,
-               GList *ignore_list,
+               IgnoreRules *ignore_list,
                gint64 *total_size,
                GQueue **remain_files,
                AddOptions *options)
@@ -1892,8 +2611,20 @@ add_recursive (const char *repo_id,
             .remain_files = remain_files,
             .options = options,
         };
+        GTimer *timer = g_timer_new ();
+        gboolean own_indexer = start_file_indexer (repo_id, version, crypt,
+                                                   options);
 
+        params.scanner = dir_scanner_new (WORKTREE_SCAN_THREADS);
         add_dir_recursive (path, full_path, &st, &params, FALSE);
+        dir_scanner_free (params.scanner);
+
+        if (own_indexer)
+            finish_file_indexer (repo_id, modifier, istate, total_size, options);
+
+        log_scan_throughput (repo_id, path, params.n_scanned,
+                             g_timer_elapsed (timer, NULL));
+        g_timer_destroy (timer);
     }
 
     g_free (full_path);
@@ -1901,10 +2632,13 @@ add_recursive (const char *repo_id,
 }
 
 static gboolean
-is_empty_dir (const char *path, GList *ignore_list)
+is_empty_dir (const char *path, IgnoreRules *ignore_list)
 {
     GDir *dir;
     const char *dname;
+    char *sub_path;
+    SeafStat st;
+    gboolean is_dir;
     gboolean ret = TRUE;
 
     dir = g_dir_open (path, 0, NULL);
@@ -1913,7 +2647,10 @@ is_empty_dir (const char *path, GList *ignore_list)
     }
 
     while ((dname = g_dir_read_name(dir)) != NULL) {
-        if (!should_ignore(path, dname, ignore_list)) {
+        sub_path = g_build_path ("/", path, dname, NULL);
+        is_dir = (seaf_stat (sub_path, &st) == 0 && S_ISDIR(st.st_mode));
+        g_free (sub_path);
+        if (!should_ignore(path, dname, is_dir, ignore_list)) {
             ret = FALSE;
             break;
         }
@@ -1935,8 +2672,26 @@ typedef struct IterCBData {
     gboolean ignored;
 } IterCBData;
 
+/* Sub-dirs are opened by the long path of their parent plus their name as
+ * returned by FindNextFile, so paths are only converted to UTF-16 once.
+ */
+static wchar_t *
+build_sub_path_w (const wchar_t *parent_w, const wchar_t *name)
+{
+    size_t parent_len = wcslen (parent_w);
+    size_t name_len = wcslen (name);
+    wchar_t *path_w = g_new (wchar_t, parent_len + name_len + 2);
+
+    wmemcpy (path_w, parent_w, parent_len);
+    path_w[parent_len] = L'\\';
+    wmemcpy (path_w + parent_len + 1, name, name_len + 1);
+
+    return path_w;
+}
+
 static int
-add_dir_recursive (const char *path, const char *full_path, SeafStat *st,
+add_dir_recursive (const char *path, const char *full_path,
+                   const wchar_t *full_path_w, SeafStat *st,
                    AddParams *params, gboolean ignored);
 
 static int
@@ -1949,9 +2704,13 @@ iter_dir_cb (wchar_t *full_parent_w,
     AddParams *params = data->add_params;
     AddOptions *options = params->options;
     char *dname = NULL, *path = NULL, *full_path = NULL;
+    wchar_t *full_path_w = NULL;
+    gboolean is_dir = (fdata->dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
     SeafStat st;
     int ret = 0;
 
+    ++(params->n_scanned);
+
     dname = g_utf16_to_utf8 (fdata->cFileName, -1, NULL, NULL, NULL);
     if (!dname) {
         goto out;
@@ -1960,13 +2719,17 @@ iter_dir_cb (wchar_t *full_parent_w,
     path = g_build_path ("/", data->parent, dname, NULL);
     full_path = g_build_path ("/", params->worktree, path, NULL);
 
+    /* The find data is all we need, files are never stat'd while scanning. */
     seaf_stat_from_find_data (fdata, &st);
+    if (is_dir)
+        full_path_w = build_sub_path_w (full_parent_w, fdata->cFileName);
 
     if (data->ignored ||
-        should_ignore(data->full_parent, dname, params->ignore_list)) {
+        should_ignore(data->full_parent, dname, is_dir, params->ignore_list)) {
         if (options && options->startup_scan) {
-            if (fdata->dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
-                add_dir_recursive (path, full_path, &st, params, TRUE);
+            if (is_dir)
+                add_dir_recursive (path, full_path, full_path_w, &st,
+                                   params, TRUE);
             else
                 seaf_sync_manager_update_active_path (seaf->sync_mgr,
                                                       params->repo_id,
@@ -1978,8 +2741,9 @@ iter_dir_cb (wchar_t *full_parent_w,
         goto out;
     }
 
-    if (fdata->dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
-        ret = add_dir_recursive (path, full_path, &st, params, FALSE);
+    if (is_dir)
+        ret = add_dir_recursive (path, full_path, full_path_w, &st,
+                                 params, FALSE);
     else
         ret = add_file (params->repo_id,
                         params->version,
@@ -1999,17 +2763,18 @@ out:
     g_free (dname);
     g_free (path);
     g_free (full_path);
+    g_free (full_path_w);
 
     return 0;
 }
 
 static int
-add_dir_recursive (const char *path, const char *full_path, SeafStat *st,
+add_dir_recursive (const char *path, const char *full_path,
+                   const wchar_t *full_path_w, SeafStat *st,
                    AddParams *params, gboolean ignored)
 {
     AddOptions *options = params->options;
     IterCBData data;
-    wchar_t *full_path_w;
     int ret = 0;
     gboolean is_writable = TRUE;
 
@@ -2019,9 +2784,7 @@ add_dir_recursive (const char *path, const char *full_path, SeafStat *st,
     data.full_parent = full_path;
     data.ignored = ignored;
 
-    full_path_w = win32_long_path (full_path);
-    ret = traverse_directory_win32 (full_path_w, iter_dir_cb, &data);
-    g_free (full_path_w);
+    ret = traverse_directory_win32 ((wchar_t *)full_path_w, iter_dir_cb, &data);
 
     /* Ignore traverse dir error. */
     if (ret < 0) {
@@ -2097,7 +2860,7 @@ add_recursive (const char *repo_id,
                const char *path,
                SeafileCrypt *crypt,
                gboolean ignore_empty_dir,
-               GList *ignore_list,
+               IgnoreRules *ignore_list,
                gint64 *total_size,
                GQueue **remain_files,
                AddOptions *options)
@@ -2146,8 +2909,21 @@ add_recursive (const char *repo_id,
             .remain_files = remain_files,
             .options = options,
         };
+        GTimer *timer = g_timer_new ();
+        gboolean own_indexer = start_file_indexer (repo_id, version, crypt,
+                                                   options);
+        wchar_t *full_path_w = win32_long_path (full_path);
+
+        ret = add_dir_recursive (path, full_path, full_path_w, &st,
+                                 &params, FALSE);
+        g_free (full_path_w);
 
-        ret = add_dir_recursive (path, full_path, &st, &params, FALSE);
+        if (own_indexer)
+            finish_file_indexer (repo_id, modifier, istate, total_size, options);
+
+        log_scan_throughput (repo_id, path, params.n_scanned,
+                             g_timer_elapsed (timer, NULL));
+        g_timer_destroy (timer);
     }
 
     g_free (full_path);
@@ -2155,7 +2931,7 @@ add_recursive (const char *repo_id,
 }
 
 static gboolean
-is_empty_dir (const char *path, GList *ignore_list)
+is_empty_dir (const char *path, IgnoreRules *ignore_list)
 {
     WIN32_FIND_DATAW fdata;
     HANDLE handle;
@@ -2188,7 +2964,10 @@ is_empty_dir (const char *path, GList *ignore_list)
             continue;
 
         dname = g_utf16_to_utf8 (fdata.cFileName, -1, NULL, NULL, NULL);
-        if (!dname || !should_ignore (path, dname, ignore_list)) {
+        if (!dname ||
+            !should_ignore (path, dname,
+                            (fdata.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0,
+                            ignore_list)) {
             ret = FALSE;
             g_free (dname);
             FindClose (handle);
@@ -2233,23 +3012,84 @@ check_locked_file_before_remove (LockedFileSet *fset, const char *path)
 #endif
 }
 
+typedef struct StatEntriesData {
+    const char *worktree;
+    struct cache_entry **ces;
+    unsigned int n;
+    int *results;
+} StatEntriesData;
+
+#define STAT_BATCH_SIZE 256
+
+static void
+stat_entries_batch (gpointer data, gpointer user_data)
+{
+    StatEntriesData *sd = user_data;
+    unsigned int start = (GPOINTER_TO_UINT(data) - 1) * STAT_BATCH_SIZE;
+    unsigned int end = MIN (start + STAT_BATCH_SIZE, sd->n);
+    char path[SEAF_PATH_MAX];
+    SeafStat st;
+    unsigned int i;
+
+    for (i = start; i < end; i++) {
+        snprintf (path, SEAF_PATH_MAX, "%s/%s", sd->worktree, sd->ces[i]->name);
+        if (seaf_stat (path, &st) < 0)
+            sd->results[i] = -(errno ? errno : EIO);
+        else
+            sd->results[i] = st.st_mode;
+    }
+}
+
+/* Stat the worktree paths of @ces on WORKTREE_SCAN_THREADS threads.
+ * results[i] is the st_mode of ces[i], or -errno if stat failed.
+ */
+static void
+stat_cache_entries (const char *worktree, struct cache_entry **ces,
+                    unsigned int n, int *results)
+{
+    StatEntriesData sd = { worktree, ces, n, results };
+    GThreadPool *pool = NULL;
+    unsigned int i, n_batches = (n + STAT_BATCH_SIZE - 1) / STAT_BATCH_SIZE;
+
+    if (n_batches > 1)
+        pool = g_thread_pool_new (stat_entries_batch, &sd,
+                                  WORKTREE_SCAN_THREADS, FALSE, NULL);
+    if (!pool) {
+        for (i = 0; i < n_batches; i++)
+            stat_entries_batch (GUINT_TO_POINTER(i + 1), &sd);
+        return;
+    }
+
+    for (i = 0; i < n_batches; i++)
+        g_thread_pool_push (pool, GUINT_TO_POINTER(i + 1), NULL);
+    g_thread_pool_free (pool, FALSE, TRUE);
+}
+
 static void
 remove_deleted (struct index_state *istate, const char *worktree, const char *prefix,
-                GList *ignore_list, LockedFileSet *fset,
+                IgnoreRules *ignore_list, LockedFileSet *fset,
                 const char *repo_id, gboolean is_repo_ro,
                 ChangeSet *changeset)
 {
-    struct cache_entry **ce_array = istate->cache;
+    struct cache_entry **ce_array;
     struct cache_entry *ce;
+    struct cache_entry **checks;
+    int *results;
     char path[SEAF_PATH_MAX];
-    unsigned int i;
-    SeafStat st;
-    int ret;
+    unsigned int i, n_checks = 0;
+    int mode;
     gboolean not_exist;
 
     char *full_prefix = g_strconcat (prefix, "/", NULL);
     int len = strlen(full_prefix);
 
+    index_flush_batch (istate);
+    ce_array = istate->cache;
+
+    /* Pick the entries to check first, so that the worktree can be
+     * stat'ed in parallel.
+     */
+    checks = g_new (struct cache_entry *, istate->cache_nr + 1);
     for (i = 0; i < istate->cache_nr; ++i) {
         ce = ce_array[i];
 
@@ -2266,15 +3106,22 @@ remove_deleted (struct index_state *istate, const char *worktree, const char *pr
             strncmp (ce->name, full_prefix, len) != 0)
             continue;
 
+        checks[n_checks++] = ce;
+    }
+
+    results = g_new (int, n_checks + 1);
+    stat_cache_entries (worktree, checks, n_checks, results);
+
+    for (i = 0; i < n_checks; ++i) {
+        ce = checks[i];
+        mode = results[i];
+
         snprintf (path, SEAF_PATH_MAX, "%s/%s", worktree, ce->name);
-        not_exist = FALSE;
-        ret = seaf_stat (path, &st);
-        if (ret < 0 && errno == ENOENT)
-            not_exist = TRUE;
+        not_exist = (mode == -ENOENT);
 
         if (S_ISDIR (ce->ce_mode)) {
             if (ce->ce_ctime.sec != 0 || ce_stage(ce) != 0) {
-                if (not_exist || (ret == 0 && !S_ISDIR (st.st_mode))) {
+                if (not_exist || (mode >= 0 && !S_ISDIR (mode))) {
                     /* Add to changeset only if dir is removed. */
                     ce->ce_flags |= CE_REMOVE;
                     if (changeset)
@@ -2297,11 +3144,11 @@ remove_deleted (struct index_state *istate, const char *worktree, const char *pr
              * In this case we don't want to mistakenly remove the file
              * from the repo.
              */
-            if ((not_exist || (ret == 0 && !S_ISREG (st.st_mode))) &&
+            if ((not_exist || (mode >= 0 && !S_ISREG (mode))) &&
                 (ce->ce_ctime.sec != 0 || ce_stage(ce) != 0) &&
                 check_locked_file_before_remove (fset, ce->name))
             {
-                ce_array[i]->ce_flags |= CE_REMOVE;
+                ce->ce_flags |= CE_REMOVE;
                 if (changeset)
                     remove_from_changeset (changeset,
                                            DIFF_STATUS_DELETED,
@@ -2312,6 +3159,9 @@ remove_deleted (struct index_state *istate, const char *worktree, const char *pr
         }
     }
 
+    g_free (checks);
+    g_free (results);
+
     remove_marked_cache_entries (istate);
 
     g_free (full_prefix);
@@ -2319,7 +3169,7 @@ remove_deleted (struct index_state *istate, const char *worktree, const char *pr
 
 static int
 scan_worktree_for_changes (struct index_state *istate, SeafRepo *repo,
-                           SeafileCrypt *crypt, GList *ignore_list,
+                           SeafileCrypt *crypt, IgnoreRules *ignore_list,
                            LockedFileSet *fset)
 {
     remove_deleted (istate, repo->worktree, "", ignore_list, fset,
@@ -2330,6 +3180,8 @@ scan_worktree_for_changes (struct index_state *istate, SeafRepo *repo,
     options.fset = fset;
     options.is_repo_ro = repo->is_readonly;
     options.changeset = repo->changeset;
+    options.sparse_rules = repo->sparse_rules;
+    options.partial_commit_size = repo->partial_commit_size;
 
     if (add_recursive (repo->id, repo->version, repo->email,
                        istate, repo->worktree, "", crypt, FALSE, ignore_list,
@@ -2340,25 +3192,30 @@ scan_worktree_for_changes (struct index_state *istate, SeafRepo *repo,
 }
 
 static gboolean
-check_full_path_ignore (const char *worktree, const char *path, GList *ignore_list)
+check_full_path_ignore (SeafRepo *repo, const char *path, gboolean is_dir,
+                        IgnoreRules *ignore_list)
 {
+    const char *worktree = repo->worktree;
     char **tokens;
     guint i;
     guint n;
     gboolean ret = FALSE;
 
+    if (sparse_path_ignored (repo->sparse_rules, path, TRUE))
+        return TRUE;
+
     tokens = g_strsplit (path, "/", 0);
     n = g_strv_length (tokens);
     for (i = 0; i < n; ++i) {
         /* don't check ignore_list */
-        if (should_ignore (NULL, tokens[i], ignore_list)) {
+        if (should_ignore (NULL, tokens[i], FALSE, ignore_list)) {
             ret = TRUE;
             goto out;
         }
     }
 
     char *full_path = g_build_path ("/", worktree, path, NULL);
-    if (seaf_repo_check_ignore_file (ignore_list, full_path))
+    if (ignore_rules_match (ignore_list, full_path, is_dir))
         ret = TRUE;
     g_free (full_path);
 
@@ -2369,12 +3226,13 @@ out:
 
 static int
 add_path_to_index (SeafRepo *repo, struct index_state *istate,
-                   SeafileCrypt *crypt, const char *path, GList *ignore_list,
+                   SeafileCrypt *crypt, const char *path, IgnoreRules *ignore_list,
                    GList **scanned_dirs, gint64 *total_size, GQueue **remain_files,
                    LockedFileSet *fset)
 {
     char *full_path;
     SeafStat st;
+    int rc, stat_errno;
     AddOptions options;
 
     /* When a repo is initially added, a SCAN_DIR event will be created
@@ -2389,6 +3247,8 @@ add_path_to_index (SeafRepo *repo, struct index_state *istate,
         options.is_repo_ro = repo->is_readonly;
         options.startup_scan = TRUE;
         options.changeset = repo->changeset;
+        options.sparse_rules = repo->sparse_rules;
+        options.partial_commit_size = repo->partial_commit_size;
 
         add_recursive (repo->id, repo->version, repo->email, istate,
                        repo->worktree, path,
@@ -2421,12 +3281,19 @@ add_path_to_index (SeafRepo *repo, struct index_state *istate,
         g_free (full_dir);
     }
 
-    if (check_full_path_ignore (repo->worktree, path, ignore_list))
-        return 0;
-
     full_path = g_build_filename (repo->worktree, path, NULL);
 
-    if (seaf_stat (full_path, &st) < 0) {
+    rc = seaf_stat (full_path, &st);
+    stat_errno = errno;
+
+    if (check_full_path_ignore (repo, path, rc == 0 && S_ISDIR(st.st_mode),
+                                ignore_list)) {
+        g_free (full_path);
+        return 0;
+    }
+
+    if (rc < 0) {
+        errno = stat_errno;
         if (errno != ENOENT)
             send_file_sync_error_notification (repo->id, repo->name, path,
                                                SYNC_ERROR_ID_INDEX_ERROR);
@@ -2442,6 +3309,8 @@ add_path_to_index (SeafRepo *repo, struct index_state *istate,
     options.fset = fset;
     options.is_repo_ro = repo->is_readonly;
     options.changeset = repo->changeset;
+    options.sparse_rules = repo->sparse_rules;
+    options.partial_commit_size = repo->partial_commit_size;
 
     /* Add is always recursive */
     add_recursive (repo->id, repo->version, repo->email, istate, repo->worktree, path,
@@ -2455,7 +3324,7 @@ add_path_to_index (SeafRepo *repo, struct index_state *istate,
 
 static int
 add_path_to_index (SeafRepo *repo, struct index_state *istate,
-                   SeafileCrypt *crypt, const char *path, GList *ignore_list,
+                   SeafileCrypt *crypt, const char *path, IgnoreRules *ignore_list,
                    GList **scanned_dirs, gint64 *total_size, GQueue **remain_files,
                    LockedFileSet *fset)
 {
@@ -2489,7 +3358,7 @@ add_path_to_index (SeafRepo *repo, struct index_state *istate,
         g_free (full_dir);
     }
 
-    if (path[0] != 0 && check_full_path_ignore (repo->worktree, path, ignore_list))
+    if (path[0] != 0 && check_full_path_ignore (repo, path, TRUE, ignore_list))
         return 0;
 
     remove_deleted (istate, repo->worktree, path, ignore_list, NULL,
@@ -2502,6 +3371,8 @@ add_path_to_index (SeafRepo *repo, struct index_state *istate,
     options.fset = fset;
     options.is_repo_ro = repo->is_readonly;
     options.changeset = repo->changeset;
+    options.sparse_rules = repo->sparse_rules;
+    options.partial_commit_size = repo->partial_commit_size;
     /* When something is changed in the root directory, update active path
      * sync status when scanning the worktree. This is inaccurate. This will
      * be changed after we process fs events on Mac more precisely.
@@ -2521,12 +3392,19 @@ add_path_to_index (SeafRepo *repo, struct index_state *istate,
 static int
 add_remain_files (SeafRepo *repo, struct index_state *istate,
                   SeafileCrypt *crypt, GQueue *remain_files,
-                  GList *ignore_list, gint64 *total_size)
+                  IgnoreRules *ignore_list, gint64 *total_size)
 {
     char *path;
     char *full_path;
     SeafStat st;
     struct cache_entry *ce;
+    AddOptions options;
+
+    memset (&options, 0, sizeof(options));
+    options.changeset = repo->changeset;
+    options.sparse_rules = repo->sparse_rules;
+    options.partial_commit_size = repo->partial_commit_size;
+    options.indexer = file_indexer_new (repo->id, repo->version, crypt, index_cb);
 
     while ((path = g_queue_pop_head (remain_files)) != NULL) {
         full_path = g_build_filename (repo->worktree, path, NULL);
@@ -2548,7 +3426,17 @@ add_remain_files (SeafRepo *repo, struct index_state *istate,
     g_free (base_name);
 #endif
 
-        if (S_ISREG(st.st_mode)) {
+        if (S_ISREG(st.st_mode) && !index_entry_uptodate (istate, path, &st)) {
+            file_indexer_submit (options.indexer, path, full_path, &st);
+            *total_size += (gint64)(st.st_size);
+            apply_indexed_files (repo->id, repo->email, istate, total_size,
+                                 &options, FALSE);
+            if (*total_size >= repo->partial_commit_size) {
+                g_free (path);
+                g_free (full_path);
+                break;
+            }
+        } else if (S_ISREG(st.st_mode)) {
             gboolean added = FALSE;
             int ret = 0;
             ret = add_to_index (repo->id, repo->version, istate, path, full_path,
@@ -2564,7 +3452,7 @@ add_remain_files (SeafRepo *repo, struct index_state *istate,
                                   NULL);
 
                 *total_size += (gint64)(st.st_size);
-                if (*total_size >= MAX_COMMIT_SIZE) {
+                if (*total_size >= repo->partial_commit_size) {
                     g_free (path);
                     g_free (full_path);
                     break;
@@ -2606,6 +3494,10 @@ add_remain_files (SeafRepo *repo, struct index_state *istate,
         g_free (full_path);
     }
 
+    apply_indexed_files (repo->id, repo->email, istate, total_size,
+                         &options, TRUE);
+    file_indexer_free (options.indexer);
+
     return 0;
 }
 
@@ -2641,7 +3533,7 @@ out:
 static void
 try_add_empty_parent_dir_entry_from_wt (const char *worktree,
                                         struct index_state *istate,
-                                        GList *ignore_list,
+                                        IgnoreRules *ignore_list,
                                         const char *path)
 {
     if (index_name_exists (istate, path, strlen(path), 0) != NULL)
@@ -2745,7 +3637,7 @@ scan_subtree_for_deletion (const char *repo_id,
                            struct index_state *istate,
                            const char *worktree,
                            const char *path,
-                           GList *ignore_list,
+                           IgnoreRules *ignore_list,
                            LockedFileSet *fset,
                            gboolean is_readonly,
                            GList **scanned_dirs,
@@ -2856,7 +3748,7 @@ scan_subtree_for_deletion (const char *repo_id,
                            struct index_state *istate,
                            const char *worktree,
                            const char *path,
-                           GList *ignore_list,
+                           IgnoreRules *ignore_list,
                            LockedFileSet *fset,
                            gboolean is_readonly,
                            GList **scanned_dirs,
@@ -2868,7 +3760,7 @@ scan_subtree_for_deletion (const char *repo_id,
 /* Return TRUE if the caller should stop processing next event. */
 static gboolean
 handle_add_files (SeafRepo *repo, struct index_state *istate,
-                  SeafileCrypt *crypt, GList *ignore_list,
+                  SeafileCrypt *crypt, IgnoreRules *ignore_list,
                   LockedFileSet *fset,
                   WTStatus *status, WTEvent *event,
                   GList **scanned_dirs, gint64 *total_size)
@@ -2888,17 +3780,17 @@ handle_add_files (SeafRepo *repo, struct index_state *istate,
         add_path_to_index (repo, istate, crypt, event->path,
                            ignore_list, scanned_dirs,
                            total_size, &remain_files, fset);
-        if (*total_size >= MAX_COMMIT_SIZE) {
+        if (*total_size >= repo->partial_commit_size) {
             seaf_message ("Creating partial commit after adding %s.\n",
                           event->path);
 
             status->partial_commit = TRUE;
 
             /* An event for a new folder may contain many files.
-             * If the total_size become larger than 100MB after adding
-             * some of these files, the remaining file paths will be
-             * cached in remain files. This way we don't need to scan
-             * the folder again next time.
+             * If the total_size become larger than the partial commit
+             * size after adding some of these files, the remaining file
+             * paths will be cached in remain files. This way we don't
+             * need to scan the folder again next time.
              */
             if (remain_files) {
                 if (g_queue_get_length (remain_files) == 0) {
@@ -2912,7 +3804,7 @@ handle_add_files (SeafRepo *repo, struct index_state *istate,
                 event->remain_files = remain_files;
 
                 pthread_mutex_lock (&status->q_lock);
-                g_queue_push_head (status->event_q, event);
+                wt_status_requeue_event (status, event);
                 pthread_mutex_unlock (&status->q_lock);
 
                 info = seaf_sync_manager_get_sync_info (seaf->sync_mgr, repo->id);
@@ -2931,7 +3823,7 @@ handle_add_files (SeafRepo *repo, struct index_state *istate,
                           ignore_list, total_size);
         if (g_queue_get_length (event->remain_files) != 0) {
             pthread_mutex_lock (&status->q_lock);
-            g_queue_push_head (status->event_q, event);
+            wt_status_requeue_event (status, event);
             pthread_mutex_unlock (&status->q_lock);
             return TRUE;
         } else {
@@ -2939,7 +3831,7 @@ handle_add_files (SeafRepo *repo, struct index_state *istate,
             info->end_multipart_upload = TRUE;
             return TRUE;
         }
-        if (*total_size >= MAX_COMMIT_SIZE)
+        if (*total_size >= repo->partial_commit_size)
             return TRUE;
     }
 
@@ -3147,7 +4039,7 @@ update_active_file (SeafRepo *repo,
 typedef struct _UpdatePathData {
     SeafRepo *repo;
     struct index_state *istate;
-    GList *ignore_list;
+    IgnoreRules *ignore_list;
 
     const char *parent;
     const char *full_parent;
@@ -3155,11 +4047,12 @@ typedef struct _UpdatePathData {
 } UpdatePathData;
 
 static void
-update_active_path_recursive (SeafRepo *repo,
-                              const char *path,
-                              struct index_state *istate,
-                              GList *ignore_list,
-                              gboolean ignored);
+update_active_dir_win32 (SeafRepo *repo,
+                         const char *path,
+                         const wchar_t *full_path_w,
+                         struct index_state *istate,
+                         IgnoreRules *ignore_list,
+                         gboolean ignored);
 
 static int
 update_active_path_cb (wchar_t *full_parent_w,
@@ -3179,17 +4072,24 @@ update_active_path_cb (wchar_t *full_parent_w,
 
     path = g_build_path ("/", upd_data->parent, dname, NULL);
 
-    if (upd_data->ignored || should_ignore (upd_data->full_parent, dname, upd_data->ignore_list))
+    if (upd_data->ignored ||
+        should_ignore (upd_data->full_parent, dname,
+                       (fdata->dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0,
+                       upd_data->ignore_list))
         ignored = TRUE;
 
     seaf_stat_from_find_data (fdata, &st);
 
     if (fdata->dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
-        update_active_path_recursive (upd_data->repo,
-                                      path,
-                                      upd_data->istate,
-                                      upd_data->ignore_list,
-                                      ignored);
+        wchar_t *sub_path_w = build_sub_path_w (full_parent_w,
+                                                fdata->cFileName);
+        update_active_dir_win32 (upd_data->repo,
+                                 path,
+                                 sub_path_w,
+                                 upd_data->istate,
+                                 upd_data->ignore_list,
+                                 ignored);
+        g_free (sub_path_w);
     } else {
         update_active_file (upd_data->repo,
                             path,
@@ -3205,14 +4105,14 @@ update_active_path_cb (wchar_t *full_parent_w,
 }
 
 static void
-update_active_path_recursive (SeafRepo *repo,
-                              const char *path,
-                              struct index_state *istate,
-                              GList *ignore_list,
-                              gboolean ignored)
+update_active_dir_win32 (SeafRepo *repo,
+                         const char *path,
+                         const wchar_t *full_path_w,
+                         struct index_state *istate,
+                         IgnoreRules *ignore_list,
+                         gboolean ignored)
 {
     char *full_path;
-    wchar_t *full_path_w;
     int ret = 0;
     UpdatePathData upd_data;
 
@@ -3226,9 +4126,8 @@ update_active_path_recursive (SeafRepo *repo,
     upd_data.full_parent = full_path;
     upd_data.ignored = ignored;
 
-    full_path_w = win32_long_path (full_path);
-    ret = traverse_directory_win32 (full_path_w, update_active_path_cb, &upd_data);
-    g_free (full_path_w);
+    ret = traverse_directory_win32 ((wchar_t *)full_path_w,
+                                    update_active_path_cb, &upd_data);
     g_free (full_path);
 
     if (ret < 0)
@@ -3267,13 +4166,30 @@ update_active_path_recursive (SeafRepo *repo,
     }
 }
 
+static void
+update_active_path_recursive (SeafRepo *repo,
+                              const char *path,
+                              struct index_state *istate,
+                              IgnoreRules *ignore_list,
+                              gboolean ignored)
+{
+    char *full_path = g_build_filename (repo->worktree, path, NULL);
+    wchar_t *full_path_w = win32_long_path (full_path);
+
+    update_active_dir_win32 (repo, path, full_path_w, istate,
+                             ignore_list, ignored);
+
+    g_free (full_path_w);
+    g_free (full_path);
+}
+
 #else
 
 static void
 update_active_path_recursive (SeafRepo *repo,
                               const char *path,
                               struct index_state *istate,
-                              GList *ignore_list,
+                              IgnoreRules *ignore_list,
                               gboolean ignored)
 {
     GDir *dir;
@@ -3301,10 +4217,6 @@ update_active_path_recursive (SeafRepo *repo,
         sub_path = g_strconcat (path, "/", dname, NULL);
         full_sub_path = g_strconcat (full_path, "/", dname, NULL);
 
-        ignore_sub = FALSE;
-        if (ignored || should_ignore(full_path, dname, ignore_list))
-            ignore_sub = TRUE;
-
         if (stat (full_sub_path, &st) < 0) {
             seaf_warning ("Failed to stat %s: %s.\n", full_sub_path, strerror(errno));
             g_free (dname);
@@ -3313,6 +4225,11 @@ update_active_path_recursive (SeafRepo *repo,
             continue;
         }
 
+        ignore_sub = FALSE;
+        if (ignored || should_ignore(full_path, dname, S_ISDIR(st.st_mode),
+                                     ignore_list))
+            ignore_sub = TRUE;
+
         if (S_ISDIR(st.st_mode)) {
             update_active_path_recursive (repo, sub_path, istate, ignore_list,
                                           ignore_sub);
@@ -3366,7 +4283,7 @@ update_active_path_recursive (SeafRepo *repo,
 
 static void
 process_active_path (SeafRepo *repo, const char *path,
-                     struct index_state *istate, GList *ignore_list)
+                     struct index_state *istate, IgnoreRules *ignore_list)
 {
     SeafStat st;
     gboolean ignored = FALSE;
@@ -3377,7 +4294,7 @@ process_active_path (SeafRepo *repo, const char *path,
         return;
     }
 
-    if (check_full_path_ignore (repo->worktree, path, ignore_list))
+    if (check_full_path_ignore (repo, path, S_ISDIR(st.st_mode), ignore_list))
         ignored = TRUE;
 
     if (S_ISREG(st.st_mode)) {
@@ -3396,7 +4313,7 @@ process_active_path (SeafRepo *repo, const char *path,
 
 /* static void */
 /* process_active_folder (SeafRepo *repo, const char *dir, */
-/*                        struct index_state *istate, GList *ignore_list) */
+/*                        struct index_state *istate, IgnoreRules *ignore_list) */
 /* { */
 /*     GList *add = NULL, *mod = NULL, *del = NULL; */
 /*     GList *p; */
@@ -3430,7 +4347,7 @@ process_active_path (SeafRepo *repo, const char *path,
 
 static void
 update_path_sync_status (SeafRepo *repo, WTStatus *status,
-                         struct index_state *istate, GList *ignore_list)
+                         struct index_state *istate, IgnoreRules *ignore_list)
 {
     char *path;
 
@@ -3485,12 +4402,15 @@ is_seafile_backup_file (const char *path)
 
 static void
 handle_rename (SeafRepo *repo, struct index_state *istate,
-               SeafileCrypt *crypt, GList *ignore_list,
+               SeafileCrypt *crypt, IgnoreRules *ignore_list,
                LockedFileSet *fset,
                WTEvent *event, GList **scanned_del_dirs,
                gint64 *total_size)
 {
     gboolean not_found, src_ignored, dst_ignored;
+    char *full_path;
+    SeafStat st;
+    gboolean is_dir;
 
     seaf_sync_manager_delete_active_path (seaf->sync_mgr, repo->id, event->path);
 
@@ -3519,8 +4439,13 @@ handle_rename (SeafRepo *repo, struct index_state *istate,
         return;
     }
 
-    src_ignored = check_full_path_ignore(repo->worktree, event->path, ignore_list);
-    dst_ignored = check_full_path_ignore(repo->worktree, event->new_path, ignore_list);
+    /* The source is gone, it has the same type as the destination. */
+    full_path = g_build_filename (repo->worktree, event->new_path, NULL);
+    is_dir = (seaf_stat (full_path, &st) == 0 && S_ISDIR(st.st_mode));
+    g_free (full_path);
+
+    src_ignored = check_full_path_ignore (repo, event->path, is_dir, ignore_list);
+    dst_ignored = check_full_path_ignore (repo, event->new_path, is_dir, ignore_list);
 
     /* If the destination path is ignored, just remove the source path. */
     if (dst_ignored) {
@@ -3583,6 +4508,8 @@ handle_rename (SeafRepo *repo, struct index_state *istate,
     options.fset = fset;
     options.is_repo_ro = repo->is_readonly;
     options.changeset = repo->changeset;
+    options.sparse_rules = repo->sparse_rules;
+    options.partial_commit_size = repo->partial_commit_size;
 
     /* We should always scan the destination to compare with the renamed
      * index entries. For example, in the following case:
@@ -3865,7 +4792,52 @@ do_unlock_office_file (LockOfficeJob *job)
     seaf_filelock_manager_mark_file_unlocked (seaf->filelock_mgr, repo->id, job->path);
 }
 
-#if 0
+/* Auto locked files are unlocked when their lock files are deleted. This
+ * only catches the ones whose delete events were missed, e.g. while the
+ * daemon wasn't running.
+ */
+#define UNLOCK_CLOSED_OFFICE_FILES_INTERVAL (30 * 60 * G_USEC_PER_SEC)
+
+/* Lock files whose delete events were missed are still tracked, so they
+ * are checked on disk. Those that are gone are forgotten.
+ */
+static gboolean
+has_office_lock_file (const char *repo_id, const char *worktree,
+                      const char *path)
+{
+    SeafRepoManagerPriv *priv = seaf->repo_mgr->priv;
+    GHashTableIter iter;
+    gpointer key, value;
+    GList *keys = NULL, *ptr;
+    char *lock_path;
+    gboolean ret = FALSE;
+
+    pthread_mutex_lock (&priv->office_lock_files_lock);
+    g_hash_table_iter_init (&iter, priv->office_lock_files);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        if (strncmp ((char *)key, repo_id, 36) == 0 &&
+            strcmp ((char *)value, path) == 0)
+            keys = g_list_prepend (keys, g_strdup ((char *)key));
+    }
+    pthread_mutex_unlock (&priv->office_lock_files_lock);
+
+    for (ptr = keys; ptr; ptr = ptr->next) {
+        /* Keys are the repo id and the lock file path, joined by '/'. */
+        lock_path = g_build_filename (worktree, (char *)ptr->data + 37, NULL);
+        if (seaf_util_exists (lock_path)) {
+            ret = TRUE;
+        } else {
+            pthread_mutex_lock (&priv->office_lock_files_lock);
+            g_hash_table_remove (priv->office_lock_files, ptr->data);
+            pthread_mutex_unlock (&priv->office_lock_files_lock);
+        }
+        g_free (lock_path);
+    }
+
+    g_list_free_full (keys, g_free);
+    return ret;
+}
+
 static void
 unlock_closed_office_files ()
 {
@@ -3878,17 +4850,15 @@ unlock_closed_office_files ()
     for (ptr = locked_files; ptr; ptr = ptr->next) {
         info = ptr->data;
 
-        seaf_message ("%s %s.\n", info->repo_id, info->path);
-
         repo = seaf_repo_manager_get_repo (seaf->repo_mgr, info->repo_id);
-        if (!repo)
+        if (!repo || !repo->worktree)
             continue;
 
-        seaf_message ("1\n");
+        /* Still open, its lock file hasn't been deleted yet. */
+        if (has_office_lock_file (info->repo_id, repo->worktree, info->path))
+            continue;
 
         if (!do_check_file_locked (info->path, repo->worktree, FALSE)) {
-            seaf_message ("2\n");
-
             job = g_new0 (LockOfficeJob, 1);
             memcpy (job->repo_id, info->repo_id, 36);
             job->path = g_strdup(info->path);
@@ -3899,7 +4869,6 @@ unlock_closed_office_files ()
 
     g_list_free_full (locked_files, (GDestroyNotify)file_lock_info_free);
 }
-#endif
 
 static void *
 lock_office_file_worker (void *vdata)
@@ -3907,12 +4876,15 @@ lock_office_file_worker (void *vdata)
     GAsyncQueue *queue = (GAsyncQueue *)vdata;
     LockOfficeJob *job;
 
-    /* unlock_closed_office_files (); */
+    unlock_closed_office_files ();
 
     while (1) {
-        job = g_async_queue_pop (queue);
-        if (!job)
-            break;
+        job = g_async_queue_timeout_pop (queue,
+                                         UNLOCK_CLOSED_OFFICE_FILES_INTERVAL);
+        if (!job) {
+            unlock_closed_office_files ();
+            continue;
+        }
 
         if (job->lock)
             do_lock_office_file (job);
@@ -3925,6 +4897,41 @@ lock_office_file_worker (void *vdata)
     return NULL;
 }
 
+static void
+add_office_lock_file (SeafRepo *repo, const char *lock_path,
+                      const char *office_path)
+{
+    SeafRepoManagerPriv *priv = seaf->repo_mgr->priv;
+
+    pthread_mutex_lock (&priv->office_lock_files_lock);
+    g_hash_table_replace (priv->office_lock_files,
+                          g_strconcat (repo->id, "/", lock_path, NULL),
+                          g_strdup (office_path));
+    pthread_mutex_unlock (&priv->office_lock_files_lock);
+}
+
+/* Returns the office file locked by @lock_path, or NULL if the lock file
+ * wasn't created since the daemon started.
+ */
+static char *
+take_office_lock_file (SeafRepo *repo, const char *lock_path)
+{
+    SeafRepoManagerPriv *priv = seaf->repo_mgr->priv;
+    char *key = g_strconcat (repo->id, "/", lock_path, NULL);
+    gpointer orig_key = NULL, office_path = NULL;
+
+    pthread_mutex_lock (&priv->office_lock_files_lock);
+    if (g_hash_table_lookup_extended (priv->office_lock_files, key,
+                                      &orig_key, &office_path)) {
+        g_hash_table_steal (priv->office_lock_files, key);
+        g_free (orig_key);
+    }
+    pthread_mutex_unlock (&priv->office_lock_files_lock);
+
+    g_free (key);
+    return office_path;
+}
+
 static void
 lock_office_file_on_server (SeafRepo *repo, const char *path)
 {
@@ -3963,12 +4970,12 @@ unlock_office_file_on_server (SeafRepo *repo, const char *path)
 
 static int
 apply_worktree_changes_to_index (SeafRepo *repo, struct index_state *istate,
-                                 SeafileCrypt *crypt, GList *ignore_list,
+                                 SeafileCrypt *crypt, IgnoreRules *ignore_list,
                                  LockedFileSet *fset, GList **event_list)
 {
     WTStatus *status;
     WTEvent *event, *next_event;
-    gboolean not_found;
+    gboolean not_found, has_dup;
 #if defined WIN32 || defined __APPLE__
     char *office_path = NULL;
 #endif
@@ -3985,53 +4992,73 @@ apply_worktree_changes_to_index (SeafRepo *repo, struct index_state *istate,
     GList *scanned_dirs = NULL, *scanned_del_dirs = NULL;
 
     WTEvent *last_event;
+    guint64 last_seq;
 
+    /* Queued events may be merged and freed by the monitor thread, so only
+     * the sequence number of the last one is kept.
+     */
     pthread_mutex_lock (&status->q_lock);
     last_event = g_queue_peek_tail (status->event_q);
+    last_seq = last_event ? last_event->seq : 0;
     pthread_mutex_unlock (&status->q_lock);
 
     if (!last_event) {
         seaf_message ("All events are processed for repo %s.\n", repo->id);
         status->partial_commit = FALSE;
+        wt_status_mark_applied (status);
         goto out;
     }
 
     gint64 total_size = 0;
 
     while (1) {
+        /* The monitor thread may merge or drop queued events, so
+         * next_event is only looked at while holding q_lock.
+         */
         pthread_mutex_lock (&status->q_lock);
-        event = g_queue_pop_head (status->event_q);
+        event = wt_status_pop_event (status);
         next_event = g_queue_peek_head (status->event_q);
-        pthread_mutex_unlock (&status->q_lock);
-        if (!event)
-            break;
-
-        WTEvent *copy = wt_event_new (event->ev_type, event->path, event->new_path);
-        *event_list = g_list_prepend (*event_list, copy);
+        has_dup = FALSE;
+        if (event) {
+            WTEvent *copy = wt_event_new (event->ev_type, event->path, event->new_path);
+            *event_list = g_list_prepend (*event_list, copy);
+        }
+        if (event && next_event) {
+            has_dup = (next_event->ev_type == event->ev_type &&
+                       g_strcmp0 (next_event->path, event->path) == 0);
 
 #ifdef WIN32
-        // If a file or dir is moved, REMOVED and ADDED event will be emitted by the kernel.
-        // When the kernel first emits the REMOVED event of the file or dir, and then emits the ADDED event of the file or dir,
-        // it indicates that this is a move event.
-        if (next_event && event->ev_type == WT_EVENT_DELETE) {
-            char *event_base_name = g_path_get_basename (event->path);
-            char *next_event_base_name  = g_path_get_basename (next_event->path);
-            if (next_event->ev_type == WT_EVENT_CREATE_OR_UPDATE && g_strcmp0(event_base_name, next_event_base_name) == 0) {
-                WTEvent *new_event =  wt_event_new (WT_EVENT_RENAME, event->path, next_event->path);
-
-                pthread_mutex_lock (&status->q_lock);
-                next_event = g_queue_pop_head (status->event_q);
-                pthread_mutex_unlock (&status->q_lock);
-
-                wt_event_free (event);
-                wt_event_free (next_event);
-
-                event = new_event;
+            // If a file or dir is moved, REMOVED and ADDED event will be emitted by the kernel.
+            // When the kernel first emits the REMOVED event of the file or dir, and then emits the ADDED event of the file or dir,
+            // it indicates that this is a move event.
+            if (event->ev_type == WT_EVENT_DELETE &&
+                next_event->ev_type == WT_EVENT_CREATE_OR_UPDATE) {
+                char *event_base_name = g_path_get_basename (event->path);
+                char *next_event_base_name  = g_path_get_basename (next_event->path);
+                if (g_strcmp0(event_base_name, next_event_base_name) == 0) {
+                    WTEvent *new_event =  wt_event_new (WT_EVENT_RENAME, event->path, next_event->path);
+
+                    next_event = wt_status_pop_event (status);
+                    new_event->seq = MAX (event->seq, next_event->seq);
+
+                    wt_event_free (event);
+                    wt_event_free (next_event);
+
+                    event = new_event;
+                    has_dup = FALSE;
+                }
+                g_free (event_base_name);
+                g_free (next_event_base_name);
             }
-            g_free (event_base_name);
-            g_free (next_event_base_name);
-        }
 #endif
+        }
+        pthread_mutex_unlock (&status->q_lock);
+        if (!event) {
+            seaf_message ("All events are processed for repo %s.\n", repo->id);
+            status->partial_commit = FALSE;
+            wt_status_mark_applied (status);
+            break;
+        }
 
         /* Scanned dirs list is used to avoid redundant scan of consecutive
            CREATE_OR_UPDATE events. When we see other events, we should
@@ -4051,9 +5078,7 @@ apply_worktree_changes_to_index (SeafRepo *repo, struct index_state *istate,
             /* If consecutive CREATE_OR_UPDATE events present
                in the event queue, only process the last one.
             */
-            if (next_event &&
-                next_event->ev_type == event->ev_type &&
-                strcmp (next_event->path, event->path) == 0)
+            if (has_dup)
                 break;
 
             /* CREATE_OR_UPDATE event tells us the exact path of changed file/dir.
@@ -4090,8 +5115,10 @@ apply_worktree_changes_to_index (SeafRepo *repo, struct index_state *istate,
 
 #if defined WIN32 || defined __APPLE__
             office_path = NULL;
-            if (is_office_lock_file (repo->worktree, event->path, &office_path))
+            if (is_office_lock_file (repo->worktree, event->path, &office_path)) {
+                add_office_lock_file (repo, event->path, office_path);
                 lock_office_file_on_server (repo, office_path);
+            }
             g_free (office_path);
 #endif
 
@@ -4116,13 +5143,18 @@ apply_worktree_changes_to_index (SeafRepo *repo, struct index_state *istate,
                                                   event->path);
 
 #if defined WIN32 || defined __APPLE__
-            office_path = NULL;
-            if (is_office_lock_file (repo->worktree, event->path, &office_path))
+            /* The office file was found when the lock file was created,
+             * no need to search its dir again.
+             */
+            office_path = take_office_lock_file (repo, event->path);
+            if (office_path ||
+                is_office_lock_file (repo->worktree, event->path, &office_path))
                 unlock_office_file_on_server (repo, office_path);
             g_free (office_path);
 #endif
 
-            if (check_full_path_ignore(repo->worktree, event->path, ignore_list))
+            /* The path is gone, dir rules don't match the path itself. */
+            if (check_full_path_ignore (repo, event->path, FALSE, ignore_list))
                 break;
 
             if (!is_path_writable(repo->id,
@@ -4180,10 +5212,12 @@ apply_worktree_changes_to_index (SeafRepo *repo, struct index_state *istate,
             break;
         }
 
-        if (event == last_event) {
+        /* An event merged into a later one is covered by it. */
+        if (event->seq >= last_seq) {
             wt_event_free (event);
             seaf_message ("All events are processed for repo %s.\n", repo->id);
             status->partial_commit = FALSE;
+            wt_status_mark_applied (status);
             break;
         } else
             wt_event_free (event);
@@ -4203,7 +5237,7 @@ index_add (SeafRepo *repo, struct index_state *istate,
 {
     SeafileCrypt *crypt = NULL;
     LockedFileSet *fset = NULL;
-    GList *ignore_list = NULL;
+    IgnoreRules *ignore_list = NULL;
     int ret = 0;
 
     if (repo->encrypted) {
@@ -4215,7 +5249,9 @@ index_add (SeafRepo *repo, struct index_state *istate,
         fset = seaf_repo_manager_get_locked_file_set (seaf->repo_mgr, repo->id);
 #endif
 
-    ignore_list = seaf_repo_load_ignore_files (repo->worktree);
+    ignore_list = ignore_rules_load (repo->worktree);
+
+    index_begin_batch (istate);
 
     if (!is_force_commit) {
         if (apply_worktree_changes_to_index (repo, istate, crypt, ignore_list, fset, event_list) < 0) {
@@ -4227,7 +5263,9 @@ index_add (SeafRepo *repo, struct index_state *istate,
         ret = -1;
     }
 
-    seaf_repo_free_ignore_files (ignore_list);
+    index_end_batch (istate);
+
+    ignore_rules_unref (ignore_list);
 
 #if defined WIN32 || defined __APPLE__
     locked_file_set_free (fset);
@@ -4238,6 +5276,35 @@ index_add (SeafRepo *repo, struct index_state *istate,
     return ret;
 }
 
+/* Record in the worktree journal that all changes up to the applied
+ * position are now in the index on disk.
+ */
+static void
+save_worktree_journal (SeafRepo *repo)
+{
+    WTStatus *status;
+    char *source = NULL;
+    gint64 pos;
+
+    status = seaf_wt_monitor_get_worktree_status (seaf->wt_monitor, repo->id);
+    if (!status)
+        return;
+
+    pthread_mutex_lock (&status->q_lock);
+    pos = status->applied_pos;
+    if (status->journal_source && pos > status->saved_pos) {
+        source = g_strdup (status->journal_source);
+        status->saved_pos = pos;
+    }
+    pthread_mutex_unlock (&status->q_lock);
+
+    if (source)
+        wt_journal_save (repo->id, repo->worktree, source, pos);
+
+    g_free (source);
+    wt_status_unref (status);
+}
+
 static int
 commit_tree (SeafRepo *repo, const char *root_id,
              const char *desc, char commit_id[])
@@ -4258,8 +5325,20 @@ commit_tree (SeafRepo *repo, const char *root_id,
 
     seaf_repo_to_commit (repo, commit);
 
-    if (seaf_commit_manager_add_commit (seaf->commit_mgr, commit) < 0)
+    /* Make sure the commit object is on disk before the branch points to it. */
+    seaf_obj_store_begin_batch (seaf->commit_mgr->obj_store,
+                                repo->id, repo->version);
+    if (seaf_commit_manager_add_commit (seaf->commit_mgr, commit) < 0) {
+        seaf_obj_store_commit_batch (seaf->commit_mgr->obj_store,
+                                     repo->id, repo->version);
+        seaf_commit_unref (commit);
+        return -1;
+    }
+    if (seaf_obj_store_commit_batch (seaf->commit_mgr->obj_store,
+                                     repo->id, repo->version) < 0) {
+        seaf_commit_unref (commit);
         return -1;
+    }
 
     seaf_branch_set_commit (repo->head, commit->commit_id);
     seaf_branch_manager_update_branch (seaf->branch_mgr, repo->head);
@@ -4356,30 +5435,121 @@ print_event_log (const char *repo_name, const char *repo_id,
     g_string_free (msg, TRUE);
 }
 
-char *
-seaf_repo_index_commit (SeafRepo *repo,
-                        gboolean is_force_commit,
-                        gboolean is_initial_commit,
-                        GError **error)
+static SparseRules *
+load_sparse_rules (const char *repo_id, const char *key)
 {
-    SeafRepoManager *mgr = repo->manager;
-    struct index_state istate;
-    char index_path[SEAF_PATH_MAX];
-    SeafCommit *head = NULL;
-    char *new_root_id = NULL;
-    char commit_id[41];
-    ChangeSet *changeset = NULL;
-    GList *diff_results = NULL;
-    char *desc = NULL;
-    char *ret = NULL;
+    char *str;
+    SparseRules *rules = NULL;
+
+    /* Rules are validated when they're set. */
+    str = seaf_repo_manager_get_repo_property (seaf->repo_mgr, repo_id, key);
+    sparse_rules_parse (str, &rules);
+    g_free (str);
+
+    return rules;
+}
+
+/* Drops the index entries left out by the sparse rules. They're not in
+ * the changeset, so the commit keeps them as they are in the head.
+ */
+static void
+prune_sparse_index (struct index_state *istate, SparseRules *rules)
+{
+    struct cache_entry *ce;
+    unsigned int i;
+    gboolean pruned = FALSE;
+
+    for (i = 0; i < istate->cache_nr; ++i) {
+        ce = istate->cache[i];
+        if (sparse_path_ignored (rules, ce->name, S_ISDIR(ce->ce_mode))) {
+            ce->ce_flags |= CE_REMOVE;
+            pruned = TRUE;
+        }
+    }
+
+    if (pruned)
+        remove_marked_cache_entries (istate);
+}
+
+/* Index the directly uploaded @files again, with their blocks written to
+ * the block store. Their blocks changed before they could be staged.
+ */
+static int
+reindex_changed_files (SeafRepo *repo, struct index_state *istate,
+                       GList *files)
+{
+    GList *ptr;
+    const char *full_path, *path;
+    SeafStat st;
+    gboolean added;
+    struct cache_entry *ce;
+    int plen = strlen (repo->worktree);
+
+    for (ptr = files; ptr; ptr = ptr->next) {
+        full_path = ptr->data;
+        if (strncmp (full_path, repo->worktree, plen) != 0 ||
+            full_path[plen] != '/')
+            return -1;
+        path = full_path + plen + 1;
+
+        /* Drop the entry and the cached id, so that the file is chunked
+         * even if its mtime and size are the same.
+         */
+        remove_file_from_index (istate, path);
+
+        if (seaf_stat (full_path, &st) < 0 || !S_ISREG(st.st_mode)) {
+            remove_from_changeset (repo->changeset, DIFF_STATUS_DELETED,
+                                   path, TRUE, NULL);
+            continue;
+        }
+
+        seaf_file_id_cache_remove (repo->id, &st);
+
+        if (add_to_index (repo->id, repo->version, istate, path, full_path,
+                          &st, 0, NULL, index_cb, repo->email, &added) < 0) {
+            seaf_warning ("Failed to index %s again in repo %.8s.\n",
+                          path, repo->id);
+            return -1;
+        }
+
+        ce = index_name_exists (istate, path, strlen(path), 0);
+        if (ce)
+            add_to_changeset (repo->changeset, DIFF_STATUS_ADDED, ce->sha1,
+                              &st, repo->email, path, NULL);
+    }
+
+    return 0;
+}
+
+char *
+seaf_repo_index_commit (SeafRepo *repo,
+                        gboolean is_force_commit,
+                        gboolean is_initial_commit,
+                        GError **error)
+{
+    SeafRepoManager *mgr = repo->manager;
+    struct index_state istate;
+    char index_path[SEAF_PATH_MAX];
+    SeafCommit *head = NULL;
+    char *new_root_id = NULL;
+    char commit_id[41];
+    ChangeSet *changeset = NULL;
+    GList *diff_results = NULL;
+    char *desc = NULL;
+    char *ret = NULL;
     GList *event_list = NULL;
+    gboolean in_batch = FALSE;
+    gboolean pre_upload = FALSE;
+    gint64 index_start;
+    gint64 start;
+    int rc;
 
     if (!check_worktree_common (repo))
         return NULL;
 
     memset (&istate, 0, sizeof(istate));
     snprintf (index_path, SEAF_PATH_MAX, "%s/%s", mgr->index_dir, repo->id);
-    if (read_index_from (&istate, index_path, repo->version) < 0) {
+    if (seaf_index_cache_load (repo->id, repo->version, &istate) < 0) {
         seaf_warning ("Failed to load index.\n");
         g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_INTERNAL, "Internal data structure error");
         return NULL;
@@ -4393,15 +5563,69 @@ seaf_repo_index_commit (SeafRepo *repo,
 
     repo->changeset = changeset;
 
+    /* Commit the paths the worktree was checked out with. */
+    repo->sparse_rules = load_sparse_rules (repo->id, REPO_PROP_SPARSE_APPLIED);
+    if (repo->sparse_rules)
+        prune_sparse_index (&istate, repo->sparse_rules);
+
+    repo->partial_commit_size = get_partial_commit_size (repo);
+    take_indexed_bytes (repo);
+    index_start = g_get_monotonic_time ();
+
+    /* Fs objects created by this commit are synced together, before the
+     * commit object that refers to them is written.
+     */
+    seaf_obj_store_begin_batch (seaf->fs_mgr->obj_store, repo->id, repo->version);
+    in_batch = TRUE;
+
+    /* Direct blocks have to be sent or staged before the commit exists. */
+    if ((seaf->pre_upload_blocks || seaf->direct_upload) &&
+        !repo->is_readonly && repo->effective_host && repo->token)
+        pre_upload = (http_tx_manager_pre_upload_start (seaf->http_tx_mgr,
+                                                        repo->id, repo->version,
+                                                        repo->effective_host,
+                                                        repo->token,
+                                                        repo->use_fileserver_port,
+                                                        seaf->direct_upload) == 0);
+
+    start = seaf_metrics_now ();
     if (index_add (repo, &istate, is_force_commit, &event_list) < 0) {
         g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL, "Failed to add");
         goto out;
     }
+    seaf_trace_span ("index_add", start, repo->id);
+
+    update_rate (repo, &repo->index_rate, take_indexed_bytes (repo),
+                 g_get_monotonic_time () - index_start);
 
-    if (!istate.cache_changed)
+    if (!istate.cache_changed) {
+        save_worktree_journal (repo);
         goto out;
+    }
+
+    /* The upload of the new commit needs the rest of its blocks anyway.
+     * Directly uploaded files that changed before their blocks were
+     * staged are indexed again.
+     */
+    if (pre_upload) {
+        GList *changed_files = NULL;
+
+        pre_upload = FALSE;
+        if (http_tx_manager_pre_upload_finish (seaf->http_tx_mgr,
+                                               repo->id, TRUE,
+                                               &changed_files) < 0 &&
+            reindex_changed_files (repo, &istate, changed_files) < 0) {
+            string_list_free (changed_files);
+            g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                         "Files changed while being committed");
+            goto out;
+        }
+        string_list_free (changed_files);
+    }
 
+    start = seaf_metrics_now ();
     new_root_id = commit_tree_from_changeset (changeset);
+    seaf_trace_span ("commit_tree_from_changeset", start, repo->id);
     if (!new_root_id) {
         seaf_warning ("Create commit tree failed for repo %s\n", repo->id);
         g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
@@ -4423,11 +5647,15 @@ seaf_repo_index_commit (SeafRepo *repo,
         seaf_message ("No change to the fs tree of repo %s\n", repo->id);
         /* If no file modification and addition are missing, and the new root
          * id is the same as the old one, skip commiting.
+         * Checking the index against the changeset walks the whole index,
+         * so it's only done when debugging sync.
          */
-        if (!is_initial_commit && !is_force_commit)
+        if (!is_initial_commit && !is_force_commit &&
+            seafile_debug_flag_is_set (SEAFILE_DEBUG_SYNC))
             compare_index_changeset (&istate, changeset);
 
-        update_index (&istate, index_path);
+        if (update_index (&istate, index_path) == 0)
+            save_worktree_journal (repo);
         goto out;
     }
 
@@ -4436,6 +5664,17 @@ seaf_repo_index_commit (SeafRepo *repo,
     if (!desc)
         desc = g_strdup("");
 
+    in_batch = FALSE;
+    start = seaf_metrics_now ();
+    rc = seaf_obj_store_commit_batch (seaf->fs_mgr->obj_store,
+                                      repo->id, repo->version);
+    seaf_trace_span ("commit_fs_batch", start, repo->id);
+    if (rc < 0) {
+        seaf_warning ("Failed to sync fs objects for repo %s.\n", repo->id);
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_INTERNAL, "Internal error");
+        goto out;
+    }
+
     if (commit_tree (repo, new_root_id, desc, commit_id) < 0) {
         seaf_warning ("Failed to save commit file");
         g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_INTERNAL, "Internal error");
@@ -4452,11 +5691,19 @@ seaf_repo_index_commit (SeafRepo *repo,
         goto out;
     }
 
+    save_worktree_journal (repo);
+
     g_signal_emit_by_name (seaf, "repo-committed", repo);
 
     ret = g_strdup(commit_id);
 
 out:
+    if (pre_upload)
+        http_tx_manager_pre_upload_finish (seaf->http_tx_mgr, repo->id,
+                                           FALSE, NULL);
+    if (in_batch)
+        seaf_obj_store_commit_batch (seaf->fs_mgr->obj_store,
+                                     repo->id, repo->version);
     if (event_list) {
         g_list_free_full (event_list, (GDestroyNotify)wt_event_free);
     }
@@ -4464,8 +5711,10 @@ out:
     seaf_commit_unref (head);
     g_free (new_root_id);
     changeset_free (changeset);
+    sparse_rules_free (repo->sparse_rules);
+    repo->sparse_rules = NULL;
     g_list_free_full (diff_results, (GDestroyNotify)diff_entry_free);
-    discard_index (&istate);
+    seaf_index_cache_release (repo->id, &istate);
     return ret;
 }
 
@@ -4620,7 +5869,7 @@ cache_entry_from_diff_entry (DiffEntry *de)
     ce->ce_flags = namelen;
 
     memcpy (ce->sha1, de->sha1, 20);
-    ce->modifier = g_strdup(de->modifier);
+    ce->modifier = g_intern_string(de->modifier);
     ce->ce_size = de->size;
     ce->ce_mtime.sec = de->mtime;
 
@@ -4641,6 +5890,7 @@ typedef struct FileTxData {
     HttpTxTask *http_task;
     char conflict_head_id[41];
     GAsyncQueue *finished_tasks;
+    FileLockProbe *lock_probe;
 } FileTxData;
 
 typedef struct FileTxTask {
@@ -4653,6 +5903,30 @@ typedef struct FileTxTask {
     int result;
     gboolean no_checkout;
     gboolean force_conflict;
+
+    /* Set for entries produced by the dir expansion thread. A task without
+     * diff entry marks the end of expansion.
+     */
+    gboolean expanded;
+    /* The task holds one of the expansion slots. */
+    gboolean holds_slot;
+    /* The file content downloaded straight into its checkout tmp file. */
+    char *staged_path;
+    /* Checked out as a placeholder, without downloading the content. */
+    gboolean placeholder;
+
+    /* Position in the fetch order, see compare_file_fetches(). */
+    int rank;
+    guint64 seq;
+
+    /* Set by prepare_file_checkout() if the file is to be written to the
+     * worktree by checkout_file_http().
+     */
+    gboolean materialize;
+    gboolean locked_on_server;
+    int checkout_result;
+    /* Path to report as conflicted once the file is checked out. */
+    char *conflict_path;
 } FileTxTask;
 
 static void
@@ -4661,10 +5935,48 @@ file_tx_task_free (FileTxTask *task)
     if (!task)
         return;
 
+    /* Not checked out. */
+    if (task->staged_path)
+        seaf_util_unlink (task->staged_path);
+
     g_free (task->path);
+    g_free (task->staged_path);
+    g_free (task->conflict_path);
     g_free (task);
 }
 
+/* Download the file into the tmp file it would be checked out to, so that
+ * its blocks don't have to be stored and then read back. Returns 1 if the
+ * blocks have to be downloaded into the block store instead.
+ */
+static int
+stream_file_http (FileTxData *data, FileTxTask *file_task, const char *file_id)
+{
+    char *tmp_path = NULL;
+    int fd, rc;
+
+    fd = seaf_fs_manager_create_checkout_tmp_file (file_task->path,
+                                                   file_task->de->mode,
+                                                   &tmp_path);
+    if (fd < 0) {
+        g_free (tmp_path);
+        return 1;
+    }
+
+    rc = http_tx_task_stream_file_blocks (data->http_task, file_id,
+                                          fd, data->crypt);
+    close (fd);
+
+    if (rc == 0) {
+        file_task->staged_path = tmp_path;
+        return 0;
+    }
+
+    seaf_util_unlink (tmp_path);
+    g_free (tmp_path);
+    return rc;
+}
+
 static int
 fetch_file_http (FileTxData *data, FileTxTask *file_task)
 {
@@ -4709,7 +6021,8 @@ fetch_file_http (FileTxData *data, FileTxTask *file_task)
             }
             /* otherwise we have to checkout the file. */
         } else {
-            if (compare_file_content (path, &st, de->sha1, crypt, repo_version) == 0) {
+            if (compare_file_content (data->repo_id, path, &st, de->sha1,
+                                      crypt, repo_version) == 0) {
                 /* This happens after the worktree file was updated,
                  * but the index was not. Just need to update the index.
                  */
@@ -4726,9 +6039,23 @@ fetch_file_http (FileTxData *data, FileTxTask *file_task)
         }
     }
 
+    /* On-demand files are hydrated when they're opened. */
+    if (!file_task->force_conflict &&
+        seaf_hydration_use_placeholder (data->repo_id, de->size)) {
+        file_task->placeholder = TRUE;
+        http_task->done_download += de->size;
+        return FETCH_CHECKOUT_SUCCESS;
+    }
+
+    /* Blocks found in worktree files don't have to be downloaded. */
+    seaf_content_index_fill_blocks (data->repo_id, repo_version,
+                                    file_id, crypt);
+
     /* Download the blocks of this file. */
     int rc;
-    rc = http_tx_task_download_file_blocks (http_task, file_id);
+    rc = stream_file_http (data, file_task, file_id);
+    if (rc == 1)
+        rc = http_tx_task_download_file_blocks (http_task, file_id);
     if (http_task->state == HTTP_TASK_STATE_CANCELED) {
         return FETCH_CHECKOUT_CANCELED;
     }
@@ -4750,10 +6077,13 @@ fetch_file_thread_func (gpointer data, gpointer user_data)
     char file_id[41];
     gboolean is_clone = tx_data->http_task->is_clone;
     int rc = FETCH_CHECKOUT_SUCCESS;
+    gint64 start;
 
     if (task->skip_fetch)
         goto out;
 
+    seaf_work_mode_apply_to_thread ();
+
     rawdata_to_hex (de->sha1, file_id, 20);
 
     /* seaf_message ("Download file %s for repo %s\n", de->name, repo_id); */
@@ -4766,7 +6096,9 @@ fetch_file_thread_func (gpointer data, gpointer user_data)
                                               SYNC_STATUS_SYNCING,
                                               TRUE);
 
+    start = seaf_metrics_now ();
     rc = fetch_file_http (tx_data, task);
+    seaf_trace_span ("fetch_file", start, de->name);
 
     /* Even if the file failed to check out, still need to update index.
      * But we have to stop after transfer errors.
@@ -4778,12 +6110,98 @@ fetch_file_thread_func (gpointer data, gpointer user_data)
     }
 
 out:
+    seaf_work_mode_restore_thread ();
     task->result = rc;
     g_async_queue_push (finished_tasks, task);
 }
 
+static void
+drop_file_fetch (gpointer data, gpointer user_data)
+{
+    FileTxTask *task = data;
+    FileTxData *tx_data = user_data;
+
+    task->result = FETCH_CHECKOUT_CANCELED;
+    g_async_queue_push (tx_data->finished_tasks, task);
+}
+
+/* Fetch order of a download. Only changed by the thread running
+ * download_files_http(), which is also the only one pushing fetches.
+ */
+typedef struct FetchOrder {
+    int order;
+    char **pins;
+    guint pins_version;
+    guint64 next_seq;
+} FetchOrder;
+
+static gint
+compare_file_fetches (gconstpointer a, gconstpointer b, gpointer user_data)
+{
+    const FileTxTask *ta = a, *tb = b;
+    FetchOrder *order = user_data;
+
+    if (ta->rank != tb->rank)
+        return ta->rank - tb->rank;
+
+    if (order->order == DOWNLOAD_ORDER_SMALL_FIRST &&
+        ta->de->size != tb->de->size)
+        return (ta->de->size < tb->de->size) ? -1 : 1;
+    if (order->order == DOWNLOAD_ORDER_RECENT_FIRST &&
+        ta->de->mtime != tb->de->mtime)
+        return (ta->de->mtime > tb->de->mtime) ? -1 : 1;
+
+    return (ta->seq < tb->seq) ? -1 : 1;
+}
+
+static void
+fetch_order_init (FetchOrder *order, const char *repo_id)
+{
+    memset (order, 0, sizeof(*order));
+    order->order = seaf_download_priority_get_order ();
+    order->pins_version = seaf_download_priority_get_version ();
+    order->pins = seaf_download_priority_get_paths (repo_id);
+}
+
+/* Re-ranks the pending fetches after the pinned folders changed. */
+static void
+fetch_order_update (FetchOrder *order, const char *repo_id,
+                    SeafTaskGroup *tasks, GHashTable *pending_tasks)
+{
+    guint version = seaf_download_priority_get_version ();
+    GHashTableIter iter;
+    gpointer value;
+    FileTxTask *task;
+
+    if (version == order->pins_version)
+        return;
+
+    order->pins_version = version;
+    g_strfreev (order->pins);
+    order->pins = seaf_download_priority_get_paths (repo_id);
+
+    g_hash_table_iter_init (&iter, pending_tasks);
+    while (g_hash_table_iter_next (&iter, NULL, &value)) {
+        task = value;
+        task->rank = seaf_download_priority_get_rank (order->pins,
+                                                      task->de->name);
+    }
+
+    seaf_task_group_resort (tasks);
+}
+
+/* Small files whose fetch is held back until their blocks have been
+ * downloaded in packs.
+ */
+typedef struct SmallFileBatch {
+    GList *tasks;
+    int n_tasks;
+} SmallFileBatch;
+
 static int
-schedule_file_fetch (GThreadPool *tpool,
+schedule_file_fetch (SeafTaskGroup *tasks,
+                     FetchOrder *order,
+                     SmallFileBatch *small_files,
                      const char *repo_id,
                      const char *repo_name,
                      const char *worktree,
@@ -4833,10 +6251,18 @@ schedule_file_fetch (GThreadPool *tpool,
     file_task->path = path;
     file_task->new_ce = new_ce;
     file_task->skip_fetch = skip_fetch;
+    file_task->rank = seaf_download_priority_get_rank (order->pins, de->name);
+    file_task->seq = order->next_seq++;
 
     if (!g_hash_table_lookup (pending_tasks, de->name)) {
         g_hash_table_insert (pending_tasks, g_strdup(de->name), file_task);
-        g_thread_pool_push (tpool, file_task, NULL);
+        if (small_files && !skip_fetch &&
+            de->size > 0 && de->size <= HTTP_MAX_PACKED_BLOCK_SIZE) {
+            small_files->tasks = g_list_prepend (small_files->tasks, file_task);
+            ++(small_files->n_tasks);
+        } else {
+            seaf_task_group_push (tasks, file_task);
+        }
     } else {
         file_tx_task_free (file_task);
     }
@@ -4844,6 +6270,43 @@ schedule_file_fetch (GThreadPool *tpool,
     return FETCH_CHECKOUT_SUCCESS;
 }
 
+static int
+flush_small_file_fetches (SeafTaskGroup *tasks, HttpTxTask *http_task,
+                          SmallFileBatch *small_files)
+{
+    GList *file_ids = NULL;
+    GList *ptr;
+    FileTxTask *task;
+    char file_id[41];
+    int rc;
+
+    if (!small_files->tasks)
+        return 0;
+
+    small_files->tasks = g_list_reverse (small_files->tasks);
+
+    for (ptr = small_files->tasks; ptr; ptr = ptr->next) {
+        task = ptr->data;
+        rawdata_to_hex (task->de->sha1, file_id, 20);
+        file_ids = g_list_prepend (file_ids, g_strdup(file_id));
+    }
+
+    rc = http_tx_task_prefetch_file_blocks (http_task, file_ids);
+    string_list_free (file_ids);
+
+    /* The tasks are still owned by pending_tasks. */
+    if (rc == 0) {
+        for (ptr = small_files->tasks; ptr; ptr = ptr->next)
+            seaf_task_group_push (tasks, ptr->data);
+    }
+
+    g_list_free (small_files->tasks);
+    small_files->tasks = NULL;
+    small_files->n_tasks = 0;
+
+    return rc;
+}
+
 static void
 cleanup_file_blocks_http (HttpTxTask *task, const char *file_id)
 {
@@ -4903,46 +6366,48 @@ check_path_conflict (const char *path, char **orig_path)
     return is_conflict;
 }
 
+/*
+ * First part of the checkout of a fetched file, on the checkout thread
+ * since it uses the lock probe and the locked file set. Sets
+ * file_task->materialize if checkout_file_http() has to write the file.
+ */
 static int
-checkout_file_http (FileTxData *data,
-                    FileTxTask *file_task,
-                    const char *worktree,
-                    GHashTable *conflict_hash,
-                    GHashTable *no_conflict_hash,
-                    const char *conflict_head_id,
-                    LockedFileSet *fset)
+prepare_file_checkout (FileTxData *data,
+                       FileTxTask *file_task,
+                       LockedFileSet *fset)
 {
     char *repo_id = data->repo_id;
-    int repo_version = data->repo_version;
-    struct cache_entry *ce = file_task->ce;
     DiffEntry *de = file_task->de;
-    SeafileCrypt *crypt = data->crypt;
-    gboolean no_checkout = file_task->no_checkout;
-    gboolean force_conflict = file_task->force_conflict;
-    HttpTxTask *http_task = data->http_task;
-    gboolean path_exists;
-    gboolean case_conflict = FALSE;
-    SeafStat st;
-    char file_id[41];
     gboolean locked_on_server = FALSE;
 
-    if (no_checkout)
+    if (file_task->no_checkout)
         return FETCH_CHECKOUT_SUCCESS;
 
     if (should_ignore_on_checkout (de->name, NULL))
         return FETCH_CHECKOUT_SUCCESS;
 
-    rawdata_to_hex (de->sha1, file_id, 20);
-
     locked_on_server = seaf_filelock_manager_is_file_locked (seaf->filelock_mgr,
                                                              repo_id, de->name);
 
 #if defined WIN32 || defined __APPLE__
-    if (do_check_file_locked (de->name, worktree, locked_on_server)) {
+    struct cache_entry *ce = file_task->ce;
+    char file_id[41];
+
+    if (file_lock_probe_check (data->lock_probe, de->name, locked_on_server)) {
         if (!locked_file_set_lookup (fset, de->name))
             send_file_sync_error_notification (repo_id, NULL, de->name,
                                                SYNC_ERROR_ID_FILE_LOCKED_BY_APP);
 
+        rawdata_to_hex (de->sha1, file_id, 20);
+
+        /* The file will be checked out from its blocks when it's unlocked. */
+        if ((file_task->staged_path || file_task->placeholder) &&
+            http_tx_task_download_file_blocks (data->http_task, file_id) < 0) {
+            seaf_warning ("Failed to download blocks of locked file %s.\n",
+                          file_task->path);
+            return FETCH_CHECKOUT_FAILED;
+        }
+
         locked_file_set_add_update (fset, de->name, LOCKED_OP_UPDATE,
                                     ce->ce_mtime.sec, file_id);
         /* Stay in syncing status if the file is locked. */
@@ -4951,6 +6416,37 @@ checkout_file_http (FileTxData *data,
     }
 #endif
 
+    file_task->locked_on_server = locked_on_server;
+    file_task->materialize = TRUE;
+
+    return FETCH_CHECKOUT_SUCCESS;
+}
+
+/*
+ * Writes a fetched file to the worktree. Files of different folders are
+ * checked out in parallel, so this only changes @file_task and its cache
+ * entry.
+ */
+static int
+checkout_file_http (FileTxData *data,
+                    FileTxTask *file_task)
+{
+    char *repo_id = data->repo_id;
+    int repo_version = data->repo_version;
+    struct cache_entry *ce = file_task->ce;
+    DiffEntry *de = file_task->de;
+    SeafileCrypt *crypt = data->crypt;
+    gboolean force_conflict = file_task->force_conflict;
+    HttpTxTask *http_task = data->http_task;
+    gboolean path_exists;
+    gboolean case_conflict = FALSE;
+    SeafStat st;
+    char file_id[41];
+    gboolean locked_on_server = file_task->locked_on_server;
+    const char *conflict_head_id = data->conflict_head_id;
+
+    rawdata_to_hex (de->sha1, file_id, 20);
+
     path_exists = (seaf_stat (file_task->path, &st) == 0);
 
     /* The worktree file may have been changed when we're downloading the blocks. */
@@ -4964,6 +6460,13 @@ checkout_file_http (FileTxData *data,
         }
     }
 
+    /* The user's version is kept, so a conflict file needs the content. */
+    if (file_task->placeholder && force_conflict) {
+        if (http_tx_task_download_file_blocks (http_task, file_id) < 0)
+            return FETCH_CHECKOUT_TRANSFER_ERROR;
+        file_task->placeholder = FALSE;
+    }
+
     /* Temporarily unlock the file if it's locked on server, so that the client
      * itself can write to it. 
      */
@@ -4973,19 +6476,43 @@ checkout_file_http (FileTxData *data,
 
     /* then checkout the file. */
     gboolean conflicted = FALSE;
-    if (seaf_fs_manager_checkout_file (seaf->fs_mgr,
-                                       repo_id,
-                                       repo_version,
-                                       file_id,
-                                       file_task->path,
-                                       de->mode,
-                                       de->mtime,
-                                       crypt,
-                                       de->name,
-                                       conflict_head_id,
-                                       force_conflict,
-                                       &conflicted,
-                                       http_task->email) < 0) {
+    gboolean streamed = (file_task->staged_path != NULL);
+    int rc;
+    if (file_task->placeholder) {
+        rc = seaf_hydration_create_placeholder (repo_id, de->name,
+                                                file_task->path, de->mode,
+                                                de->size, de->mtime);
+    } else if (streamed) {
+        rc = seaf_fs_manager_checkout_staged_file (seaf->fs_mgr,
+                                                   repo_id,
+                                                   repo_version,
+                                                   file_task->staged_path,
+                                                   file_task->path,
+                                                   de->mtime,
+                                                   de->name,
+                                                   conflict_head_id,
+                                                   force_conflict,
+                                                   &conflicted,
+                                                   http_task->email);
+        /* Moved into place or removed. */
+        g_free (file_task->staged_path);
+        file_task->staged_path = NULL;
+    } else {
+        rc = seaf_fs_manager_checkout_file (seaf->fs_mgr,
+                                            repo_id,
+                                            repo_version,
+                                            file_id,
+                                            file_task->path,
+                                            de->mode,
+                                            de->mtime,
+                                            crypt,
+                                            de->name,
+                                            conflict_head_id,
+                                            force_conflict,
+                                            &conflicted,
+                                            http_task->email);
+    }
+    if (rc < 0) {
         seaf_warning ("Failed to checkout file %s.\n", file_task->path);
 
         if (seaf_filelock_manager_is_file_locked (seaf->filelock_mgr,
@@ -5000,15 +6527,17 @@ checkout_file_http (FileTxData *data,
         seaf_filelock_manager_lock_wt_file (seaf->filelock_mgr,
                                             repo_id, de->name);
 
-    cleanup_file_blocks_http (http_task, file_id);
+    if (!streamed && !file_task->placeholder)
+        cleanup_file_blocks_http (http_task, file_id);
 
     if (conflicted) {
-        send_file_sync_error_notification (repo_id, NULL, de->name, SYNC_ERROR_ID_CONFLICT);
+        file_task->conflict_path = g_strdup (de->name);
     } else if (!http_task->is_clone) {
         char *orig_path = NULL;
         if (check_path_conflict (de->name, &orig_path))
-            send_file_sync_error_notification (repo_id, NULL, orig_path, SYNC_ERROR_ID_CONFLICT);
-        g_free (orig_path);
+            file_task->conflict_path = orig_path;
+        else
+            g_free (orig_path);
     }
 
     /* If case conflict, this file will be checked out to another path.
@@ -5085,111 +6614,251 @@ update_index:
         ce->ce_mtime.sec = de->mtime;
 }
 
-#define DEFAULT_DOWNLOAD_THREADS 3
-
-static int
-download_files_http (const char *repo_id,
-                     int repo_version,
-                     const char *worktree,
-                     struct index_state *istate,
-                     const char *index_path,
-                     SeafileCrypt *crypt,
-                     HttpTxTask *http_task,
-                     GList *results,
-                     GHashTable *conflict_hash,
-                     GHashTable *no_conflict_hash,
-                     const char *conflict_head_id,
-                     LockedFileSet *fset)
+static gboolean
+expand_dir_added_cb (SeafFSManager *mgr,
+                     const char *path,
+                     SeafDirent *dent,
+                     void *user_data,
+                     gboolean *stop)
 {
-    struct cache_entry *ce;
-    DiffEntry *de;
-    gint64 checkout_size = 0;
-    GThreadPool *tpool;
-    GAsyncQueue *finished_tasks;
-    GHashTable *pending_tasks;
-    GList *ptr;
-    FileTxTask *task;
-    int ret = FETCH_CHECKOUT_SUCCESS;
-
-    finished_tasks = g_async_queue_new ();
-
-    FileTxData data;
-    memset (&data, 0, sizeof(data));
-    memcpy (data.repo_id, repo_id, 36);
-    data.repo_version = repo_version;
-    data.crypt = crypt;
-    data.http_task = http_task;
-    memcpy (data.conflict_head_id, conflict_head_id, 40);
-    data.finished_tasks = finished_tasks;
+    GList **expanded = user_data;
+    DiffEntry *de = NULL;
+    unsigned char sha1[20];
 
-    tpool = g_thread_pool_new (fetch_file_thread_func, &data,
-                               DEFAULT_DOWNLOAD_THREADS, FALSE, NULL);
+    hex_to_rawdata (dent->id, sha1, 20);
 
-    pending_tasks = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                           g_free, (GDestroyNotify)file_tx_task_free);
+    if (S_ISDIR(dent->mode) && strcmp(dent->id, EMPTY_SHA1) == 0)
+        de = diff_entry_new (DIFF_TYPE_COMMITS, DIFF_STATUS_DIR_ADDED, sha1, path);
+    else if (S_ISREG(dent->mode))
+        de = diff_entry_new (DIFF_TYPE_COMMITS, DIFF_STATUS_ADDED, sha1, path);
 
-    for (ptr = results; ptr != NULL; ptr = ptr->next) {
-        de = ptr->data;
+    if (de) {
+        de->mtime = dent->mtime;
+        de->mode = dent->mode;
+        de->modifier = g_strdup(dent->modifier);
+        de->size = dent->size;
+        *expanded = g_list_prepend (*expanded, de);
+    }
 
-        if (de->status == DIFF_STATUS_DIR_ADDED) {
-            handle_dir_added_de (repo_id, http_task->repo_name, worktree, istate, de,
-                                 conflict_hash, no_conflict_hash);
-        } else if (de->status == DIFF_STATUS_ADDED ||
-                   de->status == DIFF_STATUS_MODIFIED) {
-            if (FETCH_CHECKOUT_FAILED == schedule_file_fetch (tpool,
-                                                              repo_id,
-                                                              http_task->repo_name,
-                                                              worktree,
-                                                              istate,
-                                                              de,
-                                                              pending_tasks,
-                                                              conflict_hash,
-                                                              no_conflict_hash))
-                continue;
+    return TRUE;
+}
+
+/*
+ * Streaming expansion of DIR_ADDED diff entries.
+ *
+ * Newly added directories are walked in a separate thread and the expanded
+ * entries are handed to download_files_http() through its finished task
+ * queue as soon as they're found. So a large clone starts fetching and
+ * checking out files right away, instead of after the whole tree has been
+ * expanded. The number of expanded entries that are not yet checked out
+ * is bounded by MAX_EXPANDED_IN_FLIGHT.
+ */
+
+#define MAX_EXPANDED_IN_FLIGHT 1000
+
+typedef struct ExpandDirData {
+    char repo_id[37];
+    int repo_version;
+    const char *root_id;
+    GList *dirs;                /* DIR_ADDED entries */
+    GAsyncQueue *out_queue;
+    /* Each expanded entry takes one slot until it's checked out. */
+    GAsyncQueue *slots;
+    gboolean stop;
+} ExpandDirData;
+
+static gboolean
+stream_dir_added_cb (SeafFSManager *mgr,
+                     const char *path,
+                     SeafDirent *dent,
+                     void *user_data,
+                     gboolean *stop)
+{
+    ExpandDirData *data = user_data;
+    GList *expanded = NULL;
+    FileTxTask *task;
+
+    expand_dir_added_cb (mgr, path, dent, &expanded, stop);
+    if (!expanded)
+        return TRUE;
+
+    g_async_queue_pop (data->slots);
+    if (data->stop) {
+        g_list_free_full (expanded, (GDestroyNotify)diff_entry_free);
+        /* Abort the traversal. */
+        return FALSE;
+    }
+
+    task = g_new0 (FileTxTask, 1);
+    task->de = expanded->data;
+    task->expanded = TRUE;
+    g_list_free (expanded);
+
+    g_async_queue_push (data->out_queue, task);
+
+    return TRUE;
+}
+
+static void *
+expand_dir_added_thread (void *vdata)
+{
+    ExpandDirData *data = vdata;
+    GList *ptr;
+    DiffEntry *de;
+    FileTxTask *done;
+    int rc = FETCH_CHECKOUT_SUCCESS;
+
+    for (ptr = data->dirs; ptr; ptr = ptr->next) {
+        de = ptr->data;
+        if (seaf_fs_manager_traverse_path (seaf->fs_mgr,
+                                           data->repo_id, data->repo_version,
+                                           data->root_id,
+                                           de->name,
+                                           stream_dir_added_cb,
+                                           data) < 0) {
+            if (!data->stop)
+                seaf_warning ("Failed to expand dir %s in repo %.8s.\n",
+                              de->name, data->repo_id);
+            rc = FETCH_CHECKOUT_FAILED;
+            break;
         }
     }
 
-    /* If there is no file need to be downloaded, return immediately. */
-    if (g_hash_table_size(pending_tasks) == 0) {
-        if (results != NULL)
-            update_index (istate, index_path);
-        goto out;
+    done = g_new0 (FileTxTask, 1);
+    done->expanded = TRUE;
+    done->result = rc;
+    g_async_queue_push (data->out_queue, done);
+
+    return NULL;
+}
+
+/* Index writes are timed apart from the phase they happen in. */
+static void
+update_index_timed (HttpTxTask *http_task,
+                    struct index_state *istate,
+                    const char *index_path)
+{
+    int prev = sync_phase_timer_switch (&http_task->timer, SYNC_PHASE_INDEX);
+
+    update_index (istate, index_path);
+    sync_phase_timer_switch (&http_task->timer, prev);
+}
+
+/* Fetched files are checked out in batches of at most this many files,
+ * by at most CHECKOUT_FILE_THREADS threads.
+ */
+#define CHECKOUT_BATCH_SIZE 256
+#define CHECKOUT_FILE_THREADS 8
+
+typedef struct CheckoutBatch {
+    /* Fetched tasks, latest first. They're still owned by pending_tasks. */
+    GList *tasks;
+    guint n_tasks;
+} CheckoutBatch;
+
+/* Checks out the files of one folder, in the order they were fetched, so
+ * that conflict files are named the same as by a sequential checkout.
+ */
+static void
+checkout_dir_files (gpointer item, gpointer user_data)
+{
+    GList *ptr;
+    FileTxTask *task;
+
+    for (ptr = item; ptr; ptr = ptr->next) {
+        task = ptr->data;
+        task->checkout_result = checkout_file_http (user_data, task);
     }
+}
 
-    char file_id[41];
-    while ((task = g_async_queue_pop (finished_tasks)) != NULL) {
-        ce = task->ce;
-        de = task->de;
+/*
+ * Checks out the fetched files of @batch. Lock checks are done first on
+ * this thread, then the files are written in parallel per folder. The
+ * index and the sync status are updated for the whole batch afterwards.
+ */
+static void
+checkout_fetched_files (FileTxData *data,
+                        CheckoutBatch *batch,
+                        struct index_state *istate,
+                        const char *index_path,
+                        LockedFileSet *fset,
+                        GHashTable *pending_tasks,
+                        GAsyncQueue *expand_slots,
+                        gint64 *checkout_size)
+{
+    HttpTxTask *http_task = data->http_task;
+    SeafTaskGroup *group;
+    GHashTable *dirs;
+    GHashTableIter iter;
+    gpointer value;
+    GQueue *files;
+    ActivePathUpdate *updates;
+    guint n_updates = 0;
+    GList *ptr;
+    FileTxTask *task;
+    struct cache_entry *ce;
+    DiffEntry *de;
+    char *parent;
+    int prev_phase;
 
-        rawdata_to_hex (de->sha1, file_id, 20);
-        /* seaf_message ("Finished downloading file %s for repo %s\n", */
-        /*               de->name, repo_id); */
+    if (!batch->tasks)
+        return;
 
-        if (task->result == FETCH_CHECKOUT_CANCELED ||
-            task->result == FETCH_CHECKOUT_TRANSFER_ERROR) {
-            ret = task->result;
-            if (task->new_ce)
-                cache_entry_free (task->ce);
-            http_task->all_stop = TRUE;
-            goto out;
+    prev_phase = sync_phase_timer_switch (&http_task->timer, SYNC_PHASE_CHECKOUT);
+
+    batch->tasks = g_list_reverse (batch->tasks);
+
+    dirs = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                  g_free, (GDestroyNotify)g_queue_free);
+    for (ptr = batch->tasks; ptr; ptr = ptr->next) {
+        task = ptr->data;
+        task->checkout_result = prepare_file_checkout (data, task, fset);
+        if (!task->materialize)
+            continue;
+
+        parent = g_path_get_dirname (task->de->name);
+        files = g_hash_table_lookup (dirs, parent);
+        if (!files) {
+            files = g_queue_new ();
+            g_hash_table_insert (dirs, parent, files);
+        } else {
+            g_free (parent);
         }
+        g_queue_push_tail (files, task);
+    }
+
+    group = seaf_task_group_new (SEAF_LANE_IO, SEAF_TASK_PRIORITY_NORMAL,
+                                 CHECKOUT_FILE_THREADS,
+                                 checkout_dir_files, data);
+    g_hash_table_iter_init (&iter, dirs);
+    while (g_hash_table_iter_next (&iter, NULL, &value)) {
+        files = value;
+        seaf_task_group_push (group, files->head);
+    }
+    seaf_task_group_free (group, FALSE);
+    g_hash_table_destroy (dirs);
+
+    updates = g_new0 (ActivePathUpdate, batch->n_tasks);
+
+    index_begin_batch (istate);
+    for (ptr = batch->tasks; ptr; ptr = ptr->next) {
+        task = ptr->data;
+        ce = task->ce;
+        de = task->de;
 
-        int rc = checkout_file_http (&data, task, worktree,
-                                     conflict_hash, no_conflict_hash,
-                                     conflict_head_id, fset);
+        if (task->conflict_path)
+            send_file_sync_error_notification (data->repo_id, NULL,
+                                               task->conflict_path,
+                                               SYNC_ERROR_ID_CONFLICT);
 
         if (!http_task->is_clone) {
-            SyncStatus status;
-            if (rc == FETCH_CHECKOUT_FAILED)
-                status = SYNC_STATUS_ERROR;
+            updates[n_updates].path = de->name;
+            updates[n_updates].mode = de->mode;
+            if (task->checkout_result == FETCH_CHECKOUT_FAILED)
+                updates[n_updates].status = SYNC_STATUS_ERROR;
             else
-                status = SYNC_STATUS_SYNCED;
-            seaf_sync_manager_update_active_path (seaf->sync_mgr,
-                                                  repo_id,
-                                                  de->name,
-                                                  de->mode,
-                                                  status,
-                                                  TRUE);
+                updates[n_updates].status = SYNC_STATUS_SYNCED;
+            ++n_updates;
         }
 
         if (task->new_ce) {
@@ -5201,118 +6870,306 @@ download_files_http (const char *repo_id,
             ce->ce_mtime.sec = de->mtime;
             ce->ce_size = de->size;
             memcpy (ce->sha1, de->sha1, 20);
-            if (ce->modifier) g_free (ce->modifier);
-            ce->modifier = g_strdup(de->modifier);
+            ce->modifier = g_intern_string(de->modifier);
             ce->ce_mode = create_ce_mode (de->mode);
         }
 
-        g_hash_table_remove (pending_tasks, de->name);
+        *checkout_size += ce->ce_size;
+    }
+    index_end_batch (istate);
 
-        if (g_hash_table_size (pending_tasks) == 0)
-            break;
+    seaf_sync_manager_update_active_paths (seaf->sync_mgr, data->repo_id,
+                                           updates, n_updates, TRUE);
+    g_free (updates);
 
-        /* Save index file to disk after checking out some size of files.
-         * This way we don't need to re-compare too many files if this
-         * checkout is interrupted.
-         */
-        checkout_size += ce->ce_size;
-        if (checkout_size >= UPDATE_CACHE_SIZE_LIMIT) {
-            update_index (istate, index_path);
-            checkout_size = 0;
-        }
+    for (ptr = batch->tasks; ptr; ptr = ptr->next) {
+        task = ptr->data;
+        if (task->holds_slot)
+            g_async_queue_push (expand_slots, GINT_TO_POINTER(1));
+        g_hash_table_remove (pending_tasks, task->de->name);
     }
 
-    update_index (istate, index_path);
+    g_list_free (batch->tasks);
+    batch->tasks = NULL;
+    batch->n_tasks = 0;
 
-out:
-    /* Wait until all threads exit.
-     * This is necessary when the download is canceled or encountered error.
+    /* Save index file to disk after checking out some size of files.
+     * This way we don't need to re-compare too many files if this
+     * checkout is interrupted.
      */
-    g_thread_pool_free (tpool, TRUE, TRUE);
-
-    /* Free all pending file task structs. */
-    g_hash_table_destroy (pending_tasks);
-
-    g_async_queue_unref (finished_tasks);
+    if (*checkout_size >= UPDATE_CACHE_SIZE_LIMIT) {
+        update_index_timed (http_task, istate, index_path);
+        *checkout_size = 0;
+    }
 
-    return ret;
+    sync_phase_timer_switch (&http_task->timer, prev_phase);
 }
 
-static gboolean
-expand_dir_added_cb (SeafFSManager *mgr,
-                     const char *path,
-                     SeafDirent *dent,
-                     void *user_data,
-                     gboolean *stop)
+static int
+download_files_http (const char *repo_id,
+                     int repo_version,
+                     const char *worktree,
+                     struct index_state *istate,
+                     const char *index_path,
+                     SeafileCrypt *crypt,
+                     HttpTxTask *http_task,
+                     GList *results,
+                     const char *remote_root,
+                     GList *dir_added,
+                     GHashTable *conflict_hash,
+                     GHashTable *no_conflict_hash,
+                     const char *conflict_head_id,
+                     LockedFileSet *fset,
+                     FileLockProbe *lock_probe)
 {
-    GList **expanded = user_data;
-    DiffEntry *de = NULL;
-    unsigned char sha1[20];
+    DiffEntry *de;
+    gint64 checkout_size = 0;
+    SeafTaskGroup *tasks;
+    GAsyncQueue *finished_tasks;
+    GHashTable *pending_tasks;
+    GList *ptr;
+    FileTxTask *task;
+    int ret = FETCH_CHECKOUT_SUCCESS;
+    ExpandDirData expand_data;
+    pthread_t expand_tid;
+    gboolean expand_running = FALSE;
+    gboolean expand_done = TRUE;
+    GList *expanded_entries = NULL;
+    SmallFileBatch small_files;
+    SmallFileBatch *psmall_files = NULL;
+    CheckoutBatch checkouts;
+    FetchOrder order;
+    int i;
 
-    hex_to_rawdata (dent->id, sha1, 20);
+    finished_tasks = g_async_queue_new ();
+    fetch_order_init (&order, repo_id);
 
-    if (S_ISDIR(dent->mode) && strcmp(dent->id, EMPTY_SHA1) == 0)
-        de = diff_entry_new (DIFF_TYPE_COMMITS, DIFF_STATUS_DIR_ADDED, sha1, path);
-    else if (S_ISREG(dent->mode))
-        de = diff_entry_new (DIFF_TYPE_COMMITS, DIFF_STATUS_ADDED, sha1, path);
+    memset (&small_files, 0, sizeof(small_files));
+    memset (&checkouts, 0, sizeof(checkouts));
+    if (http_tx_task_can_pack_blocks (http_task))
+        psmall_files = &small_files;
 
-    if (de) {
-        de->mtime = dent->mtime;
-        de->mode = dent->mode;
-        de->modifier = g_strdup(dent->modifier);
-        de->size = dent->size;
-        *expanded = g_list_prepend (*expanded, de);
-    }
+    FileTxData data;
+    memset (&data, 0, sizeof(data));
+    memcpy (data.repo_id, repo_id, 36);
+    data.repo_version = repo_version;
+    data.crypt = crypt;
+    data.http_task = http_task;
+    memcpy (data.conflict_head_id, conflict_head_id, 40);
+    data.finished_tasks = finished_tasks;
+    data.lock_probe = lock_probe;
 
-    return TRUE;
-}
+    /* Block downloads to the host are limited by the http tx manager, this
+     * only bounds the number of files being fetched at once.
+     */
+    tasks = seaf_task_group_new (SEAF_LANE_IO, SEAF_TASK_PRIORITY_NORMAL,
+                                 seaf->max_transfer_threads,
+                                 fetch_file_thread_func, &data);
+    seaf_task_group_set_cancel_func (tasks, http_tx_task_is_canceled,
+                                     http_task, drop_file_fetch);
+    seaf_task_group_set_sort_func (tasks, compare_file_fetches, &order);
 
-/*
- * Expand DIR_ADDED results into multiple ADDED results.
- */
-static int
-expand_diff_results (const char *repo_id, int version,
-                     const char *remote_root, const char *local_root,
-                     GList **results)
-{
-    GList *ptr, *next;
-    DiffEntry *de;
-    char obj_id[41];
-    GList *expanded = NULL;
+    pending_tasks = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                           g_free, (GDestroyNotify)file_tx_task_free);
 
-    ptr = *results;
-    while (ptr) {
-        de = ptr->data;
+    memset (&expand_data, 0, sizeof(expand_data));
+    expand_data.slots = g_async_queue_new ();
+
+    if (dir_added) {
+        memcpy (expand_data.repo_id, repo_id, 36);
+        expand_data.repo_version = repo_version;
+        expand_data.root_id = remote_root;
+        expand_data.dirs = dir_added;
+        expand_data.out_queue = finished_tasks;
+        for (i = 0; i < MAX_EXPANDED_IN_FLIGHT; ++i)
+            g_async_queue_push (expand_data.slots, GINT_TO_POINTER(1));
+
+        if (pthread_create (&expand_tid, NULL,
+                            expand_dir_added_thread, &expand_data) != 0) {
+            seaf_warning ("Failed to create dir expansion thread for repo %.8s.\n",
+                          repo_id);
+            ret = FETCH_CHECKOUT_FAILED;
+            goto out;
+        }
+        expand_running = TRUE;
+        expand_done = FALSE;
+    }
 
-        next = ptr->next;
+    for (ptr = results; ptr != NULL; ptr = ptr->next) {
+        de = ptr->data;
 
         if (de->status == DIFF_STATUS_DIR_ADDED) {
-            *results = g_list_delete_link (*results, ptr);
-
-            rawdata_to_hex (de->sha1, obj_id, 20);
-            if (seaf_fs_manager_traverse_path (seaf->fs_mgr,
-                                               repo_id, version,
-                                               remote_root,
-                                               de->name,
-                                               expand_dir_added_cb,
-                                               &expanded) < 0) {
-                diff_entry_free (de);
-                goto error;
+            handle_dir_added_de (repo_id, http_task->repo_name, worktree, istate, de,
+                                 conflict_hash, no_conflict_hash);
+        } else if (de->status == DIFF_STATUS_ADDED ||
+                   de->status == DIFF_STATUS_MODIFIED) {
+            if (FETCH_CHECKOUT_FAILED == schedule_file_fetch (tasks,
+                                                              &order,
+                                                              psmall_files,
+                                                              repo_id,
+                                                              http_task->repo_name,
+                                                              worktree,
+                                                              istate,
+                                                              de,
+                                                              pending_tasks,
+                                                              conflict_hash,
+                                                              no_conflict_hash))
+                continue;
+        }
+
+        if (small_files.n_tasks >= HTTP_MAX_BLOCKS_PER_PACK &&
+            flush_small_file_fetches (tasks, http_task, &small_files) < 0) {
+            ret = FETCH_CHECKOUT_TRANSFER_ERROR;
+            http_task->all_stop = TRUE;
+            goto out;
+        }
+    }
+
+    /* If there is no file need to be downloaded, return immediately. */
+    if (expand_done && g_hash_table_size(pending_tasks) == 0) {
+        if (results != NULL)
+            update_index_timed (http_task, istate, index_path);
+        goto out;
+    }
+
+    while (1) {
+        task = g_async_queue_try_pop (finished_tasks);
+        if (!task) {
+            /* Nothing else to do, fetch the small files collected so far
+             * and check out the fetched ones meanwhile.
+             */
+            if (flush_small_file_fetches (tasks, http_task, &small_files) < 0) {
+                ret = FETCH_CHECKOUT_TRANSFER_ERROR;
+                http_task->all_stop = TRUE;
+                goto out;
             }
-            diff_entry_free (de);
+            checkout_fetched_files (&data, &checkouts, istate, index_path, fset,
+                                    pending_tasks, expand_data.slots,
+                                    &checkout_size);
+            task = g_async_queue_pop (finished_tasks);
         }
 
-        ptr = next;
+        /* A folder may have been opened meanwhile. */
+        fetch_order_update (&order, repo_id, tasks, pending_tasks);
+
+        if (task->expanded) {
+            de = task->de;
+            if (!de) {
+                /* End of dir expansion. */
+                expand_done = TRUE;
+                ret = task->result;
+                file_tx_task_free (task);
+                if (ret != FETCH_CHECKOUT_SUCCESS) {
+                    http_task->all_stop = TRUE;
+                    goto out;
+                }
+                if (g_hash_table_size (pending_tasks) == checkouts.n_tasks)
+                    break;
+                continue;
+            }
+
+            file_tx_task_free (task);
+            expanded_entries = g_list_prepend (expanded_entries, de);
+
+            guint n_pending = g_hash_table_size (pending_tasks);
+            if (de->status == DIFF_STATUS_DIR_ADDED) {
+                handle_dir_added_de (repo_id, http_task->repo_name, worktree, istate, de,
+                                     conflict_hash, no_conflict_hash);
+            } else {
+                http_task->total_download += de->size;
+                schedule_file_fetch (tasks,
+                                     &order,
+                                     psmall_files,
+                                     repo_id,
+                                     http_task->repo_name,
+                                     worktree,
+                                     istate,
+                                     de,
+                                     pending_tasks,
+                                     conflict_hash,
+                                     no_conflict_hash);
+            }
+
+            if (g_hash_table_size (pending_tasks) > n_pending) {
+                task = g_hash_table_lookup (pending_tasks, de->name);
+                task->holds_slot = TRUE;
+            } else {
+                g_async_queue_push (expand_data.slots, GINT_TO_POINTER(1));
+            }
+
+            if (small_files.n_tasks >= HTTP_MAX_BLOCKS_PER_PACK &&
+                flush_small_file_fetches (tasks, http_task, &small_files) < 0) {
+                ret = FETCH_CHECKOUT_TRANSFER_ERROR;
+                http_task->all_stop = TRUE;
+                goto out;
+            }
+            continue;
+        }
+
+        if (task->result == FETCH_CHECKOUT_CANCELED ||
+            task->result == FETCH_CHECKOUT_TRANSFER_ERROR) {
+            ret = task->result;
+            if (task->new_ce)
+                cache_entry_free (task->ce);
+            http_task->all_stop = TRUE;
+            /* Keep the files fetched before the error. */
+            checkout_fetched_files (&data, &checkouts, istate, index_path, fset,
+                                    pending_tasks, expand_data.slots,
+                                    &checkout_size);
+            goto out;
+        }
+
+        checkouts.tasks = g_list_prepend (checkouts.tasks, task);
+        ++checkouts.n_tasks;
+
+        if (expand_done && g_hash_table_size (pending_tasks) == checkouts.n_tasks)
+            break;
+
+        if (checkouts.n_tasks >= CHECKOUT_BATCH_SIZE)
+            checkout_fetched_files (&data, &checkouts, istate, index_path, fset,
+                                    pending_tasks, expand_data.slots,
+                                    &checkout_size);
     }
 
-    expanded = g_list_reverse (expanded);
-    *results = g_list_concat (*results, expanded);
+    checkout_fetched_files (&data, &checkouts, istate, index_path, fset,
+                            pending_tasks, expand_data.slots, &checkout_size);
 
-    return 0;
+    update_index_timed (http_task, istate, index_path);
 
-error:
-    g_list_free_full (expanded, (GDestroyNotify)diff_entry_free);
-    return -1;
+out:
+    /* Wait until all threads exit.
+     * This is necessary when the download is canceled or encountered error.
+     */
+    seaf_task_group_free (tasks, TRUE);
+
+    if (expand_running) {
+        /* Wake up the expansion thread if it's waiting for a free slot. */
+        expand_data.stop = TRUE;
+        g_async_queue_push (expand_data.slots, GINT_TO_POINTER(1));
+        pthread_join (expand_tid, NULL);
+    }
+
+    /* Expanded entries left in the queue are not owned by pending_tasks. */
+    while ((task = g_async_queue_try_pop (finished_tasks)) != NULL) {
+        if (task->expanded) {
+            if (task->de)
+                diff_entry_free (task->de);
+            file_tx_task_free (task);
+        }
+    }
+
+    /* Free all pending file task structs. */
+    g_hash_table_destroy (pending_tasks);
+    g_list_free (small_files.tasks);
+    g_list_free (checkouts.tasks);
+
+    g_list_free_full (expanded_entries, (GDestroyNotify)diff_entry_free);
+
+    g_async_queue_unref (expand_data.slots);
+    g_async_queue_unref (finished_tasks);
+    g_strfreev (order.pins);
+
+    return ret;
 }
 
 static int
@@ -5371,12 +7228,16 @@ is_built_in_ignored_file (const char *filename)
 #ifdef WIN32
 
 /*
+ * @snapshot: mtimes of the index entries under @path, see
+ * snapshot_dir_entries(). Files that are not in it, or changed since they
+ * were checked out, are kept.
  * @path: path relative to the worktree, utf-8 encoded
- * @path_w: absolute path include worktree, utf-16 encoded.
+ * @path_w: absolute path of the folder, utf-16 encoded. It may have been
+ * moved out of the worktree.
  * Return 0 when successfully deleted the folder; otherwise -1.
  */
 static int
-delete_worktree_dir_recursive_win32 (struct index_state *istate,
+delete_worktree_dir_recursive_win32 (GHashTable *snapshot,
                                      const char *path,
                                      const wchar_t *path_w)
 {
@@ -5389,7 +7250,9 @@ delete_worktree_dir_recursive_win32 (struct index_state *istate,
     DWORD error;
     int ret = 0;
     guint64 mtime;
+    gint64 *ce_mtime;
     gboolean builtin_ignored = FALSE;
+    gboolean is_eml;
 
     path_len_w = wcslen(path_w);
 
@@ -5422,19 +7285,20 @@ delete_worktree_dir_recursive_win32 (struct index_state *istate,
 
         sub_path = g_strconcat (path, "/", dname, NULL);
         builtin_ignored = is_built_in_ignored_file(dname);
+        is_eml = is_eml_file (dname);
         g_free (dname);
 
         if (fdata.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
-            if (delete_worktree_dir_recursive_win32 (istate, sub_path, sub_path_w) < 0) {
+            if (delete_worktree_dir_recursive_win32 (snapshot, sub_path,
+                                                     sub_path_w) < 0) {
                 ret = -1;
             }
         } else {
-            struct cache_entry *ce;
             /* Files like .DS_Store and Thumbs.db should be deleted any way. */
             if (!builtin_ignored) {
                 mtime = (guint64)file_time_to_unix_time (&fdata.ftLastWriteTime);
-                ce = index_name_exists (istate, sub_path, strlen(sub_path), 0);
-                if (!ce || (!is_eml_file (dname) && ce->ce_mtime.sec != mtime)) {
+                ce_mtime = g_hash_table_lookup (snapshot, sub_path);
+                if (!ce_mtime || (!is_eml && *ce_mtime != (gint64)mtime)) {
                     seaf_message ("File %s is changed, skip deleting it.\n", sub_path);
                     g_free (sub_path_w);
                     g_free (sub_path);
@@ -5490,8 +7354,9 @@ delete_worktree_dir_recursive_win32 (struct index_state *istate,
 
 #else
 
+/* Same as delete_worktree_dir_recursive_win32(). */
 static int
-delete_worktree_dir_recursive (struct index_state *istate,
+delete_worktree_dir_recursive (GHashTable *snapshot,
                                const char *path,
                                const char *full_path)
 {
@@ -5501,6 +7366,7 @@ delete_worktree_dir_recursive (struct index_state *istate,
     GError *error = NULL;
     char *sub_path, *full_sub_path;
     SeafStat st;
+    gint64 *ce_mtime;
     int ret = 0;
     gboolean builtin_ignored = FALSE;
 
@@ -5526,14 +7392,14 @@ delete_worktree_dir_recursive (struct index_state *istate,
         }
 
         if (S_ISDIR(st.st_mode)) {
-            if (delete_worktree_dir_recursive (istate, sub_path, full_sub_path) < 0)
+            if (delete_worktree_dir_recursive (snapshot, sub_path,
+                                               full_sub_path) < 0)
                 ret = -1;
         } else {
-            struct cache_entry *ce;
             /* Files like .DS_Store and Thumbs.db should be deleted any way. */
             if (!builtin_ignored) {
-                ce = index_name_exists (istate, sub_path, strlen(sub_path), 0);
-                if (!ce || ce->ce_mtime.sec != st.st_mtime) {
+                ce_mtime = g_hash_table_lookup (snapshot, sub_path);
+                if (!ce_mtime || *ce_mtime != (gint64)st.st_mtime) {
                     seaf_message ("File %s is changed, skip deleting it.\n", full_sub_path);
                     g_free (sub_path);
                     g_free (full_sub_path);
@@ -5571,8 +7437,11 @@ delete_worktree_dir_recursive (struct index_state *istate,
 
 #define SEAFILE_RECYCLE_BIN_FOLDER "recycle-bin"
 
+/* The folder is named @name in the recycle bin, or keeps its name if @name
+ * is NULL.
+ */
 static int
-move_dir_to_recycle_bin (const char *dir_path)
+move_dir_to_recycle_bin (const char *dir_path, const char *name)
 {
     char *trash_folder = g_build_path ("/", seaf->worktree_dir, SEAFILE_RECYCLE_BIN_FOLDER, NULL);
     if (checkdir_with_mkdir (trash_folder) < 0) {
@@ -5583,7 +7452,7 @@ move_dir_to_recycle_bin (const char *dir_path)
     }
     g_free (trash_folder);
 
-    char *basename = g_path_get_basename (dir_path);
+    char *basename = name ? g_strdup (name) : g_path_get_basename (dir_path);
     char *dst_path = g_build_path ("/", seaf->worktree_dir, SEAFILE_RECYCLE_BIN_FOLDER, basename, NULL);
     int ret = 0;
 
@@ -5615,34 +7484,283 @@ out:
     return ret;
 }
 
-static void
-delete_worktree_dir (const char *repo_id,
-                     const char *repo_name,
-                     struct index_state *istate,
+/* Returns TRUE if the folder had changes and was moved to the recycle bin. */
+static gboolean
+delete_worktree_dir (GHashTable *snapshot,
                      const char *worktree,
                      const char *path)
 {
     char *full_path = g_build_path ("/", worktree, path, NULL);
+    gboolean recycled = FALSE;
 
 #ifdef WIN32
     wchar_t *full_path_w = win32_long_path (full_path);
-    delete_worktree_dir_recursive_win32 (istate, path, full_path_w);
+    delete_worktree_dir_recursive_win32 (snapshot, path, full_path_w);
     g_free (full_path_w);
 #else
-    delete_worktree_dir_recursive(istate, path, full_path);
+    delete_worktree_dir_recursive(snapshot, path, full_path);
+#endif
+
+    /* If for some reason the dir cannot be removed, try to move it to a trash folder
+     * under Seafile folder. Otherwise the removed folder will be created agian on the
+     * server, which will confuse the users.
+     */
+    if (g_file_test (full_path, G_FILE_TEST_EXISTS)) {
+        if (move_dir_to_recycle_bin (full_path, NULL) == 0)
+            recycled = TRUE;
+    }
+
+    g_free (full_path);
+    return recycled;
+}
+
+/* Index entries under @path, path -> mtime. The files in a deleted folder
+ * are checked against it, after the index entries may have been removed.
+ */
+static GHashTable *
+snapshot_dir_entries (struct index_state *istate, const char *path)
+{
+    GHashTable *snapshot;
+    struct cache_entry *ce;
+    int len = strlen (path);
+    int pos;
+    gint64 *mtime;
+
+    snapshot = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+    pos = index_name_pos (istate, path, len);
+    if (pos < 0)
+        pos = -pos - 1;
+
+    /* Names that only start with @path are sorted among those under it. */
+    for (; (unsigned int)pos < istate->cache_nr; ++pos) {
+        ce = istate->cache[pos];
+        if (strncmp (ce->name, path, len) != 0)
+            break;
+        if (ce->name[len] != '/')
+            continue;
+
+        mtime = g_new (gint64, 1);
+        *mtime = (gint64)ce->ce_mtime.sec;
+        g_hash_table_replace (snapshot, g_strdup (ce->name), mtime);
+    }
+
+    return snapshot;
+}
+
+/* Deletions of a checkout are run by at most this many threads. */
+#define CHECKOUT_DELETE_THREADS 8
+
+/*
+ * A folder deleted on the server, or the files deleted from one folder.
+ * The jobs run in parallel once the checkout thread checked the deleted
+ * paths, and only read the index; their entries are removed afterwards.
+ */
+typedef struct DeleteJob {
+    char *path;
+    gboolean is_dir;
+    /* Index entries of the files deleted from @path. */
+    GList *files;
+    /* Index entries of the folder @path, see snapshot_dir_entries(). */
+    GHashTable *snapshot;
+    /* The folder was moved here, to be purged in the background. */
+    char *trash_path;
+    /* The folder had changes and was moved to the recycle bin. */
+    gboolean recycled;
+} DeleteJob;
+
+typedef struct DeleteContext {
+    const char *worktree;
+    struct index_state *istate;
+} DeleteContext;
+
+static void
+delete_job_free (DeleteJob *job)
+{
+    g_free (job->path);
+    g_list_free (job->files);
+    if (job->snapshot)
+        g_hash_table_destroy (job->snapshot);
+    g_free (job->trash_path);
+    g_free (job);
+}
+
+/* Renames @path to a hidden name in the same folder, which is ignored by
+ * the worktree scan. A rename doesn't depend on the size of the folder.
+ */
+static char *
+move_dir_aside (const char *worktree, const char *path)
+{
+    char *full_path = g_build_path ("/", worktree, path, NULL);
+    char *parent = g_path_get_dirname (full_path);
+    char *base = g_path_get_basename (full_path);
+    char *trash_path;
+
+    trash_path = g_strdup_printf ("%s/.%s.%08x.deleted~",
+                                  parent, base, g_random_int ());
+    if (seaf_util_rename (full_path, trash_path) < 0) {
+        seaf_debug ("Failed to move %s to %s: %s.\n",
+                    full_path, trash_path, strerror(errno));
+        g_free (trash_path);
+        trash_path = NULL;
+    }
+
+    g_free (full_path);
+    g_free (parent);
+    g_free (base);
+    return trash_path;
+}
+
+/* A folder moved aside, to be deleted in the background. */
+typedef struct PurgeDir {
+    char repo_id[37];
+    char *repo_name;
+    char *path;
+    char *trash_path;
+    GHashTable *snapshot;
+    gboolean recycled;
+} PurgeDir;
+
+/* The folder was moved before it was checked, so files changed up to the
+ * move are found in it. Those are kept in the recycle bin.
+ */
+static void *
+purge_dir_thread (void *vdata)
+{
+    PurgeDir *purge = vdata;
+    char *name;
+
+#ifdef WIN32
+    wchar_t *path_w = win32_long_path (purge->trash_path);
+    delete_worktree_dir_recursive_win32 (purge->snapshot, purge->path, path_w);
+    g_free (path_w);
+#else
+    delete_worktree_dir_recursive (purge->snapshot, purge->path,
+                                   purge->trash_path);
 #endif
 
-    /* If for some reason the dir cannot be removed, try to move it to a trash folder
-     * under Seafile folder. Otherwise the removed folder will be created agian on the
-     * server, which will confuse the users.
-     */
-    if (g_file_test (full_path, G_FILE_TEST_EXISTS)) {
-        if (move_dir_to_recycle_bin (full_path) == 0)
-            send_file_sync_error_notification (repo_id, repo_name, path,
+    /* Don't leave files that are changed or in use hidden in the worktree. */
+    if (g_file_test (purge->trash_path, G_FILE_TEST_EXISTS)) {
+        name = g_path_get_basename (purge->path);
+        if (move_dir_to_recycle_bin (purge->trash_path, name) == 0)
+            purge->recycled = TRUE;
+        g_free (name);
+    }
+
+    return vdata;
+}
+
+static void
+purge_dir_done (void *result)
+{
+    PurgeDir *purge = result;
+
+    if (purge->recycled)
+        send_file_sync_error_notification (purge->repo_id, purge->repo_name,
+                                           purge->path,
+                                           SYNC_ERROR_ID_REMOVE_UNCOMMITTED_FOLDER);
+
+    g_free (purge->repo_name);
+    g_free (purge->path);
+    g_free (purge->trash_path);
+    g_hash_table_destroy (purge->snapshot);
+    g_free (purge);
+}
+
+static void
+run_delete_job (gpointer item, gpointer user_data)
+{
+    DeleteJob *job = item;
+    DeleteContext *ctx = user_data;
+    struct cache_entry *ce;
+    GList *ptr;
+
+    if (!job->is_dir) {
+        for (ptr = job->files; ptr; ptr = ptr->next) {
+            ce = ptr->data;
+            delete_path (ctx->worktree, ce->name, ce->ce_mode, ce->ce_mtime.sec);
+        }
+        return;
+    }
+
+    /* The whole folder is moved aside at once and checked against the
+     * snapshot later. If it can't be moved, the unchanged files are
+     * deleted one by one and the rest is moved to the recycle bin.
+     */
+    job->trash_path = move_dir_aside (ctx->worktree, job->path);
+    if (job->trash_path)
+        return;
+
+    job->recycled = delete_worktree_dir (job->snapshot, ctx->worktree, job->path);
+}
+
+static void
+add_file_delete_job (GHashTable *file_jobs, GList **jobs,
+                     struct cache_entry *ce)
+{
+    char *parent = g_path_get_dirname (ce->name);
+    DeleteJob *job;
+
+    job = g_hash_table_lookup (file_jobs, parent);
+    if (!job) {
+        job = g_new0 (DeleteJob, 1);
+        job->path = parent;
+        g_hash_table_insert (file_jobs, job->path, job);
+        *jobs = g_list_prepend (*jobs, job);
+    } else {
+        g_free (parent);
+    }
+
+    job->files = g_list_prepend (job->files, ce);
+}
+
+static void
+run_delete_jobs (const char *repo_id, const char *repo_name,
+                 const char *worktree, struct index_state *istate,
+                 GList *jobs)
+{
+    DeleteContext ctx;
+    SeafTaskGroup *group;
+    DeleteJob *job;
+    PurgeDir *purge;
+    GList *ptr;
+
+    if (!jobs)
+        return;
+
+    ctx.worktree = worktree;
+    ctx.istate = istate;
+
+    group = seaf_task_group_new (SEAF_LANE_IO, SEAF_TASK_PRIORITY_NORMAL,
+                                 CHECKOUT_DELETE_THREADS,
+                                 run_delete_job, &ctx);
+    for (ptr = jobs; ptr; ptr = ptr->next)
+        seaf_task_group_push (group, ptr->data);
+    seaf_task_group_free (group, FALSE);
+
+    for (ptr = jobs; ptr; ptr = ptr->next) {
+        job = ptr->data;
+        if (job->trash_path) {
+            purge = g_new0 (PurgeDir, 1);
+            memcpy (purge->repo_id, repo_id, 36);
+            purge->repo_name = g_strdup (repo_name);
+            purge->path = job->path;
+            purge->trash_path = job->trash_path;
+            purge->snapshot = job->snapshot;
+            job->path = NULL;
+            job->trash_path = NULL;
+            job->snapshot = NULL;
+
+            if (seaf_job_manager_schedule_job (seaf->job_mgr,
+                                               purge_dir_thread,
+                                               purge_dir_done,
+                                               purge) < 0)
+                purge_dir_done (purge_dir_thread (purge));
+        } else if (job->recycled) {
+            send_file_sync_error_notification (repo_id, repo_name, job->path,
                                                SYNC_ERROR_ID_REMOVE_UNCOMMITTED_FOLDER);
+        }
     }
-
-    g_free (full_path);
 }
 
 static void
@@ -5715,6 +7833,135 @@ convert_rename_to_checkout (const char *repo_id,
 }
 #endif  /* WIN32 */
 
+/*
+ * Adds the paths in the tree @dir_id that @filter passes in full to
+ * @results, as ADDED and DIR_ADDED entries if @added is TRUE, or as DELETED
+ * and DIR_DELETED entries otherwise. Used when the sparse rules change,
+ * since a diff between the trees doesn't find paths that differ only in
+ * being selected.
+ */
+static int
+collect_sparse_changes (const char *repo_id, int version,
+                        const char *dir_id, const char *basedir,
+                        DiffPathFilter filter, void *filter_data,
+                        gboolean added, GList **results)
+{
+    SeafDir *dir;
+    SeafDirent *dent;
+    DiffEntry *de;
+    GList *ptr;
+    char *path;
+    unsigned char sha1[20];
+    gboolean is_dir;
+    int match, status;
+    int ret = 0;
+
+    dir = seaf_fs_manager_get_seafdir (seaf->fs_mgr, repo_id, version, dir_id);
+    if (!dir) {
+        seaf_warning ("Failed to find dir %s in repo %.8s.\n", dir_id, repo_id);
+        return -1;
+    }
+
+    for (ptr = dir->entries; ptr && ret == 0; ptr = ptr->next) {
+        dent = ptr->data;
+        is_dir = S_ISDIR(dent->mode);
+        path = build_subpath (basedir, dent->name);
+
+        match = filter (path, is_dir, filter_data);
+        if (match == DIFF_PATH_PARTIAL) {
+            ret = collect_sparse_changes (repo_id, version, dent->id, path,
+                                          filter, filter_data, added, results);
+        } else if (match == DIFF_PATH_FULL) {
+            if (is_dir)
+                status = added ? DIFF_STATUS_DIR_ADDED : DIFF_STATUS_DIR_DELETED;
+            else
+                status = added ? DIFF_STATUS_ADDED : DIFF_STATUS_DELETED;
+
+            hex_to_rawdata (dent->id, sha1, 20);
+            de = diff_entry_new (DIFF_TYPE_COMMITS, status, sha1, path);
+            de->mtime = dent->mtime;
+            de->mode = dent->mode;
+            de->modifier = g_strdup(dent->modifier);
+            de->size = dent->size;
+            *results = g_list_prepend (*results, de);
+        }
+
+        g_free (path);
+    }
+
+    seaf_dir_free (dir);
+    return ret;
+}
+
+/*
+ * Diffs the master and remote heads for a checkout with the sparse @rules.
+ * If the rules were changed since the last checkout, the paths selected by
+ * both are diffed, paths that are only selected now are checked out from
+ * the remote head, and paths that are no longer selected are deleted like
+ * the master head had them removed.
+ */
+static int
+diff_sparse_checkout (const char *repo_id, int version,
+                      SeafCommit *master_head, SeafCommit *remote_head,
+                      const char *rules, GList **results)
+{
+    SparseRulesChange change, reverse;
+    char *applied;
+    gboolean changed;
+    int ret = -1;
+
+    applied = seaf_repo_manager_get_repo_property (seaf->repo_mgr, repo_id,
+                                                   REPO_PROP_SPARSE_APPLIED);
+    changed = (g_strcmp0 (applied, rules) != 0);
+    sparse_rules_parse (applied, &change.old_rules);
+    sparse_rules_parse (rules, &change.new_rules);
+    g_free (applied);
+
+    /* Nothing is checked out yet. */
+    if (!master_head) {
+        ret = diff_commit_roots_filtered (repo_id, version, EMPTY_SHA1,
+                                          remote_head->root_id, results, TRUE,
+                                          sparse_rules_match, change.new_rules);
+        goto out;
+    }
+
+    if (!changed) {
+        ret = diff_commit_roots_filtered (repo_id, version,
+                                          master_head->root_id,
+                                          remote_head->root_id, results, TRUE,
+                                          sparse_rules_match, change.new_rules);
+        goto out;
+    }
+
+    seaf_message ("Sparse rules of repo %.8s changed, checking out the "
+                  "selected paths.\n", repo_id);
+
+    if (diff_commit_roots_filtered (repo_id, version,
+                                    master_head->root_id,
+                                    remote_head->root_id, results, TRUE,
+                                    sparse_rules_match_kept, &change) < 0)
+        goto out;
+
+    if (collect_sparse_changes (repo_id, version, remote_head->root_id, "",
+                                sparse_rules_match_added, &change,
+                                TRUE, results) < 0)
+        goto out;
+
+    reverse.old_rules = change.new_rules;
+    reverse.new_rules = change.old_rules;
+    if (collect_sparse_changes (repo_id, version, master_head->root_id, "",
+                                sparse_rules_match_added, &reverse,
+                                FALSE, results) < 0)
+        goto out;
+
+    ret = 0;
+
+out:
+    sparse_rules_free (change.old_rules);
+    sparse_rules_free (change.new_rules);
+    return ret;
+}
+
 int
 seaf_repo_fetch_and_checkout (HttpTxTask *http_task, const char *remote_head_id)
 {
@@ -5731,10 +7978,14 @@ seaf_repo_fetch_and_checkout (HttpTxTask *http_task, const char *remote_head_id)
     struct index_state istate;
     int ret = FETCH_CHECKOUT_SUCCESS;
     GList *results = NULL;
+    GList *dir_added = NULL;
     SeafileCrypt *crypt = NULL;
     GHashTable *conflict_hash = NULL, *no_conflict_hash = NULL;
-    GList *ignore_list = NULL;
+    IgnoreRules *ignore_list = NULL;
     LockedFileSet *fset = NULL;
+    FileLockProbe *lock_probe = NULL;
+    char *sparse_rules = NULL;
+    int prev_phase;
 
     repo_id = http_task->repo_id;
     repo_version = http_task->repo_version;
@@ -5742,14 +7993,20 @@ seaf_repo_fetch_and_checkout (HttpTxTask *http_task, const char *remote_head_id)
     worktree = http_task->worktree;
     passwd = http_task->passwd;
 
+    prev_phase = sync_phase_timer_switch (&http_task->timer, SYNC_PHASE_INDEX);
+
     memset (&istate, 0, sizeof(istate));
     snprintf (index_path, SEAF_PATH_MAX, "%s/%s",
               seaf->repo_mgr->index_dir, repo_id);
-    if (read_index_from (&istate, index_path, repo_version) < 0) {
+    if (seaf_index_cache_load (repo_id, repo_version, &istate) < 0) {
         seaf_warning ("Failed to load index.\n");
+        sync_phase_timer_switch (&http_task->timer, prev_phase);
         return FETCH_CHECKOUT_FAILED;
     }
 
+    /* Diffing and applying deletes and renames to the worktree. */
+    sync_phase_timer_switch (&http_task->timer, SYNC_PHASE_CHECKOUT);
+
     if (!is_clone) {
         repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
         if (!repo) {
@@ -5791,28 +8048,43 @@ seaf_repo_fetch_and_checkout (HttpTxTask *http_task, const char *remote_head_id)
         ret = FETCH_CHECKOUT_FAILED;
         goto out;
     }
+    http_task->shared_blocks = !remote_head->encrypted;
 
-    if (diff_commit_roots (repo_id, repo_version,
-                           master_head ? master_head->root_id : EMPTY_SHA1,
-                           remote_head->root_id,
-                           &results, TRUE) < 0) {
+    sparse_rules = seaf_repo_manager_get_repo_property (seaf->repo_mgr,
+                                                        repo_id,
+                                                        REPO_PROP_SPARSE_RULES);
+    if (diff_sparse_checkout (repo_id, repo_version, master_head, remote_head,
+                              sparse_rules, &results) < 0) {
         seaf_warning ("Failed to diff for repo %.8s.\n", repo_id);
         ret = FETCH_CHECKOUT_FAILED;
         goto out;
     }
 
-    GList *ptr;
+    GList *ptr, *next;
     DiffEntry *de;
 
-    /* Expand DIR_ADDED diff entries. */
-    if (expand_diff_results (repo_id, repo_version,
-                             remote_head->root_id,
-                             master_head ? master_head->root_id : EMPTY_SHA1,
-                             &results) < 0) {
-        ret = FETCH_CHECKOUT_FAILED;
-        goto out;
+    /* DIR_ADDED entries are expanded into file entries while the
+     * files are being downloaded, see download_files_http().
+     */
+    ptr = results;
+    while (ptr) {
+        de = ptr->data;
+        next = ptr->next;
+        if (de->status == DIFF_STATUS_DIR_ADDED) {
+            results = g_list_remove_link (results, ptr);
+            dir_added = g_list_concat (dir_added, ptr);
+        }
+        ptr = next;
     }
 
+#if defined WIN32 || defined __APPLE__
+    /* Only the files in the diff are checked, the ones not in use are
+     * found in batches up front.
+     */
+    lock_probe = file_lock_probe_new (worktree);
+    file_lock_probe_prefetch (lock_probe, results);
+#endif
+
 #ifdef WIN32
     for (ptr = results; ptr; ptr = ptr->next) {
         de = ptr->data;
@@ -5831,7 +8103,7 @@ seaf_repo_fetch_and_checkout (HttpTxTask *http_task, const char *remote_head_id)
                                                                               repo_id,
                                                                               de->name);
 
-            if (do_check_file_locked (de->name, worktree, locked_on_server)) {
+            if (file_lock_probe_check (lock_probe, de->name, locked_on_server)) {
                 seaf_message ("File %s is locked by other program, skip rename.\n",
                               de->name);
                 send_file_sync_error_notification (repo_id, NULL, de->name,
@@ -5865,14 +8137,23 @@ seaf_repo_fetch_and_checkout (HttpTxTask *http_task, const char *remote_head_id)
     no_conflict_hash = g_hash_table_new_full (g_str_hash, g_str_equal,
                                               g_free, NULL);
 
-    ignore_list = seaf_repo_load_ignore_files (worktree);
+    ignore_list = ignore_rules_load (worktree);
 
     struct cache_entry *ce;
 
 #if defined WIN32 || defined __APPLE__
     fset = seaf_repo_manager_get_locked_file_set (seaf->repo_mgr, repo_id);
+    locked_file_set_begin_batch (fset);
 #endif
 
+    /* Deleted paths are checked here, then deleted in parallel and removed
+     * from the index in one pass.
+     */
+    GHashTable *file_jobs = g_hash_table_new (g_str_hash, g_str_equal);
+    GList *delete_jobs = NULL;
+    GList *deleted = NULL;
+    DeleteJob *delete_job;
+
     for (ptr = results; ptr; ptr = ptr->next) {
         de = ptr->data;
         if (de->status == DIFF_STATUS_DELETED) {
@@ -5883,8 +8164,7 @@ seaf_repo_fetch_and_checkout (HttpTxTask *http_task, const char *remote_head_id)
                 continue;
 
             if (should_ignore_on_checkout (de->name, NULL)) {
-                remove_from_index_with_prefix (&istate, de->name, NULL);
-                try_add_empty_parent_dir_entry (worktree, &istate, de->name);
+                deleted = g_list_prepend (deleted, de->name);
                 continue;
             }
 
@@ -5896,9 +8176,9 @@ seaf_repo_fetch_and_checkout (HttpTxTask *http_task, const char *remote_head_id)
                                                       repo_id, de->name);
 
 #if defined WIN32 || defined __APPLE__
-            if (!do_check_file_locked (de->name, worktree, locked_on_server)) {
+            if (!file_lock_probe_check (lock_probe, de->name, locked_on_server)) {
                 locked_file_set_remove (fset, de->name, FALSE);
-                delete_path (worktree, de->name, de->mode, ce->ce_mtime.sec);
+                add_file_delete_job (file_jobs, &delete_jobs, ce);
             } else {
                 if (!locked_file_set_lookup (fset, de->name))
                     send_file_sync_error_notification (repo_id, http_task->repo_name, de->name,
@@ -5908,13 +8188,12 @@ seaf_repo_fetch_and_checkout (HttpTxTask *http_task, const char *remote_head_id)
                                             ce->ce_mtime.sec, NULL);
             }
 #else
-            delete_path (worktree, de->name, de->mode, ce->ce_mtime.sec);
+            add_file_delete_job (file_jobs, &delete_jobs, ce);
 #endif
 
             /* No need to lock wt file again since it's deleted. */
 
-            remove_from_index_with_prefix (&istate, de->name, NULL);
-            try_add_empty_parent_dir_entry (worktree, &istate, de->name);
+            deleted = g_list_prepend (deleted, de->name);
         } else if (de->status == DIFF_STATUS_DIR_DELETED) {
             seaf_debug ("Delete dir %s.\n", de->name);
 
@@ -5925,21 +8204,34 @@ seaf_repo_fetch_and_checkout (HttpTxTask *http_task, const char *remote_head_id)
             if (should_ignore_on_checkout (de->name, NULL)) {
                 seaf_message ("Path %s is invalid on Windows, skip delete.\n",
                               de->name);
-                remove_from_index_with_prefix (&istate, de->name, NULL);
-
-                try_add_empty_parent_dir_entry (worktree, &istate, de->name);
+                deleted = g_list_prepend (deleted, de->name);
                 continue;
             }
 
-            delete_worktree_dir (repo_id, http_task->repo_name, &istate, worktree, de->name);
-
-            /* Remove all index entries under this directory */
-            remove_from_index_with_prefix (&istate, de->name, NULL);
+            delete_job = g_new0 (DeleteJob, 1);
+            delete_job->path = g_strdup (de->name);
+            delete_job->is_dir = TRUE;
+            delete_job->snapshot = snapshot_dir_entries (&istate, de->name);
+            delete_jobs = g_list_prepend (delete_jobs, delete_job);
 
-            try_add_empty_parent_dir_entry (worktree, &istate, de->name);
+            deleted = g_list_prepend (deleted, de->name);
         }
     }
 
+    run_delete_jobs (repo_id, http_task->repo_name, worktree, &istate,
+                     delete_jobs);
+    g_list_free_full (delete_jobs, (GDestroyNotify)delete_job_free);
+    g_hash_table_destroy (file_jobs);
+
+    /* Remove all index entries of the deleted files and folders. */
+    for (ptr = deleted; ptr; ptr = ptr->next)
+        mark_index_entries_with_prefix (&istate, ptr->data);
+    remove_marked_cache_entries (&istate);
+
+    for (ptr = deleted; ptr; ptr = ptr->next)
+        try_add_empty_parent_dir_entry (worktree, &istate, ptr->data);
+    g_list_free (deleted);
+
     for (ptr = results; ptr; ptr = ptr->next) {
         de = ptr->data;
         if (de->status == DIFF_STATUS_RENAMED ||
@@ -5995,7 +8287,7 @@ seaf_repo_fetch_and_checkout (HttpTxTask *http_task, const char *remote_head_id)
     }
 
     if (istate.cache_changed)
-        update_index (&istate, index_path);
+        update_index_timed (http_task, &istate, index_path);
 
     for (ptr = results; ptr; ptr = ptr->next) {
         de = ptr->data;
@@ -6004,6 +8296,9 @@ seaf_repo_fetch_and_checkout (HttpTxTask *http_task, const char *remote_head_id)
         }
     }
 
+    /* Files are checked out as their blocks arrive. */
+    sync_phase_timer_switch (&http_task->timer, prev_phase);
+
     ret = download_files_http (repo_id,
                                repo_version,
                                worktree,
@@ -6012,19 +8307,29 @@ seaf_repo_fetch_and_checkout (HttpTxTask *http_task, const char *remote_head_id)
                                crypt,
                                http_task,
                                results,
+                               remote_head->root_id,
+                               dir_added,
                                conflict_hash,
                                no_conflict_hash,
                                remote_head_id,
-                               fset);
+                               fset,
+                               lock_probe);
+
+    if (ret == FETCH_CHECKOUT_SUCCESS)
+        save_sparse_rules_applied (seaf->repo_mgr, repo_id, sparse_rules);
 
 out:
-    discard_index (&istate);
+    sync_phase_timer_switch (&http_task->timer, prev_phase);
+    g_free (sparse_rules);
+
+    seaf_index_cache_release (repo_id, &istate);
 
     seaf_branch_unref (master);
     seaf_commit_unref (master_head);
     seaf_commit_unref (remote_head);
 
     g_list_free_full (results, (GDestroyNotify)diff_entry_free);
+    g_list_free_full (dir_added, (GDestroyNotify)diff_entry_free);
 
     g_free (crypt);
     if (conflict_hash)
@@ -6033,10 +8338,12 @@ out:
         g_hash_table_destroy (no_conflict_hash);
 
     if (ignore_list)
-        seaf_repo_free_ignore_files (ignore_list);
+        ignore_rules_unref (ignore_list);
 
 #if defined WIN32 || defined __APPLE__
+    locked_file_set_end_batch (fset);
     locked_file_set_free (fset);
+    file_lock_probe_free (lock_probe);
 #endif
 
     return ret;
@@ -6107,6 +8414,18 @@ seaf_repo_manager_new (SeafileSession *seaf)
 
     pthread_mutex_init (&mgr->priv->db_lock, NULL);
 
+    mgr->priv->db_writes = g_async_queue_new ();
+    pthread_mutex_init (&mgr->priv->db_writes_lock, NULL);
+    pthread_cond_init (&mgr->priv->db_writes_cond, NULL);
+
+    pthread_mutex_init (&mgr->priv->props_lock, NULL);
+    mgr->priv->repo_props = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                   g_free,
+                                                   (GDestroyNotify)g_hash_table_destroy);
+    mgr->priv->server_props = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                     g_free,
+                                                     (GDestroyNotify)g_hash_table_destroy);
+
     mgr->priv->checkout_tasks_hash = g_hash_table_new_full
         (g_str_hash, g_str_equal, g_free, g_free);
 
@@ -6142,19 +8461,43 @@ seaf_repo_manager_new (SeafileSession *seaf)
     pthread_rwlock_init (&mgr->priv->lock, NULL);
 
     mgr->priv->lock_office_job_queue = g_async_queue_new ();
+    mgr->priv->office_lock_files = g_hash_table_new_full (g_str_hash,
+                                                          g_str_equal,
+                                                          g_free, g_free);
+    pthread_mutex_init (&mgr->priv->office_lock_files_lock, NULL);
 
     return mgr;
 }
 
+static void *
+db_writer_thread (void *vmgr);
+
+static void
+flush_db_writes ();
+
 int
 seaf_repo_manager_init (SeafRepoManager *mgr)
 {
+    pthread_t tid;
+    pthread_attr_t attr;
+    int rc;
+
     if (checkdir_with_mkdir (mgr->index_dir) < 0) {
         seaf_warning ("Index dir %s does not exist and is unable to create\n",
                    mgr->index_dir);
         return -1;
     }
 
+    pthread_attr_init (&attr);
+    pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+    rc = pthread_create (&tid, &attr, db_writer_thread, mgr);
+    if (rc != 0) {
+        seaf_warning ("Failed to start db writer thread: %s\n", strerror(rc));
+        return -1;
+    }
+    /* Tokens and worktrees set by clone tasks are queued too. */
+    atexit (flush_db_writes);
+
     /* Load all the repos into memory on the client side. */
     load_repos (mgr, mgr->seaf->seaf_dir);
 
@@ -6165,139 +8508,140 @@ seaf_repo_manager_init (SeafRepoManager *mgr)
 }
 
 static void
-watch_repos (SeafRepoManager *mgr)
+watch_repo (SeafRepoManager *mgr, SeafRepo *repo)
 {
-    GHashTableIter iter;
-    SeafRepo *repo;
-    gpointer key, value;
+    WTStatus *status;
 
-    g_hash_table_iter_init (&iter, mgr->priv->repo_hash);
-    while (g_hash_table_iter_next (&iter, &key, &value)) {
-        repo = value;
-        if (repo->auto_sync && !repo->worktree_invalid && (repo->sync_interval == 0)) {
-            if (seaf_wt_monitor_watch_repo (seaf->wt_monitor, repo->id, repo->worktree) < 0) {
-                seaf_warning ("failed to watch repo %s.\n", repo->id);
-                /* If we fail to add watch at the beginning, sync manager
-                 * will periodically check repo status and retry.
-                 */
-            }
-        }
+    if (!repo->auto_sync || repo->worktree_invalid || repo->sync_interval != 0)
+        return;
+
+    /* The sync manager may have watched it already, when it found the
+     * worktree valid again.
+     */
+    status = seaf_wt_monitor_get_worktree_status (seaf->wt_monitor, repo->id);
+    if (status) {
+        wt_status_unref (status);
+        return;
+    }
+
+    if (seaf_wt_monitor_watch_repo (seaf->wt_monitor, repo->id, repo->worktree) < 0) {
+        seaf_warning ("failed to watch repo %s.\n", repo->id);
+        /* If we fail to add watch at the beginning, sync manager
+         * will periodically check repo status and retry.
+         */
     }
 }
 
-#define REMOVE_OBJECTS_BATCH 1000
+typedef struct WorktreeCheck {
+    char repo_id[37];
+    char *repo_name;
+    char *worktree;
+    gboolean valid;
+} WorktreeCheck;
 
-static int
-remove_store (const char *top_store_dir, const char *store_id, int *count)
+static void *
+check_worktree_job (void *vdata)
 {
-    char *obj_dir = NULL;
-    GDir *dir1, *dir2;
-    const char *dname1, *dname2;
-    char *path1, *path2;
-
-    obj_dir = g_build_filename (top_store_dir, store_id, NULL);
-
-    dir1 = g_dir_open (obj_dir, 0, NULL);
-    if (!dir1) {
-        g_free (obj_dir);
-        return 0;
-    }
+    WorktreeCheck *check = vdata;
 
-    seaf_message ("Removing store %s\n", obj_dir);
+    check->valid = (check_worktree_dir (check->worktree, check->repo_name,
+                                        check->repo_id, TRUE) == 0);
 
-    while ((dname1 = g_dir_read_name(dir1)) != NULL) {
-        path1 = g_build_filename (obj_dir, dname1, NULL);
-
-        dir2 = g_dir_open (path1, 0, NULL);
-        if (!dir2) {
-            seaf_warning ("Failed to open obj dir %s.\n", path1);
-            g_dir_close (dir1);
-            g_free (path1);
-            g_free (obj_dir);
-            return -1;
-        }
+    return vdata;
+}
 
-        while ((dname2 = g_dir_read_name(dir2)) != NULL) {
-            path2 = g_build_filename (path1, dname2, NULL);
-            g_unlink (path2);
+static void
+check_worktree_done (void *vdata)
+{
+    WorktreeCheck *check = vdata;
+    SeafRepoManager *mgr = seaf->repo_mgr;
+    SeafRepo *repo;
+    SyncInfo *info;
 
-            /* To prevent using too much IO, only remove 1000 objects per 5 seconds.
-             */
-            if (++(*count) > REMOVE_OBJECTS_BATCH) {
-                g_usleep (5 * G_USEC_PER_SEC);
-                *count = 0;
-            }
+    /* The repo may have been removed or moved while it was checked. */
+    repo = seaf_repo_manager_get_repo (mgr, check->repo_id);
+    if (!repo || g_strcmp0 (repo->worktree, check->worktree) != 0)
+        goto out;
 
-            g_free (path2);
+    if (!check->valid) {
+        if (seafile_session_config_get_allow_invalid_worktree(seaf)) {
+            seaf_warning ("Worktree for repo \"%s\" is invalid, but still keep it.\n",
+                          repo->name);
+            repo->worktree_invalid = TRUE;
+        } else {
+            seaf_message ("Worktree for repo \"%s\" is invalid, delete it.\n",
+                          repo->name);
+            /* The sync manager may have started syncing it meanwhile. */
+            seaf_sync_manager_cancel_sync_task (seaf->sync_mgr, repo->id);
+            info = seaf_sync_manager_get_sync_info (seaf->sync_mgr, repo->id);
+            if (info != NULL && info->in_sync)
+                seaf_repo_manager_mark_repo_deleted (mgr, repo);
+            else
+                seaf_repo_manager_del_repo (mgr, repo);
         }
-        g_dir_close (dir2);
-
-        g_rmdir (path1);
-        g_free (path1);
+        goto out;
     }
 
-    g_dir_close (dir1);
-    g_rmdir (obj_dir);
-    g_free (obj_dir);
+    watch_repo (mgr, repo);
 
-    return 0;
+out:
+    g_free (check->repo_name);
+    g_free (check->worktree);
+    g_free (check);
 }
 
+/*
+ * Worktrees may be on slow or disconnected drives, so they're checked on
+ * the job pool. Repos are watched as their checks finish, in the order the
+ * sync manager would pick them.
+ */
 static void
-cleanup_deleted_stores_by_type (const char *type)
+check_repo_worktrees (SeafRepoManager *mgr)
 {
-    char *top_store_dir;
-    const char *repo_id;
+    GList *repos, *ptr;
+    SeafRepo *repo;
+    WorktreeCheck *check;
 
-    top_store_dir = g_build_filename (seaf->seaf_dir, "deleted_store", type, NULL);
+    repos = seaf_repo_manager_get_repo_list (mgr, -1, -1);
+    repos = g_list_sort_with_data (repos, cmp_repos_by_sync_time, NULL);
 
-    GError *error = NULL;
-    GDir *dir = g_dir_open (top_store_dir, 0, &error);
-    if (!dir) {
-        seaf_warning ("Failed to open store dir %s: %s.\n",
-                      top_store_dir, error->message);
-        g_free (top_store_dir);
-        return;
-    }
+    for (ptr = repos; ptr; ptr = ptr->next) {
+        repo = ptr->data;
 
-    int count = 0;
-    while ((repo_id = g_dir_read_name(dir)) != NULL) {
-        remove_store (top_store_dir, repo_id, &count);
-    }
+        /* Repos that aren't checked out yet have no worktree to check. */
+        if (!repo->head || !repo->worktree) {
+            watch_repo (mgr, repo);
+            continue;
+        }
 
-    g_free (top_store_dir);
-    g_dir_close (dir);
-}
+        check = g_new0 (WorktreeCheck, 1);
+        memcpy (check->repo_id, repo->id, 37);
+        check->repo_name = g_strdup (repo->name);
+        check->worktree = g_strdup (repo->worktree);
 
-static void *
-cleanup_deleted_stores (void *vdata)
-{
-    while (1) {
-        cleanup_deleted_stores_by_type ("commits");
-        cleanup_deleted_stores_by_type ("fs");
-        cleanup_deleted_stores_by_type ("blocks");
-        g_usleep (60 * G_USEC_PER_SEC);
+        seaf_job_manager_schedule_job (seaf->job_mgr,
+                                       check_worktree_job,
+                                       check_worktree_done,
+                                       check);
     }
-    return NULL;
+
+    g_list_free (repos);
 }
 
 int
 seaf_repo_manager_start (SeafRepoManager *mgr)
 {
+    check_repo_worktrees (mgr);
+
+    seaf_store_cleanup_start (seaf->deleted_store);
+
+#if defined WIN32 || defined __APPLE__
     pthread_t tid;
     pthread_attr_t attr;
-    pthread_attr_init(&attr);
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
     int rc;
 
-    watch_repos (mgr);
-
-    rc = pthread_create (&tid, &attr, cleanup_deleted_stores, NULL);
-    if (rc != 0) {
-        seaf_warning ("Failed to start cleanup thread: %s\n", strerror(rc));
-    }
-
-#if defined WIN32 || defined __APPLE__
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
     rc = pthread_create (&tid, &attr, lock_office_file_worker,
                          mgr->priv->lock_office_job_queue);
     if (rc != 0) {
@@ -6364,6 +8708,9 @@ seaf_repo_manager_add_repo (SeafRepoManager *manager,
 
     pthread_rwlock_unlock (&manager->priv->lock);
 
+    if (seaf->sync_mgr)
+        seaf_sync_manager_wake_repo (seaf->sync_mgr, repo->id, 0);
+
     return 0;
 }
 
@@ -6462,10 +8809,21 @@ seaf_repo_manager_remove_repo_ondisk (SeafRepoManager *mgr,
 
     pthread_mutex_unlock (&mgr->priv->db_lock);
 
+    /* Queued, errors of the repo may still be queued too. */
+    queue_db_write (mgr, sqlite3_mprintf ("DELETE FROM FileSyncError "
+                                          "WHERE repo_id = %Q", repo_id));
+
     /* remove index */
     char path[SEAF_PATH_MAX];
     snprintf (path, SEAF_PATH_MAX, "%s/%s", mgr->index_dir, repo_id);
+    seaf_index_cache_remove_repo (repo_id);
     seaf_util_unlink (path);
+    remove_index_delta (path);
+
+    wt_journal_remove (repo_id);
+    server_block_cache_remove (repo_id);
+    seaf_content_index_remove_repo (repo_id);
+    seaf_file_id_cache_remove_repo (repo_id);
 
     /* remove branch */
     GList *p;
@@ -6548,6 +8906,13 @@ seaf_repo_manager_move_repo_store (SeafRepoManager *mgr,
     char *src = NULL;
     char *dst = NULL;
 
+    if (strcmp (type, "blocks") == 0)
+        seaf_block_manager_release_store (seaf->block_mgr, repo_id);
+    else if (strcmp (type, "fs") == 0)
+        seaf_obj_store_release_store (seaf->fs_mgr->obj_store, repo_id);
+    else if (strcmp (type, "commits") == 0)
+        seaf_commit_manager_release_store (seaf->commit_mgr, repo_id);
+
     src = g_build_filename (seaf->seaf_dir, "storage", type, repo_id, NULL);
     dst = gen_deleted_store_path (type, repo_id);
     if (dst) {
@@ -6702,59 +9067,157 @@ load_repo_commit (SeafRepoManager *manager,
 }
 
 static gboolean
-load_keys_cb (sqlite3_stmt *stmt, void *vrepo)
+load_property_cb (sqlite3_stmt *stmt, void *pvalue)
 {
-    SeafRepo *repo = vrepo;
-    const char *key, *iv;
-
-    key = (const char *)sqlite3_column_text(stmt, 0);
-    iv = (const char *)sqlite3_column_text(stmt, 1);
+    char **value = pvalue;
 
-    if (repo->enc_version == 1) {
-        hex_to_rawdata (key, repo->enc_key, 16);
-        hex_to_rawdata (iv, repo->enc_iv, 16);
-    } else if (repo->enc_version >= 2) {
-        hex_to_rawdata (key, repo->enc_key, 32);
-        hex_to_rawdata (iv, repo->enc_iv, 16);
-    }
+    char *v = (char *) sqlite3_column_text (stmt, 0);
+    *value = g_strdup (v);
 
+    /* Only one result. */
     return FALSE;
 }
 
-static int
-load_repo_passwd (SeafRepoManager *manager, SeafRepo *repo)
+/*
+ * Property writes don't wait for the database. They update the property
+ * caches and are queued to the db writer thread, which runs them in
+ * transactions of up to DB_WRITE_BATCH statements. Reads that miss the
+ * caches wait for the queued writes before going to the database.
+ */
+
+#define DB_WRITE_BATCH 100
+
+static void *
+db_writer_thread (void *vmgr)
 {
-    sqlite3 *db = manager->priv->db;
-    char sql[256];
+    SeafRepoManager *mgr = vmgr;
+    SeafRepoManagerPriv *priv = mgr->priv;
+    char *sql;
     int n;
 
-    pthread_mutex_lock (&manager->priv->db_lock);
+    while (1) {
+        sql = g_async_queue_pop (priv->db_writes);
 
-    snprintf (sql, sizeof(sql), 
-              "SELECT key, iv FROM RepoKeys WHERE repo_id='%s'",
-              repo->id);
-    n = sqlite_foreach_selected_row (db, sql, load_keys_cb, repo);
-    if (n < 0) {
-        pthread_mutex_unlock (&manager->priv->db_lock);
-        return -1;
+        pthread_mutex_lock (&priv->db_lock);
+
+        sqlite_batch_begin (priv->db);
+        n = 0;
+        while (sql) {
+            sqlite_query_exec (priv->db, sql);
+            sqlite3_free (sql);
+            if (++n >= DB_WRITE_BATCH)
+                break;
+            sql = g_async_queue_try_pop (priv->db_writes);
+        }
+        sqlite_batch_end (priv->db, TRUE);
+
+        pthread_mutex_unlock (&priv->db_lock);
+
+        pthread_mutex_lock (&priv->db_writes_lock);
+        priv->n_db_writes_done += n;
+        pthread_cond_broadcast (&priv->db_writes_cond);
+        pthread_mutex_unlock (&priv->db_writes_lock);
+    }
+
+    return NULL;
+}
+
+/* @sql is returned by sqlite3_mprintf() and freed by the writer. */
+static void
+queue_db_write (SeafRepoManager *mgr, char *sql)
+{
+    SeafRepoManagerPriv *priv = mgr->priv;
+
+    pthread_mutex_lock (&priv->db_writes_lock);
+    ++(priv->n_db_writes_queued);
+    pthread_mutex_unlock (&priv->db_writes_lock);
+
+    g_async_queue_push (priv->db_writes, sql);
+}
+
+/* Don't call with db_lock held. */
+static void
+wait_for_db_writes (SeafRepoManager *mgr)
+{
+    SeafRepoManagerPriv *priv = mgr->priv;
+    gint64 target;
+
+    pthread_mutex_lock (&priv->db_writes_lock);
+    target = priv->n_db_writes_queued;
+    while (priv->n_db_writes_done < target)
+        pthread_cond_wait (&priv->db_writes_cond, &priv->db_writes_lock);
+    pthread_mutex_unlock (&priv->db_writes_lock);
+}
+
+/* Runs at exit, so that queued writes are not lost on shutdown. */
+static void
+flush_db_writes ()
+{
+    if (seaf && seaf->repo_mgr)
+        wait_for_db_writes (seaf->repo_mgr);
+}
+
+/* Returns TRUE if the property is cached. *value is NULL if it isn't set. */
+static gboolean
+props_cache_lookup (SeafRepoManager *mgr, GHashTable *cache,
+                    const char *id, const char *key,
+                    char **value, guint *generation)
+{
+    GHashTable *props;
+    gpointer cached;
+    gboolean found = FALSE;
+
+    pthread_mutex_lock (&mgr->priv->props_lock);
+
+    props = g_hash_table_lookup (cache, id);
+    if (props && g_hash_table_lookup_extended (props, key, NULL, &cached)) {
+        *value = g_strdup (cached);
+        found = TRUE;
+    }
+    *generation = mgr->priv->props_generation;
+
+    pthread_mutex_unlock (&mgr->priv->props_lock);
+
+    return found;
+}
+
+/* Values read from the database are only cached if nothing was removed
+ * from the cache in the meantime, and don't replace newer values.
+ */
+static void
+props_cache_set (SeafRepoManager *mgr, GHashTable *cache,
+                 const char *id, const char *key, const char *value,
+                 gboolean from_db, guint generation)
+{
+    GHashTable *props;
+
+    pthread_mutex_lock (&mgr->priv->props_lock);
+
+    if (from_db && generation != mgr->priv->props_generation)
+        goto out;
+
+    props = g_hash_table_lookup (cache, id);
+    if (!props) {
+        props = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+        g_hash_table_insert (cache, g_strdup (id), props);
     }
 
-    pthread_mutex_unlock (&manager->priv->db_lock);
+    if (from_db && g_hash_table_lookup_extended (props, key, NULL, NULL))
+        goto out;
 
-    return 0;
-    
+    g_hash_table_replace (props, g_strdup (key), g_strdup (value));
+
+out:
+    pthread_mutex_unlock (&mgr->priv->props_lock);
 }
 
-static gboolean
-load_property_cb (sqlite3_stmt *stmt, void *pvalue)
+static void
+props_cache_remove (SeafRepoManager *mgr, GHashTable *cache, const char *id)
 {
-    char **value = pvalue;
-
-    char *v = (char *) sqlite3_column_text (stmt, 0);
-    *value = g_strdup (v);
-
-    /* Only one result. */
-    return FALSE;
+    pthread_mutex_lock (&mgr->priv->props_lock);
+    g_hash_table_remove (cache, id);
+    ++(mgr->priv->props_generation);
+    pthread_mutex_unlock (&mgr->priv->props_lock);
 }
 
 static char *
@@ -6765,6 +9228,13 @@ load_repo_property (SeafRepoManager *manager,
     sqlite3 *db = manager->priv->db;
     char sql[256];
     char *value = NULL;
+    guint generation;
+
+    if (props_cache_lookup (manager, manager->priv->repo_props,
+                            repo_id, key, &value, &generation))
+        return value;
+
+    wait_for_db_writes (manager);
 
     pthread_mutex_lock (&manager->priv->db_lock);
 
@@ -6778,29 +9248,10 @@ load_repo_property (SeafRepoManager *manager,
 
     pthread_mutex_unlock (&manager->priv->db_lock);
 
-    return value;
-}
-
-static gboolean
-load_branch_cb (sqlite3_stmt *stmt, void *vrepo)
-{
-    SeafRepo *repo = vrepo;
-    SeafRepoManager *manager = repo->manager;
-
-    char *branch_name = (char *) sqlite3_column_text (stmt, 0);
-    SeafBranch *branch =
-        seaf_branch_manager_get_branch (manager->seaf->branch_mgr,
-                                        repo->id, branch_name);
-    if (branch == NULL) {
-        seaf_warning ("Broken branch name for repo %s\n", repo->id); 
-        repo->is_corrupted = TRUE;
-        return FALSE;
-    }
-    load_repo_commit (manager, repo, branch);
-    seaf_branch_unref (branch);
+    props_cache_set (manager, manager->priv->repo_props,
+                     repo_id, key, value, TRUE, generation);
 
-    /* Only one result. */
-    return FALSE;
+    return value;
 }
 
 static gboolean
@@ -6813,12 +9264,25 @@ is_wt_repo_name_same (const char *worktree, const char *repo_name)
     return ret;
 }
 
+static int
+parse_transfer_priority (const char *value)
+{
+    if (g_strcmp0 (value, "high") == 0)
+        return TRANSFER_PRIORITY_HIGH;
+    if (g_strcmp0 (value, "low") == 0)
+        return TRANSFER_PRIORITY_LOW;
+    return TRANSFER_PRIORITY_NORMAL;
+}
+
+/* Loads the head branch and commit. The repo isn't added to the cache. */
 static SeafRepo *
-load_repo (SeafRepoManager *manager, const char *repo_id)
+load_repo_head (SeafRepoManager *manager, const char *repo_id,
+                const char *branch_name)
 {
-    char sql[256];
+    SeafRepo *repo;
+    SeafBranch *branch;
 
-    SeafRepo *repo = seaf_repo_new(repo_id, NULL, NULL);
+    repo = seaf_repo_new(repo_id, NULL, NULL);
     if (!repo) {
         seaf_warning ("[repo mgr] failed to alloc repo.\n");
         return NULL;
@@ -6826,13 +9290,16 @@ load_repo (SeafRepoManager *manager, const char *repo_id)
 
     repo->manager = manager;
 
-    snprintf(sql, 256, "SELECT branch_name FROM RepoBranch WHERE repo_id='%s'",
-             repo->id);
-    if (sqlite_foreach_selected_row (manager->priv->db, sql, 
-                                     load_branch_cb, repo) < 0) {
-        seaf_warning ("Error read branch for repo %s.\n", repo->id);
-        seaf_repo_free (repo);
-        return NULL;
+    if (branch_name) {
+        branch = seaf_branch_manager_get_branch (manager->seaf->branch_mgr,
+                                                 repo->id, branch_name);
+        if (branch == NULL) {
+            seaf_warning ("Broken branch name for repo %s\n", repo->id);
+            repo->is_corrupted = TRUE;
+        } else {
+            load_repo_commit (manager, repo, branch);
+            seaf_branch_unref (branch);
+        }
     }
 
     /* If repo head is set but failed to load branch or commit. */
@@ -6845,9 +9312,8 @@ load_repo (SeafRepoManager *manager, const char *repo_id)
     /* Repo head may be not set if it's just cloned but not checked out yet. */
     if (repo->head == NULL) {
         /* the repo do not have a head branch, try to load 'master' branch */
-        SeafBranch *branch =
-            seaf_branch_manager_get_branch (manager->seaf->branch_mgr,
-                                            repo->id, "master");
+        branch = seaf_branch_manager_get_branch (manager->seaf->branch_mgr,
+                                                 repo->id, "master");
         if (branch != NULL) {
              SeafCommit *commit;
 
@@ -6877,8 +9343,31 @@ load_repo (SeafRepoManager *manager, const char *repo_id)
         return NULL;
     }
 
-    load_repo_passwd (manager, repo);
+    return repo;
+}
+
+static void
+load_repo_keys (SeafRepo *repo, const char *key, const char *iv)
+{
+    if (!key || !iv)
+        return;
+
+    if (repo->enc_version == 1) {
+        hex_to_rawdata (key, repo->enc_key, 16);
+        hex_to_rawdata (iv, repo->enc_iv, 16);
+    } else if (repo->enc_version >= 2) {
+        hex_to_rawdata (key, repo->enc_key, 32);
+        hex_to_rawdata (iv, repo->enc_iv, 16);
+    }
+}
 
+/*
+ * Sets up a repo loaded by load_repo_head() from its properties and adds
+ * it to the cache. The worktree is checked later, by check_repo_worktrees().
+ */
+static void
+finish_load_repo (SeafRepoManager *manager, SeafRepo *repo)
+{
     char *value;
 
     value = load_repo_property (manager, repo->id, REPO_AUTO_SYNC);
@@ -6897,19 +9386,6 @@ load_repo (SeafRepoManager *manager, const char *repo_id)
     /* May be NULL if this property is not set in db. */
     repo->server_url = load_repo_property (manager, repo->id, REPO_PROP_SERVER_URL);
 
-    if (repo->head != NULL && seaf_repo_check_worktree (repo) < 0) {
-        if (seafile_session_config_get_allow_invalid_worktree(seaf)) {
-            seaf_warning ("Worktree for repo \"%s\" is invalid, but still keep it.\n",
-                          repo->name);
-            repo->worktree_invalid = TRUE;
-        } else {
-            seaf_message ("Worktree for repo \"%s\" is invalid, delete it.\n",
-                          repo->name);
-            seaf_repo_manager_del_repo (manager, repo);
-            return NULL;
-        }
-    }
-
     /* load readonly property */
     value = load_repo_property (manager, repo->id, REPO_PROP_IS_READONLY);
     if (g_strcmp0(value, "true") == 0)
@@ -6927,6 +9403,18 @@ load_repo (SeafRepoManager *manager, const char *repo_id)
     }
     g_free (value);
 
+    value = load_repo_property (manager, repo->id, REPO_PROP_TRANSFER_PRIORITY);
+    repo->transfer_priority = parse_transfer_priority (value);
+    g_free (value);
+
+    value = load_repo_property (manager, repo->id, REPO_PROP_ON_DEMAND);
+    repo->on_demand = (g_strcmp0 (value, "true") == 0);
+    g_free (value);
+
+    value = load_repo_property (manager, repo->id, REPO_PROP_CHUNK_POLICY);
+    chunk_policy_parse (value, &repo->chunk_policy);
+    g_free (value);
+
     if (repo->worktree) {
         gboolean wt_repo_name_same = is_wt_repo_name_same (repo->worktree, repo->name);
         value = load_repo_property (manager, repo->id, REPO_SYNC_WORKTREE_NAME);
@@ -6945,8 +9433,6 @@ load_repo (SeafRepoManager *manager, const char *repo_id)
     }
 
     g_hash_table_insert (manager->priv->repo_hash, g_strdup(repo->id), repo);
-
-    return repo;
 }
 
 static sqlite3*
@@ -7049,35 +9535,107 @@ open_db (SeafRepoManager *manager, const char *seaf_dir)
     sql = "CREATE INDEX IF NOT EXISTS FileSyncErrorIndex ON FileSyncError (repo_id, path)";
     sqlite_query_exec (db, sql);
 
+    manager->priv->stmts = sqlite_stmt_cache_new (db);
+
     return db;
 }
 
 static gboolean
-load_repo_cb (sqlite3_stmt *stmt, void *vmanager)
+remove_deleted_repo (sqlite3_stmt *stmt, void *vmanager)
 {
     SeafRepoManager *manager = vmanager;
     const char *repo_id;
 
     repo_id = (const char *) sqlite3_column_text (stmt, 0);
 
-    load_repo (manager, repo_id);
+    seaf_repo_manager_remove_repo_ondisk (manager, repo_id, TRUE);
 
     return TRUE;
 }
 
+/* Properties read by finish_load_repo(). */
+static const char *startup_props[] = {
+    REPO_AUTO_SYNC,
+    "worktree",
+    REPO_PROP_EMAIL,
+    REPO_PROP_TOKEN,
+    REPO_PROP_SERVER_URL,
+    REPO_PROP_IS_READONLY,
+    REPO_PROP_SYNC_INTERVAL,
+    REPO_PROP_TRANSFER_PRIORITY,
+    REPO_PROP_ON_DEMAND,
+    REPO_PROP_CHUNK_POLICY,
+    REPO_SYNC_WORKTREE_NAME,
+    NULL,
+};
+
+#define LOAD_REPO_THREADS 8
+
+typedef struct RepoLoadData {
+    char repo_id[37];
+    char *branch_name;
+    char *key;
+    char *iv;
+    SeafRepo *repo;
+} RepoLoadData;
+
 static gboolean
-remove_deleted_repo (sqlite3_stmt *stmt, void *vmanager)
+prefetch_property_cb (sqlite3_stmt *stmt, void *vmanager)
 {
     SeafRepoManager *manager = vmanager;
+    const char *repo_id, *key, *value;
+
+    repo_id = (const char *) sqlite3_column_text (stmt, 0);
+    key = (const char *) sqlite3_column_text (stmt, 1);
+    value = (const char *) sqlite3_column_text (stmt, 2);
+    if (!repo_id || !key)
+        return TRUE;
+
+    props_cache_set (manager, manager->priv->repo_props, repo_id, key, value,
+                     TRUE, manager->priv->props_generation);
+
+    return TRUE;
+}
+
+static gboolean
+collect_repo_cb (sqlite3_stmt *stmt, void *vlist)
+{
+    GList **list = vlist;
+    RepoLoadData *data;
     const char *repo_id;
 
     repo_id = (const char *) sqlite3_column_text (stmt, 0);
+    if (!repo_id || strlen(repo_id) != 36)
+        return TRUE;
 
-    seaf_repo_manager_remove_repo_ondisk (manager, repo_id, TRUE);
+    data = g_new0 (RepoLoadData, 1);
+    memcpy (data->repo_id, repo_id, 37);
+    data->branch_name = g_strdup ((const char *) sqlite3_column_text (stmt, 1));
+    data->key = g_strdup ((const char *) sqlite3_column_text (stmt, 2));
+    data->iv = g_strdup ((const char *) sqlite3_column_text (stmt, 3));
+
+    *list = g_list_prepend (*list, data);
 
     return TRUE;
 }
 
+static void
+load_repo_head_thread (gpointer vdata, gpointer vmanager)
+{
+    RepoLoadData *data = vdata;
+
+    data->repo = load_repo_head (vmanager, data->repo_id, data->branch_name);
+    if (data->repo)
+        load_repo_keys (data->repo, data->key, data->iv);
+}
+
+/*
+ * Repos are registered from one query over Repo, RepoBranch and RepoKeys,
+ * and their properties are read into the property cache with another one.
+ * Head commits are loaded in parallel, since every user of the repo cache
+ * expects them. Checking worktrees and adding watches are left to
+ * seaf_repo_manager_start().
+ */
 static void
 load_repos (SeafRepoManager *manager, const char *seaf_dir)
 {
@@ -7085,6 +9643,10 @@ load_repos (SeafRepoManager *manager, const char *seaf_dir)
     if (!db) return;
 
     char *sql;
+    GList *repos = NULL, *ptr;
+    RepoLoadData *data;
+    SeafTaskGroup *tasks;
+    int i;
 
     sql = "SELECT repo_id FROM DeletedRepo";
     if (sqlite_foreach_selected_row (db, sql, remove_deleted_repo, manager) < 0) {
@@ -7092,11 +9654,51 @@ load_repos (SeafRepoManager *manager, const char *seaf_dir)
         return;
     }
 
-    sql = "SELECT repo_id FROM Repo;";
-    if (sqlite_foreach_selected_row (db, sql, load_repo_cb, manager) < 0) {
+    sql = "SELECT repo_id, key, value FROM RepoProperty";
+    if (sqlite_foreach_selected_row (db, sql, prefetch_property_cb, manager) < 0) {
+        seaf_warning ("Error read repo properties.\n");
+        return;
+    }
+
+    sql = "SELECT Repo.repo_id, RepoBranch.branch_name, RepoKeys.key, RepoKeys.iv "
+        "FROM Repo LEFT JOIN RepoBranch ON Repo.repo_id = RepoBranch.repo_id "
+        "LEFT JOIN RepoKeys ON Repo.repo_id = RepoKeys.repo_id";
+    if (sqlite_foreach_selected_row (db, sql, collect_repo_cb, &repos) < 0) {
         seaf_warning ("Error read repo db.\n");
         return;
     }
+
+    tasks = seaf_task_group_new (SEAF_LANE_IO, SEAF_TASK_PRIORITY_HIGH,
+                                 LOAD_REPO_THREADS, load_repo_head_thread,
+                                 manager);
+    for (ptr = repos; ptr; ptr = ptr->next)
+        seaf_task_group_push (tasks, ptr->data);
+    seaf_task_group_free (tasks, FALSE);
+
+    for (ptr = repos; ptr; ptr = ptr->next) {
+        data = ptr->data;
+
+        /* Properties that aren't set are cached as NULL, so that
+         * finish_load_repo() doesn't go back to the database for them.
+         */
+        for (i = 0; startup_props[i] != NULL; ++i)
+            props_cache_set (manager, manager->priv->repo_props,
+                             data->repo_id, startup_props[i], NULL,
+                             TRUE, manager->priv->props_generation);
+
+        if (data->repo)
+            finish_load_repo (manager, data->repo);
+
+        g_free (data->branch_name);
+        g_free (data->key);
+        g_free (data->iv);
+        g_free (data);
+    }
+
+    seaf_message ("Loaded %u repos.\n",
+                  g_hash_table_size (manager->priv->repo_hash));
+
+    g_list_free (repos);
 }
 
 static void
@@ -7105,28 +9707,19 @@ save_repo_property (SeafRepoManager *manager,
                     const char *key, const char *value)
 {
     char *sql;
-    sqlite3 *db = manager->priv->db;
 
-    pthread_mutex_lock (&manager->priv->db_lock);
+    props_cache_set (manager, manager->priv->repo_props,
+                     repo_id, key, value, FALSE, 0);
 
-    sql = sqlite3_mprintf ("SELECT repo_id FROM RepoProperty WHERE repo_id=%Q AND key=%Q",
+    sql = sqlite3_mprintf ("UPDATE RepoProperty SET value=%Q "
+                           "WHERE repo_id=%Q AND key=%Q; "
+                           "INSERT INTO RepoProperty SELECT %Q, %Q, %Q "
+                           "WHERE NOT EXISTS (SELECT 1 FROM RepoProperty "
+                           "WHERE repo_id=%Q AND key=%Q);",
+                           value, repo_id, key,
+                           repo_id, key, value,
                            repo_id, key);
-    if (sqlite_check_for_existence(db, sql)) {
-        sqlite3_free (sql);
-        sql = sqlite3_mprintf ("UPDATE RepoProperty SET value=%Q"
-                               "WHERE repo_id=%Q and key=%Q",
-                               value, repo_id, key);
-        sqlite_query_exec (db, sql);
-        sqlite3_free (sql);
-    } else {
-        sqlite3_free (sql);
-        sql = sqlite3_mprintf ("INSERT INTO RepoProperty VALUES (%Q, %Q, %Q)",
-                               repo_id, key, value);
-        sqlite_query_exec (db, sql);
-        sqlite3_free (sql);
-    }
-
-    pthread_mutex_unlock (&manager->priv->db_lock);
+    queue_db_write (manager, sql);
 }
 
 int
@@ -7141,6 +9734,27 @@ seaf_repo_manager_set_repo_property (SeafRepoManager *manager,
     if (!repo)
         return -1;
 
+    if (strcmp (key, REPO_PROP_SPARSE_RULES) == 0) {
+        if (seaf_repo_manager_set_sparse_rules (manager, repo_id, value) < 0)
+            return -1;
+        /* Check out with the new rules on the next sync. */
+        repo->last_sync_time = 0;
+        return 0;
+    }
+
+    /* Applies to files indexed from now on. */
+    if (strcmp (key, REPO_PROP_CHUNK_POLICY) == 0) {
+        ChunkPolicy *policy, *old_policy;
+
+        if (chunk_policy_parse (value, &policy) < 0)
+            return -1;
+        pthread_mutex_lock (&repo->lock);
+        old_policy = repo->chunk_policy;
+        repo->chunk_policy = policy;
+        pthread_mutex_unlock (&repo->lock);
+        chunk_policy_unref (old_policy);
+    }
+
     if (strcmp(key, REPO_AUTO_SYNC) == 0) {
         if (!seaf->started) {
             seaf_message ("System not started, skip setting auto sync value.\n");
@@ -7208,6 +9822,25 @@ seaf_repo_manager_set_repo_property (SeafRepoManager *manager,
            repo->is_readonly = FALSE;
     }
 
+    /* Applies to transfers started from now on. */
+    if (strcmp (key, REPO_PROP_TRANSFER_PRIORITY) == 0)
+        repo->transfer_priority = parse_transfer_priority (value);
+
+    /* Applies to files checked out from now on. Existing placeholders
+     * are hydrated when it's turned off.
+     */
+    if (strcmp (key, REPO_PROP_ON_DEMAND) == 0) {
+        gboolean on_demand = (g_strcmp0 (value, "true") == 0);
+        if (on_demand && !seaf_hydration_has_provider ()) {
+            seaf_warning ("Can't turn on on-demand files for repo %.8s "
+                          "without a hydration provider.\n", repo_id);
+            return -1;
+        }
+        if (repo->on_demand && !on_demand)
+            seaf_hydration_hydrate_repo (repo_id);
+        repo->on_demand = on_demand;
+    }
+
     save_repo_property (manager, repo_id, key, value);
     return 0;
 }
@@ -7225,15 +9858,11 @@ seaf_repo_manager_del_repo_property (SeafRepoManager *manager,
                                      const char *repo_id)
 {
     char *sql;
-    sqlite3 *db = manager->priv->db;
 
-    pthread_mutex_lock (&manager->priv->db_lock);
+    props_cache_remove (manager, manager->priv->repo_props, repo_id);
 
     sql = sqlite3_mprintf ("DELETE FROM RepoProperty WHERE repo_id = %Q", repo_id);
-    sqlite_query_exec (db, sql);
-    sqlite3_free (sql);
-
-    pthread_mutex_unlock (&manager->priv->db_lock);
+    queue_db_write (manager, sql);
 }
 
 static void
@@ -7242,17 +9871,64 @@ seaf_repo_manager_del_repo_property_by_key (SeafRepoManager *manager,
                                             const char *key)
 {
     char *sql;
-    sqlite3 *db = manager->priv->db;
 
-    pthread_mutex_lock (&manager->priv->db_lock);
+    props_cache_set (manager, manager->priv->repo_props,
+                     repo_id, key, NULL, FALSE, 0);
 
     sql = sqlite3_mprintf ("DELETE FROM RepoProperty "
                            "WHERE repo_id = %Q "
                            "  AND key = %Q", repo_id, key);
-    sqlite_query_exec (db, sql);
-    sqlite3_free (sql);
+    queue_db_write (manager, sql);
+}
 
-    pthread_mutex_unlock (&manager->priv->db_lock);
+int
+seaf_repo_manager_set_sparse_rules (SeafRepoManager *mgr,
+                                    const char *repo_id,
+                                    const char *rules)
+{
+    SparseRules *parsed = NULL;
+    char *normalized;
+
+    if (sparse_rules_parse (rules, &parsed) < 0)
+        return -1;
+
+    normalized = sparse_rules_to_string (parsed);
+    if (normalized)
+        save_repo_property (mgr, repo_id, REPO_PROP_SPARSE_RULES, normalized);
+    else
+        seaf_repo_manager_del_repo_property_by_key (mgr, repo_id,
+                                                    REPO_PROP_SPARSE_RULES);
+
+    g_free (normalized);
+    sparse_rules_free (parsed);
+    return 0;
+}
+
+gboolean
+seaf_repo_manager_sparse_rules_changed (SeafRepoManager *mgr,
+                                        const char *repo_id)
+{
+    char *rules, *applied;
+    gboolean ret;
+
+    rules = load_repo_property (mgr, repo_id, REPO_PROP_SPARSE_RULES);
+    applied = load_repo_property (mgr, repo_id, REPO_PROP_SPARSE_APPLIED);
+    ret = (g_strcmp0 (rules, applied) != 0);
+
+    g_free (rules);
+    g_free (applied);
+    return ret;
+}
+
+static void
+save_sparse_rules_applied (SeafRepoManager *mgr, const char *repo_id,
+                           const char *rules)
+{
+    if (rules)
+        save_repo_property (mgr, repo_id, REPO_PROP_SPARSE_APPLIED, rules);
+    else
+        seaf_repo_manager_del_repo_property_by_key (mgr, repo_id,
+                                                    REPO_PROP_SPARSE_APPLIED);
 }
 
 static int
@@ -7426,15 +10102,13 @@ update_server_properties (SeafRepoManager *mgr,
     if (!old_server_url)
         return;
 
-    pthread_mutex_lock (&mgr->priv->db_lock);
+    props_cache_remove (mgr, mgr->priv->server_props, old_server_url);
+    props_cache_remove (mgr, mgr->priv->server_props, new_server_url);
 
     sql = sqlite3_mprintf ("UPDATE ServerProperty SET server_url=%Q WHERE "
                            "server_url=%Q;", new_server_url, old_server_url);
-    sqlite_query_exec (mgr->priv->db, sql);
-
-    pthread_mutex_unlock (&mgr->priv->db_lock);
+    queue_db_write (mgr, sql);
 
-    sqlite3_free (sql);
     g_free (old_server_url);
 }
 
@@ -7478,10 +10152,19 @@ seaf_repo_manager_get_server_property (SeafRepoManager *mgr,
                                        const char *server_url,
                                        const char *key)
 {
-    char *sql = sqlite3_mprintf ("SELECT value FROM ServerProperty WHERE "
-                                 "server_url=%Q AND key=%Q;",
-                                 server_url, key);
-    char *value;
+    char *sql;
+    char *value = NULL;
+    guint generation;
+
+    if (props_cache_lookup (mgr, mgr->priv->server_props,
+                            server_url, key, &value, &generation))
+        return value;
+
+    wait_for_db_writes (mgr);
+
+    sql = sqlite3_mprintf ("SELECT value FROM ServerProperty WHERE "
+                           "server_url=%Q AND key=%Q;",
+                           server_url, key);
 
     pthread_mutex_lock (&mgr->priv->db_lock);
 
@@ -7490,6 +10173,10 @@ seaf_repo_manager_get_server_property (SeafRepoManager *mgr,
     pthread_mutex_unlock (&mgr->priv->db_lock);
 
     sqlite3_free (sql);
+
+    props_cache_set (mgr, mgr->priv->server_props,
+                     server_url, key, value, TRUE, generation);
+
     return value;
 }
 
@@ -7500,20 +10187,17 @@ seaf_repo_manager_set_server_property (SeafRepoManager *mgr,
                                        const char *value)
 {
     char *sql;
-    int ret;
     char *canon_server_url = canonical_server_url(server_url);
 
-    pthread_mutex_lock (&mgr->priv->db_lock);
+    props_cache_set (mgr, mgr->priv->server_props,
+                     canon_server_url, key, value, FALSE, 0);
 
     sql = sqlite3_mprintf ("REPLACE INTO ServerProperty VALUES (%Q, %Q, %Q);",
                            canon_server_url, key, value);
-    ret = sqlite_query_exec (mgr->priv->db, sql);
+    queue_db_write (mgr, sql);
 
-    pthread_mutex_unlock (&mgr->priv->db_lock);
-
-    sqlite3_free (sql);
     g_free (canon_server_url);
-    return ret;
+    return 0;
 }
 
 gboolean
@@ -7532,97 +10216,3 @@ seaf_repo_manager_server_is_pro (SeafRepoManager *mgr,
     return ret;
 }
 
-/*
- * Read ignored files from ignore.txt
- */
-GList *seaf_repo_load_ignore_files (const char *worktree)
-{
-    GList *list = NULL;
-    SeafStat st;
-    FILE *fp;
-    char *full_path, *pattern;
-    char path[SEAF_PATH_MAX];
-
-    full_path = g_build_path (PATH_SEPERATOR, worktree,
-                              IGNORE_FILE, NULL);
-    if (seaf_stat (full_path, &st) < 0)
-        goto error;
-    if (!S_ISREG(st.st_mode))
-        goto error;
-    fp = g_fopen(full_path, "r");
-    if (fp == NULL)
-        goto error;
-
-    while (fgets(path, SEAF_PATH_MAX, fp) != NULL) {
-        /* remove leading and trailing whitespace, including \n \r. */
-        g_strstrip (path);
-
-        /* ignore comment and blank line */
-        if (path[0] == '#' || path[0] == '\0')
-            continue;
-
-        /* Change 'foo/' to 'foo/ *'. */
-        if (path[strlen(path)-1] == '/')
-            pattern = g_strdup_printf("%s/%s*", worktree, path);
-        else
-            pattern = g_strdup_printf("%s/%s", worktree, path);
-
-        list = g_list_prepend(list, pattern);
-    }
-
-    fclose(fp);
-    g_free (full_path);
-    return list;
-
-error:
-    g_free (full_path);
-    return NULL;
-}
-
-gboolean
-seaf_repo_check_ignore_file (GList *ignore_list, const char *fullpath)
-{
-    char *str;
-    SeafStat st;
-    GPatternSpec *ignore_spec;
-    GList *p;
-
-    str = g_strdup(fullpath);
-
-    int rc = seaf_stat(str, &st);
-    if (rc == 0 && S_ISDIR(st.st_mode)) {
-        g_free (str);
-        str = g_strconcat (fullpath, "/", NULL);
-    }
-
-    for (p = ignore_list; p != NULL; p = p->next) {
-        char *pattern = (char *)p->data;
-
-        ignore_spec = g_pattern_spec_new(pattern);
-        if (g_pattern_match_string(ignore_spec, str)) {
-            g_free (str);
-            g_pattern_spec_free(ignore_spec);
-            return TRUE;
-        }
-        g_pattern_spec_free(ignore_spec);
-    }
-
-    g_free (str);
-    return FALSE;
-}
-
-/*
- * Free ignored file list
- */
-void seaf_repo_free_ignore_files (GList *ignore_list)
-{
-    GList *p;
-
-    if (ignore_list == NULL)
-        return;
-
-    for (p = ignore_list; p != NULL; p = p->next)
-        free(p->data);
-
-    g_list_free (ignore_list);
-}
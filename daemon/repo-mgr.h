@@ -23,7 +23,24 @@
 #define REPO_PROP_IS_READONLY "is-readonly"
 #define REPO_PROP_SERVER_URL  "server-url"
 #define REPO_PROP_SYNC_INTERVAL "sync-interval"
+/* "high", "normal" (default) or "low" share of the bandwidth limits. */
+#define REPO_PROP_TRANSFER_PRIORITY "transfer-priority"
 #define REPO_SYNC_WORKTREE_NAME "sync-worktree-name"
+/* Time of the last block GC of the repo, see block-gc.h. */
+#define REPO_PROP_LAST_BLOCK_GC "last-block-gc"
+/* Time of the last scrub and progress of a stopped one, see scrubber.h. */
+#define REPO_PROP_LAST_SCRUB "last-scrub"
+#define REPO_PROP_SCRUB_CHECKPOINT "scrub-checkpoint"
+/* Sparse checkout rules, see sparse-rules.h. Set them with
+ * seaf_repo_manager_set_sparse_rules().
+ */
+#define REPO_PROP_SPARSE_RULES "sparse-rules"
+/* The sparse rules the worktree was last checked out with. */
+#define REPO_PROP_SPARSE_APPLIED "sparse-rules-applied"
+/* "true" to check out files as placeholders, see hydration.h. */
+#define REPO_PROP_ON_DEMAND "on-demand"
+/* Files split into fixed-size blocks, see chunk-policy.h. */
+#define REPO_PROP_CHUNK_POLICY "chunk-policy"
 
 struct _SeafRepoManager;
 typedef struct _SeafRepo SeafRepo;
@@ -97,8 +114,27 @@ struct _SeafRepo {
      * Added to here to avoid passing additional arguments. */
     struct _ChangeSet *changeset;
 
+    /* Sparse rules in effect during indexing, like changeset. */
+    struct SparseRules *sparse_rules;
+
     /* Non-zero if periodic sync is set for this repo. */
     int sync_interval;
+
+    /* TRANSFER_PRIORITY_*, see bandwidth-scheduler.h. */
+    int transfer_priority;
+
+    /* Files are checked out as placeholders, see hydration.h. */
+    gboolean on_demand;
+
+    /* NULL if all files are chunked as usual. Protected by lock. */
+    struct ChunkPolicy *chunk_policy;
+
+    /* Measured bytes per second, 0 until known. Protected by lock. */
+    double index_rate;
+    double upload_rate;
+    gint64 indexed_bytes;
+    /* Size at which the current commit is split, see handle_add_files(). */
+    gint64 partial_commit_size;
 };
 
 
@@ -138,12 +174,9 @@ seaf_repo_to_commit (SeafRepo *repo, SeafCommit *commit);
 void
 seaf_repo_set_name (SeafRepo *repo, const char *new_name);
 
-/*
- * Returns a list of all commits belongs to the repo.
- * The commits in the repos are all unique.
- */
-GList *
-seaf_repo_get_commits (SeafRepo *repo);
+/* Used to size the partial commits of the repo. */
+void
+seaf_repo_record_upload_rate (SeafRepo *repo, gint64 bytes, gint64 usec);
 
 char *
 seaf_repo_index_commit (SeafRepo *repo,
@@ -261,6 +294,21 @@ seaf_repo_manager_get_repo_property (SeafRepoManager *manager,
 void
 seaf_repo_mamager_del_repo_property (SeafRepoManager *manager, SeafRepo *repo);
 
+/*
+ * Validates and saves the sparse rules of @repo_id. NULL or empty @rules
+ * clear them. The repo doesn't need to exist yet, clone tasks set the rules
+ * before the first checkout. Returns -1 if @rules are invalid.
+ */
+int
+seaf_repo_manager_set_sparse_rules (SeafRepoManager *mgr,
+                                    const char *repo_id,
+                                    const char *rules);
+
+/* TRUE if the sparse rules were changed after the last checkout. */
+gboolean
+seaf_repo_manager_sparse_rules_changed (SeafRepoManager *mgr,
+                                        const char *repo_id);
+
 int
 seaf_repo_check_worktree (SeafRepo *repo);
 
@@ -304,15 +352,6 @@ gboolean
 seaf_repo_manager_server_is_pro (SeafRepoManager *mgr,
                                  const char *server_url);
 
-GList *
-seaf_repo_load_ignore_files (const char *worktree);
-
-gboolean
-seaf_repo_check_ignore_file (GList *ignore_list, const char *fullpath);
-
-void
-seaf_repo_free_ignore_files (GList *ignore_list);
-
 enum {
     FETCH_CHECKOUT_SUCCESS = 0,
     FETCH_CHECKOUT_CANCELED,
@@ -346,6 +385,10 @@ typedef struct _LockedFileSet {
     SeafRepoManager *mgr;
     char repo_id[37];
     GHashTable *locked_files;
+
+    /* Database writes held back by locked_file_set_begin_batch(). */
+    gboolean batching;
+    GQueue *pending_writes;
 } LockedFileSet;
 
 LockedFileSet *
@@ -367,6 +410,16 @@ locked_file_set_remove (LockedFileSet *fset, const char *path, gboolean db_only)
 LockedFile *
 locked_file_set_lookup (LockedFileSet *fset, const char *path);
 
+/* Until locked_file_set_end_batch(), changes to @fset are written to the
+ * database in groups, each in one transaction. The in-memory set is always
+ * up to date.
+ */
+void
+locked_file_set_begin_batch (LockedFileSet *fset);
+
+int
+locked_file_set_end_batch (LockedFileSet *fset);
+
 /* Folder Permissions. */
 
 typedef enum FolderPermType {
@@ -425,6 +478,13 @@ seaf_repo_manager_record_sync_error (const char *repo_id,
 GList *
 seaf_repo_manager_get_file_sync_errors (SeafRepoManager *mgr, int offset, int limit);
 
+/* Returns the @limit latest errors older than @before_id, the latest ones if
+ * @before_id is 0. Pass the smallest id returned to get the next page.
+ */
+GList *
+seaf_repo_manager_get_file_sync_errors_before (SeafRepoManager *mgr,
+                                               int before_id, int limit);
+
 int
 seaf_repo_manager_del_file_sync_error_by_id (SeafRepoManager *mgr, int id);
 
@@ -0,0 +1,345 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#include "seafile-session.h"
+#include "repo-state.h"
+#include "log.h"
+
+#define CLONE_KEY_PREFIX "clone/"
+
+typedef struct StateEntry {
+    /* Compact dump of the state last returned, NULL once it's gone. */
+    char *dump;
+    /* The version the state last changed in. */
+    gint64 version;
+    gboolean seen;
+} StateEntry;
+
+static pthread_mutex_t state_lock = PTHREAD_MUTEX_INITIALIZER;
+/* repo_id or CLONE_KEY_PREFIX + repo_id -> StateEntry */
+static GHashTable *entries;
+static gint64 base_version;
+static gint64 cur_version;
+
+static void
+state_entry_free (StateEntry *entry)
+{
+    g_free (entry->dump);
+    g_free (entry);
+}
+
+static json_t *
+sync_task_to_json (SeafRepo *repo)
+{
+    SyncInfo *info;
+    SyncTask *task;
+    json_t *object;
+    const char *sync_state;
+    char allzeros[41] = {0};
+
+    info = seaf_sync_manager_get_sync_info (seaf->sync_mgr, repo->id);
+    if (!info || !info->current_task)
+        return NULL;
+    task = info->current_task;
+
+    if (!info->in_sync && memcmp(allzeros, info->head_commit, 41) == 0)
+        sync_state = "waiting for sync";
+    else
+        sync_state = sync_state_to_str (task->state);
+
+    object = json_object ();
+    json_object_set_new (object, "repo_id", json_string (repo->id));
+    json_object_set_new (object, "state", json_string (sync_state));
+    json_object_set_new (object, "error", json_integer (task->error));
+    json_object_set_new (object, "force_upload",
+                         json_boolean (task->is_manual_sync));
+
+    return object;
+}
+
+static json_t *
+transfer_task_to_json (const char *repo_id)
+{
+    HttpTxTask *task;
+    SyncInfo *info;
+    json_t *object;
+    gint64 total = -1, done = -1;
+
+    task = http_tx_manager_find_task (seaf->http_tx_mgr, repo_id);
+    if (!task)
+        return NULL;
+
+    object = json_object ();
+    json_object_set_new (object, "repo_id", json_string (repo_id));
+    json_object_set_new (object, "ttype",
+                         json_string (task->type == HTTP_TASK_TYPE_DOWNLOAD ?
+                                      "download" : "upload"));
+    json_object_set_new (object, "state",
+                         json_string (http_task_state_to_str (task->state)));
+    json_object_set_new (object, "rt_state",
+                         json_string (http_task_rt_state_to_str (task->runtime_state)));
+
+    if (task->runtime_state == HTTP_TASK_RT_STATE_FS &&
+        task->type == HTTP_TASK_TYPE_DOWNLOAD) {
+        json_object_set_new (object, "fs_objects_total",
+                             json_integer (task->n_fs_objs));
+        json_object_set_new (object, "fs_objects_done",
+                             json_integer (task->done_fs_objs));
+    }
+
+    if (task->runtime_state == HTTP_TASK_RT_STATE_BLOCK) {
+        if (task->type == HTTP_TASK_TYPE_DOWNLOAD) {
+            total = task->total_download;
+            done = task->done_download;
+        } else {
+            info = seaf_sync_manager_get_sync_info (seaf->sync_mgr, repo_id);
+            if (info && info->multipart_upload) {
+                total = info->total_bytes;
+                done = info->uploaded_bytes;
+            } else {
+                total = task->n_blocks;
+                done = task->done_blocks;
+            }
+        }
+        json_object_set_new (object, "block_total", json_integer (total));
+        json_object_set_new (object, "block_done", json_integer (done));
+        json_object_set_new (object, "rate",
+                             json_integer (http_tx_task_get_rate (task)));
+    }
+
+    return object;
+}
+
+static json_t *
+clone_task_to_json (CloneTask *task)
+{
+    json_t *object = json_object ();
+
+    json_object_set_new (object, "repo_id", json_string (task->repo_id));
+    json_object_set_new (object, "repo_name", json_string (task->repo_name));
+    json_object_set_new (object, "worktree", json_string (task->worktree));
+    json_object_set_new (object, "state",
+                         json_string (clone_task_state_to_str (task->state)));
+    json_object_set_new (object, "error", json_integer (task->error));
+
+    return object;
+}
+
+static void
+set_nullable (json_t *object, const char *key, json_t *value)
+{
+    json_object_set_new (object, key, value ? value : json_null ());
+}
+
+/* The same repos as seafile_get_repo_list() returns. */
+static json_t *
+repo_to_json (SeafRepo *r)
+{
+    json_t *object;
+
+    if (r->head == NULL)
+        return NULL;
+    if (r->worktree_invalid &&
+        !seafile_session_config_get_allow_invalid_worktree (seaf))
+        return NULL;
+
+    object = json_object ();
+    json_object_set_new (object, "id", json_string (r->id));
+    json_object_set_new (object, "name", json_string (r->name));
+    json_object_set_new (object, "desc", json_string (r->desc));
+    json_object_set_new (object, "encrypted", json_boolean (r->encrypted));
+    json_object_set_new (object, "enc_version", json_integer (r->enc_version));
+    json_object_set_new (object, "head_cmmt_id",
+                         json_string (r->head->commit_id));
+    json_object_set_new (object, "version", json_integer (r->version));
+    json_object_set_new (object, "last_modify", json_integer (r->last_modify));
+    json_object_set_new (object, "worktree", json_string (r->worktree));
+    json_object_set_new (object, "worktree_invalid",
+                         json_boolean (r->worktree_invalid));
+    json_object_set_new (object, "last_sync_time",
+                         json_integer (r->last_sync_time));
+    json_object_set_new (object, "auto_sync", json_boolean (r->auto_sync));
+    set_nullable (object, "sync_task", sync_task_to_json (r));
+    set_nullable (object, "transfer_task", transfer_task_to_json (r->id));
+
+    return object;
+}
+
+/*
+ * Called with state_lock held. Records @state under @key and adds it to
+ * @changes if the client hasn't seen it yet. Takes @state.
+ */
+static void
+update_entry (const char *key, json_t *state, gint64 since, gboolean full,
+              gint64 new_version, gboolean *changed, json_t *changes)
+{
+    StateEntry *entry;
+    char *dump;
+
+    dump = json_dumps (state, JSON_COMPACT | JSON_SORT_KEYS);
+    if (!dump) {
+        json_decref (state);
+        return;
+    }
+
+    entry = g_hash_table_lookup (entries, key);
+    if (!entry) {
+        entry = g_new0 (StateEntry, 1);
+        g_hash_table_insert (entries, g_strdup (key), entry);
+    }
+    entry->seen = TRUE;
+
+    if (g_strcmp0 (entry->dump, dump) != 0) {
+        g_free (entry->dump);
+        entry->dump = g_strdup (dump);
+        entry->version = new_version;
+        *changed = TRUE;
+    }
+    free (dump);
+
+    if (full || entry->version > since)
+        json_array_append_new (changes, state);
+    else
+        json_decref (state);
+}
+
+json_t *
+seaf_repo_state_get_changes (gint64 since)
+{
+    GList *repos, *tasks, *ptr;
+    SeafRepo *repo;
+    CloneTask *task;
+    GHashTableIter iter;
+    gpointer key, value;
+    StateEntry *entry;
+    json_t *ret, *repo_changes, *clone_changes, *removed_repos, *removed_clones;
+    json_t *state;
+    gint64 new_version;
+    gboolean full, changed = FALSE;
+    char *clone_key;
+
+    repo_changes = json_array ();
+    clone_changes = json_array ();
+    removed_repos = json_array ();
+    removed_clones = json_array ();
+
+    pthread_mutex_lock (&state_lock);
+
+    if (!entries) {
+        entries = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                         (GDestroyNotify)state_entry_free);
+        /* Later than any version of an earlier run. */
+        base_version = g_get_real_time ();
+        cur_version = base_version;
+    }
+
+    full = (since < base_version || since > cur_version);
+    new_version = cur_version + 1;
+
+    g_hash_table_iter_init (&iter, entries);
+    while (g_hash_table_iter_next (&iter, NULL, &value))
+        ((StateEntry *)value)->seen = FALSE;
+
+    repos = seaf_repo_manager_get_repo_list (seaf->repo_mgr, -1, -1);
+    for (ptr = repos; ptr; ptr = ptr->next) {
+        repo = ptr->data;
+        state = repo_to_json (repo);
+        if (state)
+            update_entry (repo->id, state, since, full, new_version,
+                          &changed, repo_changes);
+    }
+    g_list_free (repos);
+
+    tasks = seaf_clone_manager_get_tasks (seaf->clone_mgr);
+    for (ptr = tasks; ptr; ptr = ptr->next) {
+        task = ptr->data;
+        clone_key = g_strconcat (CLONE_KEY_PREFIX, task->repo_id, NULL);
+        update_entry (clone_key, clone_task_to_json (task), since, full,
+                      new_version, &changed, clone_changes);
+        g_free (clone_key);
+    }
+    g_list_free (tasks);
+
+    /* Entries gone since the last call are kept as removed. */
+    g_hash_table_iter_init (&iter, entries);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        entry = value;
+        if (!entry->seen && entry->dump) {
+            g_free (entry->dump);
+            entry->dump = NULL;
+            entry->version = new_version;
+            changed = TRUE;
+        }
+        if (full || entry->dump || entry->version <= since)
+            continue;
+        if (g_str_has_prefix (key, CLONE_KEY_PREFIX))
+            json_array_append_new (removed_clones,
+                                   json_string ((char *)key + strlen(CLONE_KEY_PREFIX)));
+        else
+            json_array_append_new (removed_repos, json_string (key));
+    }
+
+    if (changed)
+        cur_version = new_version;
+
+    ret = json_object ();
+    json_object_set_new (ret, "version", json_integer (cur_version));
+
+    pthread_mutex_unlock (&state_lock);
+
+    json_object_set_new (ret, "full", json_boolean (full));
+    json_object_set_new (ret, "repos", repo_changes);
+    json_object_set_new (ret, "removed_repos", removed_repos);
+    json_object_set_new (ret, "clone_tasks", clone_changes);
+    json_object_set_new (ret, "removed_clone_tasks", removed_clones);
+
+    return ret;
+}
+
+json_t *
+seaf_repo_state_get_tasks ()
+{
+    GList *repos, *tasks, *ptr;
+    SeafRepo *repo;
+    json_t *ret, *sync_tasks, *transfer_tasks, *clone_tasks, *task;
+
+    sync_tasks = json_array ();
+    transfer_tasks = json_array ();
+    clone_tasks = json_array ();
+
+    repos = seaf_repo_manager_get_repo_list (seaf->repo_mgr, -1, -1);
+    for (ptr = repos; ptr; ptr = ptr->next) {
+        repo = ptr->data;
+        task = sync_task_to_json (repo);
+        if (task)
+            json_array_append_new (sync_tasks, task);
+        task = transfer_task_to_json (repo->id);
+        if (task)
+            json_array_append_new (transfer_tasks, task);
+    }
+    g_list_free (repos);
+
+    /* Transfers of repos being cloned aren't in the repo list yet. */
+    tasks = seaf_clone_manager_get_tasks (seaf->clone_mgr);
+    for (ptr = tasks; ptr; ptr = ptr->next) {
+        CloneTask *clone_task = ptr->data;
+
+        json_array_append_new (clone_tasks, clone_task_to_json (clone_task));
+        if (!seaf_repo_manager_get_repo (seaf->repo_mgr, clone_task->repo_id)) {
+            task = transfer_task_to_json (clone_task->repo_id);
+            if (task)
+                json_array_append_new (transfer_tasks, task);
+        }
+    }
+    g_list_free (tasks);
+
+    ret = json_object ();
+    json_object_set_new (ret, "sync_tasks", sync_tasks);
+    json_object_set_new (ret, "transfer_tasks", transfer_tasks);
+    json_object_set_new (ret, "clone_tasks", clone_tasks);
+
+    return ret;
+}
@@ -0,0 +1,34 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef REPO_STATE_H
+#define REPO_STATE_H
+
+#include <glib.h>
+#include <jansson.h>
+
+/*
+ * Compact state of the repos and clone tasks for clients that poll it.
+ *
+ * Every state returned is remembered with the version it last changed in,
+ * so a client passing the version of its last call only gets the repos and
+ * clone tasks that changed or went away since. Versions of different
+ * daemon runs don't overlap, a version from an earlier run gets the full
+ * state.
+ */
+
+/*
+ * Returns an object with:
+ * - "version": to pass as @since next time
+ * - "full": TRUE if everything is returned, not only changes
+ * - "repos", "clone_tasks": the changed ones
+ * - "removed_repos", "removed_clone_tasks": ids of the ones gone
+ * Pass 0 to get the full state.
+ */
+json_t *
+seaf_repo_state_get_changes (gint64 since);
+
+/* Returns the sync, transfer and clone tasks of all repos at once. */
+json_t *
+seaf_repo_state_get_tasks ();
+
+#endif
@@ -0,0 +1,639 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#include "seafile-session.h"
+#include "commit-mgr.h"
+#include "branch-mgr.h"
+#include "repo-mgr.h"
+#include "fs-mgr.h"
+#include "block-mgr.h"
+#include "obj-store.h"
+#include "timer.h"
+#include "scrubber.h"
+#include "utils.h"
+#include "log.h"
+
+/* How often to look for a repo to scrub, and to save the progress. */
+#define SCRUB_CHECK_INTERVAL 60
+
+/* Seconds without sync tasks before a scrub starts. */
+#define SCRUB_IDLE_TIME 300
+
+/* The throttle sleeps at most this long at once, so stops are noticed. */
+#define MAX_THROTTLE_USEC 500000
+
+typedef struct ScrubResult {
+    char repo_id[37];
+    gint64 finish_time;
+    /* FALSE if the scrub was stopped or failed. */
+    gboolean complete;
+    gint64 n_objs;
+    gint64 n_blocks;
+    gint64 bytes_read;
+    int corrupt_objs;
+    int corrupt_blocks;
+    int repaired;
+} ScrubResult;
+
+typedef struct Scrub {
+    char repo_id[37];
+    int version;
+    char local_root[41];
+    char master_root[41];
+    char *host;
+    char *token;
+    gboolean use_fileserver_port;
+    int transfer_priority;
+
+    /* Set on the main loop to stop the scrub early. */
+    gint stop;
+    /* Jobs running, only used on the main loop. */
+    int n_jobs;
+    gboolean repairing;
+    int result;
+
+    /* Objects and blocks checked by an earlier, stopped scrub. */
+    gint64 skip_objs;
+    gint64 skip_blocks;
+    gint64 start_usec;
+
+    /* Ids of the fs objects walked, only used by the tree job. */
+    BlockList *visited;
+
+    pthread_mutex_t lock;
+    /* Protected by lock. Positions in the walks, including skipped ones. */
+    gint64 obj_pos;
+    gint64 block_pos;
+    gint64 n_objs;
+    gint64 n_blocks;
+    gint64 bytes_read;
+    GList *corrupt_objs;
+    GList *corrupt_blocks;
+    int repaired;
+} Scrub;
+
+static Scrub *current;
+static gint64 last_busy;
+
+static pthread_mutex_t status_lock = PTHREAD_MUTEX_INITIALIZER;
+/* repo_id -> ScrubResult, protected by status_lock like current. */
+static GHashTable *results;
+
+static gboolean
+scrub_stopped (Scrub *scrub)
+{
+    return g_atomic_int_get (&scrub->stop) != 0;
+}
+
+/* Sleeps for as far as the scrub is ahead of scrub_rate. */
+static void
+throttle (Scrub *scrub)
+{
+    gint64 rate = (gint64)seaf->scrub_rate << 10;
+    gint64 bytes, due, now;
+
+    if (rate <= 0)
+        return;
+
+    pthread_mutex_lock (&scrub->lock);
+    bytes = scrub->bytes_read;
+    pthread_mutex_unlock (&scrub->lock);
+
+    due = scrub->start_usec + (gint64)((double)bytes * G_USEC_PER_SEC / rate);
+    now = g_get_monotonic_time ();
+    while (due > now && !scrub_stopped (scrub)) {
+        g_usleep (MIN (due - now, MAX_THROTTLE_USEC));
+        now = g_get_monotonic_time ();
+    }
+}
+
+static gboolean
+check_tree_obj (SeafFSManager *mgr,
+                const char *repo_id,
+                int version,
+                const char *obj_id,
+                int type,
+                void *user_data,
+                gboolean *stop)
+{
+    Scrub *scrub = user_data;
+    void *data;
+    int len = 0;
+    gint64 pos;
+    gboolean sound;
+
+    /* Errors are skipped in the walk, so only pruning ends it early. */
+    if (scrub_stopped (scrub)) {
+        *stop = TRUE;
+        return TRUE;
+    }
+
+    /* Subtrees shared by the heads are checked once. */
+    if (block_list_contains (scrub->visited, obj_id)) {
+        *stop = TRUE;
+        return TRUE;
+    }
+    block_list_insert (scrub->visited, obj_id);
+
+    pthread_mutex_lock (&scrub->lock);
+    pos = ++scrub->obj_pos;
+    pthread_mutex_unlock (&scrub->lock);
+    if (pos <= scrub->skip_objs)
+        return TRUE;
+
+    if (seaf_obj_store_read_obj (seaf->fs_mgr->obj_store, repo_id, version,
+                                 obj_id, &data, &len) < 0) {
+        sound = FALSE;
+    } else {
+        sound = seaf_fs_manager_verify_object_data (mgr, version, obj_id,
+                                                    data, len);
+        g_free (data);
+    }
+    if (!sound)
+        seaf_warning ("Fs object %s of repo %.8s is missing or corrupt.\n",
+                      obj_id, repo_id);
+
+    pthread_mutex_lock (&scrub->lock);
+    ++scrub->n_objs;
+    scrub->bytes_read += len;
+    if (!sound)
+        scrub->corrupt_objs = g_list_prepend (scrub->corrupt_objs,
+                                              g_strdup (obj_id));
+    pthread_mutex_unlock (&scrub->lock);
+
+    throttle (scrub);
+    return TRUE;
+}
+
+static void *
+scrub_tree_job (void *vdata)
+{
+    Scrub *scrub = vdata;
+
+    scrub->visited = block_list_new ();
+
+    if (seaf_fs_manager_traverse_tree (seaf->fs_mgr, scrub->repo_id,
+                                       scrub->version, scrub->local_root,
+                                       check_tree_obj, scrub, TRUE) < 0 ||
+        seaf_fs_manager_traverse_tree (seaf->fs_mgr, scrub->repo_id,
+                                       scrub->version, scrub->master_root,
+                                       check_tree_obj, scrub, TRUE) < 0)
+        scrub->result = -1;
+
+    block_list_free (scrub->visited);
+    scrub->visited = NULL;
+
+    return scrub;
+}
+
+static gboolean
+check_block (const char *store_id,
+             int version,
+             const char *block_id,
+             void *user_data)
+{
+    Scrub *scrub = user_data;
+    BlockMetadata *bmd;
+    gboolean sound, io_error = FALSE;
+    gint64 pos;
+
+    if (scrub_stopped (scrub))
+        return FALSE;
+
+    pthread_mutex_lock (&scrub->lock);
+    pos = ++scrub->block_pos;
+    pthread_mutex_unlock (&scrub->lock);
+    if (pos <= scrub->skip_blocks)
+        return TRUE;
+
+    /* Blocks may be removed meanwhile, e.g. by a checkout. */
+    bmd = seaf_block_manager_stat_block (seaf->block_mgr, store_id, version,
+                                         block_id);
+    if (!bmd)
+        return TRUE;
+
+    sound = seaf_block_manager_verify_block (seaf->block_mgr, store_id, version,
+                                             block_id, &io_error);
+    if (!sound && io_error &&
+        !seaf_block_manager_block_exists (seaf->block_mgr, store_id, version,
+                                          block_id)) {
+        g_free (bmd);
+        return TRUE;
+    }
+    if (!sound)
+        seaf_warning ("Block %s of repo %.8s is corrupt.\n", block_id, store_id);
+
+    pthread_mutex_lock (&scrub->lock);
+    ++scrub->n_blocks;
+    scrub->bytes_read += bmd->size;
+    if (!sound)
+        scrub->corrupt_blocks = g_list_prepend (scrub->corrupt_blocks,
+                                                g_strdup (block_id));
+    pthread_mutex_unlock (&scrub->lock);
+    g_free (bmd);
+
+    throttle (scrub);
+    return TRUE;
+}
+
+static void *
+scrub_store_job (void *vdata)
+{
+    Scrub *scrub = vdata;
+
+    seaf_block_manager_foreach_block (seaf->block_mgr,
+                                      scrub->repo_id, scrub->version,
+                                      check_block, scrub);
+
+    return scrub;
+}
+
+static void *
+repair_job (void *vdata)
+{
+    Scrub *scrub = vdata;
+    GList *ptr;
+    gboolean io_error;
+    int repaired = 0;
+
+    http_tx_manager_refetch_objects (seaf->http_tx_mgr,
+                                     scrub->repo_id, scrub->version,
+                                     scrub->host, scrub->token,
+                                     scrub->use_fileserver_port,
+                                     scrub->transfer_priority,
+                                     scrub->corrupt_objs,
+                                     scrub->corrupt_blocks);
+
+    for (ptr = scrub->corrupt_objs; ptr; ptr = ptr->next) {
+        io_error = FALSE;
+        if (seaf_fs_manager_verify_object (seaf->fs_mgr, scrub->repo_id,
+                                           scrub->version, ptr->data,
+                                           TRUE, &io_error))
+            ++repaired;
+    }
+    for (ptr = scrub->corrupt_blocks; ptr; ptr = ptr->next) {
+        io_error = FALSE;
+        if (seaf_block_manager_block_exists (seaf->block_mgr, scrub->repo_id,
+                                             scrub->version, ptr->data) &&
+            seaf_block_manager_verify_block (seaf->block_mgr, scrub->repo_id,
+                                             scrub->version, ptr->data,
+                                             &io_error))
+            ++repaired;
+    }
+
+    pthread_mutex_lock (&scrub->lock);
+    scrub->repaired = repaired;
+    pthread_mutex_unlock (&scrub->lock);
+
+    return scrub;
+}
+
+static void
+save_checkpoint (Scrub *scrub)
+{
+    char *checkpoint;
+
+    pthread_mutex_lock (&scrub->lock);
+    checkpoint = g_strdup_printf ("%s %s %" G_GINT64_FORMAT " %" G_GINT64_FORMAT,
+                                  scrub->local_root, scrub->master_root,
+                                  scrub->obj_pos, scrub->block_pos);
+    pthread_mutex_unlock (&scrub->lock);
+
+    seaf_repo_manager_set_repo_property (seaf->repo_mgr, scrub->repo_id,
+                                         REPO_PROP_SCRUB_CHECKPOINT, checkpoint);
+    g_free (checkpoint);
+}
+
+static void
+load_checkpoint (Scrub *scrub)
+{
+    char *value;
+    char **tokens;
+
+    value = seaf_repo_manager_get_repo_property (seaf->repo_mgr, scrub->repo_id,
+                                                 REPO_PROP_SCRUB_CHECKPOINT);
+    if (!value)
+        return;
+
+    /* The walk order is only the same for the same heads. */
+    tokens = g_strsplit (value, " ", 0);
+    if (g_strv_length (tokens) == 4 &&
+        strcmp (tokens[0], scrub->local_root) == 0 &&
+        strcmp (tokens[1], scrub->master_root) == 0) {
+        scrub->skip_objs = g_ascii_strtoll (tokens[2], NULL, 10);
+        scrub->skip_blocks = g_ascii_strtoll (tokens[3], NULL, 10);
+    }
+    g_strfreev (tokens);
+    g_free (value);
+}
+
+static void
+scrub_free (Scrub *scrub)
+{
+    g_free (scrub->host);
+    g_free (scrub->token);
+    string_list_free (scrub->corrupt_objs);
+    string_list_free (scrub->corrupt_blocks);
+    pthread_mutex_destroy (&scrub->lock);
+    g_free (scrub);
+}
+
+static void
+finish_scrub (Scrub *scrub)
+{
+    ScrubResult *res;
+    char *now;
+
+    res = g_new0 (ScrubResult, 1);
+    memcpy (res->repo_id, scrub->repo_id, 37);
+    res->finish_time = (gint64)time(NULL);
+    res->complete = (scrub->result == 0 && !scrub_stopped (scrub));
+    res->n_objs = scrub->n_objs;
+    res->n_blocks = scrub->n_blocks;
+    res->bytes_read = scrub->bytes_read;
+    res->corrupt_objs = g_list_length (scrub->corrupt_objs);
+    res->corrupt_blocks = g_list_length (scrub->corrupt_blocks);
+    res->repaired = scrub->repaired;
+
+    if (res->complete) {
+        seaf_message ("Scrub of repo %.8s checked %" G_GINT64_FORMAT
+                      " fs objects and %" G_GINT64_FORMAT " blocks, "
+                      "%d corrupt, %d repaired.\n",
+                      scrub->repo_id, res->n_objs, res->n_blocks,
+                      res->corrupt_objs + res->corrupt_blocks, res->repaired);
+        now = g_strdup_printf ("%" G_GINT64_FORMAT, (gint64)time(NULL));
+        seaf_repo_manager_set_repo_property (seaf->repo_mgr, scrub->repo_id,
+                                             REPO_PROP_LAST_SCRUB, now);
+        g_free (now);
+        seaf_repo_manager_set_repo_property (seaf->repo_mgr, scrub->repo_id,
+                                             REPO_PROP_SCRUB_CHECKPOINT, "");
+    } else if (scrub_stopped (scrub)) {
+        seaf_message ("Scrub of repo %.8s stopped.\n", scrub->repo_id);
+        save_checkpoint (scrub);
+    } else {
+        seaf_warning ("Scrub of repo %.8s failed.\n", scrub->repo_id);
+        /* Don't retry before the next interval. */
+        now = g_strdup_printf ("%" G_GINT64_FORMAT, (gint64)time(NULL));
+        seaf_repo_manager_set_repo_property (seaf->repo_mgr, scrub->repo_id,
+                                             REPO_PROP_LAST_SCRUB, now);
+        g_free (now);
+    }
+
+    pthread_mutex_lock (&status_lock);
+    g_hash_table_replace (results, res->repo_id, res);
+    current = NULL;
+    pthread_mutex_unlock (&status_lock);
+
+    last_busy = (gint64)time(NULL);
+    scrub_free (scrub);
+}
+
+static void
+scrub_job_done (void *vdata)
+{
+    Scrub *scrub = vdata;
+
+    if (--scrub->n_jobs > 0)
+        return;
+
+    /* Also repaired when stopped, the sync would fail on them. Objects
+     * that stay corrupt are left to the next scrub.
+     */
+    if (!scrub->repairing &&
+        (scrub->corrupt_objs || scrub->corrupt_blocks) &&
+        scrub->host && scrub->token) {
+        scrub->repairing = TRUE;
+        scrub->n_jobs = 1;
+        if (seaf_job_manager_schedule_job (seaf->job_mgr, repair_job,
+                                           scrub_job_done, scrub) == 0)
+            return;
+        seaf_warning ("Failed to schedule scrub repair.\n");
+    }
+
+    finish_scrub (scrub);
+}
+
+static int
+get_head_root (const char *repo_id, int version,
+               const char *branch_name, char *root_id)
+{
+    SeafBranch *branch;
+    SeafCommit *head;
+
+    branch = seaf_branch_manager_get_branch (seaf->branch_mgr,
+                                             repo_id, branch_name);
+    if (!branch) {
+        seaf_warning ("Branch %s not found for repo %.8s.\n",
+                      branch_name, repo_id);
+        return -1;
+    }
+
+    head = seaf_commit_manager_get_commit (seaf->commit_mgr,
+                                           repo_id, version,
+                                           branch->commit_id);
+    seaf_branch_unref (branch);
+    if (!head) {
+        seaf_warning ("Head commit of branch %s not found for repo %.8s.\n",
+                      branch_name, repo_id);
+        return -1;
+    }
+
+    memcpy (root_id, head->root_id, 41);
+    seaf_commit_unref (head);
+    return 0;
+}
+
+static gboolean
+need_scrub (SeafRepo *repo, gint64 now)
+{
+    SyncInfo *info;
+    char *value;
+    gint64 last_scrub = 0;
+
+    if (repo->delete_pending || !repo->head)
+        return FALSE;
+
+    info = seaf_sync_manager_get_sync_info (seaf->sync_mgr, repo->id);
+    if ((info && info->in_sync) ||
+        http_tx_manager_find_task (seaf->http_tx_mgr, repo->id) != NULL)
+        return FALSE;
+
+    value = seaf_repo_manager_get_repo_property (seaf->repo_mgr, repo->id,
+                                                 REPO_PROP_LAST_SCRUB);
+    if (value)
+        last_scrub = g_ascii_strtoll (value, NULL, 10);
+    g_free (value);
+
+    return (now - last_scrub >= (gint64)seaf->scrub_interval * 3600);
+}
+
+static void
+start_scrub (SeafRepo *repo)
+{
+    Scrub *scrub = g_new0 (Scrub, 1);
+
+    memcpy (scrub->repo_id, repo->id, 37);
+    scrub->version = repo->version;
+    pthread_mutex_init (&scrub->lock, NULL);
+
+    if (get_head_root (repo->id, repo->version, "local", scrub->local_root) < 0 ||
+        get_head_root (repo->id, repo->version, "master", scrub->master_root) < 0) {
+        scrub->result = -1;
+        finish_scrub (scrub);
+        return;
+    }
+
+    scrub->host = g_strdup (repo->effective_host);
+    scrub->token = g_strdup (repo->token);
+    scrub->use_fileserver_port = repo->use_fileserver_port;
+    scrub->transfer_priority = repo->transfer_priority;
+    load_checkpoint (scrub);
+    scrub->start_usec = g_get_monotonic_time ();
+
+    seaf_message ("Starting scrub of repo %s(%.8s).\n", repo->name, repo->id);
+
+    pthread_mutex_lock (&status_lock);
+    current = scrub;
+    pthread_mutex_unlock (&status_lock);
+
+    if (seaf_job_manager_schedule_job (seaf->job_mgr, scrub_tree_job,
+                                       scrub_job_done, scrub) < 0) {
+        seaf_warning ("Failed to schedule scrub.\n");
+        scrub->result = -1;
+        finish_scrub (scrub);
+        return;
+    }
+    ++scrub->n_jobs;
+
+    if (seaf_job_manager_schedule_job (seaf->job_mgr, scrub_store_job,
+                                       scrub_job_done, scrub) < 0) {
+        /* The tree job is still running, it finishes the scrub. */
+        seaf_warning ("Failed to schedule scrub.\n");
+        scrub->result = -1;
+        g_atomic_int_set (&scrub->stop, 1);
+        return;
+    }
+    ++scrub->n_jobs;
+}
+
+static int
+scrub_pulse (void *vdata)
+{
+    gint64 now = (gint64)time(NULL);
+    GList *repos, *ptr;
+
+    if (current) {
+        if (!current->repairing)
+            save_checkpoint (current);
+        return TRUE;
+    }
+
+    if (seaf->sync_mgr->n_running_tasks > 0) {
+        last_busy = now;
+        return TRUE;
+    }
+    if (now - last_busy < SCRUB_IDLE_TIME)
+        return TRUE;
+
+    repos = seaf_repo_manager_get_repo_list (seaf->repo_mgr, -1, -1);
+    for (ptr = repos; ptr; ptr = ptr->next) {
+        if (need_scrub (ptr->data, now)) {
+            start_scrub (ptr->data);
+            break;
+        }
+    }
+    g_list_free (repos);
+
+    return TRUE;
+}
+
+int
+seaf_scrubber_start ()
+{
+    results = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, g_free);
+
+    last_busy = (gint64)time(NULL);
+    seaf_timer_new (scrub_pulse, NULL, SCRUB_CHECK_INTERVAL * 1000);
+
+    return 0;
+}
+
+gboolean
+seaf_scrubber_stop (const char *repo_id)
+{
+    if (!current || strcmp (current->repo_id, repo_id) != 0)
+        return FALSE;
+
+    g_atomic_int_set (&current->stop, 1);
+    return TRUE;
+}
+
+static json_t *
+result_to_json (ScrubResult *res)
+{
+    json_t *object = json_object ();
+
+    json_object_set_new (object, "repo_id", json_string (res->repo_id));
+    json_object_set_new (object, "finish_time", json_integer (res->finish_time));
+    json_object_set_new (object, "complete", json_boolean (res->complete));
+    json_object_set_new (object, "objects_checked", json_integer (res->n_objs));
+    json_object_set_new (object, "blocks_checked", json_integer (res->n_blocks));
+    json_object_set_new (object, "bytes_read", json_integer (res->bytes_read));
+    json_object_set_new (object, "corrupt_objects",
+                         json_integer (res->corrupt_objs));
+    json_object_set_new (object, "corrupt_blocks",
+                         json_integer (res->corrupt_blocks));
+    json_object_set_new (object, "repaired", json_integer (res->repaired));
+
+    return object;
+}
+
+json_t *
+seaf_scrubber_get_status ()
+{
+    json_t *ret, *array, *object;
+    GHashTableIter iter;
+    gpointer value;
+
+    ret = json_object ();
+    array = json_array ();
+
+    pthread_mutex_lock (&status_lock);
+
+    if (current) {
+        object = json_object ();
+        json_object_set_new (object, "repo_id", json_string (current->repo_id));
+        pthread_mutex_lock (&current->lock);
+        json_object_set_new (object, "objects_checked",
+                             json_integer (current->n_objs));
+        json_object_set_new (object, "blocks_checked",
+                             json_integer (current->n_blocks));
+        json_object_set_new (object, "bytes_read",
+                             json_integer (current->bytes_read));
+        json_object_set_new (object, "corrupt_objects",
+                             json_integer (g_list_length (current->corrupt_objs)));
+        json_object_set_new (object, "corrupt_blocks",
+                             json_integer (g_list_length (current->corrupt_blocks)));
+        pthread_mutex_unlock (&current->lock);
+        json_object_set_new (object, "repairing",
+                             json_boolean (current->repairing));
+        json_object_set_new (ret, "current", object);
+    } else {
+        json_object_set_new (ret, "current", json_null ());
+    }
+
+    if (results) {
+        g_hash_table_iter_init (&iter, results);
+        while (g_hash_table_iter_next (&iter, NULL, &value))
+            json_array_append_new (array, result_to_json (value));
+    }
+
+    pthread_mutex_unlock (&status_lock);
+
+    json_object_set_new (ret, "results", array);
+
+    return ret;
+}
@@ -0,0 +1,42 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SCRUBBER_H
+#define SCRUBBER_H
+
+#include <glib.h>
+#include <jansson.h>
+
+/*
+ * Background integrity check of the local repo data.
+ *
+ * The fs objects of the local and master head trees and the blocks in the
+ * repo's block store are verified by two jobs in parallel, reading at most
+ * scrub_rate KB per second together. Corrupt or missing objects are fetched
+ * again from the server. Only objects the server doesn't have, e.g. ones
+ * of a pending upload, stay corrupt; they're reported.
+ *
+ * Like the block GC, one repo is checked at a time after the daemon has
+ * had no sync tasks for a while, each repo at most once per scrub_interval
+ * hours. A scrub stopped for a sync saves its progress and resumes from it
+ * later if the heads haven't changed meanwhile.
+ */
+
+int
+seaf_scrubber_start ();
+
+/*
+ * Returns TRUE if a scrub of @repo_id is running, and asks it to stop. The
+ * sync manager doesn't start the sync until the scrub is done.
+ */
+gboolean
+seaf_scrubber_stop (const char *repo_id);
+
+/*
+ * Returns an object with:
+ * - "current": progress of the running scrub, or null
+ * - "results": the last result of every repo scrubbed since the start
+ */
+json_t *
+seaf_scrubber_get_status ();
+
+#endif
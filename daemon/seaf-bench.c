@@ -0,0 +1,1145 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Micro-benchmarks of the storage and chunking code, run with "make bench".
+ *
+ * All data is synthetic and generated under the work dir. Results are
+ * written as JSON, one object per benchmark with the number of operations,
+ * the total time and, for benchmarks that process data, the throughput.
+ *
+ * The "replay" benchmark runs the commit pipeline on the worktree events
+ * recorded with seafile_start_wt_event_recording(), passed with -e, or on a
+ * synthetic stream of events if there's no recording.
+ */
+
+#include "common.h"
+
+#include <getopt.h>
+#include <curl/curl.h>
+#include <jansson.h>
+
+#include "seafile-session.h"
+#include "seafile-crypt.h"
+#include "fs-mgr.h"
+#include "block-mgr.h"
+#include "obj-store.h"
+#include "index/index.h"
+#include "diff-simple.h"
+#include "cdc/cdc.h"
+#include "metrics.h"
+#include "trace.h"
+#include "wt-monitor.h"
+#include "wt-event-log.h"
+#include "utils.h"
+#include "log.h"
+
+SeafileSession *seaf;
+
+#define BENCH_REPO_ID "8d4a5f1b-9c3e-4b2a-a7f6-0e1d2c3b4a59"
+#define BENCH_REPO_VERSION 1
+
+typedef struct BenchParams {
+    char *work_dir;
+    int n_files;
+    int files_per_dir;
+    gint64 file_size;
+    int block_size;
+    int iterations;
+    char *events_file;
+} BenchParams;
+
+typedef void (*BenchFunc) (BenchParams *params, json_t *results);
+
+static const char *short_options = "hd:n:f:s:b:i:e:o:";
+static struct option long_options[] = {
+    { "help", no_argument, NULL, 'h', },
+    { "work-dir", required_argument, NULL, 'd', },
+    { "files", required_argument, NULL, 'n', },
+    { "files-per-dir", required_argument, NULL, 'f', },
+    { "file-size", required_argument, NULL, 's', },
+    { "block-size", required_argument, NULL, 'b', },
+    { "iterations", required_argument, NULL, 'i', },
+    { "events", required_argument, NULL, 'e', },
+    { "output", required_argument, NULL, 'o', },
+    { NULL, 0, NULL, 0, },
+};
+
+static void usage ()
+{
+    fprintf (stderr,
+             "usage: seaf-bench [-d work_dir] [-n files] [-f files_per_dir]\n"
+             "                  [-s file_size_mb] [-b block_size_kb]\n"
+             "                  [-i iterations] [-e events_file]\n"
+             "                  [-o output.json] [benchmark ...]\n");
+}
+
+/* Deterministic, so that runs are comparable. */
+static guint64 rand_state = 0x9e3779b97f4a7c15ULL;
+
+static guint64
+next_rand ()
+{
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 7;
+    rand_state ^= rand_state << 17;
+    return rand_state;
+}
+
+static void
+fill_random (guint8 *buf, gint64 len)
+{
+    gint64 i;
+    guint64 r = 0;
+
+    for (i = 0; i < len; ++i) {
+        if ((i & 7) == 0)
+            r = next_rand ();
+        buf[i] = (guint8)r;
+        r >>= 8;
+    }
+}
+
+static void
+random_id (char *id)
+{
+    unsigned char sha1[20];
+
+    fill_random (sha1, 20);
+    rawdata_to_hex (sha1, id, 20);
+}
+
+static void
+report (json_t *results, const char *name, gint64 ops, gint64 bytes,
+        gint64 usec)
+{
+    json_t *object = json_object ();
+
+    json_object_set_new (object, "name", json_string (name));
+    json_object_set_new (object, "ops", json_integer (ops));
+    json_object_set_new (object, "usec", json_integer (usec));
+    json_object_set_new (object, "usec_per_op",
+                         json_real (ops > 0 ? (double)usec / ops : 0));
+    if (bytes > 0) {
+        json_object_set_new (object, "bytes", json_integer (bytes));
+        json_object_set_new (object, "mb_per_sec",
+                             json_real (usec > 0 ? (double)bytes / usec : 0));
+    }
+
+    json_array_append_new (results, object);
+}
+
+static char *
+create_random_file (BenchParams *params, const char *name, gint64 size)
+{
+    char *path = g_build_filename (params->work_dir, name, NULL);
+    guint8 *buf = g_malloc (1 << 20);
+    gint64 left = size;
+    int fd, n;
+
+    fd = seaf_util_create (path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+    if (fd < 0) {
+        seaf_warning ("Failed to create %s: %s.\n", path, strerror(errno));
+        g_free (buf);
+        g_free (path);
+        return NULL;
+    }
+
+    while (left > 0) {
+        n = (int)MIN (left, 1 << 20);
+        fill_random (buf, n);
+        if (writen (fd, buf, n) != n) {
+            seaf_warning ("Failed to write %s: %s.\n", path, strerror(errno));
+            close (fd);
+            g_free (buf);
+            g_free (path);
+            return NULL;
+        }
+        left -= n;
+    }
+
+    close (fd);
+    g_free (buf);
+    return path;
+}
+
+static void
+bench_chunking (BenchParams *params, json_t *results, gboolean use_cdc)
+{
+    char *path;
+    unsigned char sha1[20];
+    gint64 size, start;
+    int i;
+
+    path = create_random_file (params, "chunk-file", params->file_size);
+    if (!path)
+        return;
+
+    start = seaf_metrics_now ();
+    for (i = 0; i < params->iterations; ++i) {
+        if (seaf_fs_manager_index_blocks (seaf->fs_mgr, BENCH_REPO_ID,
+                                          BENCH_REPO_VERSION, path, sha1,
+                                          &size, NULL, FALSE, FALSE, use_cdc,
+                                          0, NULL) < 0) {
+            seaf_warning ("Failed to chunk %s.\n", path);
+            goto out;
+        }
+    }
+    report (results, use_cdc ? "chunk_cdc" : "chunk_fixed",
+            params->iterations, params->file_size * params->iterations,
+            seaf_metrics_now () - start);
+
+out:
+    seaf_util_unlink (path);
+    g_free (path);
+}
+
+static void
+bench_chunk_cdc (BenchParams *params, json_t *results)
+{
+    bench_chunking (params, results, TRUE);
+}
+
+static void
+bench_chunk_fixed (BenchParams *params, json_t *results)
+{
+    bench_chunking (params, results, FALSE);
+}
+
+/* Entries are in descending order, like in stored dirs. */
+static GList *
+make_file_dirents (int n, const char *prefix)
+{
+    GList *entries = NULL;
+    char name[64], id[41];
+    int i;
+
+    for (i = 0; i < n; ++i) {
+        snprintf (name, sizeof(name), "%s-%08d.txt", prefix, i);
+        random_id (id);
+        entries = g_list_prepend (entries,
+                                  seaf_dirent_new (BENCH_REPO_VERSION, id,
+                                                   S_IFREG | 0644, name,
+                                                   1500000000 + i,
+                                                   "bench@example.com",
+                                                   (gint64)(next_rand () % (1 << 20))));
+    }
+
+    return entries;
+}
+
+static void
+bench_dir_serialize (BenchParams *params, json_t *results)
+{
+    SeafDir *dir, *parsed;
+    void *data;
+    int len, i;
+    gint64 start, bytes = 0;
+
+    dir = seaf_dir_new (NULL, make_file_dirents (params->files_per_dir, "f"),
+                        BENCH_REPO_VERSION);
+
+    start = seaf_metrics_now ();
+    for (i = 0; i < params->iterations * 10; ++i) {
+        data = seaf_dir_to_data (dir, &len);
+        bytes += len;
+        g_free (data);
+    }
+    report (results, "dir_to_data", params->iterations * 10, bytes,
+            seaf_metrics_now () - start);
+
+    bytes = 0;
+    start = seaf_metrics_now ();
+    for (i = 0; i < params->iterations * 10; ++i) {
+        parsed = seaf_dir_from_data (dir->dir_id, dir->ondisk,
+                                     dir->ondisk_size, TRUE);
+        if (!parsed) {
+            seaf_warning ("Failed to parse dir %s.\n", dir->dir_id);
+            break;
+        }
+        bytes += dir->ondisk_size;
+        seaf_dir_free (parsed);
+    }
+    report (results, "dir_from_data", i, bytes, seaf_metrics_now () - start);
+
+    seaf_dir_free (dir);
+}
+
+/* Text that compresses like the JSON of dir objects. */
+static guint8 *
+make_dir_like_text (int len)
+{
+    GString *buf = g_string_sized_new (len + 256);
+    char id[41];
+    int i = 0;
+
+    while (buf->len < len) {
+        random_id (id);
+        g_string_append_printf (buf,
+                                "{\"id\": \"%s\", \"mode\": 33188, "
+                                "\"modifier\": \"bench@example.com\", "
+                                "\"mtime\": %d, \"name\": \"file-%08d.txt\", "
+                                "\"size\": %d}, ",
+                                id, 1500000000 + i, i,
+                                (int)(next_rand () % (1 << 20)));
+        ++i;
+    }
+    g_string_truncate (buf, len);
+
+    return (guint8 *)g_string_free (buf, FALSE);
+}
+
+static void
+bench_compress (BenchParams *params, json_t *results)
+{
+    int len = params->block_size;
+    guint8 *text, *compressed = NULL, *decompressed;
+    int compressed_len = 0, out_len;
+    gint64 start;
+    int i, n = params->iterations * 10;
+
+    text = make_dir_like_text (len);
+
+    start = seaf_metrics_now ();
+    for (i = 0; i < n; ++i) {
+        g_free (compressed);
+        if (seaf_compress (text, len, &compressed, &compressed_len) < 0) {
+            seaf_warning ("Failed to compress.\n");
+            goto out;
+        }
+    }
+    report (results, "compress", n, (gint64)len * n,
+            seaf_metrics_now () - start);
+
+    start = seaf_metrics_now ();
+    for (i = 0; i < n; ++i) {
+        if (seaf_decompress (compressed, compressed_len,
+                             &decompressed, &out_len) < 0) {
+            seaf_warning ("Failed to decompress.\n");
+            goto out;
+        }
+        g_free (decompressed);
+    }
+    report (results, "decompress", n, (gint64)len * n,
+            seaf_metrics_now () - start);
+
+out:
+    g_free (compressed);
+    g_free (text);
+}
+
+static void
+bench_crypt (BenchParams *params, json_t *results)
+{
+    unsigned char key[32], iv[16];
+    SeafileCrypt *crypt;
+    guint8 *plain;
+    char *enc = NULL, *dec;
+    int enc_len = 0, dec_len;
+    int len = params->block_size;
+    int i, n = params->iterations * 10;
+    gint64 start;
+
+    fill_random (key, sizeof(key));
+    fill_random (iv, sizeof(iv));
+    crypt = seafile_crypt_new (2, key, iv);
+
+    plain = g_malloc (len);
+    fill_random (plain, len);
+
+    start = seaf_metrics_now ();
+    for (i = 0; i < n; ++i) {
+        g_free (enc);
+        if (seafile_encrypt (&enc, &enc_len, (char *)plain, len, crypt) < 0) {
+            seaf_warning ("Failed to encrypt.\n");
+            enc = NULL;
+            goto out;
+        }
+    }
+    report (results, "encrypt", n, (gint64)len * n,
+            seaf_metrics_now () - start);
+
+    start = seaf_metrics_now ();
+    for (i = 0; i < n; ++i) {
+        if (seafile_decrypt (&dec, &dec_len, enc, enc_len, crypt) < 0) {
+            seaf_warning ("Failed to decrypt.\n");
+            goto out;
+        }
+        g_free (dec);
+    }
+    report (results, "decrypt", n, (gint64)len * n,
+            seaf_metrics_now () - start);
+
+out:
+    g_free (enc);
+    g_free (plain);
+    g_free (crypt);
+}
+
+static void
+bench_index (BenchParams *params, json_t *results)
+{
+    struct index_state istate;
+    struct cache_entry *ce;
+    unsigned char sha1[20];
+    char *index_path, path[SEAF_PATH_MAX];
+    gint64 start, write_usec = 0, read_usec = 0;
+    int i, fd;
+
+    index_path = g_build_filename (params->work_dir, "index", NULL);
+
+    /* Creates an empty index, as the file doesn't exist yet. */
+    memset (&istate, 0, sizeof(istate));
+    if (read_index_from (&istate, index_path, BENCH_REPO_VERSION) < 0) {
+        seaf_warning ("Failed to create index.\n");
+        goto out;
+    }
+    for (i = 0; i < params->n_files; ++i) {
+        snprintf (path, sizeof(path), "dir-%06d/file-%08d.txt",
+                  i / params->files_per_dir, i);
+        fill_random (sha1, 20);
+        ce = make_cache_entry (S_IFREG | 0644, sha1, path, NULL, 0, 0);
+        ce->ce_size = next_rand () % (1 << 20);
+        add_index_entry (&istate, ce, ADD_CACHE_OK_TO_ADD);
+    }
+
+    for (i = 0; i < params->iterations; ++i) {
+        start = seaf_metrics_now ();
+        fd = seaf_util_create (index_path,
+                               O_RDWR | O_CREAT | O_TRUNC | O_BINARY, 0666);
+        if (fd < 0 || write_index (&istate, fd) < 0) {
+            seaf_warning ("Failed to write index %s.\n", index_path);
+            if (fd >= 0)
+                close (fd);
+            discard_index (&istate);
+            goto out;
+        }
+        close (fd);
+        write_usec += seaf_metrics_now () - start;
+    }
+    discard_index (&istate);
+
+    for (i = 0; i < params->iterations; ++i) {
+        memset (&istate, 0, sizeof(istate));
+        start = seaf_metrics_now ();
+        if (read_index_from (&istate, index_path, BENCH_REPO_VERSION) < 0) {
+            seaf_warning ("Failed to read index %s.\n", index_path);
+            goto out;
+        }
+        read_usec += seaf_metrics_now () - start;
+        discard_index (&istate);
+    }
+
+    report (results, "write_index", params->iterations, 0, write_usec);
+    report (results, "read_index", params->iterations, 0, read_usec);
+
+out:
+    seaf_util_unlink (index_path);
+    g_free (index_path);
+}
+
+/*
+ * Saves a root with n_files / files_per_dir subdirs. Every @modify_every-th
+ * subdir gets different file ids in the second tree.
+ */
+static int
+save_tree (BenchParams *params, int modify_every, guint64 seed,
+           char *root_id)
+{
+    GList *subdirs = NULL;
+    SeafDir *dir, *root;
+    char name[64];
+    int n_dirs = MAX (params->n_files / params->files_per_dir, 1);
+    guint64 saved;
+    int i, ret = 0;
+
+    for (i = 0; i < n_dirs; ++i) {
+        snprintf (name, sizeof(name), "dir-%06d", i);
+
+        /* Unchanged dirs get the same entries in both trees. */
+        saved = rand_state;
+        rand_state = 0x9e3779b97f4a7c15ULL + i +
+            ((modify_every > 0 && i % modify_every == 0) ? seed : 0);
+        dir = seaf_dir_new (NULL, make_file_dirents (params->files_per_dir, "f"),
+                            BENCH_REPO_VERSION);
+        rand_state = saved;
+
+        if (seaf_dir_save (seaf->fs_mgr, BENCH_REPO_ID,
+                           BENCH_REPO_VERSION, dir) < 0) {
+            seaf_dir_free (dir);
+            return -1;
+        }
+
+        subdirs = g_list_prepend (subdirs,
+                                  seaf_dirent_new (BENCH_REPO_VERSION,
+                                                   dir->dir_id,
+                                                   S_IFDIR, name, 0, NULL, 0));
+        seaf_dir_free (dir);
+    }
+
+    root = seaf_dir_new (NULL, subdirs, BENCH_REPO_VERSION);
+    if (seaf_dir_save (seaf->fs_mgr, BENCH_REPO_ID,
+                       BENCH_REPO_VERSION, root) < 0)
+        ret = -1;
+    memcpy (root_id, root->dir_id, 41);
+    seaf_dir_free (root);
+
+    return ret;
+}
+
+static void
+bench_diff_trees (BenchParams *params, json_t *results)
+{
+    char root1[41], root2[41];
+    GList *diff_results = NULL;
+    gint64 start;
+    int i;
+
+    if (save_tree (params, 0, 0, root1) < 0 ||
+        save_tree (params, 10, 1, root2) < 0) {
+        seaf_warning ("Failed to save trees.\n");
+        return;
+    }
+
+    start = seaf_metrics_now ();
+    for (i = 0; i < params->iterations; ++i) {
+        if (diff_commit_roots (BENCH_REPO_ID, BENCH_REPO_VERSION,
+                               root1, root2, &diff_results, TRUE) < 0) {
+            seaf_warning ("Failed to diff trees.\n");
+            return;
+        }
+        g_list_free_full (diff_results, (GDestroyNotify)diff_entry_free);
+        diff_results = NULL;
+    }
+    report (results, "diff_trees", params->iterations, 0,
+            seaf_metrics_now () - start);
+}
+
+static void
+bench_obj_store (BenchParams *params, json_t *results)
+{
+    struct SeafObjStore *store = seaf->fs_mgr->obj_store;
+    int n = params->n_files, len = 256;
+    char (*ids)[41];
+    guint8 *data;
+    void *read_data;
+    int read_len, i;
+    gint64 start;
+
+    ids = g_malloc0 ((gsize)n * 41);
+    data = g_malloc (len);
+
+    start = seaf_metrics_now ();
+    for (i = 0; i < n; ++i) {
+        random_id (ids[i]);
+        fill_random (data, len);
+        if (seaf_obj_store_write_obj (store, BENCH_REPO_ID, BENCH_REPO_VERSION,
+                                      ids[i], data, len, FALSE) < 0) {
+            seaf_warning ("Failed to write object %s.\n", ids[i]);
+            goto out;
+        }
+    }
+    report (results, "obj_write", n, (gint64)len * n,
+            seaf_metrics_now () - start);
+
+    start = seaf_metrics_now ();
+    for (i = 0; i < n; ++i) {
+        if (seaf_obj_store_read_obj (store, BENCH_REPO_ID, BENCH_REPO_VERSION,
+                                     ids[i], &read_data, &read_len) < 0) {
+            seaf_warning ("Failed to read object %s.\n", ids[i]);
+            goto out;
+        }
+        g_free (read_data);
+    }
+    report (results, "obj_read", n, (gint64)len * n,
+            seaf_metrics_now () - start);
+
+out:
+    g_free (data);
+    g_free (ids);
+}
+
+static void
+bench_block_store (BenchParams *params, json_t *results)
+{
+    SeafBlockManager *mgr = seaf->block_mgr;
+    int len = params->block_size;
+    int n = (int)MAX (params->file_size / len, 1);
+    unsigned char sha1[20];
+    char (*ids)[41];
+    BlockHandle *handle;
+    guint8 *data;
+    gint64 start;
+    int i;
+
+    ids = g_malloc0 ((gsize)n * 41);
+    data = g_malloc (len);
+
+    start = seaf_metrics_now ();
+    for (i = 0; i < n; ++i) {
+        fill_random (data, len);
+        calculate_sha1 (sha1, (const char *)data, len);
+        rawdata_to_hex (sha1, ids[i], 20);
+
+        handle = seaf_block_manager_open_block (mgr, BENCH_REPO_ID,
+                                                BENCH_REPO_VERSION,
+                                                ids[i], BLOCK_WRITE);
+        if (!handle) {
+            seaf_warning ("Failed to open block %s.\n", ids[i]);
+            goto out;
+        }
+        if (seaf_block_manager_write_block (mgr, handle, data, len) != len ||
+            seaf_block_manager_close_block (mgr, handle) < 0 ||
+            seaf_block_manager_commit_block (mgr, handle) < 0) {
+            seaf_warning ("Failed to write block %s.\n", ids[i]);
+            seaf_block_manager_block_handle_free (mgr, handle);
+            goto out;
+        }
+        seaf_block_manager_block_handle_free (mgr, handle);
+    }
+    report (results, "block_write", n, (gint64)len * n,
+            seaf_metrics_now () - start);
+
+    start = seaf_metrics_now ();
+    for (i = 0; i < n; ++i) {
+        handle = seaf_block_manager_open_block (mgr, BENCH_REPO_ID,
+                                                BENCH_REPO_VERSION,
+                                                ids[i], BLOCK_READ);
+        if (!handle) {
+            seaf_warning ("Failed to open block %s.\n", ids[i]);
+            goto out;
+        }
+        if (seaf_block_manager_read_block (mgr, handle, data, len) != len) {
+            seaf_warning ("Failed to read block %s.\n", ids[i]);
+            seaf_block_manager_close_block (mgr, handle);
+            seaf_block_manager_block_handle_free (mgr, handle);
+            goto out;
+        }
+        seaf_block_manager_close_block (mgr, handle);
+        seaf_block_manager_block_handle_free (mgr, handle);
+    }
+    report (results, "block_read", n, (gint64)len * n,
+            seaf_metrics_now () - start);
+
+out:
+    g_free (data);
+    g_free (ids);
+}
+
+/* Replayed files get between 4KB and 8KB of new data on every update. */
+#define REPLAY_FILE_SIZE 4096
+/* Like the monitor, commit once the worktree has been quiet for 2s. */
+#define REPLAY_QUIET_USEC (2 * G_USEC_PER_SEC)
+
+static GList *
+add_record (GList *records, gint64 time, int type,
+            const char *path, const char *new_path)
+{
+    WTEventRecord *record = g_new0 (WTEventRecord, 1);
+
+    record->time = time;
+    record->event = wt_event_new (type, path, new_path);
+    return g_list_prepend (records, record);
+}
+
+/*
+ * The files are created, then every 10th file is updated, then the first
+ * dir is renamed and the second one deleted, with quiet periods between.
+ */
+static GList *
+make_synthetic_events (BenchParams *params)
+{
+    GList *records = NULL;
+    char path[SEAF_PATH_MAX];
+    gint64 time = 0;
+    int i;
+
+    for (i = 0; i < params->n_files; ++i) {
+        snprintf (path, sizeof(path), "dir-%06d/file-%08d.txt",
+                  i / params->files_per_dir, i);
+        records = add_record (records, time++, WT_EVENT_CREATE_OR_UPDATE,
+                              path, NULL);
+    }
+
+    time += 2 * REPLAY_QUIET_USEC;
+    for (i = 0; i < params->n_files; i += 10) {
+        snprintf (path, sizeof(path), "dir-%06d/file-%08d.txt",
+                  i / params->files_per_dir, i);
+        records = add_record (records, time++, WT_EVENT_CREATE_OR_UPDATE,
+                              path, NULL);
+    }
+
+    time += 2 * REPLAY_QUIET_USEC;
+    records = add_record (records, time++, WT_EVENT_RENAME,
+                          "dir-000000", "dir-renamed");
+    if (params->n_files > params->files_per_dir)
+        records = add_record (records, time++, WT_EVENT_DELETE,
+                              "dir-000001", NULL);
+
+    return g_list_reverse (records);
+}
+
+static void
+add_parent_dirs (GHashTable *dirs, const char *path)
+{
+    char *dir = g_strdup (path);
+    char *slash;
+
+    while ((slash = strrchr (dir, '/')) != NULL) {
+        *slash = '\0';
+        g_hash_table_add (dirs, g_strdup (dir));
+    }
+    g_free (dir);
+}
+
+/* Paths with other recorded paths under them are taken as dirs. */
+static GHashTable *
+collect_dirs (GList *records)
+{
+    GHashTable *dirs = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                              g_free, NULL);
+    WTEventRecord *record;
+    GList *ptr;
+
+    for (ptr = records; ptr; ptr = ptr->next) {
+        record = ptr->data;
+        if (record->event->path)
+            add_parent_dirs (dirs, record->event->path);
+        if (record->event->new_path)
+            add_parent_dirs (dirs, record->event->new_path);
+    }
+
+    return dirs;
+}
+
+static void
+remove_path (const char *path)
+{
+    GDir *dir;
+    const char *dname;
+    char *sub;
+
+    if (g_file_test (path, G_FILE_TEST_IS_SYMLINK) ||
+        !g_file_test (path, G_FILE_TEST_IS_DIR)) {
+        seaf_util_unlink (path);
+        return;
+    }
+
+    dir = g_dir_open (path, 0, NULL);
+    if (dir) {
+        while ((dname = g_dir_read_name (dir)) != NULL) {
+            sub = g_build_filename (path, dname, NULL);
+            remove_path (sub);
+            g_free (sub);
+        }
+        g_dir_close (dir);
+    }
+    seaf_util_rmdir (path);
+}
+
+static void
+write_replay_file (const char *path)
+{
+    guint8 buf[2 * REPLAY_FILE_SIZE];
+    int len = REPLAY_FILE_SIZE + (int)(next_rand () % REPLAY_FILE_SIZE);
+    char *parent = g_path_get_dirname (path);
+
+    g_mkdir_with_parents (parent, 0777);
+    fill_random (buf, len);
+    if (!g_file_set_contents (path, (char *)buf, len, NULL))
+        seaf_warning ("Failed to write %s.\n", path);
+    g_free (parent);
+}
+
+/* Makes the change an event reports, so that the commit finds it. */
+static void
+apply_event (const char *worktree, GHashTable *dirs, WTEvent *event)
+{
+    char *path, *new_path, *parent;
+
+    path = g_build_filename (worktree, event->path, NULL);
+
+    switch (event->ev_type) {
+    case WT_EVENT_CREATE_OR_UPDATE:
+        if (g_hash_table_contains (dirs, event->path))
+            g_mkdir_with_parents (path, 0777);
+        else
+            write_replay_file (path);
+        break;
+    case WT_EVENT_DELETE:
+        remove_path (path);
+        break;
+    case WT_EVENT_RENAME:
+        new_path = g_build_filename (worktree, event->new_path, NULL);
+        parent = g_path_get_dirname (new_path);
+        g_mkdir_with_parents (parent, 0777);
+        seaf_util_rename (path, new_path);
+        g_free (parent);
+        g_free (new_path);
+        break;
+    default:
+        break;
+    }
+
+    g_free (path);
+}
+
+static SeafRepo *
+create_replay_repo (const char *worktree)
+{
+    SeafRepo *repo;
+    SeafCommit *commit;
+    SeafBranch *branch;
+    char *repo_id;
+
+    repo_id = gen_uuid ();
+    repo = seaf_repo_new (repo_id, "replay", "");
+    g_free (repo_id);
+    repo->version = BENCH_REPO_VERSION;
+    repo->email = g_strdup ("bench@example.com");
+
+    commit = seaf_commit_new (NULL, repo->id, EMPTY_SHA1, repo->email,
+                              seaf->client_id, "Created library", 0);
+    seaf_repo_to_commit (repo, commit);
+    if (seaf_commit_manager_add_commit (seaf->commit_mgr, commit) < 0) {
+        seaf_warning ("Failed to add commit.\n");
+        seaf_commit_unref (commit);
+        seaf_repo_free (repo);
+        return NULL;
+    }
+
+    seaf_repo_manager_add_repo (seaf->repo_mgr, repo);
+
+    branch = seaf_branch_new ("local", repo->id, commit->commit_id);
+    seaf_branch_manager_add_branch (seaf->branch_mgr, branch);
+    seaf_repo_set_head (repo, branch);
+    seaf_branch_unref (branch);
+    seaf_commit_unref (commit);
+
+    if (seaf_repo_manager_set_repo_worktree (seaf->repo_mgr, repo,
+                                             worktree) < 0) {
+        seaf_warning ("Failed to set worktree.\n");
+        return NULL;
+    }
+
+    return repo;
+}
+
+static void
+add_integer (json_t *object, const char *key, gint64 delta)
+{
+    gint64 value = json_integer_value (json_object_get (object, key));
+
+    json_object_set_new (object, key, json_integer (value + delta));
+}
+
+/* The stages of seaf_repo_index_commit(), as named in its trace spans. */
+static const char *replay_stages[] = {
+    "index_add",
+    "commit_tree_from_changeset",
+    "commit_fs_batch",
+};
+
+/* Takes @totals. */
+static void
+add_stage_totals (json_t *stages, json_t *totals)
+{
+    json_t *stage, *total;
+    int i;
+
+    for (i = 0; i < G_N_ELEMENTS(replay_stages); ++i) {
+        stage = json_object_get (stages, replay_stages[i]);
+        total = json_object_get (totals, replay_stages[i]);
+        if (!total)
+            continue;
+        add_integer (stage, "count",
+                     json_integer_value (json_object_get (total, "count")));
+        add_integer (stage, "usec",
+                     json_integer_value (json_object_get (total, "usec")));
+    }
+    json_decref (totals);
+}
+
+/*
+ * Events are queued to a status the repo manager finds like the one of a
+ * watched worktree. Before each commit, the changes of the events are made
+ * in the worktree, so only the commits are timed.
+ */
+static void
+bench_replay (BenchParams *params, json_t *results)
+{
+    GList *records = NULL, *ptr;
+    WTEventRecord *record;
+    GHashTable *dirs;
+    char *worktree;
+    SeafRepo *repo;
+    WTStatus *status = NULL;
+    json_t *stages, *stage;
+    char *commit_id, stage_name[128];
+    GError *error = NULL;
+    gint64 last_time, start, commit_usec = 0;
+    int n_events = 0, n_commits = 0, i;
+
+    if (params->events_file) {
+        if (wt_event_log_load (params->events_file, &records) < 0)
+            return;
+    } else {
+        records = make_synthetic_events (params);
+    }
+
+    dirs = collect_dirs (records);
+    worktree = g_build_filename (params->work_dir, "replay-worktree", NULL);
+    remove_path (worktree);
+    if (checkdir_with_mkdir (worktree) < 0) {
+        seaf_warning ("Failed to create %s.\n", worktree);
+        goto out;
+    }
+
+    repo = create_replay_repo (worktree);
+    if (!repo)
+        goto out;
+    status = create_wt_status (repo->id);
+    seaf_wt_monitor_add_replay_status (seaf->wt_monitor, status);
+
+    stages = json_object ();
+    for (i = 0; i < G_N_ELEMENTS(replay_stages); ++i) {
+        stage = json_object ();
+        json_object_set_new (stage, "count", json_integer (0));
+        json_object_set_new (stage, "usec", json_integer (0));
+        json_object_set_new (stages, replay_stages[i], stage);
+    }
+
+    ptr = records;
+    while (ptr) {
+        /* The events until the next quiet period go into one commit. */
+        last_time = ((WTEventRecord *)ptr->data)->time;
+        for (; ptr; ptr = ptr->next) {
+            record = ptr->data;
+            if (record->time - last_time > REPLAY_QUIET_USEC)
+                break;
+            last_time = record->time;
+            apply_event (worktree, dirs, record->event);
+            wt_status_add_event (status,
+                                 wt_event_new (record->event->ev_type,
+                                               record->event->path,
+                                               record->event->new_path));
+            ++n_events;
+        }
+
+        /* Restarting tracing drops the spans of the previous commit. */
+        seaf_trace_set_enabled (FALSE);
+        seaf_trace_set_enabled (TRUE);
+
+        start = seaf_metrics_now ();
+        do {
+            commit_id = seaf_repo_index_commit (repo, FALSE, FALSE, &error);
+            if (error) {
+                seaf_warning ("Failed to commit: %s.\n", error->message);
+                g_clear_error (&error);
+                seaf_trace_set_enabled (FALSE);
+                json_decref (stages);
+                goto out;
+            }
+            if (commit_id)
+                ++n_commits;
+            g_free (commit_id);
+        } while (status->partial_commit);
+        commit_usec += seaf_metrics_now () - start;
+
+        add_stage_totals (stages, seaf_trace_get_totals ());
+    }
+    seaf_trace_set_enabled (FALSE);
+
+    report (results, "replay_commit", n_commits, 0, commit_usec);
+    for (i = 0; i < G_N_ELEMENTS(replay_stages); ++i) {
+        stage = json_object_get (stages, replay_stages[i]);
+        snprintf (stage_name, sizeof(stage_name), "replay_%s",
+                  replay_stages[i]);
+        report (results, stage_name,
+                json_integer_value (json_object_get (stage, "count")), 0,
+                json_integer_value (json_object_get (stage, "usec")));
+    }
+    json_decref (stages);
+    seaf_message ("Replayed %d events in %d commits.\n", n_events, n_commits);
+
+out:
+    if (status) {
+        seaf_wt_monitor_remove_replay_status (seaf->wt_monitor, status->repo_id);
+        wt_status_unref (status);
+    }
+    g_hash_table_destroy (dirs);
+    g_list_free_full (records, (GDestroyNotify)wt_event_record_free);
+    g_free (worktree);
+}
+
+static struct {
+    const char *name;
+    BenchFunc func;
+} benchmarks[] = {
+    { "chunk_cdc", bench_chunk_cdc },
+    { "chunk_fixed", bench_chunk_fixed },
+    { "dir", bench_dir_serialize },
+    { "compress", bench_compress },
+    { "crypt", bench_crypt },
+    { "index", bench_index },
+    { "diff", bench_diff_trees },
+    { "obj", bench_obj_store },
+    { "block", bench_block_store },
+    { "replay", bench_replay },
+};
+
+static gboolean
+should_run (const char *name, int argc, char **argv)
+{
+    int i;
+
+    if (argc == 0)
+        return TRUE;
+
+    for (i = 0; i < argc; ++i) {
+        if (strcmp (argv[i], name) == 0)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+int
+main (int argc, char **argv)
+{
+    BenchParams params;
+    char *output = NULL;
+    char *seaf_dir, *worktree_dir, *ccnet_dir, *logfile;
+    json_t *report_obj, *results, *params_obj;
+    char *dump;
+    FILE *fp;
+    int c, i;
+
+    memset (&params, 0, sizeof(params));
+    params.n_files = 10000;
+    params.files_per_dir = 100;
+    params.file_size = (gint64)64 << 20;
+    params.block_size = 1 << 20;
+    params.iterations = 3;
+
+    while ((c = getopt_long (argc, argv, short_options,
+                             long_options, NULL)) != EOF) {
+        switch (c) {
+        case 'd':
+            params.work_dir = g_strdup (optarg);
+            break;
+        case 'n':
+            params.n_files = atoi (optarg);
+            break;
+        case 'f':
+            params.files_per_dir = atoi (optarg);
+            break;
+        case 's':
+            params.file_size = (gint64)atoi (optarg) << 20;
+            break;
+        case 'b':
+            params.block_size = atoi (optarg) << 10;
+            break;
+        case 'i':
+            params.iterations = atoi (optarg);
+            break;
+        case 'e':
+            params.events_file = optarg;
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'h':
+        default:
+            usage ();
+            exit (1);
+        }
+    }
+
+    argc -= optind;
+    argv += optind;
+
+    if (params.n_files <= 0 || params.files_per_dir <= 0 ||
+        params.file_size <= 0 || params.block_size <= 0 ||
+        params.iterations <= 0) {
+        usage ();
+        exit (1);
+    }
+
+    if (!params.work_dir)
+        params.work_dir = g_build_filename (g_get_tmp_dir (), "seaf-bench", NULL);
+    if (checkdir_with_mkdir (params.work_dir) < 0) {
+        fprintf (stderr, "Failed to create work dir %s.\n", params.work_dir);
+        exit (1);
+    }
+
+    cdc_init ();
+    curl_global_init (CURL_GLOBAL_ALL);
+#if !GLIB_CHECK_VERSION(2, 35, 0)
+    g_type_init();
+#endif
+
+    /* Keep stdout for the results. */
+    logfile = g_build_filename (params.work_dir, "bench.log", NULL);
+    if (seafile_log_init (logfile, "info", "info") < 0) {
+        fprintf (stderr, "Failed to init log.\n");
+        exit (1);
+    }
+
+    seaf_dir = g_build_filename (params.work_dir, "seafile-data", NULL);
+    worktree_dir = g_build_filename (params.work_dir, "worktree", NULL);
+    ccnet_dir = g_build_filename (params.work_dir, "ccnet", NULL);
+
+    seaf = seafile_session_new (seaf_dir, worktree_dir, ccnet_dir);
+    if (!seaf) {
+        fprintf (stderr, "Failed to create seafile session.\n");
+        exit (1);
+    }
+    seafile_session_prepare (seaf);
+
+    results = json_array ();
+    for (i = 0; i < G_N_ELEMENTS (benchmarks); ++i) {
+        if (should_run (benchmarks[i].name, argc, argv))
+            benchmarks[i].func (&params, results);
+    }
+
+    params_obj = json_object ();
+    json_object_set_new (params_obj, "files", json_integer (params.n_files));
+    json_object_set_new (params_obj, "files_per_dir",
+                         json_integer (params.files_per_dir));
+    json_object_set_new (params_obj, "file_size",
+                         json_integer (params.file_size));
+    json_object_set_new (params_obj, "block_size",
+                         json_integer (params.block_size));
+    json_object_set_new (params_obj, "iterations",
+                         json_integer (params.iterations));
+    if (params.events_file)
+        json_object_set_new (params_obj, "events",
+                             json_string (params.events_file));
+
+    report_obj = json_object ();
+    json_object_set_new (report_obj, "params", params_obj);
+    json_object_set_new (report_obj, "results", results);
+
+    dump = json_dumps (report_obj, JSON_INDENT(2) | JSON_SORT_KEYS);
+    if (output) {
+        fp = g_fopen (output, "w");
+        if (!fp) {
+            fprintf (stderr, "Failed to open %s.\n", output);
+            exit (1);
+        }
+        fprintf (fp, "%s\n", dump);
+        fclose (fp);
+    } else {
+        printf ("%s\n", dump);
+    }
+
+    free (dump);
+    json_decref (report_obj);
+    g_free (seaf_dir);
+    g_free (worktree_dir);
+    g_free (ccnet_dir);
+    g_free (logfile);
+    g_free (params.work_dir);
+
+    return 0;
+}
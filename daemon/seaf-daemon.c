@@ -171,6 +171,21 @@ register_rpc_service ()
                                      "seafile_update_repos_server_host",
                                      searpc_signature_int__string_string());
 
+    searpc_server_register_function ("seafile-rpcserver",
+                                     seafile_calc_dir_size,
+                                     "seafile_calc_dir_size",
+                                     searpc_signature_int__string());
+
+    searpc_server_register_function ("seafile-rpcserver",
+                                     seafile_start_calc_dir_size,
+                                     "seafile_start_calc_dir_size",
+                                     searpc_signature_int__string());
+
+    searpc_server_register_function ("seafile-rpcserver",
+                                     seafile_get_calc_dir_size_progress,
+                                     "seafile_get_calc_dir_size_progress",
+                                     searpc_signature_json__string());
+
     searpc_server_register_function ("seafile-rpcserver",
                                      seafile_disable_auto_sync,
                                      "seafile_disable_auto_sync",
@@ -231,6 +246,11 @@ register_rpc_service ()
                                      "seafile_get_repo_sync_task",
                                      searpc_signature_object__string());
 
+    searpc_server_register_function ("seafile-rpcserver",
+                                     seafile_get_repo_sync_timings,
+                                     "seafile_get_repo_sync_timings",
+                                     searpc_signature_json__string());
+
     searpc_server_register_function ("seafile-rpcserver",
                                      seafile_find_transfer_task,
                                      "seafile_find_transfer_task",
@@ -241,6 +261,11 @@ register_rpc_service ()
                                      "seafile_get_path_sync_status",
                                      searpc_signature_string__string_string_int());
 
+    searpc_server_register_function ("seafile-rpcserver",
+                                     seafile_get_paths_sync_status,
+                                     "seafile_get_paths_sync_status",
+                                     searpc_signature_json__string_string());
+
     searpc_server_register_function ("seafile-rpcserver",
                                      seafile_mark_file_locked,
                                      "seafile_mark_file_locked",
@@ -271,6 +296,11 @@ register_rpc_service ()
                                      "seafile_get_file_sync_errors",
                                      searpc_signature_objlist__int_int());
 
+    searpc_server_register_function ("seafile-rpcserver",
+                                     seafile_get_file_sync_errors_before,
+                                     "seafile_get_file_sync_errors_before",
+                                     searpc_signature_objlist__int_int());
+
     searpc_server_register_function ("seafile-rpcserver",
                                      seafile_del_file_sync_error_by_id,
                                      "seafile_del_file_sync_error_by_id",
@@ -281,6 +311,87 @@ register_rpc_service ()
                                      "seafile_get_sync_notification",
                                      searpc_signature_json__void());
 
+    searpc_server_register_function ("seafile-rpcserver",
+                                     seafile_wait_sync_notifications,
+                                     "seafile_wait_sync_notifications",
+                                     searpc_signature_json__int());
+
+    searpc_server_register_function ("seafile-rpcserver",
+                                     seafile_get_fs_cache_stats,
+                                     "seafile_get_fs_cache_stats",
+                                     searpc_signature_json__void());
+
+    searpc_server_register_function ("seafile-rpcserver",
+                                     seafile_get_metrics,
+                                     "seafile_get_metrics",
+                                     searpc_signature_json__void());
+
+    searpc_server_register_function ("seafile-rpcserver",
+                                     seafile_set_trace_enabled,
+                                     "seafile_set_trace_enabled",
+                                     searpc_signature_int__int());
+
+    /* Writing a large trace may take a while. */
+    searpc_server_register_function ("seafile-threaded-rpcserver",
+                                     seafile_dump_trace,
+                                     "seafile_dump_trace",
+                                     searpc_signature_int__string());
+
+    searpc_server_register_function ("seafile-rpcserver",
+                                     seafile_start_wt_event_recording,
+                                     "seafile_start_wt_event_recording",
+                                     searpc_signature_int__string_string());
+
+    searpc_server_register_function ("seafile-rpcserver",
+                                     seafile_stop_wt_event_recording,
+                                     "seafile_stop_wt_event_recording",
+                                     searpc_signature_int__string());
+
+    searpc_server_register_function ("seafile-rpcserver",
+                                     seafile_prioritize_download,
+                                     "seafile_prioritize_download",
+                                     searpc_signature_int__string_string());
+
+    searpc_server_register_function ("seafile-rpcserver",
+                                     seafile_clear_download_priorities,
+                                     "seafile_clear_download_priorities",
+                                     searpc_signature_int__string());
+
+    searpc_server_register_function ("seafile-rpcserver",
+                                     seafile_get_transfer_policy,
+                                     "seafile_get_transfer_policy",
+                                     searpc_signature_json__void());
+
+    searpc_server_register_function ("seafile-rpcserver",
+                                     seafile_set_transfer_policy_override,
+                                     "seafile_set_transfer_policy_override",
+                                     searpc_signature_int__string_int());
+
+    searpc_server_register_function ("seafile-rpcserver",
+                                     seafile_get_memory_usage,
+                                     "seafile_get_memory_usage",
+                                     searpc_signature_json__void());
+
+    searpc_server_register_function ("seafile-rpcserver",
+                                     seafile_get_work_mode,
+                                     "seafile_get_work_mode",
+                                     searpc_signature_json__void());
+
+    searpc_server_register_function ("seafile-rpcserver",
+                                     seafile_get_repo_state_changes,
+                                     "seafile_get_repo_state_changes",
+                                     searpc_signature_json__int64());
+
+    searpc_server_register_function ("seafile-rpcserver",
+                                     seafile_get_task_states,
+                                     "seafile_get_task_states",
+                                     searpc_signature_json__void());
+
+    searpc_server_register_function ("seafile-rpcserver",
+                                     seafile_get_scrub_status,
+                                     "seafile_get_scrub_status",
+                                     searpc_signature_json__void());
+
     searpc_server_register_function ("seafile-rpcserver",
                                      seafile_shutdown,
                                      "seafile_shutdown",
@@ -291,6 +402,23 @@ register_rpc_service ()
                                      seafile_diff,
                                      "seafile_diff",
                                      searpc_signature_objlist__string_string_string_int());
+
+    /* Reading history may load many commits. */
+    searpc_server_register_function ("seafile-threaded-rpcserver",
+                                     seafile_get_commit_history,
+                                     "seafile_get_commit_history",
+                                     searpc_signature_json__string_string_int());
+
+    /* Hydration downloads the whole file. */
+    searpc_server_register_function ("seafile-threaded-rpcserver",
+                                     seafile_hydrate_file,
+                                     "seafile_hydrate_file",
+                                     searpc_signature_int__string_string());
+
+    searpc_server_register_function ("seafile-threaded-rpcserver",
+                                     seafile_dehydrate_file,
+                                     "seafile_dehydrate_file",
+                                     searpc_signature_int__string_string());
 }
 
 #ifdef WIN32
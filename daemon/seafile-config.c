@@ -1,43 +1,112 @@
 /* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
 
 #include "common.h"
+
+#include <pthread.h>
+
 #include "db.h"
 
 #include "seafile-config.h"
+#include "mem-budget.h"
+#include "work-mode.h"
+#include "index-cache.h"
+#include "shared-block-cache.h"
+#include "download-priority.h"
+#include "transfer-policy.h"
+#include "log.h"
+
+/*
+ * All rows of the Config table, loaded when the db is opened and updated
+ * when values are set, so that reading a value doesn't query the db.
+ */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable *config_cache;
+
+typedef struct ConfigWatch {
+    char *key;
+    SeafConfigWatchFunc func;
+    void *user_data;
+} ConfigWatch;
+
+static GList *watches;
 
-gboolean
-seafile_session_config_exists (SeafileSession *session, const char *key)
+static gboolean
+load_row (sqlite3_stmt *stmt, void *data)
 {
-    char sql[256];
+    const char *key = (const char *)sqlite3_column_text (stmt, 0);
+    const char *value = (const char *)sqlite3_column_text (stmt, 1);
 
-    snprintf (sql, sizeof(sql),
-              "SELECT 1 FROM Config WHERE key = '%s'",
-              key);
-    return sqlite_check_for_existence (session->config_db, sql);
+    if (key && value)
+        g_hash_table_replace (config_cache, g_strdup(key), g_strdup(value));
+    return TRUE;
 }
 
-static gboolean
-get_value (sqlite3_stmt *stmt, void *data)
+static void
+cache_set (const char *key, const char *value)
+{
+    pthread_mutex_lock (&cache_lock);
+    g_hash_table_replace (config_cache, g_strdup(key), g_strdup(value));
+    pthread_mutex_unlock (&cache_lock);
+}
+
+static void
+notify_watches (SeafileSession *session, const char *key, const char *value)
 {
-    char **p_value = data;
+    GList *ptr, *matched = NULL;
+    ConfigWatch *watch;
+
+    pthread_mutex_lock (&cache_lock);
+    for (ptr = watches; ptr; ptr = ptr->next) {
+        watch = ptr->data;
+        if (g_strcmp0 (watch->key, key) == 0)
+            matched = g_list_prepend (matched, watch);
+    }
+    pthread_mutex_unlock (&cache_lock);
+
+    /* Watches are never removed, so they can be called without lock. */
+    for (ptr = matched; ptr; ptr = ptr->next) {
+        watch = ptr->data;
+        watch->func (session, key, value, watch->user_data);
+    }
+    g_list_free (matched);
+}
+
+void
+seafile_session_config_watch (const char *key,
+                              SeafConfigWatchFunc func,
+                              void *user_data)
+{
+    ConfigWatch *watch = g_new0 (ConfigWatch, 1);
+
+    watch->key = g_strdup (key);
+    watch->func = func;
+    watch->user_data = user_data;
 
-    *p_value = g_strdup((char *) sqlite3_column_text (stmt, 0));
-    /* Only one result. */
-    return FALSE;
+    pthread_mutex_lock (&cache_lock);
+    watches = g_list_append (watches, watch);
+    pthread_mutex_unlock (&cache_lock);
+}
+
+gboolean
+seafile_session_config_exists (SeafileSession *session, const char *key)
+{
+    gboolean ret;
+
+    pthread_mutex_lock (&cache_lock);
+    ret = g_hash_table_contains (config_cache, key);
+    pthread_mutex_unlock (&cache_lock);
+
+    return ret;
 }
 
 static char *
-config_get_string (sqlite3 *config_db, const char *key)
+config_get_string (const char *key)
 {
-    char sql[256];
-    char *value = NULL;
+    char *value;
 
-    snprintf (sql, sizeof(sql),
-              "SELECT value FROM Config WHERE key='%s';",
-              key);
-    if (sqlite_foreach_selected_row (config_db, sql,
-                                     get_value, &value) < 0)
-        return NULL;
+    pthread_mutex_lock (&cache_lock);
+    value = g_strdup (g_hash_table_lookup (config_cache, key));
+    pthread_mutex_unlock (&cache_lock);
 
     return value;
 }
@@ -46,7 +115,7 @@ char *
 seafile_session_config_get_string (SeafileSession *session,
                                    const char *key)
 {
-    return (config_get_string (session->config_db, key));
+    return (config_get_string (key));
 }
 
 int
@@ -57,7 +126,7 @@ seafile_session_config_get_int (SeafileSession *session,
     char *value;
     int ret;
 
-    value = config_get_string (session->config_db, key);
+    value = config_get_string (key);
     if (!value) {
         if (exists)
             *exists = FALSE;
@@ -78,7 +147,7 @@ seafile_session_config_get_bool (SeafileSession *session,
     char *value;
     gboolean ret = FALSE;
 
-    value = config_get_string (session->config_db, key);
+    value = config_get_string (key);
     if (g_strcmp0(value, "true") == 0)
         ret = TRUE;
 
@@ -98,6 +167,7 @@ seafile_session_config_set_string (SeafileSession *session,
                       key, value);
     if (sqlite_query_exec (session->config_db, sql) < 0)
         return -1;
+    cache_set (key, value);
 
     if (g_strcmp0 (key, KEY_CLIENT_NAME) == 0) {
         g_free (session->client_name);
@@ -149,6 +219,14 @@ seafile_session_config_set_string (SeafileSession *session,
             session->hide_windows_incompatible_path_notification = FALSE;
     }
 
+    if (g_strcmp0(key, KEY_BACKGROUND_MODE) == 0)
+        seaf_work_mode_set_enabled (g_strcmp0(value, "false") != 0);
+
+    if (g_strcmp0(key, KEY_DOWNLOAD_ORDER) == 0)
+        seaf_download_priority_set_order (value);
+
+    notify_watches (session, key, value);
+
     return 0;
 }
 
@@ -158,12 +236,15 @@ seafile_session_config_set_int (SeafileSession *session,
                                 int value)
 {
     char sql[256];
+    char str[16];
 
     sqlite3_snprintf (sizeof(sql), sql,
                       "REPLACE INTO Config VALUES ('%q', %d);",
                       key, value);
     if (sqlite_query_exec (session->config_db, sql) < 0)
         return -1;
+    snprintf (str, sizeof(str), "%d", value);
+    cache_set (key, str);
 
     if (g_strcmp0(key, KEY_PROXY_PORT) == 0) {
         session->http_proxy_port = value;
@@ -171,6 +252,40 @@ seafile_session_config_set_int (SeafileSession *session,
     if (g_strcmp0(key, KEY_DELETE_CONFIRM_THRESHOLD) == 0) {
         session->delete_confirm_threshold = value;
     }
+    if (g_strcmp0(key, KEY_HTTP2_MAX_STREAMS) == 0) {
+        session->http2_max_streams = value > 0 ? value : 0;
+    }
+    if (g_strcmp0(key, KEY_MAX_TRANSFER_THREADS) == 0) {
+        session->max_transfer_threads =
+            value > 0 ? value : DEFAULT_MAX_TRANSFER_THREADS;
+    }
+    if (g_strcmp0(key, KEY_TCP_KEEPALIVE_IDLE) == 0) {
+        session->tcp_keepalive_idle = value > 0 ? value : 0;
+    }
+    if (g_strcmp0(key, KEY_MEMORY_LIMIT) == 0) {
+        session->memory_limit = value > 0 ? value : 0;
+        seaf_mem_budget_set_limit ((gint64)session->memory_limit << 20);
+    }
+    if (g_strcmp0(key, KEY_INDEX_CACHE_SIZE) == 0) {
+        session->index_cache_size = value > 0 ? value : 0;
+        seaf_index_cache_set_limit ((gint64)session->index_cache_size << 20);
+    }
+    if (g_strcmp0(key, KEY_SCRUB_RATE) == 0)
+        session->scrub_rate = value > 0 ? value : 0;
+    if (g_strcmp0(key, KEY_METERED_UPLOAD_LIMIT) == 0)
+        session->metered_upload_limit = value > 0 ? value : 0;
+    if (g_strcmp0(key, KEY_METERED_DOWNLOAD_LIMIT) == 0)
+        session->metered_download_limit = value > 0 ? value : 0;
+    if (g_strcmp0(key, KEY_METERED_OVERRIDE) == 0)
+        seaf_transfer_policy_set_override (TRANSFER_CONDITION_METERED, value);
+    if (g_strcmp0(key, KEY_BATTERY_OVERRIDE) == 0)
+        seaf_transfer_policy_set_override (TRANSFER_CONDITION_BATTERY, value);
+    if (g_strcmp0(key, KEY_SHARED_BLOCK_CACHE_SIZE) == 0) {
+        session->shared_block_cache_size = value > 0 ? value : 0;
+        seaf_shared_block_cache_set_limit ((gint64)session->shared_block_cache_size << 20);
+    }
+
+    notify_watches (session, key, str);
 
     return 0;
 }
@@ -193,6 +308,16 @@ seafile_session_config_open_db (const char *db_path)
         "value TEXT);";
     sqlite_query_exec (db, sql);
 
+    pthread_mutex_lock (&cache_lock);
+    if (config_cache)
+        g_hash_table_destroy (config_cache);
+    config_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                          g_free, g_free);
+    if (sqlite_foreach_selected_row (db, "SELECT key, value FROM Config",
+                                     load_row, NULL) < 0)
+        seaf_warning ("Failed to load config.\n");
+    pthread_mutex_unlock (&cache_lock);
+
     return db;
 }
 
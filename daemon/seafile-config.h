@@ -18,15 +18,92 @@
 #define KEY_UPLOAD_LIMIT "upload_limit"
 #define KEY_DOWNLOAD_LIMIT "download_limit"
 #define KEY_CDC_AVERAGE_BLOCK_SIZE "block_size"
+#define KEY_SPLIT_FILE_THREADS "split_file_threads"
+#define KEY_INDEX_FILE_THREADS "index_file_threads"
 #define KEY_ALLOW_INVALID_WORKTREE "allow_invalid_worktree"
 #define KEY_ALLOW_REPO_NOT_FOUND_ON_SERVER "allow_repo_not_found_on_server"
 #define KEY_SYNC_EXTRA_TEMP_FILE "sync_extra_temp_file"
 #define KEY_DISABLE_BLOCK_HASH "disable_block_hash"
 #define KEY_HIDE_WINDOWS_INCOMPATIBLE_PATH_NOTIFICATION "hide_windows_incompatible_path_notification"
+/* Block storage backend, "fs" (default) or "pack". Takes effect after restart. */
+#define KEY_BLOCK_BACKEND "block_backend"
+#define BLOCK_BACKEND_PACK "pack"
+/* Fs and commit object storage backend, "fs" (default) or "pack".
+ * Takes effect after restart. */
+#define KEY_OBJ_BACKEND "obj_backend"
+#define OBJ_BACKEND_PACK "pack"
+/* Compression of new fs objects, "zlib" (default) or "zstd". zstd objects
+ * are stored locally only, they're converted to zlib for upload. Needs a
+ * build with --enable-zstd. Takes effect after restart. */
+#define KEY_FS_OBJECT_COMPRESSION "fs_object_compression"
+#define FS_OBJECT_COMPRESSION_ZSTD "zstd"
 
 /* Http sync settings. */
 #define KEY_ENABLE_HTTP_SYNC "enable_http_sync"
 #define KEY_DISABLE_VERIFY_CERTIFICATE "disable_verify_certificate"
+/* Max number of concurrent block streams over one HTTP/2 connection.
+ * 0 disables multiplexed block transfer. */
+#define KEY_HTTP2_MAX_STREAMS "http2_max_streams"
+/* Upper bound of block transfers running at the same time against one host.
+ * The actual number adapts to the link below this cap. */
+#define KEY_MAX_TRANSFER_THREADS "max_transfer_threads"
+#define DEFAULT_MAX_TRANSFER_THREADS 16
+/* Seconds a connection may be idle before TCP keepalive probes are sent,
+ * so that pooled connections survive between syncs. 0 disables keepalive. */
+#define KEY_TCP_KEEPALIVE_IDLE "tcp_keepalive_idle"
+#define DEFAULT_TCP_KEEPALIVE_IDLE 60
+
+/* Seconds between dumps of the metrics to <seafile data dir>/metrics.prom,
+ * in the Prometheus text format. 0 (default) disables the file. */
+#define KEY_METRICS_FILE_INTERVAL "metrics_file_interval"
+
+/* Hours between garbage collections of a repo's local block store, which
+ * run when the daemon is idle. 0 disables the GC. */
+#define KEY_BLOCK_GC_INTERVAL "block_gc_interval"
+#define DEFAULT_BLOCK_GC_INTERVAL 24
+
+/* Hours between integrity checks of a repo's local data, which run when the
+ * daemon is idle. 0 disables the checks. */
+#define KEY_SCRUB_INTERVAL "scrub_interval"
+#define DEFAULT_SCRUB_INTERVAL 168
+
+/* KB per second the integrity checks read at most. 0 removes the limit. */
+#define KEY_SCRUB_RATE "scrub_rate"
+#define DEFAULT_SCRUB_RATE 1024
+
+/* MB of disk space for the content of hydrated on-demand files. The least
+ * recently used ones are dehydrated beyond it. 0 disables the limit. */
+#define KEY_HYDRATION_BUDGET "hydration_budget"
+#define DEFAULT_HYDRATION_BUDGET 10240
+
+/* MB of memory for block buffers and object packs of all syncs together.
+ * Chunking, checkout and uploads slow down beyond it. 0 (default)
+ * disables the limit. */
+#define KEY_MEMORY_LIMIT "memory_limit"
+
+/* MB of memory for indexes kept between the commits of repos. 0 disables
+ * the cache. */
+#define KEY_INDEX_CACHE_SIZE "index_cache_size"
+#define DEFAULT_INDEX_CACHE_SIZE 64
+
+/* MB of disk for blocks shared by the unencrypted repos, so that the same
+ * content in several repos is only downloaded once. 0 (default) disables
+ * the cache. */
+#define KEY_SHARED_BLOCK_CACHE_SIZE "shared_block_cache_size"
+
+/* Index, chunk and check out files with background OS priority while the
+ * user is active. Enabled by default. */
+#define KEY_BACKGROUND_MODE "background_mode"
+
+/* Start uploading the blocks of a commit while it is being indexed. */
+#define KEY_PRE_UPLOAD_BLOCKS "pre_upload_blocks"
+/* Like pre_upload_blocks, but blocks of unencrypted repos are sent from the
+ * worktree files instead of being written to the block store first. */
+#define KEY_DIRECT_UPLOAD "direct_upload"
+
+/* Order of file downloads within a repo: "diff" (default), "small_first"
+ * or "recent_first". See download-priority.h. */
+#define KEY_DOWNLOAD_ORDER "download_order"
 
 /* Http sync proxy settings. */
 #define KEY_USE_PROXY "use_proxy"
@@ -39,6 +116,28 @@
 #define PROXY_TYPE_SOCKS "socks"
 #define KEY_DELETE_CONFIRM_THRESHOLD "delete_confirm_threshold"
 
+/* Rate limits in bytes per second on metered connections, on top of
+ * upload_limit and download_limit. 0 disables them. See transfer-policy.h. */
+#define KEY_METERED_UPLOAD_LIMIT "metered_upload_limit"
+#define KEY_METERED_DOWNLOAD_LIMIT "metered_download_limit"
+#define DEFAULT_METERED_LIMIT (1 << 20)
+/* -1 (default) to detect, 0 or 1 to force the condition off or on. */
+#define KEY_METERED_OVERRIDE "metered_override"
+#define KEY_BATTERY_OVERRIDE "battery_override"
+
+/* Watch worktrees with fanotify file system marks instead of per-directory
+ * inotify watches. Linux only, needs CAP_SYS_ADMIN. */
+#define KEY_USE_FANOTIFY "use_fanotify"
+
+/* Watch worktrees through the NTFS USN journal instead of
+ * ReadDirectoryChangesW. Windows only, needs administrator privileges. */
+#define KEY_USE_USN_JOURNAL "use_usn_journal"
+
+/*
+ * Values are read from memory; the Config table is loaded when the db is
+ * opened and written through when a value is set.
+ */
+
 gboolean
 seafile_session_config_exists (SeafileSession *session, const char *key);
 
@@ -77,6 +176,17 @@ seafile_session_config_set_int (SeafileSession *session,
                                 const char *key,
                                 int value);
 
+/* Called with the new value, as a string, after @key was set. */
+typedef void (*SeafConfigWatchFunc) (SeafileSession *session,
+                                     const char *key,
+                                     const char *value,
+                                     void *user_data);
+
+void
+seafile_session_config_watch (const char *key,
+                              SeafConfigWatchFunc func,
+                              void *user_data);
+
 int
 seafile_session_config_set_allow_invalid_worktree(SeafileSession *session, gboolean val);
 
@@ -32,6 +32,20 @@
 #include "seafile-config.h"
 #include "vc-utils.h"
 #include "log.h"
+#include "metrics.h"
+#include "timer.h"
+#include "block-gc.h"
+#include "scrubber.h"
+#include "hydration.h"
+#include "content-index.h"
+#include "file-id-cache.h"
+#include "index-cache.h"
+#include "shared-block-cache.h"
+#include "executor.h"
+#include "mem-budget.h"
+#include "work-mode.h"
+#include "download-priority.h"
+#include "transfer-policy.h"
 
 #define MAX_THREADS 50
 
@@ -228,6 +242,8 @@ seafile_session_new(const char *seafile_dir,
         goto onerror;
 
     session->job_mgr = seaf_job_manager_new (session, MAX_THREADS);
+    if (!session->job_mgr)
+        goto onerror;
     session->ev_mgr = cevent_manager_new ();
     if (!session->ev_mgr)
         goto onerror;
@@ -398,6 +414,116 @@ seafile_session_prepare (SeafileSession *session)
     session->disable_verify_certificate = seafile_session_config_get_bool
         (session, KEY_DISABLE_VERIFY_CERTIFICATE);
 
+    session->http2_max_streams =
+        seafile_session_config_get_int (session, KEY_HTTP2_MAX_STREAMS, NULL);
+    if (session->http2_max_streams < 0)
+        session->http2_max_streams = 0;
+
+    session->max_transfer_threads =
+        seafile_session_config_get_int (session, KEY_MAX_TRANSFER_THREADS, NULL);
+    if (session->max_transfer_threads <= 0)
+        session->max_transfer_threads = DEFAULT_MAX_TRANSFER_THREADS;
+
+    gboolean keepalive_set = FALSE;
+    session->tcp_keepalive_idle =
+        seafile_session_config_get_int (session, KEY_TCP_KEEPALIVE_IDLE,
+                                        &keepalive_set);
+    if (!keepalive_set)
+        session->tcp_keepalive_idle = DEFAULT_TCP_KEEPALIVE_IDLE;
+    else if (session->tcp_keepalive_idle < 0)
+        session->tcp_keepalive_idle = 0;
+
+    session->metrics_file_interval =
+        seafile_session_config_get_int (session, KEY_METRICS_FILE_INTERVAL,
+                                        NULL);
+
+    gboolean gc_interval_set = FALSE;
+    session->block_gc_interval =
+        seafile_session_config_get_int (session, KEY_BLOCK_GC_INTERVAL,
+                                        &gc_interval_set);
+    if (!gc_interval_set)
+        session->block_gc_interval = DEFAULT_BLOCK_GC_INTERVAL;
+    else if (session->block_gc_interval < 0)
+        session->block_gc_interval = 0;
+
+    gboolean scrub_interval_set = FALSE;
+    session->scrub_interval =
+        seafile_session_config_get_int (session, KEY_SCRUB_INTERVAL,
+                                        &scrub_interval_set);
+    if (!scrub_interval_set)
+        session->scrub_interval = DEFAULT_SCRUB_INTERVAL;
+    else if (session->scrub_interval < 0)
+        session->scrub_interval = 0;
+
+    gboolean scrub_rate_set = FALSE;
+    session->scrub_rate =
+        seafile_session_config_get_int (session, KEY_SCRUB_RATE,
+                                        &scrub_rate_set);
+    if (!scrub_rate_set)
+        session->scrub_rate = DEFAULT_SCRUB_RATE;
+    else if (session->scrub_rate < 0)
+        session->scrub_rate = 0;
+
+    gboolean budget_set = FALSE;
+    session->hydration_budget =
+        seafile_session_config_get_int (session, KEY_HYDRATION_BUDGET,
+                                        &budget_set);
+    if (!budget_set)
+        session->hydration_budget = DEFAULT_HYDRATION_BUDGET;
+    else if (session->hydration_budget < 0)
+        session->hydration_budget = 0;
+
+    session->memory_limit =
+        seafile_session_config_get_int (session, KEY_MEMORY_LIMIT, NULL);
+    if (session->memory_limit < 0)
+        session->memory_limit = 0;
+    seaf_mem_budget_set_limit ((gint64)session->memory_limit << 20);
+
+    gboolean index_cache_set = FALSE;
+    session->index_cache_size =
+        seafile_session_config_get_int (session, KEY_INDEX_CACHE_SIZE,
+                                        &index_cache_set);
+    if (!index_cache_set)
+        session->index_cache_size = DEFAULT_INDEX_CACHE_SIZE;
+    else if (session->index_cache_size < 0)
+        session->index_cache_size = 0;
+    seaf_index_cache_set_limit ((gint64)session->index_cache_size << 20);
+
+    session->shared_block_cache_size =
+        seafile_session_config_get_int (session, KEY_SHARED_BLOCK_CACHE_SIZE,
+                                        NULL);
+    if (session->shared_block_cache_size < 0)
+        session->shared_block_cache_size = 0;
+    seaf_shared_block_cache_set_limit ((gint64)session->shared_block_cache_size << 20);
+
+    if (seafile_session_config_exists (session, KEY_BACKGROUND_MODE))
+        seaf_work_mode_set_enabled (seafile_session_config_get_bool
+                                    (session, KEY_BACKGROUND_MODE));
+    else
+        seaf_work_mode_set_enabled (TRUE);
+
+    char *download_order =
+        seafile_session_config_get_string (session, KEY_DOWNLOAD_ORDER);
+    seaf_download_priority_set_order (download_order);
+    g_free (download_order);
+
+    gboolean metered_limit_set = FALSE;
+    session->metered_upload_limit =
+        seafile_session_config_get_int (session, KEY_METERED_UPLOAD_LIMIT,
+                                        &metered_limit_set);
+    if (!metered_limit_set)
+        session->metered_upload_limit = DEFAULT_METERED_LIMIT;
+    session->metered_download_limit =
+        seafile_session_config_get_int (session, KEY_METERED_DOWNLOAD_LIMIT,
+                                        &metered_limit_set);
+    if (!metered_limit_set)
+        session->metered_download_limit = DEFAULT_METERED_LIMIT;
+
+    seaf_transfer_policy_set_override (TRANSFER_CONDITION_METERED,
+        seafile_session_config_get_int (session, KEY_METERED_OVERRIDE, NULL));
+    seaf_transfer_policy_set_override (TRANSFER_CONDITION_BATTERY,
+        seafile_session_config_get_int (session, KEY_BATTERY_OVERRIDE, NULL));
+
     session->use_http_proxy =
         seafile_session_config_get_bool(session, KEY_USE_PROXY);
 
@@ -433,12 +559,35 @@ seafile_session_prepare (SeafileSession *session)
         seaf_message ("Block size less than 1KB. Use default block size(8MB).\n");
     }
 
+    /* Use all cores for fixed-size chunking unless configured otherwise. */
+    session->split_file_threads =
+        seafile_session_config_get_int (session, KEY_SPLIT_FILE_THREADS, NULL);
+    if (session->split_file_threads <= 0)
+        session->split_file_threads = seaf_util_get_num_cores ();
+
+    /* Number of files indexed at the same time when committing. */
+    session->index_file_threads =
+        seafile_session_config_get_int (session, KEY_INDEX_FILE_THREADS, NULL);
+    if (session->index_file_threads <= 0)
+        session->index_file_threads = seaf_util_get_num_cores ();
+
     session->disable_block_hash =
         seafile_session_config_get_bool (session, KEY_DISABLE_BLOCK_HASH);
+
+    session->pre_upload_blocks =
+        seafile_session_config_get_bool (session, KEY_PRE_UPLOAD_BLOCKS);
+    session->direct_upload =
+        seafile_session_config_get_bool (session, KEY_DIRECT_UPLOAD);
     
     session->hide_windows_incompatible_path_notification =
         seafile_session_config_get_bool (session, KEY_HIDE_WINDOWS_INCOMPATIBLE_PATH_NOTIFICATION);
     
+    /* Repos are loaded in parallel by the repo manager. Transfer threads
+     * mostly wait on the network, so the I/O lane is sized by them.
+     */
+    seaf_executor_start (g_get_num_processors (),
+                         session->max_transfer_threads * 4);
+
     /* Start mq manager earlier, so that we can send notifications
      * when start repo manager. */
     seaf_mq_manager_init (session->mq_mgr);
@@ -546,6 +695,25 @@ on_start_cleanup_job (void *vdata)
     return vdata;
 }
 
+static int
+write_metrics_file (void *vdata)
+{
+    SeafileSession *session = vdata;
+    char *path, *text;
+    GError *error = NULL;
+
+    path = g_build_filename (session->seaf_dir, "metrics.prom", NULL);
+    text = seaf_metrics_to_text ();
+    if (!g_file_set_contents (path, text, -1, &error)) {
+        seaf_warning ("Failed to write %s: %s.\n", path, error->message);
+        g_clear_error (&error);
+    }
+    g_free (text);
+    g_free (path);
+
+    return TRUE;
+}
+
 static void
 cleanup_job_done (void *vdata)
 {
@@ -587,6 +755,31 @@ cleanup_job_done (void *vdata)
         return;
     }
 
+    if (session->metrics_file_interval > 0)
+        seaf_timer_new (write_metrics_file, session,
+                        (uint64_t)session->metrics_file_interval * 1000);
+
+    if (session->block_gc_interval > 0)
+        seaf_block_gc_start ();
+
+    if (session->scrub_interval > 0)
+        seaf_scrubber_start ();
+
+    if (seaf_hydration_start () < 0)
+        seaf_warning ("Failed to start on-demand file hydration.\n");
+
+    if (seaf_content_index_start () < 0)
+        seaf_warning ("Failed to start local content index.\n");
+
+    if (seaf_file_id_cache_start () < 0)
+        seaf_warning ("Failed to start file id cache.\n");
+
+    if (seaf_index_cache_start () < 0)
+        seaf_warning ("Failed to start index cache.\n");
+
+    if (seaf_shared_block_cache_start () < 0)
+        seaf_warning ("Failed to start shared block cache.\n");
+
     /* The system is up and running. */
     session->started = TRUE;
 }
@@ -55,6 +55,8 @@ struct _SeafileSession {
     char                *rpc_socket_path;
 
     uint32_t            cdc_average_block_size;
+    int                 split_file_threads;
+    int                 index_file_threads;
     SeafBlockManager    *block_mgr;
     SeafFSManager       *fs_mgr;
     SeafCommitManager   *commit_mgr;
@@ -80,8 +82,23 @@ struct _SeafileSession {
     gboolean             sync_extra_temp_file;
     gboolean             enable_http_sync;
     gboolean             disable_verify_certificate;
+    int                  http2_max_streams;
+    int                  max_transfer_threads;
+    int                  tcp_keepalive_idle;
+    int                  metrics_file_interval;
+    int                  block_gc_interval;
+    int                  scrub_interval;
+    int                  scrub_rate;
+    int                  hydration_budget;
+    int                  memory_limit;
+    int                  index_cache_size;
+    int                  shared_block_cache_size;
+    int                  metered_upload_limit;
+    int                  metered_download_limit;
 
     gboolean             disable_block_hash;
+    gboolean             pre_upload_blocks;
+    gboolean             direct_upload;
     
     gboolean             hide_windows_incompatible_path_notification;
 
@@ -0,0 +1,351 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#include "seafile-session.h"
+#include "server-block-cache.h"
+#include "utils.h"
+#include "log.h"
+
+/*
+ * On disk, the cache is a header followed by the host name and a sorted
+ * array of binary block ids. Known ids are kept in memory in the same
+ * sorted array. Ids confirmed since the cache was loaded live in a hash
+ * table until the cache is saved.
+ */
+
+#define CACHE_DIR "block-cache"
+#define CACHE_MAGIC "SBC1"
+#define CACHE_ID_LEN 20
+
+/* Check all blocks with the server again after this long, in case it has
+ * removed some of them, e.g. when old history was cleaned up.
+ */
+#define CACHE_LIFETIME (7 * 24 * 3600)
+#define MAX_CACHED_IDS (1 << 20)
+
+typedef struct CacheHeader {
+    char magic[4];
+    guint32 host_len;
+    guint32 n_ids;
+    guint32 padding;
+    gint64 created;
+} CacheHeader;
+
+struct ServerBlockCache {
+    char *path;
+    char *host;
+    gint64 created;
+
+    unsigned char *ids;
+    guint32 n_ids;
+
+    GHashTable *added;          /* raw id -> raw id, confirmed */
+    GHashTable *pending;        /* raw id -> raw id, not yet confirmed */
+    gboolean dirty;
+
+    pthread_mutex_t lock;
+};
+
+static guint
+raw_id_hash (gconstpointer key)
+{
+    guint h;
+
+    memcpy (&h, key, sizeof(h));
+    return h;
+}
+
+static gboolean
+raw_id_equal (gconstpointer a, gconstpointer b)
+{
+    return memcmp (a, b, CACHE_ID_LEN) == 0;
+}
+
+static int
+compare_raw_ids (const void *a, const void *b)
+{
+    return memcmp (a, b, CACHE_ID_LEN);
+}
+
+static char *
+cache_path (const char *repo_id)
+{
+    return g_build_filename (seaf->seaf_dir, CACHE_DIR, repo_id, NULL);
+}
+
+static void
+load_cache_file (ServerBlockCache *cache)
+{
+    char *contents = NULL;
+    gsize len;
+    CacheHeader hdr;
+    gsize expected;
+
+    if (!g_file_get_contents (cache->path, &contents, &len, NULL))
+        return;
+
+    if (len < sizeof(hdr))
+        goto out;
+    memcpy (&hdr, contents, sizeof(hdr));
+
+    if (memcmp (hdr.magic, CACHE_MAGIC, 4) != 0)
+        goto out;
+
+    expected = sizeof(hdr) + hdr.host_len + (gsize)hdr.n_ids * CACHE_ID_LEN;
+    if (hdr.n_ids > MAX_CACHED_IDS || len != expected) {
+        seaf_warning ("Block cache %s is corrupt, ignore.\n", cache->path);
+        goto out;
+    }
+
+    if (hdr.host_len != strlen (cache->host) ||
+        memcmp (contents + sizeof(hdr), cache->host, hdr.host_len) != 0)
+        goto out;
+
+    if ((gint64)time(NULL) - hdr.created > CACHE_LIFETIME)
+        goto out;
+
+    cache->created = hdr.created;
+    cache->n_ids = hdr.n_ids;
+    cache->ids = g_memdup (contents + sizeof(hdr) + hdr.host_len,
+                           hdr.n_ids * CACHE_ID_LEN);
+
+out:
+    g_free (contents);
+}
+
+ServerBlockCache *
+server_block_cache_load (const char *repo_id, const char *host)
+{
+    ServerBlockCache *cache = g_new0 (ServerBlockCache, 1);
+
+    cache->path = cache_path (repo_id);
+    cache->host = g_strdup (host);
+    cache->created = (gint64)time(NULL);
+    cache->added = g_hash_table_new_full (raw_id_hash, raw_id_equal,
+                                          g_free, NULL);
+    cache->pending = g_hash_table_new_full (raw_id_hash, raw_id_equal,
+                                            g_free, NULL);
+    pthread_mutex_init (&cache->lock, NULL);
+
+    load_cache_file (cache);
+
+    return cache;
+}
+
+void
+server_block_cache_free (ServerBlockCache *cache)
+{
+    if (!cache)
+        return;
+
+    g_free (cache->path);
+    g_free (cache->host);
+    g_free (cache->ids);
+    g_hash_table_destroy (cache->added);
+    g_hash_table_destroy (cache->pending);
+    pthread_mutex_destroy (&cache->lock);
+    g_free (cache);
+}
+
+gboolean
+server_block_cache_lookup (ServerBlockCache *cache, const char *block_id)
+{
+    unsigned char raw[CACHE_ID_LEN];
+    gboolean found;
+
+    if (!cache || hex_to_rawdata (block_id, raw, CACHE_ID_LEN) < 0)
+        return FALSE;
+
+    pthread_mutex_lock (&cache->lock);
+    found = (bsearch (raw, cache->ids, cache->n_ids, CACHE_ID_LEN,
+                      compare_raw_ids) != NULL ||
+             g_hash_table_lookup (cache->added, raw) != NULL);
+    pthread_mutex_unlock (&cache->lock);
+
+    return found;
+}
+
+void
+server_block_cache_add (ServerBlockCache *cache, const char *block_id)
+{
+    unsigned char *raw;
+
+    if (!cache)
+        return;
+
+    raw = g_malloc (CACHE_ID_LEN);
+    if (hex_to_rawdata (block_id, raw, CACHE_ID_LEN) < 0) {
+        g_free (raw);
+        return;
+    }
+
+    pthread_mutex_lock (&cache->lock);
+    g_hash_table_replace (cache->pending, raw, raw);
+    pthread_mutex_unlock (&cache->lock);
+}
+
+void
+server_block_cache_confirm (ServerBlockCache *cache)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+
+    if (!cache)
+        return;
+
+    pthread_mutex_lock (&cache->lock);
+    g_hash_table_iter_init (&iter, cache->pending);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        g_hash_table_iter_steal (&iter);
+        g_hash_table_replace (cache->added, key, key);
+        cache->dirty = TRUE;
+    }
+    pthread_mutex_unlock (&cache->lock);
+}
+
+void
+server_block_cache_clear (ServerBlockCache *cache)
+{
+    if (!cache)
+        return;
+
+    pthread_mutex_lock (&cache->lock);
+    g_free (cache->ids);
+    cache->ids = NULL;
+    cache->n_ids = 0;
+    g_hash_table_remove_all (cache->added);
+    g_hash_table_remove_all (cache->pending);
+    cache->created = (gint64)time(NULL);
+    cache->dirty = FALSE;
+    pthread_mutex_unlock (&cache->lock);
+
+    if (seaf_util_unlink (cache->path) < 0 && errno != ENOENT)
+        seaf_warning ("Failed to remove %s: %s.\n", cache->path, strerror(errno));
+}
+
+/* Merge the ids confirmed in this session into the sorted array. */
+static void
+merge_added_ids (ServerBlockCache *cache)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    unsigned char *added, *merged;
+    guint32 n_added = 0, i = 0, j = 0, n = 0;
+    int cmp;
+
+    if (g_hash_table_size (cache->added) == 0)
+        return;
+
+    added = g_malloc ((gsize)g_hash_table_size (cache->added) * CACHE_ID_LEN);
+    g_hash_table_iter_init (&iter, cache->added);
+    while (g_hash_table_iter_next (&iter, &key, &value))
+        memcpy (added + (n_added++) * CACHE_ID_LEN, key, CACHE_ID_LEN);
+    qsort (added, n_added, CACHE_ID_LEN, compare_raw_ids);
+
+    merged = g_malloc (((gsize)cache->n_ids + n_added) * CACHE_ID_LEN);
+    while (i < cache->n_ids || j < n_added) {
+        if (j == n_added)
+            cmp = -1;
+        else if (i == cache->n_ids)
+            cmp = 1;
+        else
+            cmp = compare_raw_ids (cache->ids + i * CACHE_ID_LEN,
+                                   added + j * CACHE_ID_LEN);
+
+        if (cmp <= 0) {
+            memcpy (merged + n * CACHE_ID_LEN, cache->ids + i * CACHE_ID_LEN,
+                    CACHE_ID_LEN);
+            ++i;
+            if (cmp == 0)
+                ++j;
+        } else {
+            memcpy (merged + n * CACHE_ID_LEN, added + j * CACHE_ID_LEN,
+                    CACHE_ID_LEN);
+            ++j;
+        }
+        ++n;
+    }
+
+    g_free (added);
+    g_free (cache->ids);
+    cache->ids = merged;
+    cache->n_ids = n;
+    g_hash_table_remove_all (cache->added);
+}
+
+int
+server_block_cache_save (ServerBlockCache *cache)
+{
+    CacheHeader hdr;
+    GString *buf;
+    char *dir;
+    GError *error = NULL;
+    int ret = 0;
+
+    if (!cache)
+        return 0;
+
+    pthread_mutex_lock (&cache->lock);
+
+    if (!cache->dirty)
+        goto out;
+
+    merge_added_ids (cache);
+
+    /* Start over rather than growing without bound. */
+    if (cache->n_ids > MAX_CACHED_IDS) {
+        g_free (cache->ids);
+        cache->ids = NULL;
+        cache->n_ids = 0;
+        cache->created = (gint64)time(NULL);
+    }
+
+    dir = g_build_filename (seaf->seaf_dir, CACHE_DIR, NULL);
+    if (checkdir_with_mkdir (dir) < 0) {
+        seaf_warning ("Failed to create %s.\n", dir);
+        g_free (dir);
+        ret = -1;
+        goto out;
+    }
+    g_free (dir);
+
+    memset (&hdr, 0, sizeof(hdr));
+    memcpy (hdr.magic, CACHE_MAGIC, 4);
+    hdr.host_len = strlen (cache->host);
+    hdr.n_ids = cache->n_ids;
+    hdr.created = cache->created;
+
+    buf = g_string_sized_new (sizeof(hdr) + hdr.host_len +
+                              (gsize)cache->n_ids * CACHE_ID_LEN);
+    g_string_append_len (buf, (const char *)&hdr, sizeof(hdr));
+    g_string_append_len (buf, cache->host, hdr.host_len);
+    g_string_append_len (buf, (const char *)cache->ids,
+                         (gssize)cache->n_ids * CACHE_ID_LEN);
+
+    if (!g_file_set_contents (cache->path, buf->str, buf->len, &error)) {
+        seaf_warning ("Failed to write %s: %s.\n", cache->path, error->message);
+        g_clear_error (&error);
+        ret = -1;
+    } else {
+        cache->dirty = FALSE;
+    }
+
+    g_string_free (buf, TRUE);
+
+out:
+    pthread_mutex_unlock (&cache->lock);
+    return ret;
+}
+
+void
+server_block_cache_remove (const char *repo_id)
+{
+    char *path = cache_path (repo_id);
+
+    if (seaf_util_unlink (path) < 0 && errno != ENOENT)
+        seaf_warning ("Failed to remove %s: %s.\n", path, strerror(errno));
+    g_free (path);
+}
@@ -0,0 +1,52 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SERVER_BLOCK_CACHE_H
+#define SERVER_BLOCK_CACHE_H
+
+#include <glib.h>
+
+/*
+ * Remembers which blocks of a repo are known to be on a server, so that
+ * uploads can skip asking the server about them. The cache is kept on disk
+ * per repo, together with the host it belongs to, and is dropped when the
+ * host changes or the cache gets old.
+ *
+ * Block ids are first added as pending, and only become known after
+ * server_block_cache_confirm(), e.g. when the commit that references them
+ * has been accepted by the server. Blocks that are only uploaded may be
+ * removed by the server's GC if the commit never follows.
+ *
+ * All functions accept a NULL cache and are safe to call from multiple
+ * threads.
+ */
+
+typedef struct ServerBlockCache ServerBlockCache;
+
+ServerBlockCache *
+server_block_cache_load (const char *repo_id, const char *host);
+
+void
+server_block_cache_free (ServerBlockCache *cache);
+
+gboolean
+server_block_cache_lookup (ServerBlockCache *cache, const char *block_id);
+
+void
+server_block_cache_add (ServerBlockCache *cache, const char *block_id);
+
+/* Make all pending block ids known. */
+void
+server_block_cache_confirm (ServerBlockCache *cache);
+
+/* Forget everything, e.g. after the server rejected a commit. */
+void
+server_block_cache_clear (ServerBlockCache *cache);
+
+int
+server_block_cache_save (ServerBlockCache *cache);
+
+/* Remove the cache file of a deleted repo. */
+void
+server_block_cache_remove (const char *repo_id);
+
+#endif
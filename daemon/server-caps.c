@@ -0,0 +1,260 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include "seafile-session.h"
+#include "seafile-error.h"
+#include "server-caps.h"
+#include "http-tx-mgr.h"
+#include "utils.h"
+#include "log.h"
+
+/* Known capabilities are refreshed after this many seconds. */
+#define CAPS_TTL 3600
+/* Failed probes are repeated at most this often. */
+#define CAPS_RETRY_INTERVAL 10
+/* A notification server that wasn't alive is checked again after this. */
+#define NOTIF_RECHECK_INTERVAL 3600
+
+typedef struct CapsWaiter {
+    ServerCapsCallback callback;
+    void *user_data;
+} CapsWaiter;
+
+typedef struct ServerRecord {
+    char *server_url;
+    /* Valid if protocol_version > 0. */
+    ServerCaps caps;
+    gint64 checked_at;
+    gint64 failed_at;
+
+    gboolean probing;
+    GList *waiters;
+
+    gboolean notif_checking;
+    gboolean notif_alive;
+    gint64 notif_checked_at;
+} ServerRecord;
+
+/* canonical server url -> ServerRecord. Records are never freed, so that
+ * probes in flight can keep pointers to them.
+ */
+static GHashTable *records;
+
+static ServerRecord *
+get_record (const char *server_url)
+{
+    ServerRecord *rec;
+    char *url;
+
+    if (!records)
+        records = g_hash_table_new (g_str_hash, g_str_equal);
+
+    url = canonical_server_url (server_url);
+    rec = g_hash_table_lookup (records, url);
+    if (rec) {
+        g_free (url);
+        return rec;
+    }
+
+    rec = g_new0 (ServerRecord, 1);
+    rec->server_url = url;
+    g_hash_table_insert (records, rec->server_url, rec);
+
+    return rec;
+}
+
+static char *
+replace_port (const char *url, const char *port)
+{
+    const char *host;
+    char *colon;
+    char *url_no_port;
+    char *ret = NULL;
+
+    /* Just return the url itself if it's invalid. */
+    if (strlen(url) <= strlen("http://"))
+        return g_strdup(url);
+
+    /* Skip protocol schem. */
+    host = url + strlen("http://");
+
+    colon = strrchr (host, ':');
+    if (colon) {
+        url_no_port = g_strndup(url, colon - url);
+        ret = g_strconcat(url_no_port, port, NULL);
+        g_free (url_no_port);
+    } else {
+        ret = g_strconcat(url, port, NULL);
+    }
+
+    return ret;
+}
+
+static void
+finish_probe (ServerRecord *rec, HttpProtocolVersion *result,
+              gboolean use_fileserver_port, int error_code)
+{
+    GList *waiters, *ptr;
+    CapsWaiter *waiter;
+
+    rec->probing = FALSE;
+
+    if (result) {
+        g_free (rec->caps.effective_url);
+        rec->caps.protocol_version = result->version;
+        rec->caps.use_fileserver_port = use_fileserver_port;
+        rec->caps.effective_url = use_fileserver_port ?
+            replace_port (rec->server_url, ":8082") : g_strdup (rec->server_url);
+        rec->caps.head_commits_delta = result->head_commits_delta;
+        rec->checked_at = (gint64)time(NULL);
+        seaf_message ("File syncing protocol version on server %s is %d. "
+                      "Client file syncing protocol version is %d.\n",
+                      rec->caps.effective_url, result->version,
+                      CURRENT_SYNC_PROTO_VERSION);
+    } else {
+        rec->failed_at = (gint64)time(NULL);
+    }
+
+    waiters = rec->waiters;
+    rec->waiters = NULL;
+    for (ptr = waiters; ptr; ptr = ptr->next) {
+        waiter = ptr->data;
+        waiter->callback (result ? &rec->caps : NULL, error_code,
+                          waiter->user_data);
+        g_free (waiter);
+    }
+    g_list_free (waiters);
+}
+
+static void
+probe_fileserver_done (HttpProtocolVersion *result, void *user_data)
+{
+    ServerRecord *rec = user_data;
+
+    if (result->check_success && !result->not_supported)
+        finish_probe (rec, result, TRUE, SYNC_ERROR_ID_NO_ERROR);
+    else
+        finish_probe (rec, NULL, FALSE, result->error_code);
+}
+
+static void
+probe_done (HttpProtocolVersion *result, void *user_data)
+{
+    ServerRecord *rec = user_data;
+    char *host;
+
+    if (result->check_success && !result->not_supported) {
+        finish_probe (rec, result, FALSE, SYNC_ERROR_ID_NO_ERROR);
+    } else if (strncmp (rec->server_url, "https", 5) != 0) {
+        /* Try the fileserver port instead. */
+        host = replace_port (rec->server_url, ":8082");
+        if (http_tx_manager_check_protocol_version (seaf->http_tx_mgr,
+                                                    host,
+                                                    TRUE,
+                                                    probe_fileserver_done,
+                                                    rec) < 0)
+            finish_probe (rec, NULL, FALSE, SYNC_ERROR_ID_NOT_ENOUGH_MEMORY);
+        g_free (host);
+    } else {
+        finish_probe (rec, NULL, FALSE, result->error_code);
+    }
+}
+
+static int
+start_probe (ServerRecord *rec)
+{
+    if (rec->probing)
+        return 0;
+
+    if (http_tx_manager_check_protocol_version (seaf->http_tx_mgr,
+                                                rec->server_url,
+                                                FALSE,
+                                                probe_done,
+                                                rec) < 0)
+        return -1;
+
+    rec->probing = TRUE;
+    return 0;
+}
+
+gboolean
+seaf_server_caps_get (const char *server_url, ServerCaps *caps)
+{
+    ServerRecord *rec = get_record (server_url);
+    gint64 now = (gint64)time(NULL);
+    gboolean known = (rec->caps.protocol_version > 0);
+
+    if (!rec->probing && now - rec->failed_at >= CAPS_RETRY_INTERVAL &&
+        (!known || now - rec->checked_at >= CAPS_TTL))
+        start_probe (rec);
+
+    if (!known)
+        return FALSE;
+
+    *caps = rec->caps;
+    caps->effective_url = g_strdup (rec->caps.effective_url);
+    return TRUE;
+}
+
+int
+seaf_server_caps_probe (const char *server_url,
+                        ServerCapsCallback callback, void *user_data)
+{
+    ServerRecord *rec = get_record (server_url);
+    CapsWaiter *waiter;
+
+    if (start_probe (rec) < 0)
+        return -1;
+
+    waiter = g_new0 (CapsWaiter, 1);
+    waiter->callback = callback;
+    waiter->user_data = user_data;
+    rec->waiters = g_list_append (rec->waiters, waiter);
+
+    return 0;
+}
+
+static void
+check_notif_done (gboolean is_alive, void *user_data)
+{
+    ServerRecord *rec = user_data;
+
+    rec->notif_checking = FALSE;
+    rec->notif_alive = is_alive;
+}
+
+gboolean
+seaf_server_caps_notif_alive (const char *server_url)
+{
+    ServerRecord *rec = get_record (server_url);
+    gint64 now = (gint64)time(NULL);
+    char *notif_url;
+
+    if (rec->notif_alive)
+        return TRUE;
+
+    /* Which port to use is only known after the server was probed. */
+    if (rec->caps.protocol_version <= 0 || rec->notif_checking)
+        return FALSE;
+    if (rec->notif_checked_at != 0 &&
+        now - rec->notif_checked_at < NOTIF_RECHECK_INTERVAL)
+        return FALSE;
+
+    if (rec->caps.use_fileserver_port)
+        notif_url = replace_port (rec->server_url, ":8083");
+    else
+        notif_url = g_strdup (rec->server_url);
+
+    if (http_tx_manager_check_notif_server (seaf->http_tx_mgr,
+                                            notif_url,
+                                            rec->caps.use_fileserver_port,
+                                            check_notif_done,
+                                            rec) == 0) {
+        rec->notif_checking = TRUE;
+        rec->notif_checked_at = now;
+    }
+
+    g_free (notif_url);
+    return FALSE;
+}
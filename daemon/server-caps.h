@@ -0,0 +1,63 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SERVER_CAPS_H
+#define SERVER_CAPS_H
+
+#include <glib.h>
+
+/*
+ * What each server supports, probed once per server and shared by the
+ * clone, sync and notification code instead of being probed per repo or
+ * per clone task.
+ *
+ * A server is probed at server_url and, unless https is used, at its
+ * fileserver port 8082 if that fails. Only one probe of a server runs at a
+ * time; callers asking meanwhile wait for it. Known capabilities are
+ * refreshed in the background after an hour and kept if a refresh fails.
+ * Failed probes are repeated at most every 10 seconds.
+ *
+ * Whether the server is a Pro edition is a server property set by the
+ * client, see seaf_repo_manager_server_is_pro().
+ *
+ * All functions must be called in the main thread.
+ */
+
+typedef struct ServerCaps {
+    /* Sync protocol version of the server. */
+    int protocol_version;
+    /* server_url, or server_url:8082 if the fileserver port is used. */
+    char *effective_url;
+    gboolean use_fileserver_port;
+    /* The server supports http_tx_manager_get_head_commit_delta(). */
+    gboolean head_commits_delta;
+} ServerCaps;
+
+/* @caps is NULL if the server couldn't be probed, with @error_code set. */
+typedef void (*ServerCapsCallback) (const ServerCaps *caps, int error_code,
+                                    void *user_data);
+
+/*
+ * Fills @caps if the capabilities of @server_url are known; the caller
+ * frees caps->effective_url. Otherwise returns FALSE and starts a probe in
+ * the background if none ran recently.
+ */
+gboolean
+seaf_server_caps_get (const char *server_url, ServerCaps *caps);
+
+/*
+ * Probes @server_url, or waits for the probe that's running. @callback is
+ * called from the main loop once it's done. Returns -1 if the probe can't
+ * be started.
+ */
+int
+seaf_server_caps_probe (const char *server_url,
+                        ServerCapsCallback callback, void *user_data);
+
+/*
+ * Returns TRUE if the notification server of @server_url is alive.
+ * Otherwise checks it in the background, at most once an hour.
+ */
+gboolean
+seaf_server_caps_notif_alive (const char *server_url);
+
+#endif
@@ -0,0 +1,332 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+#include <glib/gstdio.h>
+
+#include "seafile-session.h"
+#include "shared-block-cache.h"
+#include "utils.h"
+#include "log.h"
+
+#define SHARED_BLOCK_DIR "shared-blocks"
+#define SHARED_BLOCK_TMP_DIR "tmp"
+
+typedef struct CachedBlock {
+    char block_id[41];
+    gint64 size;
+    /* In lru, the most recently used first. */
+    GList *link;
+} CachedBlock;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+/* block_id -> CachedBlock, NULL until the cache dir is loaded. */
+static GHashTable *blocks;
+static GQueue lru = G_QUEUE_INIT;
+static char *cache_dir;
+static gint64 limit;
+static gint64 total_size;
+static gint tmp_seq;
+
+static void
+get_cached_path (const char *block_id, char *path)
+{
+    snprintf (path, SEAF_PATH_MAX, "%s/%.2s/%s",
+              cache_dir, block_id, block_id + 2);
+}
+
+/* Called with cache_lock held. */
+static void
+insert_block (const char *block_id, gint64 size)
+{
+    CachedBlock *block = g_new0 (CachedBlock, 1);
+
+    memcpy (block->block_id, block_id, 40);
+    block->size = size;
+    g_queue_push_head (&lru, block);
+    block->link = lru.head;
+    g_hash_table_insert (blocks, block->block_id, block);
+    total_size += size;
+}
+
+/* Called with cache_lock held. The block's file is left to the caller. */
+static void
+remove_block (CachedBlock *block)
+{
+    g_hash_table_remove (blocks, block->block_id);
+    g_queue_delete_link (&lru, block->link);
+    total_size -= block->size;
+    g_free (block);
+}
+
+/* Called with cache_lock held. Returns the ids of the blocks dropped. */
+static GList *
+collect_victims ()
+{
+    GList *victims = NULL;
+    CachedBlock *block;
+
+    while (total_size > limit && lru.tail) {
+        block = lru.tail->data;
+        victims = g_list_prepend (victims, g_strdup (block->block_id));
+        remove_block (block);
+    }
+
+    return victims;
+}
+
+/* Removes the dropped blocks outside of cache_lock. */
+static void
+free_victims (GList *victims)
+{
+    char path[SEAF_PATH_MAX];
+    GList *ptr;
+
+    for (ptr = victims; ptr; ptr = ptr->next) {
+        get_cached_path (ptr->data, path);
+        g_unlink (path);
+    }
+    g_list_free_full (victims, g_free);
+}
+
+typedef struct ScannedBlock {
+    char block_id[41];
+    gint64 size;
+    gint64 mtime;
+} ScannedBlock;
+
+static gint
+compare_by_mtime (gconstpointer a, gconstpointer b)
+{
+    const ScannedBlock *sa = a, *sb = b;
+
+    if (sa->mtime != sb->mtime)
+        return sa->mtime < sb->mtime ? -1 : 1;
+    return 0;
+}
+
+/* Blocks of earlier runs, the least recently used first. */
+static GList *
+scan_cache_dir ()
+{
+    GList *scanned = NULL;
+    GDir *dir1, *dir2;
+    const char *dname1, *dname2;
+    char *path1, *path2;
+    ScannedBlock *sb;
+    SeafStat st;
+
+    dir1 = g_dir_open (cache_dir, 0, NULL);
+    if (!dir1)
+        return NULL;
+
+    while ((dname1 = g_dir_read_name (dir1)) != NULL) {
+        if (strlen (dname1) != 2)
+            continue;
+        path1 = g_build_filename (cache_dir, dname1, NULL);
+        dir2 = g_dir_open (path1, 0, NULL);
+        if (!dir2) {
+            g_free (path1);
+            continue;
+        }
+
+        while ((dname2 = g_dir_read_name (dir2)) != NULL) {
+            path2 = g_build_filename (path1, dname2, NULL);
+            if (strlen (dname2) != 38 || seaf_stat (path2, &st) < 0 ||
+                !S_ISREG(st.st_mode)) {
+                g_free (path2);
+                continue;
+            }
+            g_free (path2);
+
+            sb = g_new0 (ScannedBlock, 1);
+            snprintf (sb->block_id, sizeof(sb->block_id), "%s%s",
+                      dname1, dname2);
+            sb->size = (gint64)st.st_size;
+            sb->mtime = (gint64)st.st_mtime;
+            scanned = g_list_prepend (scanned, sb);
+        }
+
+        g_dir_close (dir2);
+        g_free (path1);
+    }
+
+    g_dir_close (dir1);
+
+    return g_list_sort (scanned, compare_by_mtime);
+}
+
+int
+seaf_shared_block_cache_start ()
+{
+    char *tmp_dir, *path;
+    GDir *dir;
+    const char *dname;
+    GList *scanned, *ptr;
+    GList *victims = NULL;
+    ScannedBlock *sb;
+
+    cache_dir = g_build_filename (seaf->seaf_dir, SHARED_BLOCK_DIR, NULL);
+
+    /* Left over from interrupted adds. */
+    tmp_dir = g_build_filename (cache_dir, SHARED_BLOCK_TMP_DIR, NULL);
+    dir = g_dir_open (tmp_dir, 0, NULL);
+    if (dir) {
+        while ((dname = g_dir_read_name (dir)) != NULL) {
+            path = g_build_filename (tmp_dir, dname, NULL);
+            g_unlink (path);
+            g_free (path);
+        }
+        g_dir_close (dir);
+    }
+    g_free (tmp_dir);
+
+    scanned = scan_cache_dir ();
+
+    pthread_mutex_lock (&cache_lock);
+    blocks = g_hash_table_new (g_str_hash, g_str_equal);
+    for (ptr = scanned; ptr; ptr = ptr->next) {
+        sb = ptr->data;
+        insert_block (sb->block_id, sb->size);
+    }
+    victims = collect_victims ();
+    pthread_mutex_unlock (&cache_lock);
+
+    g_list_free_full (scanned, g_free);
+    free_victims (victims);
+
+    return 0;
+}
+
+void
+seaf_shared_block_cache_set_limit (gint64 bytes)
+{
+    GList *victims = NULL;
+
+    pthread_mutex_lock (&cache_lock);
+    limit = MAX (bytes, 0);
+    if (blocks)
+        victims = collect_victims ();
+    pthread_mutex_unlock (&cache_lock);
+
+    free_victims (victims);
+}
+
+gboolean
+seaf_shared_block_cache_enabled ()
+{
+    gboolean ret;
+
+    pthread_mutex_lock (&cache_lock);
+    ret = (blocks != NULL && limit > 0);
+    pthread_mutex_unlock (&cache_lock);
+
+    return ret;
+}
+
+int
+seaf_shared_block_cache_get (const char *repo_id, int version,
+                             const char *block_id)
+{
+    char path[SEAF_PATH_MAX];
+    CachedBlock *block;
+
+    pthread_mutex_lock (&cache_lock);
+    block = blocks ? g_hash_table_lookup (blocks, block_id) : NULL;
+    if (!block) {
+        pthread_mutex_unlock (&cache_lock);
+        return -1;
+    }
+    g_queue_unlink (&lru, block->link);
+    g_queue_push_head_link (&lru, block->link);
+    pthread_mutex_unlock (&cache_lock);
+
+    get_cached_path (block_id, path);
+    if (seaf_block_manager_import_block (seaf->block_mgr, repo_id, version,
+                                         block_id, path) < 0) {
+        /* Dropped meanwhile, or the file is gone. */
+        pthread_mutex_lock (&cache_lock);
+        block = g_hash_table_lookup (blocks, block_id);
+        if (block)
+            remove_block (block);
+        pthread_mutex_unlock (&cache_lock);
+        return -1;
+    }
+
+    /* Keeps the order of use for the next run. */
+    g_utime (path, NULL);
+
+    return 0;
+}
+
+void
+seaf_shared_block_cache_add (const char *repo_id, int version,
+                             const char *block_id)
+{
+    BlockMetadata *bmd;
+    CachedBlock *block;
+    char path[SEAF_PATH_MAX];
+    char *tmp_dir, *tmp_path, *parent;
+    gint64 size;
+    GList *victims = NULL;
+
+    pthread_mutex_lock (&cache_lock);
+    if (!blocks || limit == 0) {
+        pthread_mutex_unlock (&cache_lock);
+        return;
+    }
+    block = g_hash_table_lookup (blocks, block_id);
+    if (block) {
+        g_queue_unlink (&lru, block->link);
+        g_queue_push_head_link (&lru, block->link);
+        pthread_mutex_unlock (&cache_lock);
+        return;
+    }
+    pthread_mutex_unlock (&cache_lock);
+
+    bmd = seaf_block_manager_stat_block (seaf->block_mgr, repo_id, version,
+                                         block_id);
+    if (!bmd)
+        return;
+    size = bmd->size;
+    g_free (bmd);
+    if (size > limit)
+        return;
+
+    get_cached_path (block_id, path);
+    parent = g_path_get_dirname (path);
+    tmp_dir = g_build_filename (cache_dir, SHARED_BLOCK_TMP_DIR, NULL);
+    tmp_path = g_strdup_printf ("%s/%s.%d", tmp_dir, block_id,
+                                g_atomic_int_add (&tmp_seq, 1));
+    if (checkdir_with_mkdir (parent) < 0 || checkdir_with_mkdir (tmp_dir) < 0) {
+        seaf_warning ("Failed to create shared block cache dirs.\n");
+        goto out;
+    }
+
+    if (seaf_block_manager_export_block (seaf->block_mgr, repo_id, version,
+                                         block_id, tmp_path) < 0)
+        goto out;
+    /* Another repo may have added the same block meanwhile. */
+    if (g_rename (tmp_path, path) < 0) {
+        g_unlink (tmp_path);
+        if (!g_file_test (path, G_FILE_TEST_EXISTS)) {
+            seaf_warning ("Failed to rename %s to %s: %s.\n",
+                          tmp_path, path, strerror(errno));
+            goto out;
+        }
+    }
+
+    pthread_mutex_lock (&cache_lock);
+    if (!g_hash_table_lookup (blocks, block_id))
+        insert_block (block_id, size);
+    victims = collect_victims ();
+    pthread_mutex_unlock (&cache_lock);
+
+    free_victims (victims);
+
+out:
+    g_free (parent);
+    g_free (tmp_dir);
+    g_free (tmp_path);
+}
@@ -0,0 +1,40 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SHARED_BLOCK_CACHE_H
+#define SHARED_BLOCK_CACHE_H
+
+#include <glib.h>
+
+/*
+ * Blocks downloaded into any repo, kept by block id outside of the repo
+ * stores, so that the same content synced in several libraries is only
+ * downloaded once. Blocks are hard linked between the cache and the repo
+ * stores where possible. The least recently used blocks beyond
+ * shared_block_cache_size MB are dropped.
+ *
+ * Only for repos that aren't encrypted, the caller checks that.
+ */
+
+int
+seaf_shared_block_cache_start ();
+
+/* 0 disables the cache and drops the blocks in it. */
+void
+seaf_shared_block_cache_set_limit (gint64 bytes);
+
+gboolean
+seaf_shared_block_cache_enabled ();
+
+/* Puts the cached block into the store of @repo_id. Returns -1 if it isn't
+ * cached.
+ */
+int
+seaf_shared_block_cache_get (const char *repo_id, int version,
+                             const char *block_id);
+
+/* Adds a block committed into the store of @repo_id. */
+void
+seaf_shared_block_cache_add (const char *repo_id, int version,
+                             const char *block_id);
+
+#endif
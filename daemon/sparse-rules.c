@@ -0,0 +1,235 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <jansson.h>
+
+#include "diff-simple.h"
+#include "sparse-rules.h"
+#include "utils.h"
+#include "log.h"
+
+struct SparseRules {
+    GPtrArray *includes;
+    GPtrArray *excludes;
+};
+
+/* Strips slashes at both ends and duplicated ones. Returns NULL for empty
+ * paths and paths with "." or ".." components.
+ */
+static char *
+normalize_path (const char *path)
+{
+    char **tokens;
+    GString *buf;
+    int i;
+
+    tokens = g_strsplit (path, "/", 0);
+    buf = g_string_new (NULL);
+
+    for (i = 0; tokens[i]; ++i) {
+        if (tokens[i][0] == 0)
+            continue;
+        if (strcmp (tokens[i], ".") == 0 || strcmp (tokens[i], "..") == 0) {
+            g_string_set_size (buf, 0);
+            break;
+        }
+        if (buf->len > 0)
+            g_string_append_c (buf, '/');
+        g_string_append (buf, tokens[i]);
+    }
+    g_strfreev (tokens);
+
+    if (buf->len == 0) {
+        g_string_free (buf, TRUE);
+        return NULL;
+    }
+    return g_string_free (buf, FALSE);
+}
+
+static int
+parse_paths (json_t *object, const char *key, GPtrArray *paths)
+{
+    json_t *array, *item;
+    size_t i;
+    char *path;
+
+    array = json_object_get (object, key);
+    if (!array)
+        return 0;
+    if (!json_is_array (array))
+        return -1;
+
+    json_array_foreach (array, i, item) {
+        if (!json_is_string (item))
+            return -1;
+        path = normalize_path (json_string_value (item));
+        if (!path)
+            return -1;
+        g_ptr_array_add (paths, path);
+    }
+
+    return 0;
+}
+
+int
+sparse_rules_parse (const char *str, SparseRules **rules)
+{
+    json_t *object;
+    json_error_t jerror;
+    SparseRules *ret;
+
+    *rules = NULL;
+
+    if (!str || str[0] == 0)
+        return 0;
+
+    object = json_loadb (str, strlen(str), 0, &jerror);
+    if (!object || !json_is_object (object)) {
+        seaf_warning ("Invalid sparse rules %s.\n", str);
+        json_decref (object);
+        return -1;
+    }
+
+    ret = g_new0 (SparseRules, 1);
+    ret->includes = g_ptr_array_new_with_free_func (g_free);
+    ret->excludes = g_ptr_array_new_with_free_func (g_free);
+
+    if (parse_paths (object, "include", ret->includes) < 0 ||
+        parse_paths (object, "exclude", ret->excludes) < 0) {
+        seaf_warning ("Invalid sparse rules %s.\n", str);
+        json_decref (object);
+        sparse_rules_free (ret);
+        return -1;
+    }
+    json_decref (object);
+
+    if (ret->includes->len == 0 && ret->excludes->len == 0) {
+        sparse_rules_free (ret);
+        return 0;
+    }
+
+    *rules = ret;
+    return 0;
+}
+
+void
+sparse_rules_free (SparseRules *rules)
+{
+    if (!rules)
+        return;
+
+    g_ptr_array_free (rules->includes, TRUE);
+    g_ptr_array_free (rules->excludes, TRUE);
+    g_free (rules);
+}
+
+static json_t *
+paths_to_json (GPtrArray *paths)
+{
+    json_t *array = json_array ();
+    guint i;
+
+    for (i = 0; i < paths->len; ++i)
+        json_array_append_new (array, json_string (g_ptr_array_index (paths, i)));
+
+    return array;
+}
+
+char *
+sparse_rules_to_string (SparseRules *rules)
+{
+    json_t *object;
+    char *str, *ret;
+
+    if (!rules)
+        return NULL;
+
+    object = json_object ();
+    if (rules->includes->len > 0)
+        json_object_set_new (object, "include", paths_to_json (rules->includes));
+    if (rules->excludes->len > 0)
+        json_object_set_new (object, "exclude", paths_to_json (rules->excludes));
+
+    str = json_dumps (object, JSON_COMPACT);
+    ret = g_strdup (str);
+    free (str);
+    json_decref (object);
+
+    return ret;
+}
+
+/* Whether @path is @rule or below it. */
+static gboolean
+path_under (const char *path, const char *rule)
+{
+    size_t len = strlen (rule);
+
+    return (strncmp (path, rule, len) == 0 &&
+            (path[len] == 0 || path[len] == '/'));
+}
+
+static gboolean
+any_path_under (GPtrArray *rules, const char *path)
+{
+    guint i;
+
+    for (i = 0; i < rules->len; ++i)
+        if (path_under (g_ptr_array_index (rules, i), path))
+            return TRUE;
+    return FALSE;
+}
+
+int
+sparse_rules_match (const char *path, gboolean is_dir, void *vrules)
+{
+    SparseRules *rules = vrules;
+    gboolean included = FALSE;
+    guint i;
+
+    if (!rules)
+        return DIFF_PATH_FULL;
+
+    for (i = 0; i < rules->excludes->len; ++i)
+        if (path_under (path, g_ptr_array_index (rules->excludes, i)))
+            return DIFF_PATH_SKIP;
+
+    if (rules->includes->len > 0) {
+        for (i = 0; i < rules->includes->len && !included; ++i)
+            included = path_under (path, g_ptr_array_index (rules->includes, i));
+
+        /* Dirs leading to included paths are walked. */
+        if (!included)
+            return (is_dir && any_path_under (rules->includes, path)) ?
+                DIFF_PATH_PARTIAL : DIFF_PATH_SKIP;
+    }
+
+    if (is_dir && any_path_under (rules->excludes, path))
+        return DIFF_PATH_PARTIAL;
+
+    return DIFF_PATH_FULL;
+}
+
+int
+sparse_rules_match_kept (const char *path, gboolean is_dir, void *vchange)
+{
+    SparseRulesChange *change = vchange;
+    int old_match = sparse_rules_match (path, is_dir, change->old_rules);
+    int new_match = sparse_rules_match (path, is_dir, change->new_rules);
+
+    return MIN (old_match, new_match);
+}
+
+int
+sparse_rules_match_added (const char *path, gboolean is_dir, void *vchange)
+{
+    SparseRulesChange *change = vchange;
+    int old_match = sparse_rules_match (path, is_dir, change->old_rules);
+    int new_match = sparse_rules_match (path, is_dir, change->new_rules);
+
+    if (new_match == DIFF_PATH_SKIP || old_match == DIFF_PATH_FULL)
+        return DIFF_PATH_SKIP;
+    if (new_match == DIFF_PATH_FULL && old_match == DIFF_PATH_SKIP)
+        return DIFF_PATH_FULL;
+    return DIFF_PATH_PARTIAL;
+}
@@ -0,0 +1,63 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SPARSE_RULES_H
+#define SPARSE_RULES_H
+
+#include <glib.h>
+
+/*
+ * Sparse checkout rules select the subtrees of a library that are checked
+ * out. They're kept in the "sparse-rules" repo property as JSON:
+ *
+ *     {"include": ["Projects/A", "Shared/Templates"], "exclude": ["Projects/A/tmp"]}
+ *
+ * Paths are relative to the library root. If there are include paths, only
+ * they and the dirs leading to them are checked out. Exclude paths are left
+ * out in any case.
+ *
+ * Paths that are left out are not downloaded, indexed or committed. Commits
+ * still keep them, since commits only change the subtrees with local
+ * changes and reuse the dir ids of all others.
+ */
+
+typedef struct SparseRules SparseRules;
+
+/*
+ * Parses @str into *@rules. *@rules is set to NULL if @str is NULL, empty
+ * or has no paths. Returns -1 if @str is invalid.
+ */
+int
+sparse_rules_parse (const char *str, SparseRules **rules);
+
+void
+sparse_rules_free (SparseRules *rules);
+
+/* The rules in normalized form, or NULL for no rules. */
+char *
+sparse_rules_to_string (SparseRules *rules);
+
+/*
+ * Returns DIFF_PATH_SKIP, DIFF_PATH_PARTIAL or DIFF_PATH_FULL for @path,
+ * which has no leading or trailing slash. Files are never partial. NULL
+ * rules pass everything. Can be used as a DiffPathFilter.
+ */
+int
+sparse_rules_match (const char *path, gboolean is_dir, void *rules);
+
+/*
+ * For a change from @old_rules to @new_rules. Paths that are in both sets
+ * keep being synced, added paths have to be checked out in full.
+ */
+typedef struct SparseRulesChange {
+    SparseRules *old_rules;
+    SparseRules *new_rules;
+} SparseRulesChange;
+
+/* DiffPathFilters on a SparseRulesChange. */
+int
+sparse_rules_match_kept (const char *path, gboolean is_dir, void *change);
+
+int
+sparse_rules_match_added (const char *path, gboolean is_dir, void *change);
+
+#endif
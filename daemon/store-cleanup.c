@@ -0,0 +1,296 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <glib/gstdio.h>
+#include <pthread.h>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#endif
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#ifdef __APPLE__
+#include <sys/resource.h>
+#endif
+
+#include "seafile-session.h"
+#include "metrics.h"
+#include "store-cleanup.h"
+#include "utils.h"
+#include "log.h"
+
+#define CLEANUP_THREADS 4
+
+/* Files removed by a thread between checks for running syncs. */
+#define REMOVE_BATCH 100
+
+/* While repos are syncing, remove at most 1000 files per 5 seconds,
+ * spread over the threads.
+ */
+#define BUSY_BATCH_SLEEP_USEC \
+    (5 * G_USEC_PER_SEC * REMOVE_BATCH / 1000 * CLEANUP_THREADS)
+
+/* How often to look for new deleted stores. */
+#define CLEANUP_INTERVAL 60
+
+typedef struct StoreCleanup {
+    pthread_mutex_t lock;
+    gint64 n_files;
+    gint64 n_bytes;
+} StoreCleanup;
+
+static SeafMetric *files_removed;
+static SeafMetric *bytes_removed;
+
+static void
+lower_thread_io_priority ()
+{
+#if defined __linux__ && defined SYS_ioprio_set
+    /* IOPRIO_WHO_PROCESS with id 0 is the calling thread,
+     * IOPRIO_CLASS_IDLE is 3.
+     */
+    syscall (SYS_ioprio_set, 1, 0, 3 << 13);
+#elif defined __APPLE__
+    setiopolicy_np (IOPOL_TYPE_DISK, IOPOL_SCOPE_THREAD, IOPOL_THROTTLE);
+#elif defined WIN32
+    SetThreadPriority (GetCurrentThread (), THREAD_MODE_BACKGROUND_BEGIN);
+#endif
+}
+
+static void
+add_removed (StoreCleanup *cleanup, gint64 n_files, gint64 n_bytes)
+{
+    pthread_mutex_lock (&cleanup->lock);
+    cleanup->n_files += n_files;
+    cleanup->n_bytes += n_bytes;
+    pthread_mutex_unlock (&cleanup->lock);
+
+    seaf_metric_inc (files_removed, n_files);
+    seaf_metric_inc (bytes_removed, n_bytes);
+}
+
+static void
+throttle ()
+{
+    /* Read without a lock, the count only needs to be roughly right. */
+    if (seaf->sync_mgr && seaf->sync_mgr->n_running_tasks > 0)
+        g_usleep (BUSY_BATCH_SLEEP_USEC);
+}
+
+/* Removes the files in @path and then @path itself, if it's empty. */
+static void
+remove_dir_files (const char *path, StoreCleanup *cleanup)
+{
+    gint64 n_files = 0, n_bytes = 0;
+    int n = 0;
+
+#ifndef WIN32
+    struct dirent *dent;
+    struct stat st;
+    DIR *dir;
+    int dfd;
+
+    dfd = open (path, O_RDONLY | O_DIRECTORY);
+    if (dfd < 0) {
+        seaf_warning ("Failed to open dir %s: %s.\n", path, strerror(errno));
+        return;
+    }
+    dir = fdopendir (dfd);
+    if (!dir) {
+        seaf_warning ("Failed to open dir %s: %s.\n", path, strerror(errno));
+        close (dfd);
+        return;
+    }
+
+    while ((dent = readdir (dir)) != NULL) {
+        if (strcmp (dent->d_name, ".") == 0 || strcmp (dent->d_name, "..") == 0)
+            continue;
+
+        if (fstatat (dfd, dent->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0 ||
+            S_ISDIR(st.st_mode))
+            continue;
+        if (unlinkat (dfd, dent->d_name, 0) < 0)
+            continue;
+
+        ++n_files;
+        n_bytes += st.st_size;
+        if (++n >= REMOVE_BATCH) {
+            add_removed (cleanup, n_files, n_bytes);
+            n_files = n_bytes = 0;
+            n = 0;
+            throttle ();
+        }
+    }
+
+    closedir (dir);
+#else
+    GDir *dir;
+    const char *dname;
+    char *file_path;
+    SeafStat st;
+
+    dir = g_dir_open (path, 0, NULL);
+    if (!dir) {
+        seaf_warning ("Failed to open dir %s.\n", path);
+        return;
+    }
+
+    while ((dname = g_dir_read_name (dir)) != NULL) {
+        file_path = g_build_filename (path, dname, NULL);
+        if (seaf_stat (file_path, &st) < 0 || S_ISDIR(st.st_mode) ||
+            g_unlink (file_path) < 0) {
+            g_free (file_path);
+            continue;
+        }
+        g_free (file_path);
+
+        ++n_files;
+        n_bytes += st.st_size;
+        if (++n >= REMOVE_BATCH) {
+            add_removed (cleanup, n_files, n_bytes);
+            n_files = n_bytes = 0;
+            n = 0;
+            throttle ();
+        }
+    }
+
+    g_dir_close (dir);
+#endif
+
+    add_removed (cleanup, n_files, n_bytes);
+    g_rmdir (path);
+}
+
+static void
+remove_dir_thread (gpointer vpath, gpointer vcleanup)
+{
+    char *path = vpath;
+
+    lower_thread_io_priority ();
+
+    remove_dir_files (path, vcleanup);
+    g_free (path);
+}
+
+/*
+ * A store is laid out as <store_id>/<first 2 hex of id>/<rest of id>, or
+ * <store_id>/pack/<pack files> for the pack backends. The subdirs are
+ * removed in parallel.
+ */
+static void
+remove_store (const char *top_store_dir, const char *store_id)
+{
+    char *store_dir;
+    GDir *dir;
+    const char *dname;
+    GThreadPool *tpool;
+    StoreCleanup cleanup;
+
+    store_dir = g_build_filename (top_store_dir, store_id, NULL);
+
+    dir = g_dir_open (store_dir, 0, NULL);
+    if (!dir) {
+        g_free (store_dir);
+        return;
+    }
+
+    seaf_message ("Removing store %s\n", store_dir);
+
+    memset (&cleanup, 0, sizeof(cleanup));
+    pthread_mutex_init (&cleanup.lock, NULL);
+
+    tpool = g_thread_pool_new (remove_dir_thread, &cleanup,
+                               CLEANUP_THREADS, FALSE, NULL);
+
+    while ((dname = g_dir_read_name (dir)) != NULL)
+        g_thread_pool_push (tpool,
+                            g_build_filename (store_dir, dname, NULL), NULL);
+    g_dir_close (dir);
+
+    /* Waits for the pushed dirs to be removed. */
+    g_thread_pool_free (tpool, FALSE, TRUE);
+
+    /* Files directly under the store dir. */
+    remove_dir_files (store_dir, &cleanup);
+
+    seaf_message ("Removed store %s, %" G_GINT64_FORMAT " files, "
+                  "%" G_GINT64_FORMAT " bytes reclaimed.\n",
+                  store_dir, cleanup.n_files, cleanup.n_bytes);
+
+    pthread_mutex_destroy (&cleanup.lock);
+    g_free (store_dir);
+}
+
+static void
+cleanup_stores_by_type (const char *deleted_store_dir, const char *type)
+{
+    char *top_store_dir;
+    const char *store_id;
+    GError *error = NULL;
+    GDir *dir;
+
+    top_store_dir = g_build_filename (deleted_store_dir, type, NULL);
+
+    dir = g_dir_open (top_store_dir, 0, &error);
+    if (!dir) {
+        seaf_warning ("Failed to open store dir %s: %s.\n",
+                      top_store_dir, error->message);
+        g_clear_error (&error);
+        g_free (top_store_dir);
+        return;
+    }
+
+    while ((store_id = g_dir_read_name (dir)) != NULL)
+        remove_store (top_store_dir, store_id);
+
+    g_dir_close (dir);
+    g_free (top_store_dir);
+}
+
+static void *
+cleanup_thread (void *vdir)
+{
+    char *deleted_store_dir = vdir;
+
+    lower_thread_io_priority ();
+
+    while (1) {
+        cleanup_stores_by_type (deleted_store_dir, "commits");
+        cleanup_stores_by_type (deleted_store_dir, "fs");
+        cleanup_stores_by_type (deleted_store_dir, "blocks");
+        g_usleep (CLEANUP_INTERVAL * G_USEC_PER_SEC);
+    }
+
+    return NULL;
+}
+
+int
+seaf_store_cleanup_start (const char *deleted_store_dir)
+{
+    pthread_t tid;
+    pthread_attr_t attr;
+    int rc;
+
+    files_removed = seaf_metric_get (SEAF_METRIC_COUNTER,
+                                     "seaf_store_cleanup_files", NULL);
+    bytes_removed = seaf_metric_get (SEAF_METRIC_COUNTER,
+                                     "seaf_store_cleanup_bytes", NULL);
+
+    pthread_attr_init (&attr);
+    pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+    rc = pthread_create (&tid, &attr, cleanup_thread,
+                         g_strdup (deleted_store_dir));
+    if (rc != 0) {
+        seaf_warning ("Failed to start cleanup thread: %s\n", strerror(rc));
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,18 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef STORE_CLEANUP_H
+#define STORE_CLEANUP_H
+
+/*
+ * Removes the commit, fs and block stores of deleted repos, which are moved
+ * to @deleted_store_dir, in a background thread with idle I/O priority.
+ *
+ * Each store is removed by several threads at a time. While repos are
+ * syncing, the removal is slowed down so that it doesn't compete with the
+ * sync for disk I/O. The number of files and bytes removed are logged per
+ * store and counted in the seaf_store_cleanup_* metrics.
+ */
+int
+seaf_store_cleanup_start (const char *deleted_store_dir);
+
+#endif
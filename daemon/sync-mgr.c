@@ -16,6 +16,12 @@
 
 #include "sync-status-tree.h"
 #include "diff-simple.h"
+#include "metrics.h"
+#include "block-gc.h"
+#include "scrubber.h"
+#include "index-cache.h"
+#include "transfer-policy.h"
+#include "server-caps.h"
 
 #ifdef WIN32
 #include <shlobj.h>
@@ -30,34 +36,46 @@
 #define CHECK_SYNC_INTERVAL  1000 /* 1s */
 #define UPDATE_TX_STATE_INTERVAL 1000 /* 1s */
 #define MAX_RUNNING_SYNC_TASKS 5
+#define MAX_RUNNING_SYNC_TASKS_LIMIT 16
+#define FAST_LANE_SLOTS 3
+#define FAST_LANE_MAX_EVENTS 100
+#define FAST_LANE_MAX_BLOCKS 64
+#define FAST_LANE_MAX_BYTES (16 * 1024 * 1024)
 #define CHECK_LOCKED_FILES_INTERVAL 10 /* 10s */
 #define CHECK_FOLDER_PERMS_INTERVAL 30 /* 30s */
+/* Locks and folder perms of repos subscribed to the notification server are
+ * pushed, they're only polled this often in case an event was lost.
+ */
+#define CHECK_PUSHED_STATE_INTERVAL 1800 /* 30min */
 #define JWT_TOKEN_EXPIRE_TIME 3*24*3600 /* 3 days */
 
 #define SYNC_PERM_ERROR_RETRY_TIME 2
 
 struct _HttpServerState {
+    /* Copied from the server capabilities, see server-caps.h. */
     int http_version;
-    gboolean checking;
-    gint64 last_http_check_time;
-    char *testing_host;
     /* Can be server_url or server_url:8082, depends on which one works. */
     char *effective_host;
     gboolean use_fileserver_port;
-
-    gboolean notif_server_checked;
-    gboolean notif_server_alive;
+    gboolean head_commits_delta;
 
     gboolean server_disconnected;
 
     gboolean folder_perms_not_supported;
     gint64 last_check_perms_time;
     gboolean checking_folder_perms;
+    /* Last check that included the subscribed repos. */
+    gint64 last_full_check_perms_time;
 
     gboolean locked_files_not_supported;
     gint64 last_check_locked_files_time;
     gboolean checking_locked_files;
+    gint64 last_full_check_locked_files_time;
 
+    /* Set when pushed events may have been missed, e.g. after the
+     * notification server reconnected. All repos are checked on the
+     * next pulse.
+     */
     gboolean immediate_check_folder_perms;
     gboolean immediate_check_locked_files;
 
@@ -69,6 +87,14 @@ struct _HttpServerState {
     pthread_mutex_t head_commit_map_lock;
     gboolean head_commit_map_init;
     gint64 last_update_head_commit_map_time;
+
+    /* Only used by the head commit polling thread. head_commits_token is
+     * the token of the last delta response and covers the repos in
+     * token_repos.
+     */
+    char *head_commits_token;
+    GHashTable *token_repos;
+    gint64 last_full_head_commit_poll;
 };
 typedef struct _HttpServerState HttpServerState;
 
@@ -84,6 +110,9 @@ struct _SeafSyncManagerPriv {
     /* When FALSE, auto sync is globally disabled */
     gboolean   auto_sync_enabled;
 
+    /* The notify_sync config. */
+    gboolean   notify_sync;
+
     GHashTable *active_paths;
     pthread_mutex_t paths_lock;
 
@@ -94,6 +123,24 @@ struct _SeafSyncManagerPriv {
 
     pthread_mutex_t del_confirmation_lock;
     GHashTable *del_confirmation_tasks;
+
+    /* repo_id -> time when auto_sync_pulse has to look at the repo again.
+     * Repos not in the table are due.
+     */
+    GHashTable *next_checks;
+    /* When the pulse timer fires next, or 0 before it's scheduled. */
+    gint64 next_pulse;
+
+    /* Wakeups requested by other threads, applied on the main loop. */
+    pthread_mutex_t wakeup_lock;
+    GHashTable *wakeup_repos;   /* repo_id -> earliest due time */
+    gboolean wakeup_all;
+    gboolean wakeup_pending;
+    gboolean wakeup_registered;
+    uint32_t wakeup_event_id;
+
+    /* Protects the timings of all sync infos. */
+    pthread_mutex_t timings_lock;
 };
 
 struct _ActivePathsInfo {
@@ -104,6 +151,7 @@ struct _ActivePathsInfo {
 typedef struct _ActivePathsInfo ActivePathsInfo;
 
 static int auto_sync_pulse (void *vmanager);
+static void on_sync_wakeup (CEvent *event, void *vmanager);
 
 static void on_repo_http_fetched (SeafileSession *seaf,
                                   HttpTxTask *tx_task,
@@ -132,6 +180,7 @@ http_server_state_new ()
     HttpServerState *state = g_new0 (HttpServerState, 1);
     state->head_commit_map = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
     pthread_mutex_init (&state->head_commit_map_lock, NULL);
+    state->token_repos = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
     return state;
 }
 
@@ -142,9 +191,30 @@ http_server_state_free (HttpServerState *state)
         return;
     g_hash_table_destroy (state->head_commit_map);
     pthread_mutex_destroy (&state->head_commit_map_lock);
+    g_free (state->head_commits_token);
+    g_hash_table_destroy (state->token_repos);
     g_free (state);
 }
 
+static void
+on_config_changed (SeafileSession *session, const char *key,
+                   const char *value, void *vmgr)
+{
+    SeafSyncManager *mgr = vmgr;
+    int limit;
+
+    if (strcmp (key, "notify_sync") == 0) {
+        mgr->priv->notify_sync = (g_strcmp0 (value, "on") == 0);
+        return;
+    }
+
+    limit = MAX (atoi (value), 0);
+    if (strcmp (key, KEY_UPLOAD_LIMIT) == 0)
+        mgr->upload_limit = limit;
+    else if (strcmp (key, KEY_DOWNLOAD_LIMIT) == 0)
+        mgr->download_limit = limit;
+}
+
 SeafSyncManager*
 seaf_sync_manager_new (SeafileSession *seaf)
 {
@@ -156,6 +226,13 @@ seaf_sync_manager_new (SeafileSession *seaf)
     mgr->sync_interval = DEFAULT_SYNC_INTERVAL;
     mgr->sync_infos = g_hash_table_new (g_str_hash, g_str_equal);
 
+    mgr->priv->next_checks = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                    g_free, g_free);
+    mgr->priv->wakeup_repos = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                     g_free, g_free);
+    pthread_mutex_init (&mgr->priv->wakeup_lock, NULL);
+    pthread_mutex_init (&mgr->priv->timings_lock, NULL);
+
     mgr->http_server_states = g_hash_table_new_full (g_str_hash, g_str_equal,
                                                      g_free,
                                                      (GDestroyNotify)http_server_state_free);
@@ -173,6 +250,17 @@ seaf_sync_manager_new (SeafileSession *seaf)
     if (exists)
         mgr->upload_limit = upload_limit;
 
+    char *notify_setting = seafile_session_config_get_string (seaf, "notify_sync");
+    if (!notify_setting)
+        seafile_session_config_set_string (seaf, "notify_sync", "on");
+    mgr->priv->notify_sync = (!notify_setting ||
+                              g_strcmp0 (notify_setting, "on") == 0);
+    g_free (notify_setting);
+
+    seafile_session_config_watch (KEY_UPLOAD_LIMIT, on_config_changed, mgr);
+    seafile_session_config_watch (KEY_DOWNLOAD_LIMIT, on_config_changed, mgr);
+    seafile_session_config_watch ("notify_sync", on_config_changed, mgr);
+
     mgr->priv->active_paths = g_hash_table_new_full (g_str_hash, g_str_equal,
                                                      g_free,
                                                      (GDestroyNotify)active_paths_info_free);
@@ -317,6 +405,13 @@ seaf_sync_manager_start (SeafSyncManager *mgr)
     mgr->priv->check_sync_timer = seaf_timer_new (
         auto_sync_pulse, mgr, CHECK_SYNC_INTERVAL);
 
+    pthread_mutex_lock (&mgr->priv->wakeup_lock);
+    mgr->priv->wakeup_event_id = cevent_manager_register (seaf->ev_mgr,
+                                                          on_sync_wakeup,
+                                                          mgr);
+    mgr->priv->wakeup_registered = TRUE;
+    pthread_mutex_unlock (&mgr->priv->wakeup_lock);
+
     mgr->priv->update_tx_state_timer = seaf_timer_new (
         update_tx_state, mgr, UPDATE_TX_STATE_INTERVAL);
 
@@ -457,15 +552,7 @@ seaf_sync_manager_cancel_sync_task (SeafSyncManager *mgr,
 static gboolean
 need_notify_sync (SeafRepo *repo)
 {
-    char *notify_setting = seafile_session_config_get_string(seaf, "notify_sync");
-    if (notify_setting == NULL) {
-        seafile_session_config_set_string(seaf, "notify_sync", "on");
-        return TRUE;
-    }
-
-    gboolean result = (g_strcmp0(notify_setting, "on") == 0);
-    g_free (notify_setting);
-    return result;
+    return seaf->sync_mgr->priv->notify_sync;
 }
 
 static const char *sync_state_str[] = {
@@ -480,33 +567,34 @@ static const char *sync_state_str[] = {
     "cancel pending"
 };
 
-static gboolean
-find_meaningful_commit (SeafCommit *commit, void *data, gboolean *stop)
+/* The latest commit that isn't an automatic merge. */
+static SeafCommit *
+find_meaningful_commit (SeafRepo *repo)
 {
-    SeafCommit **p_head = data;
+    SeafCommitIter *iter;
+    SeafCommit *commit;
 
-    if (commit->second_parent_id && commit->new_merge && !commit->conflict)
-        return TRUE;
+    iter = seaf_commit_iter_new (seaf->commit_mgr, repo->id, repo->version,
+                                 repo->head->commit_id);
+    if (!iter)
+        return NULL;
 
-    *stop = TRUE;
-    seaf_commit_ref (commit);
-    *p_head = commit;
-    return TRUE;
+    while ((commit = seaf_commit_iter_next (iter)) != NULL) {
+        if (!(commit->second_parent_id && commit->new_merge && !commit->conflict))
+            break;
+        seaf_commit_unref (commit);
+    }
+
+    seaf_commit_iter_free (iter);
+    return commit;
 }
 
 static void
 notify_sync (SeafRepo *repo, gboolean is_multipart_upload)
 {
-    SeafCommit *head = NULL;
+    SeafCommit *head;
 
-    if (!seaf_commit_manager_traverse_commit_tree_truncated (seaf->commit_mgr,
-                                                   repo->id, repo->version,
-                                                   repo->head->commit_id,
-                                                   find_meaningful_commit,
-                                                   &head, FALSE)) {
-        seaf_warning ("Failed to traverse commit tree of %.8s.\n", repo->id);
-        return;
-    }
+    head = find_meaningful_commit (repo);
     if (!head)
         return;
 
@@ -560,6 +648,89 @@ update_sync_info_error_state (SyncTask *task, int new_state)
 
 static void commit_repo (SyncTask *task);
 
+/* Number of syncs kept in the timing history of each repo. */
+#define SYNC_TIMING_HISTORY_LEN 10
+
+typedef struct SyncTimingRecord {
+    gint64 start_time;
+    gint64 end_time;
+    int state;
+    SyncPhaseTimes times;
+} SyncTimingRecord;
+
+/* Syncs that only found nothing to transfer are not recorded. */
+static void
+record_sync_timing (SyncTask *task, int state)
+{
+    SeafSyncManagerPriv *priv = task->mgr->priv;
+    SyncInfo *info = task->info;
+    SyncTimingRecord *record;
+    char *summary;
+
+    sync_phase_timer_switch (&task->timer, SYNC_PHASE_NONE);
+
+    if (!task->tx_id)
+        return;
+
+    record = g_new0 (SyncTimingRecord, 1);
+    record->start_time = task->start_time;
+    record->end_time = (gint64)time(NULL);
+    record->state = state;
+    record->times = task->timer.times;
+
+    summary = sync_phase_times_to_string (&record->times);
+    seaf_message ("Repo '%s' sync %s after %" G_GINT64_FORMAT "s, "
+                  "wall/cpu time: %s.\n",
+                  task->repo->name, sync_state_str[state],
+                  record->end_time - record->start_time, summary);
+    g_free (summary);
+
+    pthread_mutex_lock (&priv->timings_lock);
+    if (!info->timings)
+        info->timings = g_queue_new ();
+    g_queue_push_tail (info->timings, record);
+    if (g_queue_get_length (info->timings) > SYNC_TIMING_HISTORY_LEN)
+        g_free (g_queue_pop_head (info->timings));
+    pthread_mutex_unlock (&priv->timings_lock);
+}
+
+json_t *
+seaf_sync_manager_get_sync_timings (SeafSyncManager *mgr,
+                                    const char *repo_id)
+{
+    SyncInfo *info;
+    SyncTimingRecord *record;
+    json_t *array, *object;
+    GList *ptr;
+
+    array = json_array ();
+
+    pthread_mutex_lock (&mgr->priv->timings_lock);
+
+    info = g_hash_table_lookup (mgr->sync_infos, repo_id);
+    if (!info || !info->timings)
+        goto out;
+
+    for (ptr = info->timings->tail; ptr; ptr = ptr->prev) {
+        record = ptr->data;
+
+        object = json_object ();
+        json_object_set_new (object, "start_time",
+                             json_integer (record->start_time));
+        json_object_set_new (object, "end_time",
+                             json_integer (record->end_time));
+        json_object_set_new (object, "state",
+                             json_string (sync_state_str[record->state]));
+        json_object_set_new (object, "phases",
+                             sync_phase_times_to_json (&record->times));
+        json_array_append_new (array, object);
+    }
+
+out:
+    pthread_mutex_unlock (&mgr->priv->timings_lock);
+    return array;
+}
+
 static void
 transition_sync_state (SyncTask *task, int new_state)
 {
@@ -612,6 +783,7 @@ transition_sync_state (SyncTask *task, int new_state)
             info->in_sync = FALSE;
             --(task->mgr->n_running_tasks);
             update_sync_info_error_state (task, new_state);
+            record_sync_timing (task, new_state);
 
             /* Keep previous upload progress if sync task is canceled or failed. */
             if (new_state == SYNC_STATE_DONE) {
@@ -647,6 +819,7 @@ set_task_error (SyncTask *task, int error)
         task->info->in_sync = FALSE;
         --(task->mgr->n_running_tasks);
         update_sync_info_error_state (task, SYNC_STATE_ERROR);
+        record_sync_timing (task, SYNC_STATE_ERROR);
 
         /* For repo-level errors, only need to record in database, but not send notifications.
          * File-level errors are recorded and notified in the location they happens, not here.
@@ -895,7 +1068,11 @@ update_sync_status_v2 (SyncTask *task)
         on_repo_deleted_on_server (task, repo);
     } else {
         /* If local head is the same as remote head, already in sync. */
-        if (strcmp (local->commit_id, info->head_commit) == 0) {
+        if (strcmp (local->commit_id, info->head_commit) == 0 &&
+            seaf_repo_manager_sparse_rules_changed (seaf->repo_mgr, repo->id)) {
+            /* Check out the paths the new sparse rules select. */
+            start_fetch_if_necessary (task, task->info->head_commit);
+        } else if (strcmp (local->commit_id, info->head_commit) == 0) {
             /* As long as the repo is synced with the server. All the local
              * blocks are not useful any more.
              */
@@ -922,6 +1099,8 @@ check_head_commit_done (HttpHeadCommit *result, void *user_data)
     SyncTask *task = user_data;
     SyncInfo *info = task->info;
 
+    sync_phase_timer_switch (&task->timer, SYNC_PHASE_NONE);
+
     if (!result->check_success) {
         set_task_error (task, result->error_code);
         return;
@@ -946,8 +1125,10 @@ check_head_commit_http (SyncTask *task)
                                                  repo->use_fileserver_port,
                                                  check_head_commit_done,
                                                  task);
-    if (ret == 0)
+    if (ret == 0) {
+        sync_phase_timer_switch (&task->timer, SYNC_PHASE_CHECK_HEAD);
         transition_sync_state (task, SYNC_STATE_INIT);
+    }
     else if (ret < 0)
         set_task_error (task, SYNC_ERROR_ID_NOT_ENOUGH_MEMORY);
 
@@ -958,6 +1139,7 @@ struct CommitResult {
     SyncTask *task;
     gboolean changed;
     gboolean success;
+    SyncPhaseTimer timer;
 };
 
 static void *
@@ -969,6 +1151,7 @@ commit_job (void *vtask)
     GError *error = NULL;
 
     res->task = task;
+    sync_phase_timer_init (&res->timer);
 
     if (repo->delete_pending)
         return res;
@@ -976,10 +1159,16 @@ commit_job (void *vtask)
     res->changed = TRUE;
     res->success = TRUE;
 
+    gint64 start = seaf_metrics_now ();
+    sync_phase_timer_switch (&res->timer, SYNC_PHASE_COMMIT);
     char *commit_id = seaf_repo_index_commit (repo,
                                               task->is_manual_sync,
                                               task->is_initial_commit,
                                               &error);
+    sync_phase_timer_switch (&res->timer, SYNC_PHASE_NONE);
+    seaf_metric_observe_since (seaf_metric_get (SEAF_METRIC_HISTOGRAM,
+                                                "seaf_commit_job_usec", NULL),
+                               start);
     if (commit_id == NULL && error != NULL) {
         seaf_warning ("[Sync mgr] Failed to commit to repo %s(%.8s).\n",
                       repo->name, repo->id);
@@ -1006,6 +1195,8 @@ commit_job_done (void *vres)
 
     res->task->mgr->commit_job_running = FALSE;
 
+    sync_phase_times_add (&task->timer.times, &res->timer.times);
+
     if (repo->delete_pending) {
         transition_sync_state (res->task, SYNC_STATE_CANCELED);
         seaf_repo_manager_del_repo (seaf->repo_mgr, repo);
@@ -1064,10 +1255,11 @@ commit_repo (SyncTask *task)
 
     transition_sync_state (task, SYNC_STATE_COMMIT);
 
-    if (seaf_job_manager_schedule_job (seaf->job_mgr, 
-                                       commit_job, 
-                                       commit_job_done,
-                                       task) < 0)
+    if (seaf_job_manager_schedule_class_job (seaf->job_mgr,
+                                             SEAF_JOB_COMMIT,
+                                             commit_job, 
+                                             commit_job_done,
+                                             task) < 0)
         set_task_error (task, SYNC_ERROR_ID_NOT_ENOUGH_MEMORY);
 }
 
@@ -1085,6 +1277,167 @@ check_commit_state (void *data)
     return 1;
 }
 
+/*
+ * Admission of sync tasks.
+ *
+ * Running tasks are counted by what they are doing: committing, uploading,
+ * or checking the server and downloading. Tasks that are expected or turn
+ * out to move a lot of data are heavy. Up to MAX_RUNNING_SYNC_TASKS heavy
+ * tasks always run; more are admitted, up to one per core, while the CPU,
+ * disk and network still have headroom. Light tasks, such as a few changed
+ * files in a small repo, have FAST_LANE_SLOTS of their own, so they're never
+ * queued behind large uploads and downloads.
+ */
+
+enum {
+    SYNC_WORK_COMMIT = 0,
+    SYNC_WORK_UPLOAD,
+    SYNC_WORK_DOWNLOAD,
+    N_SYNC_WORK,
+};
+
+typedef struct RunningTasks {
+    int n_light;
+    int n_heavy[N_SYNC_WORK];
+    int total_heavy;
+} RunningTasks;
+
+static int
+sync_work_of_state (int state)
+{
+    switch (state) {
+    case SYNC_STATE_COMMIT:
+        return SYNC_WORK_COMMIT;
+    case SYNC_STATE_UPLOAD:
+        return SYNC_WORK_UPLOAD;
+    default:
+        return SYNC_WORK_DOWNLOAD;
+    }
+}
+
+/* A repo whose last sync moved a lot of data probably does so again. */
+static gboolean
+expect_heavy_sync (SeafSyncManager *manager, SeafRepo *repo)
+{
+    SyncInfo *info = get_sync_info (manager, repo->id);
+    SyncTask *last = info->current_task;
+
+    if (info->multipart_upload)
+        return TRUE;
+
+    return (last && (last->large_transfer || last->is_initial_commit));
+}
+
+static void
+update_task_weight (SyncTask *task)
+{
+    HttpTxTask *tx_task;
+
+    if (task->large_transfer || !task->tx_id)
+        return;
+
+    tx_task = http_tx_manager_find_task (seaf->http_tx_mgr, task->repo->id);
+    if (!tx_task)
+        return;
+
+    if (tx_task->n_blocks > FAST_LANE_MAX_BLOCKS ||
+        tx_task->total_download > FAST_LANE_MAX_BYTES) {
+        task->large_transfer = TRUE;
+        task->heavy = TRUE;
+    }
+}
+
+static void
+count_running_tasks (SeafSyncManager *manager, RunningTasks *running)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    SyncInfo *info;
+    SyncTask *task;
+
+    memset (running, 0, sizeof(RunningTasks));
+
+    g_hash_table_iter_init (&iter, manager->sync_infos);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        info = value;
+        task = info->current_task;
+        if (!info->in_sync || !task)
+            continue;
+
+        update_task_weight (task);
+        if (task->heavy) {
+            ++(running->n_heavy[sync_work_of_state (task->state)]);
+            ++(running->total_heavy);
+        } else {
+            ++(running->n_light);
+        }
+    }
+}
+
+static gboolean
+network_has_headroom (gint limit, gint last_bytes)
+{
+    /* Without a limit there's nothing to measure against. */
+    return (limit <= 0 || last_bytes < limit / 10 * 8);
+}
+
+static gboolean
+cpu_has_headroom (int cores)
+{
+#ifndef WIN32
+    double load;
+
+    if (getloadavg (&load, 1) == 1 && load > cores * 0.75)
+        return FALSE;
+#endif
+    return TRUE;
+}
+
+static gboolean
+has_headroom (SeafSyncManager *manager, RunningTasks *running, int work)
+{
+    int cores = seaf_util_get_num_cores ();
+
+    if (running->total_heavy >= MIN (cores, MAX_RUNNING_SYNC_TASKS_LIMIT))
+        return FALSE;
+
+    switch (work) {
+    case SYNC_WORK_COMMIT:
+        /* Indexing and checkout read and write the whole disk. */
+        return (cpu_has_headroom (cores) &&
+                running->n_heavy[SYNC_WORK_COMMIT] +
+                running->n_heavy[SYNC_WORK_DOWNLOAD] < MAX (cores / 2, 1));
+    case SYNC_WORK_UPLOAD:
+        return network_has_headroom (seaf_transfer_policy_get_upload_limit (),
+                                     manager->last_sent_bytes);
+    default:
+        return (network_has_headroom (seaf_transfer_policy_get_download_limit (),
+                                      manager->last_recv_bytes) &&
+                running->n_heavy[SYNC_WORK_COMMIT] +
+                running->n_heavy[SYNC_WORK_DOWNLOAD] < MAX (cores / 2, 1));
+    }
+}
+
+static gboolean
+admit_sync_task (SeafSyncManager *manager, int work, gboolean heavy)
+{
+    RunningTasks running;
+
+    /* Large transfers wait for mains power or an unmetered network. */
+    if (heavy && work != SYNC_WORK_COMMIT && seaf_transfer_policy_defer_heavy ())
+        return FALSE;
+
+    count_running_tasks (manager, &running);
+
+    if (!heavy && running.n_light < FAST_LANE_SLOTS)
+        return TRUE;
+
+    if (running.n_light + running.total_heavy < MAX_RUNNING_SYNC_TASKS)
+        return TRUE;
+
+    return (heavy && has_headroom (manager, &running, work));
+}
+
 static SyncTask *
 create_sync_task_v2 (SeafSyncManager *manager, SeafRepo *repo,
                      gboolean is_manual_sync, gboolean is_initial_commit)
@@ -1102,10 +1455,14 @@ create_sync_task_v2 (SeafSyncManager *manager, SeafRepo *repo,
     task->is_manual_sync = is_manual_sync;
     task->is_initial_commit = is_initial_commit;
     task->error = SYNC_ERROR_ID_NO_ERROR;
+    task->start_time = (gint64)time(NULL);
+    sync_phase_timer_init (&task->timer);
 
     repo->last_sync_time = time(NULL);
     ++(manager->n_running_tasks);
 
+    task->heavy = is_initial_commit || expect_heavy_sync (manager, repo);
+
     /* Free the last task when a new task is started.
      * This way we can always get the state of the last task even
      * after it's done.
@@ -1136,49 +1493,74 @@ create_commit_from_event_queue (SeafSyncManager *manager, SeafRepo *repo,
     gboolean ret = FALSE;
     gint now = (gint)time(NULL);
     gint last_changed;
+    gboolean need_commit = FALSE;
+    gboolean initial_commit, set_last_check = FALSE;
+    gboolean heavy;
 
     status = seaf_wt_monitor_get_worktree_status (manager->seaf->wt_monitor,
                                                   repo->id);
-    if (status) {
-        last_changed = g_atomic_int_get (&status->last_changed);
-        if (status->last_check == 0) {
-            /* Force commit and sync after a new repo is added. */
-            task = create_sync_task_v2 (manager, repo, is_manual_sync, TRUE);
-            repo->create_partial_commit = TRUE;
-            commit_repo (task);
-            status->last_check = now;
-            ret = TRUE;
-        } else if (status->partial_commit) {
-            task = create_sync_task_v2 (manager, repo, is_manual_sync, FALSE);
-            repo->create_partial_commit = TRUE;
-            commit_repo (task);
-            ret = TRUE;
-        } else if (last_changed != 0 && status->last_check <= last_changed) {
-            /* Commit and sync if the repo has been updated after the
-             * last check and is not updated for the last 2 seconds.
-             */
-            if (now - last_changed >= 2) {
-                task = create_sync_task_v2 (manager, repo, is_manual_sync, FALSE);
-                repo->create_partial_commit = TRUE;
-                commit_repo (task);
-                status->last_check = now;
-                ret = TRUE;
-            }
+    if (!status)
+        return FALSE;
+
+    last_changed = g_atomic_int_get (&status->last_changed);
+    initial_commit = (status->last_check == 0);
+    if (initial_commit) {
+        /* Force commit and sync after a new repo is added. */
+        need_commit = TRUE;
+        set_last_check = TRUE;
+    } else if (status->partial_commit) {
+        need_commit = TRUE;
+    } else if (last_changed != 0 && status->last_check <= last_changed) {
+        /* Commit and sync if the repo has been updated after the
+         * last check and is not updated for the last 2 seconds.
+         */
+        if (now - last_changed >= 2) {
+            need_commit = TRUE;
+            set_last_check = TRUE;
         }
-        wt_status_unref (status);
     }
 
+    if (!need_commit)
+        goto out;
+
+    heavy = (initial_commit || status->partial_commit ||
+             expect_heavy_sync (manager, repo));
+    if (!heavy) {
+        pthread_mutex_lock (&status->q_lock);
+        heavy = (g_queue_get_length (status->event_q) > FAST_LANE_MAX_EVENTS);
+        pthread_mutex_unlock (&status->q_lock);
+    }
+
+    /* Leave the changes in the queue until there is room for the commit,
+     * rather than starting a server check that would hold up the commit.
+     */
+    ret = TRUE;
+    if (!is_manual_sync && !admit_sync_task (manager, SYNC_WORK_COMMIT, heavy))
+        goto out;
+
+    task = create_sync_task_v2 (manager, repo, is_manual_sync, initial_commit);
+    task->heavy = heavy;
+    repo->create_partial_commit = TRUE;
+    commit_repo (task);
+    if (set_last_check)
+        status->last_check = now;
+
+out:
+    wt_status_unref (status);
     return ret;
 }
 
 static gboolean
-can_schedule_repo (SeafSyncManager *manager, SeafRepo *repo)
+can_schedule_repo (SeafSyncManager *manager, SeafRepo *repo,
+                   int work, gboolean heavy)
 {
     int now = (int)time(NULL);
 
-    return ((repo->last_sync_time == 0 ||
-             repo->last_sync_time < now - manager->sync_interval) &&
-            manager->n_running_tasks < MAX_RUNNING_SYNC_TASKS);
+    if (repo->last_sync_time != 0 &&
+        repo->last_sync_time >= now - manager->sync_interval)
+        return FALSE;
+
+    return admit_sync_task (manager, work, heavy);
 }
 
 static gboolean
@@ -1422,6 +1804,12 @@ sync_repo_v2 (SeafSyncManager *manager, SeafRepo *repo, gboolean is_manual_sync)
     char *last_download = NULL;
     SyncInfo *info = NULL;
 
+    /* The repo is synced on a later pulse, after the GC has stopped. */
+    if (seaf_block_gc_stop (repo->id))
+        return 0;
+    if (seaf_scrubber_stop (repo->id))
+        return 0;
+
     master = seaf_branch_manager_get_branch (seaf->branch_mgr, repo->id, "master");
     if (!master) {
         seaf_warning ("No master branch found for repo %s(%.8s).\n",
@@ -1442,8 +1830,11 @@ sync_repo_v2 (SeafSyncManager *manager, SeafRepo *repo, gboolean is_manual_sync)
                                                          repo->id,
                                                          REPO_PROP_DOWNLOAD_HEAD);
     if (last_download && strcmp (last_download, EMPTY_SHA1) != 0) {
-        if (is_manual_sync || can_schedule_repo (manager, repo)) {
+        /* Interrupted downloads are usually big ones. */
+        if (is_manual_sync ||
+            can_schedule_repo (manager, repo, SYNC_WORK_DOWNLOAD, TRUE)) {
             task = create_sync_task_v2 (manager, repo, is_manual_sync, FALSE);
+            task->heavy = TRUE;
             start_fetch_if_necessary (task, last_download);
         }
         goto out;
@@ -1452,7 +1843,9 @@ sync_repo_v2 (SeafSyncManager *manager, SeafRepo *repo, gboolean is_manual_sync)
     info = get_sync_info (manager, repo->id);
 
     if (strcmp (master->commit_id, local->commit_id) != 0) {
-        if (is_manual_sync || can_schedule_repo (manager, repo) || info->del_confirmation_pending) {
+        if (is_manual_sync || info->del_confirmation_pending ||
+            can_schedule_repo (manager, repo, SYNC_WORK_UPLOAD,
+                               expect_heavy_sync (manager, repo))) {
             task = create_sync_task_v2 (manager, repo, is_manual_sync, FALSE);
             if (!task->info->del_confirmation_pending) {
                 char *desc = NULL;
@@ -1497,7 +1890,9 @@ sync_repo_v2 (SeafSyncManager *manager, SeafRepo *repo, gboolean is_manual_sync)
     } else if (create_commit_from_event_queue (manager, repo, is_manual_sync))
         goto out;
 
-    if (is_manual_sync || can_schedule_repo (manager, repo)) {
+    if (is_manual_sync ||
+        can_schedule_repo (manager, repo, SYNC_WORK_DOWNLOAD,
+                           expect_heavy_sync (manager, repo))) {
         /* If file syncing protocol version is higher than 2, we check for all head commit ids
          * for synced repos regularly.
          */
@@ -1542,6 +1937,7 @@ seaf_sync_manager_update_repo (SeafSyncManager *manager, SeafRepo *repo,
         // Set last_sync_time to 0 to allow the repo to be sync immediately.
         // Otherwise it only gets synced after 30 seconds since the last sync.
         repo->last_sync_time = 0;
+        seaf_sync_manager_wake_repo (manager, repo->id, 0);
     }
 
     seaf_branch_unref (master);
@@ -1563,6 +1959,7 @@ seaf_sync_manager_check_locks_and_folder_perms (SeafSyncManager *manager, const
 
     state->immediate_check_folder_perms = TRUE;
     state->immediate_check_locked_files = TRUE;
+    seaf_sync_manager_wake_all (manager);
 
     return;
 }
@@ -1591,86 +1988,14 @@ auto_delete_repo (SeafSyncManager *manager, SeafRepo *repo)
     g_free (name);
 }
 
-static char *
-http_fileserver_url (const char *url)
-{
-    const char *host;
-    char *colon;
-    char *url_no_port;
-    char *ret = NULL;
-
-    /* Just return the url itself if it's invalid. */
-    if (strlen(url) <= strlen("http://"))
-        return g_strdup(url);
-
-    /* Skip protocol schem. */
-    host = url + strlen("http://");
-
-    colon = strrchr (host, ':');
-    if (colon) {
-        url_no_port = g_strndup(url, colon - url);
-        ret = g_strconcat(url_no_port, ":8082", NULL);
-        g_free (url_no_port);
-    } else {
-        ret = g_strconcat(url, ":8082", NULL);
-    }
-
-    return ret;
-}
-
-static void
-check_http_fileserver_protocol_done (HttpProtocolVersion *result, void *user_data)
-{
-    HttpServerState *state = user_data;
-
-    state->checking = FALSE;
-
-    if (result->check_success && !result->not_supported) {
-        state->http_version = MIN(result->version, CURRENT_SYNC_PROTO_VERSION);
-        state->effective_host = http_fileserver_url(state->testing_host);
-        state->use_fileserver_port = TRUE;
-        seaf_message ("File syncing protocol version on server %s is %d. "
-                      "Client file syncing protocol version is %d. Use version %d.\n",
-                      state->effective_host, result->version, CURRENT_SYNC_PROTO_VERSION,
-                      state->http_version);
-    }
-}
-
-static void
-check_http_protocol_done (HttpProtocolVersion *result, void *user_data)
-{
-    HttpServerState *state = user_data;
-
-    if (result->check_success && !result->not_supported) {
-        state->http_version = MIN(result->version, CURRENT_SYNC_PROTO_VERSION);
-        state->effective_host = g_strdup(state->testing_host);
-        state->checking = FALSE;
-        seaf_message ("File syncing protocol version on server %s is %d. "
-                      "Client file syncing protocol version is %d. Use version %d.\n",
-                      state->effective_host, result->version, CURRENT_SYNC_PROTO_VERSION,
-                      state->http_version);
-    } else if (strncmp(state->testing_host, "https", 5) != 0) {
-        char *host_fileserver = http_fileserver_url(state->testing_host);
-        if (http_tx_manager_check_protocol_version (seaf->http_tx_mgr,
-                                                    host_fileserver,
-                                                    TRUE,
-                                                    check_http_fileserver_protocol_done,
-                                                    state) < 0)
-            state->checking = FALSE;
-        g_free (host_fileserver);
-    } else {
-        state->checking = FALSE;
-    }
-}
-
-#define CHECK_HTTP_INTERVAL 10
-
 /*
  * Returns TRUE if we're ready to use http-sync; otherwise FALSE.
  */
 static gboolean
 check_http_protocol (SeafSyncManager *mgr, SeafRepo *repo)
 {
+    ServerCaps caps;
+
     /* If a repo was cloned before 4.0, server-url is not set. */
     if (!repo->server_url)
         return FALSE;
@@ -1683,122 +2008,38 @@ check_http_protocol (SeafSyncManager *mgr, SeafRepo *repo)
                              g_strdup(repo->server_url), state);
     }
 
-    if (state->checking) {
-        return FALSE;
-    }
-
-    if (state->http_version > 0) {
-        if (!repo->effective_host) {
-            repo->effective_host = g_strdup(state->effective_host);
-            repo->use_fileserver_port = state->use_fileserver_port;
-        }
-        return TRUE;
-    }
-
-    /* If we haven't detected the server url successfully, retry every 10 seconds. */
-    gint64 now = time(NULL);
-    if (now - state->last_http_check_time < CHECK_HTTP_INTERVAL)
-        return FALSE;
-
-    /* First try repo->server_url.
-     * If it fails and https is not used, try server_url:8082 instead.
-     */
-    g_free (state->testing_host);
-    state->testing_host = g_strdup(repo->server_url);
-
-    state->last_http_check_time = (gint64)time(NULL);
-
-    if (http_tx_manager_check_protocol_version (seaf->http_tx_mgr,
-                                                repo->server_url,
-                                                FALSE,
-                                                check_http_protocol_done,
-                                                state) < 0)
-        return FALSE;
+    if (!seaf_server_caps_get (repo->server_url, &caps))
+        return (state->http_version > 0);
 
-    state->checking = TRUE;
-
-    return FALSE;
-}
-
-static void
-check_notif_server_done (gboolean is_alive, void *user_data)
-{
-    HttpServerState *state = user_data;
-    
-    if (is_alive) {
-        state->notif_server_alive = TRUE;
+    state->http_version = MIN(caps.protocol_version, CURRENT_SYNC_PROTO_VERSION);
+    state->head_commits_delta = caps.head_commits_delta;
+    /* The head commit polling thread reads the host, so it's set once. */
+    if (!state->effective_host) {
+        state->effective_host = caps.effective_url;
+        state->use_fileserver_port = caps.use_fileserver_port;
+    } else {
+        g_free (caps.effective_url);
     }
-}
-
-static char *
-http_notification_url (const char *url)
-{
-    const char *host;
-    char *colon;
-    char *url_no_port;
-    char *ret = NULL;
 
-    /* Just return the url itself if it's invalid. */
-    if (strlen(url) <= strlen("http://"))
-        return g_strdup(url);
-
-    /* Skip protocol schem. */
-    host = url + strlen("http://");
-
-    colon = strrchr (host, ':');
-    if (colon) {
-        url_no_port = g_strndup(url, colon - url);
-        ret = g_strconcat(url_no_port, ":8083", NULL);
-        g_free (url_no_port);
-    } else {
-        ret = g_strconcat(url, ":8083", NULL);
+    if (!repo->effective_host) {
+        repo->effective_host = g_strdup(state->effective_host);
+        repo->use_fileserver_port = state->use_fileserver_port;
     }
 
-    return ret;
+    return TRUE;
 }
 
 // Returns TRUE if notification server is alive; otherwise FALSE.
-// We only check notification server once.
 static gboolean
 check_notif_server (SeafSyncManager *mgr, SeafRepo *repo)
 {
     if (!repo->server_url)
         return FALSE;
 
-    HttpServerState *state = g_hash_table_lookup (mgr->http_server_states,
-                                                  repo->server_url);
-    if (!state) {
-        return FALSE;
-    }
-
-    if (state->notif_server_alive) {
-        return TRUE;
-    }
-
-    if (state->notif_server_checked) {
-        return FALSE;
-    }
-
-    char *notif_url = NULL;
-    if (state->use_fileserver_port) {
-        notif_url = http_notification_url (repo->server_url);
-    } else {
-        notif_url = g_strdup (repo->server_url);
-    }
-
-    if (http_tx_manager_check_notif_server (seaf->http_tx_mgr,
-                                            notif_url,
-                                            state->use_fileserver_port,
-                                            check_notif_server_done,
-                                            state) < 0) {
-        g_free (notif_url);
+    if (!g_hash_table_lookup (mgr->http_server_states, repo->server_url))
         return FALSE;
-    }
-
-    state->notif_server_checked = TRUE;
 
-    g_free (notif_url);
-    return FALSE;
+    return seaf_server_caps_notif_alive (repo->server_url);
 }
 
 gint
@@ -1983,8 +2224,8 @@ check_locked_files (void *vdata)
     gpointer key, value;
     char *path;
     LockedFile *locked;
-    char index_path[SEAF_PATH_MAX];
     struct index_state istate;
+    int rc;
 
     fset = seaf_repo_manager_get_locked_file_set (seaf->repo_mgr, repo->id);
 
@@ -1993,10 +2234,13 @@ check_locked_files (void *vdata)
         return vdata;
     }
 
+    /* A commit or checkout of the repo is running, try again next time. */
     memset (&istate, 0, sizeof(istate));
-    snprintf (index_path, SEAF_PATH_MAX, "%s/%s", repo->manager->index_dir, repo->id);
-    if (read_index_from (&istate, index_path, repo->version) < 0) {
-        seaf_warning ("Failed to load index.\n");
+    rc = seaf_index_cache_try_load (repo->id, repo->version, &istate);
+    if (rc != 0) {
+        if (rc < 0)
+            seaf_warning ("Failed to load index.\n");
+        locked_file_set_free (fset);
         return vdata;
     }
 
@@ -2016,7 +2260,7 @@ check_locked_files (void *vdata)
             g_hash_table_iter_remove (&iter);
     }
 
-    discard_index (&istate);
+    seaf_index_cache_release (repo->id, &istate);
     locked_file_set_free (fset);
 
     return vdata;
@@ -2152,6 +2396,17 @@ check_folder_permissions_one_server (SeafSyncManager *mgr,
         server_state->checking_folder_perms)
         return;
 
+    /* Only changes since the timestamp of each repo are returned, so
+     * catching up with missed events is cheap.
+     */
+    if (server_state->immediate_check_folder_perms ||
+        now - server_state->last_full_check_perms_time >= CHECK_PUSHED_STATE_INTERVAL) {
+        server_state->immediate_check_folder_perms = FALSE;
+        server_state->last_full_check_perms_time = now;
+        check_folder_permissions_one_server_immediately (mgr, host, server_state, repos, TRUE);
+        return;
+    }
+
     if (server_state->last_check_perms_time > 0 &&
         now - server_state->last_check_perms_time < CHECK_FOLDER_PERMS_INTERVAL)
         return;
@@ -2294,6 +2549,14 @@ check_locked_files_one_server (SeafSyncManager *mgr,
         server_state->checking_locked_files)
         return;
 
+    if (server_state->immediate_check_locked_files ||
+        now - server_state->last_full_check_locked_files_time >= CHECK_PUSHED_STATE_INTERVAL) {
+        server_state->immediate_check_locked_files = FALSE;
+        server_state->last_full_check_locked_files_time = now;
+        check_locked_files_one_server_immediately (mgr, host, server_state, repos, TRUE);
+        return;
+    }
+
     if (server_state->last_check_locked_files_time > 0 &&
         now - server_state->last_check_locked_files_time < CHECK_FOLDER_PERMS_INTERVAL)
         return;
@@ -2403,174 +2666,421 @@ periodic_sync_due (SeafRepo *repo)
     return (now > (repo->last_sync_time + repo->sync_interval));
 }
 
-static int
-auto_sync_pulse (void *vmanager)
-{
-    SeafSyncManager *manager = vmanager;
-    GList *repos, *ptr;
-    SeafRepo *repo;
-    char *url = NULL;
+/* Connections to the server are opened this long before a repo is due to
+ * be synced.
+ */
+#define WARM_UP_LEAD_TIME 5
 
-    repos = seaf_repo_manager_get_repo_list (manager->seaf->repo_mgr, -1, -1);
+static gboolean
+sync_due_soon (SeafSyncManager *manager, SeafRepo *repo)
+{
+    int now = (int)time(NULL);
+    int interval, due;
 
-    check_folder_permissions (manager, repos);
+    if (repo->last_sync_time == 0)
+        return FALSE;
 
-    check_server_locked_files (manager, repos);
+    interval = (repo->sync_interval > 0) ? repo->sync_interval : manager->sync_interval;
+    due = repo->last_sync_time + interval;
 
-    /* Sort repos by last_sync_time, so that we don't "starve" any repo. */
-    repos = g_list_sort_with_data (repos, cmp_repos_by_sync_time, NULL);
+    return (now < due && now >= due - WARM_UP_LEAD_TIME);
+}
 
-    for (ptr = repos; ptr != NULL; ptr = ptr->next) {
-        repo = ptr->data;
+/* Look at one repo and start whatever it needs: a commit, a sync or
+ * a server check. Returns FALSE if the repo has been deleted.
+ */
+static gboolean
+check_repo_sync (SeafSyncManager *manager, SeafRepo *repo)
+{
+    char *url = NULL;
 
-        if (!manager->priv->auto_sync_enabled || !repo->auto_sync)
-            continue;
+    if (!manager->priv->auto_sync_enabled || !repo->auto_sync)
+        return TRUE;
 
-        /* Every second, we'll check the worktree to see if it still exists.
-         * We'll invalidate worktree if it gets moved or deleted.
-         * But there is a hole here: If the user delete the worktree dir and
-         * recreate a dir with the same name within a second, we'll falsely
-         * see the worktree as valid. What's worse, the new worktree dir won't
-         * be monitored.
-         * This problem can only be solved by restart.
-         */
-        /* If repo has been checked out and the worktree doesn't exist,
-         * we'll delete the repo automatically.
-         */
+    /* Every time a repo is checked, we'll check the worktree to see if it still exists.
+     * We'll invalidate worktree if it gets moved or deleted.
+     * But there is a hole here: If the user delete the worktree dir and
+     * recreate a dir with the same name within a second, we'll falsely
+     * see the worktree as valid. What's worse, the new worktree dir won't
+     * be monitored.
+     * This problem can only be solved by restart.
+     */
+    /* If repo has been checked out and the worktree doesn't exist,
+     * we'll delete the repo automatically.
+     */
 
-        if (repo->head != NULL) {
-            if (seaf_repo_check_worktree (repo) < 0) {
-                if (!repo->worktree_invalid) {
-                    // The repo worktree was valid, but now it's invalid
-                    seaf_repo_manager_invalidate_repo_worktree (seaf->repo_mgr, repo);
-                    if (!seafile_session_config_get_allow_invalid_worktree(seaf)) {
-                        auto_delete_repo (manager, repo);
-                    }
-                }
-                continue;
-            } else {
-                if (repo->worktree_invalid) {
-                    // The repo worktree was invalid, but now it's valid again,
-                    // so we start watch it
-                    seaf_repo_manager_validate_repo_worktree (seaf->repo_mgr, repo);
-                    continue;
+    if (repo->head != NULL) {
+        if (seaf_repo_check_worktree (repo) < 0) {
+            if (!repo->worktree_invalid) {
+                // The repo worktree was valid, but now it's invalid
+                seaf_repo_manager_invalidate_repo_worktree (seaf->repo_mgr, repo);
+                if (!seafile_session_config_get_allow_invalid_worktree(seaf)) {
+                    auto_delete_repo (manager, repo);
+                    return FALSE;
                 }
             }
+            return TRUE;
+        } else {
+            if (repo->worktree_invalid) {
+                // The repo worktree was invalid, but now it's valid again,
+                // so we start watch it
+                seaf_repo_manager_validate_repo_worktree (seaf->repo_mgr, repo);
+                return TRUE;
+            }
         }
+    }
 
-        repo->worktree_invalid = FALSE;
+    repo->worktree_invalid = FALSE;
 
 #ifdef USE_GPL_CRYPTO
-        if (repo->version == 0 || (repo->encrypted && repo->enc_version < 2)) {
-            continue;
-        }
+    if (repo->version == 0 || (repo->encrypted && repo->enc_version < 2)) {
+        return TRUE;
+    }
 #endif
 
-        if (!repo->token) {
-            /* If the user has logged out of the account, the repo token would
-             * be null */
-            seaf_debug ("repo token of %s (%.8s) is null, would not sync it\n", repo->name, repo->id);
-            continue;
-        }
+    if (!repo->token) {
+        /* If the user has logged out of the account, the repo token would
+         * be null */
+        seaf_debug ("repo token of %s (%.8s) is null, would not sync it\n", repo->name, repo->id);
+        return TRUE;
+    }
 
-        /* Don't sync repos not checked out yet. */
-        if (!repo->head)
-            continue;
+    /* Don't sync repos not checked out yet. */
+    if (!repo->head)
+        return TRUE;
 
-        gint64 now = (gint64)time(NULL);
+    gint64 now = (gint64)time(NULL);
 
 #if defined WIN32 || defined __APPLE__
-        if (repo->version > 0) {
-            if (repo->checking_locked_files)
-                continue;
-
-            if (repo->last_check_locked_time == 0 ||
-                now - repo->last_check_locked_time >= CHECK_LOCKED_FILES_INTERVAL)
-            {
-                repo->checking_locked_files = TRUE;
-                if (seaf_job_manager_schedule_job (seaf->job_mgr,
-                                                   check_locked_files,
-                                                   check_locked_files_done,
-                                                   repo) < 0) {
-                    seaf_warning ("Failed to schedule check local locked files\n");
-                    repo->checking_locked_files = FALSE;
-                } else {
-                    repo->last_check_locked_time = now;
-                }
-
+    if (repo->version > 0) {
+        if (repo->checking_locked_files)
+            return TRUE;
+
+        if (repo->last_check_locked_time == 0 ||
+            now - repo->last_check_locked_time >= CHECK_LOCKED_FILES_INTERVAL)
+        {
+            repo->checking_locked_files = TRUE;
+            if (seaf_job_manager_schedule_job (seaf->job_mgr,
+                                               check_locked_files,
+                                               check_locked_files_done,
+                                               repo) < 0) {
+                seaf_warning ("Failed to schedule check local locked files\n");
+                repo->checking_locked_files = FALSE;
+            } else {
+                repo->last_check_locked_time = now;
             }
+
         }
+    }
 #endif
 
-        SyncInfo *info = get_sync_info (manager, repo->id);
+    SyncInfo *info = get_sync_info (manager, repo->id);
 
-        if (info->in_sync)
-            continue;
+    if (info->in_sync)
+        return TRUE;
 
-        if (info->sync_perm_err_cnt > SYNC_PERM_ERROR_RETRY_TIME)
-            continue;
+    if (info->sync_perm_err_cnt > SYNC_PERM_ERROR_RETRY_TIME)
+        return TRUE;
 
-        if (repo->version > 0) {
-            /* For repo version > 0, only use http sync. */
-            if (check_http_protocol (manager, repo)) {
-                if (check_notif_server (manager, repo)) {
-                    seaf_notif_manager_connect_server (seaf->notif_mgr, repo->server_url, repo->use_fileserver_port);
-                }
+    if (repo->version > 0) {
+        /* For repo version > 0, only use http sync. */
+        if (check_http_protocol (manager, repo)) {
+            if (check_notif_server (manager, repo)) {
+                seaf_notif_manager_connect_server (seaf->notif_mgr, repo->server_url, repo->use_fileserver_port);
+            }
 
-                if (repo->sync_interval == 0) {
-                    sync_repo_v2 (manager, repo, FALSE);
-                    if (now - repo->last_check_jwt_token > JWT_TOKEN_EXPIRE_TIME) {
-                        repo->last_check_jwt_token = now;
-                        if (!repo->use_fileserver_port)
-                            url = g_strdup_printf ("%s/seafhttp/repo/%s/jwt-token", repo->effective_host, repo->id);
-                        else
-                            url = g_strdup_printf ("%s/repo/%s/jwt-token", repo->effective_host, repo->id);
-
-                        http_tx_manager_fileserver_api_get (seaf->http_tx_mgr,
-                                                            repo->effective_host,
-                                                            url,
-                                                            repo->token,
-                                                            fileserver_get_jwt_token_cb,
-                                                            repo->id);
-                        g_free (url);
-                        continue;
-                    }
-                    if (!seaf_notif_manager_is_repo_subscribed (seaf->notif_mgr, repo)) {
-                        if (repo->jwt_token)
-                            seaf_notif_manager_subscribe_repo (seaf->notif_mgr, repo);
-                    }
+            if (sync_due_soon (manager, repo))
+                http_tx_manager_warm_up_host (seaf->http_tx_mgr,
+                                              repo->effective_host,
+                                              repo->use_fileserver_port);
+
+            if (repo->sync_interval == 0) {
+                sync_repo_v2 (manager, repo, FALSE);
+                if (now - repo->last_check_jwt_token > JWT_TOKEN_EXPIRE_TIME) {
+                    repo->last_check_jwt_token = now;
+                    if (!repo->use_fileserver_port)
+                        url = g_strdup_printf ("%s/seafhttp/repo/%s/jwt-token", repo->effective_host, repo->id);
+                    else
+                        url = g_strdup_printf ("%s/repo/%s/jwt-token", repo->effective_host, repo->id);
+
+                    http_tx_manager_fileserver_api_get (seaf->http_tx_mgr,
+                                                        repo->effective_host,
+                                                        url,
+                                                        repo->token,
+                                                        fileserver_get_jwt_token_cb,
+                                                        repo->id);
+                    g_free (url);
+                    return TRUE;
                 }
-                else if (periodic_sync_due (repo)) {
-                    sync_repo_v2 (manager, repo, TRUE);
-                    if (now - repo->last_check_jwt_token > JWT_TOKEN_EXPIRE_TIME) {
-                        repo->last_check_jwt_token = now;
-                        if (!repo->use_fileserver_port)
-                            url = g_strdup_printf ("%s/seafhttp/repo/%s/jwt-token", repo->effective_host, repo->id);
-                        else
-                            url = g_strdup_printf ("%s/repo/%s/jwt-token", repo->effective_host, repo->id);
-
-                        http_tx_manager_fileserver_api_get (seaf->http_tx_mgr,
-                                                            repo->effective_host,
-                                                            url,
-                                                            repo->token,
-                                                            fileserver_get_jwt_token_cb,
-                                                            repo->id);
-                        g_free (url);
-                        continue;
-                    }
-                    if (!seaf_notif_manager_is_repo_subscribed (seaf->notif_mgr, repo)) {
-                        if (repo->jwt_token)
-                            seaf_notif_manager_subscribe_repo (seaf->notif_mgr, repo);
-                    }
+                if (!seaf_notif_manager_is_repo_subscribed (seaf->notif_mgr, repo)) {
+                    if (repo->jwt_token)
+                        seaf_notif_manager_subscribe_repo (seaf->notif_mgr, repo);
+                }
+            }
+            else if (periodic_sync_due (repo)) {
+                sync_repo_v2 (manager, repo, TRUE);
+                if (now - repo->last_check_jwt_token > JWT_TOKEN_EXPIRE_TIME) {
+                    repo->last_check_jwt_token = now;
+                    if (!repo->use_fileserver_port)
+                        url = g_strdup_printf ("%s/seafhttp/repo/%s/jwt-token", repo->effective_host, repo->id);
+                    else
+                        url = g_strdup_printf ("%s/repo/%s/jwt-token", repo->effective_host, repo->id);
+
+                    http_tx_manager_fileserver_api_get (seaf->http_tx_mgr,
+                                                        repo->effective_host,
+                                                        url,
+                                                        repo->token,
+                                                        fileserver_get_jwt_token_cb,
+                                                        repo->id);
+                    g_free (url);
+                    return TRUE;
+                }
+                if (!seaf_notif_manager_is_repo_subscribed (seaf->notif_mgr, repo)) {
+                    if (repo->jwt_token)
+                        seaf_notif_manager_subscribe_repo (seaf->notif_mgr, repo);
                 }
             }
-        } else {
-            seaf_warning ("Repo %s(%s) is version 0 library. Syncing is no longer supported.\n",
-                          repo->name, repo->id);
         }
+    } else {
+        seaf_warning ("Repo %s(%s) is version 0 library. Syncing is no longer supported.\n",
+                      repo->name, repo->id);
+    }
+
+    return TRUE;
+}
+
+/* Repos are only looked at when they may have something to do: when their
+ * sync interval is up, when their worktree changed, when the server
+ * reported a new head commit, or after MAX_IDLE_CHECK_INTERVAL at the
+ * latest. The pulse timer sleeps until the earliest of these.
+ */
+#define MAX_IDLE_CHECK_INTERVAL 30
+
+static gint64
+next_check_time (SeafSyncManager *manager, SeafRepo *repo, gint64 now)
+{
+    SyncInfo *info = get_sync_info (manager, repo->id);
+    WTStatus *status;
+    gint64 next = now + MAX_IDLE_CHECK_INTERVAL;
+    gint64 due;
+    int interval;
+    gint last_changed;
+
+    /* The state of running syncs is followed every second, as before. */
+    if (info->in_sync || repo->last_sync_time == 0)
+        return now + 1;
+
+    interval = (repo->sync_interval > 0) ? repo->sync_interval : manager->sync_interval;
+    due = repo->last_sync_time + interval + 1;
+    next = MIN (next, due);
+    if (due - 1 - WARM_UP_LEAD_TIME > now)
+        next = MIN (next, due - 1 - WARM_UP_LEAD_TIME);
+
+    status = seaf_wt_monitor_get_worktree_status (manager->seaf->wt_monitor,
+                                                  repo->id);
+    if (status) {
+        last_changed = g_atomic_int_get (&status->last_changed);
+        if (status->partial_commit)
+            next = now + 1;
+        else if (last_changed != 0 && status->last_check <= last_changed)
+            next = MIN (next, last_changed + 2);
+        wt_status_unref (status);
     }
 
+#if defined WIN32 || defined __APPLE__
+    if (repo->version > 0)
+        next = MIN (next, repo->last_check_locked_time + CHECK_LOCKED_FILES_INTERVAL);
+#endif
+
+    return MAX (next, now + 1);
+}
+
+static gboolean
+repo_check_due (SeafSyncManager *manager, const char *repo_id, gint64 now)
+{
+    gint64 *next = g_hash_table_lookup (manager->priv->next_checks, repo_id);
+
+    return (!next || *next <= now);
+}
+
+static void
+set_next_check (SeafSyncManager *manager, const char *repo_id, gint64 next)
+{
+    gint64 *pnext = g_new (gint64, 1);
+
+    *pnext = next;
+    g_hash_table_replace (manager->priv->next_checks, g_strdup(repo_id), pnext);
+}
+
+/* Move the wakeups requested from other threads into next_checks. */
+static void
+apply_wakeups (SeafSyncManager *manager)
+{
+    SeafSyncManagerPriv *priv = manager->priv;
+    GHashTableIter iter;
+    gpointer key, value;
+    gint64 *next, *due;
+
+    pthread_mutex_lock (&priv->wakeup_lock);
+
+    if (priv->wakeup_all) {
+        g_hash_table_remove_all (priv->next_checks);
+        priv->wakeup_all = FALSE;
+    }
+
+    g_hash_table_iter_init (&iter, priv->wakeup_repos);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        due = value;
+        next = g_hash_table_lookup (priv->next_checks, key);
+        if (next && *due < *next)
+            *next = *due;
+    }
+    g_hash_table_remove_all (priv->wakeup_repos);
+
+    priv->wakeup_pending = FALSE;
+
+    pthread_mutex_unlock (&priv->wakeup_lock);
+}
+
+/* @fired is TRUE when called from the pulse itself. Otherwise a pulse
+ * that's already scheduled sooner is kept.
+ */
+static void
+schedule_next_pulse (SeafSyncManager *manager, gboolean fired)
+{
+    SeafSyncManagerPriv *priv = manager->priv;
+    GList *repos, *ptr;
+    SeafRepo *repo;
+    gint64 now = (gint64)time(NULL);
+    gint64 next = now + MAX_IDLE_CHECK_INTERVAL;
+    gint64 *pnext;
+
+    /* Repos without a next check, new ones or all after wake_all, are
+     * due now.
+     */
+    repos = seaf_repo_manager_get_repo_list (manager->seaf->repo_mgr, -1, -1);
+    for (ptr = repos; ptr != NULL && next > now; ptr = ptr->next) {
+        repo = ptr->data;
+        pnext = g_hash_table_lookup (priv->next_checks, repo->id);
+        if (!pnext)
+            next = now;
+        else if (*pnext < next)
+            next = *pnext;
+    }
     g_list_free (repos);
+
+    next = MAX (next, now);
+    if (!fired && priv->next_pulse > now && priv->next_pulse <= next)
+        return;
+    priv->next_pulse = next;
+
+    seaf_timer_reschedule (priv->check_sync_timer, (next - now) * 1000);
+}
+
+static void
+on_sync_wakeup (CEvent *event, void *vmanager)
+{
+    SeafSyncManager *manager = vmanager;
+
+    if (!manager->priv->check_sync_timer)
+        return;
+
+    apply_wakeups (manager);
+    schedule_next_pulse (manager, FALSE);
+}
+
+static void
+request_wakeup (SeafSyncManager *manager, const char *repo_id, int delay)
+{
+    SeafSyncManagerPriv *priv = manager->priv;
+    gint64 due = (gint64)time(NULL) + delay;
+    gint64 *pdue;
+    gboolean notify = FALSE;
+
+    pthread_mutex_lock (&priv->wakeup_lock);
+
+    if (repo_id) {
+        pdue = g_hash_table_lookup (priv->wakeup_repos, repo_id);
+        if (!pdue) {
+            pdue = g_new (gint64, 1);
+            *pdue = due;
+            g_hash_table_insert (priv->wakeup_repos, g_strdup(repo_id), pdue);
+        } else if (due < *pdue) {
+            *pdue = due;
+        }
+    } else {
+        priv->wakeup_all = TRUE;
+    }
+
+    /* One event is enough for all wakeups until the main loop handles it. */
+    if (priv->wakeup_registered && !priv->wakeup_pending) {
+        priv->wakeup_pending = TRUE;
+        notify = TRUE;
+    }
+
+    pthread_mutex_unlock (&priv->wakeup_lock);
+
+    if (notify)
+        cevent_manager_add_event (seaf->ev_mgr, priv->wakeup_event_id, NULL);
+}
+
+void
+seaf_sync_manager_wake_repo (SeafSyncManager *manager, const char *repo_id,
+                             int delay)
+{
+    request_wakeup (manager, repo_id, delay);
+}
+
+void
+seaf_sync_manager_wake_all (SeafSyncManager *manager)
+{
+    request_wakeup (manager, NULL, 0);
+}
+
+static int
+auto_sync_pulse (void *vmanager)
+{
+    SeafSyncManager *manager = vmanager;
+    GList *repos, *due_repos = NULL, *ptr;
+    SeafRepo *repo;
+    char repo_id[37];
+    gint64 now = (gint64)time(NULL);
+
+    apply_wakeups (manager);
+
+    seaf_transfer_policy_update ();
+
+    repos = seaf_repo_manager_get_repo_list (manager->seaf->repo_mgr, -1, -1);
+
+    check_folder_permissions (manager, repos);
+
+    check_server_locked_files (manager, repos);
+
+    for (ptr = repos; ptr != NULL; ptr = ptr->next) {
+        repo = ptr->data;
+        if (repo_check_due (manager, repo->id, now))
+            due_repos = g_list_prepend (due_repos, repo);
+    }
+    g_list_free (repos);
+
+    /* Sort repos by last_sync_time, so that we don't "starve" any repo. */
+    due_repos = g_list_sort_with_data (due_repos, cmp_repos_by_sync_time, NULL);
+
+    for (ptr = due_repos; ptr != NULL; ptr = ptr->next) {
+        repo = ptr->data;
+        memcpy (repo_id, repo->id, 37);
+
+        if (check_repo_sync (manager, repo))
+            set_next_check (manager, repo_id,
+                            next_check_time (manager, repo, (gint64)time(NULL)));
+        else
+            g_hash_table_remove (manager->priv->next_checks, repo_id);
+    }
+
+    g_list_free (due_repos);
+
+    schedule_next_pulse (manager, TRUE);
+
     return TRUE;
 }
 
@@ -2586,6 +3096,8 @@ on_repo_http_fetched (SeafileSession *seaf,
     if (tx_task->is_clone)
         return;
 
+    sync_phase_times_add (&task->timer.times, &tx_task->timer.times);
+
     if (task->repo->delete_pending) {
         transition_sync_state (task, SYNC_STATE_CANCELED);
         seaf_repo_manager_del_repo (seaf->repo_mgr, task->repo);
@@ -2616,6 +3128,8 @@ on_repo_http_uploaded (SeafileSession *seaf,
 
     g_return_if_fail (task != NULL && info->in_sync);
 
+    sync_phase_times_add (&task->timer.times, &tx_task->timer.times);
+
     if (task->repo->delete_pending) {
         transition_sync_state (task, SYNC_STATE_CANCELED);
         seaf_repo_manager_del_repo (seaf->repo_mgr, task->repo);
@@ -2716,6 +3230,7 @@ seaf_sync_manager_enable_auto_sync (SeafSyncManager *mgr)
     enable_auto_sync_for_repos (mgr);
 
     mgr->priv->auto_sync_enabled = TRUE;
+    seaf_sync_manager_wake_all (mgr);
     g_debug ("[sync mgr] auto sync is enabled\n");
     return 0;
 }
@@ -2752,40 +3267,20 @@ active_paths_info_free (ActivePathsInfo *info)
     g_free (info);
 }
 
-void
-seaf_sync_manager_update_active_path (SeafSyncManager *mgr,
-                                      const char *repo_id,
-                                      const char *path,
-                                      int mode,
-                                      SyncStatus status,
-                                      gboolean refresh)
+/* Called with paths_lock held. */
+static void
+update_active_path_locked (SeafSyncManager *mgr,
+                           ActivePathsInfo *info,
+                           const char *path,
+                           int mode,
+                           SyncStatus status,
+                           gboolean refresh)
 {
-    ActivePathsInfo *info;
-    SeafRepo *repo;
-
-    if (!repo_id || !path) {
-        seaf_warning ("BUG: empty repo_id or path.\n");
-        return;
-    }
-
     if (status <= SYNC_STATUS_NONE || status >= N_SYNC_STATUS) {
         seaf_warning ("BUG: invalid sync status %d.\n", status);
         return;
     }
 
-    pthread_mutex_lock (&mgr->priv->paths_lock);
-
-    info = g_hash_table_lookup (mgr->priv->active_paths, repo_id);
-    if (!info) {
-        repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
-        if (!repo) {
-            pthread_mutex_unlock (&mgr->priv->paths_lock);
-            return;
-        }
-        info = active_paths_info_new (repo);
-        g_hash_table_insert (mgr->priv->active_paths, g_strdup(repo_id), info);
-    }
-
     SyncStatus existing = (SyncStatus) g_hash_table_lookup (info->paths, path);
     if (!existing) {
         g_hash_table_insert (info->paths, g_strdup(path), (void*)status);
@@ -2814,6 +3309,78 @@ seaf_sync_manager_update_active_path (SeafSyncManager *mgr,
             seaf_sync_manager_add_refresh_path (mgr, path);
 #endif
     }
+}
+
+/* Called with paths_lock held. */
+static ActivePathsInfo *
+get_active_paths_info (SeafSyncManager *mgr, const char *repo_id)
+{
+    ActivePathsInfo *info;
+    SeafRepo *repo;
+
+    info = g_hash_table_lookup (mgr->priv->active_paths, repo_id);
+    if (!info) {
+        repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
+        if (!repo)
+            return NULL;
+        info = active_paths_info_new (repo);
+        g_hash_table_insert (mgr->priv->active_paths, g_strdup(repo_id), info);
+    }
+
+    return info;
+}
+
+void
+seaf_sync_manager_update_active_path (SeafSyncManager *mgr,
+                                      const char *repo_id,
+                                      const char *path,
+                                      int mode,
+                                      SyncStatus status,
+                                      gboolean refresh)
+{
+    ActivePathsInfo *info;
+
+    if (!repo_id || !path) {
+        seaf_warning ("BUG: empty repo_id or path.\n");
+        return;
+    }
+
+    pthread_mutex_lock (&mgr->priv->paths_lock);
+
+    info = get_active_paths_info (mgr, repo_id);
+    if (info)
+        update_active_path_locked (mgr, info, path, mode, status, refresh);
+
+    pthread_mutex_unlock (&mgr->priv->paths_lock);
+}
+
+void
+seaf_sync_manager_update_active_paths (SeafSyncManager *mgr,
+                                       const char *repo_id,
+                                       const ActivePathUpdate *updates,
+                                       guint n_updates,
+                                       gboolean refresh)
+{
+    ActivePathsInfo *info;
+    guint i;
+
+    if (!repo_id) {
+        seaf_warning ("BUG: empty repo_id.\n");
+        return;
+    }
+
+    if (n_updates == 0)
+        return;
+
+    pthread_mutex_lock (&mgr->priv->paths_lock);
+
+    info = get_active_paths_info (mgr, repo_id);
+    if (info) {
+        for (i = 0; i < n_updates; ++i)
+            update_active_path_locked (mgr, info, updates[i].path,
+                                       updates[i].mode, updates[i].status,
+                                       refresh);
+    }
 
     pthread_mutex_unlock (&mgr->priv->paths_lock);
 }
@@ -2890,6 +3457,42 @@ get_repo_sync_status (SeafSyncManager *mgr, const char *repo_id)
         return g_strdup(path_status_tbl[SYNC_STATUS_READONLY]);
 }
 
+/* Must be called with paths_lock held. */
+static SyncStatus
+lookup_active_path_status (ActivePathsInfo *info, const char *path, gboolean is_dir)
+{
+    SyncStatus ret;
+
+    ret = (SyncStatus) g_hash_table_lookup (info->paths, path);
+    if (is_dir && (ret == SYNC_STATUS_NONE)) {
+        /* If a dir is not in the syncing tree but in the synced tree,
+         * it's synced. Otherwise if it's in the syncing tree, some files
+         * under it must be syncing, so it should be in syncing status too.
+         */
+        if (sync_status_tree_exists (info->syncing_tree, path))
+            ret = SYNC_STATUS_SYNCING;
+        else if (sync_status_tree_exists (info->synced_tree, path))
+            ret = SYNC_STATUS_SYNCED;
+    }
+
+    return ret;
+}
+
+static SyncStatus
+refine_synced_status (const char *repo_id, const char *path)
+{
+    if (!seaf_repo_manager_is_path_writable(seaf->repo_mgr, repo_id, path))
+        return SYNC_STATUS_READONLY;
+    else if (seaf_filelock_manager_is_file_locked_by_me (seaf->filelock_mgr,
+                                                         repo_id, path))
+        return SYNC_STATUS_LOCKED_BY_ME;
+    else if (seaf_filelock_manager_is_file_locked (seaf->filelock_mgr,
+                                                   repo_id, path))
+        return SYNC_STATUS_LOCKED;
+
+    return SYNC_STATUS_SYNCED;
+}
+
 char *
 seaf_sync_manager_get_path_sync_status (SeafSyncManager *mgr,
                                         const char *repo_id,
@@ -2925,35 +3528,59 @@ seaf_sync_manager_get_path_sync_status (SeafSyncManager *mgr,
         goto out;
     }
 
-    ret = (SyncStatus) g_hash_table_lookup (info->paths, path);
-    if (is_dir && (ret == SYNC_STATUS_NONE)) {
-        /* If a dir is not in the syncing tree but in the synced tree,
-         * it's synced. Otherwise if it's in the syncing tree, some files
-         * under it must be syncing, so it should be in syncing status too.
-         */
-        if (sync_status_tree_exists (info->syncing_tree, path))
-            ret = SYNC_STATUS_SYNCING;
-        else if (sync_status_tree_exists (info->synced_tree, path))
-            ret = SYNC_STATUS_SYNCED;
-    }
+    ret = lookup_active_path_status (info, path, is_dir);
 
     pthread_mutex_unlock (&mgr->priv->paths_lock);
 
-    if (ret == SYNC_STATUS_SYNCED) {
-        if (!seaf_repo_manager_is_path_writable(seaf->repo_mgr, repo_id, path))
-            ret = SYNC_STATUS_READONLY;
-        else if (seaf_filelock_manager_is_file_locked_by_me (seaf->filelock_mgr,
-                                                             repo_id, path))
-            ret = SYNC_STATUS_LOCKED_BY_ME;
-        else if (seaf_filelock_manager_is_file_locked (seaf->filelock_mgr,
-                                                       repo_id, path))
-            ret = SYNC_STATUS_LOCKED;
-    }
+    if (ret == SYNC_STATUS_SYNCED)
+        ret = refine_synced_status (repo_id, path);
 
 out:
     return g_strdup(path_status_tbl[ret]);
 }
 
+char **
+seaf_sync_manager_get_paths_sync_status (SeafSyncManager *mgr,
+                                         const char *repo_id,
+                                         char **paths,
+                                         gboolean *is_dirs,
+                                         int n_paths)
+{
+    ActivePathsInfo *info;
+    SyncInfo *sync_info;
+    SyncStatus *statuses;
+    char **ret;
+    int i;
+
+    ret = g_new0 (char *, n_paths + 1);
+    statuses = g_new0 (SyncStatus, n_paths);
+
+    sync_info = get_sync_info (mgr, repo_id);
+    if (!sync_info->in_error) {
+        /* Look up all the paths with the lock taken only once. */
+        pthread_mutex_lock (&mgr->priv->paths_lock);
+        info = g_hash_table_lookup (mgr->priv->active_paths, repo_id);
+        for (i = 0; info && i < n_paths; ++i) {
+            if (paths[i][0] != 0)
+                statuses[i] = lookup_active_path_status (info, paths[i], is_dirs[i]);
+        }
+        pthread_mutex_unlock (&mgr->priv->paths_lock);
+    }
+
+    for (i = 0; i < n_paths; ++i) {
+        if (paths[i][0] == 0) {
+            ret[i] = get_repo_sync_status (mgr, repo_id);
+            continue;
+        }
+        if (statuses[i] == SYNC_STATUS_SYNCED)
+            statuses[i] = refine_synced_status (repo_id, paths[i]);
+        ret[i] = g_strdup (path_status_tbl[statuses[i]]);
+    }
+
+    g_free (statuses);
+    return ret;
+}
+
 static json_t *
 active_paths_to_json (GHashTable *paths)
 {
@@ -3070,27 +3697,107 @@ win_path (const char *path)
     return ret_w;
 }
 
+/* Paths queued within this time after the first one are sent together. */
+#define REFRESH_BATCH_USEC (G_USEC_PER_SEC / 2)
+/* A dir with more changed children is refreshed as a whole. */
+#define REFRESH_DIR_THRESHOLD 20
+#define REFRESH_MAX_PER_SEC 100
+
+typedef struct RefreshRate {
+    gint64 window_start;
+    int count;
+} RefreshRate;
+
+static void
+send_refresh (RefreshRate *rate, LONG event, const char *path)
+{
+    wchar_t *wpath;
+    gint64 now;
+
+    now = g_get_monotonic_time ();
+    if (now - rate->window_start >= G_USEC_PER_SEC) {
+        rate->window_start = now;
+        rate->count = 0;
+    } else if (rate->count >= REFRESH_MAX_PER_SEC) {
+        g_usleep (rate->window_start + G_USEC_PER_SEC - now);
+        rate->window_start = g_get_monotonic_time ();
+        rate->count = 0;
+    }
+    ++(rate->count);
+
+    wpath = win_path (path);
+    SHChangeNotify (event, SHCNF_PATHW, wpath, NULL);
+    g_free (wpath);
+}
+
+/* Adds @path to @batch, which maps parent dirs to their changed children. */
+static void
+add_to_refresh_batch (GHashTable *batch, char *path)
+{
+    char *parent = g_path_get_dirname (path);
+    GHashTable *children;
+
+    children = g_hash_table_lookup (batch, parent);
+    if (!children) {
+        children = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                          g_free, NULL);
+        g_hash_table_insert (batch, parent, children);
+    } else {
+        g_free (parent);
+    }
+    /* Takes @path. */
+    g_hash_table_add (children, path);
+}
+
+static void
+send_refresh_batch (GHashTable *batch, RefreshRate *rate)
+{
+    GHashTableIter iter, child_iter;
+    gpointer key, value, child;
+
+    g_hash_table_iter_init (&iter, batch);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        if (g_hash_table_size (value) > REFRESH_DIR_THRESHOLD) {
+            send_refresh (rate, SHCNE_UPDATEDIR, key);
+            continue;
+        }
+        g_hash_table_iter_init (&child_iter, value);
+        while (g_hash_table_iter_next (&child_iter, &child, NULL))
+            send_refresh (rate, SHCNE_ATTRIBUTES, child);
+    }
+    g_hash_table_remove_all (batch);
+}
+
 static void *
 refresh_windows_explorer_thread (void *vdata)
 {
     GAsyncQueue *q = vdata;
+    GHashTable *batch;
+    RefreshRate rate;
     char *path;
-    wchar_t *wpath;
-    int count = 0;
+    gint64 deadline, timeout;
+
+    batch = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                   (GDestroyNotify)g_hash_table_destroy);
+    memset (&rate, 0, sizeof(rate));
 
     while (1) {
         path = g_async_queue_pop (q);
-        wpath = win_path (path);
-
-        SHChangeNotify (SHCNE_ATTRIBUTES, SHCNF_PATHW, wpath, NULL);
+        add_to_refresh_batch (batch, path);
 
-        g_free (path);
-        g_free (wpath);
-
-        if (++count >= 100) {
-            g_usleep (G_USEC_PER_SEC);
-            count = 0;
+        /* During a checkout paths arrive in bursts, most of them in a few
+         * dirs. Collect them for a while so that each is sent only once,
+         * and whole dirs are refreshed instead of many of their children.
+         */
+        deadline = g_get_monotonic_time () + REFRESH_BATCH_USEC;
+        while ((timeout = deadline - g_get_monotonic_time ()) > 0) {
+            path = g_async_queue_timeout_pop (q, timeout);
+            if (!path)
+                break;
+            add_to_refresh_batch (batch, path);
         }
+
+        send_refresh_batch (batch, &rate);
     }
 
     return NULL;
@@ -3114,12 +3821,165 @@ seaf_sync_manager_refresh_path (SeafSyncManager *mgr, const char *path)
 
 #endif
 
+/* Repos covered by the notification server are still polled at this
+ * interval, in case notifications were lost.
+ */
+#define FULL_HEAD_COMMITS_POLL_INTERVAL 600 /* 10 minutes */
+
+/* Build the new head commit map for @repo_id_list from the current one and
+ * @changed. Empty heads in @changed are repos removed on the server.
+ */
+static GHashTable *
+merge_head_commit_map (HttpServerState *state, GList *repo_id_list,
+                       GHashTable *changed)
+{
+    GHashTable *map;
+    GList *ptr;
+    char *repo_id, *head;
+
+    map = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+    pthread_mutex_lock (&state->head_commit_map_lock);
+    for (ptr = repo_id_list; ptr; ptr = ptr->next) {
+        repo_id = ptr->data;
+        head = changed ? g_hash_table_lookup (changed, repo_id) : NULL;
+        if (!head)
+            head = g_hash_table_lookup (state->head_commit_map, repo_id);
+        if (head && *head != '\0')
+            g_hash_table_replace (map, g_strdup (repo_id), g_strdup (head));
+    }
+    pthread_mutex_unlock (&state->head_commit_map_lock);
+
+    return map;
+}
+
+/* Repos asked for but missing from a full response are gone on the server. */
+static void
+mark_missing_repos (GHashTable *changed, GList *repo_id_list)
+{
+    GList *ptr;
+
+    for (ptr = repo_id_list; ptr; ptr = ptr->next) {
+        if (!g_hash_table_lookup (changed, ptr->data))
+            g_hash_table_replace (changed, g_strdup (ptr->data), g_strdup (""));
+    }
+}
+
+static GHashTable *
+poll_head_commit_delta (HttpServerState *state, GList *repo_id_list,
+                        int *status)
+{
+    const char *since = NULL;
+    char *token = NULL;
+    gboolean full = FALSE;
+    GHashTable *changed, *new_map;
+    GList *ptr;
+
+    /* Start over when repos were added after the token was issued. */
+    if (state->head_commits_token && state->head_commit_map_init) {
+        since = state->head_commits_token;
+        for (ptr = repo_id_list; ptr; ptr = ptr->next) {
+            if (!g_hash_table_lookup (state->token_repos, ptr->data)) {
+                since = NULL;
+                break;
+            }
+        }
+    }
+
+    changed = http_tx_manager_get_head_commit_delta (seaf->http_tx_mgr,
+                                                     state->effective_host,
+                                                     state->use_fileserver_port,
+                                                     repo_id_list, since,
+                                                     &token, &full, status);
+    if (!changed)
+        return NULL;
+
+    if (!since || full) {
+        mark_missing_repos (changed, repo_id_list);
+        g_hash_table_remove_all (state->token_repos);
+        for (ptr = repo_id_list; ptr; ptr = ptr->next)
+            g_hash_table_replace (state->token_repos, g_strdup (ptr->data),
+                                  (gpointer)1);
+    }
+
+    g_free (state->head_commits_token);
+    state->head_commits_token = token;
+
+    new_map = merge_head_commit_map (state, repo_id_list, changed);
+    g_hash_table_destroy (changed);
+
+    return new_map;
+}
+
+/* Servers without delta responses are asked for all repos, except for the
+ * ones whose updates are pushed by the notification server. The heads of
+ * those are kept up to date by seaf_sync_manager_update_repo().
+ */
+static GHashTable *
+poll_head_commit_ids (HttpServerState *state, const char *server_url,
+                      GList *repo_id_list, gboolean *polled, int *status)
+{
+    GList *request_list = NULL, *ptr;
+    GHashTable *changed, *new_map;
+    char *repo_id;
+    gboolean full_poll;
+    gboolean known;
+    gint64 now = (gint64)time(NULL);
+
+    full_poll = (now - state->last_full_head_commit_poll >=
+                 FULL_HEAD_COMMITS_POLL_INTERVAL);
+
+    for (ptr = repo_id_list; ptr; ptr = ptr->next) {
+        repo_id = ptr->data;
+        if (!full_poll) {
+            pthread_mutex_lock (&state->head_commit_map_lock);
+            known = (g_hash_table_lookup (state->head_commit_map, repo_id) != NULL);
+            pthread_mutex_unlock (&state->head_commit_map_lock);
+
+            /* The repos may be removed by the main thread meanwhile, so
+             * only their ids are used here. All of them are on @server_url.
+             */
+            if (known &&
+                seaf_notif_manager_is_repo_id_subscribed (seaf->notif_mgr,
+                                                          server_url, repo_id))
+                continue;
+        }
+        request_list = g_list_prepend (request_list, repo_id);
+    }
+
+    *polled = (request_list != NULL);
+    if (!request_list)
+        return merge_head_commit_map (state, repo_id_list, NULL);
+
+    changed = http_tx_manager_get_head_commit_ids (seaf->http_tx_mgr,
+                                                   state->effective_host,
+                                                   state->use_fileserver_port,
+                                                   request_list, status);
+    if (!changed) {
+        g_list_free (request_list);
+        return NULL;
+    }
+
+    mark_missing_repos (changed, request_list);
+    g_list_free (request_list);
+
+    if (full_poll)
+        state->last_full_head_commit_poll = now;
+
+    new_map = merge_head_commit_map (state, repo_id_list, changed);
+    g_hash_table_destroy (changed);
+
+    return new_map;
+}
+
 static void
 update_head_commit_ids_for_server (gpointer key, gpointer value, gpointer user_data)
 {
     char *server_url = key;
     HttpServerState *state = value;
     int status = 200;
+    gboolean polled = TRUE;
+    GHashTable *new_map;
 
     /* Only get head commit ids from server if:
      * 1. syncing protocol version has been checked, and
@@ -3133,18 +3993,20 @@ update_head_commit_ids_for_server (gpointer key, gpointer value, gpointer user_d
             return;
         }
 
-        GHashTable *new_map = http_tx_manager_get_head_commit_ids (seaf->http_tx_mgr,
-                                                                   state->effective_host,
-                                                                   state->use_fileserver_port,
-                                                                   repo_id_list, &status);
+        if (state->head_commits_delta)
+            new_map = poll_head_commit_delta (state, repo_id_list, &status);
+        else
+            new_map = poll_head_commit_ids (state, server_url, repo_id_list,
+                                            &polled, &status);
         if (new_map) {
             //If the fileserver hangs up before sending events to the notification server,
             // the client will not receive the updates, and some updates will be lost.
             // Therefore, after the fileserver recovers, immediately checking locks and folder perms.
-            if (state->server_disconnected) {
+            if (polled && state->server_disconnected) {
                 seaf_sync_manager_check_locks_and_folder_perms (seaf->sync_mgr, server_url);
             }
-            state->server_disconnected = FALSE;
+            if (polled)
+                state->server_disconnected = FALSE;
             pthread_mutex_lock (&state->head_commit_map_lock);
             g_hash_table_destroy (state->head_commit_map);
             state->head_commit_map = new_map;
@@ -3152,6 +4014,8 @@ update_head_commit_ids_for_server (gpointer key, gpointer value, gpointer user_d
                 state->head_commit_map_init = TRUE;
             state->last_update_head_commit_map_time = (gint64)time(NULL);
             pthread_mutex_unlock (&state->head_commit_map_lock);
+            /* Repos changed on the server are synced on the next pulse. */
+            seaf_sync_manager_wake_all (seaf->sync_mgr);
         } else {
             if (status == HTTP_SERVERR_BAD_GATEWAY ||
                 status == HTTP_SERVERR_UNAVAILABLE ||
@@ -3,6 +3,10 @@
 #ifndef SYNC_MGR_H
 #define SYNC_MGR_H
 
+#include <jansson.h>
+
+#include "sync-timing.h"
+
 typedef struct _SyncInfo SyncInfo;
 typedef struct _SyncTask SyncTask;
 
@@ -36,6 +40,9 @@ struct _SyncInfo {
 
     gint       sync_perm_err_cnt;
     gboolean   del_confirmation_pending;
+
+    /* Phase timings of the last syncs that transferred data, latest last. */
+    GQueue    *timings;
 };
 
 enum {
@@ -67,6 +74,18 @@ struct _SyncTask {
 
     int              http_version;
 
+    /* Heavy tasks don't run in the fast lane of the sync admission.
+     * large_transfer is set once the transfer turns out to be big.
+     */
+    gboolean         heavy;
+    gboolean         large_transfer;
+
+    gint64           start_time;
+    /* Switched on the main thread. Times of the commit job and the
+     * transfer tasks are added when they finish.
+     */
+    SyncPhaseTimer   timer;
+
     SeafRepo        *repo;  /* for convenience, only valid when in_sync. */
 };
 
@@ -116,6 +135,17 @@ SeafSyncManager* seaf_sync_manager_new (struct _SeafileSession *seaf);
 int seaf_sync_manager_init (SeafSyncManager *mgr);
 int seaf_sync_manager_start (SeafSyncManager *mgr);
 
+/* Have auto sync look at @repo_id in @delay seconds, rather than at its next
+ * scheduled check. Thread safe.
+ */
+void
+seaf_sync_manager_wake_repo (SeafSyncManager *mgr, const char *repo_id,
+                             int delay);
+
+/* Have auto sync look at all repos. Thread safe. */
+void
+seaf_sync_manager_wake_all (SeafSyncManager *mgr);
+
 int
 seaf_sync_manager_add_sync_task (SeafSyncManager *mgr,
                                  const char *repo_id,
@@ -130,6 +160,11 @@ SyncInfo *
 seaf_sync_manager_get_sync_info (SeafSyncManager *mgr,
                                  const char *repo_id);
 
+/* Phase timings of the last syncs of @repo_id, latest first. Thread safe. */
+json_t *
+seaf_sync_manager_get_sync_timings (SeafSyncManager *mgr,
+                                    const char *repo_id);
+
 int
 seaf_sync_manager_add_del_confirmation (SeafSyncManager *mgr,
                                         const char *confirmation_id,
@@ -155,6 +190,22 @@ seaf_sync_manager_update_active_path (SeafSyncManager *mgr,
                                       SyncStatus status,
                                       gboolean refresh);
 
+typedef struct ActivePathUpdate {
+    const char *path;
+    int mode;
+    SyncStatus status;
+} ActivePathUpdate;
+
+/* Same as seaf_sync_manager_update_active_path() for many paths of one
+ * repo, taking the lock once.
+ */
+void
+seaf_sync_manager_update_active_paths (SeafSyncManager *mgr,
+                                       const char *repo_id,
+                                       const ActivePathUpdate *updates,
+                                       guint n_updates,
+                                       gboolean refresh);
+
 void
 seaf_sync_manager_delete_active_path (SeafSyncManager *mgr,
                                       const char *repo_id,
@@ -166,6 +217,16 @@ seaf_sync_manager_get_path_sync_status (SeafSyncManager *mgr,
                                         const char *path,
                                         gboolean is_dir);
 
+/* Same as above for @n_paths paths of one repo at once. Returns the statuses
+ * in the same order, to be freed with g_strfreev().
+ */
+char **
+seaf_sync_manager_get_paths_sync_status (SeafSyncManager *mgr,
+                                         const char *repo_id,
+                                         char **paths,
+                                         gboolean *is_dirs,
+                                         int n_paths);
+
 char *
 seaf_sync_manager_list_active_paths_json (SeafSyncManager *mgr);
 
@@ -175,6 +236,10 @@ seaf_sync_manager_active_paths_number (SeafSyncManager *mgr);
 void
 seaf_sync_manager_remove_active_path_info (SeafSyncManager *mgr, const char *repo_id);
 
+/* Orders repos by last sync time, least recently synced first. */
+gint
+cmp_repos_by_sync_time (gconstpointer a, gconstpointer b, gpointer user_data);
+
 #ifdef WIN32
 /* Add to refresh queue */
 void
@@ -246,43 +246,34 @@ int
 sync_status_tree_exists (SyncStatusTree *tree,
                          const char *path)
 {
-    char **dnames = NULL;
-    guint n, i;
-    char *dname;
+    char *copy, *dname, *slash;
     SyncStatusDir *dir = tree->root;
     SyncStatusDirent *dirent;
     int ret = 0;
 
-    dnames = g_strsplit (path, "/", 0);
-    if (!dnames)
-        return ret;
-    n = g_strv_length (dnames);
+    /* Called for every icon shown by the shell extensions, so walk the path
+     * in place instead of splitting it.
+     */
+    copy = g_strdup (path);
+    dname = copy;
+
+    while (dir) {
+        slash = strchr (dname, '/');
+        if (slash)
+            *slash = '\0';
 
-    for (i = 0; i < n; i++) {
-        dname = dnames[i];
         dirent = g_hash_table_lookup (dir->dirents, dname);
-        if (dirent) {
-            if (S_ISDIR(dirent->mode)) {
-                if (i == (n-1)) {
-                    ret = 1;
-                    goto out;
-                } else {
-                    dir = dirent->subdir;
-                }
-            } else {
-                if (i == (n-1)) {
-                    ret = 1;
-                    goto out;
-                } else {
-                    goto out;
-                }
-            }
-        } else {
-            goto out;
+        if (!dirent)
+            break;
+        if (!slash) {
+            ret = 1;
+            break;
         }
+
+        dir = S_ISDIR(dirent->mode) ? dirent->subdir : NULL;
+        dname = slash + 1;
     }
 
-out:
-    g_strfreev (dnames);
+    g_free (copy);
     return ret;
 }
@@ -0,0 +1,104 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include "metrics.h"
+#include "trace.h"
+#include "sync-timing.h"
+
+static const char *phase_names[] = {
+    "commit",
+    "check_head",
+    "fs_list",
+    "fs_objects",
+    "block_list",
+    "blocks",
+    "checkout",
+    "index",
+};
+
+void
+sync_phase_timer_init (SyncPhaseTimer *timer)
+{
+    memset (timer, 0, sizeof(SyncPhaseTimer));
+    timer->phase = SYNC_PHASE_NONE;
+}
+
+int
+sync_phase_timer_switch (SyncPhaseTimer *timer, int phase)
+{
+    int prev = timer->phase;
+    gint64 wall = seaf_metrics_now ();
+    gint64 cpu = seaf_metrics_process_cpu_time ();
+
+    if (prev != SYNC_PHASE_NONE) {
+        timer->times.wall[prev] += MAX (wall - timer->wall_start, 0);
+        timer->times.cpu[prev] += MAX (cpu - timer->cpu_start, 0);
+        seaf_trace_span (phase_names[prev], timer->wall_start, NULL);
+    }
+
+    timer->phase = phase;
+    timer->wall_start = wall;
+    timer->cpu_start = cpu;
+
+    return prev;
+}
+
+void
+sync_phase_times_add (SyncPhaseTimes *times, const SyncPhaseTimes *other)
+{
+    int i;
+
+    for (i = 0; i < N_SYNC_PHASES; ++i) {
+        times->wall[i] += other->wall[i];
+        times->cpu[i] += other->cpu[i];
+    }
+}
+
+const char *
+sync_phase_to_str (int phase)
+{
+    if (phase < 0 || phase >= N_SYNC_PHASES)
+        return "none";
+
+    return phase_names[phase];
+}
+
+char *
+sync_phase_times_to_string (const SyncPhaseTimes *times)
+{
+    GString *buf = g_string_new (NULL);
+    int i;
+
+    for (i = 0; i < N_SYNC_PHASES; ++i) {
+        if (times->wall[i] == 0 && times->cpu[i] == 0)
+            continue;
+        g_string_append_printf (buf, "%s%s %" G_GINT64_FORMAT "/%" G_GINT64_FORMAT "ms",
+                                buf->len > 0 ? ", " : "",
+                                phase_names[i],
+                                times->wall[i] / 1000, times->cpu[i] / 1000);
+    }
+
+    return g_string_free (buf, FALSE);
+}
+
+json_t *
+sync_phase_times_to_json (const SyncPhaseTimes *times)
+{
+    json_t *object = json_object ();
+    json_t *phase;
+    int i;
+
+    for (i = 0; i < N_SYNC_PHASES; ++i) {
+        if (times->wall[i] == 0 && times->cpu[i] == 0)
+            continue;
+        phase = json_object ();
+        json_object_set_new (phase, "wall_ms",
+                             json_integer (times->wall[i] / 1000));
+        json_object_set_new (phase, "cpu_ms",
+                             json_integer (times->cpu[i] / 1000));
+        json_object_set_new (object, phase_names[i], phase);
+    }
+
+    return object;
+}
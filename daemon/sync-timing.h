@@ -0,0 +1,69 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SYNC_TIMING_H
+#define SYNC_TIMING_H
+
+#include <glib.h>
+#include <jansson.h>
+
+/*
+ * Wall clock and CPU time spent in each phase of a sync.
+ *
+ * CPU time is that of the whole process while the phase runs, so that work
+ * done by helper threads, e.g. block transfer threads, is included. When
+ * several repos sync at the same time, it includes their work too.
+ */
+
+enum {
+    SYNC_PHASE_NONE = -1,
+    SYNC_PHASE_COMMIT = 0,
+    SYNC_PHASE_CHECK_HEAD,
+    SYNC_PHASE_FS_LIST,
+    SYNC_PHASE_FS_OBJECTS,
+    SYNC_PHASE_BLOCK_LIST,
+    SYNC_PHASE_BLOCKS,
+    SYNC_PHASE_CHECKOUT,
+    SYNC_PHASE_INDEX,
+    N_SYNC_PHASES,
+};
+
+/* In microseconds. */
+typedef struct SyncPhaseTimes {
+    gint64 wall[N_SYNC_PHASES];
+    gint64 cpu[N_SYNC_PHASES];
+} SyncPhaseTimes;
+
+/* Not thread safe, each timer should only be switched by one thread. */
+typedef struct SyncPhaseTimer {
+    SyncPhaseTimes times;
+    int phase;
+    gint64 wall_start;
+    gint64 cpu_start;
+} SyncPhaseTimer;
+
+void
+sync_phase_timer_init (SyncPhaseTimer *timer);
+
+/*
+ * Charges the time since the last switch to the current phase and starts
+ * timing @phase. Returns the previous phase, so that a nested phase can
+ * switch back when it ends. SYNC_PHASE_NONE stops the timer.
+ */
+int
+sync_phase_timer_switch (SyncPhaseTimer *timer, int phase);
+
+void
+sync_phase_times_add (SyncPhaseTimes *times, const SyncPhaseTimes *other);
+
+const char *
+sync_phase_to_str (int phase);
+
+/* E.g. "commit 120/80ms, blocks 5300/400ms", skipping phases not run. */
+char *
+sync_phase_times_to_string (const SyncPhaseTimes *times);
+
+/* Object of {"wall_ms": .., "cpu_ms": ..} per phase that was run. */
+json_t *
+sync_phase_times_to_json (const SyncPhaseTimes *times);
+
+#endif
@@ -73,6 +73,15 @@ timeval_from_msec (uint64_t milliseconds)
     return ret;
 }
 
+void
+seaf_timer_reschedule (SeafTimer *timer, uint64_t interval_milliseconds)
+{
+    timer->tv = timeval_from_msec (interval_milliseconds);
+
+    if (!timer->in_callback)
+        evtimer_add (timer->event, &timer->tv);
+}
+
 SeafTimer*
 seaf_timer_new (TimerCB         func,
                 void           *user_data,
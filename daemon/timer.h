@@ -19,6 +19,12 @@ SeafTimer* seaf_timer_new (TimerCB           func,
                            void             *user_data,
                            uint64_t          timeout_milliseconds);
 
+/**
+ * Changes the interval of a timer and restarts it. If called from the
+ * timer callback, the new interval applies when the callback returns.
+ */
+void seaf_timer_reschedule (SeafTimer *timer, uint64_t timeout_milliseconds);
+
 /**
  * Frees a timer and sets the timer pointer to NULL.
  */
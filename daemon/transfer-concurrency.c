@@ -0,0 +1,190 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#include "seafile-session.h"
+#include "transfer-concurrency.h"
+
+#define DEBUG_FLAG SEAFILE_DEBUG_TRANSFER
+#include "log.h"
+
+/* Same as the fixed number of threads used before. */
+#define INIT_CONCURRENCY 3
+
+/* Throughput is measured over epochs of at least this long, and at least
+ * as many finished transfers as the current limit.
+ */
+#define EPOCH_MIN_TIME 2.0
+/* Relative change of throughput that counts as better or worse. */
+#define RATE_GAIN 0.05
+#define RATE_LOSS 0.10
+/* Failures of transfers that were already running when the limit was
+ * halved don't halve it again.
+ */
+#define DECREASE_INTERVAL 5.0
+
+struct TransferConcurrency {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    int limit;
+    int active;
+
+    double epoch_start;
+    gint64 epoch_bytes;
+    int epoch_done;
+    /* Whether all slots were taken at some point during the epoch. If not,
+     * the throughput is bounded by the tasks rather than the link.
+     */
+    gboolean saturated;
+
+    double last_rate;
+    int last_limit;
+    double last_decrease;
+};
+
+static double
+now_sec ()
+{
+    GTimeVal tv;
+
+    g_get_current_time (&tv);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static int
+max_concurrency ()
+{
+    return MAX (seaf->max_transfer_threads, 1);
+}
+
+static void
+start_epoch (TransferConcurrency *ctl, double now)
+{
+    ctl->epoch_start = now;
+    ctl->epoch_bytes = 0;
+    ctl->epoch_done = 0;
+    ctl->saturated = (ctl->active >= ctl->limit);
+}
+
+TransferConcurrency *
+transfer_concurrency_new ()
+{
+    TransferConcurrency *ctl = g_new0 (TransferConcurrency, 1);
+
+    pthread_mutex_init (&ctl->lock, NULL);
+    pthread_cond_init (&ctl->cond, NULL);
+    ctl->limit = MIN (INIT_CONCURRENCY, max_concurrency ());
+    ctl->last_limit = ctl->limit;
+    start_epoch (ctl, now_sec ());
+
+    return ctl;
+}
+
+void
+transfer_concurrency_free (TransferConcurrency *ctl)
+{
+    if (!ctl)
+        return;
+
+    pthread_mutex_destroy (&ctl->lock);
+    pthread_cond_destroy (&ctl->cond);
+    g_free (ctl);
+}
+
+void
+transfer_concurrency_acquire (TransferConcurrency *ctl)
+{
+    pthread_mutex_lock (&ctl->lock);
+
+    /* The cap may have been lowered since the limit was last adjusted. */
+    if (ctl->limit > max_concurrency ())
+        ctl->limit = max_concurrency ();
+
+    while (ctl->active >= ctl->limit)
+        pthread_cond_wait (&ctl->cond, &ctl->lock);
+
+    ++(ctl->active);
+    if (ctl->active >= ctl->limit)
+        ctl->saturated = TRUE;
+
+    pthread_mutex_unlock (&ctl->lock);
+}
+
+static void
+end_epoch (TransferConcurrency *ctl, double now)
+{
+    double rate = ctl->epoch_bytes / (now - ctl->epoch_start);
+    int old_limit = ctl->limit;
+
+    if (!ctl->saturated) {
+        /* Nothing learned about the link. */
+    } else if (ctl->last_rate == 0 || rate > ctl->last_rate * (1 + RATE_GAIN)) {
+        /* One more transfer may still help. */
+        ctl->last_limit = ctl->limit;
+        ctl->last_rate = rate;
+        if (ctl->limit < max_concurrency ())
+            ++(ctl->limit);
+    } else if (rate < ctl->last_rate * (1 - RATE_LOSS) &&
+               ctl->limit > ctl->last_limit) {
+        /* The last increase made things worse. */
+        ctl->limit = ctl->last_limit;
+        ctl->last_rate = rate;
+    } else {
+        ctl->last_limit = ctl->limit;
+        ctl->last_rate = rate;
+    }
+
+    if (ctl->limit != old_limit)
+        seaf_debug ("Transfer concurrency %d -> %d, %.0f KB/s.\n",
+                    old_limit, ctl->limit, rate / 1024);
+
+    start_epoch (ctl, now);
+}
+
+void
+transfer_concurrency_release (TransferConcurrency *ctl,
+                              gint64 bytes, gboolean failed)
+{
+    double now = now_sec ();
+
+    pthread_mutex_lock (&ctl->lock);
+
+    --(ctl->active);
+
+    if (failed) {
+        if (now - ctl->last_decrease >= DECREASE_INTERVAL) {
+            ctl->limit = MAX (ctl->limit / 2, 1);
+            ctl->last_limit = ctl->limit;
+            ctl->last_rate = 0;
+            ctl->last_decrease = now;
+            seaf_debug ("Transfer failed, concurrency reduced to %d.\n",
+                        ctl->limit);
+            start_epoch (ctl, now);
+        }
+    } else {
+        ctl->epoch_bytes += bytes;
+        ++(ctl->epoch_done);
+        if (now - ctl->epoch_start >= EPOCH_MIN_TIME &&
+            ctl->epoch_done >= ctl->limit)
+            end_epoch (ctl, now);
+    }
+
+    pthread_cond_broadcast (&ctl->cond);
+
+    pthread_mutex_unlock (&ctl->lock);
+}
+
+int
+transfer_concurrency_get_limit (TransferConcurrency *ctl)
+{
+    int limit;
+
+    pthread_mutex_lock (&ctl->lock);
+    limit = MIN (ctl->limit, max_concurrency ());
+    pthread_mutex_unlock (&ctl->lock);
+
+    return limit;
+}
@@ -0,0 +1,40 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef TRANSFER_CONCURRENCY_H
+#define TRANSFER_CONCURRENCY_H
+
+#include <glib.h>
+
+/*
+ * Limits the number of block transfers running at the same time against
+ * one host, shared by all upload and download tasks to that host.
+ *
+ * The limit adapts to the link (AIMD): it grows by one while the measured
+ * throughput keeps improving, steps back when an extra transfer made things
+ * slower, and is halved when transfers fail with network errors. It never
+ * exceeds seaf->max_transfer_threads.
+ */
+
+typedef struct TransferConcurrency TransferConcurrency;
+
+TransferConcurrency *
+transfer_concurrency_new ();
+
+void
+transfer_concurrency_free (TransferConcurrency *ctl);
+
+/* Block until a transfer slot is free. */
+void
+transfer_concurrency_acquire (TransferConcurrency *ctl);
+
+/* Give back a slot after transferring @bytes. @failed should be TRUE if the
+ * transfer broke because of the network.
+ */
+void
+transfer_concurrency_release (TransferConcurrency *ctl,
+                              gint64 bytes, gboolean failed);
+
+int
+transfer_concurrency_get_limit (TransferConcurrency *ctl);
+
+#endif
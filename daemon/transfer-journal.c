@@ -0,0 +1,453 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#include "transfer-journal.h"
+#include "utils.h"
+#include "log.h"
+
+#include "db.h"
+
+#define JOURNAL_DB "transfer-journal.db"
+#define PARTIAL_BLOCK_DIR "partial-blocks"
+
+#define JOURNAL_LIFETIME (24 * 3600)
+
+enum {
+    PHASE_UPLOAD_BLOCKS = 1,
+    PHASE_FS_FETCHED,
+};
+
+struct TransferJournal {
+    sqlite3 *db;
+    pthread_mutex_t lock;
+    char *partial_dir;
+};
+
+static gboolean remove_partial_block_row (sqlite3_stmt *stmt, void *data);
+
+/* Partial blocks of downloads that were never resumed. */
+static void
+remove_expired_partial_blocks (TransferJournal *journal)
+{
+    char sql[256];
+    gint64 expire = (gint64)time(NULL) - JOURNAL_LIFETIME;
+
+    snprintf (sql, sizeof(sql),
+              "SELECT repo_id, block_id FROM PartialBlock "
+              "WHERE mtime<=%"G_GINT64_FORMAT, expire);
+    sqlite_foreach_selected_row (journal->db, sql,
+                                 remove_partial_block_row, journal);
+
+    snprintf (sql, sizeof(sql),
+              "DELETE FROM PartialBlock WHERE mtime<=%"G_GINT64_FORMAT, expire);
+    sqlite_query_exec (journal->db, sql);
+}
+
+TransferJournal *
+transfer_journal_open (const char *seaf_dir)
+{
+    TransferJournal *journal;
+    char *db_path;
+    sqlite3 *db;
+    char *sql;
+
+    db_path = g_build_filename (seaf_dir, JOURNAL_DB, NULL);
+    if (sqlite_open_db (db_path, &db) < 0) {
+        g_free (db_path);
+        return NULL;
+    }
+    g_free (db_path);
+
+    sql = "CREATE TABLE IF NOT EXISTS TransferTask ("
+        "repo_id TEXT, type INTEGER, head TEXT, phase INTEGER, mtime INTEGER, "
+        "PRIMARY KEY (repo_id, type));";
+    sqlite_query_exec (db, sql);
+
+    sql = "CREATE TABLE IF NOT EXISTS TransferBlock ("
+        "repo_id TEXT, block_id TEXT, sent INTEGER, "
+        "PRIMARY KEY (repo_id, block_id));";
+    sqlite_query_exec (db, sql);
+
+    sql = "CREATE TABLE IF NOT EXISTS PartialBlock ("
+        "repo_id TEXT, block_id TEXT, size INTEGER, mtime INTEGER, "
+        "PRIMARY KEY (repo_id, block_id));";
+    sqlite_query_exec (db, sql);
+
+    journal = g_new0 (TransferJournal, 1);
+    journal->db = db;
+    pthread_mutex_init (&journal->lock, NULL);
+    journal->partial_dir = g_build_filename (seaf_dir, PARTIAL_BLOCK_DIR, NULL);
+
+    remove_expired_partial_blocks (journal);
+
+    return journal;
+}
+
+static gboolean
+task_in_phase (TransferJournal *journal, const char *repo_id, int type,
+               const char *head, int phase)
+{
+    char sql[256];
+
+    snprintf (sql, sizeof(sql),
+              "SELECT 1 FROM TransferTask WHERE repo_id='%s' AND type=%d "
+              "AND head='%s' AND phase=%d AND mtime>%"G_GINT64_FORMAT,
+              repo_id, type, head, phase,
+              (gint64)time(NULL) - JOURNAL_LIFETIME);
+    return sqlite_check_for_existence (journal->db, sql);
+}
+
+static int
+set_task_phase (TransferJournal *journal, const char *repo_id, int type,
+                const char *head, int phase)
+{
+    char sql[256];
+
+    snprintf (sql, sizeof(sql),
+              "REPLACE INTO TransferTask (repo_id, type, head, phase, mtime) "
+              "VALUES ('%s', %d, '%s', %d, %"G_GINT64_FORMAT")",
+              repo_id, type, head, phase, (gint64)time(NULL));
+    return sqlite_query_exec (journal->db, sql);
+}
+
+static gboolean
+collect_block_id (sqlite3_stmt *stmt, void *data)
+{
+    GList **block_list = data;
+    const char *block_id = (const char *)sqlite3_column_text (stmt, 0);
+
+    *block_list = g_list_prepend (*block_list, g_strdup (block_id));
+    return TRUE;
+}
+
+gboolean
+transfer_journal_get_upload_blocks (TransferJournal *journal,
+                                    const char *repo_id, const char *head,
+                                    GList **block_list)
+{
+    char sql[256];
+    gboolean ret = FALSE;
+
+    if (!journal)
+        return FALSE;
+
+    pthread_mutex_lock (&journal->lock);
+
+    if (!task_in_phase (journal, repo_id, TRANSFER_JOURNAL_UPLOAD, head,
+                        PHASE_UPLOAD_BLOCKS))
+        goto out;
+
+    snprintf (sql, sizeof(sql),
+              "SELECT block_id FROM TransferBlock WHERE repo_id='%s' AND sent=0",
+              repo_id);
+    if (sqlite_foreach_selected_row (journal->db, sql,
+                                     collect_block_id, block_list) < 0) {
+        string_list_free (*block_list);
+        *block_list = NULL;
+        goto out;
+    }
+
+    ret = TRUE;
+
+out:
+    pthread_mutex_unlock (&journal->lock);
+    return ret;
+}
+
+int
+transfer_journal_start_upload_blocks (TransferJournal *journal,
+                                      const char *repo_id, const char *head,
+                                      GList *block_list)
+{
+    char sql[256];
+    GList *ptr;
+    int ret = 0;
+
+    if (!journal)
+        return 0;
+
+    pthread_mutex_lock (&journal->lock);
+
+    if (sqlite_begin_transaction (journal->db) < 0) {
+        ret = -1;
+        goto out;
+    }
+
+    snprintf (sql, sizeof(sql),
+              "DELETE FROM TransferBlock WHERE repo_id='%s'", repo_id);
+    if (sqlite_query_exec (journal->db, sql) < 0)
+        ret = -1;
+
+    for (ptr = block_list; ptr && ret == 0; ptr = ptr->next) {
+        snprintf (sql, sizeof(sql),
+                  "REPLACE INTO TransferBlock (repo_id, block_id, sent) "
+                  "VALUES ('%s', '%s', 0)", repo_id, (char *)ptr->data);
+        if (sqlite_query_exec (journal->db, sql) < 0)
+            ret = -1;
+    }
+
+    if (ret == 0)
+        ret = set_task_phase (journal, repo_id, TRANSFER_JOURNAL_UPLOAD, head,
+                              PHASE_UPLOAD_BLOCKS);
+
+    if (ret == 0)
+        ret = sqlite_end_transaction (journal->db);
+    else
+        sqlite_query_exec (journal->db, "ROLLBACK TRANSACTION;");
+
+out:
+    pthread_mutex_unlock (&journal->lock);
+    return ret;
+}
+
+void
+transfer_journal_block_sent (TransferJournal *journal,
+                             const char *repo_id, const char *block_id)
+{
+    char sql[256];
+
+    if (!journal)
+        return;
+
+    snprintf (sql, sizeof(sql),
+              "UPDATE TransferBlock SET sent=1 WHERE repo_id='%s' AND block_id='%s'",
+              repo_id, block_id);
+
+    pthread_mutex_lock (&journal->lock);
+    sqlite_query_exec (journal->db, sql);
+    pthread_mutex_unlock (&journal->lock);
+}
+
+void
+transfer_journal_blocks_sent (TransferJournal *journal,
+                              const char *repo_id, GList *block_ids)
+{
+    char sql[256];
+    GList *ptr;
+    int ret = 0;
+
+    if (!journal || !block_ids)
+        return;
+
+    pthread_mutex_lock (&journal->lock);
+
+    if (sqlite_begin_transaction (journal->db) < 0) {
+        pthread_mutex_unlock (&journal->lock);
+        return;
+    }
+
+    for (ptr = block_ids; ptr; ptr = ptr->next) {
+        snprintf (sql, sizeof(sql),
+                  "UPDATE TransferBlock SET sent=1 WHERE repo_id='%s' AND block_id='%s'",
+                  repo_id, (char *)ptr->data);
+        if (sqlite_query_exec (journal->db, sql) < 0) {
+            ret = -1;
+            break;
+        }
+    }
+
+    if (ret == 0)
+        sqlite_end_transaction (journal->db);
+    else
+        sqlite_query_exec (journal->db, "ROLLBACK TRANSACTION;");
+
+    pthread_mutex_unlock (&journal->lock);
+}
+
+gboolean
+transfer_journal_fs_fetched (TransferJournal *journal,
+                             const char *repo_id, const char *head)
+{
+    gboolean ret;
+
+    if (!journal)
+        return FALSE;
+
+    pthread_mutex_lock (&journal->lock);
+    ret = task_in_phase (journal, repo_id, TRANSFER_JOURNAL_DOWNLOAD, head,
+                         PHASE_FS_FETCHED);
+    pthread_mutex_unlock (&journal->lock);
+
+    return ret;
+}
+
+void
+transfer_journal_set_fs_fetched (TransferJournal *journal,
+                                 const char *repo_id, const char *head)
+{
+    if (!journal)
+        return;
+
+    pthread_mutex_lock (&journal->lock);
+    set_task_phase (journal, repo_id, TRANSFER_JOURNAL_DOWNLOAD, head,
+                    PHASE_FS_FETCHED);
+    pthread_mutex_unlock (&journal->lock);
+}
+
+static char *
+partial_block_path (TransferJournal *journal,
+                    const char *repo_id, const char *block_id)
+{
+    char *name = g_strconcat (repo_id, "-", block_id, NULL);
+    char *path = g_build_filename (journal->partial_dir, name, NULL);
+
+    g_free (name);
+    return path;
+}
+
+static void
+remove_partial_block_file (TransferJournal *journal,
+                           const char *repo_id, const char *block_id)
+{
+    char *path = partial_block_path (journal, repo_id, block_id);
+
+    if (seaf_util_unlink (path) < 0 && errno != ENOENT)
+        seaf_warning ("Failed to remove %s: %s.\n", path, strerror(errno));
+    g_free (path);
+}
+
+static gboolean
+remove_partial_block_row (sqlite3_stmt *stmt, void *data)
+{
+    TransferJournal *journal = data;
+    const char *repo_id = (const char *)sqlite3_column_text (stmt, 0);
+    const char *block_id = (const char *)sqlite3_column_text (stmt, 1);
+
+    remove_partial_block_file (journal, repo_id, block_id);
+    return TRUE;
+}
+
+void
+transfer_journal_remove (TransferJournal *journal,
+                         const char *repo_id, int type)
+{
+    char sql[256];
+
+    if (!journal)
+        return;
+
+    pthread_mutex_lock (&journal->lock);
+
+    snprintf (sql, sizeof(sql),
+              "DELETE FROM TransferTask WHERE repo_id='%s' AND type=%d",
+              repo_id, type);
+    sqlite_query_exec (journal->db, sql);
+
+    if (type == TRANSFER_JOURNAL_UPLOAD) {
+        snprintf (sql, sizeof(sql),
+                  "DELETE FROM TransferBlock WHERE repo_id='%s'", repo_id);
+        sqlite_query_exec (journal->db, sql);
+    } else {
+        snprintf (sql, sizeof(sql),
+                  "SELECT repo_id, block_id FROM PartialBlock WHERE repo_id='%s'",
+                  repo_id);
+        sqlite_foreach_selected_row (journal->db, sql,
+                                     remove_partial_block_row, journal);
+        snprintf (sql, sizeof(sql),
+                  "DELETE FROM PartialBlock WHERE repo_id='%s'", repo_id);
+        sqlite_query_exec (journal->db, sql);
+    }
+
+    pthread_mutex_unlock (&journal->lock);
+}
+
+char *
+transfer_journal_load_partial_block (TransferJournal *journal,
+                                     const char *repo_id, const char *block_id,
+                                     gsize *len)
+{
+    char sql[256];
+    char *path = NULL;
+    char *data = NULL;
+    gint64 size;
+
+    if (!journal)
+        return NULL;
+
+    pthread_mutex_lock (&journal->lock);
+
+    snprintf (sql, sizeof(sql),
+              "SELECT size FROM PartialBlock WHERE repo_id='%s' AND block_id='%s' "
+              "AND mtime>%"G_GINT64_FORMAT,
+              repo_id, block_id, (gint64)time(NULL) - JOURNAL_LIFETIME);
+    size = sqlite_get_int64 (journal->db, sql);
+    if (size <= 0)
+        goto out;
+
+    path = partial_block_path (journal, repo_id, block_id);
+    if (!g_file_get_contents (path, &data, len, NULL))
+        goto out;
+
+    /* Only trust data that was completely written. */
+    if (*len != size) {
+        g_free (data);
+        data = NULL;
+    }
+
+out:
+    pthread_mutex_unlock (&journal->lock);
+    g_free (path);
+    return data;
+}
+
+void
+transfer_journal_save_partial_block (TransferJournal *journal,
+                                     const char *repo_id, const char *block_id,
+                                     const char *data, gsize len)
+{
+    char sql[256];
+    char *path;
+    GError *error = NULL;
+
+    if (!journal)
+        return;
+
+    if (checkdir_with_mkdir (journal->partial_dir) < 0) {
+        seaf_warning ("Failed to create %s.\n", journal->partial_dir);
+        return;
+    }
+
+    path = partial_block_path (journal, repo_id, block_id);
+
+    pthread_mutex_lock (&journal->lock);
+
+    if (!g_file_set_contents (path, data, len, &error)) {
+        seaf_warning ("Failed to write %s: %s.\n", path, error->message);
+        g_clear_error (&error);
+        goto out;
+    }
+
+    snprintf (sql, sizeof(sql),
+              "REPLACE INTO PartialBlock (repo_id, block_id, size, mtime) "
+              "VALUES ('%s', '%s', %"G_GINT64_FORMAT", %"G_GINT64_FORMAT")",
+              repo_id, block_id, (gint64)len, (gint64)time(NULL));
+    sqlite_query_exec (journal->db, sql);
+
+out:
+    pthread_mutex_unlock (&journal->lock);
+    g_free (path);
+}
+
+void
+transfer_journal_remove_partial_block (TransferJournal *journal,
+                                       const char *repo_id,
+                                       const char *block_id)
+{
+    char sql[256];
+
+    if (!journal)
+        return;
+
+    pthread_mutex_lock (&journal->lock);
+
+    snprintf (sql, sizeof(sql),
+              "DELETE FROM PartialBlock WHERE repo_id='%s' AND block_id='%s'",
+              repo_id, block_id);
+    sqlite_query_exec (journal->db, sql);
+    remove_partial_block_file (journal, repo_id, block_id);
+
+    pthread_mutex_unlock (&journal->lock);
+}
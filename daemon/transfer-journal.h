@@ -0,0 +1,90 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef TRANSFER_JOURNAL_H
+#define TRANSFER_JOURNAL_H
+
+#include <glib.h>
+
+/*
+ * Records the progress of sync transfers in SQLite, so that an interrupted
+ * upload or download can continue where it stopped instead of starting
+ * over.
+ *
+ * - Uploads: once the fs objects of a head commit are sent, the blocks
+ *   still to be sent are recorded, and each block is marked as it's sent.
+ *   The next upload of the same head skips straight to the blocks that
+ *   are left.
+ * - Downloads: a head commit whose fs objects have all been fetched is
+ *   recorded, so that fetching them isn't started again.
+ * - Blocks: the data received for a block before the connection broke is
+ *   kept, so that the download can be resumed with a range request.
+ *
+ * Progress older than a day is ignored, in case the server has cleaned up
+ * uploaded blocks that no commit refers to. All functions accept a NULL
+ * journal.
+ */
+
+typedef struct TransferJournal TransferJournal;
+
+enum {
+    TRANSFER_JOURNAL_UPLOAD = 0,
+    TRANSFER_JOURNAL_DOWNLOAD,
+};
+
+TransferJournal *
+transfer_journal_open (const char *seaf_dir);
+
+/* Returns TRUE and the blocks that are left to send, if the upload of
+ * @head was interrupted after its fs objects were sent.
+ */
+gboolean
+transfer_journal_get_upload_blocks (TransferJournal *journal,
+                                    const char *repo_id, const char *head,
+                                    GList **block_list);
+
+int
+transfer_journal_start_upload_blocks (TransferJournal *journal,
+                                      const char *repo_id, const char *head,
+                                      GList *block_list);
+
+void
+transfer_journal_block_sent (TransferJournal *journal,
+                             const char *repo_id, const char *block_id);
+
+/* Marks all of @block_ids as sent in one transaction. */
+void
+transfer_journal_blocks_sent (TransferJournal *journal,
+                              const char *repo_id, GList *block_ids);
+
+gboolean
+transfer_journal_fs_fetched (TransferJournal *journal,
+                             const char *repo_id, const char *head);
+
+void
+transfer_journal_set_fs_fetched (TransferJournal *journal,
+                                 const char *repo_id, const char *head);
+
+/* Forget the progress of an upload or download of @repo_id. Partial blocks
+ * are removed with downloads.
+ */
+void
+transfer_journal_remove (TransferJournal *journal,
+                         const char *repo_id, int type);
+
+/* Returns the data received so far for @block_id, or NULL. */
+char *
+transfer_journal_load_partial_block (TransferJournal *journal,
+                                     const char *repo_id, const char *block_id,
+                                     gsize *len);
+
+void
+transfer_journal_save_partial_block (TransferJournal *journal,
+                                     const char *repo_id, const char *block_id,
+                                     const char *data, gsize len);
+
+void
+transfer_journal_remove_partial_block (TransferJournal *journal,
+                                       const char *repo_id,
+                                       const char *block_id);
+
+#endif
@@ -0,0 +1,365 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#ifdef WIN32
+#define COBJMACROS
+#include <windows.h>
+#include <initguid.h>
+#include <netlistmgr.h>
+#elif defined __APPLE__
+#include <CoreFoundation/CoreFoundation.h>
+#include <IOKit/ps/IOPowerSources.h>
+#include <IOKit/ps/IOPSKeys.h>
+#endif
+
+#include "seafile-session.h"
+#include "transfer-policy.h"
+#include "log.h"
+
+#define POLICY_CHECK_INTERVAL 30
+
+static const char *condition_names[] = {
+    "metered",
+    "battery",
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+/* -1 if not known. */
+static int detected[N_TRANSFER_CONDITIONS] = { -1, -1 };
+/* Forced state, -1 if detected. */
+static int overrides[N_TRANSFER_CONDITIONS] = { -1, -1 };
+static gint64 checked_at;
+/* Set while the conditions are detected on a job thread. */
+static gboolean detecting;
+
+/* Effective state of each condition, read without lock by the transfer
+ * threads. */
+static gint active[N_TRANSFER_CONDITIONS];
+
+#ifdef WIN32
+
+static int
+detect_battery ()
+{
+    SYSTEM_POWER_STATUS status;
+
+    if (!GetSystemPowerStatus (&status) || status.ACLineStatus == 255)
+        return -1;
+    return (status.ACLineStatus == 0);
+}
+
+static int
+detect_metered ()
+{
+    INetworkCostManager *mgr = NULL;
+    DWORD cost = 0;
+    HRESULT init, hr;
+    int ret = -1;
+
+    init = CoInitializeEx (NULL, COINIT_MULTITHREADED);
+
+    hr = CoCreateInstance (&CLSID_NetworkListManager, NULL, CLSCTX_ALL,
+                           &IID_INetworkCostManager, (void **)&mgr);
+    if (SUCCEEDED(hr)) {
+        if (SUCCEEDED(INetworkCostManager_GetCost (mgr, &cost, NULL)))
+            ret = ((cost & (NLM_CONNECTION_COST_FIXED |
+                            NLM_CONNECTION_COST_VARIABLE |
+                            NLM_CONNECTION_COST_OVERDATALIMIT |
+                            NLM_CONNECTION_COST_ROAMING)) != 0);
+        INetworkCostManager_Release (mgr);
+    }
+
+    if (SUCCEEDED(init))
+        CoUninitialize ();
+
+    return ret;
+}
+
+#elif defined __APPLE__
+
+static int
+detect_battery ()
+{
+    CFTypeRef info;
+    CFStringRef type;
+    int ret = -1;
+
+    info = IOPSCopyPowerSourcesInfo ();
+    if (!info)
+        return -1;
+
+    type = IOPSGetProvidingPowerSourceType (info);
+    if (type)
+        ret = (CFStringCompare (type, CFSTR(kIOPSBatteryPowerValue), 0) ==
+               kCFCompareEqualTo);
+
+    CFRelease (info);
+    return ret;
+}
+
+static int
+detect_metered ()
+{
+    return -1;
+}
+
+#else
+
+static char *
+read_power_supply_file (const char *supply, const char *name)
+{
+    char *path, *contents = NULL;
+
+    path = g_build_filename ("/sys/class/power_supply", supply, name, NULL);
+    if (g_file_get_contents (path, &contents, NULL, NULL))
+        g_strstrip (contents);
+    g_free (path);
+
+    return contents;
+}
+
+static int
+detect_battery ()
+{
+    GDir *dir;
+    const char *supply;
+    char *type, *value;
+    gboolean has_battery = FALSE, on_mains = FALSE, discharging = FALSE;
+
+    dir = g_dir_open ("/sys/class/power_supply", 0, NULL);
+    if (!dir)
+        return -1;
+
+    while ((supply = g_dir_read_name (dir)) != NULL) {
+        type = read_power_supply_file (supply, "type");
+        if (g_strcmp0 (type, "Mains") == 0) {
+            value = read_power_supply_file (supply, "online");
+            if (g_strcmp0 (value, "1") == 0)
+                on_mains = TRUE;
+            g_free (value);
+        } else if (g_strcmp0 (type, "Battery") == 0) {
+            has_battery = TRUE;
+            value = read_power_supply_file (supply, "status");
+            if (g_strcmp0 (value, "Discharging") == 0)
+                discharging = TRUE;
+            g_free (value);
+        }
+        g_free (type);
+    }
+    g_dir_close (dir);
+
+    if (!has_battery)
+        return 0;
+    return (discharging && !on_mains);
+}
+
+/* NetworkManager's Metered property: 1 and 3 are yes and guessed yes, 2
+ * and 4 no and guessed no. Only one detection runs at a time.
+ */
+static int
+detect_metered ()
+{
+    static gboolean unavailable = FALSE;
+    char *argv[] = {
+        "busctl", "--system", "get-property",
+        "org.freedesktop.NetworkManager",
+        "/org/freedesktop/NetworkManager",
+        "org.freedesktop.NetworkManager",
+        "Metered",
+        NULL,
+    };
+    char *output = NULL;
+    int status;
+    int value = 0;
+    int ret = -1;
+
+    if (unavailable)
+        return -1;
+
+    if (!g_spawn_sync (NULL, argv, NULL,
+                       G_SPAWN_SEARCH_PATH | G_SPAWN_STDERR_TO_DEV_NULL,
+                       NULL, NULL, &output, NULL, &status, NULL)) {
+        /* Not installed, don't try again. */
+        unavailable = TRUE;
+        return -1;
+    }
+
+    if (status != 0) {
+        /* No system bus or no NetworkManager, this won't change. */
+        seaf_message ("Metered network detection is not available.\n");
+        unavailable = TRUE;
+        g_free (output);
+        return -1;
+    }
+
+    if (output && sscanf (output, "u %d", &value) == 1) {
+        if (value == 1 || value == 3)
+            ret = 1;
+        else if (value == 2 || value == 4)
+            ret = 0;
+    }
+
+    g_free (output);
+    return ret;
+}
+
+#endif
+
+/* Called with lock held. */
+static void
+update_active ()
+{
+    int i, value;
+
+    for (i = 0; i < N_TRANSFER_CONDITIONS; ++i) {
+        value = (overrides[i] >= 0) ? overrides[i] : (detected[i] > 0);
+        if (value != g_atomic_int_get (&active[i]))
+            seaf_message ("Transfer condition %s is now %s.\n",
+                          condition_names[i], value ? "on" : "off");
+        g_atomic_int_set (&active[i], value);
+    }
+}
+
+void
+seaf_transfer_policy_set_override (int condition, int value)
+{
+    if (condition < 0 || condition >= N_TRANSFER_CONDITIONS)
+        return;
+
+    pthread_mutex_lock (&lock);
+    overrides[condition] = (value < 0) ? -1 : (value != 0);
+    update_active ();
+    pthread_mutex_unlock (&lock);
+}
+
+typedef struct DetectResult {
+    int battery;
+    int metered;
+} DetectResult;
+
+/* May spawn a process or wait for the system, so not run in the main
+ * thread.
+ */
+static void *
+detect_conditions_job (void *vdata)
+{
+    DetectResult *result = vdata;
+
+    result->battery = detect_battery ();
+    result->metered = detect_metered ();
+
+    return result;
+}
+
+static void
+detect_conditions_done (void *vdata)
+{
+    DetectResult *result = vdata;
+
+    pthread_mutex_lock (&lock);
+    detected[TRANSFER_CONDITION_BATTERY] = result->battery;
+    detected[TRANSFER_CONDITION_METERED] = result->metered;
+    detecting = FALSE;
+    update_active ();
+    pthread_mutex_unlock (&lock);
+
+    g_free (result);
+}
+
+void
+seaf_transfer_policy_update ()
+{
+    gint64 now = (gint64)time(NULL);
+    DetectResult *result;
+
+    pthread_mutex_lock (&lock);
+    if (detecting || now - checked_at < POLICY_CHECK_INTERVAL) {
+        pthread_mutex_unlock (&lock);
+        return;
+    }
+    checked_at = now;
+    detecting = TRUE;
+    pthread_mutex_unlock (&lock);
+
+    result = g_new0 (DetectResult, 1);
+    if (seaf_job_manager_schedule_job (seaf->job_mgr,
+                                       detect_conditions_job,
+                                       detect_conditions_done,
+                                       result) < 0) {
+        seaf_warning ("Failed to schedule detecting transfer conditions.\n");
+        pthread_mutex_lock (&lock);
+        detecting = FALSE;
+        pthread_mutex_unlock (&lock);
+        g_free (result);
+    }
+}
+
+gboolean
+seaf_transfer_policy_defer_heavy ()
+{
+    return (g_atomic_int_get (&active[TRANSFER_CONDITION_METERED]) ||
+            g_atomic_int_get (&active[TRANSFER_CONDITION_BATTERY]));
+}
+
+/* The stricter of two limits, where 0 is no limit. */
+static gint
+min_limit (gint a, gint b)
+{
+    if (a <= 0)
+        return MAX (b, 0);
+    if (b <= 0)
+        return a;
+    return MIN (a, b);
+}
+
+gint
+seaf_transfer_policy_get_upload_limit ()
+{
+    gint limit = seaf->sync_mgr->upload_limit;
+
+    if (g_atomic_int_get (&active[TRANSFER_CONDITION_METERED]))
+        limit = min_limit (limit, seaf->metered_upload_limit);
+    return limit;
+}
+
+gint
+seaf_transfer_policy_get_download_limit ()
+{
+    gint limit = seaf->sync_mgr->download_limit;
+
+    if (g_atomic_int_get (&active[TRANSFER_CONDITION_METERED]))
+        limit = min_limit (limit, seaf->metered_download_limit);
+    return limit;
+}
+
+json_t *
+seaf_transfer_policy_to_json ()
+{
+    json_t *object, *condition;
+    int i;
+
+    object = json_object ();
+
+    pthread_mutex_lock (&lock);
+    for (i = 0; i < N_TRANSFER_CONDITIONS; ++i) {
+        condition = json_object ();
+        json_object_set_new (condition, "detected", json_integer (detected[i]));
+        json_object_set_new (condition, "override", json_integer (overrides[i]));
+        json_object_set_new (condition, "active",
+                             json_boolean (g_atomic_int_get (&active[i])));
+        json_object_set_new (object, condition_names[i], condition);
+    }
+    pthread_mutex_unlock (&lock);
+
+    json_object_set_new (object, "defer_heavy",
+                         json_boolean (seaf_transfer_policy_defer_heavy ()));
+    json_object_set_new (object, "upload_limit",
+                         json_integer (seaf_transfer_policy_get_upload_limit ()));
+    json_object_set_new (object, "download_limit",
+                         json_integer (seaf_transfer_policy_get_download_limit ()));
+
+    return object;
+}
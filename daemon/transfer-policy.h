@@ -0,0 +1,59 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef TRANSFER_POLICY_H
+#define TRANSFER_POLICY_H
+
+#include <glib.h>
+#include <jansson.h>
+
+/*
+ * Transfers on battery power and metered connections.
+ *
+ * On a metered connection (a phone hotspot, a mobile plan) or on battery,
+ * syncs that are expected to move a lot of data are deferred; light syncs,
+ * such as a few edited files, and manual syncs still run. On a metered
+ * connection, all transfers are additionally limited to
+ * metered_upload_limit and metered_download_limit bytes per second, on top
+ * of upload_limit and download_limit.
+ *
+ * Battery state comes from /sys/class/power_supply on Linux, IOKit on
+ * macOS and GetSystemPowerStatus on Windows. Metered connections are
+ * detected with NetworkManager on Linux and the network cost of Windows;
+ * there's no detection on macOS. Either state can be forced on or off with
+ * the metered_override and battery_override configs.
+ */
+
+enum {
+    TRANSFER_CONDITION_METERED,
+    TRANSFER_CONDITION_BATTERY,
+    N_TRANSFER_CONDITIONS,
+};
+
+/* -1 to detect the condition, 0 or 1 to force it off or on. */
+void
+seaf_transfer_policy_set_override (int condition, int value);
+
+/* Detects the state again on a job thread, at most every 30 seconds.
+ * Called by the sync pulse in the main thread.
+ */
+void
+seaf_transfer_policy_update ();
+
+/* Whether syncs that move a lot of data are deferred. */
+gboolean
+seaf_transfer_policy_defer_heavy ();
+
+/* Effective rate limits in bytes per second, 0 for none. */
+gint
+seaf_transfer_policy_get_upload_limit ();
+
+gint
+seaf_transfer_policy_get_download_limit ();
+
+/* Returns the detected and overridden state of each condition, whether
+ * heavy syncs are deferred and the effective limits.
+ */
+json_t *
+seaf_transfer_policy_to_json ();
+
+#endif
@@ -16,6 +16,15 @@
 #include "vc-utils.h"
 #include "vc-common.h"
 #include "index/index.h"
+#include "metrics.h"
+#include "content-index.h"
+#include "file-id-cache.h"
+#include "chunk-policy.h"
+#include "diff-simple.h"
+
+#ifdef WIN32
+#include <restartmanager.h>
+#endif
 
 static gint
 compare_dirents (gconstpointer a, gconstpointer b)
@@ -47,7 +56,7 @@ commit_trees_cb (const char *repo_id, int version,
         unsigned mode;
         guint64 mtime;
         gint64 size;
-        char *modifier;
+        const char *modifier;
 
         if (ce->ce_flags & CE_REMOVE)
             continue; /* entry being removed */
@@ -137,13 +146,21 @@ commit_trees_cb (const char *repo_id, int version,
     return 0;
 }
 
-int
-update_index (struct index_state *istate, const char *index_path)
+static int
+do_update_index (struct index_state *istate, const char *index_path)
 {
     char index_shadow[SEAF_PATH_MAX];
     int index_fd;
     int ret = 0;
 
+    /* Large indexes only get the changed entries appended. */
+    ret = write_index_delta (istate, index_path);
+    if (ret == 0)
+        return 0;
+    if (ret < 0)
+        seaf_warning ("Failed to append to index delta log, rewrite %s.\n",
+                      index_path);
+
     snprintf (index_shadow, SEAF_PATH_MAX, "%s.shadow", index_path);
     index_fd = seaf_util_create (index_shadow, O_RDWR | O_CREAT | O_TRUNC | O_BINARY,
                                  0666);
@@ -162,11 +179,35 @@ update_index (struct index_state *istate, const char *index_path)
     ret = seaf_util_rename (index_shadow, index_path);
     if (ret < 0) {
         seaf_warning ("Failed to update index errno=%d %s\n", errno, strerror(errno));
+        /* The old index is still there, don't append to it. */
+        istate->delta_broken = 1;
         return -1;
     }
+
+    /* Folded into the new index. If this fails, the stale log is ignored
+     * on read since it names the old index.
+     */
+    remove_index_delta (index_path);
     return 0;
 }
 
+int
+update_index (struct index_state *istate, const char *index_path)
+{
+    gint64 start = seaf_metrics_now ();
+    int ret;
+
+    ret = do_update_index (istate, index_path);
+    /* The index on disk is the same as in memory now. */
+    if (ret == 0)
+        istate->cache_changed = 0;
+    seaf_metric_observe_since (seaf_metric_get (SEAF_METRIC_HISTOGRAM,
+                                                "seaf_index_write_usec", NULL),
+                               start);
+
+    return ret;
+}
+
 #ifndef WIN32
 
 int
@@ -280,8 +321,10 @@ out:
 
 #endif  /* WIN32 */
 
+/* If @repo_id is not NULL, the blocks are added to its content index. */
 static int
-compute_file_id_with_cdc (const char *path, SeafStat *st,
+compute_file_id_with_cdc (const char *repo_id,
+                          const char *path, SeafStat *st,
                           SeafileCrypt *crypt, int repo_version,
                           uint32_t blk_avg_size, uint32_t blk_min_size, uint32_t blk_max_size,
                           unsigned char sha1[])
@@ -293,8 +336,11 @@ compute_file_id_with_cdc (const char *path, SeafStat *st,
     cdc.block_min_sz = blk_min_size;
     cdc.block_max_sz = blk_max_size;
     cdc.write_block = seafile_write_chunk;
+    cdc.keep_blk_lens = (repo_id != NULL && !seaf->disable_block_hash);
     if (filename_chunk_cdc (path, &cdc, crypt, FALSE) < 0) {
         seaf_warning ("Failed to chunk file.\n");
+        free (cdc.blk_sha1s);
+        free (cdc.blk_lens);
         return -1;
     }
 
@@ -303,6 +349,15 @@ compute_file_id_with_cdc (const char *path, SeafStat *st,
     else
         memcpy (sha1, cdc.file_sum, 20);
 
+    if (cdc.blk_lens) {
+        FileBlockMap block_map;
+        block_map.n_blocks = cdc.block_nr;
+        block_map.blk_sha1s = cdc.blk_sha1s;
+        block_map.blk_lens = cdc.blk_lens;
+        seaf_content_index_add_file (repo_id, path, &block_map);
+        free (cdc.blk_lens);
+    }
+
     if (cdc.blk_sha1s)
         free (cdc.blk_sha1s);
 
@@ -310,17 +365,42 @@ compute_file_id_with_cdc (const char *path, SeafStat *st,
 }
 
 int
-compare_file_content (const char *path, SeafStat *st, const unsigned char *ce_sha1,
+compare_file_content (const char *repo_id,
+                      const char *path, SeafStat *st, const unsigned char *ce_sha1,
                       SeafileCrypt *crypt, int repo_version)
 {
     unsigned char sha1[20];
+    guint32 fixed_size = 0;
+    gint64 size;
 
     if (st->st_size == 0) {
         memset (sha1, 0, 20);
         return hashcmp (sha1, ce_sha1);
     } else {
+        if (seaf_file_id_cache_lookup (repo_id, st, sha1) &&
+            hashcmp (sha1, ce_sha1) == 0)
+            return 0;
+
+        /* Files the chunking policy applies to are usually big, so check
+         * their fixed-size id before chunking them with CDC.
+         */
+        if (repo_version > 0)
+            fixed_size = chunk_policy_get_block_size (repo_id, path,
+                                                      st->st_size);
+        if (fixed_size > 0) {
+            if (seaf_fs_manager_index_blocks (seaf->fs_mgr, repo_id,
+                                              repo_version, path, sha1,
+                                              &size, crypt, FALSE, FALSE,
+                                              FALSE, fixed_size, NULL) < 0)
+                return -1;
+            if (hashcmp (sha1, ce_sha1) == 0) {
+                seaf_file_id_cache_add (repo_id, path, st, sha1);
+                return 0;
+            }
+        }
+
         if (seaf->cdc_average_block_size == 0) {
-            if (compute_file_id_with_cdc (path, st, crypt, repo_version,
+            if (compute_file_id_with_cdc (repo_id, path, st, crypt, repo_version,
                                           CDC_AVERAGE_BLOCK_SIZE,
                                           CDC_MIN_BLOCK_SIZE,
                                           CDC_MAX_BLOCK_SIZE,
@@ -328,7 +408,7 @@ compare_file_content (const char *path, SeafStat *st, const unsigned char *ce_sh
                 return -1;
             }
         } else {
-            if (compute_file_id_with_cdc (path, st, crypt, repo_version,
+            if (compute_file_id_with_cdc (repo_id, path, st, crypt, repo_version,
                                           seaf->cdc_average_block_size,
                                           seaf->cdc_average_block_size >> 1,
                                           seaf->cdc_average_block_size << 1,
@@ -336,12 +416,13 @@ compare_file_content (const char *path, SeafStat *st, const unsigned char *ce_sh
                 return -1;
             }            
         }
+        seaf_file_id_cache_add (repo_id, path, st, sha1);
         if (hashcmp (sha1, ce_sha1) == 0)
             return 0;
 
         /* Compare with old cdc block size. */
         uint32_t block_size = calculate_chunk_size (st->st_size);
-        if (compute_file_id_with_cdc (path, st, crypt, repo_version,
+        if (compute_file_id_with_cdc (NULL, path, st, crypt, repo_version,
                                       block_size,
                                       block_size >> 2,
                                       block_size << 2,
@@ -595,55 +676,6 @@ do_check_dir_locked (const char *path, const char *worktree)
     return ret;
 }
 
-gboolean
-files_locked_on_windows (struct index_state *index, const char *worktree)
-{
-    gboolean ret = FALSE;
-    int i, entries;
-    struct cache_entry *ce;
-
-    entries = index->cache_nr;
-    for (i = 0; i < entries; ++i) {
-        ce = index->cache[i];
-        if (ce_stage(ce)) {
-            int mask = 0;
-
-            mask |= 1 << (ce_stage(ce) - 1);
-            while (i < entries) {
-                struct cache_entry *nce = index->cache[i];
-
-                if (strcmp(ce->name, nce->name))
-                    break;
-
-                mask |= 1 << (ce_stage(nce) - 1);
-                i++;
-            }
-            i--;
-
-            /* Check unmerged cases that can potentially
-               update or remove current files in the worktree.
-            */
-            if (mask == 7 ||    /* both changed */
-                mask == 6 ||    /* both added */
-                mask == 3)      /* others removed */
-            {
-                if (do_check_file_locked (ce->name, worktree, FALSE)) {
-                    ret = TRUE;
-                    break;
-                }
-            }
-        } else if (ce->ce_flags & CE_UPDATE ||
-                   ce->ce_flags & CE_WT_REMOVE) {
-            if (do_check_file_locked (ce->name, worktree, FALSE)) {
-                ret = TRUE;
-                break;
-            }
-        }
-    }
-
-    return ret;
-}
-
 #endif  /* WIN32 */
 
 #ifdef __APPLE__
@@ -701,3 +733,193 @@ out:
 }
 
 #endif
+
+#if defined WIN32 || defined __APPLE__
+
+/* A file found not in use is assumed to stay so for this long. */
+#define UNLOCKED_CACHE_SECONDS 30
+
+struct FileLockProbe {
+    char *worktree;
+    /* path -> monotonic time in seconds it was found not in use */
+    GHashTable *unlocked;
+};
+
+FileLockProbe *
+file_lock_probe_new (const char *worktree)
+{
+    FileLockProbe *probe = g_new0 (FileLockProbe, 1);
+
+    probe->worktree = g_strdup (worktree);
+    probe->unlocked = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                             g_free, NULL);
+
+    return probe;
+}
+
+void
+file_lock_probe_free (FileLockProbe *probe)
+{
+    if (!probe)
+        return;
+
+    g_free (probe->worktree);
+    g_hash_table_destroy (probe->unlocked);
+    g_free (probe);
+}
+
+static gint64
+now_seconds ()
+{
+    return g_get_monotonic_time () / G_USEC_PER_SEC;
+}
+
+static void
+add_unlocked (FileLockProbe *probe, const char *path)
+{
+    g_hash_table_replace (probe->unlocked, g_strdup (path),
+                          GSIZE_TO_POINTER ((gsize)now_seconds ()));
+}
+
+gboolean
+file_lock_probe_check (FileLockProbe *probe, const char *path,
+                       gboolean locked_on_server)
+{
+    gpointer value;
+
+    if (g_hash_table_lookup_extended (probe->unlocked, path, NULL, &value) &&
+        now_seconds () - (gint64)GPOINTER_TO_SIZE (value) < UNLOCKED_CACHE_SECONDS)
+        return FALSE;
+
+    if (do_check_file_locked (path, probe->worktree, locked_on_server))
+        return TRUE;
+
+    add_unlocked (probe, path);
+    return FALSE;
+}
+
+#ifdef WIN32
+
+/* Files registered with one Restart Manager session. */
+#define RM_BATCH_SIZE 256
+/* Batches with files in use are split in halves down to this size. The
+ * files of smaller ones are opened one by one when they're checked out.
+ */
+#define RM_MIN_BATCH_SIZE 16
+
+/* Returns TRUE if no program has any of @paths_w open. */
+static gboolean
+rm_files_unused (wchar_t **paths_w, guint n, gboolean *failed)
+{
+    DWORD session;
+    WCHAR key[CCH_RM_SESSION_KEY + 1];
+    UINT needed = 0, count = 0;
+    DWORD reasons = 0, rc;
+    gboolean ret = FALSE;
+
+    memset (key, 0, sizeof(key));
+    rc = RmStartSession (&session, 0, key);
+    if (rc != ERROR_SUCCESS) {
+        seaf_warning ("Failed to start restart manager session: %lu.\n", rc);
+        *failed = TRUE;
+        return FALSE;
+    }
+
+    rc = RmRegisterResources (session, n, (LPCWSTR *)paths_w,
+                              0, NULL, 0, NULL);
+    if (rc == ERROR_SUCCESS)
+        rc = RmGetList (session, &needed, &count, NULL, &reasons);
+
+    if (rc == ERROR_SUCCESS)
+        ret = (needed == 0);
+    else if (rc != ERROR_MORE_DATA) {
+        seaf_warning ("Failed to query restart manager: %lu.\n", rc);
+        *failed = TRUE;
+    }
+
+    RmEndSession (session);
+    return ret;
+}
+
+static void
+query_batch (FileLockProbe *probe, GPtrArray *paths, GPtrArray *paths_w,
+             guint start, guint n, gboolean *failed)
+{
+    guint i, half;
+
+    if (rm_files_unused ((wchar_t **)paths_w->pdata + start, n, failed)) {
+        for (i = start; i < start + n; ++i)
+            add_unlocked (probe, g_ptr_array_index (paths, i));
+        return;
+    }
+
+    if (*failed || n < 2 * RM_MIN_BATCH_SIZE)
+        return;
+
+    half = n / 2;
+    query_batch (probe, paths, paths_w, start, half, failed);
+    if (!*failed)
+        query_batch (probe, paths, paths_w, start + half, n - half, failed);
+}
+
+void
+file_lock_probe_prefetch (FileLockProbe *probe, GList *results)
+{
+    GPtrArray *paths, *paths_w;
+    GList *ptr;
+    DiffEntry *de;
+    char *full_path, *p;
+    wchar_t *path_w;
+    gboolean failed = FALSE;
+    guint i;
+
+    paths = g_ptr_array_new ();
+    paths_w = g_ptr_array_new_with_free_func (g_free);
+
+    for (ptr = results; ptr; ptr = ptr->next) {
+        de = ptr->data;
+        if (de->status != DIFF_STATUS_ADDED &&
+            de->status != DIFF_STATUS_MODIFIED &&
+            de->status != DIFF_STATUS_DELETED &&
+            de->status != DIFF_STATUS_RENAMED)
+            continue;
+
+        /* The restart manager doesn't take long paths. */
+        full_path = g_strconcat (probe->worktree, "/", de->name, NULL);
+        for (p = full_path; *p != 0; ++p)
+            if (*p == '/')
+                *p = '\\';
+        path_w = g_utf8_to_utf16 (full_path, -1, NULL, NULL, NULL);
+        g_free (full_path);
+        if (!path_w)
+            continue;
+        if (wcslen (path_w) >= MAX_PATH) {
+            g_free (path_w);
+            continue;
+        }
+
+        g_ptr_array_add (paths, de->name);
+        g_ptr_array_add (paths_w, path_w);
+    }
+
+    /* Opening a few files is faster than a restart manager session. */
+    if (paths->len >= RM_MIN_BATCH_SIZE) {
+        for (i = 0; i < paths->len && !failed; i += RM_BATCH_SIZE)
+            query_batch (probe, paths, paths_w, i,
+                         MIN (RM_BATCH_SIZE, paths->len - i), &failed);
+    }
+
+    g_ptr_array_free (paths, TRUE);
+    g_ptr_array_free (paths_w, TRUE);
+}
+
+#else
+
+void
+file_lock_probe_prefetch (FileLockProbe *probe, GList *results)
+{
+}
+
+#endif
+
+#endif
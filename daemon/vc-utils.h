@@ -43,11 +43,38 @@ do_check_file_locked (const char *path, const char *worktree, gboolean locked_on
 gboolean
 do_check_dir_locked (const char *path, const char *worktree);
 
+/*
+ * Checks whether worktree files are open in other programs during a
+ * checkout. A file found not in use isn't checked again for a while.
+ * Not thread safe.
+ */
+typedef struct FileLockProbe FileLockProbe;
+
+#if defined WIN32 || defined __APPLE__
+
+FileLockProbe *
+file_lock_probe_new (const char *worktree);
+
+void
+file_lock_probe_free (FileLockProbe *probe);
+
+/*
+ * Queries at once the files that the DiffEntry list @results writes,
+ * removes or renames. Only done on Windows, with the Restart Manager.
+ */
+void
+file_lock_probe_prefetch (FileLockProbe *probe, GList *results);
+
 gboolean
-files_locked_on_windows (struct index_state *index, const char *worktree);
+file_lock_probe_check (FileLockProbe *probe, const char *path,
+                       gboolean locked_on_server);
+
+#endif
 
+/* The blocks of @path are added to the content index of @repo_id. */
 int
-compare_file_content (const char *path, SeafStat *st, 
+compare_file_content (const char *repo_id,
+                      const char *path, SeafStat *st,
                       const unsigned char *ce_sha1,
                       struct SeafileCrypt *crypt,
                       int repo_version);
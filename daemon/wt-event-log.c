@@ -0,0 +1,202 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+#include <glib/gstdio.h>
+
+#include "wt-event-log.h"
+#include "log.h"
+
+#define WT_EVENT_LOG_HEADER "# seafile wt events v1"
+
+/* Indexed by event type. */
+static const char *type_names[] = {
+    "update",
+    "delete",
+    "rename",
+    "attrib",
+    "overflow",
+    "scan",
+};
+
+typedef struct EventLog {
+    FILE *fp;
+    gint64 start;
+} EventLog;
+
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+/* repo_id -> EventLog */
+static GHashTable *logs;
+static gint n_logs;
+
+static void
+event_log_free (EventLog *log)
+{
+    fclose (log->fp);
+    g_free (log);
+}
+
+int
+wt_event_log_start (const char *repo_id, const char *path)
+{
+    EventLog *log;
+    FILE *fp;
+
+    fp = g_fopen (path, "w");
+    if (!fp) {
+        seaf_warning ("Failed to open %s: %s.\n", path, strerror(errno));
+        return -1;
+    }
+    fprintf (fp, "%s\n", WT_EVENT_LOG_HEADER);
+
+    log = g_new0 (EventLog, 1);
+    log->fp = fp;
+    log->start = g_get_monotonic_time ();
+
+    pthread_mutex_lock (&log_lock);
+    if (!logs)
+        logs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                      (GDestroyNotify)event_log_free);
+    if (!g_hash_table_lookup (logs, repo_id))
+        g_atomic_int_inc (&n_logs);
+    g_hash_table_replace (logs, g_strdup (repo_id), log);
+    pthread_mutex_unlock (&log_lock);
+
+    seaf_message ("Recording worktree events of repo %.8s to %s.\n",
+                  repo_id, path);
+
+    return 0;
+}
+
+int
+wt_event_log_stop (const char *repo_id)
+{
+    int ret = -1;
+
+    pthread_mutex_lock (&log_lock);
+    if (logs && g_hash_table_remove (logs, repo_id)) {
+        g_atomic_int_add (&n_logs, -1);
+        ret = 0;
+    }
+    pthread_mutex_unlock (&log_lock);
+
+    if (ret == 0)
+        seaf_message ("Stopped recording worktree events of repo %.8s.\n",
+                      repo_id);
+
+    return ret;
+}
+
+void
+wt_event_log_record (const char *repo_id, const WTEvent *event)
+{
+    EventLog *log;
+    char *path, *new_path;
+
+    if (g_atomic_int_get (&n_logs) == 0)
+        return;
+    if (event->ev_type < 0 || event->ev_type >= G_N_ELEMENTS(type_names))
+        return;
+
+    path = g_strescape (event->path ? event->path : "", NULL);
+    new_path = g_strescape (event->new_path ? event->new_path : "", NULL);
+
+    pthread_mutex_lock (&log_lock);
+    log = logs ? g_hash_table_lookup (logs, repo_id) : NULL;
+    if (log) {
+        /* Flushed per event, as recordings are usually stopped by
+         * quitting the daemon.
+         */
+        fprintf (log->fp, "%"G_GINT64_FORMAT"\t%s\t%s\t%s\n",
+                 g_get_monotonic_time () - log->start,
+                 type_names[event->ev_type], path, new_path);
+        fflush (log->fp);
+    }
+    pthread_mutex_unlock (&log_lock);
+
+    g_free (path);
+    g_free (new_path);
+}
+
+static int
+parse_type (const char *name)
+{
+    int i;
+
+    for (i = 0; i < G_N_ELEMENTS(type_names); ++i) {
+        if (strcmp (type_names[i], name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+int
+wt_event_log_load (const char *path, GList **records)
+{
+    char *contents = NULL;
+    char **lines = NULL, **fields;
+    char *ev_path, *new_path;
+    WTEventRecord *record;
+    GList *list = NULL;
+    GError *error = NULL;
+    int i, type;
+    int ret = 0;
+
+    if (!g_file_get_contents (path, &contents, NULL, &error)) {
+        seaf_warning ("Failed to read %s: %s.\n", path, error->message);
+        g_clear_error (&error);
+        return -1;
+    }
+
+    if (!g_str_has_prefix (contents, WT_EVENT_LOG_HEADER "\n")) {
+        seaf_warning ("%s is not a worktree event recording.\n", path);
+        ret = -1;
+        goto out;
+    }
+
+    lines = g_strsplit (contents, "\n", -1);
+    for (i = 1; lines[i]; ++i) {
+        if (lines[i][0] == '\0' || lines[i][0] == '#')
+            continue;
+
+        fields = g_strsplit (lines[i], "\t", 4);
+        if (g_strv_length (fields) != 4 ||
+            (type = parse_type (fields[1])) < 0) {
+            seaf_warning ("Bad line %d in %s.\n", i + 1, path);
+            g_strfreev (fields);
+            ret = -1;
+            goto out;
+        }
+
+        ev_path = g_strcompress (fields[2]);
+        new_path = g_strcompress (fields[3]);
+
+        record = g_new0 (WTEventRecord, 1);
+        record->time = g_ascii_strtoll (fields[0], NULL, 10);
+        record->event = wt_event_new (type, ev_path,
+                                      new_path[0] ? new_path : NULL);
+        list = g_list_prepend (list, record);
+
+        g_free (ev_path);
+        g_free (new_path);
+        g_strfreev (fields);
+    }
+
+out:
+    if (ret < 0) {
+        g_list_free_full (list, (GDestroyNotify)wt_event_record_free);
+        list = NULL;
+    }
+    *records = g_list_reverse (list);
+    g_strfreev (lines);
+    g_free (contents);
+    return ret;
+}
+
+void
+wt_event_record_free (WTEventRecord *record)
+{
+    wt_event_free (record->event);
+    g_free (record);
+}
@@ -0,0 +1,44 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef WT_EVENT_LOG_H
+#define WT_EVENT_LOG_H
+
+#include <glib.h>
+
+#include "wt-monitor-structs.h"
+
+/*
+ * Recording of the worktree events of a repo, to replay them later with
+ * seaf-bench without the worktree or a server.
+ *
+ * Every event the monitor queues is written as one line with the time
+ * since the recording started in microseconds, the event type and the
+ * escaped paths, separated by tabs. Events are recorded before they're
+ * merged with queued ones, so a replay goes through the same merging.
+ * While nothing is recorded, queuing an event costs one check.
+ */
+
+typedef struct WTEventRecord {
+    gint64 time;
+    WTEvent *event;
+} WTEventRecord;
+
+/* Starts recording the events of @repo_id to @path, replacing the file. */
+int
+wt_event_log_start (const char *repo_id, const char *path);
+
+int
+wt_event_log_stop (const char *repo_id);
+
+/* Called by wt_status_add_event(). */
+void
+wt_event_log_record (const char *repo_id, const WTEvent *event);
+
+/* Reads a recording into a list of WTEventRecord, in recording order. */
+int
+wt_event_log_load (const char *path, GList **records);
+
+void
+wt_event_record_free (WTEventRecord *record);
+
+#endif
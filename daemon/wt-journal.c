@@ -0,0 +1,118 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include "seafile-session.h"
+#include "utils.h"
+#include "wt-journal.h"
+#include "log.h"
+
+#define JOURNAL_DIR "wt-journal"
+#define JOURNAL_GROUP "journal"
+
+static char *
+journal_path (const char *repo_id)
+{
+    return g_build_filename (seaf->seaf_dir, JOURNAL_DIR, repo_id, NULL);
+}
+
+int
+wt_journal_load (const char *repo_id, const char *worktree,
+                 char **source, gint64 *position)
+{
+    GKeyFile *key_file = g_key_file_new ();
+    char *path = journal_path (repo_id);
+    char *saved_worktree = NULL;
+    char *pos_str = NULL;
+    char *end;
+    int ret = -1;
+
+    *source = NULL;
+    *position = -1;
+
+    if (!g_key_file_load_from_file (key_file, path, 0, NULL))
+        goto out;
+
+    saved_worktree = g_key_file_get_string (key_file, JOURNAL_GROUP,
+                                            "worktree", NULL);
+    if (g_strcmp0 (saved_worktree, worktree) != 0)
+        goto out;
+
+    *source = g_key_file_get_string (key_file, JOURNAL_GROUP, "source", NULL);
+    pos_str = g_key_file_get_string (key_file, JOURNAL_GROUP, "position", NULL);
+    if (!*source || !pos_str)
+        goto out;
+
+    *position = (gint64)g_ascii_strtoull (pos_str, &end, 10);
+    if (*end != '\0' || *position < 0)
+        goto out;
+
+    ret = 0;
+
+out:
+    if (ret < 0) {
+        g_free (*source);
+        *source = NULL;
+        *position = -1;
+    }
+    g_free (saved_worktree);
+    g_free (pos_str);
+    g_free (path);
+    g_key_file_free (key_file);
+    return ret;
+}
+
+int
+wt_journal_save (const char *repo_id, const char *worktree,
+                 const char *source, gint64 position)
+{
+    GKeyFile *key_file = NULL;
+    char *dir = NULL, *path = NULL, *data = NULL;
+    char pos_str[32];
+    gsize len;
+    GError *error = NULL;
+    int ret = -1;
+
+    dir = g_build_filename (seaf->seaf_dir, JOURNAL_DIR, NULL);
+    if (checkdir_with_mkdir (dir) < 0) {
+        seaf_warning ("Failed to create worktree journal dir %s.\n", dir);
+        goto out;
+    }
+
+    key_file = g_key_file_new ();
+    snprintf (pos_str, sizeof(pos_str), "%"G_GINT64_FORMAT, position);
+    g_key_file_set_string (key_file, JOURNAL_GROUP, "worktree", worktree);
+    g_key_file_set_string (key_file, JOURNAL_GROUP, "source", source);
+    g_key_file_set_string (key_file, JOURNAL_GROUP, "position", pos_str);
+    data = g_key_file_to_data (key_file, &len, NULL);
+
+    /* g_file_set_contents() writes to a temp file and renames it, so a
+     * crash never leaves a truncated journal behind.
+     */
+    path = journal_path (repo_id);
+    if (!g_file_set_contents (path, data, len, &error)) {
+        seaf_warning ("Failed to write worktree journal for repo %.8s: %s.\n",
+                      repo_id, error->message);
+        g_clear_error (&error);
+        goto out;
+    }
+
+    ret = 0;
+
+out:
+    if (key_file)
+        g_key_file_free (key_file);
+    g_free (data);
+    g_free (path);
+    g_free (dir);
+    return ret;
+}
+
+void
+wt_journal_remove (const char *repo_id)
+{
+    char *path = journal_path (repo_id);
+
+    seaf_util_unlink (path);
+    g_free (path);
+}
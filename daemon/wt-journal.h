@@ -0,0 +1,28 @@
+#ifndef WT_JOURNAL_H
+#define WT_JOURNAL_H
+
+#include <glib.h>
+
+/*
+ * The worktree journal records, per repo, the position in the system's
+ * change history (FSEvents event id, USN, ...) up to which worktree
+ * changes are reflected in the index. On restart the monitor can replay
+ * changes since that position instead of scanning the whole worktree.
+ *
+ * @source identifies the history the position belongs to (e.g. the volume
+ * uuid). A position is only valid for the same source and worktree;
+ * wt_journal_load() fails if the journal was saved for another worktree.
+ */
+
+int
+wt_journal_load (const char *repo_id, const char *worktree,
+                 char **source, gint64 *position);
+
+int
+wt_journal_save (const char *repo_id, const char *worktree,
+                 const char *source, gint64 position);
+
+void
+wt_journal_remove (const char *repo_id);
+
+#endif
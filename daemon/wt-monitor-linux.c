@@ -1,10 +1,19 @@
 /* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE             /* open_by_handle_at() */
+#endif
 #include "common.h"
 
-#include <sys/select.h>
+#include <sys/epoll.h>
 #include <sys/inotify.h>
-#include <sys/ioctl.h>
 #include <dirent.h>
+#include <fcntl.h>
+
+#if defined HAVE_DECL_FAN_REPORT_DFID_NAME && HAVE_DECL_FAN_REPORT_DFID_NAME
+#define USE_FANOTIFY
+#include <sys/fanotify.h>
+#include <sys/vfs.h>
+#endif
 
 #include <sys/time.h>
 #include <sys/types.h>
@@ -12,6 +21,7 @@
 
 #include "job-mgr.h"
 #include "seafile-session.h"
+#include "seafile-config.h"
 #include "utils.h"
 #include "wt-monitor.h"
 #define DEBUG_FLAG SEAFILE_DEBUG_WATCH
@@ -40,16 +50,36 @@ typedef struct RepoWatchInfo {
     RenameInfo *rename_info;
     EventInfo last_event;
     char *worktree;
+    char *real_worktree;        /* canonical worktree path, fanotify only */
 } RepoWatchInfo;
 
 #define WATCH_MASK IN_MODIFY | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB
 
+/* Events are read from the inotify fd in chunks of this size. */
+#define INOTIFY_BUF_SIZE (256 * 1024)
+
+/*
+ * All repos share one inotify instance, so the number of watched repos is
+ * not limited by max_user_instances or by the number of fds we can poll.
+ * Events are dispatched to repos by watch descriptor. Normally one wd
+ * belongs to one repo, but it can be shared if worktrees overlap.
+ */
 struct SeafWTMonitorPriv {
     pthread_mutex_t hash_lock;
-    GHashTable *handle_hash;        /* repo_id -> inotify_fd */
-    GHashTable *info_hash;          /* inotify_fd -> RepoWatchInfo */
-    fd_set read_fds;
-    int maxfd;
+    GHashTable *handle_hash;        /* repo_id -> RepoWatchInfo */
+    GHashTable *wd_hash;            /* wd -> GList of RepoWatchInfo */
+    int inotify_fd;
+    int epoll_fd;
+    char *event_buf;
+    /* Repos with an unfinished rename in the current batch of events. */
+    GPtrArray *renaming;
+
+    /* fanotify mode: one mark per file system instead of one inotify
+     * watch per directory. fan_fd is -1 when inotify is used. */
+    int fan_fd;
+    GHashTable *fan_worktrees;      /* real worktree path -> RepoWatchInfo */
+    GList *fan_marks;               /* FanMark, one per marked file system */
+    GHashTable *fan_dir_cache;      /* file handle -> dir path, per batch */
 };
 
 static void *wt_monitor_job_linux (void *vmonitor);
@@ -57,7 +87,7 @@ static void *wt_monitor_job_linux (void *vmonitor);
 static void handle_watch_command (SeafWTMonitor *monitor, WatchCommand *cmd);
 
 static int
-add_watch_recursive (RepoWatchInfo *info, int in_fd,
+add_watch_recursive (SeafWTMonitorPriv *priv, RepoWatchInfo *info,
                      const char *worktree, const char *path,
                      gboolean add_events);
 
@@ -87,6 +117,40 @@ static void add_mapping (WatchPathMapping *mapping,
     g_hash_table_insert (mapping->wd_to_path, (gpointer)(long)wd, g_strdup(path));
 }
 
+/* wd -> repos */
+
+static void
+register_wd (SeafWTMonitorPriv *priv, RepoWatchInfo *info,
+             int wd, const char *path)
+{
+    GList *infos;
+
+    add_mapping (info->mapping, path, wd);
+
+    infos = g_hash_table_lookup (priv->wd_hash, (gpointer)(long)wd);
+    if (!g_list_find (infos, info)) {
+        infos = g_list_prepend (infos, info);
+        g_hash_table_insert (priv->wd_hash, (gpointer)(long)wd, infos);
+    }
+}
+
+/* Returns TRUE if no other repo uses @wd. */
+static gboolean
+unregister_wd (SeafWTMonitorPriv *priv, RepoWatchInfo *info, int wd)
+{
+    GList *infos;
+
+    infos = g_hash_table_lookup (priv->wd_hash, (gpointer)(long)wd);
+    infos = g_list_remove (infos, info);
+    if (infos) {
+        g_hash_table_insert (priv->wd_hash, (gpointer)(long)wd, infos);
+        return FALSE;
+    }
+
+    g_hash_table_remove (priv->wd_hash, (gpointer)(long)wd);
+    return TRUE;
+}
+
 /* RenameInfo */
 
 static RenameInfo *create_rename_info ()
@@ -144,6 +208,7 @@ free_repo_watch_info (RepoWatchInfo *info)
     free_mapping (info->mapping);
     free_rename_info (info->rename_info);
     g_free (info->worktree);
+    g_free (info->real_worktree);
     g_free (info);
 }
 
@@ -179,9 +244,7 @@ add_event_to_queue (WTStatus *status,
 
     seaf_debug ("Adding event: %s, %s %s\n", name, path, new_path?new_path:"");
 
-    pthread_mutex_lock (&status->q_lock);
-    g_queue_push_tail (status->event_q, event);
-    pthread_mutex_unlock (&status->q_lock);
+    wt_status_add_event (status, event);
 
     if (type == WT_EVENT_CREATE_OR_UPDATE) {
         pthread_mutex_lock (&status->ap_q_lock);
@@ -195,8 +258,8 @@ add_event_to_queue (WTStatus *status,
 }
 
 /*
- * We only recognize two consecutive "moved" events with the same cookie as
- * a rename pair. The processing logic is:
+ * We only recognize two consecutive "moved" events of a repo with the same
+ * cookie as a rename pair. The processing logic is:
  * 1. Receive a MOVED_FROM event, set last_cookie and old_path, set processing to TRUE
  * 2. If the next event is MOVED_TO, and with the same cookie, then add an
  *    WT_EVENT_RENAME event to the queue.
@@ -204,15 +267,16 @@ add_event_to_queue (WTStatus *status,
  *    create event
  *
  * This is a two-state state machine. The states are 'not processing rename' and
- * 'processing rename'.
+ * 'processing rename'. Rename event pairs should be in one batch of events,
+ * so a MOVED_FROM still pending at the end of a batch means the path was
+ * moved out of the repo. See flush_pending_renames().
  */
 static void
-handle_rename (int in_fd,
+handle_rename (SeafWTMonitorPriv *priv,
                RepoWatchInfo *info,
                struct inotify_event *event,
                const char *worktree,
-               const char *filename,
-               gboolean last_event)
+               const char *filename)
 {
     WTStatus *status = info->status;
     RenameInfo *rename_info = info->rename_info;
@@ -224,20 +288,13 @@ handle_rename (int in_fd,
 
     if (!rename_info->processing) {
         if (event->mask & IN_MOVED_FROM) {
-            if (!last_event) {
-                set_rename_processing_state (rename_info, event->cookie, filename);
-            } else {
-                /* Rename event pair should be in one batch of events.
-                 * If a MOVED_FROM event is the last event in a batch,
-                 * the path should be moved out of the repo.
-                 */
-                add_event_to_queue (status, WT_EVENT_DELETE, filename, NULL);
-            }
+            set_rename_processing_state (rename_info, event->cookie, filename);
+            g_ptr_array_add (priv->renaming, info);
         } else if (event->mask & IN_MOVED_TO) {
             /* A file/dir was moved into this repo. */
             /* Add watch and produce events. */
             add_event_to_queue (status, WT_EVENT_CREATE_OR_UPDATE, filename, NULL);
-            add_watch_recursive (info, in_fd, worktree, filename, FALSE);
+            add_watch_recursive (priv, info, worktree, filename, FALSE);
         }
     } else {
         if (event->mask & IN_MOVED_FROM) {
@@ -246,16 +303,10 @@ handle_rename (int in_fd,
              */
             add_event_to_queue (status, WT_EVENT_DELETE, rename_info->old_path, NULL);
 
-            if (!last_event) {
-                /* Stay in processing state. */
-                rename_info->last_cookie = event->cookie;
-                g_free (rename_info->old_path);
-                rename_info->old_path = g_strdup(filename);
-            } else {
-                /* Another file/dir was moved out of this repo. */
-                add_event_to_queue (status, WT_EVENT_DELETE, filename, NULL);
-                unset_rename_processing_state (rename_info);
-            }
+            /* Stay in processing state. */
+            rename_info->last_cookie = event->cookie;
+            g_free (rename_info->old_path);
+            rename_info->old_path = g_strdup(filename);
         } else if (event->mask & IN_MOVED_TO) {
             if (event->cookie == rename_info->last_cookie) {
                 /* Rename pair detected. */
@@ -271,7 +322,7 @@ handle_rename (int in_fd,
                                     filename, NULL);
             }
             /* Need to update wd -> path mapping. */
-            add_watch_recursive (info, in_fd, worktree, filename, FALSE);
+            add_watch_recursive (priv, info, worktree, filename, FALSE);
             unset_rename_processing_state (rename_info);
         } else {
             /* A file/dir was moved out of this repo, followed by another
@@ -283,6 +334,23 @@ handle_rename (int in_fd,
     }
 }
 
+static void
+flush_pending_renames (SeafWTMonitorPriv *priv)
+{
+    RepoWatchInfo *info;
+    guint i;
+
+    for (i = 0; i < priv->renaming->len; i++) {
+        info = g_ptr_array_index (priv->renaming, i);
+        if (!info->rename_info->processing)
+            continue;
+        add_event_to_queue (info->status, WT_EVENT_DELETE,
+                            info->rename_info->old_path, NULL);
+        unset_rename_processing_state (info->rename_info);
+    }
+    g_ptr_array_set_size (priv->renaming, 0);
+}
+
 inline static gboolean
 is_modify_close_write (EventInfo *e1, struct inotify_event *e2)
 {
@@ -313,34 +381,26 @@ handle_consecutive_duplicate_event (RepoWatchInfo *info, struct inotify_event *e
 #endif
 
 static void
-process_one_event (int in_fd,
+process_one_event (SeafWTMonitorPriv *priv,
                    RepoWatchInfo *info,
                    const char *worktree,
                    const char *parent,
-                   struct inotify_event *event,
-                   gboolean last_event)
+                   struct inotify_event *event)
 {
     WTStatus *status = info->status;
     char *filename;
     gboolean update_last_changed = TRUE;
     gboolean add_to_queue = TRUE;
 
-    /* An inotfy watch has been removed, we don't care about this for now. */
-    if ((event->mask & IN_IGNORED) || (event->mask & IN_UNMOUNT))
+    if (event->mask & IN_UNMOUNT)
         return;
 
-    /* Kernel event queue was overflowed, some events may lost. */
-    if (event->mask & IN_Q_OVERFLOW) {
-        add_event_to_queue (status, WT_EVENT_OVERFLOW, NULL, NULL);
-        return;
-    }
-
     /* if (handle_consecutive_duplicate_event (info, event)) */
     /*     add_to_queue = FALSE; */
 
     filename = g_build_filename (parent, event->name, NULL);
 
-    handle_rename (in_fd, info, event, worktree, filename, last_event);
+    handle_rename (priv, info, event, worktree, filename);
 
     if (event->mask & IN_MODIFY) {
         seaf_debug ("Modified %s.\n", filename);
@@ -374,7 +434,7 @@ process_one_event (int in_fd,
          * have to scan recursively and very few new files will be found.
          */
         add_event_to_queue (status, WT_EVENT_CREATE_OR_UPDATE, filename, NULL);
-        add_watch_recursive (info, in_fd, worktree, filename, FALSE);
+        add_watch_recursive (priv, info, worktree, filename, FALSE);
     } else if (event->mask & IN_DELETE) {
         seaf_debug ("Deleted %s.\n", filename);
         add_event_to_queue (status, WT_EVENT_DELETE, filename, NULL);
@@ -390,63 +450,424 @@ process_one_event (int in_fd,
 out:
     g_free (filename);
     if (update_last_changed)
-        g_atomic_int_set (&info->status->last_changed, (gint)time(NULL));
+        seaf_wt_monitor_mark_changed (info->status);
 }
 
-static gboolean
-process_events (SeafWTMonitorPriv *priv, const char *repo_id, int in_fd)
+/* Kernel event queue was overflowed, some events may be lost in any repo. */
+static void
+handle_overflow (SeafWTMonitorPriv *priv)
 {
-    char *event_buf = NULL;
-    unsigned int buf_size;
-    struct inotify_event *event;
+    GHashTableIter iter;
+    gpointer key, value;
     RepoWatchInfo *info;
-    int rc, n;
-    char *dir;
-    gboolean ret = FALSE;
 
-    rc = ioctl (in_fd, FIONREAD, &buf_size);
-    if (rc < 0) {
-        seaf_warning ("Cannot get inotify event buf size: %s.\n", strerror(errno));
-        return FALSE;
+    g_hash_table_iter_init (&iter, priv->handle_hash);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        info = value;
+        add_event_to_queue (info->status, WT_EVENT_OVERFLOW, NULL, NULL);
     }
-    event_buf = g_new (char, buf_size);
+}
 
-    n = readn (in_fd, event_buf, buf_size);
-    if (n < 0) {
-        seaf_warning ("Failed to read inotify fd: %s.\n", strerror(errno));
-        goto out;
-    } else if (n != buf_size) {
-        seaf_warning ("Read incomplete inotify event struct.\n");
-        goto out;
+/* The watch of a directory was removed, e.g. the directory was deleted. */
+static void
+handle_watch_removed (SeafWTMonitorPriv *priv, int wd, GList *infos)
+{
+    GList *ptr;
+    RepoWatchInfo *info;
+
+    for (ptr = infos; ptr; ptr = ptr->next) {
+        info = ptr->data;
+        g_hash_table_remove (info->mapping->wd_to_path, (gpointer)(long)wd);
     }
+    g_list_free (infos);
+    g_hash_table_remove (priv->wd_hash, (gpointer)(long)wd);
+}
 
-    info = g_hash_table_lookup (priv->info_hash, (gpointer)(long)in_fd);
-    if (!info) {
-        seaf_warning ("Repo watch info not found.\n");
-        goto out;
+static void
+dispatch_event (SeafWTMonitorPriv *priv, struct inotify_event *event)
+{
+    GList *infos, *ptr;
+    RepoWatchInfo *info;
+    char *dir;
+
+    if (event->mask & IN_Q_OVERFLOW) {
+        handle_overflow (priv);
+        return;
     }
 
-    int offset = 0;
-    while (offset < buf_size) {
-        event = (struct inotify_event *)&event_buf[offset];
-        offset += sizeof(struct inotify_event) + event->len;
+    /* Events for repos or dirs that are no longer watched may still be
+     * queued in the kernel. Just skip them. */
+    infos = g_hash_table_lookup (priv->wd_hash, (gpointer)(long)event->wd);
+    if (!infos)
+        return;
+
+    if (event->mask & IN_IGNORED) {
+        handle_watch_removed (priv, event->wd, infos);
+        return;
+    }
 
+    /* Handling the event may add watches, so iterate over a copy. */
+    infos = g_list_copy (infos);
+    for (ptr = infos; ptr; ptr = ptr->next) {
+        info = ptr->data;
         dir = g_hash_table_lookup (info->mapping->wd_to_path,
                                    (gpointer)(long)event->wd);
         if (!dir) {
             seaf_warning ("Cannot find path from wd.\n");
-            goto out;
+            continue;
         }
+        process_one_event (priv, info, info->worktree, dir, event);
+    }
+    g_list_free (infos);
+}
+
+#ifdef USE_FANOTIFY
+
+#define FAN_WATCH_MASK (FAN_MODIFY | FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | \
+                        FAN_MOVED_TO | FAN_CLOSE_WRITE | FAN_ATTRIB | FAN_ONDIR)
 
-        process_one_event (in_fd, info, info->worktree, dir,
-                           event, (offset >= buf_size));
+typedef struct FanMark {
+    fsid_t fsid;
+    int mount_fd;               /* any fd on the file system, for open_by_handle_at() */
+    char *path;                 /* path the mark was added with */
+    int ref_count;              /* number of repos on this file system */
+} FanMark;
+
+static FanMark *
+fan_find_mark (SeafWTMonitorPriv *priv, const void *fsid)
+{
+    GList *ptr;
+    FanMark *mark;
+
+    for (ptr = priv->fan_marks; ptr; ptr = ptr->next) {
+        mark = ptr->data;
+        if (memcmp (&mark->fsid, fsid, sizeof(fsid_t)) == 0)
+            return mark;
     }
+    return NULL;
+}
 
-    ret = TRUE;
+static int
+fan_add_mark (SeafWTMonitorPriv *priv, const char *worktree)
+{
+    struct statfs sfs;
+    FanMark *mark;
+    int mount_fd;
 
-out:
-    g_free (event_buf);
-    return ret;
+    if (statfs (worktree, &sfs) < 0) {
+        seaf_warning ("[wt mon] fail to statfs %s: %s.\n", worktree, strerror(errno));
+        return -1;
+    }
+
+    mark = fan_find_mark (priv, &sfs.f_fsid);
+    if (mark) {
+        mark->ref_count++;
+        return 0;
+    }
+
+    mount_fd = open (worktree, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (mount_fd < 0) {
+        seaf_warning ("[wt mon] fail to open %s: %s.\n", worktree, strerror(errno));
+        return -1;
+    }
+
+    if (fanotify_mark (priv->fan_fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+                       FAN_WATCH_MASK, AT_FDCWD, worktree) < 0) {
+        seaf_warning ("[wt mon] fail to add fanotify mark for %s: %s.\n",
+                      worktree, strerror(errno));
+        close (mount_fd);
+        return -1;
+    }
+
+    mark = g_new0 (FanMark, 1);
+    memcpy (&mark->fsid, &sfs.f_fsid, sizeof(fsid_t));
+    mark->mount_fd = mount_fd;
+    mark->path = g_strdup (worktree);
+    mark->ref_count = 1;
+    priv->fan_marks = g_list_prepend (priv->fan_marks, mark);
+
+    return 0;
+}
+
+static void
+fan_remove_mark (SeafWTMonitorPriv *priv, const char *worktree)
+{
+    struct statfs sfs;
+    FanMark *mark;
+
+    if (statfs (worktree, &sfs) < 0)
+        return;
+
+    mark = fan_find_mark (priv, &sfs.f_fsid);
+    if (!mark || --mark->ref_count > 0)
+        return;
+
+    fanotify_mark (priv->fan_fd, FAN_MARK_REMOVE | FAN_MARK_FILESYSTEM,
+                   FAN_WATCH_MASK, AT_FDCWD, mark->path);
+    close (mark->mount_fd);
+    priv->fan_marks = g_list_remove (priv->fan_marks, mark);
+    g_free (mark->path);
+    g_free (mark);
+}
+
+static int
+fan_add_watch (SeafWTMonitorPriv *priv, const char *repo_id, const char *worktree)
+{
+    RepoWatchInfo *info;
+    char *real_worktree;
+
+    real_worktree = realpath (worktree, NULL);
+    if (!real_worktree) {
+        seaf_warning ("[wt mon] fail to resolve %s: %s.\n", worktree, strerror(errno));
+        return -1;
+    }
+
+    if (fan_add_mark (priv, real_worktree) < 0) {
+        free (real_worktree);
+        return -1;
+    }
+
+    info = create_repo_watch_info (repo_id, worktree);
+    info->real_worktree = g_strdup (real_worktree);
+    free (real_worktree);
+
+    pthread_mutex_lock (&priv->hash_lock);
+    g_hash_table_insert (priv->handle_hash, g_strdup(repo_id), info);
+    pthread_mutex_unlock (&priv->hash_lock);
+
+    g_hash_table_insert (priv->fan_worktrees, info->real_worktree, info);
+
+    /* A special event indicates repo-mgr to scan the whole worktree. */
+    add_event_to_queue (info->status, WT_EVENT_SCAN_DIR, "", NULL);
+
+    return 0;
+}
+
+static void
+fan_rm_watch (SeafWTMonitorPriv *priv, RepoWatchInfo *info)
+{
+    if (!info->real_worktree)
+        return;
+    g_hash_table_remove (priv->fan_worktrees, info->real_worktree);
+    fan_remove_mark (priv, info->real_worktree);
+}
+
+/* Resolve the directory of an event to an absolute path. */
+static const char *
+fan_resolve_dir (SeafWTMonitorPriv *priv, struct fanotify_event_info_fid *fid)
+{
+    struct file_handle *fh = (struct file_handle *)fid->handle;
+    FanMark *mark;
+    char *key, *path;
+    char proc_path[64];
+    char buf[SEAF_PATH_MAX];
+    ssize_t len;
+    int fd;
+
+    key = g_malloc (sizeof(fid->fsid) * 2 + 8 + fh->handle_bytes * 2 + 1);
+    rawdata_to_hex ((unsigned char *)&fid->fsid, key, sizeof(fid->fsid));
+    snprintf (key + sizeof(fid->fsid) * 2, 9, "%08x", (unsigned int)fh->handle_type);
+    rawdata_to_hex (fh->f_handle, key + sizeof(fid->fsid) * 2 + 8,
+                    fh->handle_bytes);
+
+    path = g_hash_table_lookup (priv->fan_dir_cache, key);
+    if (path) {
+        g_free (key);
+        return path;
+    }
+
+    mark = fan_find_mark (priv, &fid->fsid);
+    if (!mark) {
+        g_free (key);
+        return NULL;
+    }
+
+    /* Fails with ESTALE if the directory was removed in the meantime. */
+    fd = open_by_handle_at (mark->mount_fd, fh, O_PATH | O_CLOEXEC);
+    if (fd < 0) {
+        g_free (key);
+        return NULL;
+    }
+
+    snprintf (proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+    len = readlink (proc_path, buf, sizeof(buf) - 1);
+    close (fd);
+    if (len <= 0) {
+        g_free (key);
+        return NULL;
+    }
+    buf[len] = 0;
+
+    path = g_strdup (buf);
+    g_hash_table_insert (priv->fan_dir_cache, key, path);
+    return path;
+}
+
+/* Find the repo whose worktree contains @dir, walking up from @dir so that
+ * the cost doesn't depend on the number of repos. */
+static RepoWatchInfo *
+fan_find_repo (SeafWTMonitorPriv *priv, const char *dir, const char **parent)
+{
+    RepoWatchInfo *info = NULL;
+    char *path = g_strdup (dir);
+    char *slash;
+
+    while (1) {
+        info = g_hash_table_lookup (priv->fan_worktrees, path);
+        if (info)
+            break;
+        slash = strrchr (path, '/');
+        if (!slash || slash == path)
+            break;
+        *slash = 0;
+    }
+
+    if (info) {
+        size_t len = strlen (info->real_worktree);
+        *parent = (dir[len] == '/') ? dir + len + 1 : dir + len;
+    }
+
+    g_free (path);
+    return info;
+}
+
+static void
+fan_dispatch_event (SeafWTMonitorPriv *priv, struct fanotify_event_metadata *meta)
+{
+    struct fanotify_event_info_fid *fid;
+    struct file_handle *fh;
+    struct inotify_event *event;
+    const char *name, *dir, *parent = NULL;
+    RepoWatchInfo *info;
+    size_t name_len;
+
+    if (meta->mask & FAN_Q_OVERFLOW) {
+        handle_overflow (priv);
+        return;
+    }
+
+    if (meta->event_len <= meta->metadata_len)
+        return;
+    fid = (struct fanotify_event_info_fid *)((char *)meta + meta->metadata_len);
+    if (fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME)
+        return;
+
+    fh = (struct file_handle *)fid->handle;
+    name = (const char *)fh->f_handle + fh->handle_bytes;
+
+    dir = fan_resolve_dir (priv, fid);
+    if (!dir)
+        return;
+
+    info = fan_find_repo (priv, dir, &parent);
+    if (!info)
+        return;
+
+    /* Reuse the inotify event handling. FAN_* and IN_* event bits have
+     * the same values. fanotify has no move cookies, but the kernel queues
+     * MOVED_FROM and MOVED_TO of a rename back to back, which is what
+     * handle_rename() pairs anyway.
+     */
+    name_len = strlen (name);
+    event = g_malloc0 (sizeof(struct inotify_event) + name_len + 1);
+    event->wd = -1;
+    event->mask = (uint32_t)(meta->mask & (WATCH_MASK));
+    if (meta->mask & FAN_ONDIR)
+        event->mask |= IN_ISDIR;
+    if (meta->mask & (FAN_MOVED_FROM | FAN_MOVED_TO))
+        event->cookie = 1;
+    event->len = name_len + 1;
+    memcpy (event->name, name, name_len + 1);
+
+    process_one_event (priv, info, info->worktree, parent, event);
+
+    g_free (event);
+}
+
+static void
+fan_process_events (SeafWTMonitorPriv *priv)
+{
+    struct fanotify_event_metadata *meta;
+    ssize_t n;
+
+    while (1) {
+        n = read (priv->fan_fd, priv->event_buf, INOTIFY_BUF_SIZE);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+                seaf_warning ("Failed to read fanotify fd: %s.\n", strerror(errno));
+            break;
+        } else if (n == 0) {
+            break;
+        }
+
+        meta = (struct fanotify_event_metadata *)priv->event_buf;
+        while (FAN_EVENT_OK (meta, n)) {
+            if (meta->vers == FANOTIFY_METADATA_VERSION)
+                fan_dispatch_event (priv, meta);
+            if (meta->fd >= 0)
+                close (meta->fd);
+            meta = FAN_EVENT_NEXT (meta, n);
+        }
+    }
+
+    flush_pending_renames (priv);
+    g_hash_table_remove_all (priv->fan_dir_cache);
+}
+
+/* Needs CAP_SYS_ADMIN for file system marks, and Linux 5.9 or later for
+ * directory entry events with FAN_REPORT_DFID_NAME. */
+static int
+fan_init (SeafWTMonitorPriv *priv)
+{
+    priv->fan_fd = fanotify_init (FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME |
+                                  FAN_NONBLOCK | FAN_CLOEXEC,
+                                  O_RDONLY | O_CLOEXEC);
+    if (priv->fan_fd < 0) {
+        seaf_warning ("[wt mon] fanotify is not available, use inotify: %s.\n",
+                      strerror(errno));
+        return -1;
+    }
+
+    priv->fan_worktrees = g_hash_table_new (g_str_hash, g_str_equal);
+    priv->fan_dir_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                 g_free, g_free);
+    seaf_message ("[wt mon] Use fanotify to monitor worktrees.\n");
+    return 0;
+}
+
+#endif  /* USE_FANOTIFY */
+
+/* Drain all queued events in large batches. */
+static void
+process_events (SeafWTMonitorPriv *priv)
+{
+    struct inotify_event *event;
+    ssize_t n;
+    int offset;
+
+    while (1) {
+        n = read (priv->inotify_fd, priv->event_buf, INOTIFY_BUF_SIZE);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+                seaf_warning ("Failed to read inotify fd: %s.\n", strerror(errno));
+            break;
+        } else if (n == 0) {
+            break;
+        }
+
+        offset = 0;
+        while (offset < n) {
+            event = (struct inotify_event *)&priv->event_buf[offset];
+            offset += sizeof(struct inotify_event) + event->len;
+            dispatch_event (priv, event);
+        }
+    }
+
+    flush_pending_renames (priv);
 }
 
 static void *
@@ -456,29 +877,66 @@ wt_monitor_job_linux (void *vmonitor)
     SeafWTMonitorPriv *priv = monitor->priv;
 
     WatchCommand cmd;
-    int n;
+    struct epoll_event ev, events[2];
+    int n, i;
     int rc;
-    fd_set fds;
-    int inotify_fd;
-    char *repo_id;
-    gpointer key, value;
-    GHashTableIter iter;
 
-    FD_SET (monitor->cmd_pipe[0], &priv->read_fds);
-    priv->maxfd = monitor->cmd_pipe[0];
+    priv->epoll_fd = epoll_create (2);
+    if (priv->epoll_fd < 0) {
+        seaf_warning ("[wt mon] epoll_create failed: %s.\n", strerror(errno));
+        return NULL;
+    }
 
-    while (1) {
-        fds = priv->read_fds;
+    memset (&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = monitor->cmd_pipe[0];
+    if (epoll_ctl (priv->epoll_fd, EPOLL_CTL_ADD, monitor->cmd_pipe[0], &ev) < 0) {
+        seaf_warning ("[wt mon] failed to poll command pipe: %s.\n",
+                      strerror(errno));
+        return NULL;
+    }
+
+    if (priv->inotify_fd >= 0) {
+        ev.data.fd = priv->inotify_fd;
+        if (epoll_ctl (priv->epoll_fd, EPOLL_CTL_ADD, priv->inotify_fd, &ev) < 0) {
+            seaf_warning ("[wt mon] failed to poll inotify fd: %s.\n",
+                          strerror(errno));
+            return NULL;
+        }
+    }
 
-        rc = select (priv->maxfd + 1, &fds, NULL, NULL, NULL);
+#ifdef USE_FANOTIFY
+    if (priv->fan_fd >= 0) {
+        ev.data.fd = priv->fan_fd;
+        if (epoll_ctl (priv->epoll_fd, EPOLL_CTL_ADD, priv->fan_fd, &ev) < 0) {
+            seaf_warning ("[wt mon] failed to poll fanotify fd: %s.\n",
+                          strerror(errno));
+            return NULL;
+        }
+    }
+#endif
+
+    while (1) {
+        rc = epoll_wait (priv->epoll_fd, events, G_N_ELEMENTS(events), -1);
         if (rc < 0 && errno == EINTR) {
             continue;
         } else if (rc < 0) {
-            seaf_warning ("[wt mon] select error: %s.\n", strerror(errno));
+            seaf_warning ("[wt mon] epoll_wait error: %s.\n", strerror(errno));
             break;
         }
 
-        if (FD_ISSET (monitor->cmd_pipe[0], &fds)) {
+        for (i = 0; i < rc; i++) {
+            if (events[i].data.fd == priv->inotify_fd) {
+                process_events (priv);
+                continue;
+            }
+#ifdef USE_FANOTIFY
+            if (events[i].data.fd == priv->fan_fd) {
+                fan_process_events (priv);
+                continue;
+            }
+#endif
+
             n = seaf_pipe_readn (monitor->cmd_pipe[0], &cmd, sizeof(cmd));
             if (n != sizeof(cmd)) {
                 seaf_warning ("[wt mon] failed to read command.\n");
@@ -486,29 +944,21 @@ wt_monitor_job_linux (void *vmonitor)
             }
             handle_watch_command (monitor, &cmd);
         }
-
-        g_hash_table_iter_init (&iter, priv->handle_hash);
-        while (g_hash_table_iter_next (&iter, &key, &value)) {
-            repo_id = key;
-            inotify_fd = (int)(long)value;
-            if (FD_ISSET (inotify_fd, &fds))
-                process_events (priv, repo_id, inotify_fd);
-        }
     }
 
     return NULL;
 }
 
-/* Ignore errors so that we can still monitor other dirs
- * when one dir is bad.
+/* Returns -1 if @path itself can't be watched. A dir that can't be watched
+ * is logged and a scan of it is queued, and other dirs are still watched.
  *
  * If @add_events is TRUE, add events for each dir and entries under that dir.
  * Note that only adding events for files is not enough, because repo-mgr will
  * need to add empty dirs to index.
  */
 static int
-add_watch_recursive (RepoWatchInfo *info,
-                     int in_fd,
+add_watch_recursive (SeafWTMonitorPriv *priv,
+                     RepoWatchInfo *info,
                      const char *worktree,
                      const char *path,
                      gboolean add_events)
@@ -518,11 +968,17 @@ add_watch_recursive (RepoWatchInfo *info,
     DIR *dir;
     struct dirent *dent;
     int wd;
+    int ret = 0;
+
+    /* The whole file system is already watched. */
+    if (info->real_worktree && !add_events)
+        return 0;
 
     full_path = g_build_filename (worktree, path, NULL);
 
     if (stat (full_path, &st) < 0) {
         seaf_warning ("[wt mon] fail to stat %s: %s\n", full_path, strerror(errno));
+        ret = -1;
         goto out;
     }
 
@@ -533,14 +989,17 @@ add_watch_recursive (RepoWatchInfo *info,
     if (S_ISDIR (st.st_mode)) {
         seaf_debug ("Watching %s.\n", full_path);
 
-        wd = inotify_add_watch (in_fd, full_path, (uint32_t)WATCH_MASK);
+        wd = inotify_add_watch (priv->inotify_fd, full_path, (uint32_t)WATCH_MASK);
         if (wd < 0) {
-            seaf_warning ("[wt mon] fail to add watch to %s: %s.\n",
+            seaf_warning ("[wt mon] fail to add watch to %s: %s. "
+                          "Changes under it are only found by scanning.\n",
                           full_path, strerror(errno));
+            add_event_to_queue (info->status, WT_EVENT_SCAN_DIR, path, NULL);
+            ret = -1;
             goto out;
         }
 
-        add_mapping (info->mapping, path, wd);
+        register_wd (priv, info, wd, path);
 
         dir = opendir (full_path);
         if (!dir) {
@@ -565,7 +1024,7 @@ add_watch_recursive (RepoWatchInfo *info,
              */
             if (dent->d_type == DT_DIR || dent->d_type == DT_LNK ||
                 dent->d_type == DT_UNKNOWN)
-                add_watch_recursive (info, in_fd, worktree, sub_path, add_events);
+                add_watch_recursive (priv, info, worktree, sub_path, add_events);
 
             if (dent->d_type == DT_REG && add_events)
                 add_event_to_queue (info->status, WT_EVENT_CREATE_OR_UPDATE,
@@ -578,34 +1037,29 @@ add_watch_recursive (RepoWatchInfo *info,
 
 out:
     g_free (full_path);
-    return 0;
+    return ret;
 }
 
 static int
 add_watch (SeafWTMonitorPriv *priv, const char *repo_id, const char *worktree)
 {
-    int inotify_fd;
     RepoWatchInfo *info;
 
-    inotify_fd = inotify_init ();
-    if (inotify_fd < 0) {
-        seaf_warning ("[wt mon] inotify_init failed: %s.\n", strerror(errno));
+    if (priv->inotify_fd < 0) {
+        seaf_warning ("[wt mon] inotify is not available.\n");
         return -1;
     }
 
-    pthread_mutex_lock (&priv->hash_lock);
-    g_hash_table_insert (priv->handle_hash,
-                         g_strdup(repo_id), (gpointer)(long)inotify_fd);
-
     info = create_repo_watch_info (repo_id, worktree);
-    g_hash_table_insert (priv->info_hash, (gpointer)(long)inotify_fd, info);
+
+    pthread_mutex_lock (&priv->hash_lock);
+    g_hash_table_insert (priv->handle_hash, g_strdup(repo_id), info);
     pthread_mutex_unlock (&priv->hash_lock);
 
-    if (add_watch_recursive (info, inotify_fd, worktree, "", FALSE) < 0) {
-        close (inotify_fd);
+    if (add_watch_recursive (priv, info, worktree, "", FALSE) < 0) {
+        seaf_warning ("[wt mon] fail to watch worktree %s.\n", worktree);
         pthread_mutex_lock (&priv->hash_lock);
         g_hash_table_remove (priv->handle_hash, repo_id);
-        g_hash_table_remove (priv->info_hash, (gpointer)(long)inotify_fd);
         pthread_mutex_unlock (&priv->hash_lock);
         return -1;
     }
@@ -613,57 +1067,45 @@ add_watch (SeafWTMonitorPriv *priv, const char *repo_id, const char *worktree)
     /* A special event indicates repo-mgr to scan the whole worktree. */
     add_event_to_queue (info->status, WT_EVENT_SCAN_DIR, "", NULL);
 
-    return inotify_fd;
+    return 0;
 }
 
 static int handle_add_repo (SeafWTMonitorPriv *priv,
                             const char *repo_id,
                             const char *worktree)
 {
-    int inotify_fd;
-
-    inotify_fd = add_watch (priv, repo_id, worktree);
-    if (inotify_fd < 0) {
-        return -1;
-    }
-
-    FD_SET (inotify_fd, &priv->read_fds);
-    priv->maxfd = MAX (inotify_fd, priv->maxfd);
-    return 0;
+#ifdef USE_FANOTIFY
+    /* Some file systems don't support fanotify marks, use inotify for them. */
+    if (priv->fan_fd >= 0 && fan_add_watch (priv, repo_id, worktree) == 0)
+        return 0;
+#endif
+    return add_watch (priv, repo_id, worktree);
 }
 
-static void
-update_maxfd (SeafWTMonitor *monitor)
+static int handle_rm_repo (SeafWTMonitor *monitor,
+                           const char *repo_id,
+                           gpointer handle)
 {
     SeafWTMonitorPriv *priv = monitor->priv;
+    RepoWatchInfo *info = handle;
     GHashTableIter iter;
     gpointer key, value;
-    int fd, maxfd = monitor->cmd_pipe[0];
+    int wd;
 
-    g_hash_table_iter_init (&iter, priv->info_hash);
+    g_hash_table_iter_init (&iter, info->mapping->wd_to_path);
     while (g_hash_table_iter_next (&iter, &key, &value)) {
-        fd = (int) (long)key;
-        if (fd > maxfd)
-            maxfd = fd;
+        wd = (int)(long)key;
+        if (unregister_wd (priv, info, wd))
+            inotify_rm_watch (priv->inotify_fd, wd);
     }
 
-    priv->maxfd = maxfd;
-}
-
-static int handle_rm_repo (SeafWTMonitor *monitor,
-                           const char *repo_id,
-                           gpointer handle)
-{
-    SeafWTMonitorPriv *priv = monitor->priv;
-    int inotify_fd = (int)(long)handle;
-
-    close (inotify_fd);
-    FD_CLR (inotify_fd, &priv->read_fds);
-    update_maxfd (monitor);
+#ifdef USE_FANOTIFY
+    if (priv->fan_fd >= 0)
+        fan_rm_watch (priv, info);
+#endif
 
     pthread_mutex_lock (&priv->hash_lock);
     g_hash_table_remove (priv->handle_hash, repo_id);
-    g_hash_table_remove (priv->info_hash, (gpointer)(long)inotify_fd);
     pthread_mutex_unlock (&priv->hash_lock);
 
     return 0;
@@ -737,10 +1179,23 @@ seaf_wt_monitor_new (SeafileSession *seaf)
     pthread_mutex_init (&priv->hash_lock, NULL);
 
     priv->handle_hash = g_hash_table_new_full
-        (g_str_hash, g_str_equal, g_free, NULL);
+        (g_str_hash, g_str_equal, g_free, (GDestroyNotify)free_repo_watch_info);
 
-    priv->info_hash = g_hash_table_new_full
-        (g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)free_repo_watch_info);
+    priv->wd_hash = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+    priv->event_buf = g_new (char, INOTIFY_BUF_SIZE);
+    priv->renaming = g_ptr_array_new ();
+    priv->epoll_fd = -1;
+    priv->fan_fd = -1;
+
+#ifdef USE_FANOTIFY
+    if (seafile_session_config_get_bool (seaf, KEY_USE_FANOTIFY))
+        fan_init (priv);
+#endif
+
+    priv->inotify_fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+    if (priv->inotify_fd < 0)
+        seaf_warning ("[wt mon] inotify_init failed: %s.\n", strerror(errno));
 
     monitor->priv = priv;
     monitor->seaf = seaf;
@@ -755,18 +1210,16 @@ seaf_wt_monitor_get_worktree_status (SeafWTMonitor *monitor,
                                      const char *repo_id)
 {
     SeafWTMonitorPriv *priv = monitor->priv;
-    gpointer key, value;
     RepoWatchInfo *info;
 
     pthread_mutex_lock (&priv->hash_lock);
 
-    if (!g_hash_table_lookup_extended (priv->handle_hash, repo_id,
-                                       &key, &value)) {
+    info = g_hash_table_lookup (priv->handle_hash, repo_id);
+    if (!info) {
         pthread_mutex_unlock (&priv->hash_lock);
-        return NULL;
+        return seaf_wt_monitor_get_replay_status (monitor, repo_id);
     }
 
-    info = g_hash_table_lookup(priv->info_hash, value);
     wt_status_ref (info->status);
 
     pthread_mutex_unlock (&priv->hash_lock);
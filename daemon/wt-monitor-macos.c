@@ -13,18 +13,41 @@
 #include "seafile-session.h"
 #include "utils.h"
 #include "wt-monitor.h"
+#include "wt-journal.h"
 #define DEBUG_FLAG SEAFILE_DEBUG_WATCH
 #include "log.h"
 
+/* Events are delivered after they settled for this long. Changes are only
+ * committed some seconds later anyway, so a longer latency just means
+ * fewer wakeups with larger batches.
+ */
+#define STREAM_LATENCY 1.0 /* seconds */
+
+/* Watches added or removed in quick succession, as when the daemon starts,
+ * rebuild the stream only once.
+ */
+#define REBUILD_DELAY 0.5 /* seconds */
+
 typedef struct RepoWatchInfo {
     WTStatus *status;
-    char *worktree;
+    char *worktree;             /* NFC */
+    int worktree_len;
+    /* Whether the current stream covers the worktree. */
+    gboolean in_stream;
 } RepoWatchInfo;
 
 struct SeafWTMonitorPriv {
+    /* info_hash is only changed by the monitor thread, which reads it
+     * without the lock.
+     */
     pthread_mutex_t hash_lock;
-    GHashTable *handle_hash;        /* repo_id -> inotify_fd (or handle) */
-    GHashTable *info_hash;          /* inotify_fd(or handle in deeed) -> RepoWatchInfo */
+    GHashTable *info_hash;          /* repo_id -> RepoWatchInfo */
+
+    /* One stream for the worktrees of all repos. Only used by the monitor
+     * thread.
+     */
+    FSEventStreamRef stream;
+    CFRunLoopTimerRef rebuild_timer;
 };
 
 static void
@@ -42,7 +65,10 @@ create_repo_watch_info (const char *repo_id, const char *worktree)
 
     RepoWatchInfo *info = g_new0 (RepoWatchInfo, 1);
     info->status = status;
-    info->worktree = g_strdup(worktree);
+    info->worktree = g_utf8_normalize (worktree, -1, G_NORMALIZE_NFC);
+    if (!info->worktree)
+        info->worktree = g_strdup (worktree);
+    info->worktree_len = strlen (info->worktree);
 
     return info;
 }
@@ -97,9 +123,7 @@ add_event_to_queue (WTStatus *status,
 
     seaf_debug ("Adding event: %s, %s %s\n", name, path, new_path?new_path:"");
 
-    pthread_mutex_lock (&status->q_lock);
-    g_queue_push_tail (status->event_q, event);
-    pthread_mutex_unlock (&status->q_lock);
+    wt_status_add_event (status, event);
 
     if (type == WT_EVENT_CREATE_OR_UPDATE) {
         pthread_mutex_lock (&status->ap_q_lock);
@@ -138,6 +162,18 @@ process_one_event (const char* eventPath,
     if (len > 0 && filename[len - 1] == '/')
         filename[len - 1] = 0;
 
+    /* Events were coalesced or dropped, e.g. when replaying history after
+     * a restart. Only the directory is known, so rescan it.
+     */
+    if (eventFlags & kFSEventStreamEventFlagMustScanSubDirs) {
+        seaf_debug ("Must scan subdirs of %s.\n", filename);
+        if (*filename == '\0')
+            add_event_to_queue (status, WT_EVENT_SCAN_DIR, "", NULL);
+        else
+            add_event_to_queue (status, WT_EVENT_CREATE_OR_UPDATE, filename, NULL);
+        goto out;
+    }
+
     /* Reinterpreted RENAMED as combine of CREATED or DELETED event */
     if (eventFlags & kFSEventStreamEventFlagItemRenamed) {
         seaf_debug ("Rename flag set for %s \n", filename);
@@ -179,8 +215,9 @@ process_one_event (const char* eventPath,
         }
     }
 
+out:
     g_free (filename);
-    g_atomic_int_set (&info->status->last_changed, (gint)time(NULL));
+    seaf_wt_monitor_mark_changed (info->status);
 }
 
 #if 0
@@ -226,10 +263,93 @@ process_one_event (const char* eventPath,
     add_event_to_queue (status, WT_EVENT_CREATE_OR_UPDATE, dirname, NULL);
 
     g_free (dirname);
-    g_atomic_int_set (&info->status->last_changed, (gint)time(NULL));
+    seaf_wt_monitor_mark_changed (info->status);
 }
 #endif
 
+/* Whether @path is @info's worktree or in it. */
+static gboolean
+path_in_worktree (RepoWatchInfo *info, const char *path)
+{
+    return (strncmp (path, info->worktree, info->worktree_len) == 0 &&
+            (path[info->worktree_len] == '/' ||
+             path[info->worktree_len] == '\0'));
+}
+
+/* Whether @path is a parent dir of @info's worktree. */
+static gboolean
+path_above_worktree (RepoWatchInfo *info, const char *path)
+{
+    int len = strlen (path);
+
+    while (len > 0 && path[len - 1] == '/')
+        --len;
+    return (len < info->worktree_len &&
+            strncmp (path, info->worktree, len) == 0 &&
+            info->worktree[len] == '/');
+}
+
+/* Worktrees may be nested, so the repo with the longest matching worktree
+ * gets the event.
+ */
+static RepoWatchInfo *
+lookup_repo_by_path (SeafWTMonitorPriv *priv, const char *path)
+{
+    GHashTableIter iter;
+    gpointer value;
+    RepoWatchInfo *info, *ret = NULL;
+
+    g_hash_table_iter_init (&iter, priv->info_hash);
+    while (g_hash_table_iter_next (&iter, NULL, &value)) {
+        info = value;
+        if (info->in_stream && path_in_worktree (info, path) &&
+            (!ret || info->worktree_len > ret->worktree_len))
+            ret = info;
+    }
+
+    return ret;
+}
+
+static void
+set_queued_pos (WTStatus *status, FSEventStreamEventId pos)
+{
+    pthread_mutex_lock (&status->q_lock);
+    if ((gint64)pos > status->queued_pos)
+        status->queued_pos = (gint64)pos;
+    pthread_mutex_unlock (&status->q_lock);
+}
+
+static gint64
+get_queued_pos (WTStatus *status)
+{
+    gint64 pos;
+
+    pthread_mutex_lock (&status->q_lock);
+    pos = status->queued_pos;
+    pthread_mutex_unlock (&status->q_lock);
+
+    return pos;
+}
+
+/* Rescans the worktrees under @path, or all of them if @path is NULL. */
+static void
+scan_worktrees (SeafWTMonitorPriv *priv, const char *path)
+{
+    GHashTableIter iter;
+    gpointer value;
+    RepoWatchInfo *info;
+
+    g_hash_table_iter_init (&iter, priv->info_hash);
+    while (g_hash_table_iter_next (&iter, NULL, &value)) {
+        info = value;
+        if (!info->in_stream ||
+            (path && !path_above_worktree (info, path)))
+            continue;
+        add_event_to_queue (info->status, WT_EVENT_SCAN_DIR, "", NULL);
+        seaf_wt_monitor_mark_changed (info->status);
+    }
+}
+
 static void
 stream_callback (ConstFSEventStreamRef streamRef,
                       void *clientCallBackInfo,
@@ -238,79 +358,266 @@ stream_callback (ConstFSEventStreamRef streamRef,
                       const FSEventStreamEventFlags eventFlags[],
                       const FSEventStreamEventId eventIds[])
 {
-    RepoWatchInfo *info;
     SeafWTMonitor *monitor = (SeafWTMonitor *)clientCallBackInfo;
     SeafWTMonitorPriv *priv = monitor->priv;
     char **paths = (char **)eventPaths;
-
-    info = g_hash_table_lookup (priv->info_hash, (gpointer)(long)streamRef);
-    if (!info) {
-        seaf_warning ("Repo watch info not found.\n");
-        return;
-    }
-
+    RepoWatchInfo *info;
+    GHashTableIter iter;
+    gpointer value;
+    char *path_nfc;
     int i;
+
     for (i = 0; i < numEvents; i++) {
         seaf_debug("%ld Change %llu in %s, flags %x\n", (long)CFRunLoopGetCurrent(),
                    eventIds[i], paths[i], eventFlags[i]);
-        process_one_event (paths[i], info, info->worktree,
-                           eventIds[i], eventFlags[i]);
+        if (eventFlags[i] & kFSEventStreamEventFlagHistoryDone)
+            continue;
+        if (eventFlags[i] & kFSEventStreamEventFlagEventIdsWrapped) {
+            scan_worktrees (priv, NULL);
+            continue;
+        }
+
+        path_nfc = g_utf8_normalize (paths[i], -1, G_NORMALIZE_NFC);
+        if (!path_nfc)
+            continue;
+
+        info = lookup_repo_by_path (priv, path_nfc);
+        if (!info) {
+            /* Changes above the worktrees, e.g. events were dropped for a
+             * parent dir or it was moved.
+             */
+            if (eventFlags[i] & (kFSEventStreamEventFlagRootChanged |
+                                 kFSEventStreamEventFlagMustScanSubDirs))
+                scan_worktrees (priv, path_nfc);
+            g_free (path_nfc);
+            continue;
+        }
+        g_free (path_nfc);
+
+        /* Replayed for another repo when the stream was rebuilt. */
+        if ((gint64)eventIds[i] <= get_queued_pos (info->status))
+            continue;
+
+        if (eventFlags[i] & kFSEventStreamEventFlagRootChanged) {
+            add_event_to_queue (info->status, WT_EVENT_SCAN_DIR, "", NULL);
+            seaf_wt_monitor_mark_changed (info->status);
+        } else {
+            process_one_event (paths[i], info, info->worktree,
+                               eventIds[i], eventFlags[i]);
+        }
+        set_queued_pos (info->status, eventIds[i]);
+    }
+
+    /* Events come in order, so the other worktrees had no changes up to
+     * the last event either.
+     */
+    if (numEvents > 0) {
+        g_hash_table_iter_init (&iter, priv->info_hash);
+        while (g_hash_table_iter_next (&iter, NULL, &value)) {
+            info = value;
+            if (info->in_stream)
+                set_queued_pos (info->status, eventIds[numEvents - 1]);
+        }
     }
 }
 
-static FSEventStreamRef
-add_watch (SeafWTMonitor *monitor, const char* repo_id, const char* worktree)
+/* FSEvents ids are persistent per volume, identified by its uuid. Returns
+ * NULL if the volume doesn't keep an event history.
+ */
+static char *
+get_event_source (const char *worktree)
+{
+    struct stat st;
+    CFUUIDRef uuid;
+    CFStringRef str;
+    char buf[64];
+    char *ret = NULL;
+
+    if (stat (worktree, &st) < 0)
+        return NULL;
+
+    uuid = FSEventsCopyUUIDForDevice (st.st_dev);
+    if (!uuid)
+        return NULL;
+
+    str = CFUUIDCreateString (kCFAllocatorDefault, uuid);
+    if (str && CFStringGetCString (str, buf, sizeof(buf), kCFStringEncodingUTF8))
+        ret = g_strdup (buf);
+
+    if (str)
+        CFRelease (str);
+    CFRelease (uuid);
+    return ret;
+}
+
+static void
+stop_stream (SeafWTMonitorPriv *priv)
+{
+    if (!priv->stream)
+        return;
+
+    FSEventStreamStop (priv->stream);
+    FSEventStreamInvalidate (priv->stream);
+    FSEventStreamRelease (priv->stream);
+    priv->stream = NULL;
+}
+
+/*
+ * Replaces the stream with one for the current set of worktrees. The new
+ * stream starts at the oldest position any repo still needs, events that
+ * were already queued for a repo are skipped by stream_callback().
+ */
+static void
+rebuild_stream (SeafWTMonitor *monitor)
 {
     SeafWTMonitorPriv *priv = monitor->priv;
+    GHashTableIter iter;
+    gpointer value;
     RepoWatchInfo *info;
-    double latency = 0.25; /* unit: second */
-
-    char *worktree_nfd = g_utf8_normalize (worktree, -1, G_NORMALIZE_NFD);
+    CFMutableArrayRef paths_to_watch;
+    CFStringRef path;
+    char *worktree_nfd;
+    FSEventStreamEventId since = kFSEventStreamEventIdSinceNow;
+    gint64 pos;
+    int n_paths = 0;
+
+    stop_stream (priv);
+
+    paths_to_watch = CFArrayCreateMutable (kCFAllocatorDefault, 0,
+                                           &kCFTypeArrayCallBacks);
+
+    g_hash_table_iter_init (&iter, priv->info_hash);
+    while (g_hash_table_iter_next (&iter, NULL, &value)) {
+        info = value;
+        info->in_stream = FALSE;
+
+        worktree_nfd = g_utf8_normalize (info->worktree, -1, G_NORMALIZE_NFD);
+        path = CFStringCreateWithCString (kCFAllocatorDefault,
+                                          worktree_nfd ? worktree_nfd : info->worktree,
+                                          kCFStringEncodingUTF8);
+        g_free (worktree_nfd);
+        if (!path)
+            continue;
+        CFArrayAppendValue (paths_to_watch, path);
+        CFRelease (path);
+        info->in_stream = TRUE;
+        ++n_paths;
+
+        pos = get_queued_pos (info->status);
+        if (pos > 0 && (since == kFSEventStreamEventIdSinceNow ||
+                        (FSEventStreamEventId)pos < since))
+            since = (FSEventStreamEventId)pos;
+    }
 
-    CFStringRef mypaths[1];
-    mypaths[0] = CFStringCreateWithCString (kCFAllocatorDefault,
-                                            worktree_nfd, kCFStringEncodingUTF8);
-    g_free (worktree_nfd);
-    CFArrayRef pathsToWatch = CFArrayCreate(NULL, (const void **)mypaths, 1, NULL);
-    FSEventStreamRef stream;
+    if (n_paths == 0) {
+        CFRelease (paths_to_watch);
+        return;
+    }
 
-    /* Create the stream, passing in a callback */
     // kFSEventStreamCreateFlagFileEvents does not work for libraries with name
     // containing accent characters.
     struct FSEventStreamContext ctx = {0, monitor, NULL, NULL, NULL};
-    stream = FSEventStreamCreate(kCFAllocatorDefault,
-                                 stream_callback,
-                                 &ctx,
-                                 pathsToWatch,
-                                 kFSEventStreamEventIdSinceNow,
-                                 latency,
-                                 kFSEventStreamCreateFlagFileEvents
-                                 );
-
-    CFRelease (mypaths[0]);
-    CFRelease (pathsToWatch);
-
-    if (!stream) {
+    priv->stream = FSEventStreamCreate (kCFAllocatorDefault,
+                                        stream_callback,
+                                        &ctx,
+                                        paths_to_watch,
+                                        since,
+                                        STREAM_LATENCY,
+                                        kFSEventStreamCreateFlagFileEvents);
+    CFRelease (paths_to_watch);
+
+    if (!priv->stream) {
         seaf_warning ("[wt] Failed to create event stream.\n");
-        return stream;
+        g_hash_table_iter_init (&iter, priv->info_hash);
+        while (g_hash_table_iter_next (&iter, NULL, &value))
+            ((RepoWatchInfo *)value)->in_stream = FALSE;
+        return;
     }
 
-    FSEventStreamScheduleWithRunLoop(stream, CFRunLoopGetCurrent(), kCFRunLoopDefaultMode);
-    FSEventStreamStart (stream);
+    FSEventStreamScheduleWithRunLoop (priv->stream, CFRunLoopGetCurrent(),
+                                      kCFRunLoopDefaultMode);
+    FSEventStreamStart (priv->stream);
     /* FSEventStreamShow (stream); */
-    seaf_debug ("[wt mon] Add repo %s watch success: %s.\n", repo_id, worktree);
+    seaf_debug ("[wt mon] Watching %d worktrees since event %lld.\n",
+                n_paths, (long long)since);
+}
 
-    pthread_mutex_lock (&priv->hash_lock);
-    g_hash_table_insert (priv->handle_hash,
-                         g_strdup(repo_id), (gpointer)(long)stream);
+static void
+rebuild_timer_cb (CFRunLoopTimerRef timer, void *vmonitor)
+{
+    SeafWTMonitor *monitor = vmonitor;
+
+    rebuild_stream (monitor);
+}
+
+static void
+schedule_rebuild (SeafWTMonitor *monitor)
+{
+    SeafWTMonitorPriv *priv = monitor->priv;
+
+    if (!priv->rebuild_timer) {
+        CFRunLoopTimerContext ctx = {0, monitor, NULL, NULL, NULL};
+        /* Repeats far in the future, it's rescheduled for every change. */
+        priv->rebuild_timer = CFRunLoopTimerCreate (kCFAllocatorDefault,
+                                                    CFAbsoluteTimeGetCurrent() + REBUILD_DELAY,
+                                                    1e9, 0, 0,
+                                                    rebuild_timer_cb, &ctx);
+        CFRunLoopAddTimer (CFRunLoopGetCurrent(), priv->rebuild_timer,
+                           kCFRunLoopDefaultMode);
+        return;
+    }
+
+    CFRunLoopTimerSetNextFireDate (priv->rebuild_timer,
+                                   CFAbsoluteTimeGetCurrent() + REBUILD_DELAY);
+}
+
+static int
+add_watch (SeafWTMonitor *monitor, const char* repo_id, const char* worktree)
+{
+    SeafWTMonitorPriv *priv = monitor->priv;
+    RepoWatchInfo *info;
+
+    /* If the journal has a position on this volume, replay the changes
+     * made since then instead of scanning the whole worktree.
+     */
+    FSEventStreamEventId since = kFSEventStreamEventIdSinceNow;
+    FSEventStreamEventId current = FSEventsGetCurrentEventId ();
+    char *source = get_event_source (worktree);
+    char *saved_source = NULL;
+    gint64 saved_pos;
+
+    if (source &&
+        wt_journal_load (repo_id, worktree, &saved_source, &saved_pos) == 0 &&
+        strcmp (saved_source, source) == 0 &&
+        saved_pos > 0 && (FSEventStreamEventId)saved_pos <= current)
+        since = (FSEventStreamEventId)saved_pos;
+    g_free (saved_source);
 
     info = create_repo_watch_info (repo_id, worktree);
-    g_hash_table_insert (priv->info_hash, (gpointer)(long)stream, info);
+    info->status->journal_source = source;
+    if (since != kFSEventStreamEventIdSinceNow)
+        info->status->queued_pos = (gint64)since;
+    else
+        info->status->queued_pos = (gint64)current;
+
+    pthread_mutex_lock (&priv->hash_lock);
+    g_hash_table_insert (priv->info_hash, g_strdup(repo_id), info);
     pthread_mutex_unlock (&priv->hash_lock);
 
-    /* A special event indicates repo-mgr to scan the whole worktree. */
-    add_event_to_queue (info->status, WT_EVENT_SCAN_DIR, "", NULL);
-    return stream;
+    /* The new stream starts at queued_pos, so nothing is missed until
+     * it's created.
+     */
+    schedule_rebuild (monitor);
+    seaf_debug ("[wt mon] Add repo %s watch success: %s.\n", repo_id, worktree);
+
+    if (since != kFSEventStreamEventIdSinceNow) {
+        seaf_message ("[wt mon] Replaying changes of repo %s since event %lld.\n",
+                      repo_id, (long long)since);
+    } else {
+        /* A special event indicates repo-mgr to scan the whole worktree. */
+        add_event_to_queue (info->status, WT_EVENT_SCAN_DIR, "", NULL);
+    }
+    return 0;
 }
 
 static void
@@ -368,25 +675,19 @@ wt_monitor_job_darwin (void *vmonitor)
 static int
 handle_add_repo (SeafWTMonitor *monitor, const char *repo_id, const char *worktree)
 {
-    FSEventStreamRef stream = add_watch (monitor, repo_id, worktree);
-    if (!stream)
-        return -1;
-    return 0;
+    return add_watch (monitor, repo_id, worktree);
 }
 
 static int
-handle_rm_repo (SeafWTMonitor *monitor, const char *repo_id, gpointer handle)
+handle_rm_repo (SeafWTMonitor *monitor, const char *repo_id)
 {
     SeafWTMonitorPriv *priv = monitor->priv;
-    FSEventStreamRef stream = (FSEventStreamRef)handle;
-    FSEventStreamStop (stream);
-    FSEventStreamInvalidate (stream);
-    FSEventStreamRelease (stream);
 
     pthread_mutex_lock (&priv->hash_lock);
-    g_hash_table_remove (priv->handle_hash, repo_id);
-    g_hash_table_remove (priv->info_hash, (gpointer)(long)stream);
+    g_hash_table_remove (priv->info_hash, repo_id);
     pthread_mutex_unlock (&priv->hash_lock);
+
+    schedule_rebuild (monitor);
     return 0;
 }
 
@@ -412,7 +713,7 @@ handle_watch_command (SeafWTMonitor *monitor, WatchCommand *cmd)
     SeafWTMonitorPriv *priv = monitor->priv;
 
     if (cmd->type == CMD_ADD_WATCH) {
-        if (g_hash_table_lookup_extended (priv->handle_hash, cmd->repo_id,
+        if (g_hash_table_lookup_extended (priv->info_hash, cmd->repo_id,
                                           NULL, NULL)) {
             reply_watch_command (monitor, 0);
             return;
@@ -428,14 +729,13 @@ handle_watch_command (SeafWTMonitor *monitor, WatchCommand *cmd)
         seaf_debug ("[wt mon] add watch for repo %s\n", cmd->repo_id);
         reply_watch_command (monitor, 0);
     } else if (cmd->type == CMD_DELETE_WATCH) {
-        gpointer key, value;
-        if (!g_hash_table_lookup_extended (priv->handle_hash, cmd->repo_id,
-                                           &key, &value)) {
+        if (!g_hash_table_lookup_extended (priv->info_hash, cmd->repo_id,
+                                           NULL, NULL)) {
             reply_watch_command (monitor, 0);
             return;
         }
 
-        handle_rm_repo (monitor, cmd->repo_id, value);
+        handle_rm_repo (monitor, cmd->repo_id);
         reply_watch_command (monitor, 0);
     } else if (cmd->type ==  CMD_REFRESH_WATCH) {
         if (handle_refresh_repo (monitor, cmd->repo_id) < 0) {
@@ -456,11 +756,8 @@ seaf_wt_monitor_new (SeafileSession *seaf)
 
     pthread_mutex_init (&priv->hash_lock, NULL);
 
-    priv->handle_hash = g_hash_table_new_full
-        (g_str_hash, g_str_equal, g_free, NULL);
-
     priv->info_hash = g_hash_table_new_full
-        (g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)free_repo_watch_info);
+        (g_str_hash, g_str_equal, g_free, (GDestroyNotify)free_repo_watch_info);
 
     monitor->priv = priv;
     monitor->seaf = seaf;
@@ -475,18 +772,16 @@ seaf_wt_monitor_get_worktree_status (SeafWTMonitor *monitor,
                                      const char *repo_id)
 {
     SeafWTMonitorPriv *priv = monitor->priv;
-    gpointer key, value;
     RepoWatchInfo *info;
 
     pthread_mutex_lock (&priv->hash_lock);
 
-    if (!g_hash_table_lookup_extended (priv->handle_hash, repo_id,
-                                       &key, &value)) {
+    info = g_hash_table_lookup (priv->info_hash, repo_id);
+    if (!info) {
         pthread_mutex_unlock (&priv->hash_lock);
-        return NULL;
+        return seaf_wt_monitor_get_replay_status (monitor, repo_id);
     }
 
-    info = g_hash_table_lookup(priv->info_hash, value);
     wt_status_ref (info->status);
 
     pthread_mutex_unlock (&priv->hash_lock);
@@ -1,6 +1,7 @@
 #include <string.h>
 
 #include "wt-monitor-structs.h"
+#include "wt-event-log.h"
 
 /* WTEvent */
 
@@ -43,6 +44,15 @@ WTStatus *create_wt_status (const char *repo_id)
     status->event_q = g_queue_new ();
     pthread_mutex_init (&status->q_lock, NULL);
 
+    status->pending_updates = g_hash_table_new (g_str_hash, g_str_equal);
+    status->pending_attribs = g_hash_table_new (g_str_hash, g_str_equal);
+    status->pending_dirs = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                  g_free, NULL);
+
+    status->queued_pos = -1;
+    status->applied_pos = -1;
+    status->saved_pos = -1;
+
     status->active_paths = g_queue_new ();
     pthread_mutex_init (&status->ap_q_lock, NULL);
 
@@ -66,6 +76,10 @@ static void free_wt_status (WTStatus *status)
         g_queue_foreach (status->event_q, free_event_cb, NULL);
         g_queue_free (status->event_q);
     }
+    g_hash_table_destroy (status->pending_updates);
+    g_hash_table_destroy (status->pending_attribs);
+    g_hash_table_destroy (status->pending_dirs);
+    g_free (status->journal_source);
     pthread_mutex_destroy (&status->q_lock);
     g_free (status);
 }
@@ -84,3 +98,193 @@ wt_status_unref (WTStatus *status)
     if (--(status->ref_count) <= 0)
         free_wt_status (status);
 }
+
+/* Event coalescing */
+
+/* Once this many updates are pending under a directory, they're replaced
+ * by a single update of the directory, which is then scanned recursively.
+ */
+#define WT_FOLD_THRESHOLD 1000
+
+static void
+pending_dirs_adjust (WTStatus *status, const char *path, int delta)
+{
+    char *dir = g_strdup (path);
+    char *slash;
+    int count;
+
+    while ((slash = strrchr (dir, '/')) != NULL) {
+        *slash = '\0';
+        count = GPOINTER_TO_INT (g_hash_table_lookup (status->pending_dirs, dir));
+        count += delta;
+        if (count > 0)
+            g_hash_table_replace (status->pending_dirs, g_strdup (dir),
+                                  GINT_TO_POINTER(count));
+        else
+            g_hash_table_remove (status->pending_dirs, dir);
+    }
+
+    g_free (dir);
+}
+
+static void
+drop_pending_link (WTStatus *status, GList *link)
+{
+    WTEvent *event = link->data;
+
+    if (event->ev_type == WT_EVENT_CREATE_OR_UPDATE)
+        pending_dirs_adjust (status, event->path, -1);
+    g_queue_delete_link (status->event_q, link);
+    wt_event_free (event);
+}
+
+static void
+drop_pending (WTStatus *status, GHashTable *table, const char *path)
+{
+    GList *link = g_hash_table_lookup (table, path);
+
+    if (!link)
+        return;
+    g_hash_table_remove (table, path);
+    drop_pending_link (status, link);
+}
+
+/* Drop the pending events in @table of all paths under @dir. */
+static void
+drop_pending_under (WTStatus *status, GHashTable *table, const char *dir)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    const char *path;
+    int len = strlen (dir);
+
+    /* Updates are counted per dir, so most dirs needn't be searched. */
+    if (table == status->pending_updates &&
+        !g_hash_table_lookup (status->pending_dirs, dir))
+        return;
+
+    g_hash_table_iter_init (&iter, table);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        path = key;
+        if (strncmp (path, dir, len) == 0 && path[len] == '/') {
+            g_hash_table_iter_remove (&iter);
+            drop_pending_link (status, value);
+        }
+    }
+}
+
+static void
+push_event (WTStatus *status, WTEvent *event)
+{
+    event->seq = ++status->last_seq;
+    g_queue_push_tail (status->event_q, event);
+}
+
+static void
+queue_update (WTStatus *status, WTEvent *event)
+{
+    char *slash, *dir;
+
+    /* The newer update re-reads the path (and the whole subtree for a dir)
+     * from the worktree, so the older ones are redundant.
+     */
+    drop_pending (status, status->pending_updates, event->path);
+    drop_pending_under (status, status->pending_updates, event->path);
+
+    push_event (status, event);
+    g_hash_table_insert (status->pending_updates, event->path,
+                         g_queue_peek_tail_link (status->event_q));
+    pending_dirs_adjust (status, event->path, 1);
+
+    slash = strrchr (event->path, '/');
+    if (!slash)
+        return;
+
+    dir = g_strndup (event->path, slash - event->path);
+    if (GPOINTER_TO_INT (g_hash_table_lookup (status->pending_dirs, dir)) >=
+        WT_FOLD_THRESHOLD)
+        queue_update (status,
+                      wt_event_new (WT_EVENT_CREATE_OR_UPDATE, dir, NULL));
+    g_free (dir);
+}
+
+void
+wt_status_add_event (WTStatus *status, WTEvent *event)
+{
+    wt_event_log_record (status->repo_id, event);
+
+    pthread_mutex_lock (&status->q_lock);
+
+    switch (event->ev_type) {
+    case WT_EVENT_CREATE_OR_UPDATE:
+        queue_update (status, event);
+        break;
+    case WT_EVENT_ATTRIB:
+        drop_pending (status, status->pending_attribs, event->path);
+        push_event (status, event);
+        g_hash_table_insert (status->pending_attribs, event->path,
+                             g_queue_peek_tail_link (status->event_q));
+        break;
+    case WT_EVENT_DELETE:
+        /* A path created and then deleted before it's indexed only needs
+         * the delete event.
+         */
+        drop_pending (status, status->pending_updates, event->path);
+        drop_pending (status, status->pending_attribs, event->path);
+        drop_pending_under (status, status->pending_updates, event->path);
+        drop_pending_under (status, status->pending_attribs, event->path);
+        push_event (status, event);
+        break;
+    default:
+        /* Rename, overflow and scan events depend on the index state left
+         * by earlier events. Don't merge events across them.
+         */
+        g_hash_table_remove_all (status->pending_updates);
+        g_hash_table_remove_all (status->pending_attribs);
+        g_hash_table_remove_all (status->pending_dirs);
+        push_event (status, event);
+        break;
+    }
+
+    pthread_mutex_unlock (&status->q_lock);
+}
+
+void
+wt_status_mark_applied (WTStatus *status)
+{
+    pthread_mutex_lock (&status->q_lock);
+    if (g_queue_is_empty (status->event_q))
+        status->applied_pos = status->queued_pos;
+    pthread_mutex_unlock (&status->q_lock);
+}
+
+WTEvent *
+wt_status_pop_event (WTStatus *status)
+{
+    GList *link = g_queue_peek_head_link (status->event_q);
+    GHashTable *table = NULL;
+    WTEvent *event;
+
+    if (!link)
+        return NULL;
+    event = link->data;
+
+    if (event->ev_type == WT_EVENT_CREATE_OR_UPDATE)
+        table = status->pending_updates;
+    else if (event->ev_type == WT_EVENT_ATTRIB)
+        table = status->pending_attribs;
+
+    if (table && g_hash_table_lookup (table, event->path) == link) {
+        g_hash_table_remove (table, event->path);
+        if (event->ev_type == WT_EVENT_CREATE_OR_UPDATE)
+            pending_dirs_adjust (status, event->path, -1);
+    }
+
+    return g_queue_pop_head (status->event_q);
+}
+
+void
+wt_status_requeue_event (WTStatus *status, WTEvent *event)
+{
+    g_queue_push_head (status->event_q, event);
+}
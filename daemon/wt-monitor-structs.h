@@ -23,6 +23,9 @@ typedef struct WTEvent {
      * this queue so that we don't have to rescan the dir from beginning.
      */
     GQueue *remain_files;
+
+    /* Order in which the event was queued, see WTStatus.last_seq. */
+    guint64 seq;
 } WTEvent;
 
 WTEvent *wt_event_new (int type, const char *path, const char *new_path);
@@ -43,6 +46,33 @@ typedef struct WTStatus {
 
     pthread_mutex_t q_lock;
     GQueue *event_q;
+    /* Sequence number of the last queued event. Queued events may be
+     * merged and freed, so consumers remember a position in the queue by
+     * number rather than by pointer.
+     */
+    guint64 last_seq;
+
+    /* Coalescing index over the tail of event_q, protected by q_lock.
+     * pending_updates and pending_attribs map a path to the queue link of
+     * its queued CREATE_OR_UPDATE or ATTRIB event. pending_dirs counts the
+     * indexed CREATE_OR_UPDATE events under each directory. Only events
+     * queued after the last rename, overflow or scan event are indexed,
+     * since those must be processed in order.
+     */
+    GHashTable *pending_updates;
+    GHashTable *pending_attribs;
+    GHashTable *pending_dirs;
+
+    /* Positions in the system change history (see wt-journal.h), protected
+     * by q_lock. queued_pos is the position of the last queued event;
+     * applied_pos is queued_pos as of the last time all queued events had
+     * been applied to the index. journal_source is NULL if the monitor
+     * can't replay changes after a restart.
+     */
+    char       *journal_source;
+    gint64      queued_pos;
+    gint64      applied_pos;
+    gint64      saved_pos;
 
     /* Paths that're updated. They corresponds to CREATE_OR_UPDATE events.
      * Use a separate queue since we need to process them simultaneously with
@@ -59,4 +89,23 @@ void wt_status_ref (WTStatus *status);
 
 void wt_status_unref (WTStatus *status);
 
+/* Queue an event, merging it with pending events for the same path.
+ * Takes q_lock.
+ */
+void wt_status_add_event (WTStatus *status, WTEvent *event);
+
+/* Call after all events popped so far have been applied to the index.
+ * If the queue is empty, the current queued position becomes the
+ * applied position. Takes q_lock.
+ */
+void wt_status_mark_applied (WTStatus *status);
+
+/* Pop the head of the event queue. The caller must hold q_lock. */
+WTEvent *wt_status_pop_event (WTStatus *status);
+
+/* Put an event back to the head of the queue, e.g. after a partial commit.
+ * The event is not merged with later events. The caller must hold q_lock.
+ */
+void wt_status_requeue_event (WTStatus *status, WTEvent *event);
+
 #endif
@@ -2,10 +2,11 @@
 #include "common.h"
 
 #ifndef _WIN32_WINNT
-#define _WIN32_WINNT 0x500
+#define _WIN32_WINNT 0x600
 #endif
 
 #include <windows.h>
+#include <winioctl.h>
 
 #ifndef WIN32
 #include <unistd.h>
@@ -17,6 +18,8 @@
 #include "seafile-session.h"
 #include "utils.h"
 #include "wt-monitor.h"
+#include "wt-journal.h"
+#include "seafile-config.h"
 #define DEBUG_FLAG SEAFILE_DEBUG_WATCH
 #include "log.h"
 
@@ -35,6 +38,25 @@ typedef struct DirWatchAux {
     gboolean unused;
 } DirWatchAux;
 
+#define USN_READ_BUFSIZE (1 << 16) /* 64KB */
+
+#define USN_DATA_REASONS                                          \
+    (USN_REASON_DATA_OVERWRITE | USN_REASON_DATA_EXTEND           \
+     | USN_REASON_DATA_TRUNCATION | USN_REASON_BASIC_INFO_CHANGE)
+
+#define USN_WATCH_REASONS                                         \
+    (USN_DATA_REASONS | USN_REASON_FILE_CREATE                    \
+     | USN_REASON_FILE_DELETE | USN_REASON_RENAME_OLD_NAME        \
+     | USN_REASON_RENAME_NEW_NAME | USN_REASON_CLOSE)
+
+/* Same as DirWatchAux, for asynchronous FSCTL_READ_USN_JOURNAL on the
+   volume handle of a repo watched through the USN journal. */
+typedef struct UsnReadAux {
+    OVERLAPPED ol;
+    READ_USN_JOURNAL_DATA rd;
+    char buf[USN_READ_BUFSIZE];
+} UsnReadAux;
+
 typedef struct RenameInfo {
     char *old_path;
     gboolean processing;        /* Are we processing a rename event? */
@@ -51,6 +73,16 @@ typedef struct RepoWatchInfo {
     RenameInfo *rename_info;
     EventInfo last_event;
     char *worktree;
+
+    /* Set if the repo is watched through the USN journal. */
+    gboolean use_usn;
+    DWORDLONG usn_journal_id;
+    wchar_t *usn_worktree;      /* as returned by GetFinalPathNameByHandleW() */
+    int usn_worktree_len;
+    GHashTable *usn_dir_cache;  /* dir file id -> relative path, or NULL */
+    gboolean usn_has_old_name;
+    DWORDLONG usn_old_frn;
+    char *usn_old_path;         /* NULL if moved from outside the worktree */
 } RepoWatchInfo;
 
 struct SeafWTMonitorPriv {
@@ -63,10 +95,14 @@ struct SeafWTMonitorPriv {
 
     int cmd_bytes_read;
     WatchCommand cmd;
+
+    gboolean use_usn_journal;
 };
 
 static void *wt_monitor_job_win32 (void *vmonitor);
 
+static BOOL usn_start_read (SeafWTMonitorPriv *priv, HANDLE volume);
+
 static void handle_watch_command (SeafWTMonitor *monitor, WatchCommand *cmd);
 
 /* RenameInfo */
@@ -121,6 +157,10 @@ free_repo_watch_info (RepoWatchInfo *info)
     wt_status_unref (info->status);
     free_rename_info (info->rename_info);
     g_free (info->worktree);
+    g_free (info->usn_worktree);
+    if (info->usn_dir_cache)
+        g_hash_table_destroy (info->usn_dir_cache);
+    g_free (info->usn_old_path);
     g_free (info);
 }
 
@@ -166,9 +206,7 @@ add_event_to_queue (WTStatus *status,
 
     seaf_debug ("Adding event: %s, %s %s\n", name, path, new_path?new_path:"");
 
-    pthread_mutex_lock (&status->q_lock);
-    g_queue_push_tail (status->event_q, event);
-    pthread_mutex_unlock (&status->q_lock);
+    wt_status_add_event (status, event);
 
     if (type == WT_EVENT_CREATE_OR_UPDATE) {
         pthread_mutex_lock (&status->ap_q_lock);
@@ -327,6 +365,11 @@ add_handle_to_iocp (SeafWTMonitor *monitor, HANDLE hAdd)
         /* HANDLE is cmd_pipe */
         return start_watch_cmd_pipe (monitor, NULL);
     } else {
+        RepoWatchInfo *info = g_hash_table_lookup (priv->info_hash, hAdd);
+        if (info && info->use_usn)
+            /* HANDLE is a volume handle */
+            return usn_start_read (priv, hAdd);
+
         /* HANDLE is a dir handle */
         return start_watch_dir_change (priv, hAdd);
     }
@@ -506,8 +549,415 @@ process_one_event (RepoWatchInfo *info,
 
 out:
     g_free (filename);
-    g_atomic_int_set (&info->status->last_changed, (gint)time(NULL));
+    seaf_wt_monitor_mark_changed (info->status);
+
+}
+
+/* USN journal */
+
+/*
+ * With the USN journal, a repo is watched through its own handle of the
+ * volume. Each completed FSCTL_READ_USN_JOURNAL returns the records since
+ * the last read. Records only carry the file reference number of the
+ * parent dir, which is resolved to a path and matched against the
+ * worktree. Unlike ReadDirectoryChangesW the journal doesn't overflow,
+ * and reading can resume from the USN saved in the worktree journal after
+ * a restart.
+ */
+
+static int
+usn_query_journal (HANDLE volume, USN_JOURNAL_DATA *data)
+{
+    OVERLAPPED ol;
+    HANDLE event;
+    DWORD bytes;
+    int ret = -1;
+
+    event = CreateEvent (NULL, TRUE, FALSE, NULL);
+    if (!event)
+        return -1;
+
+    /* Setting the low-order bit of hEvent keeps the completion from being
+     * queued to the IOCP the volume handle may be associated with.
+     */
+    memset (&ol, 0, sizeof(ol));
+    ol.hEvent = (HANDLE)((DWORD_PTR)event | 1);
+
+    if (!DeviceIoControl (volume, FSCTL_QUERY_USN_JOURNAL, NULL, 0,
+                          data, sizeof(*data), &bytes, &ol) &&
+        GetLastError () != ERROR_IO_PENDING)
+        goto out;
+
+    if (!GetOverlappedResult (volume, &ol, &bytes, TRUE))
+        goto out;
+
+    ret = 0;
+
+out:
+    CloseHandle (event);
+    return ret;
+}
+
+static char *
+usn_relative_path (RepoWatchInfo *info, const wchar_t *path, int len)
+{
+    int wt_len = info->usn_worktree_len;
+
+    if (len < wt_len || _wcsnicmp (path, info->usn_worktree, wt_len) != 0)
+        return NULL;
+    if (len == wt_len)
+        return g_strdup ("");
+    if (path[wt_len] != L'\\')
+        return NULL;
+
+    return convert_to_unix_path (info->worktree, path + wt_len + 1,
+                                 (len - wt_len - 1) * sizeof(wchar_t), FALSE);
+}
+
+/* Returns the path of a dir relative to the worktree, or NULL if it's not
+ * in the worktree. Results are cached until the end of the current batch
+ * or the next dir rename.
+ */
+static char *
+usn_resolve_dir (RepoWatchInfo *info, HANDLE volume, DWORDLONG frn)
+{
+    char key[32];
+    gpointer value;
+    FILE_ID_DESCRIPTOR fid;
+    wchar_t path[SEAF_PATH_MAX];
+    HANDLE handle;
+    DWORD len;
+    char *ret = NULL;
+
+    snprintf (key, sizeof(key), "%llx", (unsigned long long)frn);
+    if (g_hash_table_lookup_extended (info->usn_dir_cache, key, NULL, &value))
+        return g_strdup (value);
+
+    memset (&fid, 0, sizeof(fid));
+    fid.dwSize = sizeof(fid);
+    fid.Type = FileIdType;
+    fid.FileId.QuadPart = (LONGLONG)frn;
+
+    handle = OpenFileById (volume, &fid, FILE_READ_ATTRIBUTES,
+                           FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                           NULL, FILE_FLAG_BACKUP_SEMANTICS);
+    if (handle != INVALID_HANDLE_VALUE) {
+        len = GetFinalPathNameByHandleW (handle, path, SEAF_PATH_MAX,
+                                         FILE_NAME_NORMALIZED | VOLUME_NAME_DOS);
+        CloseHandle (handle);
+        if (len > 0 && len < SEAF_PATH_MAX)
+            ret = usn_relative_path (info, path, len);
+    }
+
+    g_hash_table_insert (info->usn_dir_cache, g_strdup (key), g_strdup (ret));
+    return ret;
+}
+
+static void
+usn_process_record (RepoWatchInfo *info, HANDLE volume, USN_RECORD *rec)
+{
+    WTStatus *status = info->status;
+    DWORD reason = rec->Reason;
+    gboolean is_dir = (rec->FileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+    char *dir, *name = NULL, *path = NULL;
+
+    if (rec->MajorVersion != 2)
+        return;
+
+    dir = usn_resolve_dir (info, volume, rec->ParentFileReferenceNumber);
+    if (dir) {
+        name = g_utf16_to_utf8 ((gunichar2 *)((char *)rec + rec->FileNameOffset),
+                                rec->FileNameLength / sizeof(WCHAR),
+                                NULL, NULL, NULL);
+        if (name)
+            path = (*dir) ? g_strconcat (dir, "/", name, NULL) : g_strdup (name);
+    }
+
+    /* Paths of everything under a renamed or deleted dir change. */
+    if (is_dir && (reason & (USN_REASON_RENAME_OLD_NAME |
+                             USN_REASON_RENAME_NEW_NAME |
+                             USN_REASON_FILE_DELETE)))
+        g_hash_table_remove_all (info->usn_dir_cache);
+
+    if (reason & USN_REASON_RENAME_OLD_NAME) {
+        g_free (info->usn_old_path);
+        info->usn_old_path = path;
+        info->usn_old_frn = rec->FileReferenceNumber;
+        info->usn_has_old_name = TRUE;
+        path = NULL;
+    } else if (reason & USN_REASON_RENAME_NEW_NAME) {
+        if (info->usn_has_old_name &&
+            info->usn_old_frn == rec->FileReferenceNumber) {
+            if (info->usn_old_path && path)
+                add_event_to_queue (status, WT_EVENT_RENAME,
+                                    info->usn_old_path, path);
+            else if (info->usn_old_path)
+                add_event_to_queue (status, WT_EVENT_DELETE,
+                                    info->usn_old_path, NULL);
+            else if (path)
+                add_event_to_queue (status, WT_EVENT_CREATE_OR_UPDATE,
+                                    path, NULL);
+            g_free (info->usn_old_path);
+            info->usn_old_path = NULL;
+            info->usn_has_old_name = FALSE;
+        } else if (path && !(reason & USN_REASON_CLOSE)) {
+            /* The old name record was before the position reading started. */
+            add_event_to_queue (status, WT_EVENT_CREATE_OR_UPDATE, path, NULL);
+        }
+    } else if (!path) {
+        /* Not in the worktree. */
+    } else if (reason & USN_REASON_FILE_DELETE) {
+        add_event_to_queue (status, WT_EVENT_DELETE, path, NULL);
+    } else if ((reason & USN_REASON_CLOSE) &&
+               ((reason & USN_REASON_FILE_CREATE) ||
+                (!is_dir && (reason & USN_DATA_REASONS)))) {
+        /* Modifications are reported once, when the file is closed.
+         * Modified events for directories are ignored.
+         */
+        add_event_to_queue (status, WT_EVENT_CREATE_OR_UPDATE, path, NULL);
+    }
+
+    if (dir)
+        seaf_wt_monitor_mark_changed (status);
+
+    g_free (dir);
+    g_free (name);
+    g_free (path);
+}
+
+static void
+usn_process_records (RepoWatchInfo *info, HANDLE volume,
+                     UsnReadAux *aux, DWORD bytes)
+{
+    USN next;
+    USN_RECORD *rec;
+    DWORD offset;
+
+    /* The output starts with the USN to continue reading from. */
+    if (bytes < sizeof(USN))
+        return;
+    next = *(USN *)aux->buf;
+
+    offset = sizeof(USN);
+    while (offset + sizeof(USN_RECORD) <= bytes) {
+        rec = (USN_RECORD *)(aux->buf + offset);
+        if (rec->RecordLength == 0 || offset + rec->RecordLength > bytes)
+            break;
+        usn_process_record (info, volume, rec);
+        offset += rec->RecordLength;
+    }
+
+    g_hash_table_remove_all (info->usn_dir_cache);
+
+    aux->rd.StartUsn = next;
+
+    pthread_mutex_lock (&info->status->q_lock);
+    info->status->queued_pos = (gint64)next;
+    pthread_mutex_unlock (&info->status->q_lock);
+}
+
+static BOOL
+usn_issue_read (HANDLE volume, UsnReadAux *aux)
+{
+    memset (&aux->ol, 0, sizeof(aux->ol));
+
+    return (DeviceIoControl (volume, FSCTL_READ_USN_JOURNAL,
+                             &aux->rd, sizeof(aux->rd),
+                             aux->buf, USN_READ_BUFSIZE,
+                             NULL, &aux->ol) ||
+            GetLastError () == ERROR_IO_PENDING);
+}
+
+static char *
+usn_journal_source (const wchar_t *volume_name, DWORDLONG journal_id)
+{
+    char *volume = g_utf16_to_utf8 (volume_name, -1, NULL, NULL, NULL);
+    char *source;
+
+    source = g_strdup_printf ("%s:%"G_GINT64_MODIFIER"x",
+                              volume ? volume : "", (guint64)journal_id);
+    g_free (volume);
+    return source;
+}
+
+/* Reading failed, e.g. because the journal was deleted or wrapped past our
+ * position. Continue from the current end of the journal and rescan.
+ */
+static BOOL
+usn_restart (RepoWatchInfo *info, HANDLE volume, UsnReadAux *aux, DWORD error)
+{
+    USN_JOURNAL_DATA ujd;
+    char *source, *colon;
+
+    seaf_warning ("[wt mon] Failed to read USN journal for repo %s, "
+                  "error code %lu. Fall back to scan.\n",
+                  info->status->repo_id, error);
+
+    if (usn_query_journal (volume, &ujd) < 0) {
+        seaf_warning ("[wt mon] Failed to query USN journal for repo %s, "
+                      "error code %lu.\n", info->status->repo_id, GetLastError());
+        return FALSE;
+    }
+
+    aux->rd.StartUsn = ujd.NextUsn;
+    aux->rd.UsnJournalID = ujd.UsnJournalID;
+
+    add_event_to_queue (info->status, WT_EVENT_OVERFLOW, NULL, NULL);
+
+    pthread_mutex_lock (&info->status->q_lock);
+    if (ujd.UsnJournalID != info->usn_journal_id) {
+        /* The journal was recreated. Same volume, new journal id. */
+        source = info->status->journal_source;
+        colon = strrchr (source, ':');
+        if (colon)
+            *colon = '\0';
+        info->status->journal_source =
+            g_strdup_printf ("%s:%"G_GINT64_MODIFIER"x",
+                             source, (guint64)ujd.UsnJournalID);
+        g_free (source);
+        info->usn_journal_id = ujd.UsnJournalID;
+    }
+    info->status->queued_pos = (gint64)ujd.NextUsn;
+    pthread_mutex_unlock (&info->status->q_lock);
 
+    if (!usn_issue_read (volume, aux)) {
+        seaf_warning ("[wt mon] Failed to read USN journal for repo %s, "
+                      "error code %lu.\n", info->status->repo_id, GetLastError());
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static BOOL
+usn_start_read (SeafWTMonitorPriv *priv, HANDLE volume)
+{
+    RepoWatchInfo *info = g_hash_table_lookup (priv->info_hash, volume);
+    UsnReadAux *aux = g_hash_table_lookup (priv->buf_hash, volume);
+
+    if (!info || !aux)
+        return FALSE;
+
+    if (usn_issue_read (volume, aux))
+        return TRUE;
+
+    return usn_restart (info, volume, aux, GetLastError ());
+}
+
+/* Returns the volume handle, which is used like the dir handle of a repo
+ * watched with ReadDirectoryChangesW().
+ */
+static HANDLE
+usn_add_watch (SeafWTMonitorPriv *priv, const char *repo_id, const char *worktree)
+{
+    wchar_t *path = wchar_from_utf8 (worktree);
+    wchar_t volume_path[MAX_PATH], volume_name[MAX_PATH];
+    wchar_t final_path[SEAF_PATH_MAX];
+    HANDLE volume = INVALID_HANDLE_VALUE, dir, ret = NULL;
+    USN_JOURNAL_DATA ujd;
+    DWORD len;
+    char *source = NULL, *saved_source = NULL;
+    gint64 saved_pos;
+    gboolean replay = FALSE;
+    RepoWatchInfo *info;
+    UsnReadAux *aux;
+
+    if (!GetVolumePathNameW (path, volume_path, MAX_PATH) ||
+        !GetVolumeNameForVolumeMountPointW (volume_path, volume_name, MAX_PATH)) {
+        seaf_warning ("[wt mon] Failed to get volume of %s, error code %lu.\n",
+                      worktree, GetLastError());
+        goto out;
+    }
+
+    /* Without the trailing backslash the name opens the volume itself. */
+    len = wcslen (volume_name);
+    if (len > 0 && volume_name[len - 1] == L'\\')
+        volume_name[len - 1] = 0;
+
+    /* Opening a volume needs administrator privileges. */
+    volume = CreateFileW (volume_name, GENERIC_READ,
+                          FILE_SHARE_READ | FILE_SHARE_WRITE,
+                          NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+    if (volume == INVALID_HANDLE_VALUE) {
+        seaf_warning ("[wt mon] Failed to open volume of %s, error code %lu.\n",
+                      worktree, GetLastError());
+        goto out;
+    }
+
+    if (usn_query_journal (volume, &ujd) < 0) {
+        seaf_warning ("[wt mon] No USN journal on volume of %s, error code %lu.\n",
+                      worktree, GetLastError());
+        goto out;
+    }
+
+    dir = CreateFileW (path, FILE_READ_ATTRIBUTES,
+                       FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                       NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+    if (dir == INVALID_HANDLE_VALUE) {
+        seaf_warning ("[wt mon] Failed to open %s, error code %lu.\n",
+                      worktree, GetLastError());
+        goto out;
+    }
+    len = GetFinalPathNameByHandleW (dir, final_path, SEAF_PATH_MAX,
+                                     FILE_NAME_NORMALIZED | VOLUME_NAME_DOS);
+    CloseHandle (dir);
+    if (len == 0 || len >= SEAF_PATH_MAX) {
+        seaf_warning ("[wt mon] Failed to resolve %s.\n", worktree);
+        goto out;
+    }
+
+    aux = g_new0 (UsnReadAux, 1);
+    aux->rd.StartUsn = ujd.NextUsn;
+    aux->rd.ReasonMask = USN_WATCH_REASONS;
+    aux->rd.ReturnOnlyOnClose = FALSE;
+    aux->rd.Timeout = 0;
+    aux->rd.BytesToWaitFor = 1;
+    aux->rd.UsnJournalID = ujd.UsnJournalID;
+
+    /* Resume from the saved position if it's still in the journal. */
+    source = usn_journal_source (volume_name, ujd.UsnJournalID);
+    if (wt_journal_load (repo_id, worktree, &saved_source, &saved_pos) == 0 &&
+        strcmp (saved_source, source) == 0 &&
+        saved_pos >= ujd.FirstUsn && saved_pos <= ujd.NextUsn) {
+        aux->rd.StartUsn = saved_pos;
+        replay = TRUE;
+    }
+
+    info = create_repo_watch_info (repo_id, worktree);
+    info->use_usn = TRUE;
+    info->usn_journal_id = ujd.UsnJournalID;
+    info->usn_worktree = g_memdup (final_path, (len + 1) * sizeof(wchar_t));
+    info->usn_worktree_len = len;
+    info->usn_dir_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                 g_free, g_free);
+    info->status->journal_source = source;
+    info->status->queued_pos = (gint64)aux->rd.StartUsn;
+    source = NULL;
+
+    if (replay)
+        seaf_message ("[wt mon] Replaying changes of repo %s since USN %lld.\n",
+                      repo_id, (long long)aux->rd.StartUsn);
+    else
+        add_event_to_queue (info->status, WT_EVENT_SCAN_DIR, "", NULL);
+
+    g_hash_table_insert (priv->buf_hash, (gpointer)volume, aux);
+
+    pthread_mutex_lock (&priv->hash_lock);
+    g_hash_table_insert (priv->handle_hash,
+                         g_strdup(repo_id), (gpointer)volume);
+    g_hash_table_insert (priv->info_hash, (gpointer)volume, info);
+    pthread_mutex_unlock (&priv->hash_lock);
+
+    ret = volume;
+    volume = INVALID_HANDLE_VALUE;
+
+out:
+    if (volume != INVALID_HANDLE_VALUE)
+        CloseHandle (volume);
+    g_free (saved_source);
+    g_free (source);
+    g_free (path);
+    return ret;
 }
 
 static gboolean
@@ -568,8 +1018,22 @@ wt_monitor_job_win32 (void *vmonitor)
         static int retry;
 
         if (!ret) {
+            DWORD error = GetLastError ();
+
+            /* A failed read on a volume handle. */
+            if (ol && key != (ULONG_PTR)monitor->cmd_pipe[0]) {
+                info = g_hash_table_lookup (priv->info_hash, (gconstpointer)key);
+                if (info && info->use_usn) {
+                    usn_restart (info, (HANDLE)key,
+                                 g_hash_table_lookup (priv->buf_hash,
+                                                      (gconstpointer)key),
+                                 error);
+                    continue;
+                }
+            }
+
             seaf_warning ("GetQueuedCompletionStatus failed, "
-                          "error code %lu", GetLastError());
+                          "error code %lu", error);
 
             if (retry++ < 3)
                 continue;
@@ -606,7 +1070,13 @@ wt_monitor_job_win32 (void *vmonitor)
             info = (RepoWatchInfo *)g_hash_table_lookup
                 (priv->info_hash, (gconstpointer)hTriggered); 
 
-            if (info) {
+            if (info && info->use_usn) {
+                UsnReadAux *aux = g_hash_table_lookup (priv->buf_hash,
+                                                       (gconstpointer)hTriggered);
+
+                usn_process_records (info, hTriggered, aux, bytesRead);
+                usn_start_read (priv, hTriggered);
+            } else if (info) {
                 DirWatchAux *aux = g_hash_table_lookup (priv->buf_hash,
                                                         (gconstpointer)hTriggered);
 
@@ -668,6 +1138,14 @@ static HANDLE add_watch (SeafWTMonitorPriv *priv,
     wchar_t *path = NULL;
     RepoWatchInfo *info;
 
+    if (priv->use_usn_journal) {
+        dir_handle = usn_add_watch (priv, repo_id, worktree);
+        if (dir_handle)
+            return dir_handle;
+        seaf_warning ("[wt mon] Fall back to ReadDirectoryChangesW for repo %s.\n",
+                      repo_id);
+    }
+
     /* worktree is in utf8, need to convert to wchar in win32 */
     path = wchar_from_utf8 (worktree);
 
@@ -801,6 +1279,9 @@ seaf_wt_monitor_new (SeafileSession *seaf)
     priv->buf_hash = g_hash_table_new_full
         (g_direct_hash, g_direct_equal, NULL, g_free);
 
+    priv->use_usn_journal = seafile_session_config_get_bool (seaf,
+                                                             KEY_USE_USN_JOURNAL);
+
     monitor->priv = priv;
     monitor->seaf = seaf;
 
@@ -822,7 +1303,7 @@ seaf_wt_monitor_get_worktree_status (SeafWTMonitor *monitor,
     if (!g_hash_table_lookup_extended (priv->handle_hash, repo_id,
                                        &key, &value)) {
         pthread_mutex_unlock (&priv->hash_lock);
-        return NULL;
+        return seaf_wt_monitor_get_replay_status (monitor, repo_id);
     }
 
     info = g_hash_table_lookup(priv->info_hash, value);
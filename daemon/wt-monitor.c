@@ -2,6 +2,8 @@
 
 #include "common.h"
 
+#include <pthread.h>
+
 #include "seafile-session.h"
 
 #include "utils.h"
@@ -11,6 +13,57 @@
 
 #include "job-mgr.h"
 
+static pthread_mutex_t replay_lock = PTHREAD_MUTEX_INITIALIZER;
+/* repo_id -> WTStatus */
+static GHashTable *replay_statuses;
+
+void
+seaf_wt_monitor_mark_changed (WTStatus *status)
+{
+    g_atomic_int_set (&status->last_changed, (gint)time(NULL));
+    /* Changes are committed after the worktree has been quiet for 2s. */
+    seaf_sync_manager_wake_repo (seaf->sync_mgr, status->repo_id, 2);
+}
+
+void
+seaf_wt_monitor_add_replay_status (SeafWTMonitor *monitor, WTStatus *status)
+{
+    pthread_mutex_lock (&replay_lock);
+    if (!replay_statuses)
+        replay_statuses = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                 g_free,
+                                                 (GDestroyNotify)wt_status_unref);
+    wt_status_ref (status);
+    g_hash_table_replace (replay_statuses, g_strdup (status->repo_id), status);
+    pthread_mutex_unlock (&replay_lock);
+}
+
+void
+seaf_wt_monitor_remove_replay_status (SeafWTMonitor *monitor,
+                                      const char *repo_id)
+{
+    pthread_mutex_lock (&replay_lock);
+    if (replay_statuses)
+        g_hash_table_remove (replay_statuses, repo_id);
+    pthread_mutex_unlock (&replay_lock);
+}
+
+WTStatus *
+seaf_wt_monitor_get_replay_status (SeafWTMonitor *monitor,
+                                   const char *repo_id)
+{
+    WTStatus *status = NULL;
+
+    pthread_mutex_lock (&replay_lock);
+    if (replay_statuses)
+        status = g_hash_table_lookup (replay_statuses, repo_id);
+    if (status)
+        wt_status_ref (status);
+    pthread_mutex_unlock (&replay_lock);
+
+    return status;
+}
+
 int
 seaf_wt_monitor_start (SeafWTMonitor *monitor)
 {
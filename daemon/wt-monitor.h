@@ -53,4 +53,28 @@ WTStatus *
 seaf_wt_monitor_get_worktree_status (SeafWTMonitor *monitor,
                                      const char *repo_id);
 
+/*
+ * Statuses not backed by a watched worktree, which events are queued to by
+ * hand, e.g. when replaying recorded events. They're returned by
+ * seaf_wt_monitor_get_worktree_status() for repos that aren't watched.
+ * Adding takes a reference to @status.
+ */
+void
+seaf_wt_monitor_add_replay_status (SeafWTMonitor *monitor, WTStatus *status);
+
+void
+seaf_wt_monitor_remove_replay_status (SeafWTMonitor *monitor,
+                                      const char *repo_id);
+
+/* Used by the platform monitors. Returns a new reference or NULL. */
+WTStatus *
+seaf_wt_monitor_get_replay_status (SeafWTMonitor *monitor,
+                                   const char *repo_id);
+
+/* Called by the monitor threads when a worktree changed. Wakes up auto sync
+ * for the repo once it's time to commit the change.
+ */
+void
+seaf_wt_monitor_mark_changed (WTStatus *status);
+
 #endif
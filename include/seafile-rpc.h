@@ -22,6 +22,10 @@ GObject* seafile_get_repo (const gchar* id, GError **error);
 GObject *
 seafile_get_repo_sync_task (const char *repo_id, GError **error);
 
+/* Wall clock and CPU time per phase of the last syncs of a repo. */
+json_t *
+seafile_get_repo_sync_timings (const char *repo_id, GError **error);
+
 /* [seafile_get_config] returns the value of the config entry whose name is
  * [key] in config.db
  */
@@ -80,6 +84,17 @@ seafile_update_repos_server_host (const char *old_server_url,
                                   const char *new_server_url,
                                   GError **error);
 
+/* Returns the size of the files under @path in MB. */
+int seafile_calc_dir_size (const char *path, GError **error);
+
+/* Starts calculating the size of @path in the background. */
+int seafile_start_calc_dir_size (const char *path, GError **error);
+
+/* Returns the size of @path found so far and an estimate of the total, see
+ * seaf_dir_size_get_progress().
+ */
+json_t * seafile_get_calc_dir_size_progress (const char *path, GError **error);
+
 int seafile_disable_auto_sync (GError **error);
 
 int seafile_enable_auto_sync (GError **error);
@@ -92,12 +107,28 @@ seafile_get_path_sync_status (const char *repo_id,
                               int is_dir,
                               GError **error);
 
+/* @paths_json is a json array of paths, with directories ending in '/'.
+ * Returns a json object mapping each of them to its sync status.
+ */
+json_t *
+seafile_get_paths_sync_status (const char *repo_id,
+                               const char *paths_json,
+                               GError **error);
+
 int
 seafile_mark_file_locked (const char *repo_id, const char *path, GError **error);
 
 int
 seafile_mark_file_unlocked (const char *repo_id, const char *path, GError **error);
 
+/* Downloads the content of an on-demand placeholder. Blocks until done. */
+int
+seafile_hydrate_file (const char *repo_id, const char *path, GError **error);
+
+/* Turns a synced file in an on-demand repo back into a placeholder. */
+int
+seafile_dehydrate_file (const char *repo_id, const char *path, GError **error);
+
 char *
 seafile_get_server_property (const char *server_url, const char *key, GError **error);
 
@@ -110,6 +141,12 @@ seafile_set_server_property (const char *server_url,
 GList *
 seafile_get_file_sync_errors (int offset, int limit, GError **error);
 
+/* Pages the errors by the smallest id of the previous page, 0 for the
+ * first page. Unlike offsets, pages don't shift when errors are added.
+ */
+GList *
+seafile_get_file_sync_errors_before (int before_id, int limit, GError **error);
+
 int
 seafile_del_file_sync_error_by_id (int id, GError **error);
 
@@ -204,6 +241,15 @@ GList *
 seafile_diff (const char *repo_id, const char *old, const char *new,
               int fold_dir_diff, GError **error);
 
+/*
+ * Returns up to @limit commits of the repo's history, the latest first, and
+ * "next", the cursor to pass for the next page or null at the end. Pass an
+ * empty @cursor for the first page.
+ */
+json_t *
+seafile_get_commit_history (const char *repo_id, const char *cursor, int limit,
+                            GError **error);
+
 GObject *
 seafile_generate_magic_and_random_key(int enc_version,
                                       const char* repo_id,
@@ -211,6 +257,76 @@ seafile_generate_magic_and_random_key(int enc_version,
                                       GError **error);
 json_t * seafile_get_sync_notification (GError **error);
 
+/*
+ * Blocks the calling client for up to @timeout seconds, at most 60, until
+ * a sync notification arrives. Returns an array of the notifications
+ * queued by then, empty on timeout. Use a dedicated client connection, the
+ * connection can't serve other calls meanwhile.
+ */
+json_t * seafile_wait_sync_notifications (int timeout, GError **error);
+
+/* Returns hit/miss counters and usage of the parsed dir object cache. */
+json_t * seafile_get_fs_cache_stats (GError **error);
+
+/* Returns the counters, gauges and latency summaries of the daemon. */
+json_t * seafile_get_metrics (GError **error);
+
+/* Starts or stops recording trace spans. Starting drops earlier spans. */
+int seafile_set_trace_enabled (int enabled, GError **error);
+
+/* Writes the recorded spans in the Chrome trace format to @path, or to
+ * trace.json in the seafile data dir if @path is empty.
+ */
+int seafile_dump_trace (const char *path, GError **error);
+
+/* Starts recording the worktree events of a repo to @path, for replaying
+ * them with seaf-bench.
+ */
+int seafile_start_wt_event_recording (const char *repo_id, const char *path,
+                                      GError **error);
+
+int seafile_stop_wt_event_recording (const char *repo_id, GError **error);
+
+/* Downloads the files under @path in a repo ahead of the others, e.g. when
+ * the user opens the folder. Also reorders a download that is running.
+ */
+int seafile_prioritize_download (const char *repo_id, const char *path,
+                                 GError **error);
+
+int seafile_clear_download_priorities (const char *repo_id, GError **error);
+
+/* Returns whether the connection is metered and the machine on battery,
+ * and how transfers are limited because of it.
+ */
+json_t * seafile_get_transfer_policy (GError **error);
+
+/* Forces @condition ("metered" or "battery") on (1) or off (0), or goes
+ * back to detecting it (-1).
+ */
+int seafile_set_transfer_policy_override (const char *condition, int value,
+                                          GError **error);
+
+/* Returns the memory limit and the buffer memory used by each subsystem. */
+json_t * seafile_get_memory_usage (GError **error);
+
+/* Returns whether indexing and checkout run with background priority. */
+json_t * seafile_get_work_mode (GError **error);
+
+/*
+ * Returns the repos, with their sync and transfer tasks, and the clone
+ * tasks that changed since version @since, which is the "version" returned
+ * by the last call. Pass 0 to get all of them.
+ */
+json_t * seafile_get_repo_state_changes (gint64 since, GError **error);
+
+/* Returns the sync, transfer and clone tasks of all repos. */
+json_t * seafile_get_task_states (GError **error);
+
+/* Returns the progress of the running integrity check and the last result
+ * of every repo checked since the daemon started.
+ */
+json_t * seafile_get_scrub_status (GError **error);
+
 int
 seafile_shutdown (GError **error);
 
@@ -23,6 +23,15 @@ sqlite_open_db (const char *db_path, sqlite3 **db)
         return -1;
     }
 
+    /* With WAL, readers don't wait for writers, and with synchronous=NORMAL
+     * a commit doesn't wait for fsync. The database still can't be corrupted
+     * by a crash; at worst the last commits are lost on power failure.
+     * Databases on file systems without shared memory stay in the default
+     * journal mode.
+     */
+    sqlite_query_exec (*db, "PRAGMA journal_mode=WAL;");
+    sqlite_query_exec (*db, "PRAGMA synchronous=NORMAL;");
+
     return 0;
 }
 
@@ -84,6 +93,107 @@ sqlite_end_transaction (sqlite3 *db)
     return sqlite_query_exec (db, sql);
 }
 
+int
+sqlite_batch_begin (sqlite3 *db)
+{
+    /* A savepoint outside of a transaction starts one, and savepoints nest. */
+    return sqlite_query_exec (db, "SAVEPOINT batch;");
+}
+
+int
+sqlite_batch_end (sqlite3 *db, gboolean commit)
+{
+    if (!commit) {
+        sqlite_query_exec (db, "ROLLBACK TO batch;");
+        sqlite_query_exec (db, "RELEASE batch;");
+        return 0;
+    }
+
+    return sqlite_query_exec (db, "RELEASE batch;");
+}
+
+/* The least recently used statement is finalized when the cache is full. */
+#define MAX_CACHED_STMTS 64
+
+typedef struct {
+    char *sql;
+    sqlite3_stmt *stmt;
+} CachedStmt;
+
+struct SqliteStmtCache {
+    sqlite3 *db;
+    GHashTable *stmts;          /* sql -> link in lru */
+    GQueue lru;                 /* CachedStmt, most recently used first */
+};
+
+static void
+cached_stmt_free (CachedStmt *cached)
+{
+    sqlite3_finalize (cached->stmt);
+    g_free (cached->sql);
+    g_free (cached);
+}
+
+SqliteStmtCache *
+sqlite_stmt_cache_new (sqlite3 *db)
+{
+    SqliteStmtCache *cache = g_new0 (SqliteStmtCache, 1);
+
+    cache->db = db;
+    cache->stmts = g_hash_table_new (g_str_hash, g_str_equal);
+    g_queue_init (&cache->lru);
+
+    return cache;
+}
+
+void
+sqlite_stmt_cache_free (SqliteStmtCache *cache)
+{
+    if (!cache)
+        return;
+
+    g_hash_table_destroy (cache->stmts);
+    g_queue_foreach (&cache->lru, (GFunc)cached_stmt_free, NULL);
+    g_queue_clear (&cache->lru);
+    g_free (cache);
+}
+
+sqlite3_stmt *
+sqlite_stmt_cache_get (SqliteStmtCache *cache, const char *sql)
+{
+    GList *link;
+    CachedStmt *cached;
+    sqlite3_stmt *stmt;
+
+    link = g_hash_table_lookup (cache->stmts, sql);
+    if (link) {
+        g_queue_unlink (&cache->lru, link);
+        g_queue_push_head_link (&cache->lru, link);
+        cached = link->data;
+        sqlite3_reset (cached->stmt);
+        sqlite3_clear_bindings (cached->stmt);
+        return cached->stmt;
+    }
+
+    stmt = sqlite_query_prepare (cache->db, sql);
+    if (!stmt)
+        return NULL;
+
+    if (g_queue_get_length (&cache->lru) >= MAX_CACHED_STMTS) {
+        cached = g_queue_pop_tail (&cache->lru);
+        g_hash_table_remove (cache->stmts, cached->sql);
+        cached_stmt_free (cached);
+    }
+
+    cached = g_new0 (CachedStmt, 1);
+    cached->sql = g_strdup (sql);
+    cached->stmt = stmt;
+    g_queue_push_head (&cache->lru, cached);
+    g_hash_table_insert (cache->stmts, cached->sql, cache->lru.head);
+
+    return stmt;
+}
+
 
 gboolean
 sqlite_check_for_existence (sqlite3 *db, const char *sql)
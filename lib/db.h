@@ -15,6 +15,30 @@ int sqlite_query_exec (sqlite3 *db, const char *sql);
 int sqlite_begin_transaction (sqlite3 *db);
 int sqlite_end_transaction (sqlite3 *db);
 
+/* Run the writes between the two calls in one transaction. Batches can be
+ * nested, and only the outermost one commits. Pass FALSE as @commit to
+ * roll back the writes made since the matching sqlite_batch_begin().
+ */
+int sqlite_batch_begin (sqlite3 *db);
+int sqlite_batch_end (sqlite3 *db, gboolean commit);
+
+/*
+ * Prepared statements kept for the lifetime of a connection, for queries
+ * that run often with different parameters. Use it under the same lock as
+ * the connection. SQLite prepares the statements again by itself when the
+ * schema changes.
+ */
+typedef struct SqliteStmtCache SqliteStmtCache;
+
+SqliteStmtCache *sqlite_stmt_cache_new (sqlite3 *db);
+
+void sqlite_stmt_cache_free (SqliteStmtCache *cache);
+
+/* Returns a statement without bindings, or NULL on error. Don't finalize
+ * it; call sqlite3_reset() when done so it doesn't hold the read lock.
+ */
+sqlite3_stmt *sqlite_stmt_cache_get (SqliteStmtCache *cache, const char *sql);
+
 gboolean sqlite_check_for_existence (sqlite3 *db, const char *sql);
 
 typedef gboolean (*SqliteRowFunc) (sqlite3_stmt *stmt, void *data);
@@ -92,4 +92,9 @@ func_table = [
     [ "object", ["string", "string", "string", "string", "string", "string", "string", "int", "int"] ],
     [ "object", ["string", "string", "string", "string", "string", "string", "int", "string", "int", "int"] ],
     [ "json", [] ],
+    [ "json", ["int"] ],
+    [ "json", ["int64"] ],
+    [ "json", ["string"] ],
+    [ "json", ["string", "string"] ],
+    [ "json", ["string", "string", "int"] ],
 ]
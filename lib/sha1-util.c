@@ -0,0 +1,61 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include "sha1-util.h"
+
+void
+seaf_sha1_init (SeafSHA1Ctx *ctx)
+{
+#ifdef USE_GPL_CRYPTO
+    sha1_init (ctx);
+#else
+    ctx->md = EVP_MD_CTX_new ();
+    if (!ctx->md || EVP_DigestInit_ex (ctx->md, EVP_sha1 (), NULL) != 1)
+        g_error ("Failed to init SHA-1 context.\n");
+#endif
+}
+
+void
+seaf_sha1_update (SeafSHA1Ctx *ctx, const void *data, size_t len)
+{
+#ifdef USE_GPL_CRYPTO
+    sha1_update (ctx, len, data);
+#else
+    EVP_DigestUpdate (ctx->md, data, len);
+#endif
+}
+
+void
+seaf_sha1_final (SeafSHA1Ctx *ctx, unsigned char sha1[20])
+{
+#ifdef USE_GPL_CRYPTO
+    sha1_digest (ctx, 20, sha1);
+#else
+    EVP_DigestFinal_ex (ctx->md, sha1, NULL);
+    seaf_sha1_cleanup (ctx);
+#endif
+}
+
+void
+seaf_sha1_cleanup (SeafSHA1Ctx *ctx)
+{
+#ifndef USE_GPL_CRYPTO
+    EVP_MD_CTX_free (ctx->md);
+    ctx->md = NULL;
+#endif
+}
+
+void
+seaf_sha1 (const void *data, size_t len, unsigned char sha1[20])
+{
+#ifdef USE_GPL_CRYPTO
+    SeafSHA1Ctx ctx;
+
+    seaf_sha1_init (&ctx);
+    seaf_sha1_update (&ctx, data, len);
+    seaf_sha1_final (&ctx, sha1);
+#else
+    EVP_Digest (data, len, sha1, NULL, EVP_sha1 (), NULL);
+#endif
+}
@@ -0,0 +1,47 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SHA1_UTIL_H
+#define SHA1_UTIL_H
+
+/*
+ * SHA-1 used for block and object ids.
+ *
+ * This wraps the crypto library rather than GChecksum. Both OpenSSL and
+ * nettle detect SHA extensions (x86 SHA-NI, ARMv8 crypto extensions) at
+ * runtime and fall back to optimized portable code on other CPUs.
+ */
+
+#include <stddef.h>
+
+#ifdef USE_GPL_CRYPTO
+#include <nettle/sha1.h>
+typedef struct sha1_ctx SeafSHA1Ctx;
+#else
+#include <openssl/evp.h>
+/* EVP contexts are opaque and allocated by seaf_sha1_init(). */
+typedef struct SeafSHA1Ctx {
+    EVP_MD_CTX *md;
+} SeafSHA1Ctx;
+#endif
+
+void
+seaf_sha1_init (SeafSHA1Ctx *ctx);
+
+void
+seaf_sha1_update (SeafSHA1Ctx *ctx, const void *data, size_t len);
+
+/* Also releases @ctx. */
+void
+seaf_sha1_final (SeafSHA1Ctx *ctx, unsigned char sha1[20]);
+
+/* Releases @ctx when the hash is given up before seaf_sha1_final(). Safe
+ * to call after it.
+ */
+void
+seaf_sha1_cleanup (SeafSHA1Ctx *ctx);
+
+/* Hash a whole buffer. */
+void
+seaf_sha1 (const void *data, size_t len, unsigned char sha1[20]);
+
+#endif
@@ -9,6 +9,7 @@
 #endif
 
 #include "utils.h"
+#include "sha1-util.h"
 
 #ifdef WIN32
 
@@ -53,6 +54,9 @@
 #endif
 
 #include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 #include "log.h"
 
@@ -653,8 +657,90 @@ seaf_util_lseek (int fd, gint64 offset, int whence)
 #endif
 }
 
+int
+seaf_util_fsync (int fd)
+{
+#ifdef WIN32
+    HANDLE handle;
+
+    handle = (HANDLE)_get_osfhandle (fd);
+    if (handle == INVALID_HANDLE_VALUE) {
+        seaf_warning ("Failed to get handle from fd.\n");
+        return -1;
+    }
+
+    if (!FlushFileBuffers (handle)) {
+        seaf_warning ("FlushFileBuffer() failed: %lu.\n", GetLastError());
+        return -1;
+    }
+
+    return 0;
+#elif defined __APPLE__
+    /* OS X: fcntl() is required to flush disk cache, fsync() only
+     * flushes operating system cache.
+     */
+    if (fcntl (fd, F_FULLFSYNC, NULL) < 0) {
+        seaf_warning ("Failed to fsync: %s.\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+#else
+    /* Some file systems may not support fsync().
+     * In this case, just skip the error.
+     */
+    if (fsync (fd) < 0) {
+        if (errno == EINVAL)
+            return 0;
+        else {
+            seaf_warning ("Failed to fsync: %s.\n", strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+#endif
+}
+
+int
+seaf_util_fsync_dir (const char *path)
+{
+#ifndef WIN32
+    int fd, ret;
+
+    fd = g_open (path, O_RDONLY, 0);
+    if (fd < 0) {
+        seaf_warning ("Failed to open dir %s: %s.\n", path, strerror(errno));
+        return -1;
+    }
+    ret = seaf_util_fsync (fd);
+    close (fd);
+    return ret;
+#else
+    /* Directory entries can't be flushed on Windows. */
+    return 0;
+#endif
+}
+
+int
+seaf_util_get_num_cores ()
+{
+#ifdef WIN32
+    SYSTEM_INFO info;
+
+    GetSystemInfo (&info);
+    return (info.dwNumberOfProcessors > 0) ? (int)info.dwNumberOfProcessors : 1;
+#else
+    long n = sysconf (_SC_NPROCESSORS_ONLN);
+    return (n > 0) ? (int)n : 1;
+#endif
+}
+
 #ifdef WIN32
 
+#ifndef FIND_FIRST_EX_LARGE_FETCH
+#define FIND_FIRST_EX_LARGE_FETCH 2
+#endif
+#define FIND_EX_INFO_BASIC ((FINDEX_INFO_LEVELS)1)
+
 int
 traverse_directory_win32 (wchar_t *path_w,
                           DirentCallback callback,
@@ -679,7 +765,15 @@ traverse_directory_win32 (wchar_t *path_w,
     wcscpy (pattern, path_w);
     wcscat (pattern, L"\\*");
 
-    handle = FindFirstFileW (pattern, &fdata);
+    /* Skip the short names and fetch entries in larger batches. Both flags
+     * are only understood by Windows 7 and later.
+     */
+    handle = FindFirstFileExW (pattern, FIND_EX_INFO_BASIC, &fdata,
+                               FindExSearchNameMatch, NULL,
+                               FIND_FIRST_EX_LARGE_FETCH);
+    if (handle == INVALID_HANDLE_VALUE &&
+        GetLastError() == ERROR_INVALID_PARAMETER)
+        handle = FindFirstFileW (pattern, &fdata);
     if (handle == INVALID_HANDLE_VALUE) {
         g_warning ("FindFirstFile failed %s: %lu.\n",
                    path, GetLastError());
@@ -1200,16 +1294,10 @@ ccnet_expand_path (const char *src)
 int
 calculate_sha1 (unsigned char *sha1, const char *msg, int len)
 {
-    GChecksum *c;
-    gsize cs_len = 20;
-
     if (len < 0)
         len = strlen(msg);
 
-    c = g_checksum_new (G_CHECKSUM_SHA1);
-    g_checksum_update(c, (const unsigned char *)msg, len);    
-    g_checksum_get_digest (c, sha1, &cs_len);
-    g_checksum_free (c);
+    seaf_sha1 (msg, len, sha1);
     return 0;
 }
 
@@ -2368,6 +2456,89 @@ seaf_compress (guint8 *input, int inlen, guint8 **output, int *outlen)
     return 0;
 }
 
+/*
+ * zstd compressed data is told apart from zlib data by the zstd frame magic
+ * number. A zlib stream starts with 0x78 for the default window size, so
+ * the two never collide.
+ */
+static const guint8 zstd_magic[4] = { 0x28, 0xB5, 0x2F, 0xFD };
+
+#define ZSTD_LEVEL 3
+
+gboolean
+seaf_is_zstd_compressed (const guint8 *input, int inlen)
+{
+    return (inlen >= 4 && memcmp (input, zstd_magic, 4) == 0);
+}
+
+#ifdef HAVE_ZSTD
+
+static int
+zstd_compress (guint8 *input, int inlen, guint8 **output, int *outlen)
+{
+    size_t bound, n;
+    guint8 *out;
+
+    bound = ZSTD_compressBound (inlen);
+    out = g_malloc (bound);
+    n = ZSTD_compress (out, bound, input, inlen, ZSTD_LEVEL);
+    if (ZSTD_isError (n)) {
+        g_warning ("zstd compression failed: %s.\n", ZSTD_getErrorName (n));
+        g_free (out);
+        return -1;
+    }
+
+    *output = out;
+    *outlen = (int)n;
+    return 0;
+}
+
+static int
+zstd_decompress (guint8 *input, int inlen, guint8 **output, int *outlen)
+{
+    unsigned long long size;
+    size_t n;
+    guint8 *out;
+
+    /* The content size is always recorded by zstd_compress(). */
+    size = ZSTD_getFrameContentSize (input, inlen);
+    if (size == ZSTD_CONTENTSIZE_ERROR || size == ZSTD_CONTENTSIZE_UNKNOWN ||
+        size > G_MAXINT) {
+        g_warning ("Invalid zstd frame.\n");
+        return -1;
+    }
+
+    out = g_malloc (size > 0 ? size : 1);
+    n = ZSTD_decompress (out, size, input, inlen);
+    if (ZSTD_isError (n) || n != size) {
+        g_warning ("Failed to decompress zstd frame.\n");
+        g_free (out);
+        return -1;
+    }
+
+    *output = out;
+    *outlen = (int)n;
+    return 0;
+}
+
+#endif  /* HAVE_ZSTD */
+
+int
+seaf_compress_with_codec (int codec,
+                          guint8 *input, int inlen,
+                          guint8 **output, int *outlen)
+{
+#ifdef HAVE_ZSTD
+    if (codec == SEAF_COMPRESS_ZSTD) {
+        if (inlen == 0)
+            return -1;
+        return zstd_compress (input, inlen, output, outlen);
+    }
+#endif
+
+    return seaf_compress (input, inlen, output, outlen);
+}
+
 int
 seaf_decompress (guint8 *input, int inlen, guint8 **output, int *outlen)
 {
@@ -2382,6 +2553,15 @@ seaf_decompress (guint8 *input, int inlen, guint8 **output, int *outlen)
         return -1;
     }
 
+    if (seaf_is_zstd_compressed (input, inlen)) {
+#ifdef HAVE_ZSTD
+        return zstd_decompress (input, inlen, output, outlen);
+#else
+        g_warning ("zstd compressed data is not supported in this build.\n");
+        return -1;
+#endif
+    }
+
     /* allocate inflate state */
     strm.zalloc = Z_NULL;
     strm.zfree = Z_NULL;
@@ -103,6 +103,20 @@ seaf_util_exists (const char *path);
 gint64
 seaf_util_lseek (int fd, gint64 offset, int whence);
 
+/* Flush operating system and disk caches for @fd. */
+int
+seaf_util_fsync (int fd);
+
+/* Flush the entries of the directory @path, so that files created or
+ * renamed in it survive a crash.
+ */
+int
+seaf_util_fsync_dir (const char *path);
+
+/* Number of online CPUs, at least 1. */
+int
+seaf_util_get_num_cores ();
+
 #ifdef WIN32
 
 typedef int (*DirentCallback) (wchar_t *parent,
@@ -399,9 +413,23 @@ normalize_utf8_path (const char *path);
 int
 seaf_compress (guint8 *input, int inlen, guint8 **output, int *outlen);
 
+/* Decompresses zlib data, and zstd data if built with zstd. */
 int
 seaf_decompress (guint8 *input, int inlen, guint8 **output, int *outlen);
 
+enum {
+    SEAF_COMPRESS_ZLIB = 0,
+    SEAF_COMPRESS_ZSTD,         /* Needs HAVE_ZSTD, falls back to zlib. */
+};
+
+int
+seaf_compress_with_codec (int codec,
+                          guint8 *input, int inlen,
+                          guint8 **output, int *outlen);
+
+gboolean
+seaf_is_zstd_compressed (const guint8 *input, int inlen);
+
 char*
 format_dir_path (const char *path);
 
@@ -28,6 +28,16 @@ class SeafileRpcClient(NamedPipeClient):
         pass
     calc_dir_size = seafile_calc_dir_size
 
+    @searpc_func("int", ["string"])
+    def seafile_start_calc_dir_size(path):
+        pass
+    start_calc_dir_size = seafile_start_calc_dir_size
+
+    @searpc_func("json", ["string"])
+    def seafile_get_calc_dir_size_progress(path):
+        pass
+    get_calc_dir_size_progress = seafile_get_calc_dir_size_progress
+
     @searpc_func("int64", [])
     def seafile_get_total_block_size():
         pass
@@ -99,6 +109,11 @@ class SeafileRpcClient(NamedPipeClient):
         pass
     get_commit_list = seafile_get_commit_list
 
+    @searpc_func("json", ["string", "string", "int"])
+    def seafile_get_commit_history(repo_id, cursor, limit):
+        pass
+    get_commit_history = seafile_get_commit_history
+
     @searpc_func("objlist", ["string"])
     def seafile_branch_gets(repo_id):
         pass
@@ -150,6 +165,11 @@ class SeafileRpcClient(NamedPipeClient):
         pass
     get_repo_sync_task = seafile_get_repo_sync_task
 
+    @searpc_func("json", ["string"])
+    def seafile_get_repo_sync_timings(repo_id):
+        pass
+    get_repo_sync_timings = seafile_get_repo_sync_timings
+
     @searpc_func("int", [])
     def seafile_is_auto_sync_enabled():
         pass
@@ -160,6 +180,11 @@ class SeafileRpcClient(NamedPipeClient):
         pass
     get_file_sync_errors = seafile_get_file_sync_errors
 
+    @searpc_func("objlist", ["int", "int"])
+    def seafile_get_file_sync_errors_before(before_id, limit):
+        pass
+    get_file_sync_errors_before = seafile_get_file_sync_errors_before
+
     ###### Property Management #########
 
     @searpc_func("int", ["string", "string"])
@@ -212,6 +237,101 @@ class SeafileRpcClient(NamedPipeClient):
         pass
     shutdown = seafile_shutdown
 
+    @searpc_func("json", ["int"])
+    def seafile_wait_sync_notifications(timeout):
+        pass
+    wait_sync_notifications = seafile_wait_sync_notifications
+
+    @searpc_func("json", [])
+    def seafile_get_fs_cache_stats():
+        pass
+    get_fs_cache_stats = seafile_get_fs_cache_stats
+
+    @searpc_func("json", [])
+    def seafile_get_metrics():
+        pass
+    get_metrics = seafile_get_metrics
+
+    @searpc_func("int", ["int"])
+    def seafile_set_trace_enabled(enabled):
+        pass
+    set_trace_enabled = seafile_set_trace_enabled
+
+    @searpc_func("int", ["string"])
+    def seafile_dump_trace(path):
+        pass
+    dump_trace = seafile_dump_trace
+
+    @searpc_func("int", ["string", "string"])
+    def seafile_start_wt_event_recording(repo_id, path):
+        pass
+    start_wt_event_recording = seafile_start_wt_event_recording
+
+    @searpc_func("int", ["string"])
+    def seafile_stop_wt_event_recording(repo_id):
+        pass
+    stop_wt_event_recording = seafile_stop_wt_event_recording
+
+    @searpc_func("int", ["string", "string"])
+    def seafile_prioritize_download(repo_id, path):
+        pass
+    prioritize_download = seafile_prioritize_download
+
+    @searpc_func("int", ["string"])
+    def seafile_clear_download_priorities(repo_id):
+        pass
+    clear_download_priorities = seafile_clear_download_priorities
+
+    @searpc_func("json", [])
+    def seafile_get_transfer_policy():
+        pass
+    get_transfer_policy = seafile_get_transfer_policy
+
+    @searpc_func("int", ["string", "int"])
+    def seafile_set_transfer_policy_override(condition, value):
+        pass
+    set_transfer_policy_override = seafile_set_transfer_policy_override
+
+    @searpc_func("json", [])
+    def seafile_get_memory_usage():
+        pass
+    get_memory_usage = seafile_get_memory_usage
+
+    @searpc_func("json", [])
+    def seafile_get_work_mode():
+        pass
+    get_work_mode = seafile_get_work_mode
+
+    @searpc_func("json", ["int64"])
+    def seafile_get_repo_state_changes(since):
+        pass
+    get_repo_state_changes = seafile_get_repo_state_changes
+
+    @searpc_func("json", [])
+    def seafile_get_task_states():
+        pass
+    get_task_states = seafile_get_task_states
+
+    @searpc_func("json", [])
+    def seafile_get_scrub_status():
+        pass
+    get_scrub_status = seafile_get_scrub_status
+
+    @searpc_func("json", ["string", "string"])
+    def seafile_get_paths_sync_status(repo_id, paths_json):
+        pass
+    get_paths_sync_status = seafile_get_paths_sync_status
+
+    @searpc_func("int", ["string", "string"])
+    def seafile_hydrate_file(repo_id, path):
+        pass
+    hydrate_file = seafile_hydrate_file
+
+    @searpc_func("int", ["string", "string"])
+    def seafile_dehydrate_file(repo_id, path):
+        pass
+    dehydrate_file = seafile_dehydrate_file
+
     @searpc_func("int", ["string", "int"])
     def seafile_add_del_confirmation(key, value):
         pass
@@ -0,0 +1,318 @@
+#!/usr/bin/env python3
+#coding: utf-8
+
+'''
+Sync throughput benchmark.
+
+Sets up two clients with seaf-cli against the server in test.conf and times
+an initial upload, an initial clone, an incremental sync of modified files,
+a mass rename and a mass delete. Each step records files/s and MB/s, and the
+CPU time and peak RSS of both daemons as reported by "seaf-cli metrics".
+
+    ./bench.py --files 10000 --sizes 4k:60,64k:30,1m:9,32m:1 -o result.json
+'''
+
+import argparse
+import json
+import os
+import random
+import shutil
+import subprocess
+import sys
+import time
+import urllib.parse
+import urllib.request
+from configparser import ConfigParser
+
+import seafile
+
+SIZE_UNITS = { 'k': 1 << 10, 'm': 1 << 20, 'g': 1 << 30 }
+
+def parse_size(s):
+    s = s.strip().lower()
+    if s and s[-1] in SIZE_UNITS:
+        return int(float(s[:-1]) * SIZE_UNITS[s[-1]])
+    return int(s)
+
+def parse_size_dist(spec):
+    '''"4k:60,1m:40" -> [(4096, 60), (1048576, 40)]'''
+    dist = []
+    for item in spec.split(','):
+        size, weight = item.split(':')
+        dist.append((parse_size(size), float(weight)))
+    return dist
+
+def write_random_file(path, size):
+    with open(path, 'wb') as fp:
+        left = size
+        while left > 0:
+            n = min(left, 1 << 20)
+            fp.write(os.urandom(n))
+            left -= n
+
+def seaf_cli(args, conf_dir, capture=False):
+    cmd = ['seaf-cli'] + args + ['-c', conf_dir]
+    if capture:
+        return subprocess.check_output(cmd).decode('utf8')
+    subprocess.check_call(cmd, stdout=subprocess.DEVNULL)
+
+class Client(object):
+    def __init__(self, root, name):
+        self.root = os.path.join(root, name)
+        self.conf_dir = os.path.join(self.root, 'conf')
+        self.worktree = os.path.join(self.root, 'worktree')
+        self.rpc = seafile.RpcClient(os.path.join(self.root, 'seafile-data',
+                                                  'seafile.sock'))
+
+    def start(self):
+        os.makedirs(self.root)
+        seaf_cli(['init', '-d', self.root], self.conf_dir)
+        seaf_cli(['start'], self.conf_dir)
+        # Wait for the rpc server.
+        for _ in range(30):
+            try:
+                self.rpc.get_repo_list(-1, -1)
+                return
+            except Exception:
+                time.sleep(1)
+        raise Exception('seaf-daemon in %s did not start' % self.root)
+
+    def stop(self):
+        try:
+            seaf_cli(['stop'], self.conf_dir)
+        except Exception:
+            pass
+
+    def metrics(self, repo_id=None):
+        args = ['metrics']
+        if repo_id:
+            args += ['-l', repo_id]
+        result = json.loads(seaf_cli(args, self.conf_dir, capture=True))
+        values = {}
+        for m in result['metrics']:
+            if m['name'] in ('seaf_process_cpu_usec', 'seaf_process_max_rss_bytes'):
+                values[m['name']] = m['value']
+        return values, result.get('sync_timings', [])
+
+    def head(self, repo_id):
+        repo = self.rpc.get_repo(repo_id)
+        return repo.head_cmmt_id if repo else None
+
+    def is_synced(self, repo_id):
+        task = self.rpc.get_repo_sync_task(repo_id)
+        return task is not None and task.state == 'synchronized'
+
+    def has_synced_since(self, repo_id, start):
+        '''Whether a sync that transferred data finished after @start.'''
+        if not self.is_synced(repo_id):
+            return False
+        timings = self.rpc.get_repo_sync_timings(repo_id) or []
+        return any(t['end_time'] >= start and t['state'] == 'synchronized'
+                   for t in timings)
+
+def wait_for(cond, timeout, interval=0.5):
+    deadline = time.time() + timeout
+    while time.time() < deadline:
+        try:
+            if cond():
+                return
+        except Exception:
+            pass
+        time.sleep(interval)
+    raise Exception('Timed out')
+
+class Bench(object):
+    def __init__(self, args):
+        self.args = args
+        self.rand = random.Random(args.seed)
+        self.sizes = parse_size_dist(args.sizes)
+        self.files = []
+
+        parser = ConfigParser()
+        parser.read(args.config)
+        self.server = parser.get('test', 'server_url')
+        self.user = parser.get('test', 'user')
+        self.password = parser.get('test', 'password')
+
+        if os.path.exists(args.work_dir):
+            shutil.rmtree(args.work_dir)
+        self.cli1 = Client(args.work_dir, 'cli1')
+        self.cli2 = Client(args.work_dir, 'cli2')
+        self.repo_id = None
+        self.results = []
+
+    def auth_args(self):
+        return ['-s', self.server, '-u', self.user, '-p', self.password]
+
+    def pick_size(self):
+        total = sum(w for _, w in self.sizes)
+        r = self.rand.uniform(0, total)
+        for size, weight in self.sizes:
+            r -= weight
+            if r <= 0:
+                return size
+        return self.sizes[-1][0]
+
+    def generate_worktree(self):
+        os.makedirs(self.cli1.worktree)
+        for i in range(self.args.files):
+            path = os.path.join('dir-%05d' % (i // self.args.files_per_dir),
+                                'file-%08d.bin' % i)
+            abs_path = os.path.join(self.cli1.worktree, path)
+            if not os.path.isdir(os.path.dirname(abs_path)):
+                os.makedirs(os.path.dirname(abs_path))
+            size = self.pick_size()
+            write_random_file(abs_path, size)
+            self.files.append([path, size])
+
+    def record(self, step, n_files, n_bytes, start, uploaded=None, downloaded=None):
+        result = {
+            'step': step,
+            'files': n_files,
+            'bytes': n_bytes,
+        }
+        for name, end in (('upload', uploaded), ('download', downloaded)):
+            if end is None:
+                continue
+            secs = max(end - start, 0.001)
+            result[name] = {
+                'seconds': round(secs, 3),
+                'files_per_sec': round(n_files / secs, 1),
+                'mb_per_sec': round(n_bytes / secs / (1 << 20), 2),
+            }
+        for key, cli in (('cli1', self.cli1), ('cli2', self.cli2)):
+            try:
+                values, timings = cli.metrics(self.repo_id)
+            except Exception:
+                continue
+            result[key] = {
+                'cpu_seconds': values.get('seaf_process_cpu_usec', 0) / 1e6,
+                'max_rss_mb': round(values.get('seaf_process_max_rss_bytes', 0) / (1 << 20), 1),
+                'last_sync_phases': timings[0]['phases'] if timings else {},
+            }
+        print(json.dumps(result, sort_keys=True), file=sys.stderr)
+        self.results.append(result)
+
+    def propagate(self, step, n_files, n_bytes, change):
+        '''Applies @change to worktree1 and times the upload from cli1 and
+        the download to cli2.'''
+        start = time.time()
+        change()
+        wait_for(lambda: self.cli1.has_synced_since(self.repo_id, int(start)),
+                 self.args.timeout)
+        uploaded = time.time()
+        head = self.cli1.head(self.repo_id)
+        wait_for(lambda: self.cli2.head(self.repo_id) == head and
+                 self.cli2.is_synced(self.repo_id), self.args.timeout)
+        self.record(step, n_files, n_bytes, start, uploaded, time.time())
+
+    def run(self):
+        self.cli1.start()
+        self.cli2.start()
+
+        self.generate_worktree()
+        total_bytes = sum(size for _, size in self.files)
+
+        out = seaf_cli(['create', '-n', 'sync-bench'] + self.auth_args(),
+                       self.cli1.conf_dir, capture=True)
+        self.repo_id = out.strip().split('\n')[-1]
+
+        start = time.time()
+        seaf_cli(['sync', '-l', self.repo_id, '-d', self.cli1.worktree] +
+                 self.auth_args(), self.cli1.conf_dir)
+        wait_for(lambda: self.cli1.has_synced_since(self.repo_id, int(start)),
+                 self.args.timeout)
+        self.record('initial_upload', len(self.files), total_bytes, start,
+                    uploaded=time.time())
+
+        head = self.cli1.head(self.repo_id)
+        os.makedirs(self.cli2.worktree)
+        start = time.time()
+        seaf_cli(['download', '-l', self.repo_id, '-d', self.cli2.worktree] +
+                 self.auth_args(), self.cli2.conf_dir)
+        wait_for(lambda: self.cli2.head(self.repo_id) == head and
+                 self.cli2.is_synced(self.repo_id), self.args.timeout)
+        self.record('initial_clone', len(self.files), total_bytes, start,
+                    downloaded=time.time())
+
+        n_modify = max(len(self.files) * self.args.modify_percent // 100, 1)
+        modified = self.rand.sample(self.files, n_modify)
+        def modify():
+            for f in modified:
+                write_random_file(os.path.join(self.cli1.worktree, f[0]), f[1])
+        self.propagate('modify', n_modify, sum(f[1] for f in modified), modify)
+
+        def rename():
+            for f in self.files:
+                new_path = f[0].replace('.bin', '.renamed.bin')
+                os.rename(os.path.join(self.cli1.worktree, f[0]),
+                          os.path.join(self.cli1.worktree, new_path))
+                f[0] = new_path
+        self.propagate('rename', len(self.files), 0, rename)
+
+        def delete():
+            for f in self.files:
+                os.remove(os.path.join(self.cli1.worktree, f[0]))
+        self.propagate('delete', len(self.files), 0, delete)
+
+    def cleanup(self):
+        self.cli1.stop()
+        self.cli2.stop()
+        if self.repo_id:
+            try:
+                self.delete_repo()
+            except Exception as e:
+                print('Failed to delete repo %s: %s' % (self.repo_id, e),
+                      file=sys.stderr)
+
+    def delete_repo(self):
+        data = urllib.parse.urlencode({'username': self.user,
+                                       'password': self.password}).encode('utf8')
+        resp = urllib.request.urlopen('%s/api2/auth-token/' % self.server, data)
+        token = json.loads(resp.read().decode('utf8'))['token']
+        req = urllib.request.Request('%s/api2/repos/%s/' % (self.server, self.repo_id),
+                                     headers={'Authorization': 'Token %s' % token},
+                                     method='DELETE')
+        urllib.request.urlopen(req).read()
+
+def main():
+    parser = argparse.ArgumentParser(description='Sync throughput benchmark')
+    parser.add_argument('--files', type=int, default=10000, help='number of files')
+    parser.add_argument('--files-per-dir', type=int, default=100)
+    parser.add_argument('--sizes', default='4k:60,64k:30,1m:9,32m:1',
+                        help='file size distribution, as size:weight pairs')
+    parser.add_argument('--modify-percent', type=int, default=1,
+                        help='percent of files modified in the incremental sync')
+    parser.add_argument('--seed', type=int, default=1)
+    parser.add_argument('--timeout', type=int, default=3600,
+                        help='seconds to wait for each step')
+    parser.add_argument('--config', default=os.path.join(os.getcwd(), 'test.conf'))
+    parser.add_argument('--work-dir', default=os.path.join(os.getcwd(), 'bench'))
+    parser.add_argument('-o', '--output', help='write results to this file')
+    args = parser.parse_args()
+
+    bench = Bench(args)
+    try:
+        bench.run()
+    finally:
+        bench.cleanup()
+
+    report = {
+        'params': {
+            'files': args.files,
+            'files_per_dir': args.files_per_dir,
+            'sizes': args.sizes,
+            'modify_percent': args.modify_percent,
+            'seed': args.seed,
+        },
+        'results': bench.results,
+    }
+    out = json.dumps(report, indent=2, sort_keys=True)
+    if args.output:
+        with open(args.output, 'w') as fp:
+            fp.write(out + '\n')
+    else:
+        print(out)
+
+if __name__ == '__main__':
+    main()